@@ -1,10 +1,10 @@
 /*
  * app.c — Home screen rendering for the Survival Workstation
  *
- * Draws a 2×3 icon grid with labels and waits for touch input.
+ * Draws a 2×4 icon grid with labels and waits for touch input.
  * Layout: 320×240 screen
  *   y=0..23:    title bar ("SURVIVAL WORKSTATION")
- *   y=32..215:  2 rows × 3 columns of icon cells (106×92px each)
+ *   y=32..215:  2 rows × 4 columns of icon cells (80×92px each)
  *   y=220..239: version footer
  */
 
@@ -19,11 +19,11 @@
 #include "freertos/task.h"
 
 /* Grid layout constants */
-#define GRID_COLS   3
+#define GRID_COLS   4
 #define GRID_ROWS   2
-#define GRID_X      1           /* left margin */
+#define GRID_X      0           /* left margin */
 #define GRID_Y      32          /* top of grid area */
-#define CELL_W      106         /* 320 / 3 = 106.6, use 106 */
+#define CELL_W      80          /* 320 / 4; fits an 8-char label */
 #define CELL_H      92          /* (216 - 32) / 2 = 92 */
 
 /* Title bar */
@@ -34,6 +34,7 @@
 
 static void draw_home_screen(void)
 {
+    display_frame_begin();
     display_clear(COLOR_BLACK);
 
     /* Title: "SURVIVAL WORKSTATION" */
@@ -69,6 +70,7 @@ static void draw_home_screen(void)
     const char *ver = "v2.0";
     int vx = (DISPLAY_WIDTH - (int)strlen(ver) * FONT_WIDTH) / 2;
     display_string(vx, FOOTER_Y, ver, COLOR_DGRAY, COLOR_BLACK);
+    display_frame_end();
 }
 
 int home_screen_show(void)
@@ -9,7 +9,7 @@
 
 #include <stdint.h>
 
-#define APP_COUNT 6
+#define APP_COUNT 7
 
 /* App descriptor */
 typedef struct {
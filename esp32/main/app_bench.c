@@ -0,0 +1,439 @@
+/*
+ * app_bench.c — On-device benchmarks
+ *
+ * Times what a flash and the apps are made of, so one CYD clone or SD
+ * card can be told from another: SD transfers through sdcard_read and
+ * sdcard_write at several sizes, sequential and random; full-screen
+ * fills and text on the display; inflating the payload; and how long a
+ * press takes from the pen interrupt to its TOUCH_DOWN event. The
+ * results are shown and appended as one line to BENCH.CSV in the root
+ * of the card's FAT32 volume. With CONFIG_SURVIVAL_BUS_STATS the bus
+ * profile of the run (busstat.h) is printed to the console as well, so
+ * the estimates can be checked against the times measured here.
+ *
+ * Writes only go to a run of clusters the FAT has free
+ * (fat32_free_run), so nothing on the card is touched. Without a FAT32
+ * volume, or without a free run as long as BENCH_SPAN_SECTORS, the
+ * write tests are skipped; reads then start at sector 0.
+ */
+
+#include "app_bench.h"
+#include "sdcard.h"
+#include "gpt.h"
+#include "fat32.h"
+#include "flasher.h"
+#include "payload.h"
+#include "psram.h"
+#include "display.h"
+#include "touch.h"
+#include "ui.h"
+#include "font.h"
+#include "busstat.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+
+static const char *TAG = "bench";
+
+/* Sequential tests cover at most BENCH_SPAN_SECTORS (the free run the
+ * writes need) in at most BENCH_OPS transfers per size */
+#ifndef BENCH_SPAN_SECTORS
+#define BENCH_SPAN_SECTORS 8192     /* 4MB */
+#endif
+#ifndef BENCH_OPS
+#define BENCH_OPS          256
+#endif
+#ifndef BENCH_RAND_OPS
+#define BENCH_RAND_OPS     256
+#endif
+#define BENCH_RAND_SECTORS 8        /* 4KB, a typical cluster */
+#define BENCH_FILLS        16
+#define BENCH_TEXT_PASSES  4
+#define BENCH_TAPS         5
+#define BENCH_TAP_WAIT_MS  10000    /* no press this long ends the test */
+#define BENCH_CSV          "BENCH.CSV"
+
+/* Transfer sizes, in sectors; the largest is the buffer */
+static const uint32_t s_sizes[] = { 1, 8, 32, 128 };
+#define BENCH_SIZES ((int)(sizeof(s_sizes) / sizeof(s_sizes[0])))
+
+/* A result of 0 means the test did not run or failed */
+static struct {
+    uint32_t seq_read[BENCH_SIZES];     /* KB/s */
+    uint32_t seq_write[BENCH_SIZES];
+    uint32_t rand_read;                 /* 4KB transfers/s */
+    uint32_t rand_write;
+    uint32_t fill;                      /* Kpixels/s */
+    uint32_t text;                      /* chars/s */
+    uint32_t inflate;                   /* KB/s */
+    uint32_t touch_us;                  /* mean, pen down to event */
+    int      taps;
+} s_res;
+
+static uint8_t *s_buf;                  /* DMA-capable, s_buf_sectors */
+static uint32_t s_buf_sectors;
+static uint32_t s_rng;
+
+/* xorshift32: spreads the random transfers, nothing more */
+static uint32_t rng_next(void)
+{
+    s_rng ^= s_rng << 13;
+    s_rng ^= s_rng >> 17;
+    s_rng ^= s_rng << 5;
+    return s_rng;
+}
+
+static uint32_t kb_per_s(uint64_t bytes, int64_t us)
+{
+    return us > 0 ? (uint32_t)(bytes * 1000000 / 1024 / (uint64_t)us) : 0;
+}
+
+static void draw_header(void)
+{
+    const char *hdr = "Bench";
+    display_string((DISPLAY_WIDTH - (int)strlen(hdr) * FONT_WIDTH) / 2, 4, hdr,
+                   COLOR_WHITE, COLOR_BLACK);
+}
+
+static void draw_running(const char *what)
+{
+    display_frame_begin();
+    display_clear(COLOR_BLACK);
+    draw_header();
+    display_string(20, 100, "Running:", COLOR_GRAY, COLOR_BLACK);
+    display_string(20, 120, what, COLOR_CYAN, COLOR_BLACK);
+    display_frame_end();
+}
+
+/* ---- SD ---- */
+
+/* Transfers of size sectors one after another from lba */
+static uint32_t sd_seq(uint32_t lba, uint32_t size, int write)
+{
+    uint32_t ops = BENCH_SPAN_SECTORS / size;
+    if (ops > BENCH_OPS) ops = BENCH_OPS;
+
+    int64_t t0 = esp_timer_get_time();
+    for (uint32_t i = 0; i < ops; i++) {
+        int err = write ? sdcard_write(lba + i * size, size, s_buf)
+                        : sdcard_read(lba + i * size, size, s_buf);
+        if (err != 0) {
+            ESP_LOGW(TAG, "%s of %lu sectors at %lu failed",
+                     write ? "Write" : "Read", (unsigned long)size,
+                     (unsigned long)(lba + i * size));
+            return 0;
+        }
+    }
+    return kb_per_s((uint64_t)ops * size * 512, esp_timer_get_time() - t0);
+}
+
+/* 4KB transfers at random 4KB boundaries in [lba, lba + sectors) */
+static uint32_t sd_random(uint32_t lba, uint32_t sectors, int write)
+{
+    uint32_t slots = sectors / BENCH_RAND_SECTORS;
+    if (slots == 0)
+        return 0;
+
+    int64_t t0 = esp_timer_get_time();
+    for (int i = 0; i < BENCH_RAND_OPS; i++) {
+        uint32_t at = lba + rng_next() % slots * BENCH_RAND_SECTORS;
+        int err = write ? sdcard_write(at, BENCH_RAND_SECTORS, s_buf)
+                        : sdcard_read(at, BENCH_RAND_SECTORS, s_buf);
+        if (err != 0) {
+            ESP_LOGW(TAG, "Random %s at %lu failed",
+                     write ? "write" : "read", (unsigned long)at);
+            return 0;
+        }
+    }
+    int64_t us = esp_timer_get_time() - t0;
+    return us > 0 ? (uint32_t)((uint64_t)BENCH_RAND_OPS * 1000000 / (uint64_t)us)
+                  : 0;
+}
+
+static void bench_sd(uint32_t run_lba, int have_run)
+{
+    char what[40];
+    uint32_t lba = have_run ? run_lba : 0;
+
+    for (int i = 0; i < BENCH_SIZES && s_sizes[i] <= s_buf_sectors; i++) {
+        snprintf(what, sizeof(what), "SD read, %lu sectors",
+                 (unsigned long)s_sizes[i]);
+        draw_running(what);
+        s_res.seq_read[i] = sd_seq(lba, s_sizes[i], 0);
+    }
+    draw_running("SD random reads, 4KB");
+    uint64_t card = sdcard_size() / 512;
+    s_res.rand_read = sd_random(0, card > UINT32_MAX ? UINT32_MAX : (uint32_t)card, 0);
+
+    if (!have_run)
+        return;
+    for (uint32_t i = 0; i < s_buf_sectors * 512; i++)
+        s_buf[i] = (uint8_t)rng_next();
+    for (int i = 0; i < BENCH_SIZES && s_sizes[i] <= s_buf_sectors; i++) {
+        snprintf(what, sizeof(what), "SD write, %lu sectors",
+                 (unsigned long)s_sizes[i]);
+        draw_running(what);
+        s_res.seq_write[i] = sd_seq(run_lba, s_sizes[i], 1);
+    }
+    draw_running("SD random writes, 4KB");
+    s_res.rand_write = sd_random(run_lba, BENCH_SPAN_SECTORS, 1);
+}
+
+/* ---- Display, inflate, touch ---- */
+
+/* Fills and text go straight out, outside a frame, as they draw */
+static void bench_display(void)
+{
+    static const uint16_t colors[] = {
+        COLOR_RED, COLOR_GREEN, COLOR_BLUE, COLOR_WHITE,
+    };
+    int64_t t0 = esp_timer_get_time();
+    for (int i = 0; i < BENCH_FILLS; i++)
+        display_fill_rect(0, 0, DISPLAY_WIDTH, DISPLAY_HEIGHT, colors[i % 4]);
+    int64_t us = esp_timer_get_time() - t0;
+    if (us > 0)
+        s_res.fill = (uint32_t)((uint64_t)BENCH_FILLS * DISPLAY_WIDTH *
+                                DISPLAY_HEIGHT * 1000 / (uint64_t)us);
+
+    int cols = DISPLAY_WIDTH / FONT_WIDTH, rows = DISPLAY_HEIGHT / FONT_HEIGHT;
+    char line[DISPLAY_WIDTH / FONT_WIDTH + 1];
+    for (int c = 0; c < cols; c++)
+        line[c] = (char)('!' + c);
+    line[cols] = '\0';
+
+    t0 = esp_timer_get_time();
+    for (int p = 0; p < BENCH_TEXT_PASSES; p++)
+        for (int r = 0; r < rows; r++)
+            display_string(0, r * FONT_HEIGHT, line,
+                           (p & 1) ? COLOR_BLACK : COLOR_WHITE,
+                           (p & 1) ? COLOR_WHITE : COLOR_BLACK);
+    us = esp_timer_get_time() - t0;
+    if (us > 0)
+        s_res.text = (uint32_t)((uint64_t)BENCH_TEXT_PASSES * rows * cols *
+                                1000000 / (uint64_t)us);
+}
+
+/* The first arch's image, or its files, as the flasher would decode them */
+static void bench_inflate(void)
+{
+    if (payload_arch_count() == 0)
+        return;
+    draw_running("Inflate");
+    const struct payload_arch *pa = payload_get_arch(0);
+    uint64_t bytes;
+    int64_t us;
+    if (flasher_bench_inflate(pa, pa->has_image, &bytes, &us) == 0)
+        s_res.inflate = kb_per_s(bytes, us);
+}
+
+static void bench_touch(void)
+{
+    struct touch_event ev;
+    int64_t total = 0;
+    char what[40];
+
+    while (touch_get_event(&ev, 0))
+        ;   /* stale */
+    for (int i = 0; i < BENCH_TAPS; i++) {
+        snprintf(what, sizeof(what), "Tap the screen (%d of %d)", i + 1,
+                 BENCH_TAPS);
+        draw_running(what);
+
+        int down = 0;
+        while (!down && touch_get_event(&ev, BENCH_TAP_WAIT_MS))
+            down = (ev.type == TOUCH_DOWN);
+        if (!down)
+            break;
+        total += esp_timer_get_time() - touch_pen_time();
+        s_res.taps++;
+
+        while (touch_get_event(&ev, BENCH_TAP_WAIT_MS) && ev.type != TOUCH_UP)
+            ;
+    }
+    if (s_res.taps > 0)
+        s_res.touch_us = (uint32_t)(total / s_res.taps);
+}
+
+/* ---- Results ---- */
+
+static int csv_header(char *out, size_t size)
+{
+    int n = snprintf(out, size, "card_mb,psram_kb");
+    for (int i = 0; i < BENCH_SIZES; i++)
+        n += snprintf(out + n, size - (size_t)n, ",read_kbps_%lu",
+                      (unsigned long)s_sizes[i]);
+    for (int i = 0; i < BENCH_SIZES; i++)
+        n += snprintf(out + n, size - (size_t)n, ",write_kbps_%lu",
+                      (unsigned long)s_sizes[i]);
+    n += snprintf(out + n, size - (size_t)n,
+                  ",rand_read_iops,rand_write_iops,fill_kpix_s,text_chars_s,"
+                  "inflate_kbps,touch_us\n");
+    return n;
+}
+
+static int csv_row(char *out, size_t size)
+{
+    int n = snprintf(out, size, "%llu,%lu",
+                     (unsigned long long)(sdcard_size() >> 20),
+                     (unsigned long)(psram_size() >> 10));
+    for (int i = 0; i < BENCH_SIZES; i++)
+        n += snprintf(out + n, size - (size_t)n, ",%lu",
+                      (unsigned long)s_res.seq_read[i]);
+    for (int i = 0; i < BENCH_SIZES; i++)
+        n += snprintf(out + n, size - (size_t)n, ",%lu",
+                      (unsigned long)s_res.seq_write[i]);
+    n += snprintf(out + n, size - (size_t)n, ",%lu,%lu,%lu,%lu,%lu,%lu\n",
+                  (unsigned long)s_res.rand_read, (unsigned long)s_res.rand_write,
+                  (unsigned long)s_res.fill, (unsigned long)s_res.text,
+                  (unsigned long)s_res.inflate, (unsigned long)s_res.touch_us);
+    return n;
+}
+
+/* Append the row, with the header first if the file is new (or empty) */
+static int save_csv(void)
+{
+    char text[512];
+    int n = 0;
+    int f = fat32_file_open(BENCH_CSV);
+    if (f >= 0)
+        fat32_file_close(f);
+    else
+        n = csv_header(text, sizeof(text));
+    n += csv_row(text + n, sizeof(text) - (size_t)n);
+    return fat32_append_file(BENCH_CSV, text, (uint32_t)n);
+}
+
+/* A right-aligned value in width columns, "-" for a test that did not run */
+static int put_value(char *out, size_t size, int width, uint32_t v)
+{
+    if (v == 0)
+        return snprintf(out, size, "%*s", width, "-");
+    return snprintf(out, size, "%*lu", width, (unsigned long)v);
+}
+
+static void draw_results(const char *saved)
+{
+    char line[48];
+    int n;
+
+    display_frame_begin();
+    display_clear(COLOR_BLACK);
+    ui_draw_back_button();
+    draw_header();
+
+    n = snprintf(line, sizeof(line), "%-12s", "SD sectors");
+    for (int i = 0; i < BENCH_SIZES; i++)
+        n += snprintf(line + n, sizeof(line) - (size_t)n, "%6lu",
+                      (unsigned long)s_sizes[i]);
+    display_string(20, 36, line, COLOR_GRAY, COLOR_BLACK);
+
+    n = snprintf(line, sizeof(line), "%-12s", "Read KB/s");
+    for (int i = 0; i < BENCH_SIZES; i++)
+        n += put_value(line + n, sizeof(line) - (size_t)n, 6, s_res.seq_read[i]);
+    display_string(20, 56, line, COLOR_WHITE, COLOR_BLACK);
+
+    n = snprintf(line, sizeof(line), "%-12s", "Write KB/s");
+    for (int i = 0; i < BENCH_SIZES; i++)
+        n += put_value(line + n, sizeof(line) - (size_t)n, 6, s_res.seq_write[i]);
+    display_string(20, 76, line, COLOR_WHITE, COLOR_BLACK);
+
+    n = snprintf(line, sizeof(line), "%-12s", "4K random/s");
+    n += put_value(line + n, sizeof(line) - (size_t)n, 6, s_res.rand_read);
+    n += snprintf(line + n, sizeof(line) - (size_t)n, " read");
+    n += put_value(line + n, sizeof(line) - (size_t)n, 6, s_res.rand_write);
+    snprintf(line + n, sizeof(line) - (size_t)n, " write");
+    display_string(20, 96, line, COLOR_WHITE, COLOR_BLACK);
+
+    snprintf(line, sizeof(line), "Display     %lu.%lu Mpix/s %lu ch/s",
+             (unsigned long)(s_res.fill / 1000),
+             (unsigned long)(s_res.fill % 1000 / 100),
+             (unsigned long)s_res.text);
+    display_string(20, 124, line, COLOR_WHITE, COLOR_BLACK);
+
+    if (s_res.inflate)
+        snprintf(line, sizeof(line), "Inflate     %lu.%02lu MB/s",
+                 (unsigned long)(s_res.inflate / 1024),
+                 (unsigned long)(s_res.inflate % 1024 * 100 / 1024));
+    else
+        snprintf(line, sizeof(line), "Inflate     - (no payload)");
+    display_string(20, 144, line, COLOR_WHITE, COLOR_BLACK);
+
+    if (s_res.taps)
+        snprintf(line, sizeof(line), "Touch       %lu.%lu ms over %d taps",
+                 (unsigned long)(s_res.touch_us / 1000),
+                 (unsigned long)(s_res.touch_us % 1000 / 100), s_res.taps);
+    else
+        snprintf(line, sizeof(line), "Touch       - (no taps)");
+    display_string(20, 164, line, COLOR_WHITE, COLOR_BLACK);
+
+    display_string(20, 200, saved, COLOR_GRAY, COLOR_BLACK);
+    display_frame_end();
+}
+
+/* ---- Main entry point ---- */
+
+void app_bench_run(void)
+{
+    if (sdcard_init() != 0) {
+        ui_show_error("No SD card detected.\n"
+                      "Insert a card and try again.");
+        ui_wait_for_tap();
+        return;
+    }
+
+    /* The largest transfer that fits in DMA memory: 64KB, 16KB or 4KB */
+    s_buf_sectors = s_sizes[BENCH_SIZES - 1];
+    while (!(s_buf = psram_alloc_dma(s_buf_sectors * 512)) && s_buf_sectors > 8)
+        s_buf_sectors /= 4;
+    if (!s_buf) {
+        sdcard_deinit();
+        ESP_LOGE(TAG, "No memory for the transfer buffer");
+        ui_show_error("Not enough memory for\nthe benchmark.");
+        ui_wait_for_tap();
+        return;
+    }
+
+    memset(&s_res, 0, sizeof(s_res));
+    s_rng = (uint32_t)esp_timer_get_time() | 1;
+
+    int have_fat = fat32_read_init(gpt_find_partition()) == 0;
+    uint32_t run_lba = 0;
+    int have_run = have_fat && fat32_free_run(BENCH_SPAN_SECTORS, &run_lba) == 0;
+    if (!have_run)
+        ESP_LOGW(TAG, "No free run of %d sectors: write tests skipped",
+                 BENCH_SPAN_SECTORS);
+
+#ifdef CONFIG_SURVIVAL_BUS_STATS
+    busstat_reset();
+#endif
+    bench_sd(run_lba, have_run);
+    free(s_buf);
+    s_buf = NULL;
+    bench_display();
+    bench_inflate();
+    bench_touch();
+#ifdef CONFIG_SURVIVAL_BUS_STATS
+    busstat_report("bench");
+#endif
+
+    char row[256];
+    int n = csv_row(row, sizeof(row));
+    ESP_LOGI(TAG, "Results: %.*s", n - 1, row);
+
+    const char *saved = "Not saved: no FAT32 volume";
+    if (have_fat)
+        saved = save_csv() == 0 ? "Saved to " BENCH_CSV
+                                : "Could not write " BENCH_CSV;
+    sdcard_deinit();
+
+    draw_results(saved);
+    while (1) {
+        int tx, ty;
+        touch_wait_tap(&tx, &ty);
+        if (ui_check_back_button(tx, ty))
+            return;
+    }
+}
@@ -0,0 +1,12 @@
+/*
+ * app_bench.h — On-device benchmark app
+ */
+#ifndef APP_BENCH_H
+#define APP_BENCH_H
+
+/* Time SD transfers, the display, inflate and touch on this board and
+ * card, show the results and append them to BENCH.CSV on the card's
+ * FAT32 volume. Returns when Back is tapped. */
+void app_bench_run(void);
+
+#endif /* APP_BENCH_H */
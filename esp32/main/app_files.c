@@ -7,20 +7,22 @@
 
 #include "app_files.h"
 #include "sdcard.h"
+#include "gpt.h"
 #include "fat32.h"
 #include "exfat.h"
 #include "display.h"
 #include "touch.h"
 #include "ui.h"
 #include "font.h"
+#include "psram.h"
 
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
-
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
 
+
 #include "sped.h"
 #include "femtojpeg.h"
 
@@ -30,6 +32,8 @@
 #define FILES_MAX_NAME    48
 #define ROWS_PER_PAGE     12
 #define ROW_HEIGHT        16
+#define DIR_MARKS        256   /* page marks kept for a paged directory */
+#define DIR_PROGRESS     256   /* entries between "Listing..." updates */
 
 /* Screen layout */
 #define HEADER_Y     0
@@ -56,9 +60,21 @@ struct file_entry {
 
 /* --- State --- */
 
+/* Marks into a paged directory (see load_directory()) */
+union dir_mark {
+    struct fat32_dir_pos fat;
+    struct exfat_dir_pos ex;
+};
+
 static struct file_entry s_entries[FILES_MAX_ENTRIES];
 static char              s_path[256];
 static int               s_entry_count;
+static int               s_dir_count;
+static int               s_paged;         /* s_entries holds one page */
+static int               s_page;          /* ...this one, -1 if none */
+static union dir_mark    s_marks[DIR_MARKS];
+static int               s_mark_count;
+static int               s_mark_step;     /* pages per mark */
 static int               s_scroll;
 static enum fs_type      s_fs_type;
 static struct exfat_vol *s_exvol;
@@ -149,136 +165,153 @@ static void build_full_path(char *out, size_t outsz, const char *name)
     }
 }
 
-/* Read an entire file into a malloc'd buffer. Returns NULL on error.
- * Caller must free(). Caps at max_size bytes. */
+/* Read an entire file into a psram_alloc() buffer. Returns NULL on
+ * error. Caller must free(). The buffer is sized to the file, capped at
+ * max_size bytes, plus a NUL after the data; exFAT files over the cap
+ * are refused rather than cut short. */
 static void *read_file(const char *path, uint32_t max_size, uint32_t *out_size)
 {
     if (s_fs_type == FS_FAT32) {
         int fh = fat32_file_open(path);
         if (fh < 0) return NULL;
 
-        uint8_t *buf = malloc(max_size);
+        uint32_t size = fat32_file_size(fh);
+        if (size > max_size) size = max_size;
+        uint8_t *buf = psram_alloc(size + 1);
         if (!buf) { fat32_file_close(fh); return NULL; }
 
+        /* Contiguous clusters land in buf with one read each */
         uint32_t total = 0;
-        while (total < max_size) {
-            int n = fat32_file_read(fh, buf + total, 4096);
+        while (total < size) {
+            int n = fat32_file_read(fh, buf + total, size - total);
             if (n <= 0) break;
             total += (uint32_t)n;
         }
         fat32_file_close(fh);
+        buf[total] = '\0';
 
         *out_size = total;
         return buf;
     } else {
-        /* exFAT — readfile gives us the whole thing */
-        size_t fsz;
-        void *data = exfat_readfile(s_exvol, path, &fsz);
-        if (!data) return NULL;
-        if (fsz > max_size) { free(data); return NULL; }
-        *out_size = (uint32_t)fsz;
-        return data;
+        /* exFAT — one read; runs of clusters go to the card whole */
+        uint64_t fsz = 0;
+        struct exfat_file *f = exfat_open(s_exvol, path, &fsz);
+        if (!f) return NULL;
+        uint8_t *buf = fsz <= max_size ? psram_alloc((size_t)fsz + 1) : NULL;
+        size_t got = (size_t)fsz;
+        if (!buf || exfat_read(f, buf, &got) != 0 || got != fsz) {
+            free(buf);
+            exfat_close(f);
+            return NULL;
+        }
+        exfat_close(f);
+        buf[got] = '\0';
+        *out_size = (uint32_t)got;
+        return buf;
     }
 }
 
-/* --- Partition Detection --- */
+/* --- Directory Loading --- */
+
+/* A directory of up to FILES_MAX_ENTRIES entries is read whole and
+ * sorted. A bigger one is listed in card order a page at a time: one
+ * pass counts it and marks where pages start, and each page shown is
+ * read back from the nearest mark into s_entries. */
 
-static uint32_t find_partition(void)
+/* A directory scan on either filesystem */
+struct dir_cursor {
+    int fh;                        /* FAT32 handle */
+    struct exfat_dir *ex;
+};
+
+static int dir_open(struct dir_cursor *dc)
 {
-    uint8_t buf[512];
-
-    /* Read MBR (sector 0) */
-    if (sdcard_read(0, 1, buf) != 0)
-        return 0; /* superfloppy fallback */
-
-    /* Check MBR signature */
-    if (buf[510] != 0x55 || buf[511] != 0xAA)
-        return 0; /* no valid MBR — try superfloppy */
-
-    /* First partition entry at offset 446 */
-    uint8_t *pe = buf + 446;
-    uint8_t ptype = pe[4];
-
-    uint32_t start_lba = (uint32_t)pe[8]
-                       | ((uint32_t)pe[9]  << 8)
-                       | ((uint32_t)pe[10] << 16)
-                       | ((uint32_t)pe[11] << 24);
-
-    if (ptype == 0xEE) {
-        /* GPT protective MBR — read GPT header at LBA 1 */
-        uint8_t gpt[512];
-        if (sdcard_read(1, 1, gpt) != 0)
-            return 0;
-
-        /* Verify "EFI PART" signature */
-        if (memcmp(gpt, "EFI PART", 8) != 0)
-            return 0;
-
-        /* Partition entry LBA is at offset 72 (8 bytes, little-endian) */
-        uint32_t entry_lba = (uint32_t)gpt[72]
-                            | ((uint32_t)gpt[73] << 8)
-                            | ((uint32_t)gpt[74] << 16)
-                            | ((uint32_t)gpt[75] << 24);
-
-        /* Read first partition entry */
-        uint8_t entry[512];
-        if (sdcard_read(entry_lba, 1, entry) != 0)
-            return 0;
-
-        /* Starting LBA is at offset 32 in the entry (8 bytes LE) */
-        uint32_t part_lba = (uint32_t)entry[32]
-                          | ((uint32_t)entry[33] << 8)
-                          | ((uint32_t)entry[34] << 16)
-                          | ((uint32_t)entry[35] << 24);
-        return part_lba;
+    if (s_fs_type == FS_FAT32) {
+        dc->fh = fat32_open_dir(s_path);
+        return dc->fh < 0 ? -1 : 0;
     }
+    dc->ex = exfat_opendir(s_exvol, s_path);
+    return dc->ex ? 0 : -1;
+}
 
-    if (ptype == 0x0B || ptype == 0x0C || ptype == 0x07) {
-        /* FAT32 (0x0B/0x0C) or exFAT/NTFS (0x07) */
-        return start_lba;
+static int dir_open_at(struct dir_cursor *dc, const union dir_mark *m)
+{
+    if (s_fs_type == FS_FAT32) {
+        dc->fh = fat32_open_dir_at(&m->fat);
+        return dc->fh < 0 ? -1 : 0;
+    }
+    dc->ex = exfat_opendir(s_exvol, s_path);
+    if (!dc->ex)
+        return -1;
+    if (exfat_seekdir(dc->ex, &m->ex) != 0) {
+        exfat_closedir(dc->ex);
+        return -1;
     }
-
-    /* Unknown partition type — try superfloppy */
     return 0;
 }
 
-/* --- Directory Loading --- */
-
-static void load_directory(void)
+static void dir_tell(struct dir_cursor *dc, union dir_mark *m)
 {
-    s_entry_count = 0;
+    if (s_fs_type == FS_FAT32)
+        fat32_tell_dir(dc->fh, &m->fat);
+    else
+        exfat_telldir(dc->ex, &m->ex);
+}
 
+/* Returns 1=got entry, 0=end, -1=error */
+static int dir_next(struct dir_cursor *dc, struct file_entry *e)
+{
+    const char *name;
+    int r;
     if (s_fs_type == FS_FAT32) {
-        int dh = fat32_open_dir(s_path);
-        if (dh < 0)
-            return;
-        struct fat32_dir_info info;
-        while (s_entry_count < FILES_MAX_ENTRIES &&
-               fat32_read_dir(dh, &info) == 1) {
-            struct file_entry *e = &s_entries[s_entry_count];
-            strncpy(e->name, info.name, FILES_MAX_NAME - 1);
-            e->name[FILES_MAX_NAME - 1] = '\0';
-            e->size = info.size;
-            e->is_dir = info.is_dir;
-            s_entry_count++;
-        }
-        fat32_close_dir(dh);
+        static struct fat32_dir_info info;
+        r = fat32_read_dir(dc->fh, &info);
+        name = info.name;
+        e->size = info.size;
+        e->is_dir = info.is_dir;
     } else {
-        struct exfat_dir_info exents[FILES_MAX_ENTRIES];
-        int n = exfat_readdir(s_exvol, s_path, exents, FILES_MAX_ENTRIES);
-        if (n < 0)
+        static struct fs_entry info;
+        r = exfat_readdir_next(dc->ex, &info);
+        name = info.name;
+        e->size = (uint32_t)info.size; /* truncate to 4 GB */
+        e->is_dir = info.is_dir;
+    }
+    if (r == 1) {
+        strncpy(e->name, name, FILES_MAX_NAME - 1);
+        e->name[FILES_MAX_NAME - 1] = '\0';
+    }
+    return r;
+}
+
+static void dir_close(struct dir_cursor *dc)
+{
+    if (s_fs_type == FS_FAT32)
+        fat32_close_dir(dc->fh);
+    else
+        exfat_closedir(dc->ex);
+}
+
+/* Record where page `page` starts, if it falls on a mark. When the
+ * marks run out every other one is dropped and they space out twice as
+ * far. */
+static void dir_mark_page(struct dir_cursor *dc, int page)
+{
+    if (page % s_mark_step != 0)
+        return;
+    if (s_mark_count == DIR_MARKS) {
+        for (int i = 0; i < DIR_MARKS / 2; i++)
+            s_marks[i] = s_marks[2 * i];
+        s_mark_count = DIR_MARKS / 2;
+        s_mark_step *= 2;
+        if (page % s_mark_step != 0)
             return;
-        for (int i = 0; i < n && s_entry_count < FILES_MAX_ENTRIES; i++) {
-            struct file_entry *e = &s_entries[s_entry_count];
-            strncpy(e->name, exents[i].name, FILES_MAX_NAME - 1);
-            e->name[FILES_MAX_NAME - 1] = '\0';
-            e->size = (uint32_t)exents[i].size; /* truncate to 4 GB */
-            e->is_dir = exents[i].is_dir;
-            s_entry_count++;
-        }
     }
+    dir_tell(dc, &s_marks[s_mark_count++]);
+}
 
-    /* Sort: directories first, then case-insensitive alphabetical */
+/* Sort: directories first, then case-insensitive alphabetical */
+static void sort_entries(void)
+{
     for (int i = 1; i < s_entry_count; i++) {
         struct file_entry tmp = s_entries[i];
         int j = i - 1;
@@ -298,6 +331,86 @@ static void load_directory(void)
     }
 }
 
+static void load_directory(void)
+{
+    s_entry_count = 0;
+    s_dir_count = 0;
+    s_paged = 0;
+    s_page = -1;
+    s_mark_count = 0;
+    s_mark_step = 1;
+
+    struct dir_cursor dc;
+    if (dir_open(&dc) != 0)
+        return;
+
+    struct file_entry tmp;
+    int n = 0;
+    for (;;) {
+        if (n % ROWS_PER_PAGE == 0)
+            dir_mark_page(&dc, n / ROWS_PER_PAGE);
+        struct file_entry *e = n < FILES_MAX_ENTRIES ? &s_entries[n] : &tmp;
+        if (dir_next(&dc, e) != 1)
+            break;
+        if (e->is_dir)
+            s_dir_count++;
+        n++;
+
+        if (n % DIR_PROGRESS == 0) {
+            char msg[24];
+            snprintf(msg, sizeof(msg), "Listing... %d", n);
+            display_string(4, FOOTER_Y + 4, msg, COLOR_GRAY, COLOR_BLACK);
+        }
+    }
+    dir_close(&dc);
+
+    s_entry_count = n;
+    if (n <= FILES_MAX_ENTRIES)
+        sort_entries();
+    else
+        s_paged = 1;
+}
+
+/* Read page `page` of a paged directory into s_entries */
+static void load_page(int page)
+{
+    if (page == s_page)
+        return;
+    s_page = page;
+
+    int first = page * ROWS_PER_PAGE;
+    int want = s_entry_count - first;
+    if (want > ROWS_PER_PAGE)
+        want = ROWS_PER_PAGE;
+    for (int i = 0; i < ROWS_PER_PAGE; i++)
+        s_entries[i].name[0] = '\0';
+
+    int m = page / s_mark_step;
+    if (m >= s_mark_count)
+        return;
+    struct dir_cursor dc;
+    if (dir_open_at(&dc, &s_marks[m]) != 0)
+        return;
+
+    struct file_entry tmp;
+    int skip = (page - m * s_mark_step) * ROWS_PER_PAGE;
+    while (skip > 0 && dir_next(&dc, &tmp) == 1)
+        skip--;
+    for (int i = 0; skip == 0 && i < want; i++)
+        if (dir_next(&dc, &s_entries[i]) != 1)
+            break;
+    dir_close(&dc);
+}
+
+/* Entry idx of the listing, wherever it is held */
+static struct file_entry *entry_at(int idx)
+{
+    if (!s_paged)
+        return &s_entries[idx];
+    load_page(idx / ROWS_PER_PAGE);
+    return &s_entries[idx % ROWS_PER_PAGE];
+}
+
 /* --- Drawing --- */
 
 static void draw_header(void)
@@ -336,7 +449,7 @@ static void draw_file_list(void)
         visible = ROWS_PER_PAGE;
 
     for (int i = 0; i < visible; i++) {
-        struct file_entry *e = &s_entries[s_scroll + i];
+        struct file_entry *e = entry_at(s_scroll + i);
         int y = LIST_Y + i * ROW_HEIGHT;
 
         /* Alternating subtle background */
@@ -387,11 +500,7 @@ static void draw_footer(void)
 {
     display_fill_rect(0, FOOTER_Y, DISPLAY_WIDTH, FOOTER_H, COLOR_BLACK);
 
-    int dirs = 0, files = 0;
-    for (int i = 0; i < s_entry_count; i++) {
-        if (s_entries[i].is_dir) dirs++;
-        else files++;
-    }
+    int dirs = s_dir_count, files = s_entry_count - s_dir_count;
 
     /* Page Up button */
     if (s_scroll > 0) {
@@ -434,109 +543,277 @@ static void draw_footer(void)
     }
 }
 
+/* Each redraw is one compositor frame: only the tiles it changes are
+ * sent to the panel */
 static void draw_screen(void)
 {
+    display_frame_begin();
     draw_header();
     draw_file_list();
     draw_footer();
+    display_frame_end();
+}
+
+static void draw_page(void)
+{
+    display_frame_begin();
+    draw_file_list();
+    draw_footer();
+    display_frame_end();
 }
 
 /* --- Text File Viewer --- */
 
-#define TEXT_MAX_SIZE   (32 * 1024)
-#define TEXT_MAX_LINES  1000
+/* The file is never loaded whole. One pass builds a sparse index of line
+ * starts and each page is read from the nearest indexed line. The index
+ * has a fixed number of slots: when the lines outgrow them every other
+ * entry is dropped and the spacing doubles, so memory is the same for
+ * any file size. With PSRAM the index is 16 times larger, and pages far
+ * into a big file are found with that much less reading. */
 #define TEXT_LINES_PAGE 12
 #define TEXT_CHARS_LINE 40
 #define TEXT_CONTENT_Y  24
 #define TEXT_FOOTER_Y   216
+#define TEXT_INDEX_MAX  1024        /* indexed line starts */
+#define TEXT_INDEX_PSRAM 16384      /* ...when the board has PSRAM */
+#define TEXT_CHUNK      4096        /* bytes per read */
+#define TEXT_PAGES      3           /* pages kept decoded */
+#define TEXT_PROGRESS   (256 * 1024) /* indexing status every this many bytes */
+
+struct text_page {
+    int top;                        /* first line; -1 = empty slot */
+    uint32_t next_off;              /* where line top + TEXT_LINES_PAGE starts */
+    uint32_t used;                  /* LRU stamp */
+    char line[TEXT_LINES_PAGE][TEXT_CHARS_LINE + 1];
+};
 
-static void view_text_file(const char *path, const char *filename, uint32_t size)
+struct text_view {
+    uint32_t size;
+    int fh;                         /* FAT32 */
+    struct exfat_file *ex;          /* exFAT */
+    uint32_t chunk_off, chunk_len;
+    uint8_t chunk[TEXT_CHUNK];      /* file bytes at chunk_off */
+    int n_index, index_max, step;
+    int nlines;
+    struct text_page page[TEXT_PAGES];
+    uint32_t clock;
+    uint32_t index[];               /* index[i] = start of line i * step */
+};
+
+/* Read the chunk holding off. Returns 0 on success. */
+static int text_load(struct text_view *tv, uint32_t off)
 {
-    if (size > TEXT_MAX_SIZE) size = TEXT_MAX_SIZE;
+    uint32_t start = off - off % TEXT_CHUNK;
+    uint32_t len = tv->size - start;
+    if (len > TEXT_CHUNK) len = TEXT_CHUNK;
 
-    uint32_t actual = 0;
-    char *buf = read_file(path, TEXT_MAX_SIZE, &actual);
-    if (!buf) {
-        ui_show_error("Cannot read file.");
-        ui_wait_for_tap();
-        return;
+    int n;
+    if (s_fs_type == FS_FAT32) {
+        if (fat32_file_seek(tv->fh, start) != 0) return -1;
+        n = fat32_file_read(tv->fh, tv->chunk, len);
+    } else {
+        size_t got = len;
+        if (exfat_seek(tv->ex, start) != 0 ||
+            exfat_read(tv->ex, tv->chunk, &got) != 0)
+            return -1;
+        n = (int)got;
     }
+    if (n <= 0) return -1;
+    tv->chunk_off = start;
+    tv->chunk_len = (uint32_t)n;
+    return 0;
+}
 
-    /* Parse line offsets: scan for '\n', replace with '\0' */
-    uint16_t *line_off = malloc(TEXT_MAX_LINES * sizeof(uint16_t));
-    if (!line_off) { free(buf); return; }
-
-    int nlines = 0;
-    line_off[0] = 0;
-    nlines = 1;
-    for (uint32_t i = 0; i < actual && nlines < TEXT_MAX_LINES; i++) {
-        if (buf[i] == '\n') {
-            buf[i] = '\0';
-            if (i + 1 < actual) {
-                line_off[nlines++] = (uint16_t)(i + 1);
+/* Byte at off, or -1 at the end of the file or on a read error */
+static int text_byte(struct text_view *tv, uint32_t off)
+{
+    if (off >= tv->size) return -1;
+    if (off < tv->chunk_off || off >= tv->chunk_off + tv->chunk_len) {
+        if (text_load(tv, off) != 0) return -1;
+    }
+    return tv->chunk[off - tv->chunk_off];
+}
+
+/* The one pass over the file: count lines and index every step-th */
+static int text_index(struct text_view *tv)
+{
+    tv->nlines = 1;
+    tv->step = 1;
+    tv->n_index = 1;
+    tv->index[0] = 0;
+
+    uint32_t shown = 0;
+    for (uint32_t off = 0; off < tv->size; off += tv->chunk_len) {
+        if (text_load(tv, off) != 0) return -1;
+        const uint8_t *p = tv->chunk, *end = tv->chunk + tv->chunk_len;
+        while ((p = memchr(p, '\n', (size_t)(end - p))) != NULL) {
+            uint32_t start = off + (uint32_t)(++p - tv->chunk);
+            if (start >= tv->size) break;   /* a final newline starts no line */
+            int ln = tv->nlines++;
+            if (ln % tv->step) continue;
+            if (tv->n_index == tv->index_max) {
+                for (int i = 0; i < tv->index_max / 2; i++)
+                    tv->index[i] = tv->index[2 * i];
+                tv->n_index = tv->index_max / 2;
+                tv->step *= 2;
+                if (ln % tv->step) continue;
             }
-        } else if (buf[i] == '\r') {
-            buf[i] = '\0';  /* strip CR */
+            tv->index[tv->n_index++] = start;
+        }
+
+        if (off - shown >= TEXT_PROGRESS) {
+            shown = off;
+            char msg[24];
+            snprintf(msg, sizeof(msg), "Indexing... %u%%",
+                     (unsigned)((uint64_t)off * 100 / tv->size));
+            display_string(0, TEXT_CONTENT_Y, msg, COLOR_GRAY, COLOR_BLACK);
         }
     }
-    /* Null-terminate the last line */
-    if (actual < TEXT_MAX_SIZE)
-        buf[actual] = '\0';
-    else
-        buf[TEXT_MAX_SIZE - 1] = '\0';
+    return 0;
+}
 
-    int top_line = 0;
+/* The page starting at line top, from the cache or read in */
+static struct text_page *text_page(struct text_view *tv, int top)
+{
+    struct text_page *pg = &tv->page[0];
+    for (int i = 0; i < TEXT_PAGES; i++) {
+        if (tv->page[i].top == top) {
+            tv->page[i].used = ++tv->clock;
+            return &tv->page[i];
+        }
+        if (tv->page[i].used < pg->used) pg = &tv->page[i];
+    }
 
-    /* Draw function */
-    #define TV_DRAW() do { \
-        /* Header */ \
-        display_fill_rect(0, 0, BACK_W, HEADER_H, COLOR_DGRAY); \
-        display_string(4, 4, "< Back", COLOR_WHITE, COLOR_DGRAY); \
-        display_fill_rect(BACK_W, 0, DISPLAY_WIDTH - BACK_W, HEADER_H, COLOR_BLACK); \
-        { \
-            char tb[34]; \
-            strncpy(tb, filename, 33); tb[33] = '\0'; \
-            display_string(BACK_W + 4, 4, tb, COLOR_CYAN, COLOR_BLACK); \
-        } \
-        /* Content */ \
-        display_fill_rect(0, TEXT_CONTENT_Y, DISPLAY_WIDTH, \
-                          TEXT_LINES_PAGE * ROW_HEIGHT, COLOR_BLACK); \
-        for (int _i = 0; _i < TEXT_LINES_PAGE; _i++) { \
-            int _ln = top_line + _i; \
-            if (_ln >= nlines) break; \
-            char _linebuf[TEXT_CHARS_LINE + 1]; \
-            strncpy(_linebuf, buf + line_off[_ln], TEXT_CHARS_LINE); \
-            _linebuf[TEXT_CHARS_LINE] = '\0'; \
-            display_string(0, TEXT_CONTENT_Y + _i * ROW_HEIGHT, \
-                           _linebuf, COLOR_GRAY, COLOR_BLACK); \
-        } \
-        /* Footer */ \
-        display_fill_rect(0, TEXT_FOOTER_Y, DISPLAY_WIDTH, FOOTER_H, COLOR_BLACK); \
-        if (top_line > 0) { \
-            display_fill_rect(0, TEXT_FOOTER_Y, PGUP_W, FOOTER_H, COLOR_DGRAY); \
-            display_string(8, TEXT_FOOTER_Y + 4, "< Pg Up", COLOR_WHITE, COLOR_DGRAY); \
-        } \
-        { \
-            char _ind[32]; \
-            snprintf(_ind, sizeof(_ind), "%d-%d / %d", \
-                     top_line + 1, \
-                     (top_line + TEXT_LINES_PAGE < nlines) ? \
-                         top_line + TEXT_LINES_PAGE : nlines, \
-                     nlines); \
-            int _sw = (int)strlen(_ind) * FONT_WIDTH; \
-            display_string((DISPLAY_WIDTH - _sw) / 2, TEXT_FOOTER_Y + 4, \
-                           _ind, COLOR_GRAY, COLOR_BLACK); \
-        } \
-        if (top_line + TEXT_LINES_PAGE < nlines) { \
-            display_fill_rect(PGDN_X, TEXT_FOOTER_Y, \
-                              DISPLAY_WIDTH - PGDN_X, FOOTER_H, COLOR_DGRAY); \
-            display_string(PGDN_X + 8, TEXT_FOOTER_Y + 4, "Pg Dn >", \
-                           COLOR_WHITE, COLOR_DGRAY); \
-        } \
-    } while(0)
+    /* Start at the nearest indexed line, or where the page before
+     * this one ended */
+    int k = top / tv->step;
+    uint32_t off = tv->index[k];
+    int skip = top - k * tv->step;
+    for (int i = 0; i < TEXT_PAGES; i++) {
+        if (tv->page[i].top >= 0 &&
+            tv->page[i].top + TEXT_LINES_PAGE == top) {
+            off = tv->page[i].next_off;
+            skip = 0;
+        }
+    }
 
-    display_clear(COLOR_BLACK);
-    TV_DRAW();
+    int c;
+    while (skip > 0 && (c = text_byte(tv, off)) >= 0) {
+        off++;
+        if (c == '\n') skip--;
+    }
+
+    /* Lines are cut at TEXT_CHARS_LINE; CRs are dropped */
+    for (int i = 0; i < TEXT_LINES_PAGE; i++) {
+        int n = 0;
+        if (top + i < tv->nlines) {
+            while ((c = text_byte(tv, off)) >= 0) {
+                off++;
+                if (c == '\n') break;
+                if (c != '\r' && n < TEXT_CHARS_LINE)
+                    pg->line[i][n++] = (char)c;
+            }
+        }
+        pg->line[i][n] = '\0';
+    }
+    pg->top = top;
+    pg->next_off = off;
+    pg->used = ++tv->clock;
+    return pg;
+}
+
+static void text_draw(struct text_view *tv, const char *filename, int top)
+{
+    struct text_page *pg = text_page(tv, top);
+
+    display_frame_begin();
+    /* Header */
+    display_fill_rect(0, 0, BACK_W, HEADER_H, COLOR_DGRAY);
+    display_string(4, 4, "< Back", COLOR_WHITE, COLOR_DGRAY);
+    display_fill_rect(BACK_W, 0, DISPLAY_WIDTH - BACK_W, HEADER_H, COLOR_BLACK);
+    char tb[34];
+    strncpy(tb, filename, 33); tb[33] = '\0';
+    display_string(BACK_W + 4, 4, tb, COLOR_CYAN, COLOR_BLACK);
+
+    /* Content */
+    display_fill_rect(0, TEXT_CONTENT_Y, DISPLAY_WIDTH,
+                      TEXT_LINES_PAGE * ROW_HEIGHT, COLOR_BLACK);
+    for (int i = 0; i < TEXT_LINES_PAGE && top + i < tv->nlines; i++)
+        display_string(0, TEXT_CONTENT_Y + i * ROW_HEIGHT,
+                       pg->line[i], COLOR_GRAY, COLOR_BLACK);
+
+    /* Footer: Pg Up, the position (tap it to jump), Pg Dn */
+    display_fill_rect(0, TEXT_FOOTER_Y, DISPLAY_WIDTH, FOOTER_H, COLOR_BLACK);
+    if (top > 0) {
+        display_fill_rect(0, TEXT_FOOTER_Y, PGUP_W, FOOTER_H, COLOR_DGRAY);
+        display_string(8, TEXT_FOOTER_Y + 4, "< Pg Up", COLOR_WHITE, COLOR_DGRAY);
+    }
+    int last = (top + TEXT_LINES_PAGE < tv->nlines) ?
+               top + TEXT_LINES_PAGE : tv->nlines;
+    char ind[40];
+    snprintf(ind, sizeof(ind), "%d-%d / %d", top + 1, last, tv->nlines);
+    if ((int)strlen(ind) * FONT_WIDTH > PGDN_X - PGUP_W)
+        snprintf(ind, sizeof(ind), "%d%%",
+                 (int)((int64_t)last * 100 / tv->nlines));
+    int sw = (int)strlen(ind) * FONT_WIDTH;
+    display_string((DISPLAY_WIDTH - sw) / 2, TEXT_FOOTER_Y + 4,
+                   ind, COLOR_GRAY, COLOR_BLACK);
+    int bar = (int)((int64_t)(PGDN_X - PGUP_W) * last / tv->nlines);
+    display_fill_rect(PGUP_W, TEXT_FOOTER_Y + FOOTER_H - 2, bar, 2, COLOR_CYAN);
+    if (top + TEXT_LINES_PAGE < tv->nlines) {
+        display_fill_rect(PGDN_X, TEXT_FOOTER_Y,
+                          DISPLAY_WIDTH - PGDN_X, FOOTER_H, COLOR_DGRAY);
+        display_string(PGDN_X + 8, TEXT_FOOTER_Y + 4, "Pg Dn >",
+                       COLOR_WHITE, COLOR_DGRAY);
+    }
+    display_frame_end();
+}
+
+static void view_text_file(const char *path, const char *filename, uint32_t size)
+{
+    int index_max = psram_size() ? TEXT_INDEX_PSRAM : TEXT_INDEX_MAX;
+    struct text_view *tv = psram_alloc(sizeof(*tv) +
+                                       index_max * sizeof(uint32_t));
+    if (!tv) {
+        ui_show_error("Not enough memory.");
+        ui_wait_for_tap();
+        return;
+    }
+    memset(tv, 0, sizeof(*tv));
+    tv->index_max = index_max;
+    for (int i = 0; i < TEXT_PAGES; i++)
+        tv->page[i].top = -1;
+
+    int ok;
+    if (s_fs_type == FS_FAT32) {
+        tv->fh = fat32_file_open(path);
+        ok = (tv->fh > 0);
+        if (ok) tv->size = fat32_file_size(tv->fh);
+    } else {
+        uint64_t fsz = 0;
+        tv->ex = exfat_open(s_exvol, path, &fsz);
+        ok = (tv->ex && fsz <= UINT32_MAX);
+        if (ok) tv->size = (uint32_t)fsz;
+    }
+    if (ok) {
+        display_clear(COLOR_BLACK);
+        ok = (text_index(tv) == 0);
+    }
+    if (!ok) {
+        if (s_fs_type == FS_FAT32 && tv->fh > 0)
+            fat32_file_close(tv->fh);
+        else if (tv->ex)
+            exfat_close(tv->ex);
+        free(tv);
+        ui_show_error("Cannot read file.");
+        ui_wait_for_tap();
+        return;
+    }
+
+    int top_line = 0;
+    int last_top = tv->nlines - TEXT_LINES_PAGE;
+    if (last_top < 0) last_top = 0;
+    text_draw(tv, filename, top_line);
 
     while (1) {
         int tx, ty;
@@ -545,27 +822,35 @@ static void view_text_file(const char *path, const char *filename, uint32_t size
         /* Back */
         if (tx < BACK_W && ty < HEADER_H)
             break;
+        if (ty < TEXT_FOOTER_Y)
+            continue;
 
-        /* Page Up */
-        if (ty >= TEXT_FOOTER_Y && tx < PGUP_W && top_line > 0) {
+        if (tx < PGUP_W) {
+            /* Page Up */
+            if (top_line == 0) continue;
             top_line -= TEXT_LINES_PAGE;
             if (top_line < 0) top_line = 0;
-            TV_DRAW();
-            continue;
-        }
-
-        /* Page Down */
-        if (ty >= TEXT_FOOTER_Y && tx >= PGDN_X &&
-            top_line + TEXT_LINES_PAGE < nlines) {
+        } else if (tx >= PGDN_X) {
+            /* Page Down */
+            if (top_line + TEXT_LINES_PAGE >= tv->nlines) continue;
             top_line += TEXT_LINES_PAGE;
-            TV_DRAW();
-            continue;
+        } else {
+            /* Position: jump to that fraction of the file, on a page
+             * boundary so paging from there meets the cached pages */
+            int64_t at = (int64_t)(tx - PGUP_W) * tv->nlines / (PGDN_X - PGUP_W);
+            int t = (int)at - (int)at % TEXT_LINES_PAGE;
+            if (t > last_top) t = last_top;
+            if (t == top_line) continue;
+            top_line = t;
         }
+        text_draw(tv, filename, top_line);
     }
 
-    #undef TV_DRAW
-    free(line_off);
-    free(buf);
+    if (s_fs_type == FS_FAT32)
+        fat32_file_close(tv->fh);
+    else
+        exfat_close(tv->ex);
+    free(tv);
 }
 
 /* --- BMP Image Viewer --- */
@@ -668,8 +953,17 @@ static void view_bmp_file(const char *path, const char *filename, uint32_t size)
 
 /* --- PNG/JPEG Image Viewer --- */
 
-/* Max source image file size (up to 2 MB for large JPEGs we can downscale) */
-#define IMG_MAX_FILE (2u * 1024u * 1024u)
+/* Max source image file size (up to 2 MB for large JPEGs we can
+ * downscale; with PSRAM up to half of it, at most 8 MB) */
+#define IMG_MAX_FILE       (2u * 1024u * 1024u)
+#define IMG_MAX_FILE_PSRAM (8u * 1024u * 1024u)
+
+static uint32_t img_max_file(void)
+{
+    size_t half = psram_size() / 2;
+    if (half <= IMG_MAX_FILE) return IMG_MAX_FILE;
+    return half < IMG_MAX_FILE_PSRAM ? (uint32_t)half : IMG_MAX_FILE_PSRAM;
+}
 
 /* Viewer layout */
 #define VIEW_HDR_H   24
@@ -687,18 +981,121 @@ static void view_bmp_file(const char *path, const char *filename, uint32_t size)
 /* Drag threshold: movement below this is treated as a tap */
 #define DRAG_THRESH  6
 
+/* Zoom doubles per [+] up to this */
+#define ZOOM_MAX     8
+
 /* Callback context for decoding to memory buffer */
 struct img_buf_ctx {
     uint16_t *pixels;
     int w, h;
+    int next;               /* the row expected next */
+    int unordered;          /* rows came out of order (interlaced PNG) */
 };
 
+/* ---- Decode task ----
+ *
+ * The decoders run on the other core while the viewer's task draws what
+ * they have finished. Their row callbacks write straight into the
+ * destination buffer as before, then publish how many rows it holds;
+ * with one writer and one reader of that count, and the rows below it
+ * never written again, the handoff needs no lock. Task notification
+ * bits wake the viewer. */
+
+#define DECODE_STACK  4096
+#ifdef CONFIG_FREERTOS_UNICORE
+#define DECODE_CORE   0
+#else
+#define DECODE_CORE   1
+#endif
+
+#define DECODE_ROWS   (1u << 0)        /* more rows published */
+#define DECODE_DONE   (1u << 1)        /* the decoder returned */
+
+/* The decoders' row callback */
+typedef void (*img_row_fn)(int y, int w, const uint16_t *rgb565, void *user);
+
+static struct {
+    const uint8_t *buf;
+    uint32_t len;
+    int is_png, scale;
+    img_row_fn cb;
+    void *user;
+    TaskHandle_t owner;
+    int ok;                     /* what the decoder returned */
+    int rows;                   /* rows complete, published atomically */
+} s_dec;
+
+/* From a row callback: the first rows of the destination are complete */
+static void decode_publish(int rows)
+{
+    __atomic_store_n(&s_dec.rows, rows, __ATOMIC_RELEASE);
+    xTaskNotify(s_dec.owner, DECODE_ROWS, eSetBits);
+}
+
+static void decode_body(void)
+{
+    s_dec.ok = s_dec.is_png
+        ? sped_decode(s_dec.buf, s_dec.len, s_dec.scale, s_dec.cb, s_dec.user)
+        : fjpeg_decode(s_dec.buf, s_dec.len, s_dec.scale, s_dec.cb, s_dec.user);
+    xTaskNotify(s_dec.owner, DECODE_DONE, eSetBits);
+}
+
+static void decode_task(void *arg)
+{
+    (void)arg;
+    decode_body();
+    vTaskDelete(NULL);
+}
+
+/* Start decoding buf on the other core; without a task to run it on,
+ * it is decoded here, before this returns */
+static void decode_start(const uint8_t *buf, uint32_t len, int is_png,
+                         int scale, img_row_fn cb, void *user)
+{
+    s_dec.buf = buf;
+    s_dec.len = len;
+    s_dec.is_png = is_png;
+    s_dec.scale = scale;
+    s_dec.cb = cb;
+    s_dec.user = user;
+    s_dec.owner = xTaskGetCurrentTaskHandle();
+    s_dec.ok = -1;
+    s_dec.rows = 0;
+    xTaskNotifyWait(0, DECODE_ROWS | DECODE_DONE, NULL, 0);
+    if (xTaskCreatePinnedToCore(decode_task, "decode", DECODE_STACK, NULL,
+                                uxTaskPriorityGet(NULL), NULL,
+                                DECODE_CORE) != pdPASS)
+        decode_body();
+}
+
+/* Wait for more rows. Sets *rows to how many are complete; returns 1
+ * while the decoder runs, 0 once it has returned and its task is done
+ * with s_dec (then see decode_result()). */
+static int decode_wait(int *rows)
+{
+    uint32_t bits = 0;
+    xTaskNotifyWait(0, DECODE_ROWS | DECODE_DONE, &bits, portMAX_DELAY);
+    *rows = __atomic_load_n(&s_dec.rows, __ATOMIC_ACQUIRE);
+    return !(bits & DECODE_DONE);
+}
+
+static int decode_result(void)
+{
+    return s_dec.ok;
+}
+
 static void img_buf_cb(int y, int w, const uint16_t *rgb565, void *user)
 {
     struct img_buf_ctx *ctx = user;
     if (y >= ctx->h) return;
     int copy_w = (w > ctx->w) ? ctx->w : w;
     memcpy(ctx->pixels + y * ctx->w, rgb565, copy_w * sizeof(uint16_t));
+    if (y != ctx->next) {
+        ctx->unordered = 1;     /* rows published may change again */
+        return;
+    }
+    ctx->next = y + 1;
+    if (!ctx->unordered) decode_publish(ctx->next);
 }
 
 /* Draw the viewer header bar */
@@ -717,10 +1114,10 @@ static void viewer_draw_header(const char *filename, int zoom)
 
     /* [+] button */
     display_fill_rect(BTN_PLUS_X, 0, BTN_PLUS_W, VIEW_HDR_H,
-                      zoom < 4 ? COLOR_DGRAY : COLOR_BLACK);
+                      zoom < ZOOM_MAX ? COLOR_DGRAY : COLOR_BLACK);
     display_char(BTN_PLUS_X + 10, 4, '+',
-                 zoom < 4 ? COLOR_WHITE : COLOR_DGRAY,
-                 zoom < 4 ? COLOR_DGRAY : COLOR_BLACK);
+                 zoom < ZOOM_MAX ? COLOR_WHITE : COLOR_DGRAY,
+                 zoom < ZOOM_MAX ? COLOR_DGRAY : COLOR_BLACK);
 
     /* Zoom label + filename */
     int lx = BTN_PLUS_X + BTN_PLUS_W + 8;
@@ -731,15 +1128,16 @@ static void viewer_draw_header(const char *filename, int zoom)
     display_string(lx, 4, label, COLOR_CYAN, COLOR_BLACK);
 }
 
-/* Draw the viewport from the pixel buffer with zoom and pan */
-static void viewer_draw_viewport(const uint16_t *pixels, int img_w, int img_h,
-                                 int zoom, int pan_x, int pan_y)
+/* Draw screen rows [sy0, sy1) of the viewport from the pixel buffer
+ * with zoom and pan */
+static void viewer_draw_rows(const uint16_t *pixels, int img_w, int img_h,
+                             int zoom, int pan_x, int pan_y, int sy0, int sy1)
 {
     uint16_t line[VIEW_W];
     int zoomed_w = img_w * zoom;
     int zoomed_h = img_h * zoom;
 
-    for (int sy = 0; sy < VIEW_H; sy++) {
+    for (int sy = sy0; sy < sy1; sy++) {
         /* Screen row → position in zoomed image space */
         int zy = pan_y + sy;
 
@@ -761,6 +1159,13 @@ static void viewer_draw_viewport(const uint16_t *pixels, int img_w, int img_h,
     }
 }
 
+/* Draw the viewport from the pixel buffer with zoom and pan */
+static void viewer_draw_viewport(const uint16_t *pixels, int img_w, int img_h,
+                                 int zoom, int pan_x, int pan_y)
+{
+    viewer_draw_rows(pixels, img_w, img_h, zoom, pan_x, pan_y, 0, VIEW_H);
+}
+
 /* Clamp pan so the viewport stays within the zoomed image, or center if smaller */
 static void clamp_pan(int *pan_x, int *pan_y, int img_w, int img_h, int zoom)
 {
@@ -782,16 +1187,48 @@ static void clamp_pan(int *pan_x, int *pan_y, int img_w, int img_h, int zoom)
     }
 }
 
-static void view_decoded_image(const char *path, const char *filename,
-                               uint32_t size, int is_png)
+/* The last image's overview (the whole picture at the scale that fits
+ * memory) stays decoded after the viewer closes, so opening it again
+ * skips the read and decode. Opening something else, or leaving the
+ * browser, drops it. */
+static struct {
+    char path[256];
+    uint32_t size;
+    int is_png;
+    int img_w, img_h;       /* full image */
+    int scale;              /* decoder scale of the overview */
+    int w, h;
+    uint16_t *pixels;
+} s_overview;
+
+static void overview_drop(void)
 {
+    free(s_overview.pixels);
+    s_overview.pixels = NULL;
+}
+
+/* Decode path into s_overview, unless it already holds it, drawing it
+ * in the viewport at 1x as its rows come in. Shows the error and
+ * returns -1 on failure. */
+static int overview_load(const char *path, uint32_t size, int is_png)
+{
+    if (s_overview.pixels && s_overview.size == size &&
+        s_overview.is_png == is_png && strcmp(s_overview.path, path) == 0) {
+        int pan_x = 0, pan_y = 0;
+        clamp_pan(&pan_x, &pan_y, s_overview.w, s_overview.h, 1);
+        viewer_draw_viewport(s_overview.pixels, s_overview.w, s_overview.h,
+                             1, pan_x, pan_y);
+        return 0;
+    }
+    overview_drop();
+
     uint32_t actual = 0;
-    uint8_t *buf = read_file(path, IMG_MAX_FILE, &actual);
+    uint8_t *buf = read_file(path, img_max_file(), &actual);
     if (!buf || actual < 8) {
         if (buf) free(buf);
         ui_show_error("Cannot read image.");
         ui_wait_for_tap();
-        return;
+        return -1;
     }
 
     /* Get image dimensions */
@@ -799,13 +1236,13 @@ static void view_decoded_image(const char *path, const char *filename,
     if (is_png) {
         sped_info_t info;
         if (sped_info(buf, actual, &info) != 0) {
-            free(buf); ui_show_error("Bad PNG file."); ui_wait_for_tap(); return;
+            free(buf); ui_show_error("Bad PNG file."); ui_wait_for_tap(); return -1;
         }
         img_w = (int)info.width; img_h = (int)info.height;
     } else {
         fjpeg_info_t info;
         if (fjpeg_info(buf, actual, &info) != 0) {
-            free(buf); ui_show_error("Bad JPEG file."); ui_wait_for_tap(); return;
+            free(buf); ui_show_error("Bad JPEG file."); ui_wait_for_tap(); return -1;
         }
         img_w = info.width; img_h = info.height;
     }
@@ -825,15 +1262,15 @@ static void view_decoded_image(const char *path, const char *filename,
     }
     int dec_w = img_w / (scale > 1 ? scale : 1);
     int dec_h = img_h / (scale > 1 ? scale : 1);
-    if (dec_w == 0 || dec_h == 0) { free(buf); return; }
+    if (dec_w == 0 || dec_h == 0) { free(buf); return -1; }
 
     /* Allocate pixel buffer for decoded image */
-    uint16_t *pixels = malloc((size_t)dec_w * dec_h * sizeof(uint16_t));
+    uint16_t *pixels = psram_alloc((size_t)dec_w * dec_h * sizeof(uint16_t));
     if (!pixels) {
         free(buf);
         ui_show_error("Not enough memory.");
         ui_wait_for_tap();
-        return;
+        return -1;
     }
     memset(pixels, 0, (size_t)dec_w * dec_h * sizeof(uint16_t));
 
@@ -842,12 +1279,26 @@ static void view_decoded_image(const char *path, const char *filename,
     bctx.pixels = pixels;
     bctx.w = dec_w;
     bctx.h = dec_h;
-
-    int ok;
-    if (is_png)
-        ok = sped_decode(buf, actual, scale, img_buf_cb, &bctx);
-    else
-        ok = fjpeg_decode(buf, actual, scale, img_buf_cb, &bctx);
+    bctx.next = 0;
+    bctx.unordered = 0;
+
+    /* Screen row sy shows source row pan_y + sy: it can be drawn once
+     * the decoder is past that row */
+    int pan_x = 0, pan_y = 0, drawn = 0, rows, more;
+    clamp_pan(&pan_x, &pan_y, dec_w, dec_h, 1);
+    decode_start(buf, actual, is_png, scale, img_buf_cb, &bctx);
+    do {
+        more = decode_wait(&rows);
+        int ready = more ? rows - pan_y : VIEW_H;
+        if (ready > VIEW_H) ready = VIEW_H;
+        if (ready > drawn) {
+            viewer_draw_rows(pixels, dec_w, dec_h, 1, pan_x, pan_y, drawn, ready);
+            drawn = ready;
+        }
+    } while (more);
+    if (bctx.unordered)
+        viewer_draw_rows(pixels, dec_w, dec_h, 1, pan_x, pan_y, 0, VIEW_H);
+    int ok = decode_result();
 
     free(buf);  /* Source data no longer needed */
 
@@ -855,29 +1306,152 @@ static void view_decoded_image(const char *path, const char *filename,
         free(pixels);
         ui_show_error("Decode error.");
         ui_wait_for_tap();
-        return;
+        return -1;
     }
 
-    /* --- Interactive viewer loop --- */
-    int zoom = 1;
-    int pan_x = 0, pan_y = 0;
-    clamp_pan(&pan_x, &pan_y, dec_w, dec_h, zoom);
+    snprintf(s_overview.path, sizeof(s_overview.path), "%s", path);
+    s_overview.size = size;
+    s_overview.is_png = is_png;
+    s_overview.img_w = img_w;
+    s_overview.img_h = img_h;
+    s_overview.scale = scale;
+    s_overview.w = dec_w;
+    s_overview.h = dec_h;
+    s_overview.pixels = pixels;
+    return 0;
+}
 
+/* Finest decoder scale that still gives at least one source pixel per
+ * screen pixel at this zoom (1 once zoom passes the overview scale) */
+static int tile_scale(int is_png, int scale, int zoom)
+{
+    static const int png_scales[] = {4, 2, 1};
+    static const int jpg_scales[] = {8, 4, 1};
+    const int *opt = is_png ? png_scales : jpg_scales;
+    for (int i = 0; i < 3; i++)
+        if (opt[i] * zoom <= scale)
+            return opt[i];
+    return 1;
+}
+
+/* Detail tile: once zoom asks for more than the overview holds, the
+ * viewport alone is decoded again at a finer scale. The decoders emit
+ * every row; the callback keeps the rows and columns that land on
+ * screen, so the tile is one screen of pixels however large the image. */
+struct img_tile_ctx {
+    uint16_t *pixels;       /* VIEW_W x VIEW_H */
+    int16_t col[VIEW_W];    /* source column per screen column, -1 = none */
+    int pan_y;
+    int num, den;           /* zoomed y * num / den = source row */
+    int rows;               /* source rows at this scale */
+    int sy;                 /* next screen row to fill */
+};
+
+static void img_tile_cb(int y, int w, const uint16_t *rgb565, void *user)
+{
+    struct img_tile_ctx *ctx = user;
+    int sy0 = ctx->sy;
+    while (ctx->sy < VIEW_H) {
+        int zy = ctx->pan_y + ctx->sy;
+        int src = (zy < 0) ? -1 : (int)((int64_t)zy * ctx->num / ctx->den);
+        if (src > y || src >= ctx->rows) break;
+        if (src == y) {
+            uint16_t *dst = ctx->pixels + ctx->sy * VIEW_W;
+            for (int sx = 0; sx < VIEW_W; sx++) {
+                int c = ctx->col[sx];
+                dst[sx] = (c >= 0 && c < w) ? rgb565[c] : COLOR_BLACK;
+            }
+        }
+        ctx->sy++;
+    }
+    if (ctx->sy != sy0) decode_publish(ctx->sy);
+}
+
+/* Decode the viewport at tile scale ts into pixels, drawing its rows as
+ * they are filled. Returns 0 on success. */
+static int tile_decode(uint16_t *pixels, int ts, int zoom, int pan_x, int pan_y)
+{
+    static struct img_tile_ctx ctx;
+    int num = s_overview.scale, den = zoom * ts;
+    int cols = s_overview.img_w / ts;
+
+    memset(pixels, 0, (size_t)VIEW_W * VIEW_H * sizeof(uint16_t));
+    ctx.pixels = pixels;
+    for (int sx = 0; sx < VIEW_W; sx++) {
+        int zx = pan_x + sx;
+        int c = (zx < 0) ? -1 : (int)((int64_t)zx * num / den);
+        ctx.col[sx] = (int16_t)((c < cols) ? c : -1);
+    }
+    ctx.pan_y = pan_y;
+    ctx.num = num;
+    ctx.den = den;
+    ctx.rows = s_overview.img_h / ts;
+    ctx.sy = 0;
+
+    uint32_t actual = 0;
+    uint8_t *buf = read_file(s_overview.path, img_max_file(), &actual);
+    if (!buf) return -1;
+    int drawn = 0, rows, more;
+    decode_start(buf, actual, s_overview.is_png, ts, img_tile_cb, &ctx);
+    do {
+        more = decode_wait(&rows);
+        if (!more) rows = VIEW_H;
+        for (; drawn < rows; drawn++)
+            display_draw_rgb565_line(0, VIEW_Y + drawn, VIEW_W,
+                                     pixels + drawn * VIEW_W);
+    } while (more);
+    free(buf);
+    return decode_result();
+}
+
+/* Draw the viewport: the overview at once, then, when the zoom is past
+ * what it holds, the sharper tile over it as it decodes. The tile
+ * buffer is allocated on first need; without memory for it, or if the
+ * tile fails, the overview stays. */
+static void viewer_show(uint16_t **tile, int zoom, int pan_x, int pan_y)
+{
+    viewer_draw_viewport(s_overview.pixels, s_overview.w, s_overview.h,
+                         zoom, pan_x, pan_y);
+
+    int ts = tile_scale(s_overview.is_png, s_overview.scale, zoom);
+    if (ts >= s_overview.scale) return;
+    if (!*tile)
+        *tile = psram_alloc((size_t)VIEW_W * VIEW_H * sizeof(uint16_t));
+    if (*tile && tile_decode(*tile, ts, zoom, pan_x, pan_y) != 0)
+        viewer_draw_viewport(s_overview.pixels, s_overview.w, s_overview.h,
+                             zoom, pan_x, pan_y);
+}
+
+static void view_decoded_image(const char *path, const char *filename,
+                               uint32_t size, int is_png)
+{
+    int zoom = 1;
     display_clear(COLOR_BLACK);
     viewer_draw_header(filename, zoom);
-    viewer_draw_viewport(pixels, dec_w, dec_h, zoom, pan_x, pan_y);
+    if (overview_load(path, size, is_png) != 0)
+        return;
+    int dec_w = s_overview.w, dec_h = s_overview.h;
+    uint16_t *pixels = s_overview.pixels;
+    uint16_t *tile = NULL;
+
+    /* --- Interactive viewer loop --- */
+    int pan_x = 0, pan_y = 0;
+    clamp_pan(&pan_x, &pan_y, dec_w, dec_h, zoom);
 
-    int was_touching = 0;
+    int was_touching = 0;               /* a DOWN was seen */
     int drag_sx = 0, drag_sy = 0;       /* screen coords at touch-down */
     int drag_pan_x = 0, drag_pan_y = 0; /* pan at touch-down */
     int last_tx = 0, last_ty = 0;
     int dragging = 0;
 
+    /* Blocks on touch events; nothing runs while the image sits still */
     while (1) {
-        int tx, ty;
-        int touching = touch_read(&tx, &ty);
+        struct touch_event ev;
+        if (!touch_get_event(&ev, -1))
+            break;
+        int tx = ev.x, ty = ev.y;
 
-        if (touching && !was_touching) {
+        if (ev.type == TOUCH_DOWN) {
             /* Touch down */
             drag_sx = tx;
             drag_sy = ty;
@@ -886,8 +1460,9 @@ static void view_decoded_image(const char *path, const char *filename,
             dragging = 0;
             last_tx = tx;
             last_ty = ty;
-        } else if (touching && was_touching) {
-            /* Held / dragging — only move viewport for touches in the image area */
+        } else if (ev.type == TOUCH_MOVE && was_touching) {
+            /* Held / dragging — only move viewport for touches in the image area.
+             * The drag shows the overview; the tile follows on release. */
             int dx = tx - drag_sx;
             int dy = ty - drag_sy;
             if (!dragging && (dx > DRAG_THRESH || dx < -DRAG_THRESH ||
@@ -902,9 +1477,13 @@ static void view_decoded_image(const char *path, const char *filename,
             }
             last_tx = tx;
             last_ty = ty;
-        } else if (!touching && was_touching) {
+        } else if (ev.type == TOUCH_UP && was_touching) {
             /* Release — if not a drag, treat as tap */
-            if (!dragging) {
+            last_tx = tx;
+            last_ty = ty;
+            if (dragging && drag_sy >= VIEW_Y) {
+                viewer_show(&tile, zoom, pan_x, pan_y);
+            } else if (!dragging) {
                 int ttx = last_tx, tty = last_ty;
 
                 /* Back button */
@@ -922,12 +1501,12 @@ static void view_decoded_image(const char *path, const char *filename,
                     pan_y = cy / 2 - VIEW_H / 2;
                     clamp_pan(&pan_x, &pan_y, dec_w, dec_h, zoom);
                     viewer_draw_header(filename, zoom);
-                    viewer_draw_viewport(pixels, dec_w, dec_h, zoom, pan_x, pan_y);
+                    viewer_show(&tile, zoom, pan_x, pan_y);
                 }
 
                 /* [+] button */
                 if (ttx >= BTN_PLUS_X && ttx < BTN_PLUS_X + BTN_PLUS_W &&
-                    tty < VIEW_HDR_H && zoom < 4) {
+                    tty < VIEW_HDR_H && zoom < ZOOM_MAX) {
                     /* Zoom in: keep center stable */
                     int cx = pan_x + VIEW_W / 2;
                     int cy = pan_y + VIEW_H / 2;
@@ -936,16 +1515,18 @@ static void view_decoded_image(const char *path, const char *filename,
                     pan_y = cy * 2 - VIEW_H / 2;
                     clamp_pan(&pan_x, &pan_y, dec_w, dec_h, zoom);
                     viewer_draw_header(filename, zoom);
-                    viewer_draw_viewport(pixels, dec_w, dec_h, zoom, pan_x, pan_y);
+                    viewer_show(&tile, zoom, pan_x, pan_y);
                 }
             }
         }
 
-        was_touching = touching;
-        vTaskDelay(20);
+        if (ev.type == TOUCH_DOWN)
+            was_touching = 1;
+        else if (ev.type == TOUCH_UP)
+            was_touching = 0;
     }
 
-    free(pixels);
+    free(tile);
 }
 
 /* --- File Info Popup --- */
@@ -990,6 +1571,10 @@ static void open_file(struct file_entry *e)
     char full_path[256];
     build_full_path(full_path, sizeof(full_path), e->name);
 
+    /* Only an image reuses the last overview; the others need the heap */
+    if (!is_png_file(e->name) && !is_jpg_file(e->name))
+        overview_drop();
+
     if (is_text_file(e->name))
         view_text_file(full_path, e->name, e->size);
     else if (is_bmp_file(e->name))
@@ -1054,7 +1639,7 @@ void app_files_run(void)
     }
 
     /* Find partition */
-    uint32_t start_lba = find_partition();
+    uint32_t start_lba = gpt_find_partition();
 
     /* Detect filesystem */
     s_fs_type = FS_NONE;
@@ -1080,7 +1665,6 @@ void app_files_run(void)
     s_scroll = 0;
     load_directory();
 
-    display_clear(COLOR_BLACK);
     draw_screen();
 
     /* Main loop */
@@ -1099,8 +1683,7 @@ void app_files_run(void)
         if (ty >= FOOTER_Y && tx < PGUP_W && s_scroll > 0) {
             s_scroll -= ROWS_PER_PAGE;
             if (s_scroll < 0) s_scroll = 0;
-            draw_file_list();
-            draw_footer();
+            draw_page();
             continue;
         }
 
@@ -1108,8 +1691,7 @@ void app_files_run(void)
         if (ty >= FOOTER_Y && tx >= PGDN_X &&
             s_scroll + ROWS_PER_PAGE < s_entry_count) {
             s_scroll += ROWS_PER_PAGE;
-            draw_file_list();
-            draw_footer();
+            draw_page();
             continue;
         }
 
@@ -1118,12 +1700,11 @@ void app_files_run(void)
             int row = (ty - LIST_Y) / ROW_HEIGHT;
             int idx = s_scroll + row;
             if (idx < s_entry_count) {
-                struct file_entry *e = &s_entries[idx];
+                struct file_entry *e = entry_at(idx);
                 if (e->is_dir) {
                     enter_directory(e->name);
                 } else {
                     open_file(e);
-                    display_clear(COLOR_BLACK);
                     draw_screen();
                 }
             }
@@ -1131,6 +1712,7 @@ void app_files_run(void)
     }
 
     /* Cleanup */
+    overview_drop();
     if (s_fs_type == FS_EXFAT && s_exvol)
         exfat_unmount(s_exvol);
     s_exvol = NULL;
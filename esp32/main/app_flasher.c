@@ -3,6 +3,11 @@
  *
  * Default: flash x86_64 directly (confirmation screen only).
  * If show_aarch64 is enabled in settings, shows arch selection first.
+ *
+ * Batch mode (the toggle under the buttons) flashes card after card:
+ * each one is flashed as soon as it is inserted, and the next awaited
+ * once it is pulled, until the screen is tapped. Cards after the first
+ * of a size are written from its metadata map (flasher.h).
  */
 
 #include "app_flasher.h"
@@ -18,6 +23,7 @@
 #include <string.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "esp_timer.h"
 
 /* Button geometry */
 #define BTN_W      200
@@ -25,6 +31,12 @@
 #define BTN_X      ((DISPLAY_WIDTH - BTN_W) / 2)
 #define BTN_Y1     70
 #define BTN_Y2     140
+#define BATCH_Y    196
+#define BATCH_H    36
+
+#define POLL_MS    400  /* card insert/removal polling */
+
+static int s_batch;     /* batch mode toggle */
 
 static void draw_button(int x, int y, int w, int h, uint16_t bg, const char *label)
 {
@@ -55,6 +67,12 @@ static void do_flash(const char *arch)
 
     if (result == 0) {
         ui_show_done(arch);
+    } else if (result > 0) {
+        char msg[64];
+        snprintf(msg, sizeof(msg), "Verify failed: %d %s\n"
+                 "from the payload.", result,
+                 result == 1 ? "file differs" : "files differ");
+        ui_show_error(msg);
     } else {
         ui_show_error("Flash failed.\n"
                       "Check serial log for details.");
@@ -62,6 +80,80 @@ static void do_flash(const char *arch)
     ui_wait_for_tap();
 }
 
+static void draw_batch_button(void)
+{
+    draw_button(BTN_X, BATCH_Y, BTN_W, BATCH_H,
+                s_batch ? COLOR_GREEN : COLOR_GRAY,
+                s_batch ? "Batch mode: on" : "Batch mode: off");
+}
+
+/* A tap on the batch toggle: flip it. Returns 1 if it was hit. */
+static int check_batch_button(int tx, int ty)
+{
+    if (!hit_test(tx, ty, BTN_X, BATCH_Y, BTN_W, BATCH_H)) return 0;
+    s_batch = !s_batch;
+    flasher_set_batch(s_batch);
+    draw_batch_button();
+    return 1;
+}
+
+static void draw_batch_status(const char *line1, const char *line2)
+{
+    display_clear(COLOR_BLACK);
+    display_string(20, 80, line1, COLOR_WHITE, COLOR_BLACK);
+    if (line2) display_string(20, 100, line2, COLOR_GRAY, COLOR_BLACK);
+    display_string(20, 200, "Tap to stop batch", COLOR_GRAY, COLOR_BLACK);
+}
+
+/* Wait POLL_MS for a tap. Returns 1 if the screen was tapped. */
+static int batch_tapped(void)
+{
+    struct touch_event ev;
+    int64_t until = esp_timer_get_time() + (int64_t)POLL_MS * 1000;
+    for (;;) {
+        int ms = (int)((until - esp_timer_get_time()) / 1000);
+        if (ms <= 0) return 0;
+        if (touch_get_event(&ev, ms) && ev.type == TOUCH_UP) return 1;
+    }
+}
+
+/* Flash every card inserted until a tap */
+static void do_batch(const char *arch)
+{
+    int ok = 0, failed = 0;
+    char line[48], stats[48];
+    for (;;) {
+        snprintf(stats, sizeof(stats), "%d flashed, %d failed", ok, failed);
+        draw_batch_status("Insert the next SD card", stats);
+        while (sdcard_init() != 0)
+            if (batch_tapped()) return;
+
+        int result = flasher_run(arch);
+        sdcard_deinit();
+        if (result == 0) ok++;
+        else failed++;
+
+        snprintf(line, sizeof(line), "Card %d %s: remove it", ok + failed,
+                 result == 0 ? "OK" : "FAILED");
+        snprintf(stats, sizeof(stats), "%d flashed, %d failed", ok, failed);
+        draw_batch_status(line, stats);
+        for (;;) {
+            if (batch_tapped()) return;
+            if (sdcard_init() != 0) break;
+            sdcard_deinit();
+        }
+    }
+}
+
+/* The flash button: one card, or a batch of them */
+static void start_flash(const char *arch)
+{
+    if (s_batch)
+        do_batch(arch);
+    else
+        do_flash(arch);
+}
+
 /* Show arch selection (aarch64 + x86_64 + back) */
 static int show_arch_select(void)
 {
@@ -75,6 +167,7 @@ static int show_arch_select(void)
 
     draw_button(BTN_X, BTN_Y1, BTN_W, BTN_H, COLOR_BLUE, "Flash aarch64");
     draw_button(BTN_X, BTN_Y2, BTN_W, BTN_H, COLOR_BLUE, "Flash x86_64");
+    draw_batch_button();
 
     while (1) {
         int tx, ty;
@@ -82,12 +175,14 @@ static int show_arch_select(void)
 
         if (ui_check_back_button(tx, ty))
             return -1;
+        if (check_batch_button(tx, ty))
+            continue;
         if (hit_test(tx, ty, BTN_X, BTN_Y1, BTN_W, BTN_H)) {
-            do_flash("aarch64");
+            start_flash("aarch64");
             return 0;
         }
         if (hit_test(tx, ty, BTN_X, BTN_Y2, BTN_W, BTN_H)) {
-            do_flash("x86_64");
+            start_flash("x86_64");
             return 0;
         }
     }
@@ -109,6 +204,7 @@ static int show_confirm(void)
     display_string(40, 116, "the button below.", COLOR_GRAY, COLOR_BLACK);
 
     draw_button(BTN_X, BTN_Y2, BTN_W, BTN_H, COLOR_BLUE, "Flash x86_64");
+    draw_batch_button();
 
     while (1) {
         int tx, ty;
@@ -116,8 +212,10 @@ static int show_confirm(void)
 
         if (ui_check_back_button(tx, ty))
             return -1;
+        if (check_batch_button(tx, ty))
+            continue;
         if (hit_test(tx, ty, BTN_X, BTN_Y2, BTN_W, BTN_H)) {
-            do_flash("x86_64");
+            start_flash("x86_64");
             return 0;
         }
     }
@@ -0,0 +1,636 @@
+/*
+ * app_serial.c — USB serial SD writer
+ *
+ * With this app open the CYD is an SD card writer on the end of its USB
+ * cable: esp32/scripts/serial_flash.py streams a disk image over the
+ * CH340 (UART0, switched to CONFIG_SURVIVAL_SERIAL_BAUD for the
+ * session, logging muted) and it goes onto the card from sector 0. An
+ * image is not limited by the payload partition; only by the card.
+ *
+ * Protocol. Both directions send frames, integers little-endian:
+ *
+ *     magic    2   "SF" host to device, "SA" device to host
+ *     type     1
+ *     flags    1   DATA: bit 0 payload is raw deflate, bit 1 all zeros
+ *                  (no payload); replies: a status code
+ *     offset   8   byte offset in the image
+ *     length   4   image bytes the frame stands for
+ *     size     4   payload bytes that follow
+ *     payload      size bytes
+ *     crc      4   CRC-32 of everything before it
+ *
+ * HELLO (image size, image id) opens a session, answered by WELCOME:
+ * the offset to send from, the card size, the largest DATA frame and
+ * the window. A HELLO repeating the last image's size and id resumes
+ * it at the bytes already on the card, so a host that lost the port
+ * just reconnects and carries on. DATA frames go in order, each ACKed
+ * with the next offset expected; a frame that fails its CRC, or comes
+ * after a lost one, gets a NAK with that offset and the host goes back
+ * to it. The host keeps at most a window of unACKed bytes on the wire,
+ * which the UART driver's buffer always has room for, so nothing is
+ * lost while the card is busy. END asks for DONE once every byte is on
+ * the card.
+ *
+ * The receive task (core 1) checks and inflates each DATA frame into a
+ * ring of buffers; this task writes them to the card, in a multi-block
+ * write per frame, between redraws of the status screen. Zero runs are
+ * erased when the card can, written from a zeroed buffer otherwise.
+ */
+
+#include "app_serial.h"
+#include "sdcard.h"
+#include "psram.h"
+#include "display.h"
+#include "touch.h"
+#include "ui.h"
+#include "font.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sdkconfig.h"
+#include "esp_log.h"
+#include "esp_idf_version.h"
+#include "esp_timer.h"
+#include "esp_rom_crc.h"
+#include "miniz.h"
+#include "driver/uart.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+
+static const char *TAG = "serial";
+
+#ifndef CONFIG_SURVIVAL_SERIAL_BAUD
+#define CONFIG_SURVIVAL_SERIAL_BAUD 2000000
+#endif
+#ifndef CONFIG_ESP_CONSOLE_UART_BAUDRATE
+#define CONFIG_ESP_CONSOLE_UART_BAUDRATE 115200
+#endif
+
+#define SERIAL_UART      UART_NUM_0         /* the CYD's USB-serial bridge */
+#define SERIAL_RX_BUF    (32 * 1024)        /* UART driver ring */
+#define SERIAL_WINDOW    (SERIAL_RX_BUF * 3 / 4)
+#define SERIAL_RX_THRESH 64                 /* FIFO bytes before the ISR */
+#define SERIAL_BUFS      4
+#define SERIAL_BUF_SIZE  (16 * 1024)        /* largest DATA frame */
+#define SERIAL_ZERO_MAX  (1024 * 1024)      /* largest zero run */
+#define SERIAL_STACK     4096
+#ifdef CONFIG_FREERTOS_UNICORE
+#define SERIAL_CORE      0
+#else
+#define SERIAL_CORE      1
+#endif
+
+#define RX_POLL_MS       100
+#define RX_FRAME_MS      500                /* gap that abandons a frame */
+#define UI_POLL_MS       50
+#define UI_DRAW_US       500000
+
+/* ---- Frames ---- */
+
+#define FRAME_HDR   20
+#define FRAME_CRC   4
+
+#define FR_HELLO    0x01
+#define FR_DATA     0x02
+#define FR_END      0x03
+#define FR_WELCOME  0x81
+#define FR_ACK      0x82
+#define FR_NAK      0x83
+#define FR_DONE     0x84
+#define FR_ERROR    0x85
+
+#define FL_DEFLATE  0x01
+#define FL_ZERO     0x02
+
+/* Reply status */
+#define ST_OK         0
+#define ST_TOO_BIG    1   /* image larger than the card */
+#define ST_WRITE      2   /* a card write failed: HELLO again to retry */
+#define ST_NO_SESSION 3   /* DATA or END before HELLO */
+#define ST_BAD_FRAME  4   /* frame checks out but makes no sense */
+
+#define WELCOME_SIZE 20
+
+static uint32_t rd32(const uint8_t *p)
+{
+    return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+static uint64_t rd64(const uint8_t *p)
+{
+    return rd32(p) | (uint64_t)rd32(p + 4) << 32;
+}
+
+static void wr32(uint8_t *p, uint32_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+static void wr64(uint8_t *p, uint64_t v)
+{
+    wr32(p, (uint32_t)v);
+    wr32(p + 4, (uint32_t)(v >> 32));
+}
+
+/* ---- Session state ---- */
+
+#define STATE_IDLE     0
+#define STATE_RECV     1
+#define STATE_DONE     2
+#define STATE_FAILED   3
+#define STATE_TOO_BIG  4
+
+struct serial_msg {
+    int buf;                    /* ring buffer, -1 for a zero run */
+    uint64_t offset;
+    uint32_t len;
+};
+
+static uint8_t *s_buf[SERIAL_BUFS];
+static uint8_t *s_zero;             /* SERIAL_BUF_SIZE of zeros */
+static uint8_t *s_frame;            /* the frame being received */
+static tinfl_decompressor *s_decomp;
+static QueueHandle_t s_free;        /* buffer indexes */
+static QueueHandle_t s_full;        /* struct serial_msg */
+static TaskHandle_t s_owner;
+static volatile int s_stop;
+static volatile int s_state;
+static volatile int s_write_failed;
+static volatile uint32_t s_queued;  /* messages sent: receive task only */
+static volatile uint32_t s_written; /* messages done: writer only */
+
+static uint64_t s_card_bytes;
+static uint64_t s_image_size;
+static uint32_t s_image_id;
+static int s_have_session;
+static uint64_t s_next;             /* receive task: next offset expected */
+static uint64_t s_committed;        /* image bytes on the card, in order */
+
+/* ---- Receive task ---- */
+
+static void reply(uint8_t type, uint8_t status, uint64_t offset,
+                  const uint8_t *payload, uint32_t size)
+{
+    uint8_t f[FRAME_HDR + WELCOME_SIZE + FRAME_CRC];
+    f[0] = 'S';
+    f[1] = 'A';
+    f[2] = type;
+    f[3] = status;
+    wr64(f + 4, offset);
+    wr32(f + 12, 0);
+    wr32(f + 16, size);
+    if (size) memcpy(f + FRAME_HDR, payload, size);
+    wr32(f + FRAME_HDR + size, esp_rom_crc32_le(0, f, FRAME_HDR + size));
+    uart_write_bytes(SERIAL_UART, (const char *)f, FRAME_HDR + size + FRAME_CRC);
+}
+
+/* Read exactly n bytes. -1 if the line goes quiet first, or on stop. */
+static int rx_read(uint8_t *p, uint32_t n)
+{
+    int idle_ms = 0;
+    while (n > 0) {
+        int got = uart_read_bytes(SERIAL_UART, p, n, pdMS_TO_TICKS(RX_POLL_MS));
+        if (got < 0) return -1;
+        if (got == 0) {
+            idle_ms += RX_POLL_MS;
+            if (s_stop || idle_ms >= RX_FRAME_MS) return -1;
+            continue;
+        }
+        idle_ms = 0;
+        p += got;
+        n -= (uint32_t)got;
+    }
+    return 0;
+}
+
+/* Receive one frame into s_frame. 1 if it arrived whole and its CRC
+ * matches, 0 if the line is idle (or the bytes were no frame), -1 if a
+ * frame started but was damaged. */
+static int rx_frame(void)
+{
+    uint8_t *h = s_frame;
+    if (uart_read_bytes(SERIAL_UART, h, 1, pdMS_TO_TICKS(RX_POLL_MS)) != 1)
+        return 0;
+    if (h[0] != 'S') return 0;
+    if (rx_read(h + 1, 1) != 0 || h[1] != 'F') return 0;
+    if (rx_read(h + 2, FRAME_HDR - 2) != 0) return -1;
+    uint32_t size = rd32(h + 16);
+    if (size > SERIAL_BUF_SIZE) return -1;
+    if (rx_read(h + FRAME_HDR, size + FRAME_CRC) != 0) return -1;
+    if (esp_rom_crc32_le(0, h, FRAME_HDR + size) != rd32(h + FRAME_HDR + size))
+        return -1;
+    return 1;
+}
+
+/* Wait until the writer has every message sent so far */
+static void rx_drain(void)
+{
+    while (s_written != s_queued && !s_stop)
+        vTaskDelay(1);
+}
+
+static int rx_send(const struct serial_msg *m)
+{
+    s_queued++;
+    while (xQueueSend(s_full, m, pdMS_TO_TICKS(RX_POLL_MS)) != pdTRUE) {
+        if (s_stop) {
+            s_queued--;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void rx_hello(const uint8_t *p, uint32_t size)
+{
+    if (size != 12) {
+        reply(FR_ERROR, ST_BAD_FRAME, 0, NULL, 0);
+        return;
+    }
+    uint64_t image_size = rd64(p);
+    uint32_t id = rd32(p + 8);
+
+    rx_drain();
+    uint8_t w[WELCOME_SIZE];
+    wr64(w, s_card_bytes);
+    wr32(w + 8, SERIAL_BUF_SIZE);
+    wr32(w + 12, SERIAL_WINDOW);
+    wr32(w + 16, SERIAL_ZERO_MAX);
+    if (image_size == 0 || image_size > s_card_bytes) {
+        s_have_session = 0;
+        s_state = STATE_TOO_BIG;
+        reply(FR_WELCOME, ST_TOO_BIG, 0, w, sizeof(w));
+        return;
+    }
+
+    /* Same image: carry on from what is on the card */
+    if (!s_have_session || image_size != s_image_size || id != s_image_id)
+        s_committed = 0;
+    s_have_session = 1;
+    s_image_size = image_size;
+    s_image_id = id;
+    s_write_failed = 0;
+    s_next = s_committed;
+    s_state = STATE_RECV;
+    reply(FR_WELCOME, ST_OK, s_next, w, sizeof(w));
+}
+
+static int inflate_frame(const uint8_t *in, uint32_t in_size, uint8_t *out,
+                         uint32_t len)
+{
+    tinfl_init(s_decomp);
+    size_t in_bytes = in_size;
+    size_t out_bytes = SERIAL_BUF_SIZE;
+    tinfl_status st = tinfl_decompress(s_decomp, in, &in_bytes, out, out,
+                                       &out_bytes,
+                                       TINFL_FLAG_USING_NON_WRAPPING_OUTPUT_BUF);
+    return st == TINFL_STATUS_DONE && out_bytes == len ? 0 : -1;
+}
+
+static void rx_data(uint8_t flags, uint64_t offset, uint32_t len,
+                    const uint8_t *p, uint32_t size)
+{
+    if (!s_have_session) {
+        reply(FR_ERROR, ST_NO_SESSION, 0, NULL, 0);
+        return;
+    }
+    if (s_write_failed) {
+        reply(FR_ERROR, ST_WRITE, s_next, NULL, 0);
+        return;
+    }
+    if (offset < s_next) {              /* resent after a NAK: have it */
+        reply(FR_ACK, ST_OK, s_next, NULL, 0);
+        return;
+    }
+    if (offset > s_next) {              /* one before it was lost */
+        reply(FR_NAK, ST_OK, s_next, NULL, 0);
+        return;
+    }
+
+    /* Whole sectors, but for the image's tail */
+    uint32_t max = (flags & FL_ZERO) ? SERIAL_ZERO_MAX : SERIAL_BUF_SIZE;
+    if (len == 0 || len > max || offset + len > s_image_size ||
+        (len % 512 && offset + len != s_image_size)) {
+        reply(FR_ERROR, ST_BAD_FRAME, s_next, NULL, 0);
+        return;
+    }
+
+    struct serial_msg m = { -1, offset, len };
+    if (!(flags & FL_ZERO)) {
+        while (xQueueReceive(s_free, &m.buf, pdMS_TO_TICKS(RX_POLL_MS)) != pdTRUE)
+            if (s_stop) return;
+        uint8_t *dst = s_buf[m.buf];
+        int bad = (flags & FL_DEFLATE) ? inflate_frame(p, size, dst, len)
+                                       : (size != len ? -1 : 0);
+        if (bad) {
+            xQueueSend(s_free, &m.buf, 0);
+            reply(FR_ERROR, ST_BAD_FRAME, s_next, NULL, 0);
+            return;
+        }
+        if (!(flags & FL_DEFLATE)) memcpy(dst, p, len);
+        if (len % 512) memset(dst + len, 0, 512 - len % 512);
+    }
+    if (rx_send(&m) != 0) return;
+    s_next = offset + len;
+    reply(FR_ACK, ST_OK, s_next, NULL, 0);
+}
+
+static void rx_end(uint64_t offset)
+{
+    if (!s_have_session) {
+        reply(FR_ERROR, ST_NO_SESSION, 0, NULL, 0);
+        return;
+    }
+    if (s_next != s_image_size || offset != s_image_size) {
+        reply(FR_NAK, ST_OK, s_next, NULL, 0);
+        return;
+    }
+    rx_drain();
+    int failed = s_write_failed;
+    s_state = failed ? STATE_FAILED : STATE_DONE;
+    reply(FR_DONE, failed ? ST_WRITE : ST_OK, s_committed, NULL, 0);
+}
+
+static void rx_task(void *arg)
+{
+    (void)arg;
+    while (!s_stop) {
+        int got = rx_frame();
+        if (got == 0) continue;
+        if (got < 0) {
+            if (s_have_session) reply(FR_NAK, ST_OK, s_next, NULL, 0);
+            continue;
+        }
+        const uint8_t *h = s_frame;
+        uint64_t offset = rd64(h + 4);
+        uint32_t len = rd32(h + 12);
+        uint32_t size = rd32(h + 16);
+        switch (h[2]) {
+        case FR_HELLO: rx_hello(h + FRAME_HDR, size); break;
+        case FR_DATA:  rx_data(h[3], offset, len, h + FRAME_HDR, size); break;
+        case FR_END:   rx_end(offset); break;
+        default:       break;
+        }
+    }
+    xTaskNotifyGive(s_owner);
+    vTaskDelete(NULL);
+}
+
+/* ---- Writer ---- */
+
+static int write_zeros(uint32_t lba, uint32_t count)
+{
+    if (sdcard_erase(lba, count) == 0) return 0;
+    while (count > 0) {
+        uint32_t n = count < SERIAL_BUF_SIZE / 512 ? count : SERIAL_BUF_SIZE / 512;
+        if (sdcard_write(lba, n, s_zero) != 0) return -1;
+        lba += n;
+        count -= n;
+    }
+    return 0;
+}
+
+/* Once a write fails the rest are dropped, so s_committed is always
+ * where the card's copy of the image ends */
+static void write_msg(const struct serial_msg *m)
+{
+    if (!s_write_failed) {
+        uint32_t lba = (uint32_t)(m->offset / 512);
+        uint32_t count = (m->len + 511) / 512;
+        int err = m->buf >= 0 ? sdcard_write(lba, count, s_buf[m->buf])
+                              : write_zeros(lba, count);
+        if (err) s_write_failed = 1;
+        else s_committed = m->offset + m->len;
+    }
+    if (m->buf >= 0) xQueueSend(s_free, &m->buf, 0);
+    s_written++;
+}
+
+/* ---- Status screen ---- */
+
+static void draw_status(uint32_t kbps)
+{
+    char line[64];
+    uint64_t done = s_committed, total = s_image_size;
+    int state = s_state;
+    if (state == STATE_RECV && s_write_failed) state = STATE_FAILED;
+
+    static const char *const msgs[] = {
+        "Waiting for serial_flash.py",
+        "Receiving image...",
+        "Done: image written",
+        "SD write failed",
+        "Image larger than card",
+    };
+    static const uint16_t colors[] = {
+        COLOR_GRAY, COLOR_CYAN, COLOR_GREEN, COLOR_RED, COLOR_RED,
+    };
+
+    display_frame_begin();
+    display_clear(COLOR_BLACK);
+    ui_draw_back_button();
+    const char *hdr = "USB Serial SD";
+    display_string((DISPLAY_WIDTH - (int)strlen(hdr) * FONT_WIDTH) / 2, 4, hdr,
+                   COLOR_WHITE, COLOR_BLACK);
+
+    snprintf(line, sizeof(line), "UART0 at %d baud", CONFIG_SURVIVAL_SERIAL_BAUD);
+    display_string(20, 40, line, COLOR_GRAY, COLOR_BLACK);
+    snprintf(line, sizeof(line), "Card: %llu MB",
+             (unsigned long long)(s_card_bytes >> 20));
+    display_string(20, 60, line, COLOR_GRAY, COLOR_BLACK);
+    display_string(20, 100, msgs[state], colors[state], COLOR_BLACK);
+
+    int bar_w = DISPLAY_WIDTH - 40;
+    display_fill_rect(20, 150, bar_w, 24, COLOR_DGRAY);
+    if (total > 0 && done > 0)
+        display_fill_rect(20, 150, (int)(done * (uint64_t)bar_w / total), 24,
+                          COLOR_GREEN);
+    if (total > 0) {
+        snprintf(line, sizeof(line), "%llu / %llu MB, %lu KB/s",
+                 (unsigned long long)(done >> 20),
+                 (unsigned long long)(total >> 20), (unsigned long)kbps);
+        display_string((DISPLAY_WIDTH - (int)strlen(line) * FONT_WIDTH) / 2,
+                       182, line, COLOR_GRAY, COLOR_BLACK);
+    }
+    display_frame_end();
+}
+
+/* ---- UART ---- */
+
+static int serial_open(void)
+{
+    uart_config_t cfg = {
+        .baud_rate = CONFIG_SURVIVAL_SERIAL_BAUD,
+        .data_bits = UART_DATA_8_BITS,
+        .parity = UART_PARITY_DISABLE,
+        .stop_bits = UART_STOP_BITS_1,
+        .flow_ctrl = UART_HW_FLOWCTRL_DISABLE,
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+        .source_clk = UART_SCLK_DEFAULT,
+#else
+        .source_clk = UART_SCLK_APB,
+#endif
+    };
+
+    /* The log shares the port: quiet it, and let what it sent drain */
+    ESP_LOGI(TAG, "Serial writer at %d baud, log muted",
+             CONFIG_SURVIVAL_SERIAL_BAUD);
+    esp_log_level_set("*", ESP_LOG_NONE);
+    vTaskDelay(pdMS_TO_TICKS(20));
+
+    if (uart_driver_install(SERIAL_UART, SERIAL_RX_BUF, 0, 0, NULL, 0) != ESP_OK)
+        return -1;
+    if (uart_param_config(SERIAL_UART, &cfg) != ESP_OK) {
+        uart_driver_delete(SERIAL_UART);
+        return -1;
+    }
+    /* At 2-3 Mbaud the default threshold leaves the ISR a few bytes of
+     * FIFO to react in */
+    uart_set_rx_full_threshold(SERIAL_UART, SERIAL_RX_THRESH);
+    uart_flush_input(SERIAL_UART);
+    return 0;
+}
+
+static void serial_close(void)
+{
+    uart_wait_tx_done(SERIAL_UART, pdMS_TO_TICKS(100));
+    uart_set_baudrate(SERIAL_UART, CONFIG_ESP_CONSOLE_UART_BAUDRATE);
+    uart_driver_delete(SERIAL_UART);
+    esp_log_level_set("*", CONFIG_LOG_DEFAULT_LEVEL);
+}
+
+/* ---- Buffers ---- */
+
+static void buffers_free(void)
+{
+    for (int i = 0; i < SERIAL_BUFS; i++) {
+        free(s_buf[i]);
+        s_buf[i] = NULL;
+    }
+    free(s_zero);
+    free(s_frame);
+    free(s_decomp);
+    s_zero = s_frame = NULL;
+    s_decomp = NULL;
+    if (s_free) vQueueDelete(s_free);
+    if (s_full) vQueueDelete(s_full);
+    s_free = s_full = NULL;
+}
+
+static int buffers_alloc(void)
+{
+    s_free = xQueueCreate(SERIAL_BUFS, sizeof(int));
+    s_full = xQueueCreate(SERIAL_BUFS * 2, sizeof(struct serial_msg));
+    s_zero = psram_alloc_dma(SERIAL_BUF_SIZE);
+    s_frame = psram_alloc(FRAME_HDR + SERIAL_BUF_SIZE + FRAME_CRC);
+    s_decomp = psram_alloc(sizeof(tinfl_decompressor));
+    int ok = s_free && s_full && s_zero && s_frame && s_decomp;
+    for (int i = 0; i < SERIAL_BUFS && ok; i++) {
+        s_buf[i] = psram_alloc_dma(SERIAL_BUF_SIZE);
+        if (!s_buf[i]) ok = 0;
+        else xQueueSend(s_free, &i, 0);
+    }
+    if (!ok) {
+        buffers_free();
+        return -1;
+    }
+    memset(s_zero, 0, SERIAL_BUF_SIZE);
+    return 0;
+}
+
+/* ---- App ---- */
+
+static void serial_session(void)
+{
+    s_stop = 0;
+    s_state = STATE_IDLE;
+    s_write_failed = 0;
+    s_queued = s_written = 0;
+    s_have_session = 0;
+    s_image_size = s_committed = 0;
+    s_owner = xTaskGetCurrentTaskHandle();
+    if (xTaskCreatePinnedToCore(rx_task, "serial_rx", SERIAL_STACK, NULL,
+                                configMAX_PRIORITIES - 2, NULL,
+                                SERIAL_CORE) != pdPASS) {
+        ui_show_error("Could not start the\nserial receiver.");
+        ui_wait_for_tap();
+        return;
+    }
+
+    int64_t last_draw = 0, last_t = esp_timer_get_time();
+    uint64_t last_done = 0;
+    uint32_t kbps = 0;
+    draw_status(0);
+    for (;;) {
+        struct serial_msg m;
+        if (xQueueReceive(s_full, &m, pdMS_TO_TICKS(UI_POLL_MS)) == pdTRUE)
+            write_msg(&m);
+
+        struct touch_event ev;
+        int back = 0;
+        while (touch_get_event(&ev, 0))
+            if (ev.type == TOUCH_UP && ui_check_back_button(ev.x, ev.y))
+                back = 1;
+        if (back) break;
+
+        int64_t now = esp_timer_get_time();
+        if (now - last_draw >= UI_DRAW_US) {
+            uint64_t done = s_committed;
+            kbps = done >= last_done && now > last_t
+                 ? (uint32_t)((done - last_done) * 1000000 / 1024 /
+                              (uint64_t)(now - last_t))
+                 : 0;
+            last_done = done;
+            last_t = now;
+            last_draw = now;
+            draw_status(kbps);
+        }
+    }
+
+    /* Stop the receiver, then hand back what it left queued */
+    s_stop = 1;
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    struct serial_msg m;
+    while (xQueueReceive(s_full, &m, 0) == pdTRUE)
+        if (m.buf >= 0) xQueueSend(s_free, &m.buf, 0);
+}
+
+void app_serial_run(void)
+{
+    if (sdcard_init() != 0) {
+        ui_show_error("No SD card detected.\n"
+                      "Insert a card and try again.");
+        ui_wait_for_tap();
+        return;
+    }
+    s_card_bytes = sdcard_size();
+
+    if (buffers_alloc() != 0) {
+        sdcard_deinit();
+        ESP_LOGE(TAG, "No memory for the serial buffers");
+        ui_show_error("Not enough memory for\nthe serial writer.");
+        ui_wait_for_tap();
+        return;
+    }
+    if (serial_open() != 0) {
+        esp_log_level_set("*", CONFIG_LOG_DEFAULT_LEVEL);
+        buffers_free();
+        sdcard_deinit();
+        ESP_LOGE(TAG, "UART setup failed");
+        ui_show_error("Could not set up\nthe serial port.");
+        ui_wait_for_tap();
+        return;
+    }
+
+    serial_session();
+
+    serial_close();
+    buffers_free();
+    sdcard_deinit();
+    ESP_LOGI(TAG, "Serial writer closed");
+}
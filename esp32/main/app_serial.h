@@ -0,0 +1,12 @@
+/*
+ * app_serial.h — USB serial SD writer app
+ */
+#ifndef APP_SERIAL_H
+#define APP_SERIAL_H
+
+/* Run the serial writer: the CYD takes a disk image streamed by
+ * esp32/scripts/serial_flash.py over its USB-serial port and writes it
+ * to the SD card from sector 0. Returns when Back is tapped. */
+void app_serial_run(void);
+
+#endif /* APP_SERIAL_H */
@@ -2,11 +2,13 @@
  * app_settings.c — Settings app
  *
  * Shows device info and advanced options with a toggle for
- * showing aarch64 in the Flash app.
+ * showing aarch64 in the Flash app, and (CONFIG_SURVIVAL_WIFI_UPDATE)
+ * the Wi-Fi payload update.
  */
 
 #include "app_settings.h"
 #include "settings.h"
+#include "wifi_update.h"
 #include "display.h"
 #include "touch.h"
 #include "ui.h"
@@ -16,6 +18,7 @@
 #include <string.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "sdkconfig.h"
 #include "esp_chip_info.h"
 
 /* Toggle button geometry */
@@ -30,6 +33,12 @@
 #define ADV_W       280
 #define ADV_H       28
 
+/* Wi-Fi Update button */
+#define UPD_X       20
+#define UPD_Y       176
+#define UPD_W       280
+#define UPD_H       28
+
 static void draw_settings_main(void)
 {
     display_clear(COLOR_BLACK);
@@ -59,6 +68,12 @@ static void draw_settings_main(void)
     display_fill_rect(ADV_X, ADV_Y, ADV_W, ADV_H, COLOR_DGRAY);
     display_string(ADV_X + 8, ADV_Y + 6, "Advanced Options", COLOR_WHITE, COLOR_DGRAY);
     display_string(ADV_X + ADV_W - 24, ADV_Y + 6, ">", COLOR_WHITE, COLOR_DGRAY);
+
+#ifdef CONFIG_SURVIVAL_WIFI_UPDATE
+    display_fill_rect(UPD_X, UPD_Y, UPD_W, UPD_H, COLOR_DGRAY);
+    display_string(UPD_X + 8, UPD_Y + 6, "Wi-Fi Update", COLOR_WHITE, COLOR_DGRAY);
+    display_string(UPD_X + UPD_W - 24, UPD_Y + 6, ">", COLOR_WHITE, COLOR_DGRAY);
+#endif
 }
 
 static void draw_checkbox(int x, int y, int w, int h, int checked, const char *label)
@@ -130,5 +145,11 @@ void app_settings_run(void)
             show_advanced();
             draw_settings_main();
         }
+#ifdef CONFIG_SURVIVAL_WIFI_UPDATE
+        if (hit_test(tx, ty, UPD_X, UPD_Y, UPD_W, UPD_H)) {
+            wifi_update_run();
+            draw_settings_main();
+        }
+#endif
     }
 }
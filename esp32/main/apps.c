@@ -14,6 +14,8 @@
 #include "app_flasher.h"
 #include "app_settings.h"
 #include "app_files.h"
+#include "app_serial.h"
+#include "app_bench.h"
 
 #include <string.h>
 
@@ -37,16 +39,16 @@ static void app_placeholder(const char *name)
     }
 }
 
-/* app_files_run declared in app_files.h */
+/* app_files_run, app_serial_run, app_bench_run declared in their headers */
 static void app_notes_run(void)   { app_placeholder("Notes"); }
 static void app_guide_run(void)   { app_placeholder("Guide"); }
-static void app_tools_run(void)   { app_placeholder("Tools"); }
 
 app_t g_apps[APP_COUNT] = {
     { "Flash SD", icon_flash,   COLOR_GREEN,  app_flasher_run  },
     { "Files",    icon_folder,  COLOR_YELLOW, app_files_run    },
     { "Notes",    icon_notes,   COLOR_CYAN,   app_notes_run    },
     { "Guide",    icon_book,    COLOR_WHITE,  app_guide_run    },
-    { "Tools",    icon_wrench,  COLOR_GRAY,   app_tools_run    },
+    { "USB SD",   icon_wrench,  COLOR_CYAN,   app_serial_run   },
+    { "Bench",    icon_gauge,   COLOR_RED,    app_bench_run    },
     { "Settings", icon_gear,    COLOR_GRAY,   app_settings_run },
 };
@@ -0,0 +1,313 @@
+/*
+ * bcache.c — Block cache behind src/bcache.h for the ESP32
+ *
+ * The UEFI cache (src/bcache.c) is sized for megabytes: a hashed entry
+ * table, lazily grown chunks, readahead and sorted flushes. Here the
+ * same API sits on a handful of blocks searched linearly: 8 in internal
+ * RAM, or 64 when the board has PSRAM to put them in. Eviction takes
+ * the least recently used block, writing it first if dirty. Multi-block
+ * reads and writes go straight to the card (overlaying or refreshing
+ * any cached copies), since the SD driver streams them faster than the
+ * cache could hold them.
+ *
+ * Which cache a build gets is decided by which file it compiles; the
+ * exFAT driver is the same source on both targets.
+ */
+
+#include "../../src/bcache.h"
+
+#include "psram.h"
+#include "esp_log.h"
+
+static const char *TAG = "bcache";
+
+#ifndef BCACHE_BLOCKS
+#define BCACHE_BLOCKS        8      /* internal RAM */
+#endif
+#ifndef BCACHE_PSRAM_BLOCKS
+#define BCACHE_PSRAM_BLOCKS  64     /* when PSRAM is present */
+#endif
+#define BCACHE_MAX_BLOCKS    256    /* cap for bcache_set_budget() */
+
+/* ---- Structures ---- */
+
+struct bcache_entry {
+    UINT64 blk;
+    UINT32 stamp;               /* LRU clock, 0 = empty */
+    UINT8  dirty;
+};
+
+struct bcache {
+    bcache_read_fn  read_fn;
+    bcache_write_fn write_fn;
+    void           *ctx;
+
+    UINT32 block_size;          /* bytes per cache block */
+    UINT32 ratio;               /* device blocks per cache block */
+
+    UINT32 nentries;
+    struct bcache_entry *ent;
+    UINT8  *data;               /* nentries * block_size */
+    UINT32 clock;
+    UINT32 ndirty;
+
+    UINT64 hits, misses;
+};
+
+static UINT64 s_budget;         /* 0 = size from the heap */
+
+void bcache_set_budget(UINT64 bytes)
+{
+    s_budget = bytes;
+}
+
+UINT64 bcache_get_budget(void)
+{
+    return s_budget;
+}
+
+/* ---- Internal helpers ---- */
+
+static UINT8 *entry_data(struct bcache *bc, int idx)
+{
+    return bc->data + (UINTN)idx * bc->block_size;
+}
+
+static int lookup(struct bcache *bc, UINT64 blk)
+{
+    for (UINT32 i = 0; i < bc->nentries; i++) {
+        if (bc->ent[i].stamp && bc->ent[i].blk == blk)
+            return (int)i;
+    }
+    return -1;
+}
+
+static int write_entry(struct bcache *bc, int idx)
+{
+    struct bcache_entry *e = &bc->ent[idx];
+    if (bc->write_fn(bc->ctx, e->blk * bc->ratio, bc->ratio,
+                     entry_data(bc, idx)) != 0)
+        return -1;
+    e->dirty = 0;
+    bc->ndirty--;
+    return 0;
+}
+
+/* Free slot, or the least recently used one written back. -1 if that
+   write fails. */
+static int take_slot(struct bcache *bc)
+{
+    int victim = 0;
+    for (UINT32 i = 0; i < bc->nentries; i++) {
+        if (!bc->ent[i].stamp)
+            return (int)i;
+        if (bc->ent[i].stamp < bc->ent[victim].stamp)
+            victim = (int)i;
+    }
+    if (bc->ent[victim].dirty && write_entry(bc, victim) != 0)
+        return -1;
+    bc->ent[victim].stamp = 0;
+    return victim;
+}
+
+/* ---- Create / destroy ---- */
+
+struct bcache *bcache_create(bcache_read_fn read_fn, bcache_write_fn write_fn,
+                             void *ctx, UINT32 block_size,
+                             UINT32 dev_block_size)
+{
+    if (!read_fn || block_size == 0 || dev_block_size == 0)
+        return NULL;
+    if (block_size < dev_block_size || block_size % dev_block_size != 0)
+        return NULL;
+
+    struct bcache *bc = (struct bcache *)calloc(1, sizeof(struct bcache));
+    if (!bc)
+        return NULL;
+    bc->read_fn = read_fn;
+    bc->write_fn = write_fn;
+    bc->ctx = ctx;
+    bc->block_size = block_size;
+    bc->ratio = block_size / dev_block_size;
+
+    UINT32 n = psram_size() ? BCACHE_PSRAM_BLOCKS : BCACHE_BLOCKS;
+    if (s_budget) {
+        UINT64 want = s_budget / block_size;
+        n = want < 4 ? 4 : want > BCACHE_MAX_BLOCKS ? BCACHE_MAX_BLOCKS
+                                                    : (UINT32)want;
+    }
+    bc->data = (UINT8 *)psram_alloc((size_t)n * block_size);
+    bc->ent = (struct bcache_entry *)calloc(n, sizeof(struct bcache_entry));
+    if (!bc->data || !bc->ent) {
+        ESP_LOGE(TAG, "no memory for %lu blocks of %lu",
+                 (unsigned long)n, (unsigned long)block_size);
+        free(bc->data);
+        free(bc->ent);
+        free(bc);
+        return NULL;
+    }
+    bc->nentries = n;
+    ESP_LOGI(TAG, "%lu blocks of %lu bytes", (unsigned long)n,
+             (unsigned long)block_size);
+    return bc;
+}
+
+void bcache_destroy(struct bcache *bc)
+{
+    if (!bc)
+        return;
+    bcache_flush(bc);
+    free(bc->data);
+    free(bc->ent);
+    free(bc);
+}
+
+/* No readahead: the SD driver is given whole runs by the callers */
+void bcache_set_readahead(struct bcache *bc, UINT32 max_blocks)
+{
+    (void)bc;
+    (void)max_blocks;
+}
+
+/* ---- Single blocks ---- */
+
+UINT8 *bcache_get(struct bcache *bc, UINT64 blk)
+{
+    int idx = lookup(bc, blk);
+    if (idx >= 0) {
+        bc->hits++;
+        bc->ent[idx].stamp = ++bc->clock;
+        return entry_data(bc, idx);
+    }
+
+    bc->misses++;
+    idx = take_slot(bc);
+    if (idx < 0)
+        return NULL;
+    if (bc->read_fn(bc->ctx, blk * bc->ratio, bc->ratio,
+                    entry_data(bc, idx)) != 0)
+        return NULL;
+    bc->ent[idx].blk = blk;
+    bc->ent[idx].dirty = 0;
+    bc->ent[idx].stamp = ++bc->clock;
+    return entry_data(bc, idx);
+}
+
+void bcache_mark_dirty(struct bcache *bc, UINT64 blk)
+{
+    int idx = lookup(bc, blk);
+    if (idx < 0 || bc->ent[idx].dirty)
+        return;
+    bc->ent[idx].dirty = 1;
+    bc->ndirty++;
+}
+
+/* ---- Multi-block access ---- */
+
+int bcache_read(struct bcache *bc, UINT64 blk, UINT32 count, void *buf)
+{
+    UINT8 *dst = (UINT8 *)buf;
+    UINT32 bs = bc->block_size;
+
+    if (count == 1) {
+        UINT8 *p = bcache_get(bc, blk);
+        if (!p)
+            return -1;
+        memcpy(dst, p, bs);
+        return 0;
+    }
+
+    /* Straight from the card, then overlay blocks newer in the cache */
+    if (bc->read_fn(bc->ctx, blk * bc->ratio, count * bc->ratio, buf) != 0)
+        return -1;
+    if (bc->ndirty == 0)
+        return 0;
+    for (UINT32 i = 0; i < bc->nentries; i++) {
+        struct bcache_entry *e = &bc->ent[i];
+        if (e->stamp && e->dirty && e->blk >= blk && e->blk - blk < count)
+            memcpy(dst + (UINTN)(e->blk - blk) * bs, entry_data(bc, (int)i),
+                   bs);
+    }
+    return 0;
+}
+
+int bcache_write(struct bcache *bc, UINT64 blk, UINT32 count, const void *buf)
+{
+    const UINT8 *src = (const UINT8 *)buf;
+    UINT32 bs = bc->block_size;
+
+    if (!bc->write_fn)
+        return -1;
+    if (bc->write_fn(bc->ctx, blk * bc->ratio, count * bc->ratio, buf) != 0)
+        return -1;
+
+    /* Keep cached copies in step with what is now on the card */
+    for (UINT32 i = 0; i < bc->nentries; i++) {
+        struct bcache_entry *e = &bc->ent[i];
+        if (!e->stamp || e->blk < blk || e->blk - blk >= count)
+            continue;
+        memcpy(entry_data(bc, (int)i), src + (UINTN)(e->blk - blk) * bs, bs);
+        if (e->dirty) {
+            e->dirty = 0;
+            bc->ndirty--;
+        }
+    }
+    return 0;
+}
+
+/* ---- Flush / invalidate ---- */
+
+int bcache_flush(struct bcache *bc)
+{
+    if (bc->ndirty == 0)
+        return 0;
+    if (!bc->write_fn)
+        return -1;
+
+    /* Lowest block first, so the card sees the writes in order; a
+       block that fails stays dirty */
+    int ret = 0;
+    UINT64 from = 0;
+    for (;;) {
+        int best = -1;
+        for (UINT32 i = 0; i < bc->nentries; i++) {
+            struct bcache_entry *e = &bc->ent[i];
+            if (e->stamp && e->dirty && e->blk >= from &&
+                (best < 0 || e->blk < bc->ent[best].blk))
+                best = (int)i;
+        }
+        if (best < 0)
+            break;
+        from = bc->ent[best].blk + 1;
+        if (write_entry(bc, best) != 0)
+            ret = -1;
+    }
+    return ret;
+}
+
+EFI_STATUS bcache_invalidate(struct bcache *bc, UINT64 blk)
+{
+    int idx = lookup(bc, blk);
+    if (idx < 0)
+        return EFI_SUCCESS;
+    if (bc->ent[idx].dirty && (!bc->write_fn || write_entry(bc, idx) != 0))
+        return EFI_DEVICE_ERROR;    /* kept: the only copy of its data */
+    bc->ent[idx].stamp = 0;
+    return EFI_SUCCESS;
+}
+
+EFI_STATUS bcache_invalidate_all(struct bcache *bc)
+{
+    EFI_STATUS status = bcache_flush(bc) == 0 ? EFI_SUCCESS
+                                              : EFI_DEVICE_ERROR;
+    for (UINT32 i = 0; i < bc->nentries; i++)
+        if (!bc->ent[i].dirty)
+            bc->ent[i].stamp = 0;
+    return status;
+}
+
+void bcache_stats(struct bcache *bc, UINT64 *hits, UINT64 *misses)
+{
+    if (hits) *hits = bc ? bc->hits : 0;
+    if (misses) *misses = bc ? bc->misses : 0;
+}
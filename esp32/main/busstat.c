@@ -0,0 +1,172 @@
+/*
+ * busstat.c — Bus transaction counts and what they would cost
+ *
+ * One slot per (bus, function) pair, found by the function name's
+ * address first (the drivers pass __func__ or a literal) and by its
+ * text otherwise. Times are integers in ns, computed per call from the
+ * bus settings then in force, so a bus whose clock changes midway (SD
+ * dropping to 20 MHz) is costed at the clock each transfer had.
+ */
+
+#include "busstat.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#define BUSSTAT_FNS 32
+
+struct bus {
+    const char *name;
+    uint32_t hz;
+    int lanes;
+    uint32_t txn_ns;
+};
+
+/* Clocks until a driver sets them: the ILI9341 at 40 MHz, SD at the
+ * 20 MHz default on one line, the bit-banged XPT2046 at ~1 MHz. The
+ * fixed costs are rough: esp_lcd's polled command transactions take a
+ * few us each, an SD command ~150 us of card access time. */
+static struct bus s_bus[BUS_COUNT] = {
+    { "lcd",   40000000, 1, 4000 },
+    { "sd",    20000000, 1, 150000 },
+    { "touch", 1000000,  1, 2000 },
+};
+
+struct fn_stat {
+    const char *fn;
+    int bus;
+    uint32_t calls;
+    uint64_t txns, cmd_bytes, data_bytes, ns;
+};
+
+static struct fn_stat s_fns[BUSSTAT_FNS];
+static int s_nfns;
+static uint64_t s_bus_ns[BUS_COUNT];
+
+static uint32_t s_frames;
+static uint64_t s_frame_start, s_frame_ns, s_frame_max;
+
+void busstat_set_clock(int bus, uint32_t hz, int lanes)
+{
+    if (bus < 0 || bus >= BUS_COUNT || hz == 0 || lanes <= 0)
+        return;
+    s_bus[bus].hz = hz;
+    s_bus[bus].lanes = lanes;
+}
+
+static struct fn_stat *fn_slot(int bus, const char *fn)
+{
+    for (int i = 0; i < s_nfns; i++)
+        if (s_fns[i].bus == bus && s_fns[i].fn == fn)
+            return &s_fns[i];
+    for (int i = 0; i < s_nfns; i++)
+        if (s_fns[i].bus == bus && strcmp(s_fns[i].fn, fn) == 0)
+            return &s_fns[i];
+    if (s_nfns == BUSSTAT_FNS)
+        return NULL;
+    struct fn_stat *f = &s_fns[s_nfns++];
+    memset(f, 0, sizeof(*f));
+    f->fn = fn;
+    f->bus = bus;
+    return f;
+}
+
+void busstat_add(int bus, const char *fn, uint32_t txns,
+                 uint32_t cmd_bytes, uint32_t data_bytes)
+{
+    if (bus < 0 || bus >= BUS_COUNT)
+        return;
+    const struct bus *b = &s_bus[bus];
+    uint64_t ns = (uint64_t)txns * b->txn_ns
+                + (uint64_t)cmd_bytes * 8000000000ULL / b->hz
+                + (uint64_t)data_bytes * 8000000000ULL /
+                  ((uint64_t)b->hz * (uint32_t)b->lanes);
+    s_bus_ns[bus] += ns;
+
+    struct fn_stat *f = fn_slot(bus, fn ? fn : "?");
+    if (!f)
+        f = fn_slot(bus, "(other)");
+    if (!f)
+        return;
+    f->calls++;
+    f->txns += txns;
+    f->cmd_bytes += cmd_bytes;
+    f->data_bytes += data_bytes;
+    f->ns += ns;
+}
+
+void busstat_frame_begin(void)
+{
+    s_frame_start = s_bus_ns[BUS_LCD];
+}
+
+void busstat_frame_end(void)
+{
+    uint64_t ns = s_bus_ns[BUS_LCD] - s_frame_start;
+    s_frames++;
+    s_frame_ns += ns;
+    if (ns > s_frame_max)
+        s_frame_max = ns;
+}
+
+uint64_t busstat_ns(void)
+{
+    uint64_t ns = 0;
+    for (int b = 0; b < BUS_COUNT; b++)
+        ns += s_bus_ns[b];
+    return ns;
+}
+
+void busstat_reset(void)
+{
+    s_nfns = 0;
+    memset(s_bus_ns, 0, sizeof(s_bus_ns));
+    s_frames = 0;
+    s_frame_start = s_frame_ns = s_frame_max = 0;
+}
+
+/* ns as milliseconds with two decimals */
+static const char *fmt_ms(char *buf, uint64_t ns)
+{
+    snprintf(buf, 24, "%llu.%02llu", (unsigned long long)(ns / 1000000),
+             (unsigned long long)(ns / 10000 % 100));
+    return buf;
+}
+
+void busstat_report(const char *title)
+{
+    char a[24], b[24];
+    printf("== Bus profile: %s ==\n", title);
+    printf("%-6s %-26s %7s %8s %9s %10s %10s %9s\n", "bus", "function",
+           "calls", "txns", "cmd B", "data B", "est ms", "ms/call");
+
+    /* Most expensive first; the table is small */
+    int order[BUSSTAT_FNS];
+    for (int i = 0; i < s_nfns; i++) {
+        int j = i;
+        while (j > 0 && s_fns[order[j - 1]].ns < s_fns[i].ns) {
+            order[j] = order[j - 1];
+            j--;
+        }
+        order[j] = i;
+    }
+    for (int i = 0; i < s_nfns; i++) {
+        const struct fn_stat *f = &s_fns[order[i]];
+        printf("%-6s %-26s %7lu %8llu %9llu %10llu %10s %9s\n",
+               s_bus[f->bus].name, f->fn, (unsigned long)f->calls,
+               (unsigned long long)f->txns, (unsigned long long)f->cmd_bytes,
+               (unsigned long long)f->data_bytes, fmt_ms(a, f->ns),
+               fmt_ms(b, f->ns / f->calls));
+    }
+
+    for (int i = 0; i < BUS_COUNT; i++) {
+        printf("%-6s %lu kHz x%d: %s ms", s_bus[i].name,
+               (unsigned long)(s_bus[i].hz / 1000), s_bus[i].lanes,
+               fmt_ms(a, s_bus_ns[i]));
+        if (i == BUS_LCD && s_frames)
+            printf(", %lu frames, %s ms/frame (max %s)",
+                   (unsigned long)s_frames, fmt_ms(a, s_frame_ns / s_frames),
+                   fmt_ms(b, s_frame_max));
+        printf("\n");
+    }
+}
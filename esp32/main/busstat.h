@@ -0,0 +1,62 @@
+/*
+ * busstat.h — Bus transaction counts and what they would cost
+ *
+ * With CONFIG_SURVIVAL_BUS_STATS the display, SD and touch drivers note
+ * every transaction they put on their bus: the command bytes around it,
+ * the payload, and the driver function it was for. The time each would
+ * take comes from the bus clock the driver set up, its data lines, and
+ * a fixed cost per transaction for the driver, DMA set-up, and on SD the
+ * card's access time. busstat_report() prints the per-function profile,
+ * the estimated time per display frame and per SD operation.
+ *
+ * busstat.c uses nothing from ESP-IDF, so a host build of the apps can
+ * link it and count the same way from its own display, SD and touch
+ * code. Counters are not locked: a touch sample that races a display
+ * transfer can lose a count.
+ */
+#ifndef BUSSTAT_H
+#define BUSSTAT_H
+
+#include <stdint.h>
+#ifdef ESP_PLATFORM
+#include "sdkconfig.h"
+#endif
+
+enum { BUS_LCD, BUS_SD, BUS_TOUCH, BUS_COUNT };
+
+/* The bus clock in Hz and its data lines; commands always take one */
+void busstat_set_clock(int bus, uint32_t hz, int lanes);
+
+/* txns transactions for fn: cmd_bytes of commands, tokens and CRCs,
+ * data_bytes of payload */
+void busstat_add(int bus, const char *fn, uint32_t txns,
+                 uint32_t cmd_bytes, uint32_t data_bytes);
+
+/* The outermost display frame starts or ends: what the display bus did
+ * in between is one frame's time */
+void busstat_frame_begin(void);
+void busstat_frame_end(void);
+
+/* Estimated time on every bus since the last reset, in ns */
+uint64_t busstat_ns(void);
+
+void busstat_reset(void);
+
+/* Print the profile under title to stdout */
+void busstat_report(const char *title);
+
+#ifdef CONFIG_SURVIVAL_BUS_STATS
+#define BUSSTAT_ADD(bus, fn, txns, cmd, data) \
+    busstat_add((bus), (fn), (txns), (cmd), (data))
+#define BUSSTAT_SET_CLOCK(bus, hz, lanes) \
+    busstat_set_clock((bus), (hz), (lanes))
+#define BUSSTAT_FRAME_BEGIN()   busstat_frame_begin()
+#define BUSSTAT_FRAME_END()     busstat_frame_end()
+#else
+#define BUSSTAT_ADD(bus, fn, txns, cmd, data)   ((void)0)
+#define BUSSTAT_SET_CLOCK(bus, hz, lanes)       ((void)0)
+#define BUSSTAT_FRAME_BEGIN()   ((void)0)
+#define BUSSTAT_FRAME_END()     ((void)0)
+#endif
+
+#endif /* BUSSTAT_H */
@@ -5,10 +5,14 @@
  *   MOSI=13, MISO=12, CLK=14, CS=15, DC=2, Backlight=21
  *
  * Display is 320x240 in landscape mode (MADCTL rotation).
+ *
+ * With CONFIG_SURVIVAL_BUS_STATS every transfer is counted (busstat.h)
+ * under the public drawing call it was for.
  */
 
 #include "display.h"
 #include "font.h"
+#include "busstat.h"
 
 #include <string.h>
 #include "driver/spi_master.h"
@@ -16,7 +20,11 @@
 #include "esp_lcd_panel_io.h"
 #include "esp_lcd_panel_vendor.h"
 #include "esp_lcd_panel_ops.h"
+#include "esp_attr.h"
 #include "esp_log.h"
+#include "esp_rom_crc.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/semphr.h"
 
 static const char *TAG = "display";
 
@@ -30,10 +38,306 @@ static const char *TAG = "display";
 
 #define SPI_CLOCK_HZ  (40 * 1000 * 1000)  /* 40MHz — ILI9341 max */
 
+/* esp_lcd_panel_draw_bitmap(): CASET and RASET with 4 bytes each, then
+ * RAMWR, each its own transaction, before the pixels */
+#define DRAW_TXNS       4
+#define DRAW_CMD_BYTES  11
+
 static esp_lcd_panel_handle_t panel = NULL;
 
-/* Send a filled rectangle of one color to the display */
-static uint16_t line_buf[DISPLAY_WIDTH];  /* one scanline buffer */
+#ifdef CONFIG_SURVIVAL_BUS_STATS
+static const char *s_bus_fn;        /* what the next transfers are for */
+#define BUS_FN(name)    (s_bus_fn = (name))
+#else
+#define BUS_FN(name)    ((void)0)
+#endif
+
+/* ---- Strip buffers ----
+ *
+ * esp_lcd_panel_draw_bitmap() only queues the transfer: the pixels are
+ * read by DMA afterwards. Everything is drawn from one of two strips,
+ * each a full-width band of STRIP_ROWS rows, so one strip can be filled
+ * while the other is on the wire; a strip is reused only once its last
+ * transfer has finished (on_color_trans_done). */
+#define STRIP_ROWS   16                       /* one text row */
+#define STRIP_PIXELS (DISPLAY_WIDTH * STRIP_ROWS)
+
+static uint16_t __attribute__((aligned(4))) s_strip[2][STRIP_PIXELS];
+static uint32_t s_strip_seq[2];     /* transfer count after its last one */
+static int s_strip_cur;
+static uint32_t s_sent;             /* color transfers queued */
+static volatile uint32_t s_done;    /* ... and finished */
+static SemaphoreHandle_t s_done_sem;
+
+static bool IRAM_ATTR color_done(esp_lcd_panel_io_handle_t io,
+                                 esp_lcd_panel_io_event_data_t *edata,
+                                 void *ctx)
+{
+    (void)io;
+    (void)edata;
+    (void)ctx;
+    s_done++;
+    BaseType_t woken = pdFALSE;
+    xSemaphoreGiveFromISR(s_done_sem, &woken);
+    return woken == pdTRUE;
+}
+
+/* The other strip, once the display is done reading it */
+static uint16_t *strip_get(void)
+{
+    s_strip_cur ^= 1;
+    while ((int32_t)(s_done - s_strip_seq[s_strip_cur]) < 0)
+        xSemaphoreTake(s_done_sem, portMAX_DELAY);
+    return s_strip[s_strip_cur];
+}
+
+/* Send w x h pixels of strip idx, starting at pixels */
+static void strip_xfer(int idx, int x, int y, int w, int h,
+                       const uint16_t *pixels)
+{
+    esp_lcd_panel_draw_bitmap(panel, x, y, x + w, y + h, pixels);
+    s_strip_seq[idx] = ++s_sent;
+    BUSSTAT_ADD(BUS_LCD, s_bus_fn, DRAW_TXNS, DRAW_CMD_BYTES,
+                (uint32_t)(w * h) * sizeof(uint16_t));
+}
+
+/* ---- Compositor ----
+ *
+ * Between display_frame_begin() and display_frame_end() drawing calls
+ * are recorded, not sent. The frame is then rasterized one strip-high
+ * band at a time, noting which pixels it covers (a 32-bit word per tile
+ * row, bit n = column n of that tile). A tile the frame covers fully is
+ * hashed and sent only if its hash differs from what was last sent
+ * there; one it covers partly sends just the covered pixels, so what
+ * the frame left alone stays on the panel. Runs of sent tiles are
+ * packed into the other strip and go out as one transfer each.
+ * Anything drawn outside a frame makes the tiles under it unknown. */
+#define TILE_W     32
+#define TILE_H     STRIP_ROWS
+#define TILES_X    (DISPLAY_WIDTH / TILE_W)
+#define TILES_Y    (DISPLAY_HEIGHT / TILE_H)
+#define FRAME_OPS  128
+#define FRAME_TEXT 2048
+
+enum { OP_FILL, OP_TEXT, OP_BITMAP };
+
+struct frame_op {
+    uint8_t kind;
+    int16_t x, y, w, h;
+    uint16_t fg, bg;            /* OP_FILL: fg */
+    const uint8_t *data;        /* text in s_text, or the caller's bitmap */
+};
+
+static struct frame_op s_ops[FRAME_OPS];
+static int s_op_count;
+static char s_text[FRAME_TEXT];
+static int s_text_used;
+static int s_frame_depth;
+static uint32_t s_tile_hash[TILES_Y][TILES_X];
+static uint16_t s_tile_known[TILES_Y];  /* bit per tile: hash is valid */
+
+static void tiles_forget(int x, int y, int w, int h)
+{
+    if (w <= 0 || h <= 0) return;
+    for (int ty = y / TILE_H; ty <= (y + h - 1) / TILE_H && ty < TILES_Y; ty++)
+        for (int tx = x / TILE_W; tx <= (x + w - 1) / TILE_W && tx < TILES_X; tx++)
+            s_tile_known[ty] &= (uint16_t)~(1u << tx);
+}
+
+/* Drawing outside a frame: the current strip, and tiles it hits are
+ * no longer known */
+static void strip_send(int x, int y, int w, int h, const uint16_t *pixels)
+{
+    tiles_forget(x, y, w, h);
+    strip_xfer(s_strip_cur, x, y, w, h, pixels);
+}
+
+#define PIX_BIT(m, x) (((m)[(x) / TILE_W] >> ((x) % TILE_W)) & 1)
+
+static uint32_t bit_span(int from, int to)     /* bits [from, to) of a word */
+{
+    uint32_t hi = to >= 32 ? 0xFFFFFFFFu : (1u << to) - 1;
+    return hi & ~((1u << from) - 1);
+}
+
+/* Draw op's part of the band starting at row y0 into px (stride
+ * DISPLAY_WIDTH), and mark it in cov */
+static void raster_op(const struct frame_op *op, uint16_t *px, int y0,
+                      uint32_t cov[TILE_H][TILES_X])
+{
+    int x0 = op->x < 0 ? 0 : op->x;
+    int x1 = op->x + op->w > DISPLAY_WIDTH ? DISPLAY_WIDTH : op->x + op->w;
+    int r0 = op->y < y0 ? y0 : op->y;
+    int r1 = op->y + op->h;
+    if (r1 > y0 + TILE_H) r1 = y0 + TILE_H;
+    if (r1 > DISPLAY_HEIGHT) r1 = DISPLAY_HEIGHT;
+    if (x0 >= x1 || r0 >= r1) return;
+
+    int row_bytes = (op->w + 7) / 8;
+    for (int r = r0; r < r1; r++) {
+        uint16_t *out = px + (r - y0) * DISPLAY_WIDTH;
+        int sr = r - op->y;     /* row within the op */
+        switch (op->kind) {
+        case OP_FILL:
+            for (int x = x0; x < x1; x++)
+                out[x] = op->fg;
+            break;
+        case OP_TEXT:
+            for (int x = x0; x < x1; x++) {
+                int i = x - op->x;
+                char c = (char)op->data[i / FONT_WIDTH];
+                if (c < FONT_FIRST || c > FONT_LAST) c = ' ';
+                uint8_t bits = font_data[c - FONT_FIRST][sr];
+                out[x] = (bits & (0x80 >> (i % FONT_WIDTH))) ? op->fg : op->bg;
+            }
+            break;
+        case OP_BITMAP: {
+            const uint8_t *src = op->data + sr * row_bytes;
+            for (int x = x0; x < x1; x++) {
+                int col = x - op->x;
+                out[x] = (src[col / 8] & (0x80 >> (col & 7))) ? op->fg : op->bg;
+            }
+            break;
+        }
+        }
+        for (int t = x0 / TILE_W; t <= (x1 - 1) / TILE_W; t++) {
+            int a = x0 - t * TILE_W, b = x1 - t * TILE_W;
+            cov[r - y0][t] |= bit_span(a < 0 ? 0 : a, b > TILE_W ? TILE_W : b);
+        }
+    }
+}
+
+/* Copy rows [r0, r1) x columns [x0, x1) of the band to *pack and send
+ * them from there */
+static void send_packed(const uint16_t *band, int y0, int r0, int r1,
+                        int x0, int x1, uint16_t **pack, int idx)
+{
+    int w = x1 - x0;
+    uint16_t *start = *pack;
+    for (int r = r0; r < r1; r++) {
+        memcpy(*pack, band + r * DISPLAY_WIDTH + x0, (size_t)w * sizeof(uint16_t));
+        *pack += w;
+    }
+    strip_xfer(idx, x0, y0 + r0, w, r1 - r0, start);
+}
+
+static void compose_band(int by)
+{
+    int y0 = by * TILE_H;
+    int any = 0;
+    for (int i = 0; i < s_op_count && !any; i++)
+        any = s_ops[i].y < y0 + TILE_H && s_ops[i].y + s_ops[i].h > y0;
+    if (!any) return;
+
+    uint32_t cov[TILE_H][TILES_X];
+    memset(cov, 0, sizeof(cov));
+    uint16_t *band = strip_get();
+    for (int i = 0; i < s_op_count; i++)
+        raster_op(&s_ops[i], band, y0, cov);
+
+    /* Which tiles go out: changed full ones and every partial one */
+    int full[TILES_X], send[TILES_X], all = 1;
+    for (int t = 0; t < TILES_X; t++) {
+        uint32_t and = 0xFFFFFFFFu, or = 0;
+        for (int r = 0; r < TILE_H; r++) {
+            and &= cov[r][t];
+            or |= cov[r][t];
+        }
+        full[t] = and == 0xFFFFFFFFu;
+        send[t] = or != 0;
+        if (full[t]) {
+            uint32_t h = 0;
+            for (int r = 0; r < TILE_H; r++)
+                h = esp_rom_crc32_le(h, (const uint8_t *)(band + r * DISPLAY_WIDTH + t * TILE_W),
+                                     TILE_W * sizeof(uint16_t));
+            if ((s_tile_known[by] & (1u << t)) && s_tile_hash[by][t] == h)
+                send[t] = 0;
+            s_tile_hash[by][t] = h;
+            s_tile_known[by] |= (uint16_t)(1u << t);
+        } else if (send[t]) {
+            s_tile_known[by] &= (uint16_t)~(1u << t);
+        }
+        all &= full[t] && send[t];
+    }
+
+    if (all) {
+        strip_xfer(s_strip_cur, 0, y0, DISPLAY_WIDTH, TILE_H, band);
+        return;
+    }
+
+    /* Rows whose wanted pixels match go out together, one rectangle per
+     * run of them; a gap the frame covered in all those rows is sent
+     * along (it is unchanged) rather than splitting the run. Each pixel
+     * goes out at most once, so the band's worth of the other strip
+     * holds everything packed. */
+    uint16_t *pack = strip_get();
+    int pack_idx = s_strip_cur;
+    for (int r = 0; r < TILE_H; ) {
+        uint32_t want[TILES_X], keep[TILES_X];
+        for (int t = 0; t < TILES_X; t++)
+            want[t] = send[t] ? cov[r][t] : 0;
+        int r2 = r + 1;
+        for (; r2 < TILE_H; r2++) {
+            int same = 1;
+            for (int t = 0; t < TILES_X && same; t++)
+                same = (send[t] ? cov[r2][t] : 0) == want[t];
+            if (!same) break;
+        }
+        for (int t = 0; t < TILES_X; t++) {
+            keep[t] = 0xFFFFFFFFu;
+            for (int k = r; k < r2; k++)
+                keep[t] &= cov[k][t];
+        }
+
+        for (int x = 0; x < DISPLAY_WIDTH; ) {
+            if (!PIX_BIT(want, x)) { x++; continue; }
+            int x2 = x + 1;
+            for (;;) {
+                while (x2 < DISPLAY_WIDTH && PIX_BIT(want, x2)) x2++;
+                int g = x2;
+                while (g < DISPLAY_WIDTH && !PIX_BIT(want, g) && PIX_BIT(keep, g)) g++;
+                if (g == x2 || g == DISPLAY_WIDTH || !PIX_BIT(want, g)) break;
+                x2 = g;
+            }
+            send_packed(band, y0, r, r2, x, x2, &pack, pack_idx);
+            x = x2;
+        }
+        r = r2;
+    }
+}
+
+/* Send what the frame has recorded so far and start over */
+static void frame_flush(void)
+{
+    BUS_FN("display_frame_end");
+    for (int by = 0; by < TILES_Y; by++)
+        compose_band(by);
+    s_op_count = 0;
+    s_text_used = 0;
+}
+
+/* A slot for one more op (flushing if the frame is full), or NULL
+ * outside a frame */
+static struct frame_op *frame_op(int text_len)
+{
+    if (!s_frame_depth) return NULL;
+    if (s_op_count == FRAME_OPS || s_text_used + text_len > FRAME_TEXT)
+        frame_flush();
+    return &s_ops[s_op_count++];
+}
+
+void display_frame_begin(void)
+{
+    if (s_frame_depth++ == 0)
+        BUSSTAT_FRAME_BEGIN();
+}
+
+void display_frame_end(void)
+{
+    if (s_frame_depth == 0 || --s_frame_depth > 0) return;
+    frame_flush();
+    BUSSTAT_FRAME_END();
+}
 
 void display_init(void)
 {
@@ -54,11 +358,12 @@ void display_init(void)
         .sclk_io_num = PIN_CLK,
         .quadwp_io_num = -1,
         .quadhd_io_num = -1,
-        .max_transfer_sz = DISPLAY_WIDTH * sizeof(uint16_t),
+        .max_transfer_sz = STRIP_PIXELS * sizeof(uint16_t),
     };
     ESP_ERROR_CHECK(spi_bus_initialize(SPI2_HOST, &bus_cfg, SPI_DMA_CH_AUTO));
 
     /* LCD panel IO (SPI) */
+    s_done_sem = xSemaphoreCreateBinary();
     esp_lcd_panel_io_handle_t io = NULL;
     esp_lcd_panel_io_spi_config_t io_cfg = {
         .dc_gpio_num = PIN_DC,
@@ -68,6 +373,7 @@ void display_init(void)
         .lcd_param_bits = 8,
         .spi_mode = 0,
         .trans_queue_depth = 10,
+        .on_color_trans_done = color_done,
     };
     ESP_ERROR_CHECK(esp_lcd_new_panel_io_spi(SPI2_HOST, &io_cfg, &io));
 
@@ -89,6 +395,7 @@ void display_init(void)
 
     /* Display on */
     esp_lcd_panel_disp_on_off(panel, true);
+    BUSSTAT_SET_CLOCK(BUS_LCD, SPI_CLOCK_HZ, 1);
 
     display_clear(COLOR_BLACK);
     ESP_LOGI(TAG, "Display ready: %dx%d", DISPLAY_WIDTH, DISPLAY_HEIGHT);
@@ -107,55 +414,118 @@ void display_fill_rect(int x, int y, int w, int h, uint16_t color)
     if (y + h > DISPLAY_HEIGHT) h = DISPLAY_HEIGHT - y;
     if (w <= 0 || h <= 0) return;
 
-    /* Fill line buffer with color */
-    for (int i = 0; i < w; i++)
-        line_buf[i] = color;
+    struct frame_op *op = frame_op(0);
+    if (op) {
+        *op = (struct frame_op){ OP_FILL, x, y, w, h, color, 0, NULL };
+        return;
+    }
+    BUS_FN(__func__);
+
+    /* One strip of color serves every band: as many rows per transfer
+     * as fit, so a full-screen clear is 15 transfers */
+    int band = STRIP_PIXELS / w;
+    if (band > h) band = h;
+    uint16_t *px = strip_get();
+    for (int i = 0; i < w * band; i++)
+        px[i] = color;
 
-    /* Draw line by line */
-    for (int row = y; row < y + h; row++)
-        esp_lcd_panel_draw_bitmap(panel, x, row, x + w, row + 1, line_buf);
+    for (int row = y; row < y + h; row += band) {
+        int n = y + h - row;
+        if (n > band) n = band;
+        strip_send(x, row, w, n, px);
+    }
 }
 
-void display_char(int x, int y, char c, uint16_t fg, uint16_t bg)
+/* Render glyph c into a strip whose rows are stride pixels apart */
+static void render_char(uint16_t *px, int stride, char c,
+                        uint16_t fg, uint16_t bg)
 {
     if (c < FONT_FIRST || c > FONT_LAST) c = ' ';
     const uint8_t *glyph = font_data[c - FONT_FIRST];
 
-    uint16_t pixels[FONT_WIDTH];
     for (int row = 0; row < FONT_HEIGHT; row++) {
         uint8_t bits = glyph[row];
+        uint16_t *out = px + row * stride;
         for (int col = 0; col < FONT_WIDTH; col++)
-            pixels[col] = (bits & (0x80 >> col)) ? fg : bg;
+            out[col] = (bits & (0x80 >> col)) ? fg : bg;
+    }
+}
 
-        int dy = y + row;
-        if (dy >= 0 && dy < DISPLAY_HEIGHT && x >= 0 && x + FONT_WIDTH <= DISPLAY_WIDTH)
-            esp_lcd_panel_draw_bitmap(panel, x, dy, x + FONT_WIDTH, dy + 1, pixels);
+/* Send a run of glyphs rendered side by side on one text row */
+static void send_text(int x, int y, int n, const uint16_t *px)
+{
+    int w = n * FONT_WIDTH;
+    int top = 0, h = FONT_HEIGHT;
+    if (y < 0) { top = -y; h += y; }
+    if (y + FONT_HEIGHT > DISPLAY_HEIGHT) h = DISPLAY_HEIGHT - y - top;
+    if (h > 0)
+        strip_send(x, y + top, w, h, px + top * w);
+}
+
+/* Draw n glyphs of s side by side on one text row, all on screen
+ * horizontally (runs that are not are skipped, as single glyphs always
+ * were) */
+static void text_run(int x, int y, const char *s, int n, uint16_t fg, uint16_t bg)
+{
+    if (n <= 0 || x < 0 || x + n * FONT_WIDTH > DISPLAY_WIDTH) return;
+    struct frame_op *op = frame_op(n);
+    if (op) {
+        memcpy(s_text + s_text_used, s, (size_t)n);
+        *op = (struct frame_op){ OP_TEXT, x, y, n * FONT_WIDTH, FONT_HEIGHT,
+                                 fg, bg, (const uint8_t *)s_text + s_text_used };
+        s_text_used += n;
+        return;
     }
+    uint16_t *px = strip_get();
+    for (int i = 0; i < n; i++)
+        render_char(px + i * FONT_WIDTH, n * FONT_WIDTH, s[i], fg, bg);
+    send_text(x, y, n, px);
+}
+
+void display_char(int x, int y, char c, uint16_t fg, uint16_t bg)
+{
+    BUS_FN(__func__);
+    text_run(x, y, &c, 1, fg, bg);
 }
 
 void display_draw_bitmap1bpp(int x, int y, int w, int h,
                               const uint8_t *bitmap, uint16_t fg, uint16_t bg)
 {
     int row_bytes = (w + 7) / 8;
-    uint16_t pixels[32];  /* max 32px wide icons */
 
-    for (int row = 0; row < h; row++) {
+    /* Clip left and right once; rows go out in bands of whole strips */
+    int dx = x, pw = w;
+    if (dx < 0) { pw += dx; dx = 0; }
+    if (dx + pw > DISPLAY_WIDTH) pw = DISPLAY_WIDTH - dx;
+    if (pw <= 0) return;
+    int band = STRIP_PIXELS / pw;
+
+    struct frame_op *op = frame_op(0);
+    if (op) {
+        *op = (struct frame_op){ OP_BITMAP, x, y, w, h, fg, bg, bitmap };
+        return;
+    }
+    BUS_FN(__func__);
+
+    for (int row = 0; row < h; ) {
         int dy = y + row;
-        if (dy < 0 || dy >= DISPLAY_HEIGHT) continue;
+        if (dy < 0) { row = -y; continue; }
+        if (dy >= DISPLAY_HEIGHT) break;
+        int n = h - row;
+        if (n > band) n = band;
+        if (dy + n > DISPLAY_HEIGHT) n = DISPLAY_HEIGHT - dy;
 
-        const uint8_t *src = bitmap + row * row_bytes;
-        for (int col = 0; col < w; col++) {
-            int bit = src[col / 8] & (0x80 >> (col & 7));
-            pixels[col] = bit ? fg : bg;
+        uint16_t *px = strip_get();
+        for (int r = 0; r < n; r++) {
+            const uint8_t *src = bitmap + (row + r) * row_bytes;
+            uint16_t *out = px + r * pw;
+            for (int col = dx - x; col < dx - x + pw; col++) {
+                int bit = src[col / 8] & (0x80 >> (col & 7));
+                *out++ = bit ? fg : bg;
+            }
         }
-
-        int dx = x;
-        int pw = w;
-        if (dx < 0) { /* clip left */ pw += dx; dx = 0; }
-        if (dx + pw > DISPLAY_WIDTH) pw = DISPLAY_WIDTH - dx;
-        if (pw > 0)
-            esp_lcd_panel_draw_bitmap(panel, dx, dy, dx + pw, dy + 1,
-                                      pixels + (dx - x));
+        strip_send(dx, dy, pw, n, px);
+        row += n;
     }
 }
 
@@ -166,11 +536,19 @@ void display_draw_rgb565_line(int x, int y, int w, const uint16_t *pixels)
     if (x + w > DISPLAY_WIDTH) w = DISPLAY_WIDTH - x;
     if (w <= 0) return;
 
-    esp_lcd_panel_draw_bitmap(panel, x, y, x + w, y + 1, pixels);
+    /* Not recorded: what a frame has so far goes out first */
+    if (s_frame_depth) frame_flush();
+
+    /* Copied: the caller may reuse its line before the DMA reads it */
+    BUS_FN(__func__);
+    uint16_t *px = strip_get();
+    memcpy(px, pixels, (size_t)w * sizeof(uint16_t));
+    strip_send(x, y, w, 1, px);
 }
 
 void display_string(int x, int y, const char *s, uint16_t fg, uint16_t bg)
 {
+    BUS_FN(__func__);
     int cx = x, cy = y;
     while (*s) {
         if (*s == '\n') {
@@ -184,9 +562,18 @@ void display_string(int x, int y, const char *s, uint16_t fg, uint16_t bg)
             cy += FONT_HEIGHT;
         }
         if (cy + FONT_HEIGHT > DISPLAY_HEIGHT) break;
+        if (cx < 0) {               /* off the left edge: not drawn */
+            cx += FONT_WIDTH;
+            s++;
+            continue;
+        }
 
-        display_char(cx, cy, *s, fg, bg);
-        cx += FONT_WIDTH;
-        s++;
+        /* The glyphs up to the edge or a newline go out as one transfer */
+        int n = 0;
+        while (s[n] && s[n] != '\n' && cx + (n + 1) * FONT_WIDTH <= DISPLAY_WIDTH)
+            n++;
+        text_run(cx, cy, s, n, fg, bg);
+        cx += n * FONT_WIDTH;
+        s += n;
     }
 }
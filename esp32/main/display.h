@@ -33,6 +33,15 @@ void display_draw_bitmap1bpp(int x, int y, int w, int h,
  * pixels[] must contain at least w entries. */
 void display_draw_rgb565_line(int x, int y, int w, const uint16_t *pixels);
 
+/* Compose the drawing calls up to display_frame_end() into one update:
+ * the screen goes out in 32x16 tiles, and a tile the frame covers is
+ * sent only if its pixels changed since the compositor last sent it.
+ * Pixels the frame does not draw are left as they are. Frames nest
+ * (the outermost end sends). A bitmap drawn in a frame must stay valid
+ * until it ends. */
+void display_frame_begin(void);
+void display_frame_end(void);
+
 /* RGB888 to RGB565 conversion. */
 static inline uint16_t display_rgb(uint8_t r, uint8_t g, uint8_t b)
 {
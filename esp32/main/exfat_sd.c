@@ -0,0 +1,31 @@
+/*
+ * exfat_sd.c — Mount the exFAT driver (src/exfat.c) on the SD card
+ */
+
+#include "exfat.h"
+#include "sdcard.h"
+
+static struct {
+    uint32_t partition_start_lba;
+} s_exfat_ctx;
+
+static int exfat_sd_read(void *ctx, uint64_t lba, uint32_t count, void *buf)
+{
+    (void)ctx;
+    return sdcard_read((uint32_t)(s_exfat_ctx.partition_start_lba + lba),
+                       count, buf);
+}
+
+static int exfat_sd_write(void *ctx, uint64_t lba, uint32_t count,
+                          const void *buf)
+{
+    (void)ctx;
+    return sdcard_write((uint32_t)(s_exfat_ctx.partition_start_lba + lba),
+                        count, buf);
+}
+
+struct exfat_vol *exfat_mount_sdcard(uint32_t partition_start_lba)
+{
+    s_exfat_ctx.partition_start_lba = partition_start_lba;
+    return exfat_mount(exfat_sd_read, exfat_sd_write, &s_exfat_ctx, 512);
+}
@@ -8,6 +8,7 @@
  *   - disk_read_blocks/disk_write_blocks → sdcard_read/sdcard_write
  *   - All LBAs offset by part_start (GPT partition, not superfloppy)
  *   - Added streaming write for decompressing large files chunk by chunk
+ *   - The data region is aligned to the AU the card reports, not 4 MB
  */
 
 #include "fat32.h"
@@ -20,7 +21,8 @@ static const char *TAG = "fat32";
 
 /* FAT32 constants */
 #define SECTOR_SIZE       512
-#define RESERVED_SECTORS  32
+#define RESERVED_SECTORS  32       /* minimum; padded to align the data */
+#define MAX_ALIGN_SECTORS 32768    /* padding must fit the 16-bit count */
 #define NUM_FATS          2
 #define FAT32_EOC        0x0FFFFFF8
 #define FAT32_FREE       0x00000000
@@ -106,16 +108,40 @@ static struct {
     uint32_t spc;
 } s_fs;
 
+/* Sectors a stream buffers before writing them with one multi-block
+ * command. Every single-sector write over SDSPI is a full CMD24 with its
+ * own busy wait; a window of them goes out as one CMD25. */
+/* Directories a write session keeps indexed at once, and the names of
+ * each it can hold; ~6KB together */
+#ifndef FAT32_DIR_INDEX
+#define FAT32_DIR_INDEX       4
+#endif
+#ifndef FAT32_DIR_INDEX_NAMES
+#define FAT32_DIR_INDEX_NAMES 128
+#endif
+
+#ifndef FAT32_STREAM_WINDOW
+#define FAT32_STREAM_WINDOW 64  /* 32KB */
+#endif
+
 /* Shared sector buffers — static for DMA compatibility with SD SPI.
- * s_buf: used by fat_set/fat_get/format (low-level FAT operations)
+ * s_buf: used by format, read_init and volume_info (fat_get/fat_set go
+ *   through their own FAT window, s_fat_win)
  * s_dir: used by directory operations (find_in_dir, add_dir_entry, ensure_dir)
- * s_zero: 8-sector zero buffer for bulk zeroing (FAT tables, clusters)
+ * s_readdir_buf: the sector a directory scan is on, kept across calls so
+ *   a run of entries costs one read per sector
+ * s_stream_buf: a write stream's window, the reader's sector buffer, and
+ *   the zeros for bulk zeroing when no stream or image is open
  * Two working buffers needed because dir ops call fat_get/fat_set internally. */
 static uint8_t __attribute__((aligned(4))) s_buf[SECTOR_SIZE];
 static uint8_t __attribute__((aligned(4))) s_dir[SECTOR_SIZE];
+static uint8_t __attribute__((aligned(4))) s_readdir_buf[SECTOR_SIZE];
+static uint8_t __attribute__((aligned(4)))
+    s_stream_buf[SECTOR_SIZE * FAT32_STREAM_WINDOW];
 
-#define ZERO_BATCH 128  /* sectors per bulk zero write (64KB) */
-static uint8_t __attribute__((aligned(4))) s_zero[SECTOR_SIZE * ZERO_BATCH]; /* BSS = already zero */
+#define ZERO_BATCH  FAT32_STREAM_WINDOW  /* sectors per bulk zero write */
+#define ERASE_MIN   2048   /* shorter ranges are written (1MB) */
+#define ERASE_BATCH 65536  /* sectors per erase command (32MB) */
 
 /* Sector I/O — all LBAs are absolute (partition offset already added) */
 static int write_sector(uint32_t lba, const void *buf)
@@ -128,15 +154,33 @@ static int read_sector(uint32_t lba, void *buf)
     return sdcard_read(lba, 1, buf);
 }
 
-/* Zero a range of sectors efficiently using batch writes.
+/* Zero a range of sectors with the card's erase command (sdcard_erase()
+ * refuses cards whose erased state is not zero), falling back to batch
+ * writes once it fails. Ranges too short to be worth an erase are always
+ * written, from s_stream_buf: every caller runs with no stream open.
  * If progress is non-NULL, calls it with cumulative sectors zeroed vs total_for_progress. */
 static int zero_sectors_ex(uint32_t lba, uint32_t count,
                            fat32_progress_cb progress, int *done, int total_for_progress)
 {
+    int erase = (count >= ERASE_MIN);
+    int zeroed = 0;
     while (count > 0) {
-        uint32_t batch = (count > ZERO_BATCH) ? ZERO_BATCH : count;
-        if (sdcard_write(lba, batch, s_zero) != 0)
-            return -1;
+        uint32_t batch;
+        if (erase) {
+            batch = (count > ERASE_BATCH) ? ERASE_BATCH : count;
+            if (sdcard_erase(lba, batch) != 0) {
+                erase = 0;
+                continue;
+            }
+        } else {
+            batch = (count > ZERO_BATCH) ? ZERO_BATCH : count;
+            if (!zeroed) {
+                memset(s_stream_buf, 0, sizeof(s_stream_buf));
+                zeroed = 1;
+            }
+            if (sdcard_write(lba, batch, s_stream_buf) != 0)
+                return -1;
+        }
         lba += batch;
         count -= batch;
         if (progress && done) {
@@ -154,23 +198,63 @@ static int zero_sectors(uint32_t lba, uint32_t count)
 
 /* ---- FAT table operations ---- */
 
+/* FAT sectors fetched with one multi-block read and kept: a chain walk
+ * or a run of fat_set calls stays in one window for 1024 clusters. */
+#ifndef FAT32_FAT_WINDOW
+#define FAT32_FAT_WINDOW 8  /* 4KB */
+#endif
+
+static uint8_t __attribute__((aligned(4)))
+    s_fat_win[SECTOR_SIZE * FAT32_FAT_WINDOW];
+static uint32_t s_fat_win_first;  /* FAT sector at s_fat_win */
+static uint32_t s_fat_win_count;  /* sectors held; 0 = empty */
+
+/* Forget the window: whatever writes FAT sectors other than fat_set
+ * (format, a pre-built image) or points s_fs at a new volume calls this */
+static void fat_cache_drop(void)
+{
+    s_fat_win_count = 0;
+}
+
+/* The window sector holding fat_sector, read in if needed; NULL on error */
+static uint8_t *fat_cache_sector(uint32_t fat_sector)
+{
+    if (fat_sector >= s_fs.fat_sectors)
+        return NULL;
+    if (s_fat_win_count == 0 || fat_sector < s_fat_win_first ||
+        fat_sector >= s_fat_win_first + s_fat_win_count) {
+        uint32_t first = fat_sector - fat_sector % FAT32_FAT_WINDOW;
+        uint32_t count = s_fs.fat_sectors - first;
+        if (count > FAT32_FAT_WINDOW) count = FAT32_FAT_WINDOW;
+        s_fat_win_count = 0;
+        if (sdcard_read(s_fs.fat_start + first, count, s_fat_win) != 0)
+            return NULL;
+        s_fat_win_first = first;
+        s_fat_win_count = count;
+    }
+    return s_fat_win + (fat_sector - s_fat_win_first) * SECTOR_SIZE;
+}
+
 static int fat_set(uint32_t cluster, uint32_t value)
 {
     uint32_t fat_offset = cluster * 4;
     uint32_t fat_sector = fat_offset / SECTOR_SIZE;
     uint32_t fat_entry_offset = fat_offset % SECTOR_SIZE;
 
-    if (read_sector(s_fs.fat_start + fat_sector, s_buf) < 0)
+    uint8_t *sec = fat_cache_sector(fat_sector);
+    if (!sec)
         return -1;
 
-    uint32_t *entry = (uint32_t *)(s_buf + fat_entry_offset);
+    uint32_t *entry = (uint32_t *)(sec + fat_entry_offset);
     *entry = (*entry & 0xF0000000) | (value & 0x0FFFFFFF);
 
-    /* Write to both FAT copies */
-    if (write_sector(s_fs.fat_start + fat_sector, s_buf) < 0)
-        return -1;
-    if (write_sector(s_fs.fat_start + s_fs.fat_sectors + fat_sector, s_buf) < 0)
+    /* Write to both FAT copies; on failure the cached copy can no
+     * longer be trusted to match the card */
+    if (write_sector(s_fs.fat_start + fat_sector, sec) < 0 ||
+        write_sector(s_fs.fat_start + s_fs.fat_sectors + fat_sector, sec) < 0) {
+        fat_cache_drop();
         return -1;
+    }
     return 0;
 }
 
@@ -180,16 +264,54 @@ static uint32_t fat_get(uint32_t cluster)
     uint32_t fat_sector = fat_offset / SECTOR_SIZE;
     uint32_t fat_entry_offset = fat_offset % SECTOR_SIZE;
 
-    if (read_sector(s_fs.fat_start + fat_sector, s_buf) < 0)
+    uint8_t *sec = fat_cache_sector(fat_sector);
+    if (!sec)
         return FAT32_EOC;
 
-    uint32_t *entry = (uint32_t *)(s_buf + fat_entry_offset);
+    uint32_t *entry = (uint32_t *)(sec + fat_entry_offset);
     return *entry & 0x0FFFFFFF;
 }
 
+/* A write session indexes the directories it touches: a hash of each
+ * name with the slot (entry number in the directory) its entry set
+ * starts at, and the slot of the end marker. A lookup then reads only
+ * the sectors of the entries whose hash matches, and an append goes
+ * straight to the end. Volumes opened for reading are not indexed. */
+struct dir_index_name {
+    uint32_t lfn_hash;          /* 0 if the entry has no long name */
+    uint32_t sfn_hash;
+    uint32_t slot;
+};
+
+static struct dir_index {
+    uint32_t cluster;           /* first cluster, 0 if unused */
+    uint32_t end;               /* slot of the end marker */
+    uint32_t used;              /* s_dir_index_clock when last used */
+    int count;
+    int full;                   /* names were left out: misses must scan */
+    struct dir_index_name names[FAT32_DIR_INDEX_NAMES];
+} s_dir_index[FAT32_DIR_INDEX];
+
+static int s_dir_index_on;
+static uint32_t s_dir_index_clock;
+
+/* Forget every index; on starts indexing the volume from here on */
+static void dir_index_drop(int on)
+{
+    for (int i = 0; i < FAT32_DIR_INDEX; i++) {
+        s_dir_index[i].cluster = 0;
+        s_dir_index[i].used = 0;
+    }
+    s_dir_index_on = on;
+}
+
+/* Clusters from next_free_cluster on are free on a volume this made;
+ * on one it is appending to, the ones in use are stepped over */
 static uint32_t alloc_cluster(uint32_t prev)
 {
     uint32_t cl = s_fs.next_free_cluster;
+    while (cl < s_fs.total_clusters + 2 && fat_get(cl) != FAT32_FREE)
+        cl++;
     if (cl >= s_fs.total_clusters + 2)
         return 0;
 
@@ -208,42 +330,67 @@ static uint64_t cluster_to_lba(uint32_t cluster)
 
 /* ---- Format ---- */
 
+/* Reserved sectors for spc-sized clusters on the partition at start:
+ * RESERVED_SECTORS, plus what puts the data region on an au boundary of
+ * the card. Stores the FAT size (sized as if the whole partition were
+ * clusters). */
+static uint32_t aligned_layout(uint32_t start, uint32_t sectors, uint32_t spc,
+                               uint32_t au, uint32_t *fat_sectors)
+{
+    uint32_t ncl = (sectors - RESERVED_SECTORS) / spc;
+    uint32_t fat_sec = (ncl * 4 + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    uint32_t data = start + RESERVED_SECTORS + fat_sec * NUM_FATS;
+    *fat_sectors = fat_sec;
+    return RESERVED_SECTORS + (au - data % au) % au;
+}
+
 int fat32_format(uint32_t partition_start_lba, uint32_t partition_sectors,
                  fat32_progress_cb progress)
 {
     s_fs.part_start = partition_start_lba;
+    fat_cache_drop();
+    dir_index_drop(1);
 
     if (partition_sectors <= RESERVED_SECTORS + 100)
         return -1;
 
-    /* Choose sectors_per_cluster */
-    uint32_t spc = 8;
-    while (spc > 1) {
-        uint32_t est = partition_sectors - RESERVED_SECTORS;
-        uint32_t ncl = est / spc;
-        uint32_t fat_sec = (ncl * 4 + SECTOR_SIZE - 1) / SECTOR_SIZE;
-        uint32_t data_sec = partition_sectors - RESERVED_SECTORS - fat_sec * NUM_FATS;
-        ncl = data_sec / spc;
-        if (ncl >= MIN_FAT32_CLUSTERS) break;
+    /* Align the data region (cluster 2) to the card's allocation unit,
+     * as the SD Association's formatter does: a cluster then never
+     * straddles two AUs, which costs cheap cards half their write speed.
+     * A small partition aligns to less, so the padding stays under 1/32. */
+    uint32_t au = sdcard_au_sectors();
+    while (au > MAX_ALIGN_SECTORS)
+        au /= 2;
+    while (au > 8 && partition_sectors / 32 < au)
+        au /= 2;
+
+    /* 4 KB clusters, which the payload's image is laid out for (the
+     * flasher writes contiguous runs, so larger ones would not write
+     * faster), halved while FAT32 needs more clusters */
+    uint32_t spc = 8, reserved, fat_sec;
+    for (;;) {
+        reserved = aligned_layout(partition_start_lba, partition_sectors,
+                                  spc, au, &fat_sec);
+        uint32_t ncl = (partition_sectors - reserved - fat_sec * NUM_FATS) / spc;
+        if (ncl >= MIN_FAT32_CLUSTERS || spc == 1) break;
         spc /= 2;
     }
     s_fs.spc = spc;
-
-    uint32_t est_data = partition_sectors - RESERVED_SECTORS;
-    uint32_t est_clusters = est_data / spc;
-    s_fs.fat_sectors = (est_clusters * 4 + SECTOR_SIZE - 1) / SECTOR_SIZE;
-
-    s_fs.fat_start = s_fs.part_start + RESERVED_SECTORS;
+    s_fs.fat_sectors = fat_sec;
+    s_fs.fat_start = s_fs.part_start + reserved;
     s_fs.data_start = s_fs.fat_start + s_fs.fat_sectors * NUM_FATS;
-    s_fs.total_clusters = (partition_sectors - RESERVED_SECTORS - s_fs.fat_sectors * NUM_FATS)
+    s_fs.total_clusters = (partition_start_lba + partition_sectors - s_fs.data_start)
                           / spc;
     s_fs.next_free_cluster = 3;
 
-    ESP_LOGI(TAG, "Formatting: %lu sectors, spc=%lu, clusters=%lu",
+    ESP_LOGI(TAG, "Formatting: %lu sectors, spc=%lu, clusters=%lu, "
+             "data at LBA %lu (AU %lu KB)",
              (unsigned long)partition_sectors, (unsigned long)spc,
-             (unsigned long)s_fs.total_clusters);
+             (unsigned long)s_fs.total_clusters,
+             (unsigned long)s_fs.data_start, (unsigned long)(au / 2));
 
-    /* Zero reserved sectors */
+    /* Zero the boot, FSInfo and backup sectors; the alignment padding
+     * after them is never read */
     if (zero_sectors(s_fs.part_start, RESERVED_SECTORS) < 0)
         return -1;
 
@@ -254,7 +401,7 @@ int fat32_format(uint32_t partition_start_lba, uint32_t partition_sectors,
     memcpy(bpb->oem, "SURVIVAL", 8);
     bpb->bytes_per_sector = SECTOR_SIZE;
     bpb->sectors_per_cluster = (uint8_t)spc;
-    bpb->reserved_sectors = RESERVED_SECTORS;
+    bpb->reserved_sectors = (uint16_t)reserved;
     bpb->num_fats = NUM_FATS;
     bpb->media_type = 0xF8;
     bpb->sectors_per_track = 63;
@@ -293,22 +440,27 @@ int fat32_format(uint32_t partition_start_lba, uint32_t partition_sectors,
 
     /* Zero both FAT copies completely. Garbage in unzeroed FAT sectors
      * (from previous card contents) appears as corrupted cluster entries,
-     * causing fsck.fat to reject the filesystem on Linux. */
+     * causing fsck.fat to reject the filesystem on Linux. The copies are
+     * adjacent, so on a card that erases to zero this is a few erase
+     * commands however large the FAT. */
     int fat_total = (int)(s_fs.fat_sectors * NUM_FATS);
     int fat_done = 0;
     ESP_LOGI(TAG, "Zeroing FATs: %lu sectors per copy",
              (unsigned long)s_fs.fat_sectors);
-    if (zero_sectors_ex(s_fs.fat_start, s_fs.fat_sectors,
-                        progress, &fat_done, fat_total) < 0)
-        return -1;
-    if (zero_sectors_ex(s_fs.fat_start + s_fs.fat_sectors, s_fs.fat_sectors,
+    if (zero_sectors_ex(s_fs.fat_start, s_fs.fat_sectors * NUM_FATS,
                         progress, &fat_done, fat_total) < 0)
         return -1;
 
-    /* Set initial FAT entries */
-    fat_set(0, 0x0FFFFFF8);
-    fat_set(1, 0x0FFFFFFF);
-    fat_set(2, FAT32_EOC);
+    /* Set initial FAT entries; the FATs were just zeroed, so the first
+     * sector of each is written whole rather than read back */
+    memset(s_buf, 0, SECTOR_SIZE);
+    uint32_t *fat = (uint32_t *)s_buf;
+    fat[0] = 0x0FFFFFF8;
+    fat[1] = 0x0FFFFFFF;
+    fat[2] = FAT32_EOC;
+    if (write_sector(s_fs.fat_start, s_buf) < 0 ||
+        write_sector(s_fs.fat_start + s_fs.fat_sectors, s_buf) < 0)
+        return -1;
 
     /* Zero root directory cluster */
     uint64_t root_lba = cluster_to_lba(2);
@@ -516,26 +668,86 @@ static void extract_lfn_chars(const uint8_t *e, uint16_t *uname, int seq)
         uname[base + 11 + j] = (uint16_t)(e[28 + j * 2] | (e[28 + j * 2 + 1] << 8));
 }
 
-static uint32_t find_in_dir(uint32_t dir_cluster, const char *name, int *entry_idx)
+static uint32_t hash_step(uint32_t h, uint32_t c)
+{
+    return (h ^ c) * 16777619u;
+}
+
+static uint32_t sfn_hash(const uint8_t *short_name)
+{
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < 11; i++)
+        h = hash_step(h, short_name[i]);
+    return h;
+}
+
+/* Hash of a long name as find_in_dir() compares it; never 0 */
+static uint32_t lfn_hash(const uint16_t *uname)
+{
+    uint32_t h = 2166136261u;
+    for (int k = 0; k < 260 && uname[k] != 0 && uname[k] != 0xFFFF; k++)
+        h = hash_step(h, uname[k]);
+    return h ? h : 1;
+}
+
+static void dir_index_add(struct dir_index *ix, uint32_t slot,
+                          uint32_t lfn_h, const uint8_t *short_name)
+{
+    if (ix->count == FAT32_DIR_INDEX_NAMES) {
+        ix->full = 1;
+        return;
+    }
+    struct dir_index_name *dn = &ix->names[ix->count++];
+    dn->lfn_hash = lfn_h;
+    dn->sfn_hash = sfn_hash(short_name);
+    dn->slot = slot;
+}
+
+/* Scan dir_cluster from entry slot on, through at most max entries that
+ * are not LFN or free. With name, returns the first cluster of the first
+ * match (and its slot in *entry_idx, with its sector left in s_dir);
+ * with ix, adds every entry to it and records the end. Returns 0 if
+ * nothing matched. */
+static uint32_t scan_dir(uint32_t dir_cluster, uint32_t slot, uint32_t max,
+                         const char *name, int *entry_idx,
+                         struct dir_index *ix)
 {
     uint8_t target[11];
-    name_to_83(name, target);
-    int use_lfn = needs_lfn(name);
+    int use_lfn = 0;
+    if (name) {
+        name_to_83(name, target);
+        use_lfn = needs_lfn(name);
+    }
 
     /* For LFN matching: accumulate name across LFN entries */
     uint16_t lfn_buf[260];
     int lfn_active = 0;
+    uint32_t lfn_start = 0;
 
+    int count = SECTOR_SIZE / (int)sizeof(struct fat32_dir_entry);
+    uint32_t per_cluster = s_fs.spc * (uint32_t)count;
     uint32_t cluster = dir_cluster;
+    for (uint32_t skip = slot / per_cluster; skip > 0; skip--) {
+        cluster = fat_get(cluster);
+        if (cluster < 2 || cluster >= FAT32_EOC)
+            return 0;
+    }
+    uint32_t base = slot - slot % per_cluster;
+    uint32_t first_sec = (slot % per_cluster) / (uint32_t)count;
+    int first_i = (int)(slot % (uint32_t)count);
+
     while (cluster >= 2 && cluster < FAT32_EOC) {
         uint64_t lba = cluster_to_lba(cluster);
-        for (uint32_t sec = 0; sec < s_fs.spc; sec++) {
+        for (uint32_t sec = first_sec; sec < s_fs.spc; sec++) {
             if (read_sector((uint32_t)(lba + sec), s_dir) < 0)
                 return 0;
             struct fat32_dir_entry *entries = (struct fat32_dir_entry *)s_dir;
-            int count = SECTOR_SIZE / (int)sizeof(struct fat32_dir_entry);
-            for (int i = 0; i < count; i++) {
-                if (entries[i].name[0] == 0x00) return 0;
+            for (int i = first_i; i < count; i++) {
+                uint32_t here = base + sec * (uint32_t)count + (uint32_t)i;
+                if (entries[i].name[0] == 0x00) {
+                    if (ix) ix->end = here;
+                    return 0;
+                }
                 if (entries[i].name[0] == 0xE5) { lfn_active = 0; continue; }
 
                 if (entries[i].attr == ATTR_LONG_NAME) {
@@ -544,6 +756,7 @@ static uint32_t find_in_dir(uint32_t dir_cluster, const char *name, int *entry_i
                     if (e[0] & 0x40) { /* first (last in order) LFN entry */
                         memset(lfn_buf, 0xFF, sizeof(lfn_buf));
                         lfn_active = 1;
+                        lfn_start = here;
                     }
                     if (lfn_active && seq >= 1 && seq <= 20)
                         extract_lfn_chars(e, lfn_buf, seq);
@@ -552,28 +765,175 @@ static uint32_t find_in_dir(uint32_t dir_cluster, const char *name, int *entry_i
 
                 if (entries[i].attr == ATTR_VOLUME_ID) { lfn_active = 0; continue; }
 
+                if (ix)
+                    dir_index_add(ix, lfn_active ? lfn_start : here,
+                                  lfn_active ? lfn_hash(lfn_buf) : 0,
+                                  entries[i].name);
+
                 /* Regular entry — check LFN match first, then 8.3 */
                 int match = 0;
-                if (use_lfn && lfn_active) {
-                    /* Compare accumulated LFN with target name */
+                if (name && use_lfn && lfn_active) {
+                    /* Compare accumulated LFN with target name; the
+                     * 0xFFFF padding ends a name that fills its entries */
                     match = 1;
-                    for (int k = 0; name[k] || lfn_buf[k] != 0; k++) {
-                        if (lfn_buf[k] != (uint16_t)(uint8_t)name[k]) { match = 0; break; }
+                    for (int k = 0; k < 260; k++) {
+                        uint16_t c = lfn_buf[k] == 0xFFFF ? 0 : lfn_buf[k];
+                        if (c != (uint16_t)(uint8_t)name[k]) { match = 0; break; }
+                        if (!c) break;
                     }
                 }
-                if (!match)
+                if (name && !match)
                     match = (memcmp(entries[i].name, target, 11) == 0);
                 lfn_active = 0;
 
                 if (match) {
-                    if (entry_idx) *entry_idx = (int)(sec * count + i);
+                    if (entry_idx) *entry_idx = (int)here;
                     return ((uint32_t)entries[i].first_cluster_hi << 16)
                          | (uint32_t)entries[i].first_cluster_lo;
                 }
+                if (--max == 0)
+                    return 0;
             }
+            first_i = 0;
         }
+        first_sec = 0;
+        base += per_cluster;
         cluster = fat_get(cluster);
     }
+    if (ix) ix->end = base;
+    return 0;
+}
+
+/* The index of dir_cluster, built with one scan if need be; NULL when
+ * not indexing */
+static struct dir_index *dir_index_get(uint32_t dir_cluster)
+{
+    if (!s_dir_index_on)
+        return NULL;
+
+    /* A hit, or else the least recently used (unused ones are 0) */
+    struct dir_index *ix = NULL;
+    for (int i = 0; i < FAT32_DIR_INDEX; i++) {
+        if (s_dir_index[i].cluster == dir_cluster) {
+            ix = &s_dir_index[i];
+            ix->used = ++s_dir_index_clock;
+            return ix;
+        }
+        if (!ix || s_dir_index[i].used < ix->used)
+            ix = &s_dir_index[i];
+    }
+
+    ix->cluster = 0;
+    ix->used = 0;
+    ix->count = 0;
+    ix->full = 0;
+    ix->end = UINT32_MAX;
+    scan_dir(dir_cluster, 0, UINT32_MAX, NULL, NULL, ix);
+    if (ix->end == UINT32_MAX)
+        return NULL; /* read error: scan the card as before */
+    ix->cluster = dir_cluster;
+    ix->used = ++s_dir_index_clock;
+    return ix;
+}
+
+static uint32_t find_in_dir(uint32_t dir_cluster, const char *name, int *entry_idx)
+{
+    struct dir_index *ix = dir_index_get(dir_cluster);
+    if (!ix)
+        return scan_dir(dir_cluster, 0, UINT32_MAX, name, entry_idx, NULL);
+
+    uint8_t target[11];
+    name_to_83(name, target);
+    uint32_t sh = sfn_hash(target);
+    uint32_t lh = 0;
+    if (needs_lfn(name)) {
+        uint16_t uname[260];
+        int k = 0;
+        for (; name[k] && k < 259; k++) uname[k] = (uint16_t)(uint8_t)name[k];
+        uname[k] = 0;
+        lh = lfn_hash(uname);
+    }
+
+    /* Only a candidate's own entries are read back to confirm it */
+    for (int i = 0; i < ix->count; i++) {
+        struct dir_index_name *dn = &ix->names[i];
+        if (dn->sfn_hash != sh && !(lh && dn->lfn_hash == lh))
+            continue;
+        uint32_t cl = scan_dir(dir_cluster, dn->slot, 1, name, entry_idx, NULL);
+        if (cl)
+            return cl;
+    }
+    if (!ix->full)
+        return 0;
+    return scan_dir(dir_cluster, 0, UINT32_MAX, name, entry_idx, NULL);
+}
+
+/* Write n entries to an indexed directory at its end, growing the chain
+ * as needed */
+static int append_dir_entries(struct dir_index *ix,
+                              struct fat32_dir_entry *entries_arr, int n)
+{
+    int count = SECTOR_SIZE / (int)sizeof(struct fat32_dir_entry);
+    uint32_t per_cluster = s_fs.spc * (uint32_t)count;
+    uint32_t slot = ix->end;
+
+    /* Cluster holding the end, allocating when it is just past the chain */
+    uint32_t cluster = ix->cluster;
+    for (uint32_t skip = slot / per_cluster; skip > 0; skip--) {
+        uint32_t next = fat_get(cluster);
+        if (next >= FAT32_EOC) {
+            next = alloc_cluster(cluster);
+            if (next == 0) return -1;
+            zero_sectors((uint32_t)cluster_to_lba(next), s_fs.spc);
+        } else if (next < 2) {
+            return -1;
+        }
+        cluster = next;
+    }
+
+    int written = 0;
+    while (written < n) {
+        uint32_t in_cluster = slot % per_cluster;
+        uint32_t lba = (uint32_t)cluster_to_lba(cluster) +
+                       in_cluster / (uint32_t)count;
+        if (read_sector(lba, s_dir) < 0)
+            return -1;
+        struct fat32_dir_entry *de = (struct fat32_dir_entry *)s_dir;
+        for (int i = (int)(in_cluster % (uint32_t)count);
+             i < count && written < n; i++) {
+            memcpy(&de[i], &entries_arr[written++], sizeof(struct fat32_dir_entry));
+            slot++;
+        }
+        if (write_sector(lba, s_dir) < 0)
+            return -1;
+
+        if (written < n && slot % per_cluster == 0) {
+            uint32_t next = fat_get(cluster);
+            if (next >= FAT32_EOC) {
+                next = alloc_cluster(cluster);
+                if (next == 0) return -1;
+                zero_sectors((uint32_t)cluster_to_lba(next), s_fs.spc);
+            } else if (next < 2) {
+                return -1;
+            }
+            cluster = next;
+        }
+    }
+
+    uint32_t lh = 0;
+    if (n > 1) {
+        uint16_t uname[260];
+        memset(uname, 0xFF, sizeof(uname));
+        for (int i = 0; i < n - 1; i++) {
+            uint8_t *e = (uint8_t *)&entries_arr[i];
+            int seq = e[0] & 0x3F;
+            if (seq >= 1 && seq <= 20)
+                extract_lfn_chars(e, uname, seq);
+        }
+        lh = lfn_hash(uname);
+    }
+    dir_index_add(ix, ix->end, lh, entries_arr[n - 1].name);
+    ix->end = slot;
     return 0;
 }
 
@@ -581,6 +941,10 @@ static uint32_t find_in_dir(uint32_t dir_cluster, const char *name, int *entry_i
  * Used for LFN entries + short entry. */
 static int add_dir_entries(uint32_t dir_cluster, struct fat32_dir_entry *entries_arr, int n)
 {
+    struct dir_index *ix = dir_index_get(dir_cluster);
+    if (ix)
+        return append_dir_entries(ix, entries_arr, n);
+
     int written = 0;
     uint32_t cluster = dir_cluster;
     while (cluster >= 2 && cluster < FAT32_EOC) {
@@ -797,7 +1161,6 @@ int fat32_write_file(const char *path, const void *data, uint32_t size)
 /* ---- Streaming write API ---- */
 
 /* Single stream state (only one stream open at a time) */
-static uint8_t __attribute__((aligned(4))) s_stream_buf[SECTOR_SIZE]; /* DMA-safe */
 static struct {
     int active;
     uint32_t first_cluster;
@@ -808,6 +1171,8 @@ static struct {
     uint32_t bytes_written;
     uint32_t buf_pos;         /* bytes buffered in s_stream_buf */
     uint32_t sector_in_cluster; /* which sector within current cluster */
+    uint32_t win_lba;         /* where s_stream_buf goes */
+    int split;                /* the chain jumps: write the window now */
 } s_stream;
 
 int fat32_stream_open(const char *path, uint32_t size)
@@ -856,36 +1221,50 @@ int fat32_stream_open(const char *path, uint32_t size)
     s_stream.bytes_written = 0;
     s_stream.buf_pos = 0;
     s_stream.sector_in_cluster = 0;
+    s_stream.win_lba = (uint32_t)cluster_to_lba(first);
+    s_stream.split = 0;
     int flen = 0;
     while (filename[flen] && flen < 63) {
         s_stream.filename[flen] = filename[flen];
         flen++;
     }
     s_stream.filename[flen] = '\0';
-    memset(s_stream_buf, 0, SECTOR_SIZE);
 
     return 1;
 }
 
-/* Flush the sector buffer to the current position */
-static int stream_flush_sector(void)
+/* A buffered sector is complete: move to the next one in the chain.
+ * fat32_stream_open allocates the chain contiguously when it can; where
+ * it does not, the window has to end with the cluster. */
+static void stream_next_sector(void)
 {
-    uint64_t lba = cluster_to_lba(s_stream.current_cluster)
-                 + s_stream.sector_in_cluster;
-    if (write_sector((uint32_t)lba, s_stream_buf) < 0)
-        return -1;
-
-    memset(s_stream_buf, 0, SECTOR_SIZE);
-    s_stream.buf_pos = 0;
     s_stream.sector_in_cluster++;
-
-    /* Move to next cluster if needed */
     if (s_stream.sector_in_cluster >= s_fs.spc) {
         s_stream.sector_in_cluster = 0;
         uint32_t next = fat_get(s_stream.current_cluster);
-        if (next >= 2 && next < FAT32_EOC)
+        if (next >= 2 && next < FAT32_EOC) {
+            if (next != s_stream.current_cluster + 1)
+                s_stream.split = 1;
             s_stream.current_cluster = next;
+        }
     }
+}
+
+/* Write the buffered sectors (a partial last one zero-padded) in one
+ * command at win_lba, and start the next window where they end */
+static int stream_flush(void)
+{
+    uint32_t sectors = (s_stream.buf_pos + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    if (sectors == 0) return 0;
+    memset(s_stream_buf + s_stream.buf_pos, 0,
+           sectors * SECTOR_SIZE - s_stream.buf_pos);
+    if (sdcard_write_data(s_stream.win_lba, sectors, s_stream_buf) != 0)
+        return -1;
+
+    s_stream.buf_pos = 0;
+    s_stream.split = 0;
+    s_stream.win_lba = (uint32_t)(cluster_to_lba(s_stream.current_cluster)
+                                  + s_stream.sector_in_cluster);
     return 0;
 }
 
@@ -895,7 +1274,7 @@ int fat32_stream_write(int handle, const void *data, uint32_t len)
 
     const uint8_t *src = (const uint8_t *)data;
     while (len > 0) {
-        uint32_t space = SECTOR_SIZE - s_stream.buf_pos;
+        uint32_t space = SECTOR_SIZE - s_stream.buf_pos % SECTOR_SIZE;
         uint32_t chunk = (len < space) ? len : space;
 
         memcpy(s_stream_buf + s_stream.buf_pos, src, chunk);
@@ -904,8 +1283,10 @@ int fat32_stream_write(int handle, const void *data, uint32_t len)
         src += chunk;
         len -= chunk;
 
-        if (s_stream.buf_pos == SECTOR_SIZE) {
-            if (stream_flush_sector() < 0)
+        if (s_stream.buf_pos % SECTOR_SIZE == 0) {
+            stream_next_sector();
+            if ((s_stream.buf_pos == sizeof(s_stream_buf) || s_stream.split) &&
+                stream_flush() < 0)
                 return -1;
         }
     }
@@ -917,10 +1298,8 @@ int fat32_stream_close(int handle)
     if (!s_stream.active || handle != 1) return -1;
 
     /* Flush remaining data */
-    if (s_stream.buf_pos > 0) {
-        if (stream_flush_sector() < 0)
-            return -1;
-    }
+    if (stream_flush() < 0)
+        return -1;
 
     /* Add directory entry */
     struct fat32_dir_entry entry;
@@ -936,11 +1315,165 @@ int fat32_stream_close(int handle)
     return add_named_entry(s_stream.dir_cluster, s_stream.filename, &entry);
 }
 
+/* ---- Pre-built image ---- */
+
+/* The image stream is routed through s_stream_buf like a file stream:
+ * first the FAT head, sent to both copies, then the clusters of each
+ * extent. A window is written when it fills or its run ends. */
+static struct {
+    int active;
+    const struct fat32_extent *ext;
+    uint32_t n_ext;
+    uint32_t cur;             /* extent being filled */
+    uint32_t fat_entries;
+    uint32_t fat_left;        /* FAT head sectors still to come */
+    uint32_t run_left;        /* sectors left in the current extent */
+    uint32_t buf_pos;         /* bytes buffered in s_stream_buf */
+    uint32_t win_lba;         /* where s_stream_buf goes */
+    int win_fat;              /* the window is FAT: mirror it */
+} s_image;
+
+/* Start of extent i, or of nothing once they are all written */
+static void image_start_run(uint32_t i)
+{
+    s_image.cur = i;
+    s_image.win_fat = 0;
+    if (i < s_image.n_ext) {
+        s_image.run_left = s_image.ext[i].clusters * s_fs.spc;
+        s_image.win_lba = (uint32_t)cluster_to_lba(s_image.ext[i].first_cluster);
+    } else {
+        s_image.run_left = 0;
+    }
+}
+
+static int image_flush(void)
+{
+    uint32_t sectors = (s_image.buf_pos + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    if (sectors == 0) return 0;
+    memset(s_stream_buf + s_image.buf_pos, 0,
+           sectors * SECTOR_SIZE - s_image.buf_pos);
+    /* The FAT head is metadata, the extents file contents */
+    int err = s_image.win_fat
+        ? sdcard_write(s_image.win_lba, sectors, s_stream_buf)
+        : sdcard_write_data(s_image.win_lba, sectors, s_stream_buf);
+    if (err != 0)
+        return -1;
+    if (s_image.win_fat &&
+        sdcard_write(s_image.win_lba + s_fs.fat_sectors, sectors, s_stream_buf) != 0)
+        return -1;
+    s_image.win_lba += sectors;
+    s_image.buf_pos = 0;
+    return 0;
+}
+
+int fat32_image_open(uint32_t spc, uint32_t fat_entries,
+                     const struct fat32_extent *extents, uint32_t count)
+{
+    if (s_image.active || s_stream.active) return -1;
+    if (spc != s_fs.spc) {
+        ESP_LOGW(TAG, "Image has %lu sectors per cluster, volume %lu",
+                 (unsigned long)spc, (unsigned long)s_fs.spc);
+        return -1;
+    }
+    uint32_t fat_head = (fat_entries * 4 + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    if (fat_entries < 3 || fat_entries > s_fs.total_clusters + 2 ||
+        fat_head > s_fs.fat_sectors) {
+        ESP_LOGW(TAG, "Image needs %lu clusters, volume has %lu",
+                 (unsigned long)fat_entries, (unsigned long)s_fs.total_clusters);
+        return -1;
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        if (extents[i].first_cluster < 2 ||
+            extents[i].first_cluster + extents[i].clusters > fat_entries) {
+            ESP_LOGW(TAG, "Image extent %lu out of range", (unsigned long)i);
+            return -1;
+        }
+    }
+
+    s_image.active = 1;
+    s_image.ext = extents;
+    s_image.n_ext = count;
+    s_image.cur = 0;
+    s_image.fat_entries = fat_entries;
+    s_image.fat_left = fat_head;
+    s_image.buf_pos = 0;
+    s_image.win_lba = s_fs.fat_start;
+    s_image.win_fat = 1;
+    fat_cache_drop();
+    dir_index_drop(0);
+    return 1;
+}
+
+int fat32_image_write(int handle, const void *data, uint32_t len)
+{
+    if (!s_image.active || handle != 1) return -1;
+
+    const uint8_t *src = (const uint8_t *)data;
+    while (len > 0) {
+        if (!s_image.win_fat && s_image.cur >= s_image.n_ext) {
+            ESP_LOGE(TAG, "Image data past its last extent");
+            return -1;
+        }
+        uint32_t space = SECTOR_SIZE - s_image.buf_pos % SECTOR_SIZE;
+        uint32_t chunk = (len < space) ? len : space;
+
+        memcpy(s_stream_buf + s_image.buf_pos, src, chunk);
+        s_image.buf_pos += chunk;
+        src += chunk;
+        len -= chunk;
+        if (s_image.buf_pos % SECTOR_SIZE != 0) continue;
+
+        /* A sector is complete: the run it ends starts a new window */
+        int run_end;
+        if (s_image.win_fat)
+            run_end = (--s_image.fat_left == 0);
+        else
+            run_end = (--s_image.run_left == 0);
+        if (run_end || s_image.buf_pos == sizeof(s_stream_buf)) {
+            if (image_flush() < 0) return -1;
+        }
+        if (run_end)
+            image_start_run(s_image.win_fat ? 0 : s_image.cur + 1);
+    }
+    return 0;
+}
+
+int fat32_image_close(int handle)
+{
+    if (!s_image.active || handle != 1) return -1;
+    s_image.active = 0;
+
+    if (image_flush() < 0) return -1;
+    if (s_image.win_fat || s_image.cur < s_image.n_ext) {
+        ESP_LOGE(TAG, "Image ended early");
+        return -1;
+    }
+
+    /* Everything below fat_entries is in use; files added later go after */
+    s_fs.next_free_cluster = s_image.fat_entries;
+    fat_cache_drop();
+    dir_index_drop(1);
+
+    memset(s_buf, 0, SECTOR_SIZE);
+    struct fat32_fsinfo *fsi = (struct fat32_fsinfo *)s_buf;
+    fsi->lead_sig = 0x41615252;
+    fsi->struct_sig = 0x61417272;
+    fsi->free_count = s_fs.total_clusters + 2 - s_image.fat_entries;
+    fsi->next_free = s_image.fat_entries;
+    fsi->trail_sig = 0xAA550000;
+    if (write_sector(s_fs.part_start + 1, s_buf) < 0 ||
+        write_sector(s_fs.part_start + 7, s_buf) < 0)
+        return -1;
+    return 0;
+}
+
 /* ---- Reading API (Chapter 36) ---- */
 
 int fat32_read_init(uint32_t partition_start_lba)
 {
     s_fs.part_start = partition_start_lba;
+    fat_cache_drop();
+    dir_index_drop(0);
 
     /* Read BPB from first sector of partition */
     if (read_sector(partition_start_lba, s_buf) < 0)
@@ -976,6 +1509,7 @@ static struct {
     int entry;              /* entry index within sector */
     uint16_t lfn_buf[260];  /* accumulated LFN characters */
     int lfn_active;         /* 1 if we're collecting LFN entries */
+    uint32_t buf_lba;       /* sector in s_readdir_buf, 0 if none */
 } s_readdir;
 
 int fat32_open_dir(const char *path)
@@ -995,9 +1529,33 @@ int fat32_open_dir(const char *path)
     s_readdir.sector = 0;
     s_readdir.entry = 0;
     s_readdir.lfn_active = 0;
+    s_readdir.buf_lba = 0;
     return 1;
 }
 
+int fat32_open_dir_at(const struct fat32_dir_pos *pos)
+{
+    if (s_readdir.active || !pos) return -1;
+    if (pos->cluster < 2 || pos->sector >= s_fs.spc) return -1;
+
+    s_readdir.active = 1;
+    s_readdir.cluster = pos->cluster;
+    s_readdir.sector = pos->sector;
+    s_readdir.entry = pos->entry;
+    s_readdir.lfn_active = 0;
+    s_readdir.buf_lba = 0;
+    return 1;
+}
+
+int fat32_tell_dir(int handle, struct fat32_dir_pos *pos)
+{
+    if (!s_readdir.active || handle != 1 || !pos) return -1;
+    pos->cluster = s_readdir.cluster;
+    pos->sector = s_readdir.sector;
+    pos->entry = (uint32_t)s_readdir.entry;
+    return 0;
+}
+
 int fat32_read_dir(int handle, struct fat32_dir_info *info)
 {
     if (!s_readdir.active || handle != 1) return -1;
@@ -1008,10 +1566,15 @@ int fat32_read_dir(int handle, struct fat32_dir_info *info)
         uint64_t base_lba = cluster_to_lba(s_readdir.cluster);
 
         for (; s_readdir.sector < s_fs.spc; s_readdir.sector++) {
-            if (read_sector((uint32_t)(base_lba + s_readdir.sector), s_dir) < 0)
-                return -1;
+            uint32_t lba = (uint32_t)(base_lba + s_readdir.sector);
+            if (s_readdir.buf_lba != lba) {
+                if (read_sector(lba, s_readdir_buf) < 0)
+                    return -1;
+                s_readdir.buf_lba = lba;
+            }
 
-            struct fat32_dir_entry *entries = (struct fat32_dir_entry *)s_dir;
+            struct fat32_dir_entry *entries =
+                (struct fat32_dir_entry *)s_readdir_buf;
 
             for (; s_readdir.entry < entries_per_sector; s_readdir.entry++) {
                 struct fat32_dir_entry *de = &entries[s_readdir.entry];
@@ -1091,13 +1654,23 @@ void fat32_close_dir(int handle)
 
 /* ---- File reading ---- */
 
+/* The reader takes the chain a run at a time: the rest of the current
+ * cluster plus every cluster that follows it on disk, read with one
+ * multi-block command. Runs of whole sectors go straight into the
+ * caller's buffer when it is word aligned (what the SD host DMAs into);
+ * anything else is staged through s_stream_buf a window at a time. */
 static struct {
     int active;
+    uint32_t first_cluster;
     uint32_t current_cluster;
+    uint32_t cluster_idx;       /* current_cluster's place in the chain */
     uint32_t file_size;
     uint32_t position;          /* bytes read so far */
     uint32_t sector_in_cluster; /* which sector within current cluster */
+    uint32_t contig_end;        /* chain known to run +1 from current_cluster
+                                 * up to here */
     uint32_t buf_pos;           /* read offset within s_stream_buf */
+    uint32_t buf_len;           /* bytes loaded into s_stream_buf */
 } s_readfile;
 
 int fat32_file_open(const char *path)
@@ -1136,14 +1709,79 @@ int fat32_file_open(const char *path)
     uint32_t file_size = entries[idx_in_sector].file_size;
 
     s_readfile.active = 1;
+    s_readfile.first_cluster = cluster;
     s_readfile.current_cluster = cluster;
+    s_readfile.cluster_idx = 0;
     s_readfile.file_size = file_size;
     s_readfile.position = 0;
     s_readfile.sector_in_cluster = 0;
-    s_readfile.buf_pos = SECTOR_SIZE; /* force load on first read */
+    s_readfile.contig_end = cluster;
+    s_readfile.buf_pos = 0;
+    s_readfile.buf_len = 0;
+    return 1;
+}
+
+/* Follow the chain one cluster from cl, at or after the current one;
+ * within the known-contiguous stretch this needs no FAT lookup */
+static uint32_t read_next_cluster(uint32_t cl)
+{
+    if (cl < s_readfile.contig_end)
+        return cl + 1;
+    uint32_t next = fat_get(cl);
+    if (next == cl + 1)
+        s_readfile.contig_end = next;
+    return next;
+}
+
+/* Move to the start of the next cluster. Returns 0 at the chain's end. */
+static int read_step(void)
+{
+    uint32_t cl = s_readfile.current_cluster;
+    uint32_t next = read_next_cluster(cl);
+    if (next < 2 || next >= FAT32_EOC)
+        return 0;
+    if (next != cl + 1)
+        s_readfile.contig_end = next;  /* a new stretch starts here */
+    s_readfile.current_cluster = next;
+    s_readfile.cluster_idx++;
+    s_readfile.sector_in_cluster = 0;
     return 1;
 }
 
+/* Sectors (at most max) readable with one command from the current
+ * position, which is at a sector boundary inside the current cluster */
+static uint32_t read_run(uint32_t max)
+{
+    uint32_t n = s_fs.spc - s_readfile.sector_in_cluster;
+    uint32_t cl = s_readfile.current_cluster;
+    while (n < max) {
+        uint32_t next = read_next_cluster(cl);
+        if (next != cl + 1) break;
+        cl = next;
+        n += s_fs.spc;
+    }
+    return (n < max) ? n : max;
+}
+
+/* Read n sectors of the current run into dst and step past them. The
+ * run is contiguous, so the cluster it ends in is found by arithmetic;
+ * a run ending on a cluster boundary leaves sector_in_cluster == spc
+ * and the chain is followed only when more is read. */
+static int read_sectors(uint8_t *dst, uint32_t n)
+{
+    uint64_t lba = cluster_to_lba(s_readfile.current_cluster)
+                 + s_readfile.sector_in_cluster;
+    if (sdcard_read((uint32_t)lba, n, dst) != 0)
+        return -1;
+
+    uint32_t end = s_readfile.sector_in_cluster + n;
+    uint32_t skip = (end - 1) / s_fs.spc;
+    s_readfile.current_cluster += skip;
+    s_readfile.cluster_idx += skip;
+    s_readfile.sector_in_cluster = end - skip * s_fs.spc;
+    return 0;
+}
+
 int fat32_file_read(int handle, void *buf, uint32_t len)
 {
     if (!s_readfile.active || handle != 1) return -1;
@@ -1157,41 +1795,106 @@ int fat32_file_read(int handle, void *buf, uint32_t len)
     uint32_t copied = 0;
 
     while (copied < len) {
-        /* Load next sector if buffer exhausted */
-        if (s_readfile.buf_pos >= SECTOR_SIZE) {
-            /* Advance to next cluster if needed */
-            if (s_readfile.sector_in_cluster >= s_fs.spc) {
-                uint32_t next = fat_get(s_readfile.current_cluster);
-                if (next < 2 || next >= FAT32_EOC) {
-                    s_readfile.active = 0;
-                    return (copied > 0) ? (int)copied : 0;
-                }
-                s_readfile.current_cluster = next;
-                s_readfile.sector_in_cluster = 0;
-            }
+        uint32_t want = len - copied;
 
-            uint64_t lba = cluster_to_lba(s_readfile.current_cluster)
-                         + s_readfile.sector_in_cluster;
-            if (read_sector((uint32_t)lba, s_stream_buf) < 0)
-                return -1;
+        if (s_readfile.buf_pos < s_readfile.buf_len) {
+            uint32_t avail = s_readfile.buf_len - s_readfile.buf_pos;
+            uint32_t chunk = (want < avail) ? want : avail;
+            memcpy(dst + copied, s_stream_buf + s_readfile.buf_pos, chunk);
+            s_readfile.buf_pos += chunk;
+            s_readfile.position += chunk;
+            copied += chunk;
+            continue;
+        }
 
-            s_readfile.sector_in_cluster++;
-            s_readfile.buf_pos = 0;
+        /* Advance to next cluster if needed */
+        if (s_readfile.sector_in_cluster >= s_fs.spc && !read_step()) {
+            s_readfile.active = 0;
+            return (copied > 0) ? (int)copied : 0;
         }
 
-        uint32_t avail = SECTOR_SIZE - s_readfile.buf_pos;
-        uint32_t want = len - copied;
-        uint32_t chunk = (want < avail) ? want : avail;
+        /* Whole sectors straight into the caller's buffer */
+        uint32_t whole = want / SECTOR_SIZE;
+        if (whole > 0 && ((uintptr_t)(dst + copied) & 3) == 0) {
+            uint32_t n = read_run(whole);
+            if (read_sectors(dst + copied, n) < 0)
+                return -1;
+            s_readfile.position += n * SECTOR_SIZE;
+            copied += n * SECTOR_SIZE;
+            continue;
+        }
 
-        memcpy(dst + copied, s_stream_buf + s_readfile.buf_pos, chunk);
-        s_readfile.buf_pos += chunk;
-        s_readfile.position += chunk;
-        copied += chunk;
+        /* Otherwise a window of the run, no further than the file goes */
+        uint32_t left = s_readfile.file_size - s_readfile.position;
+        uint32_t max = (left + SECTOR_SIZE - 1) / SECTOR_SIZE;
+        if (max > FAT32_STREAM_WINDOW) max = FAT32_STREAM_WINDOW;
+        uint32_t n = read_run(max);
+        if (read_sectors(s_stream_buf, n) < 0)
+            return -1;
+        s_readfile.buf_pos = 0;
+        s_readfile.buf_len = n * SECTOR_SIZE;
     }
 
     return (int)copied;
 }
 
+int fat32_file_seek(int handle, uint32_t pos)
+{
+    if (!s_readfile.active || handle != 1) return -1;
+    if (pos > s_readfile.file_size) pos = s_readfile.file_size;
+
+    /* Still inside the loaded window: only the read offset moves */
+    uint32_t win = s_readfile.position - s_readfile.buf_pos;
+    if (pos >= win && pos < win + s_readfile.buf_len) {
+        s_readfile.buf_pos = pos - win;
+        s_readfile.position = pos;
+        return 0;
+    }
+
+    s_readfile.buf_pos = 0;
+    s_readfile.buf_len = 0;
+    s_readfile.position = pos;
+    if (pos == s_readfile.file_size)
+        return 0;  /* nothing left to read; the chain is not walked */
+
+    /* Walk to the cluster holding pos, forward from the current one
+     * when it is not past it, else from the start of the chain */
+    uint32_t cluster_bytes = s_fs.spc * SECTOR_SIZE;
+    uint32_t idx = pos / cluster_bytes;
+    if (idx < s_readfile.cluster_idx) {
+        s_readfile.current_cluster = s_readfile.first_cluster;
+        s_readfile.cluster_idx = 0;
+        s_readfile.contig_end = s_readfile.first_cluster;
+    }
+    while (s_readfile.cluster_idx < idx) {
+        if (!read_step()) {
+            s_readfile.active = 0;
+            return -1;
+        }
+    }
+
+    /* Load the window holding pos when it is not at a sector boundary */
+    uint32_t in_cluster = pos % cluster_bytes;
+    s_readfile.sector_in_cluster = in_cluster / SECTOR_SIZE;
+    if (pos % SECTOR_SIZE == 0)
+        return 0;
+    uint32_t left = s_readfile.file_size - (pos - pos % SECTOR_SIZE);
+    uint32_t max = (left + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    if (max > FAT32_STREAM_WINDOW) max = FAT32_STREAM_WINDOW;
+    uint32_t n = read_run(max);
+    if (read_sectors(s_stream_buf, n) < 0)
+        return -1;
+    s_readfile.buf_pos = pos % SECTOR_SIZE;
+    s_readfile.buf_len = n * SECTOR_SIZE;
+    return 0;
+}
+
+uint32_t fat32_file_size(int handle)
+{
+    if (!s_readfile.active || handle != 1) return 0;
+    return s_readfile.file_size;
+}
+
 void fat32_file_close(int handle)
 {
     if (handle == 1)
@@ -1222,3 +1925,164 @@ int fat32_volume_info(uint64_t *total_bytes, uint64_t *free_bytes)
     *free_bytes = (uint64_t)free_count * cluster_size;
     return 0;
 }
+
+/* ---- Appending to an existing volume ---- */
+
+/* The LBA of the sector holding directory entry slot of dir_cluster */
+static int dir_slot_lba(uint32_t dir_cluster, uint32_t slot, uint32_t *lba)
+{
+    uint32_t per_sector = SECTOR_SIZE / sizeof(struct fat32_dir_entry);
+    uint32_t per_cluster = s_fs.spc * per_sector;
+    uint32_t cluster = dir_cluster;
+    for (uint32_t skip = slot / per_cluster; skip > 0; skip--) {
+        cluster = fat_get(cluster);
+        if (cluster < 2 || cluster >= FAT32_EOC)
+            return -1;
+    }
+    *lba = (uint32_t)cluster_to_lba(cluster) + (slot % per_cluster) / per_sector;
+    return 0;
+}
+
+/* Append to filename in dir_cluster, creating it empty first if need be */
+static int append_in_dir(uint32_t dir_cluster, const char *filename,
+                         const uint8_t *src, uint32_t len)
+{
+    int slot = -1;
+    find_in_dir(dir_cluster, filename, &slot);
+    if (slot < 0) {
+        struct fat32_dir_entry entry;
+        memset(&entry, 0, sizeof(entry));
+        entry.nt_reserved = name_to_83(filename, entry.name);
+        entry.attr = ATTR_ARCHIVE;
+        entry.modify_date = (2026 - 1980) << 9 | 1 << 5 | 1;
+        if (add_named_entry(dir_cluster, filename, &entry) < 0)
+            return -1;
+        find_in_dir(dir_cluster, filename, &slot);
+        if (slot < 0)
+            return -1;
+    }
+
+    uint32_t entry_lba;
+    if (dir_slot_lba(dir_cluster, (uint32_t)slot, &entry_lba) < 0 ||
+        read_sector(entry_lba, s_dir) < 0)
+        return -1;
+    struct fat32_dir_entry *de = (struct fat32_dir_entry *)s_dir +
+        (uint32_t)slot % (SECTOR_SIZE / sizeof(struct fat32_dir_entry));
+    if (de->attr & ATTR_DIRECTORY)
+        return -1;
+    uint32_t size = de->file_size;
+    uint32_t first = ((uint32_t)de->first_cluster_hi << 16) | de->first_cluster_lo;
+
+    /* The cluster the end of the file is in; past the chain (one to
+     * allocate) when the file ends on a cluster boundary */
+    uint32_t cluster_size = s_fs.spc * SECTOR_SIZE;
+    uint32_t cl = first, prev = 0;
+    for (uint32_t i = size / cluster_size; i > 0; i--) {
+        if (cl < 2 || cl >= FAT32_EOC)
+            return -1;
+        prev = cl;
+        cl = fat_get(cl);
+    }
+
+    uint32_t off = size % cluster_size;
+    while (len > 0) {
+        if (cl < 2 || cl >= FAT32_EOC) {
+            cl = alloc_cluster(prev);
+            if (cl == 0)
+                return -1;
+            if (first == 0)
+                first = cl;
+        }
+        uint32_t lba = (uint32_t)cluster_to_lba(cl) + off / SECTOR_SIZE;
+        uint32_t in = off % SECTOR_SIZE;
+        uint32_t n = SECTOR_SIZE - in;
+        if (n > len) n = len;
+        if (in > 0) {
+            if (read_sector(lba, s_buf) < 0)
+                return -1;
+        } else {
+            memset(s_buf, 0, SECTOR_SIZE);
+        }
+        memcpy(s_buf + in, src, n);
+        if (write_sector(lba, s_buf) < 0)
+            return -1;
+        src += n;
+        len -= n;
+        size += n;
+        off += n;
+        if (off == cluster_size) {
+            prev = cl;
+            cl = fat_get(cl);
+            off = 0;
+        }
+    }
+
+    if (read_sector(entry_lba, s_dir) < 0)
+        return -1;
+    de->file_size = size;
+    de->first_cluster_hi = (uint16_t)(first >> 16);
+    de->first_cluster_lo = (uint16_t)(first & 0xFFFF);
+    return write_sector(entry_lba, s_dir);
+}
+
+int fat32_append_file(const char *path, const void *data, uint32_t len)
+{
+    /* Split into directory + filename */
+    const char *last_sep = NULL;
+    for (const char *p = path; *p; p++)
+        if (*p == '/' || *p == '\\') last_sep = p;
+
+    /* Allocate from the FSInfo hint, stepping over clusters in use */
+    uint32_t fsinfo_lba = s_fs.part_start + 1;
+    struct fat32_fsinfo *fsi = (struct fat32_fsinfo *)s_buf;
+    if (read_sector(fsinfo_lba, s_buf) < 0)
+        return -1;
+    uint32_t hint = fsi->next_free;
+    s_fs.next_free_cluster = (hint >= 2 && hint < s_fs.total_clusters + 2)
+                             ? hint : 2;
+
+    int ret = -1;
+    uint32_t dir_cluster = 2;
+    const char *filename = path;
+    if (last_sep) {
+        char dirpath[256];
+        int dlen = (int)(last_sep - path);
+        if (dlen >= 256) dlen = 255;
+        memcpy(dirpath, path, (size_t)dlen);
+        dirpath[dlen] = '\0';
+        dir_cluster = walk_path(dirpath);
+        filename = last_sep + 1;
+    }
+    if (dir_cluster != 0)
+        ret = append_in_dir(dir_cluster, filename, (const uint8_t *)data, len);
+
+    /* The free count is no longer known; the hint is only a hint */
+    if (read_sector(fsinfo_lba, s_buf) == 0 && fsi->lead_sig == 0x41615252) {
+        fsi->free_count = 0xFFFFFFFF;
+        fsi->next_free = s_fs.next_free_cluster;
+        if (write_sector(fsinfo_lba, s_buf) < 0)
+            ret = -1;
+    }
+    s_fs.next_free_cluster = s_fs.total_clusters + 2;
+    return ret;
+}
+
+int fat32_free_run(uint32_t sectors, uint32_t *lba)
+{
+    uint32_t need = (sectors + s_fs.spc - 1) / s_fs.spc;
+    uint32_t start = 0, run = 0;
+    for (uint32_t cl = 2; cl < s_fs.total_clusters + 2; cl++) {
+        uint32_t v = fat_get(cl);
+        if (v != FAT32_FREE) {
+            run = 0;
+            continue;
+        }
+        if (run++ == 0)
+            start = cl;
+        if (run == need) {
+            *lba = (uint32_t)cluster_to_lba(start);
+            return 0;
+        }
+    }
+    return -1;
+}
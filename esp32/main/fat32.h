@@ -58,6 +58,20 @@ int fat32_read_dir(int handle, struct fat32_dir_info *info);
 /* Close directory handle. */
 void fat32_close_dir(int handle);
 
+/* A place in a directory scan, between two entries */
+struct fat32_dir_pos {
+    uint32_t cluster;
+    uint32_t sector;
+    uint32_t entry;
+};
+
+/* Where the next fat32_read_dir() will start. Returns 0 on success. */
+int fat32_tell_dir(int handle, struct fat32_dir_pos *pos);
+
+/* Open a directory scan at a place fat32_tell_dir() gave, without
+ * walking the path again. Returns a handle (>0) or -1 on error. */
+int fat32_open_dir_at(const struct fat32_dir_pos *pos);
+
 /* Open a file for sequential reading.
  * Returns a handle (>0) or -1 on error. */
 int fat32_file_open(const char *path);
@@ -65,6 +79,14 @@ int fat32_file_open(const char *path);
 /* Read up to len bytes. Returns bytes read, 0=EOF, -1=error. */
 int fat32_file_read(int handle, void *buf, uint32_t len);
 
+/* Move the read position to pos (clamped to the file size). Seeking
+ * backward walks the chain again from its first cluster.
+ * Returns 0 or -1 on error. */
+int fat32_file_seek(int handle, uint32_t pos);
+
+/* Size in bytes of the open file, or 0 if handle is not open. */
+uint32_t fat32_file_size(int handle);
+
 /* Close file handle. */
 void fat32_file_close(int handle);
 
@@ -80,7 +102,44 @@ int fat32_stream_write(int handle, const void *data, uint32_t len);
 /* Finalize the stream. Returns 0 on success. */
 int fat32_stream_close(int handle);
 
+/* --- Pre-built image API (pack_payload.py --image) --- */
+
+/* A run of clusters the image fills */
+struct fat32_extent {
+    uint32_t first_cluster;
+    uint32_t clusters;
+};
+
+/* Begin writing a pre-built image onto the volume fat32_format() just
+ * made. The image was laid out for spc sectors per cluster and uses
+ * clusters below fat_entries; its stream is the FAT entries for clusters
+ * 0..fat_entries-1 (zero-padded to a sector), then the data of each
+ * extent in order. Returns a handle (>0), or -1 if it does not fit this
+ * volume (nothing has been written then). */
+int fat32_image_open(uint32_t spc, uint32_t fat_entries,
+                     const struct fat32_extent *extents, uint32_t count);
+
+/* Write the next bytes of the image stream. Returns 0 on success. */
+int fat32_image_write(int handle, const void *data, uint32_t len);
+
+/* Finish the image and update FSInfo. Returns 0 on success, -1 if it
+ * failed or the stream ended early. */
+int fat32_image_close(int handle);
+
 /* Get volume total and free space. Returns 0 on success. */
 int fat32_volume_info(uint64_t *total_bytes, uint64_t *free_bytes);
 
+/* --- Writing to an existing volume (after fat32_read_init) --- */
+
+/* Append len bytes to a file, creating it (and its parent directories)
+ * if it is not there. Clusters are taken from the free ones in the FAT;
+ * the volume is read-only again afterwards. Returns 0 on success. */
+int fat32_append_file(const char *path, const void *data, uint32_t len);
+
+/* Find a run of free clusters covering at least sectors sectors and put
+ * the absolute LBA of its first sector in *lba. Nothing is allocated: the
+ * run is only free until the volume is next written. Returns 0 on
+ * success, -1 if there is no such run. */
+int fat32_free_run(uint32_t sectors, uint32_t *lba);
+
 #endif /* FAT32_H */
@@ -5,10 +5,30 @@
  *   1. Create GPT partition table on SD card
  *   2. Format EFI System Partition as FAT32
  *   3. For each file in the payload:
- *      a. If compressed: streaming decompress (4KB chunks) + write
- *      b. If uncompressed: direct write
+ *      a. If chunked (v2) or compressed: decode chunk by chunk + write,
+ *         pipelined; each v2 chunk's size and CRC-32 are checked
+ *      b. If stored whole (v1) or empty: direct write
  *      c. Update progress on display
- *   4. Verify by reading back the FAT32 boot sector
+ *   4. Verify: read every file back through the FAT32 reader and check
+ *      each chunk against its CRC-32 in the payload (v1's stored files
+ *      against their bytes), reporting each file that differs
+ *
+ * When the payload carries a pre-built image for the arch and it fits
+ * the volume, step 3 is instead one sequential pass of it: the FAT head
+ * and then each used extent, in window-sized multi-block writes, with no
+ * directory searches or FAT updates on the card.
+ *
+ * In batch mode, steps 1 to 3 are recorded as a map of the metadata
+ * sectors written and the extents the data went to; a later card of
+ * the same size replays the map and streams the data into those
+ * extents before being verified in full.
+ *
+ * The pipeline: an inflate task pinned to core 1 decodes every streamed
+ * file in turn into a ring of buffers, while the calling task
+ * (app_main's, on core 0) writes them out through the FAT32 stream. Two
+ * queues carry the buffers round, so an inflater that gets ahead blocks
+ * on an empty ring. Progress is drawn by a low-priority task meanwhile,
+ * so neither side waits on the display.
  */
 
 #include "flasher.h"
@@ -17,30 +37,82 @@
 #include "sdcard.h"
 #include "payload.h"
 #include "ui.h"
+#include "psram.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include "esp_log.h"
+#include "esp_attr.h"
+#include "esp_timer.h"
+#include "esp_rom_crc.h"
 #include "miniz.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
 
 static const char *TAG = "flasher";
 
-/* Decompress a deflate stream and write via streaming FAT32 API.
- * Uses tinfl_decompress() with a 32KB dictionary buffer (TINFL_LZ_DICT_SIZE)
- * so LZ77 back-references resolve correctly. */
+/* Where inflated bytes go: fat32_stream_write or fat32_image_write */
+typedef int (*write_fn)(int handle, const void *data, uint32_t len);
+
+/* Where a chunk decoder puts its output: the pipeline's ring, or a
+ * writer directly */
+typedef int (*emit_fn)(const uint8_t *data, uint32_t len);
+
+#define RAW_PIECE (32 * 1024)  /* stored chunk: bytes per emit */
+
+/* ---- Chunk decoding ---- */
+
+/* Uses tinfl_decompress() with a 32KB dictionary buffer (TINFL_LZ_DICT_SIZE)
+ * so LZ77 back-references resolve correctly. Whichever side decodes
+ * (the inflate task, or this task without one) owns it.
+ *
+ * tinfl is esp_rom's, running from mask ROM without cache misses; the
+ * loop around it and the output copies are IRAM_ATTR so the hot path
+ * stays off the flash cache, which the mmap'd payload reads compete
+ * for. This file is built -O2 (see CMakeLists.txt). */
 static tinfl_decompressor s_decomp;
 static uint8_t s_dict[TINFL_LZ_DICT_SIZE];
 
-static int decompress_and_write(int stream_handle,
-                                 const uint8_t *compressed, uint32_t comp_size,
-                                 uint32_t orig_size)
+#if PAYLOAD_DICT_MAX > TINFL_LZ_DICT_SIZE
+#error "a preset dictionary must fit the inflate window"
+#endif
+
+/* Decode one chunk through emit, checking its size and CRC where the
+ * payload has them. A stored chunk is checked before any of it is
+ * emitted. Returns 0, or -1 on a bad chunk or a failed emit. */
+static int IRAM_ATTR decode_chunk(const struct payload_chunk *c, emit_fn emit)
 {
+    if (c->stored_size == c->original_size) {
+        if (c->has_crc && esp_rom_crc32_le(0, c->data, c->stored_size) != c->crc32) {
+            ESP_LOGE(TAG, "CRC mismatch in stored chunk");
+            return -1;
+        }
+        for (uint32_t ofs = 0; ofs < c->stored_size; ofs += RAW_PIECE) {
+            uint32_t n = c->stored_size - ofs;
+            if (n > RAW_PIECE) n = RAW_PIECE;
+            if (emit(c->data + ofs, n) != 0) return -1;
+        }
+        return 0;
+    }
+
     tinfl_init(&s_decomp);
-    const uint8_t *in_ptr = compressed;
-    size_t in_remaining = comp_size;
+    const uint8_t *in_ptr = c->data;
+    size_t in_remaining = c->stored_size;
     uint32_t total_out = 0;
+    uint32_t crc = 0;
     size_t dict_ofs = 0;
 
+    /* A preset dictionary is simply output that came before: it goes in
+     * the window first, for back-references to reach */
+    uint32_t preset_size;
+    const uint8_t *preset = payload_dictionary(&preset_size);
+    if (preset && c->has_crc) {
+        memcpy(s_dict, preset, preset_size);
+        dict_ofs = preset_size & (TINFL_LZ_DICT_SIZE - 1);
+    }
+
     for (;;) {
         size_t in_bytes = in_remaining;
         size_t out_bytes = TINFL_LZ_DICT_SIZE - dict_ofs;
@@ -52,7 +124,9 @@ static int decompress_and_write(int stream_handle,
             flags);
 
         if (out_bytes > 0) {
-            if (fat32_stream_write(stream_handle, s_dict + dict_ofs, (uint32_t)out_bytes) != 0)
+            if (c->has_crc)
+                crc = esp_rom_crc32_le(crc, s_dict + dict_ofs, (uint32_t)out_bytes);
+            if (emit(s_dict + dict_ofs, (uint32_t)out_bytes) != 0)
                 return -1;
             total_out += (uint32_t)out_bytes;
         }
@@ -68,6 +142,216 @@ static int decompress_and_write(int stream_handle,
         }
     }
 
+    if (!c->has_crc) {
+        /* v1: nothing more to go on than the size */
+        if (total_out != c->original_size)
+            ESP_LOGW(TAG, "Size mismatch: got %lu, expected %lu",
+                     (unsigned long)total_out, (unsigned long)c->original_size);
+        return 0;
+    }
+    if (total_out != c->original_size || crc != c->crc32) {
+        ESP_LOGE(TAG, "Bad chunk: %lu bytes, CRC %08lx, expected %lu, %08lx",
+                 (unsigned long)total_out, (unsigned long)crc,
+                 (unsigned long)c->original_size, (unsigned long)c->crc32);
+        return -1;
+    }
+    return 0;
+}
+
+/* Decode every chunk of a file, or of the arch's image if pf is NULL */
+static int decode_source(const struct payload_arch *pa,
+                         const struct payload_file *pf, emit_fn emit)
+{
+    uint32_t n = pf ? pf->chunk_count : pa->image.chunk_count;
+    for (uint32_t i = 0; i < n; i++) {
+        struct payload_chunk c;
+        int err = pf ? payload_file_chunk(pa, pf, i, &c)
+                     : payload_image_chunk(pa, i, &c);
+        if (err != 0 || decode_chunk(&c, emit) != 0) {
+            ESP_LOGE(TAG, "Chunk %lu of %s failed", (unsigned long)i,
+                     pf ? pf->path : "image");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Files whose bytes go through the decoder and a FAT32 stream: v1's
+ * compressed ones, every non-empty one in v2 (so each CRC is checked) */
+static int file_streamed(const struct payload_file *pf)
+{
+    return pf->compressed_size > 0;
+}
+
+/* ---- Inflate/write pipeline ---- */
+
+#define PIPE_BUFS     4
+#define PIPE_BUFS_MAX 12           /* with PSRAM holding the big buffers */
+#define PIPE_BUF_SIZE (16 * 1024)  /* half a FAT32 stream window */
+#define PIPE_STACK    4096
+#ifdef CONFIG_FREERTOS_UNICORE
+#define INFLATE_CORE  0
+#else
+#define INFLATE_CORE  1
+#endif
+
+/* Message kinds on the full queue */
+#define PIPE_DATA 0   /* buf holds len bytes of the current file */
+#define PIPE_END  1   /* current file complete */
+#define PIPE_FAIL 2   /* current file failed to inflate */
+#define PIPE_EXIT 3   /* the inflate task is gone */
+
+struct pipe_msg {
+    int kind;
+    int buf;
+    uint32_t len;
+};
+
+/* The first PIPE_BUFS buffers are always there. On a board with PSRAM
+ * the rest of internal RAM is usually free while flashing, so the ring
+ * is deepened with DMA-capable buffers for the run, which lets inflate
+ * run further ahead of a card stalled in a slow write. */
+static uint8_t __attribute__((aligned(4))) s_pipe_pool[PIPE_BUFS][PIPE_BUF_SIZE];
+static uint8_t *s_pipe_buf[PIPE_BUFS_MAX];
+static int s_pipe_bufs;             /* ring depth for this run */
+static QueueHandle_t s_pipe_free;   /* buffer indexes */
+static QueueHandle_t s_pipe_full;   /* struct pipe_msg */
+static volatile int s_pipe_abort;
+static const struct payload_arch *s_pipe_arch;
+static int s_pipe_image;            /* inflate the arch's image, not its files */
+static int s_put_buf = -1;          /* ring buffer being filled */
+static uint32_t s_put_fill;
+
+static void pipe_send(int kind, int buf, uint32_t len)
+{
+    struct pipe_msg m = { kind, buf, len };
+    xQueueSend(s_pipe_full, &m, portMAX_DELAY);
+}
+
+/* emit_fn for the inflate task: copy into ring buffers, sending each as
+ * it fills. Returns -1 once the writer has given up. */
+static int IRAM_ATTR pipe_put(const uint8_t *data, uint32_t len)
+{
+    while (len > 0) {
+        if (s_put_buf < 0) {
+            xQueueReceive(s_pipe_free, &s_put_buf, portMAX_DELAY);
+            s_put_fill = 0;
+            if (s_pipe_abort) {
+                xQueueSend(s_pipe_free, &s_put_buf, 0);
+                s_put_buf = -1;
+                return -1;
+            }
+        }
+        uint32_t n = PIPE_BUF_SIZE - s_put_fill;
+        if (n > len) n = len;
+        memcpy(s_pipe_buf[s_put_buf] + s_put_fill, data, n);
+        s_put_fill += n;
+        data += n;
+        len -= n;
+        if (s_put_fill == PIPE_BUF_SIZE) {
+            pipe_send(PIPE_DATA, s_put_buf, s_put_fill);
+            s_put_buf = -1;
+        }
+    }
+    return 0;
+}
+
+/* Decode one file (or the image) into the ring, then send its end */
+static int inflate_source(const struct payload_file *pf)
+{
+    int err = decode_source(s_pipe_arch, pf, pipe_put);
+    if (s_put_buf >= 0) {
+        if (err) xQueueSend(s_pipe_free, &s_put_buf, 0);
+        else pipe_send(PIPE_DATA, s_put_buf, s_put_fill);
+        s_put_buf = -1;
+    }
+    pipe_send(err ? PIPE_FAIL : PIPE_END, -1, 0);
+    return err;
+}
+
+/* Core 1: the image, or every streamed file in payload order, then
+ * PIPE_EXIT */
+static void inflate_task(void *arg)
+{
+    (void)arg;
+    const struct payload_arch *pa = s_pipe_arch;
+    if (s_pipe_image)
+        inflate_source(NULL);
+    for (int i = 0; i < pa->file_count && !s_pipe_image && !s_pipe_abort; i++) {
+        const struct payload_file *pf = &pa->files[i];
+        if (!file_streamed(pf)) continue;
+        if (inflate_source(pf) != 0) break;
+    }
+    pipe_send(PIPE_EXIT, -1, 0);
+    vTaskDelete(NULL);
+}
+
+/* Point the ring at its buffers, adding extra ones if there is PSRAM */
+static void pipe_bufs_alloc(void)
+{
+    for (int i = 0; i < PIPE_BUFS; i++)
+        s_pipe_buf[i] = s_pipe_pool[i];
+    s_pipe_bufs = PIPE_BUFS;
+    if (!psram_size()) return;
+    while (s_pipe_bufs < PIPE_BUFS_MAX) {
+        uint8_t *b = psram_alloc_dma(PIPE_BUF_SIZE);
+        if (!b) break;
+        s_pipe_buf[s_pipe_bufs++] = b;
+    }
+    ESP_LOGI(TAG, "pipeline ring: %d x %d KB", s_pipe_bufs,
+             PIPE_BUF_SIZE / 1024);
+}
+
+static void pipe_bufs_free(void)
+{
+    for (int i = PIPE_BUFS; i < s_pipe_bufs; i++) {
+        free(s_pipe_buf[i]);
+        s_pipe_buf[i] = NULL;
+    }
+    s_pipe_bufs = PIPE_BUFS;
+}
+
+static int pipe_start(const struct payload_arch *pa, int image)
+{
+    if (!s_pipe_free) s_pipe_free = xQueueCreate(PIPE_BUFS_MAX, sizeof(int));
+    if (!s_pipe_full) s_pipe_full = xQueueCreate(PIPE_BUFS_MAX + 2, sizeof(struct pipe_msg));
+    if (!s_pipe_free || !s_pipe_full) return -1;
+    xQueueReset(s_pipe_free);
+    xQueueReset(s_pipe_full);
+    pipe_bufs_alloc();
+    for (int i = 0; i < s_pipe_bufs; i++)
+        xQueueSend(s_pipe_free, &i, 0);
+
+    s_pipe_abort = 0;
+    s_pipe_arch = pa;
+    s_pipe_image = image;
+    if (xTaskCreatePinnedToCore(inflate_task, "inflate", PIPE_STACK, NULL,
+                                uxTaskPriorityGet(NULL), NULL,
+                                INFLATE_CORE) != pdPASS) {
+        pipe_bufs_free();
+        return -1;
+    }
+    return 0;
+}
+
+/* Write the current file's buffers until its PIPE_END. Returns 0, or
+ * -1 on a write or inflate failure. */
+static int pipe_write_file(write_fn write, int stream_handle,
+                           uint32_t orig_size)
+{
+    uint32_t total_out = 0;
+    for (;;) {
+        struct pipe_msg m;
+        xQueueReceive(s_pipe_full, &m, portMAX_DELAY);
+        if (m.kind != PIPE_DATA) {
+            if (m.kind != PIPE_END) return -1;
+            break;
+        }
+        int err = write(stream_handle, s_pipe_buf[m.buf], m.len);
+        xQueueSend(s_pipe_free, &m.buf, 0);
+        if (err != 0) return -1;
+        total_out += m.len;
+    }
     if (total_out != orig_size) {
         ESP_LOGW(TAG, "Size mismatch: got %lu, expected %lu",
                  (unsigned long)total_out, (unsigned long)orig_size);
@@ -75,97 +359,931 @@ static int decompress_and_write(int stream_handle,
     return 0;
 }
 
-static int s_last_format_pct = -1;
+/* Stop the inflate task (it may be blocked on a full ring) and wait
+ * until it is gone */
+static void pipe_stop(void)
+{
+    s_pipe_abort = 1;
+    for (;;) {
+        struct pipe_msg m;
+        xQueueReceive(s_pipe_full, &m, portMAX_DELAY);
+        if (m.kind == PIPE_EXIT) break;
+        if (m.kind == PIPE_DATA) xQueueSend(s_pipe_free, &m.buf, 0);
+    }
+    pipe_bufs_free();
+}
 
-static void format_progress(int current, int total)
+/* ---- Inline decoding ---- */
+
+/* Decode and write on this task, when the inflate task cannot be
+ * started. Output is gathered into the (idle) ring's first buffer, so
+ * the writer sees the same 16KB blocks as from the pipeline. */
+static write_fn s_direct_write;
+static int s_direct_handle;
+static uint32_t s_direct_fill;
+
+static int direct_flush(void)
 {
-    if (total <= 0) return;
-    int pct = current * 100 / total;
-    if (pct == s_last_format_pct) return;
-    s_last_format_pct = pct;
-    ui_update_progress("Formatting FAT32...", pct, 100);
+    if (s_direct_fill == 0) return 0;
+    uint32_t n = s_direct_fill;
+    s_direct_fill = 0;
+    return s_direct_write(s_direct_handle, s_pipe_pool[0], n);
 }
 
-int flasher_run(const char *arch)
+static int IRAM_ATTR direct_emit(const uint8_t *data, uint32_t len)
 {
-    ESP_LOGI(TAG, "Starting flash sequence for %s", arch);
+    while (len > 0) {
+        uint32_t n = PIPE_BUF_SIZE - s_direct_fill;
+        if (n > len) n = len;
+        memcpy(s_pipe_pool[0] + s_direct_fill, data, n);
+        s_direct_fill += n;
+        data += n;
+        len -= n;
+        if (s_direct_fill == PIPE_BUF_SIZE && direct_flush() != 0)
+            return -1;
+    }
+    return 0;
+}
 
-    const struct payload_arch *pa = payload_get_arch_by_name(arch);
-    if (!pa) {
-        ESP_LOGE(TAG, "Architecture '%s' not found in payload", arch);
-        return -1;
+static int decompress_and_write(write_fn write, int stream_handle,
+                                const struct payload_arch *pa,
+                                const struct payload_file *pf)
+{
+    s_direct_write = write;
+    s_direct_handle = stream_handle;
+    s_direct_fill = 0;
+    if (decode_source(pa, pf, direct_emit) != 0) return -1;
+    return direct_flush();
+}
+
+/* ---- Progress task ---- */
+
+struct progress_msg {
+    char status[64];
+    int current, total;         /* total < 0: stop */
+};
+
+static QueueHandle_t s_progress_q;  /* one slot, newest wins */
+static TaskHandle_t s_progress_owner;
+
+static void progress_task(void *arg)
+{
+    (void)arg;
+    for (;;) {
+        struct progress_msg m;
+        xQueueReceive(s_progress_q, &m, portMAX_DELAY);
+        if (m.total < 0) break;
+        ui_update_progress(m.status, m.current, m.total);
     }
+    xTaskNotifyGive(s_progress_owner);
+    vTaskDelete(NULL);
+}
 
-    uint64_t card_size = sdcard_size();
-    ESP_LOGI(TAG, "SD card: %llu MB", (unsigned long long)(card_size / (1024 * 1024)));
+/* Drawn on the progress task when it runs, directly otherwise */
+static void progress_post(const char *status, int current, int total)
+{
+    if (!s_progress_owner) {
+        ui_update_progress(status, current, total);
+        return;
+    }
+    struct progress_msg m;
+    snprintf(m.status, sizeof(m.status), "%s", status);
+    m.current = current;
+    m.total = total;
+    xQueueOverwrite(s_progress_q, &m);
+}
 
-    /* Step 1: Create GPT */
-    s_last_format_pct = -1;
-    ui_update_progress("Creating partition table...", 0, pa->file_count + 2);
-    if (gpt_create(card_size) != 0) {
-        ESP_LOGE(TAG, "GPT creation failed");
-        return -1;
+static void progress_start(void)
+{
+    if (!s_progress_q) s_progress_q = xQueueCreate(1, sizeof(struct progress_msg));
+    if (!s_progress_q) return;
+    xQueueReset(s_progress_q);
+    s_progress_owner = xTaskGetCurrentTaskHandle();
+    if (xTaskCreate(progress_task, "progress", PIPE_STACK, NULL,
+                    tskIDLE_PRIORITY + 1, NULL) != pdPASS)
+        s_progress_owner = NULL;
+}
+
+/* Let the last update finish drawing: the display is ours again after */
+static void progress_stop(void)
+{
+    if (!s_progress_owner) return;
+    struct progress_msg m = { "", 0, -1 };
+    xQueueOverwrite(s_progress_q, &m);
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    s_progress_owner = NULL;
+}
+
+/* ---- Throughput ---- */
+
+static void log_rate(const char *what, uint64_t bytes, int64_t us)
+{
+    uint64_t centi = us > 0 ? bytes * 100 / (uint64_t)us : 0; /* MB/s x 100 */
+    ESP_LOGI(TAG, "%s: %llu bytes in %lld ms, %llu.%02llu MB/s", what,
+             (unsigned long long)bytes, (long long)(us / 1000),
+             (unsigned long long)(centi / 100), (unsigned long long)(centi % 100));
+}
+
+static int null_emit(const uint8_t *data, uint32_t len)
+{
+    (void)data;
+    (void)len;
+    return 0;
+}
+
+int flasher_bench_inflate(const struct payload_arch *pa, int image,
+                          uint64_t *bytes, int64_t *us)
+{
+    int err = 0;
+    *bytes = 0;
+    int64_t t0 = esp_timer_get_time();
+    if (image) {
+        err = decode_source(pa, NULL, null_emit);
+        *bytes = pa->image.original_size;
+    }
+    for (int i = 0; i < pa->file_count && !image && !err; i++) {
+        if (!file_streamed(&pa->files[i])) continue;
+        err = decode_source(pa, &pa->files[i], null_emit);
+        *bytes += pa->files[i].original_size;
     }
+    *us = esp_timer_get_time() - t0;
+    return err ? -1 : 0;
+}
 
-    /* Step 2: Format FAT32 */
-    ui_update_progress("Formatting FAT32...", 0, 100);
-    uint32_t esp_start = gpt_esp_start_lba();
-    uint32_t esp_sectors = gpt_esp_size_sectors();
-    if (fat32_format(esp_start, esp_sectors, format_progress) != 0) {
-        ESP_LOGE(TAG, "FAT32 format failed");
-        return -1;
+/* Decode what is about to be written without writing it, for the
+ * inflate rate on its own next to the end-to-end one */
+static void bench_inflate(const struct payload_arch *pa, int image)
+{
+#ifdef CONFIG_SURVIVAL_FLASH_BENCH
+    uint64_t bytes;
+    int64_t us;
+    if (flasher_bench_inflate(pa, image, &bytes, &us) != 0) {
+        ESP_LOGW(TAG, "Inflate benchmark: decode failed");
+        return;
     }
+    log_rate("Inflate only", bytes, us);
+#else
+    (void)pa;
+    (void)image;
+#endif
+}
 
-    /* Step 3: Write each file */
-    for (int i = 0; i < pa->file_count; i++) {
+static int s_last_format_pct = -1;
+
+static void format_progress(int current, int total)
+{
+    if (total <= 0) return;
+    int pct = current * 100 / total;
+    if (pct == s_last_format_pct) return;
+    s_last_format_pct = pct;
+    ui_update_progress("Formatting FAT32...", pct, 100);
+}
+
+/* Write each file, inflating on the other core. Returns 0 on success. */
+static int write_files(const struct payload_arch *pa)
+{
+    bench_inflate(pa, 0);
+    int64_t t0 = esp_timer_get_time();
+    uint64_t bytes = 0;
+    int pipelined = pipe_start(pa, 0) == 0;
+    if (!pipelined)
+        ESP_LOGW(TAG, "No inflate task: decompressing inline");
+    progress_start();
+
+    int failed = 0;
+    for (int i = 0; i < pa->file_count && !failed; i++) {
         const struct payload_file *pf = &pa->files[i];
         ESP_LOGI(TAG, "Writing: %s (%lu bytes)", pf->path, (unsigned long)pf->original_size);
 
         char msg[64];
         snprintf(msg, sizeof(msg), "Writing: %.40s", pf->path);
-        ui_update_progress(msg, i + 2, pa->file_count + 2);
+        progress_post(msg, i + 2, pa->file_count + 2);
 
+        bytes += pf->original_size;
         const uint8_t *data = payload_file_data(pa, pf);
         if (!data) {
             ESP_LOGE(TAG, "Failed to get data for %s", pf->path);
-            return -1;
+            failed = 1;
+            break;
         }
 
-        if (pf->compressed_size > 0) {
-            /* Compressed — use streaming decompress + write */
+        if (file_streamed(pf)) {
+            /* Chunked — decode each chunk and stream it out */
             int handle = fat32_stream_open(pf->path, pf->original_size);
             if (handle < 0) {
                 ESP_LOGE(TAG, "Stream open failed for %s", pf->path);
-                return -1;
+                failed = 1;
+                break;
             }
-            if (decompress_and_write(handle, data, pf->compressed_size, pf->original_size) != 0) {
+            int err = pipelined
+                ? pipe_write_file(fat32_stream_write, handle, pf->original_size)
+                : decompress_and_write(fat32_stream_write, handle, pa, pf);
+            if (err != 0) {
                 ESP_LOGE(TAG, "Decompress+write failed for %s", pf->path);
-                return -1;
+                failed = 1;
+                break;
             }
             if (fat32_stream_close(handle) != 0) {
                 ESP_LOGE(TAG, "Stream close failed for %s", pf->path);
-                return -1;
+                failed = 1;
+                break;
             }
         } else {
-            /* Uncompressed — direct write */
+            /* Stored whole (v1) or empty — direct write */
             if (fat32_write_file(pf->path, data, pf->original_size) != 0) {
                 ESP_LOGE(TAG, "Write failed for %s", pf->path);
-                return -1;
+                failed = 1;
+                break;
             }
         }
     }
 
-    ui_update_progress("Verifying...", pa->file_count + 2, pa->file_count + 2);
+    if (pipelined) pipe_stop();
+    progress_stop();
+    if (failed) return -1;
+    log_rate("Wrote files", bytes, esp_timer_get_time() - t0);
+    return 0;
+}
+
+/* ---- Image mode ---- */
+
+static uint32_t s_image_done, s_image_total;
+static int s_image_pct;
+
+/* fat32_image_write, with a progress update per percent */
+static int image_write(int handle, const void *data, uint32_t len)
+{
+    if (fat32_image_write(handle, data, len) != 0) return -1;
+    s_image_done += len;
+    int pct = (int)((uint64_t)s_image_done * 100 / s_image_total);
+    if (pct != s_image_pct) {
+        s_image_pct = pct;
+        progress_post("Writing image...", pct, 100);
+    }
+    return 0;
+}
+
+/* Write the arch's pre-built image. Returns 0 on success, 1 if it does
+ * not fit this volume (nothing written: the caller writes the files one
+ * by one instead), -1 on failure. */
+static int write_image(const struct payload_arch *pa)
+{
+    const struct payload_image *im = &pa->image;
+    if (im->chunk_count == 0 || im->original_size == 0) return 1;
+    int handle = fat32_image_open(im->spc, im->fat_entries,
+                                  im->extents, im->extent_count);
+    if (handle < 0) return 1;
+
+    ESP_LOGI(TAG, "Writing image: %lu bytes in %lu extents",
+             (unsigned long)im->original_size, (unsigned long)im->extent_count);
+    s_image_done = 0;
+    s_image_total = im->original_size;
+    s_image_pct = -1;
+
+    bench_inflate(pa, 1);
+    int64_t t0 = esp_timer_get_time();
+    int pipelined = pipe_start(pa, 1) == 0;
+    if (!pipelined)
+        ESP_LOGW(TAG, "No inflate task: decompressing inline");
+    progress_start();
+    int err = pipelined
+        ? pipe_write_file(image_write, handle, im->original_size)
+        : decompress_and_write(image_write, handle, pa, NULL);
+    if (pipelined) pipe_stop();
+    progress_stop();
+    if (fat32_image_close(handle) != 0) err = -1;
+    if (err) {
+        ESP_LOGE(TAG, "Image write failed");
+        return -1;
+    }
+    log_rate("Wrote image", im->original_size, esp_timer_get_time() - t0);
+    return 0;
+}
+
+/* ---- Verify ---- */
+
+/* The write is over, so the pipeline's pool is free to read back into:
+ * a whole chunk per fat32_file_read, which goes to the card as
+ * multi-block reads of the file's contiguous clusters */
+#define VERIFY_BUF_SIZE (PIPE_BUFS * PIPE_BUF_SIZE)
+#if VERIFY_BUF_SIZE < PAYLOAD_CHUNK_SIZE
+#error "a chunk must fit the verify buffer"
+#endif
+
+/* Check one file on the card. 0 if it matches, 1 if it has nothing to
+ * check against (a v1 compressed file), -1 if it differs or cannot be
+ * read. */
+static int verify_file(const struct payload_arch *pa,
+                       const struct payload_file *pf, uint64_t *bytes)
+{
+    uint8_t *buf = s_pipe_pool[0];
+    int fh = fat32_file_open(pf->path);
+    if (fh < 0) {
+        ESP_LOGE(TAG, "Verify: %s not found", pf->path);
+        return -1;
+    }
+    int ret = 0;
+    if (fat32_file_size(fh) != pf->original_size) {
+        ESP_LOGE(TAG, "Verify: %s is %lu bytes, expected %lu", pf->path,
+                 (unsigned long)fat32_file_size(fh),
+                 (unsigned long)pf->original_size);
+        ret = -1;
+    } else if (file_streamed(pf)) {
+        uint32_t ofs = 0;
+        for (uint32_t i = 0; i < pf->chunk_count && ret == 0; i++) {
+            struct payload_chunk c;
+            if (payload_file_chunk(pa, pf, i, &c) != 0) {
+                ret = -1;
+                break;
+            }
+            if (!c.has_crc) {
+                ret = 1;
+                break;
+            }
+            if (c.original_size > VERIFY_BUF_SIZE ||
+                fat32_file_read(fh, buf, c.original_size) != (int)c.original_size) {
+                ESP_LOGE(TAG, "Verify: %s: read failed at %lu", pf->path,
+                         (unsigned long)ofs);
+                ret = -1;
+            } else if (esp_rom_crc32_le(0, buf, c.original_size) != c.crc32) {
+                ESP_LOGE(TAG, "Verify: %s: CRC mismatch in bytes %lu..%lu",
+                         pf->path, (unsigned long)ofs,
+                         (unsigned long)(ofs + c.original_size - 1));
+                ret = -1;
+            }
+            ofs += c.original_size;
+            *bytes += c.original_size;
+        }
+    } else {
+        /* Stored whole: the payload holds the very bytes */
+        const uint8_t *want = payload_file_data(pa, pf);
+        for (uint32_t ofs = 0; ofs < pf->original_size && ret == 0; ) {
+            uint32_t n = pf->original_size - ofs;
+            if (n > VERIFY_BUF_SIZE) n = VERIFY_BUF_SIZE;
+            if (!want || fat32_file_read(fh, buf, n) != (int)n) {
+                ESP_LOGE(TAG, "Verify: %s: read failed at %lu", pf->path,
+                         (unsigned long)ofs);
+                ret = -1;
+            } else if (memcmp(buf, want + ofs, n) != 0) {
+                ESP_LOGE(TAG, "Verify: %s differs in bytes %lu..%lu", pf->path,
+                         (unsigned long)ofs, (unsigned long)(ofs + n - 1));
+                ret = -1;
+            }
+            ofs += n;
+            *bytes += n;
+        }
+    }
+    fat32_file_close(fh);
+    return ret;
+}
+
+/* Read every file back. Returns how many differ or cannot be read, or
+ * -1 if the volume itself does not mount. */
+static int verify_files(const struct payload_arch *pa, uint32_t esp_start)
+{
+    if (fat32_read_init(esp_start) != 0) {
+        ESP_LOGE(TAG, "Verify: the new volume does not mount");
+        return -1;
+    }
+
+    int64_t t0 = esp_timer_get_time();
+    uint64_t bytes = 0;
+    int bad = 0, unchecked = 0;
+    progress_start();
+    for (int i = 0; i < pa->file_count; i++) {
+        const struct payload_file *pf = &pa->files[i];
+        char msg[64];
+        snprintf(msg, sizeof(msg), "Verifying: %.38s", pf->path);
+        progress_post(msg, i + 1, pa->file_count);
+        int r = verify_file(pa, pf, &bytes);
+        if (r < 0) bad++;
+        else if (r > 0) unchecked++;
+    }
+    progress_stop();
+
+    log_rate("Verified", bytes, esp_timer_get_time() - t0);
+    if (unchecked)
+        ESP_LOGW(TAG, "Verify: %d files have no CRC to check (v1 payload)",
+                 unchecked);
+    if (bad)
+        ESP_LOGE(TAG, "Verify: %d of %d files differ", bad, pa->file_count);
+    else
+        ESP_LOGI(TAG, "Verification passed");
+    return bad;
+}
+
+/* ---- Batch mode ----
+ *
+ * Flashing a run of identical cards: the first card of a capacity is
+ * flashed as usual with the card's write journal on (sdcard.h). Every
+ * metadata sector it wrote (GPT, boot sectors, FSInfo, FATs, directory
+ * clusters) is kept in a map by LBA, last write winning, with zeros and
+ * erases as bare ranges; the file data only leaves where it went. The
+ * next card with the same size and allocation unit gets the map written
+ * in LBA order, then the same data stream inflated straight into those
+ * places: no layout, no FAT zeroing beyond the ranges the format left
+ * zero, no directory searches or FAT updates. The map lives in PSRAM
+ * when there is any; one that outgrows BATCH_POOL_MAX is dropped and
+ * every card is flashed in full. */
+
+#define BATCH_POOL_MAX   (2 * 1024 * 1024)  /* metadata bytes, with PSRAM */
+#define BATCH_POOL_SMALL (96 * 1024)        /* without */
+#define BATCH_ZERO       0xFFFFFFFFu        /* a run of zeros */
+#define BATCH_SECTOR     512
+#define BATCH_WIN        (VERIFY_BUF_SIZE / BATCH_SECTOR)
+#define BATCH_ERASE_MIN  2048               /* as fat32.c's ERASE_MIN */
+#define BATCH_ERASE_MAX  65536              /* and its ERASE_BATCH */
+
+/* Sectors [lba, lba + count): their bytes at pool + off, or zeros */
+struct batch_run {
+    uint32_t lba, count;
+    uint32_t off;
+};
+
+/* Where the data stream went, in stream order */
+struct batch_ext {
+    uint32_t lba, count;
+};
+
+static struct {
+    int on;                             /* batch mode */
+    int valid;                          /* a complete template below */
+    int broken;                         /* recording gave up */
+    const struct payload_arch *pa;
+    uint64_t card_size;
+    uint32_t au;
+    int image;                          /* data is the image stream */
+    uint32_t skip;                      /* its FAT head, which the runs hold */
+    struct batch_run *runs;             /* by LBA, disjoint */
+    uint32_t nruns, runs_cap;
+    struct batch_ext *ext;
+    uint32_t next, ext_cap;
+    uint8_t *pool;
+    uint32_t pool_used, pool_cap;
+} s_batch;
+
+/* Drop the map, keeping what it was for */
+static void batch_free(void)
+{
+    free(s_batch.runs);
+    free(s_batch.ext);
+    free(s_batch.pool);
+    s_batch.runs = NULL;
+    s_batch.ext = NULL;
+    s_batch.pool = NULL;
+    s_batch.nruns = s_batch.runs_cap = 0;
+    s_batch.next = s_batch.ext_cap = 0;
+    s_batch.pool_used = s_batch.pool_cap = 0;
+    s_batch.valid = 0;
+}
+
+void flasher_set_batch(int on)
+{
+    batch_free();
+    s_batch.on = on;
+    s_batch.pa = NULL;
+    s_batch.broken = 0;
+}
+
+/* Grow a table of n entries of size bytes to hold one more */
+static int batch_grow(void **tab, uint32_t *cap, uint32_t n, size_t size)
+{
+    if (n < *cap) return 0;
+    uint32_t c = *cap ? *cap * 2 : 64;
+    void *t = psram_alloc(c * size);
+    if (!t) return -1;
+    if (*tab) {
+        memcpy(t, *tab, n * size);
+        free(*tab);
+    }
+    *tab = t;
+    *cap = c;
+    return 0;
+}
+
+/* Keep len bytes in the pool. Growing it drops the bytes of sectors
+ * written over since. Returns their offset, or BATCH_ZERO if the pool
+ * is full. */
+static uint32_t batch_keep(const void *data, uint32_t len)
+{
+    if (s_batch.pool_used + len > s_batch.pool_cap) {
+        uint32_t live = 0;
+        for (uint32_t i = 0; i < s_batch.nruns; i++)
+            if (s_batch.runs[i].off != BATCH_ZERO)
+                live += s_batch.runs[i].count * BATCH_SECTOR;
+        uint32_t max = psram_size() ? BATCH_POOL_MAX : BATCH_POOL_SMALL;
+        uint32_t cap = s_batch.pool_cap ? s_batch.pool_cap : 64 * 1024;
+        while (cap < (live + len) * 2 && cap < max) cap *= 2;
+        if (cap > max) cap = max;
+        if (live + len > cap) return BATCH_ZERO;
+        uint8_t *pool = psram_alloc(cap);
+        if (!pool) return BATCH_ZERO;
+        uint32_t used = 0;
+        for (uint32_t i = 0; i < s_batch.nruns; i++) {
+            struct batch_run *r = &s_batch.runs[i];
+            if (r->off == BATCH_ZERO) continue;
+            memcpy(pool + used, s_batch.pool + r->off, r->count * BATCH_SECTOR);
+            r->off = used;
+            used += r->count * BATCH_SECTOR;
+        }
+        free(s_batch.pool);
+        s_batch.pool = pool;
+        s_batch.pool_used = used;
+        s_batch.pool_cap = cap;
+    }
+    uint32_t off = s_batch.pool_used;
+    memcpy(s_batch.pool + off, data, len);
+    s_batch.pool_used += len;
+    return off;
+}
+
+/* Put [lba, lba + count) in the map over whatever it held */
+static int batch_put(uint32_t lba, uint32_t count, uint32_t off)
+{
+    uint32_t end = lba + count, n = s_batch.nruns;
+    struct batch_run *r = s_batch.runs;
+    uint32_t i = 0, j, k;
+    while (i < n && r[i].lba + r[i].count <= lba) i++;
+    for (j = i; j < n && r[j].lba < end; j++)
+        ;
+
+    /* What is left of the first and last runs overlapped */
+    struct batch_run left, right;
+    int has_left = i < j && r[i].lba < lba;
+    int has_right = i < j && r[j - 1].lba + r[j - 1].count > end;
+    if (has_left) {
+        left = r[i];
+        left.count = lba - left.lba;
+    }
+    if (has_right) {
+        right = r[j - 1];
+        uint32_t cut = end - right.lba;
+        right.lba = end;
+        right.count -= cut;
+        if (right.off != BATCH_ZERO) right.off += cut * BATCH_SECTOR;
+    }
+
+    uint32_t with = (uint32_t)has_left + 1 + (uint32_t)has_right;
+    while (n - (j - i) + with > s_batch.runs_cap)
+        if (batch_grow((void **)&s_batch.runs, &s_batch.runs_cap,
+                       s_batch.runs_cap, sizeof(struct batch_run)) != 0)
+            return -1;
+    r = s_batch.runs;
+    memmove(&r[i + with], &r[j], (n - j) * sizeof(struct batch_run));
+    k = i;
+    if (has_left) r[k++] = left;
+    r[k].lba = lba;
+    r[k].count = count;
+    r[k].off = off;
+    if (has_right) r[k + 1] = right;
+    s_batch.nruns = n - (j - i) + with;
+    return 0;
+}
+
+static int all_zero(const uint8_t *p, uint32_t len)
+{
+    for (uint32_t i = 0; i < len; i++)
+        if (p[i]) return 0;
+    return 1;
+}
+
+/* sdcard_journal_fn while the first card of a batch is flashed */
+static void batch_note(uint32_t lba, uint32_t count, const void *data, int kind)
+{
+    if (s_batch.broken) return;
+    if (kind == SDCARD_J_DATA) {
+        struct batch_ext *e = s_batch.next ? &s_batch.ext[s_batch.next - 1] : NULL;
+        if (e && e->lba + e->count == lba) {
+            e->count += count;
+            return;
+        }
+        if (batch_grow((void **)&s_batch.ext, &s_batch.ext_cap, s_batch.next,
+                       sizeof(struct batch_ext)) != 0) {
+            s_batch.broken = 1;
+            return;
+        }
+        s_batch.ext[s_batch.next].lba = lba;
+        s_batch.ext[s_batch.next].count = count;
+        s_batch.next++;
+        return;
+    }
+
+    /* Metadata is written before the data it describes, never over it */
+    for (uint32_t i = 0; i < s_batch.next; i++) {
+        const struct batch_ext *e = &s_batch.ext[i];
+        if (lba < e->lba + e->count && e->lba < lba + count) {
+            ESP_LOGW(TAG, "Batch: metadata over file data at LBA %lu",
+                     (unsigned long)lba);
+            s_batch.broken = 1;
+            return;
+        }
+    }
+    uint32_t off = BATCH_ZERO;
+    uint32_t len = count * BATCH_SECTOR;
+    if (kind == SDCARD_J_META && !all_zero(data, len)) {
+        off = batch_keep(data, len);
+        if (off == BATCH_ZERO) {
+            ESP_LOGW(TAG, "Batch: metadata outgrew %lu KB; flashing each card in full",
+                     (unsigned long)(s_batch.pool_cap / 1024));
+            s_batch.broken = 1;
+            return;
+        }
+    }
+    if (batch_put(lba, count, off) != 0) s_batch.broken = 1;
+}
+
+/* Whether the map (or its failure) is for this arch on the card just
+ * inserted */
+static int batch_same(const struct payload_arch *pa)
+{
+    return s_batch.pa == pa && s_batch.card_size == sdcard_size() &&
+           s_batch.au == sdcard_au_sectors();
+}
+
+/* Start the map over for this card */
+static void batch_record(const struct payload_arch *pa)
+{
+    batch_free();
+    s_batch.pa = pa;
+    s_batch.card_size = sdcard_size();
+    s_batch.au = sdcard_au_sectors();
+    s_batch.broken = 0;
+    s_batch.image = 0;
+    s_batch.skip = 0;
+    sdcard_set_journal(batch_note);
+}
+
+/* ---- Batch replay ---- */
+
+/* The stream's place: extent s_rep_ext, s_rep_done sectors into it */
+static uint32_t s_rep_ext, s_rep_done, s_rep_skip;
+static uint8_t __attribute__((aligned(4))) s_rep_tail[BATCH_SECTOR];
+static uint32_t s_rep_tail_len;
+
+/* Write count sectors of the stream at its place */
+static int rep_put(const uint8_t *data, uint32_t count)
+{
+    while (count > 0) {
+        if (s_rep_ext >= s_batch.next) {
+            ESP_LOGE(TAG, "Batch: data past its last extent");
+            return -1;
+        }
+        const struct batch_ext *e = &s_batch.ext[s_rep_ext];
+        uint32_t n = e->count - s_rep_done;
+        if (n > count) n = count;
+        if (sdcard_write_data(e->lba + s_rep_done, n, data) != 0) return -1;
+        data += n * BATCH_SECTOR;
+        count -= n;
+        s_rep_done += n;
+        if (s_rep_done == e->count) {
+            s_rep_ext++;
+            s_rep_done = 0;
+        }
+    }
+    return 0;
+}
+
+/* write_fn for a replayed stream: whole sectors go straight from the
+ * ring buffer; only a sector split between buffers is staged */
+static int rep_write(int handle, const void *data, uint32_t len)
+{
+    (void)handle;
+    const uint8_t *p = (const uint8_t *)data;
+    if (s_rep_skip) {
+        uint32_t n = len < s_rep_skip ? len : s_rep_skip;
+        s_rep_skip -= n;
+        p += n;
+        len -= n;
+    }
+    if (s_rep_tail_len && len) {
+        uint32_t n = BATCH_SECTOR - s_rep_tail_len;
+        if (n > len) n = len;
+        memcpy(s_rep_tail + s_rep_tail_len, p, n);
+        s_rep_tail_len += n;
+        p += n;
+        len -= n;
+        if (s_rep_tail_len < BATCH_SECTOR) return 0;
+        s_rep_tail_len = 0;
+        if (rep_put(s_rep_tail, 1) != 0) return -1;
+    }
+    uint32_t whole = len / BATCH_SECTOR;
+    if (whole && rep_put(p, whole) != 0) return -1;
+    len -= whole * BATCH_SECTOR;
+    if (len) {
+        memcpy(s_rep_tail, p + whole * BATCH_SECTOR, len);
+        s_rep_tail_len = len;
+    }
+    return 0;
+}
+
+/* A file of the stream is complete: its last sector goes out padded,
+ * as fat32_stream_close() left it */
+static int rep_end(void)
+{
+    if (!s_rep_tail_len) return 0;
+    memset(s_rep_tail + s_rep_tail_len, 0, BATCH_SECTOR - s_rep_tail_len);
+    s_rep_tail_len = 0;
+    return rep_put(s_rep_tail, 1);
+}
+
+/* Zero [lba, lba + count) as fat32_format() does: erases while the
+ * card takes them, else writes from buf (BATCH_WIN sectors, clobbered) */
+static int rep_zero(uint32_t lba, uint32_t count, uint8_t *buf)
+{
+    int erase = count >= BATCH_ERASE_MIN;
+    int zeroed = 0;
+    while (count > 0) {
+        uint32_t n;
+        if (erase) {
+            n = count > BATCH_ERASE_MAX ? BATCH_ERASE_MAX : count;
+            if (sdcard_erase(lba, n) != 0) {
+                erase = 0;
+                continue;
+            }
+        } else {
+            n = count > BATCH_WIN ? BATCH_WIN : count;
+            if (!zeroed) {
+                memset(buf, 0, BATCH_WIN * BATCH_SECTOR);
+                zeroed = 1;
+            }
+            if (sdcard_write(lba, n, buf) != 0) return -1;
+        }
+        lba += n;
+        count -= n;
+    }
+    return 0;
+}
+
+/* Write the map in LBA order, gathering adjacent runs into multi-block
+ * writes through the (idle) pipeline pool */
+static int rep_metadata(void)
+{
+    uint8_t *buf = s_pipe_pool[0];
+    uint32_t win_lba = 0, win_n = 0;
+    for (uint32_t i = 0; i < s_batch.nruns; i++) {
+        const struct batch_run *r = &s_batch.runs[i];
+        if (r->off == BATCH_ZERO) {
+            if (win_n && sdcard_write(win_lba, win_n, buf) != 0) return -1;
+            win_n = 0;
+            if (rep_zero(r->lba, r->count, buf) != 0) return -1;
+            continue;
+        }
+        for (uint32_t k = 0; k < r->count; ) {
+            if (win_n && (win_lba + win_n != r->lba + k || win_n == BATCH_WIN)) {
+                if (sdcard_write(win_lba, win_n, buf) != 0) return -1;
+                win_n = 0;
+            }
+            if (!win_n) win_lba = r->lba + k;
+            uint32_t n = r->count - k;
+            if (n > BATCH_WIN - win_n) n = BATCH_WIN - win_n;
+            memcpy(buf + win_n * BATCH_SECTOR,
+                   s_batch.pool + r->off + k * BATCH_SECTOR, n * BATCH_SECTOR);
+            win_n += n;
+            k += n;
+        }
+    }
+    if (win_n && sdcard_write(win_lba, win_n, buf) != 0) return -1;
+    return 0;
+}
+
+/* Flash a card from the template. Returns 0 on success. */
+static int batch_replay(const struct payload_arch *pa)
+{
+    ESP_LOGI(TAG, "Batch: %lu metadata runs (%lu KB), %lu data extents",
+             (unsigned long)s_batch.nruns, (unsigned long)(s_batch.pool_used / 1024),
+             (unsigned long)s_batch.next);
+    int64_t t0 = esp_timer_get_time();
+    ui_update_progress("Writing metadata...", 0, 100);
+    if (rep_metadata() != 0) {
+        ESP_LOGE(TAG, "Batch: metadata write failed");
+        return -1;
+    }
+
+    s_rep_ext = s_rep_done = s_rep_tail_len = 0;
+    s_rep_skip = s_batch.skip;
+    int pipelined = pipe_start(pa, s_batch.image) == 0;
+    if (!pipelined)
+        ESP_LOGW(TAG, "No inflate task: decompressing inline");
+    progress_start();
+
+    int err = 0;
+    uint64_t bytes = 0;
+    if (s_batch.image) {
+        progress_post("Writing image...", 50, 100);
+        err = pipelined
+            ? pipe_write_file(rep_write, 0, pa->image.original_size)
+            : decompress_and_write(rep_write, 0, pa, NULL);
+        if (!err) err = rep_end();
+        bytes = pa->image.original_size;
+    }
+    for (int i = 0; i < pa->file_count && !s_batch.image && !err; i++) {
+        const struct payload_file *pf = &pa->files[i];
+        if (!file_streamed(pf)) continue;   /* the map holds it whole */
+        char msg[64];
+        snprintf(msg, sizeof(msg), "Writing: %.40s", pf->path);
+        progress_post(msg, i + 1, pa->file_count);
+        err = pipelined
+            ? pipe_write_file(rep_write, 0, pf->original_size)
+            : decompress_and_write(rep_write, 0, pa, pf);
+        if (!err) err = rep_end();
+        bytes += pf->original_size;
+    }
+    if (pipelined) pipe_stop();
+    progress_stop();
+
+    if (!err && (s_rep_ext != s_batch.next || s_rep_done != 0)) {
+        ESP_LOGE(TAG, "Batch: the stream ended before its extents");
+        err = -1;
+    }
+    if (err) {
+        ESP_LOGE(TAG, "Batch: data write failed");
+        return -1;
+    }
+    log_rate("Batch card written", bytes, esp_timer_get_time() - t0);
+    return 0;
+}
+
+/* Steps 1 to 3 on the card just inserted. Sets *image if the data went
+ * out as the pre-built image. Returns 0 on success. */
+static int write_card(const struct payload_arch *pa, int *image)
+{
+    uint64_t card_size = sdcard_size();
+    ESP_LOGI(TAG, "SD card: %llu MB", (unsigned long long)(card_size / (1024 * 1024)));
+
+    /* Step 1: Create GPT */
+    s_last_format_pct = -1;
+    ui_update_progress("Creating partition table...", 0, pa->file_count + 2);
+    if (gpt_create(card_size) != 0) {
+        ESP_LOGE(TAG, "GPT creation failed");
+        return -1;
+    }
+
+    /* Step 2: Format FAT32 */
+    ui_update_progress("Formatting FAT32...", 0, 100);
+    if (fat32_format(gpt_esp_start_lba(), gpt_esp_size_sectors(),
+                     format_progress) != 0) {
+        ESP_LOGE(TAG, "FAT32 format failed");
+        return -1;
+    }
+
+    /* Step 3: the pre-built image if it fits, else each file */
+    int files = 1;
+    if (pa->has_image) {
+        files = write_image(pa);
+        if (files < 0) return -1;
+        if (files > 0)
+            ESP_LOGW(TAG, "Image does not fit this volume: writing files");
+    }
+    if (files && write_files(pa) != 0) return -1;
+    *image = !files;
+    return 0;
+}
+
+int flasher_run(const char *arch)
+{
+    ESP_LOGI(TAG, "Starting flash sequence for %s", arch);
+
+    const struct payload_arch *pa = payload_get_arch_by_name(arch);
+    if (!pa) {
+        ESP_LOGE(TAG, "Architecture '%s' not found in payload", arch);
+        return -1;
+    }
+
+    /* In a batch: the map of an earlier card like this one, or a new
+     * map from this card (unless one for it already failed) */
+    int record = 0;
+    if (s_batch.on && batch_same(pa) && s_batch.valid) {
+        if (batch_replay(pa) != 0) return -1;
+    } else {
+        record = s_batch.on && !(batch_same(pa) && s_batch.broken);
+        if (record) batch_record(pa);
+        int image = 0;
+        int err = write_card(pa, &image);
+        sdcard_set_journal(NULL);
+        if (err) {
+            if (record) batch_free();
+            s_batch.pa = NULL;
+            return -1;
+        }
+        if (record && image) {
+            s_batch.image = 1;
+            s_batch.skip = (pa->image.fat_entries * 4 + BATCH_SECTOR - 1) /
+                           BATCH_SECTOR * BATCH_SECTOR;
+        }
+    }
 
-    /* Quick verify: read back the BPB and check signature */
-    static uint8_t __attribute__((aligned(4))) verify_buf[512];
-    if (sdcard_read(esp_start, 1, verify_buf) == 0) {
-        if (verify_buf[510] == 0x55 && verify_buf[511] == 0xAA) {
-            ESP_LOGI(TAG, "Verification passed");
+    /* Step 4: read it all back */
+    int bad = verify_files(pa, gpt_esp_start_lba());
+    if (record) {
+        if (bad == 0 && !s_batch.broken) {
+            s_batch.valid = 1;
+            ESP_LOGI(TAG, "Batch: cards like this one get its map");
         } else {
-            ESP_LOGW(TAG, "BPB signature mismatch");
+            batch_free();
+            if (bad) s_batch.pa = NULL;     /* try the next card afresh */
         }
     }
+    if (bad != 0) return bad;
 
     ESP_LOGI(TAG, "Flash complete: %d files written", pa->file_count);
     return 0;
@@ -4,10 +4,27 @@
 #ifndef FLASHER_H
 #define FLASHER_H
 
+#include <stdint.h>
+#include "payload.h"
+
 /* Run the full flash sequence for the given architecture.
  * arch: "aarch64" or "x86_64"
  * SD card must be initialized before calling.
- * Returns 0 on success. */
+ * Returns 0 on success, -1 if the flash failed, or the number of files
+ * that read back differently from the payload. */
 int flasher_run(const char *arch);
 
+/* Batch mode: while on, the first card of each size flashed records
+ * the metadata it was given (partition table, boot sectors, FATs,
+ * directories) and where the file data went, and later cards of that
+ * size and allocation unit get the same sectors written straight from
+ * the record, then the data. Off drops the record. */
+void flasher_set_batch(int on);
+
+/* Decode the arch's image (image != 0) or its streamed files without
+ * writing them anywhere, checking each chunk's CRC. Sets *bytes to what
+ * was inflated and *us to how long it took. Returns 0 on success. */
+int flasher_bench_inflate(const struct payload_arch *pa, int image,
+                          uint64_t *bytes, int64_t *us);
+
 #endif /* FLASHER_H */
@@ -0,0 +1,107 @@
+/*
+ * fs_port.h — What the Part 1 filesystem code expects from boot.h,
+ * fs.h and mem.h, for the ESP32
+ *
+ * src/exfat.c, src/dirsort.c, src/runmap.c and src/bcache.h are built
+ * unchanged for the firmware; under ESP_PLATFORM they include this
+ * header instead of the UEFI ones. It also sizes the exFAT driver for a
+ * heap of a few hundred KB: the UEFI defaults assume gigabytes.
+ */
+#ifndef FS_PORT_H
+#define FS_PORT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef uint8_t  UINT8;
+typedef uint16_t UINT16;
+typedef uint32_t UINT32;
+typedef uint64_t UINT64;
+typedef size_t   UINTN;
+typedef char     CHAR8;
+
+/* What bcache_invalidate() returns, as in efi.h */
+typedef UINTN    EFI_STATUS;
+#define EFI_SUCCESS      0
+#define EFI_DEVICE_ERROR ((EFI_STATUS)1 << (sizeof(EFI_STATUS) * 8 - 1) | 7)
+#define EFI_ERROR(a)     ((intptr_t)(a) < 0)
+
+/* ---- fs.h ---- */
+
+#define FS_MAX_NAME 128
+
+#define FS_ATTR_READ_ONLY 0x01
+#define FS_ATTR_HIDDEN    0x02
+#define FS_ATTR_SYSTEM    0x04
+#define FS_ATTR_ARCHIVE   0x20
+
+struct fs_entry {
+    char     name[FS_MAX_NAME];
+    UINT64   size;
+    UINT64   id;        /* first cluster; 0 if none */
+    UINT32   mtime;     /* last change, FAT/exFAT packed form; 0 if unknown */
+    UINT32   ctime;     /* creation, the same; 0 if unknown */
+    UINT8    is_dir;
+    UINT8    attr;      /* FS_ATTR_* */
+};
+
+struct fs_extent {
+    UINT64 offset;
+    UINT64 pos;
+    UINT64 length;
+};
+
+typedef int (*fs_run_fn)(void *ctx, UINT64 lba, UINT64 count);
+
+/* ---- mem.h ---- */
+
+/* mem_alloc() memory starts zeroed, as on UEFI */
+static inline void *mem_alloc(UINTN size) { return calloc(1, size); }
+static inline void mem_free(void *p) { free(p); }
+static inline void mem_set(void *dst, UINT8 val, UINTN size)
+{
+    memset(dst, val, size);
+}
+static inline void mem_copy(void *dst, const void *src, UINTN size)
+{
+    memcpy(dst, src, size);
+}
+static inline UINT64 mem_popcount(const void *data, UINTN size)
+{
+    const UINT8 *p = (const UINT8 *)data;
+    UINT64 n = 0;
+    while (size--)
+        n += (UINT64)__builtin_popcount(*p++);
+    return n;
+}
+static inline UINTN str_len(const CHAR8 *s) { return strlen(s); }
+static inline void str_copy(char *dst, const char *src, UINTN max)
+{
+    UINTN i = 0;
+    while (i < max - 1 && src[i]) {
+        dst[i] = src[i];
+        i++;
+    }
+    dst[i] = '\0';
+}
+
+/* ---- exFAT sizing ---- */
+
+/* Two directory indexes of at most 512 entry sets (about 13 KB each);
+   bigger directories are searched linearly */
+#define DIR_INDEX_SLOTS   2
+#define DIR_INDEX_MAX     512
+
+/* Two 4 KB pages of allocation bitmap resident (65536 clusters) */
+#define BITMAP_PAGE_SIZE  4096
+#define BITMAP_PAGE_SLOTS 2
+
+/* Directory sectors read per SD request (dir_iter_map) */
+#define DIR_RUN_BYTES     8192
+
+/* Largest single SD read, and the write buffer of exfat_create() */
+#define EXFAT_DEFAULT_MAX_XFER (64 * 1024)
+
+#endif /* FS_PORT_H */
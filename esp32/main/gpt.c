@@ -214,3 +214,58 @@ uint32_t gpt_esp_size_sectors(void)
 {
     return esp_size;
 }
+
+uint32_t gpt_find_partition(void)
+{
+    /* Read MBR (sector 0) */
+    if (sdcard_read(0, 1, s_buf) != 0)
+        return 0; /* superfloppy fallback */
+
+    /* Check MBR signature */
+    if (s_buf[510] != 0x55 || s_buf[511] != 0xAA)
+        return 0; /* no valid MBR — try superfloppy */
+
+    /* First partition entry at offset 446 */
+    uint8_t *pe = s_buf + 446;
+    uint8_t ptype = pe[4];
+
+    uint32_t start_lba = (uint32_t)pe[8]
+                       | ((uint32_t)pe[9]  << 8)
+                       | ((uint32_t)pe[10] << 16)
+                       | ((uint32_t)pe[11] << 24);
+
+    if (ptype == 0xEE) {
+        /* GPT protective MBR — read GPT header at LBA 1 */
+        if (sdcard_read(1, 1, s_buf) != 0)
+            return 0;
+
+        /* Verify "EFI PART" signature */
+        if (memcmp(s_buf, "EFI PART", 8) != 0)
+            return 0;
+
+        /* Partition entry LBA is at offset 72 (8 bytes, little-endian) */
+        uint32_t entry_lba = (uint32_t)s_buf[72]
+                            | ((uint32_t)s_buf[73] << 8)
+                            | ((uint32_t)s_buf[74] << 16)
+                            | ((uint32_t)s_buf[75] << 24);
+
+        /* Read first partition entry */
+        if (sdcard_read(entry_lba, 1, s_buf) != 0)
+            return 0;
+
+        /* Starting LBA is at offset 32 in the entry (8 bytes LE) */
+        uint32_t part_lba = (uint32_t)s_buf[32]
+                          | ((uint32_t)s_buf[33] << 8)
+                          | ((uint32_t)s_buf[34] << 16)
+                          | ((uint32_t)s_buf[35] << 24);
+        return part_lba;
+    }
+
+    if (ptype == 0x0B || ptype == 0x0C || ptype == 0x07) {
+        /* FAT32 (0x0B/0x0C) or exFAT/NTFS (0x07) */
+        return start_lba;
+    }
+
+    /* Unknown partition type — try superfloppy */
+    return 0;
+}
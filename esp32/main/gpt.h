@@ -18,4 +18,9 @@ uint32_t gpt_esp_start_lba(void);
 /* Returns the size of the EFI System Partition in sectors. */
 uint32_t gpt_esp_size_sectors(void);
 
+/* Find the first partition on the card, going by its MBR: the first
+ * GPT entry behind a protective MBR, or a FAT32/exFAT MBR entry.
+ * Returns its starting LBA, or 0 (superfloppy) if there is none. */
+uint32_t gpt_find_partition(void);
+
 #endif /* GPT_H */
@@ -228,4 +228,40 @@ static const uint8_t icon_gear[128] = {
     0x00,0x00,0x00,0x00,
 };
 
+/* Gauge icon (benchmarks) */
+static const uint8_t icon_gauge[128] = {
+    0x00,0x00,0x00,0x00,
+    0x00,0x00,0x00,0x00,
+    0x00,0x00,0x00,0x00,
+    0x00,0x00,0x00,0x00,
+    0x00,0x00,0x00,0x00,
+    0x00,0x0F,0xF0,0x00, /*             ########             */
+    0x00,0x7F,0xFE,0x00, /*          ##############          */
+    0x00,0xFF,0xFF,0x00, /*         ################         */
+    0x03,0xF9,0x9F,0xC0, /*       #######  ##  #######       */
+    0x07,0xC1,0x83,0xE0, /*      #####     ##     #####      */
+    0x0F,0x81,0x81,0xF0, /*     #####      ##      #####     */
+    0x1F,0x81,0x87,0xF8, /*    ######      ##    ########    */
+    0x1F,0xC0,0x0F,0xF8, /*    #######          #########    */
+    0x3D,0xC0,0x1F,0xBC, /*   #### ###         ###### ####   */
+    0x38,0x40,0x1E,0x1C, /*   ###    #         ####    ###   */
+    0x78,0x00,0x38,0x1E, /*  ####             ###      ####  */
+    0x70,0x00,0x70,0x0E, /*  ###             ###        ###  */
+    0x70,0x00,0xF0,0x0E, /*  ###            ####        ###  */
+    0x70,0x03,0xE0,0x0E, /*  ###          #####         ###  */
+    0x7C,0x03,0xC0,0x3E, /*  #####        ####        #####  */
+    0x70,0x07,0xE0,0x0E, /*  ###         ######         ###  */
+    0x00,0x03,0xC0,0x00, /*               ####               */
+    0x00,0x03,0xC0,0x00, /*               ####               */
+    0x00,0x00,0x00,0x00,
+    0x7F,0xFF,0xFF,0xFE, /*  ##############################  */
+    0x7F,0xFF,0xFF,0xFE, /*  ##############################  */
+    0x00,0x00,0x00,0x00,
+    0x00,0x00,0x00,0x00,
+    0x00,0x00,0x00,0x00,
+    0x00,0x00,0x00,0x00,
+    0x00,0x00,0x00,0x00,
+    0x00,0x00,0x00,0x00,
+};
+
 #endif /* ICONS_H */
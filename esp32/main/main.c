@@ -7,8 +7,9 @@
  *   - SD card slot on SPI3
  *   - 4MB flash with compressed workstation images
  *
- * Boot sequence: init display → init touch → init settings →
- * read payload manifest → detect chip → show splash → home screen loop.
+ * Boot sequence: detect PSRAM → init display → init touch → init settings →
+ * init NVS → read payload manifest → detect chip → show splash → home
+ * screen loop.
  */
 
 #include <stdio.h>
@@ -17,13 +18,16 @@
 #include "freertos/task.h"
 #include "esp_log.h"
 #include "esp_chip_info.h"
+#include "nvs_flash.h"
 
+#include "psram.h"
 #include "display.h"
 #include "touch.h"
 #include "payload.h"
 #include "settings.h"
 #include "app.h"
 #include "ui.h"
+#include "replay.h"
 
 static const char *TAG = "main";
 
@@ -47,9 +51,23 @@ void app_main(void)
     ESP_LOGI(TAG, "=== Survival Workstation v2.0 ===");
 
     /* Initialize peripherals */
+    psram_init();
     display_init();
     touch_init();
     settings_init();
+#ifdef CONFIG_SURVIVAL_TOUCH_REPLAY
+    replay_load();          /* before any app takes the card */
+#endif
+
+    /* NVS records where a Wi-Fi update left the payload */
+    esp_err_t err = nvs_flash_init();
+    if (err == ESP_ERR_NVS_NO_FREE_PAGES || err == ESP_ERR_NVS_NEW_VERSION_FOUND) {
+        ESP_LOGW(TAG, "NVS partition unreadable: erasing it");
+        nvs_flash_erase();
+        err = nvs_flash_init();
+    }
+    if (err != ESP_OK)
+        ESP_LOGW(TAG, "NVS init failed: %s", esp_err_to_name(err));
 
     /* Read payload manifest from flash partition (non-fatal) */
     int payload_ok = payload_init();
@@ -3,6 +3,15 @@
  *
  * Uses esp_partition_mmap() to memory-map the payload partition, then
  * parses the manifest header to find per-architecture file lists.
+ * Chunk descriptions are read from the mapped index on demand.
+ *
+ * The header is at the start of the partition unless a Wi-Fi update
+ * has moved it: a v2 payload's offsets are from the start of the
+ * partition wherever its header is, so an update writes its new chunks
+ * and tables into sectors the live payload does not use, keeps the
+ * chunks that did not change where they are, and then records the new
+ * header's offset in NVS. Until that one write the old payload is
+ * untouched and stays in use.
  */
 
 #include "payload.h"
@@ -10,6 +19,8 @@
 #include <string.h>
 #include "esp_partition.h"
 #include "esp_log.h"
+#include "esp_rom_crc.h"
+#include "nvs.h"
 
 static const char *TAG = "payload";
 
@@ -17,77 +28,378 @@ static const char *TAG = "payload";
 #pragma pack(1)
 struct payload_header {
     uint8_t  magic[4];     /* "SURV" */
-    uint8_t  version;      /* 1 */
+    uint8_t  version;      /* 1 or 2 */
     uint8_t  arch_count;
-    uint16_t reserved;
+    uint16_t flags;        /* PAYLOAD_FLAG_* */
 };
 
+/* An image table (one offset per arch, 0 = none) follows the arch table */
+#define PAYLOAD_FLAG_IMAGES 0x0001
+/* v2: then a struct payload_dict_entry; deflate chunks use its dictionary */
+#define PAYLOAD_FLAG_DICT   0x0002
+
 struct payload_arch_entry {
     char     name[16];
     uint32_t offset;       /* from start of payload to this arch's data */
     uint32_t file_count;
 };
 
+struct payload_dict_entry {
+    uint32_t offset;       /* from start of payload */
+    uint32_t size;         /* at most PAYLOAD_DICT_MAX */
+};
+
 struct payload_file_entry {
     char     path[128];
     uint32_t compressed_size;
     uint32_t original_size;
 };
+
+/* v2: an arch's data starts with this, then its manifest */
+struct payload_arch_v2 {
+    uint32_t chunk_table;  /* from start of payload */
+    uint32_t chunk_count;
+};
+
+struct payload_file_entry_v2 {
+    char     path[128];
+    uint32_t stored_size;  /* all its chunks */
+    uint32_t original_size;
+    uint32_t first_chunk;
+    uint32_t chunk_count;
+};
+
+struct payload_chunk_entry {
+    uint32_t offset;       /* from start of payload */
+    uint32_t stored_size;
+    uint32_t original_size;
+    uint32_t crc32;
+};
+
+struct payload_image_header {
+    uint8_t  magic[4];     /* "SIMG" */
+    uint8_t  sectors_per_cluster;
+    uint8_t  reserved[3];
+    uint32_t fat_entries;
+    uint32_t extent_count;
+    uint32_t compressed_size;
+    uint32_t original_size;
+    /* struct fat32_extent[extent_count], then the stream */
+};
+
+struct payload_image_header_v2 {
+    uint8_t  magic[4];     /* "SIMG" */
+    uint8_t  sectors_per_cluster;
+    uint8_t  reserved[3];
+    uint32_t fat_entries;
+    uint32_t extent_count;
+    uint32_t first_chunk;  /* in the arch's chunk index */
+    uint32_t chunk_count;
+    uint32_t original_size;
+    /* struct fat32_extent[extent_count] */
+};
 #pragma pack()
 
+/* NVS record of where a Wi-Fi update put the payload */
+#define ROOT_NAMESPACE "payload"
+#define ROOT_KEY       "root"
+
+struct payload_root_record {
+    uint32_t root;         /* offset of the header in the partition */
+    uint32_t root_crc;     /* payload_meta_crc() of the payload there */
+    uint32_t base_crc;     /* the same for offset 0, 0 if none, at commit */
+};
+
 static const uint8_t *payload_base = NULL;
 static size_t payload_size = 0;
+static uint32_t s_root = 0;
+static int s_version = 0;
 static int s_arch_count = 0;
 static struct payload_arch s_arches[PAYLOAD_MAX_ARCHES];
+static const uint8_t *s_dict = NULL;
+static uint32_t s_dict_size = 0;
 
-int payload_init(void)
+/* Fill arch->image from the image at offset, if there is a sound one */
+static void parse_image(struct payload_arch *arch, uint32_t offset)
 {
-    /* Find the payload partition */
-    const esp_partition_t *part = esp_partition_find_first(
-        ESP_PARTITION_TYPE_DATA, 0x40, NULL);
-    if (!part) {
-        ESP_LOGE(TAG, "Payload partition not found");
-        return -1;
+    arch->has_image = 0;
+    size_t hdr_size = s_version >= 2 ? sizeof(struct payload_image_header_v2)
+                                     : sizeof(struct payload_image_header);
+    if (offset == 0 || offset % 4 != 0 || offset + hdr_size > payload_size)
+        return;
+    const struct payload_image_header *ih =
+        (const struct payload_image_header *)(payload_base + offset);
+    if (memcmp(ih->magic, "SIMG", 4) != 0) {
+        ESP_LOGW(TAG, "  %s: bad image magic", arch->name);
+        return;
     }
 
-    ESP_LOGI(TAG, "Payload partition: offset=0x%lx, size=0x%lx",
-             (unsigned long)part->address, (unsigned long)part->size);
-    payload_size = part->size;
+    uint32_t ext_ofs = offset + (uint32_t)hdr_size;
+    uint32_t data_ofs = ext_ofs + ih->extent_count * (uint32_t)sizeof(struct fat32_extent);
+    uint32_t stored = 0;    /* v2: chunks are checked as they are looked up */
+    if (s_version < 2)
+        stored = ih->compressed_size ? ih->compressed_size : ih->original_size;
+    if (ih->extent_count > payload_size / sizeof(struct fat32_extent) ||
+        data_ofs > payload_size || stored > payload_size - data_ofs) {
+        ESP_LOGW(TAG, "  %s: image truncated", arch->name);
+        return;
+    }
 
-    /* Memory-map the entire partition */
-    esp_partition_mmap_handle_t mmap_handle;
-    esp_err_t ret = esp_partition_mmap(part, 0, part->size,
-                                        ESP_PARTITION_MMAP_DATA,
-                                        (const void **)&payload_base,
-                                        &mmap_handle);
-    if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "mmap failed: %s", esp_err_to_name(ret));
+    arch->image.spc = ih->sectors_per_cluster;
+    arch->image.fat_entries = ih->fat_entries;
+    arch->image.extent_count = ih->extent_count;
+    arch->image.extents = (const struct fat32_extent *)(payload_base + ext_ofs);
+    arch->image.data_offset = data_ofs;
+    if (s_version >= 2) {
+        const struct payload_image_header_v2 *ih2 =
+            (const struct payload_image_header_v2 *)ih;
+        if ((uint64_t)ih2->first_chunk + ih2->chunk_count > arch->chunk_total) {
+            ESP_LOGW(TAG, "  %s: image chunks out of range", arch->name);
+            return;
+        }
+        arch->image.first_chunk = ih2->first_chunk;
+        arch->image.chunk_count = ih2->chunk_count;
+        arch->image.original_size = ih2->original_size;
+        arch->image.compressed_size = 0;
+        for (uint32_t i = 0; i < ih2->chunk_count; i++) {
+            struct payload_chunk c;
+            if (payload_image_chunk(arch, i, &c) == 0)
+                arch->image.compressed_size += c.stored_size;
+        }
+    } else {
+        arch->image.first_chunk = 0;
+        arch->image.chunk_count = ih->original_size ? 1 : 0;
+        arch->image.compressed_size = ih->compressed_size;
+        arch->image.original_size = ih->original_size;
+    }
+    arch->has_image = 1;
+    ESP_LOGI(TAG, "  %s: image of %lu clusters, %lu extents", arch->name,
+             (unsigned long)ih->fat_entries, (unsigned long)ih->extent_count);
+}
+
+static void parse_arch_v1(struct payload_arch *arch, uint32_t offset)
+{
+    /* Parse file manifest for this arch */
+    const uint8_t *arch_data = payload_base + offset;
+    const struct payload_file_entry *file_entries =
+        (const struct payload_file_entry *)arch_data;
+
+    uint32_t data_offset = (uint32_t)(arch->file_count * sizeof(struct payload_file_entry));
+
+    for (int f = 0; f < arch->file_count; f++) {
+        memcpy(arch->files[f].path, file_entries[f].path, 128);
+        arch->files[f].path[127] = '\0';
+        arch->files[f].compressed_size = file_entries[f].compressed_size;
+        arch->files[f].original_size = file_entries[f].original_size;
+        arch->files[f].data_offset = data_offset;
+        arch->files[f].first_chunk = 0;
+        arch->files[f].chunk_count = file_entries[f].original_size ? 1 : 0;
+
+        /* Advance past this file's data */
+        uint32_t stored = file_entries[f].compressed_size > 0
+                        ? file_entries[f].compressed_size
+                        : file_entries[f].original_size;
+        data_offset += stored;
+    }
+
+    arch->data_start = offset +
+        (uint32_t)(arch->file_count * sizeof(struct payload_file_entry));
+    arch->chunk_table = 0;
+    arch->chunk_total = 0;
+}
+
+static void parse_arch_v2(struct payload_arch *arch, uint32_t offset)
+{
+    const struct payload_arch_v2 *ah =
+        (const struct payload_arch_v2 *)(payload_base + offset);
+    const struct payload_file_entry_v2 *file_entries =
+        (const struct payload_file_entry_v2 *)(ah + 1);
+
+    arch->chunk_table = ah->chunk_table;
+    arch->chunk_total = ah->chunk_count;
+    if (ah->chunk_table > payload_size ||
+        ah->chunk_count > (payload_size - ah->chunk_table) /
+                          sizeof(struct payload_chunk_entry)) {
+        ESP_LOGW(TAG, "  %s: chunk index out of range", arch->name);
+        arch->chunk_total = 0;
+    }
+
+    for (int f = 0; f < arch->file_count; f++) {
+        memcpy(arch->files[f].path, file_entries[f].path, 128);
+        arch->files[f].path[127] = '\0';
+        /* Nonzero for any file with data: the flasher streams all of them
+         * through the chunk decoder, which checks each CRC */
+        arch->files[f].compressed_size = file_entries[f].stored_size;
+        arch->files[f].original_size = file_entries[f].original_size;
+        arch->files[f].data_offset = 0;
+        arch->files[f].first_chunk = file_entries[f].first_chunk;
+        arch->files[f].chunk_count = file_entries[f].chunk_count;
+    }
+    arch->data_start = offset;
+}
+
+/* ---- Spans ---- */
+
+typedef void (*span_fn)(uint32_t ofs, uint32_t len, void *ctx);
+
+/* Call fn for each part of the v2 payload at root that describes it, in
+ * the order pack_payload.py's meta_spans() lists them: the header and
+ * its tables, the dictionary, then per arch the manifest, chunk index
+ * and image header with its extents. With chunks, then each chunk's
+ * stored bytes too. Returns -1 if root holds no v2 payload or a part
+ * falls outside the partition. */
+static int walk_spans(uint32_t root, int chunks, span_fn fn, void *ctx)
+{
+    if (root % 4 != 0 || root > payload_size ||
+        payload_size - root < sizeof(struct payload_header))
+        return -1;
+    const struct payload_header *hdr =
+        (const struct payload_header *)(payload_base + root);
+    if (memcmp(hdr->magic, "SURV", 4) != 0 || hdr->version != 2)
         return -1;
+
+    uint32_t n = hdr->arch_count;
+    uint32_t table_end = (uint32_t)(sizeof(struct payload_header) +
+                                    n * sizeof(struct payload_arch_entry));
+    uint32_t images_at = table_end, dict_at = table_end;
+    if (hdr->flags & PAYLOAD_FLAG_IMAGES) {
+        table_end += n * (uint32_t)sizeof(uint32_t);
+        dict_at = table_end;
+    }
+    if (hdr->flags & PAYLOAD_FLAG_DICT)
+        table_end += (uint32_t)sizeof(struct payload_dict_entry);
+    if (table_end > payload_size - root) return -1;
+    fn(root, table_end, ctx);
+
+    if (hdr->flags & PAYLOAD_FLAG_DICT) {
+        const struct payload_dict_entry *de =
+            (const struct payload_dict_entry *)(payload_base + root + dict_at);
+        if (de->offset > payload_size || de->size > payload_size - de->offset)
+            return -1;
+        fn(de->offset, de->size, ctx);
+    }
+
+    const struct payload_arch_entry *at =
+        (const struct payload_arch_entry *)(hdr + 1);
+    for (uint32_t a = 0; a < n; a++) {
+        uint32_t ofs = at[a].offset;
+        if (ofs > payload_size ||
+            at[a].file_count > (payload_size - ofs) / sizeof(struct payload_file_entry_v2))
+            return -1;
+        uint32_t len = (uint32_t)(sizeof(struct payload_arch_v2) +
+                       at[a].file_count * sizeof(struct payload_file_entry_v2));
+        if (len > payload_size - ofs) return -1;
+        fn(ofs, len, ctx);
+
+        const struct payload_arch_v2 *ah =
+            (const struct payload_arch_v2 *)(payload_base + ofs);
+        if (ah->chunk_table > payload_size ||
+            ah->chunk_count > (payload_size - ah->chunk_table) /
+                              sizeof(struct payload_chunk_entry))
+            return -1;
+        fn(ah->chunk_table, ah->chunk_count *
+                            (uint32_t)sizeof(struct payload_chunk_entry), ctx);
+
+        if (hdr->flags & PAYLOAD_FLAG_IMAGES) {
+            uint32_t img = ((const uint32_t *)(payload_base + root + images_at))[a];
+            if (img != 0) {
+                const struct payload_image_header_v2 *ih =
+                    (const struct payload_image_header_v2 *)(payload_base + img);
+                if (img > payload_size || payload_size - img < sizeof(*ih) ||
+                    ih->extent_count > (payload_size - img - sizeof(*ih)) /
+                                       sizeof(struct fat32_extent))
+                    return -1;
+                fn(img, (uint32_t)(sizeof(*ih) + ih->extent_count *
+                                   sizeof(struct fat32_extent)), ctx);
+            }
+        }
+    }
+
+    for (uint32_t a = 0; chunks && a < n; a++) {
+        const struct payload_arch_v2 *ah =
+            (const struct payload_arch_v2 *)(payload_base + at[a].offset);
+        const struct payload_chunk_entry *e =
+            (const struct payload_chunk_entry *)(payload_base + ah->chunk_table);
+        for (uint32_t i = 0; i < ah->chunk_count; i++) {
+            if (e[i].offset > payload_size ||
+                e[i].stored_size > payload_size - e[i].offset)
+                return -1;
+            fn(e[i].offset, e[i].stored_size, ctx);
+        }
     }
+    return 0;
+}
+
+static void span_crc(uint32_t ofs, uint32_t len, void *ctx)
+{
+    uint32_t *crc = (uint32_t *)ctx;
+    *crc = esp_rom_crc32_le(*crc, payload_base + ofs, len);
+}
+
+/* payload_meta_crc() of the payload at root, 0 if there is none */
+static uint32_t meta_crc_at(uint32_t root)
+{
+    uint32_t crc = 0;
+    if (walk_spans(root, 0, span_crc, &crc) != 0) return 0;
+    return crc;
+}
+
+struct span_map {
+    uint8_t *map;
+    uint32_t sectors;
+};
 
+static void span_mark(uint32_t ofs, uint32_t len, void *ctx)
+{
+    struct span_map *m = (struct span_map *)ctx;
+    if (len == 0) return;
+    for (uint32_t s = ofs / PAYLOAD_SECTOR_SIZE;
+         s <= (ofs + len - 1) / PAYLOAD_SECTOR_SIZE && s < m->sectors; s++)
+        m->map[s / 8] |= (uint8_t)(1 << (s % 8));
+}
+
+static int load_root(struct payload_root_record *rec)
+{
+    nvs_handle_t h;
+    if (nvs_open(ROOT_NAMESPACE, NVS_READONLY, &h) != ESP_OK) return -1;
+    size_t len = sizeof(*rec);
+    esp_err_t err = nvs_get_blob(h, ROOT_KEY, rec, &len);
+    nvs_close(h);
+    return err == ESP_OK && len == sizeof(*rec) ? 0 : -1;
+}
+
+/* Parse the payload whose header is at root */
+static int parse_payload(uint32_t root)
+{
     /* Parse header */
-    if (payload_size < sizeof(struct payload_header)) return -1;
-    const struct payload_header *hdr = (const struct payload_header *)payload_base;
+    if (root > payload_size || payload_size - root < sizeof(struct payload_header))
+        return -1;
+    const struct payload_header *hdr =
+        (const struct payload_header *)(payload_base + root);
 
     if (memcmp(hdr->magic, "SURV", 4) != 0) {
         ESP_LOGE(TAG, "Bad magic: %02x%02x%02x%02x",
                  hdr->magic[0], hdr->magic[1], hdr->magic[2], hdr->magic[3]);
         return -1;
     }
-    if (hdr->version != 1) {
+    if (hdr->version != 1 && hdr->version != 2) {
         ESP_LOGE(TAG, "Unknown version: %d", hdr->version);
         return -1;
     }
+    s_version = hdr->version;
 
     s_arch_count = hdr->arch_count;
     if (s_arch_count > PAYLOAD_MAX_ARCHES)
         s_arch_count = PAYLOAD_MAX_ARCHES;
 
+    if (s_version < 2 && root != 0) return -1;     /* v1 offsets are from 0 */
+    s_root = root;
+
     ESP_LOGI(TAG, "Payload: version %d, %d architectures", hdr->version, s_arch_count);
 
     /* Parse architecture table */
     const struct payload_arch_entry *arch_table =
-        (const struct payload_arch_entry *)(payload_base + sizeof(struct payload_header));
+        (const struct payload_arch_entry *)(hdr + 1);
 
     for (int a = 0; a < s_arch_count; a++) {
         memcpy(s_arches[a].name, arch_table[a].name, 16);
@@ -96,36 +408,134 @@ int payload_init(void)
         if (s_arches[a].file_count > PAYLOAD_MAX_FILES)
             s_arches[a].file_count = PAYLOAD_MAX_FILES;
 
-        /* Parse file manifest for this arch */
-        const uint8_t *arch_data = payload_base + arch_table[a].offset;
-        const struct payload_file_entry *file_entries =
-            (const struct payload_file_entry *)arch_data;
-
-        uint32_t data_offset = (uint32_t)(s_arches[a].file_count * sizeof(struct payload_file_entry));
-
-        for (int f = 0; f < s_arches[a].file_count; f++) {
-            memcpy(s_arches[a].files[f].path, file_entries[f].path, 128);
-            s_arches[a].files[f].path[127] = '\0';
-            s_arches[a].files[f].compressed_size = file_entries[f].compressed_size;
-            s_arches[a].files[f].original_size = file_entries[f].original_size;
-            s_arches[a].files[f].data_offset = data_offset;
-
-            /* Advance past this file's data */
-            uint32_t stored = file_entries[f].compressed_size > 0
-                            ? file_entries[f].compressed_size
-                            : file_entries[f].original_size;
-            data_offset += stored;
+        if (s_version >= 2)
+            parse_arch_v2(&s_arches[a], arch_table[a].offset);
+        else
+            parse_arch_v1(&s_arches[a], arch_table[a].offset);
+
+        ESP_LOGI(TAG, "  %s: %d files", s_arches[a].name, s_arches[a].file_count);
+    }
+
+    size_t table_end = sizeof(struct payload_header) +
+                       hdr->arch_count * sizeof(struct payload_arch_entry);
+    if (hdr->flags & PAYLOAD_FLAG_IMAGES) {
+        const uint32_t *image_table =
+            (const uint32_t *)(payload_base + root + table_end);
+        for (int a = 0; a < s_arch_count; a++)
+            parse_image(&s_arches[a], image_table[a]);
+        table_end += hdr->arch_count * sizeof(uint32_t);
+    }
+
+    s_dict = NULL;
+    s_dict_size = 0;
+    if (s_version >= 2 && (hdr->flags & PAYLOAD_FLAG_DICT)) {
+        const struct payload_dict_entry *de =
+            (const struct payload_dict_entry *)(payload_base + root + table_end);
+        if (de->size > PAYLOAD_DICT_MAX || de->offset > payload_size ||
+            de->size > payload_size - de->offset) {
+            /* Its chunks would all fail their CRCs: refuse the payload */
+            ESP_LOGE(TAG, "Bad dictionary: %lu bytes at 0x%lx",
+                     (unsigned long)de->size, (unsigned long)de->offset);
+            return -1;
         }
+        s_dict = payload_base + de->offset;
+        s_dict_size = de->size;
+        ESP_LOGI(TAG, "  dictionary: %lu bytes", (unsigned long)s_dict_size);
+    }
 
-        s_arches[a].data_start = arch_table[a].offset +
-            (uint32_t)(s_arches[a].file_count * sizeof(struct payload_file_entry));
+    return 0;
+}
 
-        ESP_LOGI(TAG, "  %s: %d files", s_arches[a].name, s_arches[a].file_count);
+int payload_init(void)
+{
+    /* Find the payload partition */
+    const esp_partition_t *part = esp_partition_find_first(
+        ESP_PARTITION_TYPE_DATA, PAYLOAD_PARTITION_SUBTYPE, NULL);
+    if (!part) {
+        ESP_LOGE(TAG, "Payload partition not found");
+        return -1;
+    }
+
+    ESP_LOGI(TAG, "Payload partition: offset=0x%lx, size=0x%lx",
+             (unsigned long)part->address, (unsigned long)part->size);
+    payload_size = part->size;
+
+    /* Memory-map the entire partition */
+    esp_partition_mmap_handle_t mmap_handle;
+    esp_err_t ret = esp_partition_mmap(part, 0, part->size,
+                                        ESP_PARTITION_MMAP_DATA,
+                                        (const void **)&payload_base,
+                                        &mmap_handle);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "mmap failed: %s", esp_err_to_name(ret));
+        return -1;
+    }
+
+    /* A Wi-Fi update's payload, as long as the partition still holds
+     * what it did when the update was committed */
+    uint32_t root = 0;
+    struct payload_root_record rec;
+    if (load_root(&rec) == 0 && rec.root != 0) {
+        if (meta_crc_at(0) != rec.base_crc)
+            ESP_LOGW(TAG, "Partition rewritten since the last update: "
+                          "using the payload at 0");
+        else if (meta_crc_at(rec.root) != rec.root_crc)
+            ESP_LOGW(TAG, "Updated payload at 0x%lx is damaged: "
+                          "using the payload at 0", (unsigned long)rec.root);
+        else
+            root = rec.root;
     }
+    return parse_payload(root);
+}
+
+uint32_t payload_root(void)
+{
+    return s_root;
+}
 
+uint32_t payload_meta_crc(void)
+{
+    return payload_base ? meta_crc_at(s_root) : 0;
+}
+
+int payload_live_sectors(uint8_t *map, uint32_t sectors)
+{
+    memset(map, 0, (sectors + 7) / 8);
+    if (!payload_base) return -1;
+    struct span_map m = { map, sectors };
+    return walk_spans(s_root, 1, span_mark, &m);
+}
+
+int payload_commit_root(uint32_t root, uint32_t root_crc)
+{
+    if (!payload_base || meta_crc_at(root) != root_crc) {
+        ESP_LOGE(TAG, "No sound payload at 0x%lx to commit",
+                 (unsigned long)root);
+        return -1;
+    }
+    struct payload_root_record rec = { root, root_crc, meta_crc_at(0) };
+    nvs_handle_t h;
+    esp_err_t err = nvs_open(ROOT_NAMESPACE, NVS_READWRITE, &h);
+    if (err == ESP_OK) {
+        err = nvs_set_blob(h, ROOT_KEY, &rec, sizeof(rec));
+        if (err == ESP_OK) err = nvs_commit(h);
+        nvs_close(h);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Could not record the new payload: %s",
+                 esp_err_to_name(err));
+        return -1;
+    }
+    ESP_LOGI(TAG, "Payload at 0x%lx is live from the next boot",
+             (unsigned long)root);
     return 0;
 }
 
+int payload_version(void)
+{
+    return s_version;
+}
+
 int payload_arch_count(void)
 {
     return s_arch_count;
@@ -150,6 +560,13 @@ const uint8_t *payload_file_data(const struct payload_arch *arch,
                                   const struct payload_file *file)
 {
     if (!payload_base || !arch || !file) return NULL;
+    if (s_version >= 2) {
+        /* The first chunk's bytes (chunks of a file are adjacent) */
+        struct payload_chunk c;
+        if (file->chunk_count == 0) return payload_base + arch->data_start;
+        if (payload_file_chunk(arch, file, 0, &c) != 0) return NULL;
+        return c.data;
+    }
     /* data_start is the base of file data for this arch (absolute in payload),
      * file->data_offset is relative to that */
     /* Actually, we stored data_offset as offset from arch data block start,
@@ -158,3 +575,69 @@ const uint8_t *payload_file_data(const struct payload_arch *arch,
     return payload_base + (arch->data_start - (uint32_t)(arch->file_count * sizeof(struct payload_file_entry)))
          + file->data_offset;
 }
+
+const uint8_t *payload_image_data(const struct payload_arch *arch)
+{
+    if (!payload_base || !arch || !arch->has_image) return NULL;
+    return payload_base + arch->image.data_offset;
+}
+
+const uint8_t *payload_dictionary(uint32_t *size)
+{
+    *size = s_dict_size;
+    return s_dict;
+}
+
+/* Chunk index of the arch's table, checked against the partition */
+static int chunk_at(const struct payload_arch *arch, uint32_t index,
+                    struct payload_chunk *out)
+{
+    if (index >= arch->chunk_total) return -1;
+    const struct payload_chunk_entry *e =
+        (const struct payload_chunk_entry *)(payload_base + arch->chunk_table) + index;
+    if (e->offset > payload_size || e->stored_size > payload_size - e->offset ||
+        e->stored_size > e->original_size)
+        return -1;
+    out->data = payload_base + e->offset;
+    out->stored_size = e->stored_size;
+    out->original_size = e->original_size;
+    out->crc32 = e->crc32;
+    out->has_crc = 1;
+    return 0;
+}
+
+int payload_file_chunk(const struct payload_arch *arch,
+                       const struct payload_file *file, uint32_t index,
+                       struct payload_chunk *out)
+{
+    if (!payload_base || !arch || !file || index >= file->chunk_count)
+        return -1;
+    if (s_version >= 2)
+        return chunk_at(arch, file->first_chunk + index, out);
+
+    /* v1: the whole file is one chunk without a CRC */
+    out->data = payload_file_data(arch, file);
+    out->stored_size = file->compressed_size ? file->compressed_size
+                                             : file->original_size;
+    out->original_size = file->original_size;
+    out->crc32 = 0;
+    out->has_crc = 0;
+    return 0;
+}
+
+int payload_image_chunk(const struct payload_arch *arch, uint32_t index,
+                        struct payload_chunk *out)
+{
+    if (!payload_base || !arch || index >= arch->image.chunk_count)
+        return -1;
+    if (s_version >= 2)
+        return chunk_at(arch, arch->image.first_chunk + index, out);
+
+    out->data = payload_base + arch->image.data_offset;
+    out->stored_size = arch->image.compressed_size ? arch->image.compressed_size
+                                                   : arch->image.original_size;
+    out->original_size = arch->image.original_size;
+    out->crc32 = 0;
+    out->has_crc = 0;
+    return 0;
+}
@@ -4,20 +4,61 @@
  * The "payload" partition holds a binary blob created by pack_payload.py:
  *   Header: magic "SURV", version, arch count, arch table
  *   Per arch: file manifest (paths + sizes) + deflate-compressed file data
+ *   Optionally (pack_payload.py --image), per arch: a pre-built FAT32
+ *   image, as a used-extent list plus one deflate stream of its blocks
+ *
+ * Version 2 cuts every file and image into independently compressed
+ * chunks of PAYLOAD_CHUNK_SIZE bytes, each with its CRC-32, listed in a
+ * per-arch chunk index: any chunk can be decoded (and checked) on its
+ * own. Version 1 payloads read as one unchecked chunk per file.
+ *
+ * Chunk offsets are absolute, so identical chunks (the same file in both
+ * arches, say) are stored once and listed by each index that has them.
+ * A v2 payload may also carry a preset dictionary of up to
+ * PAYLOAD_DICT_MAX bytes that every deflate chunk was compressed
+ * against: text shared between files then costs each chunk only a
+ * back-reference.
  */
 #ifndef PAYLOAD_H
 #define PAYLOAD_H
 
 #include <stdint.h>
+#include "fat32.h"
 
 #define PAYLOAD_MAX_FILES 128
+#define PAYLOAD_CHUNK_SIZE (64 * 1024)  /* v2: original bytes per chunk */
+#define PAYLOAD_DICT_MAX   (32 * 1024)  /* one deflate window */
+
+/* One independently stored piece of a file or image */
+struct payload_chunk {
+    const uint8_t *data;       /* in the mmap'd partition */
+    uint32_t stored_size;      /* bytes at data */
+    uint32_t original_size;    /* raw deflate iff stored_size < original_size */
+    uint32_t crc32;            /* CRC-32 of the original bytes */
+    int      has_crc;          /* 0 for v1 payloads */
+};
 
 /* Per-file entry in the manifest */
 struct payload_file {
     char     path[128];        /* e.g., "EFI/BOOT/BOOTX64.EFI" */
     uint32_t compressed_size;  /* size in payload (0 = stored uncompressed) */
     uint32_t original_size;    /* actual file size */
-    uint32_t data_offset;      /* offset from start of arch data block */
+    uint32_t data_offset;      /* v1: offset from start of arch data block */
+    uint32_t first_chunk;      /* v2: index in the arch's chunk table */
+    uint32_t chunk_count;
+};
+
+/* Pre-built FAT32 image of an arch's files (see fat32_image_open()) */
+struct payload_image {
+    uint32_t spc;              /* sectors per cluster it was laid out for */
+    uint32_t fat_entries;      /* clusters 0..fat_entries-1 are in use */
+    uint32_t extent_count;
+    const struct fat32_extent *extents; /* in the mmap'd partition */
+    uint32_t compressed_size;  /* size in payload (0 = stored uncompressed) */
+    uint32_t original_size;    /* stream size: FAT head + extent data */
+    uint32_t data_offset;      /* offset from payload start to the stream */
+    uint32_t first_chunk;      /* as for files */
+    uint32_t chunk_count;
 };
 
 /* Per-architecture entry */
@@ -26,14 +67,46 @@ struct payload_arch {
     int      file_count;
     struct payload_file files[PAYLOAD_MAX_FILES];
     uint32_t data_start;       /* offset in mmap'd partition to file data */
+    int      has_image;
+    struct payload_image image;
+    uint32_t chunk_table;      /* v2: offset in payload of the chunk index */
+    uint32_t chunk_total;
 };
 
 #define PAYLOAD_MAX_ARCHES 2
 
-/* Initialize: mmap the payload partition and parse the manifest.
- * Returns 0 on success, -1 if no valid payload found. */
+#define PAYLOAD_PARTITION_SUBTYPE 0x40
+#define PAYLOAD_SECTOR_SIZE 4096        /* flash erase unit */
+
+/* Initialize: mmap the payload partition and parse the manifest (at
+ * the root payload_commit_root() last recorded, if it still checks
+ * out). NVS must be initialized. Returns 0 on success, -1 if no valid
+ * payload found. */
 int payload_init(void);
 
+/* Get the offset in the partition of the payload in use: 0, or where a
+ * Wi-Fi update put its header. */
+uint32_t payload_root(void);
+
+/* Get the CRC-32 of the live payload's header, tables, manifests, chunk
+ * indexes, dictionary and image headers: since the indexes hold each
+ * chunk's CRC, it stands for the whole payload. 0 for a v1 payload. */
+uint32_t payload_meta_crc(void);
+
+/* Set bit s of map (LSB first) for each PAYLOAD_SECTOR_SIZE sector of
+ * the partition, s < sectors, that the live payload uses. Returns 0, or
+ * -1 for a payload it cannot map (v1, or none). */
+int payload_live_sectors(uint8_t *map, uint32_t sectors);
+
+/* Make the v2 payload whose header is at root, with root_crc as its
+ * payload_meta_crc(), the one payload_init() reads from the next boot
+ * on. NVS must be initialized. Returns 0, or -1 if root does not hold
+ * that payload or it could not be recorded. */
+int payload_commit_root(uint32_t root, uint32_t root_crc);
+
+/* Get the payload format version (1 or 2). */
+int payload_version(void);
+
 /* Get the number of architectures in the payload. */
 int payload_arch_count(void);
 
@@ -48,4 +121,21 @@ const struct payload_arch *payload_get_arch_by_name(const char *name);
 const uint8_t *payload_file_data(const struct payload_arch *arch,
                                   const struct payload_file *file);
 
+/* Get a pointer to the arch's image stream, or NULL if it has none. */
+const uint8_t *payload_image_data(const struct payload_arch *arch);
+
+/* Get the preset dictionary deflate chunks start from, or NULL if the
+ * payload has none; *size is set to its length. */
+const uint8_t *payload_dictionary(uint32_t *size);
+
+/* Describe chunk index (0..file->chunk_count-1) of a file. Returns 0 on
+ * success, -1 if out of range. */
+int payload_file_chunk(const struct payload_arch *arch,
+                       const struct payload_file *file, uint32_t index,
+                       struct payload_chunk *out);
+
+/* The same for the arch's image. */
+int payload_image_chunk(const struct payload_arch *arch, uint32_t index,
+                        struct payload_chunk *out);
+
 #endif /* PAYLOAD_H */
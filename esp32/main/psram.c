@@ -0,0 +1,43 @@
+/*
+ * psram.c — Large-buffer allocation, PSRAM when present
+ */
+
+#include "psram.h"
+
+#include <stdlib.h>
+#include "esp_heap_caps.h"
+#include "esp_log.h"
+
+static const char *TAG = "psram";
+
+static size_t s_psram;
+
+void psram_init(void)
+{
+    s_psram = heap_caps_get_total_size(MALLOC_CAP_SPIRAM);
+    if (s_psram)
+        ESP_LOGI(TAG, "%u KB PSRAM for large buffers",
+                 (unsigned)(s_psram / 1024));
+    else
+        ESP_LOGI(TAG, "no PSRAM, large buffers in internal RAM");
+}
+
+size_t psram_size(void)
+{
+    return s_psram;
+}
+
+void *psram_alloc(size_t size)
+{
+    void *p = NULL;
+    if (s_psram)
+        p = heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (!p)
+        p = heap_caps_malloc(size, MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    return p;
+}
+
+void *psram_alloc_dma(size_t size)
+{
+    return heap_caps_malloc(size, MALLOC_CAP_DMA | MALLOC_CAP_INTERNAL);
+}
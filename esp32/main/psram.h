@@ -0,0 +1,30 @@
+/*
+ * psram.h — Where big buffers go: PSRAM on boards that have it
+ *
+ * WROVER and S3 boards carry 4-8 MB of PSRAM next to the ~300 KB of
+ * internal RAM. Buffers the CPU alone touches (file contents, decoded
+ * images, text view state) are taken from PSRAM there, keeping internal
+ * RAM for DMA, stacks and the hot inflate state. On a plain CYD both
+ * calls are internal malloc. Either kind of buffer is released with
+ * free().
+ */
+#ifndef PSRAM_H
+#define PSRAM_H
+
+#include <stddef.h>
+
+/* Detect PSRAM (logs what was found). Call once at boot. */
+void psram_init(void);
+
+/* Bytes of PSRAM heap, 0 if the board has none */
+size_t psram_size(void);
+
+/* A large buffer the CPU reads and writes: PSRAM when present, else
+ * internal RAM. NULL if neither has room. */
+void *psram_alloc(size_t size);
+
+/* A buffer a peripheral reads or writes directly (SD transfers):
+ * always internal, DMA-capable RAM. NULL if there is none. */
+void *psram_alloc_dma(size_t size);
+
+#endif /* PSRAM_H */
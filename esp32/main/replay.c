@@ -0,0 +1,244 @@
+/*
+ * replay.c — Touch sessions replayed from the card, timed per flow
+ *
+ * REPLAY.TXT in the root of the card's FAT32 volume holds the events
+ * CONFIG_SURVIVAL_TOUCH_LOG logs, "rec <us> <D|M|U> <x> <y>" anywhere in
+ * a line so the UART log can be copied over as it is, split into named
+ * flows by lines that start "flow <name>". Everything else is skipped.
+ *
+ * The script is read once at boot. The touch driver then takes its
+ * events from here, one each time an app asks for one, and nothing
+ * waits for the recorded times: a session runs as fast as the apps
+ * draw it, the same way every time. A flow is timed from the first
+ * event of it an app asks for to the first of the next flow (or the
+ * request after the last), so it covers the work its events set off;
+ * events ahead of the first "flow" line are replayed untimed.
+ * With CONFIG_SURVIVAL_BUS_STATS each flow also gets the bus time
+ * busstat.c estimates for it, and the full bus profile follows the
+ * per-flow table when the script runs out. The panel takes over then.
+ */
+
+#include "replay.h"
+#include "sdcard.h"
+#include "gpt.h"
+#include "fat32.h"
+#include "psram.h"
+#include "busstat.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+
+static const char *TAG = "replay";
+
+#define REPLAY_FILE      "REPLAY.TXT"
+#define REPLAY_MAX_BYTES (512 * 1024)
+#define REPLAY_FLOWS     32
+#define REPLAY_NAME      24
+
+#define ITEM_FLOW 0xff      /* a "flow" line; the other types are TOUCH_* */
+
+struct item {
+    uint8_t type;
+    int16_t x, y;           /* ITEM_FLOW: y indexes s_flows */
+};
+
+struct flow {
+    char name[REPLAY_NAME];
+    uint32_t events;
+    int64_t us;
+    uint64_t bus_ns;
+};
+
+static struct item *s_items;
+static int s_count, s_pos;
+
+static struct flow s_flows[REPLAY_FLOWS];
+static int s_nflows;
+static struct flow *s_cur;          /* the flow being timed */
+static int64_t s_cur_start, s_start;
+static uint64_t s_cur_bus;
+
+static uint64_t bus_now(void)
+{
+#ifdef CONFIG_SURVIVAL_BUS_STATS
+    return busstat_ns();
+#else
+    return 0;
+#endif
+}
+
+/* One line of the script into s_items; NUL-terminates it in place */
+static void parse_line(char *line)
+{
+    char *nl = strchr(line, '\n');
+    if (nl)
+        *nl = '\0';
+    while (*line == ' ' || *line == '\t')
+        line++;
+
+    if (strncmp(line, "flow ", 5) == 0) {
+        if (s_nflows == REPLAY_FLOWS) {
+            ESP_LOGW(TAG, "More than %d flows: the rest count as the last",
+                     REPLAY_FLOWS);
+            return;
+        }
+        struct flow *f = &s_flows[s_nflows];
+        char *name = line + 5;
+        while (*name == ' ')
+            name++;
+        size_t len = strcspn(name, "\r");
+        if (len >= sizeof(f->name))
+            len = sizeof(f->name) - 1;
+        memcpy(f->name, name, len);
+        f->name[len] = '\0';
+        s_items[s_count++] = (struct item){ ITEM_FLOW, 0, (int16_t)s_nflows++ };
+        return;
+    }
+
+    const char *rec = strstr(line, "rec ");
+    long long us;
+    char type;
+    int x, y;
+    if (!rec || sscanf(rec, "rec %lld %c %d %d", &us, &type, &x, &y) != 4)
+        return;
+    const char *t = type ? strchr("DMU", type) : NULL;
+    if (!t)
+        return;
+    s_items[s_count++] = (struct item){ (uint8_t)(t - "DMU"),
+                                        (int16_t)x, (int16_t)y };
+}
+
+bool replay_load(void)
+{
+    if (sdcard_init() != 0)
+        return false;
+
+    char *text = NULL;
+    uint32_t size = 0;
+    int f = fat32_read_init(gpt_find_partition()) == 0
+          ? fat32_file_open(REPLAY_FILE) : -1;
+    if (f >= 0) {
+        size = fat32_file_size(f);
+        if (size > REPLAY_MAX_BYTES)
+            ESP_LOGW(TAG, REPLAY_FILE " is over %d KB: not replayed",
+                     REPLAY_MAX_BYTES / 1024);
+        else if (size > 0)
+            text = psram_alloc(size + 1);
+        uint32_t got = 0;
+        while (text && got < size) {
+            int n = fat32_file_read(f, text + got, size - got);
+            if (n <= 0) {
+                free(text);
+                text = NULL;
+            } else {
+                got += (uint32_t)n;
+            }
+        }
+        fat32_file_close(f);
+    }
+    sdcard_deinit();
+    if (!text)
+        return false;
+    text[size] = '\0';
+
+    /* At most one item per line */
+    int lines = 1;
+    for (uint32_t i = 0; i < size; i++)
+        lines += text[i] == '\n';
+    s_items = psram_alloc((size_t)lines * sizeof(*s_items));
+    if (s_items) {
+        for (char *line = text; line; ) {
+            char *next = strchr(line, '\n');
+            parse_line(line);
+            line = next ? next + 1 : NULL;
+        }
+    }
+    free(text);
+
+    if (s_count == 0) {
+        free(s_items);
+        s_items = NULL;
+        return false;
+    }
+    ESP_LOGI(TAG, REPLAY_FILE ": %d events in %d flows", s_count - s_nflows,
+             s_nflows);
+    return true;
+}
+
+bool replay_active(void)
+{
+    return s_items != NULL;
+}
+
+static void flow_end(void)
+{
+    if (!s_cur)
+        return;
+    s_cur->us += esp_timer_get_time() - s_cur_start;
+    s_cur->bus_ns += bus_now() - s_cur_bus;
+    s_cur = NULL;
+}
+
+static void flow_begin(struct flow *f)
+{
+    s_cur = f;
+    s_cur_start = esp_timer_get_time();
+    s_cur_bus = bus_now();
+}
+
+static void report(void)
+{
+    int64_t total = esp_timer_get_time() - s_start;
+    printf("== Replay: " REPLAY_FILE " ==\n");
+    printf("%-24s %7s %12s %12s\n", "flow", "events", "ms", "bus est ms");
+    for (int i = 0; i < s_nflows; i++) {
+        const struct flow *f = &s_flows[i];
+        printf("%-24s %7lu %8lu.%03lu %8lu.%03lu\n", f->name,
+               (unsigned long)f->events,
+               (unsigned long)(f->us / 1000), (unsigned long)(f->us % 1000),
+               (unsigned long)(f->bus_ns / 1000000),
+               (unsigned long)(f->bus_ns / 1000 % 1000));
+    }
+    printf("%-24s %7d %8lu.%03lu\n", "total", s_count - s_nflows,
+           (unsigned long)(total / 1000), (unsigned long)(total % 1000));
+#ifdef CONFIG_SURVIVAL_BUS_STATS
+    busstat_report("replay");
+#endif
+}
+
+bool replay_next(struct touch_event *ev)
+{
+    if (!s_items)
+        return false;
+    if (s_pos == 0) {
+        s_start = esp_timer_get_time();
+#ifdef CONFIG_SURVIVAL_BUS_STATS
+        busstat_reset();
+#endif
+    }
+
+    while (s_pos < s_count) {
+        const struct item *it = &s_items[s_pos++];
+        if (it->type == ITEM_FLOW) {
+            flow_end();
+            flow_begin(&s_flows[it->y]);
+            continue;
+        }
+        if (s_cur)
+            s_cur->events++;
+        ev->type = it->type;
+        ev->x = it->x;
+        ev->y = it->y;
+        return true;
+    }
+
+    flow_end();
+    report();
+    free(s_items);
+    s_items = NULL;
+    ESP_LOGI(TAG, "Replay done: back to the panel");
+    return false;
+}
@@ -0,0 +1,26 @@
+/*
+ * replay.h — Touch sessions replayed from the card, timed per flow
+ *
+ * With CONFIG_SURVIVAL_TOUCH_REPLAY the touch driver hands out the
+ * events of REPLAY.TXT instead of the panel's until the script runs out
+ * (replay.c).
+ */
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stdbool.h>
+
+#include "touch.h"
+
+/* Read REPLAY.TXT from the card, if there is one. Call once at boot,
+ * before any app has the card. Returns true if a script was loaded. */
+bool replay_load(void);
+
+/* True while a loaded script has events left */
+bool replay_active(void);
+
+/* The script's next event. Ends the flow it was in when a new one
+ * starts; when the script runs out, reports and returns false. */
+bool replay_next(struct touch_event *ev);
+
+#endif /* REPLAY_H */
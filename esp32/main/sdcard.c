@@ -1,16 +1,33 @@
 /*
- * sdcard.c — SD card access via sdspi_host on SPI3
+ * sdcard.c — SD card access via sdspi_host on SPI3, or the SDMMC host
  *
- * CYD SD card slot pins: MOSI=23, MISO=19, CLK=18, CS=5
+ * CYD SD card slot pins: MOSI=23, MISO=19, CLK=18, CS=5. Boards that wire
+ * the slot to the SDMMC host pick that in menuconfig ("Survival board"):
+ * slot 1 on its fixed pins on the ESP32, any pins on chips with a GPIO
+ * matrix for SDMMC (ESP32-S3).
+ *
+ * The card is probed at 40 MHz first and checked with a read; if either
+ * fails, or a transfer later reports a CRC error, it is probed again at
+ * the 20 MHz default and stays there.
+ *
+ * With CONFIG_SURVIVAL_BUS_STATS each transfer that succeeds is counted
+ * (busstat.h) at the clock the card runs at.
  */
 
 #include "sdcard.h"
+#include "busstat.h"
 
 #include <string.h>
+#include "sdkconfig.h"
 #include "driver/sdspi_host.h"
 #include "driver/spi_common.h"
+#if defined(CONFIG_SURVIVAL_SD_SDMMC_1BIT) || defined(CONFIG_SURVIVAL_SD_SDMMC_4BIT)
+#include "driver/sdmmc_host.h"
+#define SD_SDMMC 1
+#endif
 #include "sdmmc_cmd.h"
 #include "esp_log.h"
+#include "esp_idf_version.h"
 
 static const char *TAG = "sdcard";
 
@@ -22,38 +39,199 @@ static const char *TAG = "sdcard";
 
 static sdmmc_card_t *card = NULL;
 static bool bus_initialized = false;
+static int card_khz;                    /* clock the card was probed at */
 
-int sdcard_init(void)
+/* Sector 0 read back after a fast probe */
+static uint8_t s_check_buf[512] __attribute__((aligned(4)));
+
+static sdcard_journal_fn s_journal;
+
+/* Bus cost of n sectors for busstat: the read or write command, and
+ * CMD12 or the stop token after several, ~16 bytes each with the wait
+ * for the response; start token, CRC and status around each sector */
+#define SD_CMDS(n)       ((n) > 1 ? 2u : 1u)
+#define SD_CMD_BYTES(n)  (SD_CMDS(n) * 16 + (n) * 4)
+#if defined(CONFIG_SURVIVAL_SD_SDMMC_4BIT)
+#define SD_LANES 4
+#else
+#define SD_LANES 1
+#endif
+
+#ifdef SD_SDMMC
+
+static bool host_slot_ready = false;
+
+static int host_open(sdmmc_host_t *host)
 {
-    if (card) return 0;  /* already initialized */
+    *host = (sdmmc_host_t)SDMMC_HOST_DEFAULT();
+    host->slot = SDMMC_HOST_SLOT_1;
+    if (bus_initialized) return 0;
+
+    ESP_LOGI(TAG, "Initializing SD card on SDMMC, %d-bit",
+#ifdef CONFIG_SURVIVAL_SD_SDMMC_4BIT
+             4
+#else
+             1
+#endif
+             );
+
+    esp_err_t ret = sdmmc_host_init();
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "SDMMC host init failed: %s", esp_err_to_name(ret));
+        return -1;
+    }
+    bus_initialized = true;
+    return 0;
+}
+
+static int slot_open(sdmmc_host_t *host)
+{
+    if (host_slot_ready) return 0;
+
+    sdmmc_slot_config_t slot = SDMMC_SLOT_CONFIG_DEFAULT();
+#ifdef CONFIG_SURVIVAL_SD_SDMMC_4BIT
+    slot.width = 4;
+#else
+    slot.width = 1;
+#endif
+#ifdef CONFIG_SURVIVAL_SD_PIN_CLK
+    slot.clk = CONFIG_SURVIVAL_SD_PIN_CLK;
+    slot.cmd = CONFIG_SURVIVAL_SD_PIN_CMD;
+    slot.d0 = CONFIG_SURVIVAL_SD_PIN_D0;
+#ifdef CONFIG_SURVIVAL_SD_SDMMC_4BIT
+    slot.d1 = CONFIG_SURVIVAL_SD_PIN_D1;
+    slot.d2 = CONFIG_SURVIVAL_SD_PIN_D2;
+    slot.d3 = CONFIG_SURVIVAL_SD_PIN_D3;
+#endif
+#endif
+    /* Boards without external pull-ups on CMD/DAT still come up */
+    slot.flags |= SDMMC_SLOT_FLAG_INTERNAL_PULLUP;
+
+    esp_err_t ret = sdmmc_host_init_slot(host->slot, &slot);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "SDMMC slot init failed: %s", esp_err_to_name(ret));
+        return -1;
+    }
+    host_slot_ready = true;
+    return 0;
+}
+
+/* The slot stays configured; probing again only re-runs card init */
+static void slot_close(void)
+{
+}
+
+#else /* SDSPI */
+
+static sdspi_dev_handle_t spi_dev = -1;
+
+static int host_open(sdmmc_host_t *host)
+{
+    *host = (sdmmc_host_t)SDSPI_HOST_DEFAULT();
+    host->slot = SPI3_HOST;
+    if (bus_initialized) return 0;
 
     ESP_LOGI(TAG, "Initializing SD card on SPI3");
 
     /* Initialize the SPI bus */
-    if (!bus_initialized) {
-        spi_bus_config_t bus_cfg = {
-            .mosi_io_num = PIN_MOSI,
-            .miso_io_num = PIN_MISO,
-            .sclk_io_num = PIN_CLK,
-            .quadwp_io_num = -1,
-            .quadhd_io_num = -1,
-            .max_transfer_sz = 65536,
-        };
-        esp_err_t ret = spi_bus_initialize(SPI3_HOST, &bus_cfg, SPI_DMA_CH_AUTO);
-        if (ret != ESP_OK) {
-            ESP_LOGE(TAG, "SPI bus init failed: %s", esp_err_to_name(ret));
-            return -1;
-        }
-        bus_initialized = true;
+    spi_bus_config_t bus_cfg = {
+        .mosi_io_num = PIN_MOSI,
+        .miso_io_num = PIN_MISO,
+        .sclk_io_num = PIN_CLK,
+        .quadwp_io_num = -1,
+        .quadhd_io_num = -1,
+        .max_transfer_sz = 65536,
+    };
+    esp_err_t ret = spi_bus_initialize(SPI3_HOST, &bus_cfg, SPI_DMA_CH_AUTO);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "SPI bus init failed: %s", esp_err_to_name(ret));
+        return -1;
     }
+    bus_initialized = true;
+    return 0;
+}
 
+static int slot_open(sdmmc_host_t *host)
+{
     /* SD card SPI device configuration */
     sdspi_device_config_t dev_cfg = SDSPI_DEVICE_CONFIG_DEFAULT();
     dev_cfg.host_id = SPI3_HOST;
     dev_cfg.gpio_cs = PIN_CS;
 
-    sdmmc_host_t host = SDSPI_HOST_DEFAULT();
-    host.slot = SPI3_HOST;
+    esp_err_t ret = sdspi_host_init_device(&dev_cfg, &spi_dev);
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "SPI device init failed: %s", esp_err_to_name(ret));
+        spi_dev = -1;
+        return -1;
+    }
+    host->slot = spi_dev;
+    return 0;
+}
+
+/* Each probe adds an SPI device; the previous one must go first */
+static void slot_close(void)
+{
+    if (spi_dev >= 0) {
+        sdspi_host_remove_device(spi_dev);
+        spi_dev = -1;
+    }
+}
+
+#endif
+
+/* Bring the card up with the host clock capped at khz */
+static int card_probe(int khz)
+{
+    sdmmc_host_t host;
+    if (host_open(&host) != 0) return -1;
+    slot_close();
+    if (slot_open(&host) != 0) return -1;
+
+    host.max_freq_khz = khz;
+    esp_err_t ret = sdmmc_card_init(&host, card);
+    if (ret != ESP_OK) {
+        ESP_LOGW(TAG, "Card init at %d kHz failed: %s",
+                 khz, esp_err_to_name(ret));
+        slot_close();
+        return -1;
+    }
+    /* Lower than asked if the card has no high-speed mode */
+    card_khz = (int)card->max_freq_khz;
+    BUSSTAT_SET_CLOCK(BUS_SD, (uint32_t)card_khz * 1000, SD_LANES);
+    return 0;
+}
+
+/* Probe fast, keep it only if a read survives; otherwise the default */
+static int card_bring_up(void)
+{
+#ifdef CONFIG_SURVIVAL_SD_HIGHSPEED
+    if (card_probe(SDMMC_FREQ_HIGHSPEED) == 0) {
+        esp_err_t ret = sdmmc_read_sectors(card, s_check_buf, 0, 1);
+        if (ret == ESP_OK) return 0;
+        ESP_LOGW(TAG, "Read at %d kHz failed: %s",
+                 SDMMC_FREQ_HIGHSPEED, esp_err_to_name(ret));
+    }
+#endif
+    return card_probe(SDMMC_FREQ_DEFAULT);
+}
+
+/* A transfer failed with ret: if the clock is above the default and the
+   error looks like signal trouble, drop to the default and say whether
+   the transfer is worth one more try */
+static bool slow_down(esp_err_t ret)
+{
+    if (card_khz <= SDMMC_FREQ_DEFAULT) return false;
+    if (ret != ESP_ERR_INVALID_CRC && ret != ESP_ERR_TIMEOUT &&
+        ret != ESP_ERR_INVALID_RESPONSE)
+        return false;
+    ESP_LOGW(TAG, "%s at %d kHz, dropping to %d kHz",
+             esp_err_to_name(ret), card_khz, SDMMC_FREQ_DEFAULT);
+    return card_probe(SDMMC_FREQ_DEFAULT) == 0;
+}
+
+int sdcard_init(void)
+{
+    if (card) return 0;  /* already initialized */
 
     /* Allocate and probe the card */
     card = (sdmmc_card_t *)malloc(sizeof(sdmmc_card_t));
@@ -62,36 +240,29 @@ int sdcard_init(void)
         return -1;
     }
 
-    esp_err_t ret = sdspi_host_init_device(&dev_cfg, &host.slot);
-    if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "SPI device init failed: %s", esp_err_to_name(ret));
+    if (card_bring_up() != 0) {
+        ESP_LOGE(TAG, "Card init failed");
         free(card);
         card = NULL;
         return -1;
     }
 
-    ret = sdmmc_card_init(&host, card);
-    if (ret != ESP_OK) {
-        ESP_LOGE(TAG, "Card init failed: %s", esp_err_to_name(ret));
-        free(card);
-        card = NULL;
-        return -1;
-    }
-
-    ESP_LOGI(TAG, "Card: %s, %llu MB",
+    ESP_LOGI(TAG, "Card: %s, %llu MB, %d kHz",
              card->cid.name,
              (unsigned long long)(card->csd.capacity) *
-             (unsigned long long)(card->csd.sector_size) / (1024 * 1024));
+             (unsigned long long)(card->csd.sector_size) / (1024 * 1024),
+             card_khz);
     return 0;
 }
 
 void sdcard_deinit(void)
 {
     if (card) {
+        slot_close();
         free(card);
         card = NULL;
     }
-    /* Leave SPI bus initialized — reinit is expensive */
+    /* Leave the bus (or SDMMC host) initialized — reinit is expensive */
 }
 
 uint64_t sdcard_size(void)
@@ -105,26 +276,84 @@ uint32_t sdcard_sector_size(void)
     return 512;
 }
 
-int sdcard_write(uint32_t lba, uint32_t count, const void *data)
+uint32_t sdcard_au_sectors(void)
+{
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 1, 0)
+    /* AU_SIZE of the SSR, read by the card init (ACMD13) */
+    if (card && card->ssr.alloc_unit_kb)
+        return (uint32_t)card->ssr.alloc_unit_kb * 2;
+#endif
+    return 8192;
+}
+
+static int write_sectors(uint32_t lba, uint32_t count, const void *data,
+                         int kind)
 {
     if (!card) return -1;
     esp_err_t ret = sdmmc_write_sectors(card, data, lba, count);
+    if (ret != ESP_OK && slow_down(ret))
+        ret = sdmmc_write_sectors(card, data, lba, count);
     if (ret != ESP_OK) {
         ESP_LOGE(TAG, "Write failed at LBA %lu: %s",
                  (unsigned long)lba, esp_err_to_name(ret));
         return -1;
     }
+    BUSSTAT_ADD(BUS_SD, kind == SDCARD_J_DATA ? "sdcard_write_data"
+                                              : "sdcard_write",
+                SD_CMDS(count), SD_CMD_BYTES(count), count * 512);
+    if (s_journal) s_journal(lba, count, data, kind);
     return 0;
 }
 
+int sdcard_write(uint32_t lba, uint32_t count, const void *data)
+{
+    return write_sectors(lba, count, data, SDCARD_J_META);
+}
+
+int sdcard_write_data(uint32_t lba, uint32_t count, const void *data)
+{
+    return write_sectors(lba, count, data, SDCARD_J_DATA);
+}
+
 int sdcard_read(uint32_t lba, uint32_t count, void *data)
 {
     if (!card) return -1;
     esp_err_t ret = sdmmc_read_sectors(card, data, lba, count);
+    if (ret != ESP_OK && slow_down(ret))
+        ret = sdmmc_read_sectors(card, data, lba, count);
     if (ret != ESP_OK) {
         ESP_LOGE(TAG, "Read failed at LBA %lu: %s",
                  (unsigned long)lba, esp_err_to_name(ret));
         return -1;
     }
+    BUSSTAT_ADD(BUS_SD, __func__, SD_CMDS(count), SD_CMD_BYTES(count),
+                count * 512);
     return 0;
 }
+
+int sdcard_erase(uint32_t lba, uint32_t count)
+{
+    if (!card) return -1;
+#if ESP_IDF_VERSION >= ESP_IDF_VERSION_VAL(5, 0, 0)
+    /* Cards whose erased state is all ones are no use for zeroing */
+    if (card->scr.erase_mem_state != 0) return -1;
+    esp_err_t ret = sdmmc_erase_sectors(card, lba, count, SDMMC_ERASE_ARG);
+    if (ret != ESP_OK) {
+        ESP_LOGW(TAG, "Erase failed at LBA %lu: %s",
+                 (unsigned long)lba, esp_err_to_name(ret));
+        return -1;
+    }
+    /* CMD32, CMD33, CMD38; the card's erase time is not modelled */
+    BUSSTAT_ADD(BUS_SD, __func__, 3, 3 * 16, 0);
+    if (s_journal) s_journal(lba, count, NULL, SDCARD_J_ERASE);
+    return 0;
+#else
+    (void)lba; (void)count;
+    return -1;
+#endif
+}
+
+void sdcard_set_journal(sdcard_journal_fn fn)
+{
+    s_journal = fn;
+}
@@ -1,5 +1,9 @@
 /*
- * sdcard.h — SD card driver via sdspi_host on SPI3
+ * sdcard.h — SD card driver via sdspi_host on SPI3 or the SDMMC host
+ *
+ * The interface is a board setting (menuconfig, "Survival board"); the
+ * clock is negotiated in sdcard_init() and lowered on its own if
+ * transfers fail at speed, so callers see the same API either way.
  */
 #ifndef SDCARD_H
 #define SDCARD_H
@@ -7,10 +11,10 @@
 #include <stdint.h>
 #include <stddef.h>
 
-/* Initialize the SD card on SPI3. Returns 0 on success. */
+/* Initialize the SD card. Returns 0 on success. */
 int sdcard_init(void);
 
-/* Release the SD card and SPI bus. */
+/* Release the SD card (the bus stays up for the next init). */
 void sdcard_deinit(void);
 
 /* Get total card size in bytes. */
@@ -19,6 +23,10 @@ uint64_t sdcard_size(void);
 /* Get sector size (always 512). */
 uint32_t sdcard_sector_size(void);
 
+/* The card's allocation unit in sectors, from its SD status register;
+ * 8192 (4 MB, the SDHC/SDXC norm) when it does not report one. */
+uint32_t sdcard_au_sectors(void);
+
 /* Write sectors to the SD card.
  * lba: starting sector number
  * count: number of 512-byte sectors
@@ -26,7 +34,28 @@ uint32_t sdcard_sector_size(void);
  * Returns 0 on success. */
 int sdcard_write(uint32_t lba, uint32_t count, const void *data);
 
+/* The same for file contents: the flasher's data streams write through
+ * this, so a write journal can tell them from the metadata around them. */
+int sdcard_write_data(uint32_t lba, uint32_t count, const void *data);
+
 /* Read sectors from the SD card. Returns 0 on success. */
 int sdcard_read(uint32_t lba, uint32_t count, void *data);
 
+/* Erase sectors so they read back as zeros, without sending any data.
+ * Returns 0 on success, -1 if the card cannot (its erased state is all
+ * ones, or the erase failed); the caller then writes zeros instead. */
+int sdcard_erase(uint32_t lba, uint32_t count);
+
+/* Write journal: a hook told of every write and erase that succeeded,
+ * which batch flashing records the first card of a batch with. data is
+ * the written sectors, NULL for an erase. */
+#define SDCARD_J_META  0        /* sdcard_write() */
+#define SDCARD_J_DATA  1        /* sdcard_write_data() */
+#define SDCARD_J_ERASE 2        /* sdcard_erase() */
+typedef void (*sdcard_journal_fn)(uint32_t lba, uint32_t count,
+                                  const void *data, int kind);
+
+/* Set the hook, or NULL for none */
+void sdcard_set_journal(sdcard_journal_fn fn);
+
 #endif /* SDCARD_H */
@@ -2,11 +2,20 @@
  * touch.c — XPT2046 resistive touchscreen for ESP32 CYD
  *
  * Bit-banged SPI since both hardware SPI hosts are taken (display + SD).
- * The XPT2046 only needs ~50Hz polling, so bit-bang is fine.
+ * Nobody polls it: PENIRQ wakes a task that samples every
+ * TOUCH_PERIOD_MS while the pen is down and posts down/move/up events
+ * to a queue, so waiting for a tap blocks instead of spinning.
  *
  * CYD pin assignments:
  *   MOSI=32, MISO=39, CLK=25, CS=33, IRQ=36
  *
+ * With CONFIG_SURVIVAL_TOUCH_LOG every posted event is also logged,
+ * with its time, for recording sessions to replay. With
+ * CONFIG_SURVIVAL_TOUCH_REPLAY and a REPLAY.TXT on the card, the events
+ * apps ask for come from that script (replay.c) until it runs out, and
+ * the panel's are dropped meanwhile. With CONFIG_SURVIVAL_BUS_STATS
+ * every conversion read is counted (busstat.h).
+ *
  * Calibration: raw ADC range ~200..3900 maps to screen 0..319 / 0..239.
  * The CYD's touch panel is mounted with X/Y swapped relative to the
  * ILI9341 in landscape mode.
@@ -14,11 +23,16 @@
 
 #include "touch.h"
 #include "display.h"
+#include "busstat.h"
+#include "replay.h"
 
 #include "driver/gpio.h"
+#include "esp_attr.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/queue.h"
 #include "rom/ets_sys.h"
 
 static const char *TAG = "touch";
@@ -44,9 +58,114 @@ static const char *TAG = "touch";
 /* Pressure threshold — readings below this are noise */
 #define TOUCH_THRESHOLD 100
 
+#define TOUCH_PERIOD_MS 20   /* sampling while the pen is down */
+#define TOUCH_QUEUE_LEN 16
+#ifdef CONFIG_SURVIVAL_TOUCH_LOG
+#define TOUCH_STACK     3072 /* room for the log's vprintf */
+#else
+#define TOUCH_STACK     2048
+#endif
+
+/* Half a DCLK period. The XPT2046 wants 200ns high and low; with the gpio
+ * calls around it this gives a ~1MHz clock, a 24-bit read in ~25us where
+ * three ets_delay_us(1) per bit took ~100us. */
+#define TOUCH_SPIN      8
+
+static QueueHandle_t s_events;
+static TaskHandle_t s_task;
+static bool s_poll;          /* no pen interrupt: the task polls */
+
+/* Latest sample, for touch_read() */
+static volatile bool s_down;
+static volatile int s_x, s_y;
+static volatile int64_t s_pen_us;  /* when the pen last went down */
+
+static bool sample(int *x, int *y);
+
+#ifdef CONFIG_SURVIVAL_TOUCH_REPLAY
+static bool s_polled;        /* the last poll of the script came back empty */
+
+/* The script's next event, with the state a pen would have left. A poll
+ * (timeout 0) only gets one if the poll before it got none, so a drain
+ * of stale events stops at once and a polling loop still sees the next
+ * tap. When the script runs out, what the panel queued meanwhile goes. */
+static bool replay_event(struct touch_event *ev, int timeout_ms)
+{
+    if (timeout_ms == 0 && !s_polled) {
+        s_polled = true;
+        return false;
+    }
+    s_polled = false;
+    if (!replay_next(ev)) {
+        xQueueReset(s_events);
+        return false;
+    }
+    if (ev->type == TOUCH_DOWN)
+        s_pen_us = esp_timer_get_time();
+    return true;
+}
+#endif
+
+static void IRAM_ATTR pen_isr(void *arg)
+{
+    (void)arg;
+    BaseType_t woken = pdFALSE;
+    s_pen_us = esp_timer_get_time();
+    gpio_intr_disable(PIN_IRQ);  /* the task re-enables it at pen up */
+    vTaskNotifyGiveFromISR(s_task, &woken);
+    if (woken) portYIELD_FROM_ISR();
+}
+
+static void post(uint8_t type, int x, int y)
+{
+    struct touch_event ev = { type, (int16_t)x, (int16_t)y };
+#ifdef CONFIG_SURVIVAL_TOUCH_LOG
+    ESP_LOGI(TAG, "rec %lld %c %d %d", (long long)esp_timer_get_time(),
+             "DMU"[type], x, y);
+#endif
+    xQueueSend(s_events, &ev, 0);  /* a full queue drops the event */
+}
+
+/* Woken by PENIRQ: sample until the pen lifts, then sleep again */
+static void touch_task(void *arg)
+{
+    (void)arg;
+    for (;;) {
+        ulTaskNotifyTake(pdTRUE, s_poll ? pdMS_TO_TICKS(TOUCH_PERIOD_MS)
+                                        : portMAX_DELAY);
+
+        int x, y;
+        while (sample(&x, &y)) {
+            if (!s_down) {
+                if (s_poll)
+                    s_pen_us = esp_timer_get_time();
+                s_x = x; s_y = y; s_down = true;
+                post(TOUCH_DOWN, x, y);
+            } else if (x != s_x || y != s_y) {
+                s_x = x; s_y = y;
+                post(TOUCH_MOVE, x, y);
+            }
+            vTaskDelay(pdMS_TO_TICKS(TOUCH_PERIOD_MS));
+        }
+        if (s_down) {
+            s_down = false;
+            post(TOUCH_UP, s_x, s_y);
+        }
+
+        /* A press that came while the interrupt was off has no edge */
+        if (!s_poll) {
+            gpio_intr_enable(PIN_IRQ);
+            if (gpio_get_level(PIN_IRQ) == 0) {
+                s_pen_us = esp_timer_get_time();
+                xTaskNotifyGive(s_task);
+            }
+        }
+    }
+}
+
 void touch_init(void)
 {
-    ESP_LOGI(TAG, "Initializing XPT2046 touch (bit-bang SPI)");
+    ESP_LOGI(TAG, "Initializing XPT2046 touch (bit-bang SPI, PENIRQ)");
 
     /* Output pins: MOSI, CLK, CS */
     uint64_t out_mask = (1ULL << PIN_MOSI) | (1ULL << PIN_CLK) | (1ULL << PIN_CS);
@@ -72,21 +191,47 @@ void touch_init(void)
     gpio_set_level(PIN_CS, 1);
     gpio_set_level(PIN_CLK, 0);
 
+    s_events = xQueueCreate(TOUCH_QUEUE_LEN, sizeof(struct touch_event));
+    if (!s_events ||
+        xTaskCreate(touch_task, "touch", TOUCH_STACK, NULL, 5, &s_task) != pdPASS) {
+        ESP_LOGE(TAG, "Touch task not started");
+        return;
+    }
+
+    /* PENIRQ goes low at pen down; ESP_ERR_INVALID_STATE means another
+     * driver installed the ISR service already */
+    esp_err_t err = gpio_install_isr_service(0);
+    if (err == ESP_ERR_INVALID_STATE)
+        err = ESP_OK;
+    if (err == ESP_OK)
+        err = gpio_set_intr_type(PIN_IRQ, GPIO_INTR_NEGEDGE);
+    if (err == ESP_OK)
+        err = gpio_isr_handler_add(PIN_IRQ, pen_isr, NULL);
+    if (err != ESP_OK) {
+        ESP_LOGW(TAG, "No pen interrupt (%s), polling", esp_err_to_name(err));
+        s_poll = true;
+    }
+    xTaskNotifyGive(s_task);  /* already pressed: no edge to come */
+
     ESP_LOGI(TAG, "Touch ready");
 }
 
+static inline void clk_half(void)
+{
+    for (volatile int i = 0; i < TOUCH_SPIN; i++) { }
+}
+
 /* Bit-bang one byte out, read one byte back (SPI mode 0: CPOL=0, CPHA=0) */
 static uint8_t spi_transfer(uint8_t data)
 {
     uint8_t result = 0;
     for (int i = 7; i >= 0; i--) {
         gpio_set_level(PIN_MOSI, (data >> i) & 1);
-        ets_delay_us(1);
+        clk_half();
         gpio_set_level(PIN_CLK, 1);
-        ets_delay_us(1);
+        clk_half();
         result = (result << 1) | gpio_get_level(PIN_MISO);
         gpio_set_level(PIN_CLK, 0);
-        ets_delay_us(1);
     }
     return result;
 }
@@ -97,6 +242,7 @@ static uint16_t xpt2046_read(uint8_t cmd)
     spi_transfer(cmd);
     uint8_t hi = spi_transfer(0x00);
     uint8_t lo = spi_transfer(0x00);
+    BUSSTAT_ADD(BUS_TOUCH, __func__, 1, 1, 2);
     return ((uint16_t)hi << 5) | (lo >> 3);  /* 12-bit, top-aligned in 16-bit response */
 }
 
@@ -140,7 +286,8 @@ static int map_coord(uint16_t raw, int raw_min, int raw_max, int screen_max)
     return (int)((uint32_t)(raw - raw_min) * screen_max / (raw_max - raw_min));
 }
 
-bool touch_read(int *x, int *y)
+/* One calibrated sample straight from the panel */
+static bool sample(int *x, int *y)
 {
     uint16_t raw_x, raw_y;
     if (!read_raw(&raw_x, &raw_y))
@@ -154,14 +301,83 @@ bool touch_read(int *x, int *y)
     return true;
 }
 
+bool touch_read(int *x, int *y)
+{
+    /* Without the task (init failed) sample here, as before */
+    if (!s_task)
+        return sample(x, y);
+    if (!s_down)
+        return false;
+    *x = s_x;
+    *y = s_y;
+    return true;
+}
+
+int64_t touch_pen_time(void)
+{
+    return s_pen_us;
+}
+
+bool touch_get_event(struct touch_event *ev, int timeout_ms)
+{
+    if (!s_task)
+        return false;
+#ifdef CONFIG_SURVIVAL_TOUCH_REPLAY
+    if (replay_active()) {
+        if (replay_event(ev, timeout_ms))
+            return true;
+        if (replay_active())
+            return false;       /* a poll between two events */
+    }
+#endif
+    TickType_t wait = (timeout_ms < 0) ? portMAX_DELAY
+                                       : pdMS_TO_TICKS(timeout_ms);
+    return xQueueReceive(s_events, ev, wait) == pdTRUE;
+}
+
 void touch_wait_tap(int *x, int *y)
 {
-    /* Wait for finger down */
-    while (!touch_read(x, y))
-        vTaskDelay(pdMS_TO_TICKS(20));
-
-    /* Wait for finger up (debounce) */
-    int dummy_x, dummy_y;
-    while (touch_read(&dummy_x, &dummy_y))
-        vTaskDelay(pdMS_TO_TICKS(20));
+    if (!s_task) {
+        /* Wait for finger down */
+        while (!sample(x, y))
+            vTaskDelay(pdMS_TO_TICKS(TOUCH_PERIOD_MS));
+
+        /* Wait for finger up (debounce) */
+        int dummy_x, dummy_y;
+        while (sample(&dummy_x, &dummy_y))
+            vTaskDelay(pdMS_TO_TICKS(TOUCH_PERIOD_MS));
+        return;
+    }
+
+    struct touch_event ev;
+#ifdef CONFIG_SURVIVAL_TOUCH_REPLAY
+    bool got = false;
+    while (replay_active() && replay_event(&ev, -1)) {
+        if (ev.type == TOUCH_DOWN) {
+            got = true;
+            *x = ev.x;
+            *y = ev.y;
+        } else if (ev.type == TOUCH_UP && got) {
+            return;
+        }
+    }
+#endif
+
+    /* Events from before the call are stale; a finger that is already
+     * down counts as the press, as it did when this polled */
+    xQueueReset(s_events);
+    bool down = s_down;
+    *x = s_x;
+    *y = s_y;
+    while (!down) {
+        xQueueReceive(s_events, &ev, portMAX_DELAY);
+        if (ev.type == TOUCH_DOWN) {
+            down = true;
+            *x = ev.x;
+            *y = ev.y;
+        }
+    }
+    do {
+        xQueueReceive(s_events, &ev, portMAX_DELAY);
+    } while (ev.type != TOUCH_UP);
 }
@@ -1,5 +1,5 @@
 /*
- * touch.h — XPT2046 resistive touchscreen driver (bit-banged SPI)
+ * touch.h — XPT2046 resistive touchscreen driver (bit-banged SPI, PENIRQ)
  */
 #ifndef TOUCH_H
 #define TOUCH_H
@@ -7,13 +7,34 @@
 #include <stdbool.h>
 #include <stdint.h>
 
-/* Initialize XPT2046 GPIO pins. */
+/* Touch events, posted while the pen is down. x, y are screen
+ * coordinates (0..319, 0..239) after calibration; TOUCH_UP carries the
+ * last position. */
+#define TOUCH_DOWN 0
+#define TOUCH_MOVE 1
+#define TOUCH_UP   2
+
+struct touch_event {
+    uint8_t type;
+    int16_t x, y;
+};
+
+/* Initialize XPT2046 GPIO pins, the pen interrupt and the touch task. */
 void touch_init(void);
 
-/* Read current touch state. Returns true if touched.
- * x, y are screen coordinates (0..319, 0..239) after calibration. */
+/* Read current touch state (the touch task's latest sample). Returns
+ * true if touched. */
 bool touch_read(int *x, int *y);
 
+/* Wait up to timeout_ms (-1 = forever) for the next event. Returns true
+ * if one arrived. */
+bool touch_get_event(struct touch_event *ev, int timeout_ms);
+
+/* esp_timer_get_time() when the pen last went down: the pen interrupt,
+ * or the first sample of the press when polling. TOUCH_DOWN arrives
+ * after it by the sampling and queueing time. */
+int64_t touch_pen_time(void);
+
 /* Block until a touch-down + release. Returns coordinates of the tap. */
 void touch_wait_tap(int *x, int *y);
 
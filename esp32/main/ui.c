@@ -46,6 +46,8 @@ void ui_show_splash(void)
 
 void ui_update_progress(const char *status, int current, int total)
 {
+    /* One frame: an update sends little more than the bar's new end */
+    display_frame_begin();
     if (current <= 0) {
         display_clear(COLOR_BLACK);
         display_string(20, 20, "Flashing SD card...", COLOR_WHITE, COLOR_BLACK);
@@ -72,6 +74,7 @@ void ui_update_progress(const char *status, int current, int total)
     snprintf(cnt, sizeof(cnt), "%d / %d", current, total);
     int cx = (DISPLAY_WIDTH - (int)strlen(cnt) * FONT_WIDTH) / 2;
     display_string(cx, BAR_Y + BAR_H + 8, cnt, COLOR_GRAY, COLOR_BLACK);
+    display_frame_end();
 }
 
 void ui_show_done(const char *arch)
@@ -0,0 +1,412 @@
+/*
+ * wifi_update.c — Payload delta updates over Wi-Fi
+ *
+ * Between releases most of the payload stays the same, so an update
+ * need not carry all of it: pack_payload.py --base lays the new payload
+ * out around the one the device has, reusing every unchanged chunk in
+ * place, and writes a delta of just the flash sectors that change, into
+ * sectors the live payload does not use. This joins the configured
+ * network, fetches the delta in one HTTP GET and writes it:
+ *
+ *   1. Check the header: it must be made from the payload that is live
+ *      (its meta CRC, see payload_meta_crc()), and every range must be
+ *      on a sector boundary, in order, and clear of the live payload
+ *   2. Write each range a sector at a time: a sector that already holds
+ *      the bytes (an update tried before) is left alone, any other is
+ *      erased, written and read back
+ *   3. Check each range's CRC, then commit: payload_commit_root() checks
+ *      the new header's meta CRC and records its offset in NVS
+ *
+ * The old payload is untouched until that last step, so a lost link or
+ * a power cut anywhere before it leaves the device as it was; running
+ * the update again carries on, skipping the sectors already written.
+ * The device then restarts into the new payload.
+ */
+
+#include "wifi_update.h"
+#include "payload.h"
+#include "display.h"
+#include "ui.h"
+#include "font.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "sdkconfig.h"
+#include "esp_log.h"
+#include "esp_system.h"
+#include "esp_partition.h"
+#include "esp_rom_crc.h"
+#include "esp_event.h"
+#include "esp_netif.h"
+#include "esp_wifi.h"
+#include "esp_http_client.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/event_groups.h"
+
+static const char *TAG = "update";
+
+#define WIFI_TIMEOUT_MS   20000     /* to join and get an address */
+#define WIFI_RETRIES      5
+#define HTTP_TIMEOUT_MS   10000
+#define DRAW_SECTORS      16        /* redraw the bar every 64 KB */
+
+#define DELTA_HDR         24
+#define DELTA_RANGE       12
+#define DELTA_MAX_RANGES  64
+#define DELTA_SECTORS     (0x290000 / PAYLOAD_SECTOR_SIZE)  /* partitions.csv */
+
+static uint32_t rd32(const uint8_t *p)
+{
+    return p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/* ---- Status screen ---- */
+
+static void draw_status(const char *step, uint32_t done, uint32_t total)
+{
+    char line[48];
+    display_frame_begin();
+    display_clear(COLOR_BLACK);
+    const char *hdr = "Wi-Fi Update";
+    display_string((DISPLAY_WIDTH - (int)strlen(hdr) * FONT_WIDTH) / 2, 4, hdr,
+                   COLOR_WHITE, COLOR_BLACK);
+    snprintf(line, sizeof(line), "Network: %.28s", CONFIG_SURVIVAL_WIFI_SSID);
+    display_string(20, 40, line, COLOR_GRAY, COLOR_BLACK);
+    display_string(20, 100, step, COLOR_CYAN, COLOR_BLACK);
+
+    int bar_w = DISPLAY_WIDTH - 40;
+    display_fill_rect(20, 150, bar_w, 24, COLOR_DGRAY);
+    if (total > 0) {
+        display_fill_rect(20, 150, (int)((uint64_t)done * bar_w / total), 24,
+                          COLOR_GREEN);
+        snprintf(line, sizeof(line), "%lu / %lu KB", (unsigned long)(done >> 10),
+                 (unsigned long)(total >> 10));
+        display_string((DISPLAY_WIDTH - (int)strlen(line) * FONT_WIDTH) / 2,
+                       182, line, COLOR_GRAY, COLOR_BLACK);
+    }
+    display_frame_end();
+}
+
+/* ---- Wi-Fi ---- */
+
+#define EV_GOT_IP   BIT0
+#define EV_FAILED   BIT1
+
+static EventGroupHandle_t s_events;
+static esp_event_handler_instance_t s_wifi_handler, s_ip_handler;
+static int s_retries;
+
+static void on_event(void *arg, esp_event_base_t base, int32_t id, void *data)
+{
+    (void)arg;
+    (void)data;
+    if (base == WIFI_EVENT && id == WIFI_EVENT_STA_START) {
+        esp_wifi_connect();
+    } else if (base == WIFI_EVENT && id == WIFI_EVENT_STA_DISCONNECTED) {
+        if (s_retries++ < WIFI_RETRIES) esp_wifi_connect();
+        else xEventGroupSetBits(s_events, EV_FAILED);
+    } else if (base == IP_EVENT && id == IP_EVENT_STA_GOT_IP) {
+        xEventGroupSetBits(s_events, EV_GOT_IP);
+    }
+}
+
+static void wifi_stop(void)
+{
+    esp_wifi_stop();
+    esp_wifi_deinit();
+    if (s_wifi_handler)
+        esp_event_handler_instance_unregister(WIFI_EVENT, ESP_EVENT_ANY_ID,
+                                              s_wifi_handler);
+    if (s_ip_handler)
+        esp_event_handler_instance_unregister(IP_EVENT, IP_EVENT_STA_GOT_IP,
+                                              s_ip_handler);
+    s_wifi_handler = s_ip_handler = NULL;
+    if (s_events) vEventGroupDelete(s_events);
+    s_events = NULL;
+}
+
+/* Join the network. 0 once there is an address, -1 if there is none in
+ * WIFI_TIMEOUT_MS (Wi-Fi is then stopped again). */
+static int wifi_start(void)
+{
+    /* The netif and the default event loop outlive the update */
+    static int s_netif_ready;
+    if (!s_netif_ready) {
+        esp_err_t err = esp_netif_init();
+        if (err == ESP_OK) err = esp_event_loop_create_default();
+        if (err != ESP_OK && err != ESP_ERR_INVALID_STATE) {
+            ESP_LOGE(TAG, "Network stack init failed: %s", esp_err_to_name(err));
+            return -1;
+        }
+        esp_netif_create_default_wifi_sta();
+        s_netif_ready = 1;
+    }
+
+    s_events = xEventGroupCreate();
+    s_retries = 0;
+    wifi_init_config_t init = WIFI_INIT_CONFIG_DEFAULT();
+    if (!s_events || esp_wifi_init(&init) != ESP_OK) {
+        ESP_LOGE(TAG, "Wi-Fi init failed");
+        if (s_events) vEventGroupDelete(s_events);
+        s_events = NULL;
+        return -1;
+    }
+    esp_event_handler_instance_register(WIFI_EVENT, ESP_EVENT_ANY_ID, on_event,
+                                        NULL, &s_wifi_handler);
+    esp_event_handler_instance_register(IP_EVENT, IP_EVENT_STA_GOT_IP, on_event,
+                                        NULL, &s_ip_handler);
+
+    wifi_config_t cfg;
+    memset(&cfg, 0, sizeof(cfg));
+    strncpy((char *)cfg.sta.ssid, CONFIG_SURVIVAL_WIFI_SSID,
+            sizeof(cfg.sta.ssid));
+    strncpy((char *)cfg.sta.password, CONFIG_SURVIVAL_WIFI_PASSWORD,
+            sizeof(cfg.sta.password));
+    esp_wifi_set_storage(WIFI_STORAGE_RAM);
+    esp_wifi_set_mode(WIFI_MODE_STA);
+    esp_wifi_set_config(WIFI_IF_STA, &cfg);
+    if (esp_wifi_start() != ESP_OK) {
+        wifi_stop();
+        return -1;
+    }
+
+    EventBits_t bits = xEventGroupWaitBits(s_events, EV_GOT_IP | EV_FAILED,
+                                           pdFALSE, pdFALSE,
+                                           pdMS_TO_TICKS(WIFI_TIMEOUT_MS));
+    if (!(bits & EV_GOT_IP)) {
+        ESP_LOGE(TAG, "Could not join %s", CONFIG_SURVIVAL_WIFI_SSID);
+        wifi_stop();
+        return -1;
+    }
+    ESP_LOGI(TAG, "Joined %s", CONFIG_SURVIVAL_WIFI_SSID);
+    return 0;
+}
+
+/* ---- Delta ---- */
+
+struct delta_range {
+    uint32_t offset, length, crc32;
+};
+
+struct delta {
+    uint32_t from_crc, root, root_crc;
+    uint32_t count;
+    uint32_t total;             /* bytes in all ranges */
+    struct delta_range ranges[DELTA_MAX_RANGES];
+};
+
+static struct delta s_delta;
+static uint8_t *s_net;          /* a sector as fetched */
+static uint8_t *s_flash;        /* the same sector from flash */
+
+/* Read exactly n bytes of the body. 0, or -1 if it ends or fails first. */
+static int http_read(esp_http_client_handle_t c, uint8_t *p, uint32_t n)
+{
+    while (n > 0) {
+        int got = esp_http_client_read(c, (char *)p, (int)n);
+        if (got <= 0) return -1;
+        p += got;
+        n -= (uint32_t)got;
+    }
+    return 0;
+}
+
+/* Read and check the header and range table. NULL, or why not. */
+static const char *read_header(esp_http_client_handle_t c,
+                               const esp_partition_t *part)
+{
+    uint8_t hdr[DELTA_HDR];
+    if (http_read(c, hdr, DELTA_HDR) != 0) return "Could not read\nthe update.";
+    if (memcmp(hdr, "SURD", 4) != 0 || hdr[4] != 1)
+        return "Not an update file\n(see pack_payload.py).";
+
+    struct delta *d = &s_delta;
+    d->from_crc = rd32(hdr + 8);
+    d->root = rd32(hdr + 12);
+    d->root_crc = rd32(hdr + 16);
+    d->count = rd32(hdr + 20);
+    if (d->count == 0 || d->count > DELTA_MAX_RANGES)
+        return "Update has too\nmany ranges.";
+
+    uint8_t table[DELTA_MAX_RANGES * DELTA_RANGE + 4];
+    uint32_t table_size = d->count * DELTA_RANGE + 4;
+    if (http_read(c, table, table_size) != 0) return "Could not read\nthe update.";
+    uint32_t crc = esp_rom_crc32_le(0, hdr, DELTA_HDR);
+    crc = esp_rom_crc32_le(crc, table, table_size - 4);
+    if (crc != rd32(table + table_size - 4)) return "Update header is\ncorrupt.";
+
+    uint32_t live = payload_meta_crc();
+    if (live == 0) return "The payload here is\nv1: flash it over USB.";
+    if (d->from_crc != live) {
+        ESP_LOGE(TAG, "Update is from payload %08lx, this one is %08lx",
+                 (unsigned long)d->from_crc, (unsigned long)live);
+        return "Update is for a\ndifferent payload.";
+    }
+
+    static uint8_t map[(DELTA_SECTORS + 7) / 8];
+    if (part->size > DELTA_SECTORS * PAYLOAD_SECTOR_SIZE ||
+        payload_live_sectors(map, DELTA_SECTORS) != 0)
+        return "Cannot map the\npayload here.";
+
+    uint32_t end = 0;
+    int root_in = 0;
+    d->total = 0;
+    for (uint32_t i = 0; i < d->count; i++) {
+        struct delta_range *r = &d->ranges[i];
+        r->offset = rd32(table + i * DELTA_RANGE);
+        r->length = rd32(table + i * DELTA_RANGE + 4);
+        r->crc32 = rd32(table + i * DELTA_RANGE + 8);
+        if (r->offset % PAYLOAD_SECTOR_SIZE != 0 || r->length == 0 ||
+            r->offset < end || r->offset > part->size ||
+            r->length > part->size - r->offset)
+            return "Update does not fit\nthe partition.";
+        end = r->offset + r->length;
+        for (uint32_t s = r->offset / PAYLOAD_SECTOR_SIZE;
+             s <= (end - 1) / PAYLOAD_SECTOR_SIZE; s++) {
+            if (map[s / 8] & (1 << (s % 8))) {
+                ESP_LOGE(TAG, "Range at 0x%lx overlaps the live payload",
+                         (unsigned long)r->offset);
+                return "Update overlaps\nthe live payload.";
+            }
+        }
+        if (d->root >= r->offset && d->root < end) root_in = 1;
+        d->total += r->length;
+    }
+    if (!root_in) return "Update has no\nnew payload header.";
+    return NULL;
+}
+
+/* Put one sector's bytes (n of them) at ofs, unless they are there */
+static int write_sector(const esp_partition_t *part, uint32_t ofs, uint32_t n,
+                        uint32_t *written)
+{
+    if (esp_partition_read(part, ofs, s_flash, n) == ESP_OK &&
+        memcmp(s_flash, s_net, n) == 0)
+        return 0;
+    if (esp_partition_erase_range(part, ofs, PAYLOAD_SECTOR_SIZE) != ESP_OK ||
+        esp_partition_write(part, ofs, s_net, n) != ESP_OK ||
+        esp_partition_read(part, ofs, s_flash, n) != ESP_OK ||
+        memcmp(s_flash, s_net, n) != 0) {
+        ESP_LOGE(TAG, "Flash write failed at 0x%lx", (unsigned long)ofs);
+        return -1;
+    }
+    *written += n;
+    return 0;
+}
+
+/* Fetch and apply the delta. NULL once it is committed, or why not. */
+static const char *apply_delta(const esp_partition_t *part)
+{
+    esp_http_client_config_t hc;
+    memset(&hc, 0, sizeof(hc));
+    hc.url = CONFIG_SURVIVAL_UPDATE_URL;
+    hc.timeout_ms = HTTP_TIMEOUT_MS;
+    esp_http_client_handle_t c = esp_http_client_init(&hc);
+    if (!c) return "Bad update URL.";
+
+    const char *err = NULL;
+    if (esp_http_client_open(c, 0) != ESP_OK ||
+        esp_http_client_fetch_headers(c) < 0) {
+        ESP_LOGE(TAG, "Could not reach %s", CONFIG_SURVIVAL_UPDATE_URL);
+        err = "Could not reach the\nupdate server.";
+        goto out;
+    }
+    int status = esp_http_client_get_status_code(c);
+    if (status != 200) {
+        ESP_LOGE(TAG, "HTTP %d from %s", status, CONFIG_SURVIVAL_UPDATE_URL);
+        err = "Server would not\nsend the update.";
+        goto out;
+    }
+    err = read_header(c, part);
+    if (err) goto out;
+
+    struct delta *d = &s_delta;
+    ESP_LOGI(TAG, "Update: %lu bytes in %lu ranges, new payload at 0x%lx",
+             (unsigned long)d->total, (unsigned long)d->count,
+             (unsigned long)d->root);
+    uint32_t done = 0, written = 0;
+    for (uint32_t i = 0; i < d->count && !err; i++) {
+        const struct delta_range *r = &d->ranges[i];
+        uint32_t crc = 0;
+        for (uint32_t ofs = 0; ofs < r->length; ofs += PAYLOAD_SECTOR_SIZE) {
+            uint32_t n = r->length - ofs;
+            if (n > PAYLOAD_SECTOR_SIZE) n = PAYLOAD_SECTOR_SIZE;
+            if (http_read(c, s_net, n) != 0) {
+                err = "Download cut short:\nrun the update again.";
+                break;
+            }
+            crc = esp_rom_crc32_le(crc, s_net, n);
+            if (write_sector(part, r->offset + ofs, n, &written) != 0) {
+                err = "Flash write failed.";
+                break;
+            }
+            done += n;
+            if ((done / PAYLOAD_SECTOR_SIZE) % DRAW_SECTORS == 0 ||
+                done == d->total)
+                draw_status("Writing payload...", done, d->total);
+        }
+        if (!err && crc != r->crc32) {
+            ESP_LOGE(TAG, "Range at 0x%lx fails its CRC",
+                     (unsigned long)r->offset);
+            err = "Update is corrupt:\nrun it again.";
+        }
+    }
+    if (!err) {
+        ESP_LOGI(TAG, "%lu of %lu bytes needed writing",
+                 (unsigned long)written, (unsigned long)d->total);
+        if (payload_commit_root(d->root, d->root_crc) != 0)
+            err = "New payload does not\ncheck out: not used.";
+    }
+
+out:
+    esp_http_client_cleanup(c);
+    return err;
+}
+
+/* ---- Entry ---- */
+
+void wifi_update_run(void)
+{
+    const esp_partition_t *part = esp_partition_find_first(
+        ESP_PARTITION_TYPE_DATA, PAYLOAD_PARTITION_SUBTYPE, NULL);
+    if (!part) {
+        ui_show_error("No payload partition.");
+        ui_wait_for_tap();
+        return;
+    }
+    if (CONFIG_SURVIVAL_UPDATE_URL[0] == '\0') {
+        ui_show_error("No update URL: set\nit in menuconfig.");
+        ui_wait_for_tap();
+        return;
+    }
+
+    s_net = malloc(PAYLOAD_SECTOR_SIZE);
+    s_flash = malloc(PAYLOAD_SECTOR_SIZE);
+    const char *err = NULL;
+    if (!s_net || !s_flash) {
+        err = "Not enough memory\nfor the update.";
+    } else {
+        draw_status("Joining network...", 0, 0);
+        if (wifi_start() != 0) {
+            err = "Could not join\nthe network.";
+        } else {
+            draw_status("Fetching update...", 0, 0);
+            err = apply_delta(part);
+            wifi_stop();
+        }
+    }
+    free(s_net);
+    free(s_flash);
+    s_net = s_flash = NULL;
+
+    if (err) {
+        ui_show_error(err);
+        ui_wait_for_tap();
+        return;
+    }
+    draw_status("Updated: restarting", s_delta.total, s_delta.total);
+    vTaskDelay(pdMS_TO_TICKS(1500));
+    esp_restart();
+}
@@ -0,0 +1,13 @@
+/*
+ * wifi_update.h — Payload delta updates over Wi-Fi
+ */
+#ifndef WIFI_UPDATE_H
+#define WIFI_UPDATE_H
+
+/* Join CONFIG_SURVIVAL_WIFI_SSID, fetch the delta at
+ * CONFIG_SURVIVAL_UPDATE_URL (made by pack_payload.py --base) and apply
+ * it to the payload partition. Restarts the device once the new payload
+ * is committed; otherwise returns after showing why it was not. */
+void wifi_update_run(void);
+
+#endif /* WIFI_UPDATE_H */
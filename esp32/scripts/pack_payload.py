@@ -6,34 +6,130 @@ Reads from build/{aarch64,x86_64}/esp/ and creates a single payload.bin
 that gets flashed to the ESP32's payload partition.
 
 Usage:
-    python3 pack_payload.py [--build-dir ../build] [--output payload.bin]
+    python3 pack_payload.py [--build-dir ../build] [--output payload.bin] [--image]
+                            [--dict] [--v1]
 
 Then flash with:
     esptool.py write_flash 0x170000 payload.bin
 
-Payload format:
+Or, for a device that already has a v2 payload, make a Wi-Fi update:
+    python3 pack_payload.py --base old.bin [--base-root OFS] --delta payload.delta
+
+old.bin is what the payload partition holds now: the payload.bin it
+was flashed with, or the --output of the last delta (whose header is at
+the OFS that run printed). The new payload reuses every chunk of the old
+one that did not change, in place; new chunks and its tables go into a
+run of flash sectors the old payload does not use. --output gets the
+partition as it will be after the update, the base for the next one;
+payload.delta has only the sectors that change, for the device's
+Wi-Fi Update (Settings) to fetch from CONFIG_SURVIVAL_UPDATE_URL.
+
+Payload format (version 2; --v1 writes the layout older firmware reads):
     Header (8 bytes):
         magic: "SURV" (4 bytes)
-        version: 1 (1 byte)
+        version: 2 (1 byte)
         arch_count: N (1 byte)
-        reserved: 0 (2 bytes)
+        flags: 2 bytes (bit 0: image table present,
+                        bit 1: preset dictionary present, --dict)
 
     Arch table (24 bytes × N):
         name: 16 bytes (null-padded)
         offset: 4 bytes (from payload start to arch data)
         file_count: 4 bytes
 
+    Image table (4 bytes × N, only with --image):
+        offset: 4 bytes (from payload start to the arch's image, 0 = none)
+
+    Dictionary (only with --dict):
+        offset: 4 bytes (from payload start)
+        size: 4 bytes (at most 32 KB)
+        [the dictionary bytes, then padding to 4 bytes]
+
     Per architecture:
-        File manifest (136 bytes × file_count):
+        Chunk index location (8 bytes):
+            chunk_table: 4 bytes (from payload start)
+            chunk_count: 4 bytes
+
+        File manifest (144 bytes × file_count):
             path: 128 bytes (null-padded)
-            compressed_size: 4 bytes (0 = stored uncompressed)
+            stored_size: 4 bytes (all of its chunks)
             original_size: 4 bytes
-
-        File data:
-            [compressed or raw bytes for each file, concatenated]
+            first_chunk: 4 bytes
+            chunk_count: 4 bytes (0 for an empty file)
+
+        Chunk index (16 bytes × chunk_count):
+            offset: 4 bytes (from payload start)
+            stored_size: 4 bytes (== original_size: stored raw)
+            original_size: 4 bytes (64 KB, less for a file's last chunk)
+            crc32: 4 bytes (zlib CRC-32 of the original bytes)
+
+        Chunk data:
+            [raw deflate or raw bytes of each chunk, concatenated]
+
+        Image (--image, 4-byte aligned):
+            Header (28 bytes):
+                magic: "SIMG" (4 bytes)
+                sectors_per_cluster: 1 byte
+                reserved: 0 (3 bytes)
+                fat_entries: 4 bytes (clusters 0..fat_entries-1 are used)
+                extent_count: 4 bytes
+                first_chunk: 4 bytes (in this arch's chunk index)
+                chunk_count: 4 bytes
+                original_size: 4 bytes
+            Extents (8 bytes × extent_count):
+                first_cluster: 4 bytes
+                cluster_count: 4 bytes
+            Chunk data of the stream:
+                FAT entries 0..fat_entries-1, zero-padded to a sector, then
+                the clusters of each extent in order
+
+    Each chunk is an independent deflate stream, so any one can be
+    decoded and checked against its CRC without the ones before it.
+    Chunks are content-addressed: one whose bytes were already packed,
+    for this arch or an earlier one, is not stored again, and its index
+    entry points at the first copy. With a dictionary, every deflate
+    chunk was compressed with it as the preset dictionary (zdict).
+
+    Version 1 has no chunk index: manifest entries are 136 bytes (path,
+    compressed_size with 0 = stored, original_size), each file is one
+    deflate stream, the image header is 24 bytes (compressed_size in
+    place of first_chunk/chunk_count) and images follow all arch data.
+
+    A v2 payload's header need not be at the start of the partition:
+    its offsets are from the start of the partition either way, and the
+    device records where the header is when a delta moves it.
+
+    Delta (--delta), little-endian:
+        magic: "SURD" (4 bytes)
+        version: 1 (1 byte), then 3 bytes of 0
+        from_crc: 4 bytes (meta CRC of the payload it applies to)
+        root: 4 bytes (partition offset of the new header)
+        root_crc: 4 bytes (meta CRC of the new payload)
+        range_count: 4 bytes
+        Ranges (12 bytes × range_count, in offset order):
+            offset: 4 bytes (in the partition, on a 4 KB sector)
+            length: 4 bytes
+            crc32: 4 bytes (of the range's bytes)
+        header_crc: 4 bytes (CRC-32 of everything above)
+        [the bytes of each range, concatenated]
+
+    The meta CRC is the CRC-32 of the spans meta_spans() lists: the
+    header and its tables, the dictionary, and each arch's manifest,
+    chunk index and image header with its extents. The chunk index holds
+    each chunk's CRC, so it stands for the whole payload.
+
+    The image is the FAT32 volume the flasher would build from the files,
+    minus the geometry: the BPB, FSInfo and FAT sizes depend on the card
+    and are still written by fat32_format() on the device, after which the
+    stream goes out in one sequential pass. The files stay in the payload
+    for cards the image's cluster size does not fit.
 """
 
 import argparse
+import contextlib
+import copy
+import hashlib
+import io
 import os
 import struct
 import zlib
@@ -43,6 +139,25 @@ from pathlib import Path
 # Files smaller than this are stored uncompressed (not worth the overhead)
 COMPRESS_THRESHOLD = 4096
 
+# v2: original bytes per chunk (PAYLOAD_CHUNK_SIZE in payload.h)
+CHUNK_SIZE = 64 * 1024
+
+# Preset dictionary: one deflate window (PAYLOAD_DICT_MAX in payload.h)
+DICT_SIZE = 32 * 1024
+
+# Image geometry: fat32_format() picks 8 sectors per cluster (4 KB) for
+# any partition over about 260 MB, and puts the root directory at cluster 2
+SECTOR_SIZE = 512
+IMAGE_SPC = 8
+CLUSTER_SIZE = SECTOR_SIZE * IMAGE_SPC
+FAT32_EOC = 0x0FFFFFFF
+ATTR_DIRECTORY = 0x10
+ATTR_ARCHIVE = 0x20
+ATTR_VOLUME_ID = 0x08
+ATTR_LONG_NAME = 0x0F
+FAT_DATE = (2026 - 1980) << 9 | 1 << 5 | 1
+SHORT_CHARS = set(b"ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789!#$%&'()-@^_`{}~")
+
 
 def collect_files(esp_dir):
     """Walk an ESP directory tree and return list of (relative_path, data)."""
@@ -105,13 +220,549 @@ def pack_arch(name, esp_dir):
     return manifest, data, len(files)
 
 
+# ---- Pre-built FAT32 image ----
+
+def split_83(name):
+    """Split a name into (base, ext) at the last dot, as fat32.c does."""
+    dot = name.rfind(".")
+    if dot < 0:
+        return name, ""
+    return name[:dot], name[dot + 1:]
+
+
+def short_name(name, taken):
+    """Return (11-byte 8.3 name, NT case flags, needs_lfn) for name by the
+    rules of fat32.c, whose lookups must find it: a name goes into 8.3
+    when its parts fit, with a case flag for each all-lowercase part;
+    longer ones get a long name and a unique ~N short name."""
+    base, ext = split_83(name)
+    if len(base) <= 8 and len(ext) <= 3:
+        flags = 0
+        for part, bit in ((base, 0x08), (ext, 0x10)):
+            if part != part.upper() and part == part.lower():
+                flags |= bit
+        raw = base.upper().encode().ljust(8) + ext.upper().encode().ljust(3)
+        taken.add(raw)
+        return raw, flags, False
+
+    b = bytes(c for c in base.upper().encode() if c in SHORT_CHARS) or b"_"
+    e = bytes(c for c in ext.upper().encode() if c in SHORT_CHARS)[:3]
+    n = 1
+    while True:
+        tail = b"~%d" % n
+        raw = (b[:8 - len(tail)] + tail).ljust(8) + e.ljust(3)
+        if raw not in taken:
+            taken.add(raw)
+            return raw, 0, True
+        n += 1
+
+
+def lfn_entries(name, raw):
+    """VFAT long-name entries for name, in on-disk order."""
+    cksum = 0
+    for c in raw:
+        cksum = (((cksum & 1) << 7) + (cksum >> 1) + c) & 0xFF
+    units = list(name.encode("utf-16-le"))
+    chars = [units[i] | units[i + 1] << 8 for i in range(0, len(units), 2)]
+    count = (len(chars) + 12) // 13
+    chars += [0x0000] + [0xFFFF] * (count * 13 - len(chars) - 1)
+    chars = chars[:count * 13]
+    out = []
+    for seq in range(count, 0, -1):
+        c = chars[(seq - 1) * 13:seq * 13]
+        order = seq | (0x40 if seq == count else 0)
+        out.append(struct.pack("<B5HBBB6HH2H", order, *c[0:5], ATTR_LONG_NAME,
+                               0, cksum, *c[5:11], 0, *c[11:13]))
+    return out
+
+
+def dir_entry(raw, attr, flags, cluster, size):
+    return struct.pack("<11sBBBHHHHHHHI", raw, attr, flags, 0, 0, 0, 0,
+                       cluster >> 16, 0, FAT_DATE, cluster & 0xFFFF, size)
+
+
+class Dir:
+    def __init__(self):
+        self.items = []     # (name, Dir or file bytes), in payload order
+        self.subdirs = {}
+
+    def subdir(self, name):
+        if name not in self.subdirs:
+            self.subdirs[name] = Dir()
+            self.items.append((name, self.subdirs[name]))
+        return self.subdirs[name]
+
+
+def build_image(files):
+    """Lay the files out as a FAT32 volume from cluster 2 on. Returns
+    (fat_entries, extents, stream)."""
+    root = Dir()
+    for rel_path, data in files:
+        parts = rel_path.split("/")
+        d = root
+        for part in parts[:-1]:
+            d = d.subdir(part)
+        d.items.append((parts[-1], data))
+
+    fat = [0x0FFFFFF8, FAT32_EOC]
+    clusters = {}           # first cluster -> contents of its chain
+
+    def alloc(nbytes):
+        count = max(1, (nbytes + CLUSTER_SIZE - 1) // CLUSTER_SIZE)
+        first = len(fat)
+        fat.extend(range(first + 1, first + count))
+        fat.append(FAT32_EOC)
+        return first
+
+    # Each directory gets one cluster when its parent is written, then
+    # its files' clusters follow
+    def place(d, first, parent):
+        taken = set()
+        entries = []
+        if parent is None:
+            entries.append(dir_entry(b"SURVIVAL   ", ATTR_VOLUME_ID, 0, 0, 0))
+        else:
+            entries.append(dir_entry(b".          ", ATTR_DIRECTORY, 0, first, 0))
+            entries.append(dir_entry(b"..         ", ATTR_DIRECTORY, 0,
+                                     0 if parent == 2 else parent, 0))
+        subdirs = []
+        for name, item in d.items:
+            raw, flags, lfn = short_name(name, taken)
+            if lfn:
+                entries.extend(lfn_entries(name, raw))
+            if isinstance(item, Dir):
+                sub = alloc(0)
+                subdirs.append((item, sub))
+                entries.append(dir_entry(raw, ATTR_DIRECTORY, flags, sub, 0))
+            else:
+                # Empty files get a cluster too, as on the device: its
+                # reader takes first cluster 0 for "not found"
+                cl = alloc(len(item))
+                clusters[cl] = item
+                entries.append(dir_entry(raw, ATTR_ARCHIVE, flags, cl, len(item)))
+        clusters[first] = b"".join(entries)
+        for item, sub in subdirs:
+            place(item, sub, first)
+
+    place(root, alloc(0), None)
+
+    # A directory allocated one cluster up front may need more: give it
+    # an extra chain at the end and link it on
+    for first, data in list(clusters.items()):
+        need = max(1, (len(data) + CLUSTER_SIZE - 1) // CLUSTER_SIZE)
+        have, cl = 1, first
+        while fat[cl] != FAT32_EOC:
+            cl = fat[cl]
+            have += 1
+        if need > have:
+            more = alloc((need - have) * CLUSTER_SIZE)
+            fat[cl] = more
+
+    # Cluster contents in cluster order, following each chain
+    blocks = [bytes(CLUSTER_SIZE)] * len(fat)
+    for first, data in clusters.items():
+        cl, ofs = first, 0
+        while True:
+            blocks[cl] = data[ofs:ofs + CLUSTER_SIZE].ljust(CLUSTER_SIZE, b"\0")
+            ofs += CLUSTER_SIZE
+            if fat[cl] == FAT32_EOC:
+                break
+            cl = fat[cl]
+
+    # Every cluster from 2 up is used, so the extents are one run; the
+    # format allows holes for layouts that leave some
+    extents = [(2, len(fat) - 2)]
+    fat_head = struct.pack("<%dI" % len(fat), *fat)
+    fat_head = fat_head.ljust(-(-len(fat_head) // SECTOR_SIZE) * SECTOR_SIZE, b"\0")
+    stream = fat_head + b"".join(blocks[2:])
+    return len(fat), extents, stream
+
+
+def pack_image(name, esp_dir):
+    """Pack one architecture's v1 image. Returns its bytes, or b"" if empty."""
+    files = collect_files(esp_dir)
+    if not files:
+        return b""
+    fat_entries, extents, stream = build_image(files)
+    compressed = zlib.compress(stream, 9)[2:-4]
+    comp_size = len(compressed)
+    if comp_size >= len(stream):
+        compressed, comp_size = stream, 0
+
+    header = struct.pack("<4s B 3x I I I I", b"SIMG", IMAGE_SPC, fat_entries,
+                         len(extents), comp_size, len(stream))
+    table = b"".join(struct.pack("<I I", first, count) for first, count in extents)
+    print(f"  image: {fat_entries - 2} clusters, {len(stream)}B -> "
+          f"{'deflate %dB' % comp_size if comp_size else 'stored'}")
+    return header + table + compressed
+
+
+# ---- Version 2: chunks ----
+
+class ChunkStore:
+    """Chunks packed so far, by content, across every architecture."""
+
+    def __init__(self, zdict=None):
+        self.zdict = zdict
+        self.placed = {}    # sha256 of original bytes -> (offset, stored_size)
+        self.saved = 0      # stored bytes not written again
+
+    def deflate(self, piece):
+        """Raw deflate of piece, against the dictionary if there is one.
+        Returns piece itself if that is no smaller."""
+        if self.zdict:
+            c = zlib.compressobj(9, zlib.DEFLATED, -15, 9,
+                                 zlib.Z_DEFAULT_STRATEGY, self.zdict)
+        else:
+            c = zlib.compressobj(9, zlib.DEFLATED, -15)
+        packed = c.compress(piece) + c.flush()
+        return piece if len(packed) >= len(piece) else packed
+
+
+class ChunkWriter:
+    """Chunk index and data of one architecture. New chunks are kept at
+    offsets from the start of the data until table() places it; chunks
+    the store already has are listed at their absolute offsets."""
+
+    def __init__(self, store):
+        self.store = store
+        self.index = []     # (key, offset, absolute, stored_size, original_size, crc32)
+        self.local = {}     # key -> offset in self.data
+        self.data = b""
+
+    def add(self, data, label):
+        """Chunk data. Returns (first_chunk, chunk_count, stored_size)."""
+        first, stored, shared = len(self.index), 0, 0
+        for ofs in range(0, len(data), CHUNK_SIZE):
+            piece = data[ofs:ofs + CHUNK_SIZE]
+            key = hashlib.sha256(piece).digest()
+            crc = zlib.crc32(piece)
+            if key in self.store.placed:
+                at, size = self.store.placed[key]
+                self.index.append((key, at, True, size, len(piece), crc))
+                self.store.saved += size
+                shared += 1
+            elif key in self.local:
+                at, size = self.local[key]
+                self.index.append((key, at, False, size, len(piece), crc))
+                self.store.saved += size
+                shared += 1
+            else:
+                packed = self.store.deflate(piece)
+                self.local[key] = (len(self.data), len(packed))
+                self.index.append((key, len(self.data), False, len(packed),
+                                   len(piece), crc))
+                self.data += packed
+                size = len(packed)
+            stored += size
+        count = len(self.index) - first
+        note = f", {shared} shared" if shared else ""
+        print(f"  {label}: {len(data)}B -> {count} chunks, {stored}B{note}")
+        return first, count, stored
+
+    def align(self, n):
+        self.data += b"\0" * (-len(self.data) % n)
+
+    def table(self, data_start):
+        """The index, with offsets made absolute for data at data_start.
+        The new chunks go into the store for later architectures."""
+        out = b""
+        for key, ofs, absolute, size, orig, crc in self.index:
+            at = ofs if absolute else data_start + ofs
+            self.store.placed.setdefault(key, (at, size))
+            out += struct.pack("<I I I I", at, size, orig, crc)
+        return out
+
+
+def is_text(data):
+    return len(data) > 0 and b"\0" not in data[:8192]
+
+
+def build_dictionary(all_files):
+    """A preset dictionary from lines that recur across the text files
+    of every arch (each distinct file counted once): the most bytes
+    saved first, placed last, where back-references are shortest."""
+    seen = set()
+    counts = {}
+    for files in all_files:
+        for _, data in files:
+            key = hashlib.sha256(data).digest()
+            if key in seen or not is_text(data):
+                continue
+            seen.add(key)
+            for line in set(data.splitlines(keepends=True)):
+                if len(line) >= 8:
+                    counts[line] = counts.get(line, 0) + 1
+    ranked = sorted((line for line, n in counts.items() if n > 1),
+                    key=lambda line: counts[line] * len(line), reverse=True)
+    picked, size = [], 0
+    for line in ranked:
+        if size + len(line) > DICT_SIZE:
+            continue
+        picked.append(line)
+        size += len(line)
+    return b"".join(reversed(picked))
+
+
+def pack_arch_v2(files, base, with_image, store):
+    """Pack one architecture's files at offset base, sharing chunks
+    through store. Returns (blob, file_count, image offset or 0)."""
+    if not files:
+        return b"", 0, 0
+
+    chunks = ChunkWriter(store)
+    manifest = b""
+    for rel_path, file_data in files:
+        first, count, stored = chunks.add(file_data, rel_path)
+        path_bytes = rel_path.encode("utf-8")[:127] + b"\x00"
+        path_bytes = path_bytes.ljust(128, b"\x00")
+        manifest += struct.pack("<128s I I I I", path_bytes, stored,
+                                len(file_data), first, count)
+
+    # The image goes in with the files' chunks: header and extents first,
+    # then its chunk data, all reached through the same index (the data
+    # starts 4-byte aligned, so aligning within it is enough)
+    image_at = None
+    if with_image:
+        fat_entries, extents, stream = build_image(files)
+        chunks.align(4)
+        image_at = len(chunks.data)
+        ext_size = 8 * len(extents)
+        chunks.data += b"\0" * (28 + ext_size)
+        first, count, _ = chunks.add(stream, "image")
+        header = struct.pack("<4s B 3x I I I I I", b"SIMG", IMAGE_SPC,
+                             fat_entries, len(extents), first, count, len(stream))
+        table = b"".join(struct.pack("<I I", f, c) for f, c in extents)
+        chunks.data = (chunks.data[:image_at] + header + table +
+                       chunks.data[image_at + 28 + ext_size:])
+
+    head_size = 8 + len(manifest) + 16 * len(chunks.index)
+    pad = -(base + head_size) % 4
+    data_start = base + head_size + pad
+    blob = (struct.pack("<I I", base + 8 + len(manifest), len(chunks.index)) +
+            manifest + chunks.table(data_start) + b"\0" * pad + chunks.data)
+    blob += b"\0" * (-(base + len(blob)) % 4)   # next arch aligned too
+    return blob, len(files), data_start + image_at if image_at is not None else 0
+
+
+# ---- Delta updates ----
+
+PARTITION_SIZE = 0x290000   # the payload partition (partitions.csv)
+SECTOR_SIZE_FLASH = 4096    # its erase unit (PAYLOAD_SECTOR_SIZE)
+
+
+def meta_spans(img, root, chunks=False):
+    """(offset, length) of each part of the v2 payload at root that
+    describes it, in the order payload.c's walk_spans() visits them;
+    with chunks, then each chunk's stored bytes. Raises ValueError if
+    root holds no v2 payload."""
+    size = len(img)
+    if root % 4 or root + 8 > size:
+        raise ValueError("no payload header at 0x%x" % root)
+    magic, version, n, flags = struct.unpack_from("<4s B B H", img, root)
+    if magic != b"SURV" or version != 2:
+        raise ValueError("no v2 payload at 0x%x" % root)
+
+    def check(ofs, length):
+        if ofs + length > size:
+            raise ValueError("payload at 0x%x runs off the partition" % root)
+        return ofs, length
+
+    table_end = 8 + 24 * n
+    images_at = dict_at = table_end
+    if flags & 0x0001:
+        table_end += 4 * n
+        dict_at = table_end
+    if flags & 0x0002:
+        table_end += 8
+    spans = [check(root, table_end)]
+    if flags & 0x0002:
+        spans.append(check(*struct.unpack_from("<I I", img, root + dict_at)))
+
+    arches = [struct.unpack_from("<16s I I", img, root + 8 + 24 * a)[1:]
+              for a in range(n)]
+    indexes = []
+    for a, (ofs, file_count) in enumerate(arches):
+        spans.append(check(ofs, 8 + 144 * file_count))
+        table, count = struct.unpack_from("<I I", img, ofs)
+        spans.append(check(table, 16 * count))
+        indexes.append((table, count))
+        if flags & 0x0001:
+            (image,) = struct.unpack_from("<I", img, root + images_at + 4 * a)
+            if image:
+                check(image, 28)
+                (extents,) = struct.unpack_from("<I", img, image + 12)
+                spans.append(check(image, 28 + 8 * extents))
+    if chunks:
+        for table, count in indexes:
+            for i in range(count):
+                ofs, stored = struct.unpack_from("<I I", img, table + 16 * i)
+                spans.append(check(ofs, stored))
+    return spans
+
+
+def meta_crc(img, root):
+    crc = 0
+    for ofs, length in meta_spans(img, root):
+        crc = zlib.crc32(img[ofs:ofs + length], crc)
+    return crc
+
+
+def base_chunks(img, root):
+    """The base payload's dictionary span (or None) and a ChunkStore
+    holding each of its chunks that still checks out, at its offset."""
+    _, _, n, flags = struct.unpack_from("<4s B B H", img, root)
+    dict_span = None
+    zdict = b""
+    if flags & 0x0002:
+        at = root + 8 + 24 * n + (4 * n if flags & 0x0001 else 0)
+        dict_span = struct.unpack_from("<I I", img, at)
+        zdict = img[dict_span[0]:dict_span[0] + dict_span[1]]
+    store = ChunkStore(zdict)
+    for a in range(n):
+        (ofs,) = struct.unpack_from("<I", img, root + 8 + 24 * a + 16)
+        table, count = struct.unpack_from("<I I", img, ofs)
+        for i in range(count):
+            at, stored, orig, crc = struct.unpack_from("<I I I I", img,
+                                                       table + 16 * i)
+            data = img[at:at + stored]
+            if stored < orig:
+                d = (zlib.decompressobj(-15, zdict=zdict) if zdict
+                     else zlib.decompressobj(-15))
+                try:
+                    data = d.decompress(data) + d.flush()
+                except zlib.error:
+                    continue
+            if len(data) == orig and zlib.crc32(data) == crc:
+                store.placed.setdefault(hashlib.sha256(data).digest(),
+                                        (at, stored))
+    return dict_span, store
+
+
+def build_v2(arches, arch_files, root, with_image, store, dict_span):
+    """The header, tables and arch data of a v2 payload whose header goes
+    at root, reusing the base's dictionary (dict_span) if it has one."""
+    n = len(arches)
+    flags = (0x0001 if with_image else 0) | (0x0002 if dict_span else 0)
+    header = struct.pack("<4s B B H", b"SURV", 2, n, flags)
+    dictionary = struct.pack("<I I", *dict_span) if dict_span else b""
+    data_offset = root + len(header) + 24 * n + (4 * n if with_image else 0)
+    data_offset += len(dictionary)
+
+    arch_table = image_table = b""
+    blobs = b""
+    for (arch_name, esp_dir), files in zip(arches, arch_files):
+        print(f"\nPacking {arch_name}:")
+        blob, file_count, image_at = pack_arch_v2(files, data_offset,
+                                                  with_image, store)
+        if with_image:
+            image_table += struct.pack("<I", image_at)
+        name_bytes = arch_name.encode("utf-8")[:15] + b"\x00"
+        arch_table += struct.pack("<16s I I", name_bytes.ljust(16, b"\x00"),
+                                  data_offset, file_count)
+        blobs += blob
+        data_offset += len(blob)
+    return header + arch_table + image_table + dictionary + blobs
+
+
+def make_delta(args, arches, arch_files):
+    """--base: lay the new payload out around the old one and write the
+    partition after the update (--output) and the delta (--delta)."""
+    if Path(args.output).resolve() == Path(args.base).resolve():
+        print("Error: --output would overwrite the base; name another file.")
+        return 1
+    base = Path(args.base).read_bytes()
+    if len(base) > PARTITION_SIZE:
+        print(f"Error: {args.base} is larger than the partition.")
+        return 1
+    img = bytearray(base.ljust(PARTITION_SIZE, b"\xff"))
+    try:
+        from_crc = meta_crc(img, args.base_root)
+        live = meta_spans(img, args.base_root, chunks=True)
+    except ValueError as e:
+        print(f"Error: {args.base}: {e}")
+        return 1
+    dict_span, store = base_chunks(img, args.base_root)
+    if args.dict and not dict_span:
+        print("Note: the base has no dictionary; --dict ignored")
+    elif dict_span:
+        print(f"Base dictionary: {dict_span[1]}B, kept")
+
+    sectors = PARTITION_SIZE // SECTOR_SIZE_FLASH
+    used = [False] * sectors
+    for ofs, length in live:
+        for sec in range(ofs // SECTOR_SIZE_FLASH,
+                         (ofs + length + SECTOR_SIZE_FLASH - 1) // SECTOR_SIZE_FLASH):
+            used[sec] = True
+
+    # The size does not depend on where it goes (every offset in it is
+    # 4-byte aligned relative to a sector), so a dry run tells it
+    with contextlib.redirect_stdout(io.StringIO()):
+        need = len(build_v2(arches, arch_files, 0, args.image,
+                            copy.deepcopy(store), dict_span))
+    need_sectors = -(-need // SECTOR_SIZE_FLASH)
+    root, run = None, 0
+    for sec in range(sectors):
+        run = 0 if used[sec] else run + 1
+        if run == need_sectors:
+            root = (sec - run + 1) * SECTOR_SIZE_FLASH
+            break
+    if root is None:
+        print(f"Error: no run of {need_sectors * 4} KB of free sectors in "
+              f"the partition; flash payload.bin over USB instead.")
+        return 1
+
+    region = build_v2(arches, arch_files, root, args.image, store, dict_span)
+    img[root:root + need_sectors * SECTOR_SIZE_FLASH] = (
+        region.ljust(need_sectors * SECTOR_SIZE_FLASH, b"\xff"))
+    root_crc = meta_crc(img, root)
+
+    ranges = [(root, len(region), zlib.crc32(region))]
+    head = struct.pack("<4s B 3x I I I I", b"SURD", 1, from_crc, root,
+                       root_crc, len(ranges))
+    head += b"".join(struct.pack("<I I I", *r) for r in ranges)
+    head += struct.pack("<I", zlib.crc32(head))
+    delta = head + region
+
+    end = max(len(base), root + len(region))
+    Path(args.output).write_bytes(bytes(img[:end]))
+    Path(args.delta).write_bytes(delta)
+    print(f"\nKept in place: {store.saved}B of the base payload's chunks")
+    print(f"Delta written: {args.delta} ({len(delta)} bytes, "
+          f"{len(delta)/1024:.1f} KB), new payload at 0x{root:x}")
+    print(f"Partition after the update: {args.output} "
+          f"(next time: --base {args.output} --base-root 0x{root:x})")
+    return 0
+
+
 def main():
     parser = argparse.ArgumentParser(description="Pack survival workstation payload")
     parser.add_argument("--build-dir", default="../build",
                        help="Build directory containing arch subdirs")
     parser.add_argument("--output", default="payload.bin",
                        help="Output payload binary")
+    parser.add_argument("--image", action="store_true",
+                       help="Also pack a pre-built FAT32 image per architecture")
+    parser.add_argument("--dict", action="store_true",
+                       help="Compress against a preset dictionary built from "
+                            "text shared between files")
+    parser.add_argument("--v1", action="store_true",
+                       help="Write the version 1 format (one stream per file)")
+    parser.add_argument("--base",
+                       help="Partition image the device has now: make a "
+                            "delta update from it")
+    parser.add_argument("--base-root", type=lambda v: int(v, 0), default=0,
+                       help="Offset of the base payload's header (printed "
+                            "by the delta run that made it)")
+    parser.add_argument("--delta", default="payload.delta",
+                       help="Delta output, with --base")
     args = parser.parse_args()
+    if args.v1 and args.dict:
+        print("Error: --dict needs the version 2 format.")
+        return 1
+    if args.v1 and args.base:
+        print("Error: delta updates need the version 2 format.")
+        return 1
 
     build_dir = Path(args.build_dir)
     arches = []
@@ -126,20 +777,47 @@ def main():
         print("Error: no ESP directories found. Build first with 'make all-arches'.")
         return 1
 
+    arch_files = [collect_files(esp_dir) for _, esp_dir in arches]
+    if args.base:
+        return make_delta(args, arches, arch_files)
+    zdict = build_dictionary(arch_files) if args.dict else b""
+    if args.dict:
+        print(f"Dictionary: {len(zdict)}B from shared text lines")
+
     # Build header
-    header = struct.pack("<4s B B H", b"SURV", 1, len(arches), 0)
+    flags = (0x0001 if args.image else 0) | (0x0002 if zdict else 0)
+    version = 1 if args.v1 else 2
+    header = struct.pack("<4s B B H", b"SURV", version, len(arches), flags)
 
-    # Calculate offsets: header + arch_table, then per-arch data
+    # Calculate offsets: header + arch_table (+ image table) (+ dictionary),
+    # then per-arch data
     arch_table_size = 24 * len(arches)
-    data_offset = len(header) + arch_table_size
+    image_table_size = 4 * len(arches) if args.image else 0
+    data_offset = len(header) + arch_table_size + image_table_size
+
+    dictionary = b""
+    if zdict:
+        dictionary = struct.pack("<I I", data_offset + 8, len(zdict)) + zdict
+        dictionary += b"\0" * (-(data_offset + len(dictionary)) % 4)
+        data_offset += len(dictionary)
 
     arch_table = b""
     arch_blobs = []
+    image_table = b""
+    store = ChunkStore(zdict)
 
-    for arch_name, esp_dir in arches:
+    for (arch_name, esp_dir), files in zip(arches, arch_files):
         print(f"\nPacking {arch_name}:")
-        manifest, data, file_count = pack_arch(arch_name, esp_dir)
-        blob = manifest + data
+        if args.v1:
+            manifest, data, file_count = pack_arch(arch_name, esp_dir)
+            blob = manifest + data
+        else:
+            if not files:
+                print(f"  Warning: no files found in {esp_dir}")
+            blob, file_count, image_at = pack_arch_v2(files, data_offset,
+                                                      args.image, store)
+            if args.image:
+                image_table += struct.pack("<I", image_at)
 
         # Arch table entry: 16-byte name + 4-byte offset + 4-byte file_count
         name_bytes = arch_name.encode("utf-8")[:15] + b"\x00"
@@ -149,9 +827,27 @@ def main():
         arch_blobs.append(blob)
         data_offset += len(blob)
 
+    if store.saved:
+        print(f"\nShared chunks: {store.saved}B stored once")
+
+    # v1 images go after all the arch data, each 4-byte aligned
+    image_blobs = []
+    if args.image and args.v1:
+        for arch_name, esp_dir in arches:
+            print(f"\nImaging {arch_name}:")
+            image = pack_image(arch_name, esp_dir)
+            if not image:
+                image_table += struct.pack("<I", 0)
+                continue
+            pad = -data_offset % 4
+            data_offset += pad
+            image_table += struct.pack("<I", data_offset)
+            image_blobs.append(b"\0" * pad + image)
+            data_offset += len(image)
+
     # Assemble final payload
-    payload = header + arch_table
-    for blob in arch_blobs:
+    payload = header + arch_table + image_table + dictionary
+    for blob in arch_blobs + image_blobs:
         payload += blob
 
     # Write output
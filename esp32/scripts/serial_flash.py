@@ -0,0 +1,348 @@
+#!/usr/bin/env python3
+"""
+serial_flash.py — Write a disk image to the CYD's SD card over USB serial.
+
+Open "USB SD" on the device, then:
+
+    python3 serial_flash.py /dev/ttyUSB0 survival.img [--baud 2000000]
+
+The image goes onto the card from sector 0, as dd would write it. It is
+sent in frames of up to 16 KB, each deflated on its own (or sent raw if
+that is no smaller), runs of zero sectors as one short frame apiece; so
+a mostly empty image takes far less time than its size on the wire.
+Needs pyserial.
+
+Protocol (see esp32/main/app_serial.c for the device side). Every frame,
+both ways, little-endian:
+
+    magic    2   b"SF" to the device, b"SA" from it
+    type     1
+    flags    1   DATA: 1 = deflated, 2 = zeros (no payload);
+                 replies: status
+    offset   8
+    length   4   image bytes the frame covers
+    size     4   payload bytes
+    payload
+    crc32    4   zlib CRC-32 of all of the above
+
+    HELLO(payload: size u64, id u32)  -> WELCOME(offset = resume point;
+                                         payload: card bytes u64, largest
+                                         frame u32, window u32, largest
+                                         zero run u32)
+    DATA                              -> ACK(offset = next expected) or
+                                         NAK(offset = resend from here)
+    END(offset = image size)          -> DONE(offset = bytes on card)
+
+Unacknowledged frames on the wire are kept within the device's window.
+If the port goes away (cable pulled, device busy too long), the script
+reopens it and sends HELLO again: the device answers with where it got
+to and the image carries on from there, as long as the app stayed open.
+"""
+
+import argparse
+import collections
+import os
+import struct
+import sys
+import time
+import zlib
+
+try:
+    import serial
+except ImportError:
+    serial = None
+
+HDR = struct.Struct("<2sBBQII")
+CRC = struct.Struct("<I")
+
+FR_HELLO, FR_DATA, FR_END = 0x01, 0x02, 0x03
+FR_WELCOME, FR_ACK, FR_NAK, FR_DONE, FR_ERROR = 0x81, 0x82, 0x83, 0x84, 0x85
+FL_DEFLATE, FL_ZERO = 0x01, 0x02
+
+STATUS = {
+    0: "ok",
+    1: "image is larger than the card",
+    2: "SD card write failed",
+    3: "no session",
+    4: "device rejected a frame",
+}
+
+REPLY_TIMEOUT = 3.0     # seconds without a reply before going back
+MAX_TIMEOUTS = 5        # in a row, before reopening the port
+
+
+class LinkLost(Exception):
+    pass
+
+
+class DeviceError(Exception):
+    pass
+
+
+def frame(ftype, flags, offset, length, payload=b""):
+    head = HDR.pack(b"SF", ftype, flags, offset, length, len(payload))
+    return head + payload + CRC.pack(zlib.crc32(head + payload))
+
+
+class Link:
+    """Frames over a pyserial port"""
+
+    def __init__(self, port, baud):
+        self.ser = serial.Serial()
+        self.ser.port = port
+        self.ser.baudrate = baud
+        self.ser.timeout = 0.05
+        # Leave EN and IO0 alone: toggling either resets the CYD
+        self.ser.dtr = False
+        self.ser.rts = False
+        self.ser.open()
+        self.ser.reset_input_buffer()
+        self.buf = bytearray()
+
+    def close(self):
+        try:
+            self.ser.close()
+        except (OSError, serial.SerialException):
+            pass
+
+    def send(self, data):
+        try:
+            self.ser.write(data)
+        except (OSError, serial.SerialException) as e:
+            raise LinkLost(str(e))
+
+    def _fill(self):
+        try:
+            data = self.ser.read(max(1, self.ser.in_waiting))
+        except (OSError, serial.SerialException) as e:
+            raise LinkLost(str(e))
+        self.buf += data
+
+    def reply(self, timeout):
+        """Next good reply as (type, status, offset, payload), or None"""
+        deadline = time.monotonic() + timeout
+        while True:
+            i = self.buf.find(b"SA")
+            if i < 0:
+                del self.buf[:max(0, len(self.buf) - 1)]
+            else:
+                del self.buf[:i]
+                if len(self.buf) >= HDR.size:
+                    _, ftype, status, offset, _, size = HDR.unpack_from(self.buf)
+                    if size > 64:
+                        del self.buf[:2]
+                        continue
+                    end = HDR.size + size + CRC.size
+                    if len(self.buf) >= end:
+                        body = bytes(self.buf[:HDR.size + size])
+                        (crc,) = CRC.unpack_from(self.buf, HDR.size + size)
+                        if crc != zlib.crc32(body):
+                            del self.buf[:2]
+                            continue
+                        del self.buf[:end]
+                        return ftype, status, offset, body[HDR.size:]
+            if time.monotonic() >= deadline:
+                return None
+            self._fill()
+
+
+def image_id(f, size):
+    """Identifies the image across reconnects: its size and ends"""
+    f.seek(0)
+    crc = zlib.crc32(f.read(1 << 20))
+    f.seek(max(0, size - (1 << 20)))
+    crc = zlib.crc32(f.read(1 << 20), crc)
+    return (crc ^ size ^ (size >> 32)) & 0xFFFFFFFF
+
+
+def frames_from(f, size, offset, max_data, zero_max, level):
+    """(offset, length, wire bytes) for the image from offset on"""
+    zeros = bytes(max_data)
+    f.seek(offset)
+    run_start = run_len = 0
+    while offset < size:
+        chunk = f.read(min(max_data, size - offset))
+        if not chunk:
+            raise IOError("image shorter than its size")
+        n = len(chunk)
+        if chunk == zeros[:n] and (n % 512 == 0 or offset + n == size):
+            if run_len == 0:
+                run_start = offset
+            run_len += n
+            offset += n
+            if run_len + max_data > zero_max or offset == size:
+                yield run_start, run_len, frame(FR_DATA, FL_ZERO, run_start, run_len)
+                run_len = 0
+            continue
+        if run_len:
+            yield run_start, run_len, frame(FR_DATA, FL_ZERO, run_start, run_len)
+            run_len = 0
+        c = zlib.compressobj(level, zlib.DEFLATED, -15)
+        packed = c.compress(chunk) + c.flush()
+        if len(packed) < n:
+            yield offset, n, frame(FR_DATA, FL_DEFLATE, offset, n, packed)
+        else:
+            yield offset, n, frame(FR_DATA, 0, offset, n, chunk)
+        offset += n
+
+
+class Progress:
+    def __init__(self, size):
+        self.size = size
+        self.t0 = time.monotonic()
+        self.last = 0.0
+        self.base = None
+        self.acked = 0
+        self.wire = 0
+
+    def show(self, acked, force=False):
+        self.acked = acked
+        now = time.monotonic()
+        if not force and now - self.last < 1.0:
+            return
+        self.last = now
+        if self.base is None:
+            self.base, self.t0 = acked, now
+        dt = max(now - self.t0, 1e-3)
+        sys.stdout.write("\r  %d / %d MB  %.0f KB/s (%.0f KB/s on the wire)   "
+                         % (acked >> 20, self.size >> 20,
+                            (acked - self.base) / dt / 1024,
+                            self.wire / dt / 1024))
+        sys.stdout.flush()
+
+
+def hello(link, size, ident):
+    for _ in range(MAX_TIMEOUTS):
+        link.send(frame(FR_HELLO, 0, 0, 0, struct.pack("<QI", size, ident)))
+        r = link.reply(REPLY_TIMEOUT)
+        while r and r[0] != FR_WELCOME:
+            r = link.reply(REPLY_TIMEOUT)
+        if r:
+            ftype, status, offset, payload = r
+            if status:
+                raise DeviceError(STATUS.get(status, "status %d" % status))
+            card, max_data, window, zero_max = struct.unpack("<QIII", payload)
+            return offset, card, max_data, window, zero_max
+    raise LinkLost("no answer to HELLO: is USB SD open on the device?")
+
+
+def stream(link, f, size, ident, level, progress):
+    """One connection's worth. Returns once the card has every byte."""
+    resume, card, max_data, window, zero_max = hello(link, size, ident)
+    if progress.base is None:
+        print("Card: %d MB; %s at %d MB" % (card >> 20,
+              "resuming" if resume else "starting", resume >> 20))
+
+    acked = nexto = resume
+    inflight = collections.deque()      # (offset, length, wire)
+    inflight_bytes = 0
+    frames = frames_from(f, size, nexto, max_data, zero_max, level)
+    pending = None
+    rewind_at, stale = -1, 0
+    timeouts = 0
+
+    def rewind(to):
+        nonlocal nexto, frames, pending, inflight_bytes, rewind_at, stale
+        stale = sum(1 for o, _, _ in inflight if o > to)
+        rewind_at = to
+        inflight.clear()
+        inflight_bytes = 0
+        nexto = to
+        frames = frames_from(f, size, to, max_data, zero_max, level)
+        pending = None
+
+    while True:
+        # Fill the window
+        while nexto < size:
+            if pending is None:
+                pending = next(frames)
+            if inflight and inflight_bytes + len(pending[2]) > window:
+                break
+            link.send(pending[2])
+            progress.wire += len(pending[2])
+            inflight.append(pending)
+            inflight_bytes += len(pending[2])
+            nexto = pending[0] + pending[1]
+            pending = None
+        if acked == size:
+            link.send(frame(FR_END, 0, size, 0))
+
+        r = link.reply(REPLY_TIMEOUT)
+        if r is None:
+            timeouts += 1
+            if timeouts >= MAX_TIMEOUTS:
+                raise LinkLost("device stopped answering")
+            rewind(acked)
+            continue
+        timeouts = 0
+        ftype, status, offset, _ = r
+        if ftype == FR_ACK:
+            acked = max(acked, offset)
+            while inflight and inflight[0][0] + inflight[0][1] <= acked:
+                inflight_bytes -= len(inflight.popleft()[2])
+        elif ftype == FR_NAK:
+            acked = max(acked, offset)
+            if offset == rewind_at and stale > 0:
+                stale -= 1              # sent before we went back
+            else:
+                rewind(offset)
+        elif ftype == FR_DONE:
+            if status:
+                raise DeviceError(STATUS.get(status, "status %d" % status))
+            progress.show(offset, True)
+            return
+        elif ftype == FR_ERROR:
+            raise DeviceError(STATUS.get(status, "status %d" % status))
+        progress.show(acked)
+
+
+def main():
+    ap = argparse.ArgumentParser(description="Write a disk image to the "
+                                 "CYD's SD card over USB serial")
+    ap.add_argument("port", help="serial port, e.g. /dev/ttyUSB0 or COM5")
+    ap.add_argument("image", help="raw disk image")
+    ap.add_argument("--baud", type=int, default=2000000,
+                    help="the device's CONFIG_SURVIVAL_SERIAL_BAUD")
+    ap.add_argument("--level", type=int, default=6, help="deflate level, 1-9")
+    ap.add_argument("--wait", type=float, default=120,
+                    help="seconds to keep reopening a lost port")
+    args = ap.parse_args()
+
+    if serial is None:
+        sys.exit("serial_flash.py needs pyserial (pip install pyserial)")
+
+    with open(args.image, "rb") as f:
+        size = os.fstat(f.fileno()).st_size
+        if size == 0:
+            sys.exit("%s is empty" % args.image)
+        ident = image_id(f, size)
+        progress = Progress(size)
+        t0 = time.monotonic()
+        lost_since = lost_at = None
+        while True:
+            link = None
+            try:
+                link = Link(args.port, args.baud)
+                stream(link, f, size, ident, args.level, progress)
+                break
+            except DeviceError as e:
+                sys.exit("\nDevice: %s" % e)
+            except (LinkLost, OSError, serial.SerialException) as e:
+                now = time.monotonic()
+                if lost_since is None or progress.acked != lost_at:
+                    lost_since, lost_at = now, progress.acked
+                    print("\nLink lost (%s): reconnecting" % e)
+                if now - lost_since > args.wait:
+                    sys.exit("Gave up after %.0f s" % (now - lost_since))
+                time.sleep(1)
+                continue
+            finally:
+                if link:
+                    link.close()
+
+    dt = time.monotonic() - t0
+    print("\nWrote %d bytes in %.1f s" % (size, dt))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,541 @@
+#!/usr/bin/env python3
+"""
+qemu-perf-test.py — Scripted performance run of the workstation in QEMU.
+
+Boots the built ESP under OVMF (x86_64) or AAVMF (aarch64) with a TRACE
+file on the boot disk, so the workstation writes event marks to the
+serial console (src/trace.h). Keys are sent over QMP; each step waits
+for the mark that ends it. Two sessions:
+
+  1. Boot disk, the NTFS source and an exFAT target from
+     run-qemu-exfat-ntfs-test*.sh: time to the browser, F5 compile-run
+     of hello.c (then again from the run cache), F6 rebuild (cold, then
+     with every object cached), NTFS and exFAT directory listings, and
+     pasting the NTFS volume's ISO onto the exFAT volume.
+  2. Boot disk, that exFAT volume and an empty USB disk: F10 writes
+     the ISO to the empty disk.
+
+Metrics go to build/<arch>/perf.json and are compared with a baseline
+(build/<arch>/perf-baseline.json by default, recorded on the first run
+or with --update-baseline). The run fails when a metric is worse than
+the baseline by more than --tolerance. Times include TCG overhead, so a
+baseline only means something on the machine and accelerator that made
+it.
+
+Usage:
+    python3 scripts/qemu-perf-test.py [--arch x86_64|aarch64]
+        [--ntfs IMG] [--exfat IMG] [--baseline FILE] [--update-baseline]
+        [--tolerance 0.25] [--timeout-scale N] [--kvm|--no-kvm]
+
+The images default to those the exFAT/NTFS test script leaves in /tmp;
+without them only the boot, F5 and F6 metrics are taken. They are
+copied, never changed. Requires qemu-system-<arch>, mtools, mkfs.vfat.
+"""
+
+import argparse
+import json
+import os
+import re
+import shutil
+import socket
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+PROJECT_DIR = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+FIRMWARE = {
+    "x86_64": [
+        "/usr/share/OVMF/OVMF_CODE_4M.fd",
+        "/usr/share/OVMF/OVMF_CODE.fd",
+        "/usr/share/edk2/x64/OVMF_CODE.fd",
+        "/usr/share/ovmf/OVMF.fd",
+        "/usr/share/qemu/OVMF.fd",
+    ],
+    "aarch64": [
+        "/usr/share/qemu-efi-aarch64/QEMU_EFI.fd",
+        "/usr/share/edk2/aarch64/QEMU_EFI.fd",
+        "/usr/share/AAVMF/AAVMF_CODE.fd",
+        "/usr/share/edk2-aarch64/QEMU_EFI.fd",
+    ],
+}
+
+# Images left by run-qemu-exfat-ntfs-test*.sh
+DEFAULT_IMAGES = {
+    "x86_64": ("/tmp/survival_ntfs_src_x64.img", "/tmp/survival_exfat_dst1_x64.img"),
+    "aarch64": ("/tmp/survival_ntfs_src.img", "/tmp/survival_exfat_dst1.img"),
+}
+
+BOOT_EFI = {"x86_64": "BOOTX64.EFI", "aarch64": "BOOTAA64.EFI"}
+
+# Name, unit, True when higher is better
+METRICS = [
+    ("boot_to_browser_s", "s", False),
+    ("f5_compile_run_s", "s", False),
+    ("f5_cached_run_s", "s", False),
+    ("f6_rebuild_cold_s", "s", False),
+    ("f6_rebuild_cached_s", "s", False),
+    ("ntfs_list_ms", "ms", False),
+    ("exfat_list_ms", "ms", False),
+    ("ntfs_to_exfat_mb_s", "MB/s", True),
+    ("iso_write_mb_s", "MB/s", True),
+]
+
+# Seconds each step may take under TCG, before --timeout-scale
+T_BOOT = 180
+T_STEP = 60
+T_PROBE = 120
+T_REBUILD = 3600
+T_COPY = 1800
+
+MARK_RE = re.compile(r"@@ (\d+) (\S+) (\d+) (\d+) ?(.*)")
+
+
+class TestError(Exception):
+    pass
+
+
+# ---- One QEMU session ----
+
+class Session:
+    """A running VM: marks from the serial console, keys over QMP."""
+
+    def __init__(self, args, workdir, name, disks, log):
+        self.args = args
+        self.timeout_scale = args.timeout_scale
+        self.marks = []             # (host time, guest ms, event, a, b, detail)
+        self.cond = threading.Condition()
+        self.listing = {}           # index -> (name, is_dir)
+        self.list_count = 0
+        self.probing = True
+        self.log = log
+
+        qmp_path = os.path.join(workdir, name + ".qmp")
+        cmd = qemu_command(args, workdir, name, disks, qmp_path)
+        self.t0 = time.monotonic()
+        self.proc = subprocess.Popen(cmd, stdin=subprocess.DEVNULL,
+                                     stdout=subprocess.PIPE,
+                                     stderr=subprocess.STDOUT)
+        self.reader = threading.Thread(target=self._read_serial, daemon=True)
+        self.reader.start()
+        self.qmp = self._connect_qmp(qmp_path)
+
+    def _read_serial(self):
+        for raw in self.proc.stdout:
+            line = raw.decode("latin-1").rstrip("\r\n")
+            self.log.write(line + "\n")
+            m = MARK_RE.search(line)
+            if not m:
+                continue
+            mark = (time.monotonic(), int(m.group(1)), m.group(2),
+                    int(m.group(3)), int(m.group(4)), m.group(5))
+            with self.cond:
+                if mark[2] == "list":
+                    self.listing = {}
+                    self.list_count = mark[3]
+                    self.probing = mark[4] != 0
+                elif mark[2] == "item":
+                    self.listing[mark[3]] = (mark[5], mark[4] != 0)
+                self.marks.append(mark)
+                self.cond.notify_all()
+        with self.cond:
+            self.cond.notify_all()
+
+    def _connect_qmp(self, path):
+        deadline = time.monotonic() + 30
+        while True:
+            try:
+                s = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+                s.connect(path)
+                break
+            except OSError:
+                if self.proc.poll() is not None or time.monotonic() > deadline:
+                    raise TestError("QEMU did not start (see the serial log)")
+                time.sleep(0.2)
+        f = s.makefile("rw")
+        f.readline()                            # greeting
+        self._qmp_send(f, {"execute": "qmp_capabilities"})
+        return f
+
+    def _qmp_send(self, f, msg):
+        f.write(json.dumps(msg) + "\n")
+        f.flush()
+        while True:
+            reply = json.loads(f.readline())
+            if "return" in reply:
+                return reply["return"]
+            if "error" in reply:
+                raise TestError("QMP: " + reply["error"].get("desc", "error"))
+
+    def key(self, *names):
+        """Press keys one after another; "y", "f5", "ret", "down"..."""
+        for k in names:
+            self._qmp_send(self.qmp, {
+                "execute": "send-key",
+                "arguments": {"keys": [{"type": "qcode", "data": k}]}})
+            time.sleep(0.05)
+
+    def pos(self):
+        """Where the next wait() starts looking"""
+        with self.cond:
+            return len(self.marks)
+
+    def wait(self, events, timeout, since):
+        """The first mark at or after since whose event is in events"""
+        if isinstance(events, str):
+            events = (events,)
+        deadline = time.monotonic() + timeout * self.timeout_scale
+        with self.cond:
+            while True:
+                for m in self.marks[since:]:
+                    if m[2] in events:
+                        return m
+                left = deadline - time.monotonic()
+                if left <= 0 or self.proc.poll() is not None:
+                    raise TestError("no %s mark within %d s" %
+                                    ("/".join(events), timeout * self.timeout_scale))
+                self.cond.wait(min(left, 1.0))
+
+    def wait_probed(self):
+        deadline = time.monotonic() + T_PROBE * self.timeout_scale
+        with self.cond:
+            while self.probing:
+                left = deadline - time.monotonic()
+                if left <= 0:
+                    raise TestError("volumes still probing after %d s" % T_PROBE)
+                self.cond.wait(min(left, 1.0))
+
+    def find(self, match):
+        """Index of the first listed entry match(name) accepts"""
+        with self.cond:
+            for i in sorted(self.listing):
+                if match(self.listing[i][0]):
+                    return i
+        return -1
+
+    def select(self, match, what):
+        i = self.find(match)
+        if i < 0:
+            raise TestError("%s is not in the listing" % what)
+        self.key("home")
+        self.key(*(["down"] * i))
+        return i
+
+    def enter(self, match, what):
+        """Select an entry and open it; returns the listing's dir mark"""
+        self.select(match, what)
+        p = self.pos()
+        self.key("ret")
+        mark = self.wait("dir", T_STEP, p)
+        self.wait("list", T_STEP, p)
+        return mark
+
+    def close(self):
+        try:
+            self._qmp_send(self.qmp, {"execute": "quit"})
+        except (OSError, TestError, ValueError):
+            pass
+        try:
+            self.proc.wait(timeout=30)
+        except subprocess.TimeoutExpired:
+            self.proc.kill()
+            self.proc.wait()
+
+
+# ---- Images and the QEMU command line ----
+
+def find_firmware(arch):
+    for fw in FIRMWARE[arch]:
+        if os.path.isfile(fw):
+            return fw
+    raise TestError("UEFI firmware for %s not found" % arch)
+
+
+def run(cmd):
+    subprocess.run(cmd, check=True, stdout=subprocess.DEVNULL,
+                   stderr=subprocess.DEVNULL)
+
+
+def make_boot_disk(esp, path):
+    """The ESP on a FAT32 image, with TRACE turning the marks on"""
+    with open(path, "wb") as f:
+        f.truncate(128 << 20)
+    run(["mkfs.vfat", "-F", "32", path])
+    entries = [os.path.join(esp, e) for e in sorted(os.listdir(esp))]
+    run(["mcopy", "-i", path, "-s"] + entries + ["::/"])
+    flag = os.path.join(os.path.dirname(path), "TRACE")
+    open(flag, "w").close()
+    run(["mcopy", "-i", path, flag, "::/TRACE"])
+
+
+def copy_sparse(src, dst):
+    run(["cp", "--sparse=always", src, dst])
+
+
+def qemu_command(args, workdir, name, disks, qmp_path):
+    fw = find_firmware(args.arch)
+    vars_path = os.path.join(workdir, name + "-vars.fd")
+    if args.arch == "x86_64":
+        template = None
+        for v in ("OVMF_VARS_4M.fd", "OVMF_VARS.fd"):
+            p = os.path.join(os.path.dirname(fw), v)
+            if os.path.isfile(p):
+                template = p
+                break
+        if template:
+            shutil.copy(template, vars_path)
+        else:
+            with open(vars_path, "wb") as f:
+                f.truncate(os.path.getsize(fw))
+        cmd = ["qemu-system-x86_64", "-m", "2G", "-vga", "none",
+               "-drive", "if=pflash,format=raw,file=%s,readonly=on" % fw]
+        if args.kvm:
+            cmd += ["-enable-kvm", "-cpu", "host"]
+    else:
+        # AAVMF wants both flash devices padded to 64 MB
+        fw_copy = os.path.join(workdir, name + "-fw.fd")
+        shutil.copy(fw, fw_copy)
+        for p in (fw_copy, vars_path):
+            with open(p, "ab") as f:
+                f.truncate(64 << 20)
+        cmd = ["qemu-system-aarch64", "-M", "virt", "-m", "2G",
+               "-drive", "if=pflash,format=raw,file=%s,readonly=on" % fw_copy]
+        cmd += ["-enable-kvm", "-cpu", "host"] if args.kvm else ["-cpu", "cortex-a53"]
+    cmd += ["-drive", "if=pflash,format=raw,file=%s" % vars_path,
+            "-drive", "format=raw,file=%s" % disks[0],
+            "-device", "ramfb",
+            "-device", "qemu-xhci", "-device", "usb-kbd", "-device", "usb-mouse"]
+    for i, disk in enumerate(disks[1:]):
+        cmd += ["-drive", "if=none,id=usb%d,format=raw,file=%s" % (i + 1, disk),
+                "-device", "usb-storage,drive=usb%d,removable=on" % (i + 1)]
+    cmd += ["-display", "none", "-serial", "stdio",
+            "-qmp", "unix:%s,server=on,wait=off" % qmp_path]
+    return cmd
+
+
+# ---- The steps ----
+
+def is_name(want):
+    return lambda name: name.lower() == want.lower()
+
+
+def tagged(tag):
+    return lambda name: name.startswith(tag)
+
+
+def is_iso(name):
+    return name.lower().endswith(".iso")
+
+
+def mb_s(nbytes, ms):
+    return nbytes / 1e6 / (ms / 1000.0) if ms > 0 else 0.0
+
+
+def run_editor(s, results):
+    """F5 twice, F6 twice, on hello.c from the boot volume root"""
+    s.select(is_name("hello.c"), "hello.c")
+    p = s.pos()
+    s.key("ret")
+    s.wait("edit", T_STEP, p)
+
+    for metric in ("f5_compile_run_s", "f5_cached_run_s"):
+        p = s.pos()
+        t = time.monotonic()
+        s.key("f5")
+        m = s.wait(("run", "run-failed"), T_STEP * 5, p)
+        if m[2] != "run":
+            raise TestError("hello.c did not compile")
+        results[metric] = m[0] - t
+        s.key("ret")                            # back to the editor
+        time.sleep(1)
+
+    for metric in ("f6_rebuild_cold_s", "f6_rebuild_cached_s"):
+        p = s.pos()
+        s.key("f6")
+        m = s.wait(("rebuild", "rebuild-failed"), T_REBUILD, p)
+        if m[2] != "rebuild":
+            raise TestError("F6 rebuild failed (see the serial log)")
+        results[metric] = m[3] / 1000.0         # the guest's own total
+        s.key("ret")                            # not R: stay
+        time.sleep(1)
+
+    p = s.pos()
+    s.key("esc")
+    s.wait("list", T_STEP, p)
+
+
+def session_one(args, workdir, esp, ntfs, exfat, log, results):
+    boot = os.path.join(workdir, "boot1.img")
+    make_boot_disk(esp, boot)
+    disks = [boot] + [d for d in (ntfs, exfat) if d]
+    s = Session(args, workdir, "one", disks, log)
+    try:
+        m = s.wait("browser", T_BOOT, 0)
+        results["boot_to_browser_s"] = m[0] - s.t0
+        s.wait_probed()
+        run_editor(s, results)
+        if not (ntfs and exfat):
+            return
+        s.wait_probed()
+
+        m = s.enter(tagged("[NTFS]"), "the NTFS volume")
+        results["ntfs_list_ms"] = m[4] / 1000.0
+        s.select(is_iso, "an ISO on the NTFS volume")
+        s.key("f3")
+        time.sleep(1)
+        p = s.pos()
+        s.key("esc")
+        s.wait("list", T_STEP, p)
+        s.wait_probed()
+
+        m = s.enter(tagged("[exFAT]"), "the exFAT volume")
+        results["exfat_list_ms"] = m[4] / 1000.0
+        p = s.pos()
+        s.key("f8")
+        m = s.wait("paste", T_COPY, p)
+        results["ntfs_to_exfat_mb_s"] = mb_s(m[3], m[4])
+    finally:
+        s.close()
+
+
+def session_two(args, workdir, esp, exfat, log, results):
+    """exFAT (now holding the ISO) to an empty USB disk"""
+    boot = os.path.join(workdir, "boot2.img")
+    make_boot_disk(esp, boot)
+    target = os.path.join(workdir, "target.img")
+    with open(target, "wb") as f:
+        f.truncate(os.path.getsize(exfat))
+    s = Session(args, workdir, "two", [boot, exfat, target], log)
+    try:
+        s.wait("browser", T_BOOT, 0)
+        s.wait_probed()
+        s.enter(tagged("[exFAT]"), "the exFAT volume")
+        s.select(is_iso, "the pasted ISO")
+        s.key("f10")
+        time.sleep(2)
+        s.key("ret")                            # the default target
+        time.sleep(2)
+        p = s.pos()
+        s.key("y")
+        while True:
+            m = s.wait(("io", "io-failed"), T_COPY, p)
+            if m[2] == "io-failed":
+                raise TestError("ISO write failed")
+            if m[5].startswith("Writing"):
+                break
+            p = s.marks.index(m) + 1
+        results["iso_write_mb_s"] = mb_s(m[3], m[4])
+        s.key("ret")
+    finally:
+        s.close()
+
+
+# ---- Baseline ----
+
+def compare(results, baseline, tolerance):
+    """Print the table; returns the metrics that regressed"""
+    worse = []
+    print("\n%-22s %12s %12s %8s" % ("metric", "now", "baseline", "change"))
+    for name, unit, higher in METRICS:
+        if name not in results:
+            continue
+        now = results[name]
+        base = baseline.get(name)
+        if base is None or base <= 0:
+            print("%-22s %10.2f %-2s %12s" % (name, now, unit, "-"))
+            continue
+        change = (now - base) / base
+        bad = change < -tolerance if higher else change > tolerance
+        print("%-22s %10.2f %-2s %9.2f %-2s %+7.1f%%%s" %
+              (name, now, unit, base, unit, change * 100,
+               "  REGRESSED" if bad else ""))
+        if bad:
+            worse.append(name)
+    return worse
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.split("\n\n")[0])
+    ap.add_argument("--arch", default="x86_64", choices=sorted(FIRMWARE))
+    ap.add_argument("--ntfs")
+    ap.add_argument("--exfat")
+    ap.add_argument("--baseline")
+    ap.add_argument("--update-baseline", action="store_true")
+    ap.add_argument("--tolerance", type=float, default=0.25,
+                    help="fraction a metric may get worse (default 0.25)")
+    ap.add_argument("--timeout-scale", type=float, default=1.0)
+    ap.add_argument("--kvm", dest="kvm", action="store_true", default=None)
+    ap.add_argument("--no-kvm", dest="kvm", action="store_false")
+    args = ap.parse_args()
+
+    if args.kvm is None:
+        args.kvm = (os.uname().machine == args.arch
+                    and os.access("/dev/kvm", os.R_OK | os.W_OK))
+    build = os.path.join(PROJECT_DIR, "build", args.arch)
+    esp = os.path.join(build, "esp")
+    if not os.path.isfile(os.path.join(esp, "EFI", "BOOT", BOOT_EFI[args.arch])):
+        print("ERROR: Build first with 'make ARCH=%s'" % args.arch)
+        return 2
+    baseline_path = args.baseline or os.path.join(build, "perf-baseline.json")
+    ntfs, exfat = DEFAULT_IMAGES[args.arch]
+    ntfs = args.ntfs or (ntfs if os.path.isfile(ntfs) else None)
+    exfat = args.exfat or (exfat if os.path.isfile(exfat) else None)
+    if not (ntfs and exfat):
+        print("No NTFS/exFAT images: run scripts/run-qemu-exfat-ntfs-test*.sh "
+              "once for the volume metrics.")
+
+    config = {"arch": args.arch, "accel": "kvm" if args.kvm else "tcg"}
+    results = {}
+    log_path = os.path.join(build, "perf-serial.log")
+    workdir = tempfile.mkdtemp(prefix="survival-perf-")
+    try:
+        with open(log_path, "w") as log:
+            exfat_copy = None
+            if exfat:
+                exfat_copy = os.path.join(workdir, "exfat.img")
+                copy_sparse(exfat, exfat_copy)
+            ntfs_copy = None
+            if ntfs:
+                ntfs_copy = os.path.join(workdir, "ntfs.img")
+                copy_sparse(ntfs, ntfs_copy)
+            session_one(args, workdir, esp, ntfs_copy, exfat_copy, log, results)
+            if "ntfs_to_exfat_mb_s" in results:
+                session_two(args, workdir, esp, exfat_copy, log, results)
+    except (TestError, subprocess.CalledProcessError) as e:
+        print("FAILED: %s (serial log: %s)" % (e, log_path))
+        compare(results, {}, args.tolerance)
+        return 1
+    finally:
+        shutil.rmtree(workdir, ignore_errors=True)
+
+    with open(os.path.join(build, "perf.json"), "w") as f:
+        json.dump({"config": config, "results": results}, f, indent=2)
+
+    baseline = {}
+    if os.path.isfile(baseline_path) and not args.update_baseline:
+        with open(baseline_path) as f:
+            data = json.load(f)
+        if data.get("config") != config:
+            print("ERROR: %s was recorded with %s, this run is %s" %
+                  (baseline_path, data.get("config"), config))
+            return 2
+        baseline = data.get("results", {})
+
+    worse = compare(results, baseline, args.tolerance)
+    if not baseline:
+        with open(baseline_path, "w") as f:
+            json.dump({"config": config, "results": results}, f, indent=2)
+        print("\nBaseline recorded in %s" % baseline_path)
+        return 0
+    if worse:
+        print("\nFAILED: %d metric(s) more than %d%% worse than the baseline" %
+              (len(worse), args.tolerance * 100))
+        return 1
+    print("\nPASSED")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,104 @@
+#!/usr/bin/env python3
+"""
+trace2chrome.py — Convert a TRACE.BIN event ring to Chrome trace JSON.
+
+A workstation built with `make TRACE=1` records hot-path events (disk
+and BlockIO transfers, block and MFT cache hits and misses, allocations,
+presents, TinyCC phases) into a ring and writes it to \\TRACE.BIN on the
+boot volume at shutdown; the layout is in src/trace.c. The output loads
+in chrome://tracing or https://ui.perfetto.dev. Begin/end pairs become
+duration slices, single events become instants, and the two numbers of
+each record are kept as args.
+
+Usage:
+    python3 scripts/trace2chrome.py TRACE.BIN [-o trace.json]
+        [--skip alloc,free]
+"""
+
+import argparse
+import json
+import struct
+import sys
+
+HDR = struct.Struct("<8sIIQQII")   # struct trace_ring_hdr
+REC = struct.Struct("<QIIQQ")      # struct trace_rec
+NAME_LEN = 16
+PHASES = {0: "B", 1: "E", 2: "i"}
+
+
+def load(path):
+    with open(path, "rb") as f:
+        data = f.read()
+    if len(data) < HDR.size:
+        sys.exit(f"{path}: too short for a trace header")
+    magic, version, rec_size, hz, head, cap, nids = HDR.unpack_from(data)
+    if magic.rstrip(b"\0") != b"SVTRACE" or version != 1:
+        sys.exit(f"{path}: not a version 1 TRACE.BIN")
+    if rec_size != REC.size or hz == 0:
+        sys.exit(f"{path}: unexpected record size {rec_size} or rate {hz}")
+
+    off = HDR.size
+    names = []
+    for i in range(nids):
+        raw = data[off + i * NAME_LEN:off + (i + 1) * NAME_LEN]
+        names.append(raw.split(b"\0", 1)[0].decode("ascii", "replace"))
+    off += nids * NAME_LEN
+
+    n = min(head, cap)
+    if len(data) < off + n * REC.size:
+        sys.exit(f"{path}: truncated, expected {n} records")
+    slots = [REC.unpack_from(data, off + i * REC.size) for i in range(n)]
+    # Once the ring has wrapped, the oldest record is at head modulo cap
+    start = head % cap if head > cap else 0
+    return hz, head - n, names, slots[start:] + slots[:start]
+
+
+def convert(hz, names, recs, skip):
+    events = []
+    t0 = recs[0][0] if recs else 0
+    for ticks, ident, phase, a, b in recs:
+        name = names[ident] if ident < len(names) else f"event-{ident}"
+        if name in skip:
+            continue
+        ev = {
+            "name": name,
+            "cat": name.split("-", 1)[0],
+            "ph": PHASES.get(phase, "i"),
+            "ts": (ticks - t0) * 1e6 / hz,
+            "pid": 1,
+            "tid": 1,
+            "args": {"a": a, "b": b},
+        }
+        if ev["ph"] == "i":
+            ev["s"] = "t"
+        events.append(ev)
+    return events
+
+
+def main():
+    ap = argparse.ArgumentParser(description=__doc__.split("\n")[1])
+    ap.add_argument("trace", help="TRACE.BIN from the boot volume")
+    ap.add_argument("-o", "--output", help="JSON file (default: stdout)")
+    ap.add_argument("--skip", default="",
+                    help="comma-separated event names to leave out")
+    args = ap.parse_args()
+
+    hz, lost, names, recs = load(args.trace)
+    skip = {s for s in args.skip.split(",") if s}
+    out = {
+        "traceEvents": convert(hz, names, recs, skip),
+        "displayTimeUnit": "ms",
+        "otherData": {"hz": hz, "records": len(recs), "overwritten": lost},
+    }
+    if args.output:
+        with open(args.output, "w") as f:
+            json.dump(out, f)
+    else:
+        json.dump(out, sys.stdout)
+    if lost:
+        print(f"note: ring wrapped, {lost} oldest records overwritten",
+              file=sys.stderr)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,334 @@
+/*
+ * aprun.c — User programs run on an application processor
+ *
+ * The program's core and the boot processor share two things besides
+ * the program's memory: the output ring and the call mailbox. Each has
+ * one writer per field, so a full barrier on either side of a handover
+ * is all the ordering needed. The ring's head is only written by the
+ * program's core and its tail only by the boot processor; the mailbox
+ * goes idle -> posted (program), posted -> done (boot processor),
+ * done -> idle (program). Output queued before a call is shown before
+ * the call is made.
+ *
+ * Each run has a context at the bottom of its stack block, so code on
+ * any core can tell from its stack whether it belongs to a program run
+ * here, and which one: a program left running finds its own ESC still
+ * set at its next call and unwinds, without touching the ring or the
+ * mailbox a later run now owns.
+ */
+
+#include "boot.h"
+#include "mem.h"
+#include "fb.h"
+#include "kbd.h"
+#include "shim.h"
+#include "timer.h"
+#include "mp.h"
+#include "aprun.h"
+
+/* Mailbox states */
+#define CALL_IDLE   0
+#define CALL_POSTED 1
+#define CALL_DONE   2
+
+struct ap_ctx {
+    struct mp_job job;
+    int (*main)(void);
+    int exit_code;
+    int worker;
+    int unwound;                /* stopped at a call after ESC */
+    volatile UINT32 abort;      /* BSP: unwind at the next call */
+    jmp_buf jmp;                /* the run's start, on its stack */
+};
+
+struct ap_rec {
+    UINT32 fg;                  /* fb_print() colour or APRUN_STDOUT */
+    UINT32 len;
+    char text[APRUN_TEXT];
+};
+
+static struct ap_rec s_ring[APRUN_RING];
+static volatile UINT32 s_head;  /* records queued (program's core) */
+static volatile UINT32 s_tail;  /* records shown (boot processor) */
+
+static struct {
+    const void *fn;
+    UINTN args[APRUN_ARGS];
+    UINTN ret;
+    volatile UINT32 state;
+} s_call;
+
+/* This run's context and those of programs left running */
+static struct ap_ctx *volatile s_held[APRUN_HELD];
+static struct ap_ctx *s_cur;
+
+static struct key_event s_keys[APRUN_KEYS];
+static int s_key_head, s_key_tail;
+
+/* ---- Stack switch ---- */
+
+#ifdef __aarch64__
+__attribute__((section(".text")))
+static unsigned int s_switch[] = {
+    0xa9bf7bfd, /* stp x29, x30, [sp, #-16]! */
+    0x910003fd, /* mov x29, sp               */
+    0x9100001f, /* mov sp, x0                */
+    0xaa0203e0, /* mov x0, x2                */
+    0xd63f0020, /* blr x1                    */
+    0x910003bf, /* mov sp, x29               */
+    0xa8c17bfd, /* ldp x29, x30, [sp], #16   */
+    0xd65f03c0, /* ret                       */
+};
+
+void aprun_switch_stack(void *top, void (*fn)(void *), void *arg) {
+    ((void (*)(void *, void (*)(void *), void *))(UINTN)s_switch)(top, fn, arg);
+}
+#else
+/* MS x64: rcx = top, rdx = fn, r8 = arg; the callee gets its 32-byte
+   home area below top, which stays 16-byte aligned at the call */
+__asm__(
+    ".globl aprun_switch_stack\n"
+    "aprun_switch_stack:\n"
+    "  push %rbp\n"
+    "  mov %rsp, %rbp\n"
+    "  mov %rcx, %rsp\n"
+    "  sub $32, %rsp\n"
+    "  mov %r8, %rcx\n"
+    "  call *%rdx\n"
+    "  mov %rbp, %rsp\n"
+    "  pop %rbp\n"
+    "  ret\n"
+);
+#endif
+
+/* ---- Program's core ---- */
+
+static struct ap_ctx *ap_self(void) {
+    UINT8 here = 0;
+    for (int i = 0; i < APRUN_HELD; i++) {
+        struct ap_ctx *c = s_held[i];
+        if (c && (UINTN)&here - (UINTN)c < APRUN_STACK)
+            return c;
+    }
+    return NULL;
+}
+
+int aprun_on_ap(void) {
+    return ap_self() != NULL;
+}
+
+static void check_abort(struct ap_ctx *c) {
+    if (c->abort) {
+        mp_fence();
+        longjmp(c->jmp, 1);
+    }
+}
+
+void aprun_print(const char *s, UINTN n, UINT32 fg) {
+    struct ap_ctx *c = ap_self();
+    if (!c) return;
+    while (n) {
+        check_abort(c);
+        if (s_head - s_tail == APRUN_RING) {
+            mp_relax();
+            continue;
+        }
+        struct ap_rec *r = &s_ring[s_head % APRUN_RING];
+        UINTN k = n < APRUN_TEXT ? n : APRUN_TEXT;
+        r->fg = fg;
+        r->len = (UINT32)k;
+        mem_copy(r->text, s, k);
+        mp_fence();
+        s_head = s_head + 1;
+        s += k;
+        n -= k;
+    }
+}
+
+UINTN aprun_call(const void *fn, int n, ...) {
+    struct ap_ctx *c = ap_self();
+    if (!c) return 0;
+    check_abort(c);
+    va_list ap;
+    va_start(ap, n);
+    for (int i = 0; i < APRUN_ARGS; i++)
+        s_call.args[i] = i < n ? va_arg(ap, UINTN) : 0;
+    va_end(ap);
+    s_call.fn = fn;
+    mp_fence();
+    s_call.state = CALL_POSTED;
+    while (s_call.state != CALL_DONE) {
+        check_abort(c);
+        mp_relax();
+    }
+    mp_fence();
+    UINTN ret = s_call.ret;
+    s_call.state = CALL_IDLE;
+    check_abort(c);
+    return ret;
+}
+
+/* On the run's own stack */
+static void ap_body(void *arg) {
+    struct ap_ctx *c = (struct ap_ctx *)arg;
+    if (setjmp(c->jmp) == 0)
+        c->exit_code = c->main();
+    else
+        c->unwound = 1;
+}
+
+static void ap_entry(void *arg, void *arena) {
+    (void)arena;
+    UINTN top = ((UINTN)arg + APRUN_STACK) & ~(UINTN)15;
+    aprun_switch_stack((void *)top, ap_body, arg);
+}
+
+/* ---- Boot processor ---- */
+
+/* Show what the ring holds */
+static void drain(void) {
+    char tmp[APRUN_TEXT + 1];
+    while (s_tail != s_head) {
+        mp_fence();
+        const struct ap_rec *r = &s_ring[s_tail % APRUN_RING];
+        if (r->fg == APRUN_STDOUT) {
+            fwrite(r->text, 1, r->len, stdout);
+        } else {
+            mem_copy(tmp, r->text, r->len);
+            tmp[r->len] = '\0';
+            fb_print(tmp, r->fg);
+        }
+        mp_fence();
+        s_tail = s_tail + 1;
+    }
+}
+
+typedef UINTN (*call_fn)(UINTN, UINTN, UINTN, UINTN, UINTN, UINTN, UINTN);
+
+/* Make the call the program posted, once what it printed first shows */
+static void serve(void) {
+    drain();
+    mp_fence();
+    const UINTN *a = s_call.args;
+    s_call.ret = ((call_fn)(UINTN)s_call.fn)(a[0], a[1], a[2], a[3], a[4],
+                                             a[5], a[6]);
+    mp_fence();
+    s_call.state = CALL_DONE;
+}
+
+/* A key typed during the run: ESC stops the program, others wait for it */
+static void take_key(const struct key_event *ev) {
+    if (ev->code == KEY_ESC) {
+        s_cur->abort = 1;
+        mp_fence();
+        return;
+    }
+    if (s_key_head - s_key_tail < APRUN_KEYS)
+        s_keys[s_key_head++ % APRUN_KEYS] = *ev;
+}
+
+static void watch_keys(void) {
+    struct key_event k;
+    while (!s_cur->abort && kbd_poll(&k))
+        take_key(&k);
+}
+
+static int kept_key(struct key_event *ev) {
+    if (s_key_tail == s_key_head) return 0;
+    *ev = s_keys[s_key_tail++ % APRUN_KEYS];
+    return 1;
+}
+
+int aprun_key_poll(struct key_event *ev) {
+    watch_keys();
+    return kept_key(ev);
+}
+
+void aprun_key_wait(struct key_event *ev) {
+    while (!kept_key(ev)) {
+        if (s_cur->abort) {
+            mem_set(ev, 0, sizeof(*ev));
+            return;
+        }
+        struct key_event k;
+        kbd_wait(&k);
+        take_key(&k);
+    }
+}
+
+/* Free the stacks of programs left running that have since ended */
+static void sweep(void) {
+    for (int i = 0; i < APRUN_HELD; i++) {
+        struct ap_ctx *c = s_held[i];
+        if (c && c != s_cur && !mp_launch_busy(c->worker)) {
+            s_held[i] = NULL;
+            mem_free(c);
+        }
+    }
+}
+
+int aprun_main(int (*prog_main)(void), int *exit_code) {
+    sweep();
+    int slot = 0;
+    while (slot < APRUN_HELD && s_held[slot]) slot++;
+    if (slot == APRUN_HELD) return 0;
+
+    struct ap_ctx *c = (struct ap_ctx *)mem_alloc(APRUN_STACK);
+    if (!c) return 0;
+    c->main = prog_main;
+    s_head = s_tail = 0;
+    s_call.state = CALL_IDLE;
+    s_key_head = s_key_tail = 0;
+    s_held[slot] = c;
+    s_cur = c;
+    mp_fence();
+
+    c->worker = mp_launch(&c->job, ap_entry, c,
+                          (UINTN)APRUN_TIMEOUT_S * 1000000);
+    if (c->worker < 0) {
+        s_held[slot] = NULL;
+        s_cur = NULL;
+        mem_free(c);
+        return 0;
+    }
+
+    UINT64 hz = timer_hz();
+    UINT64 start = timer_ticks(), keys = start, aborted = 0;
+    /* Past the firmware's timeout, stop waiting for it */
+    UINT64 limit = (UINT64)(APRUN_TIMEOUT_S + 2) * hz;
+    int stranded = 0;
+    while (mp_launch_busy(c->worker)) {
+        drain();
+        if (!c->abort && s_call.state == CALL_POSTED)
+            serve();
+        UINT64 now = timer_ticks();
+        if ((now - keys) * 1000 >= APRUN_KEY_MS * hz) {
+            keys = now;
+            watch_keys();
+        }
+        if (c->abort && !aborted)
+            aborted = now;
+        if ((aborted && (now - aborted) * 1000 >= APRUN_ABORT_MS * hz) ||
+            now - start >= limit) {
+            c->abort = 1;
+            stranded = 1;
+            break;
+        }
+        mp_relax();
+    }
+    mp_fence();
+    if (!stranded)
+        drain();
+
+    mp_launch_release(c->worker);
+    s_cur = NULL;
+    if (stranded)
+        return APRUN_STRANDED;
+
+    s_held[slot] = NULL;
+    int how = c->job.state != MP_DONE ? APRUN_TIMEDOUT :
+              c->unwound ? APRUN_ABORTED : APRUN_RETURNED;
+    *exit_code = c->exit_code;
+    mem_free(c);
+    return how;
+}
@@ -0,0 +1,74 @@
+/*
+ * aprun.h — User programs run on an application processor
+ *
+ * Alt+F5 runs the compiled program on a core of its own (mp_launch())
+ * instead of on the boot processor, so a program that runs long or
+ * hangs leaves the machine usable. The program gets a stack of
+ * APRUN_STACK bytes there rather than the firmware's small AP stack.
+ *
+ * Everything it prints goes into a lock-free ring that the boot
+ * processor empties onto the console while it watches the keyboard, so
+ * output shows as it is made. The other API calls that need the
+ * firmware (the parapi.h guards: memory, screen, keys, files, disks,
+ * time) are handed to the boot processor one at a time and waited for.
+ * Keys typed meanwhile are kept for the program, except ESC, which
+ * stops it: at its next call it unwinds and returns. A program that
+ * makes no call within APRUN_ABORT_MS of ESC is left running where it
+ * is, with all the memory it was given kept, and its core rejoins the
+ * pool once it does or the firmware's timeout resets it. That timeout,
+ * APRUN_TIMEOUT_S, ends any run that goes on too long.
+ *
+ * par_for() and friends run on the program's own core in that mode
+ * (par_cores() is 1): only the boot processor can start the pool.
+ */
+#ifndef APRUN_H
+#define APRUN_H
+
+#include "boot.h"
+#include "kbd.h"
+
+#define APRUN_STACK      (1024 * 1024)
+#define APRUN_TIMEOUT_S  120    /* the firmware resets the core after this */
+#define APRUN_ABORT_MS   500    /* after ESC, for the program to stop itself */
+#define APRUN_KEY_MS     20     /* keyboard checked this often */
+#define APRUN_RING       256    /* output records in flight */
+#define APRUN_TEXT       120    /* bytes per record */
+#define APRUN_KEYS       16     /* keys kept for the program */
+#define APRUN_ARGS       7      /* arguments of a call handed over */
+#define APRUN_HELD       4      /* programs left running at once */
+
+/* aprun_print() colour for bytes that go to stdout, not fb_print() */
+#define APRUN_STDOUT     0xFFFFFFFFu
+
+/* How a run ended */
+#define APRUN_RETURNED   1      /* main() returned; exit code set */
+#define APRUN_ABORTED    2      /* ESC, and it stopped at a call */
+#define APRUN_TIMEDOUT   3      /* the firmware reset its core */
+#define APRUN_STRANDED   4      /* still running: keep what it holds */
+
+/* Run prog_main() on a free AP until it ends or is given up on.
+   Returns APRUN_*, or 0 with nothing run when no AP is free. */
+int aprun_main(int (*prog_main)(void), int *exit_code);
+
+/* 1 when called from a program running on its AP */
+int aprun_on_ap(void);
+
+/* From the program's AP: queue n bytes of output, in fg for fb_print()
+   or APRUN_STDOUT. Waits while the ring is full. */
+void aprun_print(const char *s, UINTN n, UINT32 fg);
+
+/* From the program's AP: call fn with n (at most APRUN_ARGS) integer
+   or pointer arguments on the boot processor and return its result */
+UINTN aprun_call(const void *fn, int n, ...);
+
+/* Call fn(arg) with the stack pointer at top (16-byte aligned) and
+   return on the caller's stack: how a job gives itself a stack larger
+   than the firmware's AP stack */
+void aprun_switch_stack(void *top, void (*fn)(void *), void *arg);
+
+/* The boot processor's kbd_poll() and kbd_wait() for the program:
+   keys taken while watching for ESC come first */
+int aprun_key_poll(struct key_event *ev);
+void aprun_key_wait(struct key_event *ev);
+
+#endif /* APRUN_H */
@@ -0,0 +1,1237 @@
+/*
+ * archive.c — Unpack tar, tar.gz and zip archives onto a volume; pack
+ * directory trees into .tar.gz
+ *
+ * See archive.h. The archive is read into one buffer with AR_BACK bytes
+ * kept in front of each fill, the inflate source's contract, and every
+ * format takes its input from there. A tar, straight or inflated, goes
+ * through a push parser that accepts pieces of any size; zip headers
+ * are pulled from the same reader. Member paths are rebuilt one
+ * component at a time under the target: "." and empty parts fall away,
+ * ".." makes the member unsafe and characters FAT cannot hold become
+ * '_'. Directories are made by copy_mkdirs(), which passes over those
+ * the previous member had, so an archive written a directory at a time,
+ * as tar and zip tools do, costs one directory call per new directory.
+ *
+ * Packing works in batches of PK_BLOCKS blocks of tar, two batches in
+ * turn: while the workers deflate one, the boot processor fills the
+ * other from the source files, then writes the first batch's output in
+ * block order. Each block is deflated with the 32 KB of tar before it
+ * as history, as pigz does, and ends on a byte boundary, so the output
+ * is one deflate stream; the CRCs of the blocks are joined with
+ * crc32_combine() for the gzip trailer.
+ */
+
+#include "boot.h"
+#include "fb.h"
+#include "kbd.h"
+#include "mem.h"
+#include "fs.h"
+#include "copy.h"
+#include "deflate.h"
+#include "dirsort.h"
+#include "hash.h"
+#include "inflate.h"
+#include "mp.h"
+#include "progress.h"
+#include "archive.h"
+#include "shim.h"
+
+#define AR_BACK   8             /* kept before a fill: inflate gives bytes back */
+#define TAR_BLOCK 512
+#define PAX_MAX   1024          /* extended header bytes kept */
+
+#define ZIP_LOCAL   0x04034b50
+#define ZIP_CENTRAL 0x02014b50
+#define ZIP_END     0x06054b50
+#define ZIP_DESC    0x08074b50
+
+static const char s_cancelled[] = "Cancelled.";
+
+/* Where the tar parser is */
+enum { TAR_HEAD, TAR_DATA, TAR_PAD, TAR_END, TAR_RAW };
+
+/* What a tar member's data is for */
+enum { PUT_SKIP, PUT_FILE, PUT_NAME, PUT_PAX };
+
+struct tar {
+    int state;
+    int put;
+    UINT8 hdr[TAR_BLOCK];
+    UINTN have;                 /* bytes of hdr so far */
+    UINT64 left;                /* member data still to come */
+    UINT32 pad;                 /* then to the end of its last block */
+    UINT32 headers;             /* seen so far */
+
+    /* From a GNU long name or a pax header, for the next member */
+    char name[ARCHIVE_NAME_MAX];
+    int name_set;               /* 1: name holds it; -1: it was too long */
+    UINT64 size;
+    int size_set;
+
+    char meta[PAX_MAX];         /* the long name or pax records */
+    UINTN meta_len;
+    int meta_over;              /* there was more than PAX_MAX */
+};
+
+struct ar {
+    struct inflate_src src;     /* first: in_fill() is handed it */
+    struct fs_file *f;
+    UINT8 *buf;                 /* AR_BACK, then ARCHIVE_READ */
+    UINT64 size, read;
+    const char *stop;           /* why unpacking stopped; NULL until then */
+    int zip;                    /* members are checked by CRC */
+
+    struct copy_job job;
+    CHAR16 root[COPY_MAX_PATH];
+    UINTN root_len;             /* 0 for the volume's root */
+    int open;                   /* a member is being written */
+    UINT32 crc;                 /* of its data, for a zip */
+    UINT32 unsafe;              /* members with names not written */
+    UINT32 links;               /* links and devices skipped */
+
+    struct inflate *z;
+    UINT32 gz_crc;
+    int raw;                    /* a .gz of one file may hold no tar */
+    struct tar t;
+
+    struct progress pg;
+    UINT32 row;
+    char member[ARCHIVE_NAME_MAX];  /* shown under the bar */
+};
+
+/* ---- UI helpers ---- */
+
+static void ar_print(const char *msg, UINT32 color) {
+    if (g_boot.cols) fb_print(msg, color);
+}
+
+static void ar_wait_key(void) {
+    ar_print("  Press any key to return.\n", COLOR_DGRAY);
+    struct key_event ev;
+    kbd_wait(&ev);
+}
+
+/* line padded out to the screen's width, at row */
+static void ar_row(UINT32 row, char *line, int len, UINT32 color) {
+    if (len > (int)g_boot.cols) len = (int)g_boot.cols;
+    while (len < (int)g_boot.cols && len < 126) line[len++] = ' ';
+    line[len] = '\0';
+    fb_string(0, row, line, color, COLOR_BLACK);
+}
+
+/* Redraw the progress line and the member under it when it is due */
+static void ar_bar(struct progress *pg, UINT32 row, const char *member,
+                   UINT64 bytes) {
+    if (!progress_add(pg, bytes)) return;
+    char line[128];
+    line[0] = line[1] = ' ';
+    int len = 2 + progress_line(pg, line + 2, sizeof(line) - 2);
+    ar_row(row, line, len, COLOR_WHITE);
+    len = snprintf(line, sizeof(line), "  %s", member);
+    if (len > 126) len = 126;
+    ar_row(row + 1, line, len, COLOR_DGRAY);
+    fb_present();
+}
+
+/* ESC pressed since the last look */
+static int ar_cancelled(void) {
+    struct key_event ev;
+    return kbd_poll(&ev) && ev.code == KEY_ESC;
+}
+
+static int has_ext(const char *name, const char *ext) {
+    int len = 0, n = 0;
+    while (name[len]) len++;
+    while (ext[n]) n++;
+    if (len <= n) return 0;
+    for (int i = 0; i < n; i++) {
+        char c = name[len - n + i];
+        if (c >= 'A' && c <= 'Z') c += 32;
+        if (c != ext[i]) return 0;
+    }
+    return 1;
+}
+
+enum archive_kind archive_kind_of(const char *name) {
+    if (has_ext(name, ".tar")) return ARCHIVE_TAR;
+    if (has_ext(name, ".tgz") || has_ext(name, ".gz")) return ARCHIVE_GZIP;
+    if (has_ext(name, ".zip")) return ARCHIVE_ZIP;
+    return ARCHIVE_NONE;
+}
+
+void archive_stem(const char *name, char *out, UINTN max) {
+    static const char *exts[] = { ".tar.gz", ".tgz", ".tar", ".zip", ".gz" };
+    UINTN len = str_len((CHAR8 *)name);
+    for (UINTN i = 0; i < sizeof(exts) / sizeof(exts[0]); i++) {
+        if (has_ext(name, exts[i])) {
+            len -= str_len((CHAR8 *)exts[i]);
+            break;
+        }
+    }
+    if (len >= max) len = max - 1;
+    mem_copy(out, name, len);
+    out[len] = '\0';
+}
+
+static UINT32 rd16(const UINT8 *p) { return (UINT32)p[0] | (UINT32)p[1] << 8; }
+static UINT32 rd32(const UINT8 *p) { return rd16(p) | rd16(p + 2) << 16; }
+static UINT64 rd64(const UINT8 *p) { return rd32(p) | (UINT64)rd32(p + 4) << 32; }
+
+/* ---- Reading ---- */
+
+static int in_fill(struct inflate_src *s) {
+    struct ar *a = (struct ar *)s;
+    if (a->stop || a->read >= a->size) return -1;
+    mem_move(a->buf, s->p - AR_BACK, AR_BACK);
+    UINTN n = ARCHIVE_READ;
+    if ((UINT64)n > a->size - a->read) n = (UINTN)(a->size - a->read);
+    if (fs_stream_read(a->f, a->buf + AR_BACK, &n) != 0 || n == 0) {
+        a->stop = "Could not read the archive.";
+        return -1;
+    }
+    a->read += n;
+    s->p = a->buf + AR_BACK;
+    s->n = n;
+    ar_bar(&a->pg, a->row, a->member, n);
+    return 0;
+}
+
+/* Whether any of the archive is left */
+static int in_more(struct ar *a) {
+    return a->src.n > 0 || in_fill(&a->src) == 0;
+}
+
+/* The next len bytes into out; -1 if the archive ends first */
+static int in_get(struct ar *a, void *out, UINTN len) {
+    UINT8 *o = (UINT8 *)out;
+    while (len) {
+        if (a->src.n == 0 && in_fill(&a->src) != 0) return -1;
+        UINTN n = len < a->src.n ? len : a->src.n;
+        mem_copy(o, a->src.p, n);
+        a->src.p += n;
+        a->src.n -= n;
+        o += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void member_data(struct ar *a, const UINT8 *p, UINTN n);
+
+/* The next len bytes to the open member, if there is one, or skipped */
+static int in_pass(struct ar *a, UINT64 len, int to_member) {
+    while (len) {
+        if (a->src.n == 0 && in_fill(&a->src) != 0) return -1;
+        UINTN n = len < (UINT64)a->src.n ? (UINTN)len : a->src.n;
+        if (to_member) member_data(a, a->src.p, n);
+        a->src.p += n;
+        a->src.n -= n;
+        len -= n;
+    }
+    return 0;
+}
+
+static void damaged(struct ar *a) {
+    if (!a->stop) a->stop = "The archive is damaged or cut short.";
+}
+
+/* ---- Members ---- */
+
+/* name, '/'-separated, under the root into out (with *len and *dir, the
+   end of its directory part). Returns 1, 0 for a name with nothing in
+   it ("./") or -1 for one that is unsafe or too long. */
+static int member_path(struct ar *a, const char *name, CHAR16 *out,
+                       UINTN *len, UINTN *dir) {
+    UINTN n = a->root_len;
+    mem_copy(out, a->root, n * sizeof(CHAR16));
+    *dir = n;
+    for (const char *p = name; *p;) {
+        const char *e = p;
+        while (*e && *e != '/' && *e != '\\') e++;
+        UINTN k = (UINTN)(e - p);
+        if (k == 2 && p[0] == '.' && p[1] == '.') return -1;
+        if (k && !(k == 1 && p[0] == '.')) {
+            if (n + 1 + k >= COPY_MAX_PATH) return -1;
+            *dir = n;
+            out[n++] = L'\\';
+            for (UINTN i = 0; i < k; i++) {
+                char c = p[i];
+                if ((UINT8)c < 0x20 || c == ':' || c == '*' || c == '?' ||
+                    c == '"' || c == '<' || c == '>' || c == '|')
+                    c = '_';
+                out[n++] = (CHAR16)(UINT8)c;
+            }
+        }
+        p = *e ? e + 1 : e;
+    }
+    out[n] = 0;
+    *len = n;
+    return n > a->root_len ? 1 : 0;
+}
+
+/* Start a member: a directory, or a file whose size bytes follow.
+   Returns 1 when its data is to be written, 0 when it is passed over. */
+static int member_begin(struct ar *a, const char *name, int is_dir, UINT64 size) {
+    if (ar_cancelled()) {
+        a->stop = s_cancelled;
+        return 0;
+    }
+    str_copy(a->member, name, sizeof(a->member));
+
+    CHAR16 path[COPY_MAX_PATH];
+    UINTN len, dir;
+    int r = member_path(a, name, path, &len, &dir);
+    if (r <= 0) {
+        if (r < 0) a->unsafe++;
+        return 0;
+    }
+    if (is_dir) {
+        copy_mkdirs(&a->job, path);
+        return 0;
+    }
+    if (dir > 0) {
+        path[dir] = 0;
+        int rc = copy_mkdirs(&a->job, path);
+        path[dir] = L'\\';
+        if (rc != 0) return 0;
+    }
+    if (copy_open(&a->job, path, size) != 0) return 0;
+    a->open = 1;
+    a->crc = 0;
+    return 1;
+}
+
+/* A .gz holding one file, not a tar: it is written as the root itself */
+static void member_raw(struct ar *a) {
+    if (copy_open(&a->job, a->root, 0) != 0) return;
+    a->open = 1;
+    a->crc = 0;
+}
+
+static void member_data(struct ar *a, const UINT8 *p, UINTN n) {
+    if (!a->open) return;
+    if (a->zip) a->crc = crc32(a->crc, p, n);
+    if (copy_write(&a->job, p, n) != 0) {
+        copy_close(&a->job, 0);
+        a->open = 0;
+    }
+}
+
+/* Finish the open member: kept with ok, deleted without */
+static void member_end(struct ar *a, int ok) {
+    if (!a->open) return;
+    copy_close(&a->job, ok);
+    a->open = 0;
+}
+
+/* ---- tar ---- */
+
+/* An octal field, or a base-256 one (the top bit set) for sizes past 8 GB */
+static UINT64 tar_num(const UINT8 *p, int len) {
+    UINT64 v = 0;
+    int i = 0;
+    if (p[0] & 0x80) {
+        for (i = 1; i < len; i++) v = v << 8 | p[i];
+        return v;
+    }
+    while (i < len && (p[i] == ' ' || p[i] == 0)) i++;
+    for (; i < len && p[i] >= '0' && p[i] <= '7'; i++) v = v << 3 | (UINT64)(p[i] - '0');
+    return v;
+}
+
+/* The header's sum, counting its own checksum field as spaces */
+static int tar_sum_ok(const UINT8 *h) {
+    UINT64 sum = 0;
+    for (int i = 0; i < TAR_BLOCK; i++)
+        sum += (i >= 148 && i < 156) ? ' ' : h[i];
+    return sum == tar_num(h + 148, 8);
+}
+
+/* A header field, which need not end in a NUL; returns its length */
+static UINTN tar_field(char *out, const UINT8 *p, UINTN max) {
+    UINTN n = 0;
+    while (n < max && p[n]) {
+        out[n] = (char)p[n];
+        n++;
+    }
+    return n;
+}
+
+/* The name in the header, with a ustar prefix before it */
+static void tar_name(const struct tar *t, char *out) {
+    UINTN n = 0;
+    if (mem_cmp(t->hdr + 257, "ustar", 5) == 0 && t->hdr[345]) {
+        n = tar_field(out, t->hdr + 345, 155);
+        out[n++] = '/';
+    }
+    n += tar_field(out + n, t->hdr, 100);
+    out[n] = '\0';
+}
+
+/* "<length> <key>=<value>\n" records; path and size are the ones used */
+static void pax_parse(struct tar *t) {
+    UINTN i = 0;
+    int got_path = 0;
+    while (i < t->meta_len) {
+        UINTN len = 0, j = i;
+        while (j < t->meta_len && t->meta[j] >= '0' && t->meta[j] <= '9')
+            len = len * 10 + (UINTN)(t->meta[j++] - '0');
+        if (len == 0 || i + len > t->meta_len || j >= i + len || t->meta[j] != ' ')
+            break;
+        const char *kv = t->meta + j + 1;
+        UINTN n = i + len - (j + 1) - 1;
+        if (n >= 5 && mem_cmp(kv, "path=", 5) == 0) {
+            got_path = 1;
+            if (n - 5 < ARCHIVE_NAME_MAX) {
+                mem_copy(t->name, kv + 5, n - 5);
+                t->name[n - 5] = '\0';
+                t->name_set = 1;
+            } else {
+                t->name_set = -1;
+            }
+        } else if (n >= 5 && mem_cmp(kv, "size=", 5) == 0) {
+            t->size = 0;
+            for (UINTN k = 5; k < n && kv[k] >= '0' && kv[k] <= '9'; k++)
+                t->size = t->size * 10 + (UINT64)(kv[k] - '0');
+            t->size_set = 1;
+        }
+        i += len;
+    }
+    /* A path in the part that was not kept would be lost */
+    if (t->meta_over && !got_path) t->name_set = -1;
+}
+
+static void tar_data_end(struct ar *a) {
+    struct tar *t = &a->t;
+    if (t->put == PUT_FILE) {
+        member_end(a, 1);
+    } else if (t->put == PUT_NAME) {
+        if (!t->meta_over && t->meta_len < ARCHIVE_NAME_MAX) {
+            mem_copy(t->name, t->meta, t->meta_len);
+            t->name[t->meta_len] = '\0';
+            t->name_set = 1;
+        } else {
+            t->name_set = -1;
+        }
+    } else if (t->put == PUT_PAX) {
+        pax_parse(t);
+    }
+    t->state = t->pad ? TAR_PAD : TAR_HEAD;
+}
+
+static void tar_header(struct ar *a) {
+    struct tar *t = &a->t;
+    const UINT8 *h = t->hdr;
+    int zero = 1;
+    for (int i = 0; i < TAR_BLOCK && zero; i++) zero = h[i] == 0;
+    if (zero) {
+        t->state = TAR_END;
+        return;
+    }
+    if (!tar_sum_ok(h)) {
+        if (t->headers == 0 && a->raw) {
+            t->state = TAR_RAW;
+            member_raw(a);
+            member_data(a, h, TAR_BLOCK);
+            return;
+        }
+        a->stop = t->headers ? "The archive is damaged."
+                             : "Not a tar, tar.gz or zip archive.";
+        return;
+    }
+    t->headers++;
+
+    UINT8 type = h[156];
+    t->left = tar_num(h + 124, 12);
+    t->put = PUT_SKIP;
+    t->meta_len = 0;
+    t->meta_over = 0;
+    if (type == 'L') {
+        t->put = PUT_NAME;
+    } else if (type == 'x') {
+        t->put = PUT_PAX;
+    } else if (type != 'g' && type != 'K') {     /* not global pax or a long link */
+        char name[ARCHIVE_NAME_MAX];
+        if (t->name_set > 0) str_copy(name, t->name, sizeof(name));
+        else tar_name(t, name);
+        int bad = t->name_set < 0;
+        if (t->size_set) t->left = t->size;
+        t->name_set = 0;
+        t->size_set = 0;
+
+        UINTN n = str_len((CHAR8 *)name);
+        int file = type == '0' || type == 0 || type == '7';
+        if (bad) {
+            a->unsafe++;
+        } else if (type == '5' || (file && n && name[n - 1] == '/')) {
+            member_begin(a, name, 1, 0);
+        } else if (file) {
+            if (member_begin(a, name, 0, t->left)) t->put = PUT_FILE;
+        } else {
+            a->links++;         /* links, devices, FIFOs */
+        }
+    }
+    t->pad = (UINT32)((TAR_BLOCK - t->left % TAR_BLOCK) % TAR_BLOCK);
+    if (t->left) t->state = TAR_DATA;
+    else tar_data_end(a);
+}
+
+/* The next len bytes of the tar stream, split anywhere */
+static void tar_feed(struct ar *a, const UINT8 *p, UINTN len) {
+    struct tar *t = &a->t;
+    while (len && !a->stop) {
+        UINTN n = len;
+        switch (t->state) {
+        case TAR_HEAD:
+            if (n > TAR_BLOCK - t->have) n = TAR_BLOCK - t->have;
+            mem_copy(t->hdr + t->have, p, n);
+            t->have += n;
+            if (t->have == TAR_BLOCK) {
+                t->have = 0;
+                tar_header(a);
+            }
+            break;
+        case TAR_DATA:
+            if ((UINT64)n > t->left) n = (UINTN)t->left;
+            if (t->put == PUT_FILE) {
+                member_data(a, p, n);
+            } else if (t->put != PUT_SKIP) {
+                UINTN k = n;
+                if (k > PAX_MAX - t->meta_len) {
+                    k = PAX_MAX - t->meta_len;
+                    t->meta_over = 1;
+                }
+                mem_copy(t->meta + t->meta_len, p, k);
+                t->meta_len += k;
+            }
+            t->left -= n;
+            if (t->left == 0) tar_data_end(a);
+            break;
+        case TAR_PAD:
+            if (n > t->pad) n = t->pad;
+            t->pad -= (UINT32)n;
+            if (t->pad == 0) t->state = TAR_HEAD;
+            break;
+        case TAR_RAW:
+            member_data(a, p, n);
+            break;
+        default:                /* TAR_END: the rest is padding */
+            return;
+        }
+        p += n;
+        len -= n;
+    }
+}
+
+/* The tar stream is over: see that it ended where it could */
+static void tar_finish(struct ar *a) {
+    struct tar *t = &a->t;
+    if (a->stop) return;
+    if (t->state == TAR_HEAD && t->headers == 0 && a->raw) {
+        /* A .gz shorter than a tar header */
+        member_raw(a);
+        member_data(a, t->hdr, t->have);
+        member_end(a, 1);
+        return;
+    }
+    if (t->state == TAR_RAW) {
+        member_end(a, 1);
+        return;
+    }
+    /* Some writers leave out the zero blocks at the end */
+    if (t->state == TAR_END || (t->state == TAR_HEAD && t->have == 0 && t->headers))
+        return;
+    if (t->headers == 0) a->stop = "Not a tar, tar.gz or zip archive.";
+    else damaged(a);
+}
+
+static void tar_run(struct ar *a) {
+    while (a->t.state != TAR_END && !a->stop && in_more(a)) {
+        tar_feed(a, a->src.p, a->src.n);
+        a->src.p += a->src.n;
+        a->src.n = 0;
+    }
+    tar_finish(a);
+}
+
+/* ---- gzip ---- */
+
+static int gz_out(void *ctx, const UINT8 *data, UINTN len) {
+    struct ar *a = (struct ar *)ctx;
+    a->gz_crc = crc32(a->gz_crc, data, len);
+    tar_feed(a, data, len);
+    return a->stop ? -1 : 0;
+}
+
+/* One member after another (as cat makes them), each header, deflate
+   data and CRC-32 and length trailer */
+static void gz_run(struct ar *a) {
+    for (int members = 0;; members++) {
+        if (members > 0 && (a->t.state == TAR_END || !in_more(a))) break;
+        UINT8 h[10], x[2];
+        if (in_get(a, h, 10) != 0) {
+            damaged(a);
+            return;
+        }
+        if (h[0] != 0x1F || h[1] != 0x8B || h[2] != 8) {
+            if (members == 0) damaged(a);
+            break;              /* zeros padding out the last member */
+        }
+        UINT8 flg = h[3];
+        int rc = 0;
+        if (flg & 4) {          /* FEXTRA */
+            rc = in_get(a, x, 2);
+            if (rc == 0) rc = in_pass(a, rd16(x), 0);
+        }
+        for (UINT8 bit = 8; bit <= 16 && rc == 0; bit <<= 1) {
+            /* FNAME, FCOMMENT: each ends in a NUL */
+            if (!(flg & bit)) continue;
+            do rc = in_get(a, x, 1); while (rc == 0 && x[0]);
+        }
+        if (rc == 0 && (flg & 2)) rc = in_pass(a, 2, 0);
+        if (rc != 0) {
+            damaged(a);
+            return;
+        }
+
+        a->gz_crc = 0;
+        inflate_init(a->z, &a->src, gz_out, a);
+        if (inflate_run(a->z) != 0 || in_get(a, h, 8) != 0) {
+            damaged(a);
+            return;
+        }
+        if (rd32(h) != a->gz_crc || rd32(h + 4) != (UINT32)a->z->total) {
+            if (!a->stop) a->stop = "The archive is damaged: its CRC does not match.";
+            return;
+        }
+    }
+    tar_finish(a);
+}
+
+/* ---- zip ---- */
+
+static int zip_out(void *ctx, const UINT8 *data, UINTN len) {
+    struct ar *a = (struct ar *)ctx;
+    member_data(a, data, len);
+    return a->stop ? -1 : 0;
+}
+
+/* Local headers in order, up to the central directory */
+static void zip_run(struct ar *a) {
+    while (!a->stop) {
+        UINT8 h[30];
+        if (in_get(a, h, 4) != 0) {
+            damaged(a);
+            return;
+        }
+        UINT32 sig = rd32(h);
+        if (sig == ZIP_CENTRAL || sig == ZIP_END) return;   /* every member seen */
+        if (sig != ZIP_LOCAL || in_get(a, h + 4, 26) != 0) {
+            damaged(a);
+            return;
+        }
+        UINT32 flags = rd16(h + 6), method = rd16(h + 8);
+        UINT32 crc = rd32(h + 14);
+        UINT64 csize = rd32(h + 18), usize = rd32(h + 22);
+        UINT32 nlen = rd16(h + 26), xlen = rd16(h + 28);
+
+        char name[ARCHIVE_NAME_MAX];
+        UINT32 keep = nlen < sizeof(name) ? nlen : 0;
+        if (in_get(a, name, keep) != 0 || in_pass(a, nlen - keep, 0) != 0) {
+            damaged(a);
+            return;
+        }
+        name[keep] = '\0';
+
+        /* Sizes past 4 GB are in extra field 1, for those set to ~0 */
+        int zip64 = 0;
+        while (xlen >= 4) {
+            UINT8 x[16];
+            if (in_get(a, x, 4) != 0) break;
+            UINT32 id = rd16(x), sz = rd16(x + 2), k = 0;
+            xlen -= 4;
+            if (sz > xlen) break;
+            xlen -= sz;
+            if (id == 1) {
+                zip64 = 1;
+                k = sz < 16 ? sz : 16;
+                if (in_get(a, x, k) != 0) break;
+                UINT32 o = 0;
+                if (usize == 0xFFFFFFFF && o + 8 <= k) { usize = rd64(x + o); o += 8; }
+                if (csize == 0xFFFFFFFF && o + 8 <= k) { csize = rd64(x + o); o += 8; }
+            }
+            if (in_pass(a, sz - k, 0) != 0) break;
+        }
+        if (xlen >= 4 || in_pass(a, xlen, 0) != 0) {
+            damaged(a);
+            return;
+        }
+
+        /* Encrypted or packed some other way: passed over, which needs
+           the packed size ahead of the data */
+        int known = method == 0 || method == 8;
+        if ((flags & 1) || !known) {
+            a->job.failed++;
+            known = 0;
+        } else if (keep == 0) {
+            a->unsafe++;
+        } else if (name[keep - 1] == '/') {
+            member_begin(a, name, 1, 0);
+        } else {
+            member_begin(a, name, 0, usize);
+        }
+        if (a->stop) break;
+
+        /* Without its size ahead of it only a deflate stream shows where
+           it ends; zip tools writing to a pipe store just empty files
+           that way, which the size after them confirms */
+        int rc;
+        if (known && method == 8) {
+            inflate_init(a->z, &a->src, zip_out, a);
+            rc = inflate_run(a->z);
+        } else {
+            rc = in_pass(a, csize, 1);
+        }
+        if (rc == 0 && (flags & 8)) {
+            /* The CRC and sizes follow the data, maybe after a signature */
+            UINT8 d[16];
+            rc = in_get(a, d, 4);
+            if (rc == 0 && rd32(d) == ZIP_DESC) rc = in_get(a, d, 4);
+            if (rc == 0) crc = rd32(d);
+            if (rc == 0) rc = in_get(a, d, zip64 ? 16 : 8);
+            if (rc == 0 && method != 8 && csize == 0 && (zip64 ? rd64(d) : rd32(d)) != 0) {
+                member_end(a, 0);
+                a->stop = "A member's size comes after it; it cannot be passed over.";
+                break;
+            }
+        }
+        member_end(a, rc == 0 && a->crc == crc);
+        if (rc != 0) damaged(a);
+    }
+}
+
+/* ---- Unpacking ---- */
+
+int archive_extract(struct fs_volume *src, const CHAR16 *path, const char *name,
+                    struct fs_volume *dst, const CHAR16 *dst_dir) {
+    char buf[COPY_MAX_PATH + 32];
+    char into[COPY_MAX_PATH];
+    UINTN n = 0;
+    while (dst_dir[n] && n < COPY_MAX_PATH - 1) {
+        into[n] = (char)dst_dir[n];
+        n++;
+    }
+    into[n] = '\0';
+
+    fb_clear(COLOR_BLACK);
+    ar_print("\n", COLOR_WHITE);
+    ar_print("  ========================================\n", COLOR_CYAN);
+    ar_print("       EXTRACT\n", COLOR_CYAN);
+    ar_print("  ========================================\n", COLOR_CYAN);
+    ar_print("\n", COLOR_WHITE);
+    snprintf(buf, sizeof(buf), "  Archive: %s\n", name);
+    ar_print(buf, COLOR_WHITE);
+    snprintf(buf, sizeof(buf), "  Into:    %s\n\n", into);
+    ar_print(buf, COLOR_WHITE);
+
+    struct ar *a = (struct ar *)mem_alloc(sizeof(*a));
+    if (a) {
+        a->buf = (UINT8 *)mem_alloc_raw(AR_BACK + ARCHIVE_READ);
+        a->z = (struct inflate *)mem_alloc_raw(sizeof(struct inflate));
+    }
+    if (!a || !a->buf || !a->z) {
+        ar_print("  Out of memory.\n", COLOR_RED);
+        if (a && a->buf) mem_free(a->buf);
+        if (a && a->z) mem_free(a->z);
+        if (a) mem_free(a);
+        ar_wait_key();
+        return -1;
+    }
+    a->f = fs_volume_open_read(src, path, &a->size);
+    if (!a->f) {
+        ar_print("  Could not open the archive.\n", COLOR_RED);
+        mem_free(a->buf);
+        mem_free(a->z);
+        mem_free(a);
+        ar_wait_key();
+        return -1;
+    }
+    mem_set(a->buf, 0, AR_BACK);
+    a->src.p = a->buf + AR_BACK;
+    a->src.fill = in_fill;
+    copy_init(&a->job, src, dst);
+    mem_copy(a->root, dst_dir, n * sizeof(CHAR16));
+    a->root[n] = 0;
+    a->root_len = (n == 1 && dst_dir[0] == L'\\') ? 0 : n;
+    fs_volume_begin_batch(dst);    /* metadata goes out once, at the end */
+
+    ar_print("  ESC stops after the file being written.\n\n", COLOR_DGRAY);
+    a->row = g_boot.cursor_y;
+    progress_start(&a->pg, "Unpacking", a->size);
+
+    /* The format is in the first bytes; anything else may be a tar */
+    enum archive_kind kind = ARCHIVE_TAR;
+    if (in_more(a)) {
+        const UINT8 *p = a->src.p;
+        if (a->src.n >= 2 && p[0] == 0x1F && p[1] == 0x8B)
+            kind = ARCHIVE_GZIP;
+        else if (a->src.n >= 4 && (rd32(p) == ZIP_LOCAL || rd32(p) == ZIP_END))
+            kind = ARCHIVE_ZIP;
+    }
+    a->zip = kind == ARCHIVE_ZIP;
+    a->raw = kind == ARCHIVE_GZIP && !has_ext(name, ".tgz") && !has_ext(name, ".tar.gz");
+
+    if (kind == ARCHIVE_GZIP) gz_run(a);
+    else if (kind == ARCHIVE_ZIP) zip_run(a);
+    else tar_run(a);
+    member_end(a, 0);           /* one cut off by an error or ESC */
+    fs_stream_close(a->f);
+    if (fs_volume_commit_batch(dst) != 0) a->job.failed++;
+
+    int cancelled = a->stop == s_cancelled;
+    int ok = !a->stop && a->job.failed == 0 && a->unsafe == 0;
+    snprintf(buf, sizeof(buf), "%s -> %s", name, into);
+    if (!cancelled && a->pg.chunks) progress_log(&a->pg, buf, ok);
+
+    ar_print("\n\n\n", COLOR_WHITE);
+    if (a->stop) {
+        snprintf(buf, sizeof(buf), "  %s\n", a->stop);
+        ar_print(buf, cancelled ? COLOR_YELLOW : COLOR_RED);
+    }
+    snprintf(buf, sizeof(buf), "  Unpacked %u files, %llu MB.\n", a->job.files,
+             (unsigned long long)(a->job.bytes / (1024 * 1024)));
+    ar_print(buf, ok ? COLOR_GREEN : COLOR_WHITE);
+    if (a->job.failed) {
+        snprintf(buf, sizeof(buf), "  %u could not be written or unpacked.\n",
+                 a->job.failed);
+        ar_print(buf, COLOR_RED);
+    }
+    if (a->unsafe) {
+        snprintf(buf, sizeof(buf), "  %u had names too long or leading outside"
+                 " the directory; passed over.\n", a->unsafe);
+        ar_print(buf, COLOR_YELLOW);
+    }
+    if (a->links) {
+        snprintf(buf, sizeof(buf), "  %u links or special files skipped.\n", a->links);
+        ar_print(buf, COLOR_DGRAY);
+    }
+    char stats[128];
+    progress_summary(&a->pg, stats, sizeof(stats));
+    snprintf(buf, sizeof(buf), "  Reading: %s\n\n", stats);
+    ar_print(buf, COLOR_DGRAY);
+
+    copy_done(&a->job);
+    mem_free(a->buf);
+    mem_free(a->z);
+    mem_free(a);
+    ar_wait_key();
+    return ok ? 0 : -1;
+}
+
+/* ---- Packing ---- */
+
+#define PK_BLOCK  (512 * 1024)      /* tar bytes one job deflates */
+#define PK_BLOCKS 8                 /* jobs per batch */
+#define PK_BATCH  (PK_BLOCK * PK_BLOCKS)
+#define PK_OUT    DEFLATE_BOUND(PK_BLOCK)
+
+static const char s_write_failed[] = "Could not write the archive.";
+
+/* One job: a block of tar, deflated and checksummed on a worker */
+struct pk_block {
+    struct mp_job job;
+    const UINT8 *data;
+    UINTN len, history;
+    UINT8 *out;                 /* PK_OUT bytes */
+    UINTN out_len;              /* 0 if it did not fit */
+    UINT32 crc;
+    void *scratch;              /* DEFLATE_SCRATCH bytes */
+};
+
+/* Tar gathered for a round of jobs. The last 32 KB of the batch before
+   go in front, so the first block matches into them like the rest. */
+struct pk_batch {
+    UINT8 *buf;                 /* DEFLATE_WINDOW of history, then PK_BATCH */
+    UINTN history, len;
+    int blocks;                 /* submitted, not yet written */
+    struct pk_block blk[PK_BLOCKS];
+};
+
+struct pk {
+    struct fs_volume *src;
+    struct copy_job job;        /* writes the archive */
+    UINT8 *mem;
+    struct pk_batch b[2];
+    int cur;                    /* the batch being filled */
+    UINT32 crc;                 /* of the tar written */
+    UINT64 tar;                 /* its length */
+    const char *stop;
+
+    UINT32 files, dirs, failed;
+    UINT64 bytes;               /* file data packed */
+    CHAR16 path[COPY_MAX_PATH]; /* being read */
+    char name[ARCHIVE_NAME_MAX];    /* its name in the tar */
+
+    struct progress pg;
+    UINT32 row;
+};
+
+#define PK_MEM (2 * (PK_BLOCKS * (DEFLATE_SCRATCH + PK_OUT) + \
+                     DEFLATE_WINDOW + PK_BATCH))
+
+static void pk_deflate(void *arg, void *arena) {
+    struct pk_block *k = (struct pk_block *)arg;
+    (void)arena;
+    k->crc = crc32(0, k->data, k->len);
+    k->out_len = deflate_compress(k->data, k->len, k->history, k->out,
+                                  PK_OUT, k->scratch);
+}
+
+static void pk_write(struct pk *p, const void *data, UINTN len) {
+    if (!p->stop && copy_write(&p->job, data, len) != 0) p->stop = s_write_failed;
+}
+
+/* Wait for a batch's jobs and write their output in order */
+static void pk_drain(struct pk *p, struct pk_batch *b) {
+    for (int i = 0; i < b->blocks; i++) {
+        struct pk_block *k = &b->blk[i];
+        mp_wait(&k->job);
+        if (!k->out_len && !p->stop) p->stop = s_write_failed;
+        pk_write(p, k->out, k->out_len);
+        p->crc = crc32_combine(p->crc, k->crc, k->len);
+        p->tar += k->len;
+    }
+    b->blocks = 0;
+}
+
+/* Hand the batch being filled to the workers, write out the other one,
+   which had the filling's reads to finish in, and fill that next */
+static void pk_send(struct pk *p) {
+    struct pk_batch *b = &p->b[p->cur], *next = &p->b[!p->cur];
+    for (UINTN off = 0; off < b->len; off += PK_BLOCK) {
+        struct pk_block *k = &b->blk[b->blocks++];
+        k->data = b->buf + DEFLATE_WINDOW + off;
+        k->len = b->len - off < PK_BLOCK ? b->len - off : PK_BLOCK;
+        k->history = off ? DEFLATE_WINDOW : b->history;
+        mp_submit(&k->job, pk_deflate, k);
+    }
+    pk_drain(p, next);
+
+    UINTN h = b->history + b->len;
+    if (h > DEFLATE_WINDOW) h = DEFLATE_WINDOW;
+    mem_copy(next->buf + DEFLATE_WINDOW - h, b->buf + DEFLATE_WINDOW + b->len - h, h);
+    next->history = h;
+    next->len = 0;
+    p->cur = !p->cur;
+    if (!p->stop && ar_cancelled()) p->stop = s_cancelled;
+}
+
+/* Append tar bytes, or zeros when data is NULL */
+static void pk_put(struct pk *p, const void *data, UINTN len) {
+    const UINT8 *s = (const UINT8 *)data;
+    while (len && !p->stop) {
+        struct pk_batch *b = &p->b[p->cur];
+        UINTN n = PK_BATCH - b->len;
+        if (n > len) n = len;
+        UINT8 *d = b->buf + DEFLATE_WINDOW + b->len;
+        if (s) {
+            mem_copy(d, s, n);
+            s += n;
+        } else {
+            mem_set(d, 0, n);
+        }
+        b->len += n;
+        len -= n;
+        if (b->len == PK_BATCH) pk_send(p);
+    }
+}
+
+/* len digits less one, then a NUL; base-256 when it will not fit */
+static void tar_octal(UINT8 *f, int len, UINT64 v) {
+    if (v >> (3 * (len - 1))) {
+        f[0] = 0x80;
+        for (int i = len - 1; i > 0; i--, v >>= 8) f[i] = (UINT8)v;
+        return;
+    }
+    f[len - 1] = 0;
+    for (int i = len - 1; i > 0; i--, v >>= 3) f[i - 1] = (UINT8)('0' + (v & 7));
+}
+
+/* An FS_DOS_TIME() stamp as Unix time, the clock taken as UTC */
+static UINT64 dos_unix(UINT32 t) {
+    if (!t) return 0;
+    INT64 y = (INT64)(t >> 25) + 1980;
+    INT64 m = (t >> 21) & 15, d = (t >> 16) & 31;
+    y -= m <= 2;
+    INT64 era = y / 400, yoe = y - era * 400;
+    INT64 doy = (153 * (m + (m > 2 ? -3 : 9)) + 2) / 5 + d - 1;
+    INT64 days = era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468;
+    return (UINT64)days * 86400 + ((t >> 11) & 31) * 3600 +
+           ((t >> 5) & 63) * 60 + (t & 31) * 2;
+}
+
+static void pk_block_out(struct pk *p, UINT8 *h, const char *name,
+                         UINTN name_len, char type, int mode, UINT64 size,
+                         UINT64 mtime) {
+    mem_copy(h, name, name_len);
+    tar_octal(h + 100, 8, (UINT64)mode);
+    tar_octal(h + 108, 8, 0);
+    tar_octal(h + 116, 8, 0);
+    tar_octal(h + 124, 12, size);
+    tar_octal(h + 136, 12, mtime);
+    h[156] = (UINT8)type;
+    mem_copy(h + 257, "ustar\0" "00", 8);
+
+    UINT64 sum = 0;
+    mem_set(h + 148, ' ', 8);
+    for (int i = 0; i < TAR_BLOCK; i++) sum += h[i];
+    tar_octal(h + 148, 7, sum);
+    pk_put(p, h, TAR_BLOCK);
+}
+
+/* A member's header. A name too long for the ustar fields, even split
+   into prefix and name, goes first in a pax record. */
+static void pk_header(struct pk *p, int is_dir, UINT64 size, UINT32 mtime) {
+    UINT8 h[TAR_BLOCK];
+    const char *name = p->name;
+    UINTN n = str_len((CHAR8 *)name);
+    UINTN split = 0;
+    if (n > 100) {
+        UINTN i = n - 101;
+        while (i < n - 1 && i <= 155 && name[i] != '/') i++;
+        if (i < n - 1 && i <= 155) split = i + 1;
+    }
+
+    if (n > 100 && !split) {
+        /* "<length> path=<name>\n", the length counting itself */
+        char rec[ARCHIVE_NAME_MAX + 16];
+        UINTN body = 7 + n, len = body + 1;
+        while (len < body + (len >= 100 ? 3 : len >= 10 ? 2 : 1)) len++;
+        snprintf(rec, sizeof(rec), "%u path=%s\n", (UINT32)len, name);
+        mem_set(h, 0, sizeof(h));
+        pk_block_out(p, h, "PaxHeader", 9, 'x', 0644, len, 0);
+        pk_put(p, rec, len);
+        pk_put(p, NULL, (TAR_BLOCK - len % TAR_BLOCK) % TAR_BLOCK);
+        n = 100;
+    }
+
+    mem_set(h, 0, sizeof(h));
+    if (split) {
+        mem_copy(h + 345, name, split - 1);
+        name += split;
+        n -= split;
+    }
+    pk_block_out(p, h, name, n, is_dir ? '5' : '0', is_dir ? 0755 : 0644,
+                 size, dos_unix(mtime));
+}
+
+/* One file: its header, then its data from p->path. Data that will not
+   read is sent as zeros, the size being promised already. */
+static void pk_file(struct pk *p, UINT32 mtime) {
+    UINT64 size = 0;
+    struct fs_file *f = fs_volume_open_read(p->src, p->path, &size);
+    if (!f) {
+        p->failed++;
+        return;
+    }
+    pk_header(p, 0, size, mtime);
+
+    int ok = 1;
+    UINT64 left = size;
+    while (left && !p->stop) {
+        struct pk_batch *b = &p->b[p->cur];
+        UINTN n = PK_BATCH - b->len;
+        if ((UINT64)n > left) n = (UINTN)left;
+        UINT8 *d = b->buf + DEFLATE_WINDOW + b->len;
+        if (ok && (fs_stream_read(f, d, &n) != 0 || n == 0)) ok = 0;
+        if (!ok) mem_set(d, 0, n);
+        b->len += n;
+        left -= n;
+        ar_bar(&p->pg, p->row, p->name, n);
+        if (b->len == PK_BATCH) pk_send(p);
+    }
+    fs_stream_close(f);
+    pk_put(p, NULL, (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK);
+    p->bytes += size;
+    if (ok) p->files++;
+    else p->failed++;
+}
+
+/* Append name to both p->path and p->name; -1 if either gets too long */
+static int pk_push(struct pk *p, UINTN plen, UINTN nlen, const char *name) {
+    UINTN k = str_len((CHAR8 *)name);
+    if (plen + 1 + k >= COPY_MAX_PATH || nlen + k + 2 >= ARCHIVE_NAME_MAX)
+        return -1;
+    if (plen > 1 || p->path[0] != L'\\') p->path[plen++] = L'\\';
+    for (UINTN i = 0; i <= k; i++) p->path[plen + i] = (CHAR16)(UINT8)name[i];
+    if (nlen) p->name[nlen++] = '/';
+    mem_copy(p->name + nlen, name, k + 1);
+    return 0;
+}
+
+/* The directory at p->path, named p->name: its header, then what is in it */
+static void pk_walk(struct pk *p, UINT32 mtime, int depth) {
+    UINTN plen = 0, nlen = str_len((CHAR8 *)p->name);
+    while (p->path[plen]) plen++;
+    p->name[nlen] = '/';
+    p->name[nlen + 1] = '\0';
+    pk_header(p, 1, 0, mtime);
+    p->name[nlen] = '\0';
+    p->dirs++;
+
+    struct fs_dir *d = fs_volume_opendir(p->src, p->path);
+    if (!d) {
+        p->failed++;
+        return;
+    }
+    struct dirlist list;
+    mem_set(&list, 0, sizeof(list));
+    struct fs_entry e;
+    int r;
+    while ((r = fs_readdir_next(d, &e)) > 0) {
+        if (dirlist_add_entry(&list, &e) != 0) {
+            r = -1;
+            break;
+        }
+    }
+    fs_closedir(d);
+    if (r < 0) p->failed++;
+
+    for (int i = 0; i < list.count && !p->stop; i++) {
+        const struct dirlist_rec *rec = &list.recs[i];
+        if (pk_push(p, plen, nlen, dirlist_name(&list, i)) != 0) {
+            p->failed++;
+        } else if (rec->is_dir) {
+            if (depth + 1 > COPY_MAX_DEPTH) p->failed++;
+            else pk_walk(p, rec->mtime, depth + 1);
+        } else {
+            if (ar_cancelled()) p->stop = s_cancelled;
+            else pk_file(p, rec->mtime);
+        }
+        p->path[plen] = 0;
+        p->name[nlen] = '\0';
+    }
+    dirlist_free(&list);
+}
+
+int archive_pack(struct fs_volume *src, const CHAR16 *path, const char *name,
+                 int is_dir, struct fs_volume *dst, const CHAR16 *dst_path) {
+    char buf[COPY_MAX_PATH + 32];
+    char into[COPY_MAX_PATH];
+    UINTN n = 0;
+    while (dst_path[n] && n < COPY_MAX_PATH - 1) {
+        into[n] = (char)dst_path[n];
+        n++;
+    }
+    into[n] = '\0';
+
+    fb_clear(COLOR_BLACK);
+    ar_print("\n", COLOR_WHITE);
+    ar_print("  ========================================\n", COLOR_CYAN);
+    ar_print("       PACK\n", COLOR_CYAN);
+    ar_print("  ========================================\n", COLOR_CYAN);
+    ar_print("\n", COLOR_WHITE);
+    snprintf(buf, sizeof(buf), "  Packing: %s\n", name);
+    ar_print(buf, COLOR_WHITE);
+    snprintf(buf, sizeof(buf), "  Into:    %s\n\n", into);
+    ar_print(buf, COLOR_WHITE);
+
+    UINTN plen = 0;
+    while (path[plen]) plen++;
+    struct pk *p = (struct pk *)mem_alloc(sizeof(*p));
+    if (p) p->mem = (UINT8 *)mem_alloc_raw(PK_MEM);
+    if (!p || !p->mem || plen >= COPY_MAX_PATH ||
+        str_len((CHAR8 *)name) + 2 >= ARCHIVE_NAME_MAX) {
+        ar_print(p && p->mem ? "  The name is too long.\n" : "  Out of memory.\n",
+                 COLOR_RED);
+        if (p && p->mem) mem_free(p->mem);
+        if (p) mem_free(p);
+        ar_wait_key();
+        return -1;
+    }
+
+    /* Scratch first: it holds 32-bit tables */
+    UINT8 *m = p->mem;
+    for (int i = 0; i < 2; i++) {
+        struct pk_batch *b = &p->b[i];
+        for (int k = 0; k < PK_BLOCKS; k++) {
+            b->blk[k].scratch = m;
+            m += DEFLATE_SCRATCH;
+        }
+        for (int k = 0; k < PK_BLOCKS; k++) {
+            b->blk[k].out = m;
+            m += PK_OUT;
+        }
+        b->buf = m;
+        m += DEFLATE_WINDOW + PK_BATCH;
+    }
+
+    p->src = src;
+    copy_init(&p->job, src, dst);
+    mem_copy(p->path, path, (plen + 1) * sizeof(CHAR16));
+    str_copy((CHAR8 *)p->name, (CHAR8 *)name, ARCHIVE_NAME_MAX);
+
+    int workers = mp_start();
+    snprintf(buf, sizeof(buf), "  Compressing on %d core%s. ESC stops.\n\n",
+             workers + 1, workers ? "s" : "");
+    ar_print(buf, COLOR_DGRAY);
+    p->row = g_boot.cursor_y;
+    progress_start(&p->pg, "Packing", 0);
+
+    /* gzip header: deflate, no name, no time, from Unix */
+    static const UINT8 gz_head[10] = { 0x1F, 0x8B, 8, 0, 0, 0, 0, 0, 0, 3 };
+    if (copy_open(&p->job, dst_path, 0) != 0) {
+        p->stop = "Could not create the archive.";
+    } else {
+        pk_write(p, gz_head, sizeof(gz_head));
+        if (is_dir) pk_walk(p, 0, 0);
+        else pk_file(p, 0);
+        pk_put(p, NULL, 2 * TAR_BLOCK);     /* the end of the tar */
+        if (!p->stop && p->b[p->cur].len) pk_send(p);
+        pk_drain(p, &p->b[0]);
+        pk_drain(p, &p->b[1]);
+
+        UINT8 tail[8];
+        for (int i = 0; i < 4; i++) {
+            tail[i] = (UINT8)(p->crc >> (8 * i));
+            tail[4 + i] = (UINT8)(p->tar >> (8 * i));
+        }
+        pk_write(p, DEFLATE_END, DEFLATE_END_LEN);
+        pk_write(p, tail, sizeof(tail));
+        copy_close(&p->job, !p->stop);
+    }
+    mp_stop();
+
+    int cancelled = p->stop == s_cancelled;
+    int ok = !p->stop && p->failed == 0;
+    snprintf(buf, sizeof(buf), "%s -> %s", name, into);
+    if (!cancelled && p->pg.chunks) progress_log(&p->pg, buf, ok);
+
+    ar_print("\n\n\n", COLOR_WHITE);
+    if (p->stop) {
+        snprintf(buf, sizeof(buf), "  %s\n", p->stop);
+        ar_print(buf, cancelled ? COLOR_YELLOW : COLOR_RED);
+    } else {
+        snprintf(buf, sizeof(buf), "  Packed %u files in %u directories, %llu MB"
+                 " into %llu MB.\n", p->files, p->dirs,
+                 (unsigned long long)(p->bytes / (1024 * 1024)),
+                 (unsigned long long)(p->job.bytes / (1024 * 1024)));
+        ar_print(buf, ok ? COLOR_GREEN : COLOR_WHITE);
+    }
+    if (p->failed) {
+        snprintf(buf, sizeof(buf), "  %u could not be read or had names too"
+                 " long; passed over.\n", p->failed);
+        ar_print(buf, COLOR_RED);
+    }
+    char stats[128];
+    progress_summary(&p->pg, stats, sizeof(stats));
+    snprintf(buf, sizeof(buf), "  Reading: %s\n\n", stats);
+    ar_print(buf, COLOR_DGRAY);
+
+    copy_done(&p->job);
+    mem_free(p->mem);
+    mem_free(p);
+    ar_wait_key();
+    return ok ? 0 : -1;
+}
@@ -0,0 +1,57 @@
+/*
+ * archive.h — Unpack tar, tar.gz and zip archives onto a volume; pack
+ * directory trees into .tar.gz
+ *
+ * A source tree or a set of drivers arrives as one archive; this puts
+ * its files on any writable volume (exFAT, FAT32, the RAM disk) without
+ * another machine. The archive is read once, front to back, in large
+ * pieces: gzip and zip data are inflated as they stream past (inflate.h)
+ * and each member goes out through the copy engine's producer calls
+ * (copy.h), so memory use does not depend on the archive's size. A zip
+ * is read by its local headers, not its central directory at the end.
+ *
+ * A directory tree can also be packed into a .tar.gz. The tar is cut
+ * into blocks that the worker pool (mp.h) deflates side by side while
+ * the boot processor reads the next files and writes out the blocks
+ * finished before; the blocks join into one gzip stream any tool reads.
+ */
+#ifndef ARCHIVE_H
+#define ARCHIVE_H
+
+#include "fs.h"
+
+#define ARCHIVE_READ     (4 * 1024 * 1024)  /* archive bytes per read */
+#define ARCHIVE_NAME_MAX 256                /* longest member name kept */
+
+enum archive_kind {
+    ARCHIVE_NONE,
+    ARCHIVE_TAR,
+    ARCHIVE_GZIP,               /* .tar.gz, .tgz or a single .gz file */
+    ARCHIVE_ZIP,
+};
+
+/* What name's extension says it is */
+enum archive_kind archive_kind_of(const char *name);
+
+/* name without its archive extension ("src.tar.gz" -> "src"), for the
+   directory it unpacks into */
+void archive_stem(const char *name, char *out, UINTN max);
+
+/* Unpack path on src, whose name is name, into dst_dir on dst (created
+   as needed), showing progress; ESC cancels. The format is told from
+   the content. Members that will not write, or whose names would land
+   outside dst_dir, are counted and passed over; links and devices are
+   skipped. Returns 0 if every file was unpacked, -1 otherwise. */
+int archive_extract(struct fs_volume *src, const CHAR16 *path, const char *name,
+                    struct fs_volume *dst, const CHAR16 *dst_dir);
+
+/* Pack path on src (a directory and everything below it, or one file)
+   into a new .tar.gz at dst_path on dst, showing progress; ESC cancels
+   and deletes the partial archive. Members are named from name, the
+   last part of path. Files that will not read are counted and left out
+   (or zero-filled, when they fail part way). Returns 0 if everything
+   was packed, -1 otherwise. */
+int archive_pack(struct fs_volume *src, const CHAR16 *path, const char *name,
+                 int is_dir, struct fs_volume *dst, const CHAR16 *dst_path);
+
+#endif /* ARCHIVE_H */
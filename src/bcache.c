@@ -0,0 +1,670 @@
+/*
+ * bcache.c — Shared block cache for the portable filesystem drivers
+ *
+ * Portable: uses callback-based block I/O, no libc dependency.
+ *
+ * Entries live in a fixed array sized from the memory budget.  Block
+ * data is allocated lazily in chunks of BCACHE_CHUNK blocks, so a
+ * short-lived mount (e.g. reading a volume label) only pays for the
+ * blocks it touches; chunks, like the readahead and flush buffers, are
+ * device I/O buffers (mem_io_get) that the next mount can reuse.
+ * Lookup is a multiplicative hash over the block number; eviction
+ * takes the least recently used entry.  Dirty blocks are kept until
+ * bcache_flush() (or until a dirty block reaches the LRU tail), then
+ * written sorted by LBA with adjacent blocks merged into a single
+ * write call.
+ *
+ * Single-block misses that continue where the previous miss left off
+ * grow a readahead window (doubling up to ra_max blocks), so sector-
+ * at-a-time walkers such as directory and FAT scans turn into a few
+ * large device reads instead of one bus transaction per sector.
+ */
+
+#include "bcache.h"
+#include "mem.h"
+#include "trace.h"
+
+/* ---- Constants ---- */
+
+#define BCACHE_DEFAULT_BUDGET   (1024 * 1024)
+#define BCACHE_MIN_BLOCKS       16
+#define BCACHE_MAX_BLOCKS       32768
+
+/* Blocks of data per lazily allocated chunk */
+#define BCACHE_CHUNK_SHIFT      6
+#define BCACHE_CHUNK            (1 << BCACHE_CHUNK_SHIFT)
+
+/* Longest run that goes through the cache, and the flush merge limit */
+#define BCACHE_RUN_MAX          64
+
+/* First readahead window after two sequential misses */
+#define BCACHE_RA_START         4
+
+#define BCACHE_NONE             (-1)
+
+/* ---- Structures ---- */
+
+struct bcache_entry {
+    UINT64 blk;
+    int    hnext;               /* hash chain */
+    int    prev;                /* LRU list, head = most recent */
+    int    next;                /* LRU list / free list */
+    UINT8  valid;
+    UINT8  dirty;
+};
+
+struct bcache {
+    bcache_read_fn  read_fn;
+    bcache_write_fn write_fn;
+    void           *ctx;
+
+    UINT32 block_size;          /* bytes per cache block */
+    UINT32 ratio;               /* device blocks per cache block */
+
+    struct bcache_entry *ent;
+    UINT32 nentries;            /* capacity */
+    UINT32 nused;               /* entries ever handed out */
+    UINT32 ndirty;
+
+    int   *htab;
+    UINT32 hshift;              /* 64 - log2(table size) */
+
+    int    lru_head;
+    int    lru_tail;
+    int    free_head;
+
+    UINT8 **chunks;
+    UINT32 nchunks;
+
+    UINT8 *staging;             /* BCACHE_RUN_MAX blocks, for flush merging */
+
+    /* Readahead */
+    UINT8 *ra_buf;              /* ra_max + 1 blocks */
+    UINT32 ra_max;              /* window limit in blocks, 0 = off */
+    UINT32 ra_win;              /* current window */
+    UINT64 ra_next;             /* block following the last miss */
+
+    UINT64 hits;
+    UINT64 misses;
+};
+
+static UINT64 s_budget = BCACHE_DEFAULT_BUDGET;
+
+/* ---- Budget ---- */
+
+void bcache_set_budget(UINT64 bytes)
+{
+    s_budget = bytes ? bytes : BCACHE_DEFAULT_BUDGET;
+}
+
+UINT64 bcache_get_budget(void)
+{
+    return s_budget;
+}
+
+/* ---- Internal helpers ---- */
+
+static UINT32 hash_blk(struct bcache *bc, UINT64 blk)
+{
+    return (UINT32)((blk * 0x9E3779B97F4A7C15ULL) >> bc->hshift);
+}
+
+static UINT8 *entry_data(struct bcache *bc, int idx)
+{
+    return bc->chunks[idx >> BCACHE_CHUNK_SHIFT] +
+           (UINTN)(idx & (BCACHE_CHUNK - 1)) * bc->block_size;
+}
+
+static int lookup(struct bcache *bc, UINT64 blk)
+{
+    int idx = bc->htab[hash_blk(bc, blk)];
+    while (idx != BCACHE_NONE) {
+        if (bc->ent[idx].blk == blk)
+            return idx;
+        idx = bc->ent[idx].hnext;
+    }
+    return BCACHE_NONE;
+}
+
+static void hash_insert(struct bcache *bc, int idx)
+{
+    UINT32 h = hash_blk(bc, bc->ent[idx].blk);
+    bc->ent[idx].hnext = bc->htab[h];
+    bc->htab[h] = idx;
+}
+
+static void hash_remove(struct bcache *bc, int idx)
+{
+    UINT32 h = hash_blk(bc, bc->ent[idx].blk);
+    int *pp = &bc->htab[h];
+    while (*pp != BCACHE_NONE) {
+        if (*pp == idx) {
+            *pp = bc->ent[idx].hnext;
+            return;
+        }
+        pp = &bc->ent[*pp].hnext;
+    }
+}
+
+static void lru_unlink(struct bcache *bc, int idx)
+{
+    struct bcache_entry *e = &bc->ent[idx];
+    if (e->prev != BCACHE_NONE)
+        bc->ent[e->prev].next = e->next;
+    else
+        bc->lru_head = e->next;
+    if (e->next != BCACHE_NONE)
+        bc->ent[e->next].prev = e->prev;
+    else
+        bc->lru_tail = e->prev;
+    e->prev = e->next = BCACHE_NONE;
+}
+
+static void lru_push_head(struct bcache *bc, int idx)
+{
+    struct bcache_entry *e = &bc->ent[idx];
+    e->prev = BCACHE_NONE;
+    e->next = bc->lru_head;
+    if (bc->lru_head != BCACHE_NONE)
+        bc->ent[bc->lru_head].prev = idx;
+    bc->lru_head = idx;
+    if (bc->lru_tail == BCACHE_NONE)
+        bc->lru_tail = idx;
+}
+
+static void touch(struct bcache *bc, int idx)
+{
+    if (bc->lru_head == idx)
+        return;
+    lru_unlink(bc, idx);
+    lru_push_head(bc, idx);
+}
+
+/* Remove a valid entry from hash and LRU, put it on the free list */
+static void drop_entry(struct bcache *bc, int idx)
+{
+    struct bcache_entry *e = &bc->ent[idx];
+    hash_remove(bc, idx);
+    lru_unlink(bc, idx);
+    if (e->dirty)
+        bc->ndirty--;
+    e->valid = 0;
+    e->dirty = 0;
+    e->next = bc->free_head;
+    bc->free_head = idx;
+}
+
+static int write_entry(struct bcache *bc, int idx)
+{
+    struct bcache_entry *e = &bc->ent[idx];
+    if (bc->write_fn(bc->ctx, e->blk * bc->ratio, bc->ratio,
+                     entry_data(bc, idx)) != 0)
+        return -1;
+    e->dirty = 0;
+    bc->ndirty--;
+    return 0;
+}
+
+/*
+ * Get an unused entry: free list first, then a never-used entry
+ * (allocating its data chunk), then the LRU tail.
+ */
+static int take_slot(struct bcache *bc)
+{
+    if (bc->free_head != BCACHE_NONE) {
+        int idx = bc->free_head;
+        bc->free_head = bc->ent[idx].next;
+        bc->ent[idx].next = BCACHE_NONE;
+        return idx;
+    }
+
+    if (bc->nused < bc->nentries) {
+        UINT32 c = bc->nused >> BCACHE_CHUNK_SHIFT;
+        if (!bc->chunks[c])
+            bc->chunks[c] = (UINT8 *)mem_io_get(
+                (UINTN)BCACHE_CHUNK * bc->block_size);
+        if (bc->chunks[c])
+            return (int)bc->nused++;
+        /* Out of memory: fall back to recycling what we have, and size
+           the caches of later mounts at half this budget */
+        bc->nentries = bc->nused;
+        if (s_budget / 2 >= BCACHE_DEFAULT_BUDGET)
+            s_budget /= 2;
+    }
+
+    int idx = bc->lru_tail;
+    if (idx == BCACHE_NONE)
+        return BCACHE_NONE;
+
+    /* Evicting a dirty block: write back everything in LBA order,
+       one sorted batch is far cheaper than scattered single writes.
+       A block that still cannot be written stays cached and dirty, and
+       the least recently used clean entry goes instead; with none, the
+       caller gets no slot and reports an I/O error. */
+    if (bc->ent[idx].dirty && bcache_flush(bc) != 0 &&
+        bc->ent[idx].dirty && write_entry(bc, idx) != 0) {
+        while (idx != BCACHE_NONE && bc->ent[idx].dirty)
+            idx = bc->ent[idx].prev;
+        if (idx == BCACHE_NONE)
+            return BCACHE_NONE;
+    }
+
+    drop_entry(bc, idx);
+    bc->free_head = bc->ent[idx].next;
+    bc->ent[idx].next = BCACHE_NONE;
+    return idx;
+}
+
+static void install(struct bcache *bc, int idx, UINT64 blk)
+{
+    struct bcache_entry *e = &bc->ent[idx];
+    e->blk = blk;
+    e->valid = 1;
+    e->dirty = 0;
+    hash_insert(bc, idx);
+    lru_push_head(bc, idx);
+}
+
+static void release_slot(struct bcache *bc, int idx)
+{
+    bc->ent[idx].next = bc->free_head;
+    bc->free_head = idx;
+}
+
+/* ---- Create / destroy ---- */
+
+struct bcache *bcache_create(bcache_read_fn read_fn, bcache_write_fn write_fn,
+                             void *ctx, UINT32 block_size,
+                             UINT32 dev_block_size)
+{
+    if (!read_fn || block_size == 0 || dev_block_size == 0)
+        return NULL;
+    if (block_size < dev_block_size || block_size % dev_block_size != 0)
+        return NULL;
+
+    struct bcache *bc = (struct bcache *)mem_alloc(sizeof(struct bcache));
+    if (!bc)
+        return NULL;
+
+    bc->read_fn = read_fn;
+    bc->write_fn = write_fn;
+    bc->ctx = ctx;
+    bc->block_size = block_size;
+    bc->ratio = block_size / dev_block_size;
+
+    UINT64 n = s_budget / block_size;
+    if (n < BCACHE_MIN_BLOCKS) n = BCACHE_MIN_BLOCKS;
+    if (n > BCACHE_MAX_BLOCKS) n = BCACHE_MAX_BLOCKS;
+    bc->nentries = (UINT32)n;
+
+    /* Hash table: power of two >= entry count */
+    UINT32 hbits = 4;
+    while ((1U << hbits) < bc->nentries)
+        hbits++;
+    bc->hshift = 64 - hbits;
+
+    bc->ent = (struct bcache_entry *)mem_alloc(
+        (UINTN)bc->nentries * sizeof(struct bcache_entry));
+    bc->htab = (int *)mem_alloc((UINTN)(1U << hbits) * sizeof(int));
+    bc->nchunks = (bc->nentries + BCACHE_CHUNK - 1) / BCACHE_CHUNK;
+    bc->chunks = (UINT8 **)mem_alloc((UINTN)bc->nchunks * sizeof(UINT8 *));
+    if (!bc->ent || !bc->htab || !bc->chunks) {
+        mem_free(bc->ent);
+        mem_free(bc->htab);
+        mem_free(bc->chunks);
+        mem_free(bc);
+        return NULL;
+    }
+
+    for (UINT32 i = 0; i < (1U << hbits); i++)
+        bc->htab[i] = BCACHE_NONE;
+    for (UINT32 i = 0; i < bc->nentries; i++) {
+        bc->ent[i].hnext = BCACHE_NONE;
+        bc->ent[i].prev = BCACHE_NONE;
+        bc->ent[i].next = BCACHE_NONE;
+    }
+    bc->lru_head = BCACHE_NONE;
+    bc->lru_tail = BCACHE_NONE;
+    bc->free_head = BCACHE_NONE;
+    bcache_set_readahead(bc, BCACHE_RUN_MAX - 1);
+    return bc;
+}
+
+void bcache_destroy(struct bcache *bc)
+{
+    if (!bc)
+        return;
+    bcache_flush(bc);
+    for (UINT32 i = 0; i < bc->nchunks; i++)
+        mem_io_put(bc->chunks[i]);
+    mem_free(bc->chunks);
+    mem_io_put(bc->staging);
+    mem_io_put(bc->ra_buf);
+    mem_free(bc->htab);
+    mem_free(bc->ent);
+    mem_free(bc);
+}
+
+/* ---- Readahead ---- */
+
+void bcache_set_readahead(struct bcache *bc, UINT32 max_blocks)
+{
+    if (max_blocks > BCACHE_RUN_MAX - 1)
+        max_blocks = BCACHE_RUN_MAX - 1;
+    if (max_blocks > bc->nentries / 4)
+        max_blocks = bc->nentries / 4;
+    if (max_blocks != bc->ra_max) {
+        mem_io_put(bc->ra_buf);
+        bc->ra_buf = 0;
+    }
+    bc->ra_max = max_blocks;
+    bc->ra_win = 0;
+}
+
+/* Window for a miss at 'blk': grows on sequential misses, else resets */
+static UINT32 ra_window(struct bcache *bc, UINT64 blk)
+{
+    if (bc->ra_max == 0 || blk != bc->ra_next) {
+        bc->ra_win = 0;
+        return 0;
+    }
+    bc->ra_win = bc->ra_win ? bc->ra_win * 2 : BCACHE_RA_START;
+    if (bc->ra_win > bc->ra_max)
+        bc->ra_win = bc->ra_max;
+    return bc->ra_win;
+}
+
+/*
+ * Read n blocks starting at blk in one device call and install every
+ * block that is not already cached (a cached copy may be newer).
+ * Slots are reserved before the read so that any write-back caused by
+ * eviction reaches the device first and the read sees it.
+ */
+static int ra_fill(struct bcache *bc, UINT64 blk, UINT32 n)
+{
+    int slots[BCACHE_RUN_MAX];
+    UINT32 nslots = 0;
+
+    if (!bc->ra_buf)
+        bc->ra_buf = (UINT8 *)mem_io_get((UINTN)(bc->ra_max + 1) * bc->block_size);
+    if (!bc->ra_buf)
+        return -1;
+
+    for (UINT32 k = 0; k < n; k++) {
+        if (lookup(bc, blk + k) != BCACHE_NONE)
+            continue;
+        int slot = take_slot(bc);
+        if (slot == BCACHE_NONE)
+            break;
+        slots[nslots++] = slot;
+    }
+
+    int ret = bc->read_fn(bc->ctx, blk * bc->ratio, n * bc->ratio, bc->ra_buf);
+
+    UINT32 used = 0;
+    for (UINT32 k = 0; ret == 0 && k < n && used < nslots; k++) {
+        if (lookup(bc, blk + k) != BCACHE_NONE)
+            continue;
+        int slot = slots[used++];
+        mem_copy(entry_data(bc, slot), bc->ra_buf + (UINTN)k * bc->block_size,
+                 bc->block_size);
+        install(bc, slot, blk + k);
+    }
+    while (used < nslots)
+        release_slot(bc, slots[used++]);
+
+    if (ret != 0)
+        return -1;
+    bc->ra_next = blk + n;
+    return 0;
+}
+
+/* ---- Single-block access ---- */
+
+UINT8 *bcache_get(struct bcache *bc, UINT64 blk)
+{
+    int idx = lookup(bc, blk);
+    if (idx != BCACHE_NONE) {
+        bc->hits++;
+        TRACE_EVENT(TR_BCACHE_HIT, blk, (UINTN)bc);
+        touch(bc, idx);
+        return entry_data(bc, idx);
+    }
+
+    bc->misses++;
+    TRACE_EVENT(TR_BCACHE_MISS, blk, (UINTN)bc);
+
+    /* Sequential walker: fetch the window in the same call.  A failed
+       readahead (e.g. past the end of the device) falls through to a
+       plain single-block read. */
+    UINT32 ra = ra_window(bc, blk);
+    if (ra > 0 && ra_fill(bc, blk, ra + 1) == 0) {
+        idx = lookup(bc, blk);
+        if (idx != BCACHE_NONE) {
+            touch(bc, idx);
+            return entry_data(bc, idx);
+        }
+    }
+
+    idx = take_slot(bc);
+    if (idx == BCACHE_NONE)
+        return NULL;
+
+    UINT8 *data = entry_data(bc, idx);
+    if (bc->read_fn(bc->ctx, blk * bc->ratio, bc->ratio, data) != 0) {
+        release_slot(bc, idx);
+        return NULL;
+    }
+
+    install(bc, idx, blk);
+    bc->ra_next = blk + 1;
+    return data;
+}
+
+void bcache_mark_dirty(struct bcache *bc, UINT64 blk)
+{
+    int idx = lookup(bc, blk);
+    if (idx == BCACHE_NONE || bc->ent[idx].dirty)
+        return;
+    bc->ent[idx].dirty = 1;
+    bc->ndirty++;
+}
+
+/* ---- Multi-block access ---- */
+
+int bcache_read(struct bcache *bc, UINT64 blk, UINT32 count, void *buf)
+{
+    UINT8 *dst = (UINT8 *)buf;
+    UINT32 bs = bc->block_size;
+
+    if (count > BCACHE_RUN_MAX) {
+        /* Bulk transfer: straight from the device, then overlay any
+           blocks in the range that are newer in the cache */
+        if (bc->read_fn(bc->ctx, blk * bc->ratio, count * bc->ratio, buf) != 0)
+            return -1;
+        if (bc->ndirty == 0)
+            return 0;
+        for (UINT32 i = 0; i < count; i++) {
+            int idx = lookup(bc, blk + i);
+            if (idx != BCACHE_NONE && bc->ent[idx].dirty)
+                mem_copy(dst + (UINTN)i * bs, entry_data(bc, idx), bs);
+        }
+        return 0;
+    }
+
+    UINT32 i = 0;
+    while (i < count) {
+        int idx = lookup(bc, blk + i);
+        if (idx != BCACHE_NONE) {
+            bc->hits++;
+            TRACE_EVENT(TR_BCACHE_HIT, blk + i, (UINTN)bc);
+            touch(bc, idx);
+            mem_copy(dst + (UINTN)i * bs, entry_data(bc, idx), bs);
+            i++;
+            continue;
+        }
+
+        /* Gather the run of missing blocks and read it in one call */
+        UINT32 j = i + 1;
+        while (j < count && lookup(bc, blk + j) == BCACHE_NONE)
+            j++;
+
+        UINT32 run = j - i;
+        if (bc->read_fn(bc->ctx, (blk + i) * bc->ratio, run * bc->ratio,
+                        dst + (UINTN)i * bs) != 0)
+            return -1;
+
+        bc->misses += run;
+        TRACE_EVENT(TR_BCACHE_MISS, blk + i, (UINTN)bc);
+        for (UINT32 k = i; k < j; k++) {
+            int slot = take_slot(bc);
+            if (slot == BCACHE_NONE)
+                break;
+            mem_copy(entry_data(bc, slot), dst + (UINTN)k * bs, bs);
+            install(bc, slot, blk + k);
+        }
+        bc->ra_next = blk + j;
+        i = j;
+    }
+    return 0;
+}
+
+int bcache_write(struct bcache *bc, UINT64 blk, UINT32 count, const void *buf)
+{
+    const UINT8 *src = (const UINT8 *)buf;
+    UINT32 bs = bc->block_size;
+
+    if (!bc->write_fn)
+        return -1;
+    if (bc->write_fn(bc->ctx, blk * bc->ratio, count * bc->ratio, buf) != 0)
+        return -1;
+
+    /* Keep cached copies in step with what is now on disk */
+    for (UINT32 i = 0; i < count; i++) {
+        int idx = lookup(bc, blk + i);
+        if (idx == BCACHE_NONE)
+            continue;
+        mem_copy(entry_data(bc, idx), src + (UINTN)i * bs, bs);
+        if (bc->ent[idx].dirty) {
+            bc->ent[idx].dirty = 0;
+            bc->ndirty--;
+        }
+    }
+    return 0;
+}
+
+/* ---- Flush ---- */
+
+/* Shell sort of entry indices by block number */
+static void sort_by_blk(struct bcache *bc, int *idx, UINT32 n)
+{
+    for (UINT32 gap = n / 2; gap > 0; gap /= 2) {
+        for (UINT32 i = gap; i < n; i++) {
+            int tmp = idx[i];
+            UINT64 key = bc->ent[tmp].blk;
+            UINT32 j = i;
+            while (j >= gap && bc->ent[idx[j - gap]].blk > key) {
+                idx[j] = idx[j - gap];
+                j -= gap;
+            }
+            idx[j] = tmp;
+        }
+    }
+}
+
+int bcache_flush(struct bcache *bc)
+{
+    if (bc->ndirty == 0)
+        return 0;
+    if (!bc->write_fn)
+        return -1;
+
+    int ret = 0;
+    int *list = (int *)mem_alloc((UINTN)bc->ndirty * sizeof(int));
+    if (!list) {
+        /* No memory for ordering: write in cache order */
+        for (UINT32 i = 0; i < bc->nused; i++) {
+            if (bc->ent[i].valid && bc->ent[i].dirty) {
+                if (write_entry(bc, (int)i) != 0)
+                    ret = -1;
+            }
+        }
+        return ret;
+    }
+
+    UINT32 n = 0;
+    for (UINT32 i = 0; i < bc->nused && n < bc->ndirty; i++) {
+        if (bc->ent[i].valid && bc->ent[i].dirty)
+            list[n++] = (int)i;
+    }
+    sort_by_blk(bc, list, n);
+
+    if (!bc->staging)
+        bc->staging = (UINT8 *)mem_io_get((UINTN)BCACHE_RUN_MAX * bc->block_size);
+
+    UINT32 i = 0;
+    while (i < n) {
+        /* Extend a run of consecutive block numbers */
+        UINT32 j = i + 1;
+        if (bc->staging) {
+            while (j < n && j - i < BCACHE_RUN_MAX &&
+                   bc->ent[list[j]].blk == bc->ent[list[j - 1]].blk + 1)
+                j++;
+        }
+
+        if (j - i == 1) {
+            if (write_entry(bc, list[i]) != 0)
+                ret = -1;
+        } else {
+            UINT32 run = j - i;
+            for (UINT32 k = 0; k < run; k++)
+                mem_copy(bc->staging + (UINTN)k * bc->block_size,
+                         entry_data(bc, list[i + k]), bc->block_size);
+            if (bc->write_fn(bc->ctx, bc->ent[list[i]].blk * bc->ratio,
+                             run * bc->ratio, bc->staging) != 0) {
+                ret = -1;
+            } else {
+                for (UINT32 k = 0; k < run; k++)
+                    bc->ent[list[i + k]].dirty = 0;
+                bc->ndirty -= run;
+            }
+        }
+        i = j;
+    }
+
+    mem_free(list);
+    return ret;
+}
+
+/* ---- Invalidation ---- */
+
+/* A dirty block that cannot be written stays cached, as in take_slot():
+   dropping it would lose the only copy of what was written to it */
+EFI_STATUS bcache_invalidate(struct bcache *bc, UINT64 blk)
+{
+    int idx = lookup(bc, blk);
+    if (idx == BCACHE_NONE)
+        return EFI_SUCCESS;
+    if (bc->ent[idx].dirty && (!bc->write_fn || write_entry(bc, idx) != 0))
+        return EFI_DEVICE_ERROR;
+    drop_entry(bc, idx);
+    return EFI_SUCCESS;
+}
+
+EFI_STATUS bcache_invalidate_all(struct bcache *bc)
+{
+    EFI_STATUS status = EFI_SUCCESS;
+    if (bcache_flush(bc) != 0)
+        status = EFI_DEVICE_ERROR;
+    for (UINT32 i = 0; i < bc->nused; i++) {
+        if (bc->ent[i].valid && !bc->ent[i].dirty)
+            drop_entry(bc, (int)i);
+    }
+    return status;
+}
+
+void bcache_stats(struct bcache *bc, UINT64 *hits, UINT64 *misses)
+{
+    if (hits) *hits = bc ? bc->hits : 0;
+    if (misses) *misses = bc ? bc->misses : 0;
+}
@@ -0,0 +1,68 @@
+/*
+ * bcache.h — Shared block cache for the portable filesystem drivers
+ *
+ * Portable: sits on top of the same callback-based block I/O as the
+ * exFAT and NTFS drivers, no UEFI dependency.  Hashed lookup, LRU
+ * eviction, write-back with LBA-ordered, coalesced flushes.
+ */
+#ifndef BCACHE_H
+#define BCACHE_H
+
+#ifdef ESP_PLATFORM
+#include "fs_port.h"
+#else
+#include "boot.h"
+#endif
+
+/* Block I/O callbacks (same shape as exfat/ntfs callbacks) */
+typedef int (*bcache_read_fn)(void *ctx, UINT64 lba, UINT32 count, void *buf);
+typedef int (*bcache_write_fn)(void *ctx, UINT64 lba, UINT32 count, const void *buf);
+
+/* Opaque cache handle */
+struct bcache;
+
+/* Memory budget in bytes for caches created after this call.
+   0 restores the built-in default. */
+void bcache_set_budget(UINT64 bytes);
+UINT64 bcache_get_budget(void);
+
+/* Create a cache of block_size-byte blocks over a device of
+   dev_block_size-byte blocks (block_size must be a multiple of it).
+   write_fn may be NULL for read-only volumes. Returns NULL on error. */
+struct bcache *bcache_create(bcache_read_fn read_fn, bcache_write_fn write_fn,
+                             void *ctx, UINT32 block_size,
+                             UINT32 dev_block_size);
+
+/* Flush dirty blocks and free all resources */
+void bcache_destroy(struct bcache *bc);
+
+/* Get block 'blk' (in cache block units), reading it on a miss.
+   The pointer stays valid until the block is evicted or invalidated.
+   Returns NULL on I/O error. */
+UINT8 *bcache_get(struct bcache *bc, UINT64 blk);
+
+/* Mark a block returned by bcache_get as modified (written back later) */
+void bcache_mark_dirty(struct bcache *bc, UINT64 blk);
+
+/* Multi-block read/write, coherent with cached blocks.  Short runs are
+   served from and inserted into the cache; long runs go straight to
+   the device. Returns 0 on success. */
+int bcache_read(struct bcache *bc, UINT64 blk, UINT32 count, void *buf);
+int bcache_write(struct bcache *bc, UINT64 blk, UINT32 count, const void *buf);
+
+/* Limit the sequential readahead window (in blocks, 0 disables).
+   The default is the largest window the cache supports. */
+void bcache_set_readahead(struct bcache *bc, UINT32 max_blocks);
+
+/* Write all dirty blocks in ascending LBA order. Returns 0 on success. */
+int bcache_flush(struct bcache *bc);
+
+/* Drop one block / all blocks (dirty data is written first). A dirty
+   block whose write fails is kept, and EFI_DEVICE_ERROR returned. */
+EFI_STATUS bcache_invalidate(struct bcache *bc, UINT64 blk);
+EFI_STATUS bcache_invalidate_all(struct bcache *bc);
+
+/* Lookup counters (in blocks) */
+void bcache_stats(struct bcache *bc, UINT64 *hits, UINT64 *misses);
+
+#endif /* BCACHE_H */
@@ -0,0 +1,212 @@
+/*
+ * blkapi.c — Raw block devices for user programs
+ *
+ * A thin layer over disk.c that only hands out indices, so a program
+ * cannot pass the disk code a device or request it did not get from
+ * here, and that remembers what the program holds so a run that exits
+ * early (or forgets) leaves nothing in flight behind it.
+ */
+
+#include "blkapi.h"
+#include "mem.h"
+#include "fs.h"
+
+struct blk_queue {
+    struct disk_queue *q;   /* NULL = free slot */
+    int disk;
+    struct disk_io *req[DISK_QUEUE_MAX];
+};
+
+static struct disk_device s_devs[DISK_MAX_DEVICES];
+static int s_ndevs = -1;                /* -1 = not enumerated this run */
+static UINT8 s_wrote[DISK_MAX_DEVICES];
+static struct blk_queue s_queues[BLK_QUEUES];
+static void *s_bufs[BLK_BUFS];
+
+int blk_count(void) {
+    if (s_ndevs < 0)
+        s_ndevs = disk_enumerate(s_devs, DISK_MAX_DEVICES);
+    return s_ndevs;
+}
+
+static struct disk_device *blk_dev(int disk) {
+    if (disk < 0 || disk >= blk_count())
+        return NULL;
+    return &s_devs[disk];
+}
+
+/* Whether count blocks from lba lie on dev */
+static int blk_range_ok(struct disk_device *dev, UINT64 lba, UINT64 count) {
+    UINT64 nblocks = dev->size_bytes / dev->block_size;
+    return count > 0 && lba < nblocks && count <= nblocks - lba;
+}
+
+int blk_info(int disk, struct blk_info *out) {
+    struct disk_device *dev = blk_dev(disk);
+    if (!dev || !out)
+        return -1;
+    mem_set(out, 0, sizeof(*out));
+    mem_copy(out->name, dev->name, sizeof(out->name));
+    out->name[sizeof(out->name) - 1] = '\0';
+    out->size_bytes = dev->size_bytes;
+    out->block_size = dev->block_size;
+    out->io_align = dev->block_io->Media->IoAlign;
+    out->removable = dev->is_removable;
+    out->boot = dev->is_boot_device;
+    out->async = dev->block_io2 != NULL;
+    return 0;
+}
+
+int blk_read(int disk, UINT64 lba, UINT64 count, void *buf) {
+    struct disk_device *dev = blk_dev(disk);
+    if (!dev || !buf || !blk_range_ok(dev, lba, count))
+        return -1;
+    return disk_read_blocks(dev, lba, count, buf);
+}
+
+int blk_write(int disk, UINT64 lba, UINT64 count, const void *buf) {
+    struct disk_device *dev = blk_dev(disk);
+    if (!dev || !buf || !blk_range_ok(dev, lba, count))
+        return -1;
+    s_wrote[disk] = 1;
+    return disk_write_blocks(dev, lba, count, (void *)buf);
+}
+
+int blk_flush(int disk) {
+    struct disk_device *dev = blk_dev(disk);
+    return dev ? disk_flush(dev) : -1;
+}
+
+/* ---- Buffers ---- */
+
+void *blk_buf_alloc(UINTN size) {
+    if (size == 0)
+        return NULL;
+    blk_count();            /* every disk's IoAlign reaches mem_io_align() */
+    for (int i = 0; i < BLK_BUFS; i++) {
+        if (s_bufs[i])
+            continue;
+        s_bufs[i] = mem_io_get((size + 4095) & ~(UINTN)4095);
+        return s_bufs[i];
+    }
+    return NULL;
+}
+
+void blk_buf_free(void *buf) {
+    for (int i = 0; buf && i < BLK_BUFS; i++) {
+        if (s_bufs[i] == buf) {
+            mem_io_put(buf);
+            s_bufs[i] = NULL;
+            return;
+        }
+    }
+}
+
+/* ---- Queued requests ---- */
+
+static struct blk_queue *blk_queue(int queue) {
+    if (queue < 0 || queue >= BLK_QUEUES || !s_queues[queue].q)
+        return NULL;
+    return &s_queues[queue];
+}
+
+int blk_queue_open(int disk, int depth) {
+    struct disk_device *dev = blk_dev(disk);
+    if (!dev || depth < 1 || depth > DISK_QUEUE_MAX)
+        return -1;
+    for (int i = 0; i < BLK_QUEUES; i++) {
+        if (s_queues[i].q)
+            continue;
+        s_queues[i].q = disk_queue_open(dev, depth, 0);
+        if (!s_queues[i].q)
+            return -1;
+        s_queues[i].disk = disk;
+        return i;
+    }
+    return -1;
+}
+
+static int blk_submit(int queue, int write, UINT64 lba, UINT64 count,
+                      void *buf) {
+    struct blk_queue *bq = blk_queue(queue);
+    if (!bq || !buf || !blk_range_ok(&s_devs[bq->disk], lba, count))
+        return -1;
+
+    /* disk.c picks a free slot of its own; the request index is ours */
+    int r = 0;
+    while (r < DISK_QUEUE_MAX && bq->req[r])
+        r++;
+    if (r == DISK_QUEUE_MAX)
+        return -1;
+    struct disk_io *io = write
+        ? disk_submit_write(bq->q, lba, (UINTN)count, buf)
+        : disk_submit_read(bq->q, lba, (UINTN)count, buf);
+    if (!io)
+        return -1;
+    if (write)
+        s_wrote[bq->disk] = 1;
+    bq->req[r] = io;
+    return r;
+}
+
+int blk_submit_read(int queue, UINT64 lba, UINT64 count, void *buf) {
+    return blk_submit(queue, 0, lba, count, buf);
+}
+
+int blk_submit_write(int queue, UINT64 lba, UINT64 count, const void *buf) {
+    return blk_submit(queue, 1, lba, count, (void *)buf);
+}
+
+int blk_poll(int queue, int req) {
+    struct blk_queue *bq = blk_queue(queue);
+    if (!bq || req < 0 || req >= DISK_QUEUE_MAX || !bq->req[req])
+        return -1;
+    return disk_poll(bq->q, bq->req[req]);
+}
+
+int blk_wait(int queue, int req) {
+    struct blk_queue *bq = blk_queue(queue);
+    if (!bq || req < 0 || req >= DISK_QUEUE_MAX || !bq->req[req])
+        return -1;
+    int ret = disk_wait(bq->q, bq->req[req]);
+    bq->req[req] = NULL;
+    return ret;
+}
+
+int blk_queue_close(int queue) {
+    struct blk_queue *bq = blk_queue(queue);
+    if (!bq)
+        return -1;
+    int ret = disk_queue_close(bq->q);
+    mem_set(bq, 0, sizeof(*bq));
+    return ret;
+}
+
+void blk_keep_buffers(void) {
+    for (int i = 0; i < BLK_BUFS; i++)
+        s_bufs[i] = NULL;
+}
+
+void blk_release(void) {
+    for (int i = 0; i < BLK_QUEUES; i++)
+        if (s_queues[i].q)
+            blk_queue_close(i);
+    for (int i = 0; i < BLK_BUFS; i++) {
+        if (s_bufs[i])
+            mem_io_put(s_bufs[i]);
+        s_bufs[i] = NULL;
+    }
+
+    /* Cached lookups may describe what the program overwrote */
+    int wrote = 0;
+    for (int i = 0; i < DISK_MAX_DEVICES; i++) {
+        if (s_wrote[i] && i < s_ndevs) {
+            disk_flush(&s_devs[i]);
+            wrote = 1;
+        }
+        s_wrote[i] = 0;
+    }
+    if (wrote)
+        fs_cache_invalidate();
+    s_ndevs = -1;
+}
@@ -0,0 +1,85 @@
+/*
+ * blkapi.h — Raw block devices for user programs
+ *
+ * What F5 programs get instead of struct disk_device: disks by index,
+ * synchronous and queued block transfers straight into the caller's
+ * buffers, and buffers aligned for every device's IoAlign. Writes to
+ * the boot device are refused the way disk_write_blocks() refuses them.
+ * Everything a program leaves open (queues, requests in flight,
+ * buffers, queued writes) is finished and released by blk_release()
+ * when it returns. src/user-headers/survival.h mirrors these.
+ */
+#ifndef BLKAPI_H
+#define BLKAPI_H
+
+#include "boot.h"
+#include "disk.h"
+
+#define BLK_QUEUES  4       /* queues open at once per program */
+#define BLK_BUFS    64      /* blk_buf_alloc() buffers held at once */
+
+struct blk_info {
+    char   name[64];
+    UINT64 size_bytes;
+    UINT32 block_size;
+    UINT32 io_align;        /* what the device asks for; buffers meet it */
+    INT32  removable;
+    INT32  boot;            /* the boot device: writes are refused */
+    INT32  async;           /* BlockIO2: queued requests overlap */
+    INT32  pad;
+};
+
+/* Disks found (whole devices, as the browser lists them). The first
+   call of a run enumerates; later ones return the same list. */
+int blk_count(void);
+
+/* Describe disk. Returns 0, or -1 for a bad index. */
+int blk_info(int disk, struct blk_info *out);
+
+/* count blocks from lba. The range must lie on the disk. Reads see
+   earlier blk_write() data; writes of a few blocks are queued until
+   blk_flush(). Returns 0 on success, -1 on error or a refused write. */
+int blk_read(int disk, UINT64 lba, UINT64 count, void *buf);
+int blk_write(int disk, UINT64 lba, UINT64 count, const void *buf);
+
+/* Write out queued blocks and flush the device. Returns 0 on success. */
+int blk_flush(int disk);
+
+/* A buffer aligned for every disk (blk_read() and the queues use it
+   without staging), size rounded up to 4 KB; NULL if out of memory */
+void *blk_buf_alloc(UINTN size);
+void blk_buf_free(void *buf);
+
+/* ---- Queued requests ----
+ * Up to depth transfers in flight on one disk (see disk_queue_open()).
+ * Queues and requests are small integers; submit returns the request,
+ * which stays busy until blk_wait(). */
+
+/* Open a queue on disk of depth 1..DISK_QUEUE_MAX. Returns it, or -1. */
+int blk_queue_open(int disk, int depth);
+
+/* Start a transfer; buf must stay valid until the request is waited
+   for. Returns the request, or -1 if the range is off the disk, a
+   write targets the boot device, the queue is full or it failed. */
+int blk_submit_read(int queue, UINT64 lba, UINT64 count, void *buf);
+int blk_submit_write(int queue, UINT64 lba, UINT64 count, const void *buf);
+
+/* 1 if the request has finished, 0 if not, -1 if it is not busy */
+int blk_poll(int queue, int req);
+
+/* Wait for a request and release it. Returns 0 if it succeeded. */
+int blk_wait(int queue, int req);
+
+/* Wait for everything outstanding and close the queue. Returns 0 if
+   every request succeeded. */
+int blk_queue_close(int queue);
+
+/* Close what the program left open, flush disks it wrote and forget
+   the disk list. Called after every run. */
+void blk_release(void);
+
+/* Before blk_release(), for a program still running on another core
+   (aprun.h): its buffers stay allocated, never given back */
+void blk_keep_buffers(void);
+
+#endif /* BLKAPI_H */
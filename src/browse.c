@@ -3,21 +3,58 @@
 #include "fs.h"
 #include "fb.h"
 #include "kbd.h"
+#include "event.h"
 #include "mem.h"
 #include "iso.h"
 #include "disk.h"
 #include "fat32.h"
+#include "exfat.h"
+#include "dirsort.h"
+#include "copy.h"
+#include "progress.h"
+#include "diskbench.h"
+#include "memtest.h"
+#include "hexview.h"
+#include "defrag.h"
+#include "image.h"
+#include "diskclone.h"
+#include "net.h"
+#include "fetch.h"
+#include "nbd.h"
+#include "search.h"
+#include "grep.h"
+#include "du.h"
+#include "archive.h"
+#include "undelete.h"
+#include "fsck.h"
+#include "preview.h"
+#include "efiapp.h"
+#include "shim.h"
+#include "timer.h"
+#include "trace.h"
 
-#define MAX_ENTRIES  FS_MAX_ENTRIES
 #define MAX_PATH     512
 
-/* Browser state */
-static struct fs_entry s_entries[MAX_ENTRIES];
+/* Entries expanded around the visible rows (window) and kept beyond
+   them on either side (margin) */
+#define WIN_ENTRIES  256
+#define WIN_MARGIN   32
+
+/* Browser state. The listing is kept compact; only a window of rows
+   around the visible ones is expanded into fs_entry records. */
+static struct dirlist s_list;
+static struct fs_entry s_win[WIN_ENTRIES];
+static int s_win_start;
+static int s_win_len;
 static int s_count;
 static int s_cursor;
 static int s_scroll;
 static CHAR16 s_path[MAX_PATH];
 
+/* TAB: directory totals (du.h) off, shown, or shown and sorted on */
+enum { DU_OFF, DU_SHOW, DU_SORT };
+static int s_du_mode;
+
 /* USB browsing state */
 static int s_on_usb;                                /* browsing a USB volume? */
 static int s_usb_vol_idx;                            /* which USB volume */
@@ -30,11 +67,30 @@ static struct disk_device s_disk_devs[DISK_MAX_DEVICES];
 static int s_disk_count;
 static int s_disk_start_idx;
 
-/* Custom volume state (exFAT/NTFS) */
+/* Custom volume state (exFAT/NTFS/FAT32/ISO 9660) */
 static struct fs_custom_volume s_custom_vols[8];
 static int s_custom_count;
 static int s_custom_start_idx;
-static int s_on_custom;           /* browsing exFAT or NTFS volume? */
+static int s_on_custom;           /* browsing exFAT/NTFS/FAT32 volume? */
+static EFI_HANDLE s_custom_cur_handle; /* BlockIO handle of that volume */
+
+/* Inside a disk image opened with ENTER (fs_mount_image()), browsed
+   as a read-only custom volume; the state it was opened from comes
+   back when it is left */
+static int s_in_image;
+static CHAR16 s_image_path[MAX_PATH];   /* the image on its volume */
+static int s_image_part;                /* fs_image_partitions() index */
+static CHAR16 s_image_dir[MAX_PATH];
+static char s_image_name[128];
+static enum fs_vol_type s_image_host_type;
+static EFI_HANDLE s_image_host_handle;  /* as cur_vol_id() gave them */
+static int s_image_on_custom, s_image_on_usb;
+static EFI_HANDLE s_image_custom_handle;
+
+/* The USB, custom and raw device tables are a cache: they stay valid
+   while the media signature matches and nothing rewrote a device */
+static UINT64 s_vols_sig;
+static int s_vols_valid;
 
 /* Close USB volume root handles to avoid UEFI handle leaks */
 static void close_usb_handles(void) {
@@ -46,13 +102,43 @@ static void close_usb_handles(void) {
     }
 }
 
-/* Copy/paste state */
+/* Copy/paste state: the copied entry and the volume it lives on
+   (handle NULL = boot volume), reopened at paste time */
 static CHAR16 s_copy_src[MAX_PATH];
 static char s_copy_name[128];
+static int s_copy_is_dir;
+static enum fs_vol_type s_copy_vol_type;
+static EFI_HANDLE s_copy_vol_handle;
+static CHAR16 s_copy_image[MAX_PATH];   /* copied inside this image on it */
+static int s_copy_image_part;
+
+/* F3 on a [DISK] or [USB] entry copies the device: F8 saves an image
+   of it (s_copy_name is then the image file's name) */
+static int s_copy_is_disk;
+static struct disk_device s_copy_disk;
+
+/* Every entry F3 copied, all from s_copy_dir: the marked ones, or the
+   one at the cursor. F8 pastes more than one as a batch, M moves them. */
+static struct dirlist s_copy_list;
+static CHAR16 s_copy_dir[MAX_PATH];
+
+/* Marked entries (SPACE, =, +, -, *): a flag per directory entry,
+   dropped whenever the listing is read again or reordered */
+static UINT8 *s_marks;
+static int s_marks_cap;
+static int s_mark_count;
+static UINT64 s_mark_bytes;             /* of the marked files */
+static int s_mark_anchor = -1;          /* last toggled, for = */
+
+/* Outcome of a batch operation, shown on the status bar until the
+   next key */
+static char s_note[128];
 
 /* Layout constants (computed from g_boot.cols/rows) */
 static UINT32 s_list_top;     /* first row of file list */
 static UINT32 s_list_rows;    /* number of visible rows */
+static UINT32 s_list_cols;    /* columns left of the preview */
+static int s_preview;         /* V: preview pane shown */
 
 /* ---- ISO detection ---- */
 
@@ -72,34 +158,54 @@ static int is_iso_file(const char *name) {
     return 1;
 }
 
-/* ---- Helpers ---- */
+/* Case-insensitive IMAGE_EXT check */
+static int is_image_file(const char *name) {
+    const char *ext = IMAGE_EXT;
+    int len = 0, n = 0;
+    while (name[len]) len++;
+    while (ext[n]) n++;
+    if (len <= n) return 0;
+    for (int i = 0; i < n; i++) {
+        char c = name[len - n + i];
+        if (c >= 'a' && c <= 'z') c -= 32;
+        if (c != ext[i]) return 0;
+    }
+    return 1;
+}
 
-static void uint_to_str(UINT64 n, char *buf) {
-    char tmp[24];
-    int t = 0;
-    if (n == 0) { tmp[t++] = '0'; }
-    else { while (n > 0) { tmp[t++] = '0' + (n % 10); n /= 10; } }
-    int i = 0;
-    while (t > 0) buf[i++] = tmp[--t];
-    buf[i] = '\0';
-}
-
-static void format_size(UINT64 size, char *buf) {
-    if (size < 1024) {
-        uint_to_str(size, buf);
-        UINTN len = str_len((CHAR8 *)buf);
-        buf[len] = ' '; buf[len+1] = 'B'; buf[len+2] = '\0';
-    } else if (size < 1048576) {
-        uint_to_str(size / 1024, buf);
-        UINTN len = str_len((CHAR8 *)buf);
-        buf[len] = ' '; buf[len+1] = 'K'; buf[len+2] = 'B'; buf[len+3] = '\0';
-    } else {
-        uint_to_str(size / 1048576, buf);
-        UINTN len = str_len((CHAR8 *)buf);
-        buf[len] = ' '; buf[len+1] = 'M'; buf[len+2] = 'B'; buf[len+3] = '\0';
+/* Raw disk or partition images and fixed VHDs, mounted with ENTER */
+static int is_disk_image_file(const char *name) {
+    static const char *exts[] = { ".IMG", ".RAW", ".VHD" };
+    int len = 0;
+    while (name[len]) len++;
+    for (int e = 0; e < 3; e++) {
+        if (len <= 4) return 0;
+        int i = 0;
+        for (; i < 4; i++) {
+            char c = name[len - 4 + i];
+            if (c >= 'a' && c <= 'z') c -= 32;
+            if (c != exts[e][i]) break;
+        }
+        if (i == 4) return 1;
+    }
+    return 0;
+}
+
+/* EFI applications, started with ENTER */
+static int is_efi_file(const char *name) {
+    int len = 0;
+    while (name[len]) len++;
+    if (len <= 4) return 0;
+    for (int i = 0; i < 4; i++) {
+        char c = name[len - 4 + i];
+        if (c >= 'a' && c <= 'z') c -= 32;
+        if (c != ".EFI"[i]) return 0;
     }
+    return 1;
 }
 
+/* ---- Helpers ---- */
+
 /* Convert CHAR16 path to ASCII for display */
 static void path_to_ascii(char *dst, int max) {
     int i = 0;
@@ -144,6 +250,18 @@ static void path_append(const char *name) {
     s_path[i] = 0;
 }
 
+/* ASCII path of a listed name, as du.h takes it */
+static void path_of_name(const char *name, char *out, int max) {
+    int i = 0;
+    while (s_path[i] && i < max - 1) {
+        out[i] = (char)(s_path[i] & 0x7F);
+        i++;
+    }
+    if (i > 1 && i < max - 1) out[i++] = '\\';
+    while (*name && i < max - 1) out[i++] = *name++;
+    out[i] = '\0';
+}
+
 static void path_up(void) {
     int i = 0;
     while (s_path[i]) i++;
@@ -156,6 +274,82 @@ static void path_up(void) {
         s_path[i] = 0;
 }
 
+/* ---- Listing window ---- */
+
+/* Entry idx (0 <= idx < s_count), valid until an entry outside the
+   current window is requested or the directory is reloaded */
+static struct fs_entry *entry_at(int idx) {
+    if (idx < s_win_start || idx >= s_win_start + s_win_len) {
+        /* Cover the visible rows plus a margin, so scrolling refills
+           the window only every so often */
+        int start = idx - WIN_MARGIN;
+        if (idx >= s_scroll && idx < s_scroll + (int)s_list_rows)
+            start = s_scroll - WIN_MARGIN;
+        if (start > s_count - WIN_ENTRIES) start = s_count - WIN_ENTRIES;
+        if (start < 0) start = 0;
+        int len = s_count - start;
+        if (len > WIN_ENTRIES) len = WIN_ENTRIES;
+        for (int i = 0; i < len; i++)
+            dirlist_get(&s_list, start + i, &s_win[i]);
+        s_win_start = start;
+        s_win_len = len;
+    }
+    return &s_win[idx - s_win_start];
+}
+
+/* ---- Marks ---- */
+
+static int is_marked(int idx) {
+    return idx >= 0 && idx < s_real_count && idx < s_marks_cap && s_marks[idx];
+}
+
+static void marks_clear(void) {
+    if (s_marks) mem_set(s_marks, 0, (UINTN)s_marks_cap);
+    s_mark_count = 0;
+    s_mark_bytes = 0;
+    s_mark_anchor = -1;
+}
+
+/* Mark or unmark directory entry idx. Returns 0, or -1 out of memory. */
+static int mark_set(int idx, int on) {
+    if (idx < 0 || idx >= s_real_count) return 0;
+    if (idx >= s_marks_cap) {
+        int cap = s_marks_cap ? s_marks_cap : 256;
+        while (cap < s_real_count) cap *= 2;
+        UINT8 *m = (UINT8 *)mem_alloc((UINTN)cap);
+        if (!m) return -1;
+        mem_set(m, 0, (UINTN)cap);
+        if (s_marks) {
+            mem_copy(m, s_marks, (UINTN)s_marks_cap);
+            mem_free(s_marks);
+        }
+        s_marks = m;
+        s_marks_cap = cap;
+    }
+    if (!s_marks[idx] == !on) return 0;
+    s_marks[idx] = on ? 1 : 0;
+    const struct dirlist_rec *r = &s_list.recs[idx];
+    s_mark_count += on ? 1 : -1;
+    if (!r->is_dir) {
+        if (on) s_mark_bytes += r->size;
+        else s_mark_bytes -= r->size;
+    }
+    return 0;
+}
+
+/* The marked entries, or else the one at the cursor, into out (its
+   sizes those of the files). Returns the count, -1 out of memory. */
+static int marked_items(struct dirlist *out) {
+    for (int i = 0; i < s_real_count; i++) {
+        if (s_mark_count > 0 ? !is_marked(i) : i != s_cursor) continue;
+        const struct dirlist_rec *r = &s_list.recs[i];
+        if (dirlist_add(out, dirlist_name(&s_list, i), r->is_dir ? 0 : r->size,
+                        r->mtime, r->is_dir) != 0)
+            return -1;
+    }
+    return out->count;
+}
+
 /* ---- Drawing ---- */
 
 static void draw_header(void) {
@@ -183,10 +377,18 @@ static void draw_path(void) {
     if (s_on_custom) {
         enum fs_vol_type vt = fs_get_vol_type();
         const char *tag = (vt == FS_VOL_NTFS) ? "[NTFS] " :
-                          (vt == FS_VOL_EXFAT) ? "[exFAT] " : "[USB] ";
+                          (vt == FS_VOL_EXFAT) ? "[exFAT] " :
+                          (vt == FS_VOL_FAT32) ? "[FAT32] " :
+                          (vt == FS_VOL_ISO) ? "[ISO] " :
+                          (vt == FS_VOL_RAM) ? "[RAM] " : "[USB] ";
         int k = 0;
         while (tag[k] && i < (int)g_boot.cols)
             line[i++] = tag[k++];
+        /* An image shows as name.img:\path */
+        for (k = 0; s_in_image && s_image_name[k] && i < (int)g_boot.cols - 1; k++)
+            line[i++] = s_image_name[k];
+        if (s_in_image)
+            line[i++] = ':';
     } else if (s_on_usb) {
         const char *tag = "[USB] ";
         int k = 0;
@@ -209,7 +411,9 @@ static void draw_col_headers(void) {
     mem_set(line, ' ', g_boot.cols);
     line[g_boot.cols] = '\0';
 
-    const char *hdr = " Name                                    Size";
+    const char *hdr = s_du_mode == DU_SORT
+                      ? " Name                                    Size (largest first)"
+                      : " Name                                    Size";
     int i = 0;
     while (hdr[i] && i < (int)g_boot.cols) {
         line[i] = hdr[i];
@@ -224,11 +428,23 @@ static void draw_status_msg(const char *msg) {
     mem_set(line, ' ', g_boot.cols);
     line[g_boot.cols] = '\0';
 
+    char marks[192];
+    if (!msg && s_note[0]) {
+        msg = s_note;
+    } else if (!msg && s_mark_count > 0) {
+        char sz[32];
+        progress_size(s_mark_bytes, sz, sizeof(sz));
+        snprintf(marks, sizeof(marks),
+                 " %d marked, %s  F3:Copy DEL:Delete SPACE:Mark =:Range +/-:Pattern *:Invert ESC:Unmark",
+                 s_mark_count, sz);
+        msg = marks;
+    }
     if (!msg) {
-        /* Show F10:WriteISO when cursor is on a .iso file */
+        /* Show F10:Write when cursor is on a .iso file or disk image */
         int on_iso = (s_count > 0 && s_cursor < s_count
-                      && !s_entries[s_cursor].is_dir
-                      && is_iso_file(s_entries[s_cursor].name));
+                      && !entry_at(s_cursor)->is_dir
+                      && (is_iso_file(entry_at(s_cursor)->name)
+                          || is_image_file(entry_at(s_cursor)->name)));
         int on_disk = (!s_on_usb && !s_on_custom && s_disk_count > 0
                        && s_cursor >= s_disk_start_idx
                        && s_cursor < s_disk_start_idx + s_disk_count);
@@ -239,31 +455,33 @@ static void draw_status_msg(const char *msg) {
                                && s_cursor >= s_custom_start_idx
                                && s_cursor < s_custom_start_idx + s_custom_count);
         if (on_disk) {
-            msg = " ENTER:Format F11:Format                           BS:Back ESC:Exit";
+            msg = " ENTER:Format F3:Image F6:Fetch F7:Bench F9:Export F11:Format X:Hex BS:Back";
         } else if (on_custom_entry) {
             msg = " ENTER:Open                                        BS:Back ESC:Exit";
         } else if (on_usb_entry) {
-            msg = " ENTER:Open F11:Format                             BS:Back ESC:Exit";
+            msg = " ENTER:Open F3:Image F6:Fetch F7:Bench F9:Export F11:Format X:Hex BS:Back";
         } else if (s_on_custom && fs_is_read_only()) {
             if (on_iso)
-                msg = " ENTER:Open F3:Copy F10:WriteISO               BS:Back";
+                msg = " ENTER:Open F3:Copy F10:Write                  BS:Back";
+            else if (fs_volume_ntfs(fs_volume_current()))
+                msg = " ENTER:Open F3:Copy /:Find ?:Grep U:Undelete X:Hex V:Preview TAB:Sizes BS:Back";
             else
-                msg = " ENTER:Open F3:Copy                            BS:Back";
+                msg = " ENTER:Open F3:Copy /:Find ?:Grep C:Check D:Defrag X:Hex V:Preview TAB:Sizes BS:Back";
         } else if (s_on_custom) {
             if (on_iso)
-                msg = " ENTER:Open F3:Copy F10:WriteISO               BS:Back";
+                msg = " ENTER:Open F3:Copy F10:Write                  BS:Back";
             else
-                msg = " ENTER:Open F3:Copy F4:New F8:Paste F9:Rename  BS:Back";
+                msg = " ENTER:Open F3:Copy F4:New F6:Fetch F8:Paste M:Move DEL:Delete SPACE:Mark P:Pack F9:Rename /:Find ?:Grep C:Check D:Defrag X:Hex V:Preview TAB:Sizes BS:Back";
         } else if (s_on_usb) {
             if (on_iso)
-                msg = " ENTER:Open F3:Copy F10:WriteISO F12:Clone BS:Back";
+                msg = " ENTER:Open F3:Copy F10:Write F12:Clone BS:Back";
             else
-                msg = " ENTER:Open F3:Copy F4:New F8:Paste F9:Rename F12:Clone BS:Back";
+                msg = " ENTER:Open F3:Copy F4:New F6:Fetch F8:Paste M:Move DEL:Delete SPACE:Mark P:Pack F9:Rename F12:Clone /:Find ?:Grep X:Hex V:Preview TAB:Sizes BS:Back";
         } else {
             if (on_iso)
-                msg = " ENTER:Open F3:Copy F10:WriteISO BS:Back ESC:Exit";
+                msg = " ENTER:Open F3:Copy F10:Write BS:Back ESC:Exit";
             else
-                msg = " ENTER:Open F3:Copy F4:New F8:Paste F9:Rename BS:Back ESC:Exit";
+                msg = " ENTER:Open F2:Mem F3:Copy F4:New F5:Rescan F6:Fetch F8:Paste M:Move DEL:Delete SPACE:Mark P:Pack F9:Rename /:Find ?:Grep X:Hex V:Preview TAB:Sizes BS:Back ESC:Exit";
         }
     }
 
@@ -274,48 +492,73 @@ static void draw_status_msg(const char *msg) {
     }
 
     fb_string(0, g_boot.rows - 1, line, COLOR_GRAY, COLOR_DGRAY);
+    /* Often shown just before a long operation */
+    fb_present();
 }
 
 static void draw_status(void) {
     draw_status_msg(NULL);
 }
 
+static int probe_pending(void);
+
 static void draw_entry_line(int list_idx) {
     int entry_idx = s_scroll + list_idx;
     UINT32 row = s_list_top + (UINT32)list_idx;
     char line[256];
 
-    mem_set(line, ' ', g_boot.cols);
-    line[g_boot.cols] = '\0';
+    mem_set(line, ' ', s_list_cols);
+    line[s_list_cols] = '\0';
 
     if (entry_idx >= s_count) {
-        /* Empty line */
-        fb_string(0, row, line, COLOR_WHITE, COLOR_BLACK);
+        /* Empty line, or the one after the volumes found so far */
+        if (entry_idx == s_count && probe_pending()) {
+            const char *msg = "probing devices...";
+            for (int k = 0; msg[k] && k + 1 < (int)s_list_cols; k++)
+                line[k + 1] = msg[k];
+        }
+        fb_string(0, row, line, COLOR_GRAY, COLOR_BLACK);
         return;
     }
 
-    struct fs_entry *e = &s_entries[entry_idx];
+    struct fs_entry *e = entry_at(entry_idx);
     int pos = 1;  /* start at column 1 for padding */
+    int marked = is_marked(entry_idx);
+    if (marked) line[0] = '*';
 
     if (e->is_dir) {
         const char *dir_tag = "[DIR] ";
         int k = 0;
-        while (dir_tag[k] && pos < (int)g_boot.cols)
+        while (dir_tag[k] && pos < (int)s_list_cols)
             line[pos++] = dir_tag[k++];
     }
 
     /* Name */
     int k = 0;
-    int name_limit = (int)g_boot.cols - 15;  /* leave room for size column */
+    int name_limit = (int)s_list_cols - 15;  /* leave room for size column */
     while (e->name[k] && pos < name_limit)
         line[pos++] = e->name[k++];
 
-    /* Size (right-aligned area, skip for directories) */
+    /* Size (right-aligned area; directories once du has a total) */
+    char size_str[24];
+    size_str[0] = '\0';
     if (!e->is_dir) {
-        char size_str[24];
-        format_size(e->size, size_str);
+        progress_size(e->size, size_str, sizeof(size_str));
+    } else if (s_du_mode != DU_OFF && entry_idx < s_real_count) {
+        char path[DU_PATH_MAX];
+        UINT64 bytes;
+        path_of_name(e->name, path, DU_PATH_MAX);
+        int r = du_lookup(path, &bytes);
+        if (r < 0) {
+            str_copy(size_str, "...", sizeof(size_str));
+        } else {
+            progress_size(bytes, size_str, sizeof(size_str));
+            if (r == 0) str_copy(size_str + str_len((CHAR8 *)size_str), "+", 2);
+        }
+    }
+    if (size_str[0]) {
         UINTN slen = str_len((CHAR8 *)size_str);
-        int size_col = (int)g_boot.cols - (int)slen - 2;
+        int size_col = (int)s_list_cols - (int)slen - 2;
         if (size_col > pos) {
             for (UINTN s = 0; s < slen; s++)
                 line[size_col + (int)s] = size_str[s];
@@ -335,13 +578,18 @@ static void draw_entry_line(int list_idx) {
     if (entry_idx == s_cursor) {
         fg = COLOR_BLACK;
         bg = COLOR_CYAN;
+    } else if (marked) {
+        fg = COLOR_YELLOW;
+        bg = COLOR_BLACK;
     } else if (is_disk_entry) {
         fg = COLOR_RED;
         bg = COLOR_BLACK;
     } else if (is_custom_entry) {
-        /* Color by volume type: orange for exFAT, magenta for NTFS */
+        /* Color by volume type: orange for exFAT/FAT32, magenta for the
+           read-only NTFS and ISO 9660 */
         int ci = entry_idx - s_custom_start_idx;
-        fg = (s_custom_vols[ci].type == FS_VOL_NTFS) ? COLOR_MAGENTA : COLOR_ORANGE;
+        fg = (s_custom_vols[ci].type == FS_VOL_NTFS ||
+              s_custom_vols[ci].type == FS_VOL_ISO) ? COLOR_MAGENTA : COLOR_ORANGE;
         bg = COLOR_BLACK;
     } else if (is_usb_entry) {
         fg = COLOR_ORANGE;
@@ -362,142 +610,276 @@ static void draw_list(void) {
         draw_entry_line((int)i);
 }
 
+/* The listing's width, and the preview pane right of it */
+static void set_layout(void) {
+    s_list_cols = s_preview ? g_boot.cols / 2 : g_boot.cols;
+    preview_layout(s_list_cols + 1, s_list_top,
+                   g_boot.cols - s_list_cols - 1, s_list_rows);
+}
+
+static void draw_preview(void) {
+    for (UINT32 i = 0; i < s_list_rows; i++)
+        fb_char(s_list_cols, s_list_top + i, '|', COLOR_DGRAY, COLOR_BLACK);
+    preview_draw();
+}
+
 static void draw_all(void) {
     fb_clear(COLOR_BLACK);
     draw_header();
     draw_path();
     draw_col_headers();
     draw_list();
+    if (s_preview) draw_preview();
     draw_status();
 }
 
 /* ---- Directory loading ---- */
 
-static void load_dir(void) {
-    s_count = fs_readdir(s_path, s_entries, MAX_ENTRIES);
-    if (s_count < 0) s_count = 0;
-    s_real_count = s_count;
+/* ---- Volume probing ----
+ * The USB, exFAT/NTFS/FAT32 and raw device tables fill in one device
+ * per step between key presses (wait_key), so the browser answers at
+ * once however slow the attached media are: a step reads at most one
+ * device's first sectors. Probing only advances while the boot volume
+ * root is listed, the one place its results show; load_dir restarts it
+ * when the media signature changes or after an operation that rewrote
+ * a device. */
+
+enum { PROBE_DONE, PROBE_USB_LIST, PROBE_USB, PROBE_CUSTOM,
+       PROBE_DISK_LIST, PROBE_DISK };
+
+static struct {
+    int stage;
+    int next;                                   /* in usb[] or devs[] */
+    struct fs_usb_volume usb[FS_MAX_USB];       /* not yet validated */
+    int nusb;
+    struct fs_volume_scan scan;
+    struct disk_device devs[DISK_MAX_DEVICES];
+    int ndevs;
+    EFI_HANDLE claimed[FS_MAX_USB + 8];
+    int nclaimed;
+} s_probe;
 
-    /* Append USB volume entries at boot volume root */
-    if (!s_on_usb && !s_on_custom && path_is_root()) {
-        close_usb_handles();  /* close any previously opened USB handles */
-        s_usb_count = fs_enumerate_usb(s_usb_vols, FS_MAX_USB);
-
-        /* Validate each USB volume — remove those with destroyed FAT32.
-           UEFI caches SFS protocol, so a device whose FAT32 was overwritten
-           (e.g. by an ISO write) may still appear as a valid volume. */
-        for (int i = 0; i < s_usb_count; ) {
-            if (!fs_has_valid_fat32(s_usb_vols[i].handle)) {
-                if (s_usb_vols[i].root) {
-                    s_usb_vols[i].root->Close(s_usb_vols[i].root);
-                    s_usb_vols[i].root = NULL;
-                }
-                for (int j = i; j < s_usb_count - 1; j++)
-                    s_usb_vols[j] = s_usb_vols[j + 1];
-                s_usb_count--;
-            } else {
-                i++;
-            }
+static struct ev_handler s_probe_idle;
+
+static int at_boot_root(void) {
+    return !s_on_usb && !s_on_custom && path_is_root();
+}
+
+/* Probing still to do and listed here to show it */
+static int probe_pending(void) {
+    return s_probe.stage != PROBE_DONE && at_boot_root();
+}
+
+/* Abandon a probe in progress, closing what it holds */
+static void probe_stop(void) {
+    if (s_probe.stage == PROBE_USB) {
+        for (int i = s_probe.next; i < s_probe.nusb; i++)
+            if (s_probe.usb[i].root)
+                s_probe.usb[i].root->Close(s_probe.usb[i].root);
+    } else if (s_probe.stage == PROBE_CUSTOM) {
+        fs_scan_end(&s_probe.scan);
+    }
+    s_probe.stage = PROBE_DONE;
+}
+
+/* Empty the volume tables and probe them afresh from the next wait_key */
+static void probe_start(UINT64 sig) {
+    probe_stop();
+    close_usb_handles();  /* close any previously opened USB handles */
+    s_usb_count = 0;
+    s_custom_count = 0;
+    s_disk_count = 0;
+    s_probe.stage = PROBE_USB_LIST;
+    s_vols_sig = sig;
+    s_vols_valid = 1;
+}
+
+/* One probe step. Returns 1 if the volume tables changed. */
+static int probe_step(void) {
+    switch (s_probe.stage) {
+    case PROBE_USB_LIST:
+        s_probe.nusb = fs_enumerate_usb(s_probe.usb, FS_MAX_USB);
+        s_probe.next = 0;
+        s_probe.stage = PROBE_USB;
+        return 0;
+
+    case PROBE_USB: {
+        if (s_probe.next >= s_probe.nusb) {
+            fs_scan_begin(&s_probe.scan);
+            s_probe.stage = PROBE_CUSTOM;
+            return 0;
         }
+        /* Validate each USB volume — drop those with destroyed FAT32.
+           UEFI caches SFS protocol, so a device whose FAT32 was
+           overwritten (e.g. by an ISO write) may still appear as a
+           valid volume. */
+        struct fs_usb_volume *u = &s_probe.usb[s_probe.next++];
+        if (fs_has_valid_fat32(u->handle)) {
+            s_usb_vols[s_usb_count++] = *u;
+            return 1;
+        }
+        if (u->root)
+            u->root->Close(u->root);
+        return 0;
+    }
 
-        for (int i = 0; i < s_usb_count && s_count < MAX_ENTRIES; i++) {
-            struct fs_entry *e = &s_entries[s_count];
-            /* Build "[USB] label" display name */
-            int pos = 0;
-            const char *tag = "[USB] ";
-            while (tag[pos] && pos < FS_MAX_NAME - 2)
-                e->name[pos] = tag[pos], pos++;
-            int j = 0;
-            while (s_usb_vols[i].label[j] && pos < FS_MAX_NAME - 1)
-                e->name[pos++] = s_usb_vols[i].label[j++];
-            e->name[pos] = '\0';
-            e->size = 0;
-            e->is_dir = 1;
-            s_count++;
+    case PROBE_CUSTOM: {
+        int r = -1;
+        if (s_custom_count < 8)
+            r = fs_scan_next(&s_probe.scan, &s_custom_vols[s_custom_count]);
+        if (r > 0) {
+            s_custom_count++;
+            return 1;
+        }
+        if (r < 0) {
+            fs_scan_end(&s_probe.scan);
+            s_probe.stage = PROBE_DISK_LIST;
         }
+        return 0;
+    }
 
-        /* Enumerate exFAT/NTFS volumes */
-        s_custom_count = 0;
-        s_custom_start_idx = s_count;
-        s_custom_count = fs_enumerate_custom_volumes(s_custom_vols, 8);
-
-        for (int i = 0; i < s_custom_count && s_count < MAX_ENTRIES; i++) {
-            struct fs_entry *e = &s_entries[s_count];
-            int pos = 0;
-            const char *tag = (s_custom_vols[i].type == FS_VOL_NTFS)
-                              ? "[NTFS] " : "[exFAT] ";
-            while (*tag && pos < FS_MAX_NAME - 2)
-                e->name[pos++] = *tag++;
-            int j = 0;
-            while (s_custom_vols[i].label[j] && pos < FS_MAX_NAME - 1)
-                e->name[pos++] = s_custom_vols[i].label[j++];
-            e->name[pos] = '\0';
-            e->size = s_custom_vols[i].size_bytes;
-            e->is_dir = 1;
-            s_count++;
+    case PROBE_DISK_LIST:
+        /* disk_enumerate returns whole-disk handles, but USB/exFAT/NTFS
+         * volumes are partition handles. Collect all claimed partition
+         * handles so any whole disk that contains an already-listed
+         * partition is skipped (device path prefix matching). */
+        s_probe.ndevs = disk_enumerate(s_probe.devs, DISK_MAX_DEVICES);
+        s_probe.nclaimed = 0;
+        for (int i = 0; i < s_usb_count; i++)
+            s_probe.claimed[s_probe.nclaimed++] = s_usb_vols[i].handle;
+        for (int i = 0; i < s_custom_count; i++)
+            s_probe.claimed[s_probe.nclaimed++] = s_custom_vols[i].handle;
+        s_probe.next = 0;
+        s_probe.stage = PROBE_DISK;
+        return 0;
+
+    case PROBE_DISK: {
+        if (s_probe.next >= s_probe.ndevs) {
+            s_probe.stage = PROBE_DONE;
+            return 1;  /* drops the placeholder */
         }
+        struct disk_device *d = &s_probe.devs[s_probe.next++];
+        if (d->is_boot_device) return 0;
 
-        /* Enumerate raw block devices (no filesystem).
-         * disk_enumerate returns whole-disk handles, but USB/exFAT/NTFS
-         * volumes are partition handles. Build a list of all claimed
-         * partition handles so we can skip any whole disk that contains
-         * an already-listed partition (device path prefix matching). */
-        s_disk_count = 0;
-        s_disk_start_idx = s_count;
-        struct disk_device all_devs[DISK_MAX_DEVICES];
-        int ndevs = disk_enumerate(all_devs, DISK_MAX_DEVICES);
+        /* Skip devices that have SimpleFileSystem AND valid FAT32.
+           If SFS exists but FAT32 is invalid (stale cache), show as [DISK]. */
+        EFI_GUID sfs_guid = EFI_SIMPLE_FILE_SYSTEM_PROTOCOL_GUID;
+        void *sfs = NULL;
+        EFI_STATUS st = g_boot.bs->HandleProtocol(d->handle, &sfs_guid, &sfs);
+        if (!EFI_ERROR(st) && sfs && fs_has_valid_fat32(d->handle))
+            return 0;
 
-        /* Collect claimed partition handles: USB volumes + custom volumes */
-        EFI_HANDLE claimed[FS_MAX_USB + 8];
-        int nclaimed = 0;
-        for (int ci = 0; ci < s_usb_count && nclaimed < FS_MAX_USB + 8; ci++)
-            claimed[nclaimed++] = s_usb_vols[ci].handle;
-        for (int ci = 0; ci < s_custom_count && nclaimed < FS_MAX_USB + 8; ci++)
-            claimed[nclaimed++] = s_custom_vols[ci].handle;
+        /* Skip whole-disk devices that have a partition already
+           listed as a USB, exFAT, or NTFS volume */
+        if (disk_has_claimed_partition(d->handle, s_probe.claimed,
+                                       s_probe.nclaimed))
+            return 0;
 
-        EFI_GUID sfs_guid = EFI_SIMPLE_FILE_SYSTEM_PROTOCOL_GUID;
-        for (int i = 0; i < ndevs && s_count < MAX_ENTRIES; i++) {
-            if (all_devs[i].is_boot_device) continue;
-
-            /* Skip devices that have SimpleFileSystem AND valid FAT32.
-               If SFS exists but FAT32 is invalid (stale cache), show as [DISK]. */
-            void *sfs = NULL;
-            EFI_STATUS st = g_boot.bs->HandleProtocol(
-                all_devs[i].handle, &sfs_guid, &sfs);
-            if (!EFI_ERROR(st) && sfs && fs_has_valid_fat32(all_devs[i].handle))
-                continue;
-
-            /* Skip whole-disk devices that have a partition already
-               listed as a USB, exFAT, or NTFS volume */
-            if (disk_has_claimed_partition(all_devs[i].handle,
-                                           claimed, nclaimed))
-                continue;
-
-            /* This is a raw block device — show as [DISK] */
-            s_disk_devs[s_disk_count] = all_devs[i];
-            struct fs_entry *e = &s_entries[s_count];
-            int pos = 0;
-            const char *tag = "[DISK] ";
-            while (tag[pos] && pos < FS_MAX_NAME - 2)
-                e->name[pos] = tag[pos], pos++;
-            int j = 0;
-            while (all_devs[i].name[j] && pos < FS_MAX_NAME - 1)
-                e->name[pos++] = all_devs[i].name[j++];
-            e->name[pos] = '\0';
-            e->size = all_devs[i].size_bytes;
-            e->is_dir = 0;
+        /* This is a raw block device — show as [DISK] */
+        s_disk_devs[s_disk_count++] = *d;
+        return 1;
+    }
+    }
+    return 0;
+}
+
+/* Append a volume/device entry "<tag><label>" after the directory.
+   Returns 0 on success. */
+static int list_add_tagged(const char *tag, const char *label,
+                            UINT64 size, int is_dir) {
+    char name[FS_MAX_NAME];
+    int pos = 0;
+    while (*tag && pos < FS_MAX_NAME - 2)
+        name[pos++] = *tag++;
+    while (*label && pos < FS_MAX_NAME - 1)
+        name[pos++] = *label++;
+    name[pos] = '\0';
+    if (dirlist_add(&s_list, name, size, 0, is_dir) != 0)
+        return -1;
+    s_count++;
+    return 0;
+}
+
+/* (Re)append the volume and device entries after the directory, as
+   far as probing has found them */
+static void list_volumes(void) {
+    dirlist_truncate(&s_list, s_real_count);
+    s_count = s_real_count;
+    s_win_len = 0;
+
+    int ok = 1;
+    for (int i = 0; ok && i < s_usb_count; i++)
+        ok = list_add_tagged("[USB] ", s_usb_vols[i].label, 0, 1) == 0;
+
+    s_custom_start_idx = s_count;
+    for (int i = 0; ok && i < s_custom_count; i++) {
+        const char *tag = (s_custom_vols[i].type == FS_VOL_NTFS) ? "[NTFS] " :
+                          (s_custom_vols[i].type == FS_VOL_FAT32) ? "[FAT32] " :
+                          (s_custom_vols[i].type == FS_VOL_ISO) ? "[ISO] " :
+                          (s_custom_vols[i].type == FS_VOL_RAM) ? "[RAM] " :
+                          "[exFAT] ";
+        ok = list_add_tagged(tag, s_custom_vols[i].label,
+                             s_custom_vols[i].size_bytes, 1) == 0;
+    }
+
+    s_disk_start_idx = s_count;
+    for (int i = 0; ok && i < s_disk_count; i++)
+        ok = list_add_tagged("[DISK] ", s_disk_devs[i].name,
+                             s_disk_devs[i].size_bytes, 0) == 0;
+    /* Out of memory: entries past s_count simply do not exist, so
+       the index range checks never select an unlisted volume */
+}
+
+/* The listing as scripted runs see it: the count, then the first
+   TRACE_LIST_MAX names in screen order */
+static void trace_list(void) {
+    if (!trace_enabled()) return;
+    trace_mark("list", (UINT64)s_count, probe_pending() ? 1 : 0, NULL);
+    for (int i = 0; i < s_count && i < TRACE_LIST_MAX; i++)
+        trace_mark("item", (UINT64)i, entry_at(i)->is_dir, entry_at(i)->name);
+}
+
+static void du_list(void);
+
+static void load_dir(void) {
+    UINT64 t0 = trace_enabled() ? bench_start() : 0;
+    preview_clear();
+    dirlist_reset(&s_list);
+    s_win_len = 0;
+    s_count = 0;
+
+    /* Stream the directory into the compact list, then sort it once */
+    struct fs_dir *d = fs_opendir(s_path);
+    if (d) {
+        struct fs_entry e;
+        while (fs_readdir_next(d, &e) > 0) {
+            if (dirlist_add_entry(&s_list, &e) != 0)
+                break;  /* out of memory: show what fits */
             s_count++;
-            s_disk_count++;
         }
-    } else if (!s_on_usb && !s_on_custom) {
-        close_usb_handles();  /* close USB handles when not at root */
-        s_usb_count = 0;
-        s_custom_count = 0;
-        s_disk_count = 0;
+        fs_closedir(d);
+    }
+    dirlist_sort(&s_list, 0, s_count);
+    s_real_count = s_count;
+    trace_mark("dir", (UINT64)s_count, bench_stop(t0) / 1000, NULL);
+
+    /* Append volume and device entries at boot volume root */
+    if (at_boot_root()) {
+        UINT64 sig = fs_media_signature();
+        if (!s_vols_valid || sig != s_vols_sig)
+            probe_start(sig);
+        list_volumes();
+    } else {
+        /* No volume entries below the root */
+        s_custom_start_idx = s_count;
+        s_disk_start_idx = s_count;
     }
 
     s_cursor = 0;
     s_scroll = 0;
+    marks_clear();
+    du_list();
+    trace_list();
 }
 
 /* ---- Scroll clamping ---- */
@@ -512,34 +894,144 @@ static void clamp_scroll(void) {
         s_scroll = 0;
 }
 
+/* Idle handler: probe the next device, showing each volume found */
+static int probe_idle(void *arg) {
+    (void)arg;
+    if (!probe_pending())
+        return 0;
+    if (probe_step()) {
+        list_volumes();
+        if (s_cursor >= s_count)
+            s_cursor = s_count > 0 ? s_count - 1 : 0;
+        clamp_scroll();
+        draw_list();
+        draw_status();
+        trace_list();
+    }
+    return probe_pending();
+}
+
+/* ---- Directory totals ----
+ * With TAB on, the listed directories are queued for du.h and their
+ * totals fill in between keys. Sorted on size, the listing is sorted
+ * again as totals come in, at most every DU_DRAW_MS, keeping the cursor
+ * on its entry. */
+
+#define DU_DRAW_MS 250
+
+static struct ev_handler s_du_idle;
+static UINT64 s_du_draw;        /* timer ticks at the last redraw */
+static int s_du_found;          /* totals found since then */
+
+/* Sort the directory part of the listing again: on size, directories
+   at their totals so far, or back in name order */
+static void du_sort(int by_size) {
+    char cur[FS_MAX_NAME];
+    cur[0] = '\0';
+    if (s_cursor < s_real_count)
+        str_copy(cur, dirlist_name(&s_list, s_cursor), FS_MAX_NAME);
+    for (int i = 0; i < s_real_count; i++) {
+        struct dirlist_rec *r = &s_list.recs[i];
+        if (!r->is_dir) continue;
+        char path[DU_PATH_MAX];
+        UINT64 bytes = 0;
+        path_of_name(dirlist_name(&s_list, i), path, DU_PATH_MAX);
+        if (!by_size || du_lookup(path, &bytes) < 0) bytes = 0;
+        r->size = bytes;
+    }
+    if (by_size)
+        dirlist_sort_size(&s_list, 0, s_real_count);
+    else
+        dirlist_sort(&s_list, 0, s_real_count);
+    s_win_len = 0;
+    marks_clear();          /* they were by position */
+    for (int i = 0; cur[0] && i < s_real_count; i++) {
+        if (str_cmp((CHAR8 *)dirlist_name(&s_list, i), (CHAR8 *)cur) == 0) {
+            s_cursor = i;
+            break;
+        }
+    }
+    clamp_scroll();
+}
+
+/* Queue the listed directories; load_dir() calls it for each listing */
+static void du_list(void) {
+    du_begin();
+    if (s_du_mode == DU_OFF) return;
+    for (int i = 0; i < s_real_count; i++) {
+        if (!s_list.recs[i].is_dir) continue;
+        char path[DU_PATH_MAX];
+        path_of_name(dirlist_name(&s_list, i), path, DU_PATH_MAX);
+        if (du_queue(path) != 0) break;
+    }
+    if (s_du_mode == DU_SORT) du_sort(1);
+    s_du_found = 0;
+}
+
+/* Idle handler: walk, showing totals as they are found and the one
+   being counted as it grows */
+static int du_idle(void *arg) {
+    (void)arg;
+    int r = du_step();
+    if (r == DU_DONE) s_du_found = 1;
+    UINT64 now = timer_ticks();
+    int due = now - s_du_draw > timer_hz() / 1000 * DU_DRAW_MS;
+    if ((r == DU_IDLE && s_du_found) || (r != DU_IDLE && due)) {
+        if (s_du_found && s_du_mode == DU_SORT) du_sort(1);
+        s_du_found = 0;
+        draw_list();
+        s_du_draw = now;
+    }
+    return r != DU_IDLE;
+}
+
+/* Wait for a key, probing volumes a device at a time, reading the
+   previewed file and working out directory totals meanwhile. Only this
+   wait does any of it: prompts and the screens opened from here leave
+   the devices (and the status bar) alone. */
+static void wait_key(struct key_event *ev) {
+    if (probe_pending())
+        ev_add_idle(&s_probe_idle, EV_PRIO_NORMAL, probe_idle, NULL);
+    if (s_du_mode != DU_OFF)
+        ev_add_idle(&s_du_idle, EV_PRIO_LOW, du_idle, NULL);
+    if (s_preview)
+        preview_arm();
+    kbd_wait(ev);
+    ev_remove(&s_probe_idle);
+    ev_remove(&s_du_idle);
+    preview_disarm();
+}
+
 /* ---- Open file in editor ---- */
 
 static void open_file(void) {
-    if (s_count <= 0 || s_entries[s_cursor].is_dir)
+    if (s_count <= 0 || entry_at(s_cursor)->is_dir)
         return;
-    edit_run(s_path, s_entries[s_cursor].name);
+    edit_run(s_path, entry_at(s_cursor)->name);
 }
 
-/* ---- New file prompt ---- */
+/* ---- Prompts ---- */
 
-static void prompt_new_file(void) {
-    char name[128];
+/* Read a line of text on the status bar into out (at most max - 1
+   characters); a long one scrolls to keep its end in view. Returns 0
+   on ENTER with something typed, -1 on ESC. */
+static int prompt_line(const char *prompt, char *out, int max) {
     int len = 0;
-    name[0] = '\0';
+    out[0] = '\0';
 
-    /* Draw prompt on status bar */
     char line[256];
+    int plen = (int)str_len(prompt);
     for (;;) {
+        int room = (int)g_boot.cols - plen - 1;
+        if (room > (int)sizeof(line) - plen - 2) room = (int)sizeof(line) - plen - 2;
+        int first = len > room ? len - room : 0;
         int i = 0;
-        const char *prompt = " New filename: ";
         while (prompt[i] && i < (int)g_boot.cols) {
             line[i] = prompt[i];
             i++;
         }
-        int j = 0;
-        while (j < len && i < (int)g_boot.cols) {
-            line[i++] = name[j++];
-        }
+        for (int j = first; j < len && i < (int)g_boot.cols; j++)
+            line[i++] = out[j];
         /* Cursor */
         if (i < (int)g_boot.cols)
             line[i] = '_';
@@ -552,30 +1044,131 @@ static void prompt_new_file(void) {
         kbd_wait(&ev);
 
         if (ev.code == KEY_ESC) {
-            return;  /* cancelled */
+            return -1;  /* cancelled */
         } else if (ev.code == KEY_ENTER) {
             if (len > 0)
-                break;  /* got a name */
+                return 0;
         } else if (ev.code == KEY_BS) {
             if (len > 0) {
                 len--;
-                name[len] = '\0';
+                out[len] = '\0';
             }
-        } else if (ev.code >= 0x20 && ev.code <= 0x7E && len < 120) {
-            name[len++] = (char)ev.code;
-            name[len] = '\0';
+        } else if (ev.code >= 0x20 && ev.code <= 0x7E && len < max - 1) {
+            out[len++] = (char)ev.code;
+            out[len] = '\0';
         }
     }
+}
 
-    edit_run(s_path, name);
+static void prompt_new_file(void) {
+    char name[128];
+    if (prompt_line(" New filename: ", name, 121) == 0)
+        edit_run(s_path, name);
 }
 
 /* ---- Copy/Paste ---- */
 
+/* Identify the volume being browsed (handle NULL = boot volume); in an
+   image, the volume the image is on */
+static void cur_vol_id(enum fs_vol_type *type, EFI_HANDLE *handle) {
+    if (s_in_image) {
+        *type = s_image_host_type;
+        *handle = s_image_host_handle;
+    } else if (s_on_custom) {
+        *type = fs_get_vol_type();
+        *handle = s_custom_cur_handle;
+    } else if (s_on_usb) {
+        *type = fs_get_vol_type();
+        *handle = s_usb_vols[s_usb_vol_idx].handle;
+    } else {
+        *type = FS_VOL_SFS;
+        *handle = NULL;
+    }
+}
+
+static int find_disk_for_usb(int usb_idx, struct disk_device *out);
+
+/* F3 on a [DISK] or [USB] entry; other volume entries are ignored */
+static void copy_device(void) {
+    struct disk_device dev;
+    if (s_disk_count > 0 && s_cursor >= s_disk_start_idx
+        && s_cursor < s_disk_start_idx + s_disk_count)
+        dev = s_disk_devs[s_cursor - s_disk_start_idx];
+    else if (s_usb_count > 0 && s_cursor < s_real_count + s_usb_count
+             && find_disk_for_usb(s_cursor - s_real_count, &dev) == 0)
+        ;
+    else
+        return;
+    s_copy_disk = dev;
+    s_copy_is_disk = 1;
+    s_copy_is_dir = 0;
+    dirlist_reset(&s_copy_list);
+
+    /* Name the image after the device, in characters any volume takes */
+    int k = 0;
+    for (int i = 0; dev.name[i] && k < 80; i++) {
+        char c = dev.name[i];
+        int keep = (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z') ||
+                   (c >= '0' && c <= '9') || c == '-';
+        if (keep) s_copy_name[k++] = c;
+        else if (k > 0 && s_copy_name[k - 1] != '_') s_copy_name[k++] = '_';
+    }
+    while (k > 0 && s_copy_name[k - 1] == '_') k--;
+    if (k == 0) s_copy_name[k++] = 'D';
+    s_copy_name[k] = '\0';
+    snprintf(s_copy_name + k, sizeof(s_copy_name) - k, "%s", IMAGE_EXT);
+
+    char msg[256];
+    snprintf(msg, sizeof(msg),
+             " Copied: %s  (F8 in a directory saves an image, on a device clones it)",
+             dev.name);
+    draw_status_msg(msg);
+}
+
 static void do_copy(void) {
     if (s_count <= 0) return;
-    struct fs_entry *e = &s_entries[s_cursor];
-    if (e->is_dir) return;
+    if (!s_on_usb && !s_on_custom && path_is_root() && s_cursor >= s_real_count
+        && s_mark_count == 0) {
+        copy_device();      /* volume and device entries */
+        return;
+    }
+    dirlist_reset(&s_copy_list);
+    if (marked_items(&s_copy_list) <= 0) {
+        dirlist_reset(&s_copy_list);
+        s_copy_name[0] = '\0';
+        draw_status_msg(" Copy failed: out of memory");
+        return;
+    }
+    s_copy_is_disk = 0;
+
+    /* Remember the volume, which may not be current at paste time */
+    cur_vol_id(&s_copy_vol_type, &s_copy_vol_handle);
+    int ii = 0;
+    for (; s_in_image && s_image_path[ii] && ii < MAX_PATH - 1; ii++)
+        s_copy_image[ii] = s_image_path[ii];
+    s_copy_image[ii] = 0;
+    s_copy_image_part = s_image_part;
+    for (ii = 0; s_path[ii] && ii < MAX_PATH - 1; ii++)
+        s_copy_dir[ii] = s_path[ii];
+    s_copy_dir[ii] = 0;
+
+    char msg[256];
+    if (s_copy_list.count > 1) {
+        /* Marked entries: s_copy_src is their directory */
+        s_copy_is_dir = 1;
+        for (ii = 0; s_copy_dir[ii]; ii++) s_copy_src[ii] = s_copy_dir[ii];
+        s_copy_src[ii] = 0;
+        snprintf(s_copy_name, sizeof(s_copy_name), "%d entries", s_copy_list.count);
+        snprintf(msg, sizeof(msg), " Copied: %s  (F8 pastes them, M moves them here)",
+                 s_copy_name);
+        marks_clear();
+        draw_list();
+        draw_status_msg(msg);
+        return;
+    }
+
+    const char *name = dirlist_name(&s_copy_list, 0);
+    s_copy_is_dir = s_copy_list.recs[0].is_dir;
 
     /* Build full source path */
     int i = 0;
@@ -586,27 +1179,30 @@ static void do_copy(void) {
     if (i > 1 || s_copy_src[0] != L'\\')
         s_copy_src[i++] = L'\\';
     int j = 0;
-    while (e->name[j] && i < MAX_PATH - 1) {
-        s_copy_src[i++] = (CHAR16)e->name[j++];
+    while (name[j] && i < MAX_PATH - 1) {
+        s_copy_src[i++] = (CHAR16)name[j++];
     }
     s_copy_src[i] = 0;
 
     /* Copy name */
     int k = 0;
-    while (e->name[k] && k < 127) {
-        s_copy_name[k] = e->name[k];
+    while (name[k] && k < 127) {
+        s_copy_name[k] = name[k];
         k++;
     }
     s_copy_name[k] = '\0';
 
     /* Show confirmation */
-    char msg[256];
     int p = 0;
     const char *prefix = " Copied: ";
     while (prefix[p]) msg[p] = prefix[p], p++;
     k = 0;
     while (s_copy_name[k] && p < 250) msg[p++] = s_copy_name[k++];
     msg[p] = '\0';
+    if (s_mark_count > 0) {
+        marks_clear();
+        draw_list();
+    }
     draw_status_msg(msg);
 }
 
@@ -622,10 +1218,16 @@ static int names_equal(const char *a, const char *b) {
     return *a == *b;
 }
 
+/* Names a paste of several entries has made so far, not yet listed */
+static struct dirlist *s_pasted;
+
 /* Check if a name already exists in current directory listing */
 static int name_exists(const char *name) {
     for (int i = 0; i < s_count; i++)
-        if (names_equal(name, s_entries[i].name))
+        if (names_equal(name, dirlist_name(&s_list, i)))
+            return 1;
+    for (int i = 0; s_pasted && i < s_pasted->count; i++)
+        if (names_equal(name, dirlist_name(s_pasted, i)))
             return 1;
     return 0;
 }
@@ -661,78 +1263,701 @@ static void make_unique_name(char *out, const char *src, int max) {
     }
 }
 
-/* Returns 0 on success, -1 on failure */
-static int do_paste(void) {
-    if (s_copy_name[0] == '\0') {
-        draw_status_msg(" Nothing to paste");
-        return -1;
+/* Rate and redraw pacing of the copy or clone in progress */
+static struct progress s_progress;
+
+/* Status line while a copy runs: name, amount so far and throughput */
+static void copy_progress(struct copy_job *job, const CHAR16 *path,
+                          UINT64 done, UINT64 size) {
+    (void)path; (void)done; (void)size;
+    if (!progress_add(&s_progress, job->bytes - s_progress.done)) return;
+    char sz[32], msg[256];
+    progress_size(job->bytes, sz, sizeof(sz));
+    UINT64 rate = progress_rate(&s_progress) * 10 / (1024 * 1024);
+    snprintf(msg, sizeof(msg), " Copying %s  %s  %u.%u MB/s",
+             (const char *)job->ctx, sz, (UINT32)(rate / 10), (UINT32)(rate % 10));
+    draw_status_msg(msg);
+}
+
+/* Full path of name in directory dir */
+static void path_in(const CHAR16 *dir, const char *name, CHAR16 *out) {
+    int i = 0;
+    while (dir[i] && i < MAX_PATH - 1) {
+        out[i] = dir[i];
+        i++;
     }
+    if (i > 1 || out[0] != L'\\')
+        out[i++] = L'\\';
+    for (int j = 0; name[j] && i < MAX_PATH - 1; j++)
+        out[i++] = (CHAR16)name[j];
+    out[i] = 0;
+}
 
-    /* Read source file */
-    UINTN file_size;
-    void *data = fs_readfile(s_copy_src, &file_size);
-    if (!data) {
-        draw_status_msg(" Paste failed: cannot read source");
-        return -1;
+/* Full path of name in the directory being browsed */
+static void path_of(const char *name, CHAR16 *out) {
+    path_in(s_path, name, out);
+}
+
+/* ---- Extract ---- */
+
+/* ENTER on an archive: unpack it into a new directory beside it, named
+   after it ("src.tar.gz" -> "src", or "src_2" when that is taken) */
+static void do_extract(void) {
+    if (fs_is_read_only()) {
+        draw_status_msg(" Volume is read-only");
+        return;
     }
+    const char *name = entry_at(s_cursor)->name;
+    char base[128], dir[128];
+    CHAR16 src[MAX_PATH], dst[MAX_PATH];
+    archive_stem(name, base, sizeof(base));
+    make_unique_name(dir, base, sizeof(dir));
+    path_of(name, src);
+    path_of(dir, dst);
+
+    int tag = mem_tag_set(MEM_TAG_DISK);
+    archive_extract(fs_volume_current(), src, name, fs_volume_current(), dst);
+    mem_tag_set(tag);
+}
 
-    /* Check disk space */
-    UINT64 total_bytes, free_bytes;
-    if (fs_volume_info(&total_bytes, &free_bytes) == 0) {
-        if ((UINT64)file_size > free_bytes) {
-            mem_free(data);
-            draw_status_msg(" Paste failed: not enough disk space");
-            return -1;
+/* ---- Download ---- */
+
+/* F6: fetch a URL. On a [DISK] or [USB] entry it is written straight
+   onto that device; anywhere else it is saved in the directory being
+   browsed, named after the URL. */
+static void do_fetch(void) {
+    int on_disk = (!s_on_usb && !s_on_custom && s_disk_count > 0
+                   && s_cursor >= s_disk_start_idx
+                   && s_cursor < s_disk_start_idx + s_disk_count);
+    int on_usb_entry = (!s_on_usb && !s_on_custom && s_usb_count > 0
+                        && s_cursor >= s_real_count
+                        && s_cursor < s_real_count + s_usb_count);
+    if (!on_disk && !on_usb_entry && fs_is_read_only()) {
+        draw_status_msg(" Volume is read-only");
+        return;
+    }
+
+    char url[NET_URL_MAX];
+    if (prompt_line(on_disk || on_usb_entry ? " URL to write to the device: "
+                                            : " URL to download: ",
+                    url, sizeof(url)) != 0)
+        return;
+
+    int tag = mem_tag_set(MEM_TAG_DISK);
+    if (on_disk) {
+        iso_write_url(&s_disk_devs[s_cursor - s_disk_start_idx], url);
+    } else if (on_usb_entry) {
+        int usb_idx = s_cursor - s_real_count;
+        struct disk_device dev;
+        if (find_disk_for_usb(usb_idx, &dev) == 0) {
+            /* Its filesystem is about to go */
+            if (s_usb_vols[usb_idx].root) {
+                s_usb_vols[usb_idx].root->Close(s_usb_vols[usb_idx].root);
+                s_usb_vols[usb_idx].root = NULL;
+            }
+            iso_write_url(&dev, url);
         }
+    } else {
+        char base[128], name[128];
+        CHAR16 path[MAX_PATH];
+        net_url_name(url, base, sizeof(base));
+        make_unique_name(name, base, sizeof(name));
+        path_of(name, path);
+        fetch_file(fs_volume_current(), path, name, url);
     }
+    mem_tag_set(tag);
+}
 
-    /* Generate unique destination name */
-    char dest_name[128];
-    make_unique_name(dest_name, s_copy_name, 128);
+/* ---- Search ---- */
 
-    /* Build full destination path */
-    CHAR16 dest[MAX_PATH];
+/* '/': find a name anywhere on the current volume, then show it in
+   its directory */
+static void do_search(void) {
+    CHAR16 dir[MAX_PATH];
+    char name[FS_MAX_NAME];
+    if (search_run(dir, MAX_PATH, name) != 0) {
+        load_dir();
+        return;
+    }
     int i = 0;
-    while (s_path[i] && i < MAX_PATH - 1) {
-        dest[i] = s_path[i];
-        i++;
+    for (; dir[i] && i < MAX_PATH - 1; i++) s_path[i] = dir[i];
+    s_path[i] = 0;
+    load_dir();
+    for (int k = 0; k < s_real_count; k++) {
+        if (str_cmp((CHAR8 *)entry_at(k)->name, (CHAR8 *)name) == 0) {
+            s_cursor = k;
+            clamp_scroll();
+            break;
+        }
     }
-    if (i > 1 || dest[0] != L'\\')
-        dest[i++] = L'\\';
-    int j = 0;
-    while (dest_name[j] && i < MAX_PATH - 1) {
-        dest[i++] = (CHAR16)dest_name[j++];
+}
+
+/* '?': search the files under the current directory for text */
+static void do_grep(void) {
+    char pattern[GREP_PATTERN_MAX];
+    CHAR16 dir[MAX_PATH];
+    char name[FS_MAX_NAME];
+    if (prompt_line(" Grep for: ", pattern, GREP_PATTERN_MAX) != 0
+        || grep_run(s_path, pattern, dir, MAX_PATH, name) != 0) {
+        load_dir();
+        return;
     }
-    dest[i] = 0;
+    int i = 0;
+    for (; dir[i] && i < MAX_PATH - 1; i++) s_path[i] = dir[i];
+    s_path[i] = 0;
+    load_dir();
+    for (int k = 0; k < s_real_count; k++) {
+        if (str_cmp((CHAR8 *)entry_at(k)->name, (CHAR8 *)name) == 0) {
+            s_cursor = k;
+            clamp_scroll();
+            break;
+        }
+    }
+}
 
-    EFI_STATUS status = fs_writefile(dest, data, file_size);
-    mem_free(data);
+/* ---- Disk images ---- */
 
-    if (EFI_ERROR(status)) {
-        draw_status_msg(" Paste failed: write error");
+/* The volume in the image at path to open: the only one, else the one
+   asked for. Returns its fs_image_partitions() index, or -1 with a
+   message shown (or the prompt cancelled). */
+static int choose_image_part(const CHAR16 *path) {
+    struct fs_image_part parts[8];
+    int n = fs_image_partitions(path, parts, 8);
+    if (n < 0) {
+        draw_status_msg(" Not a readable disk image");
+        return -1;
+    }
+    if (n == 0) {
+        draw_status_msg(" No volume in the image that can be read");
         return -1;
     }
+    if (n == 1)
+        return 0;
+
+    /* " Partition 1 exFAT 512 MB, 2 NTFS 30720 MB: " */
+    char prompt[256];
+    int len = snprintf(prompt, sizeof(prompt), " Partition");
+    for (int i = 0; i < n && len < (int)sizeof(prompt) - 40; i++) {
+        char size[24];
+        progress_size(parts[i].size_bytes, size, sizeof(size));
+        const char *type = (parts[i].type == FS_VOL_EXFAT) ? "exFAT" :
+                           (parts[i].type == FS_VOL_NTFS) ? "NTFS" :
+                           (parts[i].type == FS_VOL_FAT32) ? "FAT32" : "ISO";
+        len += snprintf(prompt + len, sizeof(prompt) - len, "%s %d %s %s",
+                        i ? "," : "", parts[i].number, type, size);
+    }
+    snprintf(prompt + len, sizeof(prompt) - len, ": ");
 
-    /* Show what name was used */
-    char msg[256];
-    int p = 0;
-    const char *prefix = " Pasted: ";
-    while (prefix[p]) { msg[p] = prefix[p]; p++; }
-    j = 0;
-    while (dest_name[j] && p < 250) msg[p++] = dest_name[j++];
-    msg[p] = '\0';
-    draw_status_msg(msg);
-    return 0;
+    char answer[8];
+    if (prompt_line(prompt, answer, sizeof(answer)) != 0)
+        return -1;
+    int num = 0;
+    for (int i = 0; answer[i] >= '0' && answer[i] <= '9'; i++)
+        num = num * 10 + (answer[i] - '0');
+    for (int i = 0; i < n; i++)
+        if (parts[i].number == num)
+            return i;
+    draw_status_msg(" No such partition");
+    return -1;
 }
 
-static void do_rename(void) {
-    if (s_count <= 0) return;
-    struct fs_entry *e = &s_entries[s_cursor];
+/* ENTER on an .iso, .img, .raw or .vhd: browse volume part of it as a
+   read-only volume until BS or ESC at its root. Returns 0 on success. */
+static int enter_image(const char *name, int part) {
+    CHAR16 path[MAX_PATH];
+    enum fs_vol_type type;
+    EFI_HANDLE handle;
+    path_of(name, path);
+    cur_vol_id(&type, &handle);
+    if (fs_mount_image(path, part) != 0)
+        return -1;
 
-    /* Pre-fill with current name */
-    char name[128];
-    int len = 0;
-    while (e->name[len] && len < 127) {
+    int i = 0;
+    for (; path[i]; i++) s_image_path[i] = path[i];
+    s_image_path[i] = 0;
+    s_image_part = part;
+    for (i = 0; s_path[i]; i++) s_image_dir[i] = s_path[i];
+    s_image_dir[i] = 0;
+    str_copy(s_image_name, name, sizeof(s_image_name));
+    s_image_host_type = type;
+    s_image_host_handle = handle;
+    s_image_on_custom = s_on_custom;
+    s_image_on_usb = s_on_usb;
+    s_image_custom_handle = s_custom_cur_handle;
+
+    s_in_image = 1;
+    s_on_custom = 1;
+    s_on_usb = 0;
+    s_custom_cur_handle = handle;   /* the device F10 must not write */
+    path_set_root();
+    load_dir();
+    return 0;
+}
+
+/* Back to the directory the image was opened from, on its name */
+static void leave_image(void) {
+    fs_unmount_image();
+    s_in_image = 0;
+    s_on_custom = s_image_on_custom;
+    s_on_usb = s_image_on_usb;
+    s_custom_cur_handle = s_image_custom_handle;
+    int i = 0;
+    for (; s_image_dir[i]; i++) s_path[i] = s_image_dir[i];
+    s_path[i] = 0;
+    load_dir();
+    for (int k = 0; k < s_real_count; k++) {
+        if (str_cmp((CHAR8 *)entry_at(k)->name, (CHAR8 *)s_image_name) == 0) {
+            s_cursor = k;
+            clamp_scroll();
+            break;
+        }
+    }
+}
+
+/* ---- Network export ---- */
+
+/* F9 on a [DISK] or [USB] entry: serve the device over NBD. Returns -1
+   when the cursor is on neither. */
+static int do_export(void) {
+    int on_disk = (!s_on_usb && !s_on_custom && s_disk_count > 0
+                   && s_cursor >= s_disk_start_idx
+                   && s_cursor < s_disk_start_idx + s_disk_count);
+    int on_usb_entry = (!s_on_usb && !s_on_custom && s_usb_count > 0
+                        && s_cursor >= s_real_count
+                        && s_cursor < s_real_count + s_usb_count);
+    struct disk_device dev;
+    if (on_disk)
+        dev = s_disk_devs[s_cursor - s_disk_start_idx];
+    else if (!on_usb_entry || find_disk_for_usb(s_cursor - s_real_count, &dev) != 0)
+        return -1;
+
+    int tag = mem_tag_set(MEM_TAG_DISK);
+    nbd_export_run(&dev);
+    mem_tag_set(tag);
+    return 0;
+}
+
+/* F8 on a [DISK] or [USB] entry with a device copied: clone that device
+   onto it. Returns -1 when there is nothing to clone or the cursor is on
+   neither. */
+static int do_clone_disk(void) {
+    if (!s_copy_is_disk) return -1;
+    int on_disk = (!s_on_usb && !s_on_custom && s_disk_count > 0
+                   && s_cursor >= s_disk_start_idx
+                   && s_cursor < s_disk_start_idx + s_disk_count);
+    int on_usb_entry = (!s_on_usb && !s_on_custom && s_usb_count > 0
+                        && s_cursor >= s_real_count
+                        && s_cursor < s_real_count + s_usb_count);
+    struct disk_device dev;
+    if (on_disk)
+        dev = s_disk_devs[s_cursor - s_disk_start_idx];
+    else if (!on_usb_entry || find_disk_for_usb(s_cursor - s_real_count, &dev) != 0)
+        return -1;
+
+    int tag = mem_tag_set(MEM_TAG_DISK);
+    diskclone_run(&s_copy_disk, &dev);
+    mem_tag_set(tag);
+    return 0;
+}
+
+/* Paste of a copied device: image it into the current directory */
+static void paste_image(void) {
+    char dest_name[128];
+    CHAR16 dest[MAX_PATH];
+    enum fs_vol_type type;
+    EFI_HANDLE handle;
+    make_unique_name(dest_name, s_copy_name, 128);
+    path_of(dest_name, dest);
+    cur_vol_id(&type, &handle);
+
+    int tag = mem_tag_set(MEM_TAG_DISK);
+    image_backup(&s_copy_disk, fs_volume_current(), dest, dest_name, handle);
+    mem_tag_set(tag);
+}
+
+/* The volume a copy came from, for fs_volume_close(): reopened, and a
+   copy from inside an image mounted again over it */
+static struct fs_volume *copy_src_open(void) {
+    struct fs_volume *v = fs_volume_open(s_copy_vol_type, s_copy_vol_handle);
+    if (!v || !s_copy_image[0]) return v;
+    return fs_volume_open_image(v, s_copy_image, s_copy_image_part);
+}
+
+/* Whether path is dir or lies below it */
+static int path_within(const CHAR16 *path, const CHAR16 *dir) {
+    int k = 0;
+    while (dir[k] && dir[k] == path[k]) k++;
+    return !dir[k] && (!path[k] || path[k] == L'\\');
+}
+
+/* F8 or M after F3 on marked entries: copy each into the directory
+   being browsed and, for M, delete it from where it came from once it
+   has all been copied. The whole paste is one batch on each volume, so
+   the directory and allocation metadata are written back once at the
+   end rather than per entry. Returns 0 when something was pasted. */
+static int paste_list(int move) {
+    if (s_copy_list.count == 0 || s_copy_is_disk) {
+        draw_status_msg(move ? " Nothing to move: mark entries and F3 first"
+                             : " Nothing to paste");
+        return -1;
+    }
+    if (fs_is_read_only()) {
+        draw_status_msg(" Paste failed: volume is read-only");
+        return -1;
+    }
+
+    enum fs_vol_type cur_type;
+    EFI_HANDLE cur_handle;
+    cur_vol_id(&cur_type, &cur_handle);
+    int same_vol = (cur_handle == s_copy_vol_handle && !s_copy_image[0]);
+    if (move && same_vol && path_within(s_path, s_copy_dir)
+        && path_within(s_copy_dir, s_path)) {
+        draw_status_msg(" Move failed: the entries are already here");
+        return -1;
+    }
+    if (move && (s_copy_image[0] || s_copy_vol_type == FS_VOL_NTFS
+                 || s_copy_vol_type == FS_VOL_ISO)) {
+        draw_status_msg(" Move failed: source volume is read-only");
+        return -1;
+    }
+    struct fs_volume *dst = fs_volume_current();
+    struct fs_volume *src = same_vol ? dst : copy_src_open();
+    if (!src) {
+        draw_status_msg(" Paste failed: cannot open source volume");
+        return -1;
+    }
+
+    /* Files only: what a directory holds is not known without a walk */
+    UINT64 need = 0, total_bytes, free_bytes;
+    for (int i = 0; i < s_copy_list.count; i++)
+        if (!s_copy_list.recs[i].is_dir)
+            need += s_copy_list.recs[i].size;
+    if (!(move && same_vol) &&
+        fs_volume_space(dst, &total_bytes, &free_bytes) == 0 &&
+        need > free_bytes) {
+        if (!same_vol) fs_volume_close(src);
+        draw_status_msg(" Paste failed: not enough disk space");
+        return -1;
+    }
+
+    struct dirlist pasted;
+    mem_set(&pasted, 0, sizeof(pasted));
+    s_pasted = &pasted;
+
+    struct copy_job job, del;
+    char label[160];
+    copy_init(&job, src, dst);
+    copy_init(&del, NULL, src);
+    job.progress = copy_progress;
+    job.ctx = label;
+    progress_start(&s_progress, move ? "Moving" : "Copying", 0);
+    fs_volume_begin_batch(dst);
+    if (move && !same_vol) fs_volume_begin_batch(src);
+
+    int done = 0, failed = 0, n = s_copy_list.count;
+    for (int i = 0; i < n; i++) {
+        const char *name = dirlist_name(&s_copy_list, i);
+        int is_dir = s_copy_list.recs[i].is_dir;
+        CHAR16 from[MAX_PATH], dest[MAX_PATH];
+        char dest_name[128];
+        path_in(s_copy_dir, name, from);
+        make_unique_name(dest_name, name, 128);
+        path_in(s_path, dest_name, dest);
+        snprintf(label, sizeof(label), "%d/%d %s", i + 1, n, dest_name);
+
+        /* A directory cannot be pasted inside itself */
+        if (is_dir && same_vol && path_within(dest, from)) {
+            failed++;
+            continue;
+        }
+        int rc = is_dir ? copy_tree(&job, from, dest)
+                        : copy_file(&job, from, dest);
+        dirlist_add(&pasted, dest_name, 0, 0, is_dir);
+        if (rc != 0) {
+            failed++;
+            continue;
+        }
+        /* Only what arrived whole leaves its source */
+        if (move && copy_delete(&del, from, is_dir) != 0) {
+            failed++;
+            continue;
+        }
+        done++;
+    }
+
+    int crc = fs_volume_commit_batch(dst);
+    if (move && !same_vol && fs_volume_commit_batch(src) != 0)
+        crc = -1;
+    copy_done(&job);
+    copy_done(&del);
+    s_pasted = NULL;
+    dirlist_free(&pasted);
+    if (!same_vol) fs_volume_close(src);
+    trace_mark(move ? "move" : "paste", job.bytes,
+               progress_elapsed_ms(&s_progress), s_copy_name);
+
+    char msg[256];
+    UINT32 rate = copy_rate(&job);
+    if (crc != 0)
+        snprintf(msg, sizeof(msg), " %s failed: cannot write the volume metadata",
+                 move ? "Move" : "Paste");
+    else if (failed)
+        snprintf(msg, sizeof(msg), " %s %d of %d entries, %d failed",
+                 move ? "Moved" : "Pasted", done, n, failed);
+    else
+        snprintf(msg, sizeof(msg), " %s %d entries, %u files  %u.%u MB/s",
+                 move ? "Moved" : "Pasted", n, job.files, rate / 10, rate % 10);
+    snprintf(s_note, sizeof(s_note), "%s", msg);
+    if (done == 0 && crc == 0) {
+        draw_status_msg(NULL);
+        return -1;
+    }
+    if (move) {
+        /* What is left of the sources is no longer a copy to paste */
+        dirlist_reset(&s_copy_list);
+        s_copy_name[0] = '\0';
+    }
+    return 0;
+}
+
+/* DEL: delete the marked entries, or the one under the cursor, after a
+   Y on the status line. One batch, as for paste_list(). Returns 0 when
+   the listing has changed. */
+static int do_delete(void) {
+    if (s_count <= 0 || (s_mark_count == 0 && s_cursor >= s_real_count))
+        return -1;
+    if (fs_is_read_only()) {
+        draw_status_msg(" Delete failed: volume is read-only");
+        return -1;
+    }
+    struct dirlist items;
+    mem_set(&items, 0, sizeof(items));
+    if (marked_items(&items) <= 0) {
+        dirlist_free(&items);
+        draw_status_msg(" Delete failed: out of memory");
+        return -1;
+    }
+
+    int dirs = 0;
+    for (int i = 0; i < items.count; i++)
+        dirs += items.recs[i].is_dir;
+    char msg[256];
+    if (items.count == 1)
+        snprintf(msg, sizeof(msg), " Delete %s%s? Y/N", dirlist_name(&items, 0),
+                 dirs ? " and all it holds" : "");
+    else if (dirs)
+        snprintf(msg, sizeof(msg),
+                 " Delete %d entries (%d directories with all they hold)? Y/N",
+                 items.count, dirs);
+    else
+        snprintf(msg, sizeof(msg), " Delete %d files? Y/N", items.count);
+    draw_status_msg(msg);
+    struct key_event ev;
+    kbd_wait(&ev);
+    if (ev.code != 'Y' && ev.code != 'y') {
+        dirlist_free(&items);
+        draw_status_msg(NULL);
+        return -1;
+    }
+
+    struct fs_volume *v = fs_volume_current();
+    struct copy_job job;
+    copy_init(&job, NULL, v);
+    progress_start(&s_progress, "Deleting", 0);
+    fs_volume_begin_batch(v);
+    int failed = 0;
+    for (int i = 0; i < items.count; i++) {
+        CHAR16 path[MAX_PATH];
+        path_of(dirlist_name(&items, i), path);
+        if (copy_delete(&job, path, items.recs[i].is_dir) != 0)
+            failed++;
+        if (progress_add(&s_progress, 0)) {
+            snprintf(msg, sizeof(msg), " Deleting %d of %d", i + 1, items.count);
+            draw_status_msg(msg);
+        }
+    }
+    int crc = fs_volume_commit_batch(v);
+    copy_done(&job);
+    trace_mark("delete", job.deleted, progress_elapsed_ms(&s_progress), "");
+
+    if (crc != 0)
+        snprintf(s_note, sizeof(s_note),
+                 " Delete failed: cannot write the volume metadata");
+    else if (failed)
+        snprintf(s_note, sizeof(s_note), " Deleted %d of %d entries, %u failed",
+                 items.count - failed, items.count, job.failed);
+    else
+        snprintf(s_note, sizeof(s_note), " Deleted %d entries, %u in all",
+                 items.count, job.deleted);
+    dirlist_free(&items);
+    return 0;
+}
+
+/* Returns 0 on success, -1 on failure */
+static int do_paste(void) {
+    if (s_copy_name[0] == '\0') {
+        draw_status_msg(" Nothing to paste");
+        return -1;
+    }
+    if (s_copy_list.count > 1)
+        return paste_list(0);
+    if (fs_is_read_only()) {
+        draw_status_msg(" Paste failed: volume is read-only");
+        return -1;
+    }
+    if (s_copy_is_disk) {
+        paste_image();      /* a full-screen dialog: always redraw */
+        return 0;
+    }
+
+    /* Same volume: use the current one as the source too */
+    enum fs_vol_type cur_type;
+    EFI_HANDLE cur_handle;
+    cur_vol_id(&cur_type, &cur_handle);
+    int same_vol = (cur_handle == s_copy_vol_handle && !s_copy_image[0]);
+    struct fs_volume *dst = fs_volume_current();
+    struct fs_volume *src = same_vol ? dst : copy_src_open();
+    if (!src) {
+        draw_status_msg(" Paste failed: cannot open source volume");
+        return -1;
+    }
+
+    /* Check disk space */
+    if (!s_copy_is_dir) {
+        UINT64 total_bytes, free_bytes, size = 0;
+        struct fs_file *f = fs_volume_open_read(src, s_copy_src, &size);
+        if (!f) {
+            if (!same_vol) fs_volume_close(src);
+            draw_status_msg(" Paste failed: cannot read source");
+            return -1;
+        }
+        fs_stream_close(f);
+        if (fs_volume_space(dst, &total_bytes, &free_bytes) == 0 &&
+            size > free_bytes) {
+            if (!same_vol) fs_volume_close(src);
+            draw_status_msg(" Paste failed: not enough disk space");
+            return -1;
+        }
+    }
+
+    /* Generate unique destination name */
+    char dest_name[128];
+    make_unique_name(dest_name, s_copy_name, 128);
+
+    /* Build full destination path */
+    CHAR16 dest[MAX_PATH];
+    int i = 0;
+    while (s_path[i] && i < MAX_PATH - 1) {
+        dest[i] = s_path[i];
+        i++;
+    }
+    if (i > 1 || dest[0] != L'\\')
+        dest[i++] = L'\\';
+    int j = 0;
+    while (dest_name[j] && i < MAX_PATH - 1) {
+        dest[i++] = (CHAR16)dest_name[j++];
+    }
+    dest[i] = 0;
+
+    /* A directory cannot be pasted inside itself */
+    if (s_copy_is_dir && same_vol) {
+        int k = 0;
+        while (s_copy_src[k] && s_copy_src[k] == dest[k]) k++;
+        if (!s_copy_src[k] && dest[k] == L'\\') {
+            draw_status_msg(" Paste failed: destination is inside the source");
+            return -1;
+        }
+    }
+
+    struct copy_job job;
+    copy_init(&job, src, dst);
+    job.progress = copy_progress;
+    job.ctx = dest_name;
+    progress_start(&s_progress, "Copying", 0);
+    int rc = s_copy_is_dir ? copy_tree(&job, s_copy_src, dest)
+                           : copy_file(&job, s_copy_src, dest);
+    copy_done(&job);
+    if (!same_vol) fs_volume_close(src);
+    trace_mark("paste", job.bytes, progress_elapsed_ms(&s_progress), dest_name);
+
+    /* Show what name was used */
+    char msg[256];
+    UINT32 rate = copy_rate(&job);
+    if (rc != 0 && job.files == 0) {
+        draw_status_msg(" Paste failed: write error");
+        return -1;
+    }
+    if (rc != 0)
+        snprintf(msg, sizeof(msg), " Pasted: %s  %u files, %u failed",
+                 dest_name, job.files, job.failed);
+    else if (s_copy_is_dir)
+        snprintf(msg, sizeof(msg), " Pasted: %s  %u files  %u.%u MB/s",
+                 dest_name, job.files, rate / 10, rate % 10);
+    else
+        snprintf(msg, sizeof(msg), " Pasted: %s  %u.%u MB/s",
+                 dest_name, rate / 10, rate % 10);
+    draw_status_msg(msg);
+    return rc != 0 ? -1 : 0;
+}
+
+/* 'P': pack what F3 copied into <name>.tar.gz in the directory being
+   browsed, deflated on all cores */
+static int do_pack(void) {
+    if (s_copy_name[0] == '\0' || s_copy_is_disk) {
+        draw_status_msg(" Nothing to pack: F3 on a file or directory first");
+        return -1;
+    }
+    if (s_copy_list.count > 1) {
+        draw_status_msg(" Pack takes one file or directory: F3 on it alone");
+        return -1;
+    }
+    if (fs_is_read_only()) {
+        draw_status_msg(" Pack failed: volume is read-only");
+        return -1;
+    }
+
+    enum fs_vol_type cur_type;
+    EFI_HANDLE cur_handle;
+    cur_vol_id(&cur_type, &cur_handle);
+    int same_vol = (cur_handle == s_copy_vol_handle && !s_copy_image[0]);
+    struct fs_volume *dst = fs_volume_current();
+    struct fs_volume *src = same_vol ? dst : copy_src_open();
+    if (!src) {
+        draw_status_msg(" Pack failed: cannot open source volume");
+        return -1;
+    }
+
+    char base[128], dest_name[128];
+    CHAR16 dest[MAX_PATH];
+    snprintf(base, sizeof(base), "%s.tar.gz", s_copy_name);
+    make_unique_name(dest_name, base, sizeof(dest_name));
+    path_of(dest_name, dest);
+
+    /* The archive must not be among what it packs */
+    if (s_copy_is_dir && same_vol) {
+        int k = 0;
+        while (s_copy_src[k] && s_copy_src[k] == dest[k]) k++;
+        if (!s_copy_src[k] && dest[k] == L'\\') {
+            draw_status_msg(" Pack failed: destination is inside the source");
+            return -1;
+        }
+    }
+
+    int tag = mem_tag_set(MEM_TAG_DISK);
+    archive_pack(src, s_copy_src, s_copy_name, s_copy_is_dir, dst, dest);
+    mem_tag_set(tag);
+    if (!same_vol) fs_volume_close(src);
+    return 0;
+}
+
+static void do_rename(void) {
+    if (s_count <= 0) return;
+    struct fs_entry *e = entry_at(s_cursor);
+
+    /* Pre-fill with current name */
+    char name[128];
+    int len = 0;
+    while (e->name[len] && len < 127) {
         name[len] = e->name[len];
         len++;
     }
@@ -807,70 +2032,121 @@ static void do_rename(void) {
 
 /* ---- USB clone ---- */
 
-/* USB root handle used during clone — set before calling recursive copy */
-static EFI_FILE_HANDLE s_clone_usb_root;
+/* Find the whole-disk block device underlying a USB volume.
+   Returns 0 on success and populates *out, or -1 if not found. */
+static int find_disk_for_usb(int usb_idx, struct disk_device *out) {
+    EFI_HANDLE vol_handle = s_usb_vols[usb_idx].handle;
 
-/* Recursively copy files from boot volume to USB volume using UEFI SFS.
-   Caller must be on boot volume (fs_restore_boot_volume). */
-static int clone_copy_recursive(const CHAR16 *src_path, const CHAR16 *dst_path) {
-    /* Read source directory from boot volume */
-    fs_restore_boot_volume();
-    struct fs_entry entries[64];
-    int n = fs_readdir(src_path, entries, 64);
-    if (n < 0) return 0;
+    struct disk_device devs[DISK_MAX_DEVICES];
+    int ndevs = disk_enumerate(devs, DISK_MAX_DEVICES);
 
-    for (int i = 0; i < n; i++) {
-        /* Build source path (CHAR16) */
-        CHAR16 src[MAX_PATH];
-        int si = 0;
-        while (src_path[si] && si < MAX_PATH - 1) { src[si] = src_path[si]; si++; }
-        if (si > 1 || src[0] != L'\\') src[si++] = L'\\';
-        int j = 0;
-        while (entries[i].name[j] && si < MAX_PATH - 1)
-            src[si++] = (CHAR16)entries[i].name[j++];
-        src[si] = 0;
-
-        /* Build destination path (CHAR16) */
-        CHAR16 dst[MAX_PATH];
-        int di = 0;
-        while (dst_path[di] && di < MAX_PATH - 1) { dst[di] = dst_path[di]; di++; }
-        if (di > 1 || dst[0] != L'\\') dst[di++] = L'\\';
-        j = 0;
-        while (entries[i].name[j] && di < MAX_PATH - 1)
-            dst[di++] = (CHAR16)entries[i].name[j++];
-        dst[di] = 0;
-
-        if (entries[i].is_dir) {
-            /* Create directory on USB via SFS */
-            fs_set_volume(s_clone_usb_root);
-            fs_mkdir(dst);
-            fs_restore_boot_volume();
-            clone_copy_recursive(src, dst);
-        } else {
-            /* Show progress */
-            char msg[256];
-            int mp = 0;
-            const char *pre = " Copying ";
-            while (pre[mp] && mp < 240) { msg[mp] = pre[mp]; mp++; }
-            j = 0;
-            while (dst[j] && mp < 250) msg[mp++] = (char)(dst[j++] & 0x7F);
-            msg[mp] = '\0';
-            draw_status_msg(msg);
+    /* Case 1: direct handle match (superfloppy — no partition table) */
+    for (int i = 0; i < ndevs; i++) {
+        if (devs[i].handle == vol_handle && !devs[i].is_boot_device) {
+            *out = devs[i];
+            return 0;
+        }
+    }
 
-            /* Read from boot volume */
-            fs_restore_boot_volume();
-            UINTN file_size;
-            void *data = fs_readfile(src, &file_size);
-            if (data) {
-                /* Write to USB volume via SFS */
-                fs_set_volume(s_clone_usb_root);
-                fs_writefile(dst, data, file_size);
-                fs_restore_boot_volume();
-                mem_free(data);
+    /* Case 2: USB volume is a partition on the disk */
+    EFI_GUID bio_guid = EFI_BLOCK_IO_PROTOCOL_GUID;
+    EFI_BLOCK_IO *vol_bio = NULL;
+    g_boot.bs->HandleProtocol(vol_handle, &bio_guid, (VOID **)&vol_bio);
+    if (vol_bio && vol_bio->Media && vol_bio->Media->LogicalPartition) {
+        UINT64 vol_size = (UINT64)(vol_bio->Media->LastBlock + 1) *
+                          (UINT64)vol_bio->Media->BlockSize;
+        for (int i = 0; i < ndevs; i++) {
+            if (devs[i].is_removable && !devs[i].is_boot_device
+                && devs[i].size_bytes >= vol_size) {
+                *out = devs[i];
+                return 0;
             }
         }
     }
-    return 0;
+
+    return -1;
+}
+
+/* Kept on the USB by sync clones: what each file was copied from */
+#define CLONE_INDEX L"\\SURVIVAL.IDX"
+
+/* Progress for the clone: once per file, on the line below the banner */
+static void clone_progress(struct copy_job *job, const CHAR16 *path,
+                           UINT64 done, UINT64 size) {
+    (void)job; (void)size;
+    if (done != 0) return;
+    char msg[256];
+    int mp = 0;
+    const char *pre = " Copying ";
+    while (pre[mp] && mp < 240) { msg[mp] = pre[mp]; mp++; }
+    int j = 0;
+    while (path[j] && mp < 250) msg[mp++] = (char)(path[j++] & 0x7F);
+    msg[mp] = '\0';
+    draw_status_msg(msg);
+}
+
+static void raw_progress(UINT64 done, UINT64 total) {
+    s_progress.total = total;
+    if (!progress_add(&s_progress, done - s_progress.done)) return;
+    char msg[128];
+    msg[0] = ' ';
+    progress_line(&s_progress, msg + 1, sizeof(msg) - 1);
+    draw_status_msg(msg);
+}
+
+/* Rewrite the USB drive as a block copy of the boot partition */
+static void clone_raw(int usb_idx) {
+    struct key_event ev;
+    struct disk_device src, dst;
+    if (disk_open_boot_partition(&src) != 0 ||
+        find_disk_for_usb(usb_idx, &dst) != 0) {
+        fb_print("\n  Cannot find the boot partition or the USB disk.\n", COLOR_RED);
+        fb_print("  Press any key to return.\n", COLOR_WHITE);
+        kbd_wait(&ev);
+        return;
+    }
+
+    char line[128], sz[32];
+    progress_size(src.size_bytes, sz, sizeof(sz));
+    fb_print("\n  This will ERASE all data on the USB drive!\n", COLOR_RED);
+    snprintf(line, sizeof(line),
+             "  It will hold one %s volume, like the boot partition.\n", sz);
+    fb_print(line, COLOR_YELLOW);
+    fb_print("  Press 'Y' to proceed, any other key to cancel.\n", COLOR_YELLOW);
+    kbd_wait(&ev);
+    if (ev.code != 'Y' && ev.code != 'y') return;
+
+    /* Nothing may hold the old filesystem while its blocks change */
+    fs_restore_boot_volume();
+    struct fs_usb_volume *uv = &s_usb_vols[usb_idx];
+    if (uv->root) {
+        uv->root->Close(uv->root);
+        uv->root = NULL;
+    }
+
+    fb_print("\n  Writing image...\n", COLOR_WHITE);
+    progress_start(&s_progress, "Writing image", 0);
+    INT64 written = fat32_clone_image(&src, &dst, raw_progress);
+    disk_reconnect(&dst);
+    fs_cache_invalidate();
+
+    snprintf(line, sizeof(line), "boot partition -> %s", dst.name);
+    progress_log(&s_progress, line, written >= 0);
+
+    if (written < 0) {
+        fb_print("  Image clone FAILED.\n", COLOR_RED);
+    } else {
+        char stats[96];
+        progress_size((UINT64)written, sz, sizeof(sz));
+        progress_summary(&s_progress, stats, sizeof(stats));
+        snprintf(line, sizeof(line), "  %s written, %s\n", sz, stats);
+        fb_print(line, COLOR_WHITE);
+        fb_print("\n  ========================================\n", COLOR_GREEN);
+        fb_print("    BOOTABLE USB CLONE CREATED!\n", COLOR_GREEN);
+        fb_print("  ========================================\n", COLOR_GREEN);
+    }
+    fb_print("\n  Press any key to return.\n", COLOR_WHITE);
+    kbd_wait(&ev);
 }
 
 static void clone_to_usb(void) {
@@ -888,25 +2164,74 @@ static void clone_to_usb(void) {
     fb_print("  onto the USB drive, creating a bootable\n", COLOR_YELLOW);
     fb_print("  Survival Workstation clone.\n", COLOR_YELLOW);
     fb_print("\n", COLOR_WHITE);
-    fb_print("  Press 'Y' to proceed, any other key to cancel.\n", COLOR_YELLOW);
+    fb_print("  Y  copy every file\n", COLOR_WHITE);
+    fb_print("  S  sync: copy only new and changed files and\n", COLOR_WHITE);
+    fb_print("     delete what the boot volume no longer has\n", COLOR_WHITE);
+    fb_print("  V  sync, comparing contents where unsure\n", COLOR_WHITE);
+    fb_print("  R  raw image: write the boot partition's used\n", COLOR_WHITE);
+    fb_print("     blocks over the whole drive (erases it)\n", COLOR_WHITE);
+    fb_print("\n", COLOR_WHITE);
+    fb_print("  Press Y, S, V or R to proceed, any other key to cancel.\n", COLOR_YELLOW);
 
     struct key_event ev;
     kbd_wait(&ev);
-    if (ev.code != 'Y' && ev.code != 'y') {
+    int mode = (ev.code >= 'a' && ev.code <= 'z') ? ev.code - 32 : ev.code;
+    if (mode == 'R') {
+        clone_raw(s_usb_vol_idx);
+        fs_restore_boot_volume();
+        s_on_usb = 0;
+        path_set_root();
+        return;
+    }
+    if (mode != 'Y' && mode != 'S' && mode != 'V') {
         fb_print("\n  Cancelled.\n", COLOR_WHITE);
         fb_print("  Press any key to return.\n", COLOR_WHITE);
         kbd_wait(&ev);
         return;
     }
 
-    /* Save USB root handle, then switch to boot volume for reading */
-    s_clone_usb_root = s_usb_vols[s_usb_vol_idx].root;
-    fs_restore_boot_volume();
+    /* Read the boot volume through a handle of its own and write the USB
+       through whatever driver has it mounted now */
+    struct fs_volume *src = fs_volume_open(FS_VOL_SFS, NULL);
+    struct fs_volume *dst = fs_volume_current();
+    if (!src) {
+        fb_print("\n  Cannot open the boot volume.\n", COLOR_RED);
+        fb_print("  Press any key to return.\n", COLOR_WHITE);
+        kbd_wait(&ev);
+        return;
+    }
 
-    /* Recursively copy boot volume to USB via UEFI SFS */
-    fb_print("\n  Copying files...\n", COLOR_WHITE);
+    /* Recursively copy boot volume to USB */
+    fb_print(mode == 'Y' ? "\n  Copying files...\n" : "\n  Syncing files...\n",
+             COLOR_WHITE);
+    struct copy_job job;
+    copy_init(&job, src, dst);
+    job.progress = clone_progress;
+    if (mode == 'V') job.flags = COPY_VERIFY;
     CHAR16 root_path[2] = { L'\\', 0 };
-    clone_copy_recursive(root_path, root_path);
+    if (mode == 'Y')
+        copy_tree(&job, root_path, root_path);
+    else
+        copy_sync(&job, root_path, root_path, CLONE_INDEX);
+    copy_done(&job);
+    fs_volume_close(src);
+
+    char sum[128], sz[32];
+    UINT32 rate = copy_rate(&job);
+    progress_size(job.bytes, sz, sizeof(sz));
+    snprintf(sum, sizeof(sum), "\n  %u files, %s at %u.%u MB/s\n",
+             job.files, sz, rate / 10, rate % 10);
+    fb_print(sum, COLOR_WHITE);
+    if (mode != 'Y') {
+        snprintf(sum, sizeof(sum), "  %u unchanged, %u removed\n",
+                 job.skipped, job.deleted);
+        fb_print(sum, COLOR_WHITE);
+    }
+    if (job.failed) {
+        snprintf(sum, sizeof(sum), "  %u entries could not be copied\n",
+                 job.failed);
+        fb_print(sum, COLOR_RED);
+    }
 
     fb_print("\n\n", COLOR_WHITE);
     fb_print("  ========================================\n", COLOR_GREEN);
@@ -920,45 +2245,51 @@ static void clone_to_usb(void) {
     kbd_wait(&ev);
 
     /* Return to boot volume root */
+    fs_restore_boot_volume();
     s_on_usb = 0;
     path_set_root();
 }
 
 /* ---- Format block device ---- */
 
-/* Find the whole-disk block device underlying a USB volume.
-   Returns 0 on success and populates *out, or -1 if not found. */
-static int find_disk_for_usb(int usb_idx, struct disk_device *out) {
-    EFI_HANDLE vol_handle = s_usb_vols[usb_idx].handle;
+/* Zero the whole device: an erase where the firmware offers one, which
+   takes seconds, otherwise writes covering every block */
+static void do_wipe_disk(struct disk_device *dev) {
+    struct key_event ev;
+    char line[128], sz[32];
 
-    struct disk_device devs[DISK_MAX_DEVICES];
-    int ndevs = disk_enumerate(devs, DISK_MAX_DEVICES);
+    progress_size(dev->size_bytes, sz, sizeof(sz));
+    snprintf(line, sizeof(line), "\n  Wiping %s...\n", sz);
+    fb_print(line, COLOR_WHITE);
+    progress_start(&s_progress, "Wiping", dev->size_bytes);
 
-    /* Case 1: direct handle match (superfloppy — no partition table) */
-    for (int i = 0; i < ndevs; i++) {
-        if (devs[i].handle == vol_handle && !devs[i].is_boot_device) {
-            *out = devs[i];
-            return 0;
-        }
-    }
+    int tag = mem_tag_set(MEM_TAG_DISK);
+    int rc = disk_zero_blocks(dev, 0, dev->size_bytes / dev->block_size,
+                              raw_progress);
+    if (rc >= 0 && disk_flush(dev) != 0)
+        rc = -1;
+    mem_tag_set(tag);
 
-    /* Case 2: USB volume is a partition on the disk */
-    EFI_GUID bio_guid = EFI_BLOCK_IO_PROTOCOL_GUID;
-    EFI_BLOCK_IO *vol_bio = NULL;
-    g_boot.bs->HandleProtocol(vol_handle, &bio_guid, (VOID **)&vol_bio);
-    if (vol_bio && vol_bio->Media && vol_bio->Media->LogicalPartition) {
-        UINT64 vol_size = (UINT64)(vol_bio->Media->LastBlock + 1) *
-                          (UINT64)vol_bio->Media->BlockSize;
-        for (int i = 0; i < ndevs; i++) {
-            if (devs[i].is_removable && !devs[i].is_boot_device
-                && devs[i].size_bytes >= vol_size) {
-                *out = devs[i];
-                return 0;
-            }
-        }
+    disk_reconnect(dev);
+    fs_cache_invalidate();
+    progress_log(&s_progress, dev->name, rc >= 0);
+
+    if (rc < 0) {
+        fb_print("  Wipe FAILED.\n", COLOR_RED);
+    } else {
+        fb_print(rc ? "  Erased by the device.\n"
+                    : "  Zeroed by writing every block.\n", COLOR_WHITE);
+        fb_print("\n  ========================================\n", COLOR_GREEN);
+        fb_print("    WIPE COMPLETE!\n", COLOR_GREEN);
+        fb_print("  ========================================\n", COLOR_GREEN);
     }
+    fb_print("\n  Press any key to return.\n", COLOR_DGRAY);
+    kbd_wait(&ev);
+}
 
-    return -1;
+/* exfat_format() writes through the device's write queue */
+static int format_write_cb(void *ctx, UINT64 lba, UINT32 count, const void *buf) {
+    return disk_write_blocks((struct disk_device *)ctx, lba, count, (void *)buf);
 }
 
 static void do_format_disk(struct disk_device *dev) {
@@ -966,7 +2297,7 @@ static void do_format_disk(struct disk_device *dev) {
     fb_clear(COLOR_BLACK);
     fb_print("\n", COLOR_WHITE);
     fb_print("  ========================================\n", COLOR_CYAN);
-    fb_print("       FORMAT DEVICE AS FAT32\n", COLOR_CYAN);
+    fb_print("       FORMAT DEVICE\n", COLOR_CYAN);
     fb_print("  ========================================\n", COLOR_CYAN);
     fb_print("\n", COLOR_WHITE);
 
@@ -975,20 +2306,38 @@ static void do_format_disk(struct disk_device *dev) {
     fb_print(dev->name, COLOR_WHITE);
     fb_print("\n\n", COLOR_WHITE);
     fb_print("  This will ERASE all data on this device!\n", COLOR_RED);
-    fb_print("  A new FAT32 filesystem will be created.\n", COLOR_YELLOW);
     fb_print("\n", COLOR_WHITE);
-    fb_print("  Press 'Y' to proceed, any other key to cancel.\n", COLOR_YELLOW);
+    fb_print("  Press 'Y' for FAT32, 'E' for exFAT (files over 4 GB,\n", COLOR_YELLOW);
+    fb_print("  faster on large media), 'W' to wipe every block to zero\n", COLOR_YELLOW);
+    fb_print("  instead (no filesystem), any other key to cancel.\n", COLOR_YELLOW);
 
     struct key_event ev;
     kbd_wait(&ev);
-    if (ev.code != 'Y' && ev.code != 'y') return;
+    if (ev.code == 'W' || ev.code == 'w') {
+        do_wipe_disk(dev);
+        return;
+    }
+    int exfat = (ev.code == 'E' || ev.code == 'e');
+    if (!exfat && ev.code != 'Y' && ev.code != 'y') return;
 
     fb_print("\n  Formatting...\n", COLOR_WHITE);
 
-    int rc = fat32_format(dev);
+    int tag = mem_tag_set(MEM_TAG_DISK);
+    int rc;
+    if (exfat) {
+        rc = exfat_format(format_write_cb, dev, dev->block_size,
+                          dev->size_bytes / dev->block_size, "SURVIVAL",
+                          (UINT32)time(NULL));
+        if (disk_flush(dev) != 0)
+            rc = -1;
+    } else {
+        rc = fat32_format(dev);
+    }
+    mem_tag_set(tag);
 
-    /* Force firmware to re-probe — pick up the new FAT32 */
+    /* Force firmware to re-probe — pick up the new filesystem */
     disk_reconnect(dev);
+    fs_cache_invalidate();
 
     if (rc < 0) {
         fb_print("  Format FAILED.\n", COLOR_RED);
@@ -998,20 +2347,315 @@ static void do_format_disk(struct disk_device *dev) {
         fb_print("    FORMAT COMPLETE!\n", COLOR_GREEN);
         fb_print("  ========================================\n", COLOR_GREEN);
         fb_print("\n", COLOR_WHITE);
-        fb_print("  The device is now FAT32.\n", COLOR_WHITE);
-        fb_print("  It will appear as a [USB] volume.\n", COLOR_WHITE);
+        if (exfat) {
+            fb_print("  The device is now exFAT.\n", COLOR_WHITE);
+            fb_print("  It will appear as an [exFAT] volume.\n", COLOR_WHITE);
+        } else {
+            fb_print("  The device is now FAT32.\n", COLOR_WHITE);
+            fb_print("  It will appear as a [USB] volume.\n", COLOR_WHITE);
+        }
     }
 
     fb_print("\n  Press any key to return.\n", COLOR_DGRAY);
     kbd_wait(&ev);
 }
 
+/* ---- Memory viewer ---- */
+
+/* Rows are rewritten in place each refresh, padded to the full width */
+static void mem_row(int *row, UINT32 fg, const char *text) {
+    if (*row >= (int)g_boot.rows - 1)
+        return;
+    char line[256];
+    int n = (int)g_boot.cols < 255 ? (int)g_boot.cols : 255;
+    int i = 0;
+    for (; text[i] && i < n; i++)
+        line[i] = text[i];
+    for (; i < n; i++)
+        line[i] = ' ';
+    line[n] = '\0';
+    fb_string(0, *row, line, fg, COLOR_BLACK);
+    (*row)++;
+}
+
+/* How long each startup phase took, from the marks efi_main() left */
+static void draw_boot_phases(int *row) {
+    const struct boot_phase *ph;
+    int n = boot_phases(&ph);
+    if (n == 0) return;
+    char buf[256], item[48];
+    mem_row(row, COLOR_YELLOW, " Boot phases (ms)");
+
+    /* The first phase runs from the counter's start; the key wait is
+       the user's, and splits reaching the banner from the browser */
+    int key = n;
+    int p = snprintf(buf, sizeof(buf), "  ");
+    for (int i = 0; i < n; i++) {
+        UINT64 from = i ? ph[i - 1].ticks : 0;
+        int len = snprintf(item, sizeof(item), " %s %llu", ph[i].name,
+                           (unsigned long long)(timer_us(ph[i].ticks - from) / 1000));
+        if (p + len >= (int)g_boot.cols && p > 2) {
+            mem_row(row, COLOR_WHITE, buf);
+            p = snprintf(buf, sizeof(buf), "  ");
+        }
+        p += snprintf(buf + p, sizeof(buf) - p, "%s", item);
+        if (str_cmp((CHAR8 *)ph[i].name, (CHAR8 *)"key wait") == 0)
+            key = i;
+    }
+    mem_row(row, COLOR_WHITE, buf);
+
+    UINT64 ready = ph[key > 0 ? key - 1 : 0].ticks;
+    UINT64 browser = key < n - 1 ? ph[n - 1].ticks - ph[key].ticks : 0;
+    snprintf(buf, sizeof(buf),
+             "   interactive %llu ms after reset (%llu ms in the workstation),"
+             " browser %llu ms after the key; display mode %s",
+             (unsigned long long)(timer_us(ready) / 1000),
+             (unsigned long long)(timer_us(ready - ph[0].ticks) / 1000),
+             (unsigned long long)(timer_us(browser) / 1000),
+             fb_mode_cached() ? "remembered" : "searched");
+    mem_row(row, COLOR_WHITE, buf);
+    mem_row(row, COLOR_WHITE, "");
+}
+
+static void draw_memory(void) {
+    struct mem_stats m;
+    struct shim_alloc_stats a;
+    struct mem_map_stats mm;
+    char buf[256], s1[24], s2[24], s3[24], s4[24];
+    int row = 1;
+
+    mem_get_stats(&m);
+    shim_get_alloc_stats(&a);
+    int have_map = (mem_map_stats(&mm) == 0);
+
+    mem_row(&row, COLOR_YELLOW, " Heap (mem_alloc)");
+    progress_size(m.live_bytes, s1, sizeof(s1));
+    progress_size(m.peak_bytes, s2, sizeof(s2));
+    snprintf(buf, sizeof(buf), "   live %-10s peak %-10s allocs %llu  frees %llu",
+             s1, s2, (unsigned long long)m.allocs, (unsigned long long)m.frees);
+    mem_row(&row, COLOR_WHITE, buf);
+    progress_size(m.slab_bytes, s1, sizeof(s1));
+    progress_size(m.pool_bytes, s2, sizeof(s2));
+    progress_size(m.page_bytes, s3, sizeof(s3));
+    snprintf(buf, sizeof(buf), "   slabs %u (%u spare) %-8s  pool %llu blocks %-8s  pages %s",
+             m.slabs, m.spare_slabs, s1,
+             (unsigned long long)m.pool_blocks, s2, s3);
+    mem_row(&row, COLOR_WHITE, buf);
+    progress_size(m.io_bytes, s1, sizeof(s1));
+    progress_size(m.io_idle_bytes, s2, sizeof(s2));
+    snprintf(buf, sizeof(buf), "   device I/O buffers %s (%s idle)", s1, s2);
+    mem_row(&row, COLOR_WHITE, buf);
+    mem_row(&row, COLOR_WHITE, "");
+
+    mem_row(&row, COLOR_YELLOW, " Size classes (bytes: live objects / slabs)");
+    int half = (MEM_SLAB_CLASSES + 1) / 2;
+    for (int i = 0; i < half; i++) {
+        int j = i + half;
+        int p = snprintf(buf, sizeof(buf), "   %5u: %7llu / %-4u",
+                         m.cls[i].size, (unsigned long long)m.cls[i].objects,
+                         m.cls[i].slabs);
+        if (j < MEM_SLAB_CLASSES)
+            snprintf(buf + p, sizeof(buf) - p, "     %5u: %7llu / %-4u",
+                     m.cls[j].size, (unsigned long long)m.cls[j].objects,
+                     m.cls[j].slabs);
+        mem_row(&row, COLOR_WHITE, buf);
+    }
+    mem_row(&row, COLOR_WHITE, "");
+
+    mem_row(&row, COLOR_YELLOW, " Live bytes by subsystem");
+    int p = snprintf(buf, sizeof(buf), "  ");
+    for (int t = 0; t < MEM_TAGS; t++) {
+        progress_size(m.tag_bytes[t], s1, sizeof(s1));
+        p += snprintf(buf + p, sizeof(buf) - p, " %s %-8s",
+                      mem_tag_name(t), s1);
+    }
+    mem_row(&row, COLOR_WHITE, buf);
+    mem_row(&row, COLOR_WHITE, "");
+
+    mem_row(&row, COLOR_YELLOW, " Cache budgets (shares of RAM)");
+    p = snprintf(buf, sizeof(buf), "  ");
+    for (int b = 0; b < MEM_BUDGETS; b++) {
+        progress_size(mem_budget(b), s1, sizeof(s1));
+        p += snprintf(buf + p, sizeof(buf) - p, " %s %-8s",
+                      mem_budget_name(b), s1);
+    }
+    mem_row(&row, COLOR_WHITE, buf);
+    mem_row(&row, COLOR_WHITE, "");
+
+    mem_row(&row, COLOR_YELLOW, " malloc (shim)");
+    unsigned long long pct = a.reallocs ?
+        (unsigned long long)(a.reallocs_in_place * 100 / a.reallocs) : 0;
+    snprintf(buf, sizeof(buf), "   mallocs %llu  frees %llu  reallocs %llu (%llu%% in place)",
+             (unsigned long long)a.mallocs, (unsigned long long)a.frees,
+             (unsigned long long)a.reallocs, pct);
+    mem_row(&row, COLOR_WHITE, buf);
+    progress_size(a.arena_bytes, s1, sizeof(s1));
+    progress_size(a.arena_peak, s2, sizeof(s2));
+    snprintf(buf, sizeof(buf), "   arenas %llu  open: %s in %llu chunks + %llu big  peak %s",
+             (unsigned long long)a.arenas, s1,
+             (unsigned long long)a.arena_chunks,
+             (unsigned long long)a.arena_big, s2);
+    mem_row(&row, COLOR_WHITE, buf);
+    mem_row(&row, COLOR_WHITE, "");
+
+    draw_boot_phases(&row);
+
+    mem_row(&row, COLOR_YELLOW, " UEFI memory map");
+    if (!have_map) {
+        mem_row(&row, COLOR_RED, "   GetMemoryMap failed");
+        return;
+    }
+    progress_size(mm.usable_pages * 4096, s1, sizeof(s1));
+    progress_size(mm.type_pages[EfiConventionalMemory] * 4096, s2, sizeof(s2));
+    progress_size(mm.largest_free * 4096, s3, sizeof(s3));
+    snprintf(buf, sizeof(buf), "   usable %-9s free %-9s in %u ranges, largest %s",
+             s1, s2, mm.free_ranges, s3);
+    mem_row(&row, COLOR_WHITE, buf);
+    progress_size(mm.type_pages[EfiLoaderCode] * 4096, s1, sizeof(s1));
+    progress_size(mm.type_pages[EfiLoaderData] * 4096, s2, sizeof(s2));
+    progress_size(mm.type_pages[EfiBootServicesCode] * 4096, s3, sizeof(s3));
+    progress_size(mm.type_pages[EfiBootServicesData] * 4096, s4, sizeof(s4));
+    snprintf(buf, sizeof(buf), "   loader code %-9s data %-9s  boot svc code %-9s data %s",
+             s1, s2, s3, s4);
+    mem_row(&row, COLOR_WHITE, buf);
+    progress_size((mm.type_pages[EfiRuntimeServicesCode] +
+                   mm.type_pages[EfiRuntimeServicesData]) * 4096, s1, sizeof(s1));
+    progress_size((mm.type_pages[EfiACPIReclaimMemory] +
+                   mm.type_pages[EfiACPIMemoryNVS]) * 4096, s2, sizeof(s2));
+    progress_size(mm.type_pages[EfiReservedMemoryType] * 4096, s3, sizeof(s3));
+    snprintf(buf, sizeof(buf), "   runtime %-9s acpi %-9s reserved %-9s %u descriptors",
+             s1, s2, s3, mm.descriptors);
+    mem_row(&row, COLOR_WHITE, buf);
+}
+
+/* Live view of the allocator counters and the memory map, refreshed
+   about once a second until a key is pressed. B and T run the memory
+   benchmark and test (memtest.c) and come back here. */
+static void show_memory_frame(void) {
+    fb_clear(COLOR_BLACK);
+    char line[256];
+    mem_set(line, ' ', g_boot.cols);
+    line[g_boot.cols] = '\0';
+    const char *title = " MEMORY";
+    for (int i = 0; title[i] && i < (int)g_boot.cols; i++)
+        line[i] = title[i];
+    fb_string(0, 0, line, COLOR_CYAN, COLOR_DGRAY);
+    mem_set(line, ' ', g_boot.cols);
+    const char *hint = " Refreshes every second.  B: Benchmark  T: Test RAM  "
+                       "Any other key: Back";
+    for (int i = 0; hint[i] && i < (int)g_boot.cols; i++)
+        line[i] = hint[i];
+    fb_string(0, g_boot.rows - 1, line, COLOR_GRAY, COLOR_DGRAY);
+}
+
+static void show_memory(void) {
+    show_memory_frame();
+    struct key_event ev;
+    for (;;) {
+        draw_memory();
+        for (int t = 0; t < 10; t++) {
+            if (kbd_poll(&ev)) {
+                if (ev.code == 'b' || ev.code == 'B')
+                    memtest_bench();
+                else if (ev.code == 't' || ev.code == 'T')
+                    memtest_run();
+                else
+                    return;
+                show_memory_frame();
+                break;
+            }
+            g_boot.bs->Stall(100000);
+        }
+    }
+}
+
 /* ---- Main browser loop ---- */
 
-void browse_run(void) {
+static int is_move_key(UINT16 code) {
+    return code == KEY_UP || code == KEY_DOWN || code == KEY_PGUP ||
+           code == KEY_PGDN || code == KEY_HOME || code == KEY_END;
+}
+
+/* Show cursor movement since (old_cursor, old_scroll) */
+static void draw_moves(int old_cursor, int old_scroll) {
+    if (s_scroll != old_scroll) {
+        draw_list();
+    } else if (s_cursor != old_cursor) {
+        draw_entry_line(old_cursor - s_scroll);
+        draw_entry_line(s_cursor - s_scroll);
+    }
+}
+
+/* Point the preview at the file under the cursor */
+static void preview_follow(void) {
+    if (!s_preview) return;
+    if (s_count > 0 && s_cursor < s_real_count && !entry_at(s_cursor)->is_dir) {
+        struct fs_entry *e = entry_at(s_cursor);
+        CHAR16 path[MAX_PATH];
+        path_of(e->name, path);
+        preview_select(fs_volume_current(), path, e->name, e->size);
+    } else {
+        preview_select(NULL, NULL, NULL, 0);
+    }
+}
+
+/* ---- RAM disk ---- */
+
+#define RAM_SAVE_DIR   L"\\RAMDISK"
+#define RAM_SAVE_INDEX L"\\RAMDISK.IDX"
+
+/* Leaving the browser: offer to keep what is on the RAM disk. It is
+   synced into RAM_SAVE_DIR on the boot volume, so a second save only
+   rewrites the files that changed. */
+static void ram_save_on_exit(void) {
+    if (!fs_ram_active()) return;
+    struct fs_volume *ram = fs_volume_open(FS_VOL_RAM, NULL);
+    if (!ram) return;
+    struct fs_dir *d = fs_volume_opendir(ram, L"\\");
+    struct fs_entry e;
+    int empty = !d || fs_readdir_next(d, &e) <= 0;
+    if (d) fs_closedir(d);
+    struct fs_volume *boot = empty ? NULL : fs_volume_open(FS_VOL_SFS, NULL);
+    if (!boot) {
+        fs_volume_close(ram);
+        return;
+    }
+
+    struct key_event ev;
+    fb_clear(COLOR_BLACK);
+    fb_print("\n  The RAM disk holds files, which are lost at shutdown.\n",
+             COLOR_YELLOW);
+    fb_print("  Press 'Y' to save them to \\RAMDISK on the boot volume,\n",
+             COLOR_YELLOW);
+    fb_print("  any other key to discard them.\n", COLOR_YELLOW);
+    kbd_wait(&ev);
+    if (ev.code == 'Y' || ev.code == 'y') {
+        fb_print("\n  Saving...\n", COLOR_WHITE);
+        struct copy_job job;
+        copy_init(&job, ram, boot);
+        job.progress = clone_progress;
+        int rc = copy_sync(&job, L"\\", RAM_SAVE_DIR, RAM_SAVE_INDEX);
+        copy_done(&job);
+
+        char line[128], sz[32];
+        progress_size(job.bytes, sz, sizeof(sz));
+        snprintf(line, sizeof(line), "\n  %u files, %s written, %u unchanged\n",
+                 job.files, sz, job.skipped);
+        fb_print(line, COLOR_WHITE);
+        if (rc != 0)
+            fb_print("  Some files could not be saved.\n", COLOR_RED);
+        fb_print("  Press any key to continue.\n", COLOR_WHITE);
+        kbd_wait(&ev);
+    }
+    fs_volume_close(boot);
+    fs_volume_close(ram);
+}
+
+static void browse_session(void) {
     /* Init layout */
     s_list_top = 3;
     s_list_rows = g_boot.rows - 4;  /* header + path + colhdr + status */
+    set_layout();
 
     /* Init filesystem */
     EFI_STATUS status = fs_init();
@@ -1024,267 +2668,564 @@ void browse_run(void) {
     path_set_root();
     load_dir();
     draw_all();
+    preview_follow();
+    boot_phase("browser");
+    trace_mark("browser", 0, 0, NULL);
 
+    /* Main loop: cursor keys queued within a frame only move the
+       cursor, and the list is redrawn once for all of them. Any other
+       key first shows the moves, then ends the frame. */
     struct key_event ev;
     for (;;) {
-        kbd_wait(&ev);
+        wait_key(&ev);
+        kbd_frame_begin();
+        s_note[0] = '\0';
 
         int old_cursor = s_cursor;
+        int old_scroll = s_scroll;
+        int moves_only = 1;
+        do {
+            if (!is_move_key(ev.code)) {
+                draw_moves(old_cursor, old_scroll);
+                moves_only = 0;
+                du_suspend();   /* the key may use the volume */
+                preview_cancel();
+            }
 
-        switch (ev.code) {
-        case KEY_UP:
-            if (s_cursor > 0) {
-                s_cursor--;
-                int old_scroll = s_scroll;
-                clamp_scroll();
-                if (old_scroll != s_scroll) {
-                    draw_list();
-                } else {
-                    draw_entry_line(old_cursor - s_scroll);
-                    draw_entry_line(s_cursor - s_scroll);
+            switch (ev.code) {
+            case KEY_UP:
+                if (s_cursor > 0) {
+                    s_cursor--;
+                    clamp_scroll();
                 }
-            }
-            break;
+                break;
 
-        case KEY_DOWN:
-            if (s_cursor < s_count - 1) {
-                s_cursor++;
-                int prev_scroll = s_scroll;
-                clamp_scroll();
-                if (prev_scroll != s_scroll) {
-                    draw_list();
-                } else {
-                    draw_entry_line(old_cursor - s_scroll);
-                    draw_entry_line(s_cursor - s_scroll);
+            case KEY_DOWN:
+                if (s_cursor < s_count - 1) {
+                    s_cursor++;
+                    clamp_scroll();
                 }
-            }
-            break;
+                break;
 
-        case KEY_PGUP:
-            s_cursor -= (int)s_list_rows;
-            if (s_cursor < 0) s_cursor = 0;
-            clamp_scroll();
-            draw_list();
-            break;
+            case KEY_PGUP:
+                s_cursor -= (int)s_list_rows;
+                if (s_cursor < 0) s_cursor = 0;
+                clamp_scroll();
+                break;
 
-        case KEY_PGDN:
-            s_cursor += (int)s_list_rows;
-            if (s_cursor >= s_count) s_cursor = s_count - 1;
-            if (s_cursor < 0) s_cursor = 0;
-            clamp_scroll();
-            draw_list();
-            break;
+            case KEY_PGDN:
+                s_cursor += (int)s_list_rows;
+                if (s_cursor >= s_count) s_cursor = s_count - 1;
+                if (s_cursor < 0) s_cursor = 0;
+                clamp_scroll();
+                break;
 
-        case KEY_HOME:
-            s_cursor = 0;
-            s_scroll = 0;
-            draw_list();
-            break;
+            case KEY_HOME:
+                s_cursor = 0;
+                s_scroll = 0;
+                break;
 
-        case KEY_END:
-            s_cursor = s_count - 1;
-            if (s_cursor < 0) s_cursor = 0;
-            clamp_scroll();
-            draw_list();
-            break;
+            case KEY_END:
+                s_cursor = s_count - 1;
+                if (s_cursor < 0) s_cursor = 0;
+                clamp_scroll();
+                break;
 
-        case KEY_ENTER:
-            if (!s_on_usb && !s_on_custom && s_disk_count > 0
-                && s_cursor >= s_disk_start_idx
-                && s_cursor < s_disk_start_idx + s_disk_count) {
-                do_format_disk(&s_disk_devs[s_cursor - s_disk_start_idx]);
-                load_dir();
-                draw_all();
-            } else if (!s_on_usb && !s_on_custom && s_custom_count > 0
-                       && s_cursor >= s_custom_start_idx
-                       && s_cursor < s_custom_start_idx + s_custom_count) {
-                /* Entering an exFAT/NTFS volume */
-                int ci = s_cursor - s_custom_start_idx;
-                if (fs_set_custom_volume(s_custom_vols[ci].type,
-                                          s_custom_vols[ci].handle) == 0) {
-                    s_on_custom = 1;
-                    path_set_root();
+            case KEY_ENTER:
+                if (!s_on_usb && !s_on_custom && s_disk_count > 0
+                    && s_cursor >= s_disk_start_idx
+                    && s_cursor < s_disk_start_idx + s_disk_count) {
+                    do_format_disk(&s_disk_devs[s_cursor - s_disk_start_idx]);
+                    s_vols_valid = 0;
                     load_dir();
                     draw_all();
-                } else {
-                    draw_status_msg(" Failed to mount volume");
+                } else if (!s_on_usb && !s_on_custom && s_custom_count > 0
+                           && s_cursor >= s_custom_start_idx
+                           && s_cursor < s_custom_start_idx + s_custom_count) {
+                    /* Entering an exFAT/NTFS volume */
+                    int ci = s_cursor - s_custom_start_idx;
+                    if (fs_set_custom_volume(s_custom_vols[ci].type,
+                                              s_custom_vols[ci].handle) == 0) {
+                        s_on_custom = 1;
+                        s_custom_cur_handle = s_custom_vols[ci].handle;
+                        path_set_root();
+                        load_dir();
+                        draw_all();
+                    } else {
+                        draw_status_msg(" Failed to mount volume");
+                    }
+                } else if (!s_on_usb && !s_on_custom && s_cursor >= s_real_count
+                           && s_usb_count > 0
+                           && s_cursor < s_real_count + s_usb_count) {
+                    /* Entering a USB volume: prefer the built-in FAT32 driver.
+                       Its root handle is given up first, since leaving makes
+                       the firmware driver re-read the volume. */
+                    struct fs_usb_volume *uv = &s_usb_vols[s_cursor - s_real_count];
+                    if (uv->root) {
+                        uv->root->Close(uv->root);
+                        uv->root = NULL;
+                    }
+                    if (fs_set_custom_volume(FS_VOL_FAT32, uv->handle) != 0) {
+                        uv->root = fs_open_volume(uv->handle);
+                        if (uv->root) fs_set_volume(uv->root);
+                    }
+                    if (uv->root || fs_get_vol_type() == FS_VOL_FAT32) {
+                        s_usb_vol_idx = s_cursor - s_real_count;
+                        s_on_usb = 1;
+                        path_set_root();
+                        load_dir();
+                        draw_all();
+                    } else {
+                        draw_status_msg(" Failed to mount volume");
+                    }
+                } else if (s_count > 0 && entry_at(s_cursor)->is_dir) {
+                    path_append(entry_at(s_cursor)->name);
+                    load_dir();
+                    draw_all();
+                } else if (s_count > 0 && !s_in_image
+                           && (is_iso_file(entry_at(s_cursor)->name)
+                               || is_disk_image_file(entry_at(s_cursor)->name))) {
+                    CHAR16 img_path[MAX_PATH];
+                    path_of(entry_at(s_cursor)->name, img_path);
+                    int part = choose_image_part(img_path);   /* says why not */
+                    if (part >= 0) {
+                        if (enter_image(entry_at(s_cursor)->name, part) == 0)
+                            draw_all();
+                        else
+                            draw_status_msg(" Failed to mount the image");
+                    }
+                } else if (s_count > 0 && is_efi_file(entry_at(s_cursor)->name)) {
+                    CHAR16 app_path[MAX_PATH];
+                    path_of(entry_at(s_cursor)->name, app_path);
+                    efiapp_run(app_path, entry_at(s_cursor)->name);
+                    load_dir();
+                    draw_all();
+                } else if (s_count > 0
+                           && archive_kind_of(entry_at(s_cursor)->name) != ARCHIVE_NONE) {
+                    do_extract();
+                    load_dir();
+                    draw_all();
+                } else if (s_count > 0) {
+                    open_file();
+                    load_dir();  /* refresh — file may have been created/changed */
+                    draw_all();
                 }
-            } else if (!s_on_usb && !s_on_custom && s_cursor >= s_real_count
-                       && s_usb_count > 0
-                       && s_cursor < s_real_count + s_usb_count) {
-                /* Entering a USB volume */
-                s_usb_vol_idx = s_cursor - s_real_count;
-                s_on_usb = 1;
-                fs_set_volume(s_usb_vols[s_usb_vol_idx].root);
-                path_set_root();
-                load_dir();
-                draw_all();
-            } else if (s_count > 0 && s_entries[s_cursor].is_dir) {
-                path_append(s_entries[s_cursor].name);
-                load_dir();
-                draw_all();
-            } else if (s_count > 0) {
-                open_file();
-                load_dir();  /* refresh — file may have been created/changed */
-                draw_all();
-            }
-            break;
-
-        case KEY_F3:
-            do_copy();
-            break;
-
-        case KEY_F4:
-            if (fs_is_read_only()) {
-                draw_status_msg(" Volume is read-only");
                 break;
-            }
-            prompt_new_file();
-            load_dir();
-            draw_all();
-            break;
 
-        case KEY_F8:
-            if (fs_is_read_only()) {
-                draw_status_msg(" Volume is read-only");
+            case '/':
+                do_search();
+                draw_all();
                 break;
-            }
-            if (do_paste() == 0) {
-                load_dir();
+
+            case '?':
+                do_grep();
                 draw_all();
-            }
-            break;
+                break;
 
-        case KEY_F9:
-            if (fs_is_read_only()) {
-                draw_status_msg(" Volume is read-only");
+            case 'p':
+            case 'P':
+                if (do_pack() == 0) {
+                    load_dir();
+                    draw_all();
+                }
                 break;
-            }
-            do_rename();
-            load_dir();
-            draw_all();
-            break;
 
-        case KEY_F10:
-            if (s_count > 0 && !s_entries[s_cursor].is_dir
-                && is_iso_file(s_entries[s_cursor].name)) {
-                /* Build full CHAR16 path to the ISO file */
-                CHAR16 iso_path[MAX_PATH];
-                int ip = 0;
-                while (s_path[ip] && ip < MAX_PATH - 1) {
-                    iso_path[ip] = s_path[ip];
-                    ip++;
+            case 'u':
+            case 'U':
+                if (undelete_run() == 0) {
+                    load_dir();
+                    draw_all();
+                } else {
+                    draw_status_msg(" Undelete needs an NTFS volume");
                 }
-                if (ip > 1 || iso_path[0] != L'\\')
-                    iso_path[ip++] = L'\\';
-                int ij = 0;
-                while (s_entries[s_cursor].name[ij] && ip < MAX_PATH - 1)
-                    iso_path[ip++] = (CHAR16)s_entries[s_cursor].name[ij++];
-                iso_path[ip] = 0;
-
-                /* Determine volume root and handle */
-                EFI_FILE_HANDLE vol_root = NULL;
-                EFI_HANDLE vol_handle = NULL;
-                if (s_on_usb && s_usb_vol_idx >= 0 && s_usb_vol_idx < s_usb_count) {
-                    vol_root = s_usb_vols[s_usb_vol_idx].root;
-                    vol_handle = s_usb_vols[s_usb_vol_idx].handle;
+                break;
+
+            case 'c':
+            case 'C':
+                if (fsck_run() == 0) {
+                    load_dir();
+                    draw_all();
                 } else {
-                    vol_root = fs_get_boot_root();
-                    vol_handle = NULL; /* boot volume — never same as target */
+                    draw_status_msg(" Check needs an exFAT or FAT32 volume");
                 }
+                break;
 
-                iso_write(vol_root, iso_path,
-                          s_entries[s_cursor].name,
-                          s_entries[s_cursor].size,
-                          vol_handle);
-                load_dir();
-                draw_all();
-            }
-            break;
+            case 'd':
+            case 'D':
+                if (defrag_run() == 0) {
+                    load_dir();
+                    draw_all();
+                } else {
+                    draw_status_msg(" Defrag needs an exFAT or FAT32 volume");
+                }
+                break;
 
-        case KEY_F11:
-            if (!s_on_usb && s_disk_count > 0
-                && s_cursor >= s_disk_start_idx
-                && s_cursor < s_disk_start_idx + s_disk_count) {
-                /* Format a raw [DISK] entry */
-                do_format_disk(&s_disk_devs[s_cursor - s_disk_start_idx]);
-                load_dir();
-                draw_all();
-            } else if (!s_on_usb && s_usb_count > 0
-                       && s_cursor >= s_real_count
-                       && s_cursor < s_real_count + s_usb_count) {
-                /* Format a [USB] entry — find underlying block device */
-                int usb_idx = s_cursor - s_real_count;
-                struct disk_device dev;
-                if (find_disk_for_usb(usb_idx, &dev) == 0) {
-                    /* Close the volume handle before destroying its filesystem */
-                    if (s_usb_vols[usb_idx].root) {
-                        s_usb_vols[usb_idx].root->Close(s_usb_vols[usb_idx].root);
-                        s_usb_vols[usb_idx].root = NULL;
+            case 'x':
+            case 'X':
+                if (!s_on_usb && !s_on_custom && s_disk_count > 0
+                    && s_cursor >= s_disk_start_idx
+                    && s_cursor < s_disk_start_idx + s_disk_count) {
+                    hexview_disk(&s_disk_devs[s_cursor - s_disk_start_idx]);
+                    draw_all();
+                } else if (!s_on_usb && !s_on_custom && s_usb_count > 0
+                           && s_cursor >= s_real_count
+                           && s_cursor < s_real_count + s_usb_count) {
+                    struct disk_device dev;
+                    if (find_disk_for_usb(s_cursor - s_real_count, &dev) == 0) {
+                        hexview_disk(&dev);
+                        draw_all();
                     }
-                    do_format_disk(&dev);
-                    load_dir();
+                } else if (s_cursor < s_real_count && !entry_at(s_cursor)->is_dir) {
+                    CHAR16 hex_path[MAX_PATH];
+                    path_of(entry_at(s_cursor)->name, hex_path);
+                    hexview_file(fs_volume_current(), hex_path,
+                                 entry_at(s_cursor)->name);
                     draw_all();
                 }
-            }
-            break;
+                break;
 
-        case KEY_F12:
-            if (s_on_usb) {
-                clone_to_usb();
-                load_dir();
+            case 'v':
+            case 'V':
+                s_preview = !s_preview;
+                if (!s_preview) preview_clear();
+                set_layout();
                 draw_all();
-            }
-            break;
+                break;
 
-        case KEY_BS:
-            if (s_on_custom && path_is_root()) {
-                /* Leave custom volume, return to boot root */
-                fs_restore_boot_volume();
-                s_on_custom = 0;
-                path_set_root();
-                load_dir();
+            case KEY_TAB:
+                s_du_mode = (s_du_mode + 1) % 3;
+                du_list();
+                if (s_du_mode == DU_OFF) du_sort(0);
                 draw_all();
-            } else if (s_on_usb && path_is_root()) {
-                /* Leave USB volume, return to boot root */
-                fs_restore_boot_volume();
-                s_on_usb = 0;
-                path_set_root();
-                load_dir();
+                break;
+
+            case KEY_F2:
+                show_memory();
                 draw_all();
-            } else if (!path_is_root()) {
-                path_up();
+                break;
+
+            case KEY_F3:
+                do_copy();
+                break;
+
+            case KEY_F4:
+                if (fs_is_read_only()) {
+                    draw_status_msg(" Volume is read-only");
+                    break;
+                }
+                prompt_new_file();
                 load_dir();
                 draw_all();
-            }
-            break;
+                break;
 
-        case KEY_ESC:
-            if (s_on_custom && path_is_root()) {
-                /* Leave custom volume, return to boot root */
-                fs_restore_boot_volume();
-                s_on_custom = 0;
-                path_set_root();
+            case KEY_F5:
+                /* Rescan: re-read the directory and re-probe all volumes */
+                s_vols_valid = 0;
                 load_dir();
                 draw_all();
-            } else if (s_on_usb && path_is_root()) {
-                /* Leave USB volume, return to boot root */
-                fs_restore_boot_volume();
-                s_on_usb = 0;
-                path_set_root();
+                break;
+
+            case KEY_F6:
+                do_fetch();
+                s_vols_valid = 0;
                 load_dir();
                 draw_all();
-            } else if (!path_is_root()) {
-                path_up();
+                break;
+
+            case KEY_F7:
+                if (!s_on_usb && !s_on_custom && s_disk_count > 0
+                    && s_cursor >= s_disk_start_idx
+                    && s_cursor < s_disk_start_idx + s_disk_count) {
+                    /* Benchmark a raw [DISK] entry */
+                    int tag = mem_tag_set(MEM_TAG_DISK);
+                    diskbench_run(&s_disk_devs[s_cursor - s_disk_start_idx]);
+                    mem_tag_set(tag);
+                    draw_all();
+                } else if (!s_on_usb && !s_on_custom && s_usb_count > 0
+                           && s_cursor >= s_real_count
+                           && s_cursor < s_real_count + s_usb_count) {
+                    /* A [USB] entry: benchmark the disk under it */
+                    struct disk_device dev;
+                    if (find_disk_for_usb(s_cursor - s_real_count, &dev) == 0) {
+                        int tag = mem_tag_set(MEM_TAG_DISK);
+                        diskbench_run(&dev);
+                        mem_tag_set(tag);
+                        draw_all();
+                    }
+                }
+                break;
+
+            case KEY_F8:
+                if (do_clone_disk() == 0) {
+                    s_vols_valid = 0;
+                    load_dir();
+                    draw_all();
+                    break;
+                }
+                if (fs_is_read_only()) {
+                    draw_status_msg(" Volume is read-only");
+                    break;
+                }
+                if (do_paste() == 0) {
+                    load_dir();
+                    draw_all();
+                }
+                break;
+
+            case KEY_F9:
+                if (do_export() == 0) {
+                    s_vols_valid = 0;
+                    load_dir();
+                    draw_all();
+                    break;
+                }
+                if (fs_is_read_only()) {
+                    draw_status_msg(" Volume is read-only");
+                    break;
+                }
+                do_rename();
                 load_dir();
                 draw_all();
-            } else {
-                return;  /* exit browser */
+                break;
+
+            case KEY_F10:
+                if (s_count > 0 && !entry_at(s_cursor)->is_dir
+                    && is_iso_file(entry_at(s_cursor)->name)) {
+                    /* Build full CHAR16 path to the ISO file */
+                    CHAR16 iso_path[MAX_PATH];
+                    int ip = 0;
+                    while (s_path[ip] && ip < MAX_PATH - 1) {
+                        iso_path[ip] = s_path[ip];
+                        ip++;
+                    }
+                    if (ip > 1 || iso_path[0] != L'\\')
+                        iso_path[ip++] = L'\\';
+                    int ij = 0;
+                    struct fs_entry *ie = entry_at(s_cursor);
+                    while (ie->name[ij] && ip < MAX_PATH - 1)
+                        iso_path[ip++] = (CHAR16)ie->name[ij++];
+                    iso_path[ip] = 0;
+
+                    /* Determine volume root and handle */
+                    EFI_FILE_HANDLE vol_root = NULL;
+                    EFI_HANDLE vol_handle = NULL;
+                    if (s_on_usb && s_usb_vol_idx >= 0 && s_usb_vol_idx < s_usb_count) {
+                        /* NULL when the built-in FAT32 driver has it */
+                        vol_root = s_usb_vols[s_usb_vol_idx].root;
+                        vol_handle = s_usb_vols[s_usb_vol_idx].handle;
+                    } else if (s_on_custom) {
+                        vol_root = NULL;  /* current exFAT/NTFS volume */
+                        vol_handle = s_custom_cur_handle;
+                    } else {
+                        vol_root = fs_get_boot_root();
+                        vol_handle = NULL; /* boot volume — never same as target */
+                    }
+
+                    int tag = mem_tag_set(MEM_TAG_DISK);
+                    iso_write(vol_root, iso_path,
+                              ie->name,
+                              ie->size,
+                              vol_handle);
+                    mem_tag_set(tag);
+                    s_vols_valid = 0;
+                    load_dir();
+                    draw_all();
+                } else if (s_count > 0 && !entry_at(s_cursor)->is_dir
+                           && is_image_file(entry_at(s_cursor)->name)) {
+                    /* Restore a disk image from the current volume */
+                    CHAR16 img_path[MAX_PATH];
+                    enum fs_vol_type type;
+                    EFI_HANDLE handle;
+                    path_of(entry_at(s_cursor)->name, img_path);
+                    cur_vol_id(&type, &handle);
+
+                    int tag = mem_tag_set(MEM_TAG_DISK);
+                    image_restore(fs_volume_current(), img_path,
+                                  entry_at(s_cursor)->name, handle);
+                    mem_tag_set(tag);
+                    s_vols_valid = 0;
+                    load_dir();
+                    draw_all();
+                }
+                break;
+
+            case KEY_F11:
+                if (!s_on_usb && s_disk_count > 0
+                    && s_cursor >= s_disk_start_idx
+                    && s_cursor < s_disk_start_idx + s_disk_count) {
+                    /* Format a raw [DISK] entry */
+                    do_format_disk(&s_disk_devs[s_cursor - s_disk_start_idx]);
+                    s_vols_valid = 0;
+                    load_dir();
+                    draw_all();
+                } else if (!s_on_usb && s_usb_count > 0
+                           && s_cursor >= s_real_count
+                           && s_cursor < s_real_count + s_usb_count) {
+                    /* Format a [USB] entry — find underlying block device */
+                    int usb_idx = s_cursor - s_real_count;
+                    struct disk_device dev;
+                    if (find_disk_for_usb(usb_idx, &dev) == 0) {
+                        /* Close the volume handle before destroying its filesystem */
+                        if (s_usb_vols[usb_idx].root) {
+                            s_usb_vols[usb_idx].root->Close(s_usb_vols[usb_idx].root);
+                            s_usb_vols[usb_idx].root = NULL;
+                        }
+                        do_format_disk(&dev);
+                        s_vols_valid = 0;
+                        load_dir();
+                        draw_all();
+                    }
+                }
+                break;
+
+            case KEY_F12:
+                if (s_on_usb) {
+                    int tag = mem_tag_set(MEM_TAG_DISK);
+                    clone_to_usb();
+                    mem_tag_set(tag);
+                    s_vols_valid = 0;
+                    load_dir();
+                    draw_all();
+                }
+                break;
+
+            case KEY_BS:
+                if (s_in_image && path_is_root()) {
+                    leave_image();
+                    draw_all();
+                } else if (s_on_custom && path_is_root()) {
+                    /* Leave custom volume, return to boot root */
+                    fs_restore_boot_volume();
+                    s_on_custom = 0;
+                    path_set_root();
+                    load_dir();
+                    draw_all();
+                } else if (s_on_usb && path_is_root()) {
+                    /* Leave USB volume, return to boot root */
+                    fs_restore_boot_volume();
+                    s_on_usb = 0;
+                    path_set_root();
+                    load_dir();
+                    draw_all();
+                } else if (!path_is_root()) {
+                    path_up();
+                    load_dir();
+                    draw_all();
+                }
+                break;
+
+            case ' ':
+            case KEY_INS:
+                if (s_cursor < s_real_count) {
+                    mark_set(s_cursor, !is_marked(s_cursor));
+                    s_mark_anchor = s_cursor;
+                    if (s_cursor < s_count - 1) s_cursor++;
+                    clamp_scroll();
+                    draw_list();
+                }
+                break;
+
+            case '=':
+                if (s_mark_anchor < 0 || s_mark_anchor >= s_real_count) {
+                    draw_status_msg(" Mark an entry with SPACE first, then = marks up to the cursor");
+                    break;
+                } else {
+                    int a = s_mark_anchor, b = s_cursor;
+                    if (b >= s_real_count) b = s_real_count - 1;
+                    if (a > b) { int t = a; a = b; b = t; }
+                    for (int i = a; i <= b; i++) mark_set(i, 1);
+                    draw_list();
+                }
+                break;
+
+            case '+':
+            case '-': {
+                char q[64];
+                int on = ev.code == '+';
+                if (s_real_count <= 0 ||
+                    prompt_line(on ? " Mark names matching: "
+                                   : " Unmark names matching: ", q, sizeof(q)) != 0
+                    || !q[0]) {
+                    draw_status();
+                    break;
+                }
+                for (int i = 0; i < s_real_count; i++)
+                    if (search_name_matches(dirlist_name(&s_list, i), q))
+                        mark_set(i, on);
+                draw_list();
+                break;
             }
-            break;
-        }
+
+            case '*':
+                for (int i = 0; i < s_real_count; i++)
+                    mark_set(i, !is_marked(i));
+                draw_list();
+                break;
+
+            case KEY_DEL:
+                if (do_delete() == 0) {
+                    load_dir();
+                    draw_all();
+                }
+                break;
+
+            case 'm':
+            case 'M':
+                if (paste_list(1) == 0) {
+                    load_dir();
+                    draw_all();
+                }
+                break;
+
+            case KEY_ESC:
+                if (s_mark_count > 0) {
+                    marks_clear();
+                    draw_list();
+                    break;
+                }
+                if (s_in_image && path_is_root()) {
+                    leave_image();
+                    draw_all();
+                } else if (s_on_custom && path_is_root()) {
+                    /* Leave custom volume, return to boot root */
+                    fs_restore_boot_volume();
+                    s_on_custom = 0;
+                    path_set_root();
+                    load_dir();
+                    draw_all();
+                } else if (s_on_usb && path_is_root()) {
+                    /* Leave USB volume, return to boot root */
+                    fs_restore_boot_volume();
+                    s_on_usb = 0;
+                    path_set_root();
+                    load_dir();
+                    draw_all();
+                } else if (!path_is_root()) {
+                    path_up();
+                    load_dir();
+                    draw_all();
+                } else {
+                    probe_stop();
+                    close_usb_handles();
+                    ram_save_on_exit();
+                    s_vols_valid = 0;
+                    return;  /* exit browser */
+                }
+                break;
+            }
+        } while (moves_only && kbd_frame_next(&ev));
+
+        if (moves_only)
+            draw_moves(old_cursor, old_scroll);
+        preview_follow();
 
         /* Update status bar after cursor/state changes */
         draw_status();
     }
 }
+
+void browse_run(void) {
+    int tag = mem_tag_set(MEM_TAG_BROWSE);
+    browse_session();
+    mem_tag_set(tag);
+}
@@ -0,0 +1,823 @@
+/*
+ * copy.c — Streaming copies of files and directory trees between volumes
+ *
+ * Every file moves through one buffer of up to MEM_BUDGET_COPY bytes,
+ * allocated once per job.  Chunks that large go around the stream read
+ * window straight into the buffer, and the exFAT and FAT32 drivers turn
+ * them into few long transfers over contiguous clusters, so each device
+ * sees a handful of big requests per file instead of a stream of small
+ * ones.  The drivers' write path is synchronous, so on a destination
+ * with BlockIO2 the job turns on the volume's write-behind with a ring
+ * as large as the buffer: a chunk's writes are copied there and left in
+ * flight, and the read of the next chunk overlaps them.  Reads from the
+ * source still block, a destination without BlockIO2 (or an SFS one)
+ * gets plain sequential transfers, and each file waits for its writes
+ * when it is closed.
+ *
+ * Directory walks collect each listing into a compact dirlist before
+ * descending, so no cursor is held open across the copy of a subtree.
+ *
+ * A sync lists each source directory next to its destination and
+ * merges the two sorted listings.  Destination entries the source lacks
+ * go first (a name can change from file to directory), then the missing
+ * subdirectories are created in one pass, then files, then the walk
+ * descends.  Destination drivers stamp files with a fixed date, so
+ * freshness cannot come from comparing times across volumes; instead an
+ * index on the destination records, for every file copied, the source
+ * size and time and a hash of the content.  A file whose source still
+ * matches its record and whose copy has the right size is left alone.
+ */
+
+#include "copy.h"
+#include "dirsort.h"
+#include "mem.h"
+#include "shim.h"
+#include "timer.h"
+
+
+void copy_init(struct copy_job *job, struct fs_volume *src,
+               struct fs_volume *dst) {
+    mem_set(job, 0, sizeof(*job));
+    job->src = src;
+    job->dst = dst;
+}
+
+void copy_done(struct copy_job *job) {
+    if (job->behind) fs_volume_write_behind(job->dst, 0);
+    job->behind = 0;
+    if (job->buf) mem_free(job->buf);
+    job->buf = NULL;
+    job->buf_size = 0;
+}
+
+UINT32 copy_rate(const struct copy_job *job) {
+    if (job->ns == 0) return 0;
+    return (UINT32)(job->bytes * 10000 / job->ns);
+}
+
+static int copy_buffer(struct copy_job *job) {
+    if (job->buf) return 0;
+    /* MEM_BUDGET_COPY, or as much of it as can be had; half of it is
+       the write-behind ring when the destination has one */
+    UINTN size = (UINTN)mem_budget(MEM_BUDGET_COPY);
+    if (job->dst && fs_volume_write_behind(job->dst, size / 2) == 0) {
+        job->behind = 1;
+        size -= size / 2;
+    }
+    for (;;) {
+        job->buf = (UINT8 *)mem_alloc_raw(size);
+        if (job->buf) {
+            job->buf_size = size;
+            return 0;
+        }
+        UINTN less = (UINTN)mem_budget_shrink(MEM_BUDGET_COPY);
+        if (less == size) return -1;
+        size = less;
+    }
+}
+
+static void report(struct copy_job *job, const CHAR16 *path,
+                   UINT64 done, UINT64 size) {
+    if (job->progress) job->progress(job, path, done, size);
+}
+
+/* FNV-1a over 64-bit words, folded after each so high bits spread
+   down. p must be 8-byte aligned (chunks always start at job->buf). */
+static UINT64 hash_mix(UINT64 h, const UINT8 *p, UINTN n) {
+    const UINT64 *w = (const UINT64 *)p;
+    for (; n >= 8; n -= 8) {
+        h = (h ^ *w++) * 0x100000001B3ULL;
+        h ^= h >> 32;
+    }
+    for (p = (const UINT8 *)w; n; n--)
+        h = (h ^ *p++) * 0x100000001B3ULL;
+    return h;
+}
+
+#define HASH_SEED 0xCBF29CE484222325ULL
+
+/* Copy one file; with hash set, also hash what went through */
+static int copy_stream(struct copy_job *job, const CHAR16 *src_path,
+                       const CHAR16 *dst_path, UINT64 *hash) {
+    UINT64 size = 0;
+    if (copy_buffer(job) != 0) {
+        job->failed++;
+        return -1;
+    }
+
+    if (hash) *hash = HASH_SEED;
+    UINT64 t = bench_start();
+    struct fs_file *in = fs_volume_open_read(job->src, src_path, &size);
+    if (!in) {
+        job->ns += bench_stop(t);
+        job->failed++;
+        return -1;
+    }
+    struct fs_file *out = fs_volume_open_write(job->dst, dst_path);
+    if (!out) {
+        fs_stream_close(in);
+        job->ns += bench_stop(t);
+        job->failed++;
+        return -1;
+    }
+
+    int rc = fs_stream_preallocate(out, size);
+    job->ns += bench_stop(t);
+    report(job, dst_path, 0, size);
+    t = bench_start();
+
+    UINT64 done = 0;
+    while (rc == 0 && done < size) {
+        UINTN n = job->buf_size;
+        if ((UINT64)n > size - done) n = (UINTN)(size - done);
+        if (fs_stream_read(in, job->buf, &n) != 0 || n == 0 ||
+            fs_stream_write(out, job->buf, n) != 0) {
+            rc = -1;
+            break;
+        }
+        if (hash) *hash = hash_mix(*hash, job->buf, n);
+        done += n;
+        job->bytes += n;
+
+        /* The callback draws; keep that out of the rate */
+        job->ns += bench_stop(t);
+        report(job, dst_path, done, size);
+        t = bench_start();
+    }
+    fs_stream_close(in);
+    if (fs_stream_close(out) != 0) rc = -1;
+    job->ns += bench_stop(t);
+
+    if (rc != 0) {
+        fs_volume_delete(job->dst, dst_path);
+        job->failed++;
+        return -1;
+    }
+    job->files++;
+    return 0;
+}
+
+int copy_file(struct copy_job *job, const CHAR16 *src_path,
+              const CHAR16 *dst_path) {
+    return copy_stream(job, src_path, dst_path, NULL);
+}
+
+/* ---- Files from a producer ---- */
+
+int copy_open(struct copy_job *job, const CHAR16 *dst_path, UINT64 size) {
+    UINTN n = 0;
+    while (dst_path[n]) n++;
+    if (n >= COPY_MAX_PATH || copy_buffer(job) != 0) {
+        job->failed++;
+        return -1;
+    }
+    mem_copy(job->out_path, dst_path, (n + 1) * sizeof(CHAR16));
+    UINT64 t = bench_start();
+    job->out = fs_volume_open_write(job->dst, dst_path);
+    if (job->out && size && fs_stream_preallocate(job->out, size) != 0) {
+        fs_stream_close(job->out);
+        job->out = NULL;
+        fs_volume_delete(job->dst, dst_path);
+    }
+    job->ns += bench_stop(t);
+    if (!job->out) {
+        job->failed++;
+        return -1;
+    }
+    job->out_len = 0;
+    job->out_done = 0;
+    job->out_size = size;
+    report(job, job->out_path, 0, size);
+    return 0;
+}
+
+static int out_write(struct copy_job *job, const void *data, UINTN len) {
+    UINT64 t = bench_start();
+    int rc = fs_stream_write(job->out, data, len);
+    job->ns += bench_stop(t);
+    if (rc != 0) return -1;
+    job->out_done += len;
+    job->bytes += len;
+    report(job, job->out_path, job->out_done, job->out_size);
+    return 0;
+}
+
+int copy_write(struct copy_job *job, const void *data, UINTN len) {
+    const UINT8 *p = (const UINT8 *)data;
+    if (!job->out) return -1;
+    while (len) {
+        /* A whole buffer's worth goes straight from the caller */
+        if (job->out_len == 0 && len >= job->buf_size) {
+            if (out_write(job, p, job->buf_size) != 0) return -1;
+            p += job->buf_size;
+            len -= job->buf_size;
+            continue;
+        }
+        UINTN n = job->buf_size - job->out_len;
+        if (n > len) n = len;
+        mem_copy(job->buf + job->out_len, p, n);
+        job->out_len += n;
+        p += n;
+        len -= n;
+        if (job->out_len == job->buf_size) {
+            job->out_len = 0;
+            if (out_write(job, job->buf, job->buf_size) != 0) return -1;
+        }
+    }
+    return 0;
+}
+
+int copy_close(struct copy_job *job, int ok) {
+    if (!job->out) return -1;
+    if (ok && job->out_len && out_write(job, job->buf, job->out_len) != 0)
+        ok = 0;
+    UINT64 t = bench_start();
+    if (fs_stream_close(job->out) != 0) ok = 0;
+    job->out = NULL;
+    job->out_len = 0;
+    if (!ok) fs_volume_delete(job->dst, job->out_path);
+    job->ns += bench_stop(t);
+    if (!ok) {
+        job->failed++;
+        return -1;
+    }
+    job->files++;
+    return 0;
+}
+
+int copy_mkdirs(struct copy_job *job, const CHAR16 *dir_path) {
+    /* The longest leading run of whole components both paths share */
+    UINTN same = 0;
+    for (UINTN i = 0;; i++) {
+        CHAR16 a = job->made[i], b = dir_path[i];
+        if ((a == 0 || a == L'\\') && (b == 0 || b == L'\\')) same = i;
+        if (a != b || a == 0) break;
+    }
+    UINTN n = 0;
+    while (dir_path[n]) n++;
+    if (n >= COPY_MAX_PATH) {
+        job->failed++;
+        return -1;
+    }
+
+    CHAR16 path[COPY_MAX_PATH];
+    mem_copy(path, dir_path, (n + 1) * sizeof(CHAR16));
+    for (UINTN i = same + 1; i <= n; i++) {
+        if (path[i] != L'\\' && path[i] != 0) continue;
+        CHAR16 c = path[i];
+        path[i] = 0;
+        EFI_STATUS st = fs_volume_mkdir(job->dst, path);
+        path[i] = c;
+        if (EFI_ERROR(st)) {
+            job->made[0] = 0;
+            job->failed++;
+            return -1;
+        }
+        job->dirs++;
+    }
+    mem_copy(job->made, dir_path, (n + 1) * sizeof(CHAR16));
+    return 0;
+}
+
+/* dir + '\' + name into out. Returns -1 if it does not fit. */
+static int path_join(CHAR16 *out, const CHAR16 *dir, const char *name) {
+    int i = 0;
+    while (dir[i]) {
+        if (i >= COPY_MAX_PATH - 1) return -1;
+        out[i] = dir[i];
+        i++;
+    }
+    if (i == 0 || out[i - 1] != L'\\') {
+        if (i >= COPY_MAX_PATH - 1) return -1;
+        out[i++] = L'\\';
+    }
+    for (int j = 0; name[j]; j++) {
+        if (i >= COPY_MAX_PATH - 1) return -1;
+        out[i++] = (CHAR16)(UINT8)name[j];
+    }
+    out[i] = 0;
+    return 0;
+}
+
+static int copy_walk(struct copy_job *job, const CHAR16 *src_path,
+                     const CHAR16 *dst_path, int depth) {
+    /* The root always exists; anything else is created first */
+    if (!(dst_path[0] == L'\\' && dst_path[1] == 0)) {
+        if (EFI_ERROR(fs_volume_mkdir(job->dst, dst_path))) {
+            job->failed++;
+            return -1;
+        }
+        job->dirs++;
+    }
+
+    struct fs_dir *d = fs_volume_opendir(job->src, src_path);
+    if (!d) {
+        job->failed++;
+        return -1;
+    }
+    struct dirlist list;
+    mem_set(&list, 0, sizeof(list));
+    struct fs_entry e;
+    int rc = 0, r;
+    while ((r = fs_readdir_next(d, &e)) > 0) {
+        if (dirlist_add_entry(&list, &e) != 0) {
+            r = -1;
+            break;
+        }
+    }
+    fs_closedir(d);
+    if (r < 0) {
+        job->failed++;
+        rc = -1;
+    }
+
+    CHAR16 *src = (CHAR16 *)mem_alloc(2 * COPY_MAX_PATH * sizeof(CHAR16));
+    if (!src) {
+        dirlist_free(&list);
+        job->failed++;
+        return -1;
+    }
+    CHAR16 *dst = src + COPY_MAX_PATH;
+
+    for (int i = 0; i < list.count; i++) {
+        const char *name = dirlist_name(&list, i);
+        if (path_join(src, src_path, name) != 0 ||
+            path_join(dst, dst_path, name) != 0) {
+            job->failed++;
+            rc = -1;
+            continue;
+        }
+        if (list.recs[i].is_dir) {
+            if (depth + 1 > COPY_MAX_DEPTH) {
+                job->failed++;
+                rc = -1;
+            } else if (copy_walk(job, src, dst, depth + 1) != 0) {
+                rc = -1;
+            }
+        } else if (copy_file(job, src, dst) != 0) {
+            rc = -1;
+        }
+    }
+
+    mem_free(src);
+    dirlist_free(&list);
+    return rc;
+}
+
+int copy_tree(struct copy_job *job, const CHAR16 *src_path,
+              const CHAR16 *dst_path) {
+    fs_volume_begin_batch(job->dst);
+    int rc = copy_walk(job, src_path, dst_path, 0);
+    if (fs_volume_commit_batch(job->dst) != 0) {
+        job->failed++;
+        rc = -1;
+    }
+    return rc;
+}
+
+/* ---- Sync ---- */
+
+/* One file as last copied: the source's size and time, the content
+   hash and the destination path (an offset into the pool) */
+struct sync_rec {
+    UINT64 size;
+    UINT64 hash;
+    UINT32 mtime;
+    UINT32 path;
+};
+
+/* Records on the destination, looked up by folded path */
+struct sync_index {
+    struct sync_rec *recs;
+    int    count;
+    int    cap;
+    char   *pool;
+    UINT32 pool_len;
+    UINT32 pool_cap;
+    int    *slots;          /* open addressing: record + 1, 0 = empty */
+    UINT32 nslots;          /* power of two, or 0 before index_build() */
+};
+
+struct sync_state {
+    struct copy_job *job;
+    const CHAR16 *index_path;
+    struct sync_index old;  /* as loaded */
+    struct sync_index cur;  /* what the destination holds now */
+};
+
+#define INDEX_HEADER "# survival sync index 1\n"
+
+/* An index larger than this is treated as damaged and ignored */
+#define INDEX_MAX_SIZE (64 * 1024 * 1024)
+
+static UINT8 fold(char c) {
+    if (c >= 'A' && c <= 'Z') c += 32;
+    return (UINT8)c;
+}
+
+static UINT32 path_hash(const char *p) {
+    UINT32 h = 2166136261u;
+    while (*p) h = (h ^ fold(*p++)) * 16777619u;
+    return h;
+}
+
+static int path_eq(const char *a, const char *b) {
+    while (*a && fold(*a) == fold(*b)) a++, b++;
+    return *a == *b;
+}
+
+static int index_add(struct sync_index *ix, const char *path, UINT64 size,
+                     UINT32 mtime, UINT64 hash) {
+    if (ix->count == ix->cap) {
+        int cap = ix->cap ? ix->cap * 2 : 256;
+        struct sync_rec *r = (struct sync_rec *)mem_alloc_raw(
+            (UINTN)cap * sizeof(struct sync_rec));
+        if (!r) return -1;
+        if (ix->recs) {
+            mem_copy(r, ix->recs, (UINTN)ix->count * sizeof(struct sync_rec));
+            mem_free(ix->recs);
+        }
+        ix->recs = r;
+        ix->cap = cap;
+    }
+    UINT32 len = (UINT32)str_len((CHAR8 *)path) + 1;
+    if (ix->pool_len + len > ix->pool_cap) {
+        UINT32 cap = ix->pool_cap ? ix->pool_cap : 16384;
+        while (ix->pool_len + len > cap) cap *= 2;
+        char *p = (char *)mem_alloc_raw(cap);
+        if (!p) return -1;
+        if (ix->pool) {
+            mem_copy(p, ix->pool, ix->pool_len);
+            mem_free(ix->pool);
+        }
+        ix->pool = p;
+        ix->pool_cap = cap;
+    }
+    struct sync_rec *r = &ix->recs[ix->count++];
+    r->size = size;
+    r->hash = hash;
+    r->mtime = mtime;
+    r->path = ix->pool_len;
+    mem_copy(ix->pool + ix->pool_len, path, len);
+    ix->pool_len += len;
+    return 0;
+}
+
+/* Hash the records for index_find(). On failure lookups find nothing,
+   which only costs copies. */
+static void index_build(struct sync_index *ix) {
+    UINT32 n = 64;
+    while (n < (UINT32)ix->count * 2) n *= 2;
+    ix->slots = (int *)mem_alloc(n * sizeof(int));
+    if (!ix->slots) return;
+    ix->nslots = n;
+    for (int i = 0; i < ix->count; i++) {
+        UINT32 s = path_hash(ix->pool + ix->recs[i].path) & (n - 1);
+        while (ix->slots[s]) s = (s + 1) & (n - 1);
+        ix->slots[s] = i + 1;
+    }
+}
+
+static const struct sync_rec *index_find(const struct sync_index *ix,
+                                         const char *path) {
+    if (!ix->nslots) return NULL;
+    UINT32 s = path_hash(path) & (ix->nslots - 1);
+    while (ix->slots[s]) {
+        const struct sync_rec *r = &ix->recs[ix->slots[s] - 1];
+        if (path_eq(ix->pool + r->path, path)) return r;
+        s = (s + 1) & (ix->nslots - 1);
+    }
+    return NULL;
+}
+
+static void index_free(struct sync_index *ix) {
+    if (ix->recs) mem_free(ix->recs);
+    if (ix->pool) mem_free(ix->pool);
+    if (ix->slots) mem_free(ix->slots);
+    mem_set(ix, 0, sizeof(*ix));
+}
+
+/* Read the index left by the last sync. A missing or damaged one
+   leaves ix empty, so every file is compared the slow way. */
+static void index_load(struct sync_state *st) {
+    UINT64 size = 0;
+    struct fs_file *f = fs_volume_open_read(st->job->dst, st->index_path,
+                                            &size);
+    if (!f) return;
+    char *text = size <= INDEX_MAX_SIZE
+                 ? (char *)mem_alloc_raw((UINTN)size + 1) : NULL;
+    UINTN got = 0;
+    while (text && got < size) {
+        UINTN n = (UINTN)size - got;
+        if (fs_stream_read(f, text + got, &n) != 0 || n == 0) break;
+        got += n;
+    }
+    fs_stream_close(f);
+    if (!text) return;
+    text[got] = '\0';
+
+    UINTN hl = sizeof(INDEX_HEADER) - 1;
+    if (got < hl || mem_cmp(text, INDEX_HEADER, hl) != 0) {
+        mem_free(text);
+        return;
+    }
+
+    /* "<size> <time> <hash> <path>" per line, the numbers in hex */
+    char *p = text + hl;
+    while (*p) {
+        char *end, *nl = p;
+        while (*nl && *nl != '\n') nl++;
+        if (*nl) *nl++ = '\0';
+        UINT64 fsize = strtoull(p, &end, 16);
+        UINT32 mtime = (UINT32)strtoull(end, &end, 16);
+        UINT64 hash = strtoull(end, &end, 16);
+        if (*end == ' ' && end[1] == '\\' &&
+            index_add(&st->old, end + 1, fsize, mtime, hash) != 0)
+            break;
+        p = nl;
+    }
+    mem_free(text);
+    index_build(&st->old);
+}
+
+static int index_save(struct sync_state *st) {
+    struct copy_job *job = st->job;
+    struct fs_file *f = fs_volume_open_write(job->dst, st->index_path);
+    if (!f) return -1;
+
+    /* Lines are gathered in the transfer buffer */
+    UINTN used = sizeof(INDEX_HEADER) - 1;
+    mem_copy(job->buf, INDEX_HEADER, used);
+    int rc = 0;
+    for (int i = 0; i < st->cur.count && rc == 0; i++) {
+        const struct sync_rec *r = &st->cur.recs[i];
+        if (job->buf_size - used < COPY_MAX_PATH + 64) {
+            rc = fs_stream_write(f, job->buf, used);
+            used = 0;
+        }
+        used += (UINTN)snprintf((char *)job->buf + used, job->buf_size - used,
+                                "%llx %x %llx %s\n",
+                                (unsigned long long)r->size,
+                                (unsigned)r->mtime,
+                                (unsigned long long)r->hash,
+                                st->cur.pool + r->path);
+    }
+    if (rc == 0 && used) rc = fs_stream_write(f, job->buf, used);
+    if (fs_stream_close(f) != 0) rc = -1;
+    return rc;
+}
+
+static void path_key(char *out, const CHAR16 *path) {
+    int i = 0;
+    for (; path[i] && i < COPY_MAX_PATH - 1; i++)
+        out[i] = (char)(path[i] & 0x7F);
+    out[i] = '\0';
+}
+
+static int path_is(const CHAR16 *a, const CHAR16 *b) {
+    while (*a && *b && fold((char)(*a & 0x7F)) == fold((char)(*b & 0x7F)))
+        a++, b++;
+    return *a == *b;
+}
+
+/* Content hash of a file on one side of the job */
+static int hash_file(struct copy_job *job, struct fs_volume *v,
+                     const CHAR16 *path, UINT64 *hash) {
+    UINT64 size = 0;
+    struct fs_file *f = fs_volume_open_read(v, path, &size);
+    if (!f) return -1;
+    *hash = HASH_SEED;
+    UINT64 done = 0;
+    int rc = 0;
+    while (done < size) {
+        UINTN n = job->buf_size;
+        if ((UINT64)n > size - done) n = (UINTN)(size - done);
+        if (fs_stream_read(f, job->buf, &n) != 0 || n == 0) {
+            rc = -1;
+            break;
+        }
+        *hash = hash_mix(*hash, job->buf, n);
+        done += n;
+    }
+    fs_stream_close(f);
+    return rc;
+}
+
+static int list_dir(struct fs_volume *v, const CHAR16 *path,
+                    struct dirlist *list) {
+    struct fs_dir *d = fs_volume_opendir(v, path);
+    if (!d) return -1;
+    struct fs_entry e;
+    int r;
+    while ((r = fs_readdir_next(d, &e)) > 0)
+        if (dirlist_add_entry(list, &e) != 0) {
+            r = -1;
+            break;
+        }
+    fs_closedir(d);
+    if (r < 0) return -1;
+    dirlist_sort(list, 0, list->count);
+    return 0;
+}
+
+/* Remove a destination entry and, for a directory, all below it */
+static int delete_tree(struct copy_job *job, const CHAR16 *path, int is_dir,
+                       int depth) {
+    int rc = 0;
+    if (is_dir) {
+        struct dirlist list;
+        mem_set(&list, 0, sizeof(list));
+        CHAR16 *sub = (CHAR16 *)mem_alloc(COPY_MAX_PATH * sizeof(CHAR16));
+        if (!sub || depth > COPY_MAX_DEPTH ||
+            list_dir(job->dst, path, &list) != 0) {
+            if (sub) mem_free(sub);
+            dirlist_free(&list);
+            job->failed++;
+            return -1;
+        }
+        for (int i = 0; i < list.count; i++) {
+            if (path_join(sub, path, dirlist_name(&list, i)) != 0 ||
+                delete_tree(job, sub, (int)list.recs[i].is_dir,
+                            depth + 1) != 0)
+                rc = -1;
+        }
+        mem_free(sub);
+        dirlist_free(&list);
+        if (rc != 0) return -1;
+    }
+    if (EFI_ERROR(fs_volume_delete(job->dst, path))) {
+        job->failed++;
+        return -1;
+    }
+    job->deleted++;
+    return 0;
+}
+
+int copy_delete(struct copy_job *job, const CHAR16 *path, int is_dir) {
+    return delete_tree(job, path, is_dir, 0);
+}
+
+/* Order of the merged listings: directories first, then by name */
+static int rec_cmp(const struct dirlist *a, int i,
+                   const struct dirlist *b, int j) {
+    if (a->recs[i].is_dir != b->recs[j].is_dir)
+        return a->recs[i].is_dir ? -1 : 1;
+    return dirsort_name_cmp(dirlist_name(a, i), dirlist_name(b, j));
+}
+
+/* Bring one file up to date; d is its destination entry or -1 */
+static int sync_file(struct sync_state *st, const CHAR16 *src_path,
+                     const CHAR16 *dst_path, const struct dirlist *sl, int s,
+                     const struct dirlist *dl, int d) {
+    struct copy_job *job = st->job;
+    UINT64 size = sl->recs[s].size;
+    UINT32 mtime = sl->recs[s].mtime;
+    char key[COPY_MAX_PATH];
+    path_key(key, dst_path);
+
+    if (d >= 0 && dl->recs[d].size == size) {
+        const struct sync_rec *r = index_find(&st->old, key);
+        if (r && r->size == size && mtime && r->mtime == mtime) {
+            job->skipped++;
+            return index_add(&st->cur, key, size, mtime, r->hash);
+        }
+        if (job->flags & COPY_VERIFY) {
+            UINT64 h, dh;
+            if (hash_file(job, job->src, src_path, &h) == 0 &&
+                ((r && r->size == size && r->hash == h) ||
+                 (hash_file(job, job->dst, dst_path, &dh) == 0 && dh == h))) {
+                job->skipped++;
+                return index_add(&st->cur, key, size, mtime, h);
+            }
+        }
+    }
+
+    UINT64 hash;
+    if (copy_stream(job, src_path, dst_path, &hash) != 0) return -1;
+    return index_add(&st->cur, key, size, mtime, hash);
+}
+
+static int sync_walk(struct sync_state *st, const CHAR16 *src_path,
+                     const CHAR16 *dst_path, int depth) {
+    struct copy_job *job = st->job;
+    struct dirlist sl, dl;
+    mem_set(&sl, 0, sizeof(sl));
+    mem_set(&dl, 0, sizeof(dl));
+    int rc = 0;
+
+    CHAR16 *src = (CHAR16 *)mem_alloc(2 * COPY_MAX_PATH * sizeof(CHAR16));
+    if (!src || list_dir(job->src, src_path, &sl) != 0 ||
+        list_dir(job->dst, dst_path, &dl) != 0) {
+        job->failed++;
+        rc = -1;
+        goto out;
+    }
+    CHAR16 *dst = src + COPY_MAX_PATH;
+
+    /* match[i]: destination entry for source entry i, -1 for none;
+       taken[j]: destination entry j has a source entry */
+    int *match = (int *)mem_alloc((UINTN)(sl.count + dl.count + 1) * sizeof(int));
+    if (!match) {
+        job->failed++;
+        rc = -1;
+        goto out;
+    }
+    int *taken = match + sl.count;
+    for (int i = 0; i < sl.count; i++) match[i] = -1;
+    for (int i = 0, j = 0; i < sl.count && j < dl.count; ) {
+        int c = rec_cmp(&sl, i, &dl, j);
+        if (c == 0) {
+            match[i] = j;
+            taken[j] = 1;
+            i++, j++;
+        } else if (c < 0) {
+            i++;
+        } else {
+            j++;
+        }
+    }
+
+    /* Deletions first: a name may come back as the other kind */
+    for (int j = 0; j < dl.count; j++) {
+        if (taken[j]) continue;
+        if (path_join(dst, dst_path, dirlist_name(&dl, j)) != 0) {
+            job->failed++;
+            rc = -1;
+        } else if (!path_is(dst, st->index_path) &&
+                   delete_tree(job, dst, (int)dl.recs[j].is_dir, depth) != 0) {
+            rc = -1;
+        }
+    }
+
+    /* Then every missing subdirectory, before any file data */
+    for (int i = 0; i < sl.count && sl.recs[i].is_dir; i++) {
+        if (match[i] >= 0) continue;
+        if (path_join(dst, dst_path, dirlist_name(&sl, i)) != 0 ||
+            EFI_ERROR(fs_volume_mkdir(job->dst, dst))) {
+            match[i] = -2;
+            job->failed++;
+            rc = -1;
+        } else {
+            job->dirs++;
+        }
+    }
+
+    for (int i = 0; i < sl.count; i++) {
+        if (sl.recs[i].is_dir) continue;
+        if (path_join(src, src_path, dirlist_name(&sl, i)) != 0 ||
+            path_join(dst, dst_path, dirlist_name(&sl, i)) != 0) {
+            job->failed++;
+            rc = -1;
+        } else if (path_is(dst, st->index_path)) {
+            continue;
+        } else if (sync_file(st, src, dst, &sl, i, &dl, match[i]) != 0) {
+            rc = -1;
+        }
+    }
+
+    for (int i = 0; i < sl.count && sl.recs[i].is_dir; i++) {
+        if (match[i] == -2) continue;
+        if (depth + 1 > COPY_MAX_DEPTH ||
+            path_join(src, src_path, dirlist_name(&sl, i)) != 0 ||
+            path_join(dst, dst_path, dirlist_name(&sl, i)) != 0) {
+            job->failed++;
+            rc = -1;
+        } else if (sync_walk(st, src, dst, depth + 1) != 0) {
+            rc = -1;
+        }
+    }
+    mem_free(match);
+
+out:
+    if (src) mem_free(src);
+    dirlist_free(&sl);
+    dirlist_free(&dl);
+    return rc;
+}
+
+int copy_sync(struct copy_job *job, const CHAR16 *src_path,
+              const CHAR16 *dst_path, const CHAR16 *index_path) {
+    struct sync_state st;
+    mem_set(&st, 0, sizeof(st));
+    st.job = job;
+    st.index_path = index_path;
+    if (copy_buffer(job) != 0) {
+        job->failed++;
+        return -1;
+    }
+
+    index_load(&st);
+    fs_volume_begin_batch(job->dst);
+    int rc = sync_walk(&st, src_path, dst_path, 0);
+    if (index_save(&st) != 0) {
+        job->failed++;
+        rc = -1;
+    }
+    if (fs_volume_commit_batch(job->dst) != 0) {
+        job->failed++;
+        rc = -1;
+    }
+    index_free(&st.old);
+    index_free(&st.cur);
+    return rc;
+}
@@ -0,0 +1,115 @@
+/*
+ * copy.h — Streaming copies of files and directory trees between volumes
+ *
+ * Source and destination are fs_volume handles, so a copy can go from
+ * any volume to any writable one (exFAT to FAT32, SFS to exFAT, NTFS
+ * to anything) without switching the current volume.  File data moves
+ * in large chunks through one buffer, and on a BlockIO2 destination the
+ * last chunk's writes stay in flight while the next is read; nothing is
+ * read whole.
+ */
+#ifndef COPY_H
+#define COPY_H
+
+#include "fs.h"
+
+/* Nesting below the starting directory that copy_tree() follows */
+#define COPY_MAX_DEPTH 32
+
+/* Longest path (in CHAR16 units, with the NUL) built during a walk */
+#define COPY_MAX_PATH  512
+
+/* copy_sync() flags */
+#define COPY_VERIFY 1   /* compare contents where size and time cannot decide */
+
+struct copy_job;
+
+/* Called when a file starts and after every chunk: path is the
+   destination, done/size the progress within it */
+typedef void (*copy_progress_fn)(struct copy_job *job, const CHAR16 *path,
+                                 UINT64 done, UINT64 size);
+
+struct copy_job {
+    struct fs_volume *src;
+    struct fs_volume *dst;
+    copy_progress_fn progress;      /* NULL for none */
+    void *ctx;                      /* for the callback */
+    UINT32 flags;                   /* COPY_VERIFY */
+
+    /* Totals so far */
+    UINT64 bytes;                   /* file data written */
+    UINT32 files;                   /* files copied */
+    UINT32 dirs;                    /* directories created */
+    UINT32 failed;                  /* files or directories not copied */
+    UINT32 skipped;                 /* files already up to date */
+    UINT32 deleted;                 /* destination entries removed */
+    UINT64 ns;                      /* time spent moving data */
+
+    UINT8 *buf;
+    UINTN buf_size;
+    int behind;                     /* dst has write-behind on for the job */
+
+    /* The file copy_open() started */
+    struct fs_file *out;
+    UINTN out_len;                  /* bytes of it waiting in buf */
+    UINT64 out_done, out_size;
+    CHAR16 out_path[COPY_MAX_PATH];
+
+    CHAR16 made[COPY_MAX_PATH];     /* the directory copy_mkdirs() made last */
+};
+
+/* Set up a job. Zero-initialize anything not passed here. */
+void copy_init(struct copy_job *job, struct fs_volume *src,
+               struct fs_volume *dst);
+
+/* Copy one file, replacing dst_path. A partial destination is deleted.
+   Returns 0 on success, -1 on error. */
+int copy_file(struct copy_job *job, const CHAR16 *src_path,
+              const CHAR16 *dst_path);
+
+/* Write a file from data that arrives piece by piece, as an archive
+   unpacks: copy_open() replaces dst_path, copy_write() gathers the
+   pieces into the job's buffer and writes it when full, copy_close()
+   writes the rest, or with ok 0 deletes what was written. size is for
+   the progress callback and reserves the file's room up front
+   (fs_stream_preallocate()); 0 if not known. Each returns 0 or -1, and a
+   file that fails is counted in job->failed once closed. */
+int copy_open(struct copy_job *job, const CHAR16 *dst_path, UINT64 size);
+int copy_write(struct copy_job *job, const void *data, UINTN len);
+int copy_close(struct copy_job *job, int ok);
+
+/* Create dir_path and the directories above it. Those shared with the
+   previous call's path are taken as made, so a run of files for one
+   directory costs no directory calls after the first. Returns 0 or -1. */
+int copy_mkdirs(struct copy_job *job, const CHAR16 *dir_path);
+
+/* Copy a directory and everything below it to dst_path (created as
+   needed). Entries that fail are counted in job->failed and skipped.
+   The destination's metadata is written back once, at the end (see
+   fs_volume_begin_batch()). Returns 0 if everything was copied, -1
+   otherwise. */
+int copy_tree(struct copy_job *job, const CHAR16 *src_path,
+              const CHAR16 *dst_path);
+
+/* Delete path on the destination volume, a directory with everything
+   below it, counted in job->deleted (or job->failed). Inside a batch
+   the metadata is written back at its commit, so a run of deletes
+   costs one write-back. Returns 0 if all of it went, -1 otherwise. */
+int copy_delete(struct copy_job *job, const CHAR16 *path, int is_dir);
+
+/* Make dst_path a copy of src_path: copy new and changed files, create
+   missing directories and delete what src_path no longer has. Each file
+   copied is recorded in index_path on the destination with its source
+   size and time, so the next run skips unchanged files without reading
+   them. Batched like copy_tree(). Returns 0 if everything is in sync,
+   -1 otherwise. */
+int copy_sync(struct copy_job *job, const CHAR16 *src_path,
+              const CHAR16 *dst_path, const CHAR16 *index_path);
+
+/* Throughput so far in tenths of a MB (10^6 bytes) per second */
+UINT32 copy_rate(const struct copy_job *job);
+
+/* Free the job's buffer */
+void copy_done(struct copy_job *job);
+
+#endif /* COPY_H */
@@ -0,0 +1,174 @@
+/*
+ * cpu.c — What the CPU can do, read once at boot
+ *
+ * See cpu.h. The register reads are in memops_<arch>, beside the
+ * kernels they decide on; this only decodes the bits. A feature is
+ * reported only when everything its kernel needs is there, so a
+ * caller can go by a single flag.
+ */
+
+#include "cpu.h"
+#include "mem.h"
+#include "shim.h"
+
+static struct cpu_info s_cpu;
+
+struct cpu_name {
+    UINT32 feature;
+    const char *name;
+};
+
+#ifdef __x86_64__
+
+void   cpu_cpuid(UINT32 leaf, UINT32 sub, UINT32 regs[4]);
+UINT64 cpu_xgetbv(UINT32 xcr);
+
+#define EAX 0
+#define EBX 1
+#define ECX 2
+#define EDX 3
+
+static const struct cpu_name s_names[] = {
+    { CPU_SIMD,   "SSE2" },
+    { CPU_CRC32C, "SSE4.2" },
+    { CPU_POPCNT, "POPCNT" },
+    { CPU_AES,    "AES-NI" },
+    { CPU_SHA256, "SHA" },
+    { CPU_AVX2,   "AVX2" },
+};
+
+static void cpu_probe(struct cpu_info *c) {
+    UINT32 r[4];
+    cpu_cpuid(0, 0, r);
+    UINT32 max = r[EAX];
+    char vendor[13];
+    mem_copy(vendor, &r[EBX], 4);
+    mem_copy(vendor + 4, &r[EDX], 4);
+    mem_copy(vendor + 8, &r[ECX], 4);
+    vendor[12] = '\0';
+
+    cpu_cpuid(1, 0, r);
+    UINT32 ecx1 = r[ECX], edx1 = r[EDX];
+    if (edx1 & (1u << 26)) c->features |= CPU_SIMD;
+    if (ecx1 & (1u << 20)) c->features |= CPU_CRC32C;
+    if (ecx1 & (1u << 23)) c->features |= CPU_POPCNT;
+    if (ecx1 & (1u << 25)) c->features |= CPU_AES;
+
+    /* AVX registers are usable only once the firmware has turned on
+       their state in XCR0 (SSE and YMM bits), which not all do */
+    int ymm = (ecx1 & (1u << 27)) && (cpu_xgetbv(0) & 6) == 6;
+    if (max >= 7) {
+        cpu_cpuid(7, 0, r);
+        /* The SHA kernel also shuffles with SSSE3 and SSE4.1 */
+        if ((r[EBX] & (1u << 29)) && (ecx1 & 0x80200) == 0x80200)
+            c->features |= CPU_SHA256;
+        if (ymm && (r[EBX] & (1u << 5)))
+            c->features |= CPU_AVX2;
+    }
+
+    cpu_cpuid(0x80000000, 0, r);
+    if (r[EAX] >= 0x80000004) {
+        char brand[48];
+        for (UINT32 i = 0; i < 3; i++)
+            cpu_cpuid(0x80000002 + i, 0, (UINT32 *)(brand + i * 16));
+        UINT32 at = 0, n = 0;
+        while (at < 48 && brand[at] == ' ') at++;
+        while (at < 48 && brand[at]) c->name[n++] = brand[at++];
+        while (n && c->name[n - 1] == ' ') n--;
+        c->name[n] = '\0';
+    }
+    if (!c->name[0])
+        mem_copy(c->name, vendor, sizeof(vendor));
+}
+
+#elif defined(__aarch64__)
+
+UINT64 cpu_id_pfr0(void);
+UINT64 cpu_id_isar0(void);
+UINT64 cpu_id_midr(void);
+
+static const struct cpu_name s_names[] = {
+    { CPU_SIMD,    "AdvSIMD" },
+    { CPU_CRC32C,  "CRC32" },
+    { CPU_AES,     "AES" },
+    { CPU_SHA256,  "SHA2" },
+    { CPU_ATOMICS, "LSE" },
+};
+
+/* Arm's own cores by MIDR part number, the ones boards ship with */
+static const struct { UINT16 part; const char *name; } s_arm_cores[] = {
+    { 0xD03, "Cortex-A53" }, { 0xD04, "Cortex-A35" },
+    { 0xD05, "Cortex-A55" }, { 0xD07, "Cortex-A57" },
+    { 0xD08, "Cortex-A72" }, { 0xD09, "Cortex-A73" },
+    { 0xD0A, "Cortex-A75" }, { 0xD0B, "Cortex-A76" },
+    { 0xD0C, "Neoverse-N1" }, { 0xD0D, "Cortex-A77" },
+    { 0xD40, "Neoverse-V1" }, { 0xD41, "Cortex-A78" },
+    { 0xD46, "Cortex-A510" }, { 0xD47, "Cortex-A710" },
+    { 0xD49, "Neoverse-N2" }, { 0xD4F, "Neoverse-V2" },
+};
+
+static UINT32 id_field(UINT64 reg, int shift) {
+    return (UINT32)(reg >> shift) & 0xF;
+}
+
+static void cpu_probe(struct cpu_info *c) {
+    UINT64 pfr0 = cpu_id_pfr0(), isar0 = cpu_id_isar0();
+    /* AdvSIMD 0xF is "not implemented"; cnt is part of it */
+    if (id_field(pfr0, 20) != 0xF)
+        c->features |= CPU_SIMD | CPU_POPCNT;
+    if (id_field(isar0, 4))  c->features |= CPU_AES;
+    if (id_field(isar0, 12)) c->features |= CPU_SHA256;
+    if (id_field(isar0, 16)) c->features |= CPU_CRC32C;
+    if (id_field(isar0, 20) >= 2) c->features |= CPU_ATOMICS;
+
+    UINT64 midr = cpu_id_midr();
+    UINT32 impl = (UINT32)(midr >> 24) & 0xFF;
+    UINT32 part = (UINT32)(midr >> 4) & 0xFFF;
+    if (impl == 0x41)
+        for (UINTN i = 0; i < sizeof(s_arm_cores) / sizeof(s_arm_cores[0]); i++)
+            if (s_arm_cores[i].part == part) {
+                snprintf(c->name, sizeof(c->name), "Arm %s r%up%u",
+                         s_arm_cores[i].name, (unsigned)id_field(midr, 20),
+                         (unsigned)id_field(midr, 0));
+                return;
+            }
+    snprintf(c->name, sizeof(c->name), "implementer 0x%02x part 0x%03x",
+             (unsigned)impl, (unsigned)part);
+}
+
+#else
+
+static const struct cpu_name s_names[] = { { 0, "" } };
+
+static void cpu_probe(struct cpu_info *c) {
+    (void)c;
+}
+
+#endif
+
+void cpu_init(void) {
+    mem_set(&s_cpu, 0, sizeof(s_cpu));
+    cpu_probe(&s_cpu);
+}
+
+const struct cpu_info *cpu_get(void) {
+    return &s_cpu;
+}
+
+int cpu_has(UINT32 features) {
+    return (s_cpu.features & features) == features;
+}
+
+void cpu_feature_names(char *buf, UINTN size) {
+    UINTN n = 0;
+    if (!size) return;
+    buf[0] = '\0';
+    for (UINTN i = 0; i < sizeof(s_names) / sizeof(s_names[0]); i++) {
+        if (!s_names[i].feature || !(s_cpu.features & s_names[i].feature))
+            continue;
+        int w = snprintf(buf + n, size - n, "%s%s", n ? " " : "",
+                         s_names[i].name);
+        if (w < 0 || (UINTN)w >= size - n) break;
+        n += (UINTN)w;
+    }
+}
@@ -0,0 +1,40 @@
+/*
+ * cpu.h — What the CPU can do, read once at boot
+ *
+ * cpu_init() reads CPUID (and XGETBV for the AVX state) on x86_64 and
+ * ID_AA64PFR0_EL1, ID_AA64ISAR0_EL1 and MIDR_EL1 on AArch64, before
+ * anything picks a kernel. mem.c, hash.c and vec.c then choose their
+ * memops_<arch> kernels from cpu_has() rather than probing for
+ * themselves, and the banner lists what was found. Until cpu_init()
+ * has run nothing is reported, so every caller stays on plain C.
+ */
+#ifndef CPU_H
+#define CPU_H
+
+#include "boot.h"
+
+/* Features the kernels use, or worth knowing about */
+#define CPU_SIMD    0x01    /* SSE2 / AdvSIMD: copy, fill, find, vec_* */
+#define CPU_CRC32C  0x02    /* SSE4.2 crc32 / ARMv8 CRC32 (both polys) */
+#define CPU_SHA256  0x04    /* SHA-NI with SSSE3 and SSE4.1 / ARMv8 SHA2 */
+#define CPU_POPCNT  0x08    /* POPCNT / AdvSIMD cnt */
+#define CPU_AES     0x10    /* AES-NI / ARMv8 AES */
+#define CPU_AVX2    0x20    /* AVX2 with the YMM state enabled */
+#define CPU_ATOMICS 0x40    /* ARMv8.1 LSE atomics; x86 always has lock */
+
+struct cpu_info {
+    UINT32 features;        /* CPU_* */
+    char   name[49];        /* brand string or core name, "" unknown */
+};
+
+void cpu_init(void);
+const struct cpu_info *cpu_get(void);
+
+/* Nonzero if the CPU has every one of the features */
+int cpu_has(UINT32 features);
+
+/* The features found, by this architecture's names ("SSE2 SSE4.2
+   POPCNT ..."), space separated into buf */
+void cpu_feature_names(char *buf, UINTN size);
+
+#endif /* CPU_H */
@@ -0,0 +1,485 @@
+/*
+ * deflate.c — DEFLATE compression (RFC 1951) for .tar.gz archives
+ *
+ * See deflate.h. Positions are counted from the start of the history,
+ * so the hash chains cover it like the piece itself. Chain links are
+ * kept for the last 32 KB of positions only; a link that has been
+ * written over points forward and ends the walk. Symbols collect in a
+ * token buffer; when it fills, the run is sent as one block under the
+ * cheapest coding, with Huffman code lengths from Moffat and
+ * Katajainen's in-place method, limited to 15 bits (7 for the code
+ * length code) the way miniz does it.
+ */
+
+#include "deflate.h"
+#include "mem.h"
+
+#define HASH_LOG   15
+#define WMASK      (DEFLATE_WINDOW - 1)
+#define MIN_MATCH  4
+#define MAX_MATCH  258
+#define NICE_MATCH 128          /* long enough to stop looking */
+#define MAX_CHAIN  24           /* candidates tried per position */
+#define TOKENS     16384        /* symbols per block */
+#define LIT_SYMS   286
+#define DIST_SYMS  30
+#define CL_SYMS    19
+#define MAX_BITS   15
+#define CL_BITS    7
+
+static const UINT16 LEN_BASE[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const UINT8 LEN_EXTRA[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const UINT16 DIST_BASE[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+    8193, 12289, 16385, 24577
+};
+static const UINT8 DIST_EXTRA[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+/* Order the code length code lengths are sent in */
+static const UINT8 CLEN_ORDER[19] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+/* Laid over the caller's scratch */
+struct dfl {
+    UINT32 head[1 << HASH_LOG];     /* latest position + 1 with each hash */
+    UINT32 prev[DEFLATE_WINDOW];    /* the one before it with the same hash */
+    UINT32 tok[TOKENS];             /* a literal, or length << 16 | distance */
+    UINT32 ntok;
+
+    UINT32 lfreq[LIT_SYMS], dfreq[DIST_SYMS], cfreq[CL_SYMS];
+    UINT8  llen[288], dlen[DIST_SYMS], clen[CL_SYMS];  /* 288: the fixed code */
+    UINT16 lcode[288], dcode[DIST_SYMS], ccode[CL_SYMS];
+    UINT8  lens[LIT_SYMS + DIST_SYMS];  /* both code lengths, as sent */
+    UINT16 rle[LIT_SYMS + DIST_SYMS];   /* code length symbol | extra << 5 */
+    UINT32 nrle;
+    UINT32 sym[LIT_SYMS], key[LIT_SYMS];
+
+    UINT8  len_code[MAX_MATCH + 1];     /* match length -> length code */
+    UINT8  dist_code[512];              /* see dist_sym() */
+
+    UINT8  *op, *oend;
+    UINT64 bits;                        /* not yet written; LSB first */
+    UINT32 nbits;
+    int    over;                        /* ran out of room */
+};
+
+static UINT32 rd32(const UINT8 *p) {
+    return (UINT32)p[0] | (UINT32)p[1] << 8 | (UINT32)p[2] << 16 |
+           (UINT32)p[3] << 24;
+}
+
+static UINT32 hash4(const UINT8 *p) {
+    return (rd32(p) * 2654435761u) >> (32 - HASH_LOG);
+}
+
+/* Distances up to 256 by value, longer ones by their top bits, where
+   each code covers whole 128-distance steps */
+static UINT32 dist_sym(const struct dfl *d, UINT32 dist) {
+    return d->dist_code[dist <= 256 ? dist - 1 : 256 + ((dist - 1) >> 7)];
+}
+
+static void setup(struct dfl *d, void *dst, UINTN cap) {
+    for (UINT32 c = 0; c < 29; c++)
+        for (UINT32 l = LEN_BASE[c]; l < LEN_BASE[c] + (1u << LEN_EXTRA[c]) &&
+             l <= MAX_MATCH; l++)
+            d->len_code[l] = (UINT8)c;
+    for (UINT32 c = 0; c < 30; c++)
+        for (UINT32 k = DIST_BASE[c]; k < DIST_BASE[c] + (1u << DIST_EXTRA[c]); k++)
+            d->dist_code[k <= 256 ? k - 1 : 256 + ((k - 1) >> 7)] = (UINT8)c;
+
+    mem_set(d->head, 0, sizeof(d->head));
+    mem_set(d->lfreq, 0, sizeof(d->lfreq));
+    mem_set(d->dfreq, 0, sizeof(d->dfreq));
+    d->ntok = 0;
+    d->op = (UINT8 *)dst;
+    d->oend = d->op + cap;
+    d->bits = 0;
+    d->nbits = 0;
+    d->over = 0;
+}
+
+/* ---- Bits ---- */
+
+static void put_bits(struct dfl *d, UINT32 v, UINT32 n) {
+    d->bits |= (UINT64)v << d->nbits;
+    d->nbits += n;
+    if (d->nbits < 32) return;
+    if (d->oend - d->op >= 4) {
+        for (int i = 0; i < 4; i++) *d->op++ = (UINT8)(d->bits >> (8 * i));
+    } else {
+        d->over = 1;
+    }
+    d->bits >>= 32;
+    d->nbits -= 32;
+}
+
+/* Pad to a byte boundary and write out all that is held */
+static void align(struct dfl *d) {
+    put_bits(d, 0, (8 - d->nbits % 8) % 8);
+    for (; d->nbits; d->nbits -= 8, d->bits >>= 8) {
+        if (d->op < d->oend) *d->op++ = (UINT8)d->bits;
+        else d->over = 1;
+    }
+}
+
+/* After align() */
+static void put_bytes(struct dfl *d, const UINT8 *p, UINTN n) {
+    if ((UINTN)(d->oend - d->op) < n) {
+        d->over = 1;
+        return;
+    }
+    mem_copy(d->op, p, n);
+    d->op += n;
+}
+
+/* ---- Huffman codes ---- */
+
+/* Moffat and Katajainen: a[0..n) holds weights in ascending order and
+   is left holding the code lengths, longest first */
+static void min_redundancy(UINT32 *a, int n) {
+    if (n == 1) {
+        a[0] = 1;
+        return;
+    }
+    int root = 0, leaf = 2, next;
+    a[0] += a[1];
+    for (next = 1; next < n - 1; next++) {
+        if (leaf >= n || a[root] < a[leaf]) {
+            a[next] = a[root];
+            a[root++] = (UINT32)next;
+        } else {
+            a[next] = a[leaf++];
+        }
+        if (leaf >= n || (root < next && a[root] < a[leaf])) {
+            a[next] += a[root];
+            a[root++] = (UINT32)next;
+        } else {
+            a[next] += a[leaf++];
+        }
+    }
+    a[n - 2] = 0;
+    for (next = n - 3; next >= 0; next--) a[next] = a[a[next]] + 1;
+
+    int avail = 1, used = 0;
+    UINT32 depth = 0;
+    root = n - 2;
+    next = n - 1;
+    while (avail > 0) {
+        while (root >= 0 && a[root] == depth) { used++; root--; }
+        while (avail > used) { a[next--] = depth; avail--; }
+        avail = 2 * used;
+        depth++;
+        used = 0;
+    }
+}
+
+/* A tree needs two leaves; pad with unused symbols that cost nothing
+   but a code length */
+static void two_symbols(UINT32 *freq, int n) {
+    int used = 0;
+    for (int i = 0; i < n; i++) used += freq[i] != 0;
+    for (int i = 0; used < 2 && i < n; i++)
+        if (!freq[i]) { freq[i] = 1; used++; }
+}
+
+/* Code lengths for n symbols, none over max_bits */
+static void lengths(struct dfl *d, const UINT32 *freq, int n, UINT8 *len,
+                    UINT32 max_bits) {
+    int m = 0;
+    for (int i = 0; i < n; i++) {
+        len[i] = 0;
+        if (!freq[i]) continue;
+        /* Insertion sort by weight; the alphabets are small */
+        int j = m++;
+        for (; j > 0 && freq[d->sym[j - 1]] > freq[i]; j--) d->sym[j] = d->sym[j - 1];
+        d->sym[j] = (UINT32)i;
+    }
+    for (int k = 0; k < m; k++) d->key[k] = freq[d->sym[k]];
+    min_redundancy(d->key, m);
+
+    /* Fold anything too long into max_bits, then take codes back from
+       the longest lengths below it until the tree is complete again */
+    UINT32 count[33];
+    mem_set(count, 0, sizeof(count));
+    for (int k = 0; k < m; k++) count[d->key[k] > 32 ? 32 : d->key[k]]++;
+    for (UINT32 l = max_bits + 1; l <= 32; l++) {
+        count[max_bits] += count[l];
+        count[l] = 0;
+    }
+    UINT32 total = 0;
+    for (UINT32 l = max_bits; l > 0; l--) total += count[l] << (max_bits - l);
+    while (total != (1u << max_bits)) {
+        count[max_bits]--;
+        for (UINT32 l = max_bits - 1; l > 0; l--) {
+            if (count[l]) {
+                count[l]--;
+                count[l + 1] += 2;
+                break;
+            }
+        }
+        total--;
+    }
+
+    /* The most frequent symbols get the shortest codes */
+    int k = m;
+    for (UINT32 l = 1; l <= max_bits; l++)
+        for (UINT32 c = count[l]; c > 0; c--) len[d->sym[--k]] = (UINT8)l;
+}
+
+static UINT32 reverse(UINT32 code, UINT32 len) {
+    UINT32 r = 0;
+    for (UINT32 i = 0; i < len; i++, code >>= 1)
+        r = (r << 1) | (code & 1);
+    return r;
+}
+
+/* Canonical codes, bit-reversed since they are sent top bit first */
+static void codes(const UINT8 *len, int n, UINT16 *code) {
+    UINT32 count[MAX_BITS + 1], next[MAX_BITS + 1];
+    mem_set(count, 0, sizeof(count));
+    for (int i = 0; i < n; i++) count[len[i]]++;
+    count[0] = 0;
+    UINT32 c = 0;
+    for (int l = 1; l <= MAX_BITS; l++) {
+        c = (c + count[l - 1]) << 1;
+        next[l] = c;
+    }
+    for (int i = 0; i < n; i++)
+        if (len[i]) code[i] = (UINT16)reverse(next[len[i]]++, len[i]);
+}
+
+static UINT32 fixed_len(UINT32 sym) {
+    return sym < 144 ? 8 : sym < 256 ? 9 : sym < 280 ? 7 : 8;
+}
+
+/* ---- Blocks ---- */
+
+static void rle_put(struct dfl *d, UINT32 sym, UINT32 extra) {
+    d->rle[d->nrle++] = (UINT16)(sym | extra << 5);
+    d->cfreq[sym]++;
+}
+
+/* The code lengths as code length symbols: 16 repeats the last length
+   3-6 times, 17 and 18 send runs of 3-10 and 11-138 zeros */
+static void rle_lengths(struct dfl *d, UINT32 n) {
+    d->nrle = 0;
+    mem_set(d->cfreq, 0, sizeof(d->cfreq));
+    for (UINT32 i = 0; i < n;) {
+        UINT8 v = d->lens[i];
+        UINT32 run = 1;
+        while (i + run < n && d->lens[i + run] == v) run++;
+        i += run;
+        if (v == 0) {
+            while (run >= 11) {
+                UINT32 r = run > 138 ? 138 : run;
+                rle_put(d, 18, r - 11);
+                run -= r;
+            }
+            if (run >= 3) {
+                rle_put(d, 17, run - 3);
+                run = 0;
+            }
+        } else {
+            rle_put(d, v, 0);
+            run--;
+            while (run >= 3) {
+                UINT32 r = run > 6 ? 6 : run;
+                rle_put(d, 16, r - 3);
+                run -= r;
+            }
+        }
+        while (run--) rle_put(d, v, 0);
+    }
+}
+
+static void put_tokens(struct dfl *d) {
+    for (UINT32 i = 0; i < d->ntok; i++) {
+        UINT32 t = d->tok[i];
+        if (t < 256) {
+            put_bits(d, d->lcode[t], d->llen[t]);
+            continue;
+        }
+        UINT32 len = t >> 16, dist = t & 0xFFFF;
+        UINT32 c = d->len_code[len];
+        put_bits(d, d->lcode[257 + c], d->llen[257 + c]);
+        if (LEN_EXTRA[c]) put_bits(d, len - LEN_BASE[c], LEN_EXTRA[c]);
+        c = dist_sym(d, dist);
+        put_bits(d, d->dcode[c], d->dlen[c]);
+        if (DIST_EXTRA[c]) put_bits(d, dist - DIST_BASE[c], DIST_EXTRA[c]);
+    }
+    put_bits(d, d->lcode[256], d->llen[256]);
+}
+
+static void put_stored(struct dfl *d, const UINT8 *p, UINTN n) {
+    do {
+        UINT32 k = n > 65535 ? 65535 : (UINT32)n;
+        UINT8 hdr[4] = { (UINT8)k, (UINT8)(k >> 8),
+                         (UINT8)~k, (UINT8)(~k >> 8) };
+        put_bits(d, 0, 3);
+        align(d);
+        put_bytes(d, hdr, 4);
+        put_bytes(d, p, k);
+        p += k;
+        n -= k;
+    } while (n);
+}
+
+/* Send the tokens gathered for the raw_len bytes at raw */
+static void block(struct dfl *d, const UINT8 *raw, UINTN raw_len) {
+    d->lfreq[256] = 1;
+
+    /* Sizes in bits. The extra bits are the same under either code. */
+    UINT64 extra = 0, fixed = 3, dyn = 3 + 5 + 5 + 4;
+    for (int c = 0; c < 29; c++) extra += (UINT64)d->lfreq[257 + c] * LEN_EXTRA[c];
+    for (int c = 0; c < 30; c++) extra += (UINT64)d->dfreq[c] * DIST_EXTRA[c];
+    for (UINT32 s = 0; s < LIT_SYMS; s++) fixed += (UINT64)d->lfreq[s] * fixed_len(s);
+    for (int c = 0; c < 30; c++) fixed += (UINT64)d->dfreq[c] * 5;
+    fixed += extra;
+
+    two_symbols(d->lfreq, LIT_SYMS);
+    two_symbols(d->dfreq, DIST_SYMS);
+    lengths(d, d->lfreq, LIT_SYMS, d->llen, MAX_BITS);
+    lengths(d, d->dfreq, DIST_SYMS, d->dlen, MAX_BITS);
+
+    UINT32 nlit = LIT_SYMS, ndist = DIST_SYMS;
+    while (nlit > 257 && !d->llen[nlit - 1]) nlit--;
+    while (ndist > 1 && !d->dlen[ndist - 1]) ndist--;
+    mem_copy(d->lens, d->llen, nlit);
+    mem_copy(d->lens + nlit, d->dlen, ndist);
+    rle_lengths(d, nlit + ndist);
+    two_symbols(d->cfreq, CL_SYMS);
+    lengths(d, d->cfreq, CL_SYMS, d->clen, CL_BITS);
+    UINT32 ncl = CL_SYMS;
+    while (ncl > 4 && !d->clen[CLEN_ORDER[ncl - 1]]) ncl--;
+
+    dyn += 3 * ncl + extra;
+    for (UINT32 i = 0; i < d->nrle; i++) {
+        UINT32 s = d->rle[i] & 31;
+        dyn += d->clen[s] + (s == 16 ? 2 : s == 17 ? 3 : s == 18 ? 7 : 0);
+    }
+    for (UINT32 s = 0; s < LIT_SYMS; s++) dyn += (UINT64)d->lfreq[s] * d->llen[s];
+    for (int c = 0; c < 30; c++) dyn += (UINT64)d->dfreq[c] * d->dlen[c];
+
+    /* With alignment, rounded up */
+    UINT64 stored = ((UINT64)raw_len + 6 * (raw_len / 65535 + 1)) * 8;
+
+    if (stored <= dyn && stored <= fixed) {
+        put_stored(d, raw, raw_len);
+    } else if (fixed <= dyn) {
+        for (UINT32 s = 0; s < 288; s++) d->llen[s] = (UINT8)fixed_len(s);
+        for (int c = 0; c < DIST_SYMS; c++) d->dlen[c] = 5;
+        codes(d->llen, 288, d->lcode);
+        codes(d->dlen, DIST_SYMS, d->dcode);
+        put_bits(d, 1 << 1, 3);
+        put_tokens(d);
+    } else {
+        codes(d->llen, LIT_SYMS, d->lcode);
+        codes(d->dlen, DIST_SYMS, d->dcode);
+        codes(d->clen, CL_SYMS, d->ccode);
+        put_bits(d, 2 << 1, 3);
+        put_bits(d, nlit - 257, 5);
+        put_bits(d, ndist - 1, 5);
+        put_bits(d, ncl - 4, 4);
+        for (UINT32 i = 0; i < ncl; i++) put_bits(d, d->clen[CLEN_ORDER[i]], 3);
+        for (UINT32 i = 0; i < d->nrle; i++) {
+            UINT32 s = d->rle[i] & 31, x = d->rle[i] >> 5;
+            put_bits(d, d->ccode[s], d->clen[s]);
+            if (s == 16) put_bits(d, x, 2);
+            else if (s == 17) put_bits(d, x, 3);
+            else if (s == 18) put_bits(d, x, 7);
+        }
+        put_tokens(d);
+    }
+
+    mem_set(d->lfreq, 0, sizeof(d->lfreq));
+    mem_set(d->dfreq, 0, sizeof(d->dfreq));
+    d->ntok = 0;
+}
+
+/* ---- Matching ---- */
+
+static void insert(struct dfl *d, const UINT8 *base, UINTN pos) {
+    UINT32 h = hash4(base + pos);
+    d->prev[pos & WMASK] = d->head[h];
+    d->head[h] = (UINT32)pos + 1;
+}
+
+static UINT32 match_len(const UINT8 *a, const UINT8 *b, UINT32 limit) {
+    UINT32 n = 0;
+    while (n < limit && a[n] == b[n]) n++;
+    return n;
+}
+
+UINTN deflate_compress(const void *src, UINTN size, UINTN history,
+                       void *dst, UINTN cap, void *scratch) {
+    struct dfl *d = (struct dfl *)scratch;
+    const UINT8 *base = (const UINT8 *)src - history;
+    UINTN end = history + size;
+    setup(d, dst, cap);
+
+    for (UINTN pos = 0; pos < history && pos + MIN_MATCH <= end; pos++)
+        insert(d, base, pos);
+
+    UINTN pos = history, from = history;
+    while (pos < end) {
+        UINT32 len = 0, dist = 0;
+        if (pos + MIN_MATCH <= end) {
+            UINT32 limit = end - pos > MAX_MATCH ? MAX_MATCH : (UINT32)(end - pos);
+            UINT32 h = hash4(base + pos);
+            UINT32 cand = d->head[h];
+            d->prev[pos & WMASK] = cand;
+            d->head[h] = (UINT32)pos + 1;
+            for (int chain = MAX_CHAIN; cand && chain > 0; chain--) {
+                UINTN c = cand - 1;
+                if (pos - c > DEFLATE_WINDOW) break;
+                if (base[c + len] == base[pos + len]) {
+                    UINT32 l = match_len(base + c, base + pos, limit);
+                    if (l > len) {
+                        len = l;
+                        dist = (UINT32)(pos - c);
+                        if (l >= NICE_MATCH || l == limit) break;
+                    }
+                }
+                UINT32 next = d->prev[c & WMASK];
+                if (next >= cand) break;
+                cand = next;
+            }
+        }
+
+        if (len >= MIN_MATCH) {
+            d->tok[d->ntok++] = len << 16 | dist;
+            d->lfreq[257 + d->len_code[len]]++;
+            d->dfreq[dist_sym(d, dist)]++;
+            for (UINTN i = pos + 1; i < pos + len && i + MIN_MATCH <= end; i++)
+                insert(d, base, i);
+            pos += len;
+        } else {
+            d->tok[d->ntok++] = base[pos];
+            d->lfreq[base[pos]]++;
+            pos++;
+        }
+        if (d->ntok == TOKENS) {
+            block(d, base + from, pos - from);
+            from = pos;
+        }
+    }
+    if (d->ntok) block(d, base + from, pos - from);
+
+    /* An empty stored block brings the piece to a byte boundary */
+    static const UINT8 sync[4] = { 0x00, 0x00, 0xFF, 0xFF };
+    put_bits(d, 0, 3);
+    align(d);
+    put_bytes(d, sync, 4);
+    return d->over ? 0 : (UINTN)(d->op - (UINT8 *)dst);
+}
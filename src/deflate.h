@@ -0,0 +1,38 @@
+/*
+ * deflate.h — DEFLATE compression (RFC 1951) for .tar.gz archives
+ *
+ * Compresses one piece of a stream at a time, so the pieces of a large
+ * file can go to different cores and be joined afterwards, as pigz
+ * does. Each piece may look back into the bytes just before it for
+ * matches, and ends on a byte boundary with an empty stored block (a
+ * sync point), so pieces concatenate into one valid stream; the last
+ * is followed by DEFLATE_END. Matches are found greedily through hash
+ * chains, and each run of symbols goes out with whichever of its own
+ * Huffman codes, the fixed codes or no compression is smallest.
+ */
+#ifndef DEFLATE_H
+#define DEFLATE_H
+
+#include "boot.h"
+
+#define DEFLATE_WINDOW  32768           /* history a piece may match into */
+
+/* Scratch the compressor needs, in bytes; too much for an mp arena */
+#define DEFLATE_SCRATCH (384 * 1024)
+
+/* The most a piece of n bytes compresses to (stored, with block headers) */
+#define DEFLATE_BOUND(n) ((n) + (n) / 2048 + 64)
+
+/* Ends the stream after the last piece: an empty final block */
+#define DEFLATE_END     "\x03\x00"
+#define DEFLATE_END_LEN 2
+
+/* Compress size bytes of src into at most cap bytes of dst. The history
+   bytes before src (DEFLATE_WINDOW at most) are the ones the stream
+   held just before it; they are only matched against, not sent.
+   scratch holds DEFLATE_SCRATCH bytes. Returns the compressed length,
+   or 0 if it would not fit in cap. */
+UINTN deflate_compress(const void *src, UINTN size, UINTN history,
+                       void *dst, UINTN cap, void *scratch);
+
+#endif /* DEFLATE_H */
@@ -0,0 +1,318 @@
+/*
+ * defrag.c — Fragmentation report and defragmenter
+ *
+ * See defrag.h. The walk is breadth first, a queue of directory paths
+ * in one growing pool, so only one directory cursor is open at a time.
+ * When more than DEFRAG_FILES files are fragmented, the least
+ * fragmented of those kept makes room for a worse one.
+ */
+
+#include "boot.h"
+#include "fb.h"
+#include "kbd.h"
+#include "mem.h"
+#include "fs.h"
+#include "timer.h"
+#include "defrag.h"
+#include "shim.h"
+
+#define DEFRAG_DRAW_MS 100      /* progress redraws */
+#define DEFRAG_PATH    256      /* bytes of a path, from "\\" */
+#define DEFRAG_WORST   20       /* files the report lists */
+
+struct df_file {
+    UINT32 extents;             /* DEFRAG_EXTENTS + 1 when more */
+    char   path[DEFRAG_PATH];
+};
+
+struct df_scan {
+    struct fs_volume *vol;
+    struct fs_extent *ext;      /* DEFRAG_EXTENTS, for each file */
+    struct df_file   *files;    /* the worst DEFRAG_FILES fragmented */
+    UINT32 count;
+    char  *queue;               /* directory paths, each NUL-terminated */
+    UINTN  queue_len, queue_size, walk;
+    UINT64 nfiles, fragmented, extents, dirs, errors;
+    UINT32 row;                 /* of the progress line */
+    UINT64 t_draw;
+    int    cancel;
+};
+
+static void to_wide(const char *path, CHAR16 *out) {
+    UINTN i = 0;
+    for (; path[i]; i++) out[i] = (CHAR16)(UINT8)path[i];
+    out[i] = 0;
+}
+
+static void progress_line(UINT32 row, const char *text) {
+    char line[128];
+    int len = snprintf(line, sizeof(line), "  %s", text);
+    if (len > 126) len = 126;
+    while (len < (int)g_boot.cols && len < 126) line[len++] = ' ';
+    line[len] = '\0';
+    fb_string(0, row, line, COLOR_WHITE, COLOR_BLACK);
+    fb_present();
+}
+
+/* Whether a redraw is due; polls for ESC when it is */
+static int draw_due(UINT64 *t_draw, int *cancel) {
+    UINT64 now = timer_ticks();
+    if (now - *t_draw < timer_hz() / 1000 * DEFRAG_DRAW_MS) return 0;
+    *t_draw = now;
+    struct key_event ev;
+    if (kbd_poll(&ev) && ev.code == KEY_ESC) *cancel = 1;
+    return 1;
+}
+
+static int queue_dir(struct df_scan *s, const char *path) {
+    UINTN len = strlen(path) + 1;
+    if (s->queue_len + len > s->queue_size) {
+        UINTN size = s->queue_size ? s->queue_size * 2 : 16 * 1024;
+        while (size < s->queue_len + len) size *= 2;
+        char *q = (char *)mem_alloc(size);
+        if (!q) return -1;
+        if (s->queue) {
+            mem_copy(q, s->queue, s->queue_len);
+            mem_free(s->queue);
+        }
+        s->queue = q;
+        s->queue_size = size;
+    }
+    mem_copy(s->queue + s->queue_len, path, len);
+    s->queue_len += len;
+    return 0;
+}
+
+static void keep_file(struct df_scan *s, const char *path, UINT32 extents) {
+    UINT32 at = s->count;
+    if (at == DEFRAG_FILES) {
+        at = 0;
+        for (UINT32 i = 1; i < s->count; i++)
+            if (s->files[i].extents < s->files[at].extents) at = i;
+        if (s->files[at].extents >= extents) return;
+    } else {
+        s->count++;
+    }
+    s->files[at].extents = extents;
+    str_copy(s->files[at].path, path, DEFRAG_PATH);
+}
+
+static void scan_file(struct df_scan *s, const char *path) {
+    CHAR16 wpath[DEFRAG_PATH];
+    to_wide(path, wpath);
+    int n = fs_volume_extents(s->vol, wpath, s->ext, DEFRAG_EXTENTS);
+    /* Only a chain too long for the buffer fails on these drivers */
+    UINT32 extents = n < 0 ? DEFRAG_EXTENTS + 1 : (UINT32)n;
+    s->nfiles++;
+    s->extents += extents;
+    if (extents > 1) {
+        s->fragmented++;
+        keep_file(s, path, extents);
+    }
+}
+
+static void scan_dir(struct df_scan *s, const char *dir) {
+    CHAR16 wpath[DEFRAG_PATH];
+    to_wide(dir, wpath);
+    struct fs_dir *d = fs_volume_opendir(s->vol, wpath);
+    if (!d) {
+        s->errors++;
+        return;
+    }
+    s->dirs++;
+    UINTN dlen = strlen(dir);
+    struct fs_entry e;
+    int r = 0;
+    while (!s->cancel && (r = fs_readdir_next(d, &e)) > 0) {
+        if (e.name[0] == '.' && (!e.name[1] || (e.name[1] == '.' && !e.name[2])))
+            continue;
+        char path[DEFRAG_PATH];
+        int len = snprintf(path, sizeof(path), "%s%s%s", dir,
+                           dlen > 1 ? "\\" : "", e.name);
+        if (len < 0 || len >= DEFRAG_PATH) {
+            s->errors++;
+            continue;
+        }
+        if (e.is_dir) {
+            if (queue_dir(s, path) != 0) s->errors++;
+        } else if (e.size) {
+            scan_file(s, path);
+        }
+
+        if (draw_due(&s->t_draw, &s->cancel)) {
+            char line[128];
+            snprintf(line, sizeof(line), "%llu files, %llu fragmented, in %llu directories",
+                     (unsigned long long)s->nfiles, (unsigned long long)s->fragmented,
+                     (unsigned long long)s->dirs);
+            progress_line(s->row, line);
+        }
+    }
+    if (r < 0) s->errors++;
+    fs_closedir(d);
+}
+
+static int cmp_worst(const void *a, const void *b) {
+    UINT32 x = ((const struct df_file *)a)->extents;
+    UINT32 y = ((const struct df_file *)b)->extents;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static void title(const char *what) {
+    fb_clear(COLOR_BLACK);
+    fb_print("\n", COLOR_WHITE);
+    fb_print("  ========================================\n", COLOR_CYAN);
+    fb_print(what, COLOR_CYAN);
+    fb_print("  ========================================\n\n", COLOR_CYAN);
+}
+
+static void show_extents(const char *what, UINT32 n) {
+    char buf[DEFRAG_PATH + 32];
+    if (n > DEFRAG_EXTENTS)
+        snprintf(buf, sizeof(buf), "  >%-6u %.*s\n", (unsigned)DEFRAG_EXTENTS,
+                 (int)(g_boot.cols > 14 ? g_boot.cols - 14 : 1), what);
+    else
+        snprintf(buf, sizeof(buf), "  %-7u %.*s\n", (unsigned)n,
+                 (int)(g_boot.cols > 14 ? g_boot.cols - 14 : 1), what);
+    fb_print(buf, COLOR_WHITE);
+}
+
+/* Walk the volume and draw the report */
+static void report(struct df_scan *s, int exfat) {
+    title("       FRAGMENTATION\n");
+    fb_print(exfat ? "  exFAT volume. ESC stops the scan.\n\n"
+                   : "  FAT32 volume. ESC stops the scan.\n\n", COLOR_WHITE);
+    s->row = g_boot.cursor_y;
+    fb_print("\n\n", COLOR_WHITE);
+
+    UINT64 t0 = timer_ticks();
+    if (queue_dir(s, "\\") != 0) s->errors++;
+    while (!s->cancel && s->walk < s->queue_len) {
+        /* scan_dir() can grow the queue, so the path is copied out */
+        char dir[DEFRAG_PATH];
+        str_copy(dir, s->queue + s->walk, DEFRAG_PATH);
+        s->walk += strlen(s->queue + s->walk) + 1;
+        scan_dir(s, dir);
+    }
+    UINT64 ms = (timer_ticks() - t0) / (timer_hz() / 1000 ? timer_hz() / 1000 : 1);
+    qsort(s->files, s->count, sizeof(s->files[0]), cmp_worst);
+
+    title("       FRAGMENTATION\n");
+    if (s->cancel)
+        fb_print("  Stopped: what follows covers part of the volume.\n\n", COLOR_YELLOW);
+    char buf[160];
+    snprintf(buf, sizeof(buf), "  %llu files in %llu directories in %llu.%llu s\n",
+             (unsigned long long)s->nfiles, (unsigned long long)s->dirs,
+             (unsigned long long)(ms / 1000), (unsigned long long)(ms % 1000 / 100));
+    fb_print(buf, COLOR_WHITE);
+    snprintf(buf, sizeof(buf), "  %llu fragmented (%llu%%), %llu extents in all\n",
+             (unsigned long long)s->fragmented,
+             (unsigned long long)(s->nfiles ? s->fragmented * 100 / s->nfiles : 0),
+             (unsigned long long)s->extents);
+    fb_print(buf, s->fragmented ? COLOR_YELLOW : COLOR_WHITE);
+    if (s->errors) {
+        snprintf(buf, sizeof(buf), "  %llu directories or names could not be read\n",
+                 (unsigned long long)s->errors);
+        fb_print(buf, COLOR_RED);
+    }
+    fb_print("\n", COLOR_WHITE);
+
+    UINT32 room = g_boot.rows > g_boot.cursor_y + 4 ? g_boot.rows - g_boot.cursor_y - 4 : 0;
+    if (room > DEFRAG_WORST) room = DEFRAG_WORST;
+    if (s->count && room) {
+        fb_print("  Extents Worst files\n", COLOR_DGRAY);
+        room--;
+    }
+    for (UINT32 i = 0; i < s->count && i < room; i++)
+        show_extents(s->files[i].path, s->files[i].extents);
+    fb_print("\n", COLOR_WHITE);
+}
+
+/* Relocate the kept files, worst first, and show how it went */
+static void defragment(struct df_scan *s) {
+    title("       DEFRAGMENT\n");
+    fb_print("  Moving each file into one free run. ESC stops after the\n"
+             "  file being moved.\n\n", COLOR_WHITE);
+    UINT32 row = g_boot.cursor_y;
+    fb_print("\n\n", COLOR_WHITE);
+
+    UINT32 moved = 0, skipped = 0, failed = 0, i = 0;
+    UINT64 t_draw = 0;
+    int cancel = 0;
+    for (; i < s->count && !cancel; i++) {
+        if (draw_due(&t_draw, &cancel) || i == 0) {
+            char line[128];
+            snprintf(line, sizeof(line), "%u of %u: %.*s", (unsigned)(i + 1),
+                     (unsigned)s->count, 80, s->files[i].path);
+            progress_line(row, line);
+        }
+        CHAR16 wpath[DEFRAG_PATH];
+        to_wide(s->files[i].path, wpath);
+        int rc = fs_volume_relocate(s->vol, wpath);
+        if (rc == 0) moved++;
+        else if (rc > 0) skipped++;
+        else failed++;
+    }
+    fs_cache_invalidate();
+
+    title("       DEFRAGMENT\n");
+    if (cancel)
+        fb_print("  Stopped before the end of the list.\n\n", COLOR_YELLOW);
+    char buf[128];
+    snprintf(buf, sizeof(buf), "  %u of %u files moved into one run\n",
+             (unsigned)moved, (unsigned)s->count);
+    fb_print(buf, COLOR_WHITE);
+    if (skipped) {
+        snprintf(buf, sizeof(buf), "  %u left: no free run was long enough\n",
+                 (unsigned)skipped);
+        fb_print(buf, COLOR_YELLOW);
+    }
+    if (failed) {
+        snprintf(buf, sizeof(buf), "  %u could not be moved (a read or write failed)\n",
+                 (unsigned)failed);
+        fb_print(buf, COLOR_RED);
+    }
+    if (i < s->count) {
+        snprintf(buf, sizeof(buf), "  %u not tried\n", (unsigned)(s->count - i));
+        fb_print(buf, COLOR_DGRAY);
+    }
+    fb_print("\n", COLOR_WHITE);
+}
+
+int defrag_run(void) {
+    struct fs_volume *vol = fs_volume_current();
+    int exfat = fs_volume_exfat(vol) != NULL;
+    if (!exfat && !fs_volume_fat32(vol)) return -1;
+
+    struct df_scan s;
+    mem_set(&s, 0, sizeof(s));
+    s.vol = vol;
+    s.ext = (struct fs_extent *)mem_alloc(DEFRAG_EXTENTS * sizeof(struct fs_extent));
+    s.files = (struct df_file *)mem_alloc(DEFRAG_FILES * sizeof(struct df_file));
+    if (!s.ext || !s.files) {
+        if (s.ext) mem_free(s.ext);
+        if (s.files) mem_free(s.files);
+        return -1;
+    }
+
+    report(&s, exfat);
+    struct key_event key;
+    if (s.count && !fs_is_read_only()) {
+        fb_print("  Press 'D' to defragment, any other key to return.\n", COLOR_YELLOW);
+        kbd_wait(&key);
+        if (key.code == 'D' || key.code == 'd') {
+            defragment(&s);
+            fb_print("  Press any key to return.\n", COLOR_DGRAY);
+            kbd_wait(&key);
+        }
+    } else {
+        if (s.count)
+            fb_print("  The volume is read-only: nothing can be moved.\n", COLOR_WHITE);
+        fb_print("  Press any key to return.\n", COLOR_DGRAY);
+        kbd_wait(&key);
+    }
+
+    if (s.queue) mem_free(s.queue);
+    mem_free(s.files);
+    mem_free(s.ext);
+    return 0;
+}
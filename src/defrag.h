@@ -0,0 +1,25 @@
+/*
+ * defrag.h — Fragmentation report and defragmenter for exFAT and FAT32
+ *
+ * D in the browser, on a volume the built-in exFAT or FAT32 driver has
+ * mounted. The tree is walked depth first and each file's extents read
+ * from its chain (fs_volume_extents()); the report counts the files in
+ * more than one run and lists the worst of them. Defragmenting moves
+ * those files, most extents first, each into one run of free clusters
+ * with fs_volume_relocate(); a file no free run can hold is left as it
+ * is. Directories are not moved.
+ */
+#ifndef DEFRAG_H
+#define DEFRAG_H
+
+#include "boot.h"
+
+#define DEFRAG_EXTENTS  1024    /* read per file; more shows as ">1024" */
+#define DEFRAG_FILES    2048    /* fragmented files kept, the worst */
+#define DEFRAG_DEPTH    32      /* directory levels followed */
+
+/* Run the report and, when asked, defragment the current volume.
+   Returns -1 when it is not an exFAT or FAT32 volume, otherwise 0. */
+int defrag_run(void);
+
+#endif /* DEFRAG_H */
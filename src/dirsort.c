@@ -0,0 +1,384 @@
+/*
+ * dirsort.c — Directory listing order and compact listing store shared
+ * by all filesystem backends
+ *
+ * Sorting struct fs_entry records directly moves 144-byte records and
+ * case-folds both names on every comparison.  Instead each entry gets
+ * a 64-bit key: the "not a directory" flag in the top bit followed by
+ * the first seven case-folded name bytes, so unsigned key order is the
+ * listing order for all but long shared prefixes.  Only equal keys fall
+ * back to a full folded compare.  The (key, index) pairs are merge
+ * sorted bottom-up (insertion sort on short runs), and the records are
+ * then permuted into place by following cycles, moving each one once.
+ *
+ * The same sort serves both fs_entry arrays and the compact dirlist
+ * store, whose records point into one shared string pool.
+ */
+
+#include "dirsort.h"
+#ifndef ESP_PLATFORM
+#include "mem.h"
+#endif
+
+/* Runs sorted by insertion before merging */
+#define DIRSORT_RUN 16
+
+/* Bytes of folded name packed into a key */
+#define DIRSORT_KEY_CHARS 7
+
+/* Initial dirlist capacities */
+#define DIRLIST_MIN_RECS 64
+#define DIRLIST_MIN_POOL 4096
+
+struct dirsort_key {
+    UINT64 key;
+    const char *name;
+    UINT32 idx;
+};
+
+static UINT8 fold(char c)
+{
+    if (c >= 'A' && c <= 'Z') c += 32;
+    return (UINT8)c;
+}
+
+static UINT64 make_key(const char *name, int is_dir)
+{
+    UINT64 k = is_dir ? 0 : 1;
+    int i = 0;
+    for (; i < DIRSORT_KEY_CHARS && name[i]; i++)
+        k = (k << 8) | fold(name[i]);
+    for (; i < DIRSORT_KEY_CHARS; i++)
+        k <<= 8;
+    return k;
+}
+
+/* Full folded comparison; the sort only reaches it when both keys are
+   equal, i.e. same kind and the same folded first seven bytes */
+int dirsort_name_cmp(const char *a, const char *b)
+{
+    while (*a && *b) {
+        UINT8 ca = fold(*a), cb = fold(*b);
+        if (ca != cb) return (int)ca - (int)cb;
+        a++; b++;
+    }
+    return (int)(UINT8)*a - (int)(UINT8)*b;
+}
+
+/* Strict "a sorts before b" */
+static int key_less(const struct dirsort_key *a, const struct dirsort_key *b)
+{
+    if (a->key != b->key) return a->key < b->key;
+    return dirsort_name_cmp(a->name, b->name) < 0;
+}
+
+static void insertion_sort(struct dirsort_key *k, int n)
+{
+    for (int i = 1; i < n; i++) {
+        struct dirsort_key t = k[i];
+        int j = i - 1;
+        while (j >= 0 && key_less(&t, &k[j])) {
+            k[j + 1] = k[j];
+            j--;
+        }
+        k[j + 1] = t;
+    }
+}
+
+/* Stable sort of a[0..count-1], using b as scratch.
+   Returns whichever of the two holds the result. */
+static struct dirsort_key *sort_keys(struct dirsort_key *a,
+                                     struct dirsort_key *b, int count)
+{
+    for (int lo = 0; lo < count; lo += DIRSORT_RUN) {
+        int n = count - lo;
+        if (n > DIRSORT_RUN) n = DIRSORT_RUN;
+        insertion_sort(a + lo, n);
+    }
+
+    /* Bottom-up merge; ties take the left run to stay stable */
+    struct dirsort_key *src = a, *dst = b;
+    for (int width = DIRSORT_RUN; width < count; width *= 2) {
+        for (int lo = 0; lo < count; lo += 2 * width) {
+            int mid = lo + width, hi = lo + 2 * width;
+            if (mid > count) mid = count;
+            if (hi > count) hi = count;
+            int i = lo, j = mid, o = lo;
+            while (i < mid && j < hi) {
+                if (key_less(&src[j], &src[i]))
+                    dst[o++] = src[j++];
+                else
+                    dst[o++] = src[i++];
+            }
+            while (i < mid) dst[o++] = src[i++];
+            while (j < hi) dst[o++] = src[j++];
+        }
+        struct dirsort_key *t = src;
+        src = dst;
+        dst = t;
+    }
+    return src;
+}
+
+/* Position p receives element order[p].idx; walk each cycle once.
+   tmp must hold one element. */
+static void permute(UINT8 *base, UINTN elem, struct dirsort_key *order,
+                    int count, void *tmp)
+{
+    for (int p = 0; p < count; p++) {
+        if ((int)order[p].idx == p)
+            continue;
+        mem_copy(tmp, base + (UINTN)p * elem, elem);
+        int j = p;
+        for (;;) {
+            int k = (int)order[j].idx;
+            order[j].idx = (UINT32)j;
+            if (k == p) {
+                mem_copy(base + (UINTN)j * elem, tmp, elem);
+                break;
+            }
+            mem_copy(base + (UINTN)j * elem, base + (UINTN)k * elem, elem);
+            j = k;
+        }
+    }
+}
+
+static struct dirsort_key *alloc_keys(int count, struct dirsort_key **scratch)
+{
+    UINTN bytes = (UINTN)count * sizeof(struct dirsort_key);
+    struct dirsort_key *a = (struct dirsort_key *)mem_alloc(bytes);
+    struct dirsort_key *b = (struct dirsort_key *)mem_alloc(bytes);
+    if (!a || !b) {
+        if (a) mem_free(a);
+        if (b) mem_free(b);
+        return 0;
+    }
+    *scratch = b;
+    return a;
+}
+
+/* Fallback when the key arrays cannot be allocated */
+static void entries_sort_in_place(struct fs_entry *entries, int count)
+{
+    for (int i = 1; i < count; i++) {
+        struct fs_entry tmp;
+        mem_copy(&tmp, &entries[i], sizeof(tmp));
+        int j = i - 1;
+        while (j >= 0) {
+            int before;
+            if (tmp.is_dir != entries[j].is_dir)
+                before = tmp.is_dir;
+            else
+                before = dirsort_name_cmp(tmp.name, entries[j].name) < 0;
+            if (!before)
+                break;
+            mem_copy(&entries[j + 1], &entries[j], sizeof(tmp));
+            j--;
+        }
+        mem_copy(&entries[j + 1], &tmp, sizeof(tmp));
+    }
+}
+
+void dirsort_entries(struct fs_entry *entries, int count)
+{
+    if (!entries || count < 2)
+        return;
+
+    struct dirsort_key *b;
+    struct dirsort_key *a = alloc_keys(count, &b);
+    if (!a) {
+        entries_sort_in_place(entries, count);
+        return;
+    }
+
+    for (int i = 0; i < count; i++) {
+        a[i].key = make_key(entries[i].name, entries[i].is_dir);
+        a[i].name = entries[i].name;
+        a[i].idx = (UINT32)i;
+    }
+
+    struct fs_entry tmp;
+    permute((UINT8 *)entries, sizeof(struct fs_entry),
+            sort_keys(a, b, count), count, &tmp);
+
+    mem_free(a);
+    mem_free(b);
+}
+
+/* ---- Compact listing store ---- */
+
+int dirlist_add(struct dirlist *l, const char *name, UINT64 size,
+                UINT32 mtime, int is_dir)
+{
+    UINT32 len = 0;
+    while (name[len] && len < FS_MAX_NAME - 1)
+        len++;
+
+    if (l->count >= l->cap) {
+        int cap = l->cap ? l->cap * 2 : DIRLIST_MIN_RECS;
+        struct dirlist_rec *r = (struct dirlist_rec *)
+            mem_alloc((UINTN)cap * sizeof(struct dirlist_rec));
+        if (!r)
+            return -1;
+        if (l->recs) {
+            mem_copy(r, l->recs, (UINTN)l->count * sizeof(struct dirlist_rec));
+            mem_free(l->recs);
+        }
+        l->recs = r;
+        l->cap = cap;
+    }
+
+    if (l->pool_len + len + 1 > l->pool_cap) {
+        UINT32 cap = l->pool_cap ? l->pool_cap : DIRLIST_MIN_POOL;
+        while (l->pool_len + len + 1 > cap) {
+            if (cap >= 0x40000000)
+                return -1;
+            cap *= 2;
+        }
+        char *p = (char *)mem_alloc(cap);
+        if (!p)
+            return -1;
+        if (l->pool) {
+            mem_copy(p, l->pool, l->pool_len);
+            mem_free(l->pool);
+        }
+        l->pool = p;
+        l->pool_cap = cap;
+    }
+
+    struct dirlist_rec *r = &l->recs[l->count++];
+    mem_set(r, 0, sizeof(*r));
+    r->size = size;
+    r->name = l->pool_len;
+    r->mtime = mtime;
+    r->is_dir = is_dir ? 1 : 0;
+    mem_copy(l->pool + l->pool_len, name, len);
+    l->pool[l->pool_len + len] = '\0';
+    l->pool_len += len + 1;
+    return 0;
+}
+
+int dirlist_add_entry(struct dirlist *l, const struct fs_entry *e)
+{
+    if (dirlist_add(l, e->name, e->size, e->mtime, e->is_dir) != 0)
+        return -1;
+    struct dirlist_rec *r = &l->recs[l->count - 1];
+    r->id = e->id;
+    r->ctime = e->ctime;
+    r->attr = e->attr;
+    return 0;
+}
+
+static void recs_sort_in_place(struct dirlist_rec *recs, int count,
+                               const char *pool)
+{
+    for (int i = 1; i < count; i++) {
+        struct dirlist_rec tmp = recs[i];
+        int j = i - 1;
+        while (j >= 0) {
+            int before;
+            if (tmp.is_dir != recs[j].is_dir)
+                before = tmp.is_dir;
+            else
+                before = dirsort_name_cmp(pool + tmp.name, pool + recs[j].name) < 0;
+            if (!before)
+                break;
+            recs[j + 1] = recs[j];
+            j--;
+        }
+        recs[j + 1] = tmp;
+    }
+}
+
+void dirlist_sort(struct dirlist *l, int first, int count)
+{
+    if (!l || first < 0 || count < 2 || first + count > l->count)
+        return;
+
+    struct dirlist_rec *recs = l->recs + first;
+    struct dirsort_key *b;
+    struct dirsort_key *a = alloc_keys(count, &b);
+    if (!a) {
+        recs_sort_in_place(recs, count, l->pool);
+        return;
+    }
+
+    for (int i = 0; i < count; i++) {
+        a[i].name = l->pool + recs[i].name;
+        a[i].key = make_key(a[i].name, (int)recs[i].is_dir);
+        a[i].idx = (UINT32)i;
+    }
+
+    struct dirlist_rec tmp;
+    permute((UINT8 *)recs, sizeof(struct dirlist_rec),
+            sort_keys(a, b, count), count, &tmp);
+
+    mem_free(a);
+    mem_free(b);
+}
+
+void dirlist_sort_size(struct dirlist *l, int first, int count)
+{
+    if (!l || first < 0 || count < 2 || first + count > l->count)
+        return;
+
+    struct dirlist_rec *recs = l->recs + first;
+    struct dirsort_key *b;
+    struct dirsort_key *a = alloc_keys(count, &b);
+    if (!a)
+        return;     /* out of memory: the listing keeps its order */
+
+    /* Ascending keys are descending sizes */
+    for (int i = 0; i < count; i++) {
+        a[i].name = l->pool + recs[i].name;
+        a[i].key = ~recs[i].size;
+        a[i].idx = (UINT32)i;
+    }
+
+    struct dirlist_rec tmp;
+    permute((UINT8 *)recs, sizeof(struct dirlist_rec),
+            sort_keys(a, b, count), count, &tmp);
+
+    mem_free(a);
+    mem_free(b);
+}
+
+const char *dirlist_name(const struct dirlist *l, int i)
+{
+    return l->pool + l->recs[i].name;
+}
+
+void dirlist_get(const struct dirlist *l, int i, struct fs_entry *out)
+{
+    const struct dirlist_rec *r = &l->recs[i];
+    str_copy(out->name, l->pool + r->name, FS_MAX_NAME);
+    out->size = r->size;
+    out->mtime = r->mtime;
+    out->ctime = r->ctime;
+    out->id = r->id;
+    out->is_dir = (UINT8)r->is_dir;
+    out->attr = (UINT8)r->attr;
+}
+
+void dirlist_reset(struct dirlist *l)
+{
+    l->count = 0;
+    l->pool_len = 0;
+}
+
+void dirlist_truncate(struct dirlist *l, int count)
+{
+    if (count < 0 || count >= l->count) return;
+    l->pool_len = l->recs[count].name;
+    l->count = count;
+}
+
+void dirlist_free(struct dirlist *l)
+{
+    if (l->recs) mem_free(l->recs);
+    if (l->pool) mem_free(l->pool);
+    l->recs = 0;
+    l->pool = 0;
+    l->count = l->cap = 0;
+    l->pool_len = l->pool_cap = 0;
+}
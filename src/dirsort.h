@@ -0,0 +1,80 @@
+/*
+ * dirsort.h — Directory listing order and compact listing store shared
+ * by all filesystem backends
+ *
+ * Portable: no UEFI dependency, used by fs.c, the browser and the
+ * exFAT, NTFS and FAT32 drivers.
+ */
+#ifndef DIRSORT_H
+#define DIRSORT_H
+
+#ifdef ESP_PLATFORM
+#include "fs_port.h"
+#else
+#include "fs.h"
+#endif
+
+/* Sort entries in place: directories first, then by name (ASCII,
+   case-insensitive). Stable, O(n log n); each entry is moved once. */
+void dirsort_entries(struct fs_entry *entries, int count);
+
+/* Name order of the listing: <0, 0 or >0 as a sorts before, with or
+   after b (ASCII, case-insensitive) */
+int dirsort_name_cmp(const char *a, const char *b);
+
+/* ---- Compact listing store ---- */
+
+/* One listed entry; name is an offset into the list's string pool */
+struct dirlist_rec {
+    UINT64 size;
+    UINT64 id;
+    UINT32 name;
+    UINT32 mtime;
+    UINT32 ctime;
+    UINT16 is_dir;
+    UINT16 attr;
+};
+
+/* Growable listing: 32 bytes per entry plus the name itself, instead
+   of a fixed FS_MAX_NAME buffer each. Zero-initialize before use. */
+struct dirlist {
+    struct dirlist_rec *recs;
+    int    count;
+    int    cap;
+    char   *pool;
+    UINT32 pool_len;
+    UINT32 pool_cap;
+};
+
+/* Append an entry (name is truncated to FS_MAX_NAME - 1).
+   Returns 0 on success, -1 when out of memory. */
+int dirlist_add(struct dirlist *l, const char *name, UINT64 size,
+                UINT32 mtime, int is_dir);
+
+/* Append e with everything its listing read */
+int dirlist_add_entry(struct dirlist *l, const struct fs_entry *e);
+
+/* Sort recs[first .. first+count-1] in dirsort_entries() order */
+void dirlist_sort(struct dirlist *l, int first, int count);
+
+/* Sort recs[first .. first+count-1] largest first, equal sizes in
+   name order; directories are not put first */
+void dirlist_sort_size(struct dirlist *l, int first, int count);
+
+/* Name of entry i (valid until the next dirlist_add) */
+const char *dirlist_name(const struct dirlist *l, int i);
+
+/* Expand entry i into a full fs_entry */
+void dirlist_get(const struct dirlist *l, int i, struct fs_entry *out);
+
+/* Drop all entries but keep the buffers for reuse */
+void dirlist_reset(struct dirlist *l);
+
+/* Drop the entries from count on. They must be the last ones added,
+   and not sorted in among the rest. */
+void dirlist_truncate(struct dirlist *l, int count);
+
+/* Free the buffers */
+void dirlist_free(struct dirlist *l);
+
+#endif /* DIRSORT_H */
@@ -7,7 +7,12 @@
 
 #include "boot.h"
 #include "mem.h"
+#include "trace.h"
+#include "timer.h"
 #include "disk.h"
+#include "usbms.h"
+#include "sdmmc.h"
+#include "nvme.h"
 
 /* Get the boot partition handle via LoadedImage protocol */
 static EFI_HANDLE get_boot_partition(void) {
@@ -35,6 +40,94 @@ static UINTN devpath_prefix_len(EFI_DEVICE_PATH *dp) {
     return len;
 }
 
+/* ---- Device topology ----
+ * disk_enumerate() records every BlockIO handle once with its device
+ * path, the path's length and hash, and the nearest handle whose path
+ * is a proper prefix of it (the disk a partition lies on). Parent tests
+ * then walk these links instead of fetching and comparing device paths
+ * for every pair. The table describes the handles as of the last
+ * enumeration; disk_reconnect() drops it, and handles it does not know
+ * fall back to comparing device paths directly. */
+
+#define TOPO_MAX 64
+
+struct topo_node {
+    EFI_HANDLE       handle;
+    EFI_DEVICE_PATH *dp;
+    UINTN            len;        /* bytes before the end node */
+    UINT32           hash;       /* of those bytes */
+    int              parent;     /* index, -1 for a whole disk */
+};
+
+static struct topo_node s_topo[TOPO_MAX];
+static int s_topo_count;
+
+static EFI_DEVICE_PATH *devpath_of(EFI_HANDLE h) {
+    EFI_GUID dp_guid = { 0x9576e91, 0x6d3f, 0x11d2,
+        {0x8e, 0x39, 0x0, 0xa0, 0xc9, 0x69, 0x72, 0x3b} };
+    EFI_DEVICE_PATH *dp = NULL;
+    if (EFI_ERROR(g_boot.bs->HandleProtocol(h, &dp_guid, (void **)&dp)))
+        return NULL;
+    return dp;
+}
+
+/* FNV-1a over a device path, continued from h */
+static UINT32 devpath_hash(UINT32 h, const UINT8 *p, UINTN n) {
+    for (UINTN i = 0; i < n; i++)
+        h = (h ^ p[i]) * 16777619u;
+    return h;
+}
+
+static void topo_build(EFI_HANDLE *handles, UINTN count) {
+    s_topo_count = 0;
+    for (UINTN i = 0; i < count && s_topo_count < TOPO_MAX; i++) {
+        EFI_DEVICE_PATH *dp = devpath_of(handles[i]);
+        if (!dp) continue;
+        struct topo_node *t = &s_topo[s_topo_count++];
+        t->handle = handles[i];
+        t->dp = dp;
+        t->len = devpath_prefix_len(dp);
+        t->hash = devpath_hash(2166136261u, (UINT8 *)dp, t->len);
+        t->parent = -1;
+    }
+
+    /* The parent is the longest other path that ends on one of this
+       path's node boundaries: hash the path node by node and match each
+       prefix against the table by length and hash */
+    for (int i = 0; i < s_topo_count; i++) {
+        struct topo_node *t = &s_topo[i];
+        UINT8 *p = (UINT8 *)t->dp;
+        UINT32 h = 2166136261u;
+        UINTN off = 0;
+        while (off < t->len) {
+            UINTN node_len = p[off + 2] | ((UINTN)p[off + 3] << 8);
+            if (node_len < 4) break;
+            h = devpath_hash(h, p + off, node_len);
+            off += node_len;
+            if (off >= t->len) break;
+            for (int j = 0; j < s_topo_count; j++) {
+                if (j == i || s_topo[j].len != off || s_topo[j].hash != h)
+                    continue;
+                if (mem_cmp(s_topo[j].dp, p, off) == 0) {
+                    t->parent = j;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+static int topo_find(EFI_HANDLE h) {
+    for (int i = 0; i < s_topo_count; i++)
+        if (s_topo[i].handle == h) return i;
+    return -1;
+}
+
+static EFI_DEVICE_PATH *topo_path(EFI_HANDLE h) {
+    int i = topo_find(h);
+    return i >= 0 ? s_topo[i].dp : devpath_of(h);
+}
+
 /*
  * Check if a whole-disk handle is the parent of a partition handle.
  * Compares device paths: the partition's path should start with the
@@ -44,12 +137,16 @@ static int disk_is_parent_of(EFI_HANDLE disk, EFI_HANDLE partition) {
     if (!disk || !partition) return 0;
     if (disk == partition) return 1;
 
-    EFI_GUID dp_guid = { 0x9576e91, 0x6d3f, 0x11d2,
-        {0x8e, 0x39, 0x0, 0xa0, 0xc9, 0x69, 0x72, 0x3b} };
-    EFI_DEVICE_PATH *disk_dp = NULL, *part_dp = NULL;
+    int d = topo_find(disk), p = topo_find(partition);
+    if (d >= 0 && p >= 0) {
+        for (int n = s_topo[p].parent, hops = 0;
+             n >= 0 && hops < TOPO_MAX; n = s_topo[n].parent, hops++)
+            if (n == d) return 1;
+        return 0;
+    }
 
-    g_boot.bs->HandleProtocol(disk, &dp_guid, (void **)&disk_dp);
-    g_boot.bs->HandleProtocol(partition, &dp_guid, (void **)&part_dp);
+    EFI_DEVICE_PATH *disk_dp = devpath_of(disk);
+    EFI_DEVICE_PATH *part_dp = devpath_of(partition);
     if (!disk_dp || !part_dp) return 0;
 
     UINTN disk_len = devpath_prefix_len(disk_dp);
@@ -57,12 +154,27 @@ static int disk_is_parent_of(EFI_HANDLE disk, EFI_HANDLE partition) {
     if (disk_len == 0 || part_len <= disk_len) return 0;
 
     /* The partition's device path must start with the disk's device path */
-    UINT8 *db = (UINT8 *)disk_dp;
-    UINT8 *pb = (UINT8 *)part_dp;
-    for (UINTN i = 0; i < disk_len; i++) {
-        if (db[i] != pb[i]) return 0;
-    }
-    return 1;
+    return mem_cmp(disk_dp, part_dp, disk_len) == 0;
+}
+
+int disk_partition_start(EFI_HANDLE disk, EFI_HANDLE partition, UINT64 *lba) {
+    if (!disk || !partition) return -1;
+    if (disk == partition) { *lba = 0; return 0; }
+    if (!disk_is_parent_of(disk, partition)) return -1;
+
+    EFI_DEVICE_PATH *disk_dp = topo_path(disk);
+    EFI_DEVICE_PATH *part_dp = topo_path(partition);
+    if (!disk_dp || !part_dp) return -1;
+
+    /* Exactly one node past the disk's path: a hard drive node (media
+       type 4, subtype 1) with the start LBA at offset 8 */
+    UINTN disk_len = devpath_prefix_len(disk_dp);
+    UINT8 *node = (UINT8 *)part_dp + disk_len;
+    UINTN node_len = node[2] | ((UINTN)node[3] << 8);
+    if (node[0] != 4 || node[1] != 1 || node_len < 42) return -1;
+    if (devpath_prefix_len(part_dp) != disk_len + node_len) return -1;
+    mem_copy(lba, node + 8, sizeof(UINT64));
+    return 0;
 }
 
 /*
@@ -77,6 +189,150 @@ int disk_has_claimed_partition(EFI_HANDLE disk, EFI_HANDLE *claimed, int nclaime
     return 0;
 }
 
+/* ---- Backends ----
+ * A disk one of our own drivers has taken over (usbms.c, sdmmc.c,
+ * nvme.c) is
+ * registered with its BlockIO; a volume on one of its partitions is
+ * then read through an offset view of that BlockIO instead of the
+ * firmware's partition BlockIO, which sits on the firmware's driver. */
+
+#define BACKEND_MAX 4
+#define ROUTE_MAX   16
+
+struct backend {
+    EFI_HANDLE    disk;
+    EFI_BLOCK_IO *bio;
+};
+
+struct route {
+    EFI_BLOCK_IO       bio;     /* first: This points here */
+    EFI_BLOCK_IO_MEDIA media;
+    EFI_HANDLE         part;
+    EFI_BLOCK_IO      *disk;
+    UINT64             start;   /* partition's first block on the disk */
+};
+
+static struct backend s_backend[BACKEND_MAX];
+static int s_nbackend;
+static struct route s_route[ROUTE_MAX];
+static int s_nroute;
+
+static void disk_set_backend(EFI_HANDLE disk, EFI_BLOCK_IO *bio) {
+    int i = 0;
+    while (i < s_nbackend && s_backend[i].disk != disk) i++;
+    if (i == BACKEND_MAX) return;
+    if (i == s_nbackend) s_nbackend++;
+    s_backend[i].disk = disk;
+    s_backend[i].bio = bio;
+}
+
+/* Our own driver's BlockIO for d, if one takes the device */
+static void disk_attach_driver(struct disk_device *d) {
+    EFI_BLOCK_IO *fw = d->block_io;
+    EFI_BLOCK_IO2_PROTOCOL *fw2 = d->block_io2;
+    int rc = -1;
+#ifdef NVME_NATIVE
+    if (!d->is_removable) rc = nvme_attach(d);
+#endif
+#ifdef USBMS_NATIVE
+    if (rc != 0 && d->is_removable) rc = usbms_attach(d);
+#endif
+#ifdef SDMMC_NATIVE
+    if (rc != 0) rc = sdmmc_attach(d);
+#endif
+    if (rc != 0) return;
+    d->fw_block_io = fw;
+    d->fw_block_io2 = fw2;
+    disk_set_backend(d->handle, d->block_io);
+}
+
+static EFI_STATUS route_rw(struct route *r, UINT32 media_id, int write,
+                           EFI_LBA lba, UINTN size, VOID *buf) {
+    UINT32 bs = r->media.BlockSize;
+    if (media_id != r->media.MediaId) return EFI_MEDIA_CHANGED;
+    if (size % bs) return EFI_BAD_BUFFER_SIZE;
+    if (lba > r->media.LastBlock || size / bs > r->media.LastBlock - lba + 1)
+        return EFI_INVALID_PARAMETER;
+    EFI_BLOCK_IO *d = r->disk;
+    return write ? d->WriteBlocks(d, d->Media->MediaId, r->start + lba, size, buf)
+                 : d->ReadBlocks(d, d->Media->MediaId, r->start + lba, size, buf);
+}
+
+static EFI_STATUS EFIAPI route_read(EFI_BLOCK_IO *This, UINT32 media_id,
+                                    EFI_LBA lba, UINTN size, VOID *buf) {
+    return route_rw((struct route *)This, media_id, 0, lba, size, buf);
+}
+
+static EFI_STATUS EFIAPI route_write(EFI_BLOCK_IO *This, UINT32 media_id,
+                                     EFI_LBA lba, UINTN size, VOID *buf) {
+    return route_rw((struct route *)This, media_id, 1, lba, size, buf);
+}
+
+static EFI_STATUS EFIAPI route_flush(EFI_BLOCK_IO *This) {
+    EFI_BLOCK_IO *d = ((struct route *)This)->disk;
+    return d->FlushBlocks(d);
+}
+
+static EFI_STATUS EFIAPI route_reset(EFI_BLOCK_IO *This, BOOLEAN extended) {
+    EFI_BLOCK_IO *d = ((struct route *)This)->disk;
+    return d->Reset(d, extended);
+}
+
+/* A route slot for part: its own, a free one, or one whose partition
+   handle has gone (recreated by a reconnect) */
+static struct route *route_slot(EFI_HANDLE part) {
+    EFI_GUID bio_guid = EFI_BLOCK_IO_PROTOCOL_GUID;
+    for (int i = 0; i < s_nroute; i++)
+        if (s_route[i].part == part) return &s_route[i];
+    if (s_nroute < ROUTE_MAX) return &s_route[s_nroute++];
+    for (int i = 0; i < s_nroute; i++) {
+        VOID *bio;
+        if (EFI_ERROR(g_boot.bs->HandleProtocol(s_route[i].part, &bio_guid,
+                                                &bio)))
+            return &s_route[i];
+    }
+    return NULL;
+}
+
+EFI_BLOCK_IO *disk_volume_bio(EFI_HANDLE handle, EFI_BLOCK_IO *bio) {
+#if defined(USBMS_NATIVE) || defined(SDMMC_NATIVE) || defined(NVME_NATIVE)
+    static int probed;
+    if (!probed) {
+        /* Volumes can be mounted before anything lists the disks */
+        struct disk_device devs[DISK_MAX_DEVICES];
+        probed = 1;
+        disk_enumerate(devs, DISK_MAX_DEVICES);
+    }
+#endif
+    for (int i = 0; i < s_nbackend; i++) {
+        struct backend *b = &s_backend[i];
+        UINT64 start;
+        if (b->disk == handle) return b->bio;
+        if (b->bio->Media->BlockSize != bio->Media->BlockSize ||
+            disk_partition_start(b->disk, handle, &start) != 0 ||
+            start + bio->Media->LastBlock > b->bio->Media->LastBlock)
+            continue;
+        struct route *r = route_slot(handle);
+        if (!r) return bio;
+        mem_set(&r->media, 0, sizeof(r->media));
+        mem_copy(&r->media, bio->Media,
+                 (UINTN)&((EFI_BLOCK_IO_MEDIA *)0)->LowestAlignedLba);
+        if (r->media.IoAlign < b->bio->Media->IoAlign)
+            r->media.IoAlign = b->bio->Media->IoAlign;
+        r->part = handle;
+        r->disk = b->bio;
+        r->start = start;
+        r->bio.Revision = 1;
+        r->bio.Media = &r->media;
+        r->bio.Reset = route_reset;
+        r->bio.ReadBlocks = route_read;
+        r->bio.WriteBlocks = route_write;
+        r->bio.FlushBlocks = route_flush;
+        return &r->bio;
+    }
+    return bio;
+}
+
 /* Format size as human-readable string */
 static void format_size(UINT64 bytes, char *buf) {
     const char *units[] = {"B", "KB", "MB", "GB", "TB"};
@@ -101,6 +357,8 @@ static void format_size(UINT64 bytes, char *buf) {
 
 int disk_enumerate(struct disk_device *devs, int max) {
     EFI_GUID bio_guid = EFI_BLOCK_IO_PROTOCOL_GUID;
+    EFI_GUID bio2_guid = EFI_BLOCK_IO2_PROTOCOL_GUID;
+    EFI_GUID erase_guid = EFI_ERASE_BLOCK_PROTOCOL_GUID;
     EFI_STATUS status;
     UINTN handle_count = 0;
     EFI_HANDLE *handles = NULL;
@@ -112,6 +370,7 @@ int disk_enumerate(struct disk_device *devs, int max) {
         ByProtocol, &bio_guid, NULL, &handle_count, &handles);
     if (EFI_ERROR(status) || !handles)
         return 0;
+    topo_build(handles, handle_count);
 
     for (UINTN i = 0; i < handle_count && count < max; i++) {
         EFI_BLOCK_IO *bio = NULL;
@@ -132,8 +391,15 @@ int disk_enumerate(struct disk_device *devs, int max) {
         mem_set(d, 0, sizeof(*d));
         d->handle = handles[i];
         d->block_io = bio;
+        if (EFI_ERROR(g_boot.bs->HandleProtocol(handles[i], &bio2_guid,
+                                                (VOID **)&d->block_io2)))
+            d->block_io2 = NULL;
+        if (EFI_ERROR(g_boot.bs->HandleProtocol(handles[i], &erase_guid,
+                                                (VOID **)&d->erase)))
+            d->erase = NULL;
         d->block_size = media->BlockSize;
         d->media_id = media->MediaId;
+        mem_io_align(media->IoAlign);
         d->size_bytes = (UINT64)(media->LastBlock + 1) * (UINT64)media->BlockSize;
         d->is_removable = media->RemovableMedia ? 1 : 0;
         d->is_boot_device = disk_is_parent_of(handles[i], boot_part) ? 1 : 0;
@@ -158,6 +424,7 @@ int disk_enumerate(struct disk_device *devs, int max) {
         }
         d->name[pos] = '\0';
 
+        disk_attach_driver(d);
         count++;
     }
 
@@ -165,54 +432,975 @@ int disk_enumerate(struct disk_device *devs, int max) {
     return count;
 }
 
-int disk_write_blocks(struct disk_device *dev, UINT64 lba, UINT64 count, void *buf) {
-    if (!dev || !dev->block_io || dev->is_boot_device)
+int disk_open_boot_partition(struct disk_device *out) {
+    EFI_GUID bio_guid = EFI_BLOCK_IO_PROTOCOL_GUID;
+    EFI_HANDLE part = get_boot_partition();
+    EFI_BLOCK_IO *bio = NULL;
+    if (!part || EFI_ERROR(g_boot.bs->HandleProtocol(part, &bio_guid,
+                                                     (VOID **)&bio))
+        || !bio || !bio->Media || !bio->Media->MediaPresent)
         return -1;
 
-    UINTN buf_size = (UINTN)(count * (UINT64)dev->block_size);
-    EFI_STATUS status = dev->block_io->WriteBlocks(
-        dev->block_io, dev->media_id, (EFI_LBA)lba, buf_size, buf);
+    mem_set(out, 0, sizeof(*out));
+    out->handle = part;
+    out->block_io = bio;
+    out->block_size = bio->Media->BlockSize;
+    out->media_id = bio->Media->MediaId;
+    mem_io_align(bio->Media->IoAlign);
+    out->size_bytes = (UINT64)(bio->Media->LastBlock + 1) *
+                      (UINT64)bio->Media->BlockSize;
+    out->is_boot_device = 1;
+    const char *name = "Boot partition";
+    for (int i = 0; name[i]; i++) out->name[i] = name[i];
+    return 0;
+}
 
-    if (EFI_ERROR(status))
-        return -1;
+/* ---- Aligned transfers ----
+ * A buffer the device's IoAlign does not allow goes through pool
+ * buffers (mem_io_get) in DISK_BOUNCE_SIZE pieces, rather than leaving
+ * the firmware to bounce or split it however it likes. */
 
-    /* Flush */
-    dev->block_io->FlushBlocks(dev->block_io);
-    return 0;
+#define DISK_BOUNCE_SIZE (1024 * 1024)
+
+static int bio_aligned(EFI_BLOCK_IO *bio, const void *buf) {
+    UINT32 a = bio->Media->IoAlign;
+    return a <= 1 || ((UINTN)buf & (a - 1)) == 0;
+}
+
+static EFI_STATUS bio_xfer(EFI_BLOCK_IO *bio, UINT32 media_id, int write,
+                           UINT64 lba, UINTN size, void *buf) {
+    UINT32 bs = bio->Media->BlockSize;
+    UINT8 *bounce = NULL;
+    UINTN piece = size < DISK_BOUNCE_SIZE ? size : DISK_BOUNCE_SIZE;
+    piece -= piece % bs;
+    if (!bio_aligned(bio, buf) && piece > 0) {
+        mem_io_align(bio->Media->IoAlign);
+        bounce = (UINT8 *)mem_io_get(piece);
+    }
+    if (!bounce)
+        return write ? bio->WriteBlocks(bio, media_id, (EFI_LBA)lba, size, buf)
+                     : bio->ReadBlocks(bio, media_id, (EFI_LBA)lba, size, buf);
+
+    EFI_STATUS status = EFI_SUCCESS;
+    for (UINTN off = 0; off < size && !EFI_ERROR(status); off += piece) {
+        UINTN n = size - off < piece ? size - off : piece;
+        if (write) {
+            mem_copy(bounce, (UINT8 *)buf + off, n);
+            status = bio->WriteBlocks(bio, media_id, (EFI_LBA)lba, n, bounce);
+        } else {
+            status = bio->ReadBlocks(bio, media_id, (EFI_LBA)lba, n, bounce);
+            if (!EFI_ERROR(status))
+                mem_copy((UINT8 *)buf + off, bounce, n);
+        }
+        lba += n / bs;
+    }
+    mem_io_put(bounce);
+    return status;
+}
+
+int disk_bio_read(EFI_BLOCK_IO *bio, UINT32 media_id, UINT64 lba,
+                  UINTN size, void *buf) {
+    TRACE_BEGIN(TR_DISK_READ, lba, size);
+    EFI_STATUS status = bio_xfer(bio, media_id, 0, lba, size, buf);
+    TRACE_END(TR_DISK_READ, lba, size);
+    return EFI_ERROR(status) ? -1 : 0;
+}
+
+int disk_bio_write(EFI_BLOCK_IO *bio, UINT32 media_id, UINT64 lba,
+                   UINTN size, const void *buf) {
+    TRACE_BEGIN(TR_DISK_WRITE, lba, size);
+    EFI_STATUS status = bio_xfer(bio, media_id, 1, lba, size, (void *)buf);
+    TRACE_END(TR_DISK_WRITE, lba, size);
+    return EFI_ERROR(status) ? -1 : 0;
+}
+
+/* ---- Transfer size ---- */
+
+/* Bytes the media asks transfers to be a multiple of, 0 without a hint */
+static UINT32 disk_granule(struct disk_device *dev) {
+    EFI_BLOCK_IO *bio = dev->block_io;
+    if (bio->Revision < EFI_BLOCK_IO_PROTOCOL_REVISION3)
+        return 0;
+    UINT64 g = (UINT64)bio->Media->OptimalTransferLengthGranularity *
+               dev->block_size;
+    return g <= DISK_XFER_MAX ? (UINT32)g : 0;
+}
+
+/* First LBA on a physical block boundary (revision 2 and later) */
+static UINT64 disk_aligned_lba(struct disk_device *dev) {
+    EFI_BLOCK_IO *bio = dev->block_io;
+    if (bio->Revision < EFI_BLOCK_IO_PROTOCOL_REVISION2)
+        return 0;
+    return bio->Media->LowestAlignedLba;
+}
+
+/* Read rate of size-byte requests over DISK_PROBE_BYTES from lba, in
+   bytes per microsecond scaled by 1024; 0 on a read error */
+static UINT64 disk_probe_rate(struct disk_device *dev, UINT64 lba,
+                              UINT32 size, void *buf) {
+    UINT64 t = timer_ticks();
+    for (UINT32 done = 0; done < DISK_PROBE_BYTES; done += size) {
+        if (disk_bio_read(dev->block_io, dev->media_id, lba, size, buf) != 0)
+            return 0;
+        lba += size / dev->block_size;
+    }
+    UINT64 us = timer_us(timer_ticks() - t);
+    return ((UINT64)DISK_PROBE_BYTES << 10) / (us ? us : 1);
+}
+
+UINT32 disk_xfer_size(struct disk_device *dev) {
+    static const UINT32 sizes[] = {
+        DISK_XFER_MIN, 1024 * 1024, DISK_XFER_MAX
+    };
+    enum { NSIZES = sizeof(sizes) / sizeof(sizes[0]) };
+
+    if (dev->xfer_size)
+        return dev->xfer_size;
+
+    UINT32 pick = DISK_XFER_DEFAULT;
+    UINT64 start = disk_aligned_lba(dev);
+    UINT64 span = (UINT64)NSIZES * DISK_PROBE_BYTES;
+    void *buf = dev->size_bytes / dev->block_size >= start + span / dev->block_size
+              ? mem_io_get(DISK_XFER_MAX) : NULL;
+    if (buf) {
+        /* Each size reads its own stretch, so none is served from what
+           the drive cached for the one before */
+        UINT64 rate[NSIZES], best = 0;
+        int ok = 1;
+        for (int i = 0; i < NSIZES && ok; i++) {
+            UINT64 lba = start + (UINT64)i * (DISK_PROBE_BYTES / dev->block_size);
+            rate[i] = disk_probe_rate(dev, lba, sizes[i], buf);
+            ok = rate[i] != 0;
+            if (rate[i] > best) best = rate[i];
+        }
+        for (int i = 0; ok && i < NSIZES; i++) {
+            if (rate[i] * 100 >= best * (100 - DISK_XFER_SLACK)) {
+                pick = sizes[i];
+                break;
+            }
+        }
+        mem_io_put(buf);
+    }
+
+    UINT32 g = disk_granule(dev);
+    if (g > 0 && pick % g != 0)
+        pick += g - pick % g;
+    if (pick % dev->block_size != 0)
+        pick += dev->block_size - pick % dev->block_size;
+    dev->xfer_size = pick;
+    return pick;
+}
+
+/* ---- Write coalescing ----
+ * Small writes are held in a few pending runs of consecutive blocks for a
+ * single device. A write that lands inside or right after a run is merged
+ * into it (so rewriting a FAT sector costs nothing until the flush).
+ * Reads overlay pending data, so callers always see their own writes. */
+
+#define DISK_WQ_RUNS     8
+#define DISK_WQ_RUN_MAX  (256 * 1024)  /* bytes buffered per run */
+
+struct disk_wrun {
+    UINT64 lba;
+    UINT64 count;       /* blocks */
+    UINT8 *buf;         /* DISK_WQ_RUN_MAX bytes, allocated on first use */
+};
+
+static struct {
+    EFI_BLOCK_IO *bio;  /* device the pending runs belong to */
+    UINT32 media_id;
+    UINT32 block_size;
+    int nruns;
+    int error;          /* a queued write failed since the last flush */
+    struct disk_wrun runs[DISK_WQ_RUNS];
+} s_wq;
+
+static void wq_write_run(struct disk_wrun *r) {
+    EFI_STATUS status = bio_xfer(
+        s_wq.bio, s_wq.media_id, 1, r->lba,
+        (UINTN)(r->count * s_wq.block_size), r->buf);
+    if (EFI_ERROR(status)) s_wq.error = 1;
+}
+
+/* Remove run i, keeping its buffer for reuse */
+static void wq_remove(int i) {
+    UINT8 *buf = s_wq.runs[i].buf;
+    s_wq.nruns--;
+    s_wq.runs[i] = s_wq.runs[s_wq.nruns];
+    s_wq.runs[s_wq.nruns].buf = buf;
+    s_wq.runs[s_wq.nruns].count = 0;
+}
+
+/* Write out every pending run in ascending LBA order */
+static void wq_drain(void) {
+    while (s_wq.nruns > 0) {
+        int lo = 0;
+        for (int i = 1; i < s_wq.nruns; i++)
+            if (s_wq.runs[i].lba < s_wq.runs[lo].lba) lo = i;
+        wq_write_run(&s_wq.runs[lo]);
+        wq_remove(lo);
+    }
+}
+
+/* Write out runs overlapping [lba, lba+count), except run 'keep'.
+   Returns the (possibly moved) index of 'keep'. */
+static int wq_drain_overlap(UINT64 lba, UINT64 count, int keep) {
+    for (int i = 0; i < s_wq.nruns; ) {
+        struct disk_wrun *r = &s_wq.runs[i];
+        if (i != keep && r->lba < lba + count && lba < r->lba + r->count) {
+            wq_write_run(r);
+            if (keep == s_wq.nruns - 1) keep = i;  /* wq_remove moves it */
+            wq_remove(i);
+            continue;
+        }
+        i++;
+    }
+    return keep;
+}
+
+/* Point the queue at dev, draining and flushing any other device first */
+static void wq_bind(struct disk_device *dev) {
+    if (s_wq.bio == dev->block_io && s_wq.media_id == dev->media_id)
+        return;
+    if (s_wq.bio) {
+        wq_drain();
+        s_wq.bio->FlushBlocks(s_wq.bio);
+    }
+    s_wq.bio = dev->block_io;
+    s_wq.media_id = dev->media_id;
+    s_wq.block_size = dev->block_size;
+    s_wq.error = 0;
+}
+
+static int wq_write(struct disk_device *dev, UINT64 lba, UINT64 count, void *buf) {
+    wq_bind(dev);
+    UINT64 bytes = count * dev->block_size;
+
+    if (bytes >= DISK_WQ_RUN_MAX) {
+        /* Large write: no point buffering it */
+        wq_drain_overlap(lba, count, -1);
+        EFI_STATUS status = bio_xfer(
+            dev->block_io, dev->media_id, 1, lba, (UINTN)bytes, buf);
+        if (EFI_ERROR(status)) s_wq.error = 1;
+        return s_wq.error ? -1 : 0;
+    }
+
+    /* Merge into a run that the write lands inside of or extends */
+    int hit = -1;
+    for (int i = 0; i < s_wq.nruns; i++) {
+        struct disk_wrun *r = &s_wq.runs[i];
+        if (lba >= r->lba && lba <= r->lba + r->count &&
+            (lba + count - r->lba) * dev->block_size <= DISK_WQ_RUN_MAX) {
+            hit = i;
+            break;
+        }
+    }
+
+    /* Older copies of these blocks in other runs must reach the disk first */
+    hit = wq_drain_overlap(lba, count, hit);
+
+    if (hit < 0) {
+        if (s_wq.nruns == DISK_WQ_RUNS) wq_drain();
+        hit = s_wq.nruns;
+        struct disk_wrun *r = &s_wq.runs[hit];
+        if (!r->buf) {
+            r->buf = (UINT8 *)mem_io_get(DISK_WQ_RUN_MAX);
+            if (!r->buf) {
+                /* No memory for buffering: write through */
+                EFI_STATUS status = bio_xfer(
+                    dev->block_io, dev->media_id, 1, lba, (UINTN)bytes, buf);
+                if (EFI_ERROR(status)) s_wq.error = 1;
+                return s_wq.error ? -1 : 0;
+            }
+        }
+        r->lba = lba;
+        r->count = 0;
+        s_wq.nruns++;
+    }
+
+    struct disk_wrun *r = &s_wq.runs[hit];
+    mem_copy(r->buf + (lba - r->lba) * dev->block_size, buf, (UINTN)bytes);
+    if (lba + count > r->lba + r->count)
+        r->count = lba + count - r->lba;
+    return s_wq.error ? -1 : 0;
+}
+
+int disk_write_blocks(struct disk_device *dev, UINT64 lba, UINT64 count, void *buf) {
+    if (!dev || !dev->block_io || dev->is_boot_device)
+        return -1;
+    return wq_write(dev, lba, count, buf);
 }
 
 int disk_write_blocks_force(struct disk_device *dev, UINT64 lba, UINT64 count, void *buf) {
     if (!dev || !dev->block_io)
         return -1;
+    return wq_write(dev, lba, count, buf);
+}
 
-    UINTN buf_size = (UINTN)(count * (UINT64)dev->block_size);
-    EFI_STATUS status = dev->block_io->WriteBlocks(
-        dev->block_io, dev->media_id, (EFI_LBA)lba, buf_size, buf);
-
-    if (EFI_ERROR(status))
+int disk_flush(struct disk_device *dev) {
+    if (!dev || !dev->block_io)
         return -1;
 
-    dev->block_io->FlushBlocks(dev->block_io);
+    int rc = 0;
+    if (s_wq.bio == dev->block_io && s_wq.media_id == dev->media_id) {
+        wq_drain();
+        rc = s_wq.error ? -1 : 0;
+        s_wq.error = 0;
+    }
+    if (EFI_ERROR(dev->block_io->FlushBlocks(dev->block_io)))
+        rc = -1;
+    return rc;
+}
+
+int disk_holds_volume(struct disk_device *dev, EFI_HANDLE vol_handle) {
+    if (!vol_handle || !dev) return 0;
+
+    /* Direct handle match (superfloppy / whole-disk filesystem) */
+    if (vol_handle == dev->handle) return 1;
+
+    /* Both known from the last enumeration: the device paths decide */
+    if (topo_find(dev->handle) >= 0 && topo_find(vol_handle) >= 0)
+        return disk_is_parent_of(dev->handle, vol_handle);
+
+    /* Check if the volume is a partition on the target device.
+     * If the volume handle has BlockIO with LogicalPartition=true,
+     * and the target is removable, they might be the same physical disk.
+     * Compare by checking if the volume handle's BlockIO parent matches. */
+    EFI_GUID bio_guid = EFI_BLOCK_IO_PROTOCOL_GUID;
+    EFI_BLOCK_IO *vol_bio = NULL;
+    EFI_STATUS status = g_boot.bs->HandleProtocol(
+        vol_handle, &bio_guid, (VOID **)&vol_bio);
+    if (!EFI_ERROR(status) && vol_bio && vol_bio->Media) {
+        if (vol_bio->Media->LogicalPartition && dev->is_removable) {
+            /* The volume is a partition. If the device is removable and
+             * big enough to contain this partition, likely the same disk. */
+            UINT64 vol_size = (UINT64)(vol_bio->Media->LastBlock + 1) *
+                              (UINT64)vol_bio->Media->BlockSize;
+            if (dev->size_bytes >= vol_size)
+                return 1;
+        }
+    }
+
     return 0;
 }
 
 void disk_reconnect(struct disk_device *dev) {
     if (!dev || !dev->handle) return;
 
+    /* Nothing may still be queued when the drivers re-read the disk */
+    if (dev->block_io) disk_flush(dev);
+
     /* Disconnect old drivers first — drops any stale cached filesystem
      * state (e.g. SFS from boot that has old FAT data in memory).
      * Then reconnect so DiskIo + FAT driver bind fresh to the new data. */
     g_boot.bs->DisconnectController(dev->handle, NULL, NULL);
     g_boot.bs->ConnectController(dev->handle, NULL, NULL, TRUE);
+
+    /* Partition handles are recreated: the topology is stale */
+    s_topo_count = 0;
 }
 
 int disk_read_blocks(struct disk_device *dev, UINT64 lba, UINT64 count, void *buf) {
     if (!dev || !dev->block_io)
         return -1;
 
-    UINTN buf_size = (UINTN)(count * (UINT64)dev->block_size);
-    EFI_STATUS status = dev->block_io->ReadBlocks(
-        dev->block_io, dev->media_id, (EFI_LBA)lba, buf_size, buf);
+    int queued = (s_wq.bio == dev->block_io && s_wq.media_id == dev->media_id
+                  && s_wq.nruns > 0);
+    UINT32 bs = dev->block_size;
 
-    return EFI_ERROR(status) ? -1 : 0;
+    /* Entirely inside one pending run: no device access */
+    if (queued) {
+        for (int i = 0; i < s_wq.nruns; i++) {
+            struct disk_wrun *r = &s_wq.runs[i];
+            if (lba >= r->lba && lba + count <= r->lba + r->count) {
+                mem_copy(buf, r->buf + (lba - r->lba) * bs, (UINTN)(count * bs));
+                return 0;
+            }
+        }
+    }
+
+    UINTN buf_size = (UINTN)(count * (UINT64)bs);
+    EFI_STATUS status = bio_xfer(
+        dev->block_io, dev->media_id, 0, lba, buf_size, buf);
+    if (EFI_ERROR(status))
+        return -1;
+
+    /* Overlay pending data on top of what the media holds */
+    if (queued) {
+        for (int i = 0; i < s_wq.nruns; i++) {
+            struct disk_wrun *r = &s_wq.runs[i];
+            UINT64 lo = (lba > r->lba) ? lba : r->lba;
+            UINT64 hi = (lba + count < r->lba + r->count)
+                        ? lba + count : r->lba + r->count;
+            if (lo < hi)
+                mem_copy((UINT8 *)buf + (lo - lba) * bs,
+                         r->buf + (lo - r->lba) * bs, (UINTN)((hi - lo) * bs));
+        }
+    }
+    return 0;
+}
+
+/* ---- Asynchronous requests ---- */
+
+#define IO_FREE    0
+#define IO_BUSY    1            /* BlockIO2 transfer in flight */
+#define IO_DONE    2            /* finished, status not collected yet */
+
+struct disk_io {
+    EFI_BLOCK_IO2_TOKEN token;
+    int state;
+    EFI_STATUS status;
+};
+
+struct disk_queue {
+    struct disk_device *dev;
+    int depth;
+    int force;
+    int async;                  /* every slot has an event */
+    int error;                  /* a request failed */
+    struct disk_io ios[DISK_QUEUE_MAX];
+};
+
+struct disk_queue *disk_queue_open(struct disk_device *dev, int depth,
+                                   int force) {
+    if (!dev || !dev->block_io || dev->block_size == 0) return NULL;
+    if (depth < 1) depth = 1;
+    if (depth > DISK_QUEUE_MAX) depth = DISK_QUEUE_MAX;
+
+    /* Queued small writes must not land after (or be missed by) these */
+    disk_flush(dev);
+
+    struct disk_queue *q = (struct disk_queue *)mem_alloc(sizeof(*q));
+    if (!q) return NULL;
+    mem_io_align(dev->block_io->Media->IoAlign);
+    q->dev = dev;
+    q->depth = depth;
+    q->force = force;
+
+    /* Fall back to synchronous requests unless every slot has an event */
+    q->async = dev->block_io2 != NULL;
+    for (int i = 0; i < depth && q->async; i++)
+        if (EFI_ERROR(g_boot.bs->CreateEvent(0, 0, NULL, NULL,
+                                             &q->ios[i].token.Event)))
+            q->async = 0;
+    if (!q->async) {
+        for (int i = 0; i < depth; i++) {
+            if (q->ios[i].token.Event)
+                g_boot.bs->CloseEvent(q->ios[i].token.Event);
+            q->ios[i].token.Event = NULL;
+        }
+    }
+    return q;
+}
+
+static struct disk_io *queue_submit(struct disk_queue *q, int write,
+                                    UINT64 lba, UINTN count, void *buf) {
+    if (!q || count == 0) return NULL;
+    struct disk_device *dev = q->dev;
+    if (write && dev->is_boot_device && !q->force) return NULL;
+
+    struct disk_io *io = NULL;
+    for (int i = 0; i < q->depth && !io; i++)
+        if (q->ios[i].state == IO_FREE) io = &q->ios[i];
+    if (!io) return NULL;
+
+    UINTN bytes = count * dev->block_size;
+    EFI_STATUS status;
+    if (q->async && bio_aligned(dev->block_io, buf)) {
+        io->token.TransactionStatus = EFI_SUCCESS;
+        status = write
+            ? dev->block_io2->WriteBlocksEx(dev->block_io2, dev->media_id,
+                                            (EFI_LBA)lba, &io->token, bytes, buf)
+            : dev->block_io2->ReadBlocksEx(dev->block_io2, dev->media_id,
+                                           (EFI_LBA)lba, &io->token, bytes, buf);
+        if (!EFI_ERROR(status)) {
+            io->state = IO_BUSY;
+            return io;
+        }
+    } else {
+        status = bio_xfer(dev->block_io, dev->media_id, write, lba, bytes, buf);
+        if (!EFI_ERROR(status)) {
+            io->state = IO_DONE;
+            io->status = EFI_SUCCESS;
+            return io;
+        }
+    }
+    q->error = 1;
+    return NULL;
+}
+
+struct disk_io *disk_submit_read(struct disk_queue *q, UINT64 lba,
+                                 UINTN count, void *buf) {
+    return queue_submit(q, 0, lba, count, buf);
+}
+
+struct disk_io *disk_submit_write(struct disk_queue *q, UINT64 lba,
+                                  UINTN count, const void *buf) {
+    return queue_submit(q, 1, lba, count, (void *)buf);
+}
+
+int disk_poll(struct disk_queue *q, struct disk_io *io) {
+    (void)q;
+    if (!io || io->state == IO_FREE) return -1;
+    if (io->state == IO_BUSY) {
+        if (g_boot.bs->CheckEvent(io->token.Event) != EFI_SUCCESS)
+            return 0;
+        io->status = io->token.TransactionStatus;
+        io->state = IO_DONE;
+    }
+    return 1;
+}
+
+EFI_EVENT disk_io_event(struct disk_io *io) {
+    return io && io->state == IO_BUSY ? io->token.Event : NULL;
+}
+
+int disk_wait(struct disk_queue *q, struct disk_io *io) {
+    if (!io || io->state == IO_FREE) return -1;
+    if (io->state == IO_BUSY) {
+        UINTN idx;
+        g_boot.bs->WaitForEvent(1, &io->token.Event, &idx);
+        io->status = io->token.TransactionStatus;
+    }
+    io->state = IO_FREE;
+    if (EFI_ERROR(io->status)) {
+        q->error = 1;
+        return -1;
+    }
+    return 0;
+}
+
+int disk_queue_free(const struct disk_queue *q) {
+    int n = 0;
+    for (int i = 0; i < q->depth; i++)
+        if (q->ios[i].state == IO_FREE) n++;
+    return n;
+}
+
+int disk_queue_close(struct disk_queue *q) {
+    if (!q) return -1;
+    for (int i = 0; i < q->depth; i++) {
+        if (q->ios[i].state != IO_FREE) disk_wait(q, &q->ios[i]);
+        if (q->ios[i].token.Event)
+            g_boot.bs->CloseEvent(q->ios[i].token.Event);
+    }
+    int rc = q->error ? -1 : 0;
+    mem_free(q);
+    return rc;
+}
+
+/* ---- Pipelined sequential writer ---- */
+
+struct disk_writer {
+    struct disk_queue *q;
+    UINT64 lba;
+    UINTN buf_size;
+    int cur;
+    int error;
+    UINT8 *data[DISK_WRITER_NBUF];
+    struct disk_io *io[DISK_WRITER_NBUF];   /* write in flight, or NULL */
+};
+
+struct disk_writer *disk_writer_open(struct disk_device *dev, UINT64 start_lba,
+                                     UINTN buf_size, int force) {
+    if (!dev || !dev->block_io || dev->block_size == 0) return NULL;
+    if (dev->is_boot_device && !force) return NULL;
+
+    struct disk_writer *w = (struct disk_writer *)mem_alloc(sizeof(*w));
+    if (!w) return NULL;
+    w->lba = start_lba;
+    w->buf_size = (buf_size + dev->block_size - 1) / dev->block_size
+                  * dev->block_size;
+    w->q = disk_queue_open(dev, DISK_WRITER_NBUF, force);
+    if (!w->q) { mem_free(w); return NULL; }
+
+    for (int i = 0; i < DISK_WRITER_NBUF; i++) {
+        w->data[i] = (UINT8 *)mem_io_get(w->buf_size);
+        if (!w->data[i]) { disk_writer_close(w); return NULL; }
+    }
+    return w;
+}
+
+void *disk_writer_next(struct disk_writer *w) {
+    if (!w) return NULL;
+    if (w->io[w->cur]) {
+        if (disk_wait(w->q, w->io[w->cur]) != 0) w->error = 1;
+        w->io[w->cur] = NULL;
+    }
+    return w->error ? NULL : w->data[w->cur];
+}
+
+int disk_writer_submit(struct disk_writer *w, UINTN len) {
+    if (!w || w->error || len == 0 || len > w->buf_size) return -1;
+
+    UINT32 bs = w->q->dev->block_size;
+    UINT8 *b = w->data[w->cur];
+    UINTN padded = (len + bs - 1) / bs * bs;
+    if (padded > len) mem_set(b + len, 0, padded - len);
+
+    w->io[w->cur] = disk_submit_write(w->q, w->lba, padded / bs, b);
+    if (!w->io[w->cur]) {
+        w->error = 1;
+        return -1;
+    }
+
+    w->lba += padded / bs;
+    w->cur = (w->cur + 1) % DISK_WRITER_NBUF;
+    return 0;
+}
+
+int disk_writer_close(struct disk_writer *w) {
+    if (!w) return -1;
+
+    struct disk_device *dev = w->q->dev;
+    if (disk_queue_close(w->q) != 0) w->error = 1;
+    if (!w->error && EFI_ERROR(dev->block_io->FlushBlocks(dev->block_io)))
+        w->error = 1;
+
+    for (int i = 0; i < DISK_WRITER_NBUF; i++)
+        mem_io_put(w->data[i]);
+
+    int rc = w->error ? -1 : 0;
+    mem_free(w);
+    return rc;
+}
+
+/* ---- Pipelined sequential reader ---- */
+
+struct disk_reader {
+    struct disk_queue *q;
+    UINT64 lba;                 /* next block to request */
+    UINT64 end;
+    UINTN buf_size;
+    int cur;                    /* next buffer to hand out */
+    int held;                   /* buffer the caller has, or -1 */
+    int error;
+    UINT8 *data[DISK_WRITER_NBUF];
+    struct disk_io *io[DISK_WRITER_NBUF];
+    UINTN lens[DISK_WRITER_NBUF];   /* bytes requested; 0 past the end */
+};
+
+/* Start reading the next blocks into buffer i */
+static void reader_issue(struct disk_reader *r, int i) {
+    UINT32 bs = r->q->dev->block_size;
+    r->lens[i] = 0;
+    if (r->error || r->lba >= r->end) return;
+
+    UINT64 n = r->buf_size / bs;
+    if (n > r->end - r->lba) n = r->end - r->lba;
+    r->io[i] = disk_submit_read(r->q, r->lba, (UINTN)n, r->data[i]);
+    if (!r->io[i]) {
+        r->error = 1;
+        return;
+    }
+
+    r->lens[i] = (UINTN)(n * bs);
+    r->lba += n;
+}
+
+struct disk_reader *disk_reader_open(struct disk_device *dev, UINT64 start_lba,
+                                     UINT64 nblocks, UINTN buf_size) {
+    if (!dev || !dev->block_io || dev->block_size == 0) return NULL;
+
+    struct disk_reader *r = (struct disk_reader *)mem_alloc(sizeof(*r));
+    if (!r) return NULL;
+    r->lba = start_lba;
+    r->end = start_lba + nblocks;
+    r->held = -1;
+    r->buf_size = (buf_size + dev->block_size - 1) / dev->block_size
+                  * dev->block_size;
+    r->q = disk_queue_open(dev, DISK_WRITER_NBUF, 0);
+    if (!r->q) { mem_free(r); return NULL; }
+
+    for (int i = 0; i < DISK_WRITER_NBUF; i++) {
+        r->data[i] = (UINT8 *)mem_io_get(r->buf_size);
+        if (!r->data[i]) { disk_reader_close(r); return NULL; }
+    }
+
+    /* Every buffer starts out reading ahead */
+    for (int i = 0; i < DISK_WRITER_NBUF; i++)
+        reader_issue(r, i);
+    return r;
+}
+
+const void *disk_reader_next(struct disk_reader *r, UINTN *len) {
+    if (!r) return NULL;
+
+    /* The caller is done with the last buffer: refill it */
+    if (r->held >= 0) {
+        reader_issue(r, r->held);
+        r->held = -1;
+    }
+
+    int i = r->cur;
+    if (r->io[i]) {
+        if (disk_wait(r->q, r->io[i]) != 0) r->error = 1;
+        r->io[i] = NULL;
+    }
+    if (r->error || r->lens[i] == 0) return NULL;
+
+    *len = r->lens[i];
+    r->held = i;
+    r->cur = (i + 1) % DISK_WRITER_NBUF;
+    return r->data[i];
+}
+
+int disk_reader_close(struct disk_reader *r) {
+    if (!r) return -1;
+
+    if (disk_queue_close(r->q) != 0) r->error = 1;
+    for (int i = 0; i < DISK_WRITER_NBUF; i++)
+        mem_io_put(r->data[i]);
+
+    int rc = r->error ? -1 : 0;
+    mem_free(r);
+    return rc;
+}
+
+/* ---- Zeroing ---- */
+
+#define DISK_ZERO_IO    (4 * 1024 * 1024)   /* bytes per zero write */
+#define DISK_ZERO_DEPTH 4                   /* zero writes in flight */
+#define DISK_ERASE_MIN  (1024 * 1024)       /* smaller ranges are written */
+#define DISK_ERASE_STEP (1024ULL * 1024 * 1024) /* bytes per erase call */
+
+/* DISK_ZERO_IO bytes of zeros, shared by every zero write and kept */
+static UINT8 *s_zero;
+
+/* Write zeros over [lba, lba+count) from s_zero, DISK_ZERO_DEPTH
+   writes at a time, adding the bytes to *done */
+static int zero_write(struct disk_device *dev, UINT64 lba, UINT64 count,
+                      UINT64 *done, UINT64 total, disk_progress_fn progress) {
+    if (count == 0) return 0;
+    if (!s_zero) {
+        s_zero = (UINT8 *)mem_io_get(DISK_ZERO_IO);
+        if (!s_zero) return -1;
+        mem_set(s_zero, 0, DISK_ZERO_IO);
+    }
+    struct disk_queue *q = disk_queue_open(dev, DISK_ZERO_DEPTH, 0);
+    if (!q) return -1;
+
+    UINT32 bs = dev->block_size;
+    UINT64 per = DISK_ZERO_IO / bs;
+    struct disk_io *io[DISK_ZERO_DEPTH];
+    UINT64 len[DISK_ZERO_DEPTH];
+    int n = 0, k = 0, rc = 0;
+    for (;;) {
+        /* Retire the oldest write before reusing its slot */
+        if (n == DISK_ZERO_DEPTH || (count == 0 && n > 0)) {
+            int old = (k - n + DISK_ZERO_DEPTH) % DISK_ZERO_DEPTH;
+            if (disk_wait(q, io[old]) != 0) rc = -1;
+            n--;
+            *done += len[old] * bs;
+            if (progress) progress(*done, total);
+            continue;
+        }
+        if (count == 0 || rc != 0) break;
+        UINT64 c = count < per ? count : per;
+        io[k] = disk_submit_write(q, lba, (UINTN)c, s_zero);
+        if (!io[k]) { rc = -1; break; }
+        len[k] = c;
+        k = (k + 1) % DISK_ZERO_DEPTH;
+        n++;
+        lba += c;
+        count -= c;
+    }
+    if (disk_queue_close(q) != 0) rc = -1;
+    return rc;
+}
+
+/* Erase [lba, lba+count) in DISK_ERASE_STEP calls, then check that the
+   first, middle and last blocks read back as zeros */
+static int erase_range(struct disk_device *dev, UINT64 lba, UINT64 count,
+                       UINT64 *done, UINT64 total, disk_progress_fn progress) {
+    EFI_ERASE_BLOCK_PROTOCOL *eb = dev->erase;
+    UINT32 bs = dev->block_size;
+    UINT64 g = eb->EraseLengthGranularity ? eb->EraseLengthGranularity : 1;
+    UINT64 step = DISK_ERASE_STEP / bs / g * g;
+    if (step == 0) step = g;
+
+    UINT64 base = *done;
+    for (UINT64 off = 0; off < count; off += step) {
+        UINT64 n = count - off < step ? count - off : step;
+        EFI_ERASE_BLOCK_TOKEN token = { NULL, EFI_SUCCESS };
+        /* The protocol takes itself where the prototype says BlockIO */
+        EFI_STATUS st = eb->EraseBlocks((EFI_BLOCK_IO_PROTOCOL *)eb,
+                                        dev->media_id, (EFI_LBA)(lba + off),
+                                        &token, (UINTN)(n * bs));
+        if (EFI_ERROR(st) || EFI_ERROR(token.TransactionStatus)) {
+            *done = base;
+            return -1;
+        }
+        *done += n * bs;
+        if (progress) progress(*done, total);
+    }
+
+    UINT8 *blk = (UINT8 *)mem_io_get(bs);
+    if (!blk) return -1;
+    UINT64 probe[3] = { lba, lba + count / 2, lba + count - 1 };
+    int rc = 0;
+    for (int i = 0; i < 3 && rc == 0; i++) {
+        if (disk_read_blocks(dev, probe[i], 1, blk) != 0) {
+            rc = -1;
+            break;
+        }
+        for (UINT32 j = 0; j < bs; j++)
+            if (blk[j]) { rc = -1; break; }
+    }
+    mem_io_put(blk);
+    if (rc != 0) *done = base;
+    return rc;
+}
+
+int disk_zero_blocks(struct disk_device *dev, UINT64 lba, UINT64 count,
+                     disk_progress_fn progress) {
+    if (!dev || !dev->block_io || dev->is_boot_device) return -1;
+    if (count == 0) return 0;
+    UINT32 bs = dev->block_size;
+    UINT64 total = count * bs, done = 0;
+
+    /* Queued writes to these blocks must not land after the zeros */
+    if (disk_flush(dev) != 0) return -1;
+
+    /* Erase the granularity-aligned middle, write the ends */
+    if (dev->erase && total >= DISK_ERASE_MIN) {
+        UINT64 g = dev->erase->EraseLengthGranularity;
+        if (g == 0) g = 1;
+        UINT64 lo = (lba + g - 1) / g * g, hi = (lba + count) / g * g;
+        if (hi > lo && (hi - lo) * bs >= DISK_ERASE_MIN) {
+            if (zero_write(dev, lba, lo - lba, &done, total, progress) != 0)
+                return -1;
+            if (erase_range(dev, lo, hi - lo, &done, total, progress) == 0) {
+                if (zero_write(dev, hi, lba + count - hi, &done, total,
+                               progress) != 0)
+                    return -1;
+                return 1;
+            }
+            /* Refused, or erased blocks do not read as zeros: write */
+            return zero_write(dev, lo, lba + count - lo, &done, total,
+                              progress) == 0 ? 0 : -1;
+        }
+    }
+    return zero_write(dev, lba, count, &done, total, progress) == 0 ? 0 : -1;
+}
+
+/* ---- Device to device copy ---- */
+
+struct disk_copier {
+    struct disk_queue *rq, *wq;
+    UINT32 bs;
+    UINT64 per;                 /* blocks per chunk */
+    UINT8 *buf[DISK_COPY_NBUF];
+    struct disk_io *rio[DISK_COPY_NBUF], *wio[DISK_COPY_NBUF];
+    UINT64 lba[DISK_COPY_NBUF], to[DISK_COPY_NBUF], n[DISK_COPY_NBUF];
+    int next;                   /* slot of the next chunk */
+    int pending;                /* chunks read but not yet written */
+    int error;
+    disk_copy_fix_fn fix;
+    void *fix_ctx;
+    UINT64 done, total;
+    disk_progress_fn progress;
+};
+
+struct disk_copier *disk_copier_open(struct disk_device *src,
+                                     struct disk_device *dst, UINTN buf_size,
+                                     UINT64 total, disk_progress_fn progress) {
+    if (!src || !dst || !src->block_io || !dst->block_io ||
+        dst->is_boot_device || src->block_size == 0 ||
+        src->block_size != dst->block_size)
+        return NULL;
+
+    struct disk_copier *c = (struct disk_copier *)mem_alloc(sizeof(*c));
+    if (!c) return NULL;
+    c->bs = src->block_size;
+    c->per = (buf_size + c->bs - 1) / c->bs;
+    if (c->per == 0) c->per = 1;
+    c->total = total;
+    c->progress = progress;
+    c->rq = disk_queue_open(src, DISK_COPY_NBUF, 0);
+    c->wq = disk_queue_open(dst, DISK_COPY_NBUF, 0);
+    int ok = c->rq && c->wq;
+    for (int i = 0; i < DISK_COPY_NBUF && ok; i++) {
+        c->buf[i] = (UINT8 *)mem_io_get((UINTN)(c->per * c->bs));
+        if (!c->buf[i]) ok = 0;
+    }
+    if (!ok) {
+        disk_copier_close(c);
+        return NULL;
+    }
+    return c;
+}
+
+void disk_copier_fix(struct disk_copier *c, disk_copy_fix_fn fn, void *ctx) {
+    c->fix = fn;
+    c->fix_ctx = ctx;
+}
+
+/* Write out the oldest chunk once its read is in */
+static int copier_retire(struct disk_copier *c) {
+    int s = (c->next - c->pending + DISK_COPY_NBUF) % DISK_COPY_NBUF;
+    c->pending--;
+    int rc = disk_wait(c->rq, c->rio[s]);
+    c->rio[s] = NULL;
+    if (rc != 0) return -1;
+
+    if (c->fix) c->fix(c->fix_ctx, c->lba[s], c->n[s], c->buf[s]);
+    c->wio[s] = disk_submit_write(c->wq, c->to[s], (UINTN)c->n[s], c->buf[s]);
+    if (!c->wio[s]) return -1;
+
+    c->done += c->n[s] * c->bs;
+    if (c->progress) c->progress(c->done, c->total);
+    return 0;
+}
+
+int disk_copier_run(struct disk_copier *c, UINT64 lba, UINT64 count) {
+    return disk_copier_move(c, lba, lba, count);
+}
+
+int disk_copier_move(struct disk_copier *c, UINT64 lba, UINT64 to,
+                     UINT64 count) {
+    if (!c || c->error) return -1;
+    while (count) {
+        UINT64 n = count < c->per ? count : c->per;
+        int s = c->next;
+        if (c->wio[s]) {
+            int rc = disk_wait(c->wq, c->wio[s]);
+            c->wio[s] = NULL;
+            if (rc != 0) { c->error = 1; return -1; }
+        }
+        c->rio[s] = disk_submit_read(c->rq, lba, (UINTN)n, c->buf[s]);
+        if (!c->rio[s]) { c->error = 1; return -1; }
+        c->lba[s] = lba;
+        c->to[s] = to;
+        c->n[s] = n;
+        c->next = (s + 1) % DISK_COPY_NBUF;
+        c->pending++;
+        if (c->pending > DISK_COPY_NBUF / 2 && copier_retire(c) != 0) {
+            c->error = 1;
+            return -1;
+        }
+        lba += n;
+        to += n;
+        count -= n;
+    }
+    return 0;
+}
+
+int disk_copier_close(struct disk_copier *c) {
+    if (!c) return -1;
+    while (c->pending)
+        if (copier_retire(c) != 0) c->error = 1;
+    if (c->rq && disk_queue_close(c->rq) != 0) c->error = 1;
+    if (c->wq) {
+        struct disk_device *dst = c->wq->dev;
+        if (disk_queue_close(c->wq) != 0) c->error = 1;
+        if (!c->error && EFI_ERROR(dst->block_io->FlushBlocks(dst->block_io)))
+            c->error = 1;
+    }
+    for (int i = 0; i < DISK_COPY_NBUF; i++)
+        mem_io_put(c->buf[i]);
+
+    int rc = c->error ? -1 : 0;
+    mem_free(c);
+    return rc;
 }
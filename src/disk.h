@@ -11,33 +11,244 @@
 struct disk_device {
     EFI_HANDLE          handle;
     EFI_BLOCK_IO        *block_io;
+    EFI_BLOCK_IO2_PROTOCOL *block_io2; /* async I/O, NULL if unsupported */
+    EFI_ERASE_BLOCK_PROTOCOL *erase;   /* discard/erase, NULL if unsupported */
     UINT64              size_bytes;
     UINT32              block_size;
     UINT32              media_id;
     char                name[64];
     int                 is_removable;
     int                 is_boot_device; /* don't write to this! */
+    UINT32              xfer_size;      /* disk_xfer_size(), 0 until asked */
+    EFI_BLOCK_IO        *fw_block_io;   /* the firmware's, when one of our */
+    EFI_BLOCK_IO2_PROTOCOL *fw_block_io2; /* drivers has replaced them */
 };
 
-/* Enumerate block devices. Returns count found (up to max). */
+/* Enumerate block devices. Returns count found (up to max). Also
+   records how every BlockIO handle nests (partitions under their disk),
+   which the parent tests below consult until the next enumeration or
+   disk_reconnect(). */
 int disk_enumerate(struct disk_device *devs, int max);
 
-/* Write blocks to device. Returns 0 on success, -1 on error. */
+/* Describe the boot partition itself (disk_enumerate() lists whole
+   disks only) for raw reads; writes to it are refused like any boot
+   device's. Returns 0 on success. */
+int disk_open_boot_partition(struct disk_device *out);
+
+/* Write blocks to device. Small writes are queued and merged with
+   adjacent ones; nothing is guaranteed on the media until disk_flush().
+   Returns 0 on success, -1 on error (including an earlier queued write). */
 int disk_write_blocks(struct disk_device *dev, UINT64 lba, UINT64 count, void *buf);
 
-/* Read blocks from device. Returns 0 on success, -1 on error. */
+/* Read blocks from device (sees queued writes). Returns 0 on success, -1 on error. */
 int disk_read_blocks(struct disk_device *dev, UINT64 lba, UINT64 count, void *buf);
 
+/* Barrier: write out queued blocks in LBA order, then FlushBlocks once.
+   Returns 0 if every write since the last flush succeeded. */
+int disk_flush(struct disk_device *dev);
+
 /* Force UEFI to re-probe a device (disconnect and reconnect drivers).
    Call after raw block writes that change or destroy the device's filesystem. */
 void disk_reconnect(struct disk_device *dev);
 
-/* Write blocks, bypassing the boot device safety check.
-   Only for confirmed destructive operations (ISO write to boot device). */
+/* Whether the volume on vol_handle lies on dev: the same handle, or a
+   partition whose device path lies under dev's. Handles the last
+   enumeration did not see are guessed at: a partition that dev is
+   removable and big enough to hold. A NULL handle (the boot volume)
+   never matches. */
+int disk_holds_volume(struct disk_device *dev, EFI_HANDLE vol_handle);
+
+/* Write blocks, bypassing the boot device safety check (queued like
+   disk_write_blocks). Only for confirmed destructive operations. */
 int disk_write_blocks_force(struct disk_device *dev, UINT64 lba, UINT64 count, void *buf);
 
+/* ReadBlocks/WriteBlocks of size bytes on any BlockIO, staged through
+   device I/O buffers (mem_io_get) when buf does not meet the device's
+   IoAlign. disk_*_blocks() and the queues below go through these.
+   Returns 0 on success, -1 on error. */
+int disk_bio_read(EFI_BLOCK_IO *bio, UINT32 media_id, UINT64 lba,
+                  UINTN size, void *buf);
+int disk_bio_write(EFI_BLOCK_IO *bio, UINT32 media_id, UINT64 lba,
+                   UINTN size, const void *buf);
+
+/* ---- Transfer size ----
+ * The request size a bulk reader should use: the smallest of a few
+ * probed sizes whose read rate comes within DISK_XFER_SLACK percent of
+ * the best, so a USB 2.0 stick is not handed 4 MB buffers it gains
+ * nothing from. The probe reads DISK_PROBE_BYTES per size from the
+ * media's LowestAlignedLba on first use; the result is rounded up to
+ * its OptimalTransferLengthGranularity (BlockIO revision 3 hints). */
+
+#define DISK_XFER_MIN     (256 * 1024)
+#define DISK_XFER_MAX     (4 * 1024 * 1024)
+#define DISK_XFER_DEFAULT DISK_XFER_MAX     /* media too small to probe */
+#define DISK_XFER_SLACK   5
+#define DISK_PROBE_BYTES  (8 * 1024 * 1024)
+
+/* Request size for bulk transfers on dev, in bytes (a multiple of its
+   block size and granularity); probes the device the first time */
+UINT32 disk_xfer_size(struct disk_device *dev);
+
+/* ---- Asynchronous requests ----
+ * Up to a queue's depth of reads and writes in flight on one device
+ * through BlockIO2, completing in any order. Without BlockIO2 each
+ * request runs to completion when submitted, so callers have one code
+ * path either way. Requests go straight to the device: opening a queue
+ * writes out the small-write queue above, and reads through a queue do
+ * not see later disk_write_blocks() data still queued. */
+
+#define DISK_QUEUE_MAX 64
+
+struct disk_queue;
+struct disk_io;         /* a request, from submit until disk_wait() */
+
+/* Open a queue of depth requests (1..DISK_QUEUE_MAX). force=1 allows
+   writes to the boot device. Returns NULL on error. */
+struct disk_queue *disk_queue_open(struct disk_device *dev, int depth,
+                                   int force);
+
+/* Start a transfer of count blocks; buf must stay valid (and, for a
+   read, untouched) until the request is waited for. A buffer from
+   mem_io_get() runs asynchronously; one the device's IoAlign does not
+   allow is staged and completes before this returns. Returns NULL if
+   the submission failed or all depth requests are outstanding. */
+struct disk_io *disk_submit_read(struct disk_queue *q, UINT64 lba,
+                                 UINTN count, void *buf);
+struct disk_io *disk_submit_write(struct disk_queue *q, UINT64 lba,
+                                  UINTN count, const void *buf);
+
+/* 1 if the request has finished, 0 if it is still in flight */
+int disk_poll(struct disk_queue *q, struct disk_io *io);
+
+/* The event that signals when io finishes, for the event loop; NULL
+   if it already has (synchronous queues finish on submit) */
+EFI_EVENT disk_io_event(struct disk_io *io);
+
+/* Wait for a request and release it. Returns 0 if it succeeded. */
+int disk_wait(struct disk_queue *q, struct disk_io *io);
+
+/* Requests that can be submitted now */
+int disk_queue_free(const struct disk_queue *q);
+
+/* Wait for everything outstanding and free the queue. Returns 0 if
+   every request succeeded. Does not flush the device. */
+int disk_queue_close(struct disk_queue *q);
+
+/* ---- Pipelined sequential writer ----
+ * Buffers come from mem_io_get() and are written in turn through a queue of
+ * DISK_WRITER_NBUF requests: the writes of earlier buffers overlap
+ * filling the next. The device is flushed once, on close. */
+
+#define DISK_WRITER_NBUF 4
+
+struct disk_writer;
+
+/* Open a writer that starts at start_lba, using DISK_WRITER_NBUF buffers
+   of buf_size bytes (rounded up to whole blocks). force=1 allows the boot
+   device. Returns NULL on error. */
+struct disk_writer *disk_writer_open(struct disk_device *dev, UINT64 start_lba,
+                                     UINTN buf_size, int force);
+
+/* Get the next buffer to fill, waiting for its previous write to finish.
+   Returns NULL if a write has failed. */
+void *disk_writer_next(struct disk_writer *w);
+
+/* Queue the buffer returned by disk_writer_next holding len bytes; the
+   tail is zero-padded to a whole block. Returns 0 on success. */
+int disk_writer_submit(struct disk_writer *w, UINTN len);
+
+/* Wait for outstanding writes, flush the device and free the writer.
+   Returns 0 if every write succeeded. */
+int disk_writer_close(struct disk_writer *w);
+
+/* ---- Pipelined sequential reader ----
+ * The mirror of the writer: the reads of the next DISK_WRITER_NBUF - 1
+ * buffers are in flight while the caller works on the current one. */
+
+struct disk_reader;
+
+/* Open a reader over nblocks blocks from start_lba, in buffers of
+   buf_size bytes (rounded up to whole blocks). Returns NULL on error. */
+struct disk_reader *disk_reader_open(struct disk_device *dev, UINT64 start_lba,
+                                     UINT64 nblocks, UINTN buf_size);
+
+/* The next buffer in order with its length in *len, valid until the
+   following call. NULL at the end or after a read error. */
+const void *disk_reader_next(struct disk_reader *r, UINTN *len);
+
+/* Wait for outstanding reads and free the reader. Returns 0 if every
+   read succeeded. */
+int disk_reader_close(struct disk_reader *r);
+
+/* ---- Zeroing ---- */
+
+/* Bytes done so far out of total */
+typedef void (*disk_progress_fn)(UINT64 done, UINT64 total);
+
+/* Make count blocks from lba read as zeros, refusing the boot device.
+   With the Erase Block protocol the bulk of a range is erased (discard,
+   TRIM or erase: no data moves), and kept only if erased blocks read
+   back as zeros; everything else is written from a shared zero buffer
+   in large queued writes. Queued small writes are flushed first.
+   progress may be NULL. Returns 1 if the device erased the bulk of the
+   range, 0 if it was all written, -1 on error. */
+int disk_zero_blocks(struct disk_device *dev, UINT64 lba, UINT64 count,
+                     disk_progress_fn progress);
+
+/* ---- Device to device copy ----
+ * Runs of blocks copied between two devices of the same block size
+ * through a ring of DISK_COPY_NBUF buffers: the reads of the next
+ * chunks run on the source while older chunks are written to the
+ * target, each device's queue kept busy with half of the ring. */
+
+#define DISK_COPY_NBUF 8
+
+struct disk_copier;
+
+/* Called on every chunk between its read and its write: count blocks
+   from lba in buf */
+typedef void (*disk_copy_fix_fn)(void *ctx, UINT64 lba, UINT64 count,
+                                 UINT8 *buf);
+
+/* Open a copier from src to dst in chunks of up to buf_size bytes
+   (rounded up to whole blocks), refusing a boot device target.
+   progress (may be NULL) is told of the bytes submitted for writing
+   out of total. Returns NULL on error. */
+struct disk_copier *disk_copier_open(struct disk_device *src,
+                                     struct disk_device *dst, UINTN buf_size,
+                                     UINT64 total, disk_progress_fn progress);
+
+/* Have fn see every chunk from now on (fn NULL: none) */
+void disk_copier_fix(struct disk_copier *c, disk_copy_fix_fn fn, void *ctx);
+
+/* Copy blocks [lba, lba+count) of src to the same blocks of dst.
+   Returns 0, or -1 after a read or write error, when the copier is
+   only good for closing. */
+int disk_copier_run(struct disk_copier *c, UINT64 lba, UINT64 count);
+
+/* The same into blocks [to, to+count) of dst, which may be src itself
+   when the two ranges do not overlap */
+int disk_copier_move(struct disk_copier *c, UINT64 lba, UINT64 to,
+                     UINT64 count);
+
+/* Write out what is still in flight, flush dst and free the copier.
+   Returns 0 if every read and write succeeded. */
+int disk_copier_close(struct disk_copier *c);
+
+/* First LBA of a partition on a whole disk (0 when the handles are the
+   same, a filesystem without a partition table). Returns -1 if the
+   partition is not a direct child of the disk. */
+int disk_partition_start(EFI_HANDLE disk, EFI_HANDLE partition, UINT64 *lba);
+
 /* Check if a whole-disk handle has any partition matching one of the given
    handles.  Used to deduplicate [DISK] entries against USB/exFAT/NTFS. */
 int disk_has_claimed_partition(EFI_HANDLE disk, EFI_HANDLE *claimed, int nclaimed);
 
+/* The BlockIO to mount the volume on handle through: bio, the
+   firmware's for it, unless the disk it lies on is driven by one of our
+   own drivers (usbms.h, sdmmc.h, nvme.h), in which case a view of that driver's
+   BlockIO offset to the partition. The disks are enumerated on the
+   first call in builds with such a driver. */
+EFI_BLOCK_IO *disk_volume_bio(EFI_HANDLE handle, EFI_BLOCK_IO *bio);
+
 #endif /* DISK_H */
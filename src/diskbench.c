@@ -0,0 +1,511 @@
+/*
+ * diskbench.c — Raw throughput and latency benchmark for block devices
+ *
+ * Every test runs for DB_TEST_MS. Reads go straight to the device with
+ * disk_bio_read(); queued tests use the disk_queue API, which turns
+ * into one request at a time on firmware without BlockIO2 (the screen
+ * says so). Sequential tests wrap around within DB_SEQ_SPAN so a large
+ * device does not take longer than a small one.
+ *
+ * Write tests are opt-in. They stay inside a DB_WRITE_SPAN window in
+ * the middle of the device, away from the partition table and the
+ * filesystem metadata at the start: the window is read into memory
+ * first and written back at the end, so the device keeps its data
+ * unless the machine is reset or the device pulled during the tests.
+ * Writes go through a queue, which refuses the boot device exactly as
+ * disk_write_blocks() does, rather than through the small-write queue,
+ * which would merge the 4 KB writes being measured.
+ */
+
+#include "diskbench.h"
+#include "fb.h"
+#include "kbd.h"
+#include "mem.h"
+#include "progress.h"
+#include "timer.h"
+#include "shim.h"
+#include "usbms.h"
+#include "sdmmc.h"
+#include "nvme.h"
+
+#define MB (1024 * 1024)
+
+#define DB_TEST_MS     2000
+#define DB_SEQ_SPAN    (1024ULL * MB)   /* sequential tests wrap here */
+#define DB_WRITE_SPAN  (64 * MB)        /* saved, written over, restored */
+#define DB_RAND_IO     4096
+#define DB_MAX_IO      (8 * MB)
+#define DB_QD          64               /* queued random reads */
+#define DB_FLUSHES     32
+#define DB_RESTORE_IO  MB               /* backup and restore pieces */
+#define DB_MAX_RESULTS 24
+
+#define DB_CSV_HEADER \
+    "date,device,size_mb,block_io2,test,block,qd,ops,bytes,ms,mb_s,iops,avg_us,max_us\r\n"
+
+static const UINT32 s_sizes[] = {
+    4096, 16384, 65536, 262144, MB, 8 * MB
+};
+#define DB_NSIZES ((int)(sizeof(s_sizes) / sizeof(s_sizes[0])))
+
+struct db_result {
+    const char *test;
+    UINT32 block;           /* bytes per request, 0 for a bare flush */
+    UINT32 qd;
+    UINT64 ops;
+    UINT64 bytes;
+    UINT64 ns;              /* wall time of the whole test */
+    UINT64 lat_max;         /* ns, slowest single request */
+    int failed;
+};
+
+struct db_run {
+    struct disk_device *dev;
+    UINT64 nblocks;
+    UINT32 bs;
+    UINT8 *buf;             /* DB_MAX_IO; the write pattern in write tests */
+    UINT64 seed;
+    struct db_result res[DB_MAX_RESULTS];
+    int nres;
+};
+
+/* xorshift64: offsets and write data no controller can predict */
+static UINT64 db_rand(struct db_run *r) {
+    UINT64 x = r->seed;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return r->seed = x;
+}
+
+static void db_size_str(UINT32 bytes, char *out, UINTN size) {
+    if (bytes == 0)
+        snprintf(out, size, "-");
+    else if (bytes >= MB)
+        snprintf(out, size, "%u MB", bytes / MB);
+    else
+        snprintf(out, size, "%u KB", bytes / 1024);
+}
+
+/* Tenths of a MB per second and requests per second */
+static UINT64 db_rate(const struct db_result *x) {
+    UINT64 us = x->ns / 1000;
+    return us ? x->bytes * 10 * 1000000 / us / MB : 0;
+}
+
+static UINT64 db_iops(const struct db_result *x) {
+    UINT64 us = x->ns / 1000;
+    return us ? x->ops * 1000000 / us : 0;
+}
+
+/* Average latency in us; only one request at a time has one */
+static UINT64 db_avg_us(const struct db_result *x) {
+    return x->qd == 1 && x->ops ? x->ns / x->ops / 1000 : 0;
+}
+
+static void db_print(const struct db_result *x) {
+    char line[160], sz[16];
+    db_size_str(x->block, sz, sizeof(sz));
+    if (x->failed) {
+        snprintf(line, sizeof(line), "  %-16s %6s  QD%-3u  FAILED\n",
+                 x->test, sz, x->qd);
+        fb_print(line, COLOR_RED);
+        return;
+    }
+    UINT64 r = db_rate(x);
+    int n = snprintf(line, sizeof(line), "  %-16s %6s  QD%-3u %6llu.%llu MB/s %8llu IOPS",
+                     x->test, sz, x->qd, (unsigned long long)(r / 10),
+                     (unsigned long long)(r % 10),
+                     (unsigned long long)db_iops(x));
+    if (x->qd == 1 && n > 0 && (UINTN)n < sizeof(line))
+        snprintf(line + n, sizeof(line) - n, "  avg %6llu us  max %6llu us",
+                 (unsigned long long)db_avg_us(x),
+                 (unsigned long long)(x->lat_max / 1000));
+    fb_print(line, COLOR_WHITE);
+    fb_print("\n", COLOR_WHITE);
+    fb_present();
+}
+
+static struct db_result *db_result_new(struct db_run *r, const char *test,
+                                       UINT32 block, UINT32 qd) {
+    if (r->nres == DB_MAX_RESULTS) return NULL;
+    struct db_result *x = &r->res[r->nres++];
+    mem_set(x, 0, sizeof(*x));
+    x->test = test;
+    x->qd = qd;
+    /* Whole device blocks per request */
+    x->block = block == 0 ? 0 : block < r->bs ? r->bs : block / r->bs * r->bs;
+    return x;
+}
+
+static int db_write(struct disk_queue *q, UINT64 lba, UINTN count,
+                    const void *buf) {
+    struct disk_io *io = disk_submit_write(q, lba, count, buf);
+    return io ? disk_wait(q, io) : -1;
+}
+
+/* One request at a time until DB_TEST_MS is up, sequentially from lo
+   or at random x->block-aligned offsets within span blocks. Writes go
+   through q and are flushed before the clock stops. */
+static void db_qd1(struct db_run *r, struct db_result *x, struct disk_queue *q,
+                   int write, int seq, UINT64 lo, UINT64 span) {
+    UINT32 per = x->block / r->bs;
+    UINT64 slots = span / per;
+    if (slots == 0) { x->failed = 1; return; }
+
+    struct disk_device *dev = r->dev;
+    UINT64 start = timer_ticks(), now = start, next = 0, lat_max = 0;
+    UINT64 end = start + timer_hz() * DB_TEST_MS / 1000;
+    while (now < end) {
+        UINT64 slot = seq ? next++ % slots : db_rand(r) % slots;
+        UINT64 lba = lo + slot * per;
+        int rc = write ? db_write(q, lba, per, r->buf)
+                       : disk_bio_read(dev->block_io, dev->media_id, lba,
+                                       x->block, r->buf);
+        UINT64 t = timer_ticks();
+        if (rc != 0) { x->failed = 1; break; }
+        if (t - now > lat_max) lat_max = t - now;
+        now = t;
+        x->ops++;
+    }
+    if (write && !x->failed &&
+        EFI_ERROR(dev->block_io->FlushBlocks(dev->block_io)))
+        x->failed = 1;
+    x->ns = timer_ns(timer_ticks() - start);
+    x->bytes = x->ops * x->block;
+    x->lat_max = timer_ns(lat_max);
+}
+
+/* Random x->block reads over the whole device with DB_QD requests in
+   flight: each slot is resubmitted as soon as it has been waited for,
+   and the clock stops when the last one is in */
+static void db_qdn(struct db_run *r, struct db_result *x) {
+    UINT32 per = x->block / r->bs;
+    UINT64 slots = r->nblocks / per;
+    struct disk_queue *q = slots ? disk_queue_open(r->dev, DB_QD, 0) : NULL;
+    if (!q) { x->failed = 1; return; }
+
+    struct disk_io *io[DB_QD];
+    UINT64 start = timer_ticks();
+    UINT64 end = start + timer_hz() * DB_TEST_MS / 1000;
+    int n = 0;
+    for (; n < DB_QD; n++) {
+        io[n] = disk_submit_read(q, db_rand(r) % slots * per, per,
+                                 r->buf + (UINTN)n * x->block);
+        if (!io[n]) break;
+    }
+    if (n == 0) x->failed = 1;
+
+    for (int k = 0; !x->failed; k = (k + 1) % n) {
+        int rc = disk_wait(q, io[k]);
+        io[k] = NULL;
+        if (rc != 0) { x->failed = 1; break; }
+        x->ops++;
+        if (timer_ticks() >= end) break;
+        io[k] = disk_submit_read(q, db_rand(r) % slots * per, per,
+                                 r->buf + (UINTN)k * x->block);
+        if (!io[k]) x->failed = 1;
+    }
+    for (int k = 0; k < n; k++) {
+        if (!io[k]) continue;
+        if (disk_wait(q, io[k]) != 0) x->failed = 1;
+        else x->ops++;
+    }
+    x->ns = timer_ns(timer_ticks() - start);
+    x->bytes = x->ops * x->block;
+    if (disk_queue_close(q) != 0) x->failed = 1;
+}
+
+/* DB_FLUSHES flushes, each after a x->block write at lba through q
+   when there is one */
+static void db_flush(struct db_run *r, struct db_result *x,
+                     struct disk_queue *q, UINT64 lba) {
+    EFI_BLOCK_IO *bio = r->dev->block_io;
+    UINT32 per = x->block / r->bs;
+    UINT64 start = timer_ticks(), now = start, lat_max = 0;
+    for (int i = 0; i < DB_FLUSHES; i++) {
+        if (q && db_write(q, lba + (UINT64)i * per, per, r->buf) != 0) {
+            x->failed = 1;
+            break;
+        }
+        if (EFI_ERROR(bio->FlushBlocks(bio))) {
+            x->failed = 1;
+            break;
+        }
+        UINT64 t = timer_ticks();
+        if (t - now > lat_max) lat_max = t - now;
+        now = t;
+        x->ops++;
+    }
+    x->ns = timer_ns(now - start);
+    x->bytes = x->ops * x->block;
+    x->lat_max = timer_ns(lat_max);
+}
+
+/* Any key between tests stops the run */
+static int db_stopped(void) {
+    struct key_event ev;
+    if (!kbd_poll(&ev)) return 0;
+    fb_print("  Stopped.\n", COLOR_YELLOW);
+    return 1;
+}
+
+static int db_read_tests(struct db_run *r) {
+    UINT64 seq_span = DB_SEQ_SPAN / r->bs;
+    if (seq_span > r->nblocks) seq_span = r->nblocks;
+
+    for (int i = 0; i < DB_NSIZES; i++) {
+        if (db_stopped()) return -1;
+        struct db_result *x = db_result_new(r, "seq read", s_sizes[i], 1);
+        if (!x) return -1;
+        db_qd1(r, x, NULL, 0, 1, 0, seq_span);
+        db_print(x);
+    }
+
+    if (db_stopped()) return -1;
+    struct db_result *x = db_result_new(r, "random read", DB_RAND_IO, 1);
+    if (!x) return -1;
+    db_qd1(r, x, NULL, 0, 0, 0, r->nblocks);
+    db_print(x);
+
+    if (db_stopped()) return -1;
+    x = db_result_new(r, "random read", DB_RAND_IO, DB_QD);
+    if (!x) return -1;
+    db_qdn(r, x);
+    db_print(x);
+
+    if (db_stopped()) return -1;
+    x = db_result_new(r, "flush (idle)", 0, 1);
+    if (!x) return -1;
+    db_flush(r, x, NULL, 0);
+    db_print(x);
+    return 0;
+}
+
+/* With one of our own drivers on the device, the same large and small
+   reads through the firmware's driver it replaced, for comparison */
+static int db_fw_tests(struct db_run *r) {
+    struct disk_device *dev = r->dev, fw = *dev;
+    if (!dev->fw_block_io) return 0;
+    fw.block_io = dev->fw_block_io;
+    fw.block_io2 = dev->fw_block_io2;
+    fw.xfer_size = 0;
+    fw.media_id = fw.block_io->Media->MediaId;
+    r->dev = &fw;
+
+    UINT64 seq_span = DB_SEQ_SPAN / r->bs;
+    if (seq_span > r->nblocks) seq_span = r->nblocks;
+    int rc = -1;
+    struct db_result *x;
+    if (db_stopped() || !(x = db_result_new(r, "fw seq read", MB, 1)))
+        goto out;
+    db_qd1(r, x, NULL, 0, 1, 0, seq_span);
+    db_print(x);
+    if (db_stopped() || !(x = db_result_new(r, "fw random read", DB_RAND_IO, 1)))
+        goto out;
+    db_qd1(r, x, NULL, 0, 0, 0, r->nblocks);
+    db_print(x);
+    if (db_stopped() || !(x = db_result_new(r, "fw random read", DB_RAND_IO, DB_QD)))
+        goto out;
+    db_qdn(r, x);
+    db_print(x);
+    rc = 0;
+out:
+    r->dev = dev;
+    return rc;
+}
+
+/* Copy blocks [lba, lba+count) between the device and mem in
+   DB_RESTORE_IO pieces; writes go through q */
+static int db_window(struct db_run *r, struct disk_queue *q, UINT64 lba,
+                     UINT64 count, UINT8 *mem) {
+    UINT64 per = DB_RESTORE_IO / r->bs ? DB_RESTORE_IO / r->bs : 1;
+    for (UINT64 done = 0; done < count; done += per) {
+        UINT64 n = count - done < per ? count - done : per;
+        UINT8 *p = mem + done * r->bs;
+        int rc = q ? db_write(q, lba + done, (UINTN)n, p)
+                   : disk_bio_read(r->dev->block_io, r->dev->media_id,
+                                   lba + done, (UINTN)(n * r->bs), p);
+        if (rc != 0) return -1;
+    }
+    return 0;
+}
+
+/* The write tests inside the saved window. Returns -1 if the window
+   could not be restored (the device has lost that data). */
+static int db_write_tests(struct db_run *r) {
+    struct disk_device *dev = r->dev;
+    UINT64 span = DB_WRITE_SPAN / r->bs;
+    if (r->nblocks / 4 < span) {
+        fb_print("  Device too small for the write tests.\n", COLOR_YELLOW);
+        return 0;
+    }
+    UINT64 align = DB_MAX_IO / r->bs;
+    UINT64 lo = r->nblocks / 2 / align * align;
+
+    UINT8 *backup = (UINT8 *)mem_io_get(DB_WRITE_SPAN);
+    struct disk_queue *q = backup ? disk_queue_open(dev, 1, 0) : NULL;
+    if (!q) {
+        fb_print("  Not enough memory for the write tests.\n", COLOR_YELLOW);
+        mem_io_put(backup);
+        return 0;
+    }
+    if (db_window(r, NULL, lo, span, backup) != 0) {
+        fb_print("  Could not save the test window; no writes done.\n", COLOR_RED);
+        disk_queue_close(q);
+        mem_io_put(backup);
+        return 0;
+    }
+
+    for (UINTN i = 0; i < DB_MAX_IO / sizeof(UINT64); i++)
+        ((UINT64 *)r->buf)[i] = db_rand(r);
+
+    /* Tests 0..DB_NSIZES-1 are sequential, then random, then flush */
+    for (int i = 0; i < DB_NSIZES + 2 && !db_stopped(); i++) {
+        struct db_result *x;
+        if (i < DB_NSIZES) {
+            if (!(x = db_result_new(r, "seq write", s_sizes[i], 1))) break;
+            db_qd1(r, x, q, 1, 1, lo, span);
+        } else if (i == DB_NSIZES) {
+            if (!(x = db_result_new(r, "random write", DB_RAND_IO, 1))) break;
+            db_qd1(r, x, q, 1, 0, lo, span);
+        } else {
+            if (!(x = db_result_new(r, "write + flush", DB_RAND_IO, 1))) break;
+            db_flush(r, x, q, lo);
+        }
+        db_print(x);
+    }
+
+    fb_print("  Restoring the test window...\n", COLOR_WHITE);
+    fb_present();
+    int rc = db_window(r, q, lo, span, backup);
+    if (disk_queue_close(q) != 0) rc = -1;
+    if (EFI_ERROR(dev->block_io->FlushBlocks(dev->block_io))) rc = -1;
+    mem_io_put(backup);
+    if (rc != 0) {
+        fb_print("  RESTORE FAILED: the 64 MB in the middle of the device\n", COLOR_RED);
+        fb_print("  may now hold test data.\n", COLOR_RED);
+    }
+    return rc;
+}
+
+/* Append the run to DISKBENCH_CSV. Returns 0 on success. */
+static int db_save(struct db_run *r) {
+    UINTN cap = (UINTN)r->nres * 192 + 1;
+    char *text = (char *)mem_alloc(cap);
+    if (!text) return -1;
+
+    time_t now = time(NULL);
+    struct tm *t = localtime(&now);
+    UINTN len = 0;
+    for (int i = 0; i < r->nres; i++) {
+        const struct db_result *x = &r->res[i];
+        UINT64 rate = x->failed ? 0 : db_rate(x);
+        int n = snprintf(text + len, cap - len,
+            "%04d-%02d-%02d %02d:%02d:%02d,%s,%llu,%s,%s,%u,%u,%llu,%llu,%llu,"
+            "%llu.%llu,%llu,%llu,%llu%s\r\n",
+            t->tm_year + 1900, t->tm_mon + 1, t->tm_mday,
+            t->tm_hour, t->tm_min, t->tm_sec, r->dev->name,
+            (unsigned long long)(r->dev->size_bytes / MB),
+            r->dev->block_io2 ? "yes" : "no", x->test, x->block, x->qd,
+            (unsigned long long)x->ops, (unsigned long long)x->bytes,
+            (unsigned long long)(x->ns / 1000000),
+            (unsigned long long)(rate / 10), (unsigned long long)(rate % 10),
+            (unsigned long long)(x->failed ? 0 : db_iops(x)),
+            (unsigned long long)db_avg_us(x),
+            (unsigned long long)(x->lat_max / 1000),
+            x->failed ? ",FAILED" : "");
+        if (n <= 0 || (UINTN)n >= cap - len) break;
+        len += (UINTN)n;
+    }
+    int rc = progress_append(DISKBENCH_CSV, DB_CSV_HEADER, text, len,
+                             DISKBENCH_CSV_MAX);
+    mem_free(text);
+    return rc;
+}
+
+void diskbench_run(struct disk_device *dev) {
+    char line[160];
+    struct key_event ev;
+
+    fb_clear(COLOR_BLACK);
+    fb_print("\n", COLOR_WHITE);
+    fb_print("  ========================================\n", COLOR_CYAN);
+    fb_print("       DISK BENCHMARK\n", COLOR_CYAN);
+    fb_print("  ========================================\n", COLOR_CYAN);
+    fb_print("\n", COLOR_WHITE);
+
+    snprintf(line, sizeof(line), "  Device: %s, %u-byte blocks, IoAlign %u, %s\n",
+             dev->name, dev->block_size, dev->block_io->Media->IoAlign,
+             nvme_owns(dev->block_io) ? "own NVMe queues (BlockIO2)"
+             : dev->block_io2 ? "BlockIO2"
+             : usbms_owns(dev->block_io) ? "own Bulk-Only driver (queued tests run one at a time)"
+             : sdmmc_owns(dev->block_io) ? "own SD_EMMC driver (queued tests run one at a time)"
+             : "no BlockIO2 (queued tests run one at a time)");
+    fb_print(line, COLOR_WHITE);
+    fb_print("\n  'R': read tests, about 20 seconds.\n", COLOR_YELLOW);
+    if (!dev->is_boot_device)
+        fb_print("  'W': read and write tests, about 40 seconds.\n", COLOR_YELLOW);
+    fb_print("  Any other key to go back. Any key during the tests stops them.\n",
+             COLOR_YELLOW);
+    kbd_wait(&ev);
+
+    int writes = !dev->is_boot_device && (ev.code == 'W' || ev.code == 'w');
+    if (!writes && ev.code != 'R' && ev.code != 'r')
+        return;
+    if (writes) {
+        fb_print("\n  The write tests overwrite 64 MB in the middle of the device.\n",
+                 COLOR_RED);
+        fb_print("  It is saved in memory first and written back afterwards,\n",
+                 COLOR_RED);
+        fb_print("  but a reset or unplug during the tests LOSES that data.\n",
+                 COLOR_RED);
+        fb_print("  Press 'Y' to proceed, any other key to cancel.\n", COLOR_YELLOW);
+        kbd_wait(&ev);
+        if (ev.code != 'Y' && ev.code != 'y')
+            return;
+    }
+    fb_print("\n", COLOR_WHITE);
+
+    struct db_run *r = (struct db_run *)mem_alloc(sizeof(*r));
+    UINT8 *buf = (UINT8 *)mem_io_get(DB_MAX_IO);
+    if (!r || !buf || dev->block_size == 0 || DB_MAX_IO % dev->block_size) {
+        fb_print("  Not enough memory or unsupported block size.\n", COLOR_RED);
+        mem_io_put(buf);
+        mem_free(r);
+        fb_print("\n  Press any key to return.\n", COLOR_DGRAY);
+        kbd_wait(&ev);
+        return;
+    }
+    r->dev = dev;
+    r->bs = dev->block_size;
+    r->nblocks = dev->size_bytes / dev->block_size;
+    r->buf = buf;
+    r->seed = timer_ticks() | 1;
+
+    int rc = db_read_tests(r);
+    if (rc == 0) {
+        char sz[16];
+        db_size_str(disk_xfer_size(dev), sz, sizeof(sz));
+        snprintf(line, sizeof(line), "  %-16s %6s\n", "Bulk transfer", sz);
+        fb_print(line, COLOR_WHITE);
+    }
+    if (rc == 0)
+        rc = db_fw_tests(r);
+    if (rc == 0 && writes)
+        db_write_tests(r);
+
+    if (r->nres > 0) {
+        if (db_save(r) == 0)
+            fb_print("\n  Results appended to \\DISKBENCH.CSV on the boot volume.\n",
+                     COLOR_GREEN);
+        else
+            fb_print("\n  Could not save the results.\n", COLOR_RED);
+    }
+
+    mem_io_put(buf);
+    mem_free(r);
+    fb_print("\n  Press any key to return.\n", COLOR_DGRAY);
+    fb_present();
+    kbd_wait(&ev);
+}
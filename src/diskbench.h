@@ -0,0 +1,22 @@
+/*
+ * diskbench.h — Raw throughput and latency benchmark for block devices
+ *
+ * Measures a USB stick or SD card from the browser instead of booting
+ * another OS: sequential reads and writes at several block sizes,
+ * random 4 KB reads one at a time and queued, and flush latency.
+ */
+#ifndef DISKBENCH_H
+#define DISKBENCH_H
+
+#include "disk.h"
+
+/* Results of every run are appended here, on the boot volume */
+#define DISKBENCH_CSV     L"\\DISKBENCH.CSV"
+#define DISKBENCH_CSV_MAX (256 * 1024)  /* older rows are dropped past this */
+
+/* Run the benchmark screen on a whole-disk device: the read tests, and
+   the write tests if the user asks for and confirms them (never on the
+   boot device). Returns when the user leaves the screen. */
+void diskbench_run(struct disk_device *dev);
+
+#endif /* DISKBENCH_H */
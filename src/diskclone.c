@@ -0,0 +1,372 @@
+/*
+ * diskclone.c — Device to device clone that copies only what is in use
+ *
+ * The same walk runs twice: once to plan (only counting), then with the
+ * copier. Block runs from the filesystem drivers and the stretches
+ * around the partitions go through dc_add(), which never goes back
+ * before what it has already taken and joins runs closer than
+ * DISKCLONE_GAP, so the copier sees ascending requests of up to
+ * DISKCLONE_IO bytes.
+ */
+
+#include "boot.h"
+#include "fb.h"
+#include "kbd.h"
+#include "mem.h"
+#include "fs.h"
+#include "disk.h"
+#include "diskclone.h"
+#include "exfat.h"
+#include "fat32.h"
+#include "ntfs.h"
+#include "part.h"
+#include "progress.h"
+#include "shim.h"
+
+#define DC_IO_POOL ((DISK_COPY_NBUF + 1) * DISKCLONE_IO)
+
+enum dc_fs { DC_RAW, DC_EXFAT, DC_NTFS, DC_FAT32 };
+
+static const char *const s_fs_names[] = { "other", "exFAT", "NTFS", "FAT32" };
+
+/* A partition, or the whole disk when it has no table */
+struct dc_region {
+    UINT64 start, blocks;
+    enum dc_fs fs;
+    int unreadable;             /* its filesystem could not be walked */
+    UINT64 used;                /* blocks the plan takes from it */
+};
+
+/* One region's blocks, for its filesystem driver */
+struct dc_part {
+    struct disk_device *dev;
+    UINT64 start, blocks;
+};
+
+struct dc_clone {
+    struct disk_device *src;
+    struct disk_copier *cp;     /* NULL while planning */
+    UINT32 bs;
+    UINT64 base, limit;         /* the region or stretch being walked */
+    UINT64 pos;                 /* blocks before this are taken */
+    UINT64 run_lba, run_len;    /* the run being gathered */
+    UINT64 added;               /* blocks asked for */
+    UINT64 blocks;              /* blocks copied (or to copy), gaps included */
+    int cancel;
+};
+
+static struct progress s_pg;
+static UINT32 s_row;
+
+/* ---- UI helpers ---- */
+
+static void dc_print(const char *msg, UINT32 color) {
+    if (g_boot.cols) fb_print(msg, color);
+}
+
+static void dc_wait_key(void) {
+    dc_print("  Press any key to return.\n", COLOR_DGRAY);
+    struct key_event ev;
+    kbd_wait(&ev);
+}
+
+static UINT64 mb(UINT64 bytes) {
+    return bytes / (1024 * 1024);
+}
+
+/* The copier's progress: the bar at s_row */
+static void dc_progress(UINT64 done, UINT64 total) {
+    (void)total;
+    if (!progress_add(&s_pg, done - s_pg.done)) return;
+    char line[128];
+    line[0] = line[1] = ' ';
+    int len = 2 + progress_line(&s_pg, line + 2, sizeof(line) - 2);
+    while (len < (int)g_boot.cols && len < 126) line[len++] = ' ';
+    line[len] = '\0';
+    fb_string(0, s_row, line, COLOR_WHITE, COLOR_BLACK);
+    fb_present();
+}
+
+/* ---- The walk ---- */
+
+/* Hand the gathered run to the copier, or just count it */
+static int dc_flush(struct dc_clone *c) {
+    if (!c->run_len) return 0;
+    c->blocks += c->run_len;
+    UINT64 lba = c->run_lba, left = c->run_len;
+    c->run_len = 0;
+    if (!c->cp) return 0;
+
+    /* In pieces, so ESC is seen during a long run */
+    UINT64 piece = 64 * (UINT64)DISKCLONE_IO / c->bs;
+    while (left) {
+        UINT64 n = left < piece ? left : piece;
+        if (disk_copier_run(c->cp, lba, n) != 0) return -1;
+        struct key_event ev;
+        if (kbd_poll(&ev) && ev.code == KEY_ESC) {
+            c->cancel = 1;
+            return -1;
+        }
+        lba += n;
+        left -= n;
+    }
+    return 0;
+}
+
+/* Take blocks [lba, lba+count), clipped to the region and to what is
+   not taken yet */
+static int dc_add(struct dc_clone *c, UINT64 lba, UINT64 count) {
+    UINT64 end = lba + count;
+    if (lba < c->pos) lba = c->pos;
+    if (end > c->limit) end = c->limit;
+    if (end <= lba) return 0;
+    c->added += end - lba;
+
+    UINT64 gap = DISKCLONE_GAP / c->bs;
+    if (c->run_len && lba <= c->run_lba + c->run_len + gap) {
+        c->run_len = end - c->run_lba;
+    } else {
+        if (dc_flush(c) != 0) return -1;
+        c->run_lba = lba;
+        c->run_len = end - lba;
+    }
+    c->pos = end;
+    return 0;
+}
+
+static int dc_fs_run(void *ctx, UINT64 lba, UINT64 count) {
+    struct dc_clone *c = (struct dc_clone *)ctx;
+    return dc_add(c, c->base + lba, count) != 0;
+}
+
+static int dc_part_read(void *ctx, UINT64 lba, UINT32 count, void *buf) {
+    struct dc_part *p = (struct dc_part *)ctx;
+    if (lba >= p->blocks || count > p->blocks - lba) return -1;
+    return disk_read_blocks(p->dev, p->start + lba, count, buf);
+}
+
+/* The runs r's filesystem uses, through its driver. Returns 0, -1 if
+   it could not be mounted or walked. */
+static int dc_fs_walk(struct dc_clone *c, struct dc_region *r) {
+    struct dc_part p = { c->src, r->start, r->blocks };
+    int rc = -1;
+    if (r->fs == DC_EXFAT) {
+        struct exfat_vol *v = exfat_mount(dc_part_read, NULL, &p, c->bs);
+        if (v) {
+            rc = exfat_used_runs(v, dc_fs_run, c);
+            exfat_unmount(v);
+        }
+    } else if (r->fs == DC_NTFS) {
+        struct ntfs_vol *v = ntfs_mount(dc_part_read, &p, c->bs);
+        if (v) {
+            rc = ntfs_used_runs(v, dc_fs_run, c);
+            ntfs_unmount(v);
+        }
+    } else if (r->fs == DC_FAT32) {
+        struct fat32_vol *v = fat32_mount(dc_part_read, NULL, &p, c->bs);
+        if (v) {
+            rc = fat32_used_runs(v, dc_fs_run, c);
+            fat32_unmount(v);
+        }
+    }
+    return rc;
+}
+
+/* Plan (c->cp NULL: count and note what each region uses) or copy.
+   Returns 0, -1 on an error or cancel. */
+static int dc_walk(struct dc_clone *c, struct dc_region *r, int n) {
+    UINT64 total = c->src->size_bytes / c->bs;
+    UINT64 edge = DISKCLONE_EDGE / c->bs;
+    c->pos = 0;
+    c->run_len = 0;
+    c->blocks = 0;
+
+    for (int i = 0; i <= n; i++) {
+        /* The stretch up to the next region: its first and last blocks */
+        UINT64 start = i < n ? r[i].start : total;
+        if (start > c->pos) {
+            UINT64 from = c->pos;
+            c->limit = start;
+            if (dc_add(c, from, edge) != 0) return -1;
+            if (dc_add(c, start - edge > from ? start - edge : from, edge) != 0)
+                return -1;
+        }
+        if (i == n) break;
+
+        c->base = r[i].start;
+        c->limit = r[i].start + r[i].blocks;
+        UINT64 added = c->added;
+        if (r[i].fs != DC_RAW && !r[i].unreadable &&
+            dc_fs_walk(c, &r[i]) != 0) {
+            if (c->cp) return -1;   /* it could be walked a moment ago */
+            r[i].unreadable = 1;
+        }
+        if (c->cancel) return -1;
+        if (r[i].fs == DC_RAW || r[i].unreadable) {
+            if (dc_add(c, r[i].start, r[i].blocks) != 0) return -1;
+        }
+        if (!c->cp) r[i].used = c->added - added;
+    }
+    return dc_flush(c);
+}
+
+/* ---- Planning ---- */
+
+static enum dc_fs dc_probe(struct disk_device *dev, UINT64 lba, UINT8 *blk) {
+    if (disk_read_blocks(dev, lba, 1, blk) != 0) return DC_RAW;
+    if (mem_cmp(blk + 3, "EXFAT   ", 8) == 0) return DC_EXFAT;
+    if (mem_cmp(blk + 3, "NTFS    ", 8) == 0) return DC_NTFS;
+    if (mem_cmp(blk + 82, "FAT32   ", 8) == 0) return DC_FAT32;
+    return DC_RAW;
+}
+
+static int dc_dev_read(void *ctx, UINT64 lba, UINT32 count, void *buf) {
+    return disk_read_blocks((struct disk_device *)ctx, lba, count, buf);
+}
+
+/* The regions of src in ascending order, clipped to the device.
+   Returns the count, -1 if the table could not be read. */
+static int dc_regions(struct disk_device *src, struct dc_region *r, int max) {
+    UINT32 bs = src->block_size;
+    UINT64 total = src->size_bytes / bs;
+    struct part_entry pe[PART_MAX];
+    int c = part_scan(dc_dev_read, src, bs, total, pe, PART_MAX);
+    if (c < 0) return -1;
+    if (c == 0) {
+        pe[0].start = 0;    /* no table: the whole disk is one volume */
+        pe[0].blocks = total;
+        c = 1;
+    }
+
+    int n = 0;
+    for (int i = 0; i < c && n < max; i++) {
+        if (pe[i].start >= total || pe[i].blocks == 0) continue;
+        struct dc_region *x = &r[n++];
+        mem_set(x, 0, sizeof(*x));
+        x->start = pe[i].start;
+        x->blocks = pe[i].blocks < total - x->start ? pe[i].blocks
+                                                     : total - x->start;
+    }
+    for (int i = 1; i < n; i++)
+        for (int j = i; j > 0 && r[j].start < r[j - 1].start; j--) {
+            struct dc_region t = r[j];
+            r[j] = r[j - 1];
+            r[j - 1] = t;
+        }
+
+    UINT8 *blk = (UINT8 *)mem_alloc(bs);
+    if (!blk) return -1;
+    for (int i = 0; i < n; i++)
+        r[i].fs = bs >= 512 ? dc_probe(src, r[i].start, blk) : DC_RAW;
+    mem_free(blk);
+    return n;
+}
+
+/* ---- Clone ---- */
+
+int diskclone_run(struct disk_device *src, struct disk_device *dst) {
+    char buf[256];
+    fb_clear(COLOR_BLACK);
+    dc_print("\n", COLOR_WHITE);
+    dc_print("  ========================================\n", COLOR_CYAN);
+    dc_print("       CLONE DEVICE\n", COLOR_CYAN);
+    dc_print("  ========================================\n", COLOR_CYAN);
+    dc_print("\n", COLOR_WHITE);
+    snprintf(buf, sizeof(buf), "  From: %s (%llu MB)\n", src->name,
+             (unsigned long long)mb(src->size_bytes));
+    dc_print(buf, COLOR_WHITE);
+    snprintf(buf, sizeof(buf), "  To:   %s (%llu MB)\n\n", dst->name,
+             (unsigned long long)mb(dst->size_bytes));
+    dc_print(buf, COLOR_WHITE);
+
+    const char *why = src->handle == dst->handle ? "  Source and target are the same device.\n"
+                    : dst->is_boot_device ? "  The target is the boot device.\n"
+                    : src->block_size == 0 || src->block_size != dst->block_size
+                        ? "  The devices' block sizes differ.\n"
+                    : dst->size_bytes < src->size_bytes ? "  The target is smaller than the source.\n"
+                    : NULL;
+    if (why) {
+        dc_print(why, COLOR_RED);
+        dc_wait_key();
+        return -1;
+    }
+
+    struct dc_region regions[PART_MAX];
+    int n = dc_regions(src, regions, PART_MAX);
+    struct dc_clone c;
+    mem_set(&c, 0, sizeof(c));
+    c.src = src;
+    c.bs = src->block_size;
+    dc_print("  Planning...\n", COLOR_DGRAY);
+    if (n < 0 || dc_walk(&c, regions, n) != 0) {
+        dc_print("  Could not read the source's partition table.\n", COLOR_RED);
+        dc_wait_key();
+        return -1;
+    }
+
+    for (int i = 0; i < n; i++) {
+        struct dc_region *x = &regions[i];
+        UINT64 bytes = x->blocks * c.bs;
+        if (x->fs == DC_RAW || x->unreadable)
+            snprintf(buf, sizeof(buf), "  %2d  %-6s %9llu MB, copied whole%s\n",
+                     i + 1, s_fs_names[x->fs], (unsigned long long)mb(bytes),
+                     x->unreadable ? " (unreadable)" : "");
+        else
+            snprintf(buf, sizeof(buf), "  %2d  %-6s %9llu MB, %llu MB in use\n",
+                     i + 1, s_fs_names[x->fs], (unsigned long long)mb(bytes),
+                     (unsigned long long)mb(x->used * c.bs));
+        dc_print(buf, COLOR_WHITE);
+    }
+    UINT64 plan = c.blocks * c.bs;
+    snprintf(buf, sizeof(buf), "\n  %llu MB of %llu MB to copy.\n\n",
+             (unsigned long long)mb(plan), (unsigned long long)mb(src->size_bytes));
+    dc_print(buf, COLOR_WHITE);
+
+    dc_print("  The target gets the source's partition table, GUIDs\n", COLOR_WHITE);
+    dc_print("  included: don't boot with both drives attached.\n", COLOR_WHITE);
+    dc_print("  ESC stops the clone.\n\n", COLOR_WHITE);
+    dc_print("  This will ERASE all data on the target device!\n", COLOR_RED);
+    dc_print("  Press 'Y' to start, any other key to cancel.\n", COLOR_YELLOW);
+    struct key_event ev;
+    kbd_wait(&ev);
+    if (ev.code != 'Y' && ev.code != 'y') return -1;
+    dc_print("\n", COLOR_WHITE);
+
+    UINT64 io_pool = mem_io_set_pool(DC_IO_POOL);
+    s_row = g_boot.cursor_y;
+    progress_start(&s_pg, "Cloning", plan);
+    c.cp = disk_copier_open(src, dst, DISKCLONE_IO, plan, dc_progress);
+    int rc = c.cp ? dc_walk(&c, regions, n) : -1;
+    if (c.cp && disk_copier_close(c.cp) != 0) rc = -1;
+    mem_io_set_pool(io_pool);
+
+    /* The firmware's view of the target is stale now */
+    disk_reconnect(dst);
+    fs_cache_invalidate();
+
+    char detail[160];
+    snprintf(detail, sizeof(detail), "%s -> %s", src->name, dst->name);
+    if (s_pg.chunks) progress_log(&s_pg, detail, rc == 0);
+
+    dc_print("\n\n", COLOR_WHITE);
+    if (c.cancel) {
+        dc_print("  Cancelled: the target holds part of the clone.\n", COLOR_YELLOW);
+    } else if (rc != 0) {
+        dc_print("  Clone failed: a read or write error.\n", COLOR_RED);
+    } else {
+        dc_print("  ========================================\n", COLOR_GREEN);
+        dc_print("    DEVICE CLONED\n", COLOR_GREEN);
+        dc_print("  ========================================\n\n", COLOR_GREEN);
+        snprintf(buf, sizeof(buf), "  Copied %llu MB of %llu MB to %s.\n",
+                 (unsigned long long)mb(c.blocks * c.bs),
+                 (unsigned long long)mb(src->size_bytes), dst->name);
+        dc_print(buf, COLOR_WHITE);
+        char stats[128];
+        progress_summary(&s_pg, stats, sizeof(stats));
+        snprintf(buf, sizeof(buf), "  Cloning: %s\n", stats);
+        dc_print(buf, COLOR_DGRAY);
+    }
+    dc_print("\n", COLOR_WHITE);
+    dc_wait_key();
+    return rc == 0 ? 0 : -1;
+}
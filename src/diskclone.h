@@ -0,0 +1,30 @@
+/*
+ * diskclone.h — Device to device clone that copies only what is in use
+ *
+ * The source's partition table is read, and each exFAT, NTFS or FAT32
+ * partition is mounted to ask its own driver which blocks it uses (the
+ * allocation bitmap, $Bitmap, the FAT, plus the boot regions and
+ * tables around them). Those runs are copied to the same blocks of the
+ * target, with gaps under DISKCLONE_GAP between them copied as well so
+ * that requests stay large. A partition with any other filesystem goes
+ * over whole; of the space outside partitions (the tables, an MBR
+ * chain's EBRs, alignment gaps) the first and last DISKCLONE_EDGE
+ * bytes of each stretch are copied. Everything moves through the
+ * device-to-device copier (disk.h), reads overlapping writes.
+ */
+#ifndef DISKCLONE_H
+#define DISKCLONE_H
+
+#include "disk.h"
+
+#define DISKCLONE_IO   (4 * 1024 * 1024)    /* bytes per request */
+#define DISKCLONE_GAP  (1024 * 1024)        /* free space copied, not skipped */
+#define DISKCLONE_EDGE (1024 * 1024)        /* of each stretch between partitions */
+
+/* Show the plan for cloning src onto dst, ask, and clone. dst must be
+   at least as large, have the same block size and not be the boot
+   device; it ends up with src's partition table, GUIDs included.
+   Returns 0 on success, -1 on error or cancel. */
+int diskclone_run(struct disk_device *src, struct disk_device *dst);
+
+#endif /* DISKCLONE_H */
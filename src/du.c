@@ -0,0 +1,249 @@
+/*
+ * du.c — Directory totals, worked out in the background
+ *
+ * See du.h. Totals live in an open-addressed table keyed by a hash of
+ * the path, with the path itself in a pool to settle collisions. The
+ * walk keeps one open directory per level in a fixed stack and one path
+ * buffer, each level's part ending at its frame's len.
+ */
+
+#include "boot.h"
+#include "mem.h"
+#include "fs.h"
+#include "timer.h"
+#include "du.h"
+
+#define DU_TAB_MIN 1024         /* table slots, a power of two */
+
+struct du_ent {
+    UINT64 hash;
+    UINT64 bytes;
+    UINT32 path;                /* offset in the pool, + 1; 0 for a free slot */
+};
+
+struct du_frame {
+    struct fs_dir *d;
+    UINT32 len;                 /* of the directory's path */
+    UINT64 bytes;               /* counted in it so far */
+};
+
+static struct {
+    UINT32 changes;             /* fs_change_count() the totals belong to */
+    struct du_ent *tab;
+    UINT32 tab_cap, tab_count;
+    char   *pool;
+    UINT32 pool_len, pool_cap;
+
+    char   *queue;              /* NUL-ended paths */
+    UINT32 queue_len, queue_cap;
+    UINT32 queue_next;          /* offset of the one walked next */
+
+    struct du_frame stack[DU_DEPTH_MAX];
+    int    depth;
+    char   path[DU_PATH_MAX];
+} s_du;
+
+/* ---- Totals ---- */
+
+/* FNV-1a */
+static UINT64 path_hash(const char *s) {
+    UINT64 h = 0xcbf29ce484222325ULL;
+    while (*s) {
+        h ^= (UINT8)*s++;
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static struct du_ent *slot(UINT64 hash, const char *path) {
+    UINT32 mask = s_du.tab_cap - 1;
+    for (UINT32 i = (UINT32)hash & mask;; i = (i + 1) & mask) {
+        struct du_ent *x = &s_du.tab[i];
+        if (!x->path) return x;
+        if (x->hash == hash && str_cmp((CHAR8 *)(s_du.pool + x->path - 1),
+                                       (CHAR8 *)path) == 0)
+            return x;
+    }
+}
+
+static int total_get(const char *path, UINT64 *bytes) {
+    if (!s_du.tab) return 0;
+    struct du_ent *x = slot(path_hash(path), path);
+    if (!x->path) return 0;
+    *bytes = x->bytes;
+    return 1;
+}
+
+/* Kept at most half full, so a probe ends soon */
+static int tab_grow(void) {
+    UINT32 cap = s_du.tab_cap ? s_du.tab_cap * 2 : DU_TAB_MIN;
+    struct du_ent *old = s_du.tab;
+    UINT32 old_cap = s_du.tab_cap;
+    s_du.tab = (struct du_ent *)mem_alloc((UINTN)cap * sizeof(struct du_ent));
+    if (!s_du.tab) {
+        s_du.tab = old;
+        return -1;
+    }
+    s_du.tab_cap = cap;
+    for (UINT32 i = 0; i < old_cap; i++) {
+        if (!old[i].path) continue;
+        UINT32 mask = cap - 1, k = (UINT32)old[i].hash & mask;
+        while (s_du.tab[k].path) k = (k + 1) & mask;
+        s_du.tab[k] = old[i];
+    }
+    if (old) mem_free(old);
+    return 0;
+}
+
+static void total_put(const char *path, UINT64 bytes) {
+    if ((s_du.tab_count + 1) * 2 > s_du.tab_cap && tab_grow() != 0)
+        return;     /* out of memory: it is walked again when asked for */
+    UINT64 h = path_hash(path);
+    struct du_ent *x = slot(h, path);
+    if (!x->path) {
+        UINT32 n = (UINT32)str_len((CHAR8 *)path) + 1;
+        if (mem_grow((void **)&s_du.pool, &s_du.pool_cap, s_du.pool_len + n,
+                     1, 1024) != 0)
+            return;
+        mem_copy(s_du.pool + s_du.pool_len, path, n);
+        x->hash = h;
+        x->path = s_du.pool_len + 1;
+        s_du.pool_len += n;
+        s_du.tab_count++;
+    }
+    x->bytes = bytes;
+}
+
+/* Something was written: every total may be wrong */
+static void check_changes(void) {
+    if (s_du.changes == fs_change_count()) return;
+    du_suspend();
+    if (s_du.tab) mem_free(s_du.tab);
+    if (s_du.pool) mem_free(s_du.pool);
+    s_du.tab = NULL;
+    s_du.tab_cap = s_du.tab_count = 0;
+    s_du.pool = NULL;
+    s_du.pool_len = s_du.pool_cap = 0;
+    s_du.queue_next = 0;
+    s_du.changes = fs_change_count();
+}
+
+/* ---- Walk ---- */
+
+/* Open s_du.path (len bytes) as the next level */
+static int push(UINT32 len) {
+    CHAR16 w[DU_PATH_MAX];
+    UINT32 i = 0;
+    for (; i < len; i++) w[i] = (CHAR16)(UINT8)s_du.path[i];
+    w[i] = 0;
+    struct fs_dir *d = fs_opendir(w);
+    if (!d) return -1;
+    struct du_frame *f = &s_du.stack[s_du.depth++];
+    f->d = d;
+    f->len = len;
+    f->bytes = 0;
+    return 0;
+}
+
+/* path\name into s_du.path after the first len bytes; returns the new
+   length, or 0 if it does not fit */
+static UINT32 join(UINT32 len, const char *name) {
+    UINT32 n = (UINT32)str_len((CHAR8 *)name);
+    if (len == 1) len = 0;      /* the root, "\\" */
+    if (len + 1 + n + 1 > DU_PATH_MAX) return 0;
+    s_du.path[len] = '\\';
+    mem_copy(s_du.path + len + 1, name, n + 1);
+    return len + 1 + n;
+}
+
+void du_suspend(void) {
+    while (s_du.depth > 0)
+        fs_closedir(s_du.stack[--s_du.depth].d);
+}
+
+void du_begin(void) {
+    du_suspend();
+    s_du.queue_len = 0;
+    s_du.queue_next = 0;
+}
+
+int du_queue(const char *path) {
+    UINT32 n = (UINT32)str_len((CHAR8 *)path) + 1;
+    if (n > DU_PATH_MAX) return -1;
+    if (mem_grow((void **)&s_du.queue, &s_du.queue_cap, s_du.queue_len + n,
+                 1, 1024) != 0)
+        return -1;
+    mem_copy(s_du.queue + s_du.queue_len, path, n);
+    s_du.queue_len += n;
+    return 0;
+}
+
+int du_step(void) {
+    check_changes();
+    UINT64 hz = timer_hz(), t0 = timer_ticks();
+    int found = 0;
+    while (timer_ticks() - t0 < hz / 1000 * DU_STEP_MS) {
+        UINT64 bytes;
+        if (s_du.depth == 0) {
+            if (s_du.queue_next >= s_du.queue_len)
+                return found ? DU_DONE : DU_IDLE;
+            const char *q = s_du.queue + s_du.queue_next;
+            UINT32 n = (UINT32)str_len((CHAR8 *)q);
+            if (total_get(q, &bytes)) {
+                s_du.queue_next += n + 1;
+                continue;
+            }
+            mem_copy(s_du.path, q, n + 1);
+            if (push(n) != 0) {
+                total_put(q, 0);
+                s_du.queue_next += n + 1;
+                found = 1;
+            }
+            continue;
+        }
+
+        struct du_frame *f = &s_du.stack[s_du.depth - 1];
+        struct fs_entry e;
+        int r = fs_readdir_next(f->d, &e);
+        if (r > 0) {
+            if (!e.is_dir) {
+                f->bytes += e.size;
+                continue;
+            }
+            UINT32 len = join(f->len, e.name);
+            if (len == 0) continue;
+            if (total_get(s_du.path, &bytes))
+                f->bytes += bytes;
+            else if (s_du.depth < DU_DEPTH_MAX)
+                push(len);      /* one that will not open counts as empty */
+            continue;
+        }
+
+        /* The end of the directory, or a read that failed: what was read counts */
+        fs_closedir(f->d);
+        s_du.path[f->len] = '\0';
+        total_put(s_du.path, f->bytes);
+        bytes = f->bytes;
+        s_du.depth--;
+        if (s_du.depth > 0) {
+            s_du.stack[s_du.depth - 1].bytes += bytes;
+        } else {
+            s_du.queue_next += f->len + 1;
+            found = 1;
+        }
+    }
+    return found ? DU_DONE : DU_BUSY;
+}
+
+int du_lookup(const char *path, UINT64 *bytes) {
+    check_changes();
+    if (total_get(path, bytes)) return 1;
+    if (s_du.depth > 0 && s_du.queue_next < s_du.queue_len &&
+        str_cmp((CHAR8 *)(s_du.queue + s_du.queue_next), (CHAR8 *)path) == 0) {
+        UINT64 sum = 0;
+        for (int i = 0; i < s_du.depth; i++) sum += s_du.stack[i].bytes;
+        *bytes = sum;
+        return 0;
+    }
+    return -1;
+}
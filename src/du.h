@@ -0,0 +1,47 @@
+/*
+ * du.h — Directory totals, worked out in the background
+ *
+ * The browser queues the directories it lists and du_step() walks their
+ * trees between keystrokes, depth-first with the drivers' directory
+ * cursors, a few milliseconds at a time. The total of every directory
+ * finished on the way is kept, so a subtree is walked once however it
+ * is reached again, and going down into a listed directory finds most
+ * of its totals known already. Totals are the bytes of the files below;
+ * a directory that will not read, or lies more than DU_DEPTH_MAX down,
+ * counts as empty. They are kept by path, as long as fs_change_count()
+ * stays the same.
+ */
+#ifndef DU_H
+#define DU_H
+
+#include "boot.h"
+
+#define DU_STEP_MS   20         /* walking per du_step() */
+#define DU_PATH_MAX  512
+#define DU_DEPTH_MAX 64         /* directories open at once */
+
+/* du_step() results */
+#define DU_IDLE 0               /* every queued total is known */
+#define DU_BUSY 1               /* more to walk */
+#define DU_DONE 2               /* a queued total has just been found */
+
+/* Forget the queue (not the totals) and stop the walk */
+void du_begin(void);
+
+/* Queue a directory of the current volume, by its path from "\\".
+   Returns 0, or -1 when out of memory. */
+int du_queue(const char *path);
+
+/* Walk for about DU_STEP_MS */
+int du_step(void);
+
+/* path's total: 1 when known, 0 while it is being walked (the bytes
+   counted so far), -1 when not known yet */
+int du_lookup(const char *path, UINT64 *bytes);
+
+/* Close the walk's directories, before anything else uses the volume.
+   The next du_step() starts the queued directory over, with the totals
+   of the subtrees it had finished. */
+void du_suspend(void);
+
+#endif /* DU_H */
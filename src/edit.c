@@ -4,48 +4,142 @@
 #include "fs.h"
 #include "mem.h"
 #include "tcc.h"
+#include "aprun.h"
 #include "shim.h"
+#include "timer.h"
+#include "trace.h"
+#include "profile.h"
 #include "libtcc.h"
+#include "hash.h"
+#include "event.h"
+#include "symidx.h"
+#include "lz4.h"
+#include "tccpool.h"
 
-#define EDIT_MAX_LINES  4096
 #define EDIT_MAX_PATH   512
 #define EDIT_INIT_CAP   80
+#define EDIT_MIN_LINES  256     /* initial line index capacity */
+#define EDIT_SAVE_BLOCK 65536   /* bytes per write when saving */
 
 /* ---- Line buffer ---- */
 
+/* A run of one syntax colour within a line, [start, end) */
+struct hl_span {
+    UINT32 start, end;
+    UINT32 color;
+};
+
+/* A line either borrows its text from the loaded file or a pasted
+   clipboard (cap == 0, not NUL-terminated) or owns a buffer; it is
+   copied on its first edit */
 struct edit_line {
     char  *data;
     UINTN  len;
     UINTN  cap;
+    struct hl_span *spans;      /* cached colours, default runs left out */
+    INT32  nspans;              /* -1 until the line is coloured */
+    UINT8  hl_state;            /* comment state at line start */
+    UINT8  diag;                /* s_diag entry + 1, 0 = none */
 };
 
 /* ---- Editor state ---- */
 
-static struct edit_line s_lines[EDIT_MAX_LINES];
+/*
+ * The document is an array of line records with a gap at s_gap, so
+ * inserting or deleting lines near the last edit only moves the gap,
+ * and any line is found in constant time.  Loading keeps the whole file
+ * in s_file and points every line into it, with no allocation per line.
+ */
+static struct edit_line *s_lines;   /* s_line_cap records, gap included */
+static int    s_line_cap;
+static int    s_gap;                /* gap start = index of next insert */
 static int    s_line_count;
+static char  *s_file;               /* loaded file text */
+static struct edit_text **s_texts;  /* clipboards pasted lines borrow from */
+static int    s_text_count, s_text_cap;
+static int    s_crlf;               /* file had \r\n line breaks */
 static int    s_cx, s_cy;           /* cursor column, row in document */
 static int    s_scroll_x, s_scroll_y;
 static int    s_modified;
 static CHAR16 s_filepath[EDIT_MAX_PATH];
 static char   s_filename[128];
 
-/* Selection and clipboard */
+/* The file on disk as last loaded or saved, to tell whether a kept
+   copy of it still matches (see doc_fresh()) */
+struct doc_stamp {
+    int    exists;
+    UINT64 size, id;
+    UINT32 mtime;
+    UINT32 changes;                 /* fs_change_count() when it matched */
+};
+static struct doc_stamp s_stamp;
+
+/*
+ * Selection and clipboard.  The clipboard is one block of text shared
+ * by reference: pasting it points the new lines into the block instead
+ * of copying them, and the document holds the block until it is closed,
+ * so a later copy replaces the clipboard without touching those lines.
+ * While the RAM disk is in use the clipboard is also kept there in
+ * CLIP_FILE, written between keystrokes, so other files and programs
+ * can exchange text through it.
+ */
+struct edit_text {
+    UINTN refs;
+    UINTN len;
+    char  data[];
+};
+
+#define CLIP_FILE L"\\CLIPBOARD.TXT"
+
 static int    s_sel_active;
 static int    s_sel_anchor_y, s_sel_anchor_x;
-static char  *s_clipboard;
-static UINTN  s_clip_len;
-#define CLIP_MAX 65536
+static struct edit_text *s_clip;    /* NULL until the first copy */
+static int    s_clip_dirty;         /* s_clip not yet in CLIP_FILE */
+static UINT32 s_clip_crc;           /* of what CLIP_FILE last held */
+static struct ev_handler s_clip_idle;
 
 /* Screen geometry */
 static int s_text_top;    /* first screen row for text (1) */
 static int s_text_rows;   /* rows available for text */
 static int s_text_cols;   /* columns available for text */
 
+/* Search */
+#define FIND_MAX 128
+static char  s_find[FIND_MAX];              /* last search text */
+static int   s_find_len;
+static int   s_find_skip[256];              /* Horspool shift per byte */
+static int   s_find_show;                   /* mark matches while drawing */
+#define EDIT_MATCH_BG 0x00623315            /* other visible matches */
+
+/* Message for the info line's next redraw */
+static char  s_info_note[96];
+
+/* What the last background check reported (see check_run()) */
+#define DIAG_MAX  32
+#define DIAG_TEXT 96
+struct edit_diag {
+    int  error;                             /* 0 = warning */
+    char text[DIAG_TEXT];
+};
+static struct edit_diag s_diag[DIAG_MAX];
+static int    s_diag_count;
+static int    s_gutter;                     /* its column: 1 for .c files */
+static UINT32 s_doc_gen;                    /* counts edits */
+
 /* Syntax highlighting */
 static int   s_highlight_mode;             /* 1 for .c/.h files */
 #define HL_NORMAL  0
 #define HL_COMMENT 1
-static UINT8 s_line_state[EDIT_MAX_LINES]; /* start-of-line comment state */
+
+/* Lines edited since the last state pass: s_hl_lo .. s_hl_hi, or
+   s_hl_lo == -1 when every line's hl_state is current */
+static int   s_hl_lo = -1;
+static int   s_hl_hi;
+static int   s_words_ready;                /* word table built */
+
+/* Span cache bytes; past MEM_BUDGET_HL every cached line is dropped at
+   once */
+static UINTN s_hl_cache_bytes;
 
 /* Syntax colors (VS Code Dark+ inspired) */
 #define SYN_DEFAULT   0x00D4D4D4  /* light gray */
@@ -63,25 +157,45 @@ static void line_init(struct edit_line *ln) {
     ln->data = (char *)mem_alloc(ln->cap);
     ln->data[0] = '\0';
     ln->len = 0;
+    ln->spans = NULL;
+    ln->nspans = -1;
+    ln->hl_state = HL_NORMAL;
+    ln->diag = 0;
+}
+
+/* Forget the line's cached colours */
+static void line_spans_drop(struct edit_line *ln) {
+    if (ln->spans) {
+        mem_free(ln->spans);
+        s_hl_cache_bytes -= (UINTN)ln->nspans * sizeof(struct hl_span);
+    }
+    ln->spans = NULL;
+    ln->nspans = -1;
 }
 
 static void line_free(struct edit_line *ln) {
-    if (ln->data) {
+    line_spans_drop(ln);
+    if (ln->cap)
         mem_free(ln->data);
-        ln->data = NULL;
-    }
+    ln->data = NULL;
     ln->len = 0;
     ln->cap = 0;
 }
 
+/* Make the line writable with room for need bytes plus the NUL */
 static void line_ensure(struct edit_line *ln, UINTN need) {
-    if (need + 1 <= ln->cap)
+    if (ln->cap && need + 1 <= ln->cap)
         return;
+    if (need < ln->len) need = ln->len;
     UINTN new_cap = ln->cap * 2;
     if (new_cap < need + 1) new_cap = need + 1;
+    if (new_cap < EDIT_INIT_CAP) new_cap = EDIT_INIT_CAP;
     char *new_data = (char *)mem_alloc(new_cap);
-    mem_copy(new_data, ln->data, ln->len + 1);
-    mem_free(ln->data);
+    if (ln->len)
+        mem_copy(new_data, ln->data, ln->len);
+    new_data[ln->len] = '\0';
+    if (ln->cap)
+        mem_free(ln->data);
     ln->data = new_data;
     ln->cap = new_cap;
 }
@@ -99,51 +213,220 @@ static void line_insert_char(struct edit_line *ln, int pos, char c) {
 static void line_delete_char(struct edit_line *ln, int pos) {
     if (pos < 0 || pos >= (int)ln->len)
         return;
+    line_ensure(ln, ln->len);
     for (int i = pos; i < (int)ln->len - 1; i++)
         ln->data[i] = ln->data[i + 1];
     ln->len--;
     ln->data[ln->len] = '\0';
 }
 
-/* ---- Document operations ---- */
+/* Insert n bytes at pos */
+static void line_insert_text(struct edit_line *ln, int pos, const char *text,
+                             UINTN n) {
+    line_ensure(ln, ln->len + n);
+    mem_move(&ln->data[pos + n], &ln->data[pos], ln->len - (UINTN)pos);
+    mem_copy(&ln->data[pos], text, n);
+    ln->len += n;
+    ln->data[ln->len] = '\0';
+}
+
+/* Remove n bytes from pos */
+static void line_erase(struct edit_line *ln, int pos, UINTN n) {
+    line_ensure(ln, ln->len);
+    mem_move(&ln->data[pos], &ln->data[pos + n], ln->len - (UINTN)pos - n);
+    ln->len -= n;
+    ln->data[ln->len] = '\0';
+}
+
+/* Give the line a new owned buffer of cap bytes holding len bytes */
+static void line_adopt(struct edit_line *ln, char *data, UINTN len, UINTN cap) {
+    if (ln->cap)
+        mem_free(ln->data);
+    ln->data = data;
+    ln->len = len;
+    ln->cap = cap;
+    data[len] = '\0';
+}
+
+/* Cut the line to len bytes */
+static void line_truncate(struct edit_line *ln, UINTN len) {
+    if (len >= ln->len)
+        return;
+    if (!ln->cap)
+        ln->len = len;  /* copy only what is kept */
+    line_ensure(ln, len);
+    ln->len = len;
+    ln->data[len] = '\0';
+}
+
+/* ---- Shared text ---- */
+
+/* A block of len bytes with one reference, or NULL */
+static struct edit_text *text_new(UINTN len) {
+    struct edit_text *t = (struct edit_text *)
+        mem_alloc_raw(sizeof(struct edit_text) + len + 1);
+    if (!t)
+        return NULL;
+    t->refs = 1;
+    t->len = len;
+    t->data[len] = '\0';
+    return t;
+}
+
+/* Drop a reference, freeing the block with the last one */
+static void text_put(struct edit_text *t) {
+    if (t && --t->refs == 0)
+        mem_free(t);
+}
+
+/* Keep t for as long as the document's lines may borrow from it.
+   Returns 0 on success. */
+static int doc_hold(struct edit_text *t) {
+    for (int i = 0; i < s_text_count; i++)
+        if (s_texts[i] == t)
+            return 0;
+    if (s_text_count == s_text_cap) {
+        int cap = s_text_cap ? s_text_cap * 2 : 8;
+        struct edit_text **n = (struct edit_text **)
+            mem_alloc((UINTN)cap * sizeof(*n));
+        if (!n)
+            return -1;
+        if (s_texts) {
+            mem_copy(n, s_texts, (UINTN)s_text_count * sizeof(*n));
+            mem_free(s_texts);
+        }
+        s_texts = n;
+        s_text_cap = cap;
+    }
+    t->refs++;
+    s_texts[s_text_count++] = t;
+    return 0;
+}
+
+/* ---- Line index ---- */
+
+static struct edit_line *doc_at(int idx) {
+    return &s_lines[idx < s_gap ? idx : idx + (s_line_cap - s_line_count)];
+}
+
+/* Move the gap so that it starts at line idx */
+static void doc_gap_move(int idx) {
+    int gap = s_line_cap - s_line_count;
+    if (idx < s_gap)
+        mem_move(&s_lines[idx + gap], &s_lines[idx],
+                 (UINTN)(s_gap - idx) * sizeof(struct edit_line));
+    else if (idx > s_gap)
+        mem_move(&s_lines[s_gap], &s_lines[s_gap + gap],
+                 (UINTN)(idx - s_gap) * sizeof(struct edit_line));
+    s_gap = idx;
+}
+
+/* Make room for extra more lines. Returns 0 on success. */
+static int doc_reserve(int extra) {
+    if (s_line_cap - s_line_count >= extra)
+        return 0;
+    int cap = s_line_cap ? s_line_cap * 2 : EDIT_MIN_LINES;
+    if (cap < s_line_count + extra)
+        cap = s_line_count + extra;
+    struct edit_line *n = (struct edit_line *)
+        mem_alloc((UINTN)cap * sizeof(struct edit_line));
+    if (!n)
+        return -1;
+    int tail = s_line_count - s_gap;
+    if (s_lines) {
+        mem_copy(n, s_lines, (UINTN)s_gap * sizeof(struct edit_line));
+        mem_copy(&n[cap - tail], &s_lines[s_line_cap - tail],
+                 (UINTN)tail * sizeof(struct edit_line));
+        mem_free(s_lines);
+    }
+    s_lines = n;
+    s_line_cap = cap;
+    return 0;
+}
 
-static void doc_insert_line(int idx) {
-    if (s_line_count >= EDIT_MAX_LINES)
+/* Note that line idx changed; its colours and the state of the lines
+   after it are brought up to date before the next draw */
+static void hl_mark(int idx) {
+    s_doc_gen++;
+    if (s_hl_lo < 0) {
+        s_hl_lo = s_hl_hi = idx;
         return;
-    /* Shift lines down */
-    for (int i = s_line_count; i > idx; i--)
-        s_lines[i] = s_lines[i - 1];
+    }
+    if (idx < s_hl_lo) s_hl_lo = idx;
+    if (idx > s_hl_hi) s_hl_hi = idx;
+}
+
+/* Line idx for writing */
+static struct edit_line *doc_edit(int idx) {
+    struct edit_line *ln = doc_at(idx);
+    hl_mark(idx);
+    line_spans_drop(ln);
+    return ln;
+}
+
+/* ---- Document operations ---- */
+
+/* Insert an empty line before idx. Returns 0 on success. */
+static int doc_insert_line(int idx) {
+    if (idx < 0 || idx > s_line_count || doc_reserve(1) != 0)
+        return -1;
+    doc_gap_move(idx);
+    struct edit_line *ln = &s_lines[s_gap++];
     s_line_count++;
-    /* Initialize the new slot */
-    mem_set(&s_lines[idx], 0, sizeof(struct edit_line));
-    line_init(&s_lines[idx]);
+    line_init(ln);
+    if (s_hl_lo >= 0) {
+        if (s_hl_lo >= idx) s_hl_lo++;
+        if (s_hl_hi >= idx) s_hl_hi++;
+    }
+    hl_mark(idx);
+    return 0;
 }
 
 static void doc_delete_line(int idx) {
     if (idx < 0 || idx >= s_line_count)
         return;
-    line_free(&s_lines[idx]);
-    for (int i = idx; i < s_line_count - 1; i++)
-        s_lines[i] = s_lines[i + 1];
+    line_free(doc_at(idx));
+    /* The line now follows the gap; widening the gap drops it */
+    doc_gap_move(idx);
     s_line_count--;
-    mem_set(&s_lines[s_line_count], 0, sizeof(struct edit_line));
+    if (s_hl_lo >= 0) {
+        if (s_hl_lo > idx) s_hl_lo--;
+        if (s_hl_hi > idx) s_hl_hi--;
+    }
+    hl_mark(idx);  /* the line that moved up has a new predecessor */
+}
+
+/* Delete n lines from idx on at once */
+static void doc_delete_lines(int idx, int n) {
+    if (idx < 0 || n <= 0 || idx + n > s_line_count)
+        return;
+    for (int i = idx; i < idx + n; i++)
+        line_free(doc_at(i));
+    doc_gap_move(idx);
+    s_line_count -= n;
+    if (s_hl_lo >= 0) {
+        if (s_hl_lo >= idx + n) s_hl_lo -= n;
+        else if (s_hl_lo > idx) s_hl_lo = idx;
+        if (s_hl_hi >= idx + n) s_hl_hi -= n;
+        else if (s_hl_hi > idx) s_hl_hi = idx;
+    }
+    hl_mark(idx);
 }
 
 static void doc_split_line(void) {
     /* Split current line at cursor into two lines */
-    struct edit_line *cur = &s_lines[s_cy];
+    if (doc_insert_line(s_cy + 1) != 0)
+        return;
+    struct edit_line *cur = doc_edit(s_cy);
+    struct edit_line *next = doc_at(s_cy + 1);
     int right_len = (int)cur->len - s_cx;
 
-    doc_insert_line(s_cy + 1);
-    struct edit_line *next = &s_lines[s_cy + 1];
-
     if (right_len > 0) {
         line_ensure(next, (UINTN)right_len);
         mem_copy(next->data, &cur->data[s_cx], (UINTN)right_len);
         next->len = (UINTN)right_len;
         next->data[next->len] = '\0';
-        cur->len = (UINTN)s_cx;
-        cur->data[cur->len] = '\0';
+        line_truncate(cur, (UINTN)s_cx);
     }
 
     s_cy++;
@@ -155,8 +438,8 @@ static void doc_join_lines(int line_idx) {
     /* Append line_idx+1 onto line_idx, remove line_idx+1 */
     if (line_idx < 0 || line_idx + 1 >= s_line_count)
         return;
-    struct edit_line *top = &s_lines[line_idx];
-    struct edit_line *bot = &s_lines[line_idx + 1];
+    struct edit_line *top = doc_edit(line_idx);
+    struct edit_line *bot = doc_at(line_idx + 1);
 
     if (bot->len > 0) {
         line_ensure(top, top->len + bot->len);
@@ -169,37 +452,83 @@ static void doc_join_lines(int line_idx) {
     s_modified = 1;
 }
 
+/* Note what the file is on disk now */
+static void doc_stamp(void) {
+    struct fs_entry e;
+    mem_set(&s_stamp, 0, sizeof(s_stamp));
+    if (fs_file_entry(s_filepath, &e) == 0) {
+        s_stamp.exists = 1;
+        s_stamp.size = e.size;
+        s_stamp.id = e.id;
+        s_stamp.mtime = e.mtime;
+    }
+    s_stamp.changes = fs_change_count();
+}
+
+/* Whether the file at path is still the one st describes: nothing on
+   the volume changed since, or its size, date and first cluster are
+   the same (or it is still missing). The built-in FAT32 driver gives
+   every file one fixed date, so there the size and cluster tell. */
+static int doc_fresh(struct doc_stamp *st, const CHAR16 *path) {
+    UINT32 now = fs_change_count();
+    if (now == st->changes)
+        return 1;
+    struct fs_entry e;
+    int exists = fs_file_entry(path, &e) == 0;
+    if (exists != st->exists)
+        return 0;
+    if (exists && (e.size != st->size || e.id != st->id ||
+                   e.mtime != st->mtime))
+        return 0;
+    st->changes = now;
+    return 1;
+}
+
 static void doc_load(void) {
     UINTN file_size = 0;
     char *data = (char *)fs_readfile(s_filepath, &file_size);
 
     s_line_count = 0;
-    mem_set(s_lines, 0, sizeof(s_lines));
+    s_gap = 0;
+    s_hl_lo = -1;
+    s_words_ready = 0;  /* drop the previous file's typedef names */
+    s_crlf = 0;
 
     if (!data || file_size == 0) {
         /* Empty / new file — start with one blank line */
-        line_init(&s_lines[0]);
-        s_line_count = 1;
         if (data) mem_free(data);
+        doc_insert_line(0);
+        doc_stamp();
         return;
     }
 
-    /* Split into independent line buffers */
+    /* Keep the first line break's style for saving */
+    for (UINTN i = 0; i < file_size; i++) {
+        if (data[i] == '\r' || data[i] == '\n') {
+            s_crlf = data[i] == '\r' && i + 1 < file_size && data[i + 1] == '\n';
+            break;
+        }
+    }
+
+    /* Index the lines in place; they borrow from the file buffer */
+    s_file = data;
     UINTN start = 0;
-    for (UINTN i = 0; i <= file_size && s_line_count < EDIT_MAX_LINES; i++) {
+    for (UINTN i = 0; i <= file_size; i++) {
         int is_end = (i == file_size);
         int is_nl = (!is_end && (data[i] == '\n' || data[i] == '\r'));
 
         if (is_end || is_nl) {
-            UINTN seg_len = i - start;
-            struct edit_line *ln = &s_lines[s_line_count];
-            ln->cap = (seg_len < EDIT_INIT_CAP) ? EDIT_INIT_CAP : seg_len + 1;
-            ln->data = (char *)mem_alloc(ln->cap);
-            if (seg_len > 0)
-                mem_copy(ln->data, &data[start], seg_len);
-            ln->len = seg_len;
-            ln->data[ln->len] = '\0';
+            if (doc_reserve(1) != 0)
+                break;  /* out of memory: keep what fits */
+            struct edit_line *ln = &s_lines[s_gap++];
             s_line_count++;
+            ln->data = &data[start];
+            ln->len = i - start;
+            ln->cap = 0;
+            ln->spans = NULL;
+            ln->nspans = -1;
+            ln->hl_state = HL_NORMAL;
+            ln->diag = 0;
 
             /* Skip \n after \r */
             if (!is_end && data[i] == '\r' && i + 1 < file_size && data[i + 1] == '\n')
@@ -209,19 +538,20 @@ static void doc_load(void) {
     }
 
     /* Ensure at least one line */
-    if (s_line_count == 0) {
-        line_init(&s_lines[0]);
-        s_line_count = 1;
-    }
+    if (s_line_count == 0)
+        doc_insert_line(0);
 
-    mem_free(data);
+    /* One full state pass before the first draw */
+    s_hl_lo = 0;
+    s_hl_hi = s_line_count - 1;
+    doc_stamp();
 }
 
 static char *doc_serialize(UINTN *out_size) {
     /* Calculate total size: all lines + newlines */
     UINTN total = 0;
     for (int i = 0; i < s_line_count; i++) {
-        total += s_lines[i].len;
+        total += doc_at(i)->len;
         if (i < s_line_count - 1)
             total++;  /* newline between lines */
     }
@@ -234,9 +564,10 @@ static char *doc_serialize(UINTN *out_size) {
 
     UINTN pos = 0;
     for (int i = 0; i < s_line_count; i++) {
-        if (s_lines[i].len > 0) {
-            mem_copy(&buf[pos], s_lines[i].data, s_lines[i].len);
-            pos += s_lines[i].len;
+        struct edit_line *ln = doc_at(i);
+        if (ln->len > 0) {
+            mem_copy(&buf[pos], ln->data, ln->len);
+            pos += ln->len;
         }
         if (i < s_line_count - 1)
             buf[pos++] = '\n';
@@ -247,40 +578,101 @@ static char *doc_serialize(UINTN *out_size) {
     return buf;
 }
 
+/* Queue n bytes for writing, sending full blocks out. Large runs go
+   straight through. Returns 0 on success. */
+static int save_put(struct fs_file *out, char *blk, UINTN *used,
+                    const char *data, UINTN n) {
+    if (*used + n > EDIT_SAVE_BLOCK) {
+        if (*used && fs_stream_write(out, blk, *used) != 0)
+            return -1;
+        *used = 0;
+        if (n >= EDIT_SAVE_BLOCK)
+            return fs_stream_write(out, data, n);
+    }
+    mem_copy(blk + *used, data, n);
+    *used += n;
+    return 0;
+}
+
+/* Stream the lines to the file in EDIT_SAVE_BLOCK writes, with the
+   line breaks the file was loaded with */
 static int doc_save(void) {
-    UINTN size = 0;
-    char *buf = doc_serialize(&size);
-    if (!buf)
-        return -1;
+    const char *brk = s_crlf ? "\r\n" : "\n";
+    UINTN brk_len = s_crlf ? 2 : 1;
+    UINT64 size = 0;
+    for (int i = 0; i < s_line_count; i++)
+        size += doc_at(i)->len;
+    size += (UINT64)(s_line_count - 1) * brk_len;
 
     /* Check disk space (account for existing file we'll replace) */
     UINT64 total_bytes, free_bytes;
     if (fs_volume_info(&total_bytes, &free_bytes) == 0) {
         UINT64 old_size = fs_file_size(s_filepath);
-        if ((UINT64)size > free_bytes + old_size) {
-            mem_free(buf);
+        if (size > free_bytes + old_size)
             return -2;  /* out of space */
-        }
     }
 
-    EFI_STATUS status = fs_writefile(s_filepath, buf, size);
-    mem_free(buf);
+    /* Before the open, which starts writing over the file */
+    char *blk = (char *)mem_alloc(EDIT_SAVE_BLOCK);
+    if (!blk)
+        return -1;
+    struct fs_file *out = fs_open_overwrite(NULL, s_filepath);
+    if (!out) {
+        mem_free(blk);
+        return -1;
+    }
+
+    UINTN used = 0;
+    int rc = 0;
+    for (int i = 0; i < s_line_count && rc == 0; i++) {
+        struct edit_line *ln = doc_at(i);
+        rc = save_put(out, blk, &used, ln->data, ln->len);
+        if (rc == 0 && i < s_line_count - 1)
+            rc = save_put(out, blk, &used, brk, brk_len);
+    }
+    if (rc == 0 && used)
+        rc = fs_stream_write(out, blk, used);
+    if (fs_stream_close(out) != 0)
+        rc = -1;
+    mem_free(blk);
 
-    if (EFI_ERROR(status))
+    if (rc != 0)
         return -1;
 
     s_modified = 0;
+    doc_stamp();
     return 0;
 }
 
 static void doc_clear(void) {
     for (int i = 0; i < s_line_count; i++)
-        line_free(&s_lines[i]);
-    s_line_count = 0;
+        line_free(doc_at(i));
+    if (s_lines)
+        mem_free(s_lines);
+    if (s_file)
+        mem_free(s_file);
+    for (int i = 0; i < s_text_count; i++)
+        text_put(s_texts[i]);
+    if (s_texts)
+        mem_free(s_texts);
+    s_lines = NULL;
+    s_file = NULL;
+    s_texts = NULL;
+    s_text_count = s_text_cap = 0;
+    s_line_cap = s_line_count = s_gap = 0;
+    s_hl_lo = -1;
 }
 
 /* ---- Selection and clipboard ---- */
 
+/* Extend the one-shot info bar note */
+static void note_append(const char *text) {
+    int i = (int)str_len((CHAR8 *)s_info_note);
+    while (*text && i < (int)sizeof(s_info_note) - 1)
+        s_info_note[i++] = *text++;
+    s_info_note[i] = '\0';
+}
+
 static void sel_get_range(int *sy, int *sx, int *ey, int *ex) {
     if (s_sel_anchor_y < s_cy ||
         (s_sel_anchor_y == s_cy && s_sel_anchor_x <= s_cx)) {
@@ -292,26 +684,101 @@ static void sel_get_range(int *sy, int *sx, int *ey, int *ex) {
     }
 }
 
+/* Replace the clipboard with a new block of len bytes for the caller
+   to fill. Returns NULL if out of memory. */
+static char *clip_new(UINTN len) {
+    struct edit_text *t = text_new(len);
+    if (!t)
+        return NULL;
+    text_put(s_clip);
+    s_clip = t;
+    s_clip_dirty = 1;
+    return t->data;
+}
+
 static void sel_copy(void) {
     if (!s_sel_active) return;
 
     int sy, sx, ey, ex;
     sel_get_range(&sy, &sx, &ey, &ex);
 
-    if (!s_clipboard) s_clipboard = (char *)mem_alloc(CLIP_MAX);
-    if (!s_clipboard) return;
+    /* Lines end with '\n' in the clipboard, the last one without */
+    UINTN total = (UINTN)(ey - sy);
+    for (int y = sy; y <= ey; y++)
+        total += (y == ey ? (UINTN)ex : doc_at(y)->len) - (y == sy ? (UINTN)sx : 0);
+    char *out = clip_new(total);
+    if (!out) return;
 
-    UINTN pos = 0;
-    for (int y = sy; y <= ey && pos < CLIP_MAX - 1; y++) {
+    for (int y = sy; y <= ey; y++) {
+        struct edit_line *ln = doc_at(y);
         int start = (y == sy) ? sx : 0;
-        int end = (y == ey) ? ex : (int)s_lines[y].len;
-        for (int x = start; x < end && pos < CLIP_MAX - 1; x++)
-            s_clipboard[pos++] = s_lines[y].data[x];
-        if (y < ey && pos < CLIP_MAX - 1)
-            s_clipboard[pos++] = '\n';
+        int end = (y == ey) ? ex : (int)ln->len;
+        mem_copy(out, &ln->data[start], (UINTN)(end - start));
+        out += end - start;
+        if (y < ey)
+            *out++ = '\n';
+    }
+}
+
+/* Write the clipboard to CLIP_FILE on the RAM disk. Returns 0 on
+   success; without a RAM disk there is nothing to do. */
+static int clip_save(void) {
+    s_clip_dirty = 0;
+    if (!s_clip || !fs_ram_active())
+        return 0;
+    struct fs_volume *ram = fs_volume_open(FS_VOL_RAM, NULL);
+    if (!ram)
+        return -1;
+    int rc = -1;
+    struct fs_file *f = fs_volume_open_write(ram, CLIP_FILE);
+    if (f) {
+        rc = fs_stream_write(f, s_clip->data, s_clip->len);
+        if (fs_stream_close(f) != 0)
+            rc = -1;
+    }
+    fs_volume_close(ram);
+    if (rc == 0)
+        s_clip_crc = crc32c(0, s_clip->data, s_clip->len);
+    return rc;
+}
+
+static int clip_idle(void *arg) {
+    (void)arg;
+    clip_save();
+    return 0;
+}
+
+/* Take up what another file or program left in CLIP_FILE since the
+   editor last wrote or read it */
+static void clip_load(void) {
+    if (s_clip_dirty || !fs_ram_active())
+        return;     /* this clipboard is the newer */
+    struct fs_volume *ram = fs_volume_open(FS_VOL_RAM, NULL);
+    if (!ram)
+        return;
+    UINT64 size = 0;
+    struct fs_file *f = fs_volume_open_read(ram, CLIP_FILE, &size);
+    struct edit_text *t = f && size == (UINTN)size ? text_new((UINTN)size) : NULL;
+    if (t) {
+        UINTN got = 0;
+        while (got < t->len) {
+            UINTN n = t->len - got;
+            if (fs_stream_read(f, &t->data[got], &n) != 0 || n == 0)
+                break;
+            got += n;
+        }
+        UINT32 crc = crc32c(0, t->data, t->len);
+        if (got == t->len && (!s_clip || crc != s_clip_crc)) {
+            text_put(s_clip);
+            s_clip = t;
+            s_clip_crc = crc;
+            t = NULL;
+        }
+        text_put(t);
     }
-    s_clip_len = pos;
-    s_clipboard[pos] = '\0';
+    if (f)
+        fs_stream_close(f);
+    fs_volume_close(ram);
 }
 
 static void sel_delete_range(void) {
@@ -321,27 +788,16 @@ static void sel_delete_range(void) {
     sel_get_range(&sy, &sx, &ey, &ex);
 
     if (sy == ey) {
-        /* Single line deletion */
-        for (int i = sx; i < ex; i++)
-            line_delete_char(&s_lines[sy], sx);
+        line_erase(doc_edit(sy), sx, (UINTN)(ex - sx));
     } else {
         /* Multi-line: keep start of first, keep end of last */
-        struct edit_line *first = &s_lines[sy];
-        struct edit_line *last = &s_lines[ey];
+        struct edit_line *first = doc_edit(sy);
+        struct edit_line *last = doc_at(ey);
 
-        first->len = (UINTN)sx;
-        first->data[sx] = '\0';
-
-        if (ex < (int)last->len) {
-            UINTN remain = last->len - (UINTN)ex;
-            line_ensure(first, first->len + remain);
-            mem_copy(&first->data[first->len], &last->data[ex], remain);
-            first->len += remain;
-            first->data[first->len] = '\0';
-        }
-
-        for (int i = ey; i > sy; i--)
-            doc_delete_line(i);
+        line_truncate(first, (UINTN)sx);
+        if (ex < (int)last->len)
+            line_insert_text(first, sx, &last->data[ex], last->len - (UINTN)ex);
+        doc_delete_lines(sy + 1, ey - sy);
     }
 
     s_cy = sy;
@@ -350,34 +806,102 @@ static void sel_delete_range(void) {
     s_modified = 1;
 }
 
+/* The length of the clipboard line at pos, and where the next starts */
+static UINTN clip_line(const struct edit_text *t, UINTN pos, UINTN *next) {
+    UINTN i = pos;
+    while (i < t->len && t->data[i] != '\n' && t->data[i] != '\r')
+        i++;
+    *next = i + 1;
+    if (i + 1 < t->len && t->data[i] == '\r' && t->data[i + 1] == '\n')
+        (*next)++;
+    return i - pos;
+}
+
+/* Paste as one splice: the first clipboard line joins the cursor line,
+   the last one takes the text after the cursor, and every line between
+   is a record borrowing from the clipboard, inserted with one gap move */
 static void sel_paste(void) {
-    if (!s_clipboard || s_clip_len == 0) return;
+    clip_load();
+    struct edit_text *t = s_clip;
+    if (!t || t->len == 0) return;
 
     if (s_sel_active)
         sel_delete_range();
 
-    for (UINTN i = 0; i < s_clip_len; i++) {
-        if (s_clipboard[i] == '\n') {
-            doc_split_line();
-        } else {
-            line_insert_char(&s_lines[s_cy], s_cx, s_clipboard[i]);
-            s_cx++;
+    int breaks = 0;
+    for (UINTN i = 0; i < t->len; i++)
+        if (t->data[i] == '\n' ||
+            (t->data[i] == '\r' && (i + 1 == t->len || t->data[i + 1] != '\n')))
+            breaks++;
+
+    UINTN pos, len = clip_line(t, 0, &pos);
+    if (breaks == 0) {
+        line_insert_text(doc_edit(s_cy), s_cx, t->data, len);
+        s_cx += (int)len;
+        s_modified = 1;
+        return;
+    }
+    if (doc_reserve(breaks) != 0 || doc_hold(t) != 0) {
+        s_info_note[0] = '\0';
+        note_append("Not enough memory to paste");
+        return;
+    }
+
+    /* The last line: the clipboard's own bytes unless text follows it */
+    struct edit_line *cur = doc_edit(s_cy);
+    UINTN tail = cur->len - (UINTN)s_cx;
+    UINTN last_at = t->len;
+    while (last_at > 0 && t->data[last_at - 1] != '\n' && t->data[last_at - 1] != '\r')
+        last_at--;
+    UINTN last_len = t->len - last_at;
+    struct edit_line last = { &t->data[last_at], last_len, 0, NULL, -1, HL_NORMAL, 0 };
+    if (tail) {
+        char *buf = (char *)mem_alloc_raw(last_len + tail + 1);
+        if (!buf) {
+            s_info_note[0] = '\0';
+            note_append("Not enough memory to paste");
+            return;
         }
+        mem_copy(buf, last.data, last_len);
+        mem_copy(&buf[last_len], &cur->data[s_cx], tail);
+        last.len = last_len + tail;
+        line_adopt(&last, buf, last.len, last.len + 1);
     }
+    line_truncate(cur, (UINTN)s_cx);
+    line_insert_text(cur, s_cx, t->data, len);
+
+    doc_gap_move(s_cy + 1);
+    struct edit_line *ln = &s_lines[s_gap];
+    for (int k = 1; k < breaks; k++, ln++) {
+        UINTN next;
+        ln->data = &t->data[pos];
+        ln->len = clip_line(t, pos, &next);
+        ln->cap = 0;
+        ln->spans = NULL;
+        ln->nspans = -1;
+        ln->hl_state = HL_NORMAL;
+        ln->diag = 0;
+        pos = next;
+    }
+    *ln = last;
+    s_gap += breaks;
+    s_line_count += breaks;
+    if (s_hl_lo >= 0) {
+        if (s_hl_lo > s_cy) s_hl_lo += breaks;
+        if (s_hl_hi > s_cy) s_hl_hi += breaks;
+    }
+    s_cy += breaks;
+    s_cx = (int)last_len;
+    hl_mark(s_cy);
     s_modified = 1;
 }
 
 static void handle_copy_line(void) {
-    struct edit_line *ln = &s_lines[s_cy];
-    if (!s_clipboard) s_clipboard = (char *)mem_alloc(CLIP_MAX);
-    if (!s_clipboard) return;
-
-    UINTN len = ln->len;
-    if (len > CLIP_MAX - 2) len = CLIP_MAX - 2;
-    mem_copy(s_clipboard, ln->data, len);
-    s_clipboard[len] = '\n';
-    s_clip_len = len + 1;
-    s_clipboard[s_clip_len] = '\0';
+    struct edit_line *ln = doc_at(s_cy);
+    char *out = clip_new(ln->len + 1);
+    if (!out) return;
+    mem_copy(out, ln->data, ln->len);
+    out[ln->len] = '\n';
 }
 
 static void handle_cut_line(void) {
@@ -386,10 +910,9 @@ static void handle_cut_line(void) {
     if (s_line_count > 1) {
         doc_delete_line(s_cy);
         if (s_cy >= s_line_count) s_cy = s_line_count - 1;
-        if (s_cx > (int)s_lines[s_cy].len) s_cx = (int)s_lines[s_cy].len;
+        if (s_cx > (int)doc_at(s_cy)->len) s_cx = (int)doc_at(s_cy)->len;
     } else {
-        s_lines[0].len = 0;
-        s_lines[0].data[0] = '\0';
+        line_truncate(doc_edit(0), 0);
         s_cx = 0;
     }
     s_modified = 1;
@@ -410,6 +933,18 @@ static void int_to_str(int n, char *buf) {
     buf[i] = '\0';
 }
 
+/* timer_ticks() interval as milliseconds with one decimal */
+static void ticks_to_ms(UINT64 ticks, char *buf, UINTN size) {
+    UINT64 us = timer_us(ticks);
+    snprintf(buf, size, "%llu.%llu", us / 1000, us / 100 % 10);
+}
+
+/* Source lines per second over a timer_ticks() interval */
+static UINT64 lines_per_sec(UINT32 lines, UINT64 ticks) {
+    UINT64 us = timer_us(ticks);
+    return us ? (UINT64)lines * 1000000 / us : 0;
+}
+
 static void pad_line(char *line, int cols) {
     int len = (int)str_len((CHAR8 *)line);
     while (len < cols) {
@@ -430,39 +965,19 @@ static int is_c_or_h_file(void) {
     return 0;
 }
 
-/* Scan all lines to determine per-line block comment state */
-static void hl_compute_states(void) {
-    int in_comment = 0;
-    for (int i = 0; i < s_line_count; i++) {
-        s_line_state[i] = in_comment ? HL_COMMENT : HL_NORMAL;
-        struct edit_line *ln = &s_lines[i];
-        for (int j = 0; j < (int)ln->len - 1; j++) {
-            if (!in_comment && ln->data[j] == '/' && ln->data[j + 1] == '*') {
-                in_comment = 1;
-                j++;
-            } else if (in_comment && ln->data[j] == '*' && ln->data[j + 1] == '/') {
-                in_comment = 0;
-                j++;
-            }
-        }
-    }
-}
-
-/* Check if identifier matches any in a table */
-static int match_word(const char *word, int wlen, const char **table) {
-    for (int i = 0; table[i]; i++) {
-        const char *t = table[i];
-        int tlen = 0;
-        while (t[tlen]) tlen++;
-        if (tlen == wlen) {
-            int ok = 1;
-            for (int j = 0; j < wlen; j++) {
-                if (word[j] != t[j]) { ok = 0; break; }
-            }
-            if (ok) return 1;
+/* Comment state at the end of a line that starts in state */
+static int hl_scan(const struct edit_line *ln, int state) {
+    int in_comment = (state == HL_COMMENT);
+    for (int j = 0; j < (int)ln->len - 1; j++) {
+        if (!in_comment && ln->data[j] == '/' && ln->data[j + 1] == '*') {
+            in_comment = 1;
+            j++;
+        } else if (in_comment && ln->data[j] == '*' && ln->data[j + 1] == '/') {
+            in_comment = 0;
+            j++;
         }
     }
-    return 0;
+    return in_comment ? HL_COMMENT : HL_NORMAL;
 }
 
 static const char *s_keywords[] = {
@@ -483,155 +998,219 @@ static const char *s_types[] = {
     NULL
 };
 
-/* Colorize one line into a color array.
-   colors[] must have at least max_cols entries.
-   Returns with colors filled for visible columns. */
-static void hl_colorize_line(int doc_line, UINT32 *colors, int max_cols,
-                             int scroll_x) {
-    struct edit_line *ln = &s_lines[doc_line];
-    int in_comment = (s_line_state[doc_line] == HL_COMMENT);
-    (void)0;  /* string/char handled inline below */
+/*
+ * Keywords, built-in types and the type names harvested from typedefs
+ * in the buffer share one open-addressed hash table, so classifying an
+ * identifier is a hash and usually a single compare.
+ */
+#define HL_WORD_SLOTS   1024    /* power of two, kept at most half full */
+#define HL_WORD_MAX     63      /* longer identifiers are never special */
+#define HL_USER_TYPES   384
+#define HL_USER_POOL    8192
+
+struct hl_word {
+    const char *s;
+    UINT8  len;
+    UINT8  color_is_type;
+};
 
-    /* Default all to normal text color */
-    for (int i = 0; i < max_cols; i++)
-        colors[i] = SYN_DEFAULT;
+static struct hl_word s_words[HL_WORD_SLOTS];
+static int  s_user_types;
+static char s_user_pool[HL_USER_POOL];
+static int  s_user_pool_len;
+
+static UINT32 hl_hash(const char *w, int n) {
+    UINT32 h = 2166136261u;
+    for (int i = 0; i < n; i++)
+        h = (h ^ (UINT8)w[i]) * 16777619u;
+    return h & (HL_WORD_SLOTS - 1);
+}
+
+static struct hl_word *hl_word_slot(const char *w, int n) {
+    UINT32 h = hl_hash(w, n);
+    while (s_words[h].s) {
+        if (s_words[h].len == n && mem_cmp(s_words[h].s, w, (UINTN)n) == 0)
+            break;
+        h = (h + 1) & (HL_WORD_SLOTS - 1);
+    }
+    return &s_words[h];
+}
+
+static void hl_word_add(const char *w, int n, int is_type) {
+    struct hl_word *slot = hl_word_slot(w, n);
+    if (slot->s)
+        return;
+    slot->s = w;
+    slot->len = (UINT8)n;
+    slot->color_is_type = (UINT8)is_type;
+}
+
+/* Start from the built-in words only */
+static void hl_words_reset(void) {
+    mem_set(s_words, 0, sizeof(s_words));
+    for (int i = 0; s_keywords[i]; i++)
+        hl_word_add(s_keywords[i], (int)str_len((CHAR8 *)s_keywords[i]), 0);
+    for (int i = 0; s_types[i]; i++)
+        hl_word_add(s_types[i], (int)str_len((CHAR8 *)s_types[i]), 1);
+    s_user_types = 0;
+    s_user_pool_len = 0;
+    s_words_ready = 1;
+}
+
+/* Colour of an identifier: keyword, type or SYN_DEFAULT */
+static UINT32 hl_word_color(const char *w, int n) {
+    if (n > HL_WORD_MAX)
+        return SYN_DEFAULT;
+    if (!s_words_ready)
+        hl_words_reset();
+    struct hl_word *slot = hl_word_slot(w, n);
+    if (!slot->s)
+        return SYN_DEFAULT;
+    return slot->color_is_type ? SYN_TYPE : SYN_KEYWORD;
+}
+
+/* Add a typedef name. Returns 1 if it was new. */
+static int hl_user_type(const char *w, int n) {
+    if (n > HL_WORD_MAX || s_user_types >= HL_USER_TYPES ||
+        s_user_pool_len + n > HL_USER_POOL)
+        return 0;
+    if (hl_word_color(w, n) != SYN_DEFAULT)
+        return 0;
+    char *copy = &s_user_pool[s_user_pool_len];
+    mem_copy(copy, w, (UINTN)n);
+    s_user_pool_len += n;
+    s_user_types++;
+    hl_word_add(copy, n, 1);
+    return 1;
+}
+
+/* Span scratch for the line being tokenized */
+static struct hl_span *s_hl_scratch;
+static int s_hl_scratch_cap;
+static int s_hl_count;
+
+/* Colour [start, end); runs of the default colour are not stored */
+static void hl_put(int start, int end, UINT32 color) {
+    if (color == SYN_DEFAULT)
+        return;
+    if (s_hl_count > 0) {
+        struct hl_span *last = &s_hl_scratch[s_hl_count - 1];
+        if (last->end == (UINT32)start && last->color == color) {
+            last->end = (UINT32)end;
+            return;
+        }
+    }
+    if (s_hl_count >= s_hl_scratch_cap) {
+        int cap = s_hl_scratch_cap ? s_hl_scratch_cap * 2 : 64;
+        struct hl_span *n = (struct hl_span *)
+            mem_alloc((UINTN)cap * sizeof(struct hl_span));
+        if (!n)
+            return;  /* out of memory: the rest stays default */
+        if (s_hl_scratch) {
+            mem_copy(n, s_hl_scratch, (UINTN)s_hl_count * sizeof(struct hl_span));
+            mem_free(s_hl_scratch);
+        }
+        s_hl_scratch = n;
+        s_hl_scratch_cap = cap;
+    }
+    struct hl_span *sp = &s_hl_scratch[s_hl_count++];
+    sp->start = (UINT32)start;
+    sp->end = (UINT32)end;
+    sp->color = color;
+}
+
+static int is_ident_start(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+/* Split a line into colour spans in s_hl_scratch */
+static void hl_tokenize(const struct edit_line *ln) {
+    const char *d = ln->data;
+    int len = (int)ln->len;
+    int in_comment = (ln->hl_state == HL_COMMENT);
 
-    /* Walk the line */
+    s_hl_count = 0;
     int i = 0;
-    while (i < (int)ln->len) {
-        int col = i - scroll_x;  /* screen column */
+    while (i < len) {
+        int start = i;
 
-        /* Block comment */
+        /* Block comment, up to and including the closing */
         if (in_comment) {
-            if (i + 1 < (int)ln->len && ln->data[i] == '*' && ln->data[i + 1] == '/') {
-                if (col >= 0 && col < max_cols) colors[col] = SYN_COMMENT;
-                if (col + 1 >= 0 && col + 1 < max_cols) colors[col + 1] = SYN_COMMENT;
-                in_comment = 0;
+            while (i < len && !(d[i] == '*' && i + 1 < len && d[i + 1] == '/'))
+                i++;
+            if (i < len) {
                 i += 2;
-                continue;
+                in_comment = 0;
             }
-            if (col >= 0 && col < max_cols) colors[col] = SYN_COMMENT;
-            i++;
+            hl_put(start, i, SYN_COMMENT);
             continue;
         }
 
         /* Line comment */
-        if (ln->data[i] == '/' && i + 1 < (int)ln->len && ln->data[i + 1] == '/') {
-            while (i < (int)ln->len) {
-                col = i - scroll_x;
-                if (col >= 0 && col < max_cols) colors[col] = SYN_COMMENT;
-                i++;
-            }
+        if (d[i] == '/' && i + 1 < len && d[i + 1] == '/') {
+            hl_put(i, len, SYN_COMMENT);
             break;
         }
 
         /* Block comment start */
-        if (ln->data[i] == '/' && i + 1 < (int)ln->len && ln->data[i + 1] == '*') {
-            if (col >= 0 && col < max_cols) colors[col] = SYN_COMMENT;
-            if (col + 1 >= 0 && col + 1 < max_cols) colors[col + 1] = SYN_COMMENT;
-            in_comment = 1;
+        if (d[i] == '/' && i + 1 < len && d[i + 1] == '*') {
             i += 2;
+            in_comment = 1;
+            hl_put(start, i, SYN_COMMENT);
             continue;
         }
 
         /* String literal */
-        if (ln->data[i] == '"' || ln->data[i] == '\'') {
-            char quote = ln->data[i];
-            if (col >= 0 && col < max_cols) colors[col] = SYN_STRING;
-            i++;
-            while (i < (int)ln->len && ln->data[i] != quote) {
-                col = i - scroll_x;
-                if (col >= 0 && col < max_cols) colors[col] = SYN_STRING;
-                if (ln->data[i] == '\\' && i + 1 < (int)ln->len) {
+        if (d[i] == '"' || d[i] == '\'') {
+            char quote = d[i++];
+            while (i < len && d[i] != quote) {
+                if (d[i] == '\\' && i + 1 < len)
                     i++;
-                    col = i - scroll_x;
-                    if (col >= 0 && col < max_cols) colors[col] = SYN_STRING;
-                }
                 i++;
             }
-            if (i < (int)ln->len) {
-                col = i - scroll_x;
-                if (col >= 0 && col < max_cols) colors[col] = SYN_STRING;
+            if (i < len)
                 i++;
-            }
+            hl_put(start, i, SYN_STRING);
             continue;
         }
 
-        /* Preprocessor */
-        if (ln->data[i] == '#') {
-            /* Check if # is at start of line (ignoring whitespace) */
+        /* Preprocessor: # at start of line (ignoring whitespace) */
+        if (d[i] == '#') {
             int is_pp = 1;
             for (int j = 0; j < i; j++) {
-                if (ln->data[j] != ' ' && ln->data[j] != '\t') {
+                if (d[j] != ' ' && d[j] != '\t') {
                     is_pp = 0;
                     break;
                 }
             }
             if (is_pp) {
-                while (i < (int)ln->len) {
-                    col = i - scroll_x;
-                    if (col >= 0 && col < max_cols) colors[col] = SYN_PREPROC;
-                    i++;
-                }
+                hl_put(i, len, SYN_PREPROC);
                 break;
             }
         }
 
-        /* Numbers */
-        if ((ln->data[i] >= '0' && ln->data[i] <= '9') ||
-            (ln->data[i] == '.' && i + 1 < (int)ln->len &&
-             ln->data[i + 1] >= '0' && ln->data[i + 1] <= '9')) {
-            /* Check not part of identifier */
-            int prev_ident = 0;
-            if (i > 0) {
-                char p = ln->data[i - 1];
-                if ((p >= 'a' && p <= 'z') || (p >= 'A' && p <= 'Z') || p == '_')
-                    prev_ident = 1;
-            }
-            if (!prev_ident) {
-                while (i < (int)ln->len) {
-                    char c = ln->data[i];
-                    if ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') ||
-                        (c >= 'A' && c <= 'F') || c == 'x' || c == 'X' ||
-                        c == '.' || c == 'U' || c == 'L' || c == 'u' || c == 'l')
-                    {
-                        col = i - scroll_x;
-                        if (col >= 0 && col < max_cols)
-                            colors[col] = SYN_NUMBER;
-                        i++;
-                    } else {
-                        break;
-                    }
-                }
-                continue;
-            }
-        }
-
-        /* Identifiers → keyword/type check */
-        if ((ln->data[i] >= 'a' && ln->data[i] <= 'z') ||
-            (ln->data[i] >= 'A' && ln->data[i] <= 'Z') || ln->data[i] == '_') {
-            int start = i;
-            while (i < (int)ln->len) {
-                char c = ln->data[i];
-                if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
-                    (c >= '0' && c <= '9') || c == '_')
+        /* Numbers, unless part of an identifier */
+        if (((d[i] >= '0' && d[i] <= '9') ||
+             (d[i] == '.' && i + 1 < len && d[i + 1] >= '0' && d[i + 1] <= '9')) &&
+            !(i > 0 && is_ident_start(d[i - 1]))) {
+            while (i < len) {
+                char c = d[i];
+                if ((c >= '0' && c <= '9') || (c >= 'a' && c <= 'f') ||
+                    (c >= 'A' && c <= 'F') || c == 'x' || c == 'X' ||
+                    c == '.' || c == 'U' || c == 'L' || c == 'u' || c == 'l')
                     i++;
                 else
                     break;
             }
-            int wlen = i - start;
-            UINT32 wcolor = SYN_DEFAULT;
-            if (match_word(&ln->data[start], wlen, s_keywords))
-                wcolor = SYN_KEYWORD;
-            else if (match_word(&ln->data[start], wlen, s_types))
-                wcolor = SYN_TYPE;
-            if (wcolor != SYN_DEFAULT) {
-                for (int j = start; j < i; j++) {
-                    col = j - scroll_x;
-                    if (col >= 0 && col < max_cols)
-                        colors[col] = wcolor;
-                }
-            }
+            hl_put(start, i, SYN_NUMBER);
+            continue;
+        }
+
+        /* Identifiers → keyword/type check */
+        if (is_ident_start(d[i])) {
+            while (i < len && (is_ident_start(d[i]) || (d[i] >= '0' && d[i] <= '9')))
+                i++;
+            hl_put(start, i, hl_word_color(&d[start], i - start));
             continue;
         }
 
@@ -640,51 +1219,325 @@ static void hl_colorize_line(int doc_line, UINT32 *colors, int max_cols,
     }
 }
 
-/* ---- Drawing ---- */
+/* Drop every cached span list */
+static void hl_cache_flush(void) {
+    for (int i = 0; i < s_line_count; i++)
+        line_spans_drop(doc_at(i));
+}
 
-static void draw_header(void) {
-    char line[256];
-    int i = 0;
-    const char *prefix = " SURVIVAL EDITOR - ";
+static void bufs_spans_drop(void);
 
-    while (prefix[i] && i < (int)g_boot.cols) {
-        line[i] = prefix[i];
-        i++;
-    }
-    int j = 0;
-    while (s_filename[j] && i < (int)g_boot.cols) {
-        line[i++] = s_filename[j++];
-    }
-    if (s_modified && i < (int)g_boot.cols) {
-        line[i++] = ' ';
-        if (i < (int)g_boot.cols)
-            line[i++] = '*';
+/* Colour spans of a line, tokenized once and cached until it changes.
+   Sets *count. Only valid until the next call. */
+static const struct hl_span *hl_line_spans(struct edit_line *ln, int *count) {
+    if (ln->nspans >= 0) {
+        *count = ln->nspans;
+        return ln->spans;
     }
-    if (fs_is_read_only() && i + 12 < (int)g_boot.cols) {
-        const char *ro = " [READ-ONLY]";
-        int k = 0;
-        while (ro[k] && i < (int)g_boot.cols)
-            line[i++] = ro[k++];
+
+    hl_tokenize(ln);
+    *count = s_hl_count;
+    if (s_hl_count == 0) {
+        ln->nspans = 0;
+        return NULL;
     }
-    line[i] = '\0';
-    pad_line(line, (int)g_boot.cols);
 
-    fb_string(0, 0, line, COLOR_CYAN, COLOR_DGRAY);
+    /* Parked buffers' colours go first: they are not on screen */
+    UINTN bytes = (UINTN)s_hl_count * sizeof(struct hl_span);
+    if (s_hl_cache_bytes + bytes > mem_budget(MEM_BUDGET_HL))
+        bufs_spans_drop();
+    if (s_hl_cache_bytes + bytes > mem_budget(MEM_BUDGET_HL))
+        hl_cache_flush();
+    struct hl_span *sp = (struct hl_span *)mem_alloc(bytes);
+    if (!sp) {
+        /* Uncached this time, and less is cached from now on */
+        mem_budget_shrink(MEM_BUDGET_HL);
+        bufs_spans_drop();
+        hl_cache_flush();
+        return s_hl_scratch;
+    }
+    mem_copy(sp, s_hl_scratch, bytes);
+    ln->spans = sp;
+    ln->nspans = s_hl_count;
+    s_hl_cache_bytes += bytes;
+    return sp;
 }
 
-static void draw_line(int screen_row, int doc_line) {
-    int cols = s_text_cols;
-    if (cols > 255) cols = 255;
-
-    int need_per_char = (doc_line >= 0 && doc_line < s_line_count &&
-                         (s_sel_active || doc_line == s_cy || s_highlight_mode));
+/* Colorize the visible part of a line into a color array.
+   colors[] must have at least max_cols entries. */
+static void hl_colorize_line(int doc_line, UINT32 *colors, int max_cols,
+                             int scroll_x) {
+    int n;
+    const struct hl_span *sp = hl_line_spans(doc_at(doc_line), &n);
 
-    if (need_per_char) {
-        struct edit_line *ln = (doc_line >= 0 && doc_line < s_line_count)
-                               ? &s_lines[doc_line] : NULL;
+    for (int i = 0; i < max_cols; i++)
+        colors[i] = SYN_DEFAULT;
 
-        int sy = 0, sx = 0, ey = 0, ex = 0;
-        if (s_sel_active)
+    for (int k = 0; k < n; k++) {
+        int a = (int)sp[k].start - scroll_x;
+        int b = (int)sp[k].end - scroll_x;
+        if (b <= 0)
+            continue;
+        if (a >= max_cols)
+            break;
+        if (a < 0) a = 0;
+        if (b > max_cols) b = max_cols;
+        for (int c = a; c < b; c++)
+            colors[c] = sp[k].color;
+    }
+}
+
+/*
+ * Collect the names declared by typedefs in lines first..last: the last
+ * identifier at the typedef's own nesting level before each ',' or ';',
+ * or the first one after "(*" for function pointer types.  Names stay
+ * known until the next file is loaded.  Returns 1 if any were new.
+ */
+static int hl_harvest(int first, int last) {
+    int added = 0;
+    int in_td = 0, depth = 0, td_depth = 0, nest = 0, locked = 0;
+    const char *cand = NULL;
+    int cand_len = 0;
+    char prev = 0;
+
+    for (int y = first; y <= last; y++) {
+        struct edit_line *ln = doc_at(y);
+        const char *d = ln->data;
+        int len = (int)ln->len;
+        int in_comment = (ln->hl_state == HL_COMMENT);
+        int i = 0;
+
+        while (i < len) {
+            char c = d[i];
+            if (in_comment) {
+                if (c == '*' && i + 1 < len && d[i + 1] == '/') {
+                    in_comment = 0;
+                    i++;
+                }
+                i++;
+                continue;
+            }
+            if (c == '/' && i + 1 < len && d[i + 1] == '/')
+                break;
+            if (c == '/' && i + 1 < len && d[i + 1] == '*') {
+                in_comment = 1;
+                i += 2;
+                continue;
+            }
+            if (c == '"' || c == '\'') {
+                i++;
+                while (i < len && d[i] != c) {
+                    if (d[i] == '\\') i++;
+                    i++;
+                }
+                i++;
+                prev = c;
+                continue;
+            }
+            if (c == '#' && !in_td)
+                break;
+            if (is_ident_start(c)) {
+                int start = i;
+                while (i < len && (is_ident_start(d[i]) || (d[i] >= '0' && d[i] <= '9')))
+                    i++;
+                int n = i - start;
+                if (n == 7 && mem_cmp(&d[start], "typedef", 7) == 0) {
+                    in_td = 1;
+                    td_depth = depth;
+                    nest = locked = 0;
+                    cand = NULL;
+                } else if (in_td && depth == td_depth && !locked) {
+                    if (nest == 0) {
+                        cand = &d[start];
+                        cand_len = n;
+                    } else if (nest == 1 && prev == '*') {
+                        cand = &d[start];
+                        cand_len = n;
+                        locked = 1;
+                    }
+                }
+                prev = 'a';
+                continue;
+            }
+
+            if (c == '{') depth++;
+            else if (c == '}' && depth > 0) depth--;
+            else if (c == '(' || c == '[') nest++;
+            else if ((c == ')' || c == ']') && nest > 0) nest--;
+            else if ((c == ',' || c == ';') && in_td &&
+                     depth == td_depth && nest == 0) {
+                if (cand)
+                    added |= hl_user_type(cand, cand_len);
+                cand = NULL;
+                locked = 0;
+                if (c == ';')
+                    in_td = 0;
+            }
+            if (c != ' ' && c != '\t')
+                prev = c;
+            i++;
+        }
+    }
+    return added;
+}
+
+/* Re-derive line start states from the first edited line on, stopping
+   at the first line past the edits whose cached state still holds */
+static void hl_update(void) {
+    if (s_hl_lo < 0)
+        return;
+    int i = s_hl_lo;
+    if (i > s_line_count - 1) i = s_line_count - 1;
+    if (i < 0) i = 0;
+    int hi = s_hl_hi;
+    if (hi > s_line_count - 1) hi = s_line_count - 1;
+    int first = i;
+    s_hl_lo = -1;
+
+    int state = HL_NORMAL;
+    if (i > 0) {
+        struct edit_line *prev = doc_at(i - 1);
+        state = hl_scan(prev, prev->hl_state);
+    }
+    for (; i < s_line_count; i++) {
+        struct edit_line *ln = doc_at(i);
+        if (ln->hl_state != state) {
+            ln->hl_state = (UINT8)state;
+            line_spans_drop(ln);
+        } else if (i > s_hl_hi) {
+            break;
+        }
+        state = hl_scan(ln, state);
+    }
+
+    /* A new type name recolours every line that uses it */
+    if (hl_harvest(first, hi))
+        hl_cache_flush();
+}
+
+/* ---- Search ---- */
+
+/*
+ * Boyer-Moore-Horspool over each line: compare the last byte of the
+ * window first and shift by the table entry of whichever byte is under
+ * it, so most positions are never looked at.  Matches do not span
+ * lines.
+ */
+static void find_prepare(void) {
+    for (int c = 0; c < 256; c++)
+        s_find_skip[c] = s_find_len;
+    for (int j = 0; j < s_find_len - 1; j++)
+        s_find_skip[(UINT8)s_find[j]] = s_find_len - 1 - j;
+}
+
+/* First match in ln at or after from, or -1 */
+static int find_in(const struct edit_line *ln, int from) {
+    int m = s_find_len;
+    int len = (int)ln->len;
+    if (m == 0 || from < 0)
+        return -1;
+    char last = s_find[m - 1];
+    for (int i = from; i + m <= len; ) {
+        char c = ln->data[i + m - 1];
+        if (c == last && mem_cmp(&ln->data[i], s_find, (UINTN)(m - 1)) == 0)
+            return i;
+        i += s_find_skip[(UINT8)c];
+    }
+    return -1;
+}
+
+/* Last match in ln starting before before, or -1 */
+static int find_in_rev(const struct edit_line *ln, int before) {
+    int best = -1;
+    for (int p = find_in(ln, 0); p >= 0 && p < before; p = find_in(ln, p + 1))
+        best = p;
+    return best;
+}
+
+/* Select the match of length s_find_len at (y, x), cursor at its end */
+static void find_select(int y, int x) {
+    s_sel_active = 1;
+    s_sel_anchor_y = y;
+    s_sel_anchor_x = x;
+    s_cy = y;
+    s_cx = x + s_find_len;
+}
+
+/* Search the whole document from (y, x), wrapping around; dir > 0
+   finds the first match at or after x, dir < 0 the last one before it.
+   Selects it and returns 1, or returns 0. */
+static int find_from(int y, int x, int dir) {
+    if (s_find_len == 0)
+        return 0;
+    for (int k = 0; k <= s_line_count; k++) {
+        int line, p;
+        if (dir > 0) {
+            line = (y + k) % s_line_count;
+            p = find_in(doc_at(line), k == 0 ? x : 0);
+        } else {
+            line = ((y - k) % s_line_count + s_line_count) % s_line_count;
+            p = find_in_rev(doc_at(line), k == 0 ? x : 0x7FFFFFFF);
+        }
+        if (p >= 0) {
+            find_select(line, p);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* ---- Drawing ---- */
+
+static void draw_header(void) {
+    char line[256];
+    int i = 0;
+    const char *prefix = " SURVIVAL EDITOR - ";
+
+    while (prefix[i] && i < (int)g_boot.cols) {
+        line[i] = prefix[i];
+        i++;
+    }
+    int j = 0;
+    while (s_filename[j] && i < (int)g_boot.cols) {
+        line[i++] = s_filename[j++];
+    }
+    if (s_modified && i < (int)g_boot.cols) {
+        line[i++] = ' ';
+        if (i < (int)g_boot.cols)
+            line[i++] = '*';
+    }
+    if (fs_is_read_only() && i + 12 < (int)g_boot.cols) {
+        const char *ro = " [READ-ONLY]";
+        int k = 0;
+        while (ro[k] && i < (int)g_boot.cols)
+            line[i++] = ro[k++];
+    }
+    line[i] = '\0';
+    pad_line(line, (int)g_boot.cols);
+
+    fb_string(0, 0, line, COLOR_CYAN, COLOR_DGRAY);
+}
+
+static void draw_line(int screen_row, int doc_line) {
+    int cols = s_text_cols;
+    if (cols > 255) cols = 255;
+
+    if (s_gutter) {
+        int d = (doc_line >= 0 && doc_line < s_line_count) ? doc_at(doc_line)->diag : 0;
+        fb_char(0, (UINT32)screen_row, d ? '>' : ' ',
+                d && s_diag[d - 1].error ? COLOR_RED : COLOR_YELLOW, COLOR_BLACK);
+    }
+
+    int need_per_char = (doc_line >= 0 && doc_line < s_line_count &&
+                         (s_sel_active || doc_line == s_cy || s_highlight_mode ||
+                          s_find_show));
+
+    if (need_per_char) {
+        struct edit_line *ln = (doc_line >= 0 && doc_line < s_line_count)
+                               ? doc_at(doc_line) : NULL;
+
+        int sy = 0, sx = 0, ey = 0, ex = 0;
+        if (s_sel_active)
             sel_get_range(&sy, &sx, &ey, &ex);
 
         /* Compute syntax colors for this line */
@@ -695,6 +1548,21 @@ static void draw_line(int screen_row, int doc_line) {
             for (int i = 0; i < cols; i++) syn_colors[i] = COLOR_WHITE;
         }
 
+        /* Search matches in view */
+        UINT8 hit[256];
+        mem_set(hit, 0, (UINTN)cols);
+        if (s_find_show && ln) {
+            int from = s_scroll_x - s_find_len + 1;
+            if (from < 0) from = 0;
+            for (int p = find_in(ln, from); p >= 0 && p < s_scroll_x + cols;
+                 p = find_in(ln, p + 1)) {
+                for (int k = 0; k < s_find_len; k++) {
+                    int c = p + k - s_scroll_x;
+                    if (c >= 0 && c < cols) hit[c] = 1;
+                }
+            }
+        }
+
         for (int col = 0; col < cols; col++) {
             int doc_col = s_scroll_x + col;
             char ch = ' ';
@@ -704,7 +1572,7 @@ static void draw_line(int screen_row, int doc_line) {
             }
 
             UINT32 fg = syn_colors[col];
-            UINT32 bg = COLOR_BLACK;
+            UINT32 bg = hit[col] ? EDIT_MATCH_BG : COLOR_BLACK;
 
             /* Selection highlight */
             if (s_sel_active) {
@@ -727,7 +1595,7 @@ static void draw_line(int screen_row, int doc_line) {
                 bg = COLOR_WHITE;
             }
 
-            fb_char((UINT32)col, (UINT32)screen_row, ch, fg, bg);
+            fb_char((UINT32)(s_gutter + col), (UINT32)screen_row, ch, fg, bg);
         }
     } else {
         /* Fast path: no selection, no highlight, not cursor line */
@@ -736,7 +1604,7 @@ static void draw_line(int screen_row, int doc_line) {
         line[cols] = '\0';
 
         if (doc_line >= 0 && doc_line < s_line_count) {
-            struct edit_line *ln = &s_lines[doc_line];
+            struct edit_line *ln = doc_at(doc_line);
             int start = s_scroll_x;
             int i = 0;
             while (i < cols && start + i < (int)ln->len) {
@@ -746,13 +1614,13 @@ static void draw_line(int screen_row, int doc_line) {
             }
         }
 
-        fb_string(0, (UINT32)screen_row, line, COLOR_WHITE, COLOR_BLACK);
+        fb_string((UINT32)s_gutter, (UINT32)screen_row, line, COLOR_WHITE, COLOR_BLACK);
     }
 }
 
 static void draw_text(void) {
     if (s_highlight_mode)
-        hl_compute_states();
+        hl_update();
     for (int r = 0; r < s_text_rows; r++) {
         int doc_line = s_scroll_y + r;
         draw_line(s_text_top + r, doc_line);
@@ -763,6 +1631,11 @@ static void draw_info(const char *msg) {
     char line[256];
     int i = 0;
 
+    if (!msg && s_info_note[0]) {
+        msg = s_info_note;  /* shown once, by the next redraw */
+        s_info_note[0] = '\0';
+    }
+
     if (msg) {
         line[i++] = ' ';
         int j = 0;
@@ -791,6 +1664,15 @@ static void draw_info(const char *msg) {
         int_to_str(s_cx + 1, num);
         j = 0;
         while (num[j] && i < (int)g_boot.cols) line[i++] = num[j++];
+
+        /* The check's message for this line */
+        int d = s_cy < s_line_count ? doc_at(s_cy)->diag : 0;
+        if (d) {
+            const char *kind = s_diag[d - 1].error ? "   error: " : "   warning: ";
+            for (j = 0; kind[j] && i < (int)g_boot.cols; j++) line[i++] = kind[j];
+            const char *text = s_diag[d - 1].text;
+            for (j = 0; text[j] && i < (int)g_boot.cols; j++) line[i++] = text[j];
+        }
     }
     line[i] = '\0';
     pad_line(line, (int)g_boot.cols);
@@ -804,9 +1686,9 @@ static void draw_status(const char *msg) {
 
     if (!msg) {
         if (fs_is_read_only())
-            msg = " F3:Select  ESC:Exit  [READ-ONLY]";
+            msg = " F3:Select  ^F:Find  F4:Buf  ESC:Exit  [READ-ONLY]";
         else
-            msg = " F2:Save  F3:Select  F5:Run  F6:Rebuild  ESC:Exit";
+            msg = " F2:Save F3:Select ^F:Find ^R:Replace F4:Buf F5:Run F6:Rebuild F7:App ESC:Exit";
     }
 
     while (msg[i] && i < (int)g_boot.cols) {
@@ -817,6 +1699,8 @@ static void draw_status(const char *msg) {
     pad_line(line, (int)g_boot.cols);
 
     fb_string(0, g_boot.rows - 1, line, COLOR_GRAY, COLOR_DGRAY);
+    /* Often shown just before a long operation */
+    fb_present();
 }
 
 static void draw_all(void) {
@@ -849,7 +1733,7 @@ static void scroll_to_cursor(void) {
 
 static void handle_char(char c) {
     if (s_sel_active) sel_delete_range();
-    line_insert_char(&s_lines[s_cy], s_cx, c);
+    line_insert_char(doc_edit(s_cy), s_cx, c);
     s_cx++;
     s_modified = 1;
 }
@@ -863,20 +1747,20 @@ static void handle_backspace(void) {
     if (s_sel_active) { sel_delete_range(); return; }
     if (s_cx > 0) {
         s_cx--;
-        line_delete_char(&s_lines[s_cy], s_cx);
+        line_delete_char(doc_edit(s_cy), s_cx);
         s_modified = 1;
     } else if (s_cy > 0) {
         /* Join with line above */
         s_cy--;
-        s_cx = (int)s_lines[s_cy].len;
+        s_cx = (int)doc_at(s_cy)->len;
         doc_join_lines(s_cy);
     }
 }
 
 static void handle_delete(void) {
     if (s_sel_active) { sel_delete_range(); return; }
-    if (s_cx < (int)s_lines[s_cy].len) {
-        line_delete_char(&s_lines[s_cy], s_cx);
+    if (s_cx < (int)doc_at(s_cy)->len) {
+        line_delete_char(doc_edit(s_cy), s_cx);
         s_modified = 1;
     } else if (s_cy < s_line_count - 1) {
         /* Join with line below */
@@ -894,15 +1778,15 @@ static void handle_move(UINT16 key) {
     case KEY_UP:
         if (s_cy > 0) {
             s_cy--;
-            if (s_cx > (int)s_lines[s_cy].len)
-                s_cx = (int)s_lines[s_cy].len;
+            if (s_cx > (int)doc_at(s_cy)->len)
+                s_cx = (int)doc_at(s_cy)->len;
         }
         break;
     case KEY_DOWN:
         if (s_cy < s_line_count - 1) {
             s_cy++;
-            if (s_cx > (int)s_lines[s_cy].len)
-                s_cx = (int)s_lines[s_cy].len;
+            if (s_cx > (int)doc_at(s_cy)->len)
+                s_cx = (int)doc_at(s_cy)->len;
         }
         break;
     case KEY_LEFT:
@@ -910,11 +1794,11 @@ static void handle_move(UINT16 key) {
             s_cx--;
         } else if (s_cy > 0) {
             s_cy--;
-            s_cx = (int)s_lines[s_cy].len;
+            s_cx = (int)doc_at(s_cy)->len;
         }
         break;
     case KEY_RIGHT:
-        if (s_cx < (int)s_lines[s_cy].len) {
+        if (s_cx < (int)doc_at(s_cy)->len) {
             s_cx++;
         } else if (s_cy < s_line_count - 1) {
             s_cy++;
@@ -925,28 +1809,51 @@ static void handle_move(UINT16 key) {
         s_cx = 0;
         break;
     case KEY_END:
-        s_cx = (int)s_lines[s_cy].len;
+        s_cx = (int)doc_at(s_cy)->len;
         break;
     case KEY_PGUP:
         s_cy -= s_text_rows;
         if (s_cy < 0) s_cy = 0;
-        if (s_cx > (int)s_lines[s_cy].len)
-            s_cx = (int)s_lines[s_cy].len;
+        if (s_cx > (int)doc_at(s_cy)->len)
+            s_cx = (int)doc_at(s_cy)->len;
         break;
     case KEY_PGDN:
         s_cy += s_text_rows;
         if (s_cy >= s_line_count) s_cy = s_line_count - 1;
-        if (s_cx > (int)s_lines[s_cy].len)
-            s_cx = (int)s_lines[s_cy].len;
+        if (s_cx > (int)doc_at(s_cy)->len)
+            s_cx = (int)doc_at(s_cy)->len;
         break;
     }
 }
 
+static int path_eq(const CHAR16 *a, const CHAR16 *b) {
+    for (;; a++, b++) {
+        CHAR16 x = (*a >= 'A' && *a <= 'Z') ? *a + 32 : *a;
+        CHAR16 y = (*b >= 'A' && *b <= 'Z') ? *b + 32 : *b;
+        if (x != y) return 0;
+        if (!x) return 1;
+    }
+}
+
+/* The current file's path as the index has it ("/src/edit.c") */
+static void sym_cur_path(char *out, int max) {
+    int i = 0;
+    for (; s_filepath[i] && i < max - 1; i++)
+        out[i] = s_filepath[i] == L'\\' ? '/' : (char)(s_filepath[i] & 0x7F);
+    out[i] = '\0';
+}
+
 static int handle_save(void) {
     int ret = doc_save();
     if (ret == 0) {
         draw_header();
         draw_info("Saved.");
+        /* The symbol index takes it now, not at the next walk */
+        if (s_highlight_mode) {
+            char apath[EDIT_MAX_PATH];
+            sym_cur_path(apath, EDIT_MAX_PATH);
+            symidx_update(apath);
+        }
         return 0;
     } else if (ret == -2) {
         draw_info("Error: not enough disk space!");
@@ -987,6 +1894,158 @@ static int handle_exit(void) {
     }
 }
 
+/* ---- Find and replace ---- */
+
+/* Show label, text and a cursor on the info line */
+static void draw_prompt(const char *label, const char *text, const char *note) {
+    char line[256];
+    int i = 0;
+    const char *parts[4] = { label, text, "_", note };
+    for (int k = 0; k < 4; k++) {
+        for (const char *c = parts[k]; c && *c && i < (int)g_boot.cols && i < 255; c++)
+            line[i++] = *c;
+    }
+    line[i] = '\0';
+    pad_line(line, (int)g_boot.cols);
+    fb_string(0, g_boot.rows - 2, line, COLOR_YELLOW, COLOR_BLACK);
+}
+
+/* Read a line of text into buf (holding *len bytes already).
+   Returns 1 on Enter, 0 on ESC. */
+static int edit_prompt(const char *label, char *buf, int cap, int *len) {
+    for (;;) {
+        buf[*len] = '\0';
+        draw_prompt(label, buf, NULL);
+        struct key_event ev;
+        kbd_wait(&ev);
+        if (ev.code == KEY_ESC)
+            return 0;
+        if (ev.code == KEY_ENTER)
+            return 1;
+        if (ev.code == KEY_BS && *len > 0)
+            (*len)--;
+        else if (ev.code >= 0x20 && ev.code <= 0x7E && *len < cap - 1)
+            buf[(*len)++] = (char)ev.code;
+    }
+}
+
+/* Ctrl+F: search as you type. Enter, Down or Ctrl+F go to the next
+   match, Up to the previous one; ESC leaves the match selected. */
+static void handle_find(void) {
+    int oy = s_cy, ox = s_cx;
+    if (s_sel_active) {
+        int ey, ex;
+        sel_get_range(&oy, &ox, &ey, &ex);
+    }
+
+    s_find_show = 1;
+    find_prepare();
+    int found = find_from(oy, ox, 1);
+    for (;;) {
+        scroll_to_cursor();
+        draw_text();
+        s_find[s_find_len] = '\0';
+        draw_prompt(" Find: ", s_find,
+                    (s_find_len && !found) ? "   (not found)"
+                                           : "   Enter/Up/Down: next/prev  ESC: done");
+
+        struct key_event ev;
+        kbd_wait(&ev);
+        UINT16 code = ev.code;
+        if (code == KEY_ESC || code == KEY_F10)
+            break;
+        if (code == KEY_ENTER || code == KEY_DOWN || code == 0x06) {
+            found = find_from(s_cy, s_cx, 1);
+            continue;
+        }
+        if (code == KEY_UP) {
+            int sy = s_cy, sx = s_cx, ey, ex;
+            if (s_sel_active)
+                sel_get_range(&sy, &sx, &ey, &ex);
+            found = find_from(sy, sx, -1);
+            continue;
+        }
+
+        if (code == KEY_BS && s_find_len > 0)
+            s_find_len--;
+        else if (code >= 0x20 && code <= 0x7E && s_find_len < FIND_MAX - 1)
+            s_find[s_find_len++] = (char)code;
+        else
+            continue;
+
+        /* The text changed: search again from where we started */
+        find_prepare();
+        found = find_from(oy, ox, 1);
+        if (!found) {
+            s_sel_active = 0;
+            s_cy = oy;
+            s_cx = ox;
+        }
+    }
+    s_find_show = 0;
+}
+
+/* Replace every match with rep, rebuilding each changed line once.
+   Returns the number of replacements. */
+static int replace_all(const char *rep, int rlen) {
+    int total = 0;
+    int m = s_find_len;
+    for (int y = 0; y < s_line_count; y++) {
+        struct edit_line *ln = doc_at(y);
+        int count = 0;
+        for (int p = find_in(ln, 0); p >= 0; p = find_in(ln, p + m))
+            count++;
+        if (count == 0)
+            continue;
+
+        UINTN len = ln->len + (UINTN)count * (UINTN)rlen - (UINTN)count * (UINTN)m;
+        UINTN cap = len + 1 < EDIT_INIT_CAP ? EDIT_INIT_CAP : len + 1;
+        char *d = (char *)mem_alloc(cap);
+        if (!d)
+            break;
+        UINTN o = 0;
+        int from = 0;
+        for (int p = find_in(ln, 0); p >= 0; p = find_in(ln, p + m)) {
+            mem_copy(&d[o], &ln->data[from], (UINTN)(p - from));
+            o += (UINTN)(p - from);
+            mem_copy(&d[o], rep, (UINTN)rlen);
+            o += (UINTN)rlen;
+            from = p + m;
+        }
+        mem_copy(&d[o], &ln->data[from], ln->len - (UINTN)from);
+        line_adopt(doc_edit(y), d, len, cap);
+        total += count;
+    }
+
+    if (total) {
+        s_sel_active = 0;
+        if (s_cx > (int)doc_at(s_cy)->len)
+            s_cx = (int)doc_at(s_cy)->len;
+        s_modified = 1;
+    }
+    return total;
+}
+
+/* Ctrl+R: replace all */
+static void handle_replace(void) {
+    int flen = s_find_len;
+    if (!edit_prompt(" Replace: ", s_find, FIND_MAX, &flen) || flen == 0)
+        return;
+    s_find_len = flen;
+    find_prepare();
+
+    char rep[FIND_MAX];
+    int rlen = 0;
+    if (!edit_prompt(" With: ", rep, FIND_MAX, &rlen))
+        return;
+
+    char num[16];
+    int_to_str(replace_all(rep, rlen), num);
+    s_info_note[0] = '\0';
+    note_append("Replaced ");
+    note_append(num);
+}
+
 /* ---- Compile and Run (F5) ---- */
 
 static int is_c_file(void) {
@@ -994,7 +2053,150 @@ static int is_c_file(void) {
     return len >= 2 && s_filename[len - 2] == '.' && s_filename[len - 1] == 'c';
 }
 
-static void handle_compile_run(void) {
+/* After a profiled run: the functions with the most self time on
+   screen, and all of them in <file>.prof next to the source */
+#define PROF_SHOW 15
+
+static void show_profile(void) {
+    const struct prof_func *const *fs;
+    UINT64 run;
+    int n = prof_result(&fs, &run);
+    if (n == 0) {
+        fb_print("  No functions were profiled\n", COLOR_YELLOW);
+        return;
+    }
+
+    UINTN cap = (UINTN)n * 96 + 256, len = 0, shown = 0;
+    char *text = (char *)mem_alloc(cap);
+    if (!text) {
+        fb_print("  Out of memory for the profile\n", COLOR_RED);
+        return;
+    }
+    char ms[16];
+    ticks_to_ms(run, ms, sizeof(ms));
+    len += snprintf(text + len, cap - len,
+                    "Profile of %s: %s ms, %d functions\n\n"
+                    "       calls     self ms  self %%    total ms  function\n",
+                    s_filename, ms, n);
+    for (int i = 0; i < n; i++) {
+        const struct prof_func *f = fs[i];
+        char self[16], total[16], name[PROF_NAME + 4];
+        ticks_to_ms(f->self, self, sizeof(self));
+        ticks_to_ms(f->total, total, sizeof(total));
+        UINT64 pm = run ? f->self * 1000 / run : 0;
+        if (f->name[0])
+            snprintf(name, sizeof(name), "%s", f->name);
+        else
+            snprintf(name, sizeof(name), "0x%llx",
+                     (unsigned long long)(UINTN)f->fn);
+        len += snprintf(text + len, cap - len,
+                        "%12llu %11s %4llu.%llu %11s  %s\n",
+                        (unsigned long long)f->calls, self, pm / 10, pm % 10,
+                        total, name);
+        if (i < PROF_SHOW)
+            shown = len;
+    }
+
+    /* The screen gets the header and the top rows */
+    char c = text[shown];
+    text[shown] = '\0';
+    fb_print("\n", COLOR_WHITE);
+    fb_print(text, COLOR_WHITE);
+    text[shown] = c;
+    if (n > PROF_SHOW) {
+        char more[48];
+        snprintf(more, sizeof(more), "  ... %d more\n", n - PROF_SHOW);
+        fb_print(more, COLOR_DGRAY);
+    }
+
+    CHAR16 path[EDIT_MAX_PATH + 8];
+    int i = 0;
+    for (; s_filepath[i] && i < EDIT_MAX_PATH; i++)
+        path[i] = s_filepath[i];
+    const CHAR16 *ext = L".prof";
+    for (int j = 0; ext[j]; j++)
+        path[i++] = ext[j];
+    path[i] = 0;
+    if (!fs_is_read_only() && !EFI_ERROR(fs_writefile(path, text, len))) {
+        fb_print("  Saved to ", COLOR_DGRAY);
+        fb_print(s_filename, COLOR_DGRAY);
+        fb_print(".prof\n", COLOR_DGRAY);
+    } else {
+        fb_print("  Profile not saved: volume is read-only or full\n",
+                 COLOR_YELLOW);
+    }
+    mem_free(text);
+}
+
+/* How a run on an AP ended, when the program did not */
+static void show_ap_stop(const struct tcc_result *r) {
+    if (r->aprun == APRUN_ABORTED) {
+        fb_print("  --- Program stopped (ESC) ---\n", COLOR_YELLOW);
+    } else if (r->aprun == APRUN_TIMEDOUT) {
+        char num[16];
+        fb_print("  --- Program stopped after ", COLOR_YELLOW);
+        int_to_str(APRUN_TIMEOUT_S, num);
+        fb_print(num, COLOR_YELLOW);
+        fb_print(" s: its core was reset ---\n", COLOR_YELLOW);
+    } else {
+        fb_print("  --- Program not responding: left running on its core"
+                 " ---\n", COLOR_RED);
+        fb_print("  It stops at its next API call or when the timeout resets"
+                 " the core;\n  the memory it was given stays allocated\n",
+                 COLOR_DGRAY);
+    }
+}
+
+/* The end of a run: exit code or errors, then back to the editor at
+   a key */
+static void show_run_result(const struct tcc_result *r, int flags) {
+    int profile = (flags & TCC_RUN_PROFILE) != 0;
+    fb_print("\n", COLOR_WHITE);
+    if (r->success && r->aprun > APRUN_RETURNED) {
+        show_ap_stop(r);
+    } else if (r->success) {
+        fb_print("  --- Program exited with code ", COLOR_GRAY);
+        char num[16];
+        int_to_str(r->exit_code, num);
+        fb_print(num, r->exit_code == 0 ? COLOR_GREEN : COLOR_YELLOW);
+        fb_print(r->cached ? " (cached, not recompiled) ---\n" : " ---\n",
+                 COLOR_GRAY);
+        if ((flags & TCC_RUN_AP) && !r->aprun)
+            fb_print("  No AP was free: it ran on the boot processor\n",
+                     COLOR_DGRAY);
+        if (!r->cached && r->stats.lines) {
+            const struct tcc_phase_stats *st = &r->stats;
+            char pp[16], cc[16], rel[16], line[160];
+            ticks_to_ms(st->preprocess, pp, sizeof(pp));
+            ticks_to_ms(st->compile, cc, sizeof(cc));
+            ticks_to_ms(st->relocate, rel, sizeof(rel));
+            snprintf(line, sizeof(line),
+                     "  %u lines, %u tokens, %u bytes of code: preprocess %s ms,"
+                     " compile %s ms, relocate %s ms (%llu lines/s)\n",
+                     st->lines, st->tokens, st->code_bytes, pp, cc, rel,
+                     lines_per_sec(st->lines, st->preprocess + st->compile));
+            fb_print(line, COLOR_DGRAY);
+        }
+        if (profile)
+            show_profile();
+    } else {
+        fb_print("  --- Compile Error ---\n", COLOR_RED);
+        if (r->error_msg[0])
+            fb_print(r->error_msg, COLOR_RED);
+    }
+
+    fb_print("\n  Press any key to return to editor (PgUp/PgDn: scroll)...\n",
+             COLOR_DGRAY);
+
+    /* Wait for keypress */
+    struct key_event ev;
+    kbd_wait_scrollback(&ev);
+
+    /* Redraw editor */
+    draw_all();
+}
+
+static void handle_compile_run(int flags) {
     if (!is_c_file()) {
         draw_info("Not a .c file");
         return;
@@ -1021,33 +2223,41 @@ static void handle_compile_run(void) {
     fb_print("  Compiling ", COLOR_CYAN);
     fb_print(s_filename, COLOR_CYAN);
     fb_print("...\n\n", COLOR_CYAN);
+    if (flags & TCC_RUN_AP)
+        fb_print("  On an AP of its own: ESC stops it\n\n", COLOR_DGRAY);
 
     /* Compile and run */
-    struct tcc_result r = tcc_run_source(source, s_filename);
+    UINT64 t0 = bench_start();
+    struct tcc_result r = tcc_run_source(source, s_filename, flags);
+    UINT64 run_us = bench_stop(t0) / 1000;
     mem_free(source);
+    trace_mark(r.success ? "run" : "run-failed", run_us,
+               (UINT64)(INT64)r.exit_code, r.cached ? "cached" : NULL);
 
-    /* Display result */
-    fb_print("\n", COLOR_WHITE);
-    if (r.success) {
-        fb_print("  --- Program exited with code ", COLOR_GRAY);
-        char num[16];
-        int_to_str(r.exit_code, num);
-        fb_print(num, r.exit_code == 0 ? COLOR_GREEN : COLOR_YELLOW);
-        fb_print(" ---\n", COLOR_GRAY);
-    } else {
-        fb_print("  --- Compile Error ---\n", COLOR_RED);
-        if (r.error_msg[0])
-            fb_print(r.error_msg, COLOR_RED);
-    }
-
-    fb_print("\n  Press any key to return to editor...\n", COLOR_DGRAY);
-
-    /* Wait for keypress */
-    struct key_event ev;
-    kbd_wait(&ev);
+    show_run_result(&r, flags);
+}
 
-    /* Redraw editor */
-    draw_all();
+/* Shift+F5: report and empty the compiled program cache */
+static void handle_run_cache(void) {
+    struct tcc_cache_stats st;
+    tcc_cache_stats(&st);
+    tcc_cache_purge();
+
+    char num[16];
+    s_info_note[0] = '\0';
+    note_append("Run cache purged: ");
+    int_to_str(st.programs, num);
+    note_append(num);
+    note_append(st.programs == 1 ? " program, " : " programs, ");
+    int_to_str((int)((st.bytes + 1023) >> 10), num);
+    note_append(num);
+    note_append(" KB (");
+    int_to_str((int)st.hits, num);
+    note_append(num);
+    note_append(" reruns, ");
+    int_to_str((int)st.misses, num);
+    note_append(num);
+    note_append(" compiles)");
 }
 
 /* ---- Rebuild Workstation (F6) ---- */
@@ -1069,146 +2279,2682 @@ static void rebuild_error_handler(void *opaque, const char *msg) {
     fb_print("\n", COLOR_RED);
 }
 
-static void handle_rebuild(void) {
-    /* Auto-save if modified */
-    if (s_modified) {
-        if (doc_save() != 0) {
-            draw_info("Save failed - cannot rebuild");
-            return;
-        }
-    }
-
-    fb_clear(COLOR_BLACK);
-    g_boot.cursor_x = 0;
-    g_boot.cursor_y = 0;
-
-    fb_print("\n", COLOR_CYAN);
-    fb_print("  ========================================\n", COLOR_CYAN);
-    fb_print("       REBUILD WORKSTATION\n", COLOR_CYAN);
-    fb_print("  ========================================\n\n", COLOR_CYAN);
-
-    s_rebuild_err_pos = 0;
-    s_rebuild_err[0] = '\0';
-
-    /* Source files to compile */
-    static const char *sources[] = {
-        "/src/main.c", "/src/fb.c", "/src/kbd.c", "/src/mem.c",
-        "/src/font.c", "/src/fs.c", "/src/browse.c", "/src/edit.c",
-        "/src/shim.c", "/src/tcc.c",
-        "/src/disk.c", "/src/fat32.c", "/src/iso.c",
-        "/src/exfat.c", "/src/ntfs.c",
-        NULL
-    };
+/*
+ * Each translation unit is compiled to its own object under
+ * REBUILD_DIR and the objects are linked at the end.  An object is
+ * reused when its key matches the manifest: a hash of the compile
+ * flags, the source and every file reachable through #include (found
+ * the way the compiler looks for them; conditional includes are
+ * followed too, which can only cause extra rebuilds).  Delete
+ * REBUILD_DIR to force a full build.
+ *
+ * The build ships libtcc.o prebuilt in REBUILD_DIR with its key already
+ * in the manifest (tools/objkey.py computes it the same way), so the
+ * TinyCC unity build is only recompiled once its sources change.
+ *
+ * The units that need compiling go to the application processors
+ * first (tccpool.h), each worker with its own copy of the compiler
+ * loaded from libtcc.o, while the boot processor serves their file
+ * access.  That needs a current libtcc.o: when the TinyCC sources have
+ * changed, or there are no MP services, or a worker gives a unit back,
+ * the units are compiled here one after another as before.  The link
+ * always runs here.
+ *
+ * Every compile and the link are timed by phase with the cycle
+ * counter; the report is shown when the build completes and kept in
+ * REBUILD_STATS to compare versions.
+ *
+ * Units are compiled with a section per function and variable, and the
+ * link drops the sections nothing refers to.  What each object brought
+ * and what was kept of it is written to REBUILD_SIZES, the totals end
+ * the report.
+ */
+#ifdef __aarch64__
+#define REBUILD_DIR      "/build/aarch64"
+#else
+#define REBUILD_DIR      "/build/x86_64"
+#endif
+#define REBUILD_MANIFEST REBUILD_DIR "/objects.lst"
+#define REBUILD_PATH     128
+#define REBUILD_DEPS     256    /* distinct files per rebuild */
+#define REBUILD_EDGES    2048   /* include references per rebuild */
+#define REBUILD_OBJS     96
+#define REBUILD_STATS    "/build/rebuild-stats.txt"
+#define REBUILD_SIZES    REBUILD_DIR "/survival.map"
+#define REBUILD_PACK     REBUILD_DIR "/compress"     /* present: boot packed */
+#define REBUILD_IMAGE    REBUILD_DIR "/survival.efi" /* what the stub unpacks */
+
+/* Workstation sources are built with -Werror; the TCC library and the
+   assembly helpers with -w and __UEFI__, as one unity build */
+#define UNIT_WS  0
+#define UNIT_LIB 1
+
+struct rebuild_unit {
+    const char *src;
+    const char *obj;            /* object name under REBUILD_DIR */
+    int         kind;
+};
 
-    /* Output path */
+static const struct rebuild_unit s_units[] = {
+    { "/src/main.c",    "main.o",    UNIT_WS },
+    { "/src/fb.c",      "fb.o",      UNIT_WS },
+    { "/src/kbd.c",     "kbd.o",     UNIT_WS },
+    { "/src/serial.c",  "serial.o",  UNIT_WS },
+    { "/src/mem.c",     "mem.o",     UNIT_WS },
+    { "/src/font.c",    "font.o",    UNIT_WS },
+    { "/src/fs.c",      "fs.o",      UNIT_WS },
+    { "/src/browse.c",  "browse.o",  UNIT_WS },
+    { "/src/edit.c",    "edit.o",    UNIT_WS },
+    { "/src/shim.c",    "shim.o",    UNIT_WS },
+    { "/src/tcc.c",     "tcc.o",     UNIT_WS },
+    { "/src/disk.c",    "disk.o",    UNIT_WS },
+    { "/src/fat32.c",   "fat32.o",   UNIT_WS },
+    { "/src/iso.c",     "iso.o",     UNIT_WS },
+    { "/src/exfat.c",   "exfat.o",   UNIT_WS },
+    { "/src/ntfs.c",    "ntfs.o",    UNIT_WS },
+    { "/src/bcache.c",  "bcache.o",  UNIT_WS },
+    { "/src/runmap.c",  "runmap.o",  UNIT_WS },
+    { "/src/dirsort.c", "dirsort.o", UNIT_WS },
+    { "/src/timer.c",   "timer.o",   UNIT_WS },
+    { "/src/fpconv.c",  "fpconv.o",  UNIT_WS },
+    { "/src/copy.c",    "copy.o",    UNIT_WS },
+    { "/src/hash.c",    "hash.o",    UNIT_WS },
+    { "/src/cpu.c",     "cpu.o",     UNIT_WS },
+    { "/src/progress.c", "progress.o", UNIT_WS },
+    { "/src/diskbench.c", "diskbench.o", UNIT_WS },
+    { "/src/memtest.c", "memtest.o", UNIT_WS },
+    { "/src/hexview.c", "hexview.o", UNIT_WS },
+    { "/src/preview.c", "preview.o", UNIT_WS },
+    { "/src/defrag.c",  "defrag.o",  UNIT_WS },
+    { "/src/ramdisk.c", "ramdisk.o", UNIT_WS },
+    { "/src/lz4.c",     "lz4.o",     UNIT_WS },
+    { "/src/image.c",   "image.o",   UNIT_WS },
+    { "/src/mp.c",      "mp.o",      UNIT_WS },
+    { "/src/event.c",   "event.o",   UNIT_WS },
+    { "/src/trace.c",   "trace.o",   UNIT_WS },
+    { "/src/blkapi.c",  "blkapi.o",  UNIT_WS },
+    { "/src/profile.c", "profile.o", UNIT_WS },
+    { "/src/aprun.c", "aprun.o", UNIT_WS },
+    { "/src/net.c",     "net.o",     UNIT_WS },
+    { "/src/fetch.c",   "fetch.o",   UNIT_WS },
+    { "/src/nbd.c",     "nbd.o",     UNIT_WS },
+    { "/src/search.c",  "search.o",  UNIT_WS },
+    { "/src/grep.c",    "grep.o",    UNIT_WS },
+    { "/src/du.c",      "du.o",      UNIT_WS },
+    { "/src/inflate.c", "inflate.o", UNIT_WS },
+    { "/src/archive.c", "archive.o", UNIT_WS },
+    { "/src/deflate.c", "deflate.o", UNIT_WS },
+    { "/src/undelete.c", "undelete.o", UNIT_WS },
+    { "/src/iso9660.c", "iso9660.o", UNIT_WS },
+    { "/src/part.c", "part.o", UNIT_WS },
+    { "/src/symidx.c", "symidx.o", UNIT_WS },
+    { "/src/parapi.c",  "parapi.o",  UNIT_WS },
+    { "/src/vec.c",     "vec.o",     UNIT_WS },
+    { "/src/libm.c",    "libm.o",    UNIT_WS },
+    { "/src/usbms.c",   "usbms.o",   UNIT_WS },
+    { "/src/sdmmc.c",   "sdmmc.o",   UNIT_WS },
+    { "/src/nvme.c",    "nvme.o",    UNIT_WS },
+    { "/src/diskclone.c", "diskclone.o", UNIT_WS },
+    { "/src/fsck.c",    "fsck.o",    UNIT_WS },
+    { "/src/fsckview.c", "fsckview.o", UNIT_WS },
+    { "/src/efiapp.c",  "efiapp.o",  UNIT_WS },
+    { "/src/tccpool.c", "tccpool.o", UNIT_WS },
+    { "/tools/tinycc/libtcc.c", "libtcc.o", UNIT_LIB },
 #ifdef __aarch64__
-    const char *out_path = "/EFI/BOOT/BOOTAA64.EFI";
+    { "/src/setjmp_aarch64.c", "setjmp.o", UNIT_LIB },
+    { "/src/memops_aarch64.c", "memops.o", UNIT_LIB },
 #else
-    const char *out_path = "/EFI/BOOT/BOOTX64.EFI";
+    { "/src/setjmp_x86_64.S",  "setjmp.o", UNIT_LIB },
+    { "/src/memops_x86_64.S",  "memops.o", UNIT_LIB },
 #endif
+    { NULL, NULL, 0 }
+};
 
-    /* Create TCC state for PE/COFF output */
-    TCCState *tcc = tcc_new();
-    if (!tcc) {
+/* Every unit has a manifest entry and a stats slot */
+typedef char rebuild_objs_enough[REBUILD_OBJS >= sizeof(s_units) / sizeof(s_units[0]) ? 1 : -1];
+
+/* The Makefile keys the prebuilt libtcc.o with the UNIT_LIB string */
+static const char *s_unit_flags[] = {
+    "-nostdlib -nostdinc -Werror -ffunction-sections -fdata-sections",
+    "-nostdlib -nostdinc -w -D__UEFI__=1 -ffunction-sections -fdata-sections",
+};
+
+static const char *s_include_paths[] = {
+    "/src/tcc-headers", "/src", "/tools/tinycc", NULL
+};
+
+/* Where dep_resolve() and rebuild_compile() look: s_include_paths, or
+   a project's */
+static const char *const *s_dep_includes = s_include_paths;
+
+/* One file seen while hashing; children index s_dep_edges */
+struct rebuild_dep {
+    char   path[REBUILD_PATH];
+    UINT64 hash;
+    int    child0, nchild;
+    int    loaded;
+};
+
+static struct rebuild_dep s_deps[REBUILD_DEPS];
+static int   s_dep_count;
+static int   s_dep_edges[REBUILD_EDGES];
+static int   s_dep_edge_count;
+static UINT8 s_dep_seen[REBUILD_DEPS];
+
+struct rebuild_entry {
+    char   obj[24];
+    UINT64 key;
+};
+
+static struct rebuild_entry s_manifest[REBUILD_OBJS];
+static int s_manifest_count;
+
+static void rebuild_wpath(const char *path, CHAR16 *out) {
+    int i = 0;
+    for (; path[i] && i < REBUILD_PATH - 1; i++)
+        out[i] = (path[i] == '/') ? L'\\' : (CHAR16)path[i];
+    out[i] = 0;
+}
+
+static void rebuild_obj_path(const struct rebuild_unit *u, char *out) {
+    str_copy(out, REBUILD_DIR "/", REBUILD_PATH);
+    int n = (int)str_len((CHAR8 *)out);
+    str_copy(out + n, u->obj, (UINTN)(REBUILD_PATH - n));
+}
+
+static int rebuild_exists(const char *path) {
+    CHAR16 w[REBUILD_PATH];
+    rebuild_wpath(path, w);
+    return fs_exists(w);
+}
+
+/* Index of path in the table, added unloaded if new; -1 when full */
+static int dep_add(const char *path) {
+    for (int i = 0; i < s_dep_count; i++) {
+        if (str_cmp((CHAR8 *)s_deps[i].path, (CHAR8 *)path) == 0)
+            return i;
+    }
+    if (s_dep_count >= REBUILD_DEPS)
+        return -1;
+    struct rebuild_dep *d = &s_deps[s_dep_count];
+    str_copy(d->path, path, REBUILD_PATH);
+    d->loaded = 0;
+    return s_dep_count++;
+}
+
+/* Find an included file: next to the includer for "name", then on the
+   include paths. Returns 0 with out set, or -1. */
+static int dep_resolve(const char *from, const char *name, int quoted, char *out) {
+    if (quoted) {
+        int dir = 0;
+        for (int i = 0; from[i]; i++)
+            if (from[i] == '/') dir = i;
+        if (dir + 1 + (int)str_len((CHAR8 *)name) < REBUILD_PATH) {
+            mem_copy(out, from, (UINTN)dir + 1);
+            str_copy(out + dir + 1, name, (UINTN)(REBUILD_PATH - dir - 1));
+            if (rebuild_exists(out))
+                return 0;
+        }
+    }
+    for (int k = 0; s_dep_includes[k]; k++) {
+        int n = (int)str_len((CHAR8 *)s_dep_includes[k]);
+        if (n + 1 + (int)str_len((CHAR8 *)name) >= REBUILD_PATH)
+            continue;
+        str_copy(out, s_dep_includes[k], REBUILD_PATH);
+        out[n] = '/';
+        str_copy(out + n + 1, name, (UINTN)(REBUILD_PATH - n - 1));
+        if (rebuild_exists(out))
+            return 0;
+    }
+    return -1;
+}
+
+/* Hash a file's contents and record the files it includes */
+static void dep_load(int idx) {
+    struct rebuild_dep *d = &s_deps[idx];
+    d->loaded = 1;
+    d->hash = 0;
+    d->child0 = s_dep_edge_count;
+    d->nchild = 0;
+
+    CHAR16 w[REBUILD_PATH];
+    rebuild_wpath(d->path, w);
+    UINTN size = 0;
+    char *data = (char *)fs_readfile(w, &size);
+    if (!data)
+        return;
+    d->hash = fnv1a64(FNV1A64_INIT, data, size);
+
+    UINTN i = 0;
+    while (i < size) {
+        /* #include at the start of a line, spaces allowed */
+        UINTN p = i;
+        while (p < size && (data[p] == ' ' || data[p] == '\t')) p++;
+        if (p + 8 < size && data[p] == '#') {
+            p++;
+            while (p < size && (data[p] == ' ' || data[p] == '\t')) p++;
+            if (p + 7 < size && mem_cmp(&data[p], "include", 7) == 0) {
+                p += 7;
+                while (p < size && (data[p] == ' ' || data[p] == '\t')) p++;
+                char open = p < size ? data[p] : 0;
+                if (open == '"' || open == '<') {
+                    char close = open == '"' ? '"' : '>';
+                    char name[REBUILD_PATH], path[REBUILD_PATH];
+                    int n = 0;
+                    p++;
+                    while (p < size && data[p] != close && data[p] != '\n' &&
+                           n < REBUILD_PATH - 1)
+                        name[n++] = data[p++];
+                    name[n] = '\0';
+                    if (n > 0 && dep_resolve(s_deps[idx].path, name,
+                                             open == '"', path) == 0) {
+                        int c = dep_add(path);
+                        if (c >= 0 && s_dep_edge_count < REBUILD_EDGES) {
+                            s_dep_edges[s_dep_edge_count++] = c;
+                            d->nchild++;
+                        }
+                    }
+                }
+            }
+        }
+        while (i < size && data[i] != '\n') i++;
+        i++;
+    }
+    mem_free(data);
+}
+
+static UINT64 dep_visit(int idx, UINT64 h) {
+    if (s_dep_seen[idx])
+        return h;
+    s_dep_seen[idx] = 1;
+    if (!s_deps[idx].loaded)
+        dep_load(idx);
+    struct rebuild_dep *d = &s_deps[idx];
+    h = fnv1a64(h, d->path, str_len((CHAR8 *)d->path));
+    h = fnv1a64(h, &d->hash, sizeof(d->hash));
+    for (int k = 0; k < d->nchild; k++)
+        h = dep_visit(s_dep_edges[d->child0 + k], h);
+    return h;
+}
+
+/* Cache key: flags, then every file the source depends on */
+static UINT64 rebuild_key(const char *flags, const char *src) {
+    UINT64 h = fnv1a64(FNV1A64_INIT, flags, str_len((CHAR8 *)flags));
+    int root = dep_add(src);
+    if (root < 0)
+        return 0;
+    mem_set(s_dep_seen, 0, sizeof(s_dep_seen));
+    h = dep_visit(root, h);
+    return h ? h : 1;  /* 0 marks a missing key */
+}
+
+static struct rebuild_entry *rebuild_manifest_find(const char *obj) {
+    for (int i = 0; i < s_manifest_count; i++) {
+        if (str_cmp((CHAR8 *)s_manifest[i].obj, (CHAR8 *)obj) == 0)
+            return &s_manifest[i];
+    }
+    return NULL;
+}
+
+static struct rebuild_entry *rebuild_manifest_set(const char *obj) {
+    struct rebuild_entry *e = rebuild_manifest_find(obj);
+    if (e || s_manifest_count >= REBUILD_OBJS)
+        return e;
+    e = &s_manifest[s_manifest_count++];
+    str_copy(e->obj, obj, sizeof(e->obj));
+    return e;
+}
+
+/* Manifest lines: "<object> <16 hex digits>" */
+static void rebuild_manifest_load(const char *path) {
+    s_manifest_count = 0;
+    CHAR16 w[REBUILD_PATH];
+    rebuild_wpath(path, w);
+    UINTN size = 0;
+    char *data = (char *)fs_readfile(w, &size);
+    if (!data)
+        return;
+    UINTN i = 0;
+    while (i < size && s_manifest_count < REBUILD_OBJS) {
+        char name[24];
+        int n = 0;
+        while (i < size && data[i] != ' ' && data[i] != '\n' && n < 23)
+            name[n++] = data[i++];
+        name[n] = '\0';
+        UINT64 key = 0;
+        if (i < size && data[i] == ' ') {
+            i++;
+            for (; i < size && data[i] != '\n'; i++) {
+                char c = data[i];
+                int v = (c >= '0' && c <= '9') ? c - '0' :
+                        (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+                if (v < 0) { key = 0; break; }
+                key = (key << 4) | (UINT64)v;
+            }
+        }
+        while (i < size && data[i] != '\n') i++;
+        i++;
+        if (n > 0 && key) {
+            struct rebuild_entry *e = rebuild_manifest_set(name);
+            if (e) e->key = key;
+        }
+    }
+    mem_free(data);
+}
+
+static void rebuild_manifest_save(const char *path) {
+    char buf[REBUILD_OBJS * 42];
+    UINTN pos = 0;
+    for (int i = 0; i < s_manifest_count; i++) {
+        struct rebuild_entry *e = &s_manifest[i];
+        if (!e->key)
+            continue;
+        for (int k = 0; e->obj[k]; k++)
+            buf[pos++] = e->obj[k];
+        buf[pos++] = ' ';
+        for (int k = 15; k >= 0; k--)
+            buf[pos++] = "0123456789abcdef"[(e->key >> (k * 4)) & 15];
+        buf[pos++] = '\n';
+    }
+    CHAR16 w[REBUILD_PATH];
+    rebuild_wpath(path, w);
+    fs_writefile(w, buf, pos);
+}
+
+/* Phase times of the last rebuild; a unit whose object was reused has
+   no lines.  For the link, compile is the time to load the objects. */
+static struct tcc_phase_stats s_unit_stats[REBUILD_OBJS];
+static struct tcc_phase_stats s_link_stats;
+/* Bytes the objects brought to the image and kept, by TCC_OBJ_ kind */
+static UINT32 s_link_size[3], s_link_kept[3];
+
+/* Write the phase report for the units and the link into buf, which
+   total_ticks (the whole rebuild) closes. Returns its length. */
+static int rebuild_stats_format(char *buf, int size, UINT64 total_ticks) {
+    char pp[16], cc[16], out[16], rel[16];
+    UINT32 lines = 0, tokens = 0, code = 0;
+    UINT64 busy = 0;
+    int pos = snprintf(buf, size,
+        "  Rebuild phase times (ms), %s, counter %llu kHz\n"
+        "  %-24s %9s %9s %9s %7s %7s %8s %9s\n",
+        REBUILD_DIR + 7 /* past "/build/" */, timer_hz() / 1000,
+        "unit", "preproc", "compile", "output",
+        "lines", "tokens", "code", "lines/s");
+    for (int i = 0; s_units[i].src && pos < size; i++) {
+        const struct tcc_phase_stats *st = &s_unit_stats[i];
+        if (!st->lines) {
+            pos += snprintf(buf + pos, size - pos, "  %-24s %9s\n",
+                            s_units[i].src, "reused");
+            continue;
+        }
+        UINT64 t = st->preprocess + st->compile + st->output;
+        ticks_to_ms(st->preprocess, pp, sizeof(pp));
+        ticks_to_ms(st->compile, cc, sizeof(cc));
+        ticks_to_ms(st->output, out, sizeof(out));
+        pos += snprintf(buf + pos, size - pos,
+                        "  %-24s %9s %9s %9s %7u %7u %8u %9llu\n",
+                        s_units[i].src, pp, cc, out, st->lines, st->tokens,
+                        st->code_bytes, lines_per_sec(st->lines, t));
+        lines += st->lines;
+        tokens += st->tokens;
+        code += st->code_bytes;
+        busy += t;
+    }
+    if (pos < size) {
+        ticks_to_ms(busy, cc, sizeof(cc));
+        pos += snprintf(buf + pos, size - pos,
+                        "  %-24s %9s %9s %9s %7u %7u %8u %9llu\n",
+                        "all compiled", "", cc, "", lines, tokens, code,
+                        lines_per_sec(lines, busy));
+    }
+    if (pos < size) {
+        ticks_to_ms(s_link_stats.compile, cc, sizeof(cc));
+        ticks_to_ms(s_link_stats.relocate, rel, sizeof(rel));
+        ticks_to_ms(s_link_stats.output, out, sizeof(out));
+        ticks_to_ms(total_ticks, pp, sizeof(pp));
+        pos += snprintf(buf + pos, size - pos,
+                        "  link: load %s, relocate %s, PE output %s; "
+                        "rebuild total %s\n", cc, rel, out, pp);
+    }
+    if (pos < size)
+        pos += snprintf(buf + pos, size - pos,
+                        "  kept (KB): code %u of %u, data %u of %u, "
+                        "bss %u of %u; by object in %s\n",
+                        s_link_kept[0] / 1024, s_link_size[0] / 1024,
+                        s_link_kept[1] / 1024, s_link_size[1] / 1024,
+                        s_link_kept[2] / 1024, s_link_size[2] / 1024,
+                        REBUILD_SIZES);
+    return pos < size ? pos : size - 1;
+}
+
+/* Compile src with flags to obj in a TCC state of its own, timing it
+   into st. Returns 0 on success. */
+static int rebuild_compile(const char *src, const char *flags,
+                           const char *obj, struct tcc_phase_stats *st) {
+    TCCState *tcc = tcc_arena_new();
+    if (!tcc) {
+        fb_print("  Failed to create TCC context\n", COLOR_RED);
+        return -1;
+    }
+    tcc_set_error_func(tcc, NULL, rebuild_error_handler);
+    tcc_set_options(tcc, flags);
+    tcc_set_output_type(tcc, TCC_OUTPUT_OBJ);
+
+    /* Include paths: our stub headers, then source dir */
+    for (int k = 0; s_dep_includes[k]; k++)
+        tcc_add_include_path(tcc, s_dep_includes[k]);
+
+    UINT64 t0 = timer_ticks();
+    int rc = tcc_add_file(tcc, src);
+    if (rc >= 0) {
+        tcc_phase_collect(tcc, timer_ticks() - t0, st);
+        t0 = timer_ticks();
+        rc = tcc_output_file(tcc, obj);
+        st->output = timer_ticks() - t0;
+    }
+    tcc_arena_delete(tcc);
+
+    /* The shim writes the file on close and cannot report failure */
+    if (rc >= 0 && !rebuild_exists(obj)) {
+        fb_print("  Cannot write ", COLOR_RED);
+        fb_print(obj, COLOR_RED);
+        fb_print("\n", COLOR_RED);
+        rc = -1;
+    }
+    return rc < 0 ? -1 : 0;
+}
+
+/* Console progress for the units the application processors compile:
+   the same lines as a serial build, and a failed unit's messages as
+   rebuild_error_handler() gives them */
+static void rebuild_pool_progress(struct tccpool_job *job, void *ctx) {
+    (void)ctx;
+    if (job->reported == TCCPOOL_RUNNING) {
+        fb_print("  Compiling ", COLOR_WHITE);
+        fb_print(job->src, COLOR_YELLOW);
+        fb_print("...\n", COLOR_WHITE);
+        return;
+    }
+    if (job->reported != TCCPOOL_FAILED)
+        return;
+    char *p = job->errors;
+    while (*p) {
+        char *nl = p;
+        while (*nl && *nl != '\n') nl++;
+        char c = *nl;
+        *nl = '\0';
+        rebuild_error_handler(NULL, p);
+        if (!c) break;
+        *nl = c;
+        p = nl + 1;
+    }
+}
+
+/* Write the loader of efistub.h to out_path, carrying the linked
+   image as its payload: efistub.c with lz4.o and timer.o from the
+   rebuild, and the payload as the source tools/efipack.py would
+   write. Returns 0, -1 with the reason on screen. */
+static int rebuild_pack(const char *image, const char *out_path) {
+    CHAR16 w[REBUILD_PATH];
+    UINTN size = 0;
+    rebuild_wpath(image, w);
+    UINT8 *raw = (UINT8 *)fs_readfile(w, &size);
+    if (!raw) {
+        fb_print("  Cannot read the linked image\n", COLOR_RED);
+        return -1;
+    }
+    UINTN cap = size + size / 255 + 16;
+    UINT8 *packed = (UINT8 *)mem_alloc_raw(cap);
+    void *scratch = mem_alloc_raw(LZ4_SCRATCH);
+    UINTN n = packed && scratch ? lz4_compress(raw, size, packed, cap, scratch)
+                                : 0;
+    mem_free(raw);
+    if (scratch) mem_free(scratch);
+
+    /* Up to "255," per byte, and a line per 16 */
+    UINTN tcap = n * 4 + n / 16 * 6 + 256, len = 0;
+    char *text = n ? (char *)mem_alloc_raw(tcap) : NULL;
+    if (!text) {
+        if (packed) mem_free(packed);
+        fb_print("  Out of memory packing the image\n", COLOR_RED);
+        return -1;
+    }
+    len += snprintf(text + len, tcap - len,
+                    "/* Generated by F6 from survival.efi */\n"
+                    "#include \"efistub.h\"\n\n"
+                    "const UINT32 efistub_raw_size = %u;\n"
+                    "const UINT32 efistub_packed_size = %u;\n"
+                    "const UINT8 efistub_packed[] = {\n",
+                    (UINT32)size, (UINT32)n);
+    for (UINTN i = 0; i < n; i++) {
+        if (i % 16 == 0) {
+            mem_copy(text + len, "    ", 4);
+            len += 4;
+        }
+        UINT8 b = packed[i];
+        if (b >= 100) text[len++] = (char)('0' + b / 100);
+        if (b >= 10) text[len++] = (char)('0' + b / 10 % 10);
+        text[len++] = (char)('0' + b % 10);
+        text[len++] = ',';
+        if (i % 16 == 15 || i == n - 1) text[len++] = '\n';
+    }
+    mem_free(packed);
+    str_copy(text + len, "};\n", 4);
+
+    TCCState *tcc = tcc_arena_new();
+    if (!tcc) {
+        mem_free(text);
+        fb_print("  Failed to create TCC context\n", COLOR_RED);
+        return -1;
+    }
+    tcc_set_error_func(tcc, NULL, rebuild_error_handler);
+    tcc_set_options(tcc, s_unit_flags[UNIT_WS]);
+    tcc_set_options(tcc, "-Wl,-subsystem=efiapp -Wl,-e=efi_main"
+                         " -Wl,--gc-sections");
+    tcc_set_output_type(tcc, TCC_OUTPUT_DLL);
+    for (int k = 0; s_include_paths[k]; k++)
+        tcc_add_include_path(tcc, s_include_paths[k]);
+    int rc = tcc_add_file(tcc, "/src/efistub.c");
+    if (rc >= 0) rc = tcc_compile_string(tcc, text);
+    if (rc >= 0) rc = tcc_add_file(tcc, REBUILD_DIR "/lz4.o");
+    if (rc >= 0) rc = tcc_add_file(tcc, REBUILD_DIR "/timer.o");
+    if (rc >= 0) rc = tcc_output_file(tcc, out_path);
+    tcc_arena_delete(tcc);
+    mem_free(text);
+    if (rc < 0) {
+        fb_print("  Packing failed\n", COLOR_RED);
+        return -1;
+    }
+
+    char line[96];
+    snprintf(line, sizeof(line), "  Packed %u KB into %u KB\n",
+             (UINT32)(size / 1024), (UINT32)(n / 1024));
+    fb_print(line, COLOR_WHITE);
+    return 0;
+}
+
+static void handle_rebuild(void) {
+    /* Auto-save if modified */
+    if (s_modified) {
+        if (doc_save() != 0) {
+            draw_info("Save failed - cannot rebuild");
+            return;
+        }
+    }
+
+    fb_clear(COLOR_BLACK);
+    g_boot.cursor_x = 0;
+    g_boot.cursor_y = 0;
+
+    fb_print("\n", COLOR_CYAN);
+    fb_print("  ========================================\n", COLOR_CYAN);
+    fb_print("       REBUILD WORKSTATION\n", COLOR_CYAN);
+    fb_print("  ========================================\n\n", COLOR_CYAN);
+
+    s_rebuild_err_pos = 0;
+    s_rebuild_err[0] = '\0';
+
+    /* Output path */
+#ifdef __aarch64__
+    const char *out_path = "/EFI/BOOT/BOOTAA64.EFI";
+#else
+    const char *out_path = "/EFI/BOOT/BOOTX64.EFI";
+#endif
+
+    CHAR16 wdir[REBUILD_PATH];
+    rebuild_wpath(REBUILD_DIR, wdir);
+    fs_mkdir(wdir);
+    rebuild_manifest_load(REBUILD_MANIFEST);
+    s_dep_includes = s_include_paths;
+    s_dep_count = s_dep_edge_count = 0;
+    mem_set(s_unit_stats, 0, sizeof(s_unit_stats));
+    mem_set(&s_link_stats, 0, sizeof(s_link_stats));
+    UINT64 start = timer_ticks();
+
+    /* Which units need compiling */
+    int built = 0, reused = 0, failed = 0, stale = 0, lib = -1;
+    UINT64 keys[REBUILD_OBJS];
+    struct tccpool_job *jobs =
+        (struct tccpool_job *)mem_alloc(REBUILD_OBJS * sizeof(*jobs));
+    if (!jobs) {
+        fb_print("  Out of memory\n", COLOR_RED);
+        goto wait;
+    }
+    for (int i = 0; s_units[i].src; i++) {
+        const struct rebuild_unit *u = &s_units[i];
+        char obj[REBUILD_PATH];
+        CHAR16 wobj[REBUILD_PATH];
+        rebuild_obj_path(u, obj);
+        rebuild_wpath(obj, wobj);
+
+        keys[i] = rebuild_key(s_unit_flags[u->kind], u->src);
+        struct rebuild_entry *e = rebuild_manifest_find(u->obj);
+        int current = e && e->key == keys[i] && fs_exists(wobj);
+        if (u->kind == UNIT_LIB && str_cmp((CHAR8 *)u->obj, (CHAR8 *)"libtcc.o") == 0)
+            lib = current ? i : -1;
+        if (current) {
+            fb_print("  Up to date ", COLOR_DGRAY);
+            fb_print(u->src, COLOR_DGRAY);
+            fb_print("\n", COLOR_DGRAY);
+            reused++;
+            continue;
+        }
+        fs_delete_file(NULL, wobj);  /* so a failed write cannot leave it */
+        struct tccpool_job *j = &jobs[stale++];
+        j->src = u->src;
+        j->flags = s_unit_flags[u->kind];
+        j->obj = u->obj;
+        j->tag = i;
+        j->state = TCCPOOL_PENDING;
+    }
+
+    /* The application processors take what they can, with the
+       compiler in a libtcc.o that is already current */
+    static char objs[REBUILD_OBJS][REBUILD_PATH];
+    for (int k = 0; k < stale; k++) {
+        rebuild_obj_path(&s_units[jobs[k].tag], objs[k]);
+        jobs[k].obj = objs[k];
+    }
+    if (lib >= 0 && stale >= 2) {
+        char libtcc[REBUILD_PATH];
+        rebuild_obj_path(&s_units[lib], libtcc);
+        tccpool_compile(libtcc, keys[lib], jobs, stale, s_dep_includes,
+                        rebuild_pool_progress, NULL);
+    }
+
+    /* Then, in order, whatever they left, and the results */
+    for (int k = 0; k < stale; k++) {
+        struct tccpool_job *j = &jobs[k];
+        const struct rebuild_unit *u = &s_units[j->tag];
+        struct rebuild_entry *e = rebuild_manifest_find(u->obj);
+        int rc;
+        if (j->state == TCCPOOL_PENDING) {
+            if (failed) continue;
+            fb_print("  Compiling ", COLOR_WHITE);
+            fb_print(u->src, COLOR_YELLOW);
+            fb_print("...\n", COLOR_WHITE);
+            rc = rebuild_compile(j->src, j->flags, j->obj,
+                                 &s_unit_stats[j->tag]);
+        } else {
+            s_unit_stats[j->tag] = j->stats;
+            rc = j->state == TCCPOOL_DONE ? 0 : -1;
+            if (rc == 0 && !rebuild_exists(j->obj)) {
+                fb_print("  Cannot write ", COLOR_RED);
+                fb_print(j->obj, COLOR_RED);
+                fb_print("\n", COLOR_RED);
+                rc = -1;
+            }
+        }
+        if (rc != 0) {
+            if (e) e->key = 0;  /* never trust a stale object */
+            failed = 1;
+            continue;
+        }
+        e = rebuild_manifest_set(u->obj);
+        if (e) e->key = keys[j->tag];
+        built++;
+    }
+    mem_free(jobs);
+    rebuild_manifest_save(REBUILD_MANIFEST);
+
+    if (failed) {
+        fb_print("\n  BUILD FAILED\n", COLOR_RED);
+        goto wait;
+    }
+
+    {
+        char num[16];
+        fb_print("\n  ", COLOR_WHITE);
+        int_to_str(built, num);
+        fb_print(num, COLOR_WHITE);
+        fb_print(" compiled, ", COLOR_WHITE);
+        int_to_str(reused, num);
+        fb_print(num, COLOR_WHITE);
+        fb_print(" cached. Linking...\n", COLOR_WHITE);
+    }
+
+    /* Link the objects into the PE image */
+    TCCState *tcc = tcc_arena_new();
+    if (!tcc) {
         fb_print("  Failed to create TCC context\n", COLOR_RED);
         goto wait;
     }
+    tcc_set_error_func(tcc, NULL, rebuild_error_handler);
+    tcc_set_options(tcc, "-nostdlib -Wl,-subsystem=efiapp -Wl,-e=efi_main"
+                         " -Wl,--gc-sections -Wl,-Map=" REBUILD_SIZES);
+    tcc_set_output_type(tcc, TCC_OUTPUT_DLL);
+    UINT64 t0 = timer_ticks();
+    for (int i = 0; s_units[i].src; i++) {
+        char obj[REBUILD_PATH];
+        rebuild_obj_path(&s_units[i], obj);
+        if (tcc_add_file(tcc, obj) < 0) {
+            fb_print("\n  LINK FAILED\n", COLOR_RED);
+            tcc_arena_delete(tcc);
+            goto wait;
+        }
+    }
+
+    s_link_stats.compile = timer_ticks() - t0;
+
+    /* Generate PE output */
+    int pack = rebuild_exists(REBUILD_PACK);
+    t0 = timer_ticks();
+    if (tcc_output_file(tcc, pack ? REBUILD_IMAGE : out_path) < 0) {
+        fb_print("  Output failed\n", COLOR_RED);
+        tcc_arena_delete(tcc);
+        goto wait;
+    }
+    {
+        /* Relocation is everything but the write */
+        TCCStats st;
+        tcc_get_stats(tcc, &st);
+        UINT64 t = timer_ticks() - t0;
+        s_link_stats.output = st.write_ticks < t ? st.write_ticks : t;
+        s_link_stats.relocate = t - s_link_stats.output;
+
+        TCCObjSize os;
+        mem_set(s_link_size, 0, sizeof(s_link_size));
+        mem_set(s_link_kept, 0, sizeof(s_link_kept));
+        for (int i = 0; tcc_get_obj_size(tcc, i, &os) == 0; i++) {
+            for (int k = 0; k < 3; k++) {
+                s_link_size[k] += os.size[k];
+                s_link_kept[k] += os.kept[k];
+            }
+        }
+    }
+
+    tcc_arena_delete(tcc);
+    if (pack && rebuild_pack(REBUILD_IMAGE, out_path) != 0)
+        goto wait;
+
+    {
+        char report[4096];
+        UINT64 total = timer_ticks() - start;
+        int len = rebuild_stats_format(report, (int)sizeof(report), total);
+        trace_mark("rebuild", timer_us(total) / 1000, (UINT64)built, NULL);
+        fb_print("\n", COLOR_WHITE);
+        fb_print(report, COLOR_GRAY);
+        CHAR16 w[REBUILD_PATH];
+        rebuild_wpath(REBUILD_STATS, w);
+        fs_writefile(w, report, (UINTN)len);
+    }
+
+    fb_print("\n", COLOR_GREEN);
+    fb_print("  ========================================\n", COLOR_GREEN);
+    fb_print("    BUILD COMPLETE!\n", COLOR_GREEN);
+    fb_print("  ========================================\n", COLOR_GREEN);
+    fb_print("\n  Written to: ", COLOR_WHITE);
+    fb_print(out_path, COLOR_YELLOW);
+    fb_print("\n\n  Press R to reboot now, any other key for editor.\n", COLOR_YELLOW);
+    {
+        struct key_event ev;
+        kbd_wait_scrollback(&ev);
+        if (ev.code == 'R' || ev.code == 'r') {
+            fb_print("\n  Rebooting...\n", COLOR_CYAN);
+            g_boot.rs->ResetSystem(EfiResetCold, 0, 0, NULL);
+        }
+    }
+    draw_all();
+    return;
+
+wait:
+    trace_mark("rebuild-failed", timer_us(timer_ticks() - start) / 1000,
+               (UINT64)built, NULL);
+    /* Re-print error summary so it's visible at bottom of screen */
+    if (s_rebuild_err_pos > 0) {
+        fb_print("\n  ---- Error Summary ----\n", COLOR_RED);
+        fb_print(s_rebuild_err, COLOR_RED);
+    }
+    fb_print("\n  Press any key to return to editor (PgUp/PgDn: scroll)...\n",
+             COLOR_DGRAY);
+    {
+        struct key_event ev;
+        kbd_wait_scrollback(&ev);
+    }
+    draw_all();
+}
+
+/* ---- Project builds (F5 by a proj.txt) ---- */
+
+/*
+ * A directory holding PROJ_FILE is one program of several sources, and
+ * F5 on any file in it builds that the way F6 builds the workstation:
+ * each source is compiled to its own object under PROJ_OBJDIR, reused
+ * while its key (the flags, the source and every header it reaches)
+ * matches the manifest there.  The objects are linked in memory and
+ * run, and the image is cached under a hash of their keys, so an
+ * unchanged project reruns without linking.  On a read-only volume no
+ * object can be kept and the sources are compiled in memory instead.
+ *
+ * The descriptor is words on lines, from # to the end of a line a
+ * comment; paths are relative to it:
+ *
+ *     source main.c util.c    the files to compile
+ *     include inc             for <> and "" headers, before /include
+ *     define VERBOSE N=2      -D for every source
+ */
+#define PROJ_FILE      "proj.txt"
+#ifdef __aarch64__
+#define PROJ_OBJDIR    "obj-aarch64"
+#else
+#define PROJ_OBJDIR    "obj-x86_64"
+#endif
+#define PROJ_MANIFEST  PROJ_OBJDIR "/objects.lst"
+#define PROJ_SOURCES   REBUILD_OBJS
+#define PROJ_INCLUDES  8
+#define PROJ_FLAGS     512
+
+struct project {
+    char dir[REBUILD_PATH];                 /* ending in '/' */
+    char src[PROJ_SOURCES][REBUILD_PATH];
+    char obj[PROJ_SOURCES][REBUILD_PATH];   /* in the manifest by name */
+    int  nsrc;
+    char inc[PROJ_INCLUDES][REBUILD_PATH];
+    const char *inc_list[PROJ_INCLUDES + 2];    /* then /include */
+    int  ninc;
+    char flags[PROJ_FLAGS];
+};
+
+static struct project s_proj;
+
+/* name under dir, unless it is absolute. Returns 0, -1 if too long. */
+static int proj_join(const char *dir, const char *name, char *out) {
+    int n = name[0] == '/' || name[0] == '\\' ? 0 : (int)str_len((CHAR8 *)dir);
+    int len = (int)str_len((CHAR8 *)name);
+    if (n + len >= REBUILD_PATH)
+        return -1;
+    mem_copy(out, dir, (UINTN)n);
+    for (int i = 0; i <= len; i++)
+        out[n + i] = name[i] == '\\' ? '/' : name[i];
+    return 0;
+}
+
+/* The next word of the line at *i into word: its length, 0 at the end
+   of the line, -1 if longer than max - 1 */
+static int proj_word(const char *data, UINTN size, UINTN *i,
+                     char *word, int max) {
+    UINTN p = *i;
+    while (p < size && (data[p] == ' ' || data[p] == '\t' || data[p] == '\r'))
+        p++;
+    if (p < size && data[p] == '#')
+        while (p < size && data[p] != '\n') p++;
+    int n = 0;
+    while (p < size && (UINT8)data[p] > ' ') {
+        if (n == max - 1) {
+            *i = p;
+            return -1;
+        }
+        word[n++] = data[p++];
+    }
+    word[n] = '\0';
+    *i = p;
+    return n;
+}
+
+/* Add one argument of a source, include or define line (kind 0, 1, 2).
+   Returns what is wrong with it, NULL if nothing. */
+static const char *proj_add(int kind, const char *word) {
+    struct project *p = &s_proj;
+    if (kind == 0) {
+        if (p->nsrc == PROJ_SOURCES)
+            return "too many sources";
+        char *obj = p->obj[p->nsrc];
+        if (proj_join(p->dir, word, p->src[p->nsrc]) != 0 ||
+            proj_join(p->dir, PROJ_OBJDIR "/", obj) != 0)
+            return "path too long";
+        /* The object is named after the source, in one directory */
+        const char *base = word;
+        for (const char *c = word; *c; c++)
+            if (*c == '/' || *c == '\\') base = c + 1;
+        int n = 0, dot = -1;
+        for (; base[n]; n++)
+            if (base[n] == '.') dot = n;
+        if (dot > 0) n = dot;
+        int at = (int)str_len((CHAR8 *)obj);
+        if (n == 0 || n + 2 >= (int)sizeof(s_manifest[0].obj) ||
+            at + n + 2 >= REBUILD_PATH)
+            return "source name too long";
+        mem_copy(obj + at, base, (UINTN)n);
+        str_copy(obj + at + n, ".o", 3);
+        for (int k = 0; k < p->nsrc; k++)
+            if (str_cmp((CHAR8 *)p->obj[k], (CHAR8 *)obj) == 0)
+                return "two sources of one name";
+        p->nsrc++;
+    } else if (kind == 1) {
+        if (p->ninc == PROJ_INCLUDES)
+            return "too many include paths";
+        if (proj_join(p->dir, word, p->inc[p->ninc]) != 0)
+            return "path too long";
+        p->ninc++;
+    } else {
+        /* Room is left for -finstrument-functions */
+        int n = (int)str_len((CHAR8 *)p->flags);
+        if (n + 3 + (int)str_len((CHAR8 *)word) >= PROJ_FLAGS - 32)
+            return "too many defines";
+        str_copy(p->flags + n, " -D", 4);
+        str_copy(p->flags + n + 3, word, (UINTN)(PROJ_FLAGS - n - 3));
+    }
+    return NULL;
+}
+
+/* Read dir's PROJ_FILE into s_proj. Returns 0, -1 with err set. */
+static int proj_load(const char *dir, char *err, int err_size) {
+    struct project *p = &s_proj;
+    mem_set(p, 0, sizeof(*p));
+    str_copy(p->dir, dir, REBUILD_PATH);
+    str_copy(p->flags, TCC_RUN_OPTIONS, PROJ_FLAGS);
+
+    char path[REBUILD_PATH];
+    CHAR16 w[REBUILD_PATH];
+    UINTN size = 0;
+    char *data = NULL;
+    if (proj_join(dir, PROJ_FILE, path) == 0) {
+        rebuild_wpath(path, w);
+        data = (char *)fs_readfile(w, &size);
+    }
+    if (!data) {
+        snprintf(err, err_size, "Cannot read " PROJ_FILE);
+        return -1;
+    }
+
+    static const char *const kinds[] = { "source", "include", "define" };
+    const char *what = NULL;
+    int line = 1;
+    UINTN i = 0;
+    while (i < size && !what) {
+        char word[REBUILD_PATH];
+        int n = proj_word(data, size, &i, word, sizeof(word));
+        if (n != 0) {
+            int kind = 0;
+            while (kind < 3 && (n < 0 || str_cmp((CHAR8 *)word,
+                                                 (CHAR8 *)kinds[kind]) != 0))
+                kind++;
+            if (kind == 3)
+                what = "not source, include or define";
+            while (!what && (n = proj_word(data, size, &i, word,
+                                           sizeof(word))) != 0)
+                what = n < 0 ? "word too long" : proj_add(kind, word);
+        }
+        if (!what) {
+            while (i < size && data[i] != '\n') i++;
+            i++;
+            line++;
+        }
+    }
+    mem_free(data);
+    if (!what && p->nsrc == 0) {
+        snprintf(err, err_size, PROJ_FILE " lists no sources");
+        return -1;
+    }
+    if (what) {
+        snprintf(err, err_size, PROJ_FILE " line %d: %s", line, what);
+        return -1;
+    }
+
+    for (int k = 0; k < p->ninc; k++)
+        p->inc_list[k] = p->inc[k];
+    p->inc_list[p->ninc] = "/include";
+    p->inc_list[p->ninc + 1] = NULL;
+    return 0;
+}
+
+/* The project of the file being edited, saved first, into s_proj and
+   its directory into dir. Returns the directory's length, 0 if there
+   is no project here, -1 if it cannot be read (said why). */
+static int proj_open(char *dir) {
+    char path[REBUILD_PATH];
+    sym_cur_path(dir, EDIT_MAX_PATH);
+    int cut = 0;
+    for (int k = 0; dir[k]; k++)
+        if (dir[k] == '/') cut = k + 1;
+    dir[cut] = '\0';
+    if (cut == 0 || cut + (int)sizeof(PROJ_MANIFEST) > REBUILD_PATH ||
+        proj_join(dir, PROJ_FILE, path) != 0 || !rebuild_exists(path))
+        return 0;
+
+    /* Saved first, as the descriptor itself may be the file */
+    if (s_modified && doc_save() != 0) {
+        draw_info("Save failed — cannot compile");
+        return -1;
+    }
+    char err[96];
+    if (proj_load(dir, err, (int)sizeof(err)) != 0) {
+        draw_info(err);
+        return -1;
+    }
+    return cut;
+}
+
+/* Bring the objects of s_proj (in dir, cut long) up to date and list
+   into files what to link: the objects, or on a read-only volume the
+   sources. total gets what was compiled, image_key the hash of every
+   unit's key. Returns 0, -1 if a compile failed (errors on screen). */
+static int proj_build(const char *dir, int cut, const char **files,
+                      struct tcc_phase_stats *total, UINT64 *image_key) {
+    struct project *p = &s_proj;
+    char manifest[REBUILD_PATH];
+    proj_join(dir, PROJ_MANIFEST, manifest);
+    int keep = !fs_is_read_only();
+    s_manifest_count = 0;
+    if (keep) {
+        char objdir[REBUILD_PATH];
+        CHAR16 w[REBUILD_PATH];
+        proj_join(dir, PROJ_OBJDIR, objdir);
+        rebuild_wpath(objdir, w);
+        fs_mkdir(w);
+        rebuild_manifest_load(manifest);
+    }
+    s_rebuild_err_pos = 0;
+    s_rebuild_err[0] = '\0';
+    s_dep_includes = p->inc_list;
+    s_dep_count = s_dep_edge_count = 0;
+
+    /* Only units whose keys changed are compiled; the image is kept
+       under the keys of all of them */
+    mem_set(total, 0, sizeof(*total));
+    *image_key = FNV1A64_INIT;
+    int built = 0, reused = 0, failed = 0;
+    for (int i = 0; i < p->nsrc; i++) {
+        UINT64 key = rebuild_key(p->flags, p->src[i]);
+        *image_key = key && *image_key ? fnv1a64(*image_key, &key, sizeof(key))
+                                       : 0;
+        files[i] = keep ? p->obj[i] : p->src[i];
+        if (!keep)
+            continue;
+
+        const char *name = p->obj[i] + cut + sizeof(PROJ_OBJDIR);
+        CHAR16 wobj[REBUILD_PATH];
+        rebuild_wpath(p->obj[i], wobj);
+        struct rebuild_entry *e = rebuild_manifest_find(name);
+        if (key && e && e->key == key && fs_exists(wobj)) {
+            fb_print("  Up to date ", COLOR_DGRAY);
+            fb_print(p->src[i], COLOR_DGRAY);
+            fb_print("\n", COLOR_DGRAY);
+            reused++;
+            continue;
+        }
+
+        fb_print("  Compiling ", COLOR_WHITE);
+        fb_print(p->src[i], COLOR_YELLOW);
+        fb_print("...\n", COLOR_WHITE);
+        fs_delete_file(NULL, wobj);  /* so a failed write cannot leave it */
+        struct tcc_phase_stats st;
+        mem_set(&st, 0, sizeof(st));
+        if (rebuild_compile(p->src[i], p->flags, p->obj[i], &st) != 0) {
+            if (e) e->key = 0;  /* never trust a stale object */
+            failed = 1;
+            break;
+        }
+        total->preprocess += st.preprocess;
+        total->compile += st.compile;
+        total->lines += st.lines;
+        total->tokens += st.tokens;
+        total->code_bytes += st.code_bytes;
+        e = rebuild_manifest_set(name);
+        if (e) e->key = key;
+        built++;
+    }
+    if (keep)
+        rebuild_manifest_save(manifest);
+    s_dep_includes = s_include_paths;
+    if (failed)
+        return -1;
+
+    char line[80];
+    if (keep)
+        snprintf(line, sizeof(line), "\n  %d compiled, %d up to date\n\n",
+                 built, reused);
+    else
+        snprintf(line, sizeof(line),
+                 "  Read-only volume: compiling in memory\n\n");
+    fb_print(line, COLOR_WHITE);
+    return 0;
+}
+
+/* F5 on a file next to a PROJ_FILE: build the project, link it in
+   memory and run it. Returns -1 if there is no project here. */
+static int handle_project_run(int flags) {
+    struct project *p = &s_proj;
+    char dir[EDIT_MAX_PATH];
+    int cut = proj_open(dir);
+    if (cut == 0)
+        return -1;
+    if (cut < 0)
+        return 0;
+    if (flags & TCC_RUN_PROFILE) {
+        int n = (int)str_len((CHAR8 *)p->flags);
+        str_copy(p->flags + n, " -finstrument-functions",
+                 (UINTN)(PROJ_FLAGS - n));
+    }
+
+    fb_clear(COLOR_BLACK);
+    fb_print("  Building ", COLOR_CYAN);
+    fb_print(dir, COLOR_CYAN);
+    fb_print(PROJ_FILE "...\n\n", COLOR_CYAN);
+    if (flags & TCC_RUN_AP)
+        fb_print("  On an AP of its own: ESC stops it\n\n", COLOR_DGRAY);
+
+    const char *files[PROJ_SOURCES];
+    struct tcc_phase_stats total;
+    UINT64 image_key;
+    UINT64 t0 = bench_start();
+    struct tcc_result r;
+    if (proj_build(dir, cut, files, &total, &image_key) != 0) {
+        mem_set(&r, 0, sizeof(r));  /* the errors are on screen */
+    } else {
+        r = tcc_run_files(files, p->nsrc, p->flags, p->inc_list, image_key,
+                          flags);
+        /* Loading objects counts no lines; what was compiled above does */
+        if (!fs_is_read_only() && !r.cached) {
+            UINT64 rel = r.stats.relocate;
+            r.stats = total;
+            r.stats.relocate = rel;
+        }
+    }
+    trace_mark(r.success ? "run" : "run-failed", bench_stop(t0) / 1000,
+               (UINT64)(INT64)r.exit_code, r.cached ? "cached" : "project");
+
+    show_run_result(&r, flags);
+    return 0;
+}
+
+/* ---- Build as EFI application (F7) ---- */
+
+/*
+ * F7 builds the program, or the project it is part of, into an .efi
+ * that ENTER in the browser starts without compiling (efiapp.h): the
+ * buffer's beside it as <file>.efi, a project's in its directory as
+ * <directory>.efi from the objects F5 keeps.
+ */
+static void handle_build_app(void) {
+    struct project *p = &s_proj;
+    char dir[EDIT_MAX_PATH], out[EDIT_MAX_PATH + 4];
+    int cut = proj_open(dir);
+    if (cut < 0)
+        return;
+    if (cut == 0 && !is_c_file()) {
+        draw_info("Not a .c file");
+        return;
+    }
+    if (fs_is_read_only()) {
+        draw_info("Volume is read-only");
+        return;
+    }
+    if (cut == 0 && s_modified && doc_save() != 0) {
+        draw_info("Save failed — cannot compile");
+        return;
+    }
+
+    /* <file>.efi, or the project directory's name */
+    int n = 0;
+    if (cut > 0) {
+        int start = cut - 1;
+        while (start > 0 && dir[start - 1] != '/') start--;
+        n = cut - 1 - start;
+        if (n == 0) {
+            draw_info("No directory name for the application");
+            return;
+        }
+        mem_copy(out, dir, (UINTN)cut);
+        mem_copy(out + cut, dir + start, (UINTN)n);
+        n += cut;
+    } else {
+        sym_cur_path(out, EDIT_MAX_PATH);
+        n = (int)str_len((CHAR8 *)out) - 2;
+    }
+    str_copy(out + n, ".efi", 5);
+
+    fb_clear(COLOR_BLACK);
+    fb_print("  Building ", COLOR_CYAN);
+    fb_print(out, COLOR_CYAN);
+    fb_print("...\n\n", COLOR_CYAN);
+
+    UINT64 t0 = bench_start();
+    struct tcc_result r;
+    if (cut > 0) {
+        const char *files[PROJ_SOURCES];
+        struct tcc_phase_stats total;
+        UINT64 image_key;
+        mem_set(&r, 0, sizeof(r));
+        if (proj_build(dir, cut, files, &total, &image_key) == 0)
+            r = tcc_build_app(NULL, NULL, files, p->nsrc, p->flags,
+                              p->inc_list, out);
+    } else {
+        UINTN src_size = 0;
+        char *source = doc_serialize(&src_size);
+        if (!source) {
+            draw_all();
+            draw_info("Out of memory");
+            return;
+        }
+        static const char *const includes[] = { "/include", NULL };
+        r = tcc_build_app(source, s_filename, NULL, 0, NULL, includes, out);
+        mem_free(source);
+    }
+    UINT64 us = bench_stop(t0) / 1000;
+    trace_mark(r.success ? "build-app" : "build-app-failed", us, 0, out);
+
+    fb_print("\n", COLOR_WHITE);
+    if (r.success) {
+        char line[96];
+        snprintf(line, sizeof(line),
+                 "  --- Built in %llu.%03llu ms; ENTER on it in the browser"
+                 " starts it ---\n",
+                 (unsigned long long)(us / 1000),
+                 (unsigned long long)(us % 1000));
+        fb_print(line, COLOR_GREEN);
+    } else {
+        fb_print("  --- Build Failed ---\n", COLOR_RED);
+        if (r.error_msg[0])
+            fb_print(r.error_msg, COLOR_RED);
+    }
+    fb_print("\n  Press any key to return to editor (PgUp/PgDn: scroll)...\n",
+             COLOR_DGRAY);
+    struct key_event ev;
+    kbd_wait_scrollback(&ev);
+    draw_all();
+}
+
+/* ---- Large-file viewer ---- */
+
+/*
+ * Files too big to load are shown read-only.  One streaming pass
+ * records the offset of every VIEW_STEP-th line; any line is then found
+ * by seeking to the checkpoint before it and stepping over at most
+ * VIEW_STEP - 1 lines.  Text is read through a small set of cached
+ * pages, so memory use is bounded by the index, at 8 bytes per
+ * VIEW_STEP lines.  Lines longer than VIEW_LINE_MAX are shown in
+ * pieces, which also bounds the work per checkpoint.
+ */
+#define VIEW_MIN_SIZE   (8ULL * 1024 * 1024)   /* larger files open here */
+#define VIEW_PAGE       65536
+#define VIEW_PAGES      16
+#define VIEW_STEP       256
+#define VIEW_LINE_MAX   4096
+#define VIEW_HSTEP      8       /* columns per Left/Right */
+
+struct view_page {
+    UINT64 off;             /* file offset, multiple of VIEW_PAGE */
+    UINT32 len;             /* valid bytes, 0 if unused */
+    UINT32 used;            /* LRU stamp */
+    char  *data;
+};
+
+static struct fs_file  *s_view_file;
+static UINT64           s_view_size;
+static UINT64          *s_view_index;      /* start of line k * VIEW_STEP */
+static UINTN            s_view_index_len;
+static UINTN            s_view_index_cap;
+static UINT64           s_view_lines;
+static struct view_page s_view_pages[VIEW_PAGES];
+static struct view_page *s_view_last;       /* page of the last byte read */
+static UINT32           s_view_clock;
+static UINT64           s_view_top;         /* first line on screen */
+static UINT64           s_view_top_off;
+static int              s_view_scroll_x;
+static int              s_view_error;       /* a page could not be read */
+
+static void u64_to_str(UINT64 n, char *buf) {
+    char tmp[24];
+    int t = 0;
+    do { tmp[t++] = (char)('0' + n % 10); n /= 10; } while (n > 0);
+    int i = 0;
+    while (t > 0) buf[i++] = tmp[--t];
+    buf[i] = '\0';
+}
+
+/* Append s to line at *i, within the screen width */
+static void view_append(char *line, int *i, const char *s) {
+    while (*s && *i < (int)g_boot.cols && *i < 255)
+        line[(*i)++] = *s++;
+}
+
+/* Fill pg with the page holding off. Returns 0 on success. */
+static int view_page_load(struct view_page *pg, UINT64 off) {
+    pg->off = off - off % VIEW_PAGE;
+    pg->len = 0;
+    if (fs_stream_seek(s_view_file, pg->off) != 0)
+        return -1;
+    while (pg->len < VIEW_PAGE) {
+        UINTN got = VIEW_PAGE - pg->len;
+        if (fs_stream_read(s_view_file, pg->data + pg->len, &got) != 0)
+            return -1;
+        if (got == 0)
+            break;
+        pg->len += (UINT32)got;
+    }
+    return pg->len ? 0 : -1;
+}
+
+/* Byte at off, or -1 past the end or on a read error */
+static int view_byte(UINT64 off) {
+    struct view_page *pg = s_view_last;
+    if (pg && off >= pg->off && off < pg->off + pg->len)
+        return (UINT8)pg->data[off - pg->off];
+    if (off >= s_view_size)
+        return -1;
+
+    UINT64 base = off - off % VIEW_PAGE;
+    struct view_page *victim = &s_view_pages[0];
+    pg = NULL;
+    for (int i = 0; i < VIEW_PAGES; i++) {
+        struct view_page *p = &s_view_pages[i];
+        if (p->len && p->off == base) {
+            pg = p;
+            break;
+        }
+        if (!p->len || p->used < victim->used)
+            victim = p;
+    }
+    if (!pg) {
+        pg = victim;
+        if (view_page_load(pg, off) != 0) {
+            pg->len = 0;
+            s_view_error = 1;
+            return -1;
+        }
+    }
+    pg->used = ++s_view_clock;
+    s_view_last = pg;
+    if (off >= pg->off + pg->len)
+        return -1;
+    return (UINT8)pg->data[off - pg->off];
+}
+
+/*
+ * Read the line starting at off: skip its first skip bytes, copy up
+ * to n more into out (unprintables as '.'), and return the number
+ * copied.  *next receives the start of the following line.  Line
+ * breaks are \n, \r\n or a lone \r, as in the editor.
+ */
+static int view_line(UINT64 off, int skip, char *out, int n, UINT64 *next) {
+    int len = 0, copied = 0;
+    for (;;) {
+        int c = view_byte(off);
+        if (c < 0) {
+            *next = s_view_size;
+            return copied;
+        }
+        off++;
+        if (c == '\n')
+            break;
+        if (c == '\r') {
+            if (view_byte(off) == '\n')
+                off++;
+            break;
+        }
+        if (len >= skip && copied < n)
+            out[copied++] = (c >= 0x20 && c <= 0x7E) ? (char)c : '.';
+        if (++len == VIEW_LINE_MAX)
+            break;
+    }
+    *next = off;
+    return copied;
+}
+
+static UINT64 view_line_off(UINT64 line) {
+    UINT64 off = s_view_index[line / VIEW_STEP];
+    for (UINT64 k = line % VIEW_STEP; k > 0; k--)
+        view_line(off, 0, NULL, 0, &off);
+    return off;
+}
+
+static int view_index_add(UINT64 off) {
+    if (s_view_index_len >= s_view_index_cap) {
+        UINTN cap = s_view_index_cap ? s_view_index_cap * 2 : 1024;
+        UINT64 *n = (UINT64 *)mem_alloc(cap * sizeof(UINT64));
+        if (!n)
+            return -1;
+        if (s_view_index) {
+            mem_copy(n, s_view_index, s_view_index_len * sizeof(UINT64));
+            mem_free(s_view_index);
+        }
+        s_view_index = n;
+        s_view_index_cap = cap;
+    }
+    s_view_index[s_view_index_len++] = off;
+    return 0;
+}
+
+static void view_progress(UINT64 done) {
+    char line[256], num[24];
+    int i = 0;
+    view_append(line, &i, " Indexing lines... ");
+    u64_to_str(done >> 20, num);
+    view_append(line, &i, num);
+    view_append(line, &i, " of ");
+    u64_to_str(s_view_size >> 20, num);
+    view_append(line, &i, num);
+    view_append(line, &i, " MB  (ESC: cancel)");
+    line[i] = '\0';
+    pad_line(line, (int)g_boot.cols);
+    fb_string(0, g_boot.rows - 2, line, COLOR_GRAY, COLOR_BLACK);
+    fb_present();
+}
+
+/*
+ * The streaming pass: count lines with the same rules as view_line()
+ * and record every VIEW_STEP-th start.  Returns 0 when done, 1 if ESC
+ * was pressed, -1 on a read error or out of memory.
+ */
+static int view_build_index(void) {
+    char *buf = s_view_pages[0].data;
+    UINT64 pos = 0, report = 0;
+    UINT64 lines = 1;
+    int len = 0, after_cr = 0, at_start = 0;
+    char last = 0;
+
+    if (view_index_add(0) != 0 || fs_stream_seek(s_view_file, 0) != 0)
+        return -1;
+
+    for (;;) {
+        UINTN got = VIEW_PAGE;
+        if (fs_stream_read(s_view_file, buf, &got) != 0)
+            return -1;
+        if (got == 0)
+            break;
+
+        for (UINTN i = 0; i < got; i++, pos++) {
+            char c = buf[i];
+            if (at_start) {
+                if (after_cr && c == '\n') {
+                    after_cr = 0;
+                    continue;
+                }
+                /* A new line starts at pos */
+                at_start = after_cr = 0;
+                if (lines % VIEW_STEP == 0 && view_index_add(pos) != 0)
+                    return -1;
+                lines++;
+            }
+            if (c == '\n' || c == '\r') {
+                at_start = 1;
+                after_cr = (c == '\r');
+                len = 0;
+            } else if (++len == VIEW_LINE_MAX) {
+                at_start = 1;
+                len = 0;
+            }
+        }
+        last = buf[got - 1];
+
+        if (pos >= report) {
+            struct key_event ev;
+            report = pos + (16 << 20);
+            view_progress(pos);
+            if (kbd_poll(&ev) && ev.code == KEY_ESC)
+                return 1;
+        }
+    }
+
+    /* A final line break is followed by one empty line, as in the
+       editor; a break cut by VIEW_LINE_MAX is not */
+    if (at_start && (last == '\n' || last == '\r')) {
+        if (lines % VIEW_STEP == 0 && view_index_add(pos) != 0)
+            return -1;
+        lines++;
+    }
+    s_view_size = pos;
+    s_view_lines = lines;
+    return 0;
+}
+
+static void view_draw_header(void) {
+    char line[256];
+    int i = 0;
+    view_append(line, &i, " SURVIVAL VIEWER - ");
+    view_append(line, &i, s_filename);
+    view_append(line, &i, " [VIEW]");
+    line[i] = '\0';
+    pad_line(line, (int)g_boot.cols);
+    fb_string(0, 0, line, COLOR_CYAN, COLOR_DGRAY);
+}
+
+static void view_draw_text(void) {
+    int cols = s_text_cols;
+    if (cols > 255) cols = 255;
+    UINT64 off = s_view_top_off;
+    for (int r = 0; r < s_text_rows; r++) {
+        char line[256];
+        int n = 0;
+        if (s_view_top + (UINT64)r < s_view_lines)
+            n = view_line(off, s_view_scroll_x, line, cols, &off);
+        mem_set(line + n, ' ', (UINTN)(cols - n));
+        line[cols] = '\0';
+        fb_string(0, (UINT32)(s_text_top + r), line, COLOR_WHITE, COLOR_BLACK);
+    }
+}
+
+static void view_draw_info(const char *msg) {
+    char line[256], num[24];
+    int i = 0;
+    if (msg) {
+        view_append(line, &i, " ");
+        view_append(line, &i, msg);
+    } else {
+        view_append(line, &i, " Line ");
+        u64_to_str(s_view_top + 1, num);
+        view_append(line, &i, num);
+        view_append(line, &i, " of ");
+        u64_to_str(s_view_lines, num);
+        view_append(line, &i, num);
+        if (s_view_scroll_x) {
+            view_append(line, &i, ", Col ");
+            u64_to_str((UINT64)s_view_scroll_x + 1, num);
+            view_append(line, &i, num);
+        }
+        if (s_view_error)
+            view_append(line, &i, "  [read error]");
+    }
+    line[i] = '\0';
+    pad_line(line, (int)g_boot.cols);
+    fb_string(0, g_boot.rows - 2, line, COLOR_GRAY, COLOR_BLACK);
+}
+
+static void view_draw_all(void) {
+    fb_clear(COLOR_BLACK);
+    view_draw_header();
+    view_draw_text();
+    view_draw_info(NULL);
+    draw_status(" Arrows/PgUp/PgDn:Scroll  Home/End  F4:Go to line  ESC:Exit");
+}
+
+/* Prompt for a line number on the info row. Returns 0 if cancelled. */
+static UINT64 view_prompt_line(void) {
+    char digits[21];
+    int n = 0;
+    for (;;) {
+        char line[256];
+        int i = 0;
+        digits[n] = '\0';
+        view_append(line, &i, " Go to line: ");
+        view_append(line, &i, digits);
+        view_append(line, &i, "_");
+        line[i] = '\0';
+        pad_line(line, (int)g_boot.cols);
+        fb_string(0, g_boot.rows - 2, line, COLOR_YELLOW, COLOR_BLACK);
+
+        struct key_event ev;
+        kbd_wait(&ev);
+        if (ev.code == KEY_ESC)
+            return 0;
+        if (ev.code == KEY_ENTER)
+            break;
+        if (ev.code == KEY_BS && n > 0)
+            n--;
+        else if (ev.code >= '0' && ev.code <= '9' && n < 19)
+            digits[n++] = (char)ev.code;
+    }
+    UINT64 v = 0;
+    for (int i = 0; i < n; i++)
+        v = v * 10 + (UINT64)(digits[i] - '0');
+    return v;
+}
+
+/* Scroll so that line is on top, keeping the last page full */
+static void view_scroll_to(UINT64 line) {
+    UINT64 rows = (UINT64)s_text_rows;
+    UINT64 max_top = s_view_lines > rows ? s_view_lines - rows : 0;
+    if (line > max_top)
+        line = max_top;
+    if (line == s_view_top + 1 && line != 0) {
+        UINT64 next;
+        view_line(s_view_top_off, 0, NULL, 0, &next);
+        s_view_top_off = next;
+    } else if (line != s_view_top) {
+        s_view_top_off = view_line_off(line);
+    }
+    s_view_top = line;
+}
+
+/* Returns 1 when the viewer should close */
+static int view_key(const struct key_event *ev) {
+    UINT64 rows = (UINT64)s_text_rows;
+    switch (ev->code) {
+    case KEY_ESC:
+    case KEY_F10:
+        return 1;
+    case KEY_UP:
+        if (s_view_top > 0)
+            view_scroll_to(s_view_top - 1);
+        break;
+    case KEY_DOWN:
+        view_scroll_to(s_view_top + 1);
+        break;
+    case KEY_PGUP:
+        view_scroll_to(s_view_top > rows ? s_view_top - rows : 0);
+        break;
+    case KEY_PGDN:
+        view_scroll_to(s_view_top + rows);
+        break;
+    case KEY_HOME:
+        s_view_scroll_x = 0;
+        view_scroll_to(0);
+        break;
+    case KEY_END:
+        view_scroll_to(s_view_lines);
+        break;
+    case KEY_LEFT:
+        s_view_scroll_x -= VIEW_HSTEP;
+        if (s_view_scroll_x < 0) s_view_scroll_x = 0;
+        break;
+    case KEY_RIGHT:
+        if (s_view_scroll_x + VIEW_HSTEP < VIEW_LINE_MAX)
+            s_view_scroll_x += VIEW_HSTEP;
+        break;
+    case KEY_F4:
+    case 0x07: { /* Ctrl+G */
+        UINT64 line = view_prompt_line();
+        if (line > 0)
+            view_scroll_to(line - 1);
+        break;
+    }
+    }
+    return 0;
+}
+
+static void view_close(void) {
+    if (s_view_file)
+        fs_stream_close(s_view_file);
+    for (int i = 0; i < VIEW_PAGES; i++) {
+        if (s_view_pages[i].data)
+            mem_free(s_view_pages[i].data);
+        s_view_pages[i].data = NULL;
+        s_view_pages[i].len = 0;
+    }
+    if (s_view_index)
+        mem_free(s_view_index);
+    s_view_file = NULL;
+    s_view_index = NULL;
+    s_view_index_len = s_view_index_cap = 0;
+    s_view_last = NULL;
+}
+
+/* View s_filepath read-only */
+static void view_session(void) {
+    s_view_error = 0;
+    s_view_top = s_view_top_off = 0;
+    s_view_scroll_x = 0;
+    s_view_file = fs_open_read(NULL, s_filepath, &s_view_size);
+    int ok = s_view_file != NULL;
+    for (int i = 0; ok && i < VIEW_PAGES; i++) {
+        s_view_pages[i].data = (char *)mem_alloc(VIEW_PAGE);
+        s_view_pages[i].len = 0;
+        s_view_pages[i].used = 0;
+        if (!s_view_pages[i].data)
+            ok = 0;
+    }
+
+    fb_clear(COLOR_BLACK);
+    view_draw_header();
+    draw_status(" ESC:Cancel");
+    int r = ok ? view_build_index() : -1;
+    if (r != 0) {
+        view_close();
+        if (r < 0) {
+            view_draw_info("Cannot read file. Press any key.");
+            struct key_event ev;
+            kbd_wait(&ev);
+        }
+        return;
+    }
+
+    view_draw_all();
+    struct key_event ev;
+    for (;;) {
+        kbd_wait(&ev);
+        kbd_frame_begin();
+        int done = 0;
+        do {
+            done = view_key(&ev);
+            if (done || ev.code == KEY_F4 || ev.code == 0x07)
+                break;
+        } while (kbd_frame_next(&ev));
+        if (done)
+            break;
+        view_draw_text();
+        view_draw_info(NULL);
+    }
+    view_close();
+}
+
+/* ---- Background check ---- */
+
+/*
+ * Once typing pauses for CHECK_PAUSE_MS, a .c file is compiled from the
+ * buffer with -fsyntax-only: parsed and type-checked with F5's flags,
+ * or a workstation unit's rebuild flags and include paths, but no code
+ * is generated, relocated or written. Headers come through the shim,
+ * which keeps what it read cached between checks. TinyCC polls
+ * kbd_pending() as it goes and the check is dropped at the first key,
+ * to run again at the next pause. Lines with a message are marked in
+ * the gutter and the info line shows it while the cursor is on one.
+ */
+#define CHECK_PAUSE_MS 300
+
+static const char *s_run_include_paths[] = { "/include", NULL };
+
+struct check_hit {
+    int line;                   /* from 1 */
+    struct edit_diag d;
+};
+
+static struct check_hit s_check_hits[DIAG_MAX];
+static int    s_check_count;
+static UINT32 s_check_gen;      /* s_doc_gen as last checked */
+static int    s_check_stopped;
+static char   s_check_path[EDIT_MAX_PATH];
+static struct ev_handler s_check_timer;
+
+/* A new file: the gutter for .c files, checked at the first pause */
+static void check_reset(void) {
+    s_gutter = is_c_file();
+    s_text_cols = (int)g_boot.cols - s_gutter;
+    s_diag_count = 0;
+    s_check_gen = s_doc_gen - 1;
+}
+
+static int path_ieq(const char *a, const char *b) {
+    for (;; a++, b++) {
+        char x = (*a >= 'A' && *a <= 'Z') ? (char)(*a + 32) : *a;
+        char y = (*b >= 'A' && *b <= 'Z') ? (char)(*b + 32) : *b;
+        if (x != y) return 0;
+        if (!x) return 1;
+    }
+}
+
+/* "<s_check_path>:<line>" at p: the line, else -1 */
+static int check_line_at(const char *p) {
+    int n = (int)str_len((CHAR8 *)s_check_path);
+    if (mem_cmp(p, s_check_path, (UINTN)n) != 0 || p[n] != ':')
+        return -1;
+    int line = 0;
+    for (p += n + 1; *p >= '0' && *p <= '9'; p++)
+        line = line * 10 + (*p - '0');
+    return line;
+}
+
+/* One message: "file:line: error: text", after an "In file included
+   from file:line:" line per header level when it is in a header, and
+   then this file's include takes the mark */
+static void check_error_handler(void *opaque, const char *msg) {
+    (void)opaque;
+    if (s_check_stopped || s_check_count >= DIAG_MAX)
+        return;
+    static const char inc[] = "In file included from ";
+    int line = -1;
+    if (mem_cmp(msg, inc, sizeof(inc) - 1) == 0)
+        line = check_line_at(msg + sizeof(inc) - 1);
+    const char *last = msg;
+    for (const char *p = msg; *p; p++)
+        if (*p == '\n' && p[1]) last = p + 1;
+    if (line < 0)
+        line = check_line_at(last);
+    if (line <= 0)
+        return;
+
+    struct check_hit *h = &s_check_hits[s_check_count];
+    const char *text = last;
+    h->d.error = 1;
+    for (const char *p = last; *p; p++) {
+        if (mem_cmp(p, ": error: ", 9) == 0) {
+            text = p + 9;
+            break;
+        }
+        if (mem_cmp(p, ": warning: ", 11) == 0) {
+            text = p + 11;
+            h->d.error = 0;
+            break;
+        }
+    }
+    str_copy(h->d.text, text, DIAG_TEXT);
+    h->line = line;
+    s_check_count++;
+}
+
+static int check_poll(void *opaque) {
+    (void)opaque;
+    if (kbd_pending())
+        s_check_stopped = 1;
+    return s_check_stopped;
+}
+
+/* Mark the lines of a check that ran to its end, errors over warnings */
+static void check_apply(void) {
+    for (int i = 0; i < s_line_count; i++)
+        doc_at(i)->diag = 0;
+    s_diag_count = 0;
+    for (int k = 0; k < s_check_count; k++) {
+        const struct check_hit *h = &s_check_hits[k];
+        int y = h->line - 1;
+        if (y >= s_line_count) y = s_line_count - 1;
+        struct edit_line *ln = doc_at(y);
+        if (ln->diag && (s_diag[ln->diag - 1].error || !h->d.error))
+            continue;
+        s_diag[s_diag_count] = h->d;
+        ln->diag = (UINT8)(++s_diag_count);
+    }
+}
+
+static void check_run(void) {
+    UINT32 gen = s_doc_gen;
+    UINTN size = 0;
+    char *source = doc_serialize(&size);
+    if (!source)
+        return;
+
+    sym_cur_path(s_check_path, EDIT_MAX_PATH);
+    const char *flags = "-nostdlib -nostdinc";
+    const char **paths = s_run_include_paths;
+    for (const struct rebuild_unit *u = s_units; u->src; u++) {
+        if (path_ieq(u->src, s_check_path)) {
+            flags = s_unit_flags[u->kind];
+            paths = s_include_paths;
+            break;
+        }
+    }
+
+    TCCState *tcc = tcc_arena_new();
+    if (!tcc) {
+        mem_free(source);
+        return;
+    }
+    s_check_stopped = 0;
+    s_check_count = 0;
+    UINT64 t0 = timer_ticks();
+    tcc_set_error_func(tcc, NULL, check_error_handler);
+    tcc_set_options(tcc, flags);
+    tcc_set_options(tcc, "-fsyntax-only");
+    tcc_set_output_type(tcc, TCC_OUTPUT_OBJ);
+    for (int k = 0; paths[k]; k++)
+        tcc_add_include_path(tcc, paths[k]);
+    tcc_set_poll(tcc, NULL, check_poll);
+    tcc_compile_string_file(tcc, source, s_check_path);
+    tcc_arena_delete(tcc);
+    mem_free(source);
+    trace_mark(s_check_stopped ? "check-stopped" : "check",
+               timer_us(timer_ticks() - t0), (UINT64)s_check_count, s_filename);
+    if (s_check_stopped)
+        return;
+
+    s_check_gen = gen;
+    check_apply();
+    draw_text();
+    draw_info(NULL);
+}
+
+/* CHECK_PAUSE_MS after the last key */
+static int check_fire(void *arg) {
+    (void)arg;
+    ev_remove(&s_check_timer);
+    if (!kbd_pending())
+        check_run();
+    return 0;
+}
+
+/* ---- Buffers ---- */
+
+/*
+ * Up to EDIT_BUFS files stay loaded: the one in use in the globals
+ * above, the others parked here with all that goes with them (lines
+ * and their cached colours, cursor and scroll, selection, the check's
+ * marks and the typedef names found), so going back to one costs no
+ * load, no state pass and no check. F4 goes back to the last one and
+ * Shift+F4 lists them; leaving the editor keeps them, without changes,
+ * for the next time one of those files is opened. One without changes
+ * whose file has since changed on disk (doc_fresh()) is loaded again;
+ * one with changes is never replaced from disk.
+ */
+#define EDIT_BUFS 4
+
+struct edit_words {
+    struct hl_word words[HL_WORD_SLOTS];
+    int  user_types;
+    char pool[HL_USER_POOL];
+    int  pool_len;
+};
+
+struct edit_buf {
+    int    used;
+    UINT32 last_use;                /* s_buf_clock when last in use */
+    const void *vol;                /* fs_volume_key() it was opened on */
+    struct doc_stamp stamp;
+    struct edit_line *lines;        /* as s_lines .. s_filename */
+    int    line_cap, gap, line_count;
+    char  *file;
+    struct edit_text **texts;
+    int    text_count, text_cap;
+    int    crlf, cx, cy, scroll_x, scroll_y, modified;
+    int    sel_active, sel_anchor_y, sel_anchor_x;
+    int    highlight_mode, hl_lo, hl_hi;
+    struct edit_words *words;       /* NULL: harvested again */
+    struct edit_diag diag[DIAG_MAX];
+    int    diag_count, gutter;
+    int    checked;                 /* checked since its last edit */
+    CHAR16 filepath[EDIT_MAX_PATH];
+    char   filename[128];
+};
+
+static struct edit_buf s_bufs[EDIT_BUFS];
+static int    s_buf = -1;           /* slot of the file in use, -1 none */
+static UINT32 s_buf_clock;
+
+static struct edit_line *buf_line(struct edit_buf *b, int idx) {
+    return &b->lines[idx < b->gap ? idx : idx + (b->line_cap - b->line_count)];
+}
+
+/* Move the file in use out to b, leaving the globals empty */
+static void buf_park(struct edit_buf *b) {
+    b->lines = s_lines;
+    b->line_cap = s_line_cap;
+    b->gap = s_gap;
+    b->line_count = s_line_count;
+    b->file = s_file;
+    b->texts = s_texts;
+    b->text_count = s_text_count;
+    b->text_cap = s_text_cap;
+    b->crlf = s_crlf;
+    b->cx = s_cx;
+    b->cy = s_cy;
+    b->scroll_x = s_scroll_x;
+    b->scroll_y = s_scroll_y;
+    b->modified = s_modified;
+    b->sel_active = s_sel_active;
+    b->sel_anchor_y = s_sel_anchor_y;
+    b->sel_anchor_x = s_sel_anchor_x;
+    b->highlight_mode = s_highlight_mode;
+    b->hl_lo = s_hl_lo;
+    b->hl_hi = s_hl_hi;
+    mem_copy(b->diag, s_diag, sizeof(s_diag));
+    b->diag_count = s_diag_count;
+    b->gutter = s_gutter;
+    b->checked = s_check_gen == s_doc_gen;
+    b->stamp = s_stamp;
+    mem_copy(b->filepath, s_filepath, sizeof(s_filepath));
+    mem_copy(b->filename, s_filename, sizeof(s_filename));
+
+    /* Keeping the names found saves harvesting every line again */
+    b->words = NULL;
+    if (s_highlight_mode && s_words_ready) {
+        b->words = (struct edit_words *)mem_alloc(sizeof(struct edit_words));
+        if (b->words) {
+            mem_copy(b->words->words, s_words, sizeof(s_words));
+            b->words->user_types = s_user_types;
+            mem_copy(b->words->pool, s_user_pool, (UINTN)s_user_pool_len);
+            b->words->pool_len = s_user_pool_len;
+        }
+    }
 
-    tcc_set_error_func(tcc, NULL, rebuild_error_handler);
-    tcc_set_options(tcc, "-nostdlib -nostdinc -Werror"
-                        " -Wl,-subsystem=efiapp -Wl,-e=efi_main");
-    tcc_set_output_type(tcc, TCC_OUTPUT_DLL);
+    s_lines = NULL;
+    s_file = NULL;
+    s_texts = NULL;
+    s_text_count = s_text_cap = 0;
+    s_line_cap = s_line_count = s_gap = 0;
+    s_hl_lo = -1;
+}
 
-    /* Include paths: our stub headers, then source dir */
-    tcc_add_include_path(tcc, "/src/tcc-headers");
-    tcc_add_include_path(tcc, "/src");
-    tcc_add_include_path(tcc, "/tools/tinycc");
+/* Make b's file the one in use; b keeps only its slot */
+static void buf_unpark(struct edit_buf *b) {
+    s_lines = b->lines;
+    s_line_cap = b->line_cap;
+    s_gap = b->gap;
+    s_line_count = b->line_count;
+    s_file = b->file;
+    s_texts = b->texts;
+    s_text_count = b->text_count;
+    s_text_cap = b->text_cap;
+    s_crlf = b->crlf;
+    s_cx = b->cx;
+    s_cy = b->cy;
+    s_scroll_x = b->scroll_x;
+    s_scroll_y = b->scroll_y;
+    s_modified = b->modified;
+    s_sel_active = b->sel_active;
+    s_sel_anchor_y = b->sel_anchor_y;
+    s_sel_anchor_x = b->sel_anchor_x;
+    s_highlight_mode = b->highlight_mode;
+    s_hl_lo = b->hl_lo;
+    s_hl_hi = b->hl_hi;
+    mem_copy(s_diag, b->diag, sizeof(s_diag));
+    s_diag_count = b->diag_count;
+    s_gutter = b->gutter;
+    s_text_cols = (int)g_boot.cols - s_gutter;
+    s_check_gen = b->checked ? s_doc_gen : s_doc_gen - 1;
+    s_stamp = b->stamp;
+    mem_copy(s_filepath, b->filepath, sizeof(s_filepath));
+    mem_copy(s_filename, b->filename, sizeof(s_filename));
+
+    if (b->words) {
+        mem_copy(s_words, b->words->words, sizeof(s_words));
+        s_user_types = b->words->user_types;
+        mem_copy(s_user_pool, b->words->pool, (UINTN)b->words->pool_len);
+        s_user_pool_len = b->words->pool_len;
+        s_words_ready = 1;
+        mem_free(b->words);
+        b->words = NULL;
+    } else {
+        /* Another file's names are in the table: find this one's */
+        s_words_ready = 0;
+        s_hl_lo = 0;
+        s_hl_hi = s_line_count - 1;
+    }
 
-    /* Compile each workstation source file */
-    for (int i = 0; sources[i]; i++) {
-        fb_print("  Compiling ", COLOR_WHITE);
-        fb_print(sources[i], COLOR_YELLOW);
-        fb_print("...\n", COLOR_WHITE);
+    b->lines = NULL;
+    b->file = NULL;
+    b->texts = NULL;
+    b->line_count = b->text_count = 0;
+}
 
-        if (tcc_add_file(tcc, sources[i]) < 0) {
-            fb_print("\n  BUILD FAILED\n", COLOR_RED);
-            tcc_delete(tcc);
-            goto wait;
-        }
+/* Free a parked file and its slot */
+static void buf_free(struct edit_buf *b) {
+    for (int i = 0; i < b->line_count; i++)
+        line_free(buf_line(b, i));
+    if (b->lines)
+        mem_free(b->lines);
+    if (b->file)
+        mem_free(b->file);
+    for (int i = 0; i < b->text_count; i++)
+        text_put(b->texts[i]);
+    if (b->texts)
+        mem_free(b->texts);
+    if (b->words)
+        mem_free(b->words);
+    mem_set(b, 0, sizeof(*b));
+}
+
+/* Drop the parked files' cached colours, before those on screen */
+static void bufs_spans_drop(void) {
+    for (int k = 0; k < EDIT_BUFS; k++)
+        for (int i = 0; i < s_bufs[k].line_count; i++)
+            line_spans_drop(buf_line(&s_bufs[k], i));
+}
+
+/* Park the file in use, if any */
+static void buf_leave(void) {
+    if (s_buf < 0)
+        return;
+    buf_park(&s_bufs[s_buf]);
+    s_buf = -1;
+}
+
+static void buf_enter(int k) {
+    buf_leave();
+    buf_unpark(&s_bufs[k]);
+    s_buf = k;
+    s_bufs[k].last_use = ++s_buf_clock;
+}
+
+/* Close the file in use, changes and all */
+static void buf_close(void) {
+    doc_clear();
+    if (s_buf >= 0)
+        mem_set(&s_bufs[s_buf], 0, sizeof(s_bufs[0]));
+    s_buf = -1;
+}
+
+/* The slot holding path on the current volume, or -1 */
+static int buf_find(const CHAR16 *path) {
+    const void *vol = fs_volume_key();
+    for (int k = 0; k < EDIT_BUFS; k++) {
+        struct edit_buf *b = &s_bufs[k];
+        if (b->used && b->vol == vol &&
+            path_eq(k == s_buf ? s_filepath : b->filepath, path))
+            return k;
+    }
+    return -1;
+}
+
+/* A free slot, made by freeing the parked file without changes used
+   longest ago if need be. -1 when all the others have changes. */
+static int buf_slot(void) {
+    int old = -1;
+    for (int k = 0; k < EDIT_BUFS; k++) {
+        struct edit_buf *b = &s_bufs[k];
+        if (!b->used)
+            return k;
+        if (k != s_buf && !b->modified &&
+            (old < 0 || b->last_use < s_bufs[old].last_use))
+            old = k;
     }
+    if (old >= 0)
+        buf_free(&s_bufs[old]);
+    return old;
+}
 
-    /* Compile TCC library (unity build) — suppress warnings for TCC source */
-    tcc_set_options(tcc, "-w");
-    tcc_define_symbol(tcc, "__UEFI__", "1");
+/* Make the file at path on the current volume the one in use: its
+   buffer if it has one that still holds it, else loaded into a free
+   slot. Returns 0, or -1 when every buffer has changes. */
+static int buf_open(const CHAR16 *path) {
+    CHAR16 want[EDIT_MAX_PATH];
+    int i = 0;
+    for (; path[i] && i < EDIT_MAX_PATH - 1; i++)
+        want[i] = path[i];
+    want[i] = 0;
 
-    fb_print("  Compiling ", COLOR_WHITE);
-    fb_print("/tools/tinycc/libtcc.c", COLOR_YELLOW);
-    fb_print("...\n", COLOR_WHITE);
-    if (tcc_add_file(tcc, "/tools/tinycc/libtcc.c") < 0) {
-        fb_print("\n  BUILD FAILED (TCC library)\n", COLOR_RED);
-        tcc_delete(tcc);
-        goto wait;
+    int k = buf_find(want);
+    if (k >= 0 && k == s_buf)
+        return 0;
+    if (k >= 0 && !s_bufs[k].modified &&
+        !doc_fresh(&s_bufs[k].stamp, want)) {
+        buf_free(&s_bufs[k]);
+        k = -1;
+    }
+    if (k >= 0) {
+        buf_enter(k);
+        return 0;
     }
 
-    /* Compile setjmp/longjmp */
-#ifdef __aarch64__
-    fb_print("  Compiling /src/setjmp_aarch64.c...\n", COLOR_WHITE);
-    if (tcc_add_file(tcc, "/src/setjmp_aarch64.c") < 0) {
-#else
-    fb_print("  Compiling /src/setjmp_x86_64.S...\n", COLOR_WHITE);
-    if (tcc_add_file(tcc, "/src/setjmp_x86_64.S") < 0) {
-#endif
-        fb_print("\n  BUILD FAILED (setjmp)\n", COLOR_RED);
-        tcc_delete(tcc);
-        goto wait;
+    k = buf_slot();
+    if (k < 0) {
+        if (s_buf < 0 || s_modified)
+            return -1;
+        k = s_buf;                  /* the one in use makes way */
+        buf_close();
     }
+    buf_leave();
+    struct edit_buf *b = &s_bufs[k];
+    b->used = 1;
+    b->vol = fs_volume_key();
+    b->last_use = ++s_buf_clock;
+    s_buf = k;
+
+    mem_copy(s_filepath, want, sizeof(want));
+    int base = 0;
+    for (int c = 0; s_filepath[c]; c++)
+        if (s_filepath[c] == L'\\') base = c + 1;
+    for (i = 0; s_filepath[base + i] && i < (int)sizeof(s_filename) - 1; i++)
+        s_filename[i] = (char)(s_filepath[base + i] & 0x7F);
+    s_filename[i] = '\0';
+    s_cx = s_cy = 0;
+    s_scroll_x = s_scroll_y = 0;
+    s_modified = 0;
+    s_sel_active = 0;
+    s_highlight_mode = is_c_or_h_file();
+    doc_load();
+    check_reset();
+    return 0;
+}
 
-    fb_print("\n  Linking...\n", COLOR_WHITE);
+/* A parked buffer of the current volume with changes, or -1 */
+static int buf_changed(void) {
+    const void *vol = fs_volume_key();
+    for (int k = 0; k < EDIT_BUFS; k++)
+        if (k != s_buf && s_bufs[k].used && s_bufs[k].vol == vol &&
+            s_bufs[k].modified)
+            return k;
+    return -1;
+}
 
-    /* Generate PE output */
-    if (tcc_output_file(tcc, out_path) < 0) {
-        fb_print("  Output failed\n", COLOR_RED);
-        tcc_delete(tcc);
-        goto wait;
+/* ESC or F10: each buffer with changes is shown and saved or discarded
+   first, the one in use first; cancelling stays on that one. The rest
+   stay loaded. Returns 1 to leave. */
+static int handle_quit(void) {
+    for (;;) {
+        if (s_buf >= 0 && s_modified) {
+            if (!handle_exit())
+                return 0;
+            if (s_modified)
+                buf_close();        /* discarded */
+        }
+        int k = buf_changed();
+        if (k < 0)
+            break;
+        buf_enter(k);
+        draw_all();
     }
+    buf_leave();
+    return 1;
+}
 
-    tcc_delete(tcc);
+/* F4: back to the file in use before this one */
+static void handle_buf_prev(void) {
+    const void *vol = fs_volume_key();
+    int k = -1;
+    for (int i = 0; i < EDIT_BUFS; i++)
+        if (i != s_buf && s_bufs[i].used && s_bufs[i].vol == vol &&
+            (k < 0 || s_bufs[i].last_use > s_bufs[k].last_use))
+            k = i;
+    if (k < 0) {
+        draw_info("No other file open");
+        return;
+    }
+    buf_open(s_bufs[k].filepath);
+    draw_all();
+}
+
+/* Shift+F4: choose one of the open files, latest first */
+static void handle_buf_pick(void) {
+    const void *vol = fs_volume_key();
+    int list[EDIT_BUFS], n = 0;
+    for (int i = 0; i < EDIT_BUFS; i++)
+        if (s_bufs[i].used && s_bufs[i].vol == vol)
+            list[n++] = i;
+    for (int i = 1; i < n; i++)
+        for (int j = i; j > 0 && s_bufs[list[j]].last_use >
+                                 s_bufs[list[j - 1]].last_use; j--) {
+            int t = list[j];
+            list[j] = list[j - 1];
+            list[j - 1] = t;
+        }
+
+    int sel = n > 1 ? 1 : 0;
+    draw_status(" Up/Down:Choose  Enter:Open  ESC:Cancel");
+    for (;;) {
+        for (int r = 0; r < s_text_rows; r++) {
+            char line[256];
+            line[0] = '\0';
+            if (r < n) {
+                const struct edit_buf *b = &s_bufs[list[r]];
+                int cur = list[r] == s_buf;
+                const CHAR16 *p = cur ? s_filepath : b->filepath;
+                char path[EDIT_MAX_PATH];
+                int i = 0;
+                for (; p[i] && i < EDIT_MAX_PATH - 1; i++)
+                    path[i] = (char)(p[i] & 0x7F);
+                path[i] = '\0';
+                snprintf(line, sizeof(line), " %c %-24s %s",
+                         (cur ? s_modified : b->modified) ? '*' : ' ',
+                         cur ? s_filename : b->filename, path);
+            }
+            pad_line(line, (int)g_boot.cols);
+            fb_string(0, (UINT32)(s_text_top + r), line,
+                      r == sel ? COLOR_BLACK : COLOR_WHITE,
+                      r == sel ? COLOR_CYAN : COLOR_BLACK);
+        }
+        draw_info(" Open files:");
+        fb_present();
 
-    fb_print("\n", COLOR_GREEN);
-    fb_print("  ========================================\n", COLOR_GREEN);
-    fb_print("    BUILD COMPLETE!\n", COLOR_GREEN);
-    fb_print("  ========================================\n", COLOR_GREEN);
-    fb_print("\n  Written to: ", COLOR_WHITE);
-    fb_print(out_path, COLOR_YELLOW);
-    fb_print("\n\n  Press R to reboot now, any other key for editor.\n", COLOR_YELLOW);
-    {
         struct key_event ev;
         kbd_wait(&ev);
-        if (ev.code == 'R' || ev.code == 'r') {
-            fb_print("\n  Rebooting...\n", COLOR_CYAN);
-            g_boot.rs->ResetSystem(EfiResetCold, 0, 0, NULL);
+        if (ev.code == KEY_ESC) break;
+        if (ev.code == KEY_ENTER) {
+            if (list[sel] != s_buf)
+                buf_open(s_bufs[list[sel]].filepath);
+            break;
         }
+        if (ev.code == KEY_UP && sel > 0) sel--;
+        else if (ev.code == KEY_DOWN && sel < n - 1) sel++;
     }
     draw_all();
-    return;
+}
 
-wait:
-    /* Re-print error summary so it's visible at bottom of screen */
-    if (s_rebuild_err_pos > 0) {
-        fb_print("\n  ---- Error Summary ----\n", COLOR_RED);
-        fb_print(s_rebuild_err, COLOR_RED);
+/* ---- Symbols ---- */
+
+/*
+ * F12 goes to the definition of the name at the cursor and Ctrl+T to
+ * any symbol by part of its name, both answered from the symbol index
+ * (symidx.h), which the editor keeps current while it waits for keys.
+ * Where either jumped from is kept; Shift+F12 goes back.
+ */
+#define SYM_PICK_MAX 64
+#define MARK_MAX     16
+
+struct edit_mark {
+    CHAR16 path[EDIT_MAX_PATH];
+    int y, x;
+};
+
+static struct edit_mark s_marks[MARK_MAX];
+static int s_mark_count;
+static struct ev_handler s_sym_idle;
+
+/* Shown in the info bar by the redraw after the key */
+static void sym_note(const char *msg) {
+    s_info_note[0] = '\0';
+    note_append(msg);
+}
+
+static int sym_idle(void *arg) {
+    (void)arg;
+    return symidx_step() != SYMIDX_IDLE;
+}
+
+static void mark_push(void) {
+    if (s_mark_count == MARK_MAX) {
+        for (int i = 1; i < MARK_MAX; i++)
+            s_marks[i - 1] = s_marks[i];
+        s_mark_count--;
     }
-    fb_print("\n  Press any key to return to editor...\n", COLOR_DGRAY);
-    {
+    struct edit_mark *m = &s_marks[s_mark_count++];
+    for (int i = 0; i < EDIT_MAX_PATH; i++)
+        if (!(m->path[i] = s_filepath[i])) break;
+    m->y = s_cy;
+    m->x = s_cx;
+}
+
+/* Go to row y, column x of the file at path, in a buffer of its own
+   (this one stays loaded). Returns 0 when there. */
+static int goto_place(const CHAR16 *path, int y, int x, int mark) {
+    int same = path_eq(path, s_filepath);
+    if (!same && buf_find(path) < 0) {
+        if (!fs_exists(path)) {
+            sym_note("File not found");
+            return -1;
+        }
+        if (fs_file_size(path) > VIEW_MIN_SIZE) {
+            sym_note("File too large for the editor");
+            return -1;
+        }
+    }
+    if (mark) mark_push();
+    if (!same && buf_open(path) != 0) {
+        if (mark) s_mark_count--;
+        sym_note("Every open file has changes: save one first");
+        return -1;
+    }
+    s_sel_active = 0;
+    s_cy = y < 0 ? 0 : y >= s_line_count ? s_line_count - 1 : y;
+    int len = (int)doc_at(s_cy)->len;
+    s_cx = x < 0 ? 0 : x > len ? len : x;
+    s_scroll_y = s_cy - s_text_rows / 3;
+    if (s_scroll_y < 0) s_scroll_y = 0;
+    scroll_to_cursor();
+    draw_all();
+    return 0;
+}
+
+static void goto_sym(const struct sym *s) {
+    CHAR16 w[EDIT_MAX_PATH];
+    const char *p = symidx_path(s);
+    int i = 0;
+    for (; p[i] && i < EDIT_MAX_PATH - 1; i++)
+        w[i] = p[i] == '/' ? L'\\' : (CHAR16)p[i];
+    w[i] = 0;
+    goto_place(w, (int)s->line - 1, 0, 1);
+}
+
+/* Choose one of n symbols from a list over the text. Returns its
+   index, or -1 on ESC. */
+static int sym_pick(const char *title, const struct sym **list, int n) {
+    int sel = 0, top = 0;
+    draw_status(" Up/Down:Choose  Enter:Go  ESC:Cancel");
+    for (;;) {
+        if (sel < top) top = sel;
+        if (sel >= top + s_text_rows) top = sel - s_text_rows + 1;
+        for (int r = 0; r < s_text_rows; r++) {
+            char line[256];
+            int k = top + r;
+            line[0] = '\0';
+            if (k < n)
+                snprintf(line, sizeof(line), " %-32s %-7s %s:%u",
+                         list[k]->name, symidx_kind_name(list[k]->kind),
+                         symidx_path(list[k]), list[k]->line);
+            pad_line(line, (int)g_boot.cols);
+            fb_string(0, (UINT32)(s_text_top + r), line,
+                      k == sel ? COLOR_BLACK : COLOR_WHITE,
+                      k == sel ? COLOR_CYAN : COLOR_BLACK);
+        }
+        draw_info(title);
+        fb_present();
+
         struct key_event ev;
         kbd_wait(&ev);
+        if (ev.code == KEY_ESC) return -1;
+        if (ev.code == KEY_ENTER) return sel;
+        if (ev.code == KEY_UP && sel > 0) sel--;
+        else if (ev.code == KEY_DOWN && sel < n - 1) sel++;
+        else if (ev.code == KEY_PGUP) sel = sel > s_text_rows ? sel - s_text_rows : 0;
+        else if (ev.code == KEY_PGDN) sel = sel + s_text_rows < n ? sel + s_text_rows : n - 1;
+        else if (ev.code == KEY_HOME) sel = 0;
+        else if (ev.code == KEY_END) sel = n - 1;
+    }
+}
+
+/* Definitions over declarations when there are any, this file's
+   first. Returns the count kept. */
+static int sym_rank(const struct sym **hits, int n) {
+    int defs = 0;
+    while (defs < n && hits[defs]->kind != SYM_DECL) defs++;
+    if (defs) n = defs;
+    char cur[EDIT_MAX_PATH];
+    sym_cur_path(cur, EDIT_MAX_PATH);
+    int front = 0;
+    for (int i = 0; i < n; i++) {
+        if (str_cmp((const CHAR8 *)symidx_path(hits[i]), (const CHAR8 *)cur) != 0)
+            continue;
+        const struct sym *h = hits[i];
+        for (int k = i; k > front; k--) hits[k] = hits[k - 1];
+        hits[front++] = h;
+    }
+    return n;
+}
+
+/* Go to one of n hits, choosing from a list if there are several */
+static void sym_go(const char *title, const struct sym **hits, int n) {
+    int k = n == 1 ? 0 : sym_pick(title, hits, n);
+    if (k >= 0)
+        goto_sym(hits[k]);
+    else
+        draw_all();
+}
+
+static int is_ident_char(char c) {
+    return is_ident_start(c) || (c >= '0' && c <= '9');
+}
+
+/* F12: to the definition of the name at the cursor */
+static void handle_goto_def(void) {
+    struct edit_line *ln = doc_at(s_cy);
+    int a = s_cx, b = s_cx;
+    while (a > 0 && is_ident_char(ln->data[a - 1])) a--;
+    while (b < (int)ln->len && is_ident_char(ln->data[b])) b++;
+    if (b == a || b - a >= SYMIDX_NAME || !is_ident_start(ln->data[a])) {
+        sym_note("No name at the cursor");
+        return;
+    }
+    char name[SYMIDX_NAME];
+    mem_copy(name, ln->data + a, (UINTN)(b - a));
+    name[b - a] = '\0';
+
+    const struct sym *hits[SYM_PICK_MAX];
+    int n = symidx_lookup(name, hits, SYM_PICK_MAX);
+    if (n == 0) {
+        /* Not known yet: the index may still be catching up */
+        draw_info("Indexing " SYMIDX_DIR "...");
+        fb_present();
+        symidx_finish();
+        n = symidx_lookup(name, hits, SYM_PICK_MAX);
+    }
+    if (n == 0) {
+        char msg[96];
+        snprintf(msg, sizeof(msg), "%s is not defined in " SYMIDX_DIR, name);
+        sym_note(msg);
+        return;
     }
+    sym_go(" Definitions:", hits, sym_rank(hits, n));
+}
+
+/* Ctrl+T: to a symbol by part of its name */
+static void handle_goto_symbol(void) {
+    char text[SYMIDX_NAME];
+    int len = 0;
+    int ok = edit_prompt(" Symbol: ", text, (int)sizeof(text), &len);
     draw_all();
+    if (!ok || len == 0)
+        return;
+    text[len] = '\0';
+    const struct sym *hits[SYM_PICK_MAX];
+    int n = symidx_search(text, hits, SYM_PICK_MAX);
+    if (n == 0) {
+        draw_info("Indexing " SYMIDX_DIR "...");
+        fb_present();
+        symidx_finish();
+        n = symidx_search(text, hits, SYM_PICK_MAX);
+    }
+    if (n == 0) {
+        sym_note("No symbol matches");
+        return;
+    }
+    sym_go(" Symbols:", hits, n);
+}
+
+/* Shift+F12: back to where the last jump left from */
+static void handle_goto_back(void) {
+    if (s_mark_count == 0) {
+        sym_note("Nowhere to go back to");
+        return;
+    }
+    const struct edit_mark *m = &s_marks[s_mark_count - 1];
+    if (goto_place(m->path, m->y, m->x, 0) == 0)
+        s_mark_count--;
 }
 
 /* ---- Public interface ---- */
 
-void edit_run(const CHAR16 *path, const char *filename) {
+/* What a key did, for the main loop's redraw */
+#define EDIT_KEY_EDIT  0    /* text or selection may have changed */
+#define EDIT_KEY_MOVE  1    /* cursor moved only */
+#define EDIT_KEY_MODAL 2    /* ran a prompt or screen of its own */
+#define EDIT_KEY_EXIT  3    /* leave the editor */
+
+static int edit_key(const struct key_event *ev) {
+    /* Remap CUA shortcuts to Ctrl equivalents */
+    UINT16 code = ev->code;
+    if (code == KEY_INS && (ev->modifiers & KMOD_SHIFT))
+        code = 0x16;  /* Shift+Insert → Ctrl+V (paste) */
+    else if (code == KEY_INS && (ev->modifiers & KMOD_CTRL))
+        code = 0x03;  /* Ctrl+Insert → Ctrl+C (copy) */
+    else if (code == KEY_DEL && (ev->modifiers & KMOD_SHIFT))
+        code = 0x18;  /* Shift+Delete → Ctrl+X (cut) */
+
+    switch (code) {
+    case KEY_F2:
+        if (fs_is_read_only()) {
+            draw_info("Volume is read-only");
+        } else {
+            handle_save();
+        }
+        return EDIT_KEY_MODAL;
+
+    case KEY_F5:
+        if (ev->modifiers & KMOD_SHIFT) {
+            handle_run_cache();
+        } else {
+            /* Ctrl profiles, Alt runs on an AP */
+            int flags = (ev->modifiers & KMOD_CTRL) ? TCC_RUN_PROFILE :
+                        (ev->modifiers & KMOD_ALT) ? TCC_RUN_AP : 0;
+            if (handle_project_run(flags) != 0)
+                handle_compile_run(flags);
+        }
+        return EDIT_KEY_MODAL;
+
+    case KEY_F6:
+        handle_rebuild();
+        return EDIT_KEY_MODAL;
+
+    case KEY_F7:
+        handle_build_app();
+        return EDIT_KEY_MODAL;
+
+    case KEY_F3:
+        if (s_sel_active) {
+            s_sel_active = 0;
+        } else {
+            s_sel_active = 1;
+            s_sel_anchor_y = s_cy;
+            s_sel_anchor_x = s_cx;
+        }
+        break;
+
+    case KEY_ESC:
+        if (s_sel_active) {
+            s_sel_active = 0;
+            break;
+        }
+        return handle_quit() ? EDIT_KEY_EXIT : EDIT_KEY_MODAL;
+
+    case KEY_F10:
+        return handle_quit() ? EDIT_KEY_EXIT : EDIT_KEY_MODAL;
+
+    case KEY_F4:
+        if (ev->modifiers & KMOD_SHIFT)
+            handle_buf_pick();
+        else
+            handle_buf_prev();
+        return EDIT_KEY_MODAL;
+
+    case 0x03: /* Ctrl+C — copy */
+        if (s_sel_active) {
+            sel_copy();
+            s_sel_active = 0;
+        } else {
+            handle_copy_line();
+        }
+        draw_info("Copied.");
+        break;
+
+    case 0x18: /* Ctrl+X — cut */
+        if (s_sel_active) {
+            sel_copy();
+            sel_delete_range();
+        } else {
+            handle_cut_line();
+        }
+        break;
+
+    case 0x16: /* Ctrl+V — paste */
+        sel_paste();
+        break;
+
+    case 0x06: /* Ctrl+F — find */
+        handle_find();
+        return EDIT_KEY_MODAL;
+
+    case 0x12: /* Ctrl+R — replace all */
+        handle_replace();
+        return EDIT_KEY_MODAL;
+
+    case 0x0B: /* Ctrl+K — cut line */
+        handle_cut_line();
+        break;
+
+    case KEY_F12:
+        if (ev->modifiers & KMOD_SHIFT)
+            handle_goto_back();
+        else
+            handle_goto_def();
+        return EDIT_KEY_MODAL;
+
+    case 0x14: /* Ctrl+T — go to symbol */
+        handle_goto_symbol();
+        return EDIT_KEY_MODAL;
+
+    case KEY_ENTER:
+        handle_enter();
+        break;
+
+    case KEY_BS:
+        handle_backspace();
+        break;
+
+    case KEY_DEL:
+        handle_delete();
+        break;
+
+    case KEY_TAB:
+        handle_tab();
+        break;
+
+    case KEY_UP:
+    case KEY_DOWN:
+    case KEY_LEFT:
+    case KEY_RIGHT:
+    case KEY_HOME:
+    case KEY_END:
+    case KEY_PGUP:
+    case KEY_PGDN:
+        handle_move(ev->code);
+        return EDIT_KEY_MOVE;
+
+    default:
+        if (ev->code >= 0x20 && ev->code <= 0x7E)
+            handle_char((char)ev->code);
+        break;
+    }
+    return EDIT_KEY_EDIT;
+}
+
+static void edit_session(const CHAR16 *path, const char *filename) {
     /* Build full filepath */
     int i = 0;
     while (path[i] && i < EDIT_MAX_PATH - 1) {
@@ -1231,148 +4977,57 @@ void edit_run(const CHAR16 *path, const char *filename) {
     s_text_rows = (int)g_boot.rows - 3;  /* header + info + status */
     s_text_cols = (int)g_boot.cols;
 
-    /* Init cursor */
-    s_cx = 0;
-    s_cy = 0;
-    s_scroll_x = 0;
-    s_scroll_y = 0;
-    s_modified = 0;
-    s_sel_active = 0;
-    s_highlight_mode = is_c_or_h_file();
+    if (fs_file_size(s_filepath) > VIEW_MIN_SIZE) {
+        view_session();
+        return;
+    }
 
-    /* Load file */
-    doc_load();
+    /* Its kept buffer, or loaded into one */
+    if (buf_open(s_filepath) != 0)
+        return;
+    s_mark_count = 0;
+    if (s_highlight_mode)
+        symidx_begin();     /* brought up to date while keys are awaited */
 
     /* Initial draw */
     draw_all();
+    trace_mark("edit", 0, 0, s_filename);
 
-    /* Main loop */
+    /* Main loop: apply every key queued within a frame, then redraw
+       once, so held or pasted keys never pile up behind the screen */
     struct key_event ev;
-    int prev_scroll_y = s_scroll_y;
-    int prev_scroll_x = s_scroll_x;
     for (;;) {
+        if (s_highlight_mode)
+            ev_add_idle(&s_sym_idle, EV_PRIO_LOW, sym_idle, NULL);
+        if (s_clip_dirty)
+            ev_add_idle(&s_clip_idle, EV_PRIO_LOW, clip_idle, NULL);
+        if (s_gutter && s_check_gen != s_doc_gen)
+            ev_add_timer(&s_check_timer, CHECK_PAUSE_MS, 0, EV_PRIO_NORMAL,
+                         check_fire, NULL);
         kbd_wait(&ev);
-
-        int s_cy_before = s_cy;
-        int cursor_only = 0;
-
-        /* Remap CUA shortcuts to Ctrl equivalents */
-        UINT16 code = ev.code;
-        if (code == KEY_INS && (ev.modifiers & KMOD_SHIFT))
-            code = 0x16;  /* Shift+Insert → Ctrl+V (paste) */
-        else if (code == KEY_INS && (ev.modifiers & KMOD_CTRL))
-            code = 0x03;  /* Ctrl+Insert → Ctrl+C (copy) */
-        else if (code == KEY_DEL && (ev.modifiers & KMOD_SHIFT))
-            code = 0x18;  /* Shift+Delete → Ctrl+X (cut) */
-
-        switch (code) {
-        case KEY_F2:
-            if (fs_is_read_only()) {
-                draw_info("Volume is read-only");
-            } else {
-                handle_save();
-            }
-            break;
-
-        case KEY_F5:
-            handle_compile_run();
-            break;
-
-        case KEY_F6:
-            handle_rebuild();
-            break;
-
-        case KEY_F3:
-            if (s_sel_active) {
-                s_sel_active = 0;
-            } else {
-                s_sel_active = 1;
-                s_sel_anchor_y = s_cy;
-                s_sel_anchor_x = s_cx;
-            }
-            break;
-
-        case KEY_ESC:
-            if (s_sel_active) {
-                s_sel_active = 0;
-                break;
-            }
-            if (handle_exit()) {
-                doc_clear();
-                return;
-            }
-            break;
-
-        case KEY_F10:
-            if (handle_exit()) {
-                doc_clear();
+        ev_remove(&s_sym_idle);
+        ev_remove(&s_clip_idle);
+        ev_remove(&s_check_timer);
+        kbd_frame_begin();
+
+        int prev_cy = s_cy;
+        int prev_scroll_y = s_scroll_y;
+        int prev_scroll_x = s_scroll_x;
+        int cursor_only = 1;
+        do {
+            int r = edit_key(&ev);
+            if (r == EDIT_KEY_EXIT) {
+                if (s_clip_dirty)
+                    clip_save();
                 return;
             }
-            break;
-
-        case 0x03: /* Ctrl+C — copy */
-            if (s_sel_active) {
-                sel_copy();
-                s_sel_active = 0;
-            } else {
-                handle_copy_line();
-            }
-            draw_info("Copied.");
-            break;
-
-        case 0x18: /* Ctrl+X — cut */
-            if (s_sel_active) {
-                sel_copy();
-                sel_delete_range();
-            } else {
-                handle_cut_line();
-            }
-            break;
-
-        case 0x16: /* Ctrl+V — paste */
-            sel_paste();
-            break;
-
-        case 0x0B: /* Ctrl+K — cut line */
-            handle_cut_line();
-            break;
-
-        case KEY_ENTER:
-            handle_enter();
-            break;
-
-        case KEY_BS:
-            handle_backspace();
-            break;
-
-        case KEY_DEL:
-            handle_delete();
-            break;
-
-        case KEY_TAB:
-            handle_tab();
-            break;
-
-        case KEY_UP:
-        case KEY_DOWN:
-        case KEY_LEFT:
-        case KEY_RIGHT:
-        case KEY_HOME:
-        case KEY_END:
-        case KEY_PGUP:
-        case KEY_PGDN:
-            handle_move(ev.code);
-            cursor_only = 1;
-            break;
-
-        default:
-            if (ev.code >= 0x20 && ev.code <= 0x7E)
-                handle_char((char)ev.code);
-            break;
-        }
-
-        int prev_cy = s_cy_before;
-        scroll_to_cursor();
+            if (r != EDIT_KEY_MOVE)
+                cursor_only = 0;
+            scroll_to_cursor();
+            /* Keys typed at a prompt were its own; redraw now */
+            if (r == EDIT_KEY_MODAL)
+                break;
+        } while (kbd_frame_next(&ev));
 
         if (cursor_only && !s_sel_active &&
             s_scroll_y == prev_scroll_y && s_scroll_x == prev_scroll_x) {
@@ -1389,8 +5044,11 @@ void edit_run(const CHAR16 *path, const char *filename) {
             draw_text();
             draw_info(NULL);
         }
-
-        prev_scroll_y = s_scroll_y;
-        prev_scroll_x = s_scroll_x;
     }
 }
+
+void edit_run(const CHAR16 *path, const char *filename) {
+    int tag = mem_tag_set(MEM_TAG_EDIT);
+    edit_session(path, filename);
+    mem_tag_set(tag);
+}
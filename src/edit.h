@@ -6,7 +6,9 @@
 /* Launch the text editor on a file.
    path: CHAR16 directory path (e.g. L"\\notes")
    filename: ASCII filename (e.g. "todo.txt")
-   If file doesn't exist, starts with empty document and creates on save. */
+   If file doesn't exist, starts with empty document and creates on save.
+   A file edited recently comes back as it was left, unless it has
+   changed on disk since. */
 void edit_run(const CHAR16 *path, const char *filename);
 
 #endif /* EDIT_H */
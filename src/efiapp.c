@@ -0,0 +1,246 @@
+/*
+ * efiapp.c — Starting .efi files from the browser
+ *
+ * See efiapp.h. The loaded image is patched in place, through the
+ * PE32+ headers the firmware leaves at ImageBase: every RVA taken from
+ * them is checked against ImageSize before it is followed.
+ */
+
+#include "boot.h"
+#include "fb.h"
+#include "kbd.h"
+#include "mem.h"
+#include "fs.h"
+#include "timer.h"
+#include "trace.h"
+#include "tcc.h"
+#include "efiapp.h"
+#include "shim.h"
+
+#define PE_DIR_EXPORT   0
+#define PE_DIR_IMPORT   1
+
+struct pe_image {
+    UINT8 *base;
+    UINT64 size;
+    UINT32 dir_rva[2], dir_size[2];     /* export, import */
+};
+
+static UINT32 rd32(const UINT8 *p) {
+    return (UINT32)p[0] | (UINT32)p[1] << 8 | (UINT32)p[2] << 16 |
+           (UINT32)p[3] << 24;
+}
+
+/* len bytes at rva are inside the image */
+static int pe_has(const struct pe_image *pe, UINT64 rva, UINT64 len) {
+    return rva <= pe->size && len <= pe->size - rva;
+}
+
+/* The NUL-terminated name at rva, NULL if it runs off the image */
+static const char *pe_name(const struct pe_image *pe, UINT32 rva) {
+    for (UINT64 i = rva; i < pe->size; i++)
+        if (pe->base[i] == 0)
+            return (const char *)pe->base + rva;
+    return NULL;
+}
+
+static int pe_open(struct pe_image *pe, void *base, UINT64 size) {
+    mem_set(pe, 0, sizeof(*pe));
+    pe->base = (UINT8 *)base;
+    pe->size = size;
+    if (!pe_has(pe, 0, 64) || pe->base[0] != 'M' || pe->base[1] != 'Z')
+        return -1;
+    UINT32 nt = rd32(pe->base + 0x3C);
+    if (!pe_has(pe, nt, 24 + 112) || rd32(pe->base + nt) != 0x00004550)
+        return -1;
+    const UINT8 *opt = pe->base + nt + 24;
+    if ((opt[0] | opt[1] << 8) != 0x20B)   /* PE32+ */
+        return -1;
+    UINT32 dirs = rd32(opt + 108);
+    for (UINT32 d = 0; d < 2 && d < dirs; d++) {
+        if (!pe_has(pe, nt + 24 + 112 + d * 8, 8))
+            return -1;
+        pe->dir_rva[d] = rd32(opt + 112 + d * 8);
+        pe->dir_size[d] = rd32(opt + 112 + d * 8 + 4);
+    }
+    return 0;
+}
+
+static int name_eq(const char *a, const char *b) {
+    for (;; a++, b++) {
+        char x = *a, y = *b;
+        if (x >= 'A' && x <= 'Z') x += 32;
+        if (y >= 'A' && y <= 'Z') y += 32;
+        if (x != y) return 0;
+        if (!x) return 1;
+    }
+}
+
+/* Fill the thunks of every TCC_APP_DLL import. Returns how many were
+   bound, -1 with why set. */
+static int bind_imports(struct pe_image *pe, char *why, int why_size) {
+    UINT32 rva = pe->dir_rva[PE_DIR_IMPORT];
+    if (!rva || !pe->dir_size[PE_DIR_IMPORT])
+        return 0;
+    int bound = 0;
+    for (;; rva += 20) {
+        if (!pe_has(pe, rva, 20)) {
+            snprintf(why, why_size, "Damaged import table");
+            return -1;
+        }
+        const UINT8 *d = pe->base + rva;
+        UINT32 lookup = rd32(d), name = rd32(d + 12), iat = rd32(d + 16);
+        if (!name && !iat)
+            break;
+        const char *dll = pe_name(pe, name);
+        if (!dll || !name_eq(dll, TCC_APP_DLL)) {
+            snprintf(why, why_size, "Imports from %s, which is not here",
+                     dll ? dll : "?");
+            return -1;
+        }
+        if (!lookup)
+            lookup = iat;
+        for (UINT32 k = 0;; k++) {
+            if (!pe_has(pe, (UINT64)lookup + k * 8, 8) ||
+                !pe_has(pe, (UINT64)iat + k * 8, 8)) {
+                snprintf(why, why_size, "Damaged import table");
+                return -1;
+            }
+            UINT64 ent = (UINT64)rd32(pe->base + lookup + k * 8) |
+                         (UINT64)rd32(pe->base + lookup + k * 8 + 4) << 32;
+            if (!ent)
+                break;
+            const char *fn = ent >> 63 || ent >> 32 ? NULL
+                           : pe_name(pe, (UINT32)ent + 2);
+            const void *addr = fn ? tcc_app_lookup(fn) : NULL;
+            if (!addr) {
+                snprintf(why, why_size, "Needs %s, which this build lacks",
+                         fn ? fn : "an import by ordinal");
+                return -1;
+            }
+            UINT64 v = (UINT64)(UINTN)addr;
+            mem_copy(pe->base + iat + k * 8, &v, 8);
+            bound++;
+        }
+    }
+    return bound;
+}
+
+/* The exported TCC_APP_MARK, NULL if there is none */
+static UINT64 *find_mark(struct pe_image *pe) {
+    UINT32 rva = pe->dir_rva[PE_DIR_EXPORT];
+    if (!rva || !pe_has(pe, rva, 40))
+        return NULL;
+    const UINT8 *e = pe->base + rva;
+    UINT32 names = rd32(e + 24);
+    UINT32 funcs = rd32(e + 28), name_rvas = rd32(e + 32), ords = rd32(e + 36);
+    for (UINT32 i = 0; i < names; i++) {
+        if (!pe_has(pe, (UINT64)name_rvas + i * 4, 4) ||
+            !pe_has(pe, (UINT64)ords + i * 2, 2))
+            return NULL;
+        const char *n = pe_name(pe, rd32(pe->base + name_rvas + i * 4));
+        if (!n || strcmp(n, TCC_APP_MARK) != 0)
+            continue;
+        const UINT8 *o = pe->base + ords + i * 2;
+        UINT32 ord = (UINT32)(o[0] | o[1] << 8);
+        if (!pe_has(pe, (UINT64)funcs + ord * 4, 4))
+            return NULL;
+        UINT32 at = rd32(pe->base + funcs + ord * 4);
+        return pe_has(pe, at, 8) ? (UINT64 *)(pe->base + at) : NULL;
+    }
+    return NULL;
+}
+
+static int wait_key(void) {
+    fb_print("\n  Press any key to return (PgUp/PgDn: scroll)...\n",
+             COLOR_DGRAY);
+    struct key_event ev;
+    kbd_wait_scrollback(&ev);
+    return 0;
+}
+
+static int fail(const char *name, const char *why) {
+    fb_print("  Cannot start ", COLOR_RED);
+    fb_print(name, COLOR_RED);
+    fb_print(": ", COLOR_RED);
+    fb_print(why, COLOR_RED);
+    fb_print("\n", COLOR_RED);
+    wait_key();
+    return -1;
+}
+
+int efiapp_run(const CHAR16 *path, const char *name) {
+    fb_clear(COLOR_BLACK);
+    g_boot.cursor_x = 0;
+    g_boot.cursor_y = 0;
+
+    UINT64 t0 = timer_ticks();
+    UINTN size = 0;
+    void *file = fs_readfile(path, &size);
+    if (!file)
+        return fail(name, "the file cannot be read");
+
+    EFI_HANDLE h = NULL;
+    EFI_STATUS st = g_boot.bs->LoadImage(FALSE, g_boot.image_handle, NULL,
+                                         file, size, &h);
+    mem_free(file);
+    if (EFI_ERROR(st)) {
+        /* A refused signature still leaves an image to unload */
+        if (st == EFI_SECURITY_VIOLATION && h)
+            g_boot.bs->UnloadImage(h);
+        return fail(name, st == EFI_SECURITY_VIOLATION
+                              ? "Secure Boot refused it"
+                              : "the firmware would not load it");
+    }
+
+    EFI_GUID li_guid = LOADED_IMAGE_PROTOCOL;
+    EFI_LOADED_IMAGE *li = NULL;
+    struct pe_image pe;
+    char why[96];
+    int bound = 0;
+    why[0] = '\0';
+    if (EFI_ERROR(g_boot.bs->HandleProtocol(h, &li_guid, (VOID **)&li)) ||
+        !li || pe_open(&pe, li->ImageBase, li->ImageSize) != 0) {
+        snprintf(why, sizeof(why), "not a PE32+ image");
+    } else if ((bound = bind_imports(&pe, why, (int)sizeof(why))) > 0) {
+        UINT64 *mark = find_mark(&pe);
+        if (mark)
+            *mark = TCC_APP_LINKED;
+        else
+            snprintf(why, sizeof(why), "built without the F7 entry point");
+    }
+    if (why[0]) {
+        g_boot.bs->UnloadImage(h);
+        return fail(name, why);
+    }
+    UINT64 load = timer_ticks() - t0;
+
+    /* An application is unloaded by the time StartImage() returns */
+    UINTN exit_size = 0;
+    CHAR16 *exit_data = NULL;
+    t0 = timer_ticks();
+    st = g_boot.bs->StartImage(h, &exit_size, &exit_data);
+    UINT64 run = timer_ticks() - t0;
+    if (exit_data)
+        g_boot.bs->FreePool(exit_data);
+    trace_mark(EFI_ERROR(st) ? "app-failed" : "app", timer_us(run),
+               (UINT64)st, name);
+
+    char line[160];
+    fb_print("\n", COLOR_WHITE);
+    if (bound > 0 && !EFI_ERROR(st)) {
+        snprintf(line, sizeof(line),
+                 "  --- %s exited with code %d ---\n", name, (int)(UINT32)st);
+        fb_print(line, (UINT32)st == 0 ? COLOR_GREEN : COLOR_YELLOW);
+    } else {
+        snprintf(line, sizeof(line), "  --- %s returned status 0x%llx ---\n",
+                 name, (unsigned long long)st);
+        fb_print(line, EFI_ERROR(st) ? COLOR_YELLOW : COLOR_GREEN);
+    }
+    UINT64 us = timer_us(load);
+    snprintf(line, sizeof(line), "  Loaded in %llu.%03llu ms, %d imports bound\n",
+             (unsigned long long)(us / 1000), (unsigned long long)(us % 1000),
+             bound);
+    fb_print(line, COLOR_DGRAY);
+    return wait_key();
+}
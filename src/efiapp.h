@@ -0,0 +1,22 @@
+/*
+ * efiapp.h — Starting .efi files from the browser
+ *
+ * The file is handed to the firmware's LoadImage() and run with
+ * StartImage(); the screen shows what it printed and its exit code
+ * until a key. An application built by F7 in the editor
+ * (tcc_build_app()) imports the workstation API from TCC_APP_DLL:
+ * between the two calls its import table is filled in with
+ * tcc_app_lookup() and its TCC_APP_MARK export set, so it starts as
+ * fast as the firmware loads it. An image that imports nothing runs
+ * as it is; one importing anything else is refused.
+ */
+#ifndef EFIAPP_H
+#define EFIAPP_H
+
+#include "boot.h"
+
+/* Load and start the image at path (name for the screen). Returns 0
+   once it has run, -1 if it could not be started. */
+int efiapp_run(const CHAR16 *path, const char *name);
+
+#endif /* EFIAPP_H */
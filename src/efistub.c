@@ -0,0 +1,217 @@
+/*
+ * efistub.c — Small loader for a compressed workstation image
+ *
+ * See efistub.h. Linked on its own, not into survival.efi: with lz4.c
+ * for the unpacking, timer.c for the counter and the payload. The
+ * image is unpacked to pages once, as the file it was, then laid out
+ * section by section into the pages it runs from, below 2 GB as
+ * mem_alloc_code() keeps TCC's programs, so they stay within reach of
+ * each other. Only the DIR64 base relocations a PE32+ image needs are
+ * applied; anything else refuses to start rather than run misplaced.
+ */
+
+#include "boot.h"
+#include "mem.h"
+#include "lz4.h"
+#include "timer.h"
+#include "efistub.h"
+
+/* lz4.c and timer.c link against these; mem.c's without its SIMD */
+struct boot_state g_boot;
+
+void mem_copy(void *dst, const void *src, UINTN size) {
+    UINT8 *d = (UINT8 *)dst;
+    const UINT8 *s = (const UINT8 *)src;
+    if (size >= 16 && (((UINTN)d ^ (UINTN)s) & 7) == 0) {
+        while ((UINTN)d & 7) { *d++ = *s++; size--; }
+        for (; size >= 8; size -= 8, d += 8, s += 8)
+            *(UINT64 *)d = *(const UINT64 *)s;
+    }
+    while (size--) *d++ = *s++;
+}
+
+void mem_set(void *dst, UINT8 val, UINTN size) {
+    UINT8 *d = (UINT8 *)dst;
+    if (size >= 16) {
+        UINT64 w = 0x0101010101010101ULL * val;
+        while ((UINTN)d & 7) { *d++ = val; size--; }
+        for (; size >= 8; size -= 8, d += 8)
+            *(UINT64 *)d = w;
+    }
+    while (size--) *d++ = val;
+}
+
+typedef EFI_STATUS (EFIAPI *efi_entry)(EFI_HANDLE, EFI_SYSTEM_TABLE *);
+
+#define PE_DIR_EXPORT   0
+#define PE_DIR_RELOC    5
+#define PE_REL_ABS      0       /* padding */
+#define PE_REL_DIR64    10
+
+static UINT16 rd16(const UINT8 *p) {
+    return (UINT16)(p[0] | p[1] << 8);
+}
+
+static UINT32 rd32(const UINT8 *p) {
+    return (UINT32)p[0] | (UINT32)p[1] << 8 | (UINT32)p[2] << 16 |
+           (UINT32)p[3] << 24;
+}
+
+static UINT64 rd64(const UINT8 *p) {
+    return (UINT64)rd32(p) | (UINT64)rd32(p + 4) << 32;
+}
+
+static void say(const CHAR16 *s) {
+    g_boot.st->ConOut->OutputString(g_boot.st->ConOut, (CHAR16 *)s);
+}
+
+static void *pages(UINTN size, EFI_MEMORY_TYPE type) {
+    EFI_PHYSICAL_ADDRESS addr = 0x7FFFFFFF;
+    UINTN n = (size + 4095) / 4096;
+    if (EFI_ERROR(g_boot.bs->AllocatePages(AllocateMaxAddress, type, n, &addr))) {
+        addr = 0;
+        if (EFI_ERROR(g_boot.bs->AllocatePages(AllocateAnyPages, type, n, &addr)))
+            return NULL;
+    }
+    return (void *)(UINTN)addr;
+}
+
+static void pages_free(void *p, UINTN size) {
+    g_boot.bs->FreePages((EFI_PHYSICAL_ADDRESS)(UINTN)p, (size + 4095) / 4096);
+}
+
+/* An image laid out at img: the address of the export name, NULL if
+   it has none */
+static void *find_export(UINT8 *img, UINT32 size, const UINT8 *dir,
+                         const char *name) {
+    UINT32 rva = rd32(dir + PE_DIR_EXPORT * 8);
+    if (!rva || rva > size || size - rva < 40)
+        return NULL;
+    const UINT8 *e = img + rva;
+    UINT32 names = rd32(e + 24), funcs = rd32(e + 28);
+    UINT32 name_rvas = rd32(e + 32), ords = rd32(e + 36);
+    if (name_rvas > size || (size - name_rvas) / 4 < names ||
+        ords > size || (size - ords) / 2 < names)
+        return NULL;
+    for (UINT32 i = 0; i < names; i++) {
+        UINT32 at = rd32(img + name_rvas + i * 4);
+        UINT32 k = 0;
+        while (at + k < size && name[k] && img[at + k] == (UINT8)name[k]) k++;
+        if (name[k] || at + k >= size || img[at + k])
+            continue;
+        UINT32 ord = rd16(img + ords + i * 2);
+        if (funcs > size || (size - funcs) / 4 <= ord)
+            return NULL;
+        UINT32 sym = rd32(img + funcs + ord * 4);
+        return sym < size ? img + sym : NULL;
+    }
+    return NULL;
+}
+
+/* Lay the file out at img (size bytes, zeroed) and relocate it there.
+   Returns the entry point's offset, 0 if the file is not one to run. */
+static UINT32 lay_out(const UINT8 *file, UINT32 len, UINT8 *img, UINT32 size,
+                      const UINT8 **dirs) {
+    UINT32 nt = rd32(file + 0x3C);
+    if (nt > len || len - nt < 24 + 112 || rd32(file + nt) != 0x00004550)
+        return 0;
+    const UINT8 *coff = file + nt + 4, *opt = coff + 20;
+    UINT32 nsec = rd16(coff + 2), optsz = rd16(coff + 16);
+    if (rd16(opt) != 0x20B || optsz < 112 + 6 * 8 || rd32(opt + 108) < 6 ||
+        rd32(opt + 56) != size)
+        return 0;
+    UINT32 entry = rd32(opt + 16), headers = rd32(opt + 60);
+    UINT64 base = rd64(opt + 24);
+    UINT32 sec = nt + 24 + optsz;
+    if (headers > len || headers > size || sec > len ||
+        (len - sec) / 40 < nsec || entry == 0 || entry >= size)
+        return 0;
+
+    mem_copy(img, file, headers);
+    for (UINT32 i = 0; i < nsec; i++) {
+        const UINT8 *s = file + sec + i * 40;
+        UINT32 va = rd32(s + 12), vsize = rd32(s + 8);
+        UINT32 raw = rd32(s + 16), at = rd32(s + 20);
+        if (raw > vsize && vsize) raw = vsize;
+        if (va > size || size - va < raw || at > len || len - at < raw)
+            return 0;
+        mem_copy(img + va, file + at, raw);
+    }
+
+    *dirs = img + nt + 24 + 112;
+    UINT32 rva = rd32(*dirs + PE_DIR_RELOC * 8);
+    UINT32 rsize = rd32(*dirs + PE_DIR_RELOC * 8 + 4);
+    if (rva > size || size - rva < rsize)
+        return 0;
+    UINT64 delta = (UINT64)(UINTN)img - base;
+    for (UINT32 p = 0; p + 8 <= rsize;) {
+        const UINT8 *blk = img + rva + p;
+        UINT32 page = rd32(blk), bsize = rd32(blk + 4);
+        if (bsize < 8 || bsize > rsize - p)
+            return 0;
+        for (UINT32 k = 8; k + 2 <= bsize; k += 2) {
+            UINT16 e = rd16(blk + k);
+            UINT32 off = page + (e & 0xFFF);
+            if (e >> 12 == PE_REL_ABS)
+                continue;
+            if (e >> 12 != PE_REL_DIR64 || off > size - 8)
+                return 0;
+            UINT64 v = rd64(img + off) + delta;
+            mem_copy(img + off, &v, 8);
+        }
+        p += bsize;
+    }
+    return entry;
+}
+
+EFI_STATUS efi_main(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE *st) {
+    UINT64 t0 = timer_ticks();
+    g_boot.image_handle = image_handle;
+    g_boot.st = st;
+    g_boot.bs = st->BootServices;
+
+    UINT32 len = efistub_raw_size;
+    UINT8 *file = (UINT8 *)pages(len, EfiLoaderData);
+    if (!file) {
+        say(L"efistub: out of memory\r\n");
+        return EFI_OUT_OF_RESOURCES;
+    }
+    if (lz4_decompress(efistub_packed, efistub_packed_size, file, len) !=
+            (INTN)len || len < 64 || file[0] != 'M' || file[1] != 'Z') {
+        pages_free(file, len);
+        say(L"efistub: the packed image is damaged\r\n");
+        return EFI_LOAD_ERROR;
+    }
+
+    /* SizeOfImage, before anything else is trusted */
+    UINT32 nt = rd32(file + 0x3C);
+    UINT32 size = nt < len && len - nt >= 24 + 60 ? rd32(file + nt + 24 + 56) : 0;
+    UINT8 *img = size ? (UINT8 *)pages(size, EfiLoaderCode) : NULL;
+    const UINT8 *dirs = NULL;
+    UINT32 entry = 0;
+    if (img) {
+        mem_set(img, 0, size);
+        entry = lay_out(file, len, img, size, &dirs);
+    }
+    pages_free(file, len);
+    if (!entry) {
+        if (img) pages_free(img, size);
+        say(L"efistub: cannot lay out the packed image\r\n");
+        return EFI_LOAD_ERROR;
+    }
+
+#ifdef __aarch64__
+    /* The code was written as data */
+    __arm64_clear_cache(img, img + size);
+#endif
+
+    /* The workstation's boot phases start with this unpacking */
+    UINT64 *ticks = (UINT64 *)find_export(img, size, dirs, "efistub_ticks");
+    if (ticks) {
+        ticks[0] = t0;
+        ticks[1] = timer_ticks();
+    }
+    EFI_STATUS status = ((efi_entry)(UINTN)(img + entry))(image_handle, st);
+    pages_free(img, size);
+    return status;
+}
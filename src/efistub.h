@@ -0,0 +1,23 @@
+/*
+ * efistub.h — Small loader for a compressed workstation image
+ *
+ * With make COMPRESS=1, or F6 when REBUILD_DIR holds a file named
+ * "compress", BOOT*.EFI is efistub.c linked with lz4.c and a payload:
+ * the real survival.efi as one LZ4 block (lz4.h) in a generated C
+ * source, made by tools/efipack.py or by the rebuild itself. The
+ * firmware reads a file about half the size; the stub unpacks it into
+ * pages, lays out its sections, applies its base relocations and
+ * calls its entry point with the stub's own image handle, so the
+ * workstation finds its boot volume as if it had been loaded directly.
+ */
+#ifndef EFISTUB_H
+#define EFISTUB_H
+
+#include "boot.h"
+
+/* The payload, as its generated source defines it */
+extern const UINT32 efistub_raw_size;       /* bytes of survival.efi */
+extern const UINT32 efistub_packed_size;
+extern const UINT8  efistub_packed[];
+
+#endif /* EFISTUB_H */
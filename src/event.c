@@ -0,0 +1,137 @@
+/*
+ * event.c — Central event loop
+ *
+ * Handlers sit on one list sorted by priority. Each turn of ev_wait()
+ * builds the wait set from it (the caller's event first), runs the
+ * highest-priority handler whose event has signaled, then hands back a
+ * signaled key, then gives one idle handler a step; only when none has
+ * work does it sleep in WaitForEvent on the whole set. After any
+ * handler runs the set is rebuilt, since the handler may have added or
+ * removed others.
+ */
+
+#include "boot.h"
+#include "fb.h"
+#include "event.h"
+
+#define EV_MAX_WAIT    16           /* events waited on at once */
+#define TIMER_CANCEL   0
+#define TIMER_PERIODIC 1
+#define TIMER_RELATIVE 2
+
+typedef EFI_STATUS (*BS_SET_TIMER)(EFI_EVENT, UINT32, UINT64);
+
+static struct ev_handler *s_handlers;   /* highest priority first */
+
+static void ev_link(struct ev_handler *h, EFI_EVENT event, int prio,
+                    ev_fn fn, void *arg) {
+    ev_remove(h);
+    h->event = event;
+    h->fn = fn;
+    h->arg = arg;
+    h->prio = prio;
+    h->owned = 0;
+    h->busy = 0;
+
+    /* After the handlers of the same priority: equal ones take turns
+       in the order they came */
+    struct ev_handler **pp = &s_handlers;
+    while (*pp && (*pp)->prio >= prio)
+        pp = &(*pp)->next;
+    h->next = *pp;
+    *pp = h;
+    h->linked = 1;
+}
+
+void ev_add_event(struct ev_handler *h, EFI_EVENT event, int prio,
+                  ev_fn fn, void *arg) {
+    ev_link(h, event, prio, fn, arg);
+}
+
+int ev_add_timer(struct ev_handler *h, UINT32 ms, int periodic, int prio,
+                 ev_fn fn, void *arg) {
+    EFI_EVENT e;
+    if (EFI_ERROR(g_boot.bs->CreateEvent(EVT_TIMER, 0, NULL, NULL, &e)))
+        return -1;
+    if (EFI_ERROR(((BS_SET_TIMER)g_boot.bs->SetTimer)(
+            e, periodic ? TIMER_PERIODIC : TIMER_RELATIVE,
+            (UINT64)ms * 10000))) {
+        g_boot.bs->CloseEvent(e);
+        return -1;
+    }
+    ev_link(h, e, prio, fn, arg);
+    h->owned = 1;
+    return 0;
+}
+
+void ev_add_idle(struct ev_handler *h, int prio, ev_fn fn, void *arg) {
+    ev_link(h, NULL, prio, fn, arg);
+}
+
+void ev_remove(struct ev_handler *h) {
+    if (!h->linked) return;
+    for (struct ev_handler **pp = &s_handlers; *pp; pp = &(*pp)->next) {
+        if (*pp == h) {
+            *pp = h->next;
+            break;
+        }
+    }
+    h->linked = 0;
+    if (h->owned) {
+        ((BS_SET_TIMER)g_boot.bs->SetTimer)(h->event, TIMER_CANCEL, 0);
+        g_boot.bs->CloseEvent(h->event);
+        h->owned = 0;
+    }
+    h->event = NULL;
+}
+
+static int run(struct ev_handler *h) {
+    h->busy = 1;
+    int more = h->fn(h->arg);
+    h->busy = 0;
+    return more;
+}
+
+void ev_wait(EFI_EVENT until) {
+    for (;;) {
+        EFI_EVENT set[EV_MAX_WAIT];
+        struct ev_handler *owner[EV_MAX_WAIT];
+        UINTN n = 0;
+        set[n] = until;
+        owner[n++] = NULL;
+        for (struct ev_handler *h = s_handlers; h && n < EV_MAX_WAIT;
+             h = h->next) {
+            if (h->event && !h->busy) {
+                set[n] = h->event;
+                owner[n++] = h;
+            }
+        }
+
+        /* Signaled events, best first */
+        int ran = 0;
+        for (UINTN i = 1; i < n && !ran; i++) {
+            if (g_boot.bs->CheckEvent(set[i]) == EFI_SUCCESS) {
+                run(owner[i]);
+                ran = 1;
+            }
+        }
+        if (ran) continue;
+
+        if (g_boot.bs->CheckEvent(until) == EFI_SUCCESS)
+            return;
+
+        /* One step of the best idle handler with work */
+        for (struct ev_handler *h = s_handlers; h && !ran; h = h->next)
+            if (!h->event && !h->busy)
+                ran = run(h) || !h->linked;
+        if (ran) continue;
+
+        /* Whatever the handlers drew is shown before sleeping */
+        fb_present();
+        UINTN idx = 0;
+        if (EFI_ERROR(g_boot.bs->WaitForEvent(n, set, &idx)) || idx == 0)
+            return;
+        if (idx < n)
+            run(owner[idx]);
+    }
+}
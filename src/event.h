@@ -0,0 +1,66 @@
+/*
+ * event.h — Central event loop: keys, timers, firmware events, idle work
+ *
+ * Every kbd_wait() runs this loop, so whatever is registered makes
+ * progress between keystrokes in any screen. A handler is one of:
+ *
+ *     event   called when its EFI_EVENT signals: an EVT_TIMER, a
+ *             BlockIO2 token (disk_io_event()), anything WaitForEvent
+ *             accepts (not EVT_NOTIFY_SIGNAL)
+ *     timer   the same with a timer event the loop creates and closes
+ *     idle    called while nothing is pending, one step per call; it
+ *             returns nonzero while it has more to do, 0 to let the loop
+ *             sleep until the next event or key
+ *
+ * Ready handlers run highest priority first; a key is delivered only
+ * once no event handler is ready, and idle work runs only while no key
+ * is waiting. Handlers run with boot services, on the boot processor,
+ * and are never re-entered: one that waits for a key itself is skipped
+ * by the nested loop. The caller owns each struct ev_handler, which
+ * starts zeroed (adding a registered one re-registers it), and must
+ * ev_remove() it before it goes away.
+ */
+#ifndef EVENT_H
+#define EVENT_H
+
+#include "boot.h"
+
+/* Priorities: larger runs first */
+#define EV_PRIO_LOW    0
+#define EV_PRIO_NORMAL 10
+#define EV_PRIO_HIGH   20
+
+typedef int (*ev_fn)(void *arg);
+
+struct ev_handler {
+    EFI_EVENT event;                /* NULL for idle work */
+    ev_fn fn;
+    void *arg;
+    int prio;
+    UINT8 owned;                    /* timer: event closed by ev_remove() */
+    UINT8 linked;
+    UINT8 busy;                     /* running now */
+    struct ev_handler *next;
+};
+
+/* Call fn(arg) each time event signals */
+void ev_add_event(struct ev_handler *h, EFI_EVENT event, int prio,
+                  ev_fn fn, void *arg);
+
+/* Call fn(arg) after ms milliseconds, then every ms if periodic (a
+   one-shot timer stays registered until ev_remove()). Returns 0, or
+   -1 if the firmware has no timer for it. */
+int ev_add_timer(struct ev_handler *h, UINT32 ms, int periodic, int prio,
+                 ev_fn fn, void *arg);
+
+/* Call fn(arg) whenever the loop would otherwise sleep */
+void ev_add_idle(struct ev_handler *h, int prio, ev_fn fn, void *arg);
+
+/* Unregister (no-op if h is not registered); safe from a handler */
+void ev_remove(struct ev_handler *h);
+
+/* Run handlers until until signals (it is reset then, as by
+   WaitForEvent). kbd_wait() passes the key event. */
+void ev_wait(EFI_EVENT until);
+
+#endif /* EVENT_H */
@@ -2,7 +2,11 @@
  * exfat.c — exFAT filesystem driver (read/write)
  *
  * Portable: uses callback-based block I/O, no libc dependency.
- * Provides mount, readdir, readfile, writefile, mkdir, rename, delete.
+ * Provides mount, readdir, readfile, writefile, mkdir, rename, delete
+ * and format. The UEFI workstation and the ESP32 firmware compile this
+ * one file; what differs between them is only the block cache behind
+ * bcache.h and the sizing knobs below (see esp32/main/fs_port.h
+ * and esp32/main/bcache.c).
  *
  * exFAT on-disk layout (superfloppy — no MBR):
  *   Sector 0:           Boot sector (VBR)
@@ -16,7 +20,14 @@
  */
 
 #include "exfat.h"
+#include "bcache.h"
+#include "dirsort.h"
+#include "runmap.h"
+#ifndef ESP_PLATFORM
 #include "mem.h"
+#include "fsck.h"
+#include "shim.h"
+#endif
 
 /* ---- Constants ---- */
 
@@ -24,7 +35,9 @@
 #define EXFAT_BAD           0xFFFFFFF7
 #define EXFAT_FREE          0x00000000
 
-#define EXFAT_CACHE_SIZE    8
+#ifndef EXFAT_DEFAULT_MAX_XFER
+#define EXFAT_DEFAULT_MAX_XFER  (1024 * 1024)
+#endif
 
 /* Directory entry types */
 #define ENTRY_EOD           0x00  /* end of directory */
@@ -128,6 +141,16 @@ struct exfat_bitmap_dentry {
     UINT64 data_length;
 };
 
+/* Up-case Table Entry (type 0x82) */
+struct exfat_upcase_dentry {
+    UINT8  type;                 /* 0x82 */
+    UINT8  reserved1[3];
+    UINT32 table_checksum;
+    UINT8  reserved2[12];
+    UINT32 first_cluster;
+    UINT64 data_length;
+};
+
 /* Volume Label Entry (type 0x83) */
 struct exfat_label_dentry {
     UINT8  type;                 /* 0x83 */
@@ -138,17 +161,34 @@ struct exfat_label_dentry {
 
 #pragma pack()
 
-/* ---- Sector cache ---- */
+/* ---- Volume handle ---- */
 
-struct exfat_cache_entry {
-    UINT64 sector;
+#ifndef DIR_INDEX_SLOTS
+#define DIR_INDEX_SLOTS 16      /* directories indexed per volume */
+#endif
+#ifndef DIR_RUN_BYTES
+#define DIR_RUN_BYTES 32768     /* directory sectors read per request */
+#endif
+#ifndef DIR_INDEX_MAX
+#define DIR_INDEX_MAX 0         /* entry sets per index, 0 = no limit */
+#endif
+#ifndef BITMAP_PAGE_SIZE
+#define BITMAP_PAGE_SIZE 65536  /* bytes of allocation bitmap per page */
+#endif
+#ifndef BITMAP_PAGE_SLOTS
+#define BITMAP_PAGE_SLOTS 64    /* resident bitmap pages (4 MB) */
+#endif
+
+struct dir_index;
+
+/* One resident piece of the allocation bitmap */
+struct bitmap_page {
+    UINT32 index;                /* page number within the bitmap */
+    UINT32 stamp;                /* LRU clock, 0 = slot empty */
     UINT8  *data;
-    int    valid;
-    int    dirty;
+    UINT8  dirty[(BITMAP_PAGE_SIZE / 512 + 7) / 8];  /* bit per sector */
 };
 
-/* ---- Volume handle ---- */
-
 struct exfat_vol {
     exfat_block_read_fn  read_fn;
     exfat_block_write_fn write_fn;
@@ -164,18 +204,41 @@ struct exfat_vol {
     UINT32 root_cluster;
     UINT64 volume_length;
 
-    /* Allocation bitmap */
-    UINT8  *bitmap;
+    /* Allocation bitmap, paged in on demand */
     UINT32 bitmap_size;          /* in bytes */
     UINT32 bitmap_cluster;
     int    bitmap_no_fat_chain;
+    UINT32 *bitmap_chain;        /* bitmap clusters, in order */
+    UINT32 bitmap_chain_len;
+    struct bitmap_page bitmap_pages[BITMAP_PAGE_SLOTS];
+    UINT32 bitmap_clock;
+    int    bitmap_last;          /* slot of the last page used */
+    int    bitmap_error;         /* a page could not be loaded for update */
+    UINT32 free_clusters;        /* valid once free_valid is set */
+    int    free_valid;
+    UINT32 alloc_hint;           /* next-fit search start (cluster) */
+
+    /* Open exfat_begin_batch() calls; metadata write-back waits for 0 */
+    int    batch;
 
     /* Volume label (ASCII) */
     char   label[48];
 
     /* Sector cache */
-    struct exfat_cache_entry cache[EXFAT_CACHE_SIZE];
-    UINT32 cache_clock;          /* simple clock for LRU eviction */
+    struct bcache *cache;
+
+    /* Largest single data read issued to the device, in bytes */
+    UINT32 max_transfer;
+
+    /* Directory sectors read ahead by dir_iter_map(), shared by every
+       iterator on the volume; dir_run_count 0 = empty */
+    UINT8  *dir_run;
+    UINT64 dir_run_sector;
+    UINT32 dir_run_count;
+
+    /* Name-hash indexes of recently searched directories (LRU) */
+    struct dir_index *dir_index[DIR_INDEX_SLOTS];
+    UINT32 dir_index_clock;
 };
 
 /* ---- Internal helpers: ASCII case conversion ---- */
@@ -200,107 +263,47 @@ static int ascii_icmp(const char *a, const char *b)
     return (int)(unsigned char)*a - (int)(unsigned char)*b;
 }
 
-/* ---- Sector cache implementation ---- */
+/* ---- Sector cache (shared block cache, exFAT sector units) ---- */
 
-static void cache_init(struct exfat_vol *vol)
+static int cache_init(struct exfat_vol *vol)
 {
-    for (int i = 0; i < EXFAT_CACHE_SIZE; i++) {
-        vol->cache[i].data = (UINT8 *)mem_alloc(vol->bytes_per_sector);
-        vol->cache[i].valid = 0;
-        vol->cache[i].dirty = 0;
-        vol->cache[i].sector = 0;
-    }
-    vol->cache_clock = 0;
+    vol->cache = bcache_create(vol->read_fn, vol->write_fn, vol->ctx,
+                               vol->bytes_per_sector, vol->dev_block_size);
+    return vol->cache ? 0 : -1;
 }
 
 static void cache_free(struct exfat_vol *vol)
 {
-    for (int i = 0; i < EXFAT_CACHE_SIZE; i++) {
-        if (vol->cache[i].data) {
-            mem_free(vol->cache[i].data);
-            vol->cache[i].data = 0;
-        }
-    }
+    bcache_destroy(vol->cache);
+    vol->cache = 0;
+    if (vol->dir_run)
+        mem_free(vol->dir_run);
+    vol->dir_run = 0;
+    vol->dir_run_count = 0;
 }
 
-/*
- * Flush a single dirty cache entry to disk.
- * We must translate exFAT sectors to device blocks.
- */
-static int cache_flush_entry(struct exfat_vol *vol, int idx)
+/* Forget the directory run if a write touches it */
+static void dir_run_drop(struct exfat_vol *vol, UINT64 sector, UINT32 count)
 {
-    struct exfat_cache_entry *ce = &vol->cache[idx];
-    if (!ce->valid || !ce->dirty)
-        return 0;
-
-    UINT32 ratio = vol->bytes_per_sector / vol->dev_block_size;
-    UINT64 dev_lba = ce->sector * ratio;
-
-    if (vol->write_fn(vol->ctx, dev_lba, ratio, ce->data) != 0)
-        return -1;
-
-    ce->dirty = 0;
-    return 0;
+    if (vol->dir_run_count && sector < vol->dir_run_sector + vol->dir_run_count &&
+        sector + count > vol->dir_run_sector)
+        vol->dir_run_count = 0;
 }
 
 /* Flush all dirty cache entries */
 static int cache_flush_all(struct exfat_vol *vol)
 {
-    int ret = 0;
-    for (int i = 0; i < EXFAT_CACHE_SIZE; i++) {
-        if (vol->cache[i].valid && vol->cache[i].dirty) {
-            if (cache_flush_entry(vol, i) != 0)
-                ret = -1;
-        }
-    }
-    return ret;
-}
-
-/* Find a cache slot (evicting LRU if needed) */
-static int cache_find_slot(struct exfat_vol *vol)
-{
-    /* Look for an invalid entry first */
-    for (int i = 0; i < EXFAT_CACHE_SIZE; i++) {
-        if (!vol->cache[i].valid)
-            return i;
-    }
-    /* Evict using round-robin (simple clock) */
-    int idx = (int)(vol->cache_clock % EXFAT_CACHE_SIZE);
-    vol->cache_clock++;
-    /* Flush if dirty */
-    if (vol->cache[idx].dirty)
-        cache_flush_entry(vol, idx);
-    vol->cache[idx].valid = 0;
-    return idx;
+    return bcache_flush(vol->cache);
 }
 
 /*
  * Read a sector (in exFAT sector units) through the cache.
  * Returns pointer to cached buffer, or NULL on error.
- * The pointer is valid until the next cache operation.
+ * The pointer is valid until the sector is evicted.
  */
 static UINT8 *cache_read(struct exfat_vol *vol, UINT64 sector)
 {
-    /* Check if already cached */
-    for (int i = 0; i < EXFAT_CACHE_SIZE; i++) {
-        if (vol->cache[i].valid && vol->cache[i].sector == sector)
-            return vol->cache[i].data;
-    }
-
-    /* Need to read from disk */
-    int idx = cache_find_slot(vol);
-    struct exfat_cache_entry *ce = &vol->cache[idx];
-
-    UINT32 ratio = vol->bytes_per_sector / vol->dev_block_size;
-    UINT64 dev_lba = sector * ratio;
-
-    if (vol->read_fn(vol->ctx, dev_lba, ratio, ce->data) != 0)
-        return 0;
-
-    ce->sector = sector;
-    ce->valid = 1;
-    ce->dirty = 0;
-    return ce->data;
+    return bcache_get(vol->cache, sector);
 }
 
 /*
@@ -309,50 +312,23 @@ static UINT8 *cache_read(struct exfat_vol *vol, UINT64 sector)
  */
 static void cache_mark_dirty(struct exfat_vol *vol, UINT64 sector)
 {
-    for (int i = 0; i < EXFAT_CACHE_SIZE; i++) {
-        if (vol->cache[i].valid && vol->cache[i].sector == sector) {
-            vol->cache[i].dirty = 1;
-            return;
-        }
-    }
-}
-
-/* Invalidate a specific cached sector */
-static void cache_invalidate(struct exfat_vol *vol, UINT64 sector)
-{
-    for (int i = 0; i < EXFAT_CACHE_SIZE; i++) {
-        if (vol->cache[i].valid && vol->cache[i].sector == sector) {
-            if (vol->cache[i].dirty)
-                cache_flush_entry(vol, i);
-            vol->cache[i].valid = 0;
-        }
-    }
-}
-
-/* Invalidate entire cache */
-static void cache_invalidate_all(struct exfat_vol *vol)
-{
-    cache_flush_all(vol);
-    for (int i = 0; i < EXFAT_CACHE_SIZE; i++)
-        vol->cache[i].valid = 0;
+    dir_run_drop(vol, sector, 1);
+    bcache_mark_dirty(vol->cache, sector);
 }
 
-/* ---- Read/write raw sectors (bypassing cache, for bulk I/O) ---- */
+/* ---- Read/write sector runs (long runs bypass the cache) ---- */
 
 static int read_sectors_raw(struct exfat_vol *vol, UINT64 exfat_sector,
                             UINT32 count, void *buf)
 {
-    UINT32 ratio = vol->bytes_per_sector / vol->dev_block_size;
-    UINT64 dev_lba = exfat_sector * ratio;
-    return vol->read_fn(vol->ctx, dev_lba, count * ratio, buf);
+    return bcache_read(vol->cache, exfat_sector, count, buf);
 }
 
 static int write_sectors_raw(struct exfat_vol *vol, UINT64 exfat_sector,
                              UINT32 count, const void *buf)
 {
-    UINT32 ratio = vol->bytes_per_sector / vol->dev_block_size;
-    UINT64 dev_lba = exfat_sector * ratio;
-    return vol->write_fn(vol->ctx, dev_lba, count * ratio, buf);
+    dir_run_drop(vol, exfat_sector, count);
+    return bcache_write(vol->cache, exfat_sector, count, buf);
 }
 
 /* ---- Cluster addressing ---- */
@@ -406,18 +382,204 @@ static int fat_set(struct exfat_vol *vol, UINT32 cluster, UINT32 value)
     return 0;
 }
 
-/* ---- Bitmap operations ---- */
+/* ---- Allocation bitmap (paged) ---- */
+
+/*
+ * The bitmap is read on demand in BITMAP_PAGE_SIZE pieces and kept in at
+ * most BITMAP_PAGE_SLOTS buffers, evicting the least recently used, so
+ * mount cost and memory do not grow with the volume. Each page records
+ * which of its sectors changed; eviction and bitmap_flush write only those.
+ */
+
+/* Bitmap clusters in chain order, built on the first page load */
+static int bitmap_chain_build(struct exfat_vol *vol)
+{
+    if (vol->bitmap_chain)
+        return 0;
+
+    UINT32 clsz = cluster_size(vol);
+    UINT32 n = (vol->bitmap_size + clsz - 1) / clsz;
+    UINT32 *chain = (UINT32 *)mem_alloc((UINTN)(n ? n : 1) * sizeof(UINT32));
+    if (!chain)
+        return -1;
+
+    UINT32 cl = vol->bitmap_cluster;
+    for (UINT32 i = 0; i < n; i++) {
+        if (cl < 2 || cl >= vol->cluster_count + 2) {
+            mem_free(chain);
+            return -1;
+        }
+        chain[i] = cl;
+        cl = vol->bitmap_no_fat_chain ? cl + 1 : fat_get(vol, cl);
+    }
+    vol->bitmap_chain = chain;
+    vol->bitmap_chain_len = n;
+    return 0;
+}
+
+/* Sectors of the bitmap (rounded up; the tail of the last one is unused) */
+static UINT32 bitmap_sector_count(struct exfat_vol *vol)
+{
+    return (vol->bitmap_size + vol->bytes_per_sector - 1) /
+           vol->bytes_per_sector;
+}
+
+/*
+ * Read or write 'count' bitmap sectors starting at bitmap-relative sector
+ * 'first', one device request per physically contiguous stretch.
+ */
+static int bitmap_io(struct exfat_vol *vol, UINT32 first, UINT32 count,
+                     UINT8 *buf, int write)
+{
+    UINT32 spc = vol->sectors_per_cluster;
+    UINT32 bps = vol->bytes_per_sector;
+
+    while (count > 0) {
+        UINT32 k = first / spc;
+        if (k >= vol->bitmap_chain_len)
+            return -1;
+        UINT32 run = spc - first % spc;
+        if (run > count)
+            run = count;
+        while (run < count && k + 1 < vol->bitmap_chain_len &&
+               vol->bitmap_chain[k + 1] == vol->bitmap_chain[k] + 1) {
+            k++;
+            run += (count - run < spc) ? count - run : spc;
+        }
+
+        UINT64 sec = cluster_to_sector(vol, vol->bitmap_chain[first / spc]) +
+                     first % spc;
+        int rc = write ? write_sectors_raw(vol, sec, run, buf)
+                       : read_sectors_raw(vol, sec, run, buf);
+        if (rc != 0)
+            return -1;
+        first += run;
+        count -= run;
+        buf += run * bps;
+    }
+    return 0;
+}
+
+/* Write the dirty sectors of a resident page back */
+static int bitmap_page_writeback(struct exfat_vol *vol, struct bitmap_page *pg)
+{
+    UINT32 bps = vol->bytes_per_sector;
+    UINT32 spp = BITMAP_PAGE_SIZE / bps;
+    UINT32 first = pg->index * spp;
+    UINT32 total = bitmap_sector_count(vol);
+    UINT32 n = (total - first < spp) ? total - first : spp;
+
+    UINT32 i = 0;
+    while (i < n) {
+        if (!((pg->dirty[i / 8] >> (i % 8)) & 1)) {
+            i++;
+            continue;
+        }
+        UINT32 j = i;
+        while (j < n && ((pg->dirty[j / 8] >> (j % 8)) & 1))
+            j++;
+        if (bitmap_io(vol, first + i, j - i, pg->data + i * bps, 1) != 0)
+            return -1;
+        i = j;
+    }
+    mem_set(pg->dirty, 0, sizeof(pg->dirty));
+    return 0;
+}
+
+/* Get bitmap page 'index', loading it (and evicting another) on a miss */
+static struct bitmap_page *bitmap_page_get(struct exfat_vol *vol, UINT32 index)
+{
+    struct bitmap_page *last = &vol->bitmap_pages[vol->bitmap_last];
+    if (last->stamp && last->index == index) {
+        last->stamp = ++vol->bitmap_clock;
+        return last;
+    }
+
+    int victim = 0;
+    for (int i = 0; i < BITMAP_PAGE_SLOTS; i++) {
+        struct bitmap_page *pg = &vol->bitmap_pages[i];
+        if (pg->stamp && pg->index == index) {
+            pg->stamp = ++vol->bitmap_clock;
+            vol->bitmap_last = i;
+            return pg;
+        }
+        if (pg->stamp < vol->bitmap_pages[victim].stamp)
+            victim = i;
+    }
+
+    if (bitmap_chain_build(vol) != 0)
+        return 0;
+
+    UINT32 bps = vol->bytes_per_sector;
+    UINT32 spp = BITMAP_PAGE_SIZE / bps;
+    UINT32 total = bitmap_sector_count(vol);
+    if ((UINT64)index * spp >= total)
+        return 0;
+
+    /* A bitmap that fits in one page gets a buffer of its own size */
+    UINTN buf_size = BITMAP_PAGE_SIZE;
+    if (total <= spp)
+        buf_size = ((UINTN)total * bps + 7) & ~(UINTN)7;
+
+    struct bitmap_page *pg = &vol->bitmap_pages[victim];
+    if (pg->stamp && bitmap_page_writeback(vol, pg) != 0)
+        return 0;
+    pg->stamp = 0;
+    if (!pg->data) {
+        pg->data = (UINT8 *)mem_alloc(buf_size);
+        if (!pg->data) {
+            /* Out of memory: reuse the oldest resident page's buffer */
+            int old = -1;
+            for (int i = 0; i < BITMAP_PAGE_SLOTS; i++) {
+                struct bitmap_page *o = &vol->bitmap_pages[i];
+                if (o->stamp && (old < 0 ||
+                                 o->stamp < vol->bitmap_pages[old].stamp))
+                    old = i;
+            }
+            if (old < 0)
+                return 0;
+            struct bitmap_page *o = &vol->bitmap_pages[old];
+            if (bitmap_page_writeback(vol, o) != 0)
+                return 0;
+            pg = o;
+            pg->stamp = 0;
+            victim = old;
+        }
+    }
+
+    UINT32 first = index * spp;
+    UINT32 n = (total - first < spp) ? total - first : spp;
+    if (bitmap_io(vol, first, n, pg->data, 0) != 0)
+        return 0;
+
+    pg->index = index;
+    pg->stamp = ++vol->bitmap_clock;
+    mem_set(pg->dirty, 0, sizeof(pg->dirty));
+    vol->bitmap_last = victim;
+    return pg;
+}
+
+/* Number of clusters the bitmap actually describes */
+static UINT32 bitmap_limit(struct exfat_vol *vol)
+{
+    UINT64 bits = (UINT64)vol->bitmap_size * 8;
+    return (bits < vol->cluster_count) ? (UINT32)bits : vol->cluster_count;
+}
+
+#define BITMAP_PAGE_BITS ((UINT32)BITMAP_PAGE_SIZE * 8)
 
 static int bitmap_get(struct exfat_vol *vol, UINT32 cluster)
 {
     if (cluster < 2)
         return 0;
     UINT32 idx = cluster - 2;
-    UINT32 byte_idx = idx / 8;
-    UINT8  bit_idx  = (UINT8)(idx % 8);
-    if (byte_idx >= vol->bitmap_size)
+    if (idx >= bitmap_limit(vol))
         return 0;
-    return (vol->bitmap[byte_idx] >> bit_idx) & 1;
+    struct bitmap_page *pg = bitmap_page_get(vol, idx / BITMAP_PAGE_BITS);
+    if (!pg)
+        return 1;  /* unreadable: never hand it out */
+    UINT32 o = idx % BITMAP_PAGE_BITS;
+    return (pg->data[o / 8] >> (o % 8)) & 1;
 }
 
 static void bitmap_set(struct exfat_vol *vol, UINT32 cluster, int used)
@@ -425,111 +587,222 @@ static void bitmap_set(struct exfat_vol *vol, UINT32 cluster, int used)
     if (cluster < 2)
         return;
     UINT32 idx = cluster - 2;
-    UINT32 byte_idx = idx / 8;
-    UINT8  bit_idx  = (UINT8)(idx % 8);
-    if (byte_idx >= vol->bitmap_size)
+    if (idx >= bitmap_limit(vol))
         return;
-    if (used)
-        vol->bitmap[byte_idx] |= (UINT8)(1 << bit_idx);
-    else
-        vol->bitmap[byte_idx] &= (UINT8)~(1 << bit_idx);
-}
+    struct bitmap_page *pg = bitmap_page_get(vol, idx / BITMAP_PAGE_BITS);
+    if (!pg) {
+        vol->bitmap_error = 1;
+        return;
+    }
 
-/* Write the allocation bitmap back to disk */
-static int bitmap_flush(struct exfat_vol *vol)
-{
-    UINT32 bps = vol->bytes_per_sector;
-    UINT32 spc = vol->sectors_per_cluster;
-    UINT32 clust_size = bps * spc;
-    UINT32 total_bytes = vol->bitmap_size;
-    UINT32 offset = 0;
-    UINT32 cluster = vol->bitmap_cluster;
+    UINT32 o = idx % BITMAP_PAGE_BITS;
+    UINT8 mask = (UINT8)(1 << (o % 8));
+    UINT8 old = pg->data[o / 8];
+    if (used) {
+        if (old & mask)
+            return;
+        pg->data[o / 8] = old | mask;
+        if (vol->free_valid)
+            vol->free_clusters--;
+    } else {
+        if (!(old & mask))
+            return;
+        pg->data[o / 8] = old & (UINT8)~mask;
+        if (vol->free_valid)
+            vol->free_clusters++;
+    }
 
-    while (offset < total_bytes && cluster >= 2 && cluster != EXFAT_EOC) {
-        UINT64 sec = cluster_to_sector(vol, cluster);
-        UINT32 chunk = total_bytes - offset;
-        if (chunk > clust_size)
-            chunk = clust_size;
+    UINT32 sec = (o / 8) / vol->bytes_per_sector;
+    pg->dirty[sec / 8] |= (UINT8)(1 << (sec % 8));
+}
 
-        /* Write full sectors */
-        UINT32 full_secs = chunk / bps;
-        if (full_secs > 0) {
-            if (write_sectors_raw(vol, sec, full_secs, vol->bitmap + offset) != 0)
-                return -1;
+/*
+ * Find the first free cluster in [from, end). Whole 64-bit words of the
+ * bitmap are tested at once, so full regions cost one compare per 64
+ * clusters. Returns 0 if there is none.
+ */
+static UINT32 bitmap_find_free(struct exfat_vol *vol, UINT32 from, UINT32 end)
+{
+    UINT32 limit = bitmap_limit(vol) + 2;
+    if (end > limit)
+        end = limit;
+    if (from < 2)
+        from = 2;
+
+    UINT32 idx = from - 2, last = end - 2;
+    while (idx < last) {
+        UINT32 pidx = idx / BITMAP_PAGE_BITS;
+        struct bitmap_page *pg = bitmap_page_get(vol, pidx);
+        if (!pg)
+            return 0;
+        const UINT8 *bm = pg->data;
+        const UINT64 *words = (const UINT64 *)bm;
+        UINT32 base = pidx * BITMAP_PAGE_BITS;
+        UINT32 pend = (last - base > BITMAP_PAGE_BITS)
+                      ? base + BITMAP_PAGE_BITS : last;
+
+        while (idx < pend) {
+            UINT32 o = idx - base;
+            if ((o & 63) == 0 && pend - idx >= 64) {
+                UINT64 w = words[o / 64];
+                if (w == ~(UINT64)0) {
+                    idx += 64;
+                    continue;
+                }
+                while ((w & 0xFF) == 0xFF) {
+                    w >>= 8;
+                    idx += 8;
+                }
+                while (w & 1) {
+                    w >>= 1;
+                    idx++;
+                }
+                return idx + 2;
+            }
+            if (!((bm[o / 8] >> (o % 8)) & 1))
+                return idx + 2;
+            idx++;
         }
-        /* Partial last sector */
-        UINT32 partial = chunk % bps;
-        if (partial > 0) {
-            UINT8 *tmp = cache_read(vol, sec + full_secs);
-            if (!tmp)
-                return -1;
-            mem_copy(tmp, vol->bitmap + offset + full_secs * bps, partial);
-            cache_mark_dirty(vol, sec + full_secs);
+    }
+    return 0;
+}
+
+/* Length of the free run starting at 'cl', capped at 'max' */
+static UINT32 bitmap_free_run(struct exfat_vol *vol, UINT32 cl, UINT32 max)
+{
+    UINT32 end = bitmap_limit(vol) + 2;
+    UINT32 len = 0;
+    while (len < max && cl + len < end) {
+        UINT32 idx = cl + len - 2;
+        UINT32 pidx = idx / BITMAP_PAGE_BITS;
+        struct bitmap_page *pg = bitmap_page_get(vol, pidx);
+        if (!pg)
+            break;
+        UINT32 o = idx - pidx * BITMAP_PAGE_BITS;
+        if ((o & 63) == 0 && max - len >= 64 && end - (cl + len) >= 64 &&
+            BITMAP_PAGE_BITS - o >= 64 &&
+            ((const UINT64 *)pg->data)[o / 64] == 0) {
+            len += 64;
+            continue;
         }
+        if ((pg->data[o / 8] >> (o % 8)) & 1)
+            break;
+        len++;
+    }
+    return len;
+}
 
-        offset += clust_size;
-        if (vol->bitmap_no_fat_chain)
-            cluster++;
-        else
-            cluster = fat_get(vol, cluster);
+/* Count free clusters (once; bitmap_set keeps the count current after) */
+static int bitmap_count_free(struct exfat_vol *vol)
+{
+    if (vol->free_valid)
+        return 0;
+
+    UINT32 n = bitmap_limit(vol);
+    UINT32 used = 0;
+    for (UINT32 base = 0; base < n; base += BITMAP_PAGE_BITS) {
+        struct bitmap_page *pg = bitmap_page_get(vol, base / BITMAP_PAGE_BITS);
+        if (!pg)
+            return -1;
+        UINT32 bits = (n - base < BITMAP_PAGE_BITS) ? n - base
+                                                     : BITMAP_PAGE_BITS;
+        used += (UINT32)mem_popcount(pg->data, bits / 8);
+        for (UINT32 i = bits & ~7u; i < bits; i++)
+            used += (pg->data[i / 8] >> (i % 8)) & 1;
     }
 
-    return cache_flush_all(vol);
+    vol->free_clusters = vol->cluster_count - used;
+    vol->free_valid = 1;
+    return 0;
 }
 
-/* Read the allocation bitmap from disk */
-static int bitmap_load(struct exfat_vol *vol)
+/* Write the changed sectors of all resident bitmap pages back to disk */
+static int bitmap_flush(struct exfat_vol *vol)
 {
-    UINT32 bps = vol->bytes_per_sector;
-    UINT32 spc = vol->sectors_per_cluster;
-    UINT32 clust_size = bps * spc;
-    UINT32 total_bytes = vol->bitmap_size;
-    UINT32 offset = 0;
-    UINT32 cluster = vol->bitmap_cluster;
+    int rc = 0;
+    for (int i = 0; i < BITMAP_PAGE_SLOTS; i++) {
+        struct bitmap_page *pg = &vol->bitmap_pages[i];
+        if (pg->stamp && bitmap_page_writeback(vol, pg) != 0)
+            rc = -1;
+    }
+    if (vol->bitmap_error) {
+        vol->bitmap_error = 0;
+        rc = -1;
+    }
+    if (cache_flush_all(vol) != 0)
+        rc = -1;
+    return rc;
+}
 
-    while (offset < total_bytes && cluster >= 2 && cluster != EXFAT_EOC) {
-        UINT64 sec = cluster_to_sector(vol, cluster);
-        UINT32 chunk = total_bytes - offset;
-        if (chunk > clust_size)
-            chunk = clust_size;
+/* ---- Batches ---- */
 
-        /* Read full sectors */
-        UINT32 full_secs = chunk / bps;
-        if (full_secs > 0) {
-            if (read_sectors_raw(vol, sec, full_secs, vol->bitmap + offset) != 0)
-                return -1;
-        }
-        /* Partial last sector */
-        UINT32 partial = chunk % bps;
-        if (partial > 0) {
-            UINT8 *tmp = cache_read(vol, sec + full_secs);
-            if (!tmp)
-                return -1;
-            mem_copy(vol->bitmap + offset + full_secs * bps, tmp, partial);
-        }
+/*
+ * Each update normally ends by writing its metadata back. Inside a
+ * batch the bitmap, FAT and directory sectors stay in the cache instead
+ * (eviction still writes them when it runs short) and go out once, at
+ * exfat_commit_batch(), the cached ones in ascending LBA order.
+ */
 
-        offset += clust_size;
-        if (vol->bitmap_no_fat_chain)
-            cluster++;
-        else
-            cluster = fat_get(vol, cluster);
-    }
+/* Write back the cached metadata, unless batching */
+static int meta_sync(struct exfat_vol *vol)
+{
+    return vol->batch ? 0 : cache_flush_all(vol);
+}
+
+/* Write back the bitmap and the cached metadata, unless batching */
+static int meta_commit(struct exfat_vol *vol)
+{
+    return vol->batch ? 0 : bitmap_flush(vol);
+}
 
+int exfat_begin_batch(struct exfat_vol *vol)
+{
+    if (!vol)
+        return -1;
+    vol->batch++;
     return 0;
 }
 
-/* Allocate a free cluster. Returns 0 on failure. */
-static UINT32 alloc_cluster(struct exfat_vol *vol)
+int exfat_commit_batch(struct exfat_vol *vol)
 {
-    for (UINT32 i = 0; i < vol->cluster_count; i++) {
-        UINT32 cl = i + 2;
-        if (!bitmap_get(vol, cl)) {
-            bitmap_set(vol, cl, 1);
-            fat_set(vol, cl, EXFAT_EOC);
-            return cl;
-        }
+    if (!vol || vol->batch == 0)
+        return -1;
+    if (--vol->batch > 0)
+        return 0;
+    return bitmap_flush(vol);
+}
+
+/* Free page buffers (after a final bitmap_flush) */
+static void bitmap_release(struct exfat_vol *vol)
+{
+    for (int i = 0; i < BITMAP_PAGE_SLOTS; i++) {
+        if (vol->bitmap_pages[i].data)
+            mem_free(vol->bitmap_pages[i].data);
+        vol->bitmap_pages[i].data = 0;
+        vol->bitmap_pages[i].stamp = 0;
     }
-    return 0;
+    if (vol->bitmap_chain)
+        mem_free(vol->bitmap_chain);
+    vol->bitmap_chain = 0;
+}
+
+/* Allocate a free cluster (next-fit from alloc_hint). Returns 0 on failure. */
+static UINT32 alloc_cluster(struct exfat_vol *vol)
+{
+    UINT32 end = vol->cluster_count + 2;
+    if (vol->free_valid && vol->free_clusters == 0)
+        return 0;
+
+    UINT32 cl = bitmap_find_free(vol, vol->alloc_hint, end);
+    if (cl == 0)
+        cl = bitmap_find_free(vol, 2, vol->alloc_hint);
+    if (cl == 0)
+        return 0;
+
+    bitmap_set(vol, cl, 1);
+    fat_set(vol, cl, EXFAT_EOC);
+    vol->alloc_hint = cl + 1;
+    return cl;
 }
 
 /* Allocate a cluster and chain it to prev */
@@ -543,6 +816,74 @@ static UINT32 alloc_cluster_chain(struct exfat_vol *vol, UINT32 prev)
     return cl;
 }
 
+/*
+ * Allocate up to 'want' contiguous clusters in the bitmap (the FAT is not
+ * touched). If 'hint' is free the extent starts there, so a growing file
+ * stays contiguous; otherwise the search is next-fit from alloc_hint: the
+ * first free run of at least 'want' clusters is used, or the longest run
+ * if none is large enough.
+ * Returns the first cluster (0 if the volume is full), *got its length.
+ */
+static UINT32 alloc_extent(struct exfat_vol *vol, UINT32 hint, UINT32 want,
+                           UINT32 *got)
+{
+    UINT32 end = vol->cluster_count + 2;
+    UINT32 best = 0, best_len = 0;
+
+    *got = 0;
+    if (want == 0 || (vol->free_valid && vol->free_clusters == 0))
+        return 0;
+
+    if (hint >= 2 && hint < end && !bitmap_get(vol, hint)) {
+        best = hint;
+        best_len = bitmap_free_run(vol, hint, want);
+    }
+    if (best_len == 0) {
+        /* Two passes: [alloc_hint, end), then [2, alloc_hint) */
+        UINT32 start_at = (vol->alloc_hint >= 2 && vol->alloc_hint < end)
+                          ? vol->alloc_hint : 2;
+        for (int pass = 0; pass < 2 && best_len < want; pass++) {
+            UINT32 cl = pass ? 2 : start_at;
+            UINT32 stop = pass ? start_at : end;
+            while (cl < stop && best_len < want) {
+                cl = bitmap_find_free(vol, cl, stop);
+                if (cl == 0)
+                    break;
+                UINT32 len = bitmap_free_run(vol, cl, want);
+                if (cl + len > stop)
+                    len = stop - cl;
+                if (len > best_len) {
+                    best = cl;
+                    best_len = len;
+                }
+                cl += len;
+            }
+        }
+    }
+
+    for (UINT32 i = 0; i < best_len; i++)
+        bitmap_set(vol, best + i, 1);
+    *got = best_len;
+    if (best_len)
+        vol->alloc_hint = best + best_len;
+    return best_len ? best : 0;
+}
+
+/* Link clusters [start, start+count) through the FAT, after prev */
+static int fat_chain_extent(struct exfat_vol *vol, UINT32 prev,
+                            UINT32 start, UINT32 count)
+{
+    for (UINT32 i = 0; i + 1 < count; i++) {
+        if (fat_set(vol, start + i, start + i + 1) != 0)
+            return -1;
+    }
+    if (fat_set(vol, start + count - 1, EXFAT_EOC) != 0)
+        return -1;
+    if (prev >= 2 && fat_set(vol, prev, start) != 0)
+        return -1;
+    return 0;
+}
+
 /* Free a cluster chain starting from the given cluster */
 static void free_chain(struct exfat_vol *vol, UINT32 start, int no_fat_chain,
                        UINT64 data_length)
@@ -568,33 +909,6 @@ static void free_chain(struct exfat_vol *vol, UINT32 start, int no_fat_chain,
     }
 }
 
-/* Follow a cluster chain, collecting cluster numbers.
- * Returns the number of clusters. */
-static int follow_chain(struct exfat_vol *vol, UINT32 start, int no_fat_chain,
-                        UINT64 data_length, UINT32 *out, int max)
-{
-    UINT32 cluster = start;
-    UINT32 clsz = cluster_size(vol);
-    UINT64 remaining = data_length;
-    int n = 0;
-
-    while (cluster >= 2 && cluster != EXFAT_EOC && cluster != EXFAT_BAD
-           && n < max && remaining > 0) {
-        if (out)
-            out[n] = cluster;
-        n++;
-        if (no_fat_chain) {
-            if (remaining <= clsz)
-                break;
-            remaining -= clsz;
-            cluster++;
-        } else {
-            cluster = fat_get(vol, cluster);
-        }
-    }
-    return n;
-}
-
 /* ---- UTF-16LE <-> ASCII conversion ---- */
 
 /* Convert UTF-16LE to ASCII (lossy: non-ASCII becomes '?') */
@@ -677,33 +991,82 @@ struct dir_iter {
     UINT32 sector_in_cluster;   /* 0 .. sectors_per_cluster-1 */
     UINT32 entry_in_sector;     /* 0 .. entries_per_sector-1 */
     UINT64 byte_offset;         /* total bytes walked */
-    UINT8  *sector_buf;         /* cached from sector cache */
+    UINT8  *sector_buf;         /* current sector; NULL once past the end */
     UINT64 cur_sector;          /* absolute sector number */
 };
 
-static int dir_iter_init(struct dir_iter *it, struct exfat_vol *vol,
-                         UINT32 cluster, int no_fat_chain, UINT64 data_length)
+/*
+ * Point sector_buf at the current sector, reading ahead on a miss: the
+ * rest of the cluster and any clusters the chain continues into
+ * contiguously, up to DIR_RUN_BYTES, in one request.  The run lives in
+ * the volume rather than the iterator, so iterators need no cleanup and
+ * one that resumes after another moved the run simply reads again (on
+ * UEFI, runs of up to 64 sectors also land in the block cache, so that
+ * costs no device I/O).  Without memory for the run, falls back to the
+ * block cache one sector at a time.
+ */
+static UINT8 *dir_iter_map(struct dir_iter *it)
 {
-    it->vol = vol;
-    it->first_cluster = cluster;
-    it->no_fat_chain = no_fat_chain;
-    it->data_length = data_length;
-    it->cur_cluster = cluster;
-    it->sector_in_cluster = 0;
-    it->entry_in_sector = 0;
-    it->byte_offset = 0;
-    it->sector_buf = 0;
-    it->cur_sector = 0;
+    struct exfat_vol *vol = it->vol;
+    UINT32 bps = vol->bytes_per_sector;
+
+    if (vol->dir_run_count && it->cur_sector >= vol->dir_run_sector &&
+        it->cur_sector < vol->dir_run_sector + vol->dir_run_count) {
+        it->sector_buf = vol->dir_run +
+                         (UINTN)(it->cur_sector - vol->dir_run_sector) * bps;
+        return it->sector_buf;
+    }
+
+    UINT32 max = DIR_RUN_BYTES / bps;
+    if (!vol->dir_run && max > 1)
+        vol->dir_run = (UINT8 *)mem_alloc((UINTN)max * bps);
+    if (!vol->dir_run || max <= 1) {
+        it->sector_buf = cache_read(vol, it->cur_sector);
+        return it->sector_buf;
+    }
+
+    UINT32 count = vol->sectors_per_cluster - it->sector_in_cluster;
+    UINT32 cl = it->cur_cluster;
+    while (count < max) {
+        UINT32 next = it->no_fat_chain ? cl + 1 : fat_get(vol, cl);
+        if (next != cl + 1 || next >= vol->cluster_count + 2)
+            break;
+        cl = next;
+        count += vol->sectors_per_cluster;
+    }
+    if (count > max)
+        count = max;
+
+    vol->dir_run_count = 0;
+    if (read_sectors_raw(vol, it->cur_sector, count, vol->dir_run) != 0) {
+        it->sector_buf = cache_read(vol, it->cur_sector);
+        return it->sector_buf;
+    }
+    vol->dir_run_sector = it->cur_sector;
+    vol->dir_run_count = count;
+    it->sector_buf = vol->dir_run;
+    return it->sector_buf;
+}
+
+static int dir_iter_init(struct dir_iter *it, struct exfat_vol *vol,
+                         UINT32 cluster, int no_fat_chain, UINT64 data_length)
+{
+    it->vol = vol;
+    it->first_cluster = cluster;
+    it->no_fat_chain = no_fat_chain;
+    it->data_length = data_length;
+    it->cur_cluster = cluster;
+    it->sector_in_cluster = 0;
+    it->entry_in_sector = 0;
+    it->byte_offset = 0;
+    it->sector_buf = 0;
+    it->cur_sector = 0;
 
     if (cluster < 2)
         return -1;
 
     it->cur_sector = cluster_to_sector(vol, cluster);
-    it->sector_buf = cache_read(vol, it->cur_sector);
-    if (!it->sector_buf)
-        return -1;
-
-    return 0;
+    return dir_iter_map(it) ? 0 : -1;
 }
 
 /* Get pointer to current 32-byte directory entry. NULL if at end. */
@@ -713,6 +1076,8 @@ static struct exfat_dentry *dir_iter_get(struct dir_iter *it)
         return 0;
     if (it->data_length > 0 && it->byte_offset >= it->data_length)
         return 0;
+    if (!dir_iter_map(it))
+        return 0;
 
     UINT32 off = it->entry_in_sector * 32;
     return (struct exfat_dentry *)(it->sector_buf + off);
@@ -762,8 +1127,7 @@ static int dir_iter_next(struct dir_iter *it)
 
         it->cur_sector = cluster_to_sector(vol, it->cur_cluster) +
                          it->sector_in_cluster;
-        it->sector_buf = cache_read(vol, it->cur_sector);
-        if (!it->sector_buf)
+        if (!dir_iter_map(it))
             return -1;
     }
 
@@ -865,6 +1229,284 @@ static int parse_entry_set(struct dir_iter *it, struct exfat_entry_info *info)
     return 0;
 }
 
+/* ---- Directory name-hash index ----
+ *
+ * The first lookup in a directory scans it once and records, for every
+ * entry set, the name hash and where the set starts. Later lookups hash
+ * the name, walk one bucket and parse only the candidate sets. Adds and
+ * removals update the index in place so it never needs a rescan.
+ */
+
+struct dir_index_ent {
+    UINT64 sector;              /* file entry location */
+    UINT32 offset;
+    UINT32 next;                /* next in bucket, 1-based (0 = end) */
+    UINT16 hash;
+};
+
+struct dir_index {
+    UINT32 cluster;             /* first cluster of the directory */
+    UINT32 stamp;               /* LRU clock */
+    struct dir_index_ent *ents;
+    UINT32 count, cap;
+    UINT32 *buckets;            /* 1-based indexes into ents */
+    UINT32 nbuckets;            /* power of two */
+    UINT8  over;                /* past DIR_INDEX_MAX: scan linearly */
+};
+
+/* Hash an ASCII name the way the spec hashes its up-cased UTF-16 form */
+static UINT16 ascii_name_hash(const char *name)
+{
+    UINT16 utf16[FS_MAX_NAME];
+    int n = ascii_to_utf16(name, utf16, FS_MAX_NAME);
+    return exfat_name_hash(utf16, n);
+}
+
+/* Position an iterator at an entry found earlier by a full scan */
+static int dir_iter_seek(struct dir_iter *it, struct exfat_vol *vol,
+                         UINT64 sector, UINT32 offset)
+{
+    UINT64 rel = sector - vol->cluster_heap_offset;
+    mem_set(it, 0, sizeof(*it));
+    it->vol = vol;
+    it->cur_cluster = (UINT32)(rel / vol->sectors_per_cluster) + 2;
+    it->first_cluster = it->cur_cluster;
+    it->sector_in_cluster = (UINT32)(rel % vol->sectors_per_cluster);
+    it->entry_in_sector = offset / 32;
+    it->cur_sector = sector;
+    return dir_iter_map(it) ? 0 : -1;
+}
+
+static void dir_index_free(struct dir_index *di)
+{
+    if (di->ents)
+        mem_free(di->ents);
+    if (di->buckets)
+        mem_free(di->buckets);
+    mem_free(di);
+}
+
+/* Re-bucket every live entry into 'nbuckets' buckets */
+static int dir_index_rehash(struct dir_index *di, UINT32 nbuckets)
+{
+    UINT32 *b = (UINT32 *)mem_alloc(nbuckets * sizeof(UINT32));
+    if (!b)
+        return -1;
+    /* Only entries still linked from the old buckets are live */
+    for (UINT32 i = 0; i < di->nbuckets; i++) {
+        UINT32 e = di->buckets[i];
+        while (e) {
+            struct dir_index_ent *ent = &di->ents[e - 1];
+            UINT32 next = ent->next;
+            UINT32 h = ent->hash & (nbuckets - 1);
+            ent->next = b[h];
+            b[h] = e;
+            e = next;
+        }
+    }
+    if (di->buckets)
+        mem_free(di->buckets);
+    di->buckets = b;
+    di->nbuckets = nbuckets;
+    return 0;
+}
+
+static int dir_index_insert(struct dir_index *di, UINT16 hash,
+                            UINT64 sector, UINT32 offset)
+{
+    if (di->over)
+        return 0;
+    if (DIR_INDEX_MAX && di->count >= DIR_INDEX_MAX) {
+        /* Keep the slot, without entries, so the directory is not
+           scanned again just to find it is too big to index */
+        mem_free(di->ents);
+        mem_free(di->buckets);
+        di->ents = 0;
+        di->buckets = 0;
+        di->count = di->cap = di->nbuckets = 0;
+        di->over = 1;
+        return 0;
+    }
+    if (di->count == di->cap) {
+        UINT32 cap = di->cap ? di->cap * 2 : 64;
+        struct dir_index_ent *e = (struct dir_index_ent *)
+            mem_alloc(cap * sizeof(struct dir_index_ent));
+        if (!e)
+            return -1;
+        if (di->ents) {
+            mem_copy(e, di->ents, di->count * sizeof(struct dir_index_ent));
+            mem_free(di->ents);
+        }
+        di->ents = e;
+        di->cap = cap;
+    }
+    if (di->count >= di->nbuckets * 2 &&
+        dir_index_rehash(di, di->nbuckets ? di->nbuckets * 4 : 64) != 0)
+        return -1;
+
+    struct dir_index_ent *ent = &di->ents[di->count++];
+    UINT32 h = hash & (di->nbuckets - 1);
+    ent->sector = sector;
+    ent->offset = offset;
+    ent->hash = hash;
+    ent->next = di->buckets[h];
+    di->buckets[h] = di->count;
+    return 0;
+}
+
+/* Scan a directory once and index every entry set in it */
+static struct dir_index *dir_index_build(struct exfat_vol *vol, UINT32 cluster)
+{
+    struct dir_index *di =
+        (struct dir_index *)mem_alloc(sizeof(struct dir_index));
+    if (!di)
+        return 0;
+    di->cluster = cluster;
+    if (dir_index_rehash(di, 64) != 0) {
+        dir_index_free(di);
+        return 0;
+    }
+
+    struct dir_iter it;
+    if (dir_iter_init(&it, vol, cluster, 0, 0) != 0) {
+        dir_index_free(di);
+        return 0;
+    }
+
+    for (;;) {
+        struct exfat_dentry *de = dir_iter_get(&it);
+        if (!de || de->type == ENTRY_EOD)
+            break;
+
+        if (de->type == ENTRY_FILE) {
+            UINT64 sec = dir_iter_sector(&it);
+            UINT32 off = dir_iter_offset_in_sector(&it);
+            struct exfat_entry_info ei;
+            if (parse_entry_set(&it, &ei) == 0 &&
+                dir_index_insert(di, ascii_name_hash(ei.name), sec, off) != 0) {
+                dir_index_free(di);
+                return 0;
+            }
+        }
+        if (di->over || dir_iter_next(&it) != 0)
+            break;
+    }
+    return di;
+}
+
+/* Index for a directory, building it (and evicting the LRU one) on a miss.
+   NULL means "no index, scan linearly". */
+static struct dir_index *dir_index_get(struct exfat_vol *vol, UINT32 cluster)
+{
+    int victim = 0;
+    for (int i = 0; i < DIR_INDEX_SLOTS; i++) {
+        struct dir_index *di = vol->dir_index[i];
+        if (di && di->cluster == cluster) {
+            di->stamp = ++vol->dir_index_clock;
+            return di;
+        }
+        if (!di)
+            victim = i;
+        else if (vol->dir_index[victim] &&
+                 di->stamp < vol->dir_index[victim]->stamp)
+            victim = i;
+    }
+
+    struct dir_index *di = dir_index_build(vol, cluster);
+    if (!di)
+        return 0;
+    if (vol->dir_index[victim])
+        dir_index_free(vol->dir_index[victim]);
+    di->stamp = ++vol->dir_index_clock;
+    vol->dir_index[victim] = di;
+    return di;
+}
+
+/* Index for a directory only if it is already built */
+static struct dir_index *dir_index_peek(struct exfat_vol *vol, UINT32 cluster)
+{
+    for (int i = 0; i < DIR_INDEX_SLOTS; i++) {
+        if (vol->dir_index[i] && vol->dir_index[i]->cluster == cluster)
+            return vol->dir_index[i];
+    }
+    return 0;
+}
+
+/* The entry set named 'name' at sector/offset was deleted */
+static void dir_index_remove(struct exfat_vol *vol, const char *name,
+                             UINT64 sector, UINT32 offset)
+{
+    UINT16 hash = ascii_name_hash(name);
+    for (int i = 0; i < DIR_INDEX_SLOTS; i++) {
+        struct dir_index *di = vol->dir_index[i];
+        if (!di || di->over)
+            continue;
+        UINT32 *link = &di->buckets[hash & (di->nbuckets - 1)];
+        while (*link) {
+            struct dir_index_ent *ent = &di->ents[*link - 1];
+            if (ent->sector == sector && ent->offset == offset) {
+                *link = ent->next;
+                return;
+            }
+            link = &ent->next;
+        }
+    }
+}
+
+/* Forget a directory's index (the directory itself went away) */
+static void dir_index_drop(struct exfat_vol *vol, UINT32 cluster)
+{
+    for (int i = 0; i < DIR_INDEX_SLOTS; i++) {
+        if (vol->dir_index[i] && vol->dir_index[i]->cluster == cluster) {
+            dir_index_free(vol->dir_index[i]);
+            vol->dir_index[i] = 0;
+        }
+    }
+}
+
+static void dir_index_drop_all(struct exfat_vol *vol)
+{
+    for (int i = 0; i < DIR_INDEX_SLOTS; i++) {
+        if (vol->dir_index[i]) {
+            dir_index_free(vol->dir_index[i]);
+            vol->dir_index[i] = 0;
+        }
+    }
+}
+
+/* A new entry set was written at sector/offset in directory 'cluster' */
+static void dir_index_add(struct exfat_vol *vol, UINT32 cluster, UINT16 hash,
+                          UINT64 sector, UINT32 offset)
+{
+    struct dir_index *di = dir_index_peek(vol, cluster);
+    if (di && dir_index_insert(di, hash, sector, offset) != 0)
+        dir_index_drop(vol, cluster);
+}
+
+/* Look a name up through the index */
+static int dir_index_find(struct exfat_vol *vol, struct dir_index *di,
+                          const char *name, struct exfat_entry_info *info)
+{
+    UINT16 hash = ascii_name_hash(name);
+    UINT32 e = di->buckets[hash & (di->nbuckets - 1)];
+    while (e) {
+        struct dir_index_ent *ent = &di->ents[e - 1];
+        if (ent->hash == hash) {
+            struct dir_iter it;
+            struct exfat_entry_info ei;
+            if (dir_iter_seek(&it, vol, ent->sector, ent->offset) == 0 &&
+                parse_entry_set(&it, &ei) == 0 &&
+                ascii_icmp(ei.name, name) == 0) {
+                if (info)
+                    mem_copy(info, &ei, sizeof(ei));
+                return 0;
+            }
+        }
+        e = ent->next;
+    }
+    return -1;
+}
+
 /* ---- Path resolution ---- */
 
 /*
@@ -881,6 +1523,10 @@ static int parse_entry_set(struct dir_iter *it, struct exfat_entry_info *info)
 static int find_in_dir(struct exfat_vol *vol, UINT32 dir_cluster,
                        const char *name, struct exfat_entry_info *info)
 {
+    struct dir_index *di = dir_index_get(vol, dir_cluster);
+    if (di && !di->over)
+        return dir_index_find(vol, di, name, info);
+
     struct dir_iter it;
     /* Directories have no size limit; use 0 to mean "follow chain to end" */
     if (dir_iter_init(&it, vol, dir_cluster, 0, 0) != 0)
@@ -1055,10 +1701,26 @@ static int read_data(struct exfat_vol *vol, UINT32 first_cluster,
     UINT8 *dst = (UINT8 *)buf;
     UINT64 remaining = length;
     UINT32 cluster = first_cluster;
+    UINT32 max_run = vol->max_transfer / clsz;
+    if (max_run == 0)
+        max_run = 1;
 
     while (remaining > 0 && cluster >= 2 && cluster != EXFAT_EOC) {
+        /* Extend over physically contiguous clusters so one device
+           call covers the whole run (up to max_transfer bytes) */
+        UINT32 run = 1;
+        UINT32 next = no_fat_chain ? cluster + 1 : fat_get(vol, cluster);
+        while ((UINT64)run * clsz < remaining && run < max_run &&
+               next == cluster + run) {
+            run++;
+            next = no_fat_chain ? cluster + run
+                                : fat_get(vol, cluster + run - 1);
+        }
+
         UINT64 sec = cluster_to_sector(vol, cluster);
-        UINT32 chunk = (remaining > clsz) ? clsz : (UINT32)remaining;
+        UINT64 run_bytes = (UINT64)run * clsz;
+        UINT32 chunk = (remaining > run_bytes) ? (UINT32)run_bytes
+                                               : (UINT32)remaining;
         UINT32 full_secs = chunk / vol->bytes_per_sector;
         UINT32 partial = chunk % vol->bytes_per_sector;
 
@@ -1077,10 +1739,7 @@ static int read_data(struct exfat_vol *vol, UINT32 first_cluster,
         }
 
         remaining -= chunk;
-        if (no_fat_chain)
-            cluster++;
-        else
-            cluster = fat_get(vol, cluster);
+        cluster = next;
     }
 
     return (remaining > 0) ? -1 : 0;
@@ -1089,85 +1748,141 @@ static int read_data(struct exfat_vol *vol, UINT32 first_cluster,
 /* ---- Write cluster data ---- */
 
 /*
- * Write data to a cluster chain. Allocates new clusters as needed.
- * Returns 0 on success. Sets *out_first to the first cluster of the chain.
- * The chain always uses FAT (not NoFatChain).
+ * Write data into one contiguous extent of clusters [first, first+count).
+ * Full sectors go to the device in max_transfer sized pieces; a partial
+ * last sector and the rest of the last cluster are zero-padded.
+ */
+static int write_extent_data(struct exfat_vol *vol, UINT32 first,
+                             UINT32 count, const UINT8 *src, UINT64 len)
+{
+    UINT32 bps = vol->bytes_per_sector;
+    UINT64 sec = cluster_to_sector(vol, first);
+    UINT64 full_secs = len / bps;
+    UINT32 partial = (UINT32)(len % bps);
+    UINT32 max_secs = vol->max_transfer / bps;
+    if (max_secs == 0)
+        max_secs = 1;
+
+    for (UINT64 done = 0; done < full_secs; ) {
+        UINT64 n = full_secs - done;
+        if (n > max_secs)
+            n = max_secs;
+        if (write_sectors_raw(vol, sec + done, (UINT32)n, src + done * bps) != 0)
+            return -1;
+        done += n;
+    }
+
+    UINT64 s = full_secs;
+    UINT64 end = (UINT64)count * vol->sectors_per_cluster;
+    if (partial > 0) {
+        UINT8 *tmp = cache_read(vol, sec + s);
+        if (!tmp)
+            return -1;
+        mem_set(tmp, 0, bps);
+        mem_copy(tmp, src + full_secs * bps, partial);
+        cache_mark_dirty(vol, sec + s);
+        s++;
+    }
+    for (; s < end; s++) {
+        UINT8 *tmp = cache_read(vol, sec + s);
+        if (!tmp)
+            return -1;
+        mem_set(tmp, 0, bps);
+        cache_mark_dirty(vol, sec + s);
+    }
+    return 0;
+}
+
+/*
+ * Write data to newly allocated clusters. Returns 0 on success and sets
+ * *out_first and *out_flags (the stream flags for the entry set).
+ * When one contiguous extent holds the whole file it is marked
+ * NoFatChain and the FAT is not written at all; otherwise the extents
+ * are linked through the FAT.
  */
 static int write_data(struct exfat_vol *vol, const void *data, UINT64 size,
-                      UINT32 *out_first)
+                      UINT32 *out_first, UINT8 *out_flags)
 {
     UINT32 clsz = cluster_size(vol);
     UINT32 clusters_needed = (size > 0)
         ? (UINT32)((size + clsz - 1) / clsz) : 0;
 
-    if (clusters_needed == 0) {
-        *out_first = 0;
+    *out_first = 0;
+    *out_flags = 0;
+    if (clusters_needed == 0)
         return 0;
-    }
 
     const UINT8 *src = (const UINT8 *)data;
-    UINT64 remaining = size;
-    UINT32 first = 0, prev = 0;
+    UINT32 got;
+    UINT32 first = alloc_extent(vol, 0, clusters_needed, &got);
+    if (first == 0)
+        return -1;
 
-    for (UINT32 i = 0; i < clusters_needed; i++) {
-        UINT32 cl = alloc_cluster_chain(vol, prev);
-        if (cl == 0)
+    if (got == clusters_needed) {
+        if (write_extent_data(vol, first, got, src, size) != 0) {
+            free_chain(vol, first, 1, size);
             return -1;
-        if (i == 0)
-            first = cl;
-
-        UINT64 sec = cluster_to_sector(vol, cl);
-        UINT32 chunk = (remaining > clsz) ? clsz : (UINT32)remaining;
-        UINT32 full_secs = chunk / vol->bytes_per_sector;
-        UINT32 partial = chunk % vol->bytes_per_sector;
-
-        if (full_secs > 0) {
-            if (write_sectors_raw(vol, sec, full_secs, src) != 0)
-                return -1;
-            src += full_secs * vol->bytes_per_sector;
         }
+        *out_first = first;
+        *out_flags = STREAM_NO_FAT_CHAIN;
+        return 0;
+    }
 
-        if (partial > 0) {
-            /* Read-modify-write the last partial sector */
-            UINT8 *tmp = cache_read(vol, sec + full_secs);
-            if (!tmp)
-                return -1;
-            mem_set(tmp, 0, vol->bytes_per_sector);
-            mem_copy(tmp, src, partial);
-            cache_mark_dirty(vol, sec + full_secs);
-            src += partial;
-        }
-
-        /* Zero remaining sectors in the last cluster */
-        if (i == clusters_needed - 1) {
-            UINT32 used_secs = (chunk + vol->bytes_per_sector - 1) /
-                               vol->bytes_per_sector;
-            for (UINT32 s = used_secs; s < vol->sectors_per_cluster; s++) {
-                UINT8 *tmp = cache_read(vol, sec + s);
-                if (tmp) {
-                    mem_set(tmp, 0, vol->bytes_per_sector);
-                    cache_mark_dirty(vol, sec + s);
-                }
-            }
+    /* Fragmented: allocate and chain every extent first... */
+    UINT32 start = first, left = clusters_needed;
+    for (;;) {
+        if (fat_chain_extent(vol, 0, start, got) != 0)
+            goto fail;
+        left -= got;
+        if (left == 0)
+            break;
+        UINT32 prev = start + got - 1;
+        start = alloc_extent(vol, 0, left, &got);
+        if (start == 0 || fat_set(vol, prev, start) != 0) {
+            if (start != 0)
+                for (UINT32 i = 0; i < got; i++)
+                    bitmap_set(vol, start + i, 0);
+            goto fail;
         }
+    }
 
-        remaining -= chunk;
-        prev = cl;
+    /* ...then write each run of consecutive clusters in one go */
+    UINT64 remaining = size;
+    UINT32 cl = first;
+    while (remaining > 0) {
+        UINT32 run = 1;
+        while ((UINT64)run * clsz < remaining && fat_get(vol, cl + run - 1) == cl + run)
+            run++;
+        UINT64 len = (UINT64)run * clsz;
+        if (len > remaining)
+            len = remaining;
+        if (write_extent_data(vol, cl, run, src, len) != 0)
+            goto fail;
+        src += len;
+        remaining -= len;
+        cl = fat_get(vol, cl + run - 1);
     }
 
     *out_first = first;
     return 0;
+
+fail:
+    free_chain(vol, first, 0, 0);
+    return -1;
 }
 
 /* ---- Directory entry creation ---- */
 
 /*
  * Build a complete entry set (file + stream + name entries) for a new file/dir.
+ * stream_flags may carry STREAM_NO_FAT_CHAIN for a contiguous allocation.
+ * valid_length is how much of data_length has been written.
  * Returns the total number of 32-byte entries, or -1 on error.
  * Caller must provide a buffer of at least (3 + name_len/15) * 32 bytes.
  */
 static int build_entry_set(UINT8 *buf, const char *name, UINT16 attributes,
-                           UINT32 first_cluster, UINT64 data_length)
+                           UINT32 first_cluster, UINT64 data_length,
+                           UINT64 valid_length, UINT8 stream_flags)
 {
     int name_len = (int)str_len((const CHAR8 *)name);
     int name_entries = (name_len + 14) / 15;  /* ceiling division */
@@ -1201,12 +1916,13 @@ static int build_entry_set(UINT8 *buf, const char *name, UINT16 attributes,
     /* Stream Extension (0xC0) */
     struct exfat_stream_dentry *sd = (struct exfat_stream_dentry *)(buf + 32);
     sd->type = ENTRY_STREAM;
-    sd->flags = STREAM_ALLOC_POSSIBLE;  /* uses FAT chain */
+    sd->flags = STREAM_ALLOC_POSSIBLE |
+                (first_cluster ? (stream_flags & STREAM_NO_FAT_CHAIN) : 0);
     sd->name_length = (UINT8)name_len;
     sd->name_hash = hash;
     sd->first_cluster = first_cluster;
     sd->data_length = data_length;
-    sd->valid_data_length = data_length;
+    sd->valid_data_length = valid_length;
 
     /* File Name Extension entries (0xC1) */
     for (int i = 0; i < name_entries; i++) {
@@ -1248,8 +1964,6 @@ static int find_free_dir_slot(struct exfat_vol *vol, UINT32 dir_cluster,
     UINT64 run_start_sector = 0;
     UINT32 run_start_offset = 0;
 
-    UINT32 last_cluster = dir_cluster;
-
     for (;;) {
         struct exfat_dentry *de = dir_iter_get(&it);
         if (!de)
@@ -1275,8 +1989,6 @@ static int find_free_dir_slot(struct exfat_vol *vol, UINT32 dir_cluster,
                  * also exist (continue iterating). But EOD means nothing
                  * after, so all subsequent entries are usable. */
                 /* Check remaining capacity in the cluster chain */
-                UINT32 bps = vol->bytes_per_sector;
-                UINT32 entries_per_sector = bps / 32;
                 /* Estimate: all remaining entries in all remaining sectors
                  * of this cluster and chain are available */
                 /* For simplicity, if we haven't found enough,
@@ -1297,7 +2009,6 @@ static int find_free_dir_slot(struct exfat_vol *vol, UINT32 dir_cluster,
             free_run = 0;
         }
 
-        last_cluster = it.cur_cluster;
         if (dir_iter_next(&it) != 0)
             break;
     }
@@ -1326,7 +2037,7 @@ alloc_new:
             mem_set(buf, 0, vol->bytes_per_sector);
             cache_mark_dirty(vol, sec + s);
         }
-        cache_flush_all(vol);
+        meta_sync(vol);
 
         /* The free run might span from existing data into the new cluster.
          * If we had some free entries already, re-use them.
@@ -1347,6 +2058,19 @@ alloc_new:
  * The entry set spans multiple 32-byte entries across possibly
  * multiple sectors.
  */
+/* Sector after 'sector' in a FAT-chained directory (0 at end of chain) */
+static UINT64 dir_next_sector(struct exfat_vol *vol, UINT64 sector)
+{
+    UINT64 rel = sector + 1 - vol->cluster_heap_offset;
+    if (rel % vol->sectors_per_cluster != 0)
+        return sector + 1;
+    UINT32 cluster = (UINT32)((rel - 1) / vol->sectors_per_cluster) + 2;
+    UINT32 next = fat_get(vol, cluster);
+    if (next < 2 || next == EXFAT_EOC || next == EXFAT_BAD)
+        return 0;
+    return cluster_to_sector(vol, next);
+}
+
 static int write_entry_set(struct exfat_vol *vol, UINT64 start_sector,
                            UINT32 start_offset, const UINT8 *entries,
                            int count)
@@ -1365,23 +2089,47 @@ static int write_entry_set(struct exfat_vol *vol, UINT64 start_sector,
         src += 32;
         offset += 32;
 
-        if (offset >= vol->bytes_per_sector) {
+        if (offset >= vol->bytes_per_sector && i + 1 < count) {
             offset = 0;
-            sector++;
-            /* Note: this simple increment works within a cluster.
-             * Cross-cluster boundaries need more logic, but for
-             * reasonable entry sets (< 1 sector), this is fine. */
+            sector = dir_next_sector(vol, sector);
+            if (sector == 0)
+                return -1;
         }
     }
 
-    return cache_flush_all(vol);
+    return meta_sync(vol);
+}
+
+/* Read the count entries of the set at (start_sector, start_offset) */
+static int read_entry_set(struct exfat_vol *vol, UINT64 start_sector,
+                          UINT32 start_offset, UINT8 *entries, int count)
+{
+    UINT64 sector = start_sector;
+    UINT32 offset = start_offset;
+
+    for (int i = 0; i < count; i++) {
+        UINT8 *buf = cache_read(vol, sector);
+        if (!buf)
+            return -1;
+        mem_copy(entries + i * 32, buf + offset, 32);
+        offset += 32;
+        if (offset >= vol->bytes_per_sector && i + 1 < count) {
+            offset = 0;
+            sector = dir_next_sector(vol, sector);
+            if (sector == 0)
+                return -1;
+        }
+    }
+    return 0;
 }
 
 /*
  * Add an entry set to a directory. Finds free space, writes the entries.
+ * If out_sector/out_offset are non-NULL they receive the slot used.
  */
 static int add_entry_to_dir(struct exfat_vol *vol, UINT32 dir_cluster,
-                            const UINT8 *entry_set, int entry_count)
+                            const UINT8 *entry_set, int entry_count,
+                            UINT64 *out_sector, UINT32 *out_offset)
 {
     UINT64 slot_sector;
     UINT32 slot_offset;
@@ -1390,34 +2138,58 @@ static int add_entry_to_dir(struct exfat_vol *vol, UINT32 dir_cluster,
                            &slot_sector, &slot_offset) != 0)
         return -1;
 
-    return write_entry_set(vol, slot_sector, slot_offset,
-                           entry_set, entry_count);
-}
+    if (out_sector)
+        *out_sector = slot_sector;
+    if (out_offset)
+        *out_offset = slot_offset;
+
+    if (write_entry_set(vol, slot_sector, slot_offset,
+                        entry_set, entry_count) != 0)
+        return -1;
 
-/* ---- Sorting for readdir ---- */
+    const struct exfat_stream_dentry *sd =
+        (const struct exfat_stream_dentry *)(entry_set + 32);
+    dir_index_add(vol, dir_cluster, sd->name_hash, slot_sector, slot_offset);
+    return 0;
+}
 
-static void sort_entries(struct fs_entry *entries, int count)
+/*
+ * Remove an entry set: free its data clusters and clear the InUse bit
+ * of every entry. The caller flushes the bitmap and cache.
+ */
+static int remove_entry(struct exfat_vol *vol, struct exfat_entry_info *info)
 {
-    /* Simple insertion sort: directories first, then alphabetical */
-    for (int i = 1; i < count; i++) {
-        struct fs_entry tmp;
-        mem_copy(&tmp, &entries[i], sizeof(tmp));
-        int j = i - 1;
-        while (j >= 0) {
-            int swap = 0;
-            if (tmp.is_dir && !entries[j].is_dir) {
-                swap = 1;
-            } else if (tmp.is_dir == entries[j].is_dir) {
-                if (ascii_icmp(tmp.name, entries[j].name) < 0)
-                    swap = 1;
-            }
-            if (!swap)
-                break;
-            mem_copy(&entries[j + 1], &entries[j], sizeof(struct fs_entry));
-            j--;
+    /* Free the data clusters */
+    if (info->first_cluster >= 2) {
+        int no_fat = (info->stream_flags & STREAM_NO_FAT_CHAIN) ? 1 : 0;
+        free_chain(vol, info->first_cluster, no_fat, info->data_length);
+    }
+
+    dir_index_remove(vol, info->name, info->file_entry_sector,
+                     info->file_entry_offset);
+    if (info->attributes & ATTR_DIRECTORY)
+        dir_index_drop(vol, info->first_cluster);
+
+    /* Mark directory entries as deleted (clear InUse bit) */
+    UINT64 sec = info->file_entry_sector;
+    UINT32 off = info->file_entry_offset;
+    int total = 1 + info->secondary_count;
+
+    for (int i = 0; i < total; i++) {
+        UINT8 *buf = cache_read(vol, sec);
+        if (!buf)
+            return -1;
+        buf[off] &= 0x7F;  /* Clear InUse bit */
+        cache_mark_dirty(vol, sec);
+        off += 32;
+        if (off >= vol->bytes_per_sector && i + 1 < total) {
+            off = 0;
+            sec = dir_next_sector(vol, sec);
+            if (sec == 0)
+                return -1;
         }
-        mem_copy(&entries[j + 1], &tmp, sizeof(struct fs_entry));
     }
+    return 0;
 }
 
 /* ---- Mount helpers ---- */
@@ -1471,21 +2243,12 @@ static int load_metadata(struct exfat_vol *vol)
             break;
     }
 
-    if (!found_bitmap)
+    if (!found_bitmap || vol->bitmap_size == 0)
         return -1;
 
-    /* Allocate and load the bitmap */
-    vol->bitmap = (UINT8 *)mem_alloc((UINTN)vol->bitmap_size);
-    if (!vol->bitmap)
-        return -1;
-    mem_set(vol->bitmap, 0, vol->bitmap_size);
-
-    if (bitmap_load(vol) != 0) {
-        mem_free(vol->bitmap);
-        vol->bitmap = 0;
-        return -1;
-    }
-
+    /* The bitmap itself is paged in by the first allocation or
+       free-space query */
+    vol->alloc_hint = 2;
     return 0;
 }
 
@@ -1572,9 +2335,13 @@ struct exfat_vol *exfat_mount(exfat_block_read_fn read_fn,
     vol->cluster_heap_offset = bs.cluster_heap_offset;
     vol->root_cluster = bs.root_cluster;
     vol->volume_length = bs.volume_length;
+    vol->max_transfer = EXFAT_DEFAULT_MAX_XFER;
 
     /* Initialize sector cache */
-    cache_init(vol);
+    if (cache_init(vol) != 0) {
+        mem_free(vol);
+        return 0;
+    }
 
     /* Load metadata (bitmap + volume label) */
     if (load_metadata(vol) != 0) {
@@ -1586,6 +2353,15 @@ struct exfat_vol *exfat_mount(exfat_block_read_fn read_fn,
     return vol;
 }
 
+void exfat_set_max_transfer(struct exfat_vol *vol, UINT32 bytes)
+{
+    if (!vol)
+        return;
+    if (bytes < vol->bytes_per_sector)
+        bytes = vol->bytes_per_sector;
+    vol->max_transfer = bytes;
+}
+
 void exfat_unmount(struct exfat_vol *vol)
 {
     if (!vol)
@@ -1596,64 +2372,125 @@ void exfat_unmount(struct exfat_vol *vol)
     cache_flush_all(vol);
 
     /* Free resources */
-    if (vol->bitmap)
-        mem_free(vol->bitmap);
+    dir_index_drop_all(vol);
+    bitmap_release(vol);
     cache_free(vol);
     mem_free(vol);
 }
 
-int exfat_readdir(struct exfat_vol *vol, const char *path,
-                  struct fs_entry *entries, int max_entries)
+/* ---- Directory cursors ---- */
+
+struct exfat_dir {
+    struct dir_iter it;
+    int done;
+};
+
+struct exfat_dir *exfat_opendir(struct exfat_vol *vol, const char *path)
 {
-    if (!vol || !path || !entries || max_entries <= 0)
-        return -1;
+    if (!vol || !path)
+        return 0;
 
     /* Resolve the path to a directory */
     struct exfat_entry_info dir_info;
     if (resolve_path(vol, path, &dir_info) != 0)
-        return -1;
+        return 0;
 
     if (!(dir_info.attributes & ATTR_DIRECTORY))
-        return -1;
+        return 0;
 
-    UINT32 dir_cluster = dir_info.first_cluster;
-    int count = 0;
+    struct exfat_dir *d = (struct exfat_dir *)mem_alloc(sizeof(*d));
+    if (!d)
+        return 0;
+    if (dir_iter_init(&d->it, vol, dir_info.first_cluster, 0, 0) != 0) {
+        mem_free(d);
+        return 0;
+    }
+    return d;
+}
 
-    struct dir_iter it;
-    if (dir_iter_init(&it, vol, dir_cluster, 0, 0) != 0)
+int exfat_readdir_next(struct exfat_dir *d, struct fs_entry *out)
+{
+    if (!d || !out)
         return -1;
+    if (d->done)
+        return 0;
 
-    for (;;) {
-        struct exfat_dentry *de = dir_iter_get(&it);
-        if (!de)
-            break;
-
-        UINT8 type = de->type;
+    /* Another iterator may have moved the run since the last call */
+    struct dir_iter *it = &d->it;
+    if (!dir_iter_map(it))
+        return -1;
 
-        if (type == ENTRY_EOD)
+    for (;;) {
+        struct exfat_dentry *de = dir_iter_get(it);
+        if (!de || de->type == ENTRY_EOD)
             break;
 
-        if (type == ENTRY_FILE) {
+        if (de->type == ENTRY_FILE) {
             struct exfat_entry_info ei;
-            if (parse_entry_set(&it, &ei) == 0) {
-                if (count < max_entries) {
-                    str_copy(entries[count].name, ei.name, FS_MAX_NAME);
-                    entries[count].size = ei.data_length;
-                    entries[count].is_dir =
-                        (ei.attributes & ATTR_DIRECTORY) ? 1 : 0;
-                    count++;
-                }
+            int ok = (parse_entry_set(it, &ei) == 0);
+            if (dir_iter_next(it) != 0)
+                d->done = 1;
+            if (ok) {
+                str_copy(out->name, ei.name, FS_MAX_NAME);
+                out->size = ei.data_length;
+                out->is_dir = (ei.attributes & ATTR_DIRECTORY) ? 1 : 0;
+                out->attr = (UINT8)(ei.attributes & 0x27);
+                out->mtime = ei.modify_ts;
+                out->ctime = ei.create_ts;
+                out->id = ei.first_cluster;
+                return 1;
             }
-            if (dir_iter_next(&it) != 0)
-                break;
+            if (d->done)
+                return 0;
             continue;
         }
 
-        if (dir_iter_next(&it) != 0)
+        if (dir_iter_next(it) != 0)
             break;
     }
 
-    sort_entries(entries, count);
+    d->done = 1;
+    return 0;
+}
+
+void exfat_closedir(struct exfat_dir *d)
+{
+    if (d)
+        mem_free(d);
+}
+
+void exfat_telldir(struct exfat_dir *d, struct exfat_dir_pos *pos)
+{
+    pos->sector = d->it.cur_sector;
+    pos->offset = dir_iter_offset_in_sector(&d->it);
+    pos->done = (UINT8)d->done;
+}
+
+int exfat_seekdir(struct exfat_dir *d, const struct exfat_dir_pos *pos)
+{
+    if (!d || !pos)
+        return -1;
+    d->done = pos->done;
+    return dir_iter_seek(&d->it, d->it.vol, pos->sector, pos->offset);
+}
+
+int exfat_readdir(struct exfat_vol *vol, const char *path,
+                  struct fs_entry *entries, int max_entries)
+{
+    if (!vol || !path || !entries || max_entries <= 0)
+        return -1;
+
+    struct exfat_dir *d = exfat_opendir(vol, path);
+    if (!d)
+        return -1;
+
+    int count = 0;
+    while (count < max_entries &&
+           exfat_readdir_next(d, &entries[count]) > 0)
+        count++;
+    exfat_closedir(d);
+
+    dirsort_entries(entries, count);
     return count;
 }
 
@@ -1679,21 +2516,28 @@ void *exfat_readfile(struct exfat_vol *vol, const char *path, UINTN *out_size)
         return buf;
     }
 
-    UINT8 *buf = (UINT8 *)mem_alloc((UINTN)size);
+    UINT8 *buf = (UINT8 *)mem_alloc((UINTN)size + 1);
     if (!buf)
         return 0;
 
     int no_fat = (info.stream_flags & STREAM_NO_FAT_CHAIN) ? 1 : 0;
 
-    if (read_data(vol, info.first_cluster, no_fat, size, buf) != 0) {
+    /* Past the valid length the file reads as zeroes (buf already is) */
+    UINT64 valid = info.valid_data_length < size ? info.valid_data_length : size;
+    if (valid > 0 &&
+        read_data(vol, info.first_cluster, no_fat, valid, buf) != 0) {
         mem_free(buf);
         return 0;
     }
+    buf[size] = 0;
 
     *out_size = (UINTN)size;
     return buf;
 }
 
+static int file_rewrite(struct exfat_vol *vol, const char *path,
+                        const void *data, UINTN size);
+
 int exfat_writefile(struct exfat_vol *vol, const char *path,
                     const void *data, UINTN size)
 {
@@ -1708,44 +2552,20 @@ int exfat_writefile(struct exfat_vol *vol, const char *path,
     if (parent_cluster == 0)
         return -1;
 
-    /* Check if file already exists — if so, delete it first */
+    /* An existing file is rewritten in its own clusters */
     struct exfat_entry_info existing;
     if (find_in_dir(vol, parent_cluster, filename, &existing) == 0) {
-        /* Delete the existing file */
         if (existing.attributes & ATTR_DIRECTORY)
             return -1;  /* Can't overwrite a directory */
-
-        /* Free the data clusters */
-        if (existing.first_cluster >= 2) {
-            int no_fat = (existing.stream_flags & STREAM_NO_FAT_CHAIN) ? 1 : 0;
-            free_chain(vol, existing.first_cluster, no_fat,
-                       existing.data_length);
-        }
-
-        /* Mark directory entries as deleted (clear InUse bit) */
-        UINT64 sec = existing.file_entry_sector;
-        UINT32 off = existing.file_entry_offset;
-        int total = 1 + existing.secondary_count;
-
-        for (int i = 0; i < total; i++) {
-            UINT8 *buf = cache_read(vol, sec);
-            if (!buf)
-                return -1;
-            buf[off] &= 0x7F;  /* Clear InUse bit */
-            cache_mark_dirty(vol, sec);
-            off += 32;
-            if (off >= vol->bytes_per_sector) {
-                off = 0;
-                sec++;
-            }
-        }
-        cache_flush_all(vol);
+        return file_rewrite(vol, path, data, size);
     }
 
     /* Write file data to newly allocated clusters */
     UINT32 first_cluster = 0;
+    UINT8 stream_flags = 0;
     if (size > 0) {
-        if (write_data(vol, data, (UINT64)size, &first_cluster) != 0)
+        if (write_data(vol, data, (UINT64)size, &first_cluster,
+                       &stream_flags) != 0)
             return -1;
     }
 
@@ -1753,17 +2573,18 @@ int exfat_writefile(struct exfat_vol *vol, const char *path,
     UINT8 entry_buf[32 * 20]; /* max ~18 name entries + file + stream */
     mem_set(entry_buf, 0, sizeof(entry_buf));
     int entry_count = build_entry_set(entry_buf, filename, ATTR_ARCHIVE,
-                                      first_cluster, (UINT64)size);
+                                      first_cluster, (UINT64)size,
+                                      (UINT64)size, stream_flags);
     if (entry_count < 0)
         return -1;
 
     /* Add to parent directory */
-    if (add_entry_to_dir(vol, parent_cluster, entry_buf, entry_count) != 0)
+    if (add_entry_to_dir(vol, parent_cluster, entry_buf, entry_count,
+                         0, 0) != 0)
         return -1;
 
     /* Flush bitmap */
-    bitmap_flush(vol);
-    cache_flush_all(vol);
+    meta_commit(vol);
 
     return 0;
 }
@@ -1823,22 +2644,22 @@ int exfat_mkdir(struct exfat_vol *vol, const char *path)
             mem_set(buf, 0, vol->bytes_per_sector);
             cache_mark_dirty(vol, sec + s);
         }
-        cache_flush_all(vol);
+        meta_sync(vol);
 
         /* Build entry set for the new directory */
         UINT8 entry_buf[32 * 20];
         mem_set(entry_buf, 0, sizeof(entry_buf));
         int entry_count = build_entry_set(entry_buf, component,
-                                          ATTR_DIRECTORY, new_cluster, 0);
+                                          ATTR_DIRECTORY, new_cluster, 0, 0, 0);
         if (entry_count < 0)
             return -1;
 
         /* Add to parent directory */
-        if (add_entry_to_dir(vol, cur_cluster, entry_buf, entry_count) != 0)
+        if (add_entry_to_dir(vol, cur_cluster, entry_buf, entry_count,
+                             0, 0) != 0)
             return -1;
 
-        bitmap_flush(vol);
-        cache_flush_all(vol);
+        meta_commit(vol);
 
         cur_cluster = new_cluster;
     }
@@ -1875,6 +2696,8 @@ int exfat_rename(struct exfat_vol *vol, const char *path, const char *new_name)
     UINT16 attributes = info.attributes;
 
     /* Mark old directory entries as deleted */
+    dir_index_remove(vol, info.name, info.file_entry_sector,
+                     info.file_entry_offset);
     UINT64 sec = info.file_entry_sector;
     UINT32 off = info.file_entry_offset;
     int total = 1 + info.secondary_count;
@@ -1886,26 +2709,31 @@ int exfat_rename(struct exfat_vol *vol, const char *path, const char *new_name)
         buf[off] &= 0x7F;  /* Clear InUse bit */
         cache_mark_dirty(vol, sec);
         off += 32;
-        if (off >= vol->bytes_per_sector) {
+        if (off >= vol->bytes_per_sector && i + 1 < total) {
             off = 0;
-            sec++;
+            sec = dir_next_sector(vol, sec);
+            if (sec == 0)
+                return -1;
         }
     }
-    cache_flush_all(vol);
+    meta_sync(vol);
 
     /* Build new entry set with the new name */
     UINT8 entry_buf[32 * 20];
     mem_set(entry_buf, 0, sizeof(entry_buf));
     int entry_count = build_entry_set(entry_buf, new_name, attributes,
-                                      first_cluster, data_length);
+                                      first_cluster, data_length,
+                                      info.valid_data_length,
+                                      info.stream_flags);
     if (entry_count < 0)
         return -1;
 
     /* Add to parent directory */
-    if (add_entry_to_dir(vol, parent_cluster, entry_buf, entry_count) != 0)
+    if (add_entry_to_dir(vol, parent_cluster, entry_buf, entry_count,
+                         0, 0) != 0)
         return -1;
 
-    cache_flush_all(vol);
+    meta_sync(vol);
     return 0;
 }
 
@@ -1940,33 +2768,11 @@ int exfat_delete(struct exfat_vol *vol, const char *path)
         }
     }
 
-    /* Free the data clusters */
-    if (info.first_cluster >= 2) {
-        int no_fat = (info.stream_flags & STREAM_NO_FAT_CHAIN) ? 1 : 0;
-        free_chain(vol, info.first_cluster, no_fat, info.data_length);
-    }
-
-    /* Mark directory entries as deleted */
-    UINT64 sec = info.file_entry_sector;
-    UINT32 off = info.file_entry_offset;
-    int total = 1 + info.secondary_count;
-
-    for (int i = 0; i < total; i++) {
-        UINT8 *buf = cache_read(vol, sec);
-        if (!buf)
-            return -1;
-        buf[off] &= 0x7F;  /* Clear InUse bit */
-        cache_mark_dirty(vol, sec);
-        off += 32;
-        if (off >= vol->bytes_per_sector) {
-            off = 0;
-            sec++;
-        }
-    }
+    if (remove_entry(vol, &info) != 0)
+        return -1;
 
     /* Flush everything */
-    bitmap_flush(vol);
-    cache_flush_all(vol);
+    meta_commit(vol);
 
     return 0;
 }
@@ -1983,17 +2789,456 @@ int exfat_volume_info(struct exfat_vol *vol, UINT64 *total_bytes,
         *total_bytes = (UINT64)vol->cluster_count * (UINT64)clsz;
 
     if (free_bytes) {
-        UINT32 free_clusters = 0;
-        for (UINT32 i = 0; i < vol->cluster_count; i++) {
-            if (!bitmap_get(vol, i + 2))
-                free_clusters++;
+        if (bitmap_count_free(vol) != 0)
+            return -1;
+        *free_bytes = (UINT64)vol->free_clusters * (UINT64)clsz;
+    }
+
+    return 0;
+}
+
+int exfat_used_runs(struct exfat_vol *vol, fs_run_fn fn, void *ctx)
+{
+    struct used_runs u;
+    if (!vol || used_runs_init(&u, fn, ctx, vol->bytes_per_sector,
+                               vol->dev_block_size, vol->cluster_heap_offset,
+                               vol->sectors_per_cluster) != 0)
+        return -1;
+
+    /* Boot regions and FATs */
+    if (used_runs_sectors(&u, 0, vol->cluster_heap_offset))
+        return -1;
+
+    UINT32 n = bitmap_limit(vol);
+    for (UINT32 base = 0; base < n; base += BITMAP_PAGE_BITS) {
+        struct bitmap_page *pg = bitmap_page_get(vol, base / BITMAP_PAGE_BITS);
+        if (!pg)
+            return -1;
+        UINT32 bits = (n - base < BITMAP_PAGE_BITS) ? n - base
+                                                     : BITMAP_PAGE_BITS;
+        for (UINT32 i = 0; i < bits; ) {
+            UINT8 b = pg->data[i / 8];
+            int whole = i % 8 == 0 && bits - i >= 8 && (b == 0 || b == 0xFF);
+            UINT32 step = whole ? 8 : 1;
+            if (used_runs_clusters(&u, base + i + 2, step,
+                                   whole ? b != 0 : (b >> (i % 8)) & 1))
+                return -1;
+            i += step;
+        }
+    }
+    return used_runs_end(&u);
+}
+
+#ifndef ESP_PLATFORM
+
+/* ---- Consistency check (fsck.h) ---- */
+
+#define CHECK_NO_FAT_CHAIN 1    /* fsck_dir flags */
+
+struct check_state {
+    struct exfat_vol *vol;
+    struct fs_check *c;
+    UINT32 *fat;                /* the FAT read whole; NULL: through the cache */
+    UINT8  *bitmap;             /* the allocation bitmap as it stands */
+};
+
+static UINT32 check_next(struct check_state *s, UINT32 cl)
+{
+    return s->fat ? s->fat[cl] : fat_get(s->vol, cl);
+}
+
+/* Read the FAT front to back, max_transfer at a time. Without memory
+   for all of it, chains are followed through the cache instead. */
+static int check_load_fat(struct check_state *s)
+{
+    struct exfat_vol *vol = s->vol;
+    UINT32 bps = vol->bytes_per_sector;
+    UINT32 nsec = (UINT32)(((UINT64)vol->cluster_count + 2) * 4 / bps + 1);
+    if (nsec > vol->fat_length)
+        nsec = vol->fat_length;
+    s->fat = (UINT32 *)mem_alloc_raw((UINTN)nsec * bps);
+    if (!s->fat || (UINT64)nsec * bps < ((UINT64)vol->cluster_count + 2) * 4) {
+        if (s->fat)
+            mem_free(s->fat);
+        s->fat = 0;
+        return 0;
+    }
+
+    UINT32 chunk = vol->max_transfer / bps;
+    if (chunk == 0)
+        chunk = 1;
+    for (UINT32 sec = 0; sec < nsec && !s->c->cancel; ) {
+        UINT32 n = (nsec - sec < chunk) ? nsec - sec : chunk;
+        if (read_sectors_raw(vol, (UINT64)vol->fat_offset + sec, n,
+                             (UINT8 *)s->fat + (UINTN)sec * bps) != 0)
+            return -1;
+        sec += n;
+        fsck_progress(s->c, "Reading the FAT", (UINT64)sec * bps,
+                      (UINT64)nsec * bps);
+    }
+    return 0;
+}
+
+/* Read the allocation bitmap the same way; resident pages are newer */
+static int check_load_bitmap(struct check_state *s)
+{
+    struct exfat_vol *vol = s->vol;
+    UINT32 bps = vol->bytes_per_sector;
+    UINT32 nsec = bitmap_sector_count(vol);
+    if (bitmap_chain_build(vol) != 0)
+        return -1;
+    s->bitmap = (UINT8 *)mem_alloc((UINTN)nsec * bps + 8);
+    if (!s->bitmap)
+        return -1;
+
+    UINT32 chunk = vol->max_transfer / bps;
+    if (chunk == 0)
+        chunk = 1;
+    for (UINT32 sec = 0; sec < nsec && !s->c->cancel; ) {
+        UINT32 n = (nsec - sec < chunk) ? nsec - sec : chunk;
+        if (bitmap_io(vol, sec, n, s->bitmap + (UINTN)sec * bps, 0) != 0)
+            return -1;
+        sec += n;
+        fsck_progress(s->c, "Reading the bitmap", (UINT64)sec * bps,
+                      (UINT64)nsec * bps);
+    }
+
+    for (int i = 0; i < BITMAP_PAGE_SLOTS; i++) {
+        struct bitmap_page *pg = &vol->bitmap_pages[i];
+        if (!pg->stamp)
+            continue;
+        UINT64 off = (UINT64)pg->index * BITMAP_PAGE_SIZE;
+        UINT64 len = vol->bitmap_size - off;
+        if (len > BITMAP_PAGE_SIZE)
+            len = BITMAP_PAGE_SIZE;
+        mem_copy(s->bitmap + off, pg->data, (UINTN)len);
+    }
+    return 0;
+}
+
+/*
+ * Claim the clusters of a file or directory: size bytes from first,
+ * contiguous or along the FAT (size 0 on a chain: as far as it goes).
+ * What is wrong is reported against name in directory dir. Returns the
+ * clusters claimed; 0 also when the first was claimed already.
+ */
+static UINT32 check_chain(struct check_state *s, UINT32 dir, const char *name,
+                          UINT32 first, int no_fat_chain, UINT64 size)
+{
+    struct exfat_vol *vol = s->vol;
+    struct fs_check *c = s->c;
+    UINT32 clsz = cluster_size(vol);
+    UINT64 need = (size + clsz - 1) / clsz;
+    UINT32 end = vol->cluster_count + 2;
+
+    if (first == 0) {
+        if (need) {
+            c->bad_chains++;
+            fsck_problem(c, dir, name, "has a size but no clusters");
+        }
+        return 0;
+    }
+    if (first < 2 || first >= end) {
+        c->bad_chains++;
+        fsck_problem(c, dir, name, "starts outside the volume");
+        return 0;
+    }
+
+    UINT32 got = 0, crossed = 0;
+    if (no_fat_chain) {
+        if (need == 0)
+            need = 1;
+        if (need > end - first) {
+            c->bad_chains++;
+            fsck_problem(c, dir, name, "runs past the end of the volume");
+            need = end - first;
+        }
+        for (UINT32 i = 0; i < need; i++)
+            crossed |= fsck_claim(c, first - 2 + i);
+        got = (UINT32)need;
+    } else {
+        UINT32 cl = first;
+        for (;;) {
+            if (fsck_claim(c, cl - 2)) {
+                crossed = 1;
+                break;                  /* shared or looping: stop here */
+            }
+            got++;
+            if (need && got == need) {
+                UINT32 next = check_next(s, cl);
+                if (next != EXFAT_EOC) {
+                    c->size_mismatch++;
+                    fsck_problem(c, dir, name, "chain is longer than the file");
+                }
+                break;
+            }
+            UINT32 next = check_next(s, cl);
+            if (next == EXFAT_EOC)
+                break;
+            if (next < 2 || next >= end) {
+                c->bad_chains++;
+                fsck_problem(c, dir, name, next == EXFAT_BAD
+                             ? "chain runs into a bad cluster"
+                             : "chain runs into a free cluster");
+                need = 0;               /* not a size problem too */
+                break;
+            }
+            cl = next;
+        }
+        if (need && got < need && !crossed) {
+            c->size_mismatch++;
+            fsck_problem(c, dir, name, "chain is shorter than the file");
+        }
+    }
+    if (crossed) {
+        c->cross_links++;
+        fsck_problem(c, dir, name, "shares clusters with another file");
+    }
+    return (crossed && got == 0) ? 0 : got;
+}
+
+/* Check the entry set at the iterator in directory dir. Returns 0 with
+   the iterator on its last entry, 1 on the entry after it (one that
+   cut it short), -1 when out of memory. */
+static int check_entry_set(struct check_state *s, UINT32 dir,
+                           struct dir_iter *it)
+{
+    struct exfat_vol *vol = s->vol;
+    struct fs_check *c = s->c;
+    UINT8 set[19 * 32];
+    UINT64 sector = dir_iter_sector(it);
+    UINT32 offset = dir_iter_offset_in_sector(it);
+
+    struct exfat_dentry *de = dir_iter_get(it);
+    mem_copy(set, de, 32);
+    int count = 1 + set[1];
+    int have = 1, stay = 0;
+    if (count >= 3 && count <= 19) {
+        while (have < count && dir_iter_next(it) == 0 &&
+               (de = dir_iter_get(it)) != 0) {
+            if ((de->type & 0xC0) != 0xC0) {
+                stay = 1;
+                break;
+            }
+            mem_copy(set + have * 32, de, 32);
+            have++;
+        }
+    }
+
+    struct exfat_file_dentry fd;
+    struct exfat_stream_dentry sd;
+    mem_copy(&fd, set, 32);
+    mem_copy(&sd, set + 32, 32);
+    int names = 0;
+    for (int i = 2; i < have; i++)
+        names += set[i * 32] == ENTRY_NAME;
+
+    char name[FS_MAX_NAME];
+    UINT16 chars[255];
+    int n = 0;
+    for (int i = 2; i < have && n < 255; i++) {
+        if (set[i * 32] != ENTRY_NAME)
+            continue;
+        for (int k = 0; k < 15 && n < 255 && n < (int)sd.name_length; k++)
+            chars[n++] = (UINT16)(set[i * 32 + 2 + k * 2] |
+                                  (set[i * 32 + 3 + k * 2] << 8));
+    }
+    utf16_to_ascii(chars, n, name, FS_MAX_NAME);
+    if (!name[0])
+        str_copy(name, "(no name)", sizeof(name));
+
+    if (have < count || count < 3 || set[32] != ENTRY_STREAM ||
+        sd.name_length == 0 || names * 15 < (int)sd.name_length) {
+        c->bad_sets++;
+        fsck_problem(c, dir, name, "entry set is damaged");
+        return stay;                    /* its clusters show as lost */
+    }
+    if (entry_set_checksum(set, count) != fd.set_checksum) {
+        c->bad_sets++;
+        c->repaired++;
+        fsck_problem(c, dir, name, "entry set checksum is wrong");
+        if (c->repair) {
+            UINT8 *buf = cache_read(vol, sector);
+            UINT16 sum = entry_set_checksum(set, count);
+            if (buf) {
+                mem_copy(buf + offset + 2, &sum, 2);
+                cache_mark_dirty(vol, sector);
+            }
+        }
+    }
+
+    int no_fat_chain = (sd.flags & STREAM_NO_FAT_CHAIN) != 0;
+    if (fd.file_attributes & ATTR_DIRECTORY) {
+        c->dirs++;
+        if (sd.first_cluster == 0) {
+            c->bad_chains++;
+            fsck_problem(c, dir, name, "directory has no clusters");
+        } else if (fsck_dir_add(c, dir, name, sd.first_cluster,
+                                no_fat_chain ? CHECK_NO_FAT_CHAIN : 0,
+                                sd.data_length) == FSCK_ROOT) {
+            return -1;
         }
-        *free_bytes = (UINT64)free_clusters * (UINT64)clsz;
+    } else {
+        c->files++;
+        check_chain(s, dir, name, sd.first_cluster, no_fat_chain,
+                    sd.data_length);
     }
+    return 0;
+}
+
+/* Visit queued directory di: claim its clusters, check its entries */
+static int check_dir(struct check_state *s, UINT32 di)
+{
+    struct exfat_vol *vol = s->vol;
+    struct fs_check *c = s->c;
+    struct fsck_dir d = c->dir[di];     /* c->dir moves as it grows */
+    int root = d.parent == FSCK_ROOT;
+    UINT32 parent = root ? FSCK_ROOT : d.parent;
+    const char *name = root ? 0 : c->pool + d.name;
+
+    if (check_chain(s, parent, name, d.cluster, d.flags & CHECK_NO_FAT_CHAIN,
+                    d.size) == 0)
+        return 0;
 
+    struct dir_iter it;
+    if (dir_iter_init(&it, vol, d.cluster, d.flags & CHECK_NO_FAT_CHAIN,
+                      d.size) != 0) {
+        fsck_problem(c, parent, name, "directory cannot be read");
+        return 0;
+    }
+    for (;;) {
+        struct exfat_dentry *de = dir_iter_get(&it);
+        if (!de || de->type == ENTRY_EOD)
+            break;
+        if (de->type == ENTRY_FILE) {
+            int r = check_entry_set(s, di, &it);
+            if (r < 0)
+                return -1;
+            if (r > 0)
+                continue;               /* on an entry not yet looked at */
+        } else if (root && (de->type == ENTRY_BITMAP ||
+                            de->type == ENTRY_UPCASE)) {
+            struct exfat_bitmap_dentry bd;  /* same layout for the up-case */
+            mem_copy(&bd, de, 32);
+            check_chain(s, di, de->type == ENTRY_BITMAP ? "(allocation bitmap)"
+                                                        : "(up-case table)",
+                        bd.first_cluster, 0, bd.data_length);
+        } else if ((de->type & 0xC0) == 0xC0) {
+            c->bad_sets++;
+            fsck_problem(c, di, "(stray entry)", "belongs to no entry set");
+        }
+        if (dir_iter_next(&it) != 0)
+            break;
+    }
     return 0;
 }
 
+static void check_lost_run(struct check_state *s, UINT32 from, UINT32 to)
+{
+    char what[80];
+    snprintf(what, sizeof(what), "clusters %u-%u are allocated to nothing",
+             from + 2, to + 1);
+    fsck_problem(s->c, FSCK_ROOT, "(lost)", what);
+    s->c->lost_chains++;
+    s->c->repaired++;
+}
+
+/* Compare what the tree claims with the bitmap; repair makes the bitmap
+   say what the tree claims */
+static void check_bitmap(struct check_state *s)
+{
+    struct exfat_vol *vol = s->vol;
+    struct fs_check *c = s->c;
+    UINT32 n = bitmap_limit(vol);
+    UINT32 lost_from = 0;
+    int in_lost = 0;
+
+    for (UINT32 i = 0; i < n; i++) {
+        if ((i & 7) == 0 && n - i >= 8 && s->bitmap[i / 8] == c->claimed[i / 8]) {
+            if (in_lost)
+                check_lost_run(s, lost_from, i);
+            in_lost = 0;
+            i += 7;
+            continue;                   /* eight that agree */
+        }
+        int used = (s->bitmap[i / 8] >> (i % 8)) & 1;
+        int claimed = fsck_claimed(c, i);
+        if (used && !claimed) {
+            if (!in_lost)
+                lost_from = i;
+            in_lost = 1;
+            c->lost_clusters++;
+            if (c->repair)
+                bitmap_set(vol, i + 2, 0);
+            continue;
+        }
+        if (in_lost)
+            check_lost_run(s, lost_from, i);
+        in_lost = 0;
+        if (claimed && !used) {
+            if (c->unallocated++ == 0)
+                fsck_problem(c, FSCK_ROOT, "(bitmap)",
+                             "clusters in use are marked free");
+            c->repaired++;
+            if (c->repair)
+                bitmap_set(vol, i + 2, 1);
+        }
+    }
+    if (in_lost)
+        check_lost_run(s, lost_from, n);
+}
+
+int exfat_check(struct exfat_vol *vol, struct fs_check *c)
+{
+    if (!vol || !c)
+        return -1;
+    if (c->repair && !vol->write_fn)
+        c->repair = 0;
+    if (fsck_begin(c, vol->cluster_count, cluster_size(vol)) != 0)
+        return -1;
+
+    struct check_state s;
+    s.vol = vol;
+    s.c = c;
+    s.fat = 0;
+    s.bitmap = 0;
+    int rc = -1;
+    if (check_load_fat(&s) != 0 || check_load_bitmap(&s) != 0) {
+        c->io_error = 1;
+        goto out;
+    }
+
+    if (fsck_dir_add(c, FSCK_ROOT, "", vol->root_cluster, 0, 0) == FSCK_ROOT)
+        goto out;
+    UINT32 first, end, done = 0;
+    while (!c->cancel && fsck_next_level(c, &first, &end)) {
+        for (UINT32 i = first; i < end && !c->cancel; i++) {
+            if (check_dir(&s, i) != 0)
+                goto out;
+            fsck_progress(c, "Directories", ++done, c->dir_count);
+        }
+    }
+    if (c->cancel)
+        goto out;
+
+    check_bitmap(&s);
+    rc = 0;
+    if (c->repair && meta_commit(vol) != 0) {
+        c->io_error = 1;
+        rc = -1;
+    }
+
+out:
+    if (s.fat)
+        mem_free(s.fat);
+    if (s.bitmap)
+        mem_free(s.bitmap);
+    fsck_end(c);
+    return rc;
+}
+
+#endif /* ESP_PLATFORM */
+
 UINT64 exfat_file_size(struct exfat_vol *vol, const char *path)
 {
     if (!vol || !path)
@@ -2024,3 +3269,1082 @@ const char *exfat_get_label(struct exfat_vol *vol)
         return "";
     return vol->label;
 }
+
+/* ---- Streaming file handles ---- */
+
+struct exfat_file {
+    struct exfat_vol *vol;
+    int    writable;
+    UINT64 size;                 /* reader: file size; writer: bytes on disk */
+    UINT64 valid;                /* reader: ValidDataLength; zeroes past it */
+    UINT64 pos;
+    UINT32 first_cluster;
+    int    no_fat_chain;
+
+    /* Cluster cursor: cur_cluster holds file bytes [cur_base, +clsz) */
+    UINT32 cur_cluster;
+    UINT64 cur_base;
+
+    /* Reader of a FAT-chained file: its chain as runs (runmap.h), built
+       by the first seek, so no seek walks the chain again; the current
+       run holds cur_cluster */
+    struct run_map map;
+
+    /* Writer: pending data (whole clusters except at close) */
+    UINT8  *wbuf;
+    UINT32 wcap;
+    UINT32 wlen;
+    UINT32 last_cluster;
+    UINT64 reserved;             /* bytes of clusters in the chain */
+    int    failed;               /* a flush failed: later writes fail too */
+
+    /* Writer: where the entry set lives, rewritten on close */
+    char   name[FS_MAX_NAME];
+    UINT64 entry_sector;
+    UINT32 entry_offset;
+    int    in_place;             /* an existing set: only its stream changes */
+    int    entry_count;          /* its entries, for in_place */
+
+    /* Writer of an in_place set: the old layout, put back if a write
+       fails */
+    UINT32 old_first;
+    int    old_no_fat_chain;
+    UINT64 old_reserved;
+    UINT64 old_length, old_valid;
+};
+
+/* A write handle with its buffer: whole clusters, about max_transfer bytes */
+static struct exfat_file *file_writer(struct exfat_vol *vol)
+{
+    struct exfat_file *f =
+        (struct exfat_file *)mem_alloc(sizeof(struct exfat_file));
+    if (!f)
+        return 0;
+
+    UINT32 clsz = cluster_size(vol);
+    f->wcap = (vol->max_transfer / clsz) * clsz;
+    if (f->wcap == 0)
+        f->wcap = clsz;
+    f->wbuf = (UINT8 *)mem_alloc(f->wcap);
+    if (!f->wbuf) {
+        mem_free(f);
+        return 0;
+    }
+    f->vol = vol;
+    f->writable = 1;
+    return f;
+}
+
+/*
+ * Walk a reader's cluster chain once into f->map, so a seek is a binary
+ * search instead of one FAT lookup per cluster from the start.  A chain
+ * that ends early is mapped as far as it goes.  Returns 0 if the map is
+ * usable.
+ */
+static int file_map_chain(struct exfat_file *f)
+{
+    struct exfat_vol *vol = f->vol;
+    UINT32 clsz = cluster_size(vol);
+    UINT64 want = (f->size + clsz - 1) / clsz;
+
+    if (run_map_init(&f->map) != 0)
+        return -1;
+    UINT32 cl = f->first_cluster;
+    for (UINT64 i = 0; i < want; i++) {
+        if (cl < 2 || cl >= vol->cluster_count + 2)
+            break;
+        if (run_map_add(&f->map, cl) != 0)
+            return -1;
+        cl = fat_get(vol, cl);
+    }
+    return 0;
+}
+
+/* Move the cluster cursor to the cluster holding file offset 'off' */
+static int file_seek_cluster(struct exfat_file *f, UINT64 off)
+{
+    struct exfat_vol *vol = f->vol;
+    UINT32 clsz = cluster_size(vol);
+
+    if (!f->writable && !f->no_fat_chain && !f->map.runs &&
+        !f->map.failed && f->size > clsz)
+        file_map_chain(f);
+
+    if (f->map.runs) {
+        UINT64 idx = off / clsz;
+        if (run_map_seek(&f->map, idx, &f->cur_cluster) != 0)
+            return -1;
+        f->cur_base = idx * clsz;
+        return 0;
+    }
+
+    if (f->cur_cluster < 2 || off < f->cur_base) {
+        f->cur_cluster = f->first_cluster;
+        f->cur_base = 0;
+    }
+
+    if (f->no_fat_chain) {
+        UINT64 skip = (off - f->cur_base) / clsz;
+        f->cur_cluster += (UINT32)skip;
+        f->cur_base += skip * clsz;
+        return 0;
+    }
+
+    while (off - f->cur_base >= clsz) {
+        UINT32 next = fat_get(vol, f->cur_cluster);
+        if (next < 2 || next == EXFAT_EOC || next == EXFAT_BAD)
+            return -1;
+        f->cur_cluster = next;
+        f->cur_base += clsz;
+    }
+    return 0;
+}
+
+/*
+ * Read len bytes at file offset off. Contiguous clusters are merged into
+ * one device read of up to max_transfer bytes; unaligned head and tail
+ * sectors go through the sector cache.
+ */
+static int file_read_at(struct exfat_file *f, UINT64 off, UINT8 *dst,
+                        UINTN len)
+{
+    struct exfat_vol *vol = f->vol;
+    UINT32 clsz = cluster_size(vol);
+    UINT32 bps = vol->bytes_per_sector;
+    UINT32 max_run = vol->max_transfer / clsz;
+    if (max_run == 0)
+        max_run = 1;
+
+    while (len > 0) {
+        if (file_seek_cluster(f, off) != 0)
+            return -1;
+
+        UINT32 in_cl = (UINT32)(off - f->cur_base);
+        UINT32 left = run_map_left(&f->map, f->cur_cluster);
+        UINT32 run = 1;
+        while ((UINT64)run * clsz - in_cl < len && run < max_run) {
+            if (left) {
+                if (run == left)
+                    break;
+            } else {
+                UINT32 last = f->cur_cluster + run - 1;
+                UINT32 next = f->no_fat_chain ? last + 1 : fat_get(vol, last);
+                if (next != last + 1)
+                    break;
+            }
+            run++;
+        }
+
+        UINT64 avail = (UINT64)run * clsz - in_cl;
+        UINT32 chunk = (avail < len) ? (UINT32)avail : (UINT32)len;
+        UINT64 sec = cluster_to_sector(vol, f->cur_cluster) + in_cl / bps;
+        UINT32 soff = in_cl % bps;
+        UINT32 done = 0;
+
+        if (soff > 0) {
+            UINT8 *tmp = cache_read(vol, sec);
+            if (!tmp)
+                return -1;
+            UINT32 n = bps - soff;
+            if (n > chunk)
+                n = chunk;
+            mem_copy(dst, tmp + soff, n);
+            done = n;
+            sec++;
+        }
+
+        UINT32 full_secs = (chunk - done) / bps;
+        if (full_secs > 0) {
+            if (read_sectors_raw(vol, sec, full_secs, dst + done) != 0)
+                return -1;
+            done += full_secs * bps;
+            sec += full_secs;
+        }
+
+        if (done < chunk) {
+            UINT8 *tmp = cache_read(vol, sec);
+            if (!tmp)
+                return -1;
+            mem_copy(dst + done, tmp, chunk - done);
+        }
+
+        off += chunk;
+        dst += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+struct exfat_file *exfat_open(struct exfat_vol *vol, const char *path,
+                              UINT64 *out_size)
+{
+    if (!vol || !path)
+        return 0;
+
+    struct exfat_entry_info info;
+    if (resolve_path(vol, path, &info) != 0)
+        return 0;
+    if (info.attributes & ATTR_DIRECTORY)
+        return 0;
+
+    struct exfat_file *f =
+        (struct exfat_file *)mem_alloc(sizeof(struct exfat_file));
+    if (!f)
+        return 0;
+
+    f->vol = vol;
+    f->size = info.data_length;
+    f->valid = info.valid_data_length < f->size ? info.valid_data_length
+                                                : f->size;
+    f->first_cluster = info.first_cluster;
+    f->no_fat_chain = (info.stream_flags & STREAM_NO_FAT_CHAIN) ? 1 : 0;
+
+    if (out_size)
+        *out_size = f->size;
+    return f;
+}
+
+struct exfat_file *exfat_create(struct exfat_vol *vol, const char *path)
+{
+    if (!vol || !path)
+        return 0;
+    if (!vol->write_fn)
+        return 0;
+
+    char filename[FS_MAX_NAME];
+    UINT32 parent_cluster = resolve_parent(vol, path, filename, FS_MAX_NAME);
+    if (parent_cluster == 0)
+        return 0;
+
+    struct exfat_entry_info existing;
+    if (find_in_dir(vol, parent_cluster, filename, &existing) == 0) {
+        if (existing.attributes & ATTR_DIRECTORY)
+            return 0;
+        if (remove_entry(vol, &existing) != 0)
+            return 0;
+    }
+
+    struct exfat_file *f = file_writer(vol);
+    if (!f)
+        return 0;
+
+    /* Publish an empty entry now so the slot is known; close fills in
+       the first cluster and length */
+    UINT8 entry_buf[32 * 20];
+    int entry_count = build_entry_set(entry_buf, filename, ATTR_ARCHIVE,
+                                      0, 0, 0, 0);
+    if (entry_count < 0 ||
+        add_entry_to_dir(vol, parent_cluster, entry_buf, entry_count,
+                         &f->entry_sector, &f->entry_offset) != 0) {
+        mem_free(f->wbuf);
+        mem_free(f);
+        return 0;
+    }
+    meta_commit(vol);
+
+    str_copy(f->name, filename, FS_MAX_NAME);
+    return f;
+}
+
+struct exfat_file *exfat_overwrite(struct exfat_vol *vol, const char *path)
+{
+    if (!vol || !path || !vol->write_fn)
+        return 0;
+
+    struct exfat_entry_info info;
+    if (resolve_path(vol, path, &info) != 0)
+        return exfat_create(vol, path);
+    if (info.attributes & ATTR_DIRECTORY)
+        return 0;
+
+    struct exfat_file *f = file_writer(vol);
+    if (!f)
+        return 0;
+    f->in_place = 1;
+    f->entry_sector = info.file_entry_sector;
+    f->entry_offset = info.file_entry_offset;
+    f->entry_count = 1 + info.secondary_count;
+    str_copy(f->name, info.name, FS_MAX_NAME);
+
+    /* The old clusters are the new file's until they run out */
+    UINT32 clsz = cluster_size(vol);
+    UINT64 have = (info.data_length + clsz - 1) / clsz;
+    if (info.first_cluster >= 2 && have > 0) {
+        f->first_cluster = info.first_cluster;
+        f->no_fat_chain = (info.stream_flags & STREAM_NO_FAT_CHAIN) ? 1 : 0;
+        f->reserved = have * clsz;
+        if (f->no_fat_chain) {
+            f->last_cluster = f->first_cluster + (UINT32)have - 1;
+        } else if (file_seek_cluster(f, f->reserved - clsz) == 0) {
+            f->last_cluster = f->cur_cluster;
+        } else {
+            mem_free(f->wbuf);
+            mem_free(f);
+            return 0;
+        }
+    }
+    f->old_first = f->first_cluster;
+    f->old_no_fat_chain = f->no_fat_chain;
+    f->old_reserved = f->reserved;
+    f->old_length = info.data_length;
+    f->old_valid = info.valid_data_length;
+    return f;
+}
+
+int exfat_read(struct exfat_file *f, void *buf, UINTN *size)
+{
+    if (!f || !size || f->writable)
+        return -1;
+
+    UINTN want = *size;
+    if (f->pos >= f->size)
+        want = 0;
+    else if ((UINT64)want > f->size - f->pos)
+        want = (UINTN)(f->size - f->pos);
+
+    *size = 0;
+    if (want == 0)
+        return 0;
+
+    /* Past the valid length the file reads as zeroes */
+    UINTN disk = want;
+    if (f->pos >= f->valid)
+        disk = 0;
+    else if ((UINT64)disk > f->valid - f->pos)
+        disk = (UINTN)(f->valid - f->pos);
+    if (disk > 0 && file_read_at(f, f->pos, (UINT8 *)buf, disk) != 0)
+        return -1;
+    if (disk < want)
+        mem_set((UINT8 *)buf + disk, 0, want - disk);
+
+    f->pos += want;
+    *size = want;
+    return 0;
+}
+
+/*
+ * Add the clusters [cl, cl+count) to the end of a file being written.
+ * While the file stays contiguous it is NoFatChain and the FAT is never
+ * written; the first extent that cannot continue the run converts it to
+ * a FAT chain.
+ */
+static int file_append_extent(struct exfat_file *f, UINT32 cl, UINT32 count)
+{
+    struct exfat_vol *vol = f->vol;
+
+    if (f->first_cluster == 0) {
+        f->first_cluster = cl;
+        f->no_fat_chain = 1;
+    } else if (cl != f->last_cluster + 1 && f->no_fat_chain) {
+        /* Contiguity broken: give the clusters so far a FAT chain */
+        UINT32 used = f->last_cluster - f->first_cluster + 1;
+        if (fat_chain_extent(vol, 0, f->first_cluster, used) != 0)
+            return -1;
+        f->no_fat_chain = 0;
+    }
+    if (!f->no_fat_chain &&
+        fat_chain_extent(vol, f->last_cluster, cl, count) != 0)
+        return -1;
+    f->last_cluster = cl + count - 1;
+    f->reserved += (UINT64)count * cluster_size(vol);
+    return 0;
+}
+
+/*
+ * Write out the pending buffer. It goes first into the clusters the
+ * chain already holds (exfat_preallocate()'s, or an overwritten file's),
+ * merging runs that are adjacent on disk; the rest is allocated right
+ * after the file's last cluster when possible. On the final flush the
+ * tail of the last cluster is zeroed. Only a flush that succeeds adds
+ * to f->size; one that fails marks the handle failed, and clusters it
+ * linked stay in the chain for exfat_close() to trim.
+ */
+static int file_flush_wbuf(struct exfat_file *f)
+{
+    struct exfat_vol *vol = f->vol;
+    UINT32 clsz = cluster_size(vol);
+    UINT32 nclusters = (f->wlen + clsz - 1) / clsz;
+
+    if (nclusters == 0)
+        return 0;
+    if (f->wlen < nclusters * clsz)
+        mem_set(f->wbuf + f->wlen, 0, nclusters * clsz - f->wlen);
+
+    UINT8 *src = f->wbuf;
+    UINT64 off = f->size;               /* file offset of wbuf */
+    f->failed = 1;                      /* until the end is reached */
+    while (nclusters > 0 && off < f->reserved) {
+        if (file_seek_cluster(f, off) != 0)
+            return -1;
+        UINT32 run = 1;
+        while (run < nclusters && off + (UINT64)run * clsz < f->reserved) {
+            UINT32 last = f->cur_cluster + run - 1;
+            UINT32 next = f->no_fat_chain ? last + 1 : fat_get(vol, last);
+            if (next != last + 1)
+                break;
+            run++;
+        }
+        if (write_sectors_raw(vol, cluster_to_sector(vol, f->cur_cluster),
+                              run * vol->sectors_per_cluster, src) != 0)
+            return -1;
+        src += (UINT64)run * clsz;
+        off += (UINT64)run * clsz;
+        nclusters -= run;
+    }
+
+    while (nclusters > 0) {
+        UINT32 hint = f->last_cluster ? f->last_cluster + 1 : 0;
+        UINT32 got;
+        UINT32 cl = alloc_extent(vol, hint, nclusters, &got);
+        if (cl == 0)
+            return -1;
+        if (file_append_extent(f, cl, got) != 0) {
+            for (UINT32 i = 0; i < got; i++)
+                bitmap_set(vol, cl + i, 0);
+            return -1;
+        }
+
+        if (write_sectors_raw(vol, cluster_to_sector(vol, cl),
+                              got * vol->sectors_per_cluster, src) != 0)
+            return -1;
+        src += (UINT64)got * clsz;
+        nclusters -= got;
+    }
+
+    f->size += f->wlen;
+    f->wlen = 0;
+    f->failed = 0;
+    return 0;
+}
+
+/*
+ * Record the file's layout in its entry set. A new set is rebuilt; one
+ * exfat_overwrite() found keeps its name, attributes and times, and
+ * only its stream entry and checksum change.
+ */
+static int file_write_entry(struct exfat_file *f, UINT64 data_length,
+                            UINT64 valid_length)
+{
+    struct exfat_vol *vol = f->vol;
+    UINT8 entry_buf[32 * 20];
+    UINT8 flags = f->no_fat_chain ? STREAM_NO_FAT_CHAIN : 0;
+
+    if (!f->in_place) {
+        int entry_count = build_entry_set(entry_buf, f->name, ATTR_ARCHIVE,
+                                          f->first_cluster, data_length,
+                                          valid_length, flags);
+        if (entry_count < 0)
+            return -1;
+        return write_entry_set(vol, f->entry_sector, f->entry_offset,
+                               entry_buf, entry_count);
+    }
+
+    int count = f->entry_count;
+    if (count < 3 || count > 20 ||
+        read_entry_set(vol, f->entry_sector, f->entry_offset,
+                       entry_buf, count) != 0)
+        return -1;
+
+    struct exfat_file_dentry *fd = (struct exfat_file_dentry *)entry_buf;
+    struct exfat_stream_dentry *sd =
+        (struct exfat_stream_dentry *)(entry_buf + 32);
+    if (fd->type != ENTRY_FILE || sd->type != ENTRY_STREAM)
+        return -1;
+    fd->file_attributes |= ATTR_ARCHIVE;
+    sd->flags = (UINT8)((sd->flags & ~STREAM_NO_FAT_CHAIN) |
+                        (f->first_cluster ? flags : 0));
+    sd->first_cluster = f->first_cluster;
+    sd->data_length = data_length;
+    sd->valid_data_length = valid_length;
+    UINT16 checksum = entry_set_checksum(entry_buf, count);
+    mem_copy(entry_buf + 2, &checksum, 2);
+    return write_entry_set(vol, f->entry_sector, f->entry_offset,
+                           entry_buf, count);
+}
+
+/* Cut the chain to the clusters holding the first bytes of the file,
+   giving back the rest: reserved ones never written, or ones a failed
+   flush linked */
+static int file_trim(struct exfat_file *f, UINT64 bytes)
+{
+    struct exfat_vol *vol = f->vol;
+    UINT32 clsz = cluster_size(vol);
+    UINT64 keep = (bytes + clsz - 1) / clsz;
+    UINT64 have = f->reserved / clsz;
+
+    if (keep >= have)
+        return 0;
+    if (keep == 0) {
+        free_chain(vol, f->first_cluster, f->no_fat_chain, f->reserved);
+        f->first_cluster = 0;
+        f->no_fat_chain = 0;
+        f->last_cluster = 0;
+        f->reserved = 0;
+        return 0;
+    }
+    if (f->no_fat_chain) {
+        for (UINT64 i = keep; i < have; i++)
+            bitmap_set(vol, f->first_cluster + (UINT32)i, 0);
+        f->last_cluster = f->first_cluster + (UINT32)keep - 1;
+        f->reserved = keep * clsz;
+        return 0;
+    }
+    if (file_seek_cluster(f, (keep - 1) * clsz) != 0)
+        return -1;
+    UINT32 next = fat_get(vol, f->cur_cluster);
+    if (fat_set(vol, f->cur_cluster, EXFAT_EOC) != 0)
+        return -1;
+    free_chain(vol, next, 0, 0);
+    f->last_cluster = f->cur_cluster;
+    f->reserved = keep * clsz;
+    return 0;
+}
+
+int exfat_preallocate(struct exfat_file *f, UINT64 size)
+{
+    if (!f || !f->writable || f->pos != 0)
+        return -1;
+
+    /* The chain holds an overwritten file's old clusters already, or
+       an earlier reservation */
+    struct exfat_vol *vol = f->vol;
+    UINT32 clsz = cluster_size(vol);
+    UINT64 want = (size + clsz - 1) / clsz;
+    UINT64 have = f->reserved / clsz;
+    if (want <= have)
+        return 0;
+    want -= have;
+    if (want > vol->cluster_count ||
+        (vol->free_valid && want > vol->free_clusters))
+        return -1;
+
+    /* One extent if the bitmap has a run that long, else the longest
+       runs there are */
+    UINT32 left = (UINT32)want;
+    while (left > 0) {
+        UINT32 hint = f->last_cluster ? f->last_cluster + 1 : 0;
+        UINT32 got;
+        UINT32 cl = alloc_extent(vol, hint, left, &got);
+        if (cl == 0 || file_append_extent(f, cl, got) != 0) {
+            for (UINT32 i = 0; i < got; i++)
+                bitmap_set(vol, cl + i, 0);
+            file_trim(f, have * clsz);
+            return -1;
+        }
+        left -= got;
+    }
+
+    /* An overwritten file keeps its old entry until close */
+    if (f->in_place)
+        return 0;
+
+    /* DataLength now, ValidDataLength 0 until close says how far the
+       writes got */
+    if (file_write_entry(f, size, 0) == 0 && meta_commit(vol) == 0)
+        return 0;
+
+    /* Not recorded: nothing is reserved, and the entry says so */
+    file_trim(f, 0);
+    file_write_entry(f, 0, 0);
+    return -1;
+}
+
+int exfat_write(struct exfat_file *f, const void *buf, UINTN size)
+{
+    if (!f || !f->writable || f->failed)
+        return -1;
+
+    const UINT8 *src = (const UINT8 *)buf;
+    while (size > 0) {
+        UINT32 n = f->wcap - f->wlen;
+        if ((UINTN)n > size)
+            n = (UINT32)size;
+        mem_copy(f->wbuf + f->wlen, src, n);
+        f->wlen += n;
+        src += n;
+        size -= n;
+        f->pos += n;
+
+        if (f->wlen == f->wcap && file_flush_wbuf(f) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* exfat_writefile() of an existing file: all the room is taken before
+   the first byte goes over the old ones, so a file that does not fit
+   is left as it was */
+static int file_rewrite(struct exfat_vol *vol, const char *path,
+                        const void *data, UINTN size)
+{
+    struct exfat_file *f = exfat_overwrite(vol, path);
+    if (!f)
+        return -1;
+    int rc = exfat_preallocate(f, size);
+    if (rc == 0)
+        rc = exfat_write(f, data, size);
+    else
+        f->failed = 1;
+    if (exfat_close(f) != 0)
+        rc = -1;
+    return rc;
+}
+
+int exfat_seek(struct exfat_file *f, UINT64 pos)
+{
+    if (!f)
+        return -1;
+    if (f->writable)
+        return (pos == f->pos) ? 0 : -1;  /* append-only */
+    f->pos = (pos > f->size) ? f->size : pos;
+    return 0;
+}
+
+int exfat_close(struct exfat_file *f)
+{
+    if (!f)
+        return -1;
+
+    int rc = 0;
+    if (f->writable) {
+        struct exfat_vol *vol = f->vol;
+
+        /* After a failed flush the file is what reached the disk */
+        if (f->failed || file_flush_wbuf(f) != 0)
+            rc = -1;
+        UINT64 length = f->size, valid = f->size;
+        if (rc != 0 && f->in_place && file_trim(f, f->old_reserved) == 0) {
+            /* A failed overwrite goes back to the old layout; what was
+               written over the old clusters stays */
+            f->first_cluster = f->old_first;
+            f->no_fat_chain = f->old_no_fat_chain;
+            length = f->old_length;
+            valid = f->old_valid;
+        } else if (file_trim(f, f->size) != 0) {
+            /* The chain may still hold more than the file: cover it,
+               rather than leave clusters allocated to nothing */
+            length = f->reserved;
+            rc = -1;
+        }
+
+        /* Rewrite the entry set in place with the final layout */
+        if (file_write_entry(f, length, valid) != 0)
+            rc = -1;
+
+        if (meta_commit(vol) != 0)
+            rc = -1;
+        mem_free(f->wbuf);
+    }
+
+    run_map_free(&f->map);
+    mem_free(f);
+    return rc;
+}
+
+/* ---- Extent map ---- */
+
+int exfat_extents(struct exfat_vol *vol, const char *path,
+                  struct fs_extent *out, int max)
+{
+    if (!vol || !path || !out || max <= 0)
+        return -1;
+
+    struct exfat_entry_info info;
+    if (resolve_path(vol, path, &info) != 0)
+        return -1;
+    if (info.attributes & ATTR_DIRECTORY)
+        return -1;
+    /* Past the valid length reads return zeroes, not what is on disk */
+    if (info.valid_data_length < info.data_length)
+        return -1;
+
+    int no_fat_chain = (info.stream_flags & STREAM_NO_FAT_CHAIN) ? 1 : 0;
+    UINT32 clsz = cluster_size(vol);
+    UINT32 cluster = info.first_cluster;
+    UINT64 offset = 0;
+    int n = 0;
+
+    while (offset < info.data_length) {
+        if (cluster < 2 || cluster >= vol->cluster_count + 2)
+            return -1;
+        UINT64 len = info.data_length - offset;
+        if (len > clsz)
+            len = clsz;
+        UINT64 pos = cluster_to_sector(vol, cluster) * vol->bytes_per_sector;
+
+        if (n > 0 && out[n - 1].pos + out[n - 1].length == pos) {
+            out[n - 1].length += len;
+        } else {
+            if (n == max)
+                return -1;
+            out[n].offset = offset;
+            out[n].pos = pos;
+            out[n].length = len;
+            n++;
+        }
+
+        offset += len;
+        cluster = no_fat_chain ? cluster + 1 : fat_get(vol, cluster);
+    }
+    return n;
+}
+
+#ifndef ESP_PLATFORM
+
+/* ---- Relocation ---- */
+
+/* Device blocks in count exFAT sectors */
+static UINT64 sector_blocks(struct exfat_vol *vol, UINT64 count)
+{
+    return count * (vol->bytes_per_sector / vol->dev_block_size);
+}
+
+/* Point a file's entry set at one NoFatChain run from 'first' */
+static int relocate_entry(struct exfat_vol *vol,
+                          const struct exfat_entry_info *info, UINT32 first)
+{
+    UINT8 set[32 * 20];
+    int count = 1 + info->secondary_count;
+    if (count < 3 || count > 20 ||
+        read_entry_set(vol, info->file_entry_sector, info->file_entry_offset,
+                       set, count) != 0)
+        return -1;
+
+    struct exfat_stream_dentry *sd = (struct exfat_stream_dentry *)(set + 32);
+    if (set[0] != ENTRY_FILE || sd->type != ENTRY_STREAM)
+        return -1;
+    sd->flags |= STREAM_NO_FAT_CHAIN;
+    sd->first_cluster = first;
+    UINT16 checksum = entry_set_checksum(set, count);
+    mem_copy(set + 2, &checksum, 2);
+    if (write_entry_set(vol, info->file_entry_sector, info->file_entry_offset,
+                        set, count) != 0)
+        return -1;
+    return cache_flush_all(vol);
+}
+
+int exfat_relocate(struct exfat_vol *vol, const char *path,
+                   const struct fs_mover *m)
+{
+    if (!vol || !path || !m || !vol->write_fn)
+        return -1;
+
+    struct exfat_entry_info info;
+    if (resolve_path(vol, path, &info) != 0)
+        return -1;
+    if ((info.attributes & ATTR_DIRECTORY) || info.first_cluster < 2 ||
+        (info.stream_flags & STREAM_NO_FAT_CHAIN))
+        return 1;
+
+    UINT32 clsz = cluster_size(vol);
+    UINT64 want = (info.data_length + clsz - 1) / clsz;
+    if (want == 0)
+        return 1;
+    if (want > vol->cluster_count)
+        return -1;
+    UINT32 n = (UINT32)want;
+
+    /* Where the chain breaks; a chain with no break only needs the flag */
+    UINT32 breaks = 0, cl = info.first_cluster;
+    for (UINT32 i = 0; i < n; i++) {
+        if (cl < 2 || cl >= vol->cluster_count + 2)
+            return -1;
+        UINT32 next = fat_get(vol, cl);
+        if (i + 1 < n && next != cl + 1)
+            breaks++;
+        cl = next;
+    }
+    if (breaks == 0) {
+        if (relocate_entry(vol, &info, info.first_cluster) != 0 ||
+            m->barrier(m->ctx) != 0)
+            return -1;
+        for (UINT32 i = 0; i < n; i++)
+            fat_set(vol, info.first_cluster + i, EXFAT_FREE);
+        return cache_flush_all(vol);
+    }
+
+    UINT32 got;
+    UINT32 dst = alloc_extent(vol, 0, n, &got);
+    if (got < n) {
+        if (dst)
+            free_chain(vol, dst, 1, (UINT64)got * clsz);
+        return 1;
+    }
+
+    /* The run is in use on disk before anything points at it; this also
+       writes out cached data sectors, so the device holds all of the file */
+    UINT64 spc = vol->sectors_per_cluster;
+    if (bitmap_flush(vol) != 0 || m->barrier(m->ctx) != 0)
+        goto undo;
+
+    cl = info.first_cluster;
+    for (UINT32 i = 0; i < n; ) {
+        UINT32 len = 1;
+        while (i + len < n && fat_get(vol, cl + len - 1) == cl + len)
+            len++;
+        if (m->move(m->ctx,
+                    sector_blocks(vol, cluster_to_sector(vol, cl)),
+                    sector_blocks(vol, cluster_to_sector(vol, dst + i)),
+                    sector_blocks(vol, len * spc)) != 0)
+            goto undo;
+        i += len;
+        cl = fat_get(vol, cl + len - 1);
+    }
+    if (m->barrier(m->ctx) != 0)
+        goto undo;
+
+    /* Copies of the run from before are stale now */
+    UINT64 first = cluster_to_sector(vol, dst);
+    for (UINT64 s = 0; s < n * spc; s++)
+        if (EFI_ERROR(bcache_invalidate(vol->cache, first + s)))
+            goto undo;
+    dir_run_drop(vol, first, (UINT32)(n * spc));
+
+    /* Both layouts are whole from here: a failure strands the new run
+       rather than free it under an entry that may point at it */
+    if (relocate_entry(vol, &info, dst) != 0 || m->barrier(m->ctx) != 0)
+        return -1;
+    free_chain(vol, info.first_cluster, 0, info.data_length);
+    if (bitmap_flush(vol) != 0 || m->barrier(m->ctx) != 0)
+        return -1;
+    return 0;
+
+undo:
+    free_chain(vol, dst, 1, (UINT64)n * clsz);
+    bitmap_flush(vol);
+    return -1;
+}
+
+#endif /* ESP_PLATFORM */
+
+/* ---- Format ---- */
+
+#define FORMAT_BUF_SIZE  (1024 * 1024)  /* staging for the FAT and bitmap */
+#define FORMAT_ALIGN     (1024 * 1024)  /* FAT and cluster heap boundary */
+
+/* Up-case mapping written to new volumes: ASCII and Latin-1, which
+   covers every name this driver can create (see exfat_name_hash) */
+static UINT16 format_upcase_char(UINT32 c)
+{
+    if (c >= 'a' && c <= 'z')
+        return (UINT16)(c - 32);
+    if (c >= 0xE0 && c <= 0xFE && c != 0xF7)
+        return (UINT16)(c - 32);
+    if (c == 0xFF)
+        return 0x178;
+    return (UINT16)c;
+}
+
+/* Build the compressed up-case table (runs of unchanged characters as
+   0xFFFF, count). Returns the number of UINT16 entries. */
+static UINT32 format_upcase_table(UINT16 *t)
+{
+    UINT32 n = 0, c = 0;
+    while (c < 0x10000) {
+        UINT32 run = 0;
+        while (c + run < 0x10000 && run < 0xFFFF &&
+               format_upcase_char(c + run) == c + run)
+            run++;
+        if (run > 2) {
+            t[n++] = 0xFFFF;
+            t[n++] = (UINT16)run;
+            c += run;
+        } else {
+            t[n++] = format_upcase_char(c);
+            c++;
+        }
+    }
+    return n;
+}
+
+/* Rotating checksum of the boot region and the up-case table */
+static UINT32 format_checksum(UINT32 sum, const UINT8 *p, UINT32 len,
+                              int boot_sector)
+{
+    for (UINT32 i = 0; i < len; i++) {
+        /* VolumeFlags and PercentInUse change without a new checksum */
+        if (boot_sector && (i == 106 || i == 107 || i == 112))
+            continue;
+        sum = ((sum & 1) ? 0x80000000 : 0) + (sum >> 1) + p[i];
+    }
+    return sum;
+}
+
+/* Write count sectors from lba out of buf in FORMAT_BUF_SIZE pieces,
+   the same buffer for each piece */
+static int format_fill(exfat_block_write_fn write_fn, void *ctx,
+                       UINT32 bps, UINT64 lba, UINT64 count, const UINT8 *buf)
+{
+    UINT32 step = FORMAT_BUF_SIZE / bps;
+    while (count > 0) {
+        UINT32 n = count > step ? step : (UINT32)count;
+        if (write_fn(ctx, lba, n, buf) != 0)
+            return -1;
+        lba += n;
+        count -= n;
+    }
+    return 0;
+}
+
+int exfat_format(exfat_block_write_fn write_fn, void *ctx, UINT32 block_size,
+                 UINT64 total_blocks, const char *label, UINT32 serial)
+{
+    if (!write_fn || block_size < 512 || block_size > 4096 ||
+        (block_size & (block_size - 1)) != 0)
+        return -1;
+
+    UINT32 bps = block_size;
+    UINT8 bps_shift = 9;
+    while (((UINT32)1 << bps_shift) < bps)
+        bps_shift++;
+
+    /* Cluster size as Windows picks it: 4 KB up to 256 MB, 32 KB up to
+       32 GB, 128 KB above, so large media move data in big runs */
+    UINT64 bytes = total_blocks * bps;
+    UINT32 cluster_bytes = bytes <= (256ULL << 20) ? 4096 :
+                           bytes <= (32ULL << 30) ? 32768 : 131072;
+    if (cluster_bytes < bps)
+        cluster_bytes = bps;
+    UINT32 spc = cluster_bytes / bps;
+    UINT8 spc_shift = 0;
+    while (((UINT32)1 << spc_shift) < spc)
+        spc_shift++;
+
+    /* FAT and cluster heap start on FORMAT_ALIGN boundaries (erase
+       blocks of flash media), the FAT one boundary in */
+    UINT32 align = FORMAT_ALIGN / bps;
+    if (align < spc)
+        align = spc;
+    UINT32 fat_offset = align;
+    UINT64 est = (total_blocks > fat_offset ? total_blocks - fat_offset : 0) / spc;
+    if (est > 0xFFFFFFF5ULL)
+        est = 0xFFFFFFF5ULL;
+    UINT64 fat_length = ((est + 2) * 4 + bps - 1) / bps;
+    fat_length = (fat_length + align - 1) / align * align;
+    UINT64 heap_offset = fat_offset + fat_length;
+    if (total_blocks < heap_offset + (UINT64)spc * 16 ||
+        heap_offset > 0xFFFFFFFFULL)
+        return -1;
+    UINT64 clusters64 = (total_blocks - heap_offset) / spc;
+    if (clusters64 > est)
+        clusters64 = est;
+    UINT32 cluster_count = (UINT32)clusters64;
+    UINT64 volume_length = heap_offset + (UINT64)cluster_count * spc;
+
+    /* Allocation bitmap from cluster 2, then the up-case table and
+       the root directory in one cluster each */
+    UINT32 bitmap_bytes = (cluster_count + 7) / 8;
+    UINT32 bitmap_clusters = (bitmap_bytes + cluster_bytes - 1) / cluster_bytes;
+    UINT32 upcase_cluster = 2 + bitmap_clusters;
+    UINT32 root_cluster = upcase_cluster + 1;
+    UINT32 used = bitmap_clusters + 2;
+    if ((used + 2) * 4 > FORMAT_BUF_SIZE || used / 8 + 1 > FORMAT_BUF_SIZE ||
+        cluster_bytes > FORMAT_BUF_SIZE)
+        return -1;
+
+    UINT8 *buf = (UINT8 *)mem_alloc(FORMAT_BUF_SIZE);
+    UINT16 *upcase = (UINT16 *)mem_alloc(256 * sizeof(UINT16));
+    if (!buf || !upcase) {
+        mem_free(buf);
+        mem_free(upcase);
+        return -1;
+    }
+    UINT32 upcase_len = format_upcase_table(upcase) * 2;
+    int rc = -1;
+
+    /* ---- Boot region: 12 sectors, written twice ---- */
+    struct exfat_boot_sector *bs = (struct exfat_boot_sector *)buf;
+    bs->jump_boot[0] = 0xEB; bs->jump_boot[1] = 0x76; bs->jump_boot[2] = 0x90;
+    mem_copy(bs->fs_name, "EXFAT   ", 8);
+    bs->partition_offset = 0;    /* superfloppy, like fat32_format() */
+    bs->volume_length = volume_length;
+    bs->fat_offset = fat_offset;
+    bs->fat_length = (UINT32)fat_length;
+    bs->cluster_heap_offset = (UINT32)heap_offset;
+    bs->cluster_count = cluster_count;
+    bs->root_cluster = root_cluster;
+    bs->volume_serial = serial;
+    bs->fs_revision = 0x0100;
+    bs->bytes_per_sector_shift = bps_shift;
+    bs->sectors_per_cluster_shift = spc_shift;
+    bs->number_of_fats = 1;
+    bs->drive_select = 0x80;
+    bs->percent_in_use = (UINT8)((UINT64)used * 100 / cluster_count);
+    mem_set(bs->boot_code, 0xF4, sizeof(bs->boot_code));  /* hlt */
+    bs->boot_signature = 0xAA55;
+    for (UINT32 i = 1; i <= 8; i++) {
+        UINT8 *sig = buf + (i + 1) * bps - 4;  /* extended boot sectors */
+        sig[2] = 0x55;
+        sig[3] = 0xAA;
+    }
+    UINT32 sum = format_checksum(0, buf, bps, 1);
+    sum = format_checksum(sum, buf + bps, 10 * bps, 0);
+    for (UINT32 i = 0; i < bps / 4; i++)
+        mem_copy(buf + 11 * bps + i * 4, &sum, 4);
+    if (write_fn(ctx, 0, 12, buf) != 0 || write_fn(ctx, 12, 12, buf) != 0)
+        goto out;
+
+    /* ---- FAT: media entries, then each metadata chain ---- */
+    mem_set(buf, 0, FORMAT_BUF_SIZE);
+    UINT32 *fat = (UINT32 *)buf;
+    fat[0] = 0xFFFFFFF8;
+    fat[1] = 0xFFFFFFFF;
+    for (UINT32 c = 2; c < upcase_cluster; c++)
+        fat[c] = (c + 1 < upcase_cluster) ? c + 1 : EXFAT_EOC;
+    fat[upcase_cluster] = EXFAT_EOC;
+    fat[root_cluster] = EXFAT_EOC;
+    UINT32 step = FORMAT_BUF_SIZE / bps;
+    UINT32 first = fat_length < step ? (UINT32)fat_length : step;
+    if (write_fn(ctx, fat_offset, first, buf) != 0)
+        goto out;
+    mem_set(buf, 0, (used + 2) * 4);
+    if (format_fill(write_fn, ctx, bps, fat_offset + first,
+                    fat_length - first, buf) != 0)
+        goto out;
+
+    /* ---- Allocation bitmap: the metadata clusters are in use ---- */
+    for (UINT32 i = 0; i < used; i++)
+        buf[i / 8] |= (UINT8)(1 << (i % 8));
+    UINT64 bitmap_sectors = (UINT64)bitmap_clusters * spc;
+    UINT32 bfirst = bitmap_sectors < step ? (UINT32)bitmap_sectors : step;
+    UINT64 bitmap_lba = heap_offset;
+    if (write_fn(ctx, bitmap_lba, bfirst, buf) != 0)
+        goto out;
+    mem_set(buf, 0, used / 8 + 1);
+    if (format_fill(write_fn, ctx, bps, bitmap_lba + bfirst,
+                    bitmap_sectors - bfirst, buf) != 0)
+        goto out;
+
+    /* ---- Up-case table ---- */
+    UINT64 upcase_lba = heap_offset + (UINT64)(upcase_cluster - 2) * spc;
+    mem_copy(buf, upcase, upcase_len);
+    if (write_fn(ctx, upcase_lba, spc, buf) != 0)
+        goto out;
+    mem_set(buf, 0, upcase_len);
+
+    /* ---- Root directory: bitmap, up-case table and label entries ---- */
+    struct exfat_bitmap_dentry *bd = (struct exfat_bitmap_dentry *)buf;
+    bd->type = ENTRY_BITMAP;
+    bd->first_cluster = 2;
+    bd->data_length = bitmap_bytes;
+    struct exfat_upcase_dentry *ud = (struct exfat_upcase_dentry *)(buf + 32);
+    ud->type = ENTRY_UPCASE;
+    ud->table_checksum = format_checksum(0, (const UINT8 *)upcase,
+                                         upcase_len, 0);
+    ud->first_cluster = upcase_cluster;
+    ud->data_length = upcase_len;
+    if (label && label[0]) {
+        struct exfat_label_dentry *ld = (struct exfat_label_dentry *)(buf + 64);
+        ld->type = ENTRY_VLABEL;
+        ld->char_count = (UINT8)ascii_to_utf16(label, ld->label, 12);
+    }
+    UINT64 root_lba = heap_offset + (UINT64)(root_cluster - 2) * spc;
+    if (write_fn(ctx, root_lba, spc, buf) != 0)
+        goto out;
+    rc = 0;
+
+out:
+    mem_free(upcase);
+    mem_free(buf);
+    return rc;
+}
@@ -1,18 +1,34 @@
 /*
  * exfat.h — exFAT filesystem driver (read/write)
  *
- * Portable: uses callback-based block I/O, no UEFI dependency.
+ * Portable: uses callback-based block I/O, no UEFI dependency. The
+ * ESP32 firmware builds this same driver; its fs_port.h stands in
+ * for boot.h and fs.h (types, fs_entry, memory helpers) and sets the
+ * sizing knobs for a small heap.
  */
 #ifndef EXFAT_H
 #define EXFAT_H
 
+#ifdef ESP_PLATFORM
+#include "fs_port.h"
+#else
 #include "boot.h"
 #include "fs.h"
+#endif
 
 /* Block I/O callbacks */
 typedef int (*exfat_block_read_fn)(void *ctx, UINT64 lba, UINT32 count, void *buf);
 typedef int (*exfat_block_write_fn)(void *ctx, UINT64 lba, UINT32 count, const void *buf);
 
+/* Create an empty exFAT volume over total_blocks blocks of block_size
+   bytes (512 to 4096), without a partition table: boot region, FAT,
+   allocation bitmap, up-case table and a root directory holding label
+   (up to 11 ASCII characters, may be NULL). Clusters are 128 KB on
+   media above 32 GB. Nothing past the root directory is written; the
+   caller flushes. Returns 0 on success, -1 on error. */
+int exfat_format(exfat_block_write_fn write_fn, void *ctx, UINT32 block_size,
+                 UINT64 total_blocks, const char *label, UINT32 serial);
+
 /* Opaque volume handle */
 struct exfat_vol;
 
@@ -22,6 +38,10 @@ struct exfat_vol *exfat_mount(exfat_block_read_fn read_fn,
                                exfat_block_write_fn write_fn,
                                void *ctx, UINT32 block_size);
 
+/* Cap the size of a single data read issued to read_fn (default 1 MB).
+   Physically contiguous clusters are merged up to this size. */
+void exfat_set_max_transfer(struct exfat_vol *vol, UINT32 bytes);
+
 /* Unmount and free all resources */
 void exfat_unmount(struct exfat_vol *vol);
 
@@ -30,10 +50,38 @@ void exfat_unmount(struct exfat_vol *vol);
 int exfat_readdir(struct exfat_vol *vol, const char *path,
                   struct fs_entry *entries, int max_entries);
 
-/* Read entire file into newly allocated buffer. Returns NULL on error. */
+/* Directory cursor: entries of any directory size, one at a time, in
+   on-disk order (unsorted). Close before unmounting. */
+struct exfat_dir;
+
+/* Open a directory. Returns NULL on error. */
+struct exfat_dir *exfat_opendir(struct exfat_vol *vol, const char *path);
+
+/* Next entry: 1 with *out filled, 0 at the end, -1 on error */
+int exfat_readdir_next(struct exfat_dir *d, struct fs_entry *out);
+
+void exfat_closedir(struct exfat_dir *d);
+
+/* A place in an open directory, to come back to with exfat_seekdir()
+   (on the same volume, while the directory is unchanged) */
+struct exfat_dir_pos {
+    UINT64 sector;
+    UINT32 offset;
+    UINT8  done;
+};
+
+void exfat_telldir(struct exfat_dir *d, struct exfat_dir_pos *pos);
+
+/* Returns 0 on success */
+int exfat_seekdir(struct exfat_dir *d, const struct exfat_dir_pos *pos);
+
+/* Read entire file into newly allocated buffer, NUL-terminated past
+   *out_size. Returns NULL on error. */
 void *exfat_readfile(struct exfat_vol *vol, const char *path, UINTN *out_size);
 
-/* Write data to a file (create or replace). Returns 0 on success. */
+/* Write data to a file, creating it or rewriting an existing one in
+   place (see exfat_overwrite()). Returns 0 on success; an existing file
+   that does not fit is left as it was. */
 int exfat_writefile(struct exfat_vol *vol, const char *path,
                     const void *data, UINTN size);
 
@@ -46,9 +94,43 @@ int exfat_rename(struct exfat_vol *vol, const char *path, const char *new_name);
 /* Delete a file. Returns 0 on success. */
 int exfat_delete(struct exfat_vol *vol, const char *path);
 
+/* Batch many small updates: between these, writes, mkdirs, renames,
+   deletes and closes leave their bitmap, FAT and directory changes in
+   the cache, and the commit writes them all back at once. Batches nest;
+   only the outermost commit writes. A power cut inside a batch can lose
+   its metadata. exfat_commit_batch() returns 0 if the write-back
+   succeeded. */
+int exfat_begin_batch(struct exfat_vol *vol);
+int exfat_commit_batch(struct exfat_vol *vol);
+
 /* Get volume info. Returns 0 on success. */
 int exfat_volume_info(struct exfat_vol *vol, UINT64 *total_bytes, UINT64 *free_bytes);
 
+/* The blocks the volume uses, in ascending runs: the boot regions and
+   FATs, then every cluster the allocation bitmap marks in use. What a
+   clone of the volume must copy. Returns 0, or -1 on a read error or
+   when fn stops the walk. */
+int exfat_used_runs(struct exfat_vol *vol, fs_run_fn fn, void *ctx);
+
+#ifndef ESP_PLATFORM
+/* Check the volume's consistency into c, repairing as c->repair says
+   (see fsck.h). Returns 0 when the whole volume was checked, -1 on a
+   read error, without memory or when cancelled. */
+struct fs_check;
+int exfat_check(struct exfat_vol *vol, struct fs_check *c);
+
+/* Move the data of the file at path into one run of free clusters and
+   make it NoFatChain; a contiguous FAT-chained file only has its flag
+   set. The new run is marked in use on disk first, the data copied
+   through m and made durable, the stream entry switched over, and only
+   then the old clusters freed, so a power cut leaves one layout or the
+   other whole, at worst with lost clusters for the check to find. The
+   file must not be open. Returns 0 when moved, 1 when it was one run
+   already or the volume has none that long, -1 on error. */
+int exfat_relocate(struct exfat_vol *vol, const char *path,
+                   const struct fs_mover *m);
+#endif
+
 /* Get file size. Returns 0 if not found. */
 UINT64 exfat_file_size(struct exfat_vol *vol, const char *path);
 
@@ -58,4 +140,63 @@ int exfat_exists(struct exfat_vol *vol, const char *path);
 /* Get volume label (ASCII). Returns empty string if none. */
 const char *exfat_get_label(struct exfat_vol *vol);
 
+/* ---- Streaming file handles ---- */
+
+/* Opaque open-file handle. Close all handles before unmounting. */
+struct exfat_file;
+
+/* Open a file for reading. Sets *out_size. Returns NULL on error. */
+struct exfat_file *exfat_open(struct exfat_vol *vol, const char *path,
+                              UINT64 *out_size);
+
+/* Create or replace a file for sequential writing. Returns NULL on error. */
+struct exfat_file *exfat_create(struct exfat_vol *vol, const char *path);
+
+/* Open a file for rewriting from the start, in place: the new contents
+   go into the file's own clusters, with more allocated if it grows and
+   the rest freed at close if it shrinks; the entry keeps its name,
+   attributes and times, and only its stream entry changes. A missing
+   file is created as exfat_create() does. If a write fails, close puts
+   back the old chain and stream entry (with whatever was written over
+   the old clusters) rather than a partial file; exfat_preallocate()
+   first, as exfat_writefile() does, keeps a rewrite that does not fit
+   from touching the old data at all. Returns NULL on error. */
+struct exfat_file *exfat_overwrite(struct exfat_vol *vol, const char *path);
+
+/* Read up to *size bytes at the current position; *size is set to the
+   number read (0 at end of file). Returns 0 on success. */
+int exfat_read(struct exfat_file *f, void *buf, UINTN *size);
+
+/* Reserve room for a file of size bytes, on a fresh write handle before
+   the first write: one contiguous NoFatChain extent when the volume has
+   one that long. The entry records DataLength = size at once, with a
+   ValidDataLength of 0; writes then fill the reserved clusters without
+   allocating, close sets ValidDataLength and gives back clusters past
+   the end if fewer bytes came. Writing more than size still works. On
+   an exfat_overwrite() handle the old clusters count towards size and
+   only the rest is taken; the old entry stands until close.
+   Returns 0 on success, -1 if there is no room: nothing is reserved
+   then and the entry records no DataLength. */
+int exfat_preallocate(struct exfat_file *f, UINT64 size);
+
+/* Append size bytes. Returns 0 on success; after a failure (the volume
+   full, say) every later write fails too. */
+int exfat_write(struct exfat_file *f, const void *buf, UINTN size);
+
+/* Set the position (clamped to the file size). Write handles are
+   append-only and only accept the current position. */
+int exfat_seek(struct exfat_file *f, UINT64 pos);
+
+/* Close; a write handle commits its data and directory entry.
+   Returns 0 on success. After a failed write the file is left as long
+   as the data that reached the disk, with the clusters past it freed,
+   and close returns -1. */
+int exfat_close(struct exfat_file *f);
+
+/* Where a file's data lies on the volume, one extent per run of
+   consecutive clusters, in file order. Returns the count, or -1 on
+   error or if the file needs more than max. */
+int exfat_extents(struct exfat_vol *vol, const char *path,
+                  struct fs_extent *out, int max);
+
 #endif /* EXFAT_H */
@@ -1,31 +1,46 @@
 /*
- * fat32.c — FAT32 filesystem creation on block devices
+ * fat32.c — FAT32 filesystem creation and read/write driver
  *
  * Creates a valid FAT32 filesystem (superfloppy — no MBR partition table).
- * Supports writing files and creating directories.
+ * Supports writing files and creating directories on a freshly formatted
+ * device, and mounting any FAT32 volume through callback block I/O
+ * (see "Mounted volume driver" below).
  *
  * Superfloppy layout (FAT32 BPB at LBA 0):
  *   LBA 0:                     BPB (Volume Boot Record)
  *   LBA 1:                     FSInfo
  *   LBA 6:                     Backup BPB
- *   LBA 32 (RESERVED_SECTORS): FAT1
- *   LBA 32+fat_sectors:        FAT2
+ *   LBA 32 or more:            FAT1 (reserved sectors padded, below)
+ *   FAT1 + fat_sectors:        FAT2
  *   After FATs:                Data region (cluster 2 = root directory)
+ *
+ * As the SD Association's formatter does, the reserved area is padded
+ * so the data region starts on an allocation unit (4 MB, the SDHC/SDXC
+ * norm; UEFI has no way to ask the card) and no cluster straddles two.
+ * Clusters are as large as FAT32 allows up to 32 KB, the SDHC size.
  */
 
 #include "boot.h"
 #include "mem.h"
 #include "disk.h"
 #include "fat32.h"
+#include "bcache.h"
+#include "dirsort.h"
+#include "runmap.h"
+#include "fsck.h"
 #include "shim.h"
 
 /* FAT32 constants */
 #define SECTOR_SIZE       512
-#define RESERVED_SECTORS  32
+#define RESERVED_SECTORS  32       /* minimum; padded to align the data */
+#define ALIGN_SECTORS     8192     /* allocation unit: 4 MB */
+#define MAX_SPC           64       /* 32 KB clusters */
 #define NUM_FATS          2
 #define FAT32_EOC        0x0FFFFFF8
 #define FAT32_FREE       0x00000000
 #define MIN_FAT32_CLUSTERS 65525  /* below this, FAT driver treats as FAT16 */
+#define FAT_WIN_MAX       8192     /* FAT sectors cached (4 MB, 1M clusters) */
+#define DATA_IO_SECTORS   2048     /* 1 MB per file data write */
 
 /* On-disk structures (packed) */
 #pragma pack(1)
@@ -108,6 +123,14 @@ struct fat32_state {
     UINT32 total_clusters;
     UINT32 next_free_cluster;
     UINT32 spc;              /* sectors per cluster (dynamic) */
+
+    /* Cached FAT window (the whole FAT when it fits in FAT_WIN_MAX) */
+    UINT8 *fat_win;
+    UINT32 win_start;        /* first FAT sector held */
+    UINT32 win_sectors;      /* capacity in sectors */
+    UINT32 win_valid;        /* 1 once win_start's sectors are loaded */
+    UINT32 dirty_lo;         /* dirty sector range within the window, */
+    UINT32 dirty_hi;         /* [lo, hi); lo >= hi means clean */
 };
 
 static struct fat32_state s_fs;
@@ -126,27 +149,78 @@ static int write_sectors(UINT64 lba, UINT64 count, void *buf) {
     return disk_write_blocks(s_fs.dev, lba, count, buf);
 }
 
-/* ---- FAT table operations ---- */
+/* ---- FAT table operations ----
+ * FAT entries live in an in-memory window of FAT sectors. Updates only
+ * mark a sector range dirty; fat_flush() writes that range to both FAT
+ * copies in one sweep each when the window moves or at a consistency
+ * point, instead of a read-modify-write of two sectors per entry. */
+
+/* Write the window's dirty range to FAT1 and FAT2 */
+static int fat_flush(void) {
+    if (!s_fs.fat_win || s_fs.dirty_lo >= s_fs.dirty_hi)
+        return 0;
+    UINT32 sec = s_fs.win_start + s_fs.dirty_lo;
+    UINT32 n = s_fs.dirty_hi - s_fs.dirty_lo;
+    UINT8 *src = s_fs.fat_win + (UINTN)s_fs.dirty_lo * SECTOR_SIZE;
+    s_fs.dirty_lo = s_fs.win_sectors;
+    s_fs.dirty_hi = 0;
+    for (UINT32 f = 0; f < NUM_FATS; f++) {
+        if (write_sectors(s_fs.fat_start + f * s_fs.fat_sectors + sec, n, src) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* Make the window hold FAT sector 'sector'. Returns a pointer to it. */
+static UINT8 *fat_window(UINT32 sector) {
+    if (!s_fs.fat_win || sector >= s_fs.fat_sectors)
+        return NULL;
+    if (s_fs.win_valid && sector >= s_fs.win_start &&
+        sector < s_fs.win_start + s_fs.win_sectors)
+        return s_fs.fat_win + (UINTN)(sector - s_fs.win_start) * SECTOR_SIZE;
+
+    if (fat_flush() < 0)
+        return NULL;
+    UINT32 start = sector - sector % s_fs.win_sectors;
+    UINT32 n = s_fs.win_sectors;
+    if (start + n > s_fs.fat_sectors) n = s_fs.fat_sectors - start;
+    s_fs.win_valid = 0;
+    if (disk_read_blocks(s_fs.dev, s_fs.fat_start + start, n, s_fs.fat_win) < 0)
+        return NULL;
+    s_fs.win_start = start;
+    s_fs.win_valid = 1;
+    return s_fs.fat_win + (UINTN)(sector - start) * SECTOR_SIZE;
+}
+
+/* Allocate the window for a freshly zeroed FAT (no read needed) */
+static int fat_window_init(void) {
+    if (s_fs.fat_win) mem_free(s_fs.fat_win);
+    s_fs.win_sectors = s_fs.fat_sectors < FAT_WIN_MAX ? s_fs.fat_sectors : FAT_WIN_MAX;
+    s_fs.fat_win = (UINT8 *)mem_alloc((UINTN)s_fs.win_sectors * SECTOR_SIZE);
+    if (!s_fs.fat_win) return -1;
+    s_fs.win_start = 0;
+    s_fs.win_valid = 1;
+    s_fs.dirty_lo = s_fs.win_sectors;
+    s_fs.dirty_hi = 0;
+    return 0;
+}
 
 static int fat_set(UINT32 cluster, UINT32 value) {
     UINT32 fat_offset = cluster * 4;
     UINT32 fat_sector = fat_offset / SECTOR_SIZE;
     UINT32 fat_entry_offset = fat_offset % SECTOR_SIZE;
 
-    UINT8 sector_buf[SECTOR_SIZE];
-    if (read_sector(s_fs.fat_start + fat_sector, sector_buf) < 0)
+    UINT8 *sector_buf = fat_window(fat_sector);
+    if (!sector_buf)
         return -1;
 
     /* Write 28-bit entry (preserve top 4 bits) */
     UINT32 *entry = (UINT32 *)(sector_buf + fat_entry_offset);
     *entry = (*entry & 0xF0000000) | (value & 0x0FFFFFFF);
 
-    /* Write to both FAT copies */
-    if (write_sector(s_fs.fat_start + fat_sector, sector_buf) < 0)
-        return -1;
-    if (write_sector(s_fs.fat_start + s_fs.fat_sectors + fat_sector, sector_buf) < 0)
-        return -1;
-
+    UINT32 rel = fat_sector - s_fs.win_start;
+    if (rel < s_fs.dirty_lo) s_fs.dirty_lo = rel;
+    if (rel + 1 > s_fs.dirty_hi) s_fs.dirty_hi = rel + 1;
     return 0;
 }
 
@@ -155,8 +229,8 @@ static UINT32 fat_get(UINT32 cluster) {
     UINT32 fat_sector = fat_offset / SECTOR_SIZE;
     UINT32 fat_entry_offset = fat_offset % SECTOR_SIZE;
 
-    UINT8 sector_buf[SECTOR_SIZE];
-    if (read_sector(s_fs.fat_start + fat_sector, sector_buf) < 0)
+    UINT8 *sector_buf = fat_window(fat_sector);
+    if (!sector_buf)
         return FAT32_EOC;
 
     UINT32 *entry = (UINT32 *)(sector_buf + fat_entry_offset);
@@ -169,11 +243,10 @@ static UINT32 alloc_cluster(UINT32 prev) {
     if (cl >= s_fs.total_clusters + 2)
         return 0; /* out of space */
 
+    if (fat_set(cl, FAT32_EOC) < 0)
+        return 0;
     s_fs.next_free_cluster = cl + 1;
 
-    /* Mark as end of chain */
-    fat_set(cl, FAT32_EOC);
-
     /* Link to previous */
     if (prev >= 2)
         fat_set(prev, cl);
@@ -181,6 +254,41 @@ static UINT32 alloc_cluster(UINT32 prev) {
     return cl;
 }
 
+/* Allocate 'count' contiguous clusters as one chain. Nothing is ever
+ * freed on a volume we formatted, so everything past next_free_cluster
+ * is free and the extent is simply carved off the front.
+ * Returns the first cluster, or 0 if the volume is full. */
+static UINT32 alloc_extent(UINT32 count) {
+    UINT32 first = s_fs.next_free_cluster;
+    if (count == 0 || first + count > s_fs.total_clusters + 2)
+        return 0;
+
+    for (UINT32 i = 0; i + 1 < count; i++) {
+        if (fat_set(first + i, first + i + 1) < 0)
+            return 0;
+    }
+    if (fat_set(first + count - 1, FAT32_EOC) < 0)
+        return 0;
+    s_fs.next_free_cluster = first + count;
+    return first;
+}
+
+/* Consistency point: FAT window, FSInfo hints, then a device barrier */
+static int fat32_sync(void) {
+    int rc = fat_flush();
+
+    UINT8 buf[SECTOR_SIZE];
+    if (read_sector(1, buf) == 0) {
+        struct fat32_fsinfo *fsi = (struct fat32_fsinfo *)buf;
+        fsi->free_count = s_fs.total_clusters + 2 - s_fs.next_free_cluster;
+        fsi->next_free = s_fs.next_free_cluster;
+        if (write_sector(1, buf) < 0) rc = -1;
+    }
+
+    if (disk_flush(s_fs.dev) < 0) rc = -1;
+    return rc;
+}
+
 /* Get the LBA of the first sector of a cluster */
 static UINT64 cluster_to_lba(UINT32 cluster) {
     return (UINT64)s_fs.data_start +
@@ -189,49 +297,55 @@ static UINT64 cluster_to_lba(UINT32 cluster) {
 
 /* ---- Format ---- */
 
+/* Reserved sectors for spc-sized clusters on a volume of total sectors:
+ * RESERVED_SECTORS, plus what puts the data region on an au boundary.
+ * Stores the FAT size (sized as if the whole volume were clusters). */
+static UINT32 aligned_layout(UINT32 total, UINT32 spc, UINT32 au,
+                             UINT32 *fat_sectors) {
+    UINT32 ncl = (total - RESERVED_SECTORS) / spc;
+    UINT32 fat_sec = (ncl * 4 + SECTOR_SIZE - 1) / SECTOR_SIZE;
+    UINT32 data = RESERVED_SECTORS + fat_sec * NUM_FATS;
+    *fat_sectors = fat_sec;
+    return RESERVED_SECTORS + (au - data % au) % au;
+}
+
 int fat32_format(struct disk_device *dev) {
     if (!dev || dev->is_boot_device)
         return -1;
 
     s_fs.dev = dev;
+    s_fs.win_valid = 0;
+    s_fs.dirty_lo = s_fs.dirty_hi = 0;
     s_fs.part_start = 0; /* superfloppy: BPB at LBA 0, no MBR */
 
     UINT32 total_disk_sectors = (UINT32)(dev->size_bytes / SECTOR_SIZE);
     if (total_disk_sectors <= RESERVED_SECTORS + 100)
         return -1; /* too small */
 
-    /* Choose sectors_per_cluster to ensure >= MIN_FAT32_CLUSTERS.
-     * Start at 8 (4KB clusters) and halve until cluster count is valid. */
-    UINT32 spc = 8;
-    while (spc > 1) {
-        UINT32 est = total_disk_sectors - RESERVED_SECTORS;
-        UINT32 ncl = est / spc;
-        UINT32 fat_sec = (ncl * 4 + SECTOR_SIZE - 1) / SECTOR_SIZE;
-        UINT32 data_sec = total_disk_sectors - RESERVED_SECTORS - fat_sec * NUM_FATS;
-        ncl = data_sec / spc;
-        if (ncl >= MIN_FAT32_CLUSTERS) break;
+    /* A small volume aligns to less, so the padding stays under 1/32 */
+    UINT32 au = ALIGN_SECTORS;
+    while (au > 8 && total_disk_sectors / 32 < au)
+        au /= 2;
+
+    /* Largest cluster that still leaves >= MIN_FAT32_CLUSTERS */
+    UINT32 spc = MAX_SPC, reserved, fat_sec;
+    for (;;) {
+        reserved = aligned_layout(total_disk_sectors, spc, au, &fat_sec);
+        UINT32 ncl = (total_disk_sectors - reserved - fat_sec * NUM_FATS) / spc;
+        if (ncl >= MIN_FAT32_CLUSTERS || spc == 1) break;
         spc /= 2;
     }
     s_fs.spc = spc;
-
-    /* Calculate FAT size */
-    UINT32 est_data = total_disk_sectors - RESERVED_SECTORS;
-    UINT32 est_clusters = est_data / spc;
-    s_fs.fat_sectors = (est_clusters * 4 + SECTOR_SIZE - 1) / SECTOR_SIZE;
-
-    s_fs.fat_start = RESERVED_SECTORS;
+    s_fs.fat_sectors = fat_sec;
+    s_fs.fat_start = reserved;
     s_fs.data_start = s_fs.fat_start + s_fs.fat_sectors * NUM_FATS;
-    s_fs.total_clusters = (total_disk_sectors - RESERVED_SECTORS - s_fs.fat_sectors * NUM_FATS)
-                          / spc;
+    s_fs.total_clusters = (total_disk_sectors - s_fs.data_start) / spc;
     s_fs.next_free_cluster = 3; /* cluster 2 = root dir */
 
-    /* Zero out the reserved sectors area */
-    UINT8 zero[SECTOR_SIZE];
-    mem_set(zero, 0, SECTOR_SIZE);
-    for (UINT32 i = 0; i < RESERVED_SECTORS; i++) {
-        if (write_sector(i, zero) < 0)
-            return -1;
-    }
+    /* Zero the boot, FSInfo and backup sectors; the alignment padding
+       after them is never read */
+    if (disk_zero_blocks(dev, 0, RESERVED_SECTORS, NULL) < 0)
+        return -1;
 
     /* ---- Write BPB at LBA 0 ---- */
     UINT8 bpb_buf[SECTOR_SIZE];
@@ -241,7 +355,7 @@ int fat32_format(struct disk_device *dev) {
     memcpy(bpb->oem, "SURVIVAL", 8);
     bpb->bytes_per_sector = SECTOR_SIZE;
     bpb->sectors_per_cluster = (UINT8)spc;
-    bpb->reserved_sectors = RESERVED_SECTORS;
+    bpb->reserved_sectors = (UINT16)reserved;
     bpb->num_fats = NUM_FATS;
     bpb->root_entry_count = 0;
     bpb->total_sectors_16 = 0;
@@ -282,11 +396,13 @@ int fat32_format(struct disk_device *dev) {
         return -1;
 
     /* ---- Initialize FAT tables ---- */
-    /* Zero out both FATs */
-    for (UINT32 i = 0; i < s_fs.fat_sectors * NUM_FATS; i++) {
-        if (write_sector(s_fs.fat_start + i, zero) < 0)
-            return -1;
-    }
+    /* Zero out both FATs (they are contiguous): erased on devices that
+       can, so a large card takes seconds */
+    if (disk_zero_blocks(dev, s_fs.fat_start,
+                         (UINT64)s_fs.fat_sectors * NUM_FATS, NULL) < 0)
+        return -1;
+    if (fat_window_init() < 0)
+        return -1;
 
     /* Set FAT entries for cluster 0, 1, and 2 (root dir) */
     fat_set(0, 0x0FFFFFF8); /* media descriptor */
@@ -295,10 +411,8 @@ int fat32_format(struct disk_device *dev) {
 
     /* ---- Initialize root directory cluster ---- */
     UINT64 root_lba = cluster_to_lba(2);
-    for (UINT32 i = 0; i < spc; i++) {
-        if (write_sector(root_lba + (UINT64)i, zero) < 0)
-            return -1;
-    }
+    if (disk_zero_blocks(dev, root_lba, spc, NULL) < 0)
+        return -1;
 
     /* Write volume label directory entry */
     UINT8 dir_buf[SECTOR_SIZE];
@@ -310,7 +424,7 @@ int fat32_format(struct disk_device *dev) {
     if (write_sector(root_lba, dir_buf) < 0)
         return -1;
 
-    return 0;
+    return fat32_sync();
 }
 
 /* ---- Name conversion helpers ---- */
@@ -482,7 +596,7 @@ static UINT32 ensure_dir(UINT32 parent_cluster, const char *name) {
 
 /* ---- Public API ---- */
 
-int fat32_mkdir(struct disk_device *dev, const char *path) {
+int fat32_dev_mkdir(struct disk_device *dev, const char *path) {
     if (!dev || !path) return -1;
     if (s_fs.dev != dev) return -1; /* must format first */
 
@@ -504,7 +618,7 @@ int fat32_mkdir(struct disk_device *dev, const char *path) {
         cluster = ensure_dir(cluster, component);
         if (cluster == 0) return -1;
     }
-    return 0;
+    return fat32_sync();
 }
 
 int fat32_write_file(struct disk_device *dev, const char *path,
@@ -547,42 +661,41 @@ int fat32_write_file(struct disk_device *dev, const char *path,
         filename = path;
     }
 
-    /* Allocate clusters for file data */
+    /* Allocate one contiguous extent for the file data */
     UINT32 cluster_size = s_fs.spc * SECTOR_SIZE;
     UINT32 clusters_needed = (size > 0) ? (UINT32)((size + cluster_size - 1) / cluster_size) : 1;
 
-    UINT32 first_cluster = 0;
-    UINT32 prev_cluster = 0;
-    UINT8 *src = (UINT8 *)data;
-    UINT64 remaining = size;
-
-    for (UINT32 i = 0; i < clusters_needed; i++) {
-        UINT32 cl = alloc_cluster(prev_cluster);
-        if (cl == 0) return -1;
-        if (i == 0) first_cluster = cl;
-
-        UINT64 lba = cluster_to_lba(cl);
-        UINT32 bytes_to_write = (remaining > cluster_size) ? cluster_size : (UINT32)remaining;
+    UINT32 first_cluster = alloc_extent(clusters_needed);
+    if (first_cluster == 0) return -1;
 
-        /* Write sectors for this cluster */
-        for (int sec = 0; sec < s_fs.spc; sec++) {
-            UINT8 buf[SECTOR_SIZE];
-            UINT32 sec_offset = (UINT32)sec * SECTOR_SIZE;
-            if (sec_offset < bytes_to_write) {
-                UINT32 n = bytes_to_write - sec_offset;
-                if (n > SECTOR_SIZE) n = SECTOR_SIZE;
-                memcpy(buf, src + sec_offset, n);
-                if (n < SECTOR_SIZE) mem_set(buf + n, 0, SECTOR_SIZE - n);
-            } else {
-                mem_set(buf, 0, SECTOR_SIZE);
-            }
-            if (write_sector(lba + (UINT64)sec, buf) < 0)
-                return -1;
-        }
+    /* Whole sectors go straight from the caller's buffer */
+    UINT64 lba = cluster_to_lba(first_cluster);
+    UINT8 *src = (UINT8 *)data;
+    UINT64 full = size / SECTOR_SIZE;
+    for (UINT64 done = 0; done < full; ) {
+        UINT64 n = full - done;
+        if (n > DATA_IO_SECTORS) n = DATA_IO_SECTORS;
+        if (write_sectors(lba + done, n, src + done * SECTOR_SIZE) < 0)
+            return -1;
+        done += n;
+    }
 
-        src += bytes_to_write;
-        remaining -= bytes_to_write;
-        prev_cluster = cl;
+    /* Partial last sector, then zero the rest of the last cluster */
+    UINT64 sec = full;
+    UINT64 end = (UINT64)clusters_needed * s_fs.spc;
+    UINT8 buf[SECTOR_SIZE];
+    if (size % SECTOR_SIZE) {
+        UINT32 n = (UINT32)(size % SECTOR_SIZE);
+        memcpy(buf, src + full * SECTOR_SIZE, n);
+        mem_set(buf + n, 0, SECTOR_SIZE - n);
+        if (write_sector(lba + sec, buf) < 0)
+            return -1;
+        sec++;
+    }
+    mem_set(buf, 0, SECTOR_SIZE);
+    for (; sec < end; sec++) {
+        if (write_sector(lba + sec, buf) < 0)
+            return -1;
     }
 
     /* Add file entry to directory */
@@ -595,5 +708,2199 @@ int fat32_write_file(struct disk_device *dev, const char *path,
     entry.file_size = (UINT32)size;
     entry.modify_date = (2026 - 1980) << 9 | 1 << 5 | 1;
 
-    return add_dir_entry(dir_cluster, &entry);
+    if (add_dir_entry(dir_cluster, &entry) < 0)
+        return -1;
+    return fat32_sync();
+}
+
+/* ---- Image clone ----
+ * A FAT volume is copied as blocks, not files: the reserved area, both
+ * FATs and (FAT12/16) the fixed root directory go over whole, then only
+ * the clusters the first FAT marks in use, merged into runs.  With a
+ * small ESP that is a few MB of large sequential writes, against a
+ * directory walk that pays for every file's metadata.
+ */
+
+#define CLONE_IO_BYTES (1024 * 1024)
+
+/* FAT entry of cluster c; fat holds the whole first FAT */
+static UINT32 clone_fat_entry(const UINT8 *fat, int bits, UINT32 c) {
+    if (bits == 12) {
+        UINT32 off = c + c / 2;
+        UINT32 v = fat[off] | (UINT32)fat[off + 1] << 8;
+        return (c & 1) ? v >> 4 : v & 0xFFF;
+    }
+    if (bits == 16)
+        return fat[c * 2] | (UINT32)fat[c * 2 + 1] << 8;
+    return (fat[c * 4] | (UINT32)fat[c * 4 + 1] << 8 |
+            (UINT32)fat[c * 4 + 2] << 16 | (UINT32)fat[c * 4 + 3] << 24) &
+           0x0FFFFFFF;
+}
+
+/* The boot sector and its FAT32 backup get hidden_sectors = 0: on dst
+   they sit at LBA 0 */
+static void clone_fix(void *ctx, UINT64 lba, UINT64 count, UINT8 *buf) {
+    struct fat32_bpb *src = (struct fat32_bpb *)ctx;
+    UINT32 bs = src->bytes_per_sector;
+    for (UINT64 i = 0; i < count; i++) {
+        UINT64 at = lba + i;
+        if (at == 0 || (src->backup_boot_sector && at == src->backup_boot_sector))
+            ((struct fat32_bpb *)(buf + i * bs))->hidden_sectors = 0;
+    }
+}
+
+INT64 fat32_clone_image(struct disk_device *src, struct disk_device *dst,
+                        fat32_progress_fn progress) {
+    if (!src || !dst || dst->is_boot_device ||
+        src->block_size != dst->block_size || src->block_size < 512)
+        return -1;
+    UINT32 bs = src->block_size;
+
+    UINT8 *buf = (UINT8 *)mem_alloc_raw(CLONE_IO_BYTES);
+    if (!buf) return -1;
+    INT64 rc = -1;
+    UINT8 *fat = NULL;
+    if (disk_read_blocks(src, 0, 1, buf) != 0)
+        goto out;
+
+    /* The BPB fields shared by FAT12/16/32 */
+    struct fat32_bpb bpb;
+    mem_copy(&bpb, buf, sizeof(bpb));
+    UINT32 spc = bpb.sectors_per_cluster;
+    if (bpb.signature != 0xAA55 || bpb.bytes_per_sector != bs ||
+        spc == 0 || (spc & (spc - 1)) || bpb.reserved_sectors == 0 ||
+        bpb.num_fats == 0)
+        goto out;
+    UINT64 total = bpb.total_sectors_16 ? bpb.total_sectors_16
+                                        : bpb.total_sectors_32;
+    UINT32 fat_size = bpb.fat_size_16 ? bpb.fat_size_16 : bpb.fat_size_32;
+    UINT32 root_sectors = ((UINT32)bpb.root_entry_count * 32 + bs - 1) / bs;
+    UINT64 data_start = bpb.reserved_sectors +
+                        (UINT64)bpb.num_fats * fat_size + root_sectors;
+    if (fat_size == 0 || data_start >= total ||
+        total * bs > src->size_bytes || total * bs > dst->size_bytes)
+        goto out;
+    UINT32 clusters = (UINT32)((total - data_start) / spc);
+    int bits = clusters < 4085 ? 12 : clusters < 65525 ? 16 : 32;
+    UINT32 backup = bits == 32 ? bpb.backup_boot_sector : 0;
+    if (backup >= bpb.reserved_sectors) backup = 0;
+
+    /* The FAT must describe every cluster */
+    UINT64 fat_bytes = (UINT64)fat_size * bs;
+    if (((UINT64)clusters + 2) * bits > fat_bytes * 8)
+        goto out;
+    fat = (UINT8 *)mem_alloc_raw((UINTN)fat_bytes + 1);
+    if (!fat || disk_read_blocks(src, bpb.reserved_sectors, fat_size, fat) != 0)
+        goto out;
+    fat[fat_bytes] = 0;
+
+    UINT64 used = 0;
+    for (UINT32 c = 2; c < clusters + 2; c++)
+        if (clone_fat_entry(fat, bits, c)) used++;
+
+    /* clone_fix reads the block size and backup from the BPB */
+    if (backup == 0) bpb.backup_boot_sector = 0;
+    struct disk_copier *cp = disk_copier_open(src, dst, CLONE_IO_BYTES,
+                                              (data_start + used * spc) * bs,
+                                              progress);
+    if (!cp) goto out;
+    disk_copier_fix(cp, clone_fix, &bpb);
+    int ok = disk_copier_run(cp, 0, data_start) == 0;
+    for (UINT32 c = 2; c < clusters + 2 && ok; ) {
+        if (!clone_fat_entry(fat, bits, c)) { c++; continue; }
+        UINT32 first = c;
+        while (c < clusters + 2 && clone_fat_entry(fat, bits, c)) c++;
+        if (disk_copier_run(cp, data_start + (UINT64)(first - 2) * spc,
+                            (UINT64)(c - first) * spc) != 0)
+            ok = 0;
+    }
+    if (disk_copier_close(cp) != 0 || !ok)
+        goto out;
+
+    /* A GPT left at the end of the device would outrank the superfloppy */
+    mem_set(buf, 0, bs);
+    UINT64 last = dst->size_bytes / bs - 1;
+    if (last >= total && disk_write_blocks(dst, last, 1, buf) != 0)
+        goto out;
+    if (disk_flush(dst) == 0)
+        rc = (INT64)((data_start + used * spc) * bs);
+
+out:
+    if (fat) mem_free(fat);
+    mem_free(buf);
+    return rc;
+}
+
+/* ---- Mounted volume driver ----
+ * Everything below is independent of the formatter above: a portable
+ * FAT32 driver over callback block I/O, like the exFAT and NTFS drivers,
+ * sitting on the shared block cache in FAT32 sector units. FAT entries
+ * and directory sectors are updated in the cache and written back at
+ * each consistency point; file data bypasses it in large transfers.
+ * Long file names are read and written (ASCII only). */
+
+#define FAT32_ENTRY_MASK       0x0FFFFFFF
+#define FAT32_BAD              0x0FFFFFF7
+#define FAT32_MAX_FILE_SIZE    0xFFFFFFFFULL
+#define FAT32_DEFAULT_MAX_XFER (1024 * 1024)
+#define FAT32_MAX_DIR_ENTRIES  65536    /* spec limit: 2 MB directories */
+#define FAT32_FIXED_DATE       ((2026 - 1980) << 9 | 1 << 5 | 1)
+
+#define ATTR_LFN        0x0F
+#define DIRENT_END      0x00
+#define DIRENT_FREE     0xE5
+#define LFN_LAST        0x40
+#define LFN_CHARS       13
+#define LFN_MAX_ENTRIES 20               /* 255 characters */
+#define NT_LOWER_BASE   0x08
+#define NT_LOWER_EXT    0x10
+
+/* Byte offsets of the 13 UTF-16 characters in a long-name entry */
+static const UINT8 s_lfn_off[LFN_CHARS] = {
+    1, 3, 5, 7, 9, 14, 16, 18, 20, 22, 24, 28, 30
+};
+
+struct fat32_vol {
+    fat32_block_read_fn  read_fn;
+    fat32_block_write_fn write_fn;
+    void                *ctx;
+
+    UINT32 dev_block_size;
+    UINT32 bytes_per_sector;
+    UINT32 sectors_per_cluster;
+    UINT32 cluster_size;
+    UINT32 fat_start;            /* first sector of FAT copy 0 */
+    UINT32 fat_sectors;          /* sectors per FAT copy */
+    UINT32 num_fats;
+    UINT32 active_fat;           /* copy read (and the only one written
+                                    when mirroring is off) */
+    int    mirror;
+    UINT32 data_start;           /* sector of cluster 2 */
+    UINT32 cluster_count;
+    UINT32 root_cluster;
+    UINT32 fsinfo_sector;        /* 0 = none */
+
+    /* Free space: from FSInfo or counted on demand, then kept current */
+    UINT32 free_clusters;        /* valid once free_valid is set */
+    int    free_valid;
+    int    fsinfo_dirty;
+    UINT32 alloc_hint;           /* next-fit search start (cluster) */
+
+    char   label[48];
+
+    struct bcache *cache;
+
+    /* Largest single data transfer issued to the device, in bytes */
+    UINT32 max_transfer;
+};
+
+/* Entry position inside a directory's cluster chain */
+struct fat_dir_pos {
+    UINT32 cluster;
+    UINT32 index;                /* 32-byte entry within the cluster */
+};
+
+struct fat_dir_iter {
+    struct fat32_vol *vol;
+    struct fat_dir_pos pos;
+    UINT32 clusters;             /* walked so far (loop guard) */
+};
+
+/* A parsed directory entry set: optional long-name entries + short entry */
+struct fat_entry_info {
+    char   name[FS_MAX_NAME];
+    struct fat32_dir_entry de;   /* copy of the short entry */
+    struct fat_dir_pos start;    /* first entry of the set */
+    struct fat_dir_pos sfn;      /* the short entry itself */
+    UINT32 nentries;
+};
+
+/* ---- Volume helpers ---- */
+
+static char to_lower(char c) {
+    return (c >= 'A' && c <= 'Z') ? (char)(c + ('a' - 'A')) : c;
+}
+
+static char to_upper(char c) {
+    return (c >= 'a' && c <= 'z') ? (char)(c - ('a' - 'A')) : c;
+}
+
+static int ascii_icmp(const char *a, const char *b) {
+    while (*a && *b) {
+        char ca = to_lower(*a), cb = to_lower(*b);
+        if (ca != cb) return (int)(UINT8)ca - (int)(UINT8)cb;
+        a++; b++;
+    }
+    return (int)(UINT8)*a - (int)(UINT8)*b;
+}
+
+static UINT64 vol_cluster_sector(struct fat32_vol *vol, UINT32 cluster) {
+    return (UINT64)vol->data_start +
+           (UINT64)(cluster - 2) * vol->sectors_per_cluster;
+}
+
+static int vol_cluster_ok(struct fat32_vol *vol, UINT32 cluster) {
+    return cluster >= 2 && cluster < vol->cluster_count + 2;
+}
+
+static UINT32 entry_cluster(const struct fat32_dir_entry *de) {
+    return ((UINT32)de->first_cluster_hi << 16) | de->first_cluster_lo;
+}
+
+static void entry_set_cluster(struct fat32_dir_entry *de, UINT32 cluster) {
+    de->first_cluster_hi = (UINT16)(cluster >> 16);
+    de->first_cluster_lo = (UINT16)(cluster & 0xFFFF);
+}
+
+/* Write zeroes over a whole cluster */
+static int vol_zero_cluster(struct fat32_vol *vol, UINT32 cluster) {
+    UINT8 *z = (UINT8 *)mem_alloc(vol->cluster_size);
+    if (!z) return -1;
+    int rc = bcache_write(vol->cache, vol_cluster_sector(vol, cluster),
+                          vol->sectors_per_cluster, z);
+    mem_free(z);
+    return rc;
+}
+
+/* ---- FAT access (through the block cache) ---- */
+
+/* Sector of FAT copy 'copy' holding the entry for 'cluster' */
+static UINT64 fat_entry_sector(struct fat32_vol *vol, UINT32 copy,
+                               UINT32 cluster) {
+    return (UINT64)vol->fat_start + (UINT64)copy * vol->fat_sectors +
+           (UINT64)cluster * 4 / vol->bytes_per_sector;
+}
+
+/* Read an entry. An unreadable sector reads as a bad cluster, which
+   ends any chain walk and is never taken as free. */
+static UINT32 fat_entry_get(struct fat32_vol *vol, UINT32 cluster) {
+    UINT8 *sec = bcache_get(vol->cache,
+                            fat_entry_sector(vol, vol->active_fat, cluster));
+    if (!sec) return FAT32_BAD;
+    UINT32 off = (cluster * 4) % vol->bytes_per_sector;
+    return *(UINT32 *)(sec + off) & FAT32_ENTRY_MASK;
+}
+
+/* Write an entry in every FAT copy in use, keeping the free count */
+static int fat_entry_set(struct fat32_vol *vol, UINT32 cluster, UINT32 value) {
+    UINT32 off = (cluster * 4) % vol->bytes_per_sector;
+    for (UINT32 c = 0; c < vol->num_fats; c++) {
+        if (!vol->mirror && c != vol->active_fat) continue;
+        UINT64 s = fat_entry_sector(vol, c, cluster);
+        UINT8 *sec = bcache_get(vol->cache, s);
+        if (!sec) return -1;
+        UINT32 *e = (UINT32 *)(sec + off);
+        if (c == vol->active_fat && vol->free_valid) {
+            UINT32 old = *e & FAT32_ENTRY_MASK;
+            if (old == FAT32_FREE && value != FAT32_FREE && vol->free_clusters)
+                vol->free_clusters--;
+            else if (old != FAT32_FREE && value == FAT32_FREE)
+                vol->free_clusters++;
+        }
+        *e = (*e & 0xF0000000) | (value & FAT32_ENTRY_MASK);
+        bcache_mark_dirty(vol->cache, s);
+    }
+    vol->fsinfo_dirty = 1;
+    return 0;
+}
+
+/* First free cluster in [from, end), or 0. Scans a FAT sector at a time. */
+static UINT32 fat_find_free(struct fat32_vol *vol, UINT32 from, UINT32 end) {
+    UINT32 per_sec = vol->bytes_per_sector / 4;
+    UINT32 cl = from;
+    while (cl < end) {
+        UINT8 *sec = bcache_get(vol->cache,
+                                fat_entry_sector(vol, vol->active_fat, cl));
+        if (!sec) return 0;
+        const UINT32 *e = (const UINT32 *)sec;
+        UINT32 base = cl - cl % per_sec;
+        UINT32 stop = (end - base < per_sec) ? end - base : per_sec;
+        for (UINT32 i = cl - base; i < stop; i++) {
+            if ((e[i] & FAT32_ENTRY_MASK) == FAT32_FREE)
+                return base + i;
+        }
+        cl = base + per_sec;
+    }
+    return 0;
+}
+
+/* Length of the free run starting at cl, at most max */
+static UINT32 fat_free_run(struct fat32_vol *vol, UINT32 cl, UINT32 max) {
+    UINT32 end = vol->cluster_count + 2;
+    UINT32 n = 0;
+    while (n < max && cl + n < end && fat_entry_get(vol, cl + n) == FAT32_FREE)
+        n++;
+    return n;
+}
+
+/* Count free clusters with large reads of the FAT (once per mount,
+   and only when FSInfo had no usable count) */
+static int fat_count_free(struct fat32_vol *vol) {
+    if (vol->free_valid) return 0;
+
+    UINT32 bps = vol->bytes_per_sector;
+    UINT32 per_sec = bps / 4;
+    UINT32 end = vol->cluster_count + 2;
+    UINT32 nsec = (end + per_sec - 1) / per_sec;
+    UINT32 chunk = vol->max_transfer / bps;
+    if (chunk == 0) chunk = 1;
+    UINT8 *buf = (UINT8 *)mem_alloc((UINTN)chunk * bps);
+    if (!buf) return -1;
+
+    UINT32 nfree = 0;
+    for (UINT32 s = 0; s < nsec; ) {
+        UINT32 n = (nsec - s < chunk) ? nsec - s : chunk;
+        if (bcache_read(vol->cache, (UINT64)vol->fat_start +
+                        (UINT64)vol->active_fat * vol->fat_sectors + s,
+                        n, buf) != 0) {
+            mem_free(buf);
+            return -1;
+        }
+        const UINT32 *e = (const UINT32 *)buf;
+        UINT32 first = s * per_sec;
+        for (UINT32 i = 0; i < n * per_sec && first + i < end; i++) {
+            if (first + i >= 2 && (e[i] & FAT32_ENTRY_MASK) == FAT32_FREE)
+                nfree++;
+        }
+        s += n;
+    }
+    mem_free(buf);
+
+    vol->free_clusters = nfree;
+    vol->free_valid = 1;
+    return 0;
+}
+
+/*
+ * Allocate up to 'want' contiguous free clusters and chain them (the
+ * last one is end-of-chain). If 'hint' is free the extent starts there,
+ * so a growing file stays contiguous; otherwise the search is next-fit
+ * from alloc_hint: the first free run of at least 'want' clusters, or
+ * the longest run if none is large enough.
+ * Returns the first cluster (0 if the volume is full), *got its length.
+ */
+static UINT32 chain_alloc_extent(struct fat32_vol *vol, UINT32 hint,
+                                 UINT32 want, UINT32 *got) {
+    UINT32 end = vol->cluster_count + 2;
+    UINT32 best = 0, best_len = 0;
+
+    *got = 0;
+    if (want == 0 || (vol->free_valid && vol->free_clusters == 0))
+        return 0;
+
+    if (hint >= 2 && hint < end) {
+        best = hint;
+        best_len = fat_free_run(vol, hint, want);
+    }
+    if (best_len == 0) {
+        /* Two passes: [alloc_hint, end), then [2, alloc_hint) */
+        UINT32 start_at = vol_cluster_ok(vol, vol->alloc_hint)
+                          ? vol->alloc_hint : 2;
+        for (int pass = 0; pass < 2 && best_len < want; pass++) {
+            UINT32 cl = pass ? 2 : start_at;
+            UINT32 stop = pass ? start_at : end;
+            while (cl < stop && best_len < want) {
+                cl = fat_find_free(vol, cl, stop);
+                if (cl == 0) break;
+                UINT32 len = fat_free_run(vol, cl, want);
+                if (cl + len > stop) len = stop - cl;
+                if (len > best_len) {
+                    best = cl;
+                    best_len = len;
+                }
+                cl += len;
+            }
+        }
+    }
+    if (best_len == 0) return 0;
+
+    for (UINT32 i = 0; i < best_len; i++) {
+        UINT32 next = (i + 1 < best_len) ? best + i + 1 : FAT32_EOC;
+        if (fat_entry_set(vol, best + i, next) != 0) {
+            for (UINT32 j = 0; j < i; j++)
+                fat_entry_set(vol, best + j, FAT32_FREE);
+            return 0;
+        }
+    }
+    *got = best_len;
+    vol->alloc_hint = best + best_len;
+    return best;
+}
+
+/* Free a cluster chain */
+static int chain_free(struct fat32_vol *vol, UINT32 start) {
+    UINT32 cl = start;
+    UINT32 n = 0;
+    while (vol_cluster_ok(vol, cl) && n++ < vol->cluster_count) {
+        UINT32 next = fat_entry_get(vol, cl);
+        if (fat_entry_set(vol, cl, FAT32_FREE) != 0) return -1;
+        cl = next;
+    }
+    return 0;
+}
+
+/* Consistency point: FSInfo hints, then every dirty sector */
+static int vol_sync(struct fat32_vol *vol) {
+    if (vol->fsinfo_dirty && vol->fsinfo_sector) {
+        UINT8 *sec = bcache_get(vol->cache, vol->fsinfo_sector);
+        struct fat32_fsinfo *fsi = (struct fat32_fsinfo *)sec;
+        if (fsi && fsi->lead_sig == 0x41615252 &&
+            fsi->struct_sig == 0x61417272) {
+            fsi->free_count = vol->free_valid ? vol->free_clusters : 0xFFFFFFFF;
+            fsi->next_free = vol->alloc_hint;
+            bcache_mark_dirty(vol->cache, vol->fsinfo_sector);
+        }
+    }
+    vol->fsinfo_dirty = 0;
+    return bcache_flush(vol->cache);
+}
+
+/* ---- Directory iteration ---- */
+
+static void dir_iter_init(struct fat_dir_iter *it, struct fat32_vol *vol,
+                          UINT32 cluster) {
+    it->vol = vol;
+    it->pos.cluster = cluster;
+    it->pos.index = 0;
+    it->clusters = 0;
+}
+
+/* Pointer to the entry at the iterator, valid until the next cache
+   access. NULL on I/O error or a broken chain. */
+static struct fat32_dir_entry *dir_iter_get(struct fat_dir_iter *it) {
+    struct fat32_vol *vol = it->vol;
+    if (!vol_cluster_ok(vol, it->pos.cluster)) return NULL;
+    UINT32 byte = it->pos.index * 32;
+    UINT8 *sec = bcache_get(vol->cache, vol_cluster_sector(vol, it->pos.cluster)
+                                        + byte / vol->bytes_per_sector);
+    if (!sec) return NULL;
+    return (struct fat32_dir_entry *)(sec + byte % vol->bytes_per_sector);
+}
+
+/* Mark the sector under the iterator dirty after changing its entry */
+static void dir_iter_mark_dirty(struct fat_dir_iter *it) {
+    struct fat32_vol *vol = it->vol;
+    bcache_mark_dirty(vol->cache, vol_cluster_sector(vol, it->pos.cluster) +
+                      it->pos.index * 32 / vol->bytes_per_sector);
+}
+
+/* Step to the next entry. Returns 1 past the end of the chain,
+   -1 on a looping chain, 0 otherwise. */
+static int dir_iter_next(struct fat_dir_iter *it) {
+    struct fat32_vol *vol = it->vol;
+    if (++it->pos.index * 32 < vol->cluster_size) return 0;
+
+    UINT32 next = fat_entry_get(vol, it->pos.cluster);
+    if (!vol_cluster_ok(vol, next)) return 1;
+    if (++it->clusters > FAT32_MAX_DIR_ENTRIES * 32 / vol->cluster_size)
+        return -1;
+    it->pos.cluster = next;
+    it->pos.index = 0;
+    return 0;
+}
+
+static UINT8 lfn_checksum(const UINT8 *sfn) {
+    UINT8 sum = 0;
+    for (int i = 0; i < 11; i++)
+        sum = (UINT8)(((sum & 1) ? 0x80 : 0) + (sum >> 1) + sfn[i]);
+    return sum;
+}
+
+/* Short name as "NAME.EXT", honouring the lower-case flags if asked */
+static void sfn_to_ascii(const struct fat32_dir_entry *de, char *out,
+                         int use_case) {
+    int n = 0;
+    for (int i = 0; i < 11; i++) {
+        if (i == 8) {
+            if (de->name[8] == ' ') break;
+            out[n++] = '.';
+        }
+        UINT8 c = de->name[i];
+        if (c == ' ') {
+            if (i < 8) { i = 7; continue; }
+            break;
+        }
+        if (i == 0 && c == 0x05) c = 0xE5;
+        if (c >= 0x80) c = '?';
+        if (use_case && (de->nt_reserved & (i < 8 ? NT_LOWER_BASE : NT_LOWER_EXT)))
+            c = (UINT8)to_lower((char)c);
+        out[n++] = (char)c;
+    }
+    out[n] = '\0';
+}
+
+/*
+ * Read the entry set at or after the iterator: long-name entries (if
+ * their sequence and checksum hold up) followed by a short entry.
+ * Volume labels, "." and ".." are skipped. On success the iterator is
+ * left on the short entry. Returns 0 found, 1 end of directory, -1 error.
+ */
+static int dir_read_set(struct fat_dir_iter *it, struct fat_entry_info *info) {
+    UINT16 lfn[LFN_MAX_ENTRIES * LFN_CHARS + 1];
+    int lfn_total = 0, lfn_next = 0;
+    UINT8 lfn_sum = 0;
+    struct fat_dir_pos lfn_start = it->pos;
+
+    for (;;) {
+        struct fat32_dir_entry *de = dir_iter_get(it);
+        if (!de) return -1;
+        UINT8 first = de->name[0];
+        if (first == DIRENT_END) return 1;
+
+        if (first == DIRENT_FREE) {
+            lfn_total = 0;
+        } else if ((de->attr & 0x3F) == ATTR_LFN) {
+            const UINT8 *raw = (const UINT8 *)de;
+            int seq = first & 0x1F;
+            if (first & LFN_LAST) {
+                lfn_total = (seq >= 1 && seq <= LFN_MAX_ENTRIES) ? seq : 0;
+                lfn_next = lfn_total;
+                lfn_sum = raw[13];
+                lfn_start = it->pos;
+                mem_set(lfn, 0, sizeof(lfn));
+            }
+            if (lfn_total && seq == lfn_next && raw[13] == lfn_sum) {
+                for (int k = 0; k < LFN_CHARS; k++) {
+                    const UINT8 *p = raw + s_lfn_off[k];
+                    lfn[(seq - 1) * LFN_CHARS + k] = (UINT16)(p[0] | (p[1] << 8));
+                }
+                lfn_next--;
+            } else {
+                lfn_total = 0;
+            }
+        } else if ((de->attr & ATTR_VOLUME_ID) || first == '.') {
+            lfn_total = 0;
+        } else {
+            mem_copy(&info->de, de, sizeof(*de));
+            info->sfn = it->pos;
+            if (lfn_total && lfn_next == 0 && lfn_sum == lfn_checksum(de->name)) {
+                int n = 0;
+                for (int k = 0; k < lfn_total * LFN_CHARS && n < FS_MAX_NAME - 1; k++) {
+                    UINT16 ch = lfn[k];
+                    if (ch == 0x0000 || ch == 0xFFFF) break;
+                    info->name[n++] = (ch < 0x80) ? (char)ch : '?';
+                }
+                info->name[n] = '\0';
+                info->start = lfn_start;
+                info->nentries = (UINT32)lfn_total + 1;
+            } else {
+                sfn_to_ascii(de, info->name, 1);
+                info->start = it->pos;
+                info->nentries = 1;
+            }
+            return 0;
+        }
+
+        int r = dir_iter_next(it);
+        if (r != 0) return r;
+    }
+}
+
+/* ---- Name lookup ---- */
+
+/* Find a name (long or 8.3, case-insensitive) in a directory.
+   Returns 0 and fills *info if found. */
+static int dir_lookup(struct fat32_vol *vol, UINT32 dir_cluster,
+                      const char *name, struct fat_entry_info *info) {
+    struct fat_dir_iter it;
+    dir_iter_init(&it, vol, dir_cluster);
+    for (;;) {
+        if (dir_read_set(&it, info) != 0) return -1;
+        if (ascii_icmp(info->name, name) == 0) return 0;
+        if (info->nentries > 1) {
+            char sfn[13];
+            sfn_to_ascii(&info->de, sfn, 0);
+            if (ascii_icmp(sfn, name) == 0) return 0;
+        }
+        if (dir_iter_next(&it) != 0) return -1;
+    }
+}
+
+/* Resolve "/a/b/c". The root reports as a directory at root_cluster. */
+static int path_resolve(struct fat32_vol *vol, const char *path,
+                        struct fat_entry_info *info) {
+    if (!path || !path[0]) return -1;
+
+    mem_set(info, 0, sizeof(*info));
+    info->de.attr = ATTR_DIRECTORY;
+    entry_set_cluster(&info->de, vol->root_cluster);
+
+    const char *p = path;
+    while (*p == '/') p++;
+    while (*p) {
+        char component[FS_MAX_NAME];
+        int len = 0;
+        while (*p && *p != '/' && len < FS_MAX_NAME - 1)
+            component[len++] = *p++;
+        component[len] = '\0';
+        while (*p == '/') p++;
+
+        if (!(info->de.attr & ATTR_DIRECTORY)) return -1;
+        if (dir_lookup(vol, entry_cluster(&info->de), component, info) != 0)
+            return -1;
+    }
+    return 0;
+}
+
+/* Resolve the parent directory of path; the last component goes to
+   name_out. Returns the parent's first cluster, or 0 on error. */
+static UINT32 path_resolve_parent(struct fat32_vol *vol, const char *path,
+                                  char *name_out, int name_max) {
+    if (!path || !path[0]) return 0;
+
+    const char *last_slash = NULL;
+    for (const char *p = path; *p; p++) {
+        if (*p == '/') last_slash = p;
+    }
+    const char *name = last_slash ? last_slash + 1 : path;
+    int len = 0;
+    while (name[len] && len < name_max - 1) {
+        name_out[len] = name[len];
+        len++;
+    }
+    name_out[len] = '\0';
+
+    if (!last_slash || last_slash == path) return vol->root_cluster;
+
+    char parent[512];
+    int plen = (int)(last_slash - path);
+    if (plen >= (int)sizeof(parent)) return 0;
+    mem_copy(parent, path, (UINTN)plen);
+    parent[plen] = '\0';
+
+    struct fat_entry_info pinfo;
+    if (path_resolve(vol, parent, &pinfo) != 0) return 0;
+    if (!(pinfo.de.attr & ATTR_DIRECTORY)) return 0;
+    UINT32 cl = entry_cluster(&pinfo.de);
+    return cl ? cl : vol->root_cluster;   /* ".." style 0 = root */
+}
+
+/* ---- Entry set creation ---- */
+
+static int sfn_char_ok(char c) {
+    if ((c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9')) return 1;
+    for (const char *s = "$%'-_@~`!(){}^#&"; *s; s++) {
+        if (*s == c) return 1;
+    }
+    return 0;
+}
+
+/* Names the driver accepts: 1-255 printable ASCII, not "." or ".." */
+static int name_valid(const char *name) {
+    int len = 0;
+    for (; name[len]; len++) {
+        UINT8 c = (UINT8)name[len];
+        if (c < 0x20 || c >= 0x7F) return 0;
+        for (const char *s = "\"*/:<>?\\|"; *s; s++) {
+            if (*s == (char)c) return 0;
+        }
+    }
+    if (len == 0 || len > 255) return 0;
+    if (name[0] == '.' && (len == 1 || (len == 2 && name[1] == '.'))) return 0;
+    return 1;
+}
+
+/* Does name fit an 8.3 entry exactly (one case per part)?
+   Fills sfn and the lower-case flags if so. */
+static int name_to_sfn(const char *name, UINT8 *sfn, UINT8 *nt) {
+    const char *dot = NULL;
+    for (const char *p = name; *p; p++) {
+        if (*p == '.') {
+            if (dot) return 0;
+            dot = p;
+        }
+    }
+    int blen = dot ? (int)(dot - name) : (int)str_len((const CHAR8 *)name);
+    int elen = dot ? (int)str_len((const CHAR8 *)(dot + 1)) : 0;
+    if (blen < 1 || blen > 8 || elen > 3 || (dot && elen == 0)) return 0;
+
+    mem_set(sfn, ' ', 11);
+    *nt = 0;
+    for (int part = 0; part < 2; part++) {
+        const char *s = part ? (dot ? dot + 1 : "") : name;
+        int n = part ? elen : blen;
+        int upper = 0, lower = 0;
+        for (int i = 0; i < n; i++) {
+            char c = s[i];
+            if (c >= 'a' && c <= 'z') lower = 1;
+            else if (c >= 'A' && c <= 'Z') upper = 1;
+            c = to_upper(c);
+            if (!sfn_char_ok(c)) return 0;
+            sfn[(part ? 8 : 0) + i] = (UINT8)c;
+        }
+        if (upper && lower) return 0;
+        if (lower) *nt |= part ? NT_LOWER_EXT : NT_LOWER_BASE;
+    }
+    return 1;
+}
+
+/* Short-name basis for a long name, "~n" not yet applied */
+static void sfn_basis(const char *name, UINT8 *sfn) {
+    const char *dot = NULL;
+    for (const char *p = name; *p; p++) {
+        if (*p == '.') dot = p;
+    }
+    if (dot == name) dot = NULL;    /* ".profile" has no extension */
+
+    mem_set(sfn, ' ', 11);
+    int n = 0;
+    for (const char *p = name; *p && p != dot && n < 8; p++) {
+        if (*p == ' ' || *p == '.') continue;
+        char c = to_upper(*p);
+        sfn[n++] = (UINT8)(sfn_char_ok(c) ? c : '_');
+    }
+    if (n == 0) sfn[n++] = '_';
+    if (dot) {
+        n = 8;
+        for (const char *p = dot + 1; *p && n < 11; p++) {
+            if (*p == ' ') continue;
+            char c = to_upper(*p);
+            sfn[n++] = (UINT8)(sfn_char_ok(c) ? c : '_');
+        }
+    }
+}
+
+/* Put "~n" into the base part, shortening it as needed */
+static void sfn_apply_tail(UINT8 *sfn, UINT32 num) {
+    char tail[8];
+    int t = 0;
+    do { tail[t++] = (char)('0' + num % 10); num /= 10; } while (num);
+    tail[t++] = '~';
+
+    int blen = 0;
+    while (blen < 8 && sfn[blen] != ' ') blen++;
+    if (blen > 8 - t) blen = 8 - t;
+    while (t > 0) sfn[blen++] = (UINT8)tail[--t];
+    while (blen < 8) sfn[blen++] = ' ';
+}
+
+/* Is this 8.3 name already used in the directory? 1 yes, 0 no, -1 error */
+static int sfn_in_use(struct fat32_vol *vol, UINT32 dir_cluster,
+                      const UINT8 *sfn) {
+    struct fat_dir_iter it;
+    dir_iter_init(&it, vol, dir_cluster);
+    for (;;) {
+        struct fat32_dir_entry *de = dir_iter_get(&it);
+        if (!de) return -1;
+        if (de->name[0] == DIRENT_END) return 0;
+        if (de->name[0] != DIRENT_FREE && (de->attr & 0x3F) != ATTR_LFN &&
+            !(de->attr & ATTR_VOLUME_ID) && memcmp(de->name, sfn, 11) == 0)
+            return 1;
+        int r = dir_iter_next(&it);
+        if (r > 0) return 0;
+        if (r < 0) return -1;
+    }
+}
+
+/* Short entry template: attributes, first cluster, size, fixed date */
+static void dirent_proto(struct fat32_dir_entry *de, UINT8 attr,
+                         UINT32 cluster, UINT32 size) {
+    mem_set(de, 0, sizeof(*de));
+    de->attr = attr;
+    entry_set_cluster(de, cluster);
+    de->file_size = size;
+    de->create_date = FAT32_FIXED_DATE;
+    de->access_date = FAT32_FIXED_DATE;
+    de->modify_date = FAT32_FIXED_DATE;
+}
+
+/*
+ * Build the entries for 'name' in buf (32 * (LFN_MAX_ENTRIES + 1)
+ * bytes): a lone short entry when the name fits 8.3, otherwise long-name
+ * entries plus a unique "BASIS~n" short entry. Everything but the name
+ * comes from proto. Returns the entry count, or -1 on error.
+ */
+static int dirset_build(struct fat32_vol *vol, UINT32 dir_cluster,
+                        const char *name, const struct fat32_dir_entry *proto,
+                        UINT8 *buf) {
+    UINT8 sfn[11], nt = 0;
+    int len = (int)str_len((const CHAR8 *)name);
+    int nlfn = 0;
+
+    if (!name_to_sfn(name, sfn, &nt)) {
+        nlfn = (len + LFN_CHARS - 1) / LFN_CHARS;
+        UINT8 basis[11];
+        sfn_basis(name, basis);
+        for (UINT32 num = 1; ; num++) {
+            if (num > 999999) return -1;
+            mem_copy(sfn, basis, 11);
+            sfn_apply_tail(sfn, num);
+            int r = sfn_in_use(vol, dir_cluster, sfn);
+            if (r < 0) return -1;
+            if (r == 0) break;
+        }
+    }
+
+    UINT8 sum = lfn_checksum(sfn);
+    mem_set(buf, 0, (UINTN)(nlfn + 1) * 32);
+    for (int i = 0; i < nlfn; i++) {
+        int ord = nlfn - i;          /* stored last piece first */
+        UINT8 *e = buf + i * 32;
+        e[0] = (UINT8)(ord | (i == 0 ? LFN_LAST : 0));
+        e[11] = ATTR_LFN;
+        e[13] = sum;
+        for (int k = 0; k < LFN_CHARS; k++) {
+            int ci = (ord - 1) * LFN_CHARS + k;
+            UINT16 ch = (ci < len) ? (UINT8)name[ci] : (ci == len ? 0 : 0xFFFF);
+            e[s_lfn_off[k]] = (UINT8)(ch & 0xFF);
+            e[s_lfn_off[k] + 1] = (UINT8)(ch >> 8);
+        }
+    }
+
+    struct fat32_dir_entry *de = (struct fat32_dir_entry *)(buf + nlfn * 32);
+    mem_copy(de, proto, sizeof(*de));
+    mem_copy(de->name, sfn, 11);
+    de->nt_reserved = nt;
+    return nlfn + 1;
+}
+
+/*
+ * Find 'count' consecutive free entries in a directory, growing it by
+ * zeroed clusters when the chain runs out.
+ */
+static int dir_find_free(struct fat32_vol *vol, UINT32 dir_cluster,
+                         UINT32 count, struct fat_dir_pos *out) {
+    struct fat_dir_iter it;
+    struct fat_dir_pos run_start = { 0, 0 };
+    UINT32 run = 0, total = 0;
+    UINT32 last = dir_cluster;
+
+    dir_iter_init(&it, vol, dir_cluster);
+    for (;;) {
+        struct fat32_dir_entry *de = dir_iter_get(&it);
+        if (!de) return -1;
+        if (de->name[0] == DIRENT_FREE || de->name[0] == DIRENT_END) {
+            if (run == 0) run_start = it.pos;
+            if (++run == count) {
+                *out = run_start;
+                return 0;
+            }
+        } else {
+            run = 0;
+        }
+        total++;
+        last = it.pos.cluster;
+        int r = dir_iter_next(&it);
+        if (r < 0) return -1;
+        if (r > 0) break;
+    }
+
+    UINT32 per_cluster = vol->cluster_size / 32;
+    while (run < count) {
+        if (total + per_cluster > FAT32_MAX_DIR_ENTRIES) return -1;
+        UINT32 got;
+        UINT32 cl = chain_alloc_extent(vol, last + 1, 1, &got);
+        if (cl == 0) return -1;
+        if (vol_zero_cluster(vol, cl) != 0 ||
+            fat_entry_set(vol, last, cl) != 0) {
+            fat_entry_set(vol, cl, FAT32_FREE);
+            return -1;
+        }
+        if (run == 0) {
+            run_start.cluster = cl;
+            run_start.index = 0;
+        }
+        run += per_cluster;
+        total += per_cluster;
+        last = cl;
+    }
+    *out = run_start;
+    return 0;
+}
+
+/* Write count entries from buf starting at pos; *sfn_out gets the
+   position of the last (short) entry */
+static int dir_write_set(struct fat32_vol *vol, struct fat_dir_pos pos,
+                         const UINT8 *buf, int count,
+                         struct fat_dir_pos *sfn_out) {
+    struct fat_dir_iter it;
+    dir_iter_init(&it, vol, pos.cluster);
+    it.pos = pos;
+    for (int i = 0; i < count; i++) {
+        if (i > 0 && dir_iter_next(&it) != 0) return -1;
+        struct fat32_dir_entry *de = dir_iter_get(&it);
+        if (!de) return -1;
+        mem_copy(de, buf + i * 32, 32);
+        dir_iter_mark_dirty(&it);
+    }
+    if (sfn_out) *sfn_out = it.pos;
+    return 0;
+}
+
+/* Build and place an entry set for name in a directory */
+static int dir_add(struct fat32_vol *vol, UINT32 dir_cluster, const char *name,
+                   const struct fat32_dir_entry *proto,
+                   struct fat_dir_pos *sfn_out) {
+    UINT8 buf[32 * (LFN_MAX_ENTRIES + 1)];
+    int count = dirset_build(vol, dir_cluster, name, proto, buf);
+    if (count < 0) return -1;
+    struct fat_dir_pos pos;
+    if (dir_find_free(vol, dir_cluster, (UINT32)count, &pos) != 0) return -1;
+    return dir_write_set(vol, pos, buf, count, sfn_out);
+}
+
+/* Mark every entry of a set deleted */
+static int dir_remove_set(struct fat32_vol *vol, const struct fat_entry_info *info) {
+    struct fat_dir_iter it;
+    dir_iter_init(&it, vol, info->start.cluster);
+    it.pos = info->start;
+    for (UINT32 i = 0; i < info->nentries; i++) {
+        if (i > 0 && dir_iter_next(&it) != 0) return -1;
+        struct fat32_dir_entry *de = dir_iter_get(&it);
+        if (!de) return -1;
+        de->name[0] = DIRENT_FREE;
+        dir_iter_mark_dirty(&it);
+    }
+    return 0;
+}
+
+/* Remove a file's entry set and free its clusters */
+static int file_remove(struct fat32_vol *vol, const struct fat_entry_info *info) {
+    if (dir_remove_set(vol, info) != 0) return -1;
+    UINT32 cl = entry_cluster(&info->de);
+    return cl ? chain_free(vol, cl) : 0;
+}
+
+/* ---- File data ---- */
+
+struct fat32_file {
+    struct fat32_vol *vol;
+    int    writable;
+    UINT64 size;                 /* reader: file size; writer: bytes so far */
+    UINT64 pos;
+    UINT32 first_cluster;
+
+    /* Cluster cursor: cur_cluster holds file bytes [cur_base, +clsz) */
+    UINT32 cur_cluster;
+    UINT64 cur_base;
+
+    /* Reader: the chain as runs (runmap.h), built by the first seek, so
+       no seek walks the chain again; the current run holds cur_cluster */
+    struct run_map map;
+
+    /* Writer: pending data (whole clusters except at close) */
+    UINT8  *wbuf;
+    UINT32 wcap;
+    UINT32 wlen;
+    UINT32 last_cluster;
+
+    /* Writer: the short entry, rewritten on close */
+    struct fat_dir_pos sfn;
+};
+
+/*
+ * Walk a reader's cluster chain once into f->map, so a seek is a binary
+ * search instead of one FAT lookup per cluster from the start.  A chain
+ * that ends early is mapped as far as it goes.
+ */
+static int file_map_chain(struct fat32_file *f) {
+    struct fat32_vol *vol = f->vol;
+    UINT32 clsz = vol->cluster_size;
+    UINT64 want = (f->size + clsz - 1) / clsz;
+
+    if (run_map_init(&f->map) != 0) return -1;
+    UINT32 cl = f->first_cluster;
+    for (UINT64 i = 0; i < want && vol_cluster_ok(vol, cl); i++) {
+        if (run_map_add(&f->map, cl) != 0) return -1;
+        cl = fat_entry_get(vol, cl);
+    }
+    return 0;
+}
+
+/* Move the cluster cursor to the cluster holding file offset 'off' */
+static int file_seek_cluster(struct fat32_file *f, UINT64 off) {
+    struct fat32_vol *vol = f->vol;
+    UINT32 clsz = vol->cluster_size;
+
+    if (!f->writable && !f->map.runs && !f->map.failed && f->size > clsz)
+        file_map_chain(f);
+
+    if (f->map.runs) {
+        UINT64 idx = off / clsz;
+        if (run_map_seek(&f->map, idx, &f->cur_cluster) != 0) return -1;
+        f->cur_base = idx * clsz;
+        return 0;
+    }
+
+    if (f->cur_cluster < 2 || off < f->cur_base) {
+        f->cur_cluster = f->first_cluster;
+        f->cur_base = 0;
+    }
+    while (off - f->cur_base >= clsz) {
+        UINT32 next = fat_entry_get(vol, f->cur_cluster);
+        if (!vol_cluster_ok(vol, next)) return -1;
+        f->cur_cluster = next;
+        f->cur_base += clsz;
+    }
+    return 0;
+}
+
+/*
+ * Read len bytes at file offset off. Contiguous clusters are merged into
+ * one device read of up to max_transfer bytes; unaligned head and tail
+ * sectors go through the sector cache.
+ */
+static int file_read_at(struct fat32_file *f, UINT64 off, UINT8 *dst,
+                        UINTN len) {
+    struct fat32_vol *vol = f->vol;
+    UINT32 clsz = vol->cluster_size;
+    UINT32 bps = vol->bytes_per_sector;
+    UINT32 max_run = vol->max_transfer / clsz;
+    if (max_run == 0) max_run = 1;
+
+    while (len > 0) {
+        if (file_seek_cluster(f, off) != 0) return -1;
+
+        UINT32 in_cl = (UINT32)(off - f->cur_base);
+        UINT32 left = run_map_left(&f->map, f->cur_cluster);
+        UINT32 run = 1;
+        while ((UINT64)run * clsz - in_cl < len && run < max_run) {
+            UINT32 last = f->cur_cluster + run - 1;
+            if (left ? run == left : fat_entry_get(vol, last) != last + 1)
+                break;
+            run++;
+        }
+
+        UINT64 avail = (UINT64)run * clsz - in_cl;
+        UINT32 chunk = (avail < len) ? (UINT32)avail : (UINT32)len;
+        UINT64 sec = vol_cluster_sector(vol, f->cur_cluster) + in_cl / bps;
+        UINT32 soff = in_cl % bps;
+        UINT32 done = 0;
+
+        if (soff > 0) {
+            UINT8 *tmp = bcache_get(vol->cache, sec);
+            if (!tmp) return -1;
+            UINT32 n = bps - soff;
+            if (n > chunk) n = chunk;
+            mem_copy(dst, tmp + soff, n);
+            done = n;
+            sec++;
+        }
+
+        UINT32 full_secs = (chunk - done) / bps;
+        if (full_secs > 0) {
+            if (bcache_read(vol->cache, sec, full_secs, dst + done) != 0)
+                return -1;
+            done += full_secs * bps;
+            sec += full_secs;
+        }
+
+        if (done < chunk) {
+            UINT8 *tmp = bcache_get(vol->cache, sec);
+            if (!tmp) return -1;
+            mem_copy(dst + done, tmp, chunk - done);
+        }
+
+        /* The cursor now sits on the run's last cluster */
+        UINT32 skip = (in_cl + chunk - 1) / clsz;
+        f->cur_cluster += skip;
+        f->cur_base += (UINT64)skip * clsz;
+
+        off += chunk;
+        dst += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+/*
+ * Write len bytes into the contiguous clusters [first, first+count).
+ * Whole clusters go to the device in max_transfer sized pieces straight
+ * from src; a partial last cluster is zero-padded.
+ */
+static int extent_write(struct fat32_vol *vol, UINT32 first, UINT32 count,
+                        const UINT8 *src, UINT64 len) {
+    UINT32 clsz = vol->cluster_size;
+    UINT32 max_cl = vol->max_transfer / clsz;
+    if (max_cl == 0) max_cl = 1;
+    UINT32 full = (UINT32)(len / clsz);
+
+    for (UINT32 done = 0; done < full; ) {
+        UINT32 n = (full - done < max_cl) ? full - done : max_cl;
+        if (bcache_write(vol->cache, vol_cluster_sector(vol, first + done),
+                         n * vol->sectors_per_cluster,
+                         src + (UINT64)done * clsz) != 0)
+            return -1;
+        done += n;
+    }
+
+    UINT32 partial = (UINT32)(len % clsz);
+    if (partial > 0 && full < count) {
+        UINT8 *tmp = (UINT8 *)mem_alloc(clsz);
+        if (!tmp) return -1;
+        mem_copy(tmp, src + (UINT64)full * clsz, partial);
+        int rc = bcache_write(vol->cache, vol_cluster_sector(vol, first + full),
+                              vol->sectors_per_cluster, tmp);
+        mem_free(tmp);
+        if (rc != 0) return -1;
+    }
+    return 0;
+}
+
+/* Allocate clusters for size bytes as few extents as possible, chain
+   them and write the data. *out_first is 0 for an empty file. */
+static int data_write(struct fat32_vol *vol, const UINT8 *src, UINT64 size,
+                      UINT32 *out_first) {
+    UINT32 clsz = vol->cluster_size;
+    UINT32 need = (UINT32)((size + clsz - 1) / clsz);
+    UINT32 first = 0, prev = 0;
+    UINT64 left = size;
+
+    *out_first = 0;
+    while (need > 0) {
+        UINT32 got;
+        UINT32 cl = chain_alloc_extent(vol, prev ? prev + 1 : 0, need, &got);
+        if (cl == 0) goto fail;
+        if (prev && fat_entry_set(vol, prev, cl) != 0) {
+            chain_free(vol, cl);
+            goto fail;
+        }
+        if (!first) first = cl;
+        UINT64 len = (UINT64)got * clsz;
+        if (len > left) len = left;
+        if (extent_write(vol, cl, got, src, len) != 0) goto fail;
+        src += len;
+        left -= len;
+        need -= got;
+        prev = cl + got - 1;
+    }
+    *out_first = first;
+    return 0;
+
+fail:
+    if (first) chain_free(vol, first);
+    return -1;
+}
+
+/* ---- Volume API ---- */
+
+/* Copy an 11-byte space-padded label, dropping "NO NAME" */
+static void label_from_83(char *dst, const UINT8 *src) {
+    int n = 11;
+    while (n > 0 && src[n - 1] == ' ') n--;
+    if (n == 7 && memcmp(src, "NO NAME", 7) == 0) n = 0;
+    for (int i = 0; i < n; i++)
+        dst[i] = (src[i] >= 0x20 && src[i] < 0x7F) ? (char)src[i] : '?';
+    dst[n] = '\0';
+}
+
+struct fat32_vol *fat32_mount(fat32_block_read_fn read_fn,
+                              fat32_block_write_fn write_fn,
+                              void *ctx, UINT32 block_size) {
+    if (!read_fn || block_size == 0) return NULL;
+
+    /* The BPB is the first 512 bytes of the volume */
+    UINT32 blocks = (512 + block_size - 1) / block_size;
+    UINT8 *boot = (UINT8 *)mem_alloc((UINTN)blocks * block_size);
+    if (!boot) return NULL;
+    if (read_fn(ctx, 0, blocks, boot) != 0) {
+        mem_free(boot);
+        return NULL;
+    }
+    struct fat32_bpb bpb;
+    mem_copy(&bpb, boot, sizeof(bpb));
+    mem_free(boot);
+
+    /* FAT32 is told apart by its layout (no fixed root directory, no
+       16-bit FAT size), not by the advisory type string */
+    UINT32 bps = bpb.bytes_per_sector;
+    UINT32 spc = bpb.sectors_per_cluster;
+    if (bpb.signature != 0xAA55) return NULL;
+    if (bps < 512 || bps > 4096 || (bps & (bps - 1)) || bps % block_size)
+        return NULL;
+    if (spc == 0 || (spc & (spc - 1))) return NULL;
+    if (bpb.reserved_sectors == 0 || bpb.num_fats == 0) return NULL;
+    if (bpb.root_entry_count != 0 || bpb.fat_size_16 != 0 ||
+        bpb.fat_size_32 == 0 || bpb.fs_version != 0)
+        return NULL;
+
+    UINT64 total = bpb.total_sectors_16 ? bpb.total_sectors_16
+                                        : bpb.total_sectors_32;
+    UINT64 data_start = (UINT64)bpb.reserved_sectors +
+                        (UINT64)bpb.num_fats * bpb.fat_size_32;
+    if (total <= data_start) return NULL;
+    UINT64 clusters = (total - data_start) / spc;
+    UINT64 fat_cap = (UINT64)bpb.fat_size_32 * bps / 4 - 2;
+    if (clusters > fat_cap) clusters = fat_cap;
+    if (clusters > FAT32_BAD - 2) clusters = FAT32_BAD - 2;
+    if (clusters == 0) return NULL;
+
+    struct fat32_vol *vol = (struct fat32_vol *)mem_alloc(sizeof(*vol));
+    if (!vol) return NULL;
+    vol->read_fn = read_fn;
+    vol->write_fn = write_fn;
+    vol->ctx = ctx;
+    vol->dev_block_size = block_size;
+    vol->bytes_per_sector = bps;
+    vol->sectors_per_cluster = spc;
+    vol->cluster_size = bps * spc;
+    vol->fat_start = bpb.reserved_sectors;
+    vol->fat_sectors = bpb.fat_size_32;
+    vol->num_fats = bpb.num_fats;
+    vol->mirror = (bpb.ext_flags & 0x80) ? 0 : 1;
+    vol->active_fat = vol->mirror ? 0 : (bpb.ext_flags & 0x0F);
+    vol->data_start = (UINT32)data_start;
+    vol->cluster_count = (UINT32)clusters;
+    vol->root_cluster = bpb.root_cluster;
+    vol->alloc_hint = 2;
+    vol->max_transfer = FAT32_DEFAULT_MAX_XFER;
+    if (vol->active_fat >= vol->num_fats || !vol_cluster_ok(vol, vol->root_cluster)) {
+        mem_free(vol);
+        return NULL;
+    }
+    if (bpb.fs_info_sector && bpb.fs_info_sector < bpb.reserved_sectors)
+        vol->fsinfo_sector = bpb.fs_info_sector;
+    label_from_83(vol->label, bpb.volume_label);
+
+    vol->cache = bcache_create(read_fn, write_fn, ctx, bps, block_size);
+    if (!vol->cache) {
+        mem_free(vol);
+        return NULL;
+    }
+
+    /* FSInfo: a plausible free count saves counting the whole FAT */
+    if (vol->fsinfo_sector) {
+        struct fat32_fsinfo *fsi =
+            (struct fat32_fsinfo *)bcache_get(vol->cache, vol->fsinfo_sector);
+        if (fsi && fsi->lead_sig == 0x41615252 &&
+            fsi->struct_sig == 0x61417272) {
+            if (fsi->free_count <= vol->cluster_count) {
+                vol->free_clusters = fsi->free_count;
+                vol->free_valid = 1;
+            }
+            if (vol_cluster_ok(vol, fsi->next_free))
+                vol->alloc_hint = fsi->next_free;
+        } else {
+            vol->fsinfo_sector = 0;
+        }
+    }
+
+    /* The root directory's label entry wins over the BPB copy */
+    struct fat_dir_iter it;
+    dir_iter_init(&it, vol, vol->root_cluster);
+    for (;;) {
+        struct fat32_dir_entry *de = dir_iter_get(&it);
+        if (!de || de->name[0] == DIRENT_END) break;
+        if (de->name[0] != DIRENT_FREE && (de->attr & 0x3F) != ATTR_LFN &&
+            (de->attr & ATTR_VOLUME_ID)) {
+            label_from_83(vol->label, de->name);
+            break;
+        }
+        if (dir_iter_next(&it) != 0) break;
+    }
+    return vol;
+}
+
+void fat32_set_max_transfer(struct fat32_vol *vol, UINT32 bytes) {
+    if (!vol) return;
+    if (bytes < vol->cluster_size) bytes = vol->cluster_size;
+    vol->max_transfer = bytes;
+}
+
+void fat32_unmount(struct fat32_vol *vol) {
+    if (!vol) return;
+    if (vol->write_fn) vol_sync(vol);
+    bcache_destroy(vol->cache);
+    mem_free(vol);
+}
+
+struct fat32_dir {
+    struct fat_dir_iter it;
+    int done;
+};
+
+struct fat32_dir *fat32_opendir(struct fat32_vol *vol, const char *path) {
+    if (!vol || !path) return NULL;
+
+    struct fat_entry_info info;
+    if (path_resolve(vol, path, &info) != 0) return NULL;
+    if (!(info.de.attr & ATTR_DIRECTORY)) return NULL;
+
+    struct fat32_dir *d = (struct fat32_dir *)mem_alloc(sizeof(*d));
+    if (!d) return NULL;
+    dir_iter_init(&d->it, vol, entry_cluster(&info.de));
+    return d;
+}
+
+int fat32_readdir_next(struct fat32_dir *d, struct fs_entry *out) {
+    if (!d || !out) return -1;
+    if (d->done) return 0;
+
+    struct fat_entry_info info;
+    int r = dir_read_set(&d->it, &info);
+    if (r != 0) {
+        d->done = 1;
+        return r < 0 ? -1 : 0;
+    }
+    str_copy(out->name, info.name, FS_MAX_NAME);
+    out->is_dir = (info.de.attr & ATTR_DIRECTORY) ? 1 : 0;
+    out->size = out->is_dir ? 0 : info.de.file_size;
+    out->mtime = (UINT32)info.de.modify_date << 16 | info.de.modify_time;
+    out->ctime = (UINT32)info.de.create_date << 16 | info.de.create_time;
+    out->attr = info.de.attr & 0x27;
+    out->id = entry_cluster(&info.de);
+    if (dir_iter_next(&d->it) != 0) d->done = 1;
+    return 1;
+}
+
+void fat32_closedir(struct fat32_dir *d) {
+    if (d) mem_free(d);
+}
+
+int fat32_readdir(struct fat32_vol *vol, const char *path,
+                  struct fs_entry *entries, int max_entries) {
+    if (!vol || !path || !entries || max_entries <= 0) return -1;
+
+    struct fat32_dir *d = fat32_opendir(vol, path);
+    if (!d) return -1;
+    int count = 0, r = 0;
+    while (count < max_entries &&
+           (r = fat32_readdir_next(d, &entries[count])) > 0)
+        count++;
+    fat32_closedir(d);
+    if (r < 0 && count == 0) return -1;
+
+    dirsort_entries(entries, count);
+    return count;
+}
+
+void *fat32_readfile(struct fat32_vol *vol, const char *path, UINTN *out_size) {
+    if (!vol || !path || !out_size) return NULL;
+
+    UINT64 size;
+    struct fat32_file *f = fat32_open(vol, path, &size);
+    if (!f) return NULL;
+
+    /* Empty file: a 1-byte buffer with NUL */
+    UINT8 *buf = (UINT8 *)mem_alloc(size ? (UINTN)size : 1);
+    if (buf && size && file_read_at(f, 0, buf, (UINTN)size) != 0) {
+        mem_free(buf);
+        buf = NULL;
+    }
+    fat32_close(f);
+    if (buf) *out_size = (UINTN)size;
+    return buf;
+}
+
+int fat32_writefile(struct fat32_vol *vol, const char *path,
+                    const void *data, UINTN size) {
+    if (!vol || !path || !vol->write_fn) return -1;
+    if ((UINT64)size > FAT32_MAX_FILE_SIZE) return -1;
+
+    char name[FS_MAX_NAME];
+    UINT32 parent = path_resolve_parent(vol, path, name, FS_MAX_NAME);
+    if (parent == 0 || !name_valid(name)) return -1;
+
+    struct fat_entry_info existing;
+    if (dir_lookup(vol, parent, name, &existing) == 0) {
+        if (existing.de.attr & ATTR_DIRECTORY) return -1;
+        if (file_remove(vol, &existing) != 0) return -1;
+    }
+
+    UINT32 first = 0;
+    if (size > 0 && data_write(vol, (const UINT8 *)data, size, &first) != 0) {
+        vol_sync(vol);
+        return -1;
+    }
+
+    struct fat32_dir_entry proto;
+    dirent_proto(&proto, ATTR_ARCHIVE, first, (UINT32)size);
+    if (dir_add(vol, parent, name, &proto, NULL) != 0) {
+        if (first) chain_free(vol, first);
+        vol_sync(vol);
+        return -1;
+    }
+    return vol_sync(vol);
+}
+
+/* Create one directory: a zeroed cluster with "." and ".." */
+static UINT32 dir_create(struct fat32_vol *vol, UINT32 parent, const char *name) {
+    UINT32 got;
+    UINT32 cl = chain_alloc_extent(vol, 0, 1, &got);
+    if (cl == 0) return 0;
+
+    UINT8 *buf = (UINT8 *)mem_alloc(vol->cluster_size);
+    if (!buf) {
+        fat_entry_set(vol, cl, FAT32_FREE);
+        return 0;
+    }
+    struct fat32_dir_entry *de = (struct fat32_dir_entry *)buf;
+    dirent_proto(&de[0], ATTR_DIRECTORY, cl, 0);
+    mem_copy(de[0].name, ".          ", 11);
+    /* ".." of a top-level directory points at cluster 0, not the root */
+    dirent_proto(&de[1], ATTR_DIRECTORY,
+                 parent == vol->root_cluster ? 0 : parent, 0);
+    mem_copy(de[1].name, "..         ", 11);
+    int rc = bcache_write(vol->cache, vol_cluster_sector(vol, cl),
+                          vol->sectors_per_cluster, buf);
+    mem_free(buf);
+
+    struct fat32_dir_entry proto;
+    dirent_proto(&proto, ATTR_DIRECTORY, cl, 0);
+    if (rc != 0 || dir_add(vol, parent, name, &proto, NULL) != 0) {
+        fat_entry_set(vol, cl, FAT32_FREE);
+        return 0;
+    }
+    return cl;
+}
+
+int fat32_mkdir(struct fat32_vol *vol, const char *path) {
+    if (!vol || !path || !vol->write_fn) return -1;
+
+    UINT32 cur = vol->root_cluster;
+    const char *p = path;
+    int rc = 0;
+    while (*p == '/') p++;
+    while (*p) {
+        char component[FS_MAX_NAME];
+        int len = 0;
+        while (*p && *p != '/' && len < FS_MAX_NAME - 1)
+            component[len++] = *p++;
+        component[len] = '\0';
+        while (*p == '/') p++;
+
+        struct fat_entry_info info;
+        if (dir_lookup(vol, cur, component, &info) == 0) {
+            if (!(info.de.attr & ATTR_DIRECTORY)) { rc = -1; break; }
+            cur = entry_cluster(&info.de);
+            if (cur == 0) cur = vol->root_cluster;
+            continue;
+        }
+        if (!name_valid(component)) { rc = -1; break; }
+        cur = dir_create(vol, cur, component);
+        if (cur == 0) { rc = -1; break; }
+    }
+
+    if (vol_sync(vol) != 0) rc = -1;
+    return rc;
+}
+
+int fat32_rename(struct fat32_vol *vol, const char *path, const char *new_name) {
+    if (!vol || !path || !new_name || !vol->write_fn) return -1;
+    if (!name_valid(new_name)) return -1;
+
+    struct fat_entry_info info;
+    char old_name[FS_MAX_NAME];
+    UINT32 parent = path_resolve_parent(vol, path, old_name, FS_MAX_NAME);
+    if (parent == 0 || dir_lookup(vol, parent, old_name, &info) != 0)
+        return -1;
+
+    /* The new name may only match the entry itself (a case change) */
+    struct fat_entry_info conflict;
+    if (dir_lookup(vol, parent, new_name, &conflict) == 0 &&
+        (conflict.sfn.cluster != info.sfn.cluster ||
+         conflict.sfn.index != info.sfn.index))
+        return -1;
+
+    /* New set first, so a failure leaves the old name in place */
+    struct fat32_dir_entry proto;
+    mem_copy(&proto, &info.de, sizeof(proto));
+    if (dir_add(vol, parent, new_name, &proto, NULL) != 0 ||
+        dir_remove_set(vol, &info) != 0) {
+        vol_sync(vol);
+        return -1;
+    }
+    return vol_sync(vol);
+}
+
+int fat32_delete(struct fat32_vol *vol, const char *path) {
+    if (!vol || !path || !vol->write_fn) return -1;
+
+    struct fat_entry_info info;
+    if (path_resolve(vol, path, &info) != 0) return -1;
+    if (info.nentries == 0) return -1;          /* the root */
+
+    if (info.de.attr & ATTR_DIRECTORY) {
+        struct fat_entry_info child;
+        struct fat_dir_iter it;
+        dir_iter_init(&it, vol, entry_cluster(&info.de));
+        if (dir_read_set(&it, &child) != 1) return -1;   /* not empty */
+    }
+
+    int rc = file_remove(vol, &info);
+    if (vol_sync(vol) != 0) rc = -1;
+    return rc;
+}
+
+int fat32_volume_info(struct fat32_vol *vol, UINT64 *total_bytes,
+                      UINT64 *free_bytes) {
+    if (!vol) return -1;
+    if (total_bytes)
+        *total_bytes = (UINT64)vol->cluster_count * vol->cluster_size;
+    if (free_bytes) {
+        if (fat_count_free(vol) != 0) return -1;
+        *free_bytes = (UINT64)vol->free_clusters * vol->cluster_size;
+    }
+    return 0;
+}
+
+int fat32_used_runs(struct fat32_vol *vol, fs_run_fn fn, void *ctx) {
+    struct used_runs u;
+    if (!vol || used_runs_init(&u, fn, ctx, vol->bytes_per_sector,
+                               vol->dev_block_size, vol->data_start,
+                               vol->sectors_per_cluster) != 0)
+        return -1;
+
+    /* Reserved area (boot sector, FSInfo, the backups) and the FATs */
+    if (used_runs_sectors(&u, 0, vol->data_start)) return -1;
+
+    UINT32 bps = vol->bytes_per_sector;
+    UINT32 per_sec = bps / 4;
+    UINT32 end = vol->cluster_count + 2;
+    UINT32 nsec = (end + per_sec - 1) / per_sec;
+    UINT32 chunk = vol->max_transfer / bps;
+    if (chunk == 0) chunk = 1;
+    UINT8 *buf = (UINT8 *)mem_alloc((UINTN)chunk * bps);
+    if (!buf) return -1;
+
+    /* Clusters in use, gathered into runs; bad ones are left out */
+    int rc = 0;
+    for (UINT32 s = 0; s < nsec && rc == 0; ) {
+        UINT32 n = (nsec - s < chunk) ? nsec - s : chunk;
+        if (bcache_read(vol->cache, (UINT64)vol->fat_start +
+                        (UINT64)vol->active_fat * vol->fat_sectors + s,
+                        n, buf) != 0) {
+            rc = -1;
+            break;
+        }
+        const UINT32 *e = (const UINT32 *)buf;
+        UINT32 first = s * per_sec;
+        for (UINT32 i = 0; i < n * per_sec && first + i < end; i++) {
+            UINT32 cl = first + i;
+            if (cl < 2) continue;
+            UINT32 v = e[i] & FAT32_ENTRY_MASK;
+            if (used_runs_clusters(&u, cl, 1,
+                                   v != FAT32_FREE && v != FAT32_BAD)) {
+                rc = -1;
+                break;
+            }
+        }
+        s += n;
+    }
+    if (rc == 0 && used_runs_end(&u)) rc = -1;
+    mem_free(buf);
+    return rc;
+}
+
+/* ---- Consistency check (fsck.h) ---- */
+
+#define FAT32_EOC_MIN 0x0FFFFFF8
+
+struct check_state {
+    struct fat32_vol *vol;
+    struct fs_check *c;
+    UINT32 *fat;                /* the active FAT read whole; NULL: through
+                                   the cache */
+};
+
+static UINT32 check_next(struct check_state *s, UINT32 cl) {
+    return s->fat ? s->fat[cl] & FAT32_ENTRY_MASK : fat_entry_get(s->vol, cl);
+}
+
+/* Read the active FAT front to back, max_transfer at a time. Without
+   memory for all of it, chains are followed through the cache. */
+static int check_load_fat(struct check_state *s) {
+    struct fat32_vol *vol = s->vol;
+    UINT32 bps = vol->bytes_per_sector;
+    UINT32 per_sec = bps / 4;
+    UINT32 nsec = (vol->cluster_count + 2 + per_sec - 1) / per_sec;
+    s->fat = (UINT32 *)mem_alloc_raw((UINTN)nsec * bps);
+    if (!s->fat) return 0;
+
+    UINT32 chunk = vol->max_transfer / bps;
+    if (chunk == 0) chunk = 1;
+    for (UINT32 sec = 0; sec < nsec && !s->c->cancel; ) {
+        UINT32 n = (nsec - sec < chunk) ? nsec - sec : chunk;
+        if (bcache_read(vol->cache, (UINT64)vol->fat_start +
+                        (UINT64)vol->active_fat * vol->fat_sectors + sec,
+                        n, (UINT8 *)s->fat + (UINTN)sec * bps) != 0)
+            return -1;
+        sec += n;
+        fsck_progress(s->c, "Reading the FAT", (UINT64)sec * bps,
+                      (UINT64)nsec * bps);
+    }
+    return 0;
+}
+
+/* Claim a chain from first: a file of size bytes, or a directory
+   (is_dir) as far as its chain goes. What is wrong is reported against
+   name in directory dir. Returns the clusters claimed; 0 also when the
+   first was claimed already. */
+static UINT32 check_chain(struct check_state *s, UINT32 dir, const char *name,
+                          UINT32 first, int is_dir, UINT64 size) {
+    struct fat32_vol *vol = s->vol;
+    struct fs_check *c = s->c;
+    UINT64 need = (size + vol->cluster_size - 1) / vol->cluster_size;
+
+    if (first == 0) {
+        if (need || is_dir) {
+            c->bad_chains++;
+            fsck_problem(c, dir, name, is_dir ? "directory has no clusters"
+                                              : "has a size but no clusters");
+        }
+        return 0;
+    }
+    if (!vol_cluster_ok(vol, first)) {
+        c->bad_chains++;
+        fsck_problem(c, dir, name, "starts outside the volume");
+        return 0;
+    }
+
+    UINT32 got = 0, crossed = 0, broken = 0;
+    for (UINT32 cl = first;;) {
+        if (fsck_claim(c, cl - 2)) {
+            crossed = 1;
+            c->cross_links++;
+            break;                      /* shared or looping: stop here */
+        }
+        got++;
+        UINT32 next = check_next(s, cl);
+        if (next >= FAT32_EOC_MIN) break;
+        if (!vol_cluster_ok(vol, next)) {
+            broken = 1;
+            c->bad_chains++;
+            fsck_problem(c, dir, name, next == FAT32_BAD
+                         ? "chain runs into a bad cluster"
+                         : next == FAT32_FREE ? "chain runs into a free cluster"
+                                              : "chain leaves the volume");
+            break;
+        }
+        cl = next;
+    }
+    if (crossed)
+        fsck_problem(c, dir, name, "shares clusters with another file");
+    if (!is_dir && !crossed && !broken && got != need) {
+        c->size_mismatch++;
+        fsck_problem(c, dir, name, got > need ? "chain is longer than the file"
+                                              : "chain is shorter than the file");
+    }
+    return (crossed && got == 0) ? 0 : got;
+}
+
+/* Long-name entries [from, from+count) that lead to no short entry */
+static void check_orphans(struct check_state *s, UINT32 dir,
+                          struct fat_dir_pos from, UINT32 count) {
+    struct fs_check *c = s->c;
+    c->bad_sets++;
+    c->repaired++;
+    fsck_problem(c, dir, "(long name)", "belongs to no file");
+    if (!c->repair) return;
+
+    struct fat_dir_iter it;
+    dir_iter_init(&it, s->vol, from.cluster);
+    it.pos = from;
+    for (UINT32 i = 0; i < count; i++) {
+        struct fat32_dir_entry *de = dir_iter_get(&it);
+        if (!de) break;
+        de->name[0] = DIRENT_FREE;
+        dir_iter_mark_dirty(&it);
+        if (dir_iter_next(&it) != 0) break;
+    }
+}
+
+/* Visit queued directory di: claim its chain, check its entries.
+   Returns -1 when out of memory. */
+static int check_dir(struct check_state *s, UINT32 di) {
+    struct fat32_vol *vol = s->vol;
+    struct fs_check *c = s->c;
+    struct fsck_dir d = c->dir[di];     /* c->dir moves as it grows */
+    int root = d.parent == FSCK_ROOT;
+    UINT32 parent = d.parent;
+    const char *dname = root ? NULL : c->pool + d.name;
+    if (check_chain(s, parent, dname, d.cluster, 1, 0) == 0) return 0;
+
+    UINT16 lfn[LFN_MAX_ENTRIES * LFN_CHARS + 1];
+    UINT32 run = 0;                     /* long-name entries pending */
+    int lfn_total = 0, lfn_next = 0;
+    UINT8 lfn_sum = 0;
+    struct fat_dir_pos lfn_start = { 0, 0 };
+
+    struct fat_dir_iter it;
+    dir_iter_init(&it, vol, d.cluster);
+    for (;;) {
+        struct fat32_dir_entry *de = dir_iter_get(&it);
+        if (!de) {
+            fsck_problem(c, parent, dname, "directory cannot be read");
+            break;
+        }
+        UINT8 first = de->name[0];
+        if (first == DIRENT_END) break;
+
+        if (first == DIRENT_FREE) {
+            if (run) check_orphans(s, di, lfn_start, run);
+            run = 0;
+            lfn_total = 0;
+        } else if ((de->attr & 0x3F) == ATTR_LFN) {
+            const UINT8 *raw = (const UINT8 *)de;
+            int seq = first & 0x1F;
+            if (first & LFN_LAST) {
+                if (run) check_orphans(s, di, lfn_start, run);
+                run = 0;
+                lfn_total = (seq >= 1 && seq <= LFN_MAX_ENTRIES) ? seq : 0;
+                lfn_next = lfn_total;
+                lfn_sum = raw[13];
+                lfn_start = it.pos;
+                mem_set(lfn, 0, sizeof(lfn));
+            }
+            if (!run && !(first & LFN_LAST)) lfn_start = it.pos;
+            run++;
+            if (lfn_total && seq == lfn_next && raw[13] == lfn_sum) {
+                for (int k = 0; k < LFN_CHARS; k++) {
+                    const UINT8 *p = raw + s_lfn_off[k];
+                    lfn[(seq - 1) * LFN_CHARS + k] = (UINT16)(p[0] | (p[1] << 8));
+                }
+                lfn_next--;
+            } else {
+                lfn_total = 0;          /* the run is an orphan now */
+            }
+        } else if ((de->attr & ATTR_VOLUME_ID) || first == '.') {
+            if (run) check_orphans(s, di, lfn_start, run);
+            run = 0;
+            lfn_total = 0;
+        } else {
+            struct fat32_dir_entry e = *de;
+            char name[FS_MAX_NAME];
+            if (run && lfn_total && lfn_next == 0 &&
+                lfn_sum == lfn_checksum(e.name)) {
+                int n = 0;
+                for (int k = 0; k < lfn_total * LFN_CHARS && n < FS_MAX_NAME - 1; k++) {
+                    UINT16 ch = lfn[k];
+                    if (ch == 0x0000 || ch == 0xFFFF) break;
+                    name[n++] = (ch < 0x80) ? (char)ch : '?';
+                }
+                name[n] = '\0';
+            } else {
+                if (run) check_orphans(s, di, lfn_start, run);
+                sfn_to_ascii(&e, name, 1);
+            }
+            run = 0;
+            lfn_total = 0;
+
+            if (e.attr & ATTR_DIRECTORY) {
+                c->dirs++;
+                if (entry_cluster(&e) == 0) {
+                    c->bad_chains++;
+                    fsck_problem(c, di, name, "directory has no clusters");
+                } else if (fsck_dir_add(c, di, name, entry_cluster(&e), 0, 0)
+                           == FSCK_ROOT) {
+                    return -1;
+                }
+            } else {
+                c->files++;
+                check_chain(s, di, name, entry_cluster(&e), 0, e.file_size);
+            }
+        }
+
+        int r = dir_iter_next(&it);
+        if (r < 0) fsck_problem(c, parent, dname, "directory chain loops");
+        if (r != 0) break;
+    }
+    if (run) check_orphans(s, di, lfn_start, run);
+    return 0;
+}
+
+/* Allocated clusters the tree never claimed, counted in chains: a lost
+   cluster no other lost cluster points to starts one. Repair frees
+   them. Returns the free clusters there were, or -1 on a write error
+   or without memory. */
+static INT64 check_lost(struct check_state *s) {
+    struct fat32_vol *vol = s->vol;
+    struct fs_check *c = s->c;
+    UINT32 end = vol->cluster_count + 2;
+    UINT8 *pointed = (UINT8 *)mem_alloc((UINTN)c->clusters / 8 + 1);
+    if (!pointed) return -1;
+
+    UINT64 nfree = 0;
+    for (UINT32 cl = 2; cl < end; cl++) {
+        UINT32 v = check_next(s, cl);
+        if (v == FAT32_FREE) {
+            nfree++;
+        } else if (v != FAT32_BAD && !fsck_claimed(c, cl - 2)) {
+            c->lost_clusters++;
+            if (vol_cluster_ok(vol, v) && !fsck_claimed(c, v - 2))
+                pointed[(v - 2) >> 3] |= (UINT8)(1 << ((v - 2) & 7));
+        }
+    }
+
+    UINT64 heads = 0;
+    for (UINT32 cl = 2; cl < end && c->lost_clusters; cl++) {
+        UINT32 v = check_next(s, cl);
+        if (v == FAT32_FREE || v == FAT32_BAD || fsck_claimed(c, cl - 2))
+            continue;
+        if (!((pointed[(cl - 2) >> 3] >> ((cl - 2) & 7)) & 1)) {
+            heads++;
+            if (heads <= 16) {
+                char what[80];
+                snprintf(what, sizeof(what), "chain at cluster %u belongs to no file", cl);
+                fsck_problem(c, FSCK_ROOT, "(lost)", what);
+            }
+        }
+        if (c->repair && fat_entry_set(vol, cl, FAT32_FREE) != 0) {
+            mem_free(pointed);
+            return -1;
+        }
+    }
+    mem_free(pointed);
+    if (c->lost_clusters && heads == 0) heads = 1;  /* lost ones in a loop */
+    c->lost_chains = heads;
+    c->repaired += heads;
+    return (INT64)nfree;
+}
+
+int fat32_check(struct fat32_vol *vol, struct fs_check *c) {
+    if (!vol || !c) return -1;
+    if (c->repair && !vol->write_fn) c->repair = 0;
+    if (fsck_begin(c, vol->cluster_count, vol->cluster_size) != 0) return -1;
+
+    struct check_state s;
+    s.vol = vol;
+    s.c = c;
+    s.fat = NULL;
+    int rc = -1;
+    if (check_load_fat(&s) != 0) {
+        c->io_error = 1;
+        goto out;
+    }
+
+    if (fsck_dir_add(c, FSCK_ROOT, "", vol->root_cluster, 0, 0) == FSCK_ROOT)
+        goto out;
+    UINT32 first, end, done = 0;
+    while (!c->cancel && fsck_next_level(c, &first, &end)) {
+        for (UINT32 i = first; i < end && !c->cancel; i++) {
+            if (check_dir(&s, i) != 0) goto out;
+            fsck_progress(c, "Directories", ++done, c->dir_count);
+        }
+    }
+    if (c->cancel) goto out;
+
+    INT64 nfree = check_lost(&s);
+    if (nfree < 0) {
+        c->io_error = 1;
+        goto out;
+    }
+
+    /* The free count FSInfo keeps */
+    struct fat32_fsinfo *fsi = vol->fsinfo_sector
+        ? (struct fat32_fsinfo *)bcache_get(vol->cache, vol->fsinfo_sector) : NULL;
+    if (fsi && fsi->free_count != 0xFFFFFFFF && fsi->free_count != (UINT32)nfree) {
+        c->free_count++;
+        c->repaired++;
+        fsck_problem(c, FSCK_ROOT, "(FSInfo)", "free cluster count is wrong");
+    }
+    rc = 0;
+    if (c->repair) {
+        vol->free_clusters = (UINT32)(nfree + c->lost_clusters);
+        vol->free_valid = 1;
+        vol->fsinfo_dirty = 1;
+        if (vol_sync(vol) != 0) {
+            c->io_error = 1;
+            rc = -1;
+        }
+    }
+
+out:
+    if (s.fat) mem_free(s.fat);
+    fsck_end(c);
+    return rc;
+}
+
+UINT64 fat32_file_size(struct fat32_vol *vol, const char *path) {
+    struct fat_entry_info info;
+    if (!vol || !path || path_resolve(vol, path, &info) != 0) return 0;
+    if (info.de.attr & ATTR_DIRECTORY) return 0;
+    return info.de.file_size;
+}
+
+int fat32_exists(struct fat32_vol *vol, const char *path) {
+    struct fat_entry_info info;
+    if (!vol || !path) return 0;
+    return path_resolve(vol, path, &info) == 0 ? 1 : 0;
+}
+
+const char *fat32_get_label(struct fat32_vol *vol) {
+    return vol ? vol->label : "";
+}
+
+/* ---- Streaming file handles ---- */
+
+struct fat32_file *fat32_open(struct fat32_vol *vol, const char *path,
+                              UINT64 *out_size) {
+    if (!vol || !path) return NULL;
+
+    struct fat_entry_info info;
+    if (path_resolve(vol, path, &info) != 0) return NULL;
+    if (info.de.attr & ATTR_DIRECTORY) return NULL;
+
+    struct fat32_file *f = (struct fat32_file *)mem_alloc(sizeof(*f));
+    if (!f) return NULL;
+    f->vol = vol;
+    f->size = info.de.file_size;
+    f->first_cluster = entry_cluster(&info.de);
+    if (out_size) *out_size = f->size;
+    return f;
+}
+
+struct fat32_file *fat32_create(struct fat32_vol *vol, const char *path) {
+    if (!vol || !path || !vol->write_fn) return NULL;
+
+    char name[FS_MAX_NAME];
+    UINT32 parent = path_resolve_parent(vol, path, name, FS_MAX_NAME);
+    if (parent == 0 || !name_valid(name)) return NULL;
+
+    struct fat_entry_info existing;
+    if (dir_lookup(vol, parent, name, &existing) == 0) {
+        if (existing.de.attr & ATTR_DIRECTORY) return NULL;
+        if (file_remove(vol, &existing) != 0) return NULL;
+    }
+
+    struct fat32_file *f = (struct fat32_file *)mem_alloc(sizeof(*f));
+    if (!f) return NULL;
+
+    /* Write buffer: whole clusters, about max_transfer bytes */
+    UINT32 clsz = vol->cluster_size;
+    f->wcap = (vol->max_transfer / clsz) * clsz;
+    if (f->wcap == 0) f->wcap = clsz;
+    f->wbuf = (UINT8 *)mem_alloc(f->wcap);
+    if (!f->wbuf) {
+        mem_free(f);
+        return NULL;
+    }
+
+    /* Publish an empty entry now; close fills in cluster and size */
+    struct fat32_dir_entry proto;
+    dirent_proto(&proto, ATTR_ARCHIVE, 0, 0);
+    if (dir_add(vol, parent, name, &proto, &f->sfn) != 0) {
+        mem_free(f->wbuf);
+        mem_free(f);
+        vol_sync(vol);
+        return NULL;
+    }
+
+    f->vol = vol;
+    f->writable = 1;
+    return f;
+}
+
+int fat32_read(struct fat32_file *f, void *buf, UINTN *size) {
+    if (!f || !size || f->writable) return -1;
+
+    UINTN want = *size;
+    if (f->pos >= f->size) want = 0;
+    else if ((UINT64)want > f->size - f->pos) want = (UINTN)(f->size - f->pos);
+
+    *size = 0;
+    if (want == 0) return 0;
+    if (file_read_at(f, f->pos, (UINT8 *)buf, want) != 0) return -1;
+    f->pos += want;
+    *size = want;
+    return 0;
+}
+
+/*
+ * Write out the pending buffer. Extents are allocated right after the
+ * file's last cluster when possible, so a streamed file stays one run.
+ * On the final flush the tail of the last cluster is zeroed.
+ */
+static int file_flush_wbuf(struct fat32_file *f) {
+    struct fat32_vol *vol = f->vol;
+    UINT32 clsz = vol->cluster_size;
+    UINT32 nclusters = (f->wlen + clsz - 1) / clsz;
+
+    if (nclusters == 0) return 0;
+    if (f->wlen < nclusters * clsz)
+        mem_set(f->wbuf + f->wlen, 0, nclusters * clsz - f->wlen);
+
+    UINT8 *src = f->wbuf;
+    while (nclusters > 0) {
+        UINT32 hint = f->last_cluster ? f->last_cluster + 1 : 0;
+        UINT32 got;
+        UINT32 cl = chain_alloc_extent(vol, hint, nclusters, &got);
+        if (cl == 0) return -1;
+        if (f->first_cluster == 0)
+            f->first_cluster = cl;
+        else if (fat_entry_set(vol, f->last_cluster, cl) != 0)
+            return -1;
+        f->last_cluster = cl + got - 1;
+
+        if (bcache_write(vol->cache, vol_cluster_sector(vol, cl),
+                         got * vol->sectors_per_cluster, src) != 0)
+            return -1;
+        src += (UINT64)got * clsz;
+        nclusters -= got;
+    }
+
+    f->wlen = 0;
+    return 0;
+}
+
+int fat32_write(struct fat32_file *f, const void *buf, UINTN size) {
+    if (!f || !f->writable) return -1;
+    if (f->size + size > FAT32_MAX_FILE_SIZE) return -1;
+
+    const UINT8 *src = (const UINT8 *)buf;
+    while (size > 0) {
+        UINT32 n = f->wcap - f->wlen;
+        if ((UINTN)n > size) n = (UINT32)size;
+        mem_copy(f->wbuf + f->wlen, src, n);
+        f->wlen += n;
+        src += n;
+        size -= n;
+        f->size += n;
+        f->pos += n;
+
+        if (f->wlen == f->wcap && file_flush_wbuf(f) != 0) return -1;
+    }
+    return 0;
+}
+
+int fat32_seek(struct fat32_file *f, UINT64 pos) {
+    if (!f) return -1;
+    if (f->writable) return (pos == f->pos) ? 0 : -1;  /* append-only */
+    f->pos = (pos > f->size) ? f->size : pos;
+    return 0;
+}
+
+int fat32_close(struct fat32_file *f) {
+    if (!f) return -1;
+
+    int rc = 0;
+    if (f->writable) {
+        struct fat32_vol *vol = f->vol;
+        if (file_flush_wbuf(f) != 0) rc = -1;
+
+        /* Fill in the short entry with the final cluster and size */
+        struct fat_dir_iter it;
+        dir_iter_init(&it, vol, f->sfn.cluster);
+        it.pos = f->sfn;
+        struct fat32_dir_entry *de = dir_iter_get(&it);
+        if (de) {
+            entry_set_cluster(de, f->first_cluster);
+            de->file_size = (UINT32)f->size;
+            dir_iter_mark_dirty(&it);
+        } else {
+            rc = -1;
+        }
+        if (vol_sync(vol) != 0) rc = -1;
+        mem_free(f->wbuf);
+    }
+
+    run_map_free(&f->map);
+    mem_free(f);
+    return rc;
+}
+
+/* ---- Extent map ---- */
+
+int fat32_extents(struct fat32_vol *vol, const char *path,
+                  struct fs_extent *out, int max) {
+    if (!vol || !path || !out || max <= 0) return -1;
+
+    struct fat_entry_info info;
+    if (path_resolve(vol, path, &info) != 0) return -1;
+    if (info.de.attr & ATTR_DIRECTORY) return -1;
+
+    UINT64 size = info.de.file_size;
+    UINT32 cluster = entry_cluster(&info.de);
+    UINT64 offset = 0;
+    int n = 0;
+
+    while (offset < size) {
+        if (!vol_cluster_ok(vol, cluster)) return -1;
+        UINT64 len = size - offset;
+        if (len > vol->cluster_size) len = vol->cluster_size;
+        UINT64 pos = vol_cluster_sector(vol, cluster) * vol->bytes_per_sector;
+
+        if (n > 0 && out[n - 1].pos + out[n - 1].length == pos) {
+            out[n - 1].length += len;
+        } else {
+            if (n == max) return -1;
+            out[n].offset = offset;
+            out[n].pos = pos;
+            out[n].length = len;
+            n++;
+        }
+
+        offset += len;
+        cluster = fat_entry_get(vol, cluster);
+    }
+    return n;
+}
+
+/* ---- Relocation ---- */
+
+int fat32_relocate(struct fat32_vol *vol, const char *path,
+                   const struct fs_mover *m) {
+    if (!vol || !path || !m || !vol->write_fn) return -1;
+
+    struct fat_entry_info info;
+    if (path_resolve(vol, path, &info) != 0) return -1;
+    UINT32 old = entry_cluster(&info.de);
+    if ((info.de.attr & ATTR_DIRECTORY) || !vol_cluster_ok(vol, old))
+        return 1;
+    UINT32 n = (UINT32)(((UINT64)info.de.file_size + vol->cluster_size - 1) /
+                        vol->cluster_size);
+    if (n == 0) return 1;
+    if (n > vol->cluster_count) return -1;
+
+    UINT32 breaks = 0, cl = old;
+    for (UINT32 i = 0; i < n; i++) {
+        if (!vol_cluster_ok(vol, cl)) return -1;
+        UINT32 next = fat_entry_get(vol, cl);
+        if (i + 1 < n && next != cl + 1) breaks++;
+        cl = next;
+    }
+    if (breaks == 0) return 1;
+
+    UINT32 got;
+    UINT32 dst = chain_alloc_extent(vol, 0, n, &got);
+    if (got < n) {
+        if (dst) chain_free(vol, dst);
+        return 1;
+    }
+
+    /* The new chain is on disk before anything points at it; this also
+       writes out cached data sectors, so the device holds all of the file */
+    UINT32 per = vol->bytes_per_sector / vol->dev_block_size;
+    UINT64 spc = vol->sectors_per_cluster;
+    if (vol_sync(vol) != 0 || m->barrier(m->ctx) != 0) goto undo;
+
+    cl = old;
+    for (UINT32 i = 0; i < n; ) {
+        UINT32 len = 1;
+        while (i + len < n && fat_entry_get(vol, cl + len - 1) == cl + len)
+            len++;
+        if (m->move(m->ctx, vol_cluster_sector(vol, cl) * per,
+                    vol_cluster_sector(vol, dst + i) * per,
+                    len * spc * per) != 0)
+            goto undo;
+        i += len;
+        cl = fat_entry_get(vol, cl + len - 1);
+    }
+    if (m->barrier(m->ctx) != 0) goto undo;
+
+    /* Copies of the run from before are stale now */
+    UINT64 first = vol_cluster_sector(vol, dst);
+    for (UINT64 s = 0; s < n * spc; s++)
+        if (EFI_ERROR(bcache_invalidate(vol->cache, first + s))) goto undo;
+
+    /* Both layouts are whole from here: a failure strands the new chain
+       rather than free it under an entry that may point at it */
+    struct fat_dir_iter it;
+    dir_iter_init(&it, vol, info.sfn.cluster);
+    it.pos = info.sfn;
+    struct fat32_dir_entry *de = dir_iter_get(&it);
+    if (!de) return -1;
+    entry_set_cluster(de, dst);
+    dir_iter_mark_dirty(&it);
+    if (vol_sync(vol) != 0 || m->barrier(m->ctx) != 0) return -1;
+
+    if (chain_free(vol, old) != 0 || vol_sync(vol) != 0 ||
+        m->barrier(m->ctx) != 0)
+        return -1;
+    return 0;
+
+undo:
+    chain_free(vol, dst);
+    vol_sync(vol);
+    return -1;
 }
@@ -1,10 +1,15 @@
 /*
- * fat32.h — FAT32 filesystem creation on block devices
+ * fat32.h — FAT32 filesystem creation and read/write driver
+ *
+ * The formatter works on a disk_device. The volume driver is portable:
+ * it uses callback-based block I/O like the exFAT and NTFS drivers and
+ * has no UEFI dependency.
  */
 #ifndef FAT32_H
 #define FAT32_H
 
 #include "disk.h"
+#include "fs.h"
 
 /* Format a block device as FAT32 with MBR. Returns 0 on success. */
 int fat32_format(struct disk_device *dev);
@@ -15,6 +20,141 @@ int fat32_write_file(struct disk_device *dev, const char *path,
                      void *data, UINT64 size);
 
 /* Create a directory on a FAT32-formatted device. Returns 0 on success. */
-int fat32_mkdir(struct disk_device *dev, const char *path);
+int fat32_dev_mkdir(struct disk_device *dev, const char *path);
+
+/* Progress of fat32_clone_image(): bytes written so far of total */
+typedef void (*fat32_progress_fn)(UINT64 done, UINT64 total);
+
+/* Copy the FAT12/16/32 volume on src block for block to the start of
+   dst, as a superfloppy of the same size. Free clusters are skipped, so
+   only the reserved area, FATs, root directory and data in use are
+   written. progress may be NULL. Returns bytes written, -1 on error. */
+INT64 fat32_clone_image(struct disk_device *src, struct disk_device *dst,
+                        fat32_progress_fn progress);
+
+/* ---- Volume driver ---- */
+
+/* Block I/O callbacks */
+typedef int (*fat32_block_read_fn)(void *ctx, UINT64 lba, UINT32 count, void *buf);
+typedef int (*fat32_block_write_fn)(void *ctx, UINT64 lba, UINT32 count, const void *buf);
+
+/* Opaque volume handle */
+struct fat32_vol;
+
+/* Mount a FAT32 volume. Returns NULL on error. block_size is the
+   underlying device block size (typically 512); write_fn may be NULL
+   for a read-only mount. */
+struct fat32_vol *fat32_mount(fat32_block_read_fn read_fn,
+                              fat32_block_write_fn write_fn,
+                              void *ctx, UINT32 block_size);
+
+/* Cap the size of a single data transfer (default 1 MB).
+   Physically contiguous clusters are merged up to this size. */
+void fat32_set_max_transfer(struct fat32_vol *vol, UINT32 bytes);
+
+/* Write everything back, then free all resources */
+void fat32_unmount(struct fat32_vol *vol);
+
+/* Read directory contents. path is ASCII with '/' separators,
+   "/" for root. Long names are returned where present.
+   Returns entry count, or -1 on error. */
+int fat32_readdir(struct fat32_vol *vol, const char *path,
+                  struct fs_entry *entries, int max_entries);
+
+/* Directory cursor: entries one at a time in on-disk order (unsorted).
+   Close before unmounting. */
+struct fat32_dir;
+
+/* Open a directory. Returns NULL on error. */
+struct fat32_dir *fat32_opendir(struct fat32_vol *vol, const char *path);
+
+/* Next entry: 1 with *out filled, 0 at the end, -1 on error */
+int fat32_readdir_next(struct fat32_dir *d, struct fs_entry *out);
+
+void fat32_closedir(struct fat32_dir *d);
+
+/* Read entire file into newly allocated buffer. Returns NULL on error. */
+void *fat32_readfile(struct fat32_vol *vol, const char *path, UINTN *out_size);
+
+/* Write data to a file (create or replace). Returns 0 on success. */
+int fat32_writefile(struct fat32_vol *vol, const char *path,
+                    const void *data, UINTN size);
+
+/* Create a directory and any missing parents. Returns 0 on success. */
+int fat32_mkdir(struct fat32_vol *vol, const char *path);
+
+/* Rename a file/dir. new_name is just the filename. Returns 0 on success. */
+int fat32_rename(struct fat32_vol *vol, const char *path, const char *new_name);
+
+/* Delete a file or empty directory. Returns 0 on success. */
+int fat32_delete(struct fat32_vol *vol, const char *path);
+
+/* Get volume info. Returns 0 on success. */
+int fat32_volume_info(struct fat32_vol *vol, UINT64 *total_bytes, UINT64 *free_bytes);
+
+/* The blocks the volume uses, in ascending runs: the reserved area and
+   FATs, then every cluster the FAT marks in use (bad ones left out).
+   What a clone of the volume must copy. Returns 0, or -1 on a read
+   error or when fn stops the walk. */
+int fat32_used_runs(struct fat32_vol *vol, fs_run_fn fn, void *ctx);
+
+/* Check the volume's consistency into c, repairing as c->repair says
+   (see fsck.h). Returns 0 when the whole volume was checked, -1 on a
+   read error, without memory or when cancelled. */
+struct fs_check;
+int fat32_check(struct fat32_vol *vol, struct fs_check *c);
+
+/* Get file size. Returns 0 if not found. */
+UINT64 fat32_file_size(struct fat32_vol *vol, const char *path);
+
+/* Check if path exists. Returns 1 if yes. */
+int fat32_exists(struct fat32_vol *vol, const char *path);
+
+/* Get volume label (ASCII). Returns empty string if none. */
+const char *fat32_get_label(struct fat32_vol *vol);
+
+/* ---- Streaming file handles ---- */
+
+/* Opaque open-file handle. Close all handles before unmounting. */
+struct fat32_file;
+
+/* Open a file for reading. Sets *out_size. Returns NULL on error. */
+struct fat32_file *fat32_open(struct fat32_vol *vol, const char *path,
+                              UINT64 *out_size);
+
+/* Create or replace a file for sequential writing. Returns NULL on error. */
+struct fat32_file *fat32_create(struct fat32_vol *vol, const char *path);
+
+/* Read up to *size bytes at the current position; *size is set to the
+   number read (0 at end of file). Returns 0 on success. */
+int fat32_read(struct fat32_file *f, void *buf, UINTN *size);
+
+/* Append size bytes (files are limited to 4 GB - 1). Returns 0 on success. */
+int fat32_write(struct fat32_file *f, const void *buf, UINTN size);
+
+/* Set the position (clamped to the file size). Write handles are
+   append-only and only accept the current position. */
+int fat32_seek(struct fat32_file *f, UINT64 pos);
+
+/* Close; a write handle commits its data and directory entry.
+   Returns 0 on success. */
+int fat32_close(struct fat32_file *f);
+
+/* Where a file's data lies on the volume, one extent per run of
+   consecutive clusters, in file order. Returns the count, or -1 on
+   error or if the file needs more than max. */
+int fat32_extents(struct fat32_vol *vol, const char *path,
+                  struct fs_extent *out, int max);
+
+/* Move the data of the file at path into one run of free clusters,
+   chained in order. The new chain is written to the FAT first, the data
+   copied through m and made durable, the short entry switched to it in
+   one sector write, and only then the old chain freed, so a power cut
+   leaves one layout or the other whole, at worst with a lost chain for
+   the check to find. The file must not be open. Returns 0 when moved,
+   1 when it was one run already or the volume has none that long, -1
+   on error. */
+int fat32_relocate(struct fat32_vol *vol, const char *path,
+                   const struct fs_mover *m);
 
 #endif /* FAT32_H */
@@ -1,31 +1,524 @@
 #include "fb.h"
 #include "font.h"
 #include "mem.h"
+#include "timer.h"
+#include "trace.h"
 
-EFI_STATUS fb_init(void) {
-    EFI_GUID gop_guid = EFI_GRAPHICS_OUTPUT_PROTOCOL_GUID;
-    EFI_STATUS status;
+/*
+ * Drawing goes to a back buffer in cached RAM (s_draw, s_draw_pitch
+ * pixels per row) and reaches the screen in fb_present(), which sends
+ * the dirty rectangles with GOP Blt.  The framebuffer itself is often
+ * uncached or write-combined, so it is written in whole rows and never
+ * read.  Without a back buffer (allocation failed) s_draw is the
+ * framebuffer and presenting is a no-op.  A text grid with no GOP
+ * (fb_init_text()) has no pixels at all: s_draw is NULL and only the
+ * cells are kept, for the mirror hook to show.
+ */
 
-    status = g_boot.bs->LocateProtocol(&gop_guid, NULL, (void **)&g_boot.gop);
-    if (EFI_ERROR(status))
-        return status;
+#define FB_DIRTY_MAX 8
 
-    EFI_GRAPHICS_OUTPUT_PROTOCOL *gop = g_boot.gop;
+/* EFI_GRAPHICS_OUTPUT_BLT_OPERATION */
+#define BLT_BUFFER_TO_VIDEO 2
 
-    /* GOP method casts (protocol stores them as void *) */
-    typedef EFI_STATUS (*GOP_QUERY)(EFI_GRAPHICS_OUTPUT_PROTOCOL *,
-                                    UINT32, UINTN *,
-                                    EFI_GRAPHICS_OUTPUT_MODE_INFORMATION **);
-    typedef EFI_STATUS (*GOP_SET)(EFI_GRAPHICS_OUTPUT_PROTOCOL *, UINT32);
-    GOP_QUERY query_mode = (GOP_QUERY)gop->QueryMode;
-    GOP_SET   set_mode   = (GOP_SET)gop->SetMode;
+typedef EFI_STATUS (*GOP_BLT)(EFI_GRAPHICS_OUTPUT_PROTOCOL *, void *,
+                              UINT32, UINTN, UINTN, UINTN, UINTN,
+                              UINTN, UINTN, UINTN);
+
+struct fb_area {
+    UINT32 x0, y0, x1, y1;      /* half-open */
+};
+
+static UINT32 *s_draw;
+static UINT32  s_draw_pitch;
+static UINT32 *s_back;
+static UINTN   s_back_size;
+static int     s_blt_ok;        /* cleared after the first Blt failure */
+
+static struct fb_area s_dirty[FB_DIRTY_MAX];
+static int s_ndirty;
+
+/*
+ * Text is drawn without per-pixel branches.  Every byte value maps to
+ * its glyph (unprintable ones to '?'), and each colour pair in use gets
+ * a small table that expands a 4-pixel nibble of a font row into its
+ * pixels, doubled at scale 2.  A glyph row is then two table lookups
+ * and 64-bit stores.  fb_string draws a whole run one pixel row at a
+ * time so the stores stay sequential.
+ */
+
+#define FB_PAIRS 4              /* colour pairs kept expanded */
+#define FB_RUN   64             /* glyphs looked up per pass */
+
+struct fb_pair {
+    UINT32 fg, bg;
+    UINT64 px[16][4];           /* nibble -> 4 pixels, or 8 at scale 2 */
+};
+
+static const UINT8 *s_glyph[256];
+static struct fb_pair s_pairs[FB_PAIRS];
+static int s_npairs;
+static int s_last_pair;
+static int s_wide;              /* s_draw rows allow 64-bit stores */
 
-    /* Hard-limit resolution to 800x600 to keep framebuffer draws fast */
-    UINT32 max_w = 800;
-    UINT32 max_h = 600;
+/*
+ * Text is kept as a grid of cells.  fb_char and fb_string only update
+ * the wanted grid; fb_present compares it with the grid of what the
+ * pixels show and draws just the cells that differ, so a screen that
+ * is redrawn with one changed character costs one glyph.  Pixel
+ * operations first draw pending cells, then mark the cells they cover
+ * as unknown in both grids.  Without the grid (allocation failed) text
+ * is drawn immediately.
+ *
+ * The wanted grid is a ring of s_ring rows whose live screen starts at
+ * s_top, so scrolling advances s_top instead of moving pixels, and the
+ * rows above it are scrollback history.  Only if pixels were drawn into
+ * the text area does fb_scroll still move the image.
+ */
+
+#define FB_HISTORY 500          /* scrollback rows kept above the screen */
+
+/* fb_print presents at most once per tick while it is scrolling */
+#define FB_PRINT_TICK 200000    /* 100 ns units: 20 ms */
+#define TIMER_PERIODIC 1
+
+typedef EFI_STATUS (*BS_SET_TIMER)(EFI_EVENT, UINT32, UINT64);
+
+static const struct fb_cell s_blank = { COLOR_BLACK, COLOR_BLACK, ' ' };
+
+static struct fb_cell *s_want;  /* s_ring rows */
+static struct fb_cell *s_shown; /* g_boot.rows rows */
+static UINT8 *s_row_dirty;
+static UINTN  s_grid_size;
+static int    s_grid_dirty;
+static UINT32 s_grid_gen;       /* fb_text_generation() */
+static UINT32 s_ring;
+static UINT32 s_top;            /* ring row shown as screen row 0 */
+static UINT32 s_hist;           /* valid history rows above s_top */
+static UINT32 s_view;           /* rows scrolled back, 0 = live */
+static int    s_pixels;         /* text area has directly drawn pixels */
+static EFI_EVENT s_tick;
+static int    s_hold;           /* fb_print leaves presenting to others */
+static void (*s_present_hook)(void);
+static void (*s_mirror_hook)(void);
+static int    s_margin_ok;      /* margins known to hold s_margin */
+static UINT32 s_margin;
+
+/* Record a changed area. It is merged into an area whose bounding box
+   with it covers nothing extra; when the list is full it joins the one
+   it grows least. */
+static void fb_damage(UINT32 x, UINT32 y, UINT32 w, UINT32 h) {
+    if (!s_back || x >= g_boot.fb_width || y >= g_boot.fb_height)
+        return;
+    if (w > g_boot.fb_width - x) w = g_boot.fb_width - x;
+    if (h > g_boot.fb_height - y) h = g_boot.fb_height - y;
+    if (!w || !h)
+        return;
+    struct fb_area a = { x, y, x + w, y + h };
+
+    int best = -1;
+    UINT64 best_cost = 0;
+    UINT64 a_area = (UINT64)w * h;
+    for (int i = 0; i < s_ndirty; i++) {
+        struct fb_area *d = &s_dirty[i];
+        UINT32 ux0 = a.x0 < d->x0 ? a.x0 : d->x0;
+        UINT32 uy0 = a.y0 < d->y0 ? a.y0 : d->y0;
+        UINT32 ux1 = a.x1 > d->x1 ? a.x1 : d->x1;
+        UINT32 uy1 = a.y1 > d->y1 ? a.y1 : d->y1;
+        UINT64 grow = (UINT64)(ux1 - ux0) * (uy1 - uy0) -
+                      (UINT64)(d->x1 - d->x0) * (d->y1 - d->y0);
+        if (grow <= a_area) {
+            best = i;
+            break;
+        }
+        if (s_ndirty == FB_DIRTY_MAX && (best < 0 || grow < best_cost)) {
+            best = i;
+            best_cost = grow;
+        }
+    }
+
+    if (best < 0) {
+        s_dirty[s_ndirty++] = a;
+        return;
+    }
+    struct fb_area *d = &s_dirty[best];
+    if (a.x0 < d->x0) d->x0 = a.x0;
+    if (a.y0 < d->y0) d->y0 = a.y0;
+    if (a.x1 > d->x1) d->x1 = a.x1;
+    if (a.y1 > d->y1) d->y1 = a.y1;
+}
+
+static void fb_text_init(void) {
+    for (int c = 0; c < 256; c++) {
+        int g = (c >= FONT_FIRST && c <= FONT_LAST) ? c : '?';
+        s_glyph[c] = font_data[g - FONT_FIRST];
+    }
+    s_npairs = 0;
+    s_last_pair = 0;
+    s_wide = !((UINTN)s_draw & 7) && !(s_draw_pitch & 1);
+}
+
+static const struct fb_pair *fb_pair_get(UINT32 fg, UINT32 bg) {
+    struct fb_pair *p = &s_pairs[s_last_pair];
+    if (s_npairs && p->fg == fg && p->bg == bg)
+        return p;
+    for (int i = 0; i < s_npairs; i++) {
+        if (s_pairs[i].fg == fg && s_pairs[i].bg == bg) {
+            s_last_pair = i;
+            return &s_pairs[i];
+        }
+    }
+
+    /* Replace the entry after the last one used */
+    int slot = s_npairs < FB_PAIRS ? s_npairs++ : (s_last_pair + 1) % FB_PAIRS;
+    p = &s_pairs[slot];
+    p->fg = fg;
+    p->bg = bg;
+    UINT32 scale = g_boot.scale;
+    for (int n = 0; n < 16; n++) {
+        UINT32 *px = (UINT32 *)p->px[n];
+        for (int b = 0; b < 4; b++) {
+            UINT32 color = (n & (8 >> b)) ? fg : bg;
+            if (scale == 1) {
+                px[b] = color;
+            } else {
+                px[b * 2] = color;
+                px[b * 2 + 1] = color;
+            }
+        }
+    }
+    s_last_pair = slot;
+    return p;
+}
+
+/* Draw n characters on one text row; the caller has clipped them */
+static void fb_text_run(UINT32 cx, UINT32 cy, const char *s, UINT32 n,
+                        const struct fb_pair *p) {
+    UINT32 scale = g_boot.scale;
+    UINT32 cw = FONT_WIDTH * scale;
+    UINT32 ch = FONT_HEIGHT * scale;
+    UINT32 pitch = s_draw_pitch;
+    fb_damage(cx * cw, cy * ch, n * cw, ch);
+
+    const UINT8 *glyph[FB_RUN];
+    while (n) {
+        UINT32 k = n < FB_RUN ? n : FB_RUN;
+        for (UINT32 i = 0; i < k; i++)
+            glyph[i] = s_glyph[(UINT8)s[i]];
+
+        UINT32 *row = s_draw + (UINTN)cy * ch * pitch + cx * cw;
+        for (UINT32 y = 0; y < FONT_HEIGHT; y++) {
+            UINT32 *dst = row;
+            if (s_wide && scale == 1) {
+                for (UINT32 i = 0; i < k; i++) {
+                    UINT8 bits = glyph[i][y];
+                    const UINT64 *hi = p->px[bits >> 4];
+                    const UINT64 *lo = p->px[bits & 15];
+                    UINT64 *d = (UINT64 *)dst;
+                    d[0] = hi[0];
+                    d[1] = hi[1];
+                    d[2] = lo[0];
+                    d[3] = lo[1];
+                    dst += FONT_WIDTH;
+                }
+            } else if (s_wide) {
+                for (UINT32 i = 0; i < k; i++) {
+                    UINT8 bits = glyph[i][y];
+                    const UINT64 *hi = p->px[bits >> 4];
+                    const UINT64 *lo = p->px[bits & 15];
+                    UINT64 *d = (UINT64 *)dst;
+                    UINT64 *d2 = (UINT64 *)(dst + pitch);
+                    d[0] = d2[0] = hi[0];
+                    d[1] = d2[1] = hi[1];
+                    d[2] = d2[2] = hi[2];
+                    d[3] = d2[3] = hi[3];
+                    d[4] = d2[4] = lo[0];
+                    d[5] = d2[5] = lo[1];
+                    d[6] = d2[6] = lo[2];
+                    d[7] = d2[7] = lo[3];
+                    dst += FONT_WIDTH * 2;
+                }
+            } else {
+                /* Odd pitch: 32-bit stores only */
+                UINT32 half = cw / 2;
+                for (UINT32 i = 0; i < k; i++) {
+                    UINT8 bits = glyph[i][y];
+                    const UINT32 *hi = (const UINT32 *)p->px[bits >> 4];
+                    const UINT32 *lo = (const UINT32 *)p->px[bits & 15];
+                    for (UINT32 x = 0; x < half; x++) {
+                        dst[x] = hi[x];
+                        dst[half + x] = lo[x];
+                    }
+                    if (scale != 1)
+                        for (UINT32 x = 0; x < cw; x++)
+                            dst[pitch + x] = dst[x];
+                    dst += cw;
+                }
+            }
+            row += pitch * scale;
+        }
+        s += k;
+        cx += k;
+        n -= k;
+    }
+}
+
+int fb_cell_eq(const struct fb_cell *a, const struct fb_cell *b) {
+    return a->ch == b->ch && a->fg == b->fg && a->bg == b->bg;
+}
+
+static struct fb_cell *want_row(UINT32 r) {
+    return s_want + (UINTN)((s_top + r) % s_ring) * g_boot.cols;
+}
 
+static void fb_grid_all_dirty(void) {
+    mem_set(s_row_dirty, 1, g_boot.rows);
+    s_grid_dirty = 1;
+    s_grid_gen++;
+}
+
+/* Leave the scrollback view before changing the live screen */
+static void fb_grid_live(void) {
+    if (s_view) {
+        s_view = 0;
+        fb_grid_all_dirty();
+    }
+}
+
+static void fb_grid_init(void) {
+    if (s_want)
+        mem_free_pages(s_want, s_grid_size);
+    UINTN cols = g_boot.cols, rows = g_boot.rows;
+    s_want = NULL;
+    s_grid_dirty = 0;
+    s_margin_ok = 0;
+    s_top = s_hist = s_view = 0;
+    s_pixels = 0;
+    if (!cols || !rows)
+        return;
+
+    /* Without room for history, keep just the screen */
+    for (UINT32 hist = FB_HISTORY; ; hist = 0) {
+        s_ring = (UINT32)rows + hist;
+        s_grid_size = ((UINTN)s_ring + rows) * cols * sizeof(struct fb_cell)
+                      + rows;
+        s_want = (struct fb_cell *)mem_alloc_pages(s_grid_size);
+        if (s_want || !hist)
+            break;
+    }
+    if (!s_want)
+        return;
+    s_shown = s_want + (UINTN)s_ring * cols;
+    s_row_dirty = (UINT8 *)(s_shown + rows * cols);
+    /* Nothing is known about the pixels yet */
+    mem_set(s_want, 0, s_grid_size);
+}
+
+/* Store text in the wanted grid. Unprintable bytes become '?' and
+   blanks ignore fg, so cells that look alike compare equal. */
+static void fb_grid_put(UINT32 cx, UINT32 cy, const char *s, UINT32 n,
+                        UINT32 fg, UINT32 bg) {
+    fb_grid_live();
+    struct fb_cell *w = want_row(cy) + cx;
+    for (UINT32 i = 0; i < n; i++) {
+        UINT32 ch = (UINT8)s[i];
+        if (ch < FONT_FIRST || ch > FONT_LAST)
+            ch = '?';
+        w[i].fg = ch == ' ' ? bg : fg;
+        w[i].bg = bg;
+        w[i].ch = ch;
+    }
+    s_row_dirty[cy] = 1;
+    s_grid_dirty = 1;
+    s_grid_gen++;
+}
+
+/* What a wanted cell should look like, or NULL to leave its pixels */
+static const struct fb_cell *fb_cell_look(const struct fb_cell *w) {
+    if (w->ch)
+        return w;
+    /* Cells left unknown by an earlier image show as blanks in the
+       history */
+    return s_view ? &s_blank : NULL;
+}
+
+/* Draw every cell whose wanted content differs from what is shown */
+static void fb_grid_flush(void) {
+    if (!s_grid_dirty)
+        return;
+    s_grid_dirty = 0;
+
+    UINT32 cols = g_boot.cols;
+    UINT32 first = s_top + s_ring - s_view;
+    char text[FB_RUN];
+    for (UINT32 r = 0; r < g_boot.rows; r++) {
+        if (!s_row_dirty[r])
+            continue;
+        s_row_dirty[r] = 0;
+        struct fb_cell *w = s_want + (UINTN)((first + r) % s_ring) * cols;
+        struct fb_cell *sh = s_shown + (UINTN)r * cols;
+        UINT32 c = 0;
+        while (c < cols) {
+            const struct fb_cell *a = fb_cell_look(&w[c]);
+            if (!a || fb_cell_eq(a, &sh[c])) {
+                c++;
+                continue;
+            }
+            /* Run of changed cells sharing one colour pair */
+            UINT32 fg = a->fg, bg = a->bg, n = 0;
+            while (c + n < cols && n < FB_RUN) {
+                const struct fb_cell *b = fb_cell_look(&w[c + n]);
+                if (!b || b->fg != fg || b->bg != bg || fb_cell_eq(b, &sh[c + n]))
+                    break;
+                text[n] = (char)b->ch;
+                sh[c + n] = *b;
+                n++;
+            }
+            if (s_draw)
+                fb_text_run(c, r, text, n, fb_pair_get(fg, bg));
+            c += n;
+        }
+    }
+}
+
+/* Pixels in the area were drawn directly; forget their cells */
+static void fb_grid_forget(UINT32 x, UINT32 y, UINT32 w, UINT32 h) {
+    if (!s_want || !w || !h)
+        return;
+    UINT32 cw = FONT_WIDTH * g_boot.scale;
+    UINT32 ch = FONT_HEIGHT * g_boot.scale;
+    if ((UINT64)x + w > g_boot.cols * cw || (UINT64)y + h > g_boot.rows * ch)
+        s_margin_ok = 0;
+    UINT32 c0 = x / cw, r0 = y / ch;
+    UINT32 c1 = (UINT32)(((UINT64)x + w + cw - 1) / cw);
+    UINT32 r1 = (UINT32)(((UINT64)y + h + ch - 1) / ch);
+    if (c1 > g_boot.cols) c1 = g_boot.cols;
+    if (r1 > g_boot.rows) r1 = g_boot.rows;
+    s_grid_gen++;
+    for (UINT32 r = r0; r < r1; r++) {
+        struct fb_cell *wr = want_row(r);
+        struct fb_cell *sr = s_shown + (UINTN)r * g_boot.cols;
+        for (UINT32 c = c0; c < c1; c++) {
+            mem_set(&wr[c], 0, sizeof(struct fb_cell));
+            mem_set(&sr[c], 0, sizeof(struct fb_cell));
+            s_pixels = 1;
+        }
+    }
+}
+
+int fb_scrollback(int delta) {
+    /* Pixels drawn outside the grid could not be restored afterwards */
+    if (!s_want || s_pixels)
+        return 0;
+    INT64 v = (INT64)s_view + delta;
+    if (v < 0) v = 0;
+    if (v > (INT64)s_hist) v = s_hist;
+    if ((UINT32)v != s_view) {
+        s_view = (UINT32)v;
+        fb_grid_all_dirty();
+    }
+    return (int)s_view;
+}
+
+void fb_present(void) {
+    if (s_present_hook)
+        s_present_hook();
+    if (s_want)
+        fb_grid_flush();
+    if (s_mirror_hook)
+        s_mirror_hook();
+    if (!s_back || !s_ndirty)
+        return;
+
+    TRACE_BEGIN(TR_PRESENT, s_ndirty, 0);
+    GOP_BLT blt = (GOP_BLT)g_boot.gop->Blt;
+    UINT32 *fb = (UINT32 *)(UINTN)g_boot.gop->Mode->FrameBufferBase;
+    for (int i = 0; i < s_ndirty; i++) {
+        struct fb_area *d = &s_dirty[i];
+        UINT32 w = d->x1 - d->x0, h = d->y1 - d->y0;
+        if (s_blt_ok &&
+            !EFI_ERROR(blt(g_boot.gop, s_back, BLT_BUFFER_TO_VIDEO,
+                           d->x0, d->y0, d->x0, d->y0, w, h,
+                           (UINTN)s_draw_pitch * sizeof(UINT32))))
+            continue;
+        s_blt_ok = 0;
+        if (!fb)
+            continue;
+        /* Firmware without a working Blt: stream whole rows */
+        for (UINT32 y = d->y0; y < d->y1; y++)
+            mem_copy(&fb[(UINTN)y * g_boot.fb_pitch + d->x0],
+                     &s_back[(UINTN)y * s_draw_pitch + d->x0],
+                     (UINTN)w * sizeof(UINT32));
+    }
+    TRACE_END(TR_PRESENT, s_ndirty, 0);
+    s_ndirty = 0;
+}
+
+/* ---- Mode selection ----
+ *
+ * Picking a mode queries every one the GOP offers, which some ARM
+ * firmware answers slowly (each query can probe the panel). The mode
+ * picked is remembered in a non-volatile variable with MaxMode and its
+ * resolution; while those still match, the next boot queries that mode
+ * alone. The variable is only rewritten when the choice changes.
+ */
+
+/* GOP method casts (protocol stores them as void *) */
+typedef EFI_STATUS (*GOP_QUERY)(EFI_GRAPHICS_OUTPUT_PROTOCOL *,
+                                UINT32, UINTN *,
+                                EFI_GRAPHICS_OUTPUT_MODE_INFORMATION **);
+typedef EFI_STATUS (*GOP_SET)(EFI_GRAPHICS_OUTPUT_PROTOCOL *, UINT32);
+typedef EFI_STATUS (*RT_GET_VARIABLE)(CHAR16 *, EFI_GUID *, UINT32 *,
+                                      UINTN *, void *);
+typedef EFI_STATUS (*RT_SET_VARIABLE)(CHAR16 *, EFI_GUID *, UINT32,
+                                      UINTN, void *);
+
+/* Cap the mode: text lines are drawn into 256-byte buffers */
+#define FB_MAX_W 1280
+#define FB_MAX_H 1024
+
+#define FB_MODE_VAR   L"SurvivalGopMode"
+#define FB_MODE_GUID  { 0x5f1b7c2e, 0x93a4, 0x4d61, \
+                        { 0x8e, 0x2f, 0x6b, 0x1d, 0x0a, 0x47, 0xc3, 0x95 } }
+#define FB_VAR_ATTRS  0x3   /* NON_VOLATILE | BOOTSERVICE_ACCESS */
+
+struct fb_mode_cache {
+    UINT32 max_mode;
+    UINT32 mode;
+    UINT32 width, height;
+};
+
+static int s_mode_cached;      /* this boot's mode came from the variable */
+
+/* The remembered mode, if the GOP still offers it unchanged */
+static int mode_from_cache(EFI_GRAPHICS_OUTPUT_PROTOCOL *gop,
+                           struct fb_mode_cache *c) {
+    EFI_GUID guid = FB_MODE_GUID;
+    RT_GET_VARIABLE get_var = (RT_GET_VARIABLE)g_boot.rs->GetVariable;
+    UINTN size = sizeof(*c);
+    UINT32 attrs;
+    if (EFI_ERROR(get_var(FB_MODE_VAR, &guid, &attrs, &size, c)) ||
+        size != sizeof(*c) || c->max_mode != gop->Mode->MaxMode ||
+        c->mode >= gop->Mode->MaxMode)
+        return -1;
+
+    EFI_GRAPHICS_OUTPUT_MODE_INFORMATION *info;
+    UINTN info_size;
+    if (EFI_ERROR(((GOP_QUERY)gop->QueryMode)(gop, c->mode, &info_size, &info)))
+        return -1;
+    if (info->HorizontalResolution != c->width ||
+        info->VerticalResolution != c->height)
+        return -1;
+    return 0;
+}
+
+/* The largest mode within FB_MAX_W x FB_MAX_H */
+static UINT32 mode_search(EFI_GRAPHICS_OUTPUT_PROTOCOL *gop,
+                          UINT32 *width, UINT32 *height) {
+    GOP_QUERY query_mode = (GOP_QUERY)gop->QueryMode;
     UINT32 best_mode = gop->Mode->Mode;
     UINT32 best_pixels = 0;
+    *width = gop->Mode->Info->HorizontalResolution;
+    *height = gop->Mode->Info->VerticalResolution;
 
     for (UINT32 m = 0; m < gop->Mode->MaxMode; m++) {
         EFI_GRAPHICS_OUTPUT_MODE_INFORMATION *info;
@@ -34,14 +527,51 @@ EFI_STATUS fb_init(void) {
             continue;
         UINT32 w = info->HorizontalResolution;
         UINT32 h = info->VerticalResolution;
-        if (w <= max_w && h <= max_h && w * h > best_pixels) {
+        if (w <= FB_MAX_W && h <= FB_MAX_H && w * h > best_pixels) {
             best_pixels = w * h;
             best_mode = m;
+            *width = w;
+            *height = h;
         }
     }
+    return best_mode;
+}
+
+static void mode_select(EFI_GRAPHICS_OUTPUT_PROTOCOL *gop) {
+    struct fb_mode_cache c;
+    s_mode_cached = mode_from_cache(gop, &c) == 0;
+    if (!s_mode_cached) {
+        c.max_mode = gop->Mode->MaxMode;
+        c.mode = mode_search(gop, &c.width, &c.height);
+        EFI_GUID guid = FB_MODE_GUID;
+        ((RT_SET_VARIABLE)g_boot.rs->SetVariable)(FB_MODE_VAR, &guid,
+                                                  FB_VAR_ATTRS, sizeof(c), &c);
+    }
+    if (c.mode != gop->Mode->Mode)
+        ((GOP_SET)gop->SetMode)(gop, c.mode);
+}
+
+int fb_mode_cached(void) {
+    return s_mode_cached;
+}
 
-    if (best_mode != gop->Mode->Mode)
-        set_mode(gop, best_mode);
+static void fb_tick_init(void) {
+    if (!s_tick && !EFI_ERROR(g_boot.bs->CreateEvent(EVT_TIMER, 0, NULL,
+                                                     NULL, &s_tick)))
+        ((BS_SET_TIMER)g_boot.bs->SetTimer)(s_tick, TIMER_PERIODIC,
+                                            FB_PRINT_TICK);
+}
+
+EFI_STATUS fb_init(void) {
+    EFI_GUID gop_guid = EFI_GRAPHICS_OUTPUT_PROTOCOL_GUID;
+    EFI_STATUS status;
+
+    status = g_boot.bs->LocateProtocol(&gop_guid, NULL, (void **)&g_boot.gop);
+    if (EFI_ERROR(status))
+        return status;
+
+    EFI_GRAPHICS_OUTPUT_PROTOCOL *gop = g_boot.gop;
+    mode_select(gop);
 
     g_boot.framebuffer = (UINT32 *)(UINTN)gop->Mode->FrameBufferBase;
     g_boot.fb_width = gop->Mode->Info->HorizontalResolution;
@@ -49,85 +579,156 @@ EFI_STATUS fb_init(void) {
     g_boot.fb_pitch = gop->Mode->Info->PixelsPerScanLine;
     g_boot.fb_size = gop->Mode->FrameBufferSize;
 
+    /* Back buffer, tightly packed */
+    if (s_back)
+        mem_free_pages(s_back, s_back_size);
+    s_back_size = (UINTN)g_boot.fb_width * g_boot.fb_height * sizeof(UINT32);
+    s_back = s_back_size ? (UINT32 *)mem_alloc_pages(s_back_size) : NULL;
+    s_blt_ok = 1;
+    s_ndirty = 0;
+
+    if (s_back) {
+        s_draw = s_back;
+        s_draw_pitch = g_boot.fb_width;
+        /* Blt-only modes have no linear framebuffer; hand out the
+           back buffer so callers still see a drawing surface */
+        if (g_boot.framebuffer == NULL &&
+            gop->Mode->Info->PixelFormat == PixelBltOnly) {
+            g_boot.framebuffer = s_back;
+            g_boot.fb_pitch = g_boot.fb_width;
+            g_boot.fb_size = s_back_size;
+        }
+    } else {
+        s_draw = g_boot.framebuffer;
+        s_draw_pitch = g_boot.fb_pitch;
+    }
+
     if (g_boot.framebuffer == NULL || g_boot.fb_size == 0)
         return EFI_UNSUPPORTED;
 
     g_boot.scale = 1;
+    fb_text_init();
 
     g_boot.cols = g_boot.fb_width / (FONT_WIDTH * g_boot.scale);
     g_boot.rows = g_boot.fb_height / (FONT_HEIGHT * g_boot.scale);
     g_boot.cursor_x = 0;
     g_boot.cursor_y = 0;
+    fb_grid_init();
+    fb_tick_init();
+
+    fb_clear(COLOR_BLACK);
+    return EFI_SUCCESS;
+}
+
+EFI_STATUS fb_init_text(UINT32 cols, UINT32 rows) {
+    if (!cols || !rows)
+        return EFI_INVALID_PARAMETER;
+    if (s_back)
+        mem_free_pages(s_back, s_back_size);
+    s_back = NULL;
+    s_draw = NULL;
+    s_draw_pitch = 0;
+    s_ndirty = 0;
+    g_boot.framebuffer = NULL;
+    g_boot.fb_width = g_boot.fb_height = g_boot.fb_pitch = 0;
+    g_boot.fb_size = 0;
+
+    g_boot.scale = 1;
+    g_boot.cols = cols;
+    g_boot.rows = rows;
+    g_boot.cursor_x = 0;
+    g_boot.cursor_y = 0;
+    fb_grid_init();
+    if (!s_want)
+        return EFI_OUT_OF_RESOURCES;
+    fb_tick_init();
 
     fb_clear(COLOR_BLACK);
     return EFI_SUCCESS;
 }
 
 void fb_pixel(UINT32 x, UINT32 y, UINT32 color) {
-    if (x < g_boot.fb_width && y < g_boot.fb_height)
-        g_boot.framebuffer[y * g_boot.fb_pitch + x] = color;
+    if (x < g_boot.fb_width && y < g_boot.fb_height) {
+        if (s_want) {
+            fb_grid_live();
+            fb_grid_flush();
+            fb_grid_forget(x, y, 1, 1);
+        }
+        s_draw[y * s_draw_pitch + x] = color;
+        fb_damage(x, y, 1, 1);
+    }
 }
 
 void fb_rect(UINT32 x, UINT32 y, UINT32 w, UINT32 h, UINT32 color) {
+    if (!s_draw)
+        return;
+    if (s_want) {
+        fb_grid_live();
+        fb_grid_flush();
+        fb_grid_forget(x, y, w, h);
+    }
     for (UINT32 row = y; row < y + h && row < g_boot.fb_height; row++) {
-        UINT32 *line = &g_boot.framebuffer[row * g_boot.fb_pitch + x];
+        UINT32 *line = &s_draw[row * s_draw_pitch + x];
         for (UINT32 col = 0; col < w && (x + col) < g_boot.fb_width; col++)
             line[col] = color;
     }
+    fb_damage(x, y, w, h);
 }
 
-void fb_clear(UINT32 color) {
-    for (UINT32 y = 0; y < g_boot.fb_height; y++) {
-        UINT32 *line = &g_boot.framebuffer[y * g_boot.fb_pitch];
-        for (UINT32 x = 0; x < g_boot.fb_width; x++)
+static void fb_fill(UINT32 x0, UINT32 y0, UINT32 x1, UINT32 y1, UINT32 color) {
+    if (!s_draw)
+        return;
+    for (UINT32 y = y0; y < y1; y++) {
+        UINT32 *line = &s_draw[y * s_draw_pitch];
+        for (UINT32 x = x0; x < x1; x++)
             line[x] = color;
     }
+    if (x1 > x0 && y1 > y0)
+        fb_damage(x0, y0, x1 - x0, y1 - y0);
 }
 
-void fb_char(UINT32 cx, UINT32 cy, char c, UINT32 fg, UINT32 bg) {
-    if (c < FONT_FIRST || c > FONT_LAST)
-        c = '?';
-
-    UINT32 scale = g_boot.scale;
-    UINT32 cw = FONT_WIDTH * scale;
-    UINT32 ch = FONT_HEIGHT * scale;
-    UINT32 px = cx * cw;
-    UINT32 py = cy * ch;
-
-    if (px + cw > g_boot.fb_width || py + ch > g_boot.fb_height)
+void fb_clear(UINT32 color) {
+    if (!s_want) {
+        fb_fill(0, 0, g_boot.fb_width, g_boot.fb_height, color);
         return;
+    }
 
-    const UINT8 *glyph = font_data[c - FONT_FIRST];
-    UINT32 pitch = g_boot.fb_pitch;
-    UINT32 *base = g_boot.framebuffer + py * pitch + px;
-
-    if (scale == 1) {
-        for (UINT32 row = 0; row < FONT_HEIGHT; row++) {
-            UINT8 bits = glyph[row];
-            UINT32 *dst = base;
-            for (UINT32 col = 0; col < FONT_WIDTH; col++)
-                *dst++ = (bits & (0x80 >> col)) ? fg : bg;
-            base += pitch;
-        }
-    } else {
-        /* 2x: write 2 pixels wide, 2 rows at once per font row */
-        for (UINT32 row = 0; row < FONT_HEIGHT; row++) {
-            UINT8 bits = glyph[row];
-            UINT32 *dst = base;
-            for (UINT32 col = 0; col < FONT_WIDTH; col++) {
-                UINT32 color = (bits & (0x80 >> col)) ? fg : bg;
-                dst[0] = color;
-                dst[1] = color;
-                dst[pitch] = color;
-                dst[pitch + 1] = color;
-                dst += 2;
-            }
-            base += pitch * 2;
+    /* Cells become blanks, drawn at present time only where they
+       differ; the margins outside the grid are filled now. History
+       above the screen is kept. */
+    fb_grid_live();
+    for (UINT32 r = 0; r < g_boot.rows; r++) {
+        struct fb_cell *w = want_row(r);
+        for (UINT32 c = 0; c < g_boot.cols; c++) {
+            w[c].fg = color;
+            w[c].bg = color;
+            w[c].ch = ' ';
         }
     }
+    fb_grid_all_dirty();
+    s_pixels = 0;
+
+    if (s_margin_ok && s_margin == color)
+        return;
+    UINT32 gw = g_boot.cols * FONT_WIDTH * g_boot.scale;
+    UINT32 gh = g_boot.rows * FONT_HEIGHT * g_boot.scale;
+    fb_fill(gw, 0, g_boot.fb_width, gh, color);
+    fb_fill(0, gh, g_boot.fb_width, g_boot.fb_height, color);
+    s_margin_ok = 1;
+    s_margin = color;
+}
+
+void fb_char(UINT32 cx, UINT32 cy, char c, UINT32 fg, UINT32 bg) {
+    if (cx >= g_boot.cols || cy >= g_boot.rows)
+        return;
+    if (s_want)
+        fb_grid_put(cx, cy, &c, 1, fg, bg);
+    else
+        fb_text_run(cx, cy, &c, 1, fb_pair_get(fg, bg));
 }
 
 void fb_string(UINT32 cx, UINT32 cy, const char *s, UINT32 fg, UINT32 bg) {
+    const struct fb_pair *p = s_want ? NULL : fb_pair_get(fg, bg);
     while (*s) {
         if (cx >= g_boot.cols) {
             cx = 0;
@@ -135,33 +736,80 @@ void fb_string(UINT32 cx, UINT32 cy, const char *s, UINT32 fg, UINT32 bg) {
         }
         if (cy >= g_boot.rows)
             return;
-        fb_char(cx, cy, *s, fg, bg);
-        cx++;
-        s++;
+        UINT32 n = 0;
+        while (s[n] && cx + n < g_boot.cols)
+            n++;
+        if (s_want)
+            fb_grid_put(cx, cy, s, n, fg, bg);
+        else
+            fb_text_run(cx, cy, s, n, p);
+        cx += n;
+        s += n;
     }
 }
 
+void fb_line(UINT32 cy, const char *s, UINT32 fg, UINT32 bg) {
+    char line[256];
+    UINTN i = 0;
+    while (s[i] && i < g_boot.cols && i < sizeof(line) - 1) {
+        line[i] = s[i];
+        i++;
+    }
+    while (i < g_boot.cols && i < sizeof(line) - 1) line[i++] = ' ';
+    line[i] = '\0';
+    fb_string(0, cy, line, fg, bg);
+}
+
 void fb_scroll(void) {
     UINT32 scroll_rows = FONT_HEIGHT * g_boot.scale;
 
+    if (s_want) {
+        /* The top row becomes history and a blank row enters */
+        fb_grid_live();
+        s_top = (s_top + 1) % s_ring;
+        if (s_hist < s_ring - g_boot.rows)
+            s_hist++;
+        struct fb_cell *w = want_row(g_boot.rows - 1);
+        for (UINT32 c = 0; c < g_boot.cols; c++)
+            w[c] = s_blank;
+        fb_grid_all_dirty();
+        if (!s_pixels)
+            return;
+
+        /* Directly drawn pixels must move with the text: shift the
+           image and the shown grid; the new bottom row is unknown */
+        s_margin_ok = 0;
+        UINTN row = g_boot.cols;
+        UINTN keep = (UINTN)(g_boot.rows - 1) * row;
+        mem_move(s_shown, s_shown + row, keep * sizeof(struct fb_cell));
+        mem_set(s_shown + keep, 0, row * sizeof(struct fb_cell));
+    }
+    if (!s_draw)
+        return;
+
     for (UINT32 y = 0; y < g_boot.fb_height - scroll_rows; y++) {
-        mem_copy(&g_boot.framebuffer[y * g_boot.fb_pitch],
-                 &g_boot.framebuffer[(y + scroll_rows) * g_boot.fb_pitch],
+        mem_copy(&s_draw[y * s_draw_pitch],
+                 &s_draw[(y + scroll_rows) * s_draw_pitch],
                  g_boot.fb_width * sizeof(UINT32));
     }
 
     for (UINT32 y = g_boot.fb_height - scroll_rows; y < g_boot.fb_height; y++) {
-        UINT32 *line = &g_boot.framebuffer[y * g_boot.fb_pitch];
+        UINT32 *line = &s_draw[y * s_draw_pitch];
         for (UINT32 x = 0; x < g_boot.fb_width; x++)
             line[x] = COLOR_BLACK;
     }
+    fb_damage(0, 0, g_boot.fb_width, g_boot.fb_height);
 }
 
 void fb_print(const char *s, UINT32 fg) {
+    if (!g_boot.cols || !g_boot.rows)
+        return;
+    UINT32 scrolls = 0;
     while (*s) {
         if (*s == '\n') {
             g_boot.cursor_x = 0;
             g_boot.cursor_y++;
+            s++;
         } else {
             if (g_boot.cursor_x >= g_boot.cols) {
                 g_boot.cursor_x = 0;
@@ -169,17 +817,213 @@ void fb_print(const char *s, UINT32 fg) {
             }
             if (g_boot.cursor_y >= g_boot.rows) {
                 fb_scroll();
+                scrolls++;
                 g_boot.cursor_y = g_boot.rows - 1;
             }
-            fb_char(g_boot.cursor_x, g_boot.cursor_y, *s, fg, COLOR_BLACK);
-            g_boot.cursor_x++;
+            /* The rest of the line, up to the edge, in one run */
+            UINT32 n = 0;
+            while (s[n] && s[n] != '\n' && g_boot.cursor_x + n < g_boot.cols)
+                n++;
+            if (s_want)
+                fb_grid_put(g_boot.cursor_x, g_boot.cursor_y, s, n,
+                            fg, COLOR_BLACK);
+            else
+                fb_text_run(g_boot.cursor_x, g_boot.cursor_y, s, n,
+                            fb_pair_get(fg, COLOR_BLACK));
+            g_boot.cursor_x += n;
+            s += n;
         }
 
         if (g_boot.cursor_y >= g_boot.rows) {
             fb_scroll();
+            scrolls++;
             g_boot.cursor_y = g_boot.rows - 1;
         }
+    }
+
+    /* A scrolling burst repaints the whole screen; do that at most once
+       per tick. The next print, key poll or sleep shows the rest. While
+       held, only the grid and history change until the next present. */
+    if (s_hold)
+        return;
+    if (!scrolls || !s_tick || g_boot.bs->CheckEvent(s_tick) == EFI_SUCCESS)
+        fb_present();
+}
+
+void fb_print_hold(int on) {
+    s_hold = on;
+    if (!on)
+        fb_present();
+}
+
+void fb_set_present_hook(void (*hook)(void)) {
+    s_present_hook = hook;
+}
+
+const struct fb_cell *fb_text_row(UINT32 r) {
+    if (!s_want || r >= g_boot.rows)
+        return NULL;
+    return s_want + (UINTN)((s_top + s_ring - s_view + r) % s_ring) * g_boot.cols;
+}
+
+UINT32 fb_text_generation(void) {
+    return s_grid_gen;
+}
+
+void fb_set_mirror_hook(void (*hook)(void)) {
+    s_mirror_hook = hook;
+}
+
+/* ---- Surfaces ---- */
+
+static struct fb_surface s_surfaces[FB_SURFACES];
+static struct fb_surface s_screen;
+static UINT64 s_frame_next;     /* bench_ns() deadline, 0 = none */
+static UINT32 s_surfaces_kept;  /* bit per slot fb_surface_keep() took */
+
+static int fb_surface_owned(struct fb_surface *s) {
+    return s >= s_surfaces && s < s_surfaces + FB_SURFACES && s->pixels &&
+           !(s_surfaces_kept >> (s - s_surfaces) & 1);
+}
+
+struct fb_surface *fb_surface_create(UINT32 w, UINT32 h) {
+    if (!w || !h || (UINT64)w * h > ((UINTN)-1) / sizeof(UINT32))
+        return NULL;
+    for (int i = 0; i < FB_SURFACES; i++) {
+        struct fb_surface *s = &s_surfaces[i];
+        if (s->pixels)
+            continue;
+        s->pixels = (UINT32 *)mem_alloc((UINTN)w * h * sizeof(UINT32));
+        if (!s->pixels)
+            return NULL;
+        s->width = w;
+        s->height = h;
+        s->pitch = w;
+        return s;
+    }
+    return NULL;
+}
+
+void fb_surface_free(struct fb_surface *s) {
+    if (!fb_surface_owned(s))
+        return;
+    mem_free(s->pixels);
+    mem_set(s, 0, sizeof(*s));
+}
+
+struct fb_surface *fb_surface_screen(void) {
+    if (!s_draw)
+        return NULL;
+    if (s_want) {
+        fb_grid_live();
+        fb_grid_flush();
+    }
+    s_screen.pixels = s_draw;
+    s_screen.width = g_boot.fb_width;
+    s_screen.height = g_boot.fb_height;
+    s_screen.pitch = s_draw_pitch;
+    return &s_screen;
+}
+
+void fb_surface_present(struct fb_surface *s, UINT32 x, UINT32 y) {
+    if (s)
+        fb_surface_present_rect(s, 0, 0, s->width, s->height, x, y);
+}
+
+void fb_surface_present_rect(struct fb_surface *s, UINT32 sx, UINT32 sy,
+                             UINT32 w, UINT32 h, UINT32 x, UINT32 y) {
+    int screen = s == &s_screen;
+    if (!screen && !fb_surface_owned(s))
+        return;
+    if (screen)
+        x = y = 0;
+    if (sx >= s->width || sy >= s->height)
+        return;
+    if (w > s->width - sx) w = s->width - sx;
+    if (h > s->height - sy) h = s->height - sy;
+    if ((UINT64)x + sx >= g_boot.fb_width || (UINT64)y + sy >= g_boot.fb_height)
+        return;
+    UINT32 dx = x + sx, dy = y + sy;
+    if (w > g_boot.fb_width - dx) w = g_boot.fb_width - dx;
+    if (h > g_boot.fb_height - dy) h = g_boot.fb_height - dy;
+    if (!w || !h)
+        return;
+
+    /* Draw pending text first so it ends up under the surface */
+    if (s_want) {
+        fb_grid_live();
+        fb_grid_flush();
+        fb_grid_forget(dx, dy, w, h);
+    }
+    if (!screen) {
+        for (UINT32 row = 0; row < h; row++)
+            mem_copy(&s_draw[(UINTN)(dy + row) * s_draw_pitch + dx],
+                     &s->pixels[(UINTN)(sy + row) * s->pitch + sx],
+                     (UINTN)w * sizeof(UINT32));
+    }
+    fb_damage(dx, dy, w, h);
+    fb_present();
+}
+
+void fb_surface_text(struct fb_surface *s, UINT32 x, UINT32 y,
+                     const char *str, UINT32 fg, UINT32 bg) {
+    if (!str || (s != &s_screen && !fb_surface_owned(s)))
+        return;
+    UINT32 scale = g_boot.scale;
+    UINT32 cw = FONT_WIDTH * scale;
+    UINT32 ch = FONT_HEIGHT * scale;
+    if (y >= s->height || ch > s->height - y)
+        return;
+
+    /* The expanded nibble tables hold 4 * scale pixels each */
+    const struct fb_pair *p = fb_pair_get(fg, bg);
+    UINT32 half = cw / 2;
+    for (; *str && x < s->width && cw <= s->width - x; str++, x += cw) {
+        const UINT8 *glyph = s_glyph[(UINT8)*str];
+        UINT32 *dst = s->pixels + (UINTN)y * s->pitch + x;
+        for (UINT32 gy = 0; gy < FONT_HEIGHT; gy++) {
+            const UINT32 *hi = (const UINT32 *)p->px[glyph[gy] >> 4];
+            const UINT32 *lo = (const UINT32 *)p->px[glyph[gy] & 15];
+            for (UINT32 i = 0; i < half; i++) {
+                dst[i] = hi[i];
+                dst[half + i] = lo[i];
+            }
+            if (scale == 2)
+                mem_copy(dst + s->pitch, dst, cw * sizeof(UINT32));
+            dst += (UINTN)s->pitch * scale;
+        }
+    }
+}
 
-        s++;
+UINT32 fb_frame_wait(UINT32 fps) {
+    if (!fps)
+        return 0;
+    UINT64 period = 1000000000ULL / fps;
+    UINT64 now = bench_ns();
+    UINT32 missed = 0;
+    if (!s_frame_next) {
+        s_frame_next = now;
+    } else if (now < s_frame_next) {
+        g_boot.bs->Stall((UINTN)((s_frame_next - now) / 1000));
+        while (bench_ns() < s_frame_next)
+            ;
+    } else if (now - s_frame_next >= period) {
+        /* Overran: count the frames skipped and restart from now */
+        missed = (UINT32)((now - s_frame_next) / period);
+        s_frame_next = now;
     }
+    s_frame_next += period;
+    return missed;
+}
+
+void fb_surface_keep(void) {
+    for (int i = 0; i < FB_SURFACES; i++)
+        if (s_surfaces[i].pixels)
+            s_surfaces_kept |= 1u << i;
+}
+
+void fb_surface_release(void) {
+    for (int i = 0; i < FB_SURFACES; i++)
+        fb_surface_free(&s_surfaces[i]);
+    s_frame_next = 0;
 }
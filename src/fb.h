@@ -6,6 +6,10 @@
 /* Initialize framebuffer via UEFI GOP */
 EFI_STATUS fb_init(void);
 
+/* 1 when fb_init() took the mode remembered from an earlier boot
+   instead of querying every mode */
+int fb_mode_cached(void);
+
 /* Pixel-level operations */
 void fb_pixel(UINT32 x, UINT32 y, UINT32 color);
 void fb_rect(UINT32 x, UINT32 y, UINT32 w, UINT32 h, UINT32 color);
@@ -15,11 +19,119 @@ void fb_clear(UINT32 color);
 void fb_char(UINT32 cx, UINT32 cy, char c, UINT32 fg, UINT32 bg);
 void fb_string(UINT32 cx, UINT32 cy, const char *s, UINT32 fg, UINT32 bg);
 
-/* Scroll the screen up by one text row */
+/* Text row cy filled from the left edge: s, clipped to the screen
+   width, then spaces in bg to the right edge */
+void fb_line(UINT32 cy, const char *s, UINT32 fg, UINT32 bg);
+
+/* Scroll the screen up by one text row; the top row joins the
+   scrollback history */
 void fb_scroll(void);
 
+/* Move the view delta rows back into the history (negative: toward
+   the live screen), clamped. Any drawing returns to the live screen.
+   Returns how many rows back the view now is. */
+int fb_scrollback(int delta);
+
 /* Print a string at the current cursor position, advancing cursor.
-   Handles \n for newline. Scrolls when reaching bottom. */
+   Handles \n for newline. Scrolls when reaching bottom. Presents
+   before returning, at most every 20 ms while output scrolls. */
 void fb_print(const char *s, UINT32 fg);
 
+/* Fast console: while held, fb_print() only updates the text grid and
+   the scrollback history, so a burst of output costs no drawing and
+   the next fb_present() shows just its final screen. Releasing
+   presents. */
+void fb_print_hold(int on);
+
+/* Drawing lands in an off-screen buffer; send the changed areas to the
+   screen. fb_print() and kbd_poll() call this, so only code that
+   draws without either needs to. */
+void fb_present(void);
+
+/* Call hook at the start of every fb_present(), so text a caller still
+   buffers (the shim's stdout) is printed before the screen updates */
+void fb_set_present_hook(void (*hook)(void));
+
+/* ---- Text grid ----
+ * What the screen's text cells hold, for a second view of the screen
+ * that is not made of pixels (the serial console, serial.h). */
+
+struct fb_cell {
+    UINT32 fg, bg;
+    UINT32 ch;                  /* 0: unknown, pixels drawn directly */
+};
+
+/* Nonzero if a and b show the same character in the same colors */
+int fb_cell_eq(const struct fb_cell *a, const struct fb_cell *b);
+
+/* No GOP: a cols x rows text grid with no pixels behind it, for the
+   serial console to show. Pixel calls do nothing, surfaces cannot be
+   presented and fb_surface_screen() returns NULL. */
+EFI_STATUS fb_init_text(UINT32 cols, UINT32 rows);
+
+/* The g_boot.cols cells of screen row r as the screen shows them (the
+   scrollback view while one is up), or NULL without a grid */
+const struct fb_cell *fb_text_row(UINT32 r);
+
+/* Changes whenever a cell may have: a view need only look at the
+   rows again when this differs from the last time */
+UINT32 fb_text_generation(void);
+
+/* Call hook at the end of every fb_present(), once the cells are what
+   the screen shows */
+void fb_set_mirror_hook(void (*hook)(void));
+
+/* ---- Surfaces (exported to programs) ----
+ * A surface is a pixel buffer in cached RAM that programs draw into
+ * directly, pitch pixels per row, and present in one call: the rows
+ * are copied into the back buffer, text cells under them are
+ * forgotten, and the area goes out with the usual Blt. The screen
+ * surface is the back buffer itself, so presenting it copies nothing.
+ * Surfaces a program leaves behind are freed after its run. */
+
+#define FB_SURFACES 8
+
+struct fb_surface {
+    UINT32 *pixels;
+    UINT32 width, height;
+    UINT32 pitch;               /* pixels per row */
+};
+
+/* A w x h surface, cleared to black; NULL if out of memory or all
+   FB_SURFACES are in use */
+struct fb_surface *fb_surface_create(UINT32 w, UINT32 h);
+void fb_surface_free(struct fb_surface *s);
+
+/* The back buffer as a surface, placed at 0,0. Pending text is drawn
+   into it first. Present it to show what was drawn. NULL on a text
+   grid (fb_init_text()). */
+struct fb_surface *fb_surface_screen(void);
+
+/* Show all of s with its top left at x,y on screen */
+void fb_surface_present(struct fb_surface *s, UINT32 x, UINT32 y);
+
+/* Show the w x h area at sx,sy of s, for s placed at x,y on screen:
+   the area lands at x + sx, y + sy. Clipped to both. */
+void fb_surface_present_rect(struct fb_surface *s, UINT32 sx, UINT32 sy,
+                             UINT32 w, UINT32 h, UINT32 x, UINT32 y);
+
+/* Draw text into s with its top left at pixel x,y, in the screen's
+   font size, one glyph row at a time. Glyphs that do not fit whole
+   are left out. */
+void fb_surface_text(struct fb_surface *s, UINT32 x, UINT32 y,
+                     const char *str, UINT32 fg, UINT32 bg);
+
+/* Frame pacing without vsync: frames fall 1/fps s apart on the
+   monotonic clock, starting at the first call, and each call waits for
+   the next one. A frame that overran by a whole period starts a new
+   schedule from now. Returns the frames missed (0 when on time). */
+UINT32 fb_frame_wait(UINT32 fps);
+
+/* Free every surface and forget the frame schedule (after a run) */
+void fb_surface_release(void);
+
+/* Leave the surfaces there are now allocated for good, to a program
+   still running on another core (aprun.h); their slots stay taken */
+void fb_surface_keep(void);
+
 #endif /* FB_H */
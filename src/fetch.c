@@ -0,0 +1,230 @@
+/*
+ * fetch.c — Download a URL into a file on any writable volume
+ *
+ * The body arrives in pieces of whatever size the network delivered;
+ * they are hashed as they come and collect in a staging buffer that
+ * goes to the file in large writes, as image backups do. The next
+ * receive is posted before a write starts (net_next()), so the network
+ * keeps filling while the volume is busy.
+ */
+
+#include "boot.h"
+#include "fb.h"
+#include "kbd.h"
+#include "mem.h"
+#include "fs.h"
+#include "hash.h"
+#include "net.h"
+#include "fetch.h"
+#include "progress.h"
+#include "shim.h"
+
+#define FETCH_OUT_BUF (4 * 1024 * 1024)  /* file writes */
+#define SIDECAR_MAX   512                /* a digest, a name and some slack */
+
+/* ---- UI helpers ---- */
+
+static void fetch_print(const char *msg, UINT32 color) {
+    if (g_boot.cols) fb_print(msg, color);
+}
+
+static void fetch_wait_key(void) {
+    fetch_print("  Press any key to return.\n", COLOR_DGRAY);
+    struct key_event ev;
+    kbd_wait(&ev);
+}
+
+/* Redraw the progress line at row when it is due */
+static void fetch_bar(struct progress *pg, UINT32 row, UINT64 bytes) {
+    if (!progress_add(pg, bytes)) return;
+    char line[128];
+    line[0] = line[1] = ' ';
+    int len = 2 + progress_line(pg, line + 2, sizeof(line) - 2);
+    while (len < (int)g_boot.cols && len < 126) line[len++] = ' ';
+    line[len] = '\0';
+    fb_string(0, row, line, COLOR_WHITE, COLOR_BLACK);
+    fb_present();
+}
+
+/* ESC pressed since the last look */
+static int fetch_cancelled(void) {
+    struct key_event ev;
+    return kbd_poll(&ev) && ev.code == KEY_ESC;
+}
+
+static void digest_hex(const UINT8 d[SHA256_DIGEST], char *out) {
+    static const char hex[] = "0123456789abcdef";
+    for (int i = 0; i < SHA256_DIGEST; i++) {
+        out[2 * i] = hex[d[i] >> 4];
+        out[2 * i + 1] = hex[d[i] & 15];
+    }
+    out[2 * SHA256_DIGEST] = '\0';
+}
+
+int fetch_sidecar(const char *url, UINT8 out[SHA256_DIGEST]) {
+    char side[NET_URL_MAX + 8];
+    snprintf(side, sizeof(side), "%s.sha256", url);
+    char text[SIDECAR_MAX];
+    UINTN len = sizeof(text);
+    if (net_fetch_small(side, text, &len) != 0) return -1;
+    return sha256_parse(text, len, out);
+}
+
+/* ---- Download ---- */
+
+int fetch_file(struct fs_volume *dst, const CHAR16 *path, const char *name,
+               const char *url) {
+    char buf[NET_URL_MAX + 16];
+    fb_clear(COLOR_BLACK);
+    fetch_print("\n", COLOR_WHITE);
+    fetch_print("  ========================================\n", COLOR_CYAN);
+    fetch_print("       DOWNLOAD\n", COLOR_CYAN);
+    fetch_print("  ========================================\n", COLOR_CYAN);
+    fetch_print("\n", COLOR_WHITE);
+    snprintf(buf, sizeof(buf), "  URL:     %s\n", url);
+    fetch_print(buf, COLOR_WHITE);
+    snprintf(buf, sizeof(buf), "  Save as: %s\n\n", name);
+    fetch_print(buf, COLOR_WHITE);
+
+    /* The checksum first: it is one small request, and the transfer
+       that follows then runs alone */
+    fetch_print("  Connecting...\n", COLOR_DGRAY);
+    fb_present();
+    UINT8 expect[SHA256_DIGEST];
+    int have_sidecar = fetch_sidecar(url, expect) == 0;
+
+    char err[96];
+    UINT64 size;
+    struct net_get *g = net_open(url, &size, err, sizeof(err));
+    if (!g) {
+        snprintf(buf, sizeof(buf), "  %s\n", err);
+        fetch_print(buf, COLOR_RED);
+        fetch_wait_key();
+        return -1;
+    }
+
+    if (size != NET_SIZE_UNKNOWN)
+        snprintf(buf, sizeof(buf), "  Size: %llu MB\n",
+                 (unsigned long long)(size / (1024 * 1024)));
+    else
+        snprintf(buf, sizeof(buf), "  Size: not given by the server\n");
+    fetch_print(buf, COLOR_WHITE);
+    if (have_sidecar)
+        fetch_print("  Found a .sha256 file on the server.\n", COLOR_WHITE);
+
+    UINT64 total_bytes, free_bytes;
+    if (size != NET_SIZE_UNKNOWN
+        && fs_volume_space(dst, &total_bytes, &free_bytes) == 0
+        && free_bytes < size) {
+        fetch_print("  Not enough free space on this volume.\n", COLOR_RED);
+        net_close(g);
+        fetch_wait_key();
+        return -1;
+    }
+    enum fs_vol_type type = fs_volume_type(dst);
+    if ((type == FS_VOL_FAT32 || type == FS_VOL_SFS) && size != NET_SIZE_UNKNOWN
+        && size > 0xFFFFFFFFULL) {
+        fetch_print("  FAT32 files stop at 4 GB: use an exFAT volume or\n", COLOR_RED);
+        fetch_print("  the RAM disk, or write it straight to a device.\n", COLOR_RED);
+        net_close(g);
+        fetch_wait_key();
+        return -1;
+    }
+    fetch_print("  ESC stops the download.\n\n", COLOR_DGRAY);
+
+    UINT8 *out = (UINT8 *)mem_alloc_raw(FETCH_OUT_BUF);
+    struct fs_file *f = out ? fs_volume_open_write(dst, path) : NULL;
+    if (!f) {
+        fetch_print(out ? "  Could not create the file.\n" : "  Out of memory.\n",
+                    COLOR_RED);
+        if (out) mem_free(out);
+        net_close(g);
+        fetch_wait_key();
+        return -1;
+    }
+
+    struct sha256_ctx sha;
+    sha256_init(&sha);
+    struct progress pg;
+    UINT32 row = g_boot.cursor_y;
+    progress_start(&pg, "Downloading", size != NET_SIZE_UNKNOWN ? size : 0);
+
+    int rc = 0;        /* 1: cancelled */
+    if (size != NET_SIZE_UNKNOWN && fs_stream_preallocate(f, size) != 0) rc = -1;
+    UINTN out_len = 0;
+    UINT64 got = 0;
+    while (rc == 0) {
+        UINTN len;
+        const UINT8 *data = (const UINT8 *)net_next(g, &len);
+        if (!data) {
+            if (net_error(g)) rc = -1;
+            break;
+        }
+        sha256_update(&sha, data, len);
+        got += len;
+        fetch_bar(&pg, row, len);
+        while (len > 0 && rc == 0) {
+            UINTN n = FETCH_OUT_BUF - out_len < len ? FETCH_OUT_BUF - out_len : len;
+            mem_copy(out + out_len, data, n);
+            out_len += n;
+            data += n;
+            len -= n;
+            if (out_len == FETCH_OUT_BUF) {
+                if (fs_stream_write(f, out, out_len) != 0) rc = -1;
+                out_len = 0;
+            }
+        }
+        if (rc != 0) break;
+        if (fetch_cancelled()) {
+            rc = 1;
+            break;
+        }
+    }
+    net_close(g);
+
+    if (rc == 0 && out_len && fs_stream_write(f, out, out_len) != 0) rc = -1;
+    if (fs_stream_close(f) != 0 && rc == 0) rc = -1;
+    mem_free(out);
+    if (rc != 0) fs_volume_delete(dst, path);
+
+    char detail[160];
+    snprintf(detail, sizeof(detail), "%s -> %s", url, name);
+    if (rc != 1 && pg.chunks) progress_log(&pg, detail, rc == 0);
+
+    fetch_print("\n\n", COLOR_WHITE);
+    if (rc == 1) {
+        fetch_print("  Cancelled; the partial file was deleted.\n", COLOR_YELLOW);
+        fetch_wait_key();
+        return -1;
+    }
+    if (rc != 0) {
+        fetch_print("  Download failed; the partial file was deleted.\n", COLOR_RED);
+        fetch_wait_key();
+        return -1;
+    }
+
+    UINT8 digest[SHA256_DIGEST];
+    char hex[2 * SHA256_DIGEST + 1];
+    sha256_final(&sha, digest);
+    digest_hex(digest, hex);
+    int sha_ok = !have_sidecar || mem_cmp(digest, expect, SHA256_DIGEST) == 0;
+
+    char stats[128];
+    progress_summary(&pg, stats, sizeof(stats));
+    snprintf(buf, sizeof(buf), "  Saved %llu MB as %s\n",
+             (unsigned long long)(got / (1024 * 1024)), name);
+    fetch_print(buf, sha_ok ? COLOR_GREEN : COLOR_WHITE);
+    snprintf(buf, sizeof(buf), "  Downloading: %s\n", stats);
+    fetch_print(buf, COLOR_DGRAY);
+    snprintf(buf, sizeof(buf), "  SHA-256: %s\n", hex);
+    fetch_print(buf, COLOR_WHITE);
+    if (!sha_ok) {
+        fetch_print("  SHA-256 MISMATCH: the file does not match the\n", COLOR_RED);
+        fetch_print("  server's .sha256 file. The download is corrupt.\n", COLOR_RED);
+    } else if (have_sidecar) {
+        fetch_print("  SHA-256 matches the server's .sha256 file.\n", COLOR_GREEN);
+    }
+    fetch_print("\n", COLOR_WHITE);
+    fetch_wait_key();
+    return sha_ok ? 0 : -1;
+}
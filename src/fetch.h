@@ -0,0 +1,26 @@
+/*
+ * fetch.h — Download a URL into a file on any writable volume
+ *
+ * The ISO or image lands on the RAM disk, an exFAT stick or the boot
+ * volume without another machine. The body streams from the network
+ * (net.h) into the file while its SHA-256 is taken; a "<url>.sha256"
+ * on the server, when there is one, is checked against it. Writing a
+ * download straight onto a device is iso_write_url() (iso.h).
+ */
+#ifndef FETCH_H
+#define FETCH_H
+
+#include "fs.h"
+#include "hash.h"
+
+/* Download url into path on dst, showing progress; ESC cancels. A
+   partial file is deleted. Returns 0 on success, -1 on error, cancel
+   or a SHA-256 mismatch (the file is kept then, to look at). */
+int fetch_file(struct fs_volume *dst, const CHAR16 *path, const char *name,
+               const char *url);
+
+/* Fetch "<url>.sha256" and parse the digest in it. Returns 0 with the
+   digest in out, -1 when there is none. */
+int fetch_sidecar(const char *url, UINT8 out[SHA256_DIGEST]);
+
+#endif /* FETCH_H */
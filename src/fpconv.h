@@ -0,0 +1,50 @@
+/*
+ * fpconv.h — Correctly rounded conversions between decimal text and
+ * binary floating point, used by the shim's strtod() and printf()
+ *
+ * Portable: no UEFI dependency.
+ */
+#ifndef FPCONV_H
+#define FPCONV_H
+
+#include "boot.h"
+
+/* Digits a decimal can hold; enough for every double exactly */
+#define FP_DECIMAL_DIGITS 800
+
+/* A decimal number 0.d[0]d[1]...d[nd-1] * 10^dp. Digits are ASCII with
+   no trailing zeros; zero has nd == 0. */
+struct fp_decimal {
+    char d[FP_DECIMAL_DIGITS];
+    int  nd;
+    int  dp;
+    int  neg;
+    int  trunc;     /* nonzero digits were dropped past d[] */
+};
+
+/* strtod()/strtof() after any leading blanks: decimal or hexadecimal
+   (0x..p..) numbers, inf, infinity and nan. *erange is set to 1 when
+   the result overflowed to infinity or underflowed to zero. */
+double fp_strtod(const char *s, char **endp, int *erange);
+float  fp_strtof(const char *s, char **endp, int *erange);
+
+/* What fp_digits() makes of a value */
+#define FP_FINITE 0
+#define FP_INF    1
+#define FP_NAN    2
+
+/* Digit modes */
+#define FP_SIGNIFICANT 0    /* prec significant digits (prec >= 1) */
+#define FP_FRACTION    1    /* prec digits after the decimal point */
+#define FP_SHORTEST    2    /* fewest digits that read back as v */
+
+/* Decimal digits of v rounded to nearest, ties to even; out->neg is
+   the sign. Returns FP_FINITE, FP_INF or FP_NAN. */
+int fp_digits(double v, int mode, int prec, struct fp_decimal *out);
+
+/* Format v with the fewest digits that read back exactly, as %g does
+   but without its six-digit limit ("0.1", "1e+100", "-inf").
+   buf should hold 32 bytes. Returns the length. */
+int fp_shortest(double v, char *buf, UINTN size);
+
+#endif /* FPCONV_H */
@@ -1,20 +1,51 @@
 #include "fs.h"
 #include "mem.h"
+#include "trace.h"
 #include "exfat.h"
 #include "ntfs.h"
+#include "iso9660.h"
+#include "part.h"
+#include "fat32.h"
 #include "disk.h"
+#include "bcache.h"
+#include "dirsort.h"
+#include "ramdisk.h"
 
-/* Root directory handle for the boot volume */
-static EFI_FILE_HANDLE s_root;
+/* ---- BlockIO callback wrappers for custom drivers ---- */
+
+struct bio_wb;
+
+struct bio_ctx {
+    EFI_BLOCK_IO *bio;
+    UINT32 media_id;
+    int wrote;              /* any block written since mount */
+    struct bio_wb *wb;      /* write-behind, while fs_volume_write_behind() */
+};
+
+/* A volume: an SFS root, or a BlockIO handle mounted with one of the
+   built-in drivers. s_cur is the current one that the path-only calls
+   use; fs_volume_open() makes others. */
+struct fs_volume {
+    enum fs_vol_type type;
+    EFI_FILE_HANDLE root;   /* FS_VOL_SFS */
+    struct exfat_vol *exfat;
+    struct ntfs_vol *ntfs;
+    struct fat32_vol *fat32;
+    struct iso9660_vol *iso;
+    EFI_HANDLE handle;      /* BlockIO handle of a mount */
+    struct bio_ctx *bio;    /* the callbacks' context: allocated, so that
+                               the volume can move (fs_mount_image()) */
+    struct fs_file *streams;    /* open streams on the mount */
+    int close_root;         /* root was opened for this volume */
+    int batch;              /* open fs_volume_begin_batch() calls */
+    struct image_dev *image;    /* an image mount: the file it is read from */
+    struct fs_volume *host; /* and the volume that file is on */
+};
+
+static struct fs_volume s_cur = { FS_VOL_SFS };
 static EFI_FILE_HANDLE s_boot_root;  /* saved boot volume root */
 static EFI_HANDLE s_boot_device;     /* boot device handle */
 
-/* Custom volume state */
-static enum fs_vol_type s_vol_type = FS_VOL_SFS;
-static struct exfat_vol *s_exfat = NULL;
-static struct ntfs_vol *s_ntfs = NULL;
-static EFI_HANDLE s_custom_handle = NULL;  /* BlockIO handle for custom vol */
-
 /* Convert CHAR16 string to ASCII (truncates to 7-bit) */
 static void char16_to_ascii(const CHAR16 *src, char *dst, int max) {
     int i = 0;
@@ -36,81 +67,804 @@ static void path_to_ascii(const CHAR16 *src, char *dst, int max) {
     dst[i] = '\0';
 }
 
-/* Case-insensitive ASCII comparison for sorting */
-static int name_cmp(const char *a, const char *b) {
-    while (*a && *b) {
-        char ca = *a, cb = *b;
-        if (ca >= 'A' && ca <= 'Z') ca += 32;
-        if (cb >= 'A' && cb <= 'Z') cb += 32;
-        if (ca != cb) return (int)(UINT8)ca - (int)(UINT8)cb;
-        a++; b++;
-    }
-    return (int)(UINT8)*a - (int)(UINT8)*b;
-}
-
-/* Sort entries: directories first, then alphabetical */
-static void sort_entries(struct fs_entry *entries, int count) {
-    /* Simple insertion sort — fine for <= 256 entries */
-    for (int i = 1; i < count; i++) {
-        struct fs_entry tmp;
-        mem_copy(&tmp, &entries[i], sizeof(tmp));
-        int j = i - 1;
-        while (j >= 0) {
-            int swap = 0;
-            if (tmp.is_dir && !entries[j].is_dir) {
-                swap = 1;
-            } else if (tmp.is_dir == entries[j].is_dir) {
-                if (name_cmp(tmp.name, entries[j].name) < 0)
-                    swap = 1;
-            }
-            if (!swap) break;
-            mem_copy(&entries[j + 1], &entries[j], sizeof(tmp));
-            j--;
-        }
-        mem_copy(&entries[j + 1], &tmp, sizeof(tmp));
+/* ---- Write-behind ----
+ * The drivers' write path is synchronous: exfat_write() and fat32_write()
+ * return only once their runs are on the device. While a volume has
+ * write-behind on, data writes of WB_MIN bytes or more are copied into
+ * a ring of device I/O memory and left in flight on the firmware's
+ * BlockIO2, so the caller's next read (a copy's next chunk) runs while
+ * they complete. Reads and smaller writes wait only for the requests
+ * they overlap; a barrier waits for all of them. A failed write is
+ * reported by the next write or barrier. */
+#define WB_MIN   (64 * 1024)
+#define WB_DEPTH 32
+#define WB_ALIGN 4096       /* keeps every request at the ring's IoAlign */
+
+struct wb_req {
+    struct disk_io *io;
+    UINT64 lba;
+    UINT32 count;
+    UINTN off, len;         /* its place in the ring */
+};
+
+struct bio_wb {
+    struct disk_device dev;
+    struct disk_queue *q;
+    UINT8 *ring;
+    UINTN size;
+    UINTN head;             /* where the next request goes */
+    struct wb_req req[WB_DEPTH];
+    int first, n;           /* oldest request in flight, and how many */
+    int error;
+};
+
+/* Wait for the oldest request in flight */
+static void wb_retire(struct bio_wb *wb) {
+    struct wb_req *r = &wb->req[wb->first];
+    if (disk_wait(wb->q, r->io) != 0) wb->error = 1;
+    r->io = NULL;
+    wb->first = (wb->first + 1) % WB_DEPTH;
+    wb->n--;
+}
+
+/* Wait until no request in flight writes blocks [lba, lba+count) */
+static void wb_settle(struct bio_wb *wb, UINT64 lba, UINT32 count) {
+    int last = -1;
+    for (int i = 0; i < wb->n; i++) {
+        struct wb_req *r = &wb->req[(wb->first + i) % WB_DEPTH];
+        if (r->lba < lba + count && lba < r->lba + r->count) last = i;
     }
+    while (last-- >= 0) wb_retire(wb);
 }
 
-/* ---- BlockIO callback wrappers for custom drivers ---- */
+/* Wait for everything in flight; 0 if it all landed */
+static int wb_drain(struct bio_wb *wb) {
+    while (wb->n) wb_retire(wb);
+    int rc = wb->error ? -1 : 0;
+    wb->error = 0;
+    return rc;
+}
 
-struct bio_ctx {
-    EFI_BLOCK_IO *bio;
-    UINT32 media_id;
-};
+/* Copy a write into the ring and submit it. 0 if it is in flight. */
+static int wb_submit(struct bio_wb *wb, UINT64 lba, UINT32 count,
+                     const void *buf, UINTN len) {
+    wb_settle(wb, lba, count);
+    UINTN off = wb->head + len <= wb->size ? wb->head : 0;
+    /* Requests leave in order: retire the oldest until the space is free */
+    while (wb->n) {
+        int busy = wb->n == WB_DEPTH;
+        for (int i = 0; i < wb->n && !busy; i++) {
+            struct wb_req *r = &wb->req[(wb->first + i) % WB_DEPTH];
+            busy = r->off < off + len && off < r->off + r->len;
+        }
+        if (!busy) break;
+        wb_retire(wb);
+    }
+    mem_copy(wb->ring + off, buf, len);
+    struct disk_io *io = disk_submit_write(wb->q, lba, count, wb->ring + off);
+    if (!io) return -1;
+    struct wb_req *r = &wb->req[(wb->first + wb->n) % WB_DEPTH];
+    r->io = io;
+    r->lba = lba;
+    r->count = count;
+    r->off = off;
+    r->len = len;
+    wb->n++;
+    wb->head = (off + len + WB_ALIGN - 1) & ~(UINTN)(WB_ALIGN - 1);
+    return 0;
+}
 
-static struct bio_ctx s_bio_ctx;
+/* ---- BlockIO callbacks ---- */
 
 static int bio_read_cb(void *ctx, UINT64 lba, UINT32 count, void *buf) {
     struct bio_ctx *bc = (struct bio_ctx *)ctx;
     UINTN size = (UINTN)count * (UINTN)bc->bio->Media->BlockSize;
-    EFI_STATUS st = bc->bio->ReadBlocks(bc->bio, bc->media_id,
-                                         (EFI_LBA)lba, size, buf);
-    return EFI_ERROR(st) ? -1 : 0;
+    if (bc->wb) wb_settle(bc->wb, lba, count);
+    TRACE_BEGIN(TR_BIO_READ, lba, count);
+    int r = disk_bio_read(bc->bio, bc->media_id, lba, size, buf);
+    TRACE_END(TR_BIO_READ, lba, count);
+    return r;
 }
 
 static int bio_write_cb(void *ctx, UINT64 lba, UINT32 count, const void *buf) {
     struct bio_ctx *bc = (struct bio_ctx *)ctx;
     UINTN size = (UINTN)count * (UINTN)bc->bio->Media->BlockSize;
-    EFI_STATUS st = bc->bio->WriteBlocks(bc->bio, bc->media_id,
-                                          (EFI_LBA)lba, size, (void *)buf);
-    if (EFI_ERROR(st)) return -1;
-    bc->bio->FlushBlocks(bc->bio);
+    bc->wrote = 1;
+    struct bio_wb *wb = bc->wb;
+    if (wb) {
+        if (wb->error) return -1;
+        if (size >= WB_MIN && size <= wb->size) {
+            TRACE_BEGIN(TR_BIO_WRITE, lba, count);
+            int r = wb_submit(wb, lba, count, buf, size);
+            TRACE_END(TR_BIO_WRITE, lba, count);
+            return r;
+        }
+        wb_settle(wb, lba, count);
+    }
+    TRACE_BEGIN(TR_BIO_WRITE, lba, count);
+    int r = disk_bio_write(bc->bio, bc->media_id, lba, size, buf);
+    TRACE_END(TR_BIO_WRITE, lba, count);
+    return r;
+}
+
+/* Consistency point for a mounted custom volume: the drivers have
+   written everything back, now make it durable with one device flush
+   (bio_write_cb itself never flushes). Writes still in flight behind
+   are waited for even inside a batch, so every stream close reports
+   them. Passes rc through. */
+static int bio_barrier(struct fs_volume *v, int rc) {
+    if (v->bio && v->bio->wb && wb_drain(v->bio->wb) != 0)
+        rc = -1;
+    if (v->batch) return rc;    /* one barrier at the commit */
+    if (v->bio && EFI_ERROR(v->bio->bio->FlushBlocks(v->bio->bio)))
+        rc = -1;
+    return rc;
+}
+
+/* ---- Path lookup cache ---- */
+
+/* Remembers which paths exist (and their sizes) on a volume so repeated
+   probes -- TCC include searches, browser refreshes -- skip the driver's
+   walk from the root. Keyed by (volume, exact path); any write through
+   this module drops the whole cache. */
+#define DCACHE_SETS     64
+#define DCACHE_WAYS     4
+#define DCACHE_PATH_MAX 128
+
+struct dcache_ent {
+    const void *vol;        /* NULL = empty slot */
+    UINT32 hash;
+    UINT32 stamp;           /* LRU within the set */
+    INT8   exists;          /* -1 unknown, 0 absent, 1 present */
+    UINT8  size_known;
+    UINT64 size;
+    CHAR16 path[DCACHE_PATH_MAX];
+};
+
+static struct dcache_ent s_dcache[DCACHE_SETS][DCACHE_WAYS];
+static UINT32 s_dcache_clock;
+
+/* Content caches above this module (the shim's include cache) key on
+   the generation and hear about single-file writes from the listener */
+static UINT32 s_generation = 1;
+static UINT32 s_changes = 1;
+static fs_write_fn s_write_fn;
+
+static void dcache_clear(void) {
+    mem_set(s_dcache, 0, sizeof(s_dcache));
+}
+
+void fs_cache_invalidate(void) {
+    dcache_clear();
+    s_generation++;
+    s_changes++;
+}
+
+UINT32 fs_generation(void) {
+    return s_generation;
+}
+
+UINT32 fs_change_count(void) {
+    return s_changes;
+}
+
+void fs_set_write_listener(fs_write_fn fn) {
+    s_write_fn = fn;
+}
+
+/* A file is about to be replaced, deleted or renamed */
+static void fs_wrote(const CHAR16 *path) {
+    dcache_clear();
+    s_changes++;
+    if (s_write_fn)
+        s_write_fn(path);
+}
+
+/* The RAM disk is an exFAT volume on a ramdisk store */
+static int vol_is_exfat(const struct fs_volume *v) {
+    return v->type == FS_VOL_EXFAT || v->type == FS_VOL_RAM;
+}
+
+/* The built-in drivers that only read, and image mounts */
+static int vol_read_only(const struct fs_volume *v) {
+    return v->type == FS_VOL_NTFS || v->type == FS_VOL_ISO || v->image != NULL;
+}
+
+/* Identity of a volume in the cache: its driver instance or SFS root */
+static const void *dcache_vol(const struct fs_volume *v) {
+    if (vol_is_exfat(v)) return v->exfat;
+    if (v->type == FS_VOL_NTFS) return v->ntfs;
+    if (v->type == FS_VOL_FAT32) return v->fat32;
+    if (v->type == FS_VOL_ISO) return v->iso;
+    return v->root;
+}
+
+/* Identity of the volume that a NULL root refers to */
+static const void *dcache_cur_vol(void) {
+    return dcache_vol(&s_cur);
+}
+
+static UINT32 dcache_hash(const CHAR16 *path, int *len) {
+    UINT32 h = 2166136261u;
+    int i = 0;
+    while (path[i]) {
+        h = (h ^ path[i]) * 16777619u;
+        i++;
+    }
+    *len = i;
+    return h;
+}
+
+/* Find the entry for (vol, path). With create set, a missing entry is
+   made by evicting the set's oldest. NULL if absent or uncacheable. */
+static struct dcache_ent *dcache_get(const void *vol, const CHAR16 *path,
+                                     int create) {
+    if (!vol || !path) return NULL;
+    int len;
+    UINT32 h = dcache_hash(path, &len);
+    if (len >= DCACHE_PATH_MAX) return NULL;
+
+    struct dcache_ent *set = s_dcache[h & (DCACHE_SETS - 1)];
+    struct dcache_ent *victim = &set[0];
+    for (int w = 0; w < DCACHE_WAYS; w++) {
+        struct dcache_ent *e = &set[w];
+        if (e->vol == vol && e->hash == h) {
+            int i = 0;
+            while (i < len && e->path[i] == path[i]) i++;
+            if (i == len && e->path[len] == 0) {
+                e->stamp = ++s_dcache_clock;
+                return e;
+            }
+        }
+        if (!e->vol || (victim->vol && e->stamp < victim->stamp))
+            victim = e;
+    }
+    if (!create) return NULL;
+
+    victim->vol = vol;
+    victim->hash = h;
+    victim->stamp = ++s_dcache_clock;
+    victim->exists = -1;
+    victim->size_known = 0;
+    victim->size = 0;
+    mem_copy(victim->path, path, (UINTN)(len + 1) * sizeof(CHAR16));
+    return victim;
+}
+
+/* Cached answer for "does path exist": 1, 0, or -1 if not known */
+static int dcache_exists(const void *vol, const CHAR16 *path) {
+    struct dcache_ent *e = dcache_get(vol, path, 0);
+    return e ? e->exists : -1;
+}
+
+static void dcache_set_absent(const void *vol, const CHAR16 *path) {
+    struct dcache_ent *e = dcache_get(vol, path, 1);
+    if (!e) return;
+    e->exists = 0;
+    e->size_known = 1;
+    e->size = 0;
+}
+
+static void dcache_set_present(const void *vol, const CHAR16 *path,
+                               int size_known, UINT64 size) {
+    struct dcache_ent *e = dcache_get(vol, path, 1);
+    if (!e) return;
+    e->exists = 1;
+    if (size_known) {
+        e->size_known = 1;
+        e->size = size;
+    }
+}
+
+/* ---- Mounting custom volumes ---- */
+
+static void streams_detach_all(struct fs_volume *v);
+struct image_dev;
+static void image_dev_close(struct image_dev *d);
+
+/* ---- RAM disk ---- */
+
+/* MEM_BUDGET_RAMDISK (half of RAM), formatted on first use; chunks are
+   only taken as files fill it. The contents last until the machine is
+   switched off. */
+static struct ramdisk *s_ram;
+
+static UINT64 ram_size(void) {
+    return mem_budget(MEM_BUDGET_RAMDISK);
+}
+
+static struct ramdisk *ram_open(void) {
+    if (s_ram) return s_ram;
+    struct ramdisk *rd = ramdisk_create(ram_size());
+    if (!rd) return NULL;
+    if (exfat_format(ramdisk_write, rd, RAMDISK_BLOCK,
+                     ramdisk_size(rd) / RAMDISK_BLOCK, "RAMDISK", 0) != 0) {
+        ramdisk_destroy(rd);
+        return NULL;
+    }
+    s_ram = rd;
+    return rd;
+}
+
+int fs_ram_active(void) {
+    return s_ram != NULL;
+}
+
+/* Mount handle on v with the driver for type (the RAM disk with a NULL
+   handle). Returns 0 on success. */
+static int vol_mount(struct fs_volume *v, enum fs_vol_type type,
+                     EFI_HANDLE handle) {
+    if (type == FS_VOL_RAM) {
+        int tag = mem_tag_set(MEM_TAG_FS);
+        struct ramdisk *rd = ram_open();
+        if (rd)
+            v->exfat = exfat_mount(ramdisk_read, ramdisk_write, rd,
+                                   RAMDISK_BLOCK);
+        mem_tag_set(tag);
+        if (!v->exfat) return -1;
+        /* Memory to memory: let data runs go through in one piece */
+        exfat_set_max_transfer(v->exfat, RAMDISK_CHUNK);
+        v->type = FS_VOL_RAM;
+        v->handle = NULL;       /* and no bio: nothing to flush */
+        return 0;
+    }
+
+    /* Get BlockIO from the handle */
+    EFI_GUID bio_guid = EFI_BLOCK_IO_PROTOCOL_GUID;
+    EFI_BLOCK_IO *bio = NULL;
+    EFI_STATUS st = g_boot.bs->HandleProtocol(
+        handle, &bio_guid, (void **)&bio);
+    if (EFI_ERROR(st) || !bio || !bio->Media)
+        return -1;
+    bio = disk_volume_bio(handle, bio);
+
+    /* Set up BlockIO context for callbacks */
+    v->bio = (struct bio_ctx *)mem_alloc(sizeof(struct bio_ctx));
+    if (!v->bio)
+        return -1;
+    v->bio->bio = bio;
+    v->bio->media_id = bio->Media->MediaId;
+    v->bio->wb = NULL;
+    UINT32 block_size = bio->Media->BlockSize;
+
+    /* The mount's caches and tables stay charged to the fs tag */
+    int tag = mem_tag_set(MEM_TAG_FS);
+    if (type == FS_VOL_EXFAT) {
+        v->exfat = exfat_mount(bio_read_cb, bio_write_cb,
+                               v->bio, block_size);
+        if (v->exfat) v->type = FS_VOL_EXFAT;
+    } else if (type == FS_VOL_NTFS) {
+        v->ntfs = ntfs_mount(bio_read_cb, v->bio, block_size);
+        if (v->ntfs) v->type = FS_VOL_NTFS;
+    } else if (type == FS_VOL_FAT32) {
+        v->fat32 = fat32_mount(bio_read_cb, bio_write_cb,
+                               v->bio, block_size);
+        if (v->fat32) v->type = FS_VOL_FAT32;
+    } else if (type == FS_VOL_ISO) {
+        v->iso = iso9660_mount(bio_read_cb, v->bio, block_size);
+        if (v->iso) v->type = FS_VOL_ISO;
+    }
+    mem_tag_set(tag);
+    if (v->type == FS_VOL_SFS) {
+        mem_free(v->bio);
+        v->bio = NULL;
+        return -1;
+    }
+
+    v->handle = handle;
     return 0;
 }
 
-/* ---- Unmount any active custom volume ---- */
+/* Finish v's streams and unmount its driver, if any */
+static void vol_unmount(struct fs_volume *v) {
+    v->batch = 0;           /* unmounting writes everything back */
+    streams_detach_all(v);
+    fs_cache_invalidate();
+    if (v->exfat) {
+        exfat_unmount(v->exfat);
+        v->exfat = NULL;
+        bio_barrier(v, 0);
+    }
+    if (v->ntfs) {
+        ntfs_unmount(v->ntfs);
+        v->ntfs = NULL;
+    }
+    if (v->fat32) {
+        fat32_unmount(v->fat32);
+        v->fat32 = NULL;
+        bio_barrier(v, 0);
+        /* The firmware FAT driver may hold the old FAT and directories
+           in memory; make it re-read the volume we changed under it. */
+        EFI_GUID sfs_guid = EFI_SIMPLE_FILE_SYSTEM_PROTOCOL_GUID;
+        void *sfs = NULL;
+        if (v->bio && v->bio->wrote &&
+            !EFI_ERROR(g_boot.bs->HandleProtocol(v->handle,
+                                                 &sfs_guid, &sfs))) {
+            g_boot.bs->DisconnectController(v->handle, NULL, NULL);
+            g_boot.bs->ConnectController(v->handle, NULL, NULL, TRUE);
+        }
+    }
+    if (v->iso) {
+        iso9660_unmount(v->iso);
+        v->iso = NULL;
+    }
+    if (v->image) {
+        image_dev_close(v->image);
+        v->image = NULL;
+    }
+    if (v->host) {
+        /* Leaving an image for another volume: the one it was on goes */
+        struct fs_volume *host = v->host;
+        v->host = NULL;
+        fs_volume_close(host);
+    }
+    if (v->bio) {
+        fs_volume_write_behind(v, 0);
+        mem_free(v->bio);
+        v->bio = NULL;
+    }
+    v->type = FS_VOL_SFS;
+    v->handle = NULL;
+}
 
 static void unmount_custom(void) {
-    if (s_exfat) {
-        exfat_unmount(s_exfat);
-        s_exfat = NULL;
+    vol_unmount(&s_cur);
+}
+
+/* ---- Boot volume preload ---- */
+
+/* On SD-card boards every probe and read of the boot volume costs
+   milliseconds. fs_preload_boot() walks the volume once and indexes
+   every path, holding the contents of small files; lookups and reads
+   of the boot root are then answered from memory. Writes still go to
+   the card and update the index as they land, so a path missing from
+   it does not exist. Paths the index does not model (8.3 aliases,
+   "." and "..", non-ASCII names) fall through to the firmware. */
+#define PRE_BUCKETS   4096
+#define PRE_PATH_MAX  260
+#define PRE_MAX_DEPTH 32
+
+/* File contents held in memory, shared by the index and memory streams */
+struct pre_data {
+    UINT32 refs;
+    UINT64 size;
+    UINT8 *bytes;
+};
+
+struct pre_ent {
+    struct pre_ent *next;   /* hash chain */
+    UINT32 hash;
+    UINT8  is_dir;
+    UINT8  size_known;
+    UINT64 size;
+    struct pre_data *data;  /* NULL: read from the volume */
+    CHAR16 *key;            /* folded path, stored after the entry */
+};
+
+static struct {
+    struct pre_ent **buckets;   /* NULL while not preloaded */
+    UINT64 bytes;               /* contents held */
+    UINT64 limit;
+    UINT32 files;
+} s_pre;
+
+/* The index key of path: upper-cased, no trailing backslash. Returns
+   its length, or -1 for a path the index does not model. */
+static int pre_key(const CHAR16 *path, CHAR16 *key) {
+    if (!path || path[0] != L'\\') return -1;
+    int n = 0, i = 0;
+    while (path[i]) {
+        i++;                    /* the backslash */
+        if (!path[i]) break;    /* trailing */
+        int start = i;
+        while (path[i] && path[i] != L'\\') {
+            CHAR16 c = path[i];
+            if (c < 0x20 || c >= 0x7F || c == L'/' || c == L'~') return -1;
+            i++;
+        }
+        /* Empty components, "." and ".." and the trailing dots and
+           spaces FAT ignores */
+        if (i == start || path[i - 1] == L'.' || path[i - 1] == L' ')
+            return -1;
+        if (n + 1 + (i - start) >= PRE_PATH_MAX) return -1;
+        key[n++] = L'\\';
+        for (int j = start; j < i; j++) {
+            CHAR16 c = path[j];
+            key[n++] = (c >= L'a' && c <= L'z') ? (CHAR16)(c - 32) : c;
+        }
+    }
+    if (n == 0) key[n++] = L'\\';
+    key[n] = 0;
+    return n;
+}
+
+static UINT32 pre_hash(const CHAR16 *key) {
+    int len;
+    return dcache_hash(key, &len);
+}
+
+static struct pre_ent *pre_find(const CHAR16 *key) {
+    UINT32 h = pre_hash(key);
+    for (struct pre_ent *e = s_pre.buckets[h & (PRE_BUCKETS - 1)]; e; e = e->next) {
+        if (e->hash != h) continue;
+        int i = 0;
+        while (e->key[i] && e->key[i] == key[i]) i++;
+        if (e->key[i] == key[i]) return e;
+    }
+    return NULL;
+}
+
+static void pre_data_put(struct pre_data *pd) {
+    if (pd && --pd->refs == 0) mem_free(pd);
+}
+
+/* Drop an entry's contents (it will be read from the volume) */
+static void pre_drop_data(struct pre_ent *e) {
+    if (!e->data) return;
+    s_pre.bytes -= e->data->size;
+    pre_data_put(e->data);
+    e->data = NULL;
+}
+
+/* Hold size bytes as e's contents if they fit the budget */
+static void pre_set_data(struct pre_ent *e, const void *bytes, UINT64 size) {
+    pre_drop_data(e);
+    if (size == 0 || size > FS_PRELOAD_FILE_MAX ||
+        s_pre.bytes + size > s_pre.limit)
+        return;
+    struct pre_data *pd = (struct pre_data *)mem_alloc_raw(
+        sizeof(struct pre_data) + (UINTN)size);
+    if (!pd) {
+        s_pre.limit = mem_budget_shrink(MEM_BUDGET_PRELOAD);
+        return;
+    }
+    pd->refs = 1;
+    pd->size = size;
+    pd->bytes = (UINT8 *)(pd + 1);
+    mem_copy(pd->bytes, bytes, (UINTN)size);
+    e->data = pd;
+    s_pre.bytes += size;
+}
+
+/* The entry for key, made empty if missing. NULL if out of memory. */
+static struct pre_ent *pre_put(const CHAR16 *key, int len) {
+    struct pre_ent *e = pre_find(key);
+    if (e) return e;
+    e = (struct pre_ent *)mem_alloc(sizeof(struct pre_ent) +
+                                    (UINTN)(len + 1) * sizeof(CHAR16));
+    if (!e) return NULL;
+    e->key = (CHAR16 *)(e + 1);
+    mem_copy(e->key, key, (UINTN)(len + 1) * sizeof(CHAR16));
+    e->hash = pre_hash(key);
+    struct pre_ent **b = &s_pre.buckets[e->hash & (PRE_BUCKETS - 1)];
+    e->next = *b;
+    *b = e;
+    return e;
+}
+
+static void pre_remove(const CHAR16 *key) {
+    UINT32 h = pre_hash(key);
+    struct pre_ent **pp = &s_pre.buckets[h & (PRE_BUCKETS - 1)];
+    struct pre_ent *e = pre_find(key);
+    if (!e) return;
+    while (*pp != e) pp = &(*pp)->next;
+    *pp = e->next;
+    pre_drop_data(e);
+    mem_free(e);
+}
+
+/* Stop serving from memory (streams already open keep their data) */
+static void pre_disable(void) {
+    if (!s_pre.buckets) return;
+    for (int b = 0; b < PRE_BUCKETS; b++) {
+        while (s_pre.buckets[b]) {
+            struct pre_ent *e = s_pre.buckets[b];
+            s_pre.buckets[b] = e->next;
+            pre_drop_data(e);
+            mem_free(e);
+        }
+    }
+    mem_free(s_pre.buckets);
+    s_pre.buckets = NULL;
+}
+
+/* Is v the preloaded boot volume */
+static int pre_on(const struct fs_volume *v) {
+    return s_pre.buckets && v->type == FS_VOL_SFS && v->root &&
+           v->root == s_boot_root;
+}
+
+/* What the index says about path on v: 1 with *out set, 0 if it does
+   not exist, -1 if the volume must be asked */
+static int pre_lookup(const struct fs_volume *v, const CHAR16 *path,
+                      struct pre_ent **out) {
+    CHAR16 key[PRE_PATH_MAX];
+    if (!pre_on(v) || pre_key(path, key) < 0) return -1;
+    *out = pre_find(key);
+    return *out != NULL;
+}
+
+/* The key of a path being written, or -1 after giving up on the index
+   (a change it cannot follow) */
+static int pre_write_key(const struct fs_volume *v, const CHAR16 *path,
+                         CHAR16 *key) {
+    if (!pre_on(v)) return -1;
+    int len = pre_key(path, key);
+    if (len < 0) pre_disable();
+    return len;
+}
+
+/* path on v was (re)written: with size unknown, or holding data */
+static void pre_note_file(const struct fs_volume *v, const CHAR16 *path,
+                          const void *data, UINT64 size, int size_known) {
+    CHAR16 key[PRE_PATH_MAX];
+    int len = pre_write_key(v, path, key);
+    if (len < 0) return;
+    struct pre_ent *e = pre_put(key, len);
+    if (!e) { pre_disable(); return; }
+    e->is_dir = 0;
+    e->size_known = (UINT8)size_known;
+    e->size = size_known ? size : 0;
+    if (data) pre_set_data(e, data, size);
+    else pre_drop_data(e);
+}
+
+/* path on v no longer exists */
+static void pre_note_gone(const struct fs_volume *v, const CHAR16 *path) {
+    CHAR16 key[PRE_PATH_MAX];
+    if (pre_write_key(v, path, key) >= 0) pre_remove(key);
+}
+
+/* Directory path on v exists, with any parents it needed */
+static void pre_note_dir(const struct fs_volume *v, const CHAR16 *path) {
+    CHAR16 key[PRE_PATH_MAX];
+    int len = pre_write_key(v, path, key);
+    for (int i = 1; i <= len; i++) {
+        if (key[i] != L'\\' && key[i] != 0) continue;
+        CHAR16 c = key[i];
+        key[i] = 0;
+        if (!pre_find(key)) {
+            struct pre_ent *e = pre_put(key, i);
+            if (!e) { pre_disable(); return; }
+            e->is_dir = 1;
+        }
+        key[i] = c;
+    }
+}
+
+/* File path on v was renamed to new_name in the same directory */
+static void pre_note_rename(const struct fs_volume *v, const CHAR16 *path,
+                            const CHAR16 *new_name) {
+    CHAR16 key[PRE_PATH_MAX], npath[PRE_PATH_MAX], nkey[PRE_PATH_MAX];
+    if (pre_write_key(v, path, key) < 0) return;
+
+    /* Directories would move their whole subtree */
+    struct pre_ent *e = pre_find(key);
+    int n = 0, cut = 0;
+    while (path[n] && n < PRE_PATH_MAX - 1) {
+        if (path[n] == L'\\') cut = n;
+        npath[n] = path[n];
+        n++;
+    }
+    n = cut + 1;
+    for (int i = 0; new_name[i] && n < PRE_PATH_MAX - 1; i++)
+        npath[n++] = new_name[i];
+    npath[n] = 0;
+    int nlen = pre_key(npath, nkey);
+    struct pre_ent *ne = (e && !e->is_dir && nlen > 0) ? pre_put(nkey, nlen) : NULL;
+    if (!ne) { pre_disable(); return; }
+    if (ne == e) return;        /* only the case changed */
+    ne->is_dir = 0;
+    ne->size_known = e->size_known;
+    ne->size = e->size;
+    pre_drop_data(ne);
+    ne->data = e->data;         /* keeps its share of s_pre.bytes */
+    e->data = NULL;
+    pre_remove(key);
+}
+
+/* Index the directory open as dir, whose path is path[0..len): every
+   entry, with the contents of files that fit. info is scratch for the
+   whole walk. Returns 0, or -1 if it could not be walked completely. */
+static int pre_walk(EFI_FILE_HANDLE dir, CHAR16 *path, int len, int depth,
+                    EFI_FILE_INFO *info, UINTN info_size) {
+    CHAR16 key[PRE_PATH_MAX];
+    for (;;) {
+        UINTN n = info_size;
+        if (EFI_ERROR(dir->Read(dir, &n, info))) return -1;
+        if (n == 0) return 0;
+
+        CHAR16 *name = info->FileName;
+        if (name[0] == L'.' &&
+            (name[1] == 0 || (name[1] == L'.' && name[2] == 0)))
+            continue;
+
+        int plen = len == 1 ? 1 : len + 1;
+        int i = 0;
+        if (len > 1) path[len] = L'\\';
+        while (name[i] && plen < PRE_PATH_MAX - 1) path[plen++] = name[i++];
+        path[plen] = 0;
+        int klen = name[i] ? -1 : pre_key(path, key);
+        /* A path no lookup can spell, nor anything below it */
+        if (klen < 0) { path[len] = 0; continue; }
+
+        struct pre_ent *e = pre_put(key, klen);
+        if (!e) return -1;
+        EFI_FILE_HANDLE h = NULL;
+        if (info->Attribute & EFI_FILE_DIRECTORY) {
+            e->is_dir = 1;
+            if (depth >= PRE_MAX_DEPTH ||
+                EFI_ERROR(dir->Open(dir, &h, name, EFI_FILE_MODE_READ, 0)))
+                return -1;
+            int rc = pre_walk(h, path, plen, depth + 1, info, info_size);
+            h->Close(h);
+            if (rc != 0) return -1;
+        } else {
+            UINT64 size = info->FileSize;
+            e->size_known = 1;
+            e->size = size;
+            s_pre.files++;
+            if (size > 0 && size <= FS_PRELOAD_FILE_MAX &&
+                s_pre.bytes + size <= s_pre.limit &&
+                !EFI_ERROR(dir->Open(dir, &h, name, EFI_FILE_MODE_READ, 0))) {
+                /* Read straight into the held copy */
+                struct pre_data *pd = (struct pre_data *)mem_alloc_raw(
+                    sizeof(struct pre_data) + (UINTN)size);
+                UINTN got = (UINTN)size;
+                if (!pd) {
+                    s_pre.limit = mem_budget_shrink(MEM_BUDGET_PRELOAD);
+                } else {
+                    pd->refs = 1;
+                    pd->size = size;
+                    pd->bytes = (UINT8 *)(pd + 1);
+                    if (EFI_ERROR(h->Read(h, &got, pd->bytes)) || got != size) {
+                        mem_free(pd);
+                    } else {
+                        e->data = pd;
+                        s_pre.bytes += size;
+                    }
+                }
+                h->Close(h);
+            }
+        }
+        path[len] = 0;
+    }
+}
+
+int fs_preload_boot(UINT32 *files, UINT64 *bytes) {
+    *files = 0;
+    *bytes = 0;
+    if (!s_boot_root) return -1;
+    pre_disable();
+
+    s_pre.limit = mem_budget(MEM_BUDGET_PRELOAD);
+    s_pre.bytes = 0;
+    s_pre.files = 0;
+    s_pre.buckets = (struct pre_ent **)mem_alloc(
+        PRE_BUCKETS * sizeof(struct pre_ent *));
+    UINTN info_size = SIZE_OF_EFI_FILE_INFO + PRE_PATH_MAX * sizeof(CHAR16);
+    EFI_FILE_INFO *info = (EFI_FILE_INFO *)mem_alloc(info_size);
+    CHAR16 path[PRE_PATH_MAX];
+    path[0] = L'\\';
+    path[1] = 0;
+
+    struct pre_ent *root = (s_pre.buckets && info) ? pre_put(path, 1) : NULL;
+    EFI_FILE_HANDLE dir = NULL;
+    int rc = -1;
+    if (root && !EFI_ERROR(s_boot_root->Open(s_boot_root, &dir, path,
+                                             EFI_FILE_MODE_READ, 0))) {
+        root->is_dir = 1;
+        rc = pre_walk(dir, path, 1, 0, info, info_size);
+        dir->Close(dir);
     }
-    if (s_ntfs) {
-        ntfs_unmount(s_ntfs);
-        s_ntfs = NULL;
+    if (info) mem_free(info);
+    if (rc != 0) {
+        pre_disable();
+        return -1;
     }
-    s_vol_type = FS_VOL_SFS;
-    s_custom_handle = NULL;
+    *files = s_pre.files;
+    *bytes = s_pre.bytes;
+    return 0;
 }
 
 /* ---- Public API ---- */
@@ -138,56 +892,101 @@ EFI_STATUS fs_init(void) {
     /* Save boot device handle for USB enumeration */
     s_boot_device = loaded_image->DeviceHandle;
 
+    /* Block cache budget for exFAT/NTFS mounts */
+    bcache_set_budget(mem_budget(MEM_BUDGET_BCACHE));
+
     /* Open the root directory */
-    status = sfs->OpenVolume(sfs, &s_root);
+    status = sfs->OpenVolume(sfs, &s_cur.root);
     if (!EFI_ERROR(status))
-        s_boot_root = s_root;
+        s_boot_root = s_cur.root;
     return status;
 }
 
-int fs_readdir(const CHAR16 *path, struct fs_entry *entries, int max_entries) {
-    /* Dispatch to custom driver */
-    if (s_vol_type == FS_VOL_EXFAT && s_exfat) {
-        char apath[512];
-        path_to_ascii(path, apath, 512);
-        return exfat_readdir(s_exfat, apath, entries, max_entries);
-    }
-    if (s_vol_type == FS_VOL_NTFS && s_ntfs) {
+/* ---- Directory cursors ---- */
+
+struct fs_dir {
+    EFI_FILE_HANDLE sfs;
+    void *buf;              /* EFI_FILE_INFO scratch (SFS) */
+    UINTN buf_size;
+    struct exfat_dir *xd;
+    struct fat32_dir *fd;
+    struct iso9660_dir *id;
+    struct dirlist list;    /* whole listing, collected up front (NTFS) */
+    int next;
+};
+
+static int ntfs_list_visit(void *ctx, const struct fs_entry *entry) {
+    return dirlist_add_entry((struct dirlist *)ctx, entry) != 0;
+}
+
+static struct fs_dir *vol_opendir(struct fs_volume *v, const CHAR16 *path) {
+    struct fs_dir *d = (struct fs_dir *)mem_alloc(sizeof(struct fs_dir));
+    if (!d) return NULL;
+
+    if (v->type != FS_VOL_SFS) {
         char apath[512];
+        int ok = 0;
         path_to_ascii(path, apath, 512);
-        return ntfs_readdir(s_ntfs, apath, entries, max_entries);
+        if (vol_is_exfat(v) && v->exfat) {
+            d->xd = exfat_opendir(v->exfat, apath);
+            ok = d->xd != NULL;
+        } else if (v->type == FS_VOL_FAT32 && v->fat32) {
+            d->fd = fat32_opendir(v->fat32, apath);
+            ok = d->fd != NULL;
+        } else if (v->type == FS_VOL_NTFS && v->ntfs) {
+            /* The index walk is recursive, so there is no cursor to hold;
+               the compact list keeps large directories cheap */
+            ok = ntfs_enumdir(v->ntfs, apath, ntfs_list_visit, &d->list) == 0;
+        } else if (v->type == FS_VOL_ISO && v->iso) {
+            d->id = iso9660_opendir(v->iso, apath);
+            ok = d->id != NULL;
+        }
+        if (!ok) { fs_closedir(d); return NULL; }
+        return d;
     }
 
-    /* SFS path */
-    EFI_STATUS status;
-    EFI_FILE_HANDLE dir = NULL;
-    int count = 0;
+    if (!v->root ||
+        EFI_ERROR(v->root->Open(v->root, &d->sfs, (CHAR16 *)path,
+                                EFI_FILE_MODE_READ, 0))) {
+        mem_free(d);
+        return NULL;
+    }
+    d->buf_size = 1024;
+    d->buf = mem_alloc(d->buf_size);
+    if (!d->buf) { fs_closedir(d); return NULL; }
+    return d;
+}
 
-    /* Open the directory */
-    status = s_root->Open(s_root, &dir, (CHAR16 *)path,
-                          EFI_FILE_MODE_READ, 0);
-    if (EFI_ERROR(status))
-        return -1;
+struct fs_dir *fs_opendir(const CHAR16 *path) {
+    return vol_opendir(&s_cur, path);
+}
 
-    /* Allocate scratch buffer for variable-size EFI_FILE_INFO */
-    UINTN buf_size = 1024;
-    void *buf = mem_alloc(buf_size);
-    if (!buf) {
-        dir->Close(dir);
-        return -1;
+int fs_readdir_next(struct fs_dir *d, struct fs_entry *out) {
+    if (!d || !out) return -1;
+    if (d->xd) return exfat_readdir_next(d->xd, out);
+    if (d->fd) return fat32_readdir_next(d->fd, out);
+    if (d->id) return iso9660_readdir_next(d->id, out);
+    if (!d->sfs) {
+        if (d->next >= d->list.count) return 0;
+        dirlist_get(&d->list, d->next++, out);
+        return 1;
     }
 
-    /* Read entries one at a time */
     for (;;) {
-        UINTN read_size = buf_size;
-        status = dir->Read(dir, &read_size, buf);
-
-        if (EFI_ERROR(status))
-            break;
-        if (read_size == 0)
-            break;  /* no more entries */
+        UINTN read_size = d->buf_size;
+        EFI_STATUS status = d->sfs->Read(d->sfs, &read_size, d->buf);
+        if (status == EFI_BUFFER_TOO_SMALL && read_size > d->buf_size) {
+            void *nb = mem_alloc(read_size);
+            if (!nb) return -1;
+            mem_free(d->buf);
+            d->buf = nb;
+            d->buf_size = read_size;
+            continue;
+        }
+        if (EFI_ERROR(status)) return -1;
+        if (read_size == 0) return 0;  /* no more entries */
 
-        EFI_FILE_INFO *info = (EFI_FILE_INFO *)buf;
+        EFI_FILE_INFO *info = (EFI_FILE_INFO *)d->buf;
 
         /* Skip "." and ".." */
         if (info->FileName[0] == L'.' &&
@@ -195,33 +994,80 @@ int fs_readdir(const CHAR16 *path, struct fs_entry *entries, int max_entries) {
              (info->FileName[1] == L'.' && info->FileName[2] == 0)))
             continue;
 
-        if (count >= max_entries)
-            break;
-
-        char16_to_ascii(info->FileName, entries[count].name, FS_MAX_NAME);
-        entries[count].size = info->FileSize;
-        entries[count].is_dir = (info->Attribute & EFI_FILE_DIRECTORY) ? 1 : 0;
-        count++;
+        char16_to_ascii(info->FileName, out->name, FS_MAX_NAME);
+        out->size = info->FileSize;
+        out->is_dir = (info->Attribute & EFI_FILE_DIRECTORY) ? 1 : 0;
+        EFI_TIME *t = &info->ModificationTime;
+        out->mtime = t->Year >= 1980 && t->Year < 2108
+                     ? FS_DOS_TIME(t->Year, t->Month, t->Day,
+                                   t->Hour, t->Minute, t->Second)
+                     : 0;
+        t = &info->CreateTime;
+        out->ctime = t->Year >= 1980 && t->Year < 2108
+                     ? FS_DOS_TIME(t->Year, t->Month, t->Day,
+                                   t->Hour, t->Minute, t->Second)
+                     : 0;
+        out->attr = (UINT8)(info->Attribute & 0x27);
+        out->id = 0;   /* that the firmware does not say */
+        return 1;
     }
+}
 
-    mem_free(buf);
-    dir->Close(dir);
+void fs_closedir(struct fs_dir *d) {
+    if (!d) return;
+    if (d->xd) exfat_closedir(d->xd);
+    if (d->fd) fat32_closedir(d->fd);
+    if (d->id) iso9660_closedir(d->id);
+    if (d->sfs) d->sfs->Close(d->sfs);
+    if (d->buf) mem_free(d->buf);
+    dirlist_free(&d->list);
+    mem_free(d);
+}
+
+int fs_readdir(const CHAR16 *path, struct fs_entry *entries, int max_entries) {
+    struct fs_dir *d = fs_opendir(path);
+    if (!d) return -1;
+
+    int count = 0;
+    while (count < max_entries && fs_readdir_next(d, &entries[count]) > 0)
+        count++;
+    fs_closedir(d);
 
-    sort_entries(entries, count);
+    dirsort_entries(entries, count);
     return count;
 }
 
 void *fs_readfile(const CHAR16 *path, UINTN *out_size) {
-    /* Dispatch to custom driver */
-    if (s_vol_type == FS_VOL_EXFAT && s_exfat) {
-        char apath[512];
-        path_to_ascii(path, apath, 512);
-        return exfat_readfile(s_exfat, apath, out_size);
+    struct pre_ent *pe;
+    int pre = pre_lookup(&s_cur, path, &pe);
+    if (pre == 1 && pe->data) {
+        void *copy = mem_alloc_raw((UINTN)pe->data->size);
+        *out_size = copy ? (UINTN)pe->data->size : 0;
+        if (copy) mem_copy(copy, pe->data->bytes, *out_size);
+        return copy;
     }
-    if (s_vol_type == FS_VOL_NTFS && s_ntfs) {
+
+    const void *vol = dcache_cur_vol();
+    if (pre == 0 || dcache_exists(vol, path) == 0) {
+        *out_size = 0;
+        return NULL;
+    }
+
+    /* Dispatch to custom driver */
+    if (s_cur.type != FS_VOL_SFS) {
         char apath[512];
+        void *data = NULL;
         path_to_ascii(path, apath, 512);
-        return ntfs_readfile(s_ntfs, apath, out_size);
+        if (vol_is_exfat(&s_cur) && s_cur.exfat)
+            data = exfat_readfile(s_cur.exfat, apath, out_size);
+        else if (s_cur.type == FS_VOL_NTFS && s_cur.ntfs)
+            data = ntfs_readfile(s_cur.ntfs, apath, out_size);
+        else if (s_cur.type == FS_VOL_FAT32 && s_cur.fat32)
+            data = fat32_readfile(s_cur.fat32, apath, out_size);
+        else if (s_cur.type == FS_VOL_ISO && s_cur.iso)
+            data = iso9660_readfile(s_cur.iso, apath, out_size);
+        if (data) dcache_set_present(vol, path, 1, *out_size);
+        return data;
     }
 
     /* SFS path */
@@ -231,14 +1077,16 @@ void *fs_readfile(const CHAR16 *path, UINTN *out_size) {
     *out_size = 0;
 
     /* Guard against uninitialized filesystem */
-    if (!s_root)
+    if (!s_cur.root)
         return NULL;
 
     /* Open the file */
-    status = s_root->Open(s_root, &file, (CHAR16 *)path,
-                          EFI_FILE_MODE_READ, 0);
-    if (EFI_ERROR(status))
+    status = s_cur.root->Open(s_cur.root, &file, (CHAR16 *)path,
+                              EFI_FILE_MODE_READ, 0);
+    if (EFI_ERROR(status)) {
+        if (status == EFI_NOT_FOUND) dcache_set_absent(vol, path);
         return NULL;
+    }
 
     /* Get file size via GetInfo */
     EFI_GUID info_guid = EFI_FILE_INFO_ID;
@@ -285,58 +1133,71 @@ void *fs_readfile(const CHAR16 *path, UINTN *out_size) {
     }
 
     *out_size = read_size;
+    dcache_set_present(vol, path, 1, read_size);
     return data;
 }
 
+static int vol_space(struct fs_volume *v, UINT64 *total_bytes, UINT64 *free_bytes) {
+    if (vol_is_exfat(v) && v->exfat)
+        return exfat_volume_info(v->exfat, total_bytes, free_bytes);
+    if (v->type == FS_VOL_NTFS && v->ntfs)
+        return ntfs_volume_info(v->ntfs, total_bytes, free_bytes);
+    if (v->type == FS_VOL_FAT32 && v->fat32)
+        return fat32_volume_info(v->fat32, total_bytes, free_bytes);
+    if (v->type == FS_VOL_ISO && v->iso)
+        return iso9660_volume_info(v->iso, total_bytes, free_bytes);
+
+    return fs_root_volume_info(v->root, total_bytes, free_bytes);
+}
+
 int fs_volume_info(UINT64 *total_bytes, UINT64 *free_bytes) {
-    if (s_vol_type == FS_VOL_EXFAT && s_exfat)
-        return exfat_volume_info(s_exfat, total_bytes, free_bytes);
-    if (s_vol_type == FS_VOL_NTFS && s_ntfs)
-        return ntfs_volume_info(s_ntfs, total_bytes, free_bytes);
+    return vol_space(&s_cur, total_bytes, free_bytes);
+}
 
-    if (!s_root) return -1;
+UINT64 fs_file_size(const CHAR16 *path) {
+    struct pre_ent *pe;
+    int pre = pre_lookup(&s_cur, path, &pe);
+    if (pre == 0) return 0;
+    if (pre == 1 && pe->size_known) return pe->size;
 
-    EFI_GUID fsi_guid = EFI_FILE_SYSTEM_INFO_ID;
-    UINTN buf_size = 0;
+    const void *vol = dcache_cur_vol();
+    struct dcache_ent *e = dcache_get(vol, path, 0);
+    if (e && e->size_known) return e->size;
 
-    /* First call to get required size */
-    s_root->GetInfo(s_root, &fsi_guid, &buf_size, NULL);
-    if (buf_size == 0) return -1;
+    if (s_cur.type != FS_VOL_SFS) {
+        char apath[512];
+        UINT64 size = 0;
+        path_to_ascii(path, apath, 512);
+        if (vol_is_exfat(&s_cur) && s_cur.exfat)
+            size = exfat_file_size(s_cur.exfat, apath);
+        else if (s_cur.type == FS_VOL_NTFS && s_cur.ntfs)
+            size = ntfs_file_size(s_cur.ntfs, apath);
+        else if (s_cur.type == FS_VOL_FAT32 && s_cur.fat32)
+            size = fat32_file_size(s_cur.fat32, apath);
+        else if (s_cur.type == FS_VOL_ISO && s_cur.iso)
+            size = iso9660_file_size(s_cur.iso, apath);
+        else
+            return 0;
+        /* 0 is also "not found", so it says nothing about existence */
+        e = dcache_get(vol, path, 1);
+        if (e) {
+            e->size_known = 1;
+            e->size = size;
+            if (size) e->exists = 1;
+        }
+        return size;
+    }
 
-    EFI_FILE_SYSTEM_INFO *info = (EFI_FILE_SYSTEM_INFO *)mem_alloc(buf_size);
-    if (!info) return -1;
+    if (!s_cur.root) return 0;
 
-    EFI_STATUS status = s_root->GetInfo(s_root, &fsi_guid, &buf_size, info);
+    EFI_FILE_HANDLE file = NULL;
+    EFI_STATUS status = s_cur.root->Open(s_cur.root, &file, (CHAR16 *)path,
+                                         EFI_FILE_MODE_READ, 0);
     if (EFI_ERROR(status)) {
-        mem_free(info);
-        return -1;
+        if (status == EFI_NOT_FOUND) dcache_set_absent(vol, path);
+        return 0;
     }
 
-    *total_bytes = info->VolumeSize;
-    *free_bytes = info->FreeSpace;
-    mem_free(info);
-    return 0;
-}
-
-UINT64 fs_file_size(const CHAR16 *path) {
-    if (s_vol_type == FS_VOL_EXFAT && s_exfat) {
-        char apath[512];
-        path_to_ascii(path, apath, 512);
-        return exfat_file_size(s_exfat, apath);
-    }
-    if (s_vol_type == FS_VOL_NTFS && s_ntfs) {
-        char apath[512];
-        path_to_ascii(path, apath, 512);
-        return ntfs_file_size(s_ntfs, apath);
-    }
-
-    if (!s_root) return 0;
-
-    EFI_FILE_HANDLE file = NULL;
-    EFI_STATUS status = s_root->Open(s_root, &file, (CHAR16 *)path,
-                                      EFI_FILE_MODE_READ, 0);
-    if (EFI_ERROR(status)) return 0;
-
     EFI_GUID info_guid = EFI_FILE_INFO_ID;
     UINTN info_size = 0;
     file->GetInfo(file, &info_guid, &info_size, NULL);
@@ -345,49 +1206,111 @@ UINT64 fs_file_size(const CHAR16 *path) {
 
     status = file->GetInfo(file, &info_guid, &info_size, info);
     UINT64 size = EFI_ERROR(status) ? 0 : info->FileSize;
+    if (!EFI_ERROR(status)) dcache_set_present(vol, path, 1, size);
     mem_free(info);
     file->Close(file);
     return size;
 }
 
 int fs_exists(const CHAR16 *path) {
-    if (s_vol_type == FS_VOL_EXFAT && s_exfat) {
-        char apath[512];
-        path_to_ascii(path, apath, 512);
-        return exfat_exists(s_exfat, apath);
-    }
-    if (s_vol_type == FS_VOL_NTFS && s_ntfs) {
+    struct pre_ent *pe;
+    int pre = pre_lookup(&s_cur, path, &pe);
+    if (pre >= 0) return pre;
+
+    const void *vol = dcache_cur_vol();
+    int cached = dcache_exists(vol, path);
+    if (cached >= 0) return cached;
+
+    if (s_cur.type != FS_VOL_SFS) {
         char apath[512];
+        int found;
         path_to_ascii(path, apath, 512);
-        return ntfs_exists(s_ntfs, apath);
+        if (vol_is_exfat(&s_cur) && s_cur.exfat)
+            found = exfat_exists(s_cur.exfat, apath);
+        else if (s_cur.type == FS_VOL_NTFS && s_cur.ntfs)
+            found = ntfs_exists(s_cur.ntfs, apath);
+        else if (s_cur.type == FS_VOL_FAT32 && s_cur.fat32)
+            found = fat32_exists(s_cur.fat32, apath);
+        else if (s_cur.type == FS_VOL_ISO && s_cur.iso)
+            found = iso9660_exists(s_cur.iso, apath);
+        else
+            return 0;
+        if (found) dcache_set_present(vol, path, 0, 0);
+        else dcache_set_absent(vol, path);
+        return found;
     }
 
-    if (!s_root) return 0;
+    if (!s_cur.root) return 0;
     EFI_FILE_HANDLE file = NULL;
-    EFI_STATUS status = s_root->Open(s_root, &file, (CHAR16 *)path,
-                                      EFI_FILE_MODE_READ, 0);
-    if (EFI_ERROR(status)) return 0;
+    EFI_STATUS status = s_cur.root->Open(s_cur.root, &file, (CHAR16 *)path,
+                                         EFI_FILE_MODE_READ, 0);
+    if (EFI_ERROR(status)) {
+        if (status == EFI_NOT_FOUND) dcache_set_absent(vol, path);
+        return 0;
+    }
     file->Close(file);
+    dcache_set_present(vol, path, 0, 0);
     return 1;
 }
 
+int fs_file_entry(const CHAR16 *path, struct fs_entry *out) {
+    CHAR16 dir[512];
+    int i = 0, base = 0;
+    for (; path[i] && i < 511; i++) {
+        dir[i] = path[i];
+        if (path[i] == L'\\') base = i + 1;
+    }
+    if (path[i]) return -1;
+    dir[base > 1 ? base - 1 : 1] = 0;       /* "\\" for the root */
+    if (base == 0) dir[0] = L'\\';
+
+    struct fs_dir *d = fs_opendir(dir);
+    if (!d) return -1;
+    int r;
+    while ((r = fs_readdir_next(d, out)) > 0) {
+        int k = 0;
+        for (;; k++) {
+            char a = out->name[k], b = (char)(path[base + k] & 0x7F);
+            if (a >= 'A' && a <= 'Z') a = (char)(a + 32);
+            if (b >= 'A' && b <= 'Z') b = (char)(b + 32);
+            if (a != b || !a) break;
+        }
+        if (!out->name[k] && !path[base + k]) break;
+    }
+    fs_closedir(d);
+    return r > 0 ? 0 : -1;
+}
+
+const void *fs_volume_key(void) {
+    return dcache_cur_vol();
+}
+
 EFI_STATUS fs_rename(const CHAR16 *path, const CHAR16 *new_name) {
-    if (s_vol_type == FS_VOL_NTFS)
+    if (vol_read_only(&s_cur))
         return EFI_WRITE_PROTECTED;
-    if (s_vol_type == FS_VOL_EXFAT && s_exfat) {
+    fs_wrote(path);
+    if (vol_is_exfat(&s_cur) && s_cur.exfat) {
         char apath[512];
         path_to_ascii(path, apath, 512);
         char aname[256];
         char16_to_ascii(new_name, aname, 256);
-        return exfat_rename(s_exfat, apath, aname) == 0
+        return bio_barrier(&s_cur, exfat_rename(s_cur.exfat, apath, aname)) == 0
+               ? EFI_SUCCESS : EFI_DEVICE_ERROR;
+    }
+    if (s_cur.type == FS_VOL_FAT32 && s_cur.fat32) {
+        char apath[512];
+        path_to_ascii(path, apath, 512);
+        char aname[256];
+        char16_to_ascii(new_name, aname, 256);
+        return bio_barrier(&s_cur, fat32_rename(s_cur.fat32, apath, aname)) == 0
                ? EFI_SUCCESS : EFI_DEVICE_ERROR;
     }
 
-    if (!s_root) return EFI_NOT_READY;
+    if (!s_cur.root) return EFI_NOT_READY;
 
     EFI_FILE_HANDLE file = NULL;
-    EFI_STATUS status = s_root->Open(s_root, &file, (CHAR16 *)path,
-                                      EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE, 0);
+    EFI_STATUS status = s_cur.root->Open(s_cur.root, &file, (CHAR16 *)path,
+                                         EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE, 0);
     if (EFI_ERROR(status)) return status;
 
     /* Get current file info */
@@ -418,6 +1341,7 @@ EFI_STATUS fs_rename(const CHAR16 *path, const CHAR16 *new_name) {
 
     UINTN set_size = (UINTN)info->Size;
     status = file->SetInfo(file, &info_guid, set_size, info);
+    if (!EFI_ERROR(status)) pre_note_rename(&s_cur, path, new_name);
 
     mem_free(info);
     file->Close(file);
@@ -426,12 +1350,12 @@ EFI_STATUS fs_rename(const CHAR16 *path, const CHAR16 *new_name) {
 
 void fs_set_volume(EFI_FILE_HANDLE new_root) {
     unmount_custom();
-    s_root = new_root;
+    s_cur.root = new_root;
 }
 
 void fs_restore_boot_volume(void) {
     unmount_custom();
-    s_root = s_boot_root;
+    s_cur.root = s_boot_root;
 }
 
 int fs_enumerate_usb(struct fs_usb_volume *vols, int max) {
@@ -553,143 +1477,541 @@ int fs_enumerate_usb(struct fs_usb_volume *vols, int max) {
 
 /* ---- Streaming file I/O ---- */
 
-EFI_FILE_HANDLE fs_open_read(EFI_FILE_HANDLE root, const CHAR16 *path, UINT64 *out_size) {
-    if (!root) root = s_root;
-    if (!root) return NULL;
+/* Read window: starts small, doubles on sequential reads */
+#define FS_STREAM_MIN_WINDOW (64 * 1024)
+#define FS_STREAM_MAX_WINDOW (1024 * 1024)
+
+struct fs_file {
+    enum fs_vol_type type;
+    EFI_FILE_HANDLE sfs;
+    struct exfat_file *xf;
+    struct ntfs_file *nf;
+    struct fat32_file *ff;
+    struct iso9660_file *isf;
+    struct pre_data *pd;    /* boot volume file held by the preload */
+    int writable;
+    int truncate;           /* SFS overwrite: cut the file to size on close */
+    int dead;               /* custom volume was unmounted under us */
+    UINT64 size;            /* file size at open (readers) */
+    UINT64 pos;             /* logical position */
+    UINT64 bpos;            /* backend position */
+
+    /* Read-side window buffer */
+    UINT8 *rbuf;
+    UINT32 rcap;
+    UINT32 rlen;
+    UINT64 roff;
+    UINT32 window;
+
+    struct fs_volume *vol;  /* mount of a custom-volume stream */
+    struct fs_file *next;   /* its list of open streams */
+};
 
-    EFI_FILE_HANDLE file = NULL;
-    EFI_STATUS status = root->Open(root, &file, (CHAR16 *)path,
-                                    EFI_FILE_MODE_READ, 0);
-    if (EFI_ERROR(status)) return NULL;
+static void stream_link(struct fs_volume *v, struct fs_file *f) {
+    f->vol = v;
+    f->next = v->streams;
+    v->streams = f;
+}
+
+static void stream_unlink(struct fs_file *f) {
+    struct fs_file **pp = &f->vol->streams;
+    while (*pp) {
+        if (*pp == f) { *pp = f->next; return; }
+        pp = &(*pp)->next;
+    }
+}
 
-    /* Get file size */
+/* Close the driver handle (committing writes) but keep the fs_file */
+/* Cut or extend an open SFS file to size bytes */
+static EFI_STATUS sfs_set_size(EFI_FILE_HANDLE file, UINT64 size) {
     EFI_GUID info_guid = EFI_FILE_INFO_ID;
     UINTN info_size = 0;
     file->GetInfo(file, &info_guid, &info_size, NULL);
     EFI_FILE_INFO *info = (EFI_FILE_INFO *)mem_alloc(info_size);
-    if (!info) { file->Close(file); return NULL; }
+    if (!info) return EFI_OUT_OF_RESOURCES;
+    EFI_STATUS status = file->GetInfo(file, &info_guid, &info_size, info);
+    if (!EFI_ERROR(status) && info->FileSize != size) {
+        info->FileSize = size;
+        status = file->SetInfo(file, &info_guid, info_size, info);
+    }
+    mem_free(info);
+    return status;
+}
 
-    status = file->GetInfo(file, &info_guid, &info_size, info);
-    if (EFI_ERROR(status)) { mem_free(info); file->Close(file); return NULL; }
+static int stream_close_backend(struct fs_file *f) {
+    int rc = 0;
+    if (f->xf) {
+        rc = exfat_close(f->xf);
+        if (f->writable) rc = bio_barrier(f->vol, rc);
+        f->xf = NULL;
+    }
+    if (f->nf) { ntfs_close(f->nf); f->nf = NULL; }
+    if (f->isf) { iso9660_close(f->isf); f->isf = NULL; }
+    if (f->pd) { pre_data_put(f->pd); f->pd = NULL; }
+    if (f->ff) {
+        rc = fat32_close(f->ff);
+        if (f->writable) rc = bio_barrier(f->vol, rc);
+        f->ff = NULL;
+    }
+    if (f->sfs) {
+        if (f->truncate && EFI_ERROR(sfs_set_size(f->sfs, f->size))) rc = -1;
+        if (EFI_ERROR(f->sfs->Flush(f->sfs)) && f->writable) rc = -1;
+        f->sfs->Close(f->sfs);
+        f->sfs = NULL;
+    }
+    return rc;
+}
+
+/* Called before a custom volume goes away: finish and orphan its streams */
+static void streams_detach_all(struct fs_volume *v) {
+    while (v->streams) {
+        struct fs_file *f = v->streams;
+        v->streams = f->next;
+        stream_close_backend(f);
+        f->dead = 1;
+    }
+}
+
+static int stream_backend_seek(struct fs_file *f, UINT64 pos) {
+    int rc;
+    if (f->xf) rc = exfat_seek(f->xf, pos);
+    else if (f->nf) rc = ntfs_seek(f->nf, pos);
+    else if (f->ff) rc = fat32_seek(f->ff, pos);
+    else if (f->isf) rc = iso9660_seek(f->isf, pos);
+    else if (f->pd) rc = pos <= f->pd->size ? 0 : -1;
+    else rc = EFI_ERROR(f->sfs->SetPosition(f->sfs, pos)) ? -1 : 0;
+    if (rc == 0) f->bpos = pos;
+    return rc;
+}
+
+static int stream_backend_read(struct fs_file *f, UINT64 off, void *buf, UINTN *size) {
+    if (f->bpos != off && stream_backend_seek(f, off) != 0) return -1;
+    int rc;
+    if (f->xf) rc = exfat_read(f->xf, buf, size);
+    else if (f->nf) rc = ntfs_read(f->nf, buf, size);
+    else if (f->ff) rc = fat32_read(f->ff, buf, size);
+    else if (f->isf) rc = iso9660_read(f->isf, buf, size);
+    else if (f->pd) {
+        if ((UINT64)*size > f->pd->size - off) *size = (UINTN)(f->pd->size - off);
+        mem_copy(buf, f->pd->bytes + off, *size);
+        rc = 0;
+    }
+    else rc = EFI_ERROR(f->sfs->Read(f->sfs, size, buf)) ? -1 : 0;
+    if (rc != 0) return -1;
+    f->bpos += *size;
+    return 0;
+}
+
+int fs_root_volume_info(EFI_FILE_HANDLE root, UINT64 *total_bytes, UINT64 *free_bytes) {
+    if (!root) return -1;
+
+    EFI_GUID fsi_guid = EFI_FILE_SYSTEM_INFO_ID;
+    UINTN buf_size = 0;
+
+    /* First call to get required size */
+    root->GetInfo(root, &fsi_guid, &buf_size, NULL);
+    if (buf_size == 0) return -1;
+
+    EFI_FILE_SYSTEM_INFO *info = (EFI_FILE_SYSTEM_INFO *)mem_alloc(buf_size);
+    if (!info) return -1;
 
-    *out_size = info->FileSize;
+    EFI_STATUS status = root->GetInfo(root, &fsi_guid, &buf_size, info);
+    if (EFI_ERROR(status)) {
+        mem_free(info);
+        return -1;
+    }
+
+    *total_bytes = info->VolumeSize;
+    *free_bytes = info->FreeSpace;
     mem_free(info);
-    return file;
+    return 0;
 }
 
-EFI_FILE_HANDLE fs_open_write(EFI_FILE_HANDLE root, const CHAR16 *path) {
-    if (!root) root = s_root;
-    if (!root) return NULL;
+static struct fs_file *vol_open_read(struct fs_volume *v, const CHAR16 *path,
+                                     UINT64 *out_size) {
+    struct fs_file *f = (struct fs_file *)mem_alloc(sizeof(struct fs_file));
+    if (!f) return NULL;
+
+    struct pre_ent *pe;
+    int pre = pre_lookup(v, path, &pe);
+    const void *vol = dcache_vol(v);
+    if (pre == 0 || dcache_exists(vol, path) == 0) { mem_free(f); return NULL; }
+
+    if (pre == 1 && pe->data) {
+        f->pd = pe->data;
+        f->pd->refs++;
+        f->size = f->pd->size;
+        f->type = FS_VOL_SFS;
+    } else if (v->type != FS_VOL_SFS) {
+        char apath[512];
+        path_to_ascii(path, apath, 512);
+        if (vol_is_exfat(v) && v->exfat)
+            f->xf = exfat_open(v->exfat, apath, &f->size);
+        else if (v->type == FS_VOL_NTFS && v->ntfs)
+            f->nf = ntfs_open(v->ntfs, apath, &f->size);
+        else if (v->type == FS_VOL_FAT32 && v->fat32)
+            f->ff = fat32_open(v->fat32, apath, &f->size);
+        else if (v->type == FS_VOL_ISO && v->iso)
+            f->isf = iso9660_open(v->iso, apath, &f->size);
+        if (!f->xf && !f->nf && !f->ff && !f->isf) {
+            /* Lets a miss (include-path probe) be cached, unlike
+               other failures */
+            if (v == &s_cur) fs_exists(path);
+            mem_free(f);
+            return NULL;
+        }
+        f->type = v->type;
+        stream_link(v, f);
+    } else {
+        EFI_FILE_HANDLE root = v->root;
+        if (!root) { mem_free(f); return NULL; }
+
+        EFI_FILE_HANDLE file = NULL;
+        EFI_STATUS status = root->Open(root, &file, (CHAR16 *)path,
+                                        EFI_FILE_MODE_READ, 0);
+        if (EFI_ERROR(status)) {
+            if (status == EFI_NOT_FOUND) dcache_set_absent(vol, path);
+            mem_free(f);
+            return NULL;
+        }
+
+        /* Get file size */
+        EFI_GUID info_guid = EFI_FILE_INFO_ID;
+        UINTN info_size = 0;
+        file->GetInfo(file, &info_guid, &info_size, NULL);
+        EFI_FILE_INFO *info = (EFI_FILE_INFO *)mem_alloc(info_size);
+        if (!info) { file->Close(file); mem_free(f); return NULL; }
+
+        status = file->GetInfo(file, &info_guid, &info_size, info);
+        if (EFI_ERROR(status)) {
+            mem_free(info); file->Close(file); mem_free(f);
+            return NULL;
+        }
+
+        f->size = info->FileSize;
+        mem_free(info);
+        f->type = FS_VOL_SFS;
+        f->sfs = file;
+    }
+
+    dcache_set_present(vol, path, 1, f->size);
+    f->window = FS_STREAM_MIN_WINDOW;
+    if (out_size) *out_size = f->size;
+    return f;
+}
+
+/* An explicit SFS root as a volume, for the root-taking calls */
+static void vol_wrap_root(struct fs_volume *v, EFI_FILE_HANDLE root) {
+    mem_set(v, 0, sizeof(*v));
+    v->type = FS_VOL_SFS;
+    v->root = root;
+}
+
+struct fs_file *fs_open_read(EFI_FILE_HANDLE root, const CHAR16 *path, UINT64 *out_size) {
+    struct fs_volume tmp;
+    if (!root) return vol_open_read(&s_cur, path, out_size);
+    vol_wrap_root(&tmp, root);
+    return vol_open_read(&tmp, path, out_size);
+}
+
+/* in_place rewrites an existing file in its own space (exFAT, SFS)
+   rather than deleting and recreating it */
+static struct fs_file *vol_open_write(struct fs_volume *v, const CHAR16 *path,
+                                      int in_place) {
+    if (vol_read_only(v)) return NULL;
+    fs_wrote(path);
+
+    struct fs_file *f = (struct fs_file *)mem_alloc(sizeof(struct fs_file));
+    if (!f) return NULL;
+    f->writable = 1;
 
-    /* Delete existing file first */
+    if (vol_is_exfat(v)) {
+        char apath[512];
+        path_to_ascii(path, apath, 512);
+        f->xf = !v->exfat ? NULL : in_place ? exfat_overwrite(v->exfat, apath)
+                                            : exfat_create(v->exfat, apath);
+        if (!f->xf) { mem_free(f); return NULL; }
+        f->type = FS_VOL_EXFAT;
+        stream_link(v, f);
+        return f;
+    }
+    if (v->type == FS_VOL_FAT32) {
+        char apath[512];
+        path_to_ascii(path, apath, 512);
+        f->ff = v->fat32 ? fat32_create(v->fat32, apath) : NULL;
+        if (!f->ff) { mem_free(f); return NULL; }
+        f->type = FS_VOL_FAT32;
+        stream_link(v, f);
+        return f;
+    }
+
+    EFI_FILE_HANDLE root = v->root;
+    if (!root) { mem_free(f); return NULL; }
+
+    /* Delete existing file first, or keep it to write over */
     EFI_FILE_HANDLE file = NULL;
     EFI_STATUS status = root->Open(root, &file, (CHAR16 *)path,
                                     EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE, 0);
-    if (!EFI_ERROR(status)) {
-        file->Delete(file);
-        file = NULL;
+    if (!EFI_ERROR(status) && in_place) {
+        f->truncate = 1;        /* close cuts off what was not rewritten */
+    } else {
+        if (!EFI_ERROR(status)) {
+            file->Delete(file);
+            file = NULL;
+        }
+
+        /* Create fresh */
+        status = root->Open(root, &file, (CHAR16 *)path,
+                             EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE |
+                             EFI_FILE_MODE_CREATE, 0);
+    }
+    if (EFI_ERROR(status)) {
+        if (pre_on(v)) pre_disable();   /* the old file may be gone */
+        mem_free(f);
+        return NULL;
     }
+    pre_note_file(v, path, NULL, 0, 0);
+    f->type = FS_VOL_SFS;
+    f->sfs = file;
+    return f;
+}
 
-    /* Create fresh */
-    status = root->Open(root, &file, (CHAR16 *)path,
-                         EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE |
-                         EFI_FILE_MODE_CREATE, 0);
-    if (EFI_ERROR(status)) return NULL;
-    return file;
+struct fs_file *fs_open_write(EFI_FILE_HANDLE root, const CHAR16 *path) {
+    struct fs_volume tmp;
+    if (!root) return vol_open_write(&s_cur, path, 0);
+    vol_wrap_root(&tmp, root);
+    return vol_open_write(&tmp, path, 0);
 }
 
-int fs_stream_read(EFI_FILE_HANDLE file, void *buf, UINTN *size) {
-    EFI_STATUS status = file->Read(file, size, buf);
-    return EFI_ERROR(status) ? -1 : 0;
+struct fs_file *fs_open_overwrite(EFI_FILE_HANDLE root, const CHAR16 *path) {
+    struct fs_volume tmp;
+    if (!root) return vol_open_write(&s_cur, path, 1);
+    vol_wrap_root(&tmp, root);
+    return vol_open_write(&tmp, path, 1);
 }
 
-int fs_stream_write(EFI_FILE_HANDLE file, const void *buf, UINTN size) {
-    UINTN write_size = size;
-    EFI_STATUS status = file->Write(file, &write_size, (void *)buf);
-    return EFI_ERROR(status) ? -1 : 0;
+int fs_stream_read(struct fs_file *f, void *buf, UINTN *size) {
+    if (!f || !size || f->writable || f->dead) return -1;
+
+    UINTN want = *size;
+    if (f->pos >= f->size) want = 0;
+    else if ((UINT64)want > f->size - f->pos) want = (UINTN)(f->size - f->pos);
+
+    UINT8 *dst = (UINT8 *)buf;
+    UINTN got = 0;
+    while (got < want) {
+        /* Serve from the window first */
+        if (f->pos >= f->roff && f->pos < f->roff + f->rlen) {
+            UINTN n = (UINTN)(f->roff + f->rlen - f->pos);
+            if (n > want - got) n = want - got;
+            mem_copy(dst + got, f->rbuf + (f->pos - f->roff), n);
+            got += n;
+            f->pos += n;
+            continue;
+        }
+
+        /* Sequential access grows the window, a jump resets it */
+        if (f->rlen > 0 && f->pos == f->roff + f->rlen) {
+            if (f->window < FS_STREAM_MAX_WINDOW) f->window *= 2;
+        } else {
+            f->window = FS_STREAM_MIN_WINDOW;
+        }
+
+        UINTN n = want - got;
+        if (n >= f->window) {
+            /* Large request: read straight into the caller's buffer */
+            if (stream_backend_read(f, f->pos, dst + got, &n) != 0) return -1;
+            if (n == 0) break;
+            got += n;
+            f->pos += n;
+            continue;
+        }
+
+        /* Refill the window (never larger than the file) */
+        UINT32 cap = f->window;
+        if ((UINT64)cap > f->size) cap = (UINT32)f->size;
+        if (f->rcap < cap) {
+            if (f->rbuf) mem_free(f->rbuf);
+            f->rbuf = (UINT8 *)mem_alloc(cap);
+            f->rcap = f->rbuf ? cap : 0;
+            f->rlen = 0;
+            if (!f->rbuf) return -1;
+        }
+        n = cap;
+        if ((UINT64)n > f->size - f->pos) n = (UINTN)(f->size - f->pos);
+        f->rlen = 0;
+        if (stream_backend_read(f, f->pos, f->rbuf, &n) != 0) return -1;
+        if (n == 0) break;
+        f->roff = f->pos;
+        f->rlen = (UINT32)n;
+    }
+
+    *size = got;
+    return 0;
 }
 
-void fs_stream_close(EFI_FILE_HANDLE file) {
-    if (file) {
-        file->Flush(file);
-        file->Close(file);
+int fs_stream_preallocate(struct fs_file *f, UINT64 size) {
+    if (!f || !f->writable || f->dead) return -1;
+    if (f->xf) return exfat_preallocate(f->xf, size);
+    return 0;
+}
+
+int fs_stream_write(struct fs_file *f, const void *buf, UINTN size) {
+    if (!f || !f->writable || f->dead) return -1;
+    if (f->xf) {
+        if (exfat_write(f->xf, buf, size) != 0) return -1;
+    } else if (f->ff) {
+        if (fat32_write(f->ff, buf, size) != 0) return -1;
+    } else {
+        UINTN write_size = size;
+        EFI_STATUS status = f->sfs->Write(f->sfs, &write_size, (void *)buf);
+        if (EFI_ERROR(status)) return -1;
     }
+    f->pos += size;
+    f->bpos = f->pos;
+    if (f->pos > f->size) f->size = f->pos;
+    return 0;
 }
 
-EFI_STATUS fs_delete_file(EFI_FILE_HANDLE root, const CHAR16 *path) {
-    if (!root) root = s_root;
+int fs_stream_seek(struct fs_file *f, UINT64 pos) {
+    if (!f || f->dead) return -1;
+    if (f->writable) {
+        /* Writes go straight to the backend; exFAT and FAT32 are
+           append-only */
+        if (stream_backend_seek(f, pos) != 0) return -1;
+        f->pos = pos;
+        return 0;
+    }
+    /* Readers seek lazily on the next backend read */
+    f->pos = (pos > f->size) ? f->size : pos;
+    return 0;
+}
+
+int fs_stream_close(struct fs_file *f) {
+    if (!f) return -1;
+    int rc = f->dead ? -1 : 0;
+    if (!f->dead) {
+        if (f->type != FS_VOL_SFS) stream_unlink(f);
+        rc = stream_close_backend(f);
+    }
+    if (f->writable) fs_cache_invalidate();
+    if (f->rbuf) mem_free(f->rbuf);
+    mem_free(f);
+    return rc;
+}
+
+static EFI_STATUS vol_delete(struct fs_volume *v, const CHAR16 *path) {
+    if (vol_read_only(v))
+        return EFI_WRITE_PROTECTED;
+    fs_wrote(path);
+    if (vol_is_exfat(v) && v->exfat) {
+        char apath[512];
+        path_to_ascii(path, apath, 512);
+        return bio_barrier(v, exfat_delete(v->exfat, apath)) == 0
+               ? EFI_SUCCESS : EFI_NOT_FOUND;
+    }
+    if (v->type == FS_VOL_FAT32 && v->fat32) {
+        char apath[512];
+        path_to_ascii(path, apath, 512);
+        return bio_barrier(v, fat32_delete(v->fat32, apath)) == 0
+               ? EFI_SUCCESS : EFI_NOT_FOUND;
+    }
+
+    EFI_FILE_HANDLE root = v->root;
     if (!root) return EFI_NOT_READY;
 
     EFI_FILE_HANDLE file = NULL;
     EFI_STATUS status = root->Open(root, &file, (CHAR16 *)path,
                                     EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE, 0);
     if (EFI_ERROR(status)) return status;
-    return file->Delete(file);  /* Delete also closes */
+    status = file->Delete(file);  /* Delete also closes */
+    if (status == EFI_SUCCESS) pre_note_gone(v, path);
+    return status;
+}
+
+EFI_STATUS fs_delete_file(EFI_FILE_HANDLE root, const CHAR16 *path) {
+    struct fs_volume tmp;
+    if (!root) return vol_delete(&s_cur, path);
+    vol_wrap_root(&tmp, root);
+    return vol_delete(&tmp, path);
 }
 
 EFI_FILE_HANDLE fs_get_boot_root(void) {
     return s_boot_root;
 }
 
-EFI_STATUS fs_mkdir(const CHAR16 *path) {
-    if (s_vol_type == FS_VOL_NTFS)
+static EFI_STATUS vol_mkdir(struct fs_volume *v, const CHAR16 *path) {
+    if (vol_read_only(v))
         return EFI_WRITE_PROTECTED;
-    if (s_vol_type == FS_VOL_EXFAT && s_exfat) {
+    dcache_clear();
+    if (vol_is_exfat(v) && v->exfat) {
         char apath[512];
         path_to_ascii(path, apath, 512);
-        return exfat_mkdir(s_exfat, apath) == 0
+        return bio_barrier(v, exfat_mkdir(v->exfat, apath)) == 0
+               ? EFI_SUCCESS : EFI_DEVICE_ERROR;
+    }
+    if (v->type == FS_VOL_FAT32 && v->fat32) {
+        char apath[512];
+        path_to_ascii(path, apath, 512);
+        return bio_barrier(v, fat32_mkdir(v->fat32, apath)) == 0
                ? EFI_SUCCESS : EFI_DEVICE_ERROR;
     }
 
-    if (!s_root) return EFI_NOT_READY;
+    if (!v->root) return EFI_NOT_READY;
     EFI_FILE_HANDLE dir = NULL;
-    EFI_STATUS status = s_root->Open(s_root, &dir, (CHAR16 *)path,
+    EFI_STATUS status = v->root->Open(v->root, &dir, (CHAR16 *)path,
                                       EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE |
                                       EFI_FILE_MODE_CREATE, EFI_FILE_DIRECTORY);
     if (EFI_ERROR(status)) return status;
     dir->Close(dir);
+    pre_note_dir(v, path);
     return EFI_SUCCESS;
 }
 
+EFI_STATUS fs_mkdir(const CHAR16 *path) {
+    return vol_mkdir(&s_cur, path);
+}
+
 EFI_STATUS fs_writefile(const CHAR16 *path, const void *data, UINTN size) {
-    if (s_vol_type == FS_VOL_NTFS)
+    if (vol_read_only(&s_cur))
         return EFI_WRITE_PROTECTED;
-    if (s_vol_type == FS_VOL_EXFAT && s_exfat) {
+    fs_wrote(path);
+    if (vol_is_exfat(&s_cur) && s_cur.exfat) {
         char apath[512];
         path_to_ascii(path, apath, 512);
-        return exfat_writefile(s_exfat, apath, data, size) == 0
+        return bio_barrier(&s_cur, exfat_writefile(s_cur.exfat, apath, data, size)) == 0
                ? EFI_SUCCESS : EFI_DEVICE_ERROR;
     }
-
-    /* SFS path */
-    EFI_STATUS status;
-    EFI_FILE_HANDLE file = NULL;
-
-    /* Try to delete existing file first */
-    status = s_root->Open(s_root, &file, (CHAR16 *)path,
-                          EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE, 0);
-    if (!EFI_ERROR(status)) {
-        file->Delete(file);  /* Delete also closes the handle */
-        file = NULL;
+    if (s_cur.type == FS_VOL_FAT32 && s_cur.fat32) {
+        char apath[512];
+        path_to_ascii(path, apath, 512);
+        return bio_barrier(&s_cur, fat32_writefile(s_cur.fat32, apath, data, size)) == 0
+               ? EFI_SUCCESS : EFI_DEVICE_ERROR;
     }
 
-    /* Create fresh file */
-    status = s_root->Open(s_root, &file, (CHAR16 *)path,
-                          EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE |
-                          EFI_FILE_MODE_CREATE, 0);
-    if (EFI_ERROR(status))
+    /* SFS path: write over an existing file, then cut it to size */
+    EFI_FILE_HANDLE file = NULL;
+    EFI_STATUS status = s_cur.root->Open(s_cur.root, &file, (CHAR16 *)path,
+                                         EFI_FILE_MODE_READ | EFI_FILE_MODE_WRITE |
+                                         EFI_FILE_MODE_CREATE, 0);
+    if (EFI_ERROR(status)) {
+        if (pre_on(&s_cur)) pre_disable();
         return status;
+    }
 
     /* Write contents */
     UINTN write_size = size;
     status = file->Write(file, &write_size, (void *)data);
+    if (!EFI_ERROR(status)) status = sfs_set_size(file, size);
     if (EFI_ERROR(status)) {
         file->Close(file);
+        pre_note_file(&s_cur, path, NULL, 0, 0);
         return status;
     }
 
     file->Flush(file);
     file->Close(file);
+    pre_note_file(&s_cur, path, data, size, 1);
     return EFI_SUCCESS;
 }
 
@@ -698,43 +2020,577 @@ EFI_STATUS fs_writefile(const CHAR16 *path, const void *data, UINTN size) {
 int fs_set_custom_volume(enum fs_vol_type type, EFI_HANDLE handle) {
     /* Unmount any previous custom volume */
     unmount_custom();
+    return vol_mount(&s_cur, type, handle);
+}
 
-    /* Get BlockIO from the handle */
-    EFI_GUID bio_guid = EFI_BLOCK_IO_PROTOCOL_GUID;
-    EFI_BLOCK_IO *bio = NULL;
-    EFI_STATUS st = g_boot.bs->HandleProtocol(
-        handle, &bio_guid, (void **)&bio);
-    if (EFI_ERROR(st) || !bio || !bio->Media)
-        return -1;
+/* ---- Disk images ---- */
 
-    /* Set up BlockIO context for callbacks */
-    s_bio_ctx.bio = bio;
-    s_bio_ctx.media_id = bio->Media->MediaId;
-    UINT32 block_size = bio->Media->BlockSize;
+/* The filesystem whose boot sector sec is, if a built-in driver reads
+   it. Returns 1 with *type set. */
+static int boot_sector_type(const UINT8 *sec, enum fs_vol_type *type) {
+    if (mem_cmp(sec + 3, "EXFAT   ", 8) == 0) {
+        *type = FS_VOL_EXFAT;
+        return 1;
+    }
+    if (mem_cmp(sec + 3, "NTFS    ", 8) == 0) {
+        *type = FS_VOL_NTFS;
+        return 1;
+    }
+    /* FAT32 the firmware did not mount */
+    if (sec[510] == 0x55 && sec[511] == 0xAA &&
+        mem_cmp(sec + 82, "FAT32", 5) == 0) {
+        *type = FS_VOL_FAT32;
+        return 1;
+    }
+    return 0;
+}
 
-    if (type == FS_VOL_EXFAT) {
-        s_exfat = exfat_mount(bio_read_cb, bio_write_cb,
-                               &s_bio_ctx, block_size);
-        if (!s_exfat) return -1;
-        s_vol_type = FS_VOL_EXFAT;
-    } else if (type == FS_VOL_NTFS) {
-        s_ntfs = ntfs_mount(bio_read_cb, &s_bio_ctx, block_size);
-        if (!s_ntfs) return -1;
-        s_vol_type = FS_VOL_NTFS;
-    } else {
+/* An ISO 9660 volume descriptor ("CD001" after the type byte) */
+static int is_iso_descriptor(const UINT8 *sec) {
+    return mem_cmp(sec + 1, "CD001", 5) == 0;
+}
+
+/* An image file read as a block device: an .iso, a raw disk or
+   partition image (.img, .raw) or a fixed VHD, which is a raw disk
+   with a footer. Where the host can say which device blocks hold the
+   file (fs_volume_extents()), that is resolved once at open and reads
+   go to the device by LBA; otherwise through the file's stream. */
+#define IMAGE_MAX_EXTENTS 4096
+#define IMAGE_MAX_PARTS   16
+#define VHD_FOOTER        512
+#define VHD_FIXED         2
+
+struct image_dev {
+    struct fs_file *f;
+    UINT64 size;            /* bytes of disk: a VHD without its footer */
+    UINT32 bs;              /* block size the image is read in */
+    UINT64 base, limit;     /* bytes of the partition being read */
+    EFI_BLOCK_IO *bio;      /* mapped: the device the file is on */
+    UINT32 media_id;
+    struct fs_extent *ext;  /* and where, in file order */
+    int count;
+};
+
+static int image_dev_read(void *ctx, UINT64 lba, UINT32 count, void *buf) {
+    struct image_dev *d = (struct image_dev *)ctx;
+    UINT64 off = d->base + lba * d->bs;
+    UINTN len = (UINTN)count * d->bs;
+    if (off + len > d->limit) return -1;
+    if (!d->ext) {
+        UINTN got = len;
+        if (fs_stream_seek(d->f, off) != 0 ||
+            fs_stream_read(d->f, buf, &got) != 0 || got != len)
+            return -1;
+        return 0;
+    }
+    UINT8 *dst = (UINT8 *)buf;
+    UINT32 dev_bs = d->bio->Media->BlockSize;
+    while (len > 0) {
+        /* The last extent starting at or before off */
+        int lo = 0, hi = d->count - 1;
+        while (lo < hi) {
+            int mid = (lo + hi + 1) / 2;
+            if (d->ext[mid].offset <= off) lo = mid;
+            else hi = mid - 1;
+        }
+        const struct fs_extent *e = &d->ext[lo];
+        UINT64 in = off - e->offset;
+        if (off < e->offset || in >= e->length) return -1;
+        UINT64 n = e->length - in;
+        if (n > len) n = len;
+        if (disk_bio_read(d->bio, d->media_id, (e->pos + in) / dev_bs,
+                          (UINTN)n, dst) != 0)
+            return -1;
+        dst += n;
+        off += n;
+        len -= (UINTN)n;
+    }
+    return 0;
+}
+
+static void image_dev_close(struct image_dev *d) {
+    if (!d) return;
+    if (d->f) fs_stream_close(d->f);
+    if (d->ext) mem_free(d->ext);
+    mem_free(d);
+}
+
+/* Resolve where d's file lies on host's device, if that has 512-byte
+   blocks and every extent is in whole ones; a read of d then never
+   splits a device block. Otherwise d stays on the stream. */
+static void image_dev_map(struct image_dev *d, struct fs_volume *host,
+                          const CHAR16 *path) {
+    if (!host->bio || host->bio->bio->Media->BlockSize != 512) return;
+    UINT32 dev_bs = 512;
+    d->ext = (struct fs_extent *)mem_alloc_raw(IMAGE_MAX_EXTENTS *
+                                               sizeof(struct fs_extent));
+    if (!d->ext) return;
+    int c = fs_volume_extents(host, path, d->ext, IMAGE_MAX_EXTENTS);
+    UINT64 covered = 0;
+    for (int i = 0; i < c; i++) {
+        const struct fs_extent *e = &d->ext[i];
+        if (e->offset != covered || e->pos % dev_bs || e->length % dev_bs) {
+            c = -1;
+            break;
+        }
+        covered += e->length;
+    }
+    if (c <= 0 || covered < d->size) {
+        mem_free(d->ext);
+        d->ext = NULL;
+        return;
+    }
+    d->count = c;
+    d->bio = host->bio->bio;
+    d->media_id = host->bio->media_id;
+}
+
+static struct image_dev *image_dev_open(struct fs_volume *host,
+                                        const CHAR16 *path) {
+    struct image_dev *d = (struct image_dev *)mem_alloc(sizeof(struct image_dev));
+    if (!d) return NULL;
+    d->f = vol_open_read(host, path, &d->size);
+    if (!d->f || d->size < VHD_FOOTER || d->size % VHD_FOOTER) {
+        image_dev_close(d);
+        return NULL;
+    }
+
+    /* A VHD footer: only the fixed kind is the raw disk ahead of it */
+    UINT8 foot[VHD_FOOTER];
+    UINTN got = VHD_FOOTER;
+    if (fs_stream_seek(d->f, d->size - VHD_FOOTER) == 0 &&
+        fs_stream_read(d->f, foot, &got) == 0 && got == VHD_FOOTER &&
+        mem_cmp(foot, "conectix", 8) == 0) {
+        UINT32 disk_type = ((UINT32)foot[60] << 24) | ((UINT32)foot[61] << 16) |
+                           ((UINT32)foot[62] << 8) | foot[63];
+        if (disk_type != VHD_FIXED) {
+            image_dev_close(d);
+            return NULL;
+        }
+        d->size -= VHD_FOOTER;
+    }
+    d->bs = 512;
+    d->limit = d->size;
+    image_dev_map(d, host, path);
+    return d;
+}
+
+/* What d holds from d->base: FS_VOL_SFS if nothing a driver reads */
+static enum fs_vol_type image_dev_type(struct image_dev *d, UINT8 *blk) {
+    enum fs_vol_type type;
+    if (image_dev_read(d, 0, 1, blk) == 0 && boot_sector_type(blk, &type))
+        return type;
+    if (d->bs <= ISO9660_BLOCK &&
+        image_dev_read(d, 32768 / d->bs, 1, blk) == 0 && is_iso_descriptor(blk))
+        return FS_VOL_ISO;
+    return FS_VOL_SFS;
+}
+
+/* The mountable volumes of d: the whole image if it is one (an ISO,
+   hybrid or not, or a partition image), else its partitions. Sets
+   d->bs to the sector size they are in. */
+static int image_dev_parts(struct image_dev *d, struct fs_image_part *out,
+                           int max) {
+    UINT8 *blk = (UINT8 *)mem_alloc_raw(4096);
+    if (!blk) return -1;
+    int n = 0;
+    d->bs = 512;
+    d->base = 0;
+    d->limit = d->size;
+    enum fs_vol_type whole = image_dev_type(d, blk);
+    if (whole != FS_VOL_SFS) {
+        if (max > 0) {
+            out[0].type = whole;
+            out[0].number = 0;
+            out[0].offset = 0;
+            out[0].size_bytes = d->size;
+            n = 1;
+        }
+        mem_free(blk);
+        return n;
+    }
+
+    /* A GPT made for 4K sectors has its header at byte 4096 */
+    if (d->size % 4096 == 0 &&
+        !(image_dev_read(d, 1, 1, blk) == 0 && mem_cmp(blk, "EFI PART", 8) == 0) &&
+        image_dev_read(d, 4096 / 512, 1, blk) == 0 && mem_cmp(blk, "EFI PART", 8) == 0)
+        d->bs = 4096;
+
+    struct part_entry pe[IMAGE_MAX_PARTS];
+    int c = part_scan(image_dev_read, d, d->bs, d->size / d->bs,
+                      pe, IMAGE_MAX_PARTS);
+    for (int i = 0; i < c && n < max; i++) {
+        UINT64 start = pe[i].start * d->bs;
+        UINT64 bytes = pe[i].blocks * d->bs;
+        if (start >= d->size) continue;
+        if (bytes > d->size - start) bytes = d->size - start;
+        d->base = start;
+        d->limit = start + bytes;
+        enum fs_vol_type type = image_dev_type(d, blk);
+        if (type == FS_VOL_SFS) continue;
+        out[n].type = type;
+        out[n].number = i + 1;
+        out[n].offset = start;
+        out[n].size_bytes = bytes;
+        n++;
+    }
+    d->base = 0;
+    d->limit = d->size;
+    mem_free(blk);
+    return n;
+}
+
+int fs_image_partitions(const CHAR16 *path, struct fs_image_part *out,
+                        int max) {
+    struct image_dev *d = image_dev_open(&s_cur, path);
+    if (!d) return -1;
+    int n = image_dev_parts(d, out, max);
+    image_dev_close(d);
+    return n;
+}
+
+/* Point the streams of v, just moved, back at it */
+static void streams_rehome(struct fs_volume *v) {
+    for (struct fs_file *f = v->streams; f; f = f->next)
+        f->vol = v;
+}
+
+/* Mount volume part (fs_image_partitions()) of the image at path on
+   host onto the empty v, read-only. Returns 0 on success; v->host is
+   the caller's to set. */
+static int vol_mount_image(struct fs_volume *v, struct fs_volume *host,
+                           const CHAR16 *path, int part) {
+    struct image_dev *d = image_dev_open(host, path);
+    if (!d) return -1;
+    struct fs_image_part parts[IMAGE_MAX_PARTS];
+    int n = image_dev_parts(d, parts, IMAGE_MAX_PARTS);
+    if (part < 0 || part >= n) {
+        image_dev_close(d);
         return -1;
     }
+    d->base = parts[part].offset;
+    d->limit = d->base + parts[part].size_bytes;
+
+    int tag = mem_tag_set(MEM_TAG_FS);
+    if (parts[part].type == FS_VOL_EXFAT) {
+        v->exfat = exfat_mount(image_dev_read, NULL, d, d->bs);
+        if (v->exfat) v->type = FS_VOL_EXFAT;
+    } else if (parts[part].type == FS_VOL_NTFS) {
+        v->ntfs = ntfs_mount(image_dev_read, d, d->bs);
+        if (v->ntfs) v->type = FS_VOL_NTFS;
+    } else if (parts[part].type == FS_VOL_FAT32) {
+        v->fat32 = fat32_mount(image_dev_read, NULL, d, d->bs);
+        if (v->fat32) v->type = FS_VOL_FAT32;
+    } else if (parts[part].type == FS_VOL_ISO) {
+        v->iso = iso9660_mount(image_dev_read, d, d->bs);
+        if (v->iso) v->type = FS_VOL_ISO;
+    }
+    mem_tag_set(tag);
+    if (v->type == FS_VOL_SFS) {
+        image_dev_close(d);
+        return -1;
+    }
+    v->image = d;
+    return 0;
+}
 
-    s_custom_handle = handle;
+int fs_mount_image(const CHAR16 *path, int part) {
+    if (s_cur.host) return -1;  /* images do not nest */
+
+    /* The current volume moves out of the way, still mounted */
+    struct fs_volume *host = (struct fs_volume *)mem_alloc(sizeof(struct fs_volume));
+    if (!host) return -1;
+    *host = s_cur;
+    streams_rehome(host);
+    mem_set(&s_cur, 0, sizeof(s_cur));
+    s_cur.type = FS_VOL_SFS;
+
+    if (vol_mount_image(&s_cur, host, path, part) != 0) {
+        s_cur = *host;
+        streams_rehome(&s_cur);
+        mem_free(host);
+        return -1;
+    }
+    s_cur.host = host;
+    fs_cache_invalidate();
+    return 0;
+}
+
+int fs_unmount_image(void) {
+    struct fs_volume *host = s_cur.host;
+    if (!host) return -1;
+    s_cur.host = NULL;          /* kept, not closed with the image */
+    vol_unmount(&s_cur);
+    s_cur = *host;
+    streams_rehome(&s_cur);
+    mem_free(host);
+    fs_cache_invalidate();
     return 0;
 }
 
 int fs_is_read_only(void) {
-    return (s_vol_type == FS_VOL_NTFS) ? 1 : 0;
+    return vol_read_only(&s_cur);
 }
 
 enum fs_vol_type fs_get_vol_type(void) {
-    return s_vol_type;
+    return s_cur.type;
+}
+
+EFI_FILE_HANDLE fs_open_volume(EFI_HANDLE handle) {
+    EFI_GUID sfs_guid = EFI_SIMPLE_FILE_SYSTEM_PROTOCOL_GUID;
+    EFI_SIMPLE_FILE_SYSTEM_PROTOCOL *sfs = NULL;
+    EFI_FILE_HANDLE root = NULL;
+    if (!handle) return NULL;
+    EFI_STATUS st = g_boot.bs->HandleProtocol(handle, &sfs_guid,
+                                              (void **)&sfs);
+    if (EFI_ERROR(st) || !sfs) return NULL;
+    st = sfs->OpenVolume(sfs, &root);
+    return EFI_ERROR(st) ? NULL : root;
+}
+
+/* ---- Volume handles ---- */
+
+struct fs_volume *fs_volume_current(void) {
+    return &s_cur;
+}
+
+/* The current volume, or one an image mounted as current is on */
+static int vol_is_current(const struct fs_volume *v) {
+    for (const struct fs_volume *c = &s_cur; c; c = c->host)
+        if (v == c) return 1;
+    return 0;
+}
+
+struct fs_volume *fs_volume_open(enum fs_vol_type type, EFI_HANDLE handle) {
+    /* The current volume, or a device it has mounted, is shared: two
+       driver instances on one device would corrupt it. So is the
+       volume under a mounted image. */
+    for (struct fs_volume *c = &s_cur; c; c = c->host) {
+        if (type == FS_VOL_RAM) {
+            if (c->type == FS_VOL_RAM)
+                return c;
+        } else if (!handle) {
+            if (c->type == FS_VOL_SFS && c->root == s_boot_root)
+                return c;
+        } else if (handle == c->handle) {
+            return c;
+        }
+    }
+
+    struct fs_volume *v = (struct fs_volume *)mem_alloc(sizeof(struct fs_volume));
+    if (!v) return NULL;
+    v->type = FS_VOL_SFS;
+    if (type == FS_VOL_RAM) {
+        if (vol_mount(v, type, NULL) != 0) {
+            mem_free(v);
+            return NULL;
+        }
+    } else if (!handle) {
+        v->root = s_boot_root;
+    } else if (type == FS_VOL_SFS) {
+        v->root = fs_open_volume(handle);
+        v->close_root = 1;
+    } else if (vol_mount(v, type, handle) != 0) {
+        mem_free(v);
+        return NULL;
+    }
+    if (v->type == FS_VOL_SFS && !v->root) {
+        mem_free(v);
+        return NULL;
+    }
+    return v;
+}
+
+void fs_volume_close(struct fs_volume *v) {
+    if (!v || vol_is_current(v)) return;
+    vol_unmount(v);
+    if (v->close_root && v->root) v->root->Close(v->root);
+    mem_free(v);
+}
+
+enum fs_vol_type fs_volume_type(const struct fs_volume *v) {
+    return v->type;
+}
+
+int fs_volume_space(struct fs_volume *v, UINT64 *total_bytes, UINT64 *free_bytes) {
+    return vol_space(v, total_bytes, free_bytes);
+}
+
+struct fs_dir *fs_volume_opendir(struct fs_volume *v, const CHAR16 *path) {
+    return vol_opendir(v, path);
+}
+
+struct fs_file *fs_volume_open_read(struct fs_volume *v, const CHAR16 *path,
+                                    UINT64 *out_size) {
+    return vol_open_read(v, path, out_size);
+}
+
+struct fs_file *fs_volume_open_write(struct fs_volume *v, const CHAR16 *path) {
+    return vol_open_write(v, path, 0);
+}
+
+EFI_STATUS fs_volume_mkdir(struct fs_volume *v, const CHAR16 *path) {
+    return vol_mkdir(v, path);
+}
+
+EFI_STATUS fs_volume_delete(struct fs_volume *v, const CHAR16 *path) {
+    return vol_delete(v, path);
+}
+
+void fs_volume_begin_batch(struct fs_volume *v) {
+    if (!v) return;
+    v->batch++;
+    if (vol_is_exfat(v) && v->exfat) exfat_begin_batch(v->exfat);
+}
+
+int fs_volume_commit_batch(struct fs_volume *v) {
+    if (!v || v->batch == 0) return 0;
+    int rc = 0;
+    if (vol_is_exfat(v) && v->exfat && exfat_commit_batch(v->exfat) != 0)
+        rc = -1;
+    if (--v->batch > 0) return rc;
+    return bio_barrier(v, rc);
+}
+
+int fs_volume_extents(struct fs_volume *v, const CHAR16 *path,
+                      struct fs_extent *out, int max) {
+    char apath[512];
+    if (v->image) return -1;    /* positions in the image, not on a device */
+    path_to_ascii(path, apath, 512);
+    if (vol_is_exfat(v) && v->exfat)
+        return exfat_extents(v->exfat, apath, out, max);
+    if (v->type == FS_VOL_FAT32 && v->fat32)
+        return fat32_extents(v->fat32, apath, out, max);
+    if (v->type == FS_VOL_ISO && v->iso)
+        return iso9660_extents(v->iso, apath, out, max);
+    return -1;
+}
+
+/* The device under a mount, for queues of its own */
+static void vol_device(struct fs_volume *v, struct disk_device *dev) {
+    mem_set(dev, 0, sizeof(*dev));
+    dev->handle = v->handle;
+    dev->block_io = v->bio->bio;
+    dev->block_size = v->bio->bio->Media->BlockSize;
+    dev->media_id = v->bio->media_id;
+    /* The firmware's BlockIO2 only when the mount uses its BlockIO too,
+       not a view of one of our drivers (disk_volume_bio()) */
+    EFI_GUID bio_guid = EFI_BLOCK_IO_PROTOCOL_GUID;
+    EFI_GUID bio2_guid = EFI_BLOCK_IO2_PROTOCOL_GUID;
+    EFI_BLOCK_IO *fw = NULL;
+    if (EFI_ERROR(g_boot.bs->HandleProtocol(v->handle, &bio_guid, (void **)&fw)) ||
+        fw != dev->block_io ||
+        EFI_ERROR(g_boot.bs->HandleProtocol(v->handle, &bio2_guid,
+                                            (void **)&dev->block_io2)))
+        dev->block_io2 = NULL;
+}
+
+int fs_volume_write_behind(struct fs_volume *v, UINTN bytes) {
+    if (!v || !v->bio) return bytes ? -1 : 0;
+    struct bio_wb *wb = v->bio->wb;
+    if (bytes == 0) {
+        if (!wb) return 0;
+        int rc = wb_drain(wb);
+        if (disk_queue_close(wb->q) != 0) rc = -1;
+        mem_io_put(wb->ring);
+        mem_free(wb);
+        v->bio->wb = NULL;
+        return rc;
+    }
+    if (wb || v->image || (!v->exfat && !v->fat32)) return -1;
+
+    wb = (struct bio_wb *)mem_alloc(sizeof(*wb));
+    if (!wb) return -1;
+    mem_set(wb, 0, sizeof(*wb));
+    vol_device(v, &wb->dev);
+    if (!wb->dev.block_io2) {
+        mem_free(wb);
+        return -1;
+    }
+    bytes &= ~(UINTN)(WB_ALIGN - 1);
+    wb->ring = bytes >= WB_MIN ? (UINT8 *)mem_io_get(bytes) : NULL;
+    wb->q = wb->ring ? disk_queue_open(&wb->dev, WB_DEPTH, 0) : NULL;
+    if (!wb->q) {
+        if (wb->ring) mem_io_put(wb->ring);
+        mem_free(wb);
+        return -1;
+    }
+    wb->size = bytes;
+    v->bio->wb = wb;
+    return 0;
+}
+
+/* A relocation's moves, on the mount's own BlockIO: a copier (two
+   queues on the one device) from the first move to the next barrier,
+   so the reads of the next chunks overlap the writes of the last */
+#define RELOCATE_IO (4 * 1024 * 1024)
+
+struct vol_mover {
+    struct disk_device dev;
+    struct disk_copier *copier;
+};
+
+static int mover_move(void *ctx, UINT64 from, UINT64 to, UINT64 count) {
+    struct vol_mover *m = (struct vol_mover *)ctx;
+    if (!m->copier)
+        m->copier = disk_copier_open(&m->dev, &m->dev, RELOCATE_IO, 0, NULL);
+    return m->copier ? disk_copier_move(m->copier, from, to, count) : -1;
+}
+
+/* Closing the copier waits for its writes and flushes the device */
+static int mover_barrier(void *ctx) {
+    struct vol_mover *m = (struct vol_mover *)ctx;
+    if (m->copier) {
+        int rc = disk_copier_close(m->copier);
+        m->copier = NULL;
+        return rc;
+    }
+    return EFI_ERROR(m->dev.block_io->FlushBlocks(m->dev.block_io)) ? -1 : 0;
+}
+
+int fs_volume_relocate(struct fs_volume *v, const CHAR16 *path) {
+    if (!v || !v->bio || v->image || v->streams) return -1;
+    if (!(vol_is_exfat(v) && v->exfat) && !(v->type == FS_VOL_FAT32 && v->fat32))
+        return -1;
+
+    struct vol_mover vm;
+    mem_set(&vm, 0, sizeof(vm));
+    vol_device(v, &vm.dev);
+
+    struct fs_mover m = { mover_move, mover_barrier, &vm };
+    char apath[512];
+    path_to_ascii(path, apath, 512);
+    v->bio->wrote = 1;
+    int rc = vol_is_exfat(v) ? exfat_relocate(v->exfat, apath, &m)
+                             : fat32_relocate(v->fat32, apath, &m);
+    if (vm.copier && disk_copier_close(vm.copier) != 0 && rc == 0)
+        rc = -1;
+    return rc;
+}
+
+struct fs_volume *fs_volume_open_image(struct fs_volume *host,
+                                       const CHAR16 *path, int part) {
+    if (!host) return NULL;
+    struct fs_volume *v = (struct fs_volume *)mem_alloc(sizeof(struct fs_volume));
+    if (!v || vol_mount_image(v, host, path, part) != 0) {
+        if (v) mem_free(v);
+        fs_volume_close(host);
+        return NULL;
+    }
+    v->host = host;             /* closed with it */
+    return v;
+}
+
+struct ntfs_vol *fs_volume_ntfs(struct fs_volume *v) {
+    return v && v->type == FS_VOL_NTFS ? v->ntfs : NULL;
+}
+
+struct exfat_vol *fs_volume_exfat(struct fs_volume *v) {
+    return v && v->type == FS_VOL_EXFAT ? v->exfat : NULL;
+}
+
+struct fat32_vol *fs_volume_fat32(struct fs_volume *v) {
+    return v && v->type == FS_VOL_FAT32 ? v->fat32 : NULL;
 }
 
 /* Check if a handle has a valid FAT32 boot sector */
@@ -752,8 +2608,7 @@ int fs_has_valid_fat32(EFI_HANDLE handle) {
     unsigned char *sec = mem_alloc(bs);
     if (!sec) return 0;
 
-    st = bio->ReadBlocks(bio, bio->Media->MediaId, 0, bs, sec);
-    if (EFI_ERROR(st)) {
+    if (disk_bio_read(bio, bio->Media->MediaId, 0, bs, sec) != 0) {
         mem_free(sec);
         return 0;
     }
@@ -771,6 +2626,45 @@ int fs_has_valid_fat32(EFI_HANDLE handle) {
     return valid;
 }
 
+UINT64 fs_media_signature(void) {
+    EFI_GUID bio_guid = EFI_BLOCK_IO_PROTOCOL_GUID;
+    EFI_GUID sfs_guid = EFI_SIMPLE_FILE_SYSTEM_PROTOCOL_GUID;
+    UINTN handle_count = 0;
+    EFI_HANDLE *handles = NULL;
+
+    EFI_STATUS status = g_boot.bs->LocateHandleBuffer(
+        ByProtocol, &bio_guid, NULL, &handle_count, &handles);
+    if (EFI_ERROR(status) || !handles)
+        return 0;
+
+    /* FNV-1a over what the volume probes depend on; no media access */
+    UINT64 h = 0xCBF29CE484222325ULL;
+    for (UINTN i = 0; i < handle_count; i++) {
+        UINT64 v[5];
+        EFI_BLOCK_IO *bio = NULL;
+        void *sfs = NULL;
+        v[0] = (UINT64)(UINTN)handles[i];
+        v[1] = v[2] = v[3] = 0;
+        if (!EFI_ERROR(g_boot.bs->HandleProtocol(handles[i], &bio_guid,
+                                                 (void **)&bio))
+            && bio && bio->Media) {
+            v[1] = bio->Media->MediaId;
+            v[2] = bio->Media->MediaPresent;
+            v[3] = bio->Media->LastBlock;
+        }
+        v[4] = !EFI_ERROR(g_boot.bs->HandleProtocol(handles[i], &sfs_guid,
+                                                    &sfs)) && sfs;
+        const UINT8 *b = (const UINT8 *)v;
+        for (UINTN k = 0; k < sizeof(v); k++) {
+            h ^= b[k];
+            h *= 0x100000001B3ULL;
+        }
+    }
+
+    g_boot.bs->FreePool(handles);
+    return h;
+}
+
 /* Format size for label */
 static void fs_format_label_size(UINT64 size_bytes, char *label, int *pos) {
     UINT64 size_mb = size_bytes / (1024 * 1024);
@@ -802,123 +2696,185 @@ static void fs_format_label_size(UINT64 size_bytes, char *label, int *pos) {
     label[*pos] = '\0';
 }
 
-int fs_enumerate_custom_volumes(struct fs_custom_volume *vols, int max) {
+/* Check one BlockIO handle for a volume the built-in drivers mount;
+   fills *v and returns 1 if there is one */
+static int probe_custom_handle(EFI_HANDLE handle, struct fs_custom_volume *v) {
     EFI_GUID bio_guid = EFI_BLOCK_IO_PROTOCOL_GUID;
     EFI_GUID sfs_guid = EFI_SIMPLE_FILE_SYSTEM_PROTOCOL_GUID;
     EFI_STATUS status;
-    UINTN handle_count = 0;
-    EFI_HANDLE *handles = NULL;
-    int count = 0;
 
-    status = g_boot.bs->LocateHandleBuffer(
-        ByProtocol, &bio_guid, NULL, &handle_count, &handles);
-    if (EFI_ERROR(status) || !handles)
+    /* Skip boot device */
+    if (handle == s_boot_device)
         return 0;
 
-    for (UINTN i = 0; i < handle_count && count < max; i++) {
-        /* Skip boot device */
-        if (handles[i] == s_boot_device)
-            continue;
+    /* Skip handles that have SFS with valid FAT32: those are
+       listed as USB volumes */
+    void *sfs = NULL;
+    status = g_boot.bs->HandleProtocol(
+        handle, &sfs_guid, &sfs);
+    if (!EFI_ERROR(status) && sfs && fs_has_valid_fat32(handle))
+        return 0;
 
-        /* Skip handles that have SFS with valid FAT32 */
-        void *sfs = NULL;
-        status = g_boot.bs->HandleProtocol(
-            handles[i], &sfs_guid, &sfs);
-        if (!EFI_ERROR(status) && sfs && fs_has_valid_fat32(handles[i]))
-            continue;
+    /* Get BlockIO */
+    EFI_BLOCK_IO *bio = NULL;
+    status = g_boot.bs->HandleProtocol(
+        handle, &bio_guid, (void **)&bio);
+    if (EFI_ERROR(status) || !bio || !bio->Media)
+        return 0;
+    if (!bio->Media->MediaPresent)
+        return 0;
 
-        /* Get BlockIO */
-        EFI_BLOCK_IO *bio = NULL;
-        status = g_boot.bs->HandleProtocol(
-            handles[i], &bio_guid, (void **)&bio);
-        if (EFI_ERROR(status) || !bio || !bio->Media)
-            continue;
-        if (!bio->Media->MediaPresent)
-            continue;
+    /* Read sector 0 to check filesystem signature */
+    UINT32 bs = bio->Media->BlockSize;
+    if (bs < 512) return 0;
 
-        /* Read sector 0 to check filesystem signature */
-        UINT32 bs = bio->Media->BlockSize;
-        if (bs < 512) continue;
+    unsigned char *sec = mem_alloc(bs);
+    if (!sec) return 0;
 
-        unsigned char *sec = mem_alloc(bs);
-        if (!sec) continue;
+    if (disk_bio_read(bio, bio->Media->MediaId, 0, bs, sec) != 0) {
+        mem_free(sec);
+        return 0;
+    }
 
-        status = bio->ReadBlocks(bio, bio->Media->MediaId, 0, bs, sec);
-        if (EFI_ERROR(status)) {
-            mem_free(sec);
-            continue;
-        }
+    enum fs_vol_type type;
+    int found = boot_sector_type(sec, &type);
 
-        enum fs_vol_type type;
-        int found = 0;
+    /* ISO 9660 (a disc, or a hybrid image written to a stick): the
+       primary descriptor at byte 32768 */
+    if (!found && bs <= ISO9660_BLOCK &&
+        disk_bio_read(bio, bio->Media->MediaId, 32768 / bs, bs, sec) == 0 &&
+        is_iso_descriptor(sec)) {
+        type = FS_VOL_ISO;
+        found = 1;
+    }
 
-        /* Check for exFAT: "EXFAT   " at offset 3 */
-        if (sec[3] == 'E' && sec[4] == 'X' && sec[5] == 'F' &&
-            sec[6] == 'A' && sec[7] == 'T' && sec[8] == ' ' &&
-            sec[9] == ' ' && sec[10] == ' ') {
-            type = FS_VOL_EXFAT;
-            found = 1;
-        }
-        /* Check for NTFS: "NTFS    " at offset 3 */
-        else if (sec[3] == 'N' && sec[4] == 'T' && sec[5] == 'F' &&
-                 sec[6] == 'S' && sec[7] == ' ' && sec[8] == ' ' &&
-                 sec[9] == ' ' && sec[10] == ' ') {
-            type = FS_VOL_NTFS;
-            found = 1;
-        }
+    mem_free(sec);
 
-        mem_free(sec);
+    if (!found)
+        return 0;
 
-        if (!found)
-            continue;
+    v->handle = handle;
+    v->type = type;
+    v->size_bytes = (UINT64)(bio->Media->LastBlock + 1) *
+                    (UINT64)bio->Media->BlockSize;
+
+    /* Try to get label by temporarily mounting */
+    int pos = 0;
+    const char *type_name = (type == FS_VOL_EXFAT) ? "exFAT" :
+                            (type == FS_VOL_FAT32) ? "FAT32" :
+                            (type == FS_VOL_ISO) ? "ISO" : "NTFS";
+    while (*type_name && pos < 30)
+        v->label[pos++] = *type_name++;
+
+    /* Attempt quick mount to get real label */
+    struct bio_ctx tmp_ctx;
+    tmp_ctx.bio = bio;
+    tmp_ctx.media_id = bio->Media->MediaId;
+    tmp_ctx.wrote = 0;
+    tmp_ctx.wb = NULL;
 
-        struct fs_custom_volume *v = &vols[count];
-        v->handle = handles[i];
-        v->type = type;
-        v->size_bytes = (UINT64)(bio->Media->LastBlock + 1) *
-                        (UINT64)bio->Media->BlockSize;
-
-        /* Try to get label by temporarily mounting */
-        int pos = 0;
-        const char *type_name = (type == FS_VOL_EXFAT) ? "exFAT" : "NTFS";
-        while (*type_name && pos < 30)
-            v->label[pos++] = *type_name++;
-
-        /* Attempt quick mount to get real label */
-        struct bio_ctx tmp_ctx;
-        tmp_ctx.bio = bio;
-        tmp_ctx.media_id = bio->Media->MediaId;
-
-        if (type == FS_VOL_EXFAT) {
-            struct exfat_vol *ev = exfat_mount(bio_read_cb, bio_write_cb,
-                                                &tmp_ctx, bs);
-            if (ev) {
-                const char *lbl = exfat_get_label(ev);
-                if (lbl && lbl[0]) {
-                    pos = 0;
-                    while (*lbl && pos < 30)
-                        v->label[pos++] = *lbl++;
-                }
-                exfat_unmount(ev);
+    if (type == FS_VOL_EXFAT) {
+        struct exfat_vol *ev = exfat_mount(bio_read_cb, bio_write_cb,
+                                            &tmp_ctx, bs);
+        if (ev) {
+            const char *lbl = exfat_get_label(ev);
+            if (lbl && lbl[0]) {
+                pos = 0;
+                while (*lbl && pos < 30)
+                    v->label[pos++] = *lbl++;
             }
-        } else {
-            struct ntfs_vol *nv = ntfs_mount(bio_read_cb, &tmp_ctx, bs);
-            if (nv) {
-                const char *lbl = ntfs_get_label(nv);
-                if (lbl && lbl[0]) {
-                    pos = 0;
-                    while (*lbl && pos < 30)
-                        v->label[pos++] = *lbl++;
-                }
-                ntfs_unmount(nv);
+            exfat_unmount(ev);
+        }
+    } else if (type == FS_VOL_FAT32) {
+        struct fat32_vol *fv = fat32_mount(bio_read_cb, NULL,
+                                           &tmp_ctx, bs);
+        if (fv) {
+            const char *lbl = fat32_get_label(fv);
+            if (lbl && lbl[0]) {
+                pos = 0;
+                while (*lbl && pos < 30)
+                    v->label[pos++] = *lbl++;
+            }
+            fat32_unmount(fv);
+        }
+    } else if (type == FS_VOL_ISO) {
+        struct iso9660_vol *iv = iso9660_mount(bio_read_cb, &tmp_ctx, bs);
+        if (iv) {
+            const char *lbl = iso9660_get_label(iv);
+            if (lbl && lbl[0]) {
+                pos = 0;
+                while (*lbl && pos < 30)
+                    v->label[pos++] = *lbl++;
             }
+            iso9660_unmount(iv);
         }
+    } else {
+        struct ntfs_vol *nv = ntfs_mount(bio_read_cb, &tmp_ctx, bs);
+        if (nv) {
+            const char *lbl = ntfs_get_label(nv);
+            if (lbl && lbl[0]) {
+                pos = 0;
+                while (*lbl && pos < 30)
+                    v->label[pos++] = *lbl++;
+            }
+            ntfs_unmount(nv);
+        }
+    }
 
-        v->label[pos] = '\0';
-        fs_format_label_size(v->size_bytes, v->label, &pos);
-        count++;
+    v->label[pos] = '\0';
+    fs_format_label_size(v->size_bytes, v->label, &pos);
+    return 1;
+}
+
+void fs_scan_begin(struct fs_volume_scan *s) {
+    EFI_GUID bio_guid = EFI_BLOCK_IO_PROTOCOL_GUID;
+    s->handles = NULL;
+    s->count = 0;
+    s->next = 0;
+    s->ram_done = 0;
+    EFI_STATUS status = g_boot.bs->LocateHandleBuffer(
+        ByProtocol, &bio_guid, NULL, &s->count, &s->handles);
+    if (EFI_ERROR(status) || !s->handles) {
+        s->handles = NULL;
+        s->count = 0;
     }
+}
 
-    g_boot.bs->FreePool(handles);
+int fs_scan_next(struct fs_volume_scan *s, struct fs_custom_volume *v) {
+    if (s->next < s->count)
+        return probe_custom_handle(s->handles[s->next++], v);
+
+    /* The RAM disk last, whether or not anything is on it yet */
+    if (s->ram_done) return -1;
+    s->ram_done = 1;
+    if (ram_size() < RAMDISK_CHUNK) return -1;
+    const char *name = "RAM disk";
+    int pos = 0;
+    while (name[pos]) {
+        v->label[pos] = name[pos];
+        pos++;
+    }
+    v->label[pos] = '\0';
+    v->handle = NULL;
+    v->type = FS_VOL_RAM;
+    v->size_bytes = s_ram ? ramdisk_size(s_ram) : ram_size();
+    fs_format_label_size(v->size_bytes, v->label, &pos);
+    return 1;
+}
+
+void fs_scan_end(struct fs_volume_scan *s) {
+    if (s->handles) g_boot.bs->FreePool(s->handles);
+    s->handles = NULL;
+    s->count = s->next = 0;
+    s->ram_done = 1;
+}
+
+int fs_enumerate_custom_volumes(struct fs_custom_volume *vols, int max) {
+    struct fs_volume_scan scan;
+    int count = 0, r;
+    fs_scan_begin(&scan);
+    while (count < max && (r = fs_scan_next(&scan, &vols[count])) >= 0)
+        count += r;
+    fs_scan_end(&scan);
     return count;
 }
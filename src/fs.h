@@ -6,10 +6,14 @@
 #define FS_MAX_NAME    128
 #define FS_MAX_ENTRIES 256
 
-/* Volume type for dispatch */
-enum fs_vol_type { FS_VOL_SFS, FS_VOL_EXFAT, FS_VOL_NTFS };
-
-/* Custom volume descriptor (exFAT/NTFS found on BlockIO handles) */
+/* Volume type for dispatch. FS_VOL_RAM is the RAM disk: an exFAT
+   volume held in memory, opened with a NULL handle. FS_VOL_ISO is an
+   ISO 9660 disc or hybrid stick, or an .iso file (fs_mount_image()). */
+enum fs_vol_type { FS_VOL_SFS, FS_VOL_EXFAT, FS_VOL_NTFS, FS_VOL_FAT32,
+                   FS_VOL_RAM, FS_VOL_ISO };
+
+/* Custom volume descriptor (exFAT/NTFS/FAT32/ISO 9660 found on BlockIO
+   handles) */
 struct fs_custom_volume {
     EFI_HANDLE      handle;
     enum fs_vol_type type;
@@ -17,13 +21,55 @@ struct fs_custom_volume {
     UINT64          size_bytes;
 };
 
-/* A single directory entry (pre-converted to ASCII) */
+/* fs_entry attr bits, as FAT, exFAT, NTFS and UEFI all number them */
+#define FS_ATTR_READ_ONLY 0x01
+#define FS_ATTR_HIDDEN    0x02
+#define FS_ATTR_SYSTEM    0x04
+#define FS_ATTR_ARCHIVE   0x20
+
+/* A single directory entry (pre-converted to ASCII), with what the
+   driver read along with the name, so that listing needs no lookup
+   per file */
 struct fs_entry {
     char     name[FS_MAX_NAME];
     UINT64   size;
+    UINT64   id;        /* the file's while it exists: first cluster, MFT
+                           record or extent; 0 if none (an empty FAT or
+                           exFAT file) or unknown */
+    UINT32   mtime;     /* last change, FS_DOS_TIME() form; 0 if unknown */
+    UINT32   ctime;     /* creation, the same; 0 if unknown */
     UINT8    is_dir;
+    UINT8    attr;      /* FS_ATTR_* */
 };
 
+/* A run of a file's data: length bytes at file offset 'offset' lie at
+   byte 'pos' of the volume */
+struct fs_extent {
+    UINT64 offset;
+    UINT64 pos;
+    UINT64 length;
+};
+
+/* A run of count device blocks at lba, counted from a volume's first
+   block, that the volume uses; nonzero stops the walk */
+typedef int (*fs_run_fn)(void *ctx, UINT64 lba, UINT64 count);
+
+/* How a driver moves a file's data when relocating it: move copies
+   count device blocks from lba 'from' to lba 'to' (counted like
+   fs_run_fn's), barrier makes everything written so far durable. Each
+   returns 0 on success. */
+struct fs_mover {
+    int (*move)(void *ctx, UINT64 from, UINT64 to, UINT64 count);
+    int (*barrier)(void *ctx);
+    void *ctx;
+};
+
+/* A timestamp as FAT and exFAT store it: year since 1980, month, day,
+   hour, minute, second / 2 packed so that later times compare greater */
+#define FS_DOS_TIME(y, mo, d, h, mi, s) \
+    ((UINT32)((y) - 1980) << 25 | (UINT32)(mo) << 21 | (UINT32)(d) << 16 | \
+     (UINT32)(h) << 11 | (UINT32)(mi) << 5 | (UINT32)(s) / 2)
+
 /* Initialize filesystem — opens the boot volume.
    Call after g_boot is set up. */
 EFI_STATUS fs_init(void);
@@ -34,13 +80,28 @@ EFI_STATUS fs_init(void);
    Entries are sorted: directories first, then alphabetical. */
 int fs_readdir(const CHAR16 *path, struct fs_entry *entries, int max_entries);
 
+/* Directory cursor on the current volume: walks directories of any
+   size one entry at a time, in on-disk order (unsorted, without "."
+   and ".."). Close it before switching volumes. */
+struct fs_dir;
+
+/* Open a directory. Returns NULL on error. */
+struct fs_dir *fs_opendir(const CHAR16 *path);
+
+/* Next entry: 1 with *out filled, 0 at the end, -1 on error */
+int fs_readdir_next(struct fs_dir *d, struct fs_entry *out);
+
+void fs_closedir(struct fs_dir *d);
+
 /* Read entire file into a newly allocated buffer.
    Caller must mem_free() the returned pointer.
    Sets *out_size to file size. Returns NULL on error. */
 void *fs_readfile(const CHAR16 *path, UINTN *out_size);
 
-/* Write data to a file, creating or replacing it.
-   Uses delete-and-recreate to ensure clean write. */
+/* Write data to a file, creating or replacing it. On exFAT and SFS an
+   existing file is rewritten in place, its space reused and its tail
+   extended or cut off, so saving it again does not fragment it; FAT32
+   deletes and recreates it. */
 EFI_STATUS fs_writefile(const CHAR16 *path, const void *data, UINTN size);
 
 /* Get volume size and free space in bytes.
@@ -53,6 +114,15 @@ UINT64 fs_file_size(const CHAR16 *path);
 /* Check if a file or directory exists. Returns 1 if yes, 0 if no. */
 int fs_exists(const CHAR16 *path);
 
+/* The directory entry of path as its directory lists it (size, id,
+   mtime), read from the volume: 0 with *out filled, -1 if it is not
+   there */
+int fs_file_entry(const CHAR16 *path, struct fs_entry *out);
+
+/* Identity of the current volume while it stays mounted (its driver
+   instance or SFS root), for what is kept across volume switches */
+const void *fs_volume_key(void);
+
 /* Rename a file. new_name is just the filename, not a full path. */
 EFI_STATUS fs_rename(const CHAR16 *path, const CHAR16 *new_name);
 
@@ -60,29 +130,90 @@ EFI_STATUS fs_rename(const CHAR16 *path, const CHAR16 *new_name);
    Returns EFI_SUCCESS if created or already exists. */
 EFI_STATUS fs_mkdir(const CHAR16 *path);
 
+/* Forget cached path lookups. Writes through this module do it
+   themselves; call it after changing a volume behind fs.c's back
+   (raw formatting, disk_reconnect). */
+void fs_cache_invalidate(void);
+
+/* Changes on every volume switch, fs_cache_invalidate() and finished
+   stream write. Caches of file contents key on it with the path. */
+UINT32 fs_generation(void);
+
+/* Changes with fs_generation() and whenever a file is about to be
+   replaced, deleted or renamed: caches of what directories hold (du.h)
+   key on it */
+UINT32 fs_change_count(void);
+
+/* Called with the path of each file this module is about to replace,
+   delete or rename on any volume (one listener; NULL to remove) */
+typedef void (*fs_write_fn)(const CHAR16 *path);
+void fs_set_write_listener(fs_write_fn fn);
+
+/* ---- Boot volume preload ---- */
+
+/* When this file exists on the boot volume, startup preloads it */
+#define FS_PRELOAD_FLAG     L"\\PRELOAD"
+#define FS_PRELOAD_FILE_MAX (8 * 1024 * 1024)   /* larger files stay on disk */
+
+/* Walk the boot volume once and answer lookups and reads of it from
+   memory from then on: every path is indexed, and files up to
+   FS_PRELOAD_FILE_MAX are held within MEM_BUDGET_PRELOAD (1/16 of
+   RAM, at most 1 GB). Writes still go to the volume and keep the index
+   current; directory listings always come from the volume. Sets the
+   files indexed and bytes held. Returns 0, or -1 if the volume could
+   not be walked (nothing is served from memory then). */
+int fs_preload_boot(UINT32 *files, UINT64 *bytes);
+
 /* ---- Streaming file I/O ---- */
 
-/* Open a file for streaming read on a specific volume root (NULL = current).
-   Returns file handle and sets *out_size to file size. NULL on error. */
-EFI_FILE_HANDLE fs_open_read(EFI_FILE_HANDLE root, const CHAR16 *path, UINT64 *out_size);
+/* Opaque stream handle. Works on SFS roots, the current custom
+   (exFAT/NTFS/FAT32) volume and fs_volume handles (below); memory use
+   is bounded regardless of file size. */
+struct fs_file;
+
+/* Open a file for streaming read on a specific volume root
+   (NULL = current volume, including exFAT/NTFS/FAT32).
+   Sets *out_size to file size. Returns NULL on error. */
+struct fs_file *fs_open_read(EFI_FILE_HANDLE root, const CHAR16 *path, UINT64 *out_size);
 
 /* Open a file for streaming write (delete-and-recreate).
-   root=NULL uses current s_root. Returns file handle, NULL on error. */
-EFI_FILE_HANDLE fs_open_write(EFI_FILE_HANDLE root, const CHAR16 *path);
+   root=NULL uses the current volume. Returns NULL on error. */
+struct fs_file *fs_open_write(EFI_FILE_HANDLE root, const CHAR16 *path);
+
+/* The same, but an existing file is written over in place, as
+   fs_writefile() does: the file keeps its clusters and directory
+   entry, and closing cuts it to the bytes written. A failed write can
+   leave the old contents partly replaced. */
+struct fs_file *fs_open_overwrite(EFI_FILE_HANDLE root, const CHAR16 *path);
 
 /* Read up to *size bytes from a streaming handle. Updates *size to actual bytes read.
    Returns 0 on success, -1 on error. *size=0 means EOF. */
-int fs_stream_read(EFI_FILE_HANDLE file, void *buf, UINTN *size);
+int fs_stream_read(struct fs_file *file, void *buf, UINTN *size);
+
+/* Tell a fresh write handle the file's final size before the first
+   write. On exFAT this reserves the clusters as one extent where it can
+   (see exfat_preallocate()); elsewhere it does nothing. Returns 0, or -1
+   if the volume cannot hold size bytes. */
+int fs_stream_preallocate(struct fs_file *file, UINT64 size);
 
 /* Write size bytes to a streaming handle. Returns 0 on success, -1 on error. */
-int fs_stream_write(EFI_FILE_HANDLE file, const void *buf, UINTN size);
+int fs_stream_write(struct fs_file *file, const void *buf, UINTN size);
+
+/* Set the position of a streaming handle. Reads clamp to the file size;
+   exFAT and FAT32 write handles are append-only. Returns 0 on success. */
+int fs_stream_seek(struct fs_file *file, UINT64 pos);
 
-/* Flush and close a streaming handle. */
-void fs_stream_close(EFI_FILE_HANDLE file);
+/* Flush and close a streaming handle. Returns 0 on success, -1 if data
+   could not be committed (or the volume was unmounted first). */
+int fs_stream_close(struct fs_file *file);
 
-/* Delete a file on a specific volume root (NULL = current). */
+/* Delete a file on a specific volume root (NULL = current volume). */
 EFI_STATUS fs_delete_file(EFI_FILE_HANDLE root, const CHAR16 *path);
 
+/* Get size and free space of a specific SFS volume root.
+   Returns 0 on success, -1 on error. */
+int fs_root_volume_info(EFI_FILE_HANDLE root, UINT64 *total_bytes, UINT64 *free_bytes);
+
 /* Get the boot volume root handle. */
 EFI_FILE_HANDLE fs_get_boot_root(void);
 
@@ -106,23 +237,174 @@ void fs_set_volume(EFI_FILE_HANDLE new_root);
 /* Restore to the boot volume root */
 void fs_restore_boot_volume(void);
 
-/* ---- Custom volume support (exFAT/NTFS) ---- */
+/* ---- Custom volume support (exFAT/NTFS/FAT32/ISO 9660) ---- */
 
-/* Mount a custom (non-SFS) volume via BlockIO handle.
-   Returns 0 on success, -1 on error. */
+/* Mount a volume with one of the built-in drivers via its BlockIO
+   handle, bypassing any firmware SFS on it. Returns 0 on success,
+   -1 on error. */
 int fs_set_custom_volume(enum fs_vol_type type, EFI_HANDLE handle);
 
-/* Returns 1 if current volume is read-only (NTFS), 0 otherwise */
+/* A volume in a disk image file: an .iso, a raw disk or partition
+   image (.img, .raw), or a fixed VHD */
+struct fs_image_part {
+    enum fs_vol_type type;  /* FS_VOL_EXFAT, _NTFS, _FAT32 or _ISO */
+    int number;             /* in the partition table, 1-based; 0 for
+                               an image that is one volume */
+    UINT64 offset;          /* bytes into the image */
+    UINT64 size_bytes;
+};
+
+/* The volumes the built-in drivers read in the image at path on the
+   current volume: the whole image if it is one (an ISO, hybrid or not,
+   or a partition image), else the partitions of its MBR or GPT that
+   are. Returns the count (0: nothing mountable), or -1 if the file
+   cannot be read as an image (a dynamic VHD, say). */
+int fs_image_partitions(const CHAR16 *path, struct fs_image_part *out,
+                        int max);
+
+/* Make volume part (an index into fs_image_partitions()) of the image
+   at path on the current volume the current volume, read-only. Where
+   the volume it is on knows the file's extents (fs_volume_extents())
+   and has 512-byte blocks, they are resolved once and the image's
+   blocks are read from the device by LBA; otherwise through a stream.
+   That volume stays mounted underneath, open streams and all, until
+   fs_unmount_image() puts it back. Images do not nest. Returns 0 on
+   success, -1 on error (the current volume unchanged). */
+int fs_mount_image(const CHAR16 *path, int part);
+
+/* Back to the volume fs_mount_image() was called on. Returns 0, or -1
+   if the current volume is not an image. */
+int fs_unmount_image(void);
+
+/* Returns 1 if current volume is read-only (NTFS, ISO 9660, an image),
+   0 otherwise */
 int fs_is_read_only(void);
 
 /* Query current volume type */
 enum fs_vol_type fs_get_vol_type(void);
 
-/* Enumerate exFAT/NTFS volumes on all BlockIO handles.
+/* Enumerate exFAT/NTFS/ISO 9660 volumes, and FAT32 volumes the
+   firmware did not mount, on all BlockIO handles, then the RAM disk.
    Returns count found (up to max). */
 int fs_enumerate_custom_volumes(struct fs_custom_volume *vols, int max);
 
+/* The same enumeration one device at a time, so a caller can keep
+   serving input between the sector reads: fs_scan_next() probes the
+   next BlockIO handle and returns 1 with *v filled, 0 if it holds no
+   such volume, or -1 once every handle and the RAM disk are done.
+   fs_scan_end() frees the handle list (also to stop early). */
+struct fs_volume_scan {
+    EFI_HANDLE *handles;
+    UINTN       count;
+    UINTN       next;
+    int         ram_done;
+};
+void fs_scan_begin(struct fs_volume_scan *s);
+int fs_scan_next(struct fs_volume_scan *s, struct fs_custom_volume *v);
+void fs_scan_end(struct fs_volume_scan *s);
+
+/* Returns 1 once the RAM disk has been opened (it may hold files) */
+int fs_ram_active(void);
+
+/* Cheap fingerprint of the attached media: every BlockIO handle with
+   its MediaId, presence, size and whether it has SFS. No device I/O, so
+   callers can poll it to decide when to re-run the enumerations. */
+UINT64 fs_media_signature(void);
+
 /* Check if a handle's block device has a valid FAT32 boot sector */
 int fs_has_valid_fat32(EFI_HANDLE handle);
 
+/* Open the firmware SFS root of a volume handle. NULL on error. */
+EFI_FILE_HANDLE fs_open_volume(EFI_HANDLE handle);
+
+/* ---- Volume handles ---- */
+
+/* A volume named explicitly, so one operation can read one volume and
+   write another without switching the current volume: an SFS root or
+   a device mounted with a built-in driver. */
+struct fs_volume;
+
+/* The current volume as fs_set_volume()/fs_set_custom_volume() left
+   it, valid until the next switch. fs_volume_close() ignores it. */
+struct fs_volume *fs_volume_current(void);
+
+/* Open a volume by BlockIO handle: FS_VOL_SFS uses the firmware's
+   filesystem, the other types mount the built-in driver. A NULL
+   handle is the boot volume. A handle the current volume has mounted
+   returns the current volume, since a device must never be mounted
+   twice. Returns NULL on error. */
+struct fs_volume *fs_volume_open(enum fs_vol_type type, EFI_HANDLE handle);
+
+/* Unmount and free (streams still open on it are closed first and
+   fail from then on) */
+void fs_volume_close(struct fs_volume *v);
+
+enum fs_vol_type fs_volume_type(const struct fs_volume *v);
+
+/* Volume size and free space. Returns 0 on success, -1 on error. */
+int fs_volume_space(struct fs_volume *v, UINT64 *total_bytes, UINT64 *free_bytes);
+
+/* fs_opendir(), fs_open_read(), fs_open_write(), fs_mkdir() and
+   fs_delete_file() on a given volume */
+struct fs_dir *fs_volume_opendir(struct fs_volume *v, const CHAR16 *path);
+struct fs_file *fs_volume_open_read(struct fs_volume *v, const CHAR16 *path,
+                                    UINT64 *out_size);
+struct fs_file *fs_volume_open_write(struct fs_volume *v, const CHAR16 *path);
+EFI_STATUS fs_volume_mkdir(struct fs_volume *v, const CHAR16 *path);
+EFI_STATUS fs_volume_delete(struct fs_volume *v, const CHAR16 *path);
+
+/* Group many small writes (a copy, clone or extraction of a tree):
+   until the matching commit, the exFAT driver keeps the allocation
+   bitmap, FAT and directory changes in its cache, and no operation
+   asks the device to flush. The commit writes them back once, in
+   ascending LBA order, then flushes the device. Batches nest; other
+   volume types only skip the device flushes. A power cut inside a
+   batch can lose its metadata. fs_volume_commit_batch() returns 0 on
+   success, -1 if the write-back failed. */
+void fs_volume_begin_batch(struct fs_volume *v);
+int fs_volume_commit_batch(struct fs_volume *v);
+
+/* Leave long data writes in flight (a copy's destination): with bytes
+   > 0, writes of 64 KB or more to a built-in exFAT or FAT32 mount are
+   copied into a ring of that many bytes of device I/O memory and
+   submitted on the device's BlockIO2, so they complete while the
+   caller reads on. Every stream close, barrier and overlapping access
+   still waits for them. Returns -1 if the volume cannot (no BlockIO2,
+   an SFS or image volume, no memory). With bytes = 0, waits for what
+   is in flight and stops; returns -1 if any of it failed. */
+int fs_volume_write_behind(struct fs_volume *v, UINTN bytes);
+
+/* Where a file's data lies on the volume, in file order (see struct
+   fs_extent). Only the built-in exFAT, FAT32 and ISO 9660 drivers know;
+   SFS, NTFS and image volumes (fs_mount_image()) return -1, as does a
+   file with more than max extents. Returns the count. */
+int fs_volume_extents(struct fs_volume *v, const CHAR16 *path,
+                      struct fs_extent *out, int max);
+
+/* Move the data of the file at path into one run of free clusters, an
+   exFAT file as NoFatChain, with large copies through a disk queue so
+   reads overlap writes; see exfat_relocate(). Only the built-in exFAT
+   and FAT32 drivers on a device can; the file must not be open.
+   Returns 0 when moved, 1 when it was in one run already or no free
+   run is that long, -1 on error. */
+int fs_volume_relocate(struct fs_volume *v, const CHAR16 *path);
+
+/* Volume part of the image file at path on host (as fs_mount_image())
+   as a read-only volume of its own, which takes host over: closing it
+   closes host too, and so does a failure (fs_volume_close() already
+   ignores the current volume). Returns NULL on error. */
+struct fs_volume *fs_volume_open_image(struct fs_volume *host,
+                                       const CHAR16 *path, int part);
+
+/* The built-in NTFS driver under v, for what only it can do (reading
+   the whole $MFT in order, ntfs.h); NULL on any other type */
+struct ntfs_vol;
+struct ntfs_vol *fs_volume_ntfs(struct fs_volume *v);
+
+/* The same for the built-in exFAT and FAT32 drivers (fsck.h) */
+struct exfat_vol;
+struct fat32_vol;
+struct exfat_vol *fs_volume_exfat(struct fs_volume *v);
+struct fat32_vol *fs_volume_fat32(struct fs_volume *v);
+
 #endif /* FS_H */
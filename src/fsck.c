@@ -0,0 +1,121 @@
+/*
+ * fsck.c — Consistency check of exFAT and FAT32 volumes
+ *
+ * See fsck.h. The queue of directories doubles as the record of their
+ * names: each one keeps the index of the directory it was found in and
+ * its own name in a pool, so a problem's path is put together only
+ * when one is reported. Nothing here draws or touches a volume, so
+ * the host bench links it with the drivers; the screen is fsckview.c.
+ */
+
+#include "boot.h"
+#include "mem.h"
+#include "fsck.h"
+#include "shim.h"
+
+/* ---- For the drivers ---- */
+
+int fsck_begin(struct fs_check *c, UINT32 clusters, UINT32 cluster_size) {
+    int repair = c->repair;
+    void (*problem)(struct fs_check *, const char *, const char *) = c->problem;
+    void (*progress)(struct fs_check *, const char *, UINT64, UINT64) = c->progress;
+    void *ctx = c->ctx;
+    mem_set(c, 0, sizeof(*c));
+    c->repair = repair;
+    c->problem = problem;
+    c->progress = progress;
+    c->ctx = ctx;
+
+    c->clusters = clusters;
+    c->cluster_size = cluster_size;
+    c->claimed = (UINT8 *)mem_alloc((UINTN)clusters / 8 + 1);
+    return c->claimed ? 0 : -1;
+}
+
+void fsck_end(struct fs_check *c) {
+    if (c->claimed) mem_free(c->claimed);
+    if (c->dir) mem_free(c->dir);
+    if (c->pool) mem_free(c->pool);
+    c->claimed = NULL;
+    c->dir = NULL;
+    c->pool = NULL;
+    c->dir_count = c->dir_cap = c->level = 0;
+    c->pool_len = c->pool_cap = 0;
+}
+
+int fsck_claim(struct fs_check *c, UINT32 i) {
+    UINT8 m = (UINT8)(1 << (i & 7));
+    if (c->claimed[i >> 3] & m) return 1;
+    c->claimed[i >> 3] |= m;
+    c->used++;
+    return 0;
+}
+
+int fsck_claimed(const struct fs_check *c, UINT32 i) {
+    return (c->claimed[i >> 3] >> (i & 7)) & 1;
+}
+
+UINT32 fsck_dir_add(struct fs_check *c, UINT32 parent, const char *name,
+                    UINT32 cluster, UINT32 flags, UINT64 size) {
+    UINT32 len = (UINT32)str_len((const CHAR8 *)name) + 1;
+    if (mem_grow((void **)&c->dir, &c->dir_cap, c->dir_count + 1,
+                 sizeof(struct fsck_dir), 256) != 0 ||
+        mem_grow((void **)&c->pool, &c->pool_cap, c->pool_len + len, 1, 256) != 0)
+        return FSCK_ROOT;
+
+    struct fsck_dir *d = &c->dir[c->dir_count];
+    d->cluster = cluster;
+    d->parent = parent;
+    d->name = c->pool_len;
+    d->flags = flags;
+    d->size = size;
+    mem_copy(c->pool + c->pool_len, name, len);
+    c->pool_len += len;
+    return c->dir_count++;
+}
+
+static int dir_cmp(const void *a, const void *b) {
+    UINT32 x = ((const struct fsck_dir *)a)->cluster;
+    UINT32 y = ((const struct fsck_dir *)b)->cluster;
+    return x < y ? -1 : x > y;
+}
+
+int fsck_next_level(struct fs_check *c, UINT32 *first, UINT32 *end) {
+    /* Only this level's own children refer to it, and none exist yet */
+    *first = c->level;
+    *end = c->dir_count;
+    c->level = c->dir_count;
+    if (*end - *first > 1)
+        qsort(c->dir + *first, *end - *first, sizeof(struct fsck_dir), dir_cmp);
+    return *end > *first;
+}
+
+void fsck_problem(struct fs_check *c, UINT32 dir, const char *name,
+                  const char *what) {
+    if (!c->problem) return;
+
+    /* Built from the end: name, then each directory up to the root */
+    char path[512];
+    UINT32 pos = sizeof(path) - 1;
+    path[pos] = '\0';
+    const char *part = name;
+    for (;;) {
+        if (part && part[0]) {
+            UINT32 n = (UINT32)str_len((const CHAR8 *)part);
+            if (n + 1 > pos) break;
+            pos -= n;
+            mem_copy(path + pos, part, n);
+            path[--pos] = '/';
+        }
+        if (dir == FSCK_ROOT) break;
+        part = c->pool + c->dir[dir].name;
+        dir = c->dir[dir].parent;
+    }
+    if (path[pos] == '\0') path[--pos] = '/';
+    c->problem(c, path + pos, what);
+}
+
+void fsck_progress(struct fs_check *c, const char *stage, UINT64 done,
+                   UINT64 total) {
+    if (c->progress) c->progress(c, stage, done, total);
+}
@@ -0,0 +1,106 @@
+/*
+ * fsck.h — Consistency check of exFAT and FAT32 volumes
+ *
+ * The drivers do the reading (exfat_check(), fat32_check()): one pass
+ * straight through the FAT and allocation bitmap in large reads into
+ * memory, then the directory tree breadth first, a level at a time in
+ * order of the directories' first clusters, so the disk moves forward.
+ * Every cluster a file or directory claims is set in a bitset; one
+ * claimed twice is cross-linked, and one allocated but never claimed
+ * is lost. What they share (the bitset, the queue of directories and
+ * the paths of problems) is fsck.c; the screen that runs a check is
+ * fsckview.c.
+ */
+#ifndef FSCK_H
+#define FSCK_H
+
+#include "boot.h"
+
+#define FSCK_ROOT       0xFFFFFFFF  /* parent of the root directory */
+#define FSCK_PROBLEMS   256         /* problems the screen keeps */
+
+/* A directory waiting for, or done with, its visit */
+struct fsck_dir {
+    UINT32 cluster;
+    UINT32 parent;              /* index in the queue, FSCK_ROOT */
+    UINT32 name;                /* offset in the name pool */
+    UINT32 flags;               /* the driver's (exFAT: no FAT chain) */
+    UINT64 size;                /* bytes, 0 if the chain says */
+};
+
+struct fs_check {
+    int repair;                 /* in: fix what can be fixed */
+
+    /* What was found */
+    UINT64 files, dirs;
+    UINT64 used;                /* clusters the tree claims */
+    UINT32 cluster_size;
+    UINT64 bad_sets;            /* entry sets failing their checksums */
+    UINT64 bad_chains;          /* chains leaving the volume or running
+                                   into free or bad clusters */
+    UINT64 size_mismatch;       /* chains longer or shorter than the file */
+    UINT64 cross_links;         /* files sharing clusters with one before */
+    UINT64 lost_chains, lost_clusters;  /* allocated, never claimed */
+    UINT64 unallocated;         /* claimed but free in the bitmap (exFAT) */
+    UINT64 free_count;          /* a stored free count was wrong */
+    UINT64 repaired;            /* of the above, fixed (without repair:
+                                   the ones repair would fix) */
+    int    io_error;
+    int    cancel;              /* set by the caller to stop the check */
+
+    /* Each problem as found, and how far the check is */
+    void (*problem)(struct fs_check *c, const char *path, const char *what);
+    void (*progress)(struct fs_check *c, const char *stage, UINT64 done,
+                     UINT64 total);
+    void *ctx;
+
+    /* Kept by fsck_begin() .. fsck_end() for the drivers */
+    UINT8 *claimed;             /* bit per cluster, from cluster 2 */
+    UINT32 clusters;
+    struct fsck_dir *dir;
+    UINT32 dir_count, dir_cap;
+    UINT32 level;               /* first directory not yet visited */
+    char  *pool;
+    UINT32 pool_len, pool_cap;
+};
+
+/* ---- For the drivers ---- */
+
+/* Clear the results and allocate the bitset for a volume of clusters
+   clusters (repair, callbacks and ctx are kept). Returns 0, -1 when
+   out of memory. */
+int fsck_begin(struct fs_check *c, UINT32 clusters, UINT32 cluster_size);
+void fsck_end(struct fs_check *c);
+
+/* Claim the cluster at index i (cluster i + 2); returns 1 if it was
+   claimed already */
+int fsck_claim(struct fs_check *c, UINT32 i);
+int fsck_claimed(const struct fs_check *c, UINT32 i);
+
+/* Queue a directory to visit; parent is the index of the one it was
+   found in. A directory can only be entered once (its first cluster
+   is claimed on the visit), so a loop ends there. Returns its index,
+   FSCK_ROOT when out of memory. */
+UINT32 fsck_dir_add(struct fs_check *c, UINT32 parent, const char *name,
+                    UINT32 cluster, UINT32 flags, UINT64 size);
+
+/* The next level of directories to visit, sorted by first cluster, as
+   [*first, *end). Returns 0 when none are left. */
+int fsck_next_level(struct fs_check *c, UINT32 *first, UINT32 *end);
+
+/* Report a problem with the entry name in directory dir (FSCK_ROOT
+   and NULL for the volume itself) */
+void fsck_problem(struct fs_check *c, UINT32 dir, const char *name,
+                  const char *what);
+
+void fsck_progress(struct fs_check *c, const char *stage, UINT64 done,
+                   UINT64 total);
+
+/* ---- The screen ---- */
+
+/* Check the current volume, which must be mounted with the built-in
+   exFAT or FAT32 driver, show what was found and offer to repair it.
+   Returns when left; -1 if the volume cannot be checked. */
+int fsck_run(void);
+
+#endif /* FSCK_H */
@@ -0,0 +1,180 @@
+/*
+ * fsckview.c — The screen that checks and repairs the current volume
+ *
+ * See fsck.h. The check runs once to find problems, with a progress
+ * line and the first FSCK_PROBLEMS of them kept for the summary; when
+ * any can be fixed and the volume is writable, a second pass inside
+ * one batch repairs them.
+ */
+
+#include "boot.h"
+#include "fb.h"
+#include "kbd.h"
+#include "mem.h"
+#include "fs.h"
+#include "exfat.h"
+#include "fat32.h"
+#include "timer.h"
+#include "fsck.h"
+#include "shim.h"
+
+#define FSCK_DRAW_MS 100        /* progress redraws */
+#define FSCK_LINE    120        /* characters kept of a problem */
+
+struct fsck_view {
+    char  (*lines)[FSCK_LINE];  /* the first FSCK_PROBLEMS problems */
+    UINT32 count;
+    UINT64 total;
+    UINT32 row;                 /* of the progress line */
+    UINT64 t_draw;
+    const char *stage;
+};
+
+static void view_problem(struct fs_check *c, const char *path, const char *what) {
+    struct fsck_view *v = (struct fsck_view *)c->ctx;
+    v->total++;
+    if (v->count < FSCK_PROBLEMS)
+        snprintf(v->lines[v->count++], FSCK_LINE, "%s: %s", path, what);
+}
+
+static void view_progress(struct fs_check *c, const char *stage, UINT64 done,
+                          UINT64 total) {
+    struct fsck_view *v = (struct fsck_view *)c->ctx;
+    UINT64 now = timer_ticks();
+    if (stage == v->stage && now - v->t_draw < timer_hz() / 1000 * FSCK_DRAW_MS)
+        return;
+    v->stage = stage;
+    v->t_draw = now;
+
+    struct key_event ev;
+    if (kbd_poll(&ev) && ev.code == KEY_ESC) c->cancel = 1;
+
+    char line[128];
+    int len = total ? snprintf(line, sizeof(line), "  %s: %llu of %llu (%llu%%)",
+                               stage, (unsigned long long)done,
+                               (unsigned long long)total,
+                               (unsigned long long)(done * 100 / total))
+                    : snprintf(line, sizeof(line), "  %s: %llu", stage,
+                               (unsigned long long)done);
+    while (len < (int)g_boot.cols && len < 126) line[len++] = ' ';
+    line[len] = '\0';
+    fb_string(0, v->row, line, COLOR_WHITE, COLOR_BLACK);
+    fb_present();
+}
+
+static void show_count(const char *what, UINT64 n) {
+    char buf[96];
+    snprintf(buf, sizeof(buf), "  %-32s %llu\n", what, (unsigned long long)n);
+    fb_print(buf, n ? COLOR_YELLOW : COLOR_WHITE);
+}
+
+/* Run the check once, drawing as it goes. Returns the driver's rc. */
+static int check_once(struct fs_check *c, struct fsck_view *v,
+                      struct exfat_vol *ev, struct fat32_vol *fv) {
+    fb_clear(COLOR_BLACK);
+    fb_print("\n", COLOR_WHITE);
+    fb_print("  ========================================\n", COLOR_CYAN);
+    fb_print(c->repair ? "       REPAIR VOLUME\n" : "       CHECK VOLUME\n", COLOR_CYAN);
+    fb_print("  ========================================\n", COLOR_CYAN);
+    fb_print("\n", COLOR_WHITE);
+    fb_print(ev ? "  exFAT volume. ESC stops the check.\n\n"
+                : "  FAT32 volume. ESC stops the check.\n\n", COLOR_WHITE);
+
+    v->count = 0;
+    v->total = 0;
+    v->stage = NULL;
+    v->row = g_boot.cursor_y;
+    fb_print("\n\n", COLOR_WHITE);
+
+    UINT64 t0 = timer_ticks();
+    int rc = ev ? exfat_check(ev, c) : fat32_check(fv, c);
+    UINT64 ms = (timer_ticks() - t0) / (timer_hz() / 1000 ? timer_hz() / 1000 : 1);
+
+    fb_clear(COLOR_BLACK);
+    fb_print("\n", COLOR_WHITE);
+    fb_print("  ========================================\n", COLOR_CYAN);
+    fb_print(c->repair ? "       REPAIR VOLUME\n" : "       CHECK VOLUME\n", COLOR_CYAN);
+    fb_print("  ========================================\n\n", COLOR_CYAN);
+    char buf[160];
+    if (c->cancel) {
+        fb_print("  Stopped: what follows covers part of the volume.\n\n", COLOR_YELLOW);
+    } else if (rc != 0) {
+        fb_print(c->io_error ? "  The check could not read the volume.\n\n"
+                             : "  Not enough memory for the check.\n\n", COLOR_RED);
+    }
+    snprintf(buf, sizeof(buf), "  %llu files and %llu directories in %llu.%llu s,"
+             " %llu MB in use\n\n", (unsigned long long)c->files,
+             (unsigned long long)c->dirs, (unsigned long long)(ms / 1000),
+             (unsigned long long)(ms % 1000 / 100),
+             (unsigned long long)(c->used * c->cluster_size / (1024 * 1024)));
+    fb_print(buf, COLOR_WHITE);
+    show_count("Bad entry sets", c->bad_sets);
+    show_count("Broken cluster chains", c->bad_chains);
+    show_count("Sizes not matching their chains", c->size_mismatch);
+    show_count("Cross-linked files", c->cross_links);
+    snprintf(buf, sizeof(buf), "Lost chains (%llu clusters)",
+             (unsigned long long)c->lost_clusters);
+    show_count(buf, c->lost_chains);
+    if (ev) show_count("In use but free in the bitmap", c->unallocated);
+    if (c->free_count) show_count("Wrong free cluster count", c->free_count);
+    show_count(c->repair ? "Repaired" : "Repairable", c->repaired);
+    fb_print("\n", COLOR_WHITE);
+
+    /* As many problems as fit, leaving room for the prompt */
+    UINT32 room = g_boot.rows > g_boot.cursor_y + 4 ? g_boot.rows - g_boot.cursor_y - 4 : 0;
+    for (UINT32 i = 0; i < v->count && i < room; i++) {
+        snprintf(buf, sizeof(buf), "  %.*s\n", (int)(g_boot.cols > 4 ? g_boot.cols - 4 : 1),
+                 v->lines[i]);
+        fb_print(buf, COLOR_DGRAY);
+    }
+    if (v->total > room && room) {
+        snprintf(buf, sizeof(buf), "  ... and %llu more\n",
+                 (unsigned long long)(v->total - room));
+        fb_print(buf, COLOR_DGRAY);
+    }
+    return rc;
+}
+
+int fsck_run(void) {
+    struct fs_volume *vol = fs_volume_current();
+    struct exfat_vol *ev = fs_volume_exfat(vol);
+    struct fat32_vol *fv = fs_volume_fat32(vol);
+    if (!ev && !fv) return -1;
+
+    struct fsck_view v;
+    mem_set(&v, 0, sizeof(v));
+    v.lines = (char (*)[FSCK_LINE])mem_alloc((UINTN)FSCK_PROBLEMS * FSCK_LINE);
+    if (!v.lines) return -1;
+    struct fs_check c;
+    mem_set(&c, 0, sizeof(c));
+    c.problem = view_problem;
+    c.progress = view_progress;
+    c.ctx = &v;
+
+    int rc = check_once(&c, &v, ev, fv);
+    if (rc == 0 && !c.cancel && c.repaired && !fs_is_read_only()) {
+        fb_print("  Press 'R' to repair, any other key to return.\n", COLOR_YELLOW);
+        struct key_event key;
+        kbd_wait(&key);
+        if (key.code == 'R' || key.code == 'r') {
+            c.repair = 1;
+            fs_volume_begin_batch(vol);
+            rc = check_once(&c, &v, ev, fv);
+            if (fs_volume_commit_batch(vol) != 0) {
+                fb_print("  Writing the repairs back failed.\n", COLOR_RED);
+                rc = -1;
+            }
+            fs_cache_invalidate();
+            fb_print("  Press any key to return.\n", COLOR_DGRAY);
+            kbd_wait(&key);
+        }
+    } else {
+        if (c.repaired && fs_is_read_only())
+            fb_print("  The volume is read-only: nothing can be repaired.\n", COLOR_WHITE);
+        fb_print("  Press any key to return.\n", COLOR_DGRAY);
+        struct key_event key;
+        kbd_wait(&key);
+    }
+    mem_free(v.lines);
+    return 0;
+}
@@ -0,0 +1,501 @@
+/*
+ * grep.c — Text search through a directory tree
+ *
+ * See grep.h. A directory is listed whole before its files are opened,
+ * so no directory cursor is held across file reads. Each read lands
+ * after the last GR_KEEP bytes of the one before, which lets a match
+ * and its line's start straddle two chunks.
+ */
+
+#include "boot.h"
+#include "fb.h"
+#include "kbd.h"
+#include "mem.h"
+#include "fs.h"
+#include "timer.h"
+#include "progress.h"
+#include "grep.h"
+#include "shim.h"
+
+#define GR_STEP_MS  30          /* searching between looks at the keyboard */
+#define GR_DRAW_MS  100         /* redraws while searching */
+#define GR_PATH_MAX 512
+#define GR_KEEP     256         /* bytes carried into the next chunk */
+#define GR_BACK     48          /* bytes shown before a match on a long line */
+#define GR_CONTEXT  160         /* bytes of a matching line kept */
+#define GR_BINARY   8192        /* a NUL in this much makes a file binary */
+
+#define GR_ONES  0x0101010101010101ULL
+#define GR_LOWS  0x7F7F7F7F7F7F7F7FULL
+#define GR_HIGHS 0x8080808080808080ULL
+
+struct gr_hit {
+    UINT32 path;                /* offsets in the hit pool */
+    UINT32 text;
+    UINT64 line;                /* from 1; 0 for a binary file */
+};
+
+struct gr_state {
+    const UINT8 *pat;
+    UINTN plen;
+
+    /* The walk: every directory found, in order, and the files of the
+       one being searched */
+    char   *dirs;               /* pool of paths */
+    UINT32 dirs_len, dirs_cap;
+    UINT32 *dir_off;
+    UINT32 ndirs, dir_off_cap;
+    UINT32 walk;                /* directories listed */
+    char   *files;              /* NUL-ended names */
+    UINT32 files_len, files_cap;
+    UINT32 file_next;           /* offset of the next name to open */
+    char   dir[GR_PATH_MAX];    /* the directory they are in */
+
+    /* The file being read */
+    struct fs_file *f;
+    char   path[GR_PATH_MAX];
+    UINT8  *buf;                /* GR_KEEP bytes, then GREP_CHUNK */
+    UINTN  keep;                /* bytes carried, just before buf + GR_KEEP */
+    UINTN  from;                /* the first start not yet tried */
+    UINTN  counted;             /* newlines are counted up to here */
+    UINT64 line;                /* newlines before counted */
+    UINT64 last_line;           /* of the last match, from 1; 0 for none */
+    UINT32 path_off;            /* its path in the hit pool, once listed */
+    int    listed, first, binary;
+
+    /* Results */
+    struct gr_hit *hits;
+    UINT32 nhits, hits_cap;
+    char   *pool;
+    UINT32 pool_len, pool_cap;
+
+    UINT32 nfiles, matched, errors;
+    int    done, full, stopped;
+    struct progress pr;
+};
+
+/* ---- Search ---- */
+
+/* Newlines in n bytes. A byte of t is zero exactly where the top bit
+   of ~(((t & 0x7F..) + 0x7F..) | t) is set, with no borrow between
+   bytes, so the bits can be summed. */
+static UINT64 count_nl(const UINT8 *p, UINTN n) {
+    UINT64 c = 0;
+    for (; n && ((UINTN)p & 7); n--, p++)
+        c += *p == '\n';
+    for (; n >= 8; n -= 8, p += 8) {
+        UINT64 t = *(const UINT64 *)p ^ (GR_ONES * '\n');
+        UINT64 z = ~(((t & GR_LOWS) + GR_LOWS) | t) & GR_HIGHS;
+        c += ((z >> 7) * GR_ONES) >> 56;
+    }
+    for (; n; n--, p++)
+        c += *p == '\n';
+    return c;
+}
+
+/* Copy n bytes (and a NUL) into the hit pool at *off */
+static int pool_add(struct gr_state *g, const char *s, UINTN n, UINT32 *off) {
+    if (mem_grow((void **)&g->pool, &g->pool_cap, g->pool_len + (UINT32)n + 1,
+                 1, 1024) != 0)
+        return -1;
+    *off = g->pool_len;
+    mem_copy(g->pool + g->pool_len, s, n);
+    g->pool[g->pool_len + n] = '\0';
+    g->pool_len += (UINT32)n + 1;
+    return 0;
+}
+
+static void add_hit(struct gr_state *g, const char *text, UINTN n, UINT64 line) {
+    struct gr_hit h;
+    if (mem_grow((void **)&g->hits, &g->hits_cap, g->nhits + 1,
+                 sizeof(struct gr_hit), 1024) != 0
+        || (!g->listed &&
+            pool_add(g, g->path, str_len((CHAR8 *)g->path), &g->path_off) != 0)
+        || pool_add(g, text, n, &h.text) != 0) {
+        g->full = 1;
+        return;
+    }
+    if (!g->listed) {
+        g->listed = 1;
+        g->matched++;
+    }
+    h.path = g->path_off;
+    h.line = line;
+    g->hits[g->nhits++] = h;
+}
+
+/* A match at data[x]: one hit per line, shown from the line's start
+   unless that is more than GR_BACK bytes back */
+static void hit_at(struct gr_state *g, const UINT8 *data, UINTN len, UINTN x) {
+    g->line += count_nl(data + g->counted, x - g->counted);
+    g->counted = x;
+    UINT64 line = g->line + 1;
+    if (line == g->last_line) return;
+    g->last_line = line;
+
+    UINTN s = x, lim = x > GR_BACK ? x - GR_BACK : 0;
+    while (s > lim && data[s - 1] != '\n') s--;
+    char text[GR_CONTEXT + 3];
+    UINTN n = 0;
+    if (s > 0 && data[s - 1] != '\n') {
+        mem_copy(text, "...", 3);
+        n = 3;
+    }
+    for (UINTN i = s; i < len && data[i] != '\n' && n < sizeof(text); i++) {
+        UINT8 c = data[i];
+        if (c == '\r') continue;
+        text[n++] = c == '\t' ? ' ' : (c >= 0x20 && c < 0x7F) ? (char)c : '.';
+    }
+    add_hit(g, text, n, line);
+}
+
+/* Try the starts from g->from on. Returns 1 when the file is done
+   with: a binary file is listed once. */
+static int scan(struct gr_state *g, const UINT8 *data, UINTN len) {
+    UINTN pos = g->from;
+    while (pos + g->plen <= len) {
+        const UINT8 *m = (const UINT8 *)mem_find(data + pos, len - pos, g->pat, g->plen);
+        if (!m) break;
+        if (g->binary) {
+            add_hit(g, "binary file matches", 19, 0);
+            return 1;
+        }
+        UINTN x = (UINTN)(m - data);
+        hit_at(g, data, len, x);
+        /* The rest of the line adds nothing */
+        const UINT8 *nl = (const UINT8 *)mem_chr(m, '\n', len - x);
+        if (!nl) break;
+        pos = (UINTN)(nl - data) + 1;
+    }
+    return 0;
+}
+
+static void file_close(struct gr_state *g) {
+    fs_stream_close(g->f);
+    g->f = NULL;
+}
+
+static void read_chunk(struct gr_state *g) {
+    UINTN n = GREP_CHUNK;
+    if (fs_stream_read(g->f, g->buf + GR_KEEP, &n) != 0) {
+        g->errors++;
+        file_close(g);
+        return;
+    }
+    if (n == 0) {
+        file_close(g);
+        return;
+    }
+    progress_add(&g->pr, n);
+
+    UINT8 *data = g->buf + GR_KEEP - g->keep;
+    UINTN len = g->keep + n;
+    if (g->first) {
+        g->first = 0;
+        g->binary = mem_chr(data, 0, len < GR_BINARY ? len : GR_BINARY) != NULL;
+    }
+    if (scan(g, data, len)) {
+        file_close(g);
+        return;
+    }
+
+    /* Carry the tail: the starts too close to the end to have been
+       tried, and the start of the last line */
+    UINTN keep = len < GR_KEEP ? len : GR_KEEP;
+    UINTN drop = len - keep;
+    if (!g->binary) {
+        if (g->counted < drop) {
+            g->line += count_nl(data + g->counted, drop - g->counted);
+            g->counted = 0;
+        } else {
+            g->counted -= drop;
+        }
+    }
+    g->from = len >= g->plen ? len - g->plen + 1 - drop : 0;
+    mem_move(g->buf + GR_KEEP - keep, data + drop, keep);
+    g->keep = keep;
+}
+
+/* dir\name into out; -1 if it does not fit */
+static int join(char *out, const char *dir, const char *name) {
+    UINTN dl = str_len((CHAR8 *)dir), nl = str_len((CHAR8 *)name);
+    if (dl == 1) dl = 0;        /* the root, "\\" */
+    if (dl + 1 + nl + 1 > GR_PATH_MAX) return -1;
+    mem_copy(out, dir, dl);
+    out[dl] = '\\';
+    mem_copy(out + dl + 1, name, nl + 1);
+    return 0;
+}
+
+static void widen(const char *s, CHAR16 *w) {
+    UINTN i = 0;
+    for (; s[i]; i++) w[i] = (CHAR16)(UINT8)s[i];
+    w[i] = 0;
+}
+
+static int dir_add(struct gr_state *g, const char *path) {
+    UINT32 n = (UINT32)str_len((CHAR8 *)path) + 1;
+    if (mem_grow((void **)&g->dirs, &g->dirs_cap, g->dirs_len + n, 1, 1024) != 0
+        || mem_grow((void **)&g->dir_off, &g->dir_off_cap, g->ndirs + 1,
+                    sizeof(UINT32), 1024) != 0)
+        return -1;
+    mem_copy(g->dirs + g->dirs_len, path, n);
+    g->dir_off[g->ndirs++] = g->dirs_len;
+    g->dirs_len += n;
+    return 0;
+}
+
+/* List the next directory: its subdirectories are queued after the
+   others, so the walk is breadth-first. Returns 1 when one was read,
+   0 when none are left, -1 out of memory. */
+static int list_dir(struct gr_state *g) {
+    if (g->walk >= g->ndirs) return 0;
+    str_copy(g->dir, g->dirs + g->dir_off[g->walk++], GR_PATH_MAX);
+    g->files_len = 0;
+    g->file_next = 0;
+
+    CHAR16 w[GR_PATH_MAX];
+    widen(g->dir, w);
+    struct fs_dir *d = fs_opendir(w);
+    if (!d) {
+        g->errors++;
+        return 1;
+    }
+    struct fs_entry e;
+    int r, rc = 1;
+    while ((r = fs_readdir_next(d, &e)) > 0) {
+        if (e.is_dir) {
+            char path[GR_PATH_MAX];
+            if (join(path, g->dir, e.name) != 0) {
+                g->errors++;
+            } else if (dir_add(g, path) != 0) {
+                rc = -1;
+                break;
+            }
+            continue;
+        }
+        UINT32 n = (UINT32)str_len((CHAR8 *)e.name) + 1;
+        if (mem_grow((void **)&g->files, &g->files_cap, g->files_len + n,
+                     1, 1024) != 0) {
+            rc = -1;
+            break;
+        }
+        mem_copy(g->files + g->files_len, e.name, n);
+        g->files_len += n;
+    }
+    if (r < 0) g->errors++;
+    fs_closedir(d);
+    return rc;
+}
+
+/* Open the next file of the directory listed. Returns 0 when there
+   are none left. */
+static int next_file(struct gr_state *g) {
+    while (g->file_next < g->files_len) {
+        const char *name = g->files + g->file_next;
+        g->file_next += (UINT32)str_len((CHAR8 *)name) + 1;
+        CHAR16 w[GR_PATH_MAX];
+        UINT64 size;
+        if (join(g->path, g->dir, name) != 0) {
+            g->errors++;
+            continue;
+        }
+        widen(g->path, w);
+        g->f = fs_open_read(NULL, w, &size);
+        if (!g->f) {
+            g->errors++;
+            continue;
+        }
+        g->nfiles++;
+        g->keep = g->from = g->counted = 0;
+        g->line = g->last_line = 0;
+        g->listed = 0;
+        g->first = 1;
+        g->binary = 0;
+        return 1;
+    }
+    return 0;
+}
+
+/* Search for about GR_STEP_MS */
+static void gr_step(struct gr_state *g) {
+    UINT64 hz = timer_hz(), t0 = timer_ticks();
+    while (!g->done && timer_ticks() - t0 < hz / 1000 * GR_STEP_MS) {
+        if (g->full) {
+            g->done = 1;
+        } else if (g->f) {
+            read_chunk(g);
+        } else if (!next_file(g)) {
+            int r = list_dir(g);
+            if (r < 0) g->full = 1;
+            else if (r == 0) g->done = 1;
+        }
+    }
+    if (g->done && g->f) file_close(g);
+}
+
+/* ---- Screen ---- */
+
+struct gr_view {
+    int cursor, scroll;
+    const char *msg;            /* one-off status line */
+};
+
+static void draw_hit(struct gr_state *g, struct gr_view *vw, int idx, UINT32 row) {
+    const struct gr_hit *h = &g->hits[idx];
+    const char *path = g->pool + h->path;
+    char where[GR_PATH_MAX + 24], line[256];
+    if (h->line)
+        snprintf(where, sizeof(where), "%s:%llu:", path, (unsigned long long)h->line);
+    else
+        snprintf(where, sizeof(where), "%s:", path);
+
+    /* Keep the end of a long path, where the name is */
+    int room = (int)g_boot.cols / 2;
+    if (room > (int)sizeof(line) / 2) room = (int)sizeof(line) / 2;
+    int wlen = (int)str_len((CHAR8 *)where);
+    snprintf(line, sizeof(line), " %s%s %s", wlen > room ? "..." : "",
+             wlen > room ? where + wlen - room : where, g->pool + h->text);
+    int sel = idx == vw->cursor;
+    fb_line(row, line, sel ? COLOR_BLACK : h->line ? COLOR_WHITE : COLOR_YELLOW,
+            sel ? COLOR_CYAN : COLOR_BLACK);
+}
+
+static void draw_view(struct gr_state *g, struct gr_view *vw, const char *from) {
+    char line[256], rate[96];
+    snprintf(line, sizeof(line), " Grep: %s  in %s", (const char *)g->pat, from);
+    fb_line(0, line, COLOR_CYAN, COLOR_DGRAY);
+
+    g->pr.what = !g->done ? "searching" : g->stopped ? "stopped" : "done";
+    progress_line(&g->pr, rate, sizeof(rate));
+    snprintf(line, sizeof(line), " %u matches in %u of %u files; %s%s%s", g->nhits,
+             g->matched, g->nfiles, rate,
+             g->full ? ", out of memory" : "",
+             g->errors ? ", some unreadable" : "");
+    fb_line(1, line, g->done ? COLOR_YELLOW : COLOR_GRAY, COLOR_BLACK);
+
+    UINT32 rows = g_boot.rows - 3;
+    for (UINT32 r = 0; r < rows; r++) {
+        int idx = vw->scroll + (int)r;
+        if (idx < (int)g->nhits)
+            draw_hit(g, vw, idx, 2 + r);
+        else
+            fb_line(2 + r, "", COLOR_WHITE, COLOR_BLACK);
+    }
+
+    fb_line(g_boot.rows - 1,
+            vw->msg ? vw->msg
+            : g->done ? " ENTER:Go to  ESC:Back"
+                      : " ENTER:Go to  ESC:Stop",
+            COLOR_GRAY, COLOR_DGRAY);
+    vw->msg = NULL;
+    fb_present();
+}
+
+static void gr_free(struct gr_state *g) {
+    if (g->f) fs_stream_close(g->f);
+    if (g->buf) mem_free(g->buf);
+    if (g->dirs) mem_free(g->dirs);
+    if (g->dir_off) mem_free(g->dir_off);
+    if (g->files) mem_free(g->files);
+    if (g->hits) mem_free(g->hits);
+    if (g->pool) mem_free(g->pool);
+}
+
+int grep_run(const CHAR16 *from, const char *pattern,
+             CHAR16 *dir, UINTN dir_max, char *name) {
+    struct gr_state g;
+    mem_set(&g, 0, sizeof(g));
+    g.pat = (const UINT8 *)pattern;
+    g.plen = str_len((CHAR8 *)pattern);
+    if (g.plen == 0 || g.plen >= GREP_PATTERN_MAX) return -1;
+
+    char start[GR_PATH_MAX];
+    UINTN i = 0;
+    for (; from[i] && i + 1 < GR_PATH_MAX; i++) start[i] = (char)from[i];
+    if (i == 0) start[i++] = '\\';
+    start[i] = '\0';
+
+    struct gr_view vw;
+    mem_set(&vw, 0, sizeof(vw));
+    g.buf = (UINT8 *)mem_alloc_raw(GR_KEEP + GREP_CHUNK);
+    if (!g.buf || dir_add(&g, start) != 0) {
+        g.full = 1;
+        g.done = 1;
+    }
+    progress_start(&g.pr, "searching", 0);
+
+    int rows = (int)g_boot.rows - 3;
+    int rc = -1;
+    UINT64 hz = timer_hz(), t_draw = 0;
+    fb_clear(COLOR_BLACK);
+
+    for (;;) {
+        if (!g.done) gr_step(&g);
+
+        UINT64 now = timer_ticks();
+        if (g.done || now - t_draw > hz / 1000 * GR_DRAW_MS) {
+            draw_view(&g, &vw, start);
+            t_draw = now;
+        }
+
+        struct key_event ev;
+        if (!g.done) {
+            if (!kbd_poll(&ev)) continue;
+        } else {
+            kbd_wait(&ev);
+        }
+
+        switch (ev.code) {
+        case KEY_UP:
+            if (vw.cursor > 0) vw.cursor--;
+            break;
+        case KEY_DOWN:
+            if (vw.cursor < (int)g.nhits - 1) vw.cursor++;
+            break;
+        case KEY_PGUP:
+            vw.cursor -= rows;
+            if (vw.cursor < 0) vw.cursor = 0;
+            break;
+        case KEY_PGDN:
+            vw.cursor += rows;
+            if (vw.cursor > (int)g.nhits - 1) vw.cursor = (int)g.nhits - 1;
+            if (vw.cursor < 0) vw.cursor = 0;
+            break;
+        case KEY_HOME:
+            vw.cursor = 0;
+            break;
+        case KEY_END:
+            vw.cursor = g.nhits ? (int)g.nhits - 1 : 0;
+            break;
+        case KEY_ENTER:
+            if (g.nhits > 0) {
+                const char *path = g.pool + g.hits[vw.cursor].path;
+                UINTN len = str_len((CHAR8 *)path), cut = len;
+                while (cut > 0 && path[cut - 1] != '\\') cut--;
+                UINTN k = 0;
+                if (cut <= 1) dir[k++] = '\\';
+                for (; k + 1 < cut && k + 1 < dir_max; k++) dir[k] = (CHAR16)path[k];
+                dir[k] = 0;
+                str_copy(name, path + cut, FS_MAX_NAME);
+                rc = 0;
+                goto out;
+            }
+            break;
+        case KEY_ESC:
+            if (g.done) goto out;
+            /* Stop, keeping what was found */
+            if (g.f) file_close(&g);
+            g.done = 1;
+            g.stopped = 1;
+            break;
+        }
+        if (vw.cursor < vw.scroll) vw.scroll = vw.cursor;
+        if (vw.cursor >= vw.scroll + rows) vw.scroll = vw.cursor - rows + 1;
+        t_draw = 0;     /* a key always shows */
+    }
+
+out:
+    gr_free(&g);
+    return rc;
+}
@@ -0,0 +1,28 @@
+/*
+ * grep.h — Find text inside the files of a directory tree
+ *
+ * The tree is walked breadth-first and every file is streamed through
+ * GREP_CHUNK-byte reads (fs.h), so a search runs at about the rate the
+ * volume reads at. Each chunk is scanned with mem_find() (mem.h), which
+ * filters on the pattern's first two bytes with SIMD where there is a
+ * kernel, and line numbers are counted a word at a time. Matches show
+ * as "path:line: text" while the search goes on; ESC stops it early,
+ * keeping what was found.
+ */
+#ifndef GREP_H
+#define GREP_H
+
+#include "boot.h"
+#include "fs.h"
+
+#define GREP_CHUNK       (4 * 1024 * 1024)  /* bytes per read */
+#define GREP_PATTERN_MAX 64
+
+/* Search the files under from (a directory of the current volume) for
+   pattern, byte for byte. Returns 0 when a match was picked, with its
+   file's directory in dir (dir_max CHAR16s) and its name in name
+   (FS_MAX_NAME bytes); -1 when left. */
+int grep_run(const CHAR16 *from, const char *pattern,
+             CHAR16 *dir, UINTN dir_max, char *name);
+
+#endif /* GREP_H */
@@ -0,0 +1,297 @@
+/*
+ * hash.c — CRC32C, CRC32, SHA-256 and FNV-1a
+ *
+ * The CRCs run on 8-byte words through the CPU's CRC instruction when
+ * there is one: a single dependent chain at a few GB/s, far ahead of
+ * any USB device.  Without it, slicing-by-8 folds a word per step
+ * through eight 256-entry tables built on first use.  SHA-256 is the
+ * plain FIPS 180-4 compression, one 64-byte block at a time, unless
+ * the CPU has SHA-256 instructions (SHA-NI, the ARMv8 crypto
+ * extension), which take whole runs of blocks.
+ */
+
+#include "hash.h"
+#include "cpu.h"
+#include "mem.h"
+
+/* Kernels (memops_<arch>): raw state in and out, whole words or
+   blocks only. x86 has no instruction for the IEEE polynomial. */
+#if defined(__aarch64__) || defined(__x86_64__)
+#define HAVE_CRC_KERNELS 1
+UINT32 crc32c_words(UINT32 crc, const void *p, UINTN words);
+void   sha256_blocks(UINT32 h[8], const void *p, UINTN blocks,
+                     const UINT32 k[64]);
+#endif
+#ifdef __aarch64__
+#define HAVE_CRC32_KERNEL 1
+UINT32 crc32_words(UINT32 crc, const void *p, UINTN words);
+#endif
+
+#define CRC32C_POLY 0x82F63B78u     /* reflected Castagnoli */
+#define CRC32_POLY  0xEDB88320u     /* reflected IEEE 802.3 */
+
+typedef UINT32 (*crc_words_fn)(UINT32 crc, const void *p, UINTN words);
+
+struct crc_kind {
+    UINT32 tab[8][256];
+    crc_words_fn words;             /* CPU kernel, NULL = tables */
+};
+
+static struct crc_kind s_crc32c, s_crc32;
+static int s_hash_ready;
+static UINT32 s_accel;              /* HASH_HW_* */
+
+/* The tables serve the unaligned ends even when the CPU does words */
+static void crc_tables(struct crc_kind *k, UINT32 poly) {
+    for (UINT32 i = 0; i < 256; i++) {
+        UINT32 c = i;
+        for (int b = 0; b < 8; b++)
+            c = (c >> 1) ^ (poly & (0u - (c & 1)));
+        k->tab[0][i] = c;
+    }
+    for (UINT32 i = 0; i < 256; i++)
+        for (int t = 1; t < 8; t++)
+            k->tab[t][i] = (k->tab[t - 1][i] >> 8) ^
+                           k->tab[0][k->tab[t - 1][i] & 0xFF];
+}
+
+static void hash_setup(void) {
+    crc_tables(&s_crc32c, CRC32C_POLY);
+    crc_tables(&s_crc32, CRC32_POLY);
+#ifdef HAVE_CRC_KERNELS
+    if (cpu_has(CPU_CRC32C)) {
+        s_crc32c.words = crc32c_words;
+        s_accel |= HASH_HW_CRC32C;
+#ifdef HAVE_CRC32_KERNEL
+        s_crc32.words = crc32_words;
+        s_accel |= HASH_HW_CRC32;
+#endif
+    }
+    if (cpu_has(CPU_SHA256)) s_accel |= HASH_HW_SHA256;
+#endif
+    s_hash_ready = 1;
+}
+
+static UINT32 crc_bytes(const struct crc_kind *k, UINT32 c,
+                        const UINT8 *p, UINTN n) {
+    while (n--)
+        c = (c >> 8) ^ k->tab[0][(c ^ *p++) & 0xFF];
+    return c;
+}
+
+static UINT32 crc_run(const struct crc_kind *k, UINT32 crc,
+                      const void *data, UINTN size) {
+    const UINT8 *p = (const UINT8 *)data;
+    UINT32 c = ~crc;
+
+    UINTN lead = (8 - ((UINTN)p & 7)) & 7;
+    if (lead > size) lead = size;
+    c = crc_bytes(k, c, p, lead);
+    p += lead;
+    size -= lead;
+
+    if (k->words && size >= 8) {
+        c = k->words(c, p, size / 8);
+        p += size & ~(UINTN)7;
+        size &= 7;
+    }
+    for (; size >= 8; size -= 8, p += 8) {
+        UINT32 lo = *(const UINT32 *)p ^ c;
+        UINT32 hi = *(const UINT32 *)(p + 4);
+        c = k->tab[7][lo & 0xFF] ^ k->tab[6][(lo >> 8) & 0xFF] ^
+            k->tab[5][(lo >> 16) & 0xFF] ^ k->tab[4][lo >> 24] ^
+            k->tab[3][hi & 0xFF] ^ k->tab[2][(hi >> 8) & 0xFF] ^
+            k->tab[1][(hi >> 16) & 0xFF] ^ k->tab[0][hi >> 24];
+    }
+    return ~crc_bytes(k, c, p, size);
+}
+
+UINT32 crc32c(UINT32 crc, const void *data, UINTN size) {
+    if (!s_hash_ready) hash_setup();
+    return crc_run(&s_crc32c, crc, data, size);
+}
+
+UINT32 crc32(UINT32 crc, const void *data, UINTN size) {
+    if (!s_hash_ready) hash_setup();
+    return crc_run(&s_crc32, crc, data, size);
+}
+
+/* The CRC of crc1's data followed by len2 bytes whose CRC is crc2, as
+   zlib's crc32_combine(): crc1 is run through len2 zero bytes by
+   repeated squaring of the one-zero-bit operator over GF(2) */
+static UINT32 gf2_times(const UINT32 *mat, UINT32 vec) {
+    UINT32 sum = 0;
+    for (; vec; vec >>= 1, mat++)
+        if (vec & 1) sum ^= *mat;
+    return sum;
+}
+
+static void gf2_square(UINT32 *sq, const UINT32 *mat) {
+    for (int n = 0; n < 32; n++) sq[n] = gf2_times(mat, mat[n]);
+}
+
+UINT32 crc32_combine(UINT32 crc1, UINT32 crc2, UINT64 len2) {
+    if (len2 == 0) return crc1;
+
+    UINT32 even[32], odd[32];
+    odd[0] = CRC32_POLY;
+    for (int n = 1; n < 32; n++) odd[n] = 1u << (n - 1);
+    gf2_square(even, odd);          /* two zero bits */
+    gf2_square(odd, even);          /* four */
+
+    /* Each square doubles it; the first is one zero byte */
+    for (;;) {
+        gf2_square(even, odd);
+        if (len2 & 1) crc1 = gf2_times(even, crc1);
+        len2 >>= 1;
+        if (!len2) break;
+        gf2_square(odd, even);
+        if (len2 & 1) crc1 = gf2_times(odd, crc1);
+        len2 >>= 1;
+        if (!len2) break;
+    }
+    return crc1 ^ crc2;
+}
+
+UINT64 fnv1a64(UINT64 h, const void *data, UINTN size) {
+    const UINT8 *p = (const UINT8 *)data;
+    for (UINTN i = 0; i < size; i++)
+        h = (h ^ p[i]) * 0x100000001B3ULL;
+    return h;
+}
+
+UINT32 hash_accel(void) {
+    if (!s_hash_ready) hash_setup();
+    return s_accel;
+}
+
+/* ---- SHA-256 ---- */
+
+static const UINT32 s_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(UINT32 h[8], const UINT8 *p) {
+    UINT32 w[64];
+    for (int i = 0; i < 16; i++, p += 4)
+        w[i] = (UINT32)p[0] << 24 | (UINT32)p[1] << 16 |
+               (UINT32)p[2] << 8 | p[3];
+    for (int i = 16; i < 64; i++) {
+        UINT32 s0 = ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        UINT32 s1 = ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    UINT32 a = h[0], b = h[1], c = h[2], d = h[3];
+    UINT32 e = h[4], f = h[5], g = h[6], k = h[7];
+    for (int i = 0; i < 64; i++) {
+        UINT32 t1 = k + (ROR(e, 6) ^ ROR(e, 11) ^ ROR(e, 25)) +
+                    ((e & f) ^ (~e & g)) + s_k[i] + w[i];
+        UINT32 t2 = (ROR(a, 2) ^ ROR(a, 13) ^ ROR(a, 22)) +
+                    ((a & b) ^ (a & c) ^ (b & c));
+        k = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+    h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+}
+
+static void sha256_run(UINT32 h[8], const UINT8 *p, UINTN blocks) {
+#ifdef HAVE_CRC_KERNELS
+    if (s_accel & HASH_HW_SHA256) {
+        sha256_blocks(h, p, blocks, s_k);
+        return;
+    }
+#endif
+    for (; blocks; blocks--, p += 64)
+        sha256_block(h, p);
+}
+
+void sha256_init(struct sha256_ctx *c) {
+    static const UINT32 iv[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    if (!s_hash_ready) hash_setup();
+    mem_copy(c->h, iv, sizeof(iv));
+    c->len = 0;
+    c->used = 0;
+}
+
+void sha256_update(struct sha256_ctx *c, const void *data, UINTN size) {
+    const UINT8 *p = (const UINT8 *)data;
+    c->len += size;
+    if (c->used) {
+        UINTN n = 64 - c->used;
+        if (n > size) n = size;
+        mem_copy(c->block + c->used, p, n);
+        c->used += (UINT32)n;
+        p += n;
+        size -= n;
+        if (c->used < 64) return;
+        sha256_run(c->h, c->block, 1);
+        c->used = 0;
+    }
+    if (size >= 64) {
+        sha256_run(c->h, p, size / 64);
+        p += size & ~(UINTN)63;
+        size &= 63;
+    }
+    mem_copy(c->block, p, size);
+    c->used = (UINT32)size;
+}
+
+void sha256_final(struct sha256_ctx *c, UINT8 out[SHA256_DIGEST]) {
+    UINT64 bits = c->len * 8;
+    c->block[c->used++] = 0x80;
+    if (c->used > 56) {
+        mem_set(c->block + c->used, 0, 64 - c->used);
+        sha256_run(c->h, c->block, 1);
+        c->used = 0;
+    }
+    mem_set(c->block + c->used, 0, 56 - c->used);
+    for (int i = 0; i < 8; i++)
+        c->block[56 + i] = (UINT8)(bits >> (56 - 8 * i));
+    sha256_run(c->h, c->block, 1);
+    for (int i = 0; i < 8; i++) {
+        out[4 * i]     = (UINT8)(c->h[i] >> 24);
+        out[4 * i + 1] = (UINT8)(c->h[i] >> 16);
+        out[4 * i + 2] = (UINT8)(c->h[i] >> 8);
+        out[4 * i + 3] = (UINT8)c->h[i];
+    }
+}
+
+static int hex_val(char ch) {
+    if (ch >= '0' && ch <= '9') return ch - '0';
+    if (ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+    if (ch >= 'A' && ch <= 'F') return ch - 'A' + 10;
+    return -1;
+}
+
+int sha256_parse(const char *text, UINTN len, UINT8 out[SHA256_DIGEST]) {
+    UINTN i = 0;
+    while (i < len && (text[i] == ' ' || text[i] == '\t' ||
+                       text[i] == '\r' || text[i] == '\n'))
+        i++;
+    if (len - i < 2 * SHA256_DIGEST) return -1;
+    for (int k = 0; k < SHA256_DIGEST; k++, i += 2) {
+        int hi = hex_val(text[i]), lo = hex_val(text[i + 1]);
+        if (hi < 0 || lo < 0) return -1;
+        out[k] = (UINT8)(hi << 4 | lo);
+    }
+    /* The digest must end there (a longer hex run is another hash) */
+    if (i < len && hex_val(text[i]) >= 0) return -1;
+    return 0;
+}
@@ -0,0 +1,58 @@
+/*
+ * hash.h — Checksums for verifying written data: CRC32C, CRC32 and
+ * SHA-256; FNV-1a for keying content
+ *
+ * Portable: each uses the CPU's instructions when present (SSE4.2 and
+ * SHA-NI on x86_64, the CRC32 and crypto extensions on AArch64; see
+ * memops_<arch>) and plain C otherwise, slicing-by-8 tables for the
+ * CRCs. User programs get the same functions.
+ */
+#ifndef HASH_H
+#define HASH_H
+
+#include "boot.h"
+
+/* Extend a CRC32C (Castagnoli) over size bytes. Start from 0; the
+   result of one call is the crc for the next, as with zlib's crc32(). */
+UINT32 crc32c(UINT32 crc, const void *data, UINTN size);
+
+/* The same for the IEEE CRC32 of zlib, gzip, zip and PNG */
+UINT32 crc32(UINT32 crc, const void *data, UINTN size);
+
+/* The CRC32 of two pieces joined, from each one's CRC and the second's
+   length, so pieces can be checksummed apart (on different cores) */
+UINT32 crc32_combine(UINT32 crc1, UINT32 crc2, UINT64 len2);
+
+/* 64-bit FNV-1a over size bytes, from FNV1A64_INIT or the last result:
+   the content hash the rebuild keys objects by (tools/objkey.py too)
+   and the symbol index checks files with. Byte at a time; not for
+   catching corruption. */
+#define FNV1A64_INIT 0xCBF29CE484222325ULL
+UINT64 fnv1a64(UINT64 h, const void *data, UINTN size);
+
+/* Which of these run on CPU instructions here */
+#define HASH_HW_CRC32C 0x1
+#define HASH_HW_CRC32  0x2
+#define HASH_HW_SHA256 0x4
+UINT32 hash_accel(void);
+
+/* ---- SHA-256 ---- */
+
+#define SHA256_DIGEST 32
+
+struct sha256_ctx {
+    UINT32 h[8];
+    UINT64 len;             /* bytes hashed */
+    UINT8  block[64];
+    UINT32 used;            /* bytes in block */
+};
+
+void sha256_init(struct sha256_ctx *c);
+void sha256_update(struct sha256_ctx *c, const void *data, UINTN size);
+void sha256_final(struct sha256_ctx *c, UINT8 out[SHA256_DIGEST]);
+
+/* Parse the first 64 hex digits of text (a .sha256 file: the digest,
+   then usually the file name) into out. Returns 0 on success. */
+int sha256_parse(const char *text, UINTN len, UINT8 out[SHA256_DIGEST]);
+
+#endif /* HASH_H */
@@ -0,0 +1,513 @@
+/*
+ * hexview.c — Paged hex and ASCII view of a file or a raw device
+ *
+ * See hexview.h. Reads go through HV_PAGES cached pages of HV_PAGE
+ * bytes (whole blocks on a device), evicting the one least recently
+ * used; after each redraw the page next in the direction of travel is
+ * read too, so scrolling rarely waits. A device page whose read fails
+ * is read again a block at a time and the blocks that still fail show
+ * as "??". The search reads about HV_FIND bytes at a time into its own
+ * buffer, keeping the last needle-1 bytes in front of the next piece
+ * so a match across two pieces is found, and looks at the keyboard
+ * between pieces.
+ */
+
+#include "hexview.h"
+#include "fb.h"
+#include "kbd.h"
+#include "mem.h"
+#include "timer.h"
+#include "shim.h"
+
+#define HV_PAGE     (64 * 1024)
+#define HV_PAGES    8
+#define HV_FIND     (1024 * 1024)   /* bytes searched per read */
+#define HV_NEEDLE   64              /* longest pattern */
+#define HV_DRAW_MS  250             /* search progress */
+#define HV_ROW      16              /* bytes per row */
+#define HV_MAX_BAD  (HV_PAGE / 512) /* blocks per page we track */
+
+struct hv_page {
+    UINT64 base;                /* ~0 while empty */
+    UINT32 len;
+    UINT32 stamp;               /* last use */
+    int    ok;                  /* the whole page was read */
+    UINT8  bad[HV_MAX_BAD];     /* device blocks that failed, if !ok */
+    UINT8 *buf;
+};
+
+struct hv {
+    struct fs_file *file;       /* exactly one of file and dev */
+    struct disk_device *dev;
+    UINT64 size;
+    UINT32 block;               /* device block size, 1 for a file */
+    UINT32 page_size;           /* a multiple of block */
+    struct hv_page page[HV_PAGES];
+    UINT32 stamp;
+
+    UINT64 top;                 /* offset of the first row shown */
+    UINT64 cursor;
+    int    dir;                 /* last move: 1 forward, -1 back */
+    UINT32 rows;
+    UINT32 digits;              /* offset column width */
+
+    UINT8  needle[HV_NEEDLE];
+    UINT32 nlen;
+    UINT64 match;               /* last hit, ~0 for none */
+
+    char   title[160];
+    const char *msg;
+    char   msg_buf[128];
+};
+
+/* ---- Reading ---- */
+
+/* len bytes at off; on a device both are whole blocks */
+static int hv_read(struct hv *h, UINT64 off, void *buf, UINTN len) {
+    if (h->dev)
+        return disk_read_blocks(h->dev, off / h->block, len / h->block, buf);
+    if (fs_stream_seek(h->file, off) != 0) return -1;
+    for (UINTN done = 0; done < len;) {
+        UINTN n = len - done;
+        if (fs_stream_read(h->file, (UINT8 *)buf + done, &n) != 0 || n == 0)
+            return -1;
+        done += n;
+    }
+    return 0;
+}
+
+static void hv_fill(struct hv *h, struct hv_page *p, UINT64 base) {
+    UINT64 left = h->size - base;
+    p->base = base;
+    p->len = left < h->page_size ? (UINT32)left : h->page_size;
+    p->ok = hv_read(h, base, p->buf, p->len) == 0;
+    if (p->ok || !h->dev) return;
+
+    /* Find which blocks are unreadable */
+    mem_set(p->bad, 0, sizeof(p->bad));
+    UINT32 nblk = p->len / h->block;
+    for (UINT32 i = 0; i < nblk; i++) {
+        UINT8 *b = p->buf + (UINTN)i * h->block;
+        if (hv_read(h, base + (UINT64)i * h->block, b, h->block) != 0 && i < HV_MAX_BAD) {
+            p->bad[i] = 1;
+            mem_set(b, 0, h->block);
+        }
+    }
+}
+
+/* The cached page holding off, read in if need be */
+static struct hv_page *hv_page_of(struct hv *h, UINT64 off) {
+    UINT64 base = off - off % h->page_size;
+    struct hv_page *lru = &h->page[0];
+    for (int i = 0; i < HV_PAGES; i++) {
+        struct hv_page *p = &h->page[i];
+        if (p->base == base) {
+            p->stamp = ++h->stamp;
+            return p;
+        }
+        if (p->stamp < lru->stamp) lru = p;
+    }
+    hv_fill(h, lru, base);
+    lru->stamp = ++h->stamp;
+    return lru;
+}
+
+/* The byte at off into *out; 0 if it could not be read */
+static int hv_byte(struct hv *h, UINT64 off, UINT8 *out) {
+    struct hv_page *p = hv_page_of(h, off);
+    UINT32 at = (UINT32)(off - p->base);
+    *out = p->buf[at];
+    if (p->ok) return 1;
+    if (!h->dev) return 0;
+    UINT32 blk = at / h->block;
+    return blk >= HV_MAX_BAD || !p->bad[blk];
+}
+
+/* Read the page after (or before) the window ahead of the next key */
+static void hv_prefetch(struct hv *h) {
+    UINT64 span = (UINT64)h->rows * HV_ROW;
+    UINT64 off;
+    if (h->dir >= 0) {
+        off = h->top + span + h->page_size / 2;
+        if (off >= h->size) return;
+    } else {
+        if (h->top < h->page_size / 2) return;
+        off = h->top - h->page_size / 2;
+    }
+    UINT64 base = off - off % h->page_size;
+    for (int i = 0; i < HV_PAGES; i++)
+        if (h->page[i].base == base) return;
+    hv_page_of(h, off);
+}
+
+/* ---- Screen ---- */
+
+static int hv_in_match(struct hv *h, UINT64 off) {
+    return h->match != ~0ULL && off >= h->match && off < h->match + h->nlen;
+}
+
+static void draw_row(struct hv *h, UINT32 row, UINT64 off) {
+    UINT32 y = 2 + row;
+    if (off >= h->size) {
+        fb_line(y, "", COLOR_WHITE, COLOR_BLACK);
+        return;
+    }
+    char text[256];
+    UINT32 hex_x = h->digits + 3;
+    UINT32 asc_x = hex_x + HV_ROW * 3 + 2;
+    snprintf(text, sizeof(text), " %0*llx", (int)h->digits, (unsigned long long)off);
+    fb_line(y, text, COLOR_GRAY, COLOR_BLACK);
+
+    static const char digits[] = "0123456789abcdef";
+    for (UINT32 i = 0; i < HV_ROW && off + i < h->size; i++) {
+        UINT64 at = off + i;
+        UINT8 b;
+        int ok = hv_byte(h, at, &b);
+        char hx[3] = { digits[b >> 4], digits[b & 15], '\0' };
+        char ch = b >= 0x20 && b < 0x7F ? (char)b : '.';
+        UINT32 fg = b == 0 ? COLOR_DGRAY : COLOR_WHITE, bg = COLOR_BLACK;
+        if (!ok) {
+            hx[0] = hx[1] = ch = '?';
+            fg = COLOR_RED;
+        }
+        if (hv_in_match(h, at)) bg = COLOR_BLUE;
+        if (at == h->cursor) {
+            fg = COLOR_BLACK;
+            bg = COLOR_CYAN;
+        }
+        UINT32 x = hex_x + i * 3 + (i >= HV_ROW / 2);
+        if (x + 2 <= g_boot.cols) fb_string(x, y, hx, fg, bg);
+        if (asc_x + i < g_boot.cols) fb_char(asc_x + i, y, ch, fg, bg);
+    }
+}
+
+static void draw_view(struct hv *h) {
+    fb_line(0, h->title, COLOR_CYAN, COLOR_DGRAY);
+
+    char line[256];
+    if (h->dev) {
+        snprintf(line, sizeof(line),
+                 " Offset 0x%llx  LBA %llu + %u  of %llu blocks",
+                 (unsigned long long)h->cursor,
+                 (unsigned long long)(h->cursor / h->block),
+                 (unsigned)(h->cursor % h->block),
+                 (unsigned long long)(h->size / h->block));
+    } else {
+        snprintf(line, sizeof(line), " Offset 0x%llx (%llu) of %llu bytes",
+                 (unsigned long long)h->cursor, (unsigned long long)h->cursor,
+                 (unsigned long long)h->size);
+    }
+    fb_line(1, line, COLOR_YELLOW, COLOR_BLACK);
+
+    for (UINT32 r = 0; r < h->rows; r++)
+        draw_row(h, r, h->top + (UINT64)r * HV_ROW);
+
+    fb_line(g_boot.rows - 1,
+            h->msg ? h->msg
+            : h->dev ? " G:Offset L:LBA F:Find N:Next  arrows/PgUp/PgDn/Home/End  ESC:Back"
+                     : " G:Offset F:Find N:Next  arrows/PgUp/PgDn/Home/End  ESC:Back",
+            COLOR_GRAY, COLOR_DGRAY);
+    h->msg = NULL;
+    fb_present();
+}
+
+/* Keep the cursor's row in view */
+static void hv_scroll(struct hv *h) {
+    UINT64 row = h->cursor - h->cursor % HV_ROW;
+    UINT64 span = (UINT64)h->rows * HV_ROW;
+    if (row < h->top) h->top = row;
+    else if (row >= h->top + span) h->top = row - span + HV_ROW;
+}
+
+/* Cursor to off (clamped), the view centred on it if off is not shown */
+static void hv_goto(struct hv *h, UINT64 off) {
+    if (off >= h->size) off = h->size ? h->size - 1 : 0;
+    UINT64 span = (UINT64)h->rows * HV_ROW;
+    h->dir = off >= h->cursor ? 1 : -1;
+    h->cursor = off;
+    if (off < h->top || off >= h->top + span) {
+        UINT64 row = off - off % HV_ROW;
+        UINT64 back = (UINT64)(h->rows / 2) * HV_ROW;
+        h->top = row > back ? row - back : 0;
+    }
+}
+
+/* Read a line on the status bar; 0 on ENTER with text, -1 on ESC */
+static int hv_prompt(const char *prompt, char *out, int max) {
+    int len = 0;
+    out[0] = '\0';
+    for (;;) {
+        char line[256];
+        snprintf(line, sizeof(line), "%s%s_", prompt, out);
+        fb_line(g_boot.rows - 1, line, COLOR_WHITE, COLOR_DGRAY);
+        fb_present();
+
+        struct key_event ev;
+        kbd_wait(&ev);
+        if (ev.code == KEY_ESC) {
+            return -1;
+        } else if (ev.code == KEY_ENTER) {
+            if (len > 0) return 0;
+        } else if (ev.code == KEY_BS) {
+            if (len > 0) out[--len] = '\0';
+        } else if (ev.code >= 0x20 && ev.code <= 0x7E && len < max - 1) {
+            out[len++] = (char)ev.code;
+            out[len] = '\0';
+        }
+    }
+}
+
+/* A number as typed: 0x for hex, else decimal. Returns 0 if valid. */
+static int hv_number(const char *s, UINT64 *out) {
+    char *end;
+    while (*s == ' ') s++;
+    if (!*s) return -1;
+    *out = strtoull(s, &end, 0);
+    while (*end == ' ') end++;
+    return *end ? -1 : 0;
+}
+
+static int hex_digit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/* "text in quotes" or hex bytes ("55 AA", "55aa") into the needle */
+static int hv_pattern(struct hv *h, const char *s) {
+    UINT32 n = 0;
+    if (*s == '"') {
+        for (s++; *s && !(*s == '"' && !s[1]); s++) {
+            if (n == HV_NEEDLE) return -1;
+            h->needle[n++] = (UINT8)*s;
+        }
+    } else {
+        while (*s) {
+            if (*s == ' ') {
+                s++;
+                continue;
+            }
+            int hi = hex_digit(s[0]), lo = hi < 0 ? -1 : hex_digit(s[1]);
+            if (lo < 0 || n == HV_NEEDLE) return -1;
+            h->needle[n++] = (UINT8)(hi << 4 | lo);
+            s += 2;
+        }
+    }
+    if (n == 0) return -1;
+    h->nlen = n;
+    return 0;
+}
+
+static void hv_progress(struct hv *h, UINT64 at, UINT64 from) {
+    char line[128];
+    UINT64 total = h->size - from, done = at - from;
+    snprintf(line, sizeof(line),
+             " Searching: %llu of %llu MB (%u%%), any key stops",
+             (unsigned long long)(done >> 20), (unsigned long long)(total >> 20),
+             total ? (UINT32)(done * 100 / total) : 0);
+    fb_line(g_boot.rows - 1, line, COLOR_YELLOW, COLOR_DGRAY);
+    fb_present();
+}
+
+/* The needle from just after the cursor to the end */
+static void hv_find(struct hv *h) {
+    if (h->nlen == 0) {
+        h->msg = " Nothing to search for yet: F sets it";
+        return;
+    }
+    UINTN piece = h->block >= HV_FIND ? h->block : HV_FIND / h->block * h->block;
+    UINT8 *buf = (UINT8 *)mem_alloc_raw(piece + HV_NEEDLE);
+    if (!buf) {
+        h->msg = " Out of memory";
+        return;
+    }
+
+    /* Pieces start on a block; keep is what carries over */
+    UINT64 from = h->cursor + 1;
+    UINT64 pos = from - from % h->block;
+    UINTN keep = 0, skip = (UINTN)(from - pos);
+    UINT64 unread = 0, hz = timer_hz(), t_draw = timer_ticks();
+    UINT64 found = ~0ULL;
+    int stopped = 0;
+    while (pos < h->size && found == ~0ULL) {
+        UINT64 left = h->size - pos;
+        UINTN n = left < piece ? (UINTN)left : piece;
+        if (hv_read(h, pos, buf + keep, n) != 0) {
+            unread += n;
+            keep = 0;
+        } else {
+            /* buf holds the bytes from pos - keep */
+            const UINT8 *hay = buf + skip;
+            UINTN len = keep + n - skip;
+            const UINT8 *hit = (const UINT8 *)mem_find(hay, len, h->needle, h->nlen);
+            if (hit) {
+                found = pos - keep + (UINT64)(hit - buf);
+                break;
+            }
+            UINTN tail = h->nlen - 1;
+            if (tail > len) tail = len;
+            mem_move(buf, buf + keep + n - tail, tail);
+            keep = tail;
+        }
+        skip = 0;
+        pos += n;
+
+        if (timer_ticks() - t_draw > hz / 1000 * HV_DRAW_MS) {
+            struct key_event ev;
+            if (kbd_poll(&ev)) {
+                stopped = 1;
+                break;
+            }
+            hv_progress(h, pos, from);
+            t_draw = timer_ticks();
+        }
+    }
+    mem_free(buf);
+
+    if (found != ~0ULL) {
+        h->match = found;
+        hv_goto(h, found);
+        if (unread) {
+            snprintf(h->msg_buf, sizeof(h->msg_buf),
+                     " Found; %llu KB on the way could not be read",
+                     (unsigned long long)(unread >> 10));
+            h->msg = h->msg_buf;
+        }
+    } else {
+        snprintf(h->msg_buf, sizeof(h->msg_buf), " %s at 0x%llx%s",
+                 stopped ? "Stopped" : "Not found; searched to the end",
+                 (unsigned long long)(stopped ? pos : h->size),
+                 unread ? " (some of it unreadable)" : "");
+        h->msg = h->msg_buf;
+    }
+}
+
+/* ---- View ---- */
+
+static void hv_run(struct hv *h) {
+    h->rows = g_boot.rows > 3 ? (UINT32)g_boot.rows - 3 : 1;
+    h->digits = h->size > 0xFFFFFFFFULL ? 12 : 8;
+    h->match = ~0ULL;
+    h->page_size = h->block >= HV_PAGE ? h->block : HV_PAGE / h->block * h->block;
+    int have = 0;
+    for (int i = 0; i < HV_PAGES; i++) {
+        struct hv_page *p = &h->page[i];
+        p->base = ~0ULL;
+        p->buf = (UINT8 *)mem_alloc_raw(h->page_size);
+        if (p->buf) have = 1;
+        else p->stamp = ~0U;        /* never picked to be read into */
+    }
+    if (!have) return;
+
+    fb_clear(COLOR_BLACK);
+    UINT64 page = (UINT64)h->rows * HV_ROW;
+    for (;;) {
+        draw_view(h);
+        hv_prefetch(h);
+
+        struct key_event ev;
+        kbd_wait(&ev);
+        UINT64 c = h->cursor;
+        char in[80];
+        UINT64 v;
+        switch (ev.code) {
+        case KEY_UP:
+            if (c >= HV_ROW) c -= HV_ROW;
+            break;
+        case KEY_DOWN:
+            if (c + HV_ROW < h->size) c += HV_ROW;
+            break;
+        case KEY_LEFT:
+            if (c > 0) c--;
+            break;
+        case KEY_RIGHT:
+            if (c + 1 < h->size) c++;
+            break;
+        case KEY_PGUP:
+            c = c > page ? c - page : c % HV_ROW;
+            h->top = h->top > page ? h->top - page : 0;
+            break;
+        case KEY_PGDN:
+            if (c + page < h->size) {
+                c += page;
+                h->top += page;
+            }
+            break;
+        case KEY_HOME:
+            c = 0;
+            break;
+        case KEY_END:
+            c = h->size ? h->size - 1 : 0;
+            break;
+        case 'g':
+        case 'G':
+            if (hv_prompt(" Go to offset (0x for hex): ", in, sizeof(in)) != 0)
+                break;
+            if (hv_number(in, &v) != 0 || v >= h->size)
+                h->msg = " Not an offset in this file or device";
+            else
+                hv_goto(h, v);
+            continue;
+        case 'l':
+        case 'L':
+            if (!h->dev) break;
+            if (hv_prompt(" Go to LBA (0x for hex): ", in, sizeof(in)) != 0)
+                break;
+            if (hv_number(in, &v) != 0 || v >= h->size / h->block)
+                h->msg = " Not a block of this device";
+            else
+                hv_goto(h, v * h->block);
+            continue;
+        case 'f':
+        case 'F':
+        case '/':
+            if (hv_prompt(" Find hex bytes (55 AA) or \"text\": ", in, sizeof(in)) != 0)
+                break;
+            if (hv_pattern(h, in) != 0) {
+                h->msg = " Give hex byte pairs or \"text\", at most 64 bytes";
+                break;
+            }
+            hv_find(h);
+            continue;
+        case 'n':
+        case 'N':
+            hv_find(h);
+            continue;
+        case KEY_ESC:
+            goto out;
+        default:
+            break;
+        }
+        h->dir = c >= h->cursor ? 1 : -1;
+        h->cursor = c;
+        hv_scroll(h);
+    }
+
+out:
+    for (int i = 0; i < HV_PAGES; i++)
+        if (h->page[i].buf) mem_free(h->page[i].buf);
+}
+
+void hexview_file(struct fs_volume *v, const CHAR16 *path, const char *name) {
+    struct hv h;
+    mem_set(&h, 0, sizeof(h));
+    h.file = fs_volume_open_read(v, path, &h.size);
+    if (!h.file) return;
+    h.block = 1;
+    snprintf(h.title, sizeof(h.title), " Hex: %s", name);
+    if (h.size > 0) hv_run(&h);
+    fs_stream_close(h.file);
+}
+
+void hexview_disk(struct disk_device *dev) {
+    struct hv h;
+    mem_set(&h, 0, sizeof(h));
+    if (dev->block_size == 0 || dev->size_bytes == 0) return;
+    h.dev = dev;
+    h.size = dev->size_bytes;
+    h.block = dev->block_size;
+    snprintf(h.title, sizeof(h.title), " Hex: %s, %u-byte blocks (read only)",
+             dev->name, (unsigned)dev->block_size);
+    hv_run(&h);
+}
@@ -0,0 +1,24 @@
+/*
+ * hexview.h — Paged hex and ASCII view of a file or a raw device
+ *
+ * X in the browser, on a file or a [DISK] or [USB] entry. Only the
+ * rows on screen are read, through a few cached pages, plus the page
+ * the view is heading into, so a jump to any offset or LBA of a
+ * multi-terabyte device costs one read and memory use is fixed. A
+ * search for bytes or text streams forward from the cursor through
+ * mem_find(). Nothing is ever written.
+ */
+#ifndef HEXVIEW_H
+#define HEXVIEW_H
+
+#include "boot.h"
+#include "disk.h"
+#include "fs.h"
+
+/* View path on volume v; name is shown in the title */
+void hexview_file(struct fs_volume *v, const CHAR16 *path, const char *name);
+
+/* View the blocks of dev from LBA 0 */
+void hexview_disk(struct disk_device *dev);
+
+#endif /* HEXVIEW_H */
@@ -0,0 +1,721 @@
+/*
+ * image.c — Compressed whole-disk images: backup to a file and restore
+ *
+ * Backup reads the device through the pipelined reader, so the next
+ * buffers are in flight while one is checked for zeros, checksummed
+ * and compressed, its chunks in parallel on the worker pool (mp.h);
+ * stored chunks collect in a staging buffer that goes to the image
+ * file in large writes.  A read error closes the reader
+ * and the failed chunk is read again, then block by block, before the
+ * reader starts over behind it.
+ *
+ * Restore loads the index from the end of the file, then unpacks
+ * chunks straight into the pipelined writer's buffers, again checked
+ * and decompressed in parallel.  Long runs of
+ * zero chunks are handed to disk_zero_blocks(), which erases them where
+ * the device can.
+ */
+
+#include "boot.h"
+#include "fb.h"
+#include "kbd.h"
+#include "mem.h"
+#include "fs.h"
+#include "disk.h"
+#include "image.h"
+#include "hash.h"
+#include "lz4.h"
+#include "mp.h"
+#include "progress.h"
+#include "shim.h"
+
+#define IMG_READ_BUF  (4 * IMAGE_CHUNK)   /* device reads, whole chunks */
+#define IMG_OUT_BUF   (4 * IMAGE_CHUNK)   /* image file writes */
+#define IMG_IO_POOL   ((DISK_WRITER_NBUF + 1) * IMG_READ_BUF)
+#define IMG_GROUP     (IMG_READ_BUF / IMAGE_CHUNK)  /* chunks per buffer */
+#define IMG_ZERO_RUN  16    /* zero chunks in a row that restore erases */
+#define IMG_GIVE_UP   64    /* wholly unreadable chunks in a row: device gone */
+
+/* Largest LZ4 block kept: anything bigger is stored as read */
+#define IMG_PACKED_MAX(len) ((len) - (len) / 16)
+
+/* ---- UI helpers ---- */
+
+static void img_print(const char *msg, UINT32 color) {
+    if (g_boot.cols) fb_print(msg, color);
+}
+
+static void img_wait_key(void) {
+    img_print("  Press any key to return.\n", COLOR_DGRAY);
+    struct key_event ev;
+    kbd_wait(&ev);
+}
+
+/* Redraw the progress line at row when it is due */
+static void img_bar(struct progress *pg, UINT32 row, UINT64 bytes) {
+    if (!progress_add(pg, bytes)) return;
+    char line[128];
+    line[0] = line[1] = ' ';
+    int len = 2 + progress_line(pg, line + 2, sizeof(line) - 2);
+    while (len < (int)g_boot.cols && len < 126) line[len++] = ' ';
+    line[len] = '\0';
+    fb_string(0, row, line, COLOR_WHITE, COLOR_BLACK);
+    fb_present();
+}
+
+/* ESC pressed since the last look */
+static int img_cancelled(void) {
+    struct key_event ev;
+    return kbd_poll(&ev) && ev.code == KEY_ESC;
+}
+
+static UINT64 mb(UINT64 bytes) {
+    return bytes / (1024 * 1024);
+}
+
+static int all_zero(const UINT8 *p, UINTN len) {
+    const UINT64 *q = (const UINT64 *)p;
+    for (UINTN i = 0; i < len / 8; i++)
+        if (q[i])
+            return 0;
+    return 1;
+}
+
+static UINT32 header_crc(struct image_header *h) {
+    UINT32 saved = h->crc;
+    h->crc = 0;
+    UINT32 crc = crc32c(0, h, sizeof(*h));
+    h->crc = saved;
+    return crc;
+}
+
+/* Device bytes in chunk k of an image of total bytes */
+static UINTN chunk_len(UINT64 total, UINT32 chunk_size, UINT32 k) {
+    UINT64 left = total - (UINT64)k * chunk_size;
+    return left < chunk_size ? (UINTN)left : chunk_size;
+}
+
+/* ---- Backup ---- */
+
+/* One chunk on its way into the image: checksummed, checked for zeros
+   and compressed by pack_job, on whichever core is free */
+struct img_pack {
+    const UINT8 *data;
+    UINTN len;
+    UINT8 *packed;                  /* IMAGE_CHUNK bytes of room */
+    UINTN n;                        /* LZ4 bytes, 0 to store as read */
+    UINT32 crc;
+    int zero;
+    struct mp_job job;
+};
+
+static void pack_job(void *arg, void *arena) {
+    struct img_pack *p = (struct img_pack *)arg;
+    p->crc = crc32c(0, p->data, p->len);
+    p->zero = all_zero(p->data, p->len);
+    p->n = p->zero ? 0 : lz4_compress(p->data, p->len, p->packed,
+                                      IMG_PACKED_MAX(p->len), arena);
+}
+
+struct img_backup {
+    struct disk_device *dev;
+    struct fs_file *f;
+    UINT64 total;                   /* device bytes */
+    UINT32 chunks;
+    struct image_chunk *index;
+
+    UINT8 *out;                     /* staged file data */
+    UINTN out_len;
+    UINT64 written;                 /* bytes in the file so far */
+    int error;                      /* a file write failed */
+
+    UINT8 *packed;                  /* IMG_GROUP LZ4 blocks */
+    struct img_pack pack[IMG_GROUP];
+    UINT8 *salvage;                 /* a chunk read block by block */
+    UINT32 dead_run;                /* wholly unreadable chunks in a row */
+
+    UINT64 zero_bytes, unread_blocks;
+    struct progress pg;
+    UINT32 row;
+};
+
+static void out_flush(struct img_backup *b) {
+    if (b->out_len && !b->error &&
+        fs_stream_write(b->f, b->out, b->out_len) != 0)
+        b->error = 1;
+    b->written += b->out_len;
+    b->out_len = 0;
+}
+
+static void out_put(struct img_backup *b, const void *data, UINTN len) {
+    const UINT8 *p = (const UINT8 *)data;
+    while (len > 0) {
+        UINTN n = IMG_OUT_BUF - b->out_len;
+        if (n > len) n = len;
+        mem_copy(b->out + b->out_len, p, n);
+        b->out_len += n;
+        p += n;
+        len -= n;
+        if (b->out_len == IMG_OUT_BUF) out_flush(b);
+    }
+}
+
+/* Index chunk k as packed and store it */
+static void backup_store(struct img_backup *b, UINT32 k,
+                         const struct img_pack *p, int unread) {
+    struct image_chunk *c = &b->index[k];
+    c->crc = p->crc;
+    c->unread = (UINT8)(unread != 0);
+    if (p->zero) {
+        c->method = IMAGE_ZERO;
+        c->length = 0;
+        b->zero_bytes += p->len;
+    } else {
+        c->method = p->n ? IMAGE_LZ4 : IMAGE_RAW;
+        c->length = (UINT32)(p->n ? p->n : p->len);
+        out_put(b, p->n ? p->packed : p->data, c->length);
+    }
+    img_bar(&b->pg, b->row, p->len);
+}
+
+/* Pack chunks k.. from a read buffer of len bytes, all at once on the
+   worker pool, then store them in order. Returns the chunk count. */
+static UINT32 backup_group(struct img_backup *b, UINT32 k, const UINT8 *data,
+                           UINTN len, int unread) {
+    UINT32 m = 0;
+    for (UINTN off = 0; off < len && k + m < b->chunks && m < IMG_GROUP; m++) {
+        struct img_pack *p = &b->pack[m];
+        p->data = data + off;
+        p->len = chunk_len(b->total, IMAGE_CHUNK, k + m);
+        p->packed = b->packed + (UINTN)m * IMAGE_CHUNK;
+        mp_submit(&p->job, pack_job, p);
+        off += p->len;
+    }
+    for (UINT32 i = 0; i < m; i++) {
+        mp_wait(&b->pack[i].job);
+        backup_store(b, k + i, &b->pack[i], unread);
+    }
+    return m;
+}
+
+/* Read chunk k after the reader failed on it: whole, else one block at
+   a time with unreadable blocks left as zeros. Returns -1 once the
+   device has stopped answering altogether. */
+static int backup_salvage(struct img_backup *b, UINT32 k) {
+    UINT32 bs = b->dev->block_size;
+    UINTN len = chunk_len(b->total, IMAGE_CHUNK, k);
+    UINT64 lba = (UINT64)k * (IMAGE_CHUNK / bs);
+    UINT64 count = len / bs;
+    UINT64 bad = 0;
+
+    if (disk_read_blocks(b->dev, lba, count, b->salvage) != 0) {
+        for (UINT64 i = 0; i < count; i++) {
+            UINT8 *blk = b->salvage + i * bs;
+            if (disk_read_blocks(b->dev, lba + i, 1, blk) != 0) {
+                mem_set(blk, 0, bs);
+                bad++;
+            }
+        }
+    }
+    b->unread_blocks += bad;
+    b->dead_run = bad == count ? b->dead_run + 1 : 0;
+    if (b->dead_run >= IMG_GIVE_UP) return -1;
+    backup_group(b, k, b->salvage, len, bad != 0);
+    return 0;
+}
+
+/* Image every chunk. Returns 0, 1 if cancelled, -1 on error. */
+static int backup_run(struct img_backup *b) {
+    UINT32 bs = b->dev->block_size;
+    UINT64 blocks = b->total / bs;
+    UINT32 k = 0;
+
+    while (k < b->chunks) {
+        UINT64 lba = (UINT64)k * (IMAGE_CHUNK / bs);
+        struct disk_reader *r = disk_reader_open(b->dev, lba, blocks - lba,
+                                                 IMG_READ_BUF);
+        if (!r) r = disk_reader_open(b->dev, lba, blocks - lba, IMAGE_CHUNK);
+        if (!r) return -1;
+
+        int cancel = 0;
+        const UINT8 *data;
+        UINTN len;
+        while (k < b->chunks && !b->error && !cancel &&
+               (data = (const UINT8 *)disk_reader_next(r, &len)) != NULL) {
+            k += backup_group(b, k, data, len, 0);
+            b->dead_run = 0;
+            cancel = img_cancelled();
+        }
+        int failed = disk_reader_close(r) != 0;
+        if (b->error) return -1;
+        if (cancel) return 1;
+        if (k < b->chunks) {
+            if (!failed) return -1;     /* ended early without saying why */
+            if (backup_salvage(b, k) != 0 || b->error) return -1;
+            k++;
+        }
+    }
+    return 0;
+}
+
+int image_backup(struct disk_device *dev, struct fs_volume *dst,
+                 const CHAR16 *path, const char *name, EFI_HANDLE vol_handle) {
+    char buf[256];
+    fb_clear(COLOR_BLACK);
+    img_print("\n", COLOR_WHITE);
+    img_print("  ========================================\n", COLOR_CYAN);
+    img_print("       BACK UP DEVICE TO IMAGE\n", COLOR_CYAN);
+    img_print("  ========================================\n", COLOR_CYAN);
+    img_print("\n", COLOR_WHITE);
+
+    snprintf(buf, sizeof(buf), "  Device: %s (%llu MB)\n", dev->name,
+             (unsigned long long)mb(dev->size_bytes));
+    img_print(buf, COLOR_WHITE);
+    snprintf(buf, sizeof(buf), "  Image:  %s\n", name);
+    img_print(buf, COLOR_WHITE);
+
+    UINT64 total_bytes, free_bytes;
+    if (fs_volume_space(dst, &total_bytes, &free_bytes) == 0) {
+        snprintf(buf, sizeof(buf), "  Free on destination: %llu MB\n",
+                 (unsigned long long)mb(free_bytes));
+        img_print(buf, COLOR_WHITE);
+    }
+    img_print("\n", COLOR_WHITE);
+
+    /* The image cannot be written into the device it is taken of */
+    int same = vol_handle ? disk_holds_volume(dev, vol_handle)
+                          : fs_volume_type(dst) == FS_VOL_SFS && dev->is_boot_device;
+    if (same) {
+        img_print("  The destination volume is on this device.\n", COLOR_RED);
+        img_print("  Open a volume on another drive first.\n", COLOR_RED);
+        img_wait_key();
+        return -1;
+    }
+    UINT32 bs = dev->block_size;
+    if (bs == 0 || IMAGE_CHUNK % bs != 0 || dev->size_bytes < bs) {
+        img_print("  Unsupported block size.\n", COLOR_RED);
+        img_wait_key();
+        return -1;
+    }
+    enum fs_vol_type type = fs_volume_type(dst);
+    if ((type == FS_VOL_FAT32 || type == FS_VOL_SFS) &&
+        dev->size_bytes > 0xFFFFFFFFULL) {
+        img_print("  FAT32 files stop at 4 GB: the backup fails if the\n", COLOR_YELLOW);
+        img_print("  image does not compress below that (exFAT has no limit).\n", COLOR_YELLOW);
+        img_print("\n", COLOR_WHITE);
+    }
+
+    img_print("  Every block is read; zeros take no space and the rest\n", COLOR_WHITE);
+    img_print("  is compressed. ESC stops the backup.\n\n", COLOR_WHITE);
+    img_print("  Press 'Y' to start, any other key to cancel.\n", COLOR_YELLOW);
+    struct key_event ev;
+    kbd_wait(&ev);
+    if (ev.code != 'Y' && ev.code != 'y') return -1;
+    img_print("\n", COLOR_WHITE);
+
+    struct img_backup b;
+    mem_set(&b, 0, sizeof(b));
+    b.dev = dev;
+    b.total = dev->size_bytes / bs * bs;
+    b.chunks = (UINT32)((b.total + IMAGE_CHUNK - 1) / IMAGE_CHUNK);
+    b.index = (struct image_chunk *)mem_alloc((UINTN)b.chunks * sizeof(struct image_chunk));
+    b.out = (UINT8 *)mem_alloc_raw(IMG_OUT_BUF);
+    b.packed = (UINT8 *)mem_alloc_raw(IMG_GROUP * IMAGE_CHUNK);
+    b.salvage = (UINT8 *)mem_alloc_raw(IMAGE_CHUNK);
+    UINT64 io_pool = mem_io_set_pool(IMG_IO_POOL);
+    int rc = -1;
+
+    if (b.index && b.out && b.packed && b.salvage)
+        b.f = fs_volume_open_write(dst, path);
+    if (b.f) {
+        struct image_header h;
+        mem_set(&h, 0, sizeof(h));
+        mem_copy(h.magic, IMAGE_MAGIC, 8);
+        h.version = IMAGE_VERSION;
+        h.block_size = bs;
+        h.blocks = b.total / bs;
+        h.chunk_size = IMAGE_CHUNK;
+        h.chunks = b.chunks;
+        h.created = (UINT32)time(NULL);
+        snprintf(h.source, sizeof(h.source), "%s", dev->name);
+        h.crc = header_crc(&h);
+        mem_set(b.out, 0, IMAGE_HEADER);
+        mem_copy(b.out, &h, sizeof(h));
+        b.out_len = IMAGE_HEADER;
+
+        b.row = g_boot.cursor_y;
+        progress_start(&b.pg, "Imaging", b.total);
+        mp_start();
+        rc = backup_run(&b);
+        mp_stop();
+
+        if (rc == 0) {
+            struct image_tail t;
+            mem_set(&t, 0, sizeof(t));
+            mem_copy(t.magic, IMAGE_TAIL, 8);
+            t.index_offset = b.written + b.out_len;
+            t.unread_blocks = b.unread_blocks;
+            t.chunks = b.chunks;
+            t.index_crc = crc32c(0, b.index, (UINTN)b.chunks * sizeof(struct image_chunk));
+            out_put(&b, b.index, (UINTN)b.chunks * sizeof(struct image_chunk));
+            out_put(&b, &t, sizeof(t));
+        }
+        out_flush(&b);
+        if (fs_stream_close(b.f) != 0 || b.error) rc = -1;
+        if (rc != 0) fs_volume_delete(dst, path);
+    }
+    mem_io_set_pool(io_pool);
+
+    char detail[160];
+    snprintf(detail, sizeof(detail), "%s -> %s", dev->name, name);
+    if (rc >= 0 && b.pg.chunks) progress_log(&b.pg, detail, rc == 0);
+
+    if (b.index) mem_free(b.index);
+    if (b.out) mem_free(b.out);
+    if (b.packed) mem_free(b.packed);
+    if (b.salvage) mem_free(b.salvage);
+
+    img_print("\n\n", COLOR_WHITE);
+    if (rc == 1) {
+        img_print("  Cancelled; the partial image was deleted.\n", COLOR_YELLOW);
+        img_wait_key();
+        return -1;
+    }
+    if (rc != 0) {
+        img_print(b.error ? "  Writing the image failed (destination full?).\n"
+                          : b.f ? "  Reading the device failed.\n"
+                                : "  Could not create the image file.\n", COLOR_RED);
+        img_wait_key();
+        return -1;
+    }
+
+    img_print("  ========================================\n", COLOR_GREEN);
+    img_print("    IMAGE SAVED\n", COLOR_GREEN);
+    img_print("  ========================================\n\n", COLOR_GREEN);
+    snprintf(buf, sizeof(buf), "  %llu MB of device data in a %llu MB image (%llu MB zeros)\n",
+             (unsigned long long)mb(b.total), (unsigned long long)mb(b.written),
+             (unsigned long long)mb(b.zero_bytes));
+    img_print(buf, COLOR_WHITE);
+    char stats[128];
+    progress_summary(&b.pg, stats, sizeof(stats));
+    snprintf(buf, sizeof(buf), "  Imaging: %s\n", stats);
+    img_print(buf, COLOR_DGRAY);
+    if (b.unread_blocks) {
+        snprintf(buf, sizeof(buf), "  %llu unreadable blocks were imaged as zeros.\n",
+                 (unsigned long long)b.unread_blocks);
+        img_print(buf, COLOR_YELLOW);
+    }
+    img_print("\n", COLOR_WHITE);
+    img_wait_key();
+    return 0;
+}
+
+/* ---- Restore ---- */
+
+/* Read and check the header, tail and index. Returns the index
+   (mem_free() it) or NULL with a message printed. */
+static struct image_chunk *restore_load(struct fs_file *f, UINT64 size,
+                                        struct image_header *h) {
+    struct image_tail t;
+    UINTN n = sizeof(*h);
+    if (size < IMAGE_HEADER + sizeof(t) ||
+        fs_stream_read(f, h, &n) != 0 || n != sizeof(*h) ||
+        mem_cmp(h->magic, IMAGE_MAGIC, 8) != 0) {
+        img_print("  Not a disk image.\n", COLOR_RED);
+        return NULL;
+    }
+    if (h->version != IMAGE_VERSION || header_crc(h) != h->crc ||
+        h->block_size == 0 || h->chunk_size == 0 ||
+        h->chunk_size > IMAGE_CHUNK || h->chunk_size % h->block_size != 0 ||
+        h->chunks != (h->blocks * h->block_size + h->chunk_size - 1) / h->chunk_size) {
+        img_print("  The image header is damaged or from a newer version.\n", COLOR_RED);
+        return NULL;
+    }
+
+    n = sizeof(t);
+    UINT64 index_bytes = (UINT64)h->chunks * sizeof(struct image_chunk);
+    if (fs_stream_seek(f, size - sizeof(t)) != 0 ||
+        fs_stream_read(f, &t, &n) != 0 || n != sizeof(t) ||
+        mem_cmp(t.magic, IMAGE_TAIL, 8) != 0 || t.chunks != h->chunks ||
+        t.index_offset < IMAGE_HEADER ||
+        t.index_offset + index_bytes + sizeof(t) != size) {
+        img_print("  The image is incomplete (the backup did not finish).\n", COLOR_RED);
+        return NULL;
+    }
+
+    struct image_chunk *index = (struct image_chunk *)mem_alloc_raw((UINTN)index_bytes);
+    if (!index) {
+        img_print("  Out of memory.\n", COLOR_RED);
+        return NULL;
+    }
+    n = (UINTN)index_bytes;
+    UINT64 stored = 0;
+    int ok = fs_stream_seek(f, t.index_offset) == 0 &&
+             fs_stream_read(f, index, &n) == 0 && n == index_bytes &&
+             crc32c(0, index, n) == t.index_crc;
+    for (UINT32 k = 0; ok && k < h->chunks; k++) {
+        UINTN len = chunk_len(h->blocks * h->block_size, h->chunk_size, k);
+        struct image_chunk *c = &index[k];
+        ok = c->method == IMAGE_ZERO ? c->length == 0
+           : c->method == IMAGE_RAW  ? c->length == len
+           : c->method == IMAGE_LZ4 && c->length > 0 && c->length < len;
+        stored += c->length;
+    }
+    if (!ok || IMAGE_HEADER + stored != t.index_offset) {
+        img_print("  The image index is damaged.\n", COLOR_RED);
+        mem_free(index);
+        return NULL;
+    }
+    return index;
+}
+
+/* One chunk on its way to the device: unpacked into the writer's
+   buffer and checked against its CRC by unpack_job */
+struct img_unpack {
+    const struct image_chunk *c;
+    const UINT8 *packed;            /* the stored LZ4 block */
+    UINT8 *buf;
+    UINTN len;
+    int bad;                        /* damaged: did not unpack or match */
+    struct mp_job job;
+};
+
+static void unpack_job(void *arg, void *arena) {
+    struct img_unpack *u = (struct img_unpack *)arg;
+    const struct image_chunk *c = u->c;
+    (void)arena;
+    if (c->method == IMAGE_ZERO)
+        mem_set(u->buf, 0, u->len);
+    else if (c->method == IMAGE_LZ4 &&
+             lz4_decompress(u->packed, c->length, u->buf, u->len) != (INTN)u->len) {
+        u->bad = 1;
+        return;
+    }
+    u->bad = crc32c(0, u->buf, u->len) != c->crc;
+}
+
+/* Zero chunks in a row from k */
+static UINT32 zero_run(const struct image_chunk *index, UINT32 chunks, UINT32 k) {
+    UINT32 run = 0;
+    while (k + run < chunks && index[k + run].method == IMAGE_ZERO) run++;
+    return run;
+}
+
+/* Write every chunk to dev. packed has room for IMG_GROUP chunks.
+   Returns 0, 1 if cancelled, -1 on a device error, or 2 + k if chunk k
+   does not match its checksum. */
+static int restore_run(struct disk_device *dev, struct fs_file *f,
+                       const struct image_header *h,
+                       const struct image_chunk *index, UINT8 *packed,
+                       struct progress *pg, UINT32 row) {
+    UINT64 total = h->blocks * h->block_size;
+    UINT32 bs = dev->block_size;
+    UINT32 per = h->chunk_size / bs;    /* device blocks per chunk */
+    struct disk_writer *w = NULL;
+    struct img_unpack un[IMG_GROUP];
+    int rc = 0;
+
+    if (fs_stream_seek(f, IMAGE_HEADER) != 0) return -1;
+    for (UINT32 k = 0; k < h->chunks && rc == 0; ) {
+        /* A long run of zeros goes in one request, erased if possible */
+        UINT32 run = zero_run(index, h->chunks, k);
+        if (run >= IMG_ZERO_RUN) {
+            if (w && disk_writer_close(w) != 0) { w = NULL; rc = -1; break; }
+            w = NULL;
+            UINT64 end = (UINT64)(k + run) * h->chunk_size;
+            if (end > total) end = total;
+            UINT64 bytes = end - (UINT64)k * h->chunk_size;
+            if (disk_zero_blocks(dev, (UINT64)k * per, bytes / bs, NULL) < 0) {
+                rc = -1;
+                break;
+            }
+            img_bar(pg, row, bytes);
+            k += run;
+            continue;
+        }
+
+        if (!w) {
+            w = disk_writer_open(dev, (UINT64)k * per,
+                                 IMG_GROUP * h->chunk_size, 0);
+            if (!w) { rc = -1; break; }
+        }
+        UINT8 *buf = (UINT8 *)disk_writer_next(w);
+        if (!buf) { rc = -1; break; }
+
+        /* Read up to IMG_GROUP chunks, stopping short of a zero run,
+           and unpack them all at once on the worker pool */
+        UINT32 m = 0;
+        UINTN fill = 0;
+        while (m < IMG_GROUP && k + m < h->chunks) {
+            if (m > 0 && zero_run(index, h->chunks, k + m) >= IMG_ZERO_RUN)
+                break;
+            const struct image_chunk *c = &index[k + m];
+            struct img_unpack *u = &un[m];
+            u->c = c;
+            u->packed = packed + (UINTN)m * h->chunk_size;
+            u->buf = buf + fill;
+            u->len = chunk_len(total, h->chunk_size, k + m);
+            u->bad = 0;
+            UINTN n = c->length;
+            if (c->method == IMAGE_RAW) {
+                if (fs_stream_read(f, u->buf, &n) != 0 || n != u->len) rc = -1;
+            } else if (c->method == IMAGE_LZ4) {
+                if (fs_stream_read(f, (UINT8 *)u->packed, &n) != 0 ||
+                    n != c->length)
+                    rc = 2 + (int)(k + m);
+            }
+            if (rc != 0) break;
+            mp_submit(&u->job, unpack_job, u);
+            fill += u->len;
+            m++;
+        }
+        for (UINT32 i = 0; i < m; i++) {
+            mp_wait(&un[i].job);
+            if (rc == 0 && un[i].bad) rc = 2 + (int)(k + i);
+        }
+        if (rc == 0 && disk_writer_submit(w, fill) != 0) rc = -1;
+        img_bar(pg, row, fill);
+        k += m;
+        if (rc == 0 && img_cancelled()) rc = 1;
+    }
+    if (w && disk_writer_close(w) != 0 && rc == 0) rc = -1;
+    return rc;
+}
+
+int image_restore(struct fs_volume *src, const CHAR16 *path, const char *name,
+                  EFI_HANDLE vol_handle) {
+    char buf[256];
+    fb_clear(COLOR_BLACK);
+    img_print("\n", COLOR_WHITE);
+    img_print("  ========================================\n", COLOR_CYAN);
+    img_print("       RESTORE IMAGE TO DEVICE\n", COLOR_CYAN);
+    img_print("  ========================================\n", COLOR_CYAN);
+    img_print("\n", COLOR_WHITE);
+    snprintf(buf, sizeof(buf), "  Image: %s\n", name);
+    img_print(buf, COLOR_WHITE);
+
+    UINT64 size = 0;
+    struct fs_file *f = fs_volume_open_read(src, path, &size);
+    if (!f) {
+        img_print("  Failed to open the image.\n", COLOR_RED);
+        img_wait_key();
+        return -1;
+    }
+    struct image_header h;
+    struct image_chunk *index = restore_load(f, size, &h);
+    if (!index) {
+        fs_stream_close(f);
+        img_wait_key();
+        return -1;
+    }
+    UINT64 total = h.blocks * h.block_size;
+    h.source[sizeof(h.source) - 1] = '\0';
+    snprintf(buf, sizeof(buf), "  Taken of: %s, %llu MB (%llu MB in the file)\n\n",
+             h.source, (unsigned long long)mb(total), (unsigned long long)mb(size));
+    img_print(buf, COLOR_WHITE);
+
+    struct disk_device devs[DISK_MAX_DEVICES];
+    int ndevs = disk_enumerate(devs, DISK_MAX_DEVICES);
+    int ok[DISK_MAX_DEVICES];
+    int target = -1;
+    img_print("  Select target device:\n\n", COLOR_WHITE);
+    for (int i = 0; i < ndevs; i++) {
+        int holds = disk_holds_volume(&devs[i], vol_handle);
+        int fits = devs[i].size_bytes >= total && devs[i].block_size &&
+                   h.chunk_size % devs[i].block_size == 0 &&
+                   total % devs[i].block_size == 0;
+        ok[i] = fits && !holds && !devs[i].is_boot_device;
+        snprintf(buf, sizeof(buf), "  [%d] %s", i + 1, devs[i].name);
+        img_print(buf, ok[i] ? COLOR_YELLOW : COLOR_DGRAY);
+        img_print(holds ? " * IMAGE SOURCE\n"
+                        : devs[i].is_boot_device ? " (boot device)\n"
+                        : !fits ? " (too small)\n" : "\n", COLOR_DGRAY);
+        if (ok[i] && (target < 0 || (!devs[target].is_removable &&
+                                     devs[i].is_removable)))
+            target = i;
+    }
+    if (target < 0) {
+        img_print("\n  No suitable target device found.\n", COLOR_RED);
+        mem_free(index);
+        fs_stream_close(f);
+        img_wait_key();
+        return -1;
+    }
+
+    snprintf(buf, sizeof(buf), "\n  Target: [%d] %s\n", target + 1, devs[target].name);
+    img_print(buf, COLOR_YELLOW);
+    img_print("  Press number to change, ENTER to continue, ESC to cancel.\n", COLOR_DGRAY);
+    for (;;) {
+        struct key_event ev;
+        kbd_wait(&ev);
+        if (ev.code == KEY_ESC) {
+            mem_free(index);
+            fs_stream_close(f);
+            return -1;
+        }
+        if (ev.code == KEY_ENTER) break;
+        if (ev.code >= '1' && ev.code < '1' + ndevs && ok[ev.code - '1']) {
+            target = ev.code - '1';
+            snprintf(buf, sizeof(buf), "  Target: [%d] %s\n", target + 1, devs[target].name);
+            img_print(buf, COLOR_YELLOW);
+        }
+    }
+    struct disk_device *dev = &devs[target];
+
+    img_print("\n  This will ERASE all data on the target device!\n", COLOR_RED);
+    img_print("  Press 'Y' to proceed, any other key to cancel.\n", COLOR_YELLOW);
+    struct key_event ev;
+    kbd_wait(&ev);
+    if (ev.code != 'Y' && ev.code != 'y') {
+        mem_free(index);
+        fs_stream_close(f);
+        return -1;
+    }
+    img_print("\n  Restoring...\n", COLOR_WHITE);
+
+    UINT8 *packed = (UINT8 *)mem_alloc_raw(IMG_GROUP * h.chunk_size);
+    UINT64 io_pool = mem_io_set_pool(IMG_IO_POOL);
+    struct progress pg;
+    progress_start(&pg, "Restoring", total);
+    mp_start();
+    int rc = packed ? restore_run(dev, f, &h, index, packed, &pg, g_boot.cursor_y)
+                    : -1;
+    mp_stop();
+    mem_io_set_pool(io_pool);
+    if (packed) mem_free(packed);
+    mem_free(index);
+    fs_stream_close(f);
+
+    /* The firmware's view of the device is stale now */
+    disk_reconnect(dev);
+    fs_cache_invalidate();
+
+    char detail[160];
+    snprintf(detail, sizeof(detail), "%s -> %s", name, dev->name);
+    progress_log(&pg, detail, rc == 0);
+
+    img_print("\n\n", COLOR_WHITE);
+    if (rc == 1) {
+        img_print("  Cancelled: the device holds part of the image.\n", COLOR_YELLOW);
+    } else if (rc >= 2) {
+        snprintf(buf, sizeof(buf), "  The image is damaged at %llu MB (checksum mismatch).\n",
+                 (unsigned long long)mb((UINT64)(rc - 2) * h.chunk_size));
+        img_print(buf, COLOR_RED);
+    } else if (rc != 0) {
+        img_print("  Restore failed: a read or write error.\n", COLOR_RED);
+    } else {
+        img_print("  ========================================\n", COLOR_GREEN);
+        img_print("    IMAGE RESTORED\n", COLOR_GREEN);
+        img_print("  ========================================\n\n", COLOR_GREEN);
+        snprintf(buf, sizeof(buf), "  Wrote %llu MB to %s; every chunk matched its checksum.\n",
+                 (unsigned long long)mb(total), dev->name);
+        img_print(buf, COLOR_WHITE);
+        char stats[128];
+        progress_summary(&pg, stats, sizeof(stats));
+        snprintf(buf, sizeof(buf), "  Restoring: %s\n", stats);
+        img_print(buf, COLOR_DGRAY);
+    }
+    img_print("\n", COLOR_WHITE);
+    img_wait_key();
+    return rc == 0 ? 0 : -1;
+}
@@ -0,0 +1,80 @@
+/*
+ * image.h — Compressed whole-disk images: backup to a file and restore
+ *
+ * A backup streams every block of a device into one image file on any
+ * writable volume: all-zero chunks are only noted in the index, the
+ * rest is LZ4-compressed (or stored when it does not shrink), and each
+ * chunk's CRC32C is kept so a restore can prove the data it writes.
+ * Unreadable blocks on a failing drive are retried one at a time and
+ * imaged as zeros, so a backup gets everything that can still be read.
+ *
+ * File layout, all little-endian:
+ *
+ *     header    IMAGE_HEADER bytes: struct image_header, zero-padded
+ *     data      the stored chunks in order, back to back
+ *     index     struct image_chunk for every chunk
+ *     tail      struct image_tail
+ */
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include "fs.h"
+#include "disk.h"
+
+#define IMAGE_MAGIC   "SURVIMG1"
+#define IMAGE_TAIL    "SURVIDX1"
+#define IMAGE_VERSION 1
+#define IMAGE_HEADER  4096
+#define IMAGE_CHUNK   (1024 * 1024)   /* device bytes per chunk */
+
+/* How a chunk is stored */
+#define IMAGE_ZERO 0                  /* all zeros: no data */
+#define IMAGE_RAW  1                  /* as read */
+#define IMAGE_LZ4  2                  /* one LZ4 block */
+
+struct image_header {
+    char   magic[8];                  /* IMAGE_MAGIC */
+    UINT32 version;
+    UINT32 block_size;                /* of the source device */
+    UINT64 blocks;                    /* device size in blocks */
+    UINT32 chunk_size;
+    UINT32 chunks;
+    UINT32 created;                   /* seconds since 1970 */
+    UINT32 crc;                       /* CRC32C of this struct with crc = 0 */
+    char   source[64];                /* device name */
+};
+
+struct image_chunk {
+    UINT32 length;                    /* bytes stored (0 for IMAGE_ZERO) */
+    UINT32 crc;                       /* CRC32C of the chunk's device bytes */
+    UINT8  method;                    /* IMAGE_ZERO/RAW/LZ4 */
+    UINT8  unread;                    /* some blocks could not be read */
+    UINT16 reserved;
+};
+
+struct image_tail {
+    char   magic[8];                  /* IMAGE_TAIL */
+    UINT64 index_offset;
+    UINT64 unread_blocks;             /* imaged as zeros */
+    UINT32 chunks;
+    UINT32 index_crc;                 /* CRC32C of the index */
+};
+
+/* File extension the browser offers F10:Restore on */
+#define IMAGE_EXT ".SIMG"
+
+/* Image all of dev into path on dst (vol_handle is dst's BlockIO
+   handle, NULL for the boot volume or the RAM disk), after showing the
+   plan and asking. A partial file is deleted. Returns 0 on success,
+   -1 on error or cancel. */
+int image_backup(struct disk_device *dev, struct fs_volume *dst,
+                 const CHAR16 *path, const char *name, EFI_HANDLE vol_handle);
+
+/* Write the image at path on src back to a device the user picks
+   (never the boot device or the one holding the image, identified by
+   vol_handle as above), checking every chunk's CRC as it goes.
+   Returns 0 on success, -1 on error or cancel. */
+int image_restore(struct fs_volume *src, const CHAR16 *path, const char *name,
+                  EFI_HANDLE vol_handle);
+
+#endif /* IMAGE_H */
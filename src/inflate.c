@@ -0,0 +1,313 @@
+/*
+ * inflate.c — DEFLATE decoding (RFC 1951) for gzip and zip archives
+ *
+ * See inflate.h. The bit buffer is refilled a byte at a time, only as
+ * far as the next code needs, so at the end of a stream it holds no
+ * more than two bytes that belong to whatever follows. Codes the fast
+ * table does not cover are decoded bit by bit against the canonical
+ * code counts, as in zlib's puff.
+ */
+
+#include "inflate.h"
+#include "mem.h"
+
+#define MAX_BITS 15
+
+static const UINT16 LEN_BASE[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+static const UINT8 LEN_EXTRA[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+static const UINT16 DIST_BASE[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+    8193, 12289, 16385, 24577
+};
+static const UINT8 DIST_EXTRA[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+/* Order the code length code lengths are sent in */
+static const UINT8 CLEN_ORDER[19] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15
+};
+
+void inflate_init(struct inflate *z, struct inflate_src *src,
+                  inflate_out_fn out, void *ctx) {
+    z->src = src;
+    z->out = out;
+    z->ctx = ctx;
+    z->bits = 0;
+    z->nbits = 0;
+    z->wpos = 0;
+    z->flushed = 0;
+    z->total = 0;
+}
+
+/* ---- Bits ---- */
+
+/* At least k bits in the buffer; -1 when the input runs out first */
+static int need(struct inflate *z, UINT32 k) {
+    struct inflate_src *s = z->src;
+    while (z->nbits < k) {
+        if (s->n == 0 && (s->fill(s) != 0 || s->n == 0)) return -1;
+        z->bits |= (UINT64)*s->p++ << z->nbits;
+        s->n--;
+        z->nbits += 8;
+    }
+    return 0;
+}
+
+/* k bits that need() has made sure of */
+static UINT32 take(struct inflate *z, UINT32 k) {
+    UINT32 v = (UINT32)(z->bits & (((UINT64)1 << k) - 1));
+    z->bits >>= k;
+    z->nbits -= k;
+    return v;
+}
+
+/* ---- Huffman codes ---- */
+
+static UINT32 reverse(UINT32 code, UINT32 len) {
+    UINT32 r = 0;
+    for (UINT32 i = 0; i < len; i++, code >>= 1)
+        r = (r << 1) | (code & 1);
+    return r;
+}
+
+/* Canonical code from n code lengths. Returns -1 if the lengths ask
+   for more codes than there are; fewer is allowed (a one-code
+   distance tree sends just one). */
+static int build(struct inflate_huff *h, const UINT8 *len, int n) {
+    mem_set(h->count, 0, sizeof(h->count));
+    for (int i = 0; i < n; i++) h->count[len[i]]++;
+    h->count[0] = 0;
+
+    int left = 1;
+    for (int l = 1; l <= MAX_BITS; l++) {
+        left <<= 1;
+        left -= h->count[l];
+        if (left < 0) return -1;
+    }
+
+    UINT16 offs[MAX_BITS + 1];
+    offs[1] = 0;
+    for (int l = 1; l < MAX_BITS; l++) offs[l + 1] = offs[l] + h->count[l];
+    for (int i = 0; i < n; i++)
+        if (len[i]) h->sym[offs[len[i]]++] = (UINT16)i;
+
+    /* Codes are sent from their top bit down while the stream is read
+       from the bottom bit up, so the table is indexed reversed */
+    mem_set(h->fast, 0, sizeof(h->fast));
+    UINT32 code = 0, k = 0;
+    for (UINT32 l = 1; l <= MAX_BITS; l++) {
+        for (UINT32 c = 0; c < h->count[l]; c++, k++, code++) {
+            if (l > INFLATE_FAST) continue;
+            for (UINT32 j = reverse(code, l); j < (1u << INFLATE_FAST); j += 1u << l)
+                h->fast[j] = (UINT16)(h->sym[k] << 4 | l);
+        }
+        code <<= 1;
+    }
+    return 0;
+}
+
+/* Next symbol, or -1. Near the end of the input fewer than MAX_BITS
+   bits may be left; a code that fits in them still decodes. */
+static int decode(struct inflate *z, const struct inflate_huff *h) {
+    need(z, MAX_BITS);
+    UINT32 e = h->fast[z->bits & ((1u << INFLATE_FAST) - 1)];
+    if (e && (e & 15) <= z->nbits) {
+        take(z, e & 15);
+        return (int)(e >> 4);
+    }
+
+    int code = 0, first = 0, index = 0;
+    for (UINT32 l = 1; l <= MAX_BITS && l <= z->nbits; l++) {
+        code |= (int)((z->bits >> (l - 1)) & 1);
+        int count = h->count[l];
+        if (code - count < first) {
+            take(z, l);
+            return h->sym[index + (code - first)];
+        }
+        index += count;
+        first += count;
+        first <<= 1;
+        code <<= 1;
+    }
+    return -1;
+}
+
+/* ---- Output ---- */
+
+/* Pass on what the window holds past flushed */
+static int flush(struct inflate *z) {
+    UINT32 n = z->wpos - z->flushed;
+    if (n && z->out(z->ctx, z->window + z->flushed, n) != 0) return -1;
+    z->total += n;
+    if (z->wpos == INFLATE_WINDOW) z->wpos = 0;
+    z->flushed = z->wpos;
+    return 0;
+}
+
+static int put(struct inflate *z, UINT8 c) {
+    z->window[z->wpos++] = c;
+    return z->wpos == INFLATE_WINDOW ? flush(z) : 0;
+}
+
+/* len bytes from dist back */
+static int match(struct inflate *z, UINT32 len, UINT32 dist) {
+    if (dist > z->total + (z->wpos - z->flushed)) return -1;
+    UINT32 from = (z->wpos - dist) & (INFLATE_WINDOW - 1);
+    while (len) {
+        /* Up to whichever end of the window comes first */
+        UINT32 n = len;
+        if (n > INFLATE_WINDOW - z->wpos) n = INFLATE_WINDOW - z->wpos;
+        if (n > INFLATE_WINDOW - from) n = INFLATE_WINDOW - from;
+        UINT8 *d = z->window + z->wpos;
+        const UINT8 *s = z->window + from;
+        if (from + n <= z->wpos || z->wpos + n <= from) {
+            mem_copy(d, s, n);
+        } else {
+            /* An overlapping run repeats what it has just written */
+            for (UINT32 i = 0; i < n; i++) d[i] = s[i];
+        }
+        z->wpos += n;
+        from = (from + n) & (INFLATE_WINDOW - 1);
+        len -= n;
+        if (z->wpos == INFLATE_WINDOW && flush(z) != 0) return -1;
+    }
+    return 0;
+}
+
+/* ---- Blocks ---- */
+
+static int stored(struct inflate *z) {
+    take(z, z->nbits & 7);
+    if (need(z, 32) != 0) return -1;
+    UINT32 len = take(z, 16);
+    if (take(z, 16) != (~len & 0xFFFF)) return -1;
+
+    /* Whole bytes may still sit in the bit buffer */
+    while (len && z->nbits >= 8) {
+        if (put(z, (UINT8)take(z, 8)) != 0) return -1;
+        len--;
+    }
+    struct inflate_src *s = z->src;
+    while (len) {
+        if (s->n == 0 && (s->fill(s) != 0 || s->n == 0)) return -1;
+        UINT32 n = len;
+        if (n > s->n) n = (UINT32)s->n;
+        if (n > INFLATE_WINDOW - z->wpos) n = INFLATE_WINDOW - z->wpos;
+        mem_copy(z->window + z->wpos, s->p, n);
+        s->p += n;
+        s->n -= n;
+        z->wpos += n;
+        len -= n;
+        if (z->wpos == INFLATE_WINDOW && flush(z) != 0) return -1;
+    }
+    return 0;
+}
+
+static int codes(struct inflate *z) {
+    for (;;) {
+        int sym = decode(z, &z->lit);
+        if (sym < 0) return -1;
+        if (sym < 256) {
+            if (put(z, (UINT8)sym) != 0) return -1;
+            continue;
+        }
+        if (sym == 256) return 0;
+
+        sym -= 257;
+        if (sym >= 29 || need(z, LEN_EXTRA[sym]) != 0) return -1;
+        UINT32 len = LEN_BASE[sym] + take(z, LEN_EXTRA[sym]);
+        int d = decode(z, &z->dist);
+        if (d < 0 || d >= 30 || need(z, DIST_EXTRA[d]) != 0) return -1;
+        UINT32 dist = DIST_BASE[d] + take(z, DIST_EXTRA[d]);
+        if (match(z, len, dist) != 0) return -1;
+    }
+}
+
+static int fixed(struct inflate *z) {
+    UINT8 len[288];
+    int i = 0;
+    for (; i < 144; i++) len[i] = 8;
+    for (; i < 256; i++) len[i] = 9;
+    for (; i < 280; i++) len[i] = 7;
+    for (; i < 288; i++) len[i] = 8;
+    build(&z->lit, len, 288);
+    for (i = 0; i < 30; i++) len[i] = 5;
+    build(&z->dist, len, 30);
+    return codes(z);
+}
+
+static int dynamic(struct inflate *z) {
+    if (need(z, 14) != 0) return -1;
+    int nlen = (int)take(z, 5) + 257;
+    int ndist = (int)take(z, 5) + 1;
+    int ncode = (int)take(z, 4) + 4;
+    if (nlen > 286 || ndist > 30) return -1;
+
+    UINT8 len[286 + 30];
+    mem_set(len, 0, sizeof(len));
+    for (int i = 0; i < ncode; i++) {
+        if (need(z, 3) != 0) return -1;
+        len[CLEN_ORDER[i]] = (UINT8)take(z, 3);
+    }
+    /* The code length code goes in lit until the real one is built */
+    if (build(&z->lit, len, 19) != 0) return -1;
+
+    for (int i = 0; i < nlen + ndist;) {
+        int sym = decode(z, &z->lit);
+        if (sym < 0) return -1;
+        if (sym < 16) {
+            len[i++] = (UINT8)sym;
+            continue;
+        }
+        UINT8 v = 0;
+        UINT32 rep;
+        if (sym == 16) {
+            if (i == 0 || need(z, 2) != 0) return -1;
+            v = len[i - 1];
+            rep = 3 + take(z, 2);
+        } else if (sym == 17) {
+            if (need(z, 3) != 0) return -1;
+            rep = 3 + take(z, 3);
+        } else {
+            if (need(z, 7) != 0) return -1;
+            rep = 11 + take(z, 7);
+        }
+        if (i + (int)rep > nlen + ndist) return -1;
+        while (rep--) len[i++] = v;
+    }
+    if (len[256] == 0) return -1;   /* no end-of-block code */
+
+    if (build(&z->lit, len, nlen) != 0 || build(&z->dist, len + nlen, ndist) != 0)
+        return -1;
+    return codes(z);
+}
+
+int inflate_run(struct inflate *z) {
+    UINT32 last;
+    do {
+        if (need(z, 3) != 0) return -1;
+        last = take(z, 1);
+        UINT32 type = take(z, 2);
+        int rc = type == 0 ? stored(z)
+               : type == 1 ? fixed(z)
+               : type == 2 ? dynamic(z) : -1;
+        if (rc != 0) return -1;
+    } while (!last);
+    if (flush(z) != 0) return -1;
+
+    UINT32 spare = z->nbits / 8;
+    z->src->p -= spare;
+    z->src->n += spare;
+    z->bits = 0;
+    z->nbits = 0;
+    return 0;
+}
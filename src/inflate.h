@@ -0,0 +1,60 @@
+/*
+ * inflate.h — DEFLATE decoding (RFC 1951) for gzip and zip archives
+ *
+ * A streaming decoder in constant memory: input is pulled from a source
+ * a buffer at a time and output is pushed out of the 32 KB history
+ * window the format needs, so an archive of any size unpacks in one
+ * pass. Codes up to INFLATE_FAST bits long, nearly all of them, take
+ * one table lookup. (The ESP32 firmware uses its ROM's miniz.)
+ */
+#ifndef INFLATE_H
+#define INFLATE_H
+
+#include "boot.h"
+
+#define INFLATE_WINDOW 32768    /* history: the longest match distance */
+#define INFLATE_FAST   10       /* code bits one lookup resolves */
+
+/* Input on hand is n bytes at p, taken from the front. fill() is called
+   once n is 0 to make more; it returns 0, or -1 at the end of the input
+   or on an error. The 8 bytes before p must stay the ones taken last:
+   inflate_run() gives back what it read past the stream's end. */
+struct inflate_src {
+    const UINT8 *p;
+    UINTN n;
+    int (*fill)(struct inflate_src *s);
+};
+
+/* Decoded bytes, INFLATE_WINDOW at most per call. Returns 0, or
+   nonzero to stop decoding. */
+typedef int (*inflate_out_fn)(void *ctx, const UINT8 *data, UINTN len);
+
+struct inflate_huff {
+    UINT16 fast[1 << INFLATE_FAST];     /* symbol << 4 | length; 0 if longer */
+    UINT16 count[16];                   /* codes of each length */
+    UINT16 sym[288];                    /* symbols in code order */
+};
+
+struct inflate {
+    struct inflate_src *src;
+    inflate_out_fn out;
+    void *ctx;
+    UINT64 bits;                        /* read, not yet used; LSB first */
+    UINT32 nbits;
+    UINT32 wpos;                        /* next byte of window */
+    UINT32 flushed;                     /* window bytes before this are out */
+    UINT64 total;                       /* bytes passed to out */
+    struct inflate_huff lit, dist;
+    UINT8 window[INFLATE_WINDOW];
+};
+
+/* Set up z for a stream; about 38 KB, so not on the stack */
+void inflate_init(struct inflate *z, struct inflate_src *src,
+                  inflate_out_fn out, void *ctx);
+
+/* Decode one stream through its last block. The whole bytes read past
+   it are given back to src. Returns 0, or -1 on corrupt data, input
+   that ends early or out() stopping it. */
+int inflate_run(struct inflate *z);
+
+#endif /* INFLATE_H */
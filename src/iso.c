@@ -1,9 +1,19 @@
 /*
  * iso.c — ISO image writer for Survival Workstation
  *
- * Stream-writes a .iso file to a block device chunk by chunk.
+ * Stream-writes a .iso file to a block device through a double-buffered
+ * writer: the next chunk is read while the previous one is written.
  * Modern Linux ISOs are "hybrid" — dd'ing them to a USB drive
  * creates a valid UEFI-bootable disk.
+ *
+ * Verifying takes a CRC32C of the data as it streams to the device,
+ * then reads the device back through a pipelined reader and compares.
+ * A .sha256 file next to the ISO is checked against the same stream.
+ * A delta write reads the device alongside the ISO and rewrites only
+ * the pieces that differ, for updating a stick to a newer release.
+ * A download can go to the device with no file in between: the body
+ * is gathered straight into the writer's buffers (net.h). A batch of
+ * sticks is written from one read of the ISO, all of them at once.
  */
 
 #include "boot.h"
@@ -13,79 +23,895 @@
 #include "fs.h"
 #include "disk.h"
 #include "iso.h"
+#include "hash.h"
+#include "mp.h"
+#include "progress.h"
+#include "net.h"
+#include "fetch.h"
 #include "shim.h"
 
-#define CHUNK_SIZE (64 * 1024)  /* 64KB streaming chunks */
+#define CHUNK_SIZE   (1024 * 1024)      /* temp-copy chunks */
+#define ISO_BUF_SIZE (4 * 1024 * 1024)  /* device I/O buffers */
+#define ISO_BUF_MIN  (256 * 1024)       /* fallback when memory is short */
+
+/* Device I/O buffers kept idle between the phases of a write, so the
+   verify reader reuses the writer's and a delta's extra buffer */
+#define ISO_IO_POOL  ((DISK_WRITER_NBUF + 1) * ISO_BUF_SIZE)
 
 /* ---- UI helpers ---- */
 
 static void iso_print(const char *msg, UINT32 color) {
-    if (g_boot.framebuffer) fb_print(msg, color);
+    if (g_boot.cols) fb_print(msg, color);
 }
 
-static void show_progress(UINT64 written, UINT64 total, UINT32 row) {
-    char line[128];
-    UINT64 written_mb = written / (1024 * 1024);
-    UINT64 total_mb = total / (1024 * 1024);
-    int pct = total > 0 ? (int)((written * 100) / total) : 0;
+/* A progress line at a fixed row, redrawn at most PROGRESS_HZ times a
+   second with rate and ETA */
+struct iso_bar {
+    struct progress pg;
+    UINT32 row;
+    UINT32 color;
+};
+
+static void bar_init(struct iso_bar *b, UINT32 row, UINT32 color) {
+    mem_set(b, 0, sizeof(*b));
+    b->row = row;
+    b->color = color;
+}
+
+static void bar_start(struct iso_bar *b, const char *what, UINT64 total) {
+    progress_start(&b->pg, what, total);
+}
+
+static void bar_add(struct iso_bar *b, UINT64 bytes) {
+    if (!progress_add(&b->pg, bytes)) return;
 
-    snprintf(line, sizeof(line), "  Writing: %llu MB / %llu MB (%d%%)",
-             (unsigned long long)written_mb, (unsigned long long)total_mb, pct);
+    char line[128];
+    line[0] = line[1] = ' ';
+    int len = 2 + progress_line(&b->pg, line + 2, sizeof(line) - 2);
 
     /* Pad to full width to overwrite previous line */
-    int len = (int)strlen(line);
     while (len < (int)g_boot.cols && len < 126) line[len++] = ' ';
     line[len] = '\0';
 
-    fb_string(0, row, line, COLOR_WHITE, COLOR_BLACK);
+    fb_string(0, b->row, line, b->color, COLOR_BLACK);
+    fb_present();
 }
 
-static void show_copy_progress(UINT64 copied, UINT64 total, UINT32 row) {
-    char line[128];
-    UINT64 copied_mb = copied / (1024 * 1024);
-    UINT64 total_mb = total / (1024 * 1024);
-    int pct = total > 0 ? (int)((copied * 100) / total) : 0;
+/* ---- Verification ---- */
 
-    snprintf(line, sizeof(line), "  Copying ISO to boot volume: %llu MB / %llu MB (%d%%)",
-             (unsigned long long)copied_mb, (unsigned long long)total_mb, pct);
+#define SIDECAR_MAX 512     /* a digest, a name and some slack */
 
-    int len = (int)strlen(line);
-    while (len < (int)g_boot.cols && len < 126) line[len++] = ' ';
-    line[len] = '\0';
+/* Read and parse a .sha256 file. Returns 0 with the digest in out. */
+static int read_sidecar(EFI_FILE_HANDLE root, const CHAR16 *path,
+                        UINT8 out[SHA256_DIGEST]) {
+    UINT64 size = 0;
+    struct fs_file *f = fs_open_read(root, path, &size);
+    if (!f) return -1;
+
+    char text[SIDECAR_MAX];
+    UINTN len = size < sizeof(text) ? (UINTN)size : sizeof(text);
+    int rc = fs_stream_read(f, text, &len);
+    fs_stream_close(f);
+    if (rc < 0) return -1;
+    return sha256_parse(text, len, out);
+}
+
+/* Look for "<iso>.sha256", then the ISO's name with its extension
+   replaced ("<name>.sha256"). Returns 0 with the digest in out. */
+static int find_sidecar(EFI_FILE_HANDLE root, const CHAR16 *iso_path,
+                        UINT8 out[SHA256_DIGEST]) {
+    static const CHAR16 ext[] = {'.','s','h','a','2','5','6',0};
+    CHAR16 path[512];
+    UINTN n = 0;
+    while (iso_path[n]) n++;
+    if (n + 8 > sizeof(path) / sizeof(path[0])) return -1;
+
+    mem_copy(path, iso_path, n * sizeof(CHAR16));
+    mem_copy(path + n, ext, sizeof(ext));
+    if (read_sidecar(root, path, out) == 0) return 0;
+
+    UINTN dot = n;
+    while (dot > 0 && path[dot - 1] != '.' && path[dot - 1] != '\\') dot--;
+    if (dot == 0 || path[dot - 1] != '.') return -1;
+    mem_copy(path + dot - 1, ext, sizeof(ext));
+    return read_sidecar(root, path, out);
+}
+
+/* What is taken of the source stream on its way to the device */
+struct iso_sums {
+    int crc_on, sha_on;
+    UINT32 crc;
+    struct sha256_ctx sha;
+    const void *data;               /* for sha_job */
+    UINTN len;
+};
+
+static void sums_init(struct iso_sums *s, int crc_on, int sha_on) {
+    s->crc_on = crc_on;
+    s->sha_on = sha_on;
+    s->crc = 0;
+    sha256_init(&s->sha);
+}
+
+static void sha_job(void *arg, void *arena) {
+    struct iso_sums *s = (struct iso_sums *)arg;
+    (void)arena;
+    sha256_update(&s->sha, s->data, s->len);
+}
+
+/* The SHA-256 goes to a worker (mp.h) while the CRC is taken here */
+static void sums_add(struct iso_sums *s, const void *data, UINTN len) {
+    struct mp_job job;
+    if (s->sha_on) {
+        s->data = data;
+        s->len = len;
+        mp_submit(&job, sha_job, s);
+    }
+    if (s->crc_on) s->crc = crc32c(s->crc, data, len);
+    if (s->sha_on) mp_wait(&job);
+}
+
+/* Read the first size bytes of the device back and take their CRC32C.
+   Returns 0 with the CRC in *out, -1 on a read error. */
+static int readback_crc(struct disk_device *dev, UINT64 size, struct iso_bar *bar,
+                        UINT32 *out) {
+    UINT64 nblocks = (size + dev->block_size - 1) / dev->block_size;
+    struct disk_reader *r = disk_reader_open(dev, 0, nblocks,
+                                             disk_xfer_size(dev));
+    if (!r) r = disk_reader_open(dev, 0, nblocks, ISO_BUF_MIN);
+    if (!r) return -1;
+
+    UINT32 crc = 0;
+    UINT64 done = 0;
+    bar_start(bar, "Verifying", size);
+    while (done < size) {
+        UINTN len;
+        const void *data = disk_reader_next(r, &len);
+        if (!data) break;
+        /* The last block was zero-padded on write; leave the pad out */
+        if (len > size - done) len = (UINTN)(size - done);
+        crc = crc32c(crc, data, len);
+        done += len;
+        bar_add(bar, len);
+    }
+
+    if (disk_reader_close(r) != 0 || done < size) return -1;
+    *out = crc;
+    return 0;
+}
+
+/* ---- Writing ---- */
+
+/* Stream the whole image to the device: read straight into the
+   writer's buffers. Returns nonzero on error. */
+static int write_full(struct disk_device *dev, struct fs_file *src,
+                      UINT64 size, int force, struct iso_bar *bar,
+                      struct iso_sums *sums, UINT64 *written) {
+    UINTN buf_size = ISO_BUF_SIZE;
+    struct disk_writer *writer = disk_writer_open(dev, 0, buf_size, force);
+    if (!writer) {
+        buf_size = ISO_BUF_MIN;
+        writer = disk_writer_open(dev, 0, buf_size, force);
+    }
+    if (!writer) {
+        iso_print("  Out of memory.\n", COLOR_RED);
+        return 1;
+    }
+
+    int error = 0;
+    bar_start(bar, "Writing", size);
+    while (*written < size) {
+        void *chunk = disk_writer_next(writer);
+        if (!chunk) {
+            error = 1;
+            break;
+        }
+
+        UINTN to_read = buf_size;
+        if (*written + to_read > size)
+            to_read = (UINTN)(size - *written);
+
+        if (fs_stream_read(src, chunk, &to_read) < 0 || to_read == 0) {
+            error = 1;
+            break;
+        }
+
+        /* Hash before submitting: the buffer belongs to the device after */
+        sums_add(sums, chunk, to_read);
+
+        if (disk_writer_submit(writer, to_read) < 0) {
+            error = 1;
+            break;
+        }
+
+        *written += to_read;
+        bar_add(bar, to_read);
+    }
+
+    /* Drain outstanding writes and flush once */
+    if (disk_writer_close(writer) != 0)
+        error = 1;
+    return error;
+}
+
+#define DELTA_GRAIN (64 * 1024)     /* compare and rewrite granularity */
+
+/* Write only what differs: read the device alongside the source, compare
+   DELTA_GRAIN pieces and rewrite runs of differing ones. *changed counts
+   the bytes rewritten. Returns nonzero on error. */
+static int write_delta(struct disk_device *dev, struct fs_file *src,
+                       UINT64 size, struct iso_bar *bar, struct iso_sums *sums,
+                       UINT64 *written, UINT64 *changed) {
+    UINT32 bs = dev->block_size;
+    UINT64 nblocks = (size + bs - 1) / bs;
+    UINTN buf_size = ISO_BUF_SIZE;
+    UINT8 *buf = (UINT8 *)mem_io_get(buf_size);
+    struct disk_reader *r = buf ? disk_reader_open(dev, 0, nblocks, buf_size)
+                                : NULL;
+    if (!r) {
+        mem_io_put(buf);
+        buf_size = ISO_BUF_MIN;
+        buf = (UINT8 *)mem_io_get(buf_size);
+        r = buf ? disk_reader_open(dev, 0, nblocks, buf_size) : NULL;
+    }
+    if (!r) {
+        mem_io_put(buf);
+        iso_print("  Out of memory.\n", COLOR_RED);
+        return 1;
+    }
+
+    /* Whole blocks per piece, so rewrites stay block-aligned */
+    UINTN grain = DELTA_GRAIN < bs ? bs : DELTA_GRAIN / bs * bs;
+    UINT64 lba = 0;
+    int error = 0;
+    char label[48];
+    bar_start(bar, "Updating", size);
+
+    while (*written < size) {
+        UINTN len;
+        const UINT8 *old = (const UINT8 *)disk_reader_next(r, &len);
+        if (!old) {
+            error = 1;
+            break;
+        }
+
+        /* The same span of the image; a short last block is zero-padded
+           as the full write pads it */
+        UINTN want = len;
+        if (want > size - *written) want = (UINTN)(size - *written);
+        UINTN got = want;
+        if (fs_stream_read(src, buf, &got) < 0 || got != want) {
+            error = 1;
+            break;
+        }
+        if (want < len) mem_set(buf + want, 0, len - want);
+        sums_add(sums, buf, want);
+
+        /* Rewrite each run of differing pieces with one write */
+        UINTN off = 0;
+        while (off < len) {
+            UINTN n = len - off < grain ? len - off : grain;
+            if (mem_cmp(buf + off, old + off, n) == 0) {
+                off += n;
+                continue;
+            }
+            UINTN run = off;
+            while (off < len) {
+                n = len - off < grain ? len - off : grain;
+                if (mem_cmp(buf + off, old + off, n) == 0) break;
+                off += n;
+            }
+            if (disk_write_blocks(dev, lba + run / bs, (off - run) / bs,
+                                  buf + run) != 0) {
+                error = 1;
+                break;
+            }
+            *changed += off - run;
+        }
+        if (error) break;
+
+        lba += len / bs;
+        *written += want;
+        snprintf(label, sizeof(label), "Updating (%llu MB changed)",
+                 (unsigned long long)(*changed / (1024 * 1024)));
+        bar->pg.what = label;
+        bar_add(bar, want);
+    }
+
+    bar->pg.what = "Updating";     /* label is about to go */
+    if (disk_reader_close(r) != 0) error = 1;
+    if (disk_flush(dev) != 0) error = 1;
+    mem_io_put(buf);
+    return error;
+}
+
+/* ---- Writing over the ISO's own device ----
+ * When the ISO lives on the target, each part must be read before the
+ * write reaches its blocks. If the whole image fits in memory it is
+ * read first and written after. Otherwise its extents (exFAT and FAT32
+ * only) give the device position of every part; chunks are written in
+ * order as soon as no unread part lies below the end of the next one,
+ * holding in memory whatever has been read ahead meanwhile. The temp
+ * copy on the boot volume is the last resort. */
+
+#define SAME_TEMP    0  /* copy to the boot volume first */
+#define SAME_RAM     1  /* hold the whole image in memory */
+#define SAME_PLANNED 2  /* read ahead only as far as the layout needs */
+
+#define ISO_MAX_EXTENTS 4096
+#define ISO_RAM_RESERVE (128ULL * 1024 * 1024)  /* left for everything else */
+
+/* Free conventional memory beyond the reserve */
+static UINT64 ram_budget(void) {
+    struct mem_map_stats m;
+    if (mem_map_stats(&m) != 0) return 0;
+    UINT64 free_bytes = m.type_pages[EfiConventionalMemory] * 4096;
+    return free_bytes > ISO_RAM_RESERVE ? free_bytes - ISO_RAM_RESERVE : 0;
+}
+
+static void chunks_free(UINT8 **c, UINT32 n) {
+    for (UINT32 i = 0; i < n; i++)
+        mem_io_put(c[i]);
+    mem_free(c);
+}
+
+/* n buffers of ISO_BUF_SIZE bytes; NULL unless all could be had */
+static UINT8 **chunks_alloc(UINT32 n) {
+    UINT8 **c = (UINT8 **)mem_alloc(n * sizeof(UINT8 *));
+    if (!c) return NULL;
+    for (UINT32 i = 0; i < n; i++) {
+        c[i] = (UINT8 *)mem_io_get(ISO_BUF_SIZE);
+        if (!c[i]) {
+            chunks_free(c, i);
+            return NULL;
+        }
+    }
+    return c;
+}
+
+/* Bytes of the image in chunk k */
+static UINTN chunk_len(UINT64 size, UINT32 k) {
+    UINT64 off = (UINT64)k * ISO_BUF_SIZE;
+    return size - off < ISO_BUF_SIZE ? (UINTN)(size - off) : ISO_BUF_SIZE;
+}
+
+/* Hand one chunk to the writer */
+static int put_chunk(struct disk_writer *w, const UINT8 *data, UINTN len) {
+    void *buf = disk_writer_next(w);
+    if (!buf) return -1;
+    mem_copy(buf, data, len);
+    return disk_writer_submit(w, len);
+}
+
+/* Read the whole image into memory, then write it */
+static int write_from_ram(struct disk_device *dev, struct fs_file *src,
+                          UINT64 size, int force, struct iso_bar *bar,
+                          struct iso_sums *sums, UINT64 *written) {
+    UINT32 n = (UINT32)((size + ISO_BUF_SIZE - 1) / ISO_BUF_SIZE);
+    UINT8 **c = chunks_alloc(n);
+    struct disk_writer *w = c ? disk_writer_open(dev, 0, ISO_BUF_SIZE, force)
+                              : NULL;
+    if (!w) {
+        if (c) chunks_free(c, n);
+        iso_print("  Out of memory.\n", COLOR_RED);
+        return 1;
+    }
+
+    int error = 0;
+    bar_start(bar, "Reading into memory", size);
+    for (UINT32 k = 0; k < n && !error; k++) {
+        UINTN want = chunk_len(size, k), len = want;
+        if (fs_stream_read(src, c[k], &len) < 0 || len != want) {
+            error = 1;
+            break;
+        }
+        sums_add(sums, c[k], len);
+        bar_add(bar, len);
+    }
+
+    if (!error) bar_start(bar, "Writing", size);
+
+    /* Nothing has been written yet, so a failed read costs nothing */
+    for (UINT32 k = 0; k < n && !error; k++) {
+        UINTN len = chunk_len(size, k);
+        if (put_chunk(w, c[k], len) != 0) {
+            error = 1;
+            break;
+        }
+        *written += len;
+        bar_add(bar, len);
+    }
 
-    fb_string(0, row, line, COLOR_YELLOW, COLOR_BLACK);
+    if (disk_writer_close(w) != 0) error = 1;
+    chunks_free(c, n);
+    return error;
 }
 
-/* ---- Same-device detection ---- */
+struct iso_plan {
+    struct fs_extent *ext;      /* pos is a byte offset on the device */
+    int next;                   /* first extent not yet read past */
+    UINT32 nchunks;
+    UINT64 size;
+    UINT64 *low;                /* per chunk: lowest device byte holding
+                                   it or any later chunk; ~0 past the end */
+};
+
+static void plan_free(struct iso_plan *p) {
+    if (p->ext) mem_free(p->ext);
+    if (p->low) mem_free(p->low);
+    mem_set(p, 0, sizeof(*p));
+}
+
+/* Map the ISO's extents onto the target. Returns 0 on success. */
+static int plan_build(struct iso_plan *p, EFI_FILE_HANDLE iso_root,
+                      const CHAR16 *iso_path, EFI_HANDLE vol_handle,
+                      struct disk_device *dev, UINT64 size) {
+    mem_set(p, 0, sizeof(*p));
+    UINT32 bs = dev->block_size;
+    UINT64 part_lba;
+    if (size == 0 || ISO_BUF_SIZE % bs != 0 ||
+        disk_partition_start(dev->handle, vol_handle, &part_lba) != 0)
+        return -1;
+
+    /* The current volume is asked directly; an SFS volume through the
+       built-in FAT32 driver, read-only here */
+    struct fs_volume *v = NULL;
+    if (!iso_root)
+        v = fs_volume_current();
+    else if (fs_has_valid_fat32(vol_handle))
+        v = fs_volume_open(FS_VOL_FAT32, vol_handle);
+    if (!v) return -1;
+
+    p->ext = (struct fs_extent *)mem_alloc(ISO_MAX_EXTENTS * sizeof(struct fs_extent));
+    int n = p->ext ? fs_volume_extents(v, iso_path, p->ext, ISO_MAX_EXTENTS) : -1;
+    fs_volume_close(v);
+
+    /* Reads go by whole blocks straight to the device */
+    UINT64 base = part_lba * bs, covered = 0;
+    for (int i = 0; i < n; i++) {
+        struct fs_extent *e = &p->ext[i];
+        if (e->offset != covered || e->offset % bs || e->pos % bs) n = -1;
+        else {
+            covered += e->length;
+            e->pos += base;
+        }
+    }
+    if (n <= 0 || covered != size) {
+        plan_free(p);
+        return -1;
+    }
 
-static int is_same_device(EFI_HANDLE vol_handle, struct disk_device *dev) {
-    if (!vol_handle || !dev) return 0;
+    p->size = size;
+    p->nchunks = (UINT32)((size + ISO_BUF_SIZE - 1) / ISO_BUF_SIZE);
+    p->low = (UINT64 *)mem_alloc((p->nchunks + 1) * sizeof(UINT64));
+    if (!p->low) {
+        plan_free(p);
+        return -1;
+    }
+    for (UINT32 k = 0; k <= p->nchunks; k++)
+        p->low[k] = ~0ULL;
+    for (int i = 0; i < n; i++) {
+        struct fs_extent *e = &p->ext[i];
+        UINT32 first = (UINT32)(e->offset / ISO_BUF_SIZE);
+        UINT32 last = (UINT32)((e->offset + e->length - 1) / ISO_BUF_SIZE);
+        for (UINT32 k = first; k <= last; k++) {
+            UINT64 at = (UINT64)k * ISO_BUF_SIZE;
+            UINT64 pos = e->pos + (at > e->offset ? at - e->offset : 0);
+            if (pos < p->low[k]) p->low[k] = pos;
+        }
+    }
+    for (UINT32 k = p->nchunks; k-- > 0; )
+        if (p->low[k + 1] < p->low[k]) p->low[k] = p->low[k + 1];
+    return 0;
+}
 
-    /* Direct handle match (superfloppy / whole-disk filesystem) */
-    if (vol_handle == dev->handle) return 1;
+/* With chunks [0, r) read and [0, w) written, whether chunk w may be
+   written: nothing still unread may lie below its end */
+static int plan_can_write(const struct iso_plan *p, UINT32 r, UINT32 w) {
+    return w < r && p->low[r] >= (UINT64)(w + 1) * ISO_BUF_SIZE;
+}
 
-    /* Check if the ISO volume is a partition on the target device.
-     * If the volume handle has BlockIO with LogicalPartition=true,
-     * and the target is removable, they might be the same physical disk.
-     * Compare by checking if the volume handle's BlockIO parent matches. */
-    EFI_GUID bio_guid = EFI_BLOCK_IO_PROTOCOL_GUID;
-    EFI_BLOCK_IO *vol_bio = NULL;
-    EFI_STATUS status = g_boot.bs->HandleProtocol(
-        vol_handle, &bio_guid, (VOID **)&vol_bio);
-    if (!EFI_ERROR(status) && vol_bio && vol_bio->Media) {
-        if (vol_bio->Media->LogicalPartition && dev->is_removable) {
-            /* The volume is a partition. If the device is removable and
-             * big enough to contain this partition, likely the same disk. */
-            UINT64 vol_size = (UINT64)(vol_bio->Media->LastBlock + 1) *
-                              (UINT64)vol_bio->Media->BlockSize;
-            if (dev->size_bytes >= vol_size)
-                return 1;
+/* Most chunks held at once when writing as early as possible */
+static UINT32 plan_peak(const struct iso_plan *p) {
+    UINT32 r = 0, w = 0, peak = 0;
+    while (w < p->nchunks) {
+        if (plan_can_write(p, r, w)) {
+            w++;
+        } else {
+            r++;
+            if (r - w > peak) peak = r - w;
         }
     }
+    return peak;
+}
 
+/* Gather chunk k from the device */
+static int plan_read(struct iso_plan *p, struct disk_device *dev, UINT32 k,
+                     UINT8 *buf) {
+    UINT32 bs = dev->block_size;
+    UINT64 lo = (UINT64)k * ISO_BUF_SIZE, hi = lo + chunk_len(p->size, k);
+    while (p->ext[p->next].offset + p->ext[p->next].length <= lo) p->next++;
+
+    for (int i = p->next; lo < hi; i++) {
+        struct fs_extent *e = &p->ext[i];
+        UINT64 end = e->offset + e->length < hi ? e->offset + e->length : hi;
+        UINT64 pos = e->pos + (lo - e->offset);
+        UINT64 count = (end - lo + bs - 1) / bs;
+        if (disk_read_blocks(dev, pos / bs, count,
+                             buf + (lo - (UINT64)k * ISO_BUF_SIZE)) != 0)
+            return -1;
+        lo = end;
+    }
     return 0;
 }
 
+/* Write the image in order, reading ahead only as far as the layout
+   forces. Chunks live in a ring of 'slots' buffers. */
+static int write_planned(struct iso_plan *p, struct disk_device *dev,
+                         UINT32 slots, int force, struct iso_bar *bar,
+                         struct iso_sums *sums, UINT64 *written) {
+    UINT8 **c = chunks_alloc(slots);
+    struct disk_writer *w = c ? disk_writer_open(dev, 0, ISO_BUF_SIZE, force)
+                              : NULL;
+    if (!w) {
+        if (c) chunks_free(c, slots);
+        iso_print("  Out of memory.\n", COLOR_RED);
+        return 1;
+    }
+
+    int error = 0;
+    UINT32 r = 0, k = 0;
+    bar_start(bar, "Writing", p->size);
+    while (k < p->nchunks && !error) {
+        if (plan_can_write(p, r, k)) {
+            UINTN len = chunk_len(p->size, k);
+            if (put_chunk(w, c[k % slots], len) != 0) {
+                error = 1;
+                break;
+            }
+            *written += len;
+            k++;
+            bar_add(bar, len);
+        } else {
+            /* Same order as plan_peak(), so r - k stays within slots */
+            UINT8 *buf = c[r % slots];
+            if (plan_read(p, dev, r, buf) != 0) {
+                error = 1;
+                break;
+            }
+            sums_add(sums, buf, chunk_len(p->size, r));
+            r++;
+        }
+    }
+
+    if (disk_writer_close(w) != 0) error = 1;
+    chunks_free(c, slots);
+    return error;
+}
+
+/* Pick how to write an ISO that lives on the target; *slots is set for
+   SAME_PLANNED. Two writer buffers are counted on top. */
+static int plan_same_device(EFI_FILE_HANDLE iso_root, const CHAR16 *iso_path,
+                            EFI_HANDLE vol_handle, struct disk_device *dev,
+                            UINT64 size, UINT32 *slots) {
+    UINT64 budget = ram_budget();
+    UINT64 chunks = (size + ISO_BUF_SIZE - 1) / ISO_BUF_SIZE;
+    if ((chunks + DISK_WRITER_NBUF) * ISO_BUF_SIZE <= budget)
+        return SAME_RAM;
+
+    struct iso_plan p;
+    if (plan_build(&p, iso_root, iso_path, vol_handle, dev, size) != 0)
+        return SAME_TEMP;
+    *slots = plan_peak(&p);
+    plan_free(&p);
+    if ((UINT64)(*slots + DISK_WRITER_NBUF) * ISO_BUF_SIZE <= budget)
+        return SAME_PLANNED;
+    return SAME_TEMP;
+}
+
+/* ---- Writing several devices at once ----
+ * A batch of identical sticks: the image is read once into a ring of
+ * FAN_SLOTS buffers and every chunk goes to all targets through their
+ * own queues (BlockIO2 where the device has it), each as fast as its
+ * device allows. A slot is read into again only once every target still
+ * writing is done with it, so the batch takes about as long as the
+ * slowest stick alone. A target that fails drops out and holds back
+ * none of the others. */
+
+#define FAN_MAX   8         /* targets per batch */
+#define FAN_SLOTS 8         /* ring buffers */
+#define FAN_DEPTH 4         /* writes in flight per target */
+#define FAN_IDLE_US 100     /* pause when no request has finished */
+
+struct fan_target {
+    struct disk_device *dev;
+    struct disk_queue *q;
+    struct disk_io *io[FAN_DEPTH];  /* chunk k's write is io[k % FAN_DEPTH] */
+    UINT32 sub, done;               /* chunks submitted, finished */
+    int failed;                     /* 0, or the stage it failed in */
+    struct iso_bar bar;
+    char what[48];
+};
+
+#define FAN_FAIL_WRITE  1
+#define FAN_FAIL_VERIFY 2
+
+static void fan_fail(struct fan_target *t, int how) {
+    if (t->q) disk_queue_close(t->q);
+    t->q = NULL;
+    t->failed = how;
+    char line[96];
+    snprintf(line, sizeof(line), "  %s: %s FAILED", t->dev->name,
+             how == FAN_FAIL_WRITE ? "write" : "verify");
+    fb_string(0, t->bar.row, line, COLOR_RED, COLOR_BLACK);
+    fb_present();
+}
+
+/* Bytes of the image in chunk k of buf_size */
+static UINTN fan_len(UINT64 size, UINTN buf_size, UINT32 k) {
+    UINT64 off = (UINT64)k * buf_size;
+    return size - off < buf_size ? (UINTN)(size - off) : buf_size;
+}
+
+/* Reap finished writes of one target and submit what the ring holds
+   for it. Returns 1 if anything moved. */
+static int fan_step(struct fan_target *t, UINT8 **c, UINT32 slots, UINT32 rd,
+                    UINT64 size, UINTN buf_size) {
+    int moved = 0;
+    while (t->done < t->sub &&
+           disk_poll(t->q, t->io[t->done % FAN_DEPTH]) == 1) {
+        if (disk_wait(t->q, t->io[t->done % FAN_DEPTH]) != 0) {
+            fan_fail(t, FAN_FAIL_WRITE);
+            return 1;
+        }
+        bar_add(&t->bar, fan_len(size, buf_size, t->done));
+        t->done++;
+        moved = 1;
+    }
+    UINT32 bs = t->dev->block_size;
+    while (t->sub < rd && t->sub - t->done < FAN_DEPTH) {
+        UINTN len = fan_len(size, buf_size, t->sub);
+        struct disk_io *io = disk_submit_write(t->q,
+                                               (UINT64)t->sub * (buf_size / bs),
+                                               (len + bs - 1) / bs,
+                                               c[t->sub % slots]);
+        if (!io) {
+            fan_fail(t, FAN_FAIL_WRITE);
+            return 1;
+        }
+        t->io[t->sub % FAN_DEPTH] = io;
+        t->sub++;
+        moved = 1;
+    }
+    return moved;
+}
+
+/* Write the image to every target. Returns 0, 1 if the source could not
+   be read (every target failed), 2 on cancel. */
+static int fan_write(struct fan_target *t, int nt, struct fs_file *src,
+                     UINT64 size, struct iso_sums *sums) {
+    UINTN buf_size = ISO_BUF_SIZE;
+    UINT32 slots = FAN_SLOTS;
+    UINT8 **c = chunks_alloc(slots);
+    if (!c) {
+        /* chunks_alloc() is for ISO_BUF_SIZE; take smaller ones */
+        c = (UINT8 **)mem_alloc(slots * sizeof(UINT8 *));
+        buf_size = ISO_BUF_MIN;
+        for (UINT32 i = 0; c && i < slots; i++)
+            if (!(c[i] = (UINT8 *)mem_io_get(buf_size))) {
+                chunks_free(c, i);
+                c = NULL;
+            }
+    }
+    if (!c) {
+        iso_print("  Out of memory.\n", COLOR_RED);
+        return 1;
+    }
+
+    for (int i = 0; i < nt; i++) {
+        t[i].q = disk_queue_open(t[i].dev, FAN_DEPTH, 0);
+        if (!t[i].q) fan_fail(&t[i], FAN_FAIL_WRITE);
+        else bar_start(&t[i].bar, t[i].what, size);
+    }
+
+    UINT32 n = (UINT32)((size + buf_size - 1) / buf_size), rd = 0;
+    int rc = 0;
+    for (;;) {
+        int moved = 0, live = 0;
+        UINT32 low = rd;        /* first chunk a live target still needs */
+        for (int i = 0; i < nt; i++) {
+            if (t[i].failed || t[i].done == n) continue;
+            moved |= fan_step(&t[i], c, slots, rd, size, buf_size);
+            if (t[i].failed || t[i].done == n) continue;
+            live++;
+            if (t[i].done < low) low = t[i].done;
+        }
+        if (!live) break;
+
+        if (rd < n && rd < low + slots) {
+            UINT8 *buf = c[rd % slots];
+            UINTN want = fan_len(size, buf_size, rd), len = want;
+            if (fs_stream_read(src, buf, &len) < 0 || len != want) {
+                rc = 1;
+                break;
+            }
+            /* The last block goes out zero-padded */
+            if (want < buf_size) mem_set(buf + want, 0, buf_size - want);
+            sums_add(sums, buf, want);
+            rd++;
+            moved = 1;
+
+            struct key_event ev;
+            if (kbd_poll(&ev) && ev.code == KEY_ESC) {
+                rc = 2;
+                break;
+            }
+        }
+        if (!moved) g_boot.bs->Stall(FAN_IDLE_US);
+    }
+
+    /* An early stop leaves every target incomplete */
+    for (int i = 0; i < nt; i++) {
+        if (t[i].failed) continue;
+        int bad = disk_queue_close(t[i].q) != 0 || rc != 0;
+        t[i].q = NULL;
+        if (disk_flush(t[i].dev) != 0 || bad) fan_fail(&t[i], FAN_FAIL_WRITE);
+    }
+    chunks_free(c, slots);
+    return rc;
+}
+
+/* Read every target that was written back at once, round robin: each
+   reader keeps its device busy while the others are looked at */
+static void fan_verify(struct fan_target *t, int nt, UINT64 size, UINT32 crc) {
+    struct disk_reader *r[FAN_MAX];
+    UINT32 got[FAN_MAX];
+    UINT64 done[FAN_MAX];
+    int active = 0;
+    for (int i = 0; i < nt; i++) {
+        r[i] = NULL;
+        if (t[i].failed) continue;
+        UINT64 nblocks = (size + t[i].dev->block_size - 1) / t[i].dev->block_size;
+        r[i] = disk_reader_open(t[i].dev, 0, nblocks,
+                                disk_xfer_size(t[i].dev));
+        if (!r[i]) r[i] = disk_reader_open(t[i].dev, 0, nblocks, ISO_BUF_MIN);
+        if (!r[i]) {
+            fan_fail(&t[i], FAN_FAIL_VERIFY);
+            continue;
+        }
+        got[i] = 0;
+        done[i] = 0;
+        snprintf(t[i].what, sizeof(t[i].what), "%.30s verifying", t[i].dev->name);
+        bar_start(&t[i].bar, t[i].what, size);
+        active++;
+    }
+
+    while (active) {
+        for (int i = 0; i < nt; i++) {
+            if (!r[i]) continue;
+            UINTN len = 0;
+            const void *data = done[i] < size ? disk_reader_next(r[i], &len) : NULL;
+            if (data) {
+                /* The last block was zero-padded on write; leave the pad out */
+                if (len > size - done[i]) len = (UINTN)(size - done[i]);
+                got[i] = crc32c(got[i], data, len);
+                done[i] += len;
+                bar_add(&t[i].bar, len);
+                if (done[i] < size) continue;
+            }
+            if (disk_reader_close(r[i]) != 0 || done[i] < size || got[i] != crc)
+                fan_fail(&t[i], FAN_FAIL_VERIFY);
+            r[i] = NULL;
+            active--;
+        }
+    }
+}
+
+/* Write one ISO to the nt devices in devs indexed by pick, all at once */
+static int iso_write_batch(EFI_FILE_HANDLE iso_root, const CHAR16 *iso_path,
+                           const char *iso_name, struct disk_device *devs,
+                           const int *pick, int nt) {
+    char buf[160];
+    struct fan_target t[FAN_MAX];
+    mem_set(t, 0, sizeof(t));
+
+    iso_print("\n  Batch targets:\n", COLOR_WHITE);
+    for (int i = 0; i < nt; i++) {
+        t[i].dev = &devs[pick[i]];
+        snprintf(t[i].what, sizeof(t[i].what), "%.30s", t[i].dev->name);
+        snprintf(buf, sizeof(buf), "    %s\n", t[i].dev->name);
+        iso_print(buf, COLOR_YELLOW);
+    }
+
+    UINT64 size = 0;
+    struct fs_file *src = fs_open_read(iso_root, iso_path, &size);
+    if (!src || size == 0) {
+        if (src) fs_stream_close(src);
+        iso_print("  Failed to open ISO file.\n", COLOR_RED);
+        iso_print("  Press any key to return.\n", COLOR_DGRAY);
+        struct key_event ev;
+        kbd_wait(&ev);
+        return -1;
+    }
+
+    UINT8 expect[SHA256_DIGEST];
+    int have_sidecar = find_sidecar(iso_root, iso_path, expect) == 0;
+    if (have_sidecar)
+        iso_print("  Found a .sha256 file for this ISO.\n", COLOR_WHITE);
+
+    snprintf(buf, sizeof(buf), "\n  This will ERASE all data on these %d devices!\n", nt);
+    iso_print(buf, COLOR_RED);
+    iso_print("  Press 'Y' to proceed, 'V' to proceed and verify,\n", COLOR_YELLOW);
+    iso_print("  any other key to cancel. ESC stops the write.\n", COLOR_YELLOW);
+    struct key_event ev;
+    kbd_wait(&ev);
+    int verify = ev.code == 'V' || ev.code == 'v';
+    if (ev.code != 'Y' && ev.code != 'y' && !verify) {
+        fs_stream_close(src);
+        return -1;
+    }
+
+    iso_print("\n  Writing ISO to all devices...\n", COLOR_WHITE);
+    UINT32 row = g_boot.cursor_y;
+    for (int i = 0; i < nt; i++) {
+        bar_init(&t[i].bar, row + (UINT32)i, COLOR_WHITE);
+        iso_print("\n", COLOR_WHITE);
+    }
+
+    struct iso_sums sums;
+    sums_init(&sums, verify, have_sidecar);
+    UINT64 io_pool = mem_io_set_pool((UINT64)FAN_SLOTS * ISO_BUF_SIZE);
+    mp_start();
+    int rc = fan_write(t, nt, src, size, &sums);
+    mp_stop();
+    fs_stream_close(src);
+
+    int sha_ok = 1;
+    if (sums.sha_on && rc == 0) {
+        UINT8 got[SHA256_DIGEST];
+        sha256_final(&sums.sha, got);
+        sha_ok = mem_cmp(got, expect, SHA256_DIGEST) == 0;
+    }
+    if (verify && rc == 0)
+        fan_verify(t, nt, size, sums.crc);
+    mem_io_set_pool(io_pool);
+
+    int ok = 0;
+    for (int i = 0; i < nt; i++) {
+        disk_reconnect(t[i].dev);
+        snprintf(buf, sizeof(buf), "%s -> %s", iso_name, t[i].dev->name);
+        progress_log(&t[i].bar.pg, buf, !t[i].failed);
+        if (!t[i].failed) ok++;
+    }
+    fs_cache_invalidate();
+
+    iso_print("\n", COLOR_WHITE);
+    if (rc == 1)
+        iso_print("  Reading the ISO failed; no device is complete.\n", COLOR_RED);
+    else if (rc == 2)
+        iso_print("  Stopped; no device is complete.\n", COLOR_YELLOW);
+    for (int i = 0; i < nt && rc == 0; i++) {
+        char stats[96];
+        progress_summary(&t[i].bar.pg, stats, sizeof(stats));
+        snprintf(buf, sizeof(buf), "  %-24.24s %s  %s\n", t[i].dev->name,
+                 !t[i].failed ? (verify ? "verified" : "written")
+                 : t[i].failed == FAN_FAIL_WRITE ? "WRITE FAILED" : "VERIFY FAILED",
+                 stats);
+        iso_print(buf, t[i].failed ? COLOR_RED : COLOR_GREEN);
+    }
+    if (!sha_ok) {
+        iso_print("  SHA-256 MISMATCH: the ISO file does not match\n", COLOR_RED);
+        iso_print("  its .sha256 file. The download is corrupt.\n", COLOR_RED);
+    } else if (sums.sha_on && rc == 0) {
+        iso_print("  SHA-256 matches the .sha256 file.\n", COLOR_GREEN);
+    }
+    snprintf(buf, sizeof(buf), "\n  %d of %d devices written.\n", ok, nt);
+    iso_print(buf, ok == nt && sha_ok ? COLOR_WHITE : COLOR_YELLOW);
+    iso_print("  Press any key to return.\n", COLOR_DGRAY);
+    kbd_wait(&ev);
+    return ok == nt && sha_ok ? 0 : -1;
+}
+
 /* ---- Main ISO write function ---- */
 
 int iso_write(EFI_FILE_HANDLE iso_root, const CHAR16 *iso_path,
@@ -129,7 +955,7 @@ int iso_write(EFI_FILE_HANDLE iso_root, const CHAR16 *iso_path,
     for (int i = 0; i < ndevs; i++) {
         /* Skip devices smaller than ISO */
         int too_small = (devs[i].size_bytes < iso_size) ? 1 : 0;
-        int is_source = is_same_device(iso_vol_handle, &devs[i]);
+        int is_source = disk_holds_volume(&devs[i], iso_vol_handle);
 
         UINT32 color;
         if (too_small)
@@ -179,13 +1005,35 @@ int iso_write(EFI_FILE_HANDLE iso_root, const CHAR16 *iso_path,
     snprintf(buf, sizeof(buf), "  Target: [%d] %s\n", target_idx + 1, devs[target_idx].name);
     iso_print(buf, COLOR_YELLOW);
     iso_print("  Press number to change, ENTER to confirm, ESC to cancel.\n", COLOR_DGRAY);
+    iso_print("  SPACE adds the target to a batch written all at once.\n", COLOR_DGRAY);
 
     /* Device selection loop */
+    int pick[FAN_MAX], npick = 0;
     for (;;) {
         struct key_event ev;
         kbd_wait(&ev);
         if (ev.code == KEY_ESC) return -1;
         if (ev.code == KEY_ENTER) break;
+        if (ev.code == ' ') {
+            /* Only spare sticks: never the boot device or the ISO's own */
+            struct disk_device *d = &devs[target_idx];
+            int k = 0;
+            while (k < npick && pick[k] != target_idx) k++;
+            if (k < npick) {
+                pick[k] = pick[--npick];
+                snprintf(buf, sizeof(buf), "  - %s (%d in batch)\n", d->name, npick);
+                iso_print(buf, COLOR_YELLOW);
+            } else if (d->is_boot_device || disk_holds_volume(d, iso_vol_handle)
+                       || ISO_BUF_MIN % d->block_size) {
+                iso_print("  That device cannot be in a batch.\n", COLOR_RED);
+            } else if (npick == FAN_MAX) {
+                iso_print("  The batch is full.\n", COLOR_RED);
+            } else {
+                pick[npick++] = target_idx;
+                snprintf(buf, sizeof(buf), "  + %s (%d in batch)\n", d->name, npick);
+                iso_print(buf, COLOR_YELLOW);
+            }
+        }
         if (ev.code >= '1' && ev.code <= '0' + ndevs) {
             int idx = ev.code - '1';
             if (devs[idx].size_bytes >= iso_size) {
@@ -197,28 +1045,43 @@ int iso_write(EFI_FILE_HANDLE iso_root, const CHAR16 *iso_path,
         }
     }
 
+    if (npick > 1)
+        return iso_write_batch(iso_root, iso_path, iso_name, devs, pick, npick);
+    if (npick == 1)
+        target_idx = pick[0];
+
     struct disk_device *target = &devs[target_idx];
 
     /* Same-device detection */
-    int same_device = is_same_device(iso_vol_handle, target);
-    EFI_FILE_HANDLE read_handle = NULL;
-    EFI_FILE_HANDLE temp_handle = NULL;
+    int same_device = disk_holds_volume(target, iso_vol_handle);
+    struct fs_file *read_handle = NULL;
+    struct fs_file *temp_handle = NULL;
     int using_temp = 0;
     UINT64 file_size = 0;
 
+    int same_mode = SAME_TEMP;
+    UINT32 plan_slots = 0;
     if (same_device) {
-        /* ISO is on the target device — must copy to boot volume first */
         iso_print("\n  ISO is on the target device!\n", COLOR_YELLOW);
+        same_mode = plan_same_device(iso_root, iso_path, iso_vol_handle,
+                                     target, iso_size, &plan_slots);
+        if (same_mode == SAME_RAM)
+            iso_print("  It will be read into memory before writing.\n\n", COLOR_YELLOW);
+        else if (same_mode == SAME_PLANNED)
+            iso_print("  It will be written in an order that reads every\n"
+                      "  part before overwriting it.\n\n", COLOR_YELLOW);
+    }
+
+    if (same_device && same_mode == SAME_TEMP) {
+        /* No way around it: copy to the boot volume first */
         iso_print("  Copying to boot volume as temporary file...\n", COLOR_YELLOW);
 
-        /* Check boot volume free space */
+        /* Check boot volume free space (without switching volumes, so
+           an exFAT/NTFS source stays mounted) */
         EFI_FILE_HANDLE boot_root = fs_get_boot_root();
         UINT64 total_bytes, free_bytes;
-        /* Temporarily switch to boot volume for volume info */
-        EFI_FILE_HANDLE saved_root = boot_root;  /* just for clarity */
-        fs_set_volume(saved_root);
-        if (fs_volume_info(&total_bytes, &free_bytes) != 0 || free_bytes < iso_size) {
-            fs_set_volume(iso_root);  /* restore */
+        if (fs_root_volume_info(boot_root, &total_bytes, &free_bytes) != 0
+            || free_bytes < iso_size) {
             iso_print("  Not enough space on boot volume for temp copy.\n", COLOR_RED);
             iso_print("  Press any key to return.\n", COLOR_DGRAY);
             struct key_event ev;
@@ -227,9 +1090,8 @@ int iso_write(EFI_FILE_HANDLE iso_root, const CHAR16 *iso_path,
         }
 
         /* Open ISO for reading from original volume */
-        EFI_FILE_HANDLE src = fs_open_read(iso_root, iso_path, &file_size);
+        struct fs_file *src = fs_open_read(iso_root, iso_path, &file_size);
         if (!src) {
-            fs_set_volume(iso_root);
             iso_print("  Failed to open ISO file.\n", COLOR_RED);
             iso_print("  Press any key to return.\n", COLOR_DGRAY);
             struct key_event ev;
@@ -242,7 +1104,6 @@ int iso_write(EFI_FILE_HANDLE iso_root, const CHAR16 *iso_path,
         temp_handle = fs_open_write(boot_root, temp_name);
         if (!temp_handle) {
             fs_stream_close(src);
-            fs_set_volume(iso_root);
             iso_print("  Failed to create temp file.\n", COLOR_RED);
             iso_print("  Press any key to return.\n", COLOR_DGRAY);
             struct key_event ev;
@@ -251,7 +1112,9 @@ int iso_write(EFI_FILE_HANDLE iso_root, const CHAR16 *iso_path,
         }
 
         /* Stream copy ISO → temp file */
-        UINT32 progress_row = g_boot.cursor_y + 1;
+        struct iso_bar copy_bar;
+        bar_init(&copy_bar, g_boot.cursor_y + 1, COLOR_YELLOW);
+        bar_start(&copy_bar, "Copying ISO to boot volume", file_size);
         void *chunk = mem_alloc(CHUNK_SIZE);
         if (!chunk) {
             fs_stream_close(src);
@@ -262,8 +1125,10 @@ int iso_write(EFI_FILE_HANDLE iso_root, const CHAR16 *iso_path,
             return -1;
         }
 
+        /* Reserved in one piece up front where the volume can */
         UINT64 copied = 0;
-        while (copied < file_size) {
+        int room = fs_stream_preallocate(temp_handle, file_size) == 0;
+        while (room && copied < file_size) {
             UINTN to_read = CHUNK_SIZE;
             if (copied + to_read > file_size)
                 to_read = (UINTN)(file_size - copied);
@@ -273,11 +1138,12 @@ int iso_write(EFI_FILE_HANDLE iso_root, const CHAR16 *iso_path,
             if (fs_stream_write(temp_handle, chunk, to_read) < 0)
                 break;
             copied += to_read;
-            show_copy_progress(copied, file_size, progress_row);
+            bar_add(&copy_bar, to_read);
         }
         mem_free(chunk);
         fs_stream_close(src);
-        fs_stream_close(temp_handle);
+        if (fs_stream_close(temp_handle) != 0)
+            copied = 0;
 
         if (copied < file_size) {
             fs_delete_file(boot_root, temp_name);
@@ -293,7 +1159,7 @@ int iso_write(EFI_FILE_HANDLE iso_root, const CHAR16 *iso_path,
         using_temp = 1;
         iso_print("\n  Temp copy complete.\n\n", COLOR_GREEN);
     } else {
-        /* ISO is on a different device — read directly */
+        /* Read directly */
         read_handle = fs_open_read(iso_root, iso_path, &file_size);
     }
 
@@ -318,8 +1184,16 @@ int iso_write(EFI_FILE_HANDLE iso_root, const CHAR16 *iso_path,
         return -1;
     }
 
+    /* Look for a checksum file now: it may live on the target */
+    UINT8 expect[SHA256_DIGEST];
+    int have_sidecar = find_sidecar(iso_root, iso_path, expect) == 0;
+    if (have_sidecar)
+        iso_print("  Found a .sha256 file for this ISO.\n", COLOR_WHITE);
+
     /* Confirmation */
     int is_boot = target->is_boot_device;
+    int verify = 1;
+    int delta = 0;
     if (is_boot) {
         iso_print("  !! WARNING: TARGET IS THE BOOT DEVICE !!\n", COLOR_RED);
         iso_print("  THIS WILL DESTROY THE WORKSTATION!\n", COLOR_RED);
@@ -360,11 +1234,19 @@ int iso_write(EFI_FILE_HANDLE iso_root, const CHAR16 *iso_path,
         iso_print("\n\n", COLOR_WHITE);
     } else {
         iso_print("\n  This will ERASE all data on the target device!\n", COLOR_RED);
-        iso_print("  Press 'Y' to proceed, any other key to cancel.\n", COLOR_YELLOW);
+        iso_print("  Press 'Y' to proceed, 'V' to proceed and verify,\n", COLOR_YELLOW);
+        if (!same_device) {
+            iso_print("  'D' to rewrite only blocks that differ (same ISO,\n", COLOR_YELLOW);
+            iso_print("  newer release), any other key to cancel.\n", COLOR_YELLOW);
+        } else {
+            iso_print("  any other key to cancel.\n", COLOR_YELLOW);
+        }
 
         struct key_event ev;
         kbd_wait(&ev);
-        if (ev.code != 'Y' && ev.code != 'y') {
+        verify = ev.code == 'V' || ev.code == 'v';
+        delta = !same_device && (ev.code == 'D' || ev.code == 'd');
+        if (ev.code != 'Y' && ev.code != 'y' && !verify && !delta) {
             fs_stream_close(read_handle);
             if (using_temp) {
                 static const CHAR16 temp_name[] = {'\\','_','_','i','s','o','_','t','e','m','p','_','_','.','i','s','o',0};
@@ -375,60 +1257,39 @@ int iso_write(EFI_FILE_HANDLE iso_root, const CHAR16 *iso_path,
         iso_print("\n", COLOR_WHITE);
     }
 
-    /* Streaming write loop */
-    iso_print("  Writing ISO to device...\n", COLOR_WHITE);
-    UINT32 progress_row = g_boot.cursor_y;
-
-    void *chunk = mem_alloc(CHUNK_SIZE);
-    if (!chunk) {
-        iso_print("  Out of memory.\n", COLOR_RED);
-        fs_stream_close(read_handle);
-        struct key_event ev;
-        kbd_wait(&ev);
-        return -1;
-    }
-
-    UINT64 written = 0;
-    UINT64 lba = 0;
-    UINT32 block_size = target->block_size;
-    int write_error = 0;
-
-    while (written < file_size) {
-        UINTN to_read = CHUNK_SIZE;
-        if (written + to_read > file_size)
-            to_read = (UINTN)(file_size - written);
-
-        if (fs_stream_read(read_handle, chunk, &to_read) < 0 || to_read == 0) {
-            write_error = 1;
-            break;
-        }
-
-        /* Pad last chunk to block boundary */
-        UINTN padded = to_read;
-        if (padded % block_size != 0) {
-            UINTN pad_to = ((padded / block_size) + 1) * block_size;
-            mem_set((char *)chunk + padded, 0, pad_to - padded);
-            padded = pad_to;
-        }
-
-        UINT64 blocks = padded / block_size;
-        int rc;
-        if (is_boot)
-            rc = disk_write_blocks_force(target, lba, blocks, chunk);
-        else
-            rc = disk_write_blocks(target, lba, blocks, chunk);
-
-        if (rc < 0) {
-            write_error = 1;
-            break;
+    iso_print(delta ? "  Comparing and updating device...\n"
+                    : "  Writing ISO to device...\n", COLOR_WHITE);
+    struct iso_bar bar, vbar;
+    bar_init(&bar, g_boot.cursor_y, COLOR_WHITE);
+    bar_init(&vbar, g_boot.cursor_y + 1, COLOR_WHITE);
+
+    struct iso_sums sums;
+    sums_init(&sums, verify, have_sidecar && (verify || delta));
+    UINT64 written = 0, changed = 0;
+    int write_error;
+    struct iso_plan plan;
+    UINT64 io_pool = mem_io_set_pool(ISO_IO_POOL);
+    mp_start();
+    if (delta) {
+        write_error = write_delta(target, read_handle, file_size, &bar,
+                                  &sums, &written, &changed);
+    } else if (same_mode == SAME_RAM) {
+        write_error = write_from_ram(target, read_handle, file_size, is_boot,
+                                     &bar, &sums, &written);
+    } else if (same_mode == SAME_PLANNED) {
+        /* Rebuilt now: planning freed it so that cancelling leaks nothing */
+        write_error = 1;
+        if (plan_build(&plan, iso_root, iso_path, iso_vol_handle, target,
+                       file_size) == 0) {
+            if (plan_peak(&plan) <= plan_slots)
+                write_error = write_planned(&plan, target, plan_slots, is_boot,
+                                            &bar, &sums, &written);
+            plan_free(&plan);
         }
-
-        written += to_read;
-        lba += blocks;
-        show_progress(written, file_size, progress_row);
-    }
-
-    mem_free(chunk);
+    } else
+        write_error = write_full(target, read_handle, file_size, is_boot,
+                                 &bar, &sums, &written);
+    mp_stop();
     fs_stream_close(read_handle);
 
     /* Cleanup temp file if used */
@@ -437,9 +1298,35 @@ int iso_write(EFI_FILE_HANDLE iso_root, const CHAR16 *iso_path,
         fs_delete_file(fs_get_boot_root(), temp_name);
     }
 
+    /* Read back before the firmware re-probes (and maybe writes) it */
+    int sha_ok = 1, verify_ok = 1;
+    if (sums.sha_on && !write_error) {
+        UINT8 got[SHA256_DIGEST];
+        sha256_final(&sums.sha, got);
+        sha_ok = mem_cmp(got, expect, SHA256_DIGEST) == 0;
+    }
+    if (verify && !write_error) {
+        iso_print("\n", COLOR_WHITE);
+        UINT32 back = 0;
+        verify_ok = readback_crc(target, file_size, &vbar, &back) == 0
+                    && back == sums.crc;
+    }
+    mem_io_set_pool(io_pool);
+
     /* Force firmware to re-probe the target device.
        The old SFS driver is stale — the FAT32 is gone. */
     disk_reconnect(target);
+    fs_cache_invalidate();
+
+    /* Timings for comparing sticks; the boot volume is gone after an
+       ISO went over it */
+    if (!is_boot) {
+        char detail[160];
+        snprintf(detail, sizeof(detail), "%s -> %s", iso_name, target->name);
+        progress_log(&bar.pg, detail, !write_error);
+        if (vbar.pg.chunks)
+            progress_log(&vbar.pg, detail, verify_ok);
+    }
 
     if (write_error) {
         iso_print("\n\n  Write failed!\n", COLOR_RED);
@@ -449,6 +1336,22 @@ int iso_write(EFI_FILE_HANDLE iso_root, const CHAR16 *iso_path,
         return -1;
     }
 
+    if (!sha_ok || !verify_ok) {
+        iso_print("\n\n", COLOR_WHITE);
+        if (!sha_ok) {
+            iso_print("  SHA-256 MISMATCH: the ISO file does not match\n", COLOR_RED);
+            iso_print("  its .sha256 file. The download is corrupt.\n", COLOR_RED);
+        }
+        if (!verify_ok) {
+            iso_print("  VERIFY FAILED: the device does not read back\n", COLOR_RED);
+            iso_print("  what was written. Try another USB drive.\n", COLOR_RED);
+        }
+        iso_print("  Press any key to return.\n", COLOR_DGRAY);
+        struct key_event ev;
+        kbd_wait(&ev);
+        return -1;
+    }
+
     /* Success */
     iso_print("\n\n", COLOR_WHITE);
     iso_print("  ========================================\n", COLOR_GREEN);
@@ -456,10 +1359,33 @@ int iso_write(EFI_FILE_HANDLE iso_root, const CHAR16 *iso_path,
     iso_print("  ========================================\n", COLOR_GREEN);
     iso_print("\n", COLOR_WHITE);
 
-    snprintf(buf, sizeof(buf), "  Wrote %llu MB to %s\n",
-             (unsigned long long)(written / (1024 * 1024)), target->name);
+    if (delta)
+        snprintf(buf, sizeof(buf), "  Updated %s: %llu MB of %llu MB differed\n",
+                 target->name, (unsigned long long)(changed / (1024 * 1024)),
+                 (unsigned long long)(written / (1024 * 1024)));
+    else
+        snprintf(buf, sizeof(buf), "  Wrote %llu MB to %s\n",
+                 (unsigned long long)(written / (1024 * 1024)), target->name);
     iso_print(buf, COLOR_WHITE);
 
+    char stats[128];
+    progress_summary(&bar.pg, stats, sizeof(stats));
+    snprintf(buf, sizeof(buf), "  %s: %s\n", bar.pg.what, stats);
+    iso_print(buf, COLOR_DGRAY);
+    if (vbar.pg.chunks) {
+        progress_summary(&vbar.pg, stats, sizeof(stats));
+        snprintf(buf, sizeof(buf), "  Verifying: %s\n", stats);
+        iso_print(buf, COLOR_DGRAY);
+    }
+
+    if (verify) {
+        snprintf(buf, sizeof(buf), "  Verified: the device reads back intact (CRC32C %08x)\n",
+                 (unsigned)sums.crc);
+        iso_print(buf, COLOR_GREEN);
+    }
+    if (sums.sha_on)
+        iso_print("  SHA-256 matches the .sha256 file.\n", COLOR_GREEN);
+
     iso_print("\n  The ISO has been written as raw disk data.\n", COLOR_WHITE);
     iso_print("  The target device is no longer a FAT32 volume.\n", COLOR_WHITE);
 
@@ -476,3 +1402,223 @@ int iso_write(EFI_FILE_HANDLE iso_root, const CHAR16 *iso_path,
     kbd_wait(&ev);
     return 0;
 }
+
+/* ---- Writing a download ---- */
+
+static int url_cancelled(void) {
+    struct key_event ev;
+    return kbd_poll(&ev) && ev.code == KEY_ESC;
+}
+
+/* Gather the body into the writer's buffers, so each device write is a
+   whole buffer whatever the network delivered. Returns nonzero on
+   error, 2 on cancel. */
+static int write_url(struct disk_device *dev, struct net_get *g, UINT64 size,
+                     struct iso_bar *bar, struct iso_sums *sums,
+                     UINT64 *written) {
+    UINTN buf_size = ISO_BUF_SIZE;
+    struct disk_writer *writer = disk_writer_open(dev, 0, buf_size, 0);
+    if (!writer) {
+        buf_size = ISO_BUF_MIN;
+        writer = disk_writer_open(dev, 0, buf_size, 0);
+    }
+    if (!writer) {
+        iso_print("  Out of memory.\n", COLOR_RED);
+        return 1;
+    }
+
+    int error = 0;
+    const UINT8 *data = NULL;
+    UINTN have = 0;
+    bar_start(bar, "Downloading", size);
+    while (*written < size && !error) {
+        UINT8 *chunk = (UINT8 *)disk_writer_next(writer);
+        if (!chunk) {
+            error = 1;
+            break;
+        }
+
+        UINTN want = buf_size, fill = 0;
+        if (*written + want > size) want = (UINTN)(size - *written);
+        while (fill < want) {
+            if (have == 0) {
+                data = (const UINT8 *)net_next(g, &have);
+                if (!data) break;
+            }
+            UINTN n = want - fill < have ? want - fill : have;
+            mem_copy(chunk + fill, data, n);
+            fill += n;
+            data += n;
+            have -= n;
+        }
+        if (fill < want) {
+            error = 1;
+            break;
+        }
+
+        sums_add(sums, chunk, fill);
+        if (disk_writer_submit(writer, fill) < 0) {
+            error = 1;
+            break;
+        }
+        *written += fill;
+        bar_add(bar, fill);
+        if (url_cancelled()) error = 2;
+    }
+
+    if (disk_writer_close(writer) != 0 && !error)
+        error = 1;
+    return error;
+}
+
+int iso_write_url(struct disk_device *target, const char *url) {
+    char buf[NET_URL_MAX + 16];
+    fb_clear(COLOR_BLACK);
+    iso_print("\n", COLOR_WHITE);
+    iso_print("  ========================================\n", COLOR_CYAN);
+    iso_print("       WRITE DOWNLOAD TO DEVICE\n", COLOR_CYAN);
+    iso_print("  ========================================\n", COLOR_CYAN);
+    iso_print("\n", COLOR_WHITE);
+    snprintf(buf, sizeof(buf), "  URL:    %s\n", url);
+    iso_print(buf, COLOR_WHITE);
+    snprintf(buf, sizeof(buf), "  Target: %s\n\n", target->name);
+    iso_print(buf, COLOR_WHITE);
+
+    if (target->is_boot_device) {
+        iso_print("  That is the boot device. Download to a file and\n", COLOR_RED);
+        iso_print("  write it from there instead.\n", COLOR_RED);
+        iso_print("  Press any key to return.\n", COLOR_DGRAY);
+        struct key_event ev;
+        kbd_wait(&ev);
+        return -1;
+    }
+
+    iso_print("  Connecting...\n", COLOR_DGRAY);
+    fb_present();
+    UINT8 expect[SHA256_DIGEST];
+    int have_sidecar = fetch_sidecar(url, expect) == 0;
+
+    char err[96];
+    UINT64 size = 0;
+    struct net_get *g = net_open(url, &size, err, sizeof(err));
+    const char *why = NULL;
+    if (!g)
+        why = err;
+    else if (size == NET_SIZE_UNKNOWN || size == 0)
+        why = "The server gives no size; download to a file instead.";
+    else if (size > target->size_bytes)
+        why = "The download is larger than the device.";
+    if (why) {
+        snprintf(buf, sizeof(buf), "  %s\n", why);
+        iso_print(buf, COLOR_RED);
+        iso_print("  Press any key to return.\n", COLOR_DGRAY);
+        net_close(g);
+        struct key_event ev;
+        kbd_wait(&ev);
+        return -1;
+    }
+
+    snprintf(buf, sizeof(buf), "  Size: %llu MB\n",
+             (unsigned long long)(size / (1024 * 1024)));
+    iso_print(buf, COLOR_WHITE);
+    if (have_sidecar)
+        iso_print("  Found a .sha256 file on the server.\n", COLOR_WHITE);
+
+    iso_print("\n  This will ERASE all data on the target device!\n", COLOR_RED);
+    iso_print("  Press 'Y' to proceed, 'V' to proceed and verify,\n", COLOR_YELLOW);
+    iso_print("  any other key to cancel. ESC stops the download.\n", COLOR_YELLOW);
+    struct key_event ev;
+    kbd_wait(&ev);
+    int verify = ev.code == 'V' || ev.code == 'v';
+    if (ev.code != 'Y' && ev.code != 'y' && !verify) {
+        net_close(g);
+        return -1;
+    }
+    iso_print("\n  Downloading to the device...\n", COLOR_WHITE);
+
+    struct iso_bar bar, vbar;
+    bar_init(&bar, g_boot.cursor_y, COLOR_WHITE);
+    bar_init(&vbar, g_boot.cursor_y + 1, COLOR_WHITE);
+    struct iso_sums sums;
+    sums_init(&sums, verify, 1);
+    UINT64 written = 0;
+    UINT64 io_pool = mem_io_set_pool(ISO_IO_POOL);
+    mp_start();
+    int write_error = write_url(target, g, size, &bar, &sums, &written);
+    mp_stop();
+    net_close(g);
+
+    UINT8 digest[SHA256_DIGEST];
+    sha256_final(&sums.sha, digest);
+    int sha_ok = !have_sidecar || mem_cmp(digest, expect, SHA256_DIGEST) == 0;
+    int verify_ok = 1;
+    if (verify && !write_error) {
+        iso_print("\n", COLOR_WHITE);
+        UINT32 back = 0;
+        verify_ok = readback_crc(target, size, &vbar, &back) == 0
+                    && back == sums.crc;
+    }
+    mem_io_set_pool(io_pool);
+
+    disk_reconnect(target);
+    fs_cache_invalidate();
+
+    char detail[160];
+    snprintf(detail, sizeof(detail), "%s -> %s", url, target->name);
+    if (write_error != 2) {
+        progress_log(&bar.pg, detail, !write_error);
+        if (vbar.pg.chunks)
+            progress_log(&vbar.pg, detail, verify_ok);
+    }
+
+    iso_print("\n\n", COLOR_WHITE);
+    if (write_error) {
+        iso_print(write_error == 2 ? "  Cancelled: the device holds part of the download.\n"
+                                   : "  Download or write failed!\n", COLOR_RED);
+        iso_print("  Press any key to return.\n", COLOR_DGRAY);
+        kbd_wait(&ev);
+        return -1;
+    }
+
+    char stats[128];
+    progress_summary(&bar.pg, stats, sizeof(stats));
+    snprintf(buf, sizeof(buf), "  Wrote %llu MB to %s\n",
+             (unsigned long long)(written / (1024 * 1024)), target->name);
+    iso_print(buf, sha_ok && verify_ok ? COLOR_GREEN : COLOR_WHITE);
+    snprintf(buf, sizeof(buf), "  Downloading: %s\n", stats);
+    iso_print(buf, COLOR_DGRAY);
+    if (vbar.pg.chunks) {
+        progress_summary(&vbar.pg, stats, sizeof(stats));
+        snprintf(buf, sizeof(buf), "  Verifying: %s\n", stats);
+        iso_print(buf, COLOR_DGRAY);
+    }
+
+    static const char hex[] = "0123456789abcdef";
+    char sum[2 * SHA256_DIGEST + 1];
+    for (int i = 0; i < SHA256_DIGEST; i++) {
+        sum[2 * i] = hex[digest[i] >> 4];
+        sum[2 * i + 1] = hex[digest[i] & 15];
+    }
+    sum[2 * SHA256_DIGEST] = '\0';
+    snprintf(buf, sizeof(buf), "  SHA-256: %s\n", sum);
+    iso_print(buf, COLOR_WHITE);
+
+    if (!sha_ok) {
+        iso_print("  SHA-256 MISMATCH: the download does not match the\n", COLOR_RED);
+        iso_print("  server's .sha256 file. It is corrupt.\n", COLOR_RED);
+    } else if (have_sidecar) {
+        iso_print("  SHA-256 matches the server's .sha256 file.\n", COLOR_GREEN);
+    }
+    if (!verify_ok) {
+        iso_print("  VERIFY FAILED: the device does not read back\n", COLOR_RED);
+        iso_print("  what was written. Try another USB drive.\n", COLOR_RED);
+    } else if (verify) {
+        snprintf(buf, sizeof(buf), "  Verified: the device reads back intact (CRC32C %08x)\n",
+                 (unsigned)sums.crc);
+        iso_print(buf, COLOR_GREEN);
+    }
+
+    iso_print("\n  Press any key to return.\n", COLOR_DGRAY);
+    kbd_wait(&ev);
+    return sha_ok && verify_ok ? 0 : -1;
+}
@@ -8,6 +8,7 @@
 #define ISO_H
 
 #include "boot.h"
+#include "disk.h"
 
 /* Write an ISO file to a block device.
  * iso_root:       volume root handle where the ISO file lives (NULL = current)
@@ -16,10 +17,21 @@
  * iso_size:       size of the ISO file in bytes
  * iso_vol_handle: EFI_HANDLE of the volume the ISO is on (for same-device detection)
  *
+ * Several targets can be picked for a batch: the ISO is read once and
+ * written to all of them concurrently, each verified and reported on
+ * its own.
+ *
  * Returns 0 on success, -1 on error/cancel.
  */
 int iso_write(EFI_FILE_HANDLE iso_root, const CHAR16 *iso_path,
               const char *iso_name, UINT64 iso_size,
               EFI_HANDLE iso_vol_handle);
 
+/* Download url straight onto target (never the boot device): the body
+ * streams into the device writer with its SHA-256 taken, checked
+ * against "<url>.sha256" on the server when there is one. The server
+ * must give the size. Returns 0 on success, -1 on error/cancel.
+ */
+int iso_write_url(struct disk_device *target, const char *url);
+
 #endif /* ISO_H */
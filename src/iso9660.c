@@ -0,0 +1,996 @@
+/*
+ * iso9660.c — ISO 9660 filesystem driver (read-only)
+ *
+ * Directories are found through the path table, read once at mount
+ * into a table of every directory (its extent and parent) with two
+ * hashes over it: (parent, name) and extent block. A path resolves
+ * one component per probe, and only the last directory's records are
+ * read to find a file. Under Rock Ridge the path table holds the short
+ * ISO names, so a directory's children are hashed under their Rock
+ * Ridge names the first time it is looked through.
+ *
+ * Directory blocks come through a block cache; file data is read from
+ * its extent straight into the caller's buffer whenever whole blocks
+ * are asked for.
+ */
+
+#include "iso9660.h"
+#include "mem.h"
+#include "bcache.h"
+
+/* ------------------------------------------------------------------ */
+/* On-disk layout                                                      */
+/* ------------------------------------------------------------------ */
+
+#define ISO9660_VD_START       16      /* first volume descriptor */
+#define ISO9660_VD_MAX         32      /* descriptors looked at */
+#define ISO9660_VD_PRIMARY     1
+#define ISO9660_VD_SUPPLEMENT  2
+#define ISO9660_VD_END         255
+
+#define ISO9660_REC_MIN        34      /* a record with a 1-byte name */
+#define ISO9660_FLAG_HIDDEN    0x01
+#define ISO9660_FLAG_DIR       0x02
+#define ISO9660_FLAG_MORE      0x80    /* more extents of the file follow */
+
+#define ISO9660_MAX_DIRS       65535   /* path table parents are 16-bit */
+#define ISO9660_PT_MAX         (16 * 1024 * 1024)
+#define ISO9660_CE_MAX         8       /* SUSP continuation areas followed */
+#define ISO9660_MAX_TRANSFER   (1024 * 1024)
+
+#define ISO9660_NO_NAME        0xFFFFFFFFu
+
+/* Which names the volume is read with */
+#define ISO9660_NAMES_PLAIN    0
+#define ISO9660_NAMES_JOLIET   1
+#define ISO9660_NAMES_RR       2
+
+static UINT16 rd16(const UINT8 *p)
+{
+    return (UINT16)(p[0] | (p[1] << 8));
+}
+
+static UINT32 rd32(const UINT8 *p)
+{
+    return (UINT32)p[0] | ((UINT32)p[1] << 8) |
+           ((UINT32)p[2] << 16) | ((UINT32)p[3] << 24);
+}
+
+/* ------------------------------------------------------------------ */
+/* Volume structures                                                   */
+/* ------------------------------------------------------------------ */
+
+struct iso9660_dnode {
+    UINT32 lba;             /* first block of its records */
+    UINT32 size;            /* bytes of records; 0 until read */
+    UINT32 parent;          /* index in dirs; the root is its own */
+    UINT32 name;            /* offset in pool, or ISO9660_NO_NAME */
+    UINT8  loaded;          /* its children are in the name hash */
+};
+
+struct iso9660_vol {
+    iso9660_block_read_fn read_fn;
+    void   *ctx;
+    UINT32  dev_block_size;
+    UINT32  spb;            /* device blocks per ISO block */
+    UINT32  max_transfer;
+    struct bcache *cache;   /* ISO blocks of directories */
+
+    UINT64  volume_blocks;
+    int     names;          /* ISO9660_NAMES_* */
+    UINT32  susp_skip;      /* bytes before the SUSP entries of a record */
+
+    struct iso9660_dnode *dirs;
+    UINT32  ndirs;
+    UINT32 *name_hash;      /* dir index + 1, 0 for empty */
+    UINT32 *lba_hash;
+    UINT32  hash_mask;
+    char   *pool;
+    UINT32  pool_len, pool_cap;
+
+    char    label[64];
+};
+
+/* A directory record, decoded */
+struct iso9660_rec {
+    UINT32 lba;
+    UINT32 size;
+    UINT8  flags;
+    UINT8  special;         /* "." or ".." */
+    UINT32 mtime;
+    char   name[FS_MAX_NAME];
+};
+
+/* A place in a directory's records */
+struct iso9660_cur {
+    UINT32 lba;
+    UINT32 size;
+    UINT32 off;             /* the next record */
+};
+
+/* A piece of a file: len bytes at block lba hold bytes from off */
+struct iso9660_ext {
+    UINT64 off;
+    UINT32 lba;
+    UINT32 len;
+};
+
+struct iso9660_dir {
+    struct iso9660_vol *vol;
+    struct iso9660_cur cur;
+};
+
+struct iso9660_file {
+    struct iso9660_vol *vol;
+    struct iso9660_ext *ext;
+    int     count;
+    int     hint;           /* extent of the last read */
+    UINT64  size;
+    UINT64  pos;
+    UINT8  *blk;            /* the block a partial read came from */
+    UINT64  blk_lba;
+    int     blk_valid;
+};
+
+/* What a path names: a directory, or a file by its first record with
+   the cursor just past it */
+struct iso9660_node {
+    INT64  dir;             /* -1 for a file */
+    struct iso9660_cur cur;
+    struct iso9660_rec rec;
+};
+
+/* ------------------------------------------------------------------ */
+/* Block I/O                                                           */
+/* ------------------------------------------------------------------ */
+
+static const UINT8 *iso9660_block(struct iso9660_vol *vol, UINT64 lba)
+{
+    if (lba >= vol->volume_blocks && vol->volume_blocks)
+        return 0;
+    return bcache_get(vol->cache, lba);
+}
+
+static int iso9660_read_blocks(struct iso9660_vol *vol, UINT64 lba,
+                               UINT32 count, void *buf)
+{
+    return vol->read_fn(vol->ctx, lba * vol->spb, count * vol->spb, buf);
+}
+
+/* ------------------------------------------------------------------ */
+/* Names                                                               */
+/* ------------------------------------------------------------------ */
+
+static int lower(int c)
+{
+    return (c >= 'A' && c <= 'Z') ? c + 32 : c;
+}
+
+static int iso9660_name_eq(const char *a, const char *b, UINTN blen)
+{
+    UINTN i = 0;
+    for (; i < blen; i++) {
+        if (!a[i] || lower(a[i]) != lower(b[i]))
+            return 0;
+    }
+    return a[i] == '\0';
+}
+
+/* An identifier as it is shown: Joliet UCS-2 big-endian or d-characters,
+   without the ";1" version and the '.' of a name with no extension */
+static void iso9660_id_name(const UINT8 *id, UINT32 len, int joliet, char *out)
+{
+    UINT32 n = 0;
+    if (joliet) {
+        for (UINT32 i = 0; i + 1 < len && n < FS_MAX_NAME - 1; i += 2) {
+            UINT16 c = (UINT16)((id[i] << 8) | id[i + 1]);
+            out[n++] = (c >= 0x20 && c <= 0x7E) ? (char)c : '?';
+        }
+    } else {
+        for (UINT32 i = 0; i < len && n < FS_MAX_NAME - 1; i++)
+            out[n++] = (id[i] >= 0x20 && id[i] <= 0x7E) ? (char)id[i] : '?';
+    }
+    out[n] = '\0';
+
+    for (UINT32 i = 0; i < n; i++) {
+        if (out[i] == ';') {
+            n = i;
+            break;
+        }
+    }
+    if (n > 1 && out[n - 1] == '.')
+        n--;
+    out[n] = '\0';
+}
+
+/* Append Rock Ridge name bytes, one '?' per non-ASCII UTF-8 character */
+static void iso9660_rr_append(char *out, UINT32 *n, const UINT8 *s, UINT32 len)
+{
+    for (UINT32 i = 0; i < len && *n < FS_MAX_NAME - 1; i++) {
+        if (s[i] >= 0x80 && s[i] < 0xC0)
+            continue;   /* UTF-8 continuation */
+        out[(*n)++] = (s[i] >= 0x20 && s[i] < 0x7F) ? (char)s[i] : '?';
+    }
+    out[*n] = '\0';
+}
+
+/* The Rock Ridge NM name of record r, following continuation areas.
+   Returns 1 with out set, 0 if it has none. */
+static int iso9660_rr_name(struct iso9660_vol *vol, const UINT8 *r, char *out)
+{
+    UINT32 rlen = r[0], idlen = r[32];
+    UINT32 su = 33 + idlen + ((idlen & 1) == 0) + vol->susp_skip;
+    const UINT8 *p = r + su, *end = r + rlen;
+    UINT32 n = 0;
+    int found = 0, hops = 0;
+    out[0] = '\0';
+
+    while (p) {
+        const UINT8 *next = 0;
+        while (p + 4 <= end) {
+            UINT32 elen = p[2];
+            if (elen < 4 || p + elen > end)
+                break;
+            if (p[0] == 'N' && p[1] == 'M' && elen >= 5) {
+                found = 1;
+                if (p[4] & 0x06)
+                    return 0;   /* "." or ".." */
+                iso9660_rr_append(out, &n, p + 5, elen - 5);
+            } else if (p[0] == 'C' && p[1] == 'E' && elen >= 28) {
+                UINT32 blk = rd32(p + 4), off = rd32(p + 12), len = rd32(p + 20);
+                const UINT8 *b;
+                if (hops < ISO9660_CE_MAX && off < ISO9660_BLOCK &&
+                    len <= ISO9660_BLOCK - off && (b = iso9660_block(vol, blk))) {
+                    /* The block stays cached while this area is read */
+                    next = b + off;
+                    end = next + len;
+                }
+            } else if (p[0] == 'S' && p[1] == 'T') {
+                break;
+            }
+            p += elen;
+        }
+        p = next;
+        hops++;
+    }
+    return found && n > 0;
+}
+
+/* ------------------------------------------------------------------ */
+/* Directory records                                                   */
+/* ------------------------------------------------------------------ */
+
+static UINT32 iso9660_time(const UINT8 *t)
+{
+    UINT32 year = 1900 + t[0];
+    if (year < 1980 || year >= 2108 || t[1] < 1 || t[1] > 12 || t[2] < 1)
+        return 0;
+    return FS_DOS_TIME(year, t[1], t[2], t[3], t[4], t[5]);
+}
+
+/* Decode the next record. Returns 1 with *rec set, 0 at the end, -1
+   on a read error or a record that runs past its block. */
+static int iso9660_next_record(struct iso9660_vol *vol, struct iso9660_cur *c,
+                               struct iso9660_rec *rec)
+{
+    for (;;) {
+        if (c->off >= c->size)
+            return 0;
+        const UINT8 *b = iso9660_block(vol, c->lba + c->off / ISO9660_BLOCK);
+        if (!b)
+            return -1;
+        UINT32 in = c->off % ISO9660_BLOCK;
+        const UINT8 *r = b + in;
+        UINT32 len = r[0];
+        if (len == 0) {
+            /* Records never cross a block: the rest is padding */
+            c->off += ISO9660_BLOCK - in;
+            continue;
+        }
+        if (len < ISO9660_REC_MIN || in + len > ISO9660_BLOCK ||
+            33 + (UINT32)r[32] > len)
+            return -1;
+        c->off += len;
+
+        rec->lba = rd32(r + 2);
+        rec->size = rd32(r + 10);
+        rec->flags = r[25];
+        rec->mtime = iso9660_time(r + 18);
+        rec->special = r[32] == 1 && r[33] <= 1;
+        if (rec->special) {
+            str_copy(rec->name, r[33] ? ".." : ".", FS_MAX_NAME);
+            return 1;
+        }
+        if (vol->names != ISO9660_NAMES_RR || !iso9660_rr_name(vol, r, rec->name))
+            iso9660_id_name(r + 33, r[32],
+                            vol->names == ISO9660_NAMES_JOLIET, rec->name);
+        return 1;
+    }
+}
+
+/* The byte size of directory d's records, from its "." record */
+static int iso9660_dir_size(struct iso9660_vol *vol, UINT32 d, UINT32 *out)
+{
+    struct iso9660_dnode *dn = &vol->dirs[d];
+    if (!dn->size) {
+        const UINT8 *b = iso9660_block(vol, dn->lba);
+        if (!b || b[0] < ISO9660_REC_MIN)
+            return -1;
+        dn->size = rd32(b + 10);
+        if (!dn->size)
+            return -1;
+    }
+    *out = dn->size;
+    return 0;
+}
+
+static int iso9660_dir_cursor(struct iso9660_vol *vol, UINT32 d,
+                              struct iso9660_cur *c)
+{
+    c->lba = vol->dirs[d].lba;
+    c->off = 0;
+    return iso9660_dir_size(vol, d, &c->size);
+}
+
+/* ------------------------------------------------------------------ */
+/* Directory table                                                     */
+/* ------------------------------------------------------------------ */
+
+static UINT32 iso9660_name_key(UINT32 parent, const char *name, UINTN len)
+{
+    UINT32 h = 2166136261u ^ parent;
+    for (UINTN i = 0; i < len; i++)
+        h = (h ^ (UINT32)lower(name[i])) * 16777619u;
+    return h;
+}
+
+static UINT32 iso9660_lba_key(UINT32 lba)
+{
+    return lba * 2654435761u;
+}
+
+static int iso9660_pool_add(struct iso9660_vol *vol, const char *name)
+{
+    UINT32 len = (UINT32)str_len((const CHAR8 *)name) + 1;
+    if (vol->pool_len + len > vol->pool_cap) {
+        UINT32 cap = vol->pool_cap ? vol->pool_cap : 4096;
+        while (cap < vol->pool_len + len)
+            cap *= 2;
+        char *p = (char *)mem_alloc_raw(cap);
+        if (!p)
+            return -1;
+        if (vol->pool) {
+            mem_copy(p, vol->pool, vol->pool_len);
+            mem_free(vol->pool);
+        }
+        vol->pool = p;
+        vol->pool_cap = cap;
+    }
+    mem_copy(vol->pool + vol->pool_len, name, len);
+    return (int)((vol->pool_len += len) - len);
+}
+
+/* Name directory d and hash it under its parent */
+static int iso9660_name_dir(struct iso9660_vol *vol, UINT32 d, const char *name)
+{
+    int off = iso9660_pool_add(vol, name);
+    if (off < 0)
+        return -1;
+    vol->dirs[d].name = (UINT32)off;
+    UINT32 i = iso9660_name_key(vol->dirs[d].parent, name,
+                                str_len((const CHAR8 *)name));
+    while (vol->name_hash[i & vol->hash_mask])
+        i++;
+    vol->name_hash[i & vol->hash_mask] = d + 1;
+    return 0;
+}
+
+static INT64 iso9660_dir_by_lba(const struct iso9660_vol *vol, UINT32 lba)
+{
+    for (UINT32 i = iso9660_lba_key(lba);; i++) {
+        UINT32 e = vol->lba_hash[i & vol->hash_mask];
+        if (!e)
+            return -1;
+        if (vol->dirs[e - 1].lba == lba)
+            return e - 1;
+    }
+}
+
+/* Hash directory p's children under the names its records give them
+   (Rock Ridge: the path table only has the ISO names) */
+static int iso9660_load_names(struct iso9660_vol *vol, UINT32 p)
+{
+    if (vol->dirs[p].loaded)
+        return 0;
+    struct iso9660_cur c;
+    struct iso9660_rec rec;
+    int r;
+    if (iso9660_dir_cursor(vol, p, &c) != 0)
+        return -1;
+    while ((r = iso9660_next_record(vol, &c, &rec)) > 0) {
+        if (rec.special || !(rec.flags & ISO9660_FLAG_DIR))
+            continue;
+        INT64 d = iso9660_dir_by_lba(vol, rec.lba);
+        if (d > 0 && vol->dirs[d].parent == p &&
+            vol->dirs[d].name == ISO9660_NO_NAME &&
+            iso9660_name_dir(vol, (UINT32)d, rec.name) != 0)
+            return -1;
+        if (d > 0 && !vol->dirs[d].size)
+            vol->dirs[d].size = rec.size;
+    }
+    if (r < 0)
+        return -1;
+    vol->dirs[p].loaded = 1;
+    return 0;
+}
+
+/* The child directory of p called name, or -1 */
+static INT64 iso9660_find_dir(struct iso9660_vol *vol, UINT32 p,
+                              const char *name, UINTN len)
+{
+    if (iso9660_load_names(vol, p) != 0)
+        return -1;
+    for (UINT32 i = iso9660_name_key(p, name, len);; i++) {
+        UINT32 e = vol->name_hash[i & vol->hash_mask];
+        if (!e)
+            return -1;
+        const struct iso9660_dnode *dn = &vol->dirs[e - 1];
+        if (dn->parent == p && e - 1 != 0 &&
+            iso9660_name_eq(vol->pool + dn->name, name, len))
+            return e - 1;
+    }
+}
+
+/* Read the path table of descriptor vd into the directory table */
+static int iso9660_load_path_table(struct iso9660_vol *vol, const UINT8 *vd)
+{
+    UINT32 pt_size = rd32(vd + 132);
+    UINT32 pt_lba = rd32(vd + 140);
+    if (pt_size < 10 || pt_size > ISO9660_PT_MAX)
+        return -1;
+
+    UINT32 blocks = (pt_size + ISO9660_BLOCK - 1) / ISO9660_BLOCK;
+    UINT8 *pt = (UINT8 *)mem_alloc_raw((UINTN)blocks * ISO9660_BLOCK);
+    if (!pt)
+        return -1;
+    int rc = -1;
+    if (bcache_read(vol->cache, pt_lba, blocks, pt) != 0)
+        goto out;
+
+    /* Count, then fill */
+    UINT32 n = 0;
+    for (UINT32 p = 0; p + 8 <= pt_size && pt[p] && n < ISO9660_MAX_DIRS;
+         p += 8 + pt[p] + (pt[p] & 1))
+        n++;
+    if (n == 0)
+        goto out;
+
+    UINT32 hsize = 16;
+    while (hsize < n * 2)
+        hsize *= 2;
+    vol->dirs = (struct iso9660_dnode *)mem_alloc((UINTN)n * sizeof(struct iso9660_dnode));
+    vol->name_hash = (UINT32 *)mem_alloc((UINTN)hsize * sizeof(UINT32));
+    vol->lba_hash = (UINT32 *)mem_alloc((UINTN)hsize * sizeof(UINT32));
+    if (!vol->dirs || !vol->name_hash || !vol->lba_hash)
+        goto out;
+    vol->hash_mask = hsize - 1;
+
+    UINT32 p = 0;
+    for (UINT32 i = 0; i < n; i++) {
+        UINT32 len = pt[p];
+        struct iso9660_dnode *dn = &vol->dirs[i];
+        dn->lba = rd32(pt + p + 2);
+        dn->parent = (UINT32)rd16(pt + p + 6) - 1;
+        dn->name = ISO9660_NO_NAME;
+        if (p + 8 + len > pt_size || dn->parent >= (i ? i : 1))
+            goto out;   /* parents always come first */
+
+        UINT32 h = iso9660_lba_key(dn->lba);
+        while (vol->lba_hash[h & vol->hash_mask])
+            h++;
+        vol->lba_hash[h & vol->hash_mask] = i + 1;
+
+        if (i > 0 && vol->names != ISO9660_NAMES_RR) {
+            char name[FS_MAX_NAME];
+            iso9660_id_name(pt + p + 8, len,
+                            vol->names == ISO9660_NAMES_JOLIET, name);
+            if (iso9660_name_dir(vol, i, name) != 0)
+                goto out;
+        }
+        dn->loaded = vol->names != ISO9660_NAMES_RR;
+        p += 8 + len + (len & 1);
+    }
+    vol->ndirs = n;
+    rc = 0;
+
+out:
+    mem_free(pt);
+    return rc;
+}
+
+/* ------------------------------------------------------------------ */
+/* Path lookup                                                         */
+/* ------------------------------------------------------------------ */
+
+static int iso9660_lookup(struct iso9660_vol *vol, const char *path,
+                          struct iso9660_node *node)
+{
+    UINT32 d = 0;
+    const char *s = path;
+    while (*s == '/')
+        s++;
+
+    while (*s) {
+        UINTN len = 0;
+        while (s[len] && s[len] != '/')
+            len++;
+        const char *rest = s + len;
+        while (*rest == '/')
+            rest++;
+
+        if (len == 1 && s[0] == '.') {
+            s = rest;
+            continue;
+        }
+        if (len == 2 && s[0] == '.' && s[1] == '.') {
+            d = vol->dirs[d].parent;
+            s = rest;
+            continue;
+        }
+
+        INT64 c = iso9660_find_dir(vol, d, s, len);
+        if (c >= 0) {
+            d = (UINT32)c;
+            s = rest;
+            continue;
+        }
+        if (*rest)
+            return -1;
+
+        /* The last component: a file among d's records */
+        if (iso9660_dir_cursor(vol, d, &node->cur) != 0)
+            return -1;
+        while (iso9660_next_record(vol, &node->cur, &node->rec) > 0) {
+            if (!node->rec.special && !(node->rec.flags & ISO9660_FLAG_DIR) &&
+                iso9660_name_eq(node->rec.name, s, len)) {
+                node->dir = -1;
+                return 0;
+            }
+        }
+        return -1;
+    }
+    node->dir = d;
+    return 0;
+}
+
+/* The extents of the file at node: its first record and, while a
+   record says more follow, the next ones. Sets *out (mem_free it). */
+static int iso9660_file_extents(struct iso9660_vol *vol,
+                                struct iso9660_node *node,
+                                struct iso9660_ext **out, int *count,
+                                UINT64 *size)
+{
+    struct iso9660_ext *ext = 0;
+    int n = 0, cap = 0;
+    UINT64 off = 0;
+    struct iso9660_rec *rec = &node->rec;
+
+    for (;;) {
+        if (n == cap) {
+            int ncap = cap ? cap * 2 : 4;
+            struct iso9660_ext *ne = (struct iso9660_ext *)
+                mem_alloc_raw((UINTN)ncap * sizeof(struct iso9660_ext));
+            if (!ne)
+                break;
+            if (ext) {
+                mem_copy(ne, ext, (UINTN)n * sizeof(struct iso9660_ext));
+                mem_free(ext);
+            }
+            ext = ne;
+            cap = ncap;
+        }
+        ext[n].off = off;
+        ext[n].lba = rec->lba;
+        ext[n].len = rec->size;
+        off += rec->size;
+        n++;
+        if (!(rec->flags & ISO9660_FLAG_MORE)) {
+            *out = ext;
+            *count = n;
+            *size = off;
+            return 0;
+        }
+        if (iso9660_next_record(vol, &node->cur, rec) <= 0 || rec->special)
+            break;
+    }
+    if (ext)
+        mem_free(ext);
+    return -1;
+}
+
+/* ------------------------------------------------------------------ */
+/* Mount / unmount                                                     */
+/* ------------------------------------------------------------------ */
+
+/* Whether the root's "." record starts the System Use Sharing Protocol
+   with Rock Ridge entries; sets the SUSP skip length */
+static int iso9660_detect_rr(struct iso9660_vol *vol, UINT32 root_lba)
+{
+    const UINT8 *b = iso9660_block(vol, root_lba);
+    if (!b || b[0] < ISO9660_REC_MIN || b[32] != 1)
+        return 0;
+    const UINT8 *p = b + 34, *end = b + b[0];
+    if (p + 7 > end || p[0] != 'S' || p[1] != 'P' || p[4] != 0xBE || p[5] != 0xEF)
+        return 0;
+    vol->susp_skip = p[6];
+    for (p += p[2]; p + 4 <= end && p[2] >= 4; p += p[2]) {
+        if ((p[0] == 'R' && p[1] == 'R') || (p[0] == 'P' && p[1] == 'X') ||
+            (p[0] == 'N' && p[1] == 'M') || (p[0] == 'E' && p[1] == 'R') ||
+            (p[0] == 'C' && p[1] == 'E'))
+            return 1;
+    }
+    return 0;
+}
+
+static void iso9660_set_label(struct iso9660_vol *vol, const UINT8 *id,
+                              int joliet)
+{
+    int n = 0;
+    if (joliet) {
+        for (int i = 0; i + 1 < 32; i += 2) {
+            UINT16 c = (UINT16)((id[i] << 8) | id[i + 1]);
+            vol->label[n++] = (c >= 0x20 && c <= 0x7E) ? (char)c : '?';
+        }
+    } else {
+        for (int i = 0; i < 32; i++)
+            vol->label[n++] = (id[i] >= 0x20 && id[i] <= 0x7E) ? (char)id[i] : '?';
+    }
+    while (n > 0 && vol->label[n - 1] == ' ')
+        n--;
+    vol->label[n] = '\0';
+}
+
+struct iso9660_vol *iso9660_mount(iso9660_block_read_fn read_fn,
+                                  void *ctx, UINT32 block_size)
+{
+    if (!read_fn || block_size < 512 || block_size > ISO9660_BLOCK ||
+        ISO9660_BLOCK % block_size != 0)
+        return 0;
+
+    struct iso9660_vol *vol =
+        (struct iso9660_vol *)mem_alloc(sizeof(struct iso9660_vol));
+    if (!vol)
+        return 0;
+    vol->read_fn = read_fn;
+    vol->ctx = ctx;
+    vol->dev_block_size = block_size;
+    vol->spb = ISO9660_BLOCK / block_size;
+    vol->max_transfer = ISO9660_MAX_TRANSFER;
+    vol->cache = bcache_create(read_fn, 0, ctx, ISO9660_BLOCK, block_size);
+
+    UINT8 *pvd = (UINT8 *)mem_alloc(ISO9660_BLOCK);
+    UINT8 *svd = (UINT8 *)mem_alloc(ISO9660_BLOCK);
+    int have_pvd = 0, have_svd = 0;
+    if (!vol->cache || !pvd || !svd)
+        goto fail;
+
+    for (UINT32 i = 0; i < ISO9660_VD_MAX; i++) {
+        const UINT8 *b = iso9660_block(vol, ISO9660_VD_START + i);
+        if (!b || b[1] != 'C' || b[2] != 'D' || b[3] != '0' ||
+            b[4] != '0' || b[5] != '1' || b[0] == ISO9660_VD_END)
+            break;
+        if (b[0] == ISO9660_VD_PRIMARY && !have_pvd) {
+            mem_copy(pvd, b, ISO9660_BLOCK);
+            have_pvd = 1;
+        } else if (b[0] == ISO9660_VD_SUPPLEMENT && !have_svd &&
+                   b[88] == '%' && b[89] == '/' &&
+                   (b[90] == '@' || b[90] == 'C' || b[90] == 'E')) {
+            mem_copy(svd, b, ISO9660_BLOCK);
+            have_svd = 1;
+        }
+    }
+    if (!have_pvd)
+        goto fail;
+    vol->volume_blocks = rd32(pvd + 80);
+
+    if (iso9660_detect_rr(vol, rd32(pvd + 156 + 2)))
+        vol->names = ISO9660_NAMES_RR;
+    else if (have_svd)
+        vol->names = ISO9660_NAMES_JOLIET;
+    else
+        vol->names = ISO9660_NAMES_PLAIN;
+
+    const UINT8 *vd = (vol->names == ISO9660_NAMES_JOLIET) ? svd : pvd;
+    if (iso9660_load_path_table(vol, vd) != 0)
+        goto fail;
+    /* The descriptor's root record is the authority for the root */
+    vol->dirs[0].lba = rd32(vd + 156 + 2);
+    vol->dirs[0].size = rd32(vd + 156 + 10);
+    vol->dirs[0].parent = 0;
+
+    if (have_svd)
+        iso9660_set_label(vol, svd + 40, 1);
+    else
+        iso9660_set_label(vol, pvd + 40, 0);
+
+    mem_free(pvd);
+    mem_free(svd);
+    return vol;
+
+fail:
+    if (pvd)
+        mem_free(pvd);
+    if (svd)
+        mem_free(svd);
+    iso9660_unmount(vol);
+    return 0;
+}
+
+void iso9660_set_max_transfer(struct iso9660_vol *vol, UINT32 bytes)
+{
+    if (vol)
+        vol->max_transfer = (bytes < ISO9660_BLOCK) ? ISO9660_BLOCK : bytes;
+}
+
+void iso9660_unmount(struct iso9660_vol *vol)
+{
+    if (!vol)
+        return;
+    if (vol->cache)
+        bcache_destroy(vol->cache);
+    if (vol->dirs)
+        mem_free(vol->dirs);
+    if (vol->name_hash)
+        mem_free(vol->name_hash);
+    if (vol->lba_hash)
+        mem_free(vol->lba_hash);
+    if (vol->pool)
+        mem_free(vol->pool);
+    mem_free(vol);
+}
+
+/* ------------------------------------------------------------------ */
+/* Public API: directories                                             */
+/* ------------------------------------------------------------------ */
+
+struct iso9660_dir *iso9660_opendir(struct iso9660_vol *vol, const char *path)
+{
+    struct iso9660_node node;
+    if (!vol || !path || iso9660_lookup(vol, path, &node) != 0 || node.dir < 0)
+        return 0;
+    struct iso9660_dir *d = (struct iso9660_dir *)mem_alloc(sizeof(*d));
+    if (!d)
+        return 0;
+    d->vol = vol;
+    if (iso9660_dir_cursor(vol, (UINT32)node.dir, &d->cur) != 0) {
+        mem_free(d);
+        return 0;
+    }
+    return d;
+}
+
+int iso9660_readdir_next(struct iso9660_dir *d, struct fs_entry *out)
+{
+    if (!d || !out)
+        return -1;
+    struct iso9660_rec rec;
+    int r;
+    while ((r = iso9660_next_record(d->vol, &d->cur, &rec)) > 0) {
+        if (rec.special)
+            continue;
+        str_copy(out->name, rec.name, FS_MAX_NAME);
+        out->is_dir = (rec.flags & ISO9660_FLAG_DIR) ? 1 : 0;
+        out->mtime = rec.mtime;
+        out->ctime = 0;
+        out->attr = FS_ATTR_READ_ONLY |
+                    ((rec.flags & ISO9660_FLAG_HIDDEN) ? FS_ATTR_HIDDEN : 0);
+        out->id = rec.lba;
+        out->size = out->is_dir ? 0 : rec.size;
+        /* A file over 4 GB is one record per extent */
+        while (!out->is_dir && (rec.flags & ISO9660_FLAG_MORE)) {
+            if (iso9660_next_record(d->vol, &d->cur, &rec) <= 0)
+                return -1;
+            out->size += rec.size;
+        }
+        return 1;
+    }
+    return r;
+}
+
+void iso9660_closedir(struct iso9660_dir *d)
+{
+    if (d)
+        mem_free(d);
+}
+
+/* ------------------------------------------------------------------ */
+/* Public API: files                                                   */
+/* ------------------------------------------------------------------ */
+
+struct iso9660_file *iso9660_open(struct iso9660_vol *vol, const char *path,
+                                  UINT64 *out_size)
+{
+    struct iso9660_node node;
+    if (!vol || !path || iso9660_lookup(vol, path, &node) != 0 || node.dir >= 0)
+        return 0;
+    struct iso9660_file *f = (struct iso9660_file *)mem_alloc(sizeof(*f));
+    if (!f)
+        return 0;
+    f->vol = vol;
+    if (iso9660_file_extents(vol, &node, &f->ext, &f->count, &f->size) != 0) {
+        mem_free(f);
+        return 0;
+    }
+    if (out_size)
+        *out_size = f->size;
+    return f;
+}
+
+int iso9660_read(struct iso9660_file *f, void *buf, UINTN *size)
+{
+    if (!f || !size)
+        return -1;
+    struct iso9660_vol *vol = f->vol;
+    UINTN want = *size;
+    if (f->pos >= f->size)
+        want = 0;
+    else if ((UINT64)want > f->size - f->pos)
+        want = (UINTN)(f->size - f->pos);
+    *size = 0;
+
+    UINT8 *dst = (UINT8 *)buf;
+    UINTN got = 0;
+    while (got < want) {
+        /* Reads mostly go forward: start from the last extent */
+        if (f->hint >= f->count || f->ext[f->hint].off > f->pos)
+            f->hint = 0;
+        while (f->hint < f->count - 1 &&
+               f->pos >= f->ext[f->hint].off + f->ext[f->hint].len)
+            f->hint++;
+        const struct iso9660_ext *x = &f->ext[f->hint];
+        UINT64 in = f->pos - x->off;
+        if (in >= x->len)
+            return -1;
+        UINT64 lba = x->lba + in / ISO9660_BLOCK;
+        UINT32 boff = (UINT32)(in % ISO9660_BLOCK);
+        UINTN n = want - got;
+        if ((UINT64)n > x->len - in)
+            n = (UINTN)(x->len - in);
+
+        if (boff == 0 && n >= ISO9660_BLOCK) {
+            /* Whole blocks: straight into the caller's buffer */
+            UINTN cap = vol->max_transfer / ISO9660_BLOCK;
+            UINTN blocks = n / ISO9660_BLOCK;
+            if (blocks > cap)
+                blocks = cap;
+            if (iso9660_read_blocks(vol, lba, (UINT32)blocks, dst + got) != 0)
+                return -1;
+            n = blocks * ISO9660_BLOCK;
+        } else {
+            if (!f->blk) {
+                f->blk = (UINT8 *)mem_alloc_raw(ISO9660_BLOCK);
+                if (!f->blk)
+                    return -1;
+            }
+            if (!f->blk_valid || f->blk_lba != lba) {
+                f->blk_valid = 0;
+                if (iso9660_read_blocks(vol, lba, 1, f->blk) != 0)
+                    return -1;
+                f->blk_lba = lba;
+                f->blk_valid = 1;
+            }
+            if (n > ISO9660_BLOCK - boff)
+                n = ISO9660_BLOCK - boff;
+            mem_copy(dst + got, f->blk + boff, n);
+        }
+        got += n;
+        f->pos += n;
+        *size = got;
+    }
+    return 0;
+}
+
+int iso9660_seek(struct iso9660_file *f, UINT64 pos)
+{
+    if (!f)
+        return -1;
+    f->pos = (pos > f->size) ? f->size : pos;
+    return 0;
+}
+
+void iso9660_close(struct iso9660_file *f)
+{
+    if (!f)
+        return;
+    if (f->ext)
+        mem_free(f->ext);
+    if (f->blk)
+        mem_free(f->blk);
+    mem_free(f);
+}
+
+void *iso9660_readfile(struct iso9660_vol *vol, const char *path, UINTN *out_size)
+{
+    UINT64 size;
+    struct iso9660_file *f = iso9660_open(vol, path, &size);
+    if (!f)
+        return 0;
+    UINT8 *data = (UINT8 *)mem_alloc_raw((UINTN)size + 1);
+    UINTN n = (UINTN)size;
+    if (data && (iso9660_read(f, data, &n) != 0 || n != size)) {
+        mem_free(data);
+        data = 0;
+    }
+    iso9660_close(f);
+    if (!data)
+        return 0;
+    data[size] = 0;
+    if (out_size)
+        *out_size = (UINTN)size;
+    return data;
+}
+
+int iso9660_extents(struct iso9660_vol *vol, const char *path,
+                    struct fs_extent *out, int max)
+{
+    struct iso9660_node node;
+    struct iso9660_ext *ext;
+    int count;
+    UINT64 size;
+    if (!vol || !path || iso9660_lookup(vol, path, &node) != 0 || node.dir >= 0 ||
+        iso9660_file_extents(vol, &node, &ext, &count, &size) != 0)
+        return -1;
+    int n = 0;
+    for (int i = 0; i < count && n <= max; i++) {
+        if (ext[i].len == 0)
+            continue;
+        if (n < max) {
+            out[n].offset = ext[i].off;
+            out[n].pos = (UINT64)ext[i].lba * ISO9660_BLOCK;
+            out[n].length = ext[i].len;
+        }
+        n++;
+    }
+    mem_free(ext);
+    return n > max ? -1 : n;
+}
+
+/* ------------------------------------------------------------------ */
+/* Public API: volume                                                  */
+/* ------------------------------------------------------------------ */
+
+int iso9660_volume_info(struct iso9660_vol *vol, UINT64 *total_bytes,
+                        UINT64 *free_bytes)
+{
+    if (!vol)
+        return -1;
+    if (total_bytes)
+        *total_bytes = vol->volume_blocks * ISO9660_BLOCK;
+    if (free_bytes)
+        *free_bytes = 0;
+    return 0;
+}
+
+UINT64 iso9660_file_size(struct iso9660_vol *vol, const char *path)
+{
+    struct iso9660_node node;
+    struct iso9660_ext *ext;
+    int count;
+    UINT64 size;
+    if (!vol || !path || iso9660_lookup(vol, path, &node) != 0 || node.dir >= 0 ||
+        iso9660_file_extents(vol, &node, &ext, &count, &size) != 0)
+        return 0;
+    mem_free(ext);
+    return size;
+}
+
+int iso9660_exists(struct iso9660_vol *vol, const char *path)
+{
+    struct iso9660_node node;
+    return vol && path && iso9660_lookup(vol, path, &node) == 0;
+}
+
+const char *iso9660_get_label(struct iso9660_vol *vol)
+{
+    return vol ? vol->label : "";
+}
@@ -0,0 +1,94 @@
+/*
+ * iso9660.h — ISO 9660 filesystem driver (read-only)
+ *
+ * Portable: uses callback-based block I/O, no UEFI dependency, so an
+ * optical drive, a hybrid USB stick or an .iso file read through a
+ * stream (fs.h) all mount the same way.
+ * Supports: Rock Ridge names (preferred), then Joliet, then plain
+ * ISO 9660 names; multi-extent files over 4 GB.
+ * Does NOT support: Rock Ridge symlinks and relocated deep
+ * directories (they show where the image put them), UDF-only discs.
+ */
+#ifndef ISO9660_H
+#define ISO9660_H
+
+#include "boot.h"
+#include "fs.h"
+
+/* The ISO 9660 logical block */
+#define ISO9660_BLOCK 2048
+
+/* Block I/O callbacks */
+typedef int (*iso9660_block_read_fn)(void *ctx, UINT64 lba, UINT32 count, void *buf);
+
+/* Opaque volume handle */
+struct iso9660_vol;
+
+/* Mount an ISO 9660 volume. block_size is the device block size, 512
+   to ISO9660_BLOCK (an image file read as a device uses the latter).
+   Returns NULL on error. */
+struct iso9660_vol *iso9660_mount(iso9660_block_read_fn read_fn,
+                                  void *ctx, UINT32 block_size);
+
+/* Cap the size of a single data read issued to read_fn (default 1 MB) */
+void iso9660_set_max_transfer(struct iso9660_vol *vol, UINT32 bytes);
+
+/* Unmount and free all resources */
+void iso9660_unmount(struct iso9660_vol *vol);
+
+/* Directory cursor: entries in on-disk order (unsorted), without "."
+   and "..". path is ASCII with '/' separators, "/" for root. Close
+   before unmounting. */
+struct iso9660_dir;
+
+/* Open a directory. Returns NULL on error. */
+struct iso9660_dir *iso9660_opendir(struct iso9660_vol *vol, const char *path);
+
+/* Next entry: 1 with *out filled, 0 at the end, -1 on error */
+int iso9660_readdir_next(struct iso9660_dir *d, struct fs_entry *out);
+
+void iso9660_closedir(struct iso9660_dir *d);
+
+/* Read entire file into newly allocated buffer, NUL-terminated past
+   *out_size. Returns NULL on error. */
+void *iso9660_readfile(struct iso9660_vol *vol, const char *path, UINTN *out_size);
+
+/* Get volume info (nothing is free). Returns 0 on success. */
+int iso9660_volume_info(struct iso9660_vol *vol, UINT64 *total_bytes,
+                        UINT64 *free_bytes);
+
+/* Get file size. Returns 0 if not found. */
+UINT64 iso9660_file_size(struct iso9660_vol *vol, const char *path);
+
+/* Check if path exists. Returns 1 if yes. */
+int iso9660_exists(struct iso9660_vol *vol, const char *path);
+
+/* Get volume label (ASCII). Returns empty string if none. */
+const char *iso9660_get_label(struct iso9660_vol *vol);
+
+/* ---- Streaming file handles ---- */
+
+/* Opaque open-file handle. Close all handles before unmounting. */
+struct iso9660_file;
+
+/* Open a file for reading. Sets *out_size. Returns NULL on error. */
+struct iso9660_file *iso9660_open(struct iso9660_vol *vol, const char *path,
+                                  UINT64 *out_size);
+
+/* Read up to *size bytes at the current position; *size is set to the
+   number read (0 at end of file). Whole blocks go from read_fn straight
+   into buf. Returns 0 on success. */
+int iso9660_read(struct iso9660_file *f, void *buf, UINTN *size);
+
+/* Set the position (clamped to the file size). Returns 0 on success. */
+int iso9660_seek(struct iso9660_file *f, UINT64 pos);
+
+void iso9660_close(struct iso9660_file *f);
+
+/* Where a file's data lies on the volume, one extent per record, in
+   file order. Returns the count, or -1 on error or if the file needs
+   more than max. */
+int iso9660_extents(struct iso9660_vol *vol, const char *path,
+                    struct fs_extent *out, int max);
+
+#endif /* ISO9660_H */
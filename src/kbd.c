@@ -1,4 +1,19 @@
 #include "kbd.h"
+#include "fb.h"
+#include "event.h"
+#include "serial.h"
+
+/* Input drained per frame: whatever is queued within this time, capped
+   at this many keys, is handled before the next redraw */
+#define KBD_FRAME_BUDGET 300000 /* 100 ns units: 30 ms */
+#define KBD_FRAME_KEYS   256
+#define TIMER_RELATIVE   2
+
+typedef EFI_STATUS (*BS_SET_TIMER)(EFI_EVENT, UINT32, UINT64);
+
+static EFI_EVENT s_frame_timer;
+static int s_frame_tried;
+static int s_frame_keys;
 
 /* SimpleTextInputEx protocol — try once, cache result */
 static EFI_SIMPLE_TEXT_INPUT_EX_PROTOCOL *s_inputex;
@@ -60,7 +75,7 @@ static UINT32 shift_to_modifiers(UINT32 shift_state) {
     return mods;
 }
 
-int kbd_poll(struct key_event *ev) {
+static int kbd_read(struct key_event *ev) {
     try_inputex();
 
     if (s_inputex) {
@@ -70,7 +85,7 @@ int kbd_poll(struct key_event *ev) {
             ev->code = KEY_NONE;
             ev->scancode = 0;
             ev->modifiers = 0;
-            return 0;
+            return serial_read_key(ev);
         }
         ev->scancode = kd.Key.ScanCode;
         ev->modifiers = shift_to_modifiers(kd.KeyState.KeyShiftState);
@@ -97,7 +112,7 @@ int kbd_poll(struct key_event *ev) {
         ev->code = KEY_NONE;
         ev->scancode = 0;
         ev->modifiers = 0;
-        return 0;
+        return serial_read_key(ev);
     }
 
     ev->scancode = key.ScanCode;
@@ -109,16 +124,74 @@ int kbd_poll(struct key_event *ev) {
     return 1;
 }
 
-void kbd_wait(struct key_event *ev) {
-    try_inputex();
+int kbd_poll(struct key_event *ev) {
+    /* Whatever was drawn is shown before waiting on the user */
+    fb_present();
+    return kbd_read(ev);
+}
 
-    EFI_EVENT wait_event;
+/* The event that signals while a key is waiting */
+static EFI_EVENT key_event(void) {
+    try_inputex();
     if (s_inputex)
-        wait_event = s_inputex->WaitForKeyEx;
-    else
-        wait_event = g_boot.st->ConIn->WaitForKey;
+        return s_inputex->WaitForKeyEx;
+    return g_boot.st->ConIn->WaitForKey;
+}
+
+int kbd_pending(void) {
+    /* The wait event is re-armed by the firmware while keys remain, so
+       checking it leaves the key for the next read */
+    return serial_pending() ||
+           g_boot.bs->CheckEvent(key_event()) == EFI_SUCCESS;
+}
 
-    UINTN index;
-    g_boot.bs->WaitForEvent(1, &wait_event, &index);
-    kbd_poll(ev);
+void kbd_wait(struct key_event *ev) {
+    fb_present();
+    /* Keys from the serial line signal nothing: wake to look for them */
+    EFI_EVENT wait_event = serial_wait_event();
+    if (!wait_event)
+        wait_event = key_event();
+
+    /* The event loop runs its handlers until the key arrives */
+    do {
+        ev_wait(wait_event);
+    } while (!kbd_poll(ev));
+}
+
+void kbd_wait_scrollback(struct key_event *ev) {
+    int page = (int)g_boot.rows - 1;
+    for (;;) {
+        kbd_wait(ev);
+        if (ev->code == KEY_PGUP)
+            fb_scrollback(page);
+        else if (ev->code == KEY_PGDN)
+            fb_scrollback(-page);
+        else
+            break;
+    }
+    fb_scrollback(-fb_scrollback(0));
+}
+
+void kbd_frame_begin(void) {
+    if (!s_frame_tried) {
+        s_frame_tried = 1;
+        if (EFI_ERROR(g_boot.bs->CreateEvent(EVT_TIMER, 0, NULL, NULL,
+                                             &s_frame_timer)))
+            s_frame_timer = NULL;
+    }
+    if (s_frame_timer) {
+        /* Clear a signal left from a frame that ended early */
+        g_boot.bs->CheckEvent(s_frame_timer);
+        ((BS_SET_TIMER)g_boot.bs->SetTimer)(s_frame_timer, TIMER_RELATIVE,
+                                            KBD_FRAME_BUDGET);
+    }
+    s_frame_keys = 0;
+}
+
+int kbd_frame_next(struct key_event *ev) {
+    if (++s_frame_keys >= KBD_FRAME_KEYS)
+        return 0;
+    if (s_frame_timer && g_boot.bs->CheckEvent(s_frame_timer) == EFI_SUCCESS)
+        return 0;
+    return kbd_read(ev);
 }
@@ -47,7 +47,23 @@ struct key_event {
 /* Poll for key — returns 0 if no key, nonzero if key available */
 int kbd_poll(struct key_event *ev);
 
-/* Wait for a key press (blocking) */
+/* Whether a key is waiting, without taking it: for long work in an
+   event handler that should give way to typing */
+int kbd_pending(void);
+
+/* Wait for a key press, running the event loop's handlers meanwhile
+   (see event.h) */
 void kbd_wait(struct key_event *ev);
 
+/* Coalescing input: after kbd_wait() returns a key, call
+   kbd_frame_begin(), apply that key, then apply each further key from
+   kbd_frame_next() and redraw once it returns 0. It returns queued
+   keys only, without presenting, until about 30 ms have passed. */
+void kbd_frame_begin(void);
+int kbd_frame_next(struct key_event *ev);
+
+/* Wait for a key press; PgUp/PgDn page through the console scrollback
+   meanwhile. The view is back on the live screen on return. */
+void kbd_wait_scrollback(struct key_event *ev);
+
 #endif /* KBD_H */
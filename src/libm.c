@@ -0,0 +1,1116 @@
+/*
+ * libm.c — Math functions for the shim and user programs
+ *
+ * exp, exp2 and pow scale a polynomial by a table of 2^(j/128); log,
+ * log2, log10 and pow look up 1/c and log(c) for 128 points c over an
+ * octave and take log1p of what is left. Intermediate results are
+ * carried in pairs of doubles (hi + lo) where it matters, so exp, log
+ * and pow are within 0.52 ulp and sin and cos, on fdlibm's kernels
+ * after an exact reduction by pi/2, within 1. sqrt is the CPU
+ * instruction (memops_<arch>). The float functions round the double
+ * result. Nothing here sets errno.
+ */
+
+#include "boot.h"
+#include "shim.h"
+
+static double asdouble(UINT64 u) {
+    union { UINT64 u; double d; } v;
+    v.u = u;
+    return v.d;
+}
+
+static UINT64 asuint64(double d) {
+    union { double d; UINT64 u; } v;
+    v.d = d;
+    return v.u;
+}
+
+#define SIGN_BIT (1ULL << 63)
+#define TOP12(x) ((UINT32)(asuint64(x) >> 52))
+
+/* ---- Exact sums and products (Knuth, Dekker) ----
+ * No fused multiply-add: the product is split into 26-bit halves. */
+
+static void two_sum(double a, double b, double *s, double *e) {
+    double t = a + b, bb = t - a;
+    *s = t;
+    *e = (a - (t - bb)) + (b - bb);
+}
+
+#define SPLITTER 134217729.0            /* 2^27 + 1 */
+
+static void two_prod(double a, double b, double *p, double *e) {
+    double t = a * b;
+    double c = SPLITTER * a, ah = c - (c - a), al = a - ah;
+    c = SPLITTER * b;
+    double bh = c - (c - b), bl = b - bh;
+    *p = t;
+    *e = ((ah * bh - t) + ah * bl + al * bh) + al * bl;
+}
+
+/* ---- Bits ---- */
+
+double fabs(double x) {
+    return asdouble(asuint64(x) & ~SIGN_BIT);
+}
+
+/* x * 2^n, rounding once even into the subnormals */
+double ldexp(double x, int n) {
+    if (n > 1023) {
+        x *= 0x1p1023;
+        n -= 1023;
+        if (n > 1023) {
+            x *= 0x1p1023;
+            n -= 1023;
+            if (n > 1023) n = 1023;
+        }
+    } else if (n < -1022) {
+        /* Stop short of the subnormals, then cross them in one step */
+        x *= 0x1p-1022 * 0x1p53;
+        n += 1022 - 53;
+        if (n < -1022) {
+            x *= 0x1p-1022 * 0x1p53;
+            n += 1022 - 53;
+            if (n < -1022) n = -1022;
+        }
+    }
+    return x * asdouble((UINT64)(0x3ff + n) << 52);
+}
+
+double frexp(double x, int *exp) {
+    UINT64 ix = asuint64(x);
+    int e = (int)(ix >> 52) & 0x7ff;
+    if (e == 0) {
+        if (x == 0) {
+            *exp = 0;
+            return x;
+        }
+        x = frexp(x * 0x1p64, exp);
+        *exp -= 64;
+        return x;
+    }
+    if (e == 0x7ff) {
+        *exp = 0;
+        return x;
+    }
+    *exp = e - 0x3fe;
+    return asdouble((ix & 0x800fffffffffffffULL) | 0x3fe0000000000000ULL);
+}
+
+/* ---- Rounding to integers ----
+ * frac is the mask of the fraction bits for an exponent e in 0..51 */
+
+double trunc(double x) {
+    UINT64 ix = asuint64(x);
+    int e = (int)((ix >> 52) & 0x7ff) - 0x3ff;
+    if (e >= 52) return x + 0.0;
+    if (e < 0) return asdouble(ix & SIGN_BIT);
+    return asdouble(ix & ~(0x000fffffffffffffULL >> e));
+}
+
+double floor(double x) {
+    UINT64 ix = asuint64(x);
+    int e = (int)((ix >> 52) & 0x7ff) - 0x3ff;
+    if (e >= 52) return x + 0.0;
+    if (e < 0) {
+        if (!(ix & SIGN_BIT) || (ix << 1) == 0) return asdouble(ix & SIGN_BIT);
+        return -1.0;
+    }
+    UINT64 frac = 0x000fffffffffffffULL >> e;
+    if (!(ix & frac)) return x;
+    if (ix & SIGN_BIT) ix += frac + 1;
+    return asdouble(ix & ~frac);
+}
+
+double ceil(double x) {
+    UINT64 ix = asuint64(x);
+    int e = (int)((ix >> 52) & 0x7ff) - 0x3ff;
+    if (e >= 52) return x + 0.0;
+    if (e < 0) {
+        if ((ix & SIGN_BIT) || ix == 0) return asdouble(ix & SIGN_BIT);
+        return 1.0;
+    }
+    UINT64 frac = 0x000fffffffffffffULL >> e;
+    if (!(ix & frac)) return x;
+    if (!(ix & SIGN_BIT)) ix += frac + 1;
+    return asdouble(ix & ~frac);
+}
+
+/* Halves away from zero */
+double round(double x) {
+    UINT64 ix = asuint64(x);
+    int e = (int)((ix >> 52) & 0x7ff) - 0x3ff;
+    if (e >= 52) return x + 0.0;
+    if (e < -1) return asdouble(ix & SIGN_BIT);
+    if (e == -1) return asdouble((ix & SIGN_BIT) | 0x3ff0000000000000ULL);
+    UINT64 frac = 0x000fffffffffffffULL >> e;
+    ix += (frac + 1) >> 1;
+    return asdouble(ix & ~frac);
+}
+
+/* Exact: the remainder is found by shift-and-subtract on the
+   significands */
+double fmod(double x, double y) {
+    UINT64 ux = asuint64(x), uy = asuint64(y);
+    int ex = (int)(ux >> 52) & 0x7ff, ey = (int)(uy >> 52) & 0x7ff;
+    UINT64 sx = ux & SIGN_BIT, i;
+
+    if ((uy << 1) == 0 || y != y || ex == 0x7ff)
+        return (x * y) / (x * y);
+    if ((ux << 1) <= (uy << 1)) {
+        if ((ux << 1) == (uy << 1)) return 0 * x;
+        return x;
+    }
+    if (!ex) {
+        for (i = ux << 12; !(i >> 63); ex--, i <<= 1) ;
+        ux <<= -ex + 1;
+    } else {
+        ux &= 0x000fffffffffffffULL;
+        ux |= 1ULL << 52;
+    }
+    if (!ey) {
+        for (i = uy << 12; !(i >> 63); ey--, i <<= 1) ;
+        uy <<= -ey + 1;
+    } else {
+        uy &= 0x000fffffffffffffULL;
+        uy |= 1ULL << 52;
+    }
+    for (; ex > ey; ex--) {
+        i = ux - uy;
+        if (!(i >> 63)) {
+            if (i == 0) return 0 * x;
+            ux = i;
+        }
+        ux <<= 1;
+    }
+    i = ux - uy;
+    if (!(i >> 63)) {
+        if (i == 0) return 0 * x;
+        ux = i;
+    }
+    for (; !(ux >> 52); ux <<= 1, ex--) ;
+    if (ex > 0) {
+        ux -= 1ULL << 52;
+        ux |= (UINT64)ex << 52;
+    } else {
+        ux >>= -ex + 1;
+    }
+    return asdouble(ux | sx);
+}
+
+/* ---- Square root ---- */
+#if !defined(__aarch64__) && !defined(__x86_64__)
+/* Newton from frexp's estimate, then a correction to the rounding */
+double sqrt(double x) {
+    if (x <= 0 || x != x || x == asdouble(0x7ff0000000000000ULL))
+        return x == 0 || x > 0 ? x : (x - x) / (x - x);
+    int e;
+    double m = frexp(x, &e);
+    if (e & 1) {
+        m *= 2;
+        e--;
+    }
+    double r = ldexp(0.5 + 0.5 * m, e / 2);
+    for (int k = 0; k < 6; k++) r = 0.5 * (r + x / r);
+    double p, q;
+    two_prod(r, r, &p, &q);
+    return r + ((x - p) - q) / (2 * r);
+}
+
+float sqrtf(float x) { return (float)sqrt(x); }
+#endif
+
+/* ---- exp ---- */
+
+static const struct { double hi, tail; } s_exp2j[128] = {
+    { 0x1.0000000000000p+0, 0x0p+0 },
+    { 0x1.0163da9fb3335p+0, 0x1.b3b4f1a88bf6ep-54 },
+    { 0x1.02c9a3e778061p+0, -0x1.160139cd8dc5dp-56 },
+    { 0x1.04315e86e7f85p+0, -0x1.05e7a108766d1p-54 },
+    { 0x1.059b0d3158574p+0, 0x1.cd2523567f613p-55 },
+    { 0x1.0706b29ddf6dep+0, -0x1.bce8023f98efap-55 },
+    { 0x1.0874518759bc8p+0, 0x1.0f74e61e6c861p-57 },
+    { 0x1.09e3ecac6f383p+0, 0x1.0a3e45b33d399p-54 },
+    { 0x1.0b5586cf9890fp+0, 0x1.79aa65d837b6dp-54 },
+    { 0x1.0cc922b7247f7p+0, 0x1.eb51a92fdeffcp-55 },
+    { 0x1.0e3ec32d3d1a2p+0, 0x1.ebe3d702f9cd1p-60 },
+    { 0x1.0fb66affed31bp+0, -0x1.a033489906e0bp-57 },
+    { 0x1.11301d0125b51p+0, -0x1.556522a2fbd0ep-54 },
+    { 0x1.12abdc06c31ccp+0, -0x1.080ef8c4eea55p-58 },
+    { 0x1.1429aaea92de0p+0, -0x1.1c923b9d5f416p-54 },
+    { 0x1.15a98c8a58e51p+0, 0x1.0d3e3e95c55afp-55 },
+    { 0x1.172b83c7d517bp+0, -0x1.01b15eaa59348p-55 },
+    { 0x1.18af9388c8deap+0, -0x1.f1ff055de323dp-55 },
+    { 0x1.1a35beb6fcb75p+0, 0x1.b898c3f1353bfp-55 },
+    { 0x1.1bbe084045cd4p+0, -0x1.6d99c7611eb26p-54 },
+    { 0x1.1d4873168b9aap+0, 0x1.aecf73e3a2f60p-54 },
+    { 0x1.1ed5022fcd91dp+0, -0x1.fe782cb86389dp-55 },
+    { 0x1.2063b88628cd6p+0, 0x1.a6f4144a6c38dp-55 },
+    { 0x1.21f49917ddc96p+0, 0x1.07a05b0e4047dp-55 },
+    { 0x1.2387a6e756238p+0, 0x1.68efde3a8a894p-54 },
+    { 0x1.251ce4fb2a63fp+0, 0x1.75e18f274487dp-55 },
+    { 0x1.26b4565e27cddp+0, 0x1.0472b981fe7f2p-55 },
+    { 0x1.284dfe1f56381p+0, -0x1.6b87b3f71085ep-54 },
+    { 0x1.29e9df51fdee1p+0, 0x1.2f7e16d09ab31p-55 },
+    { 0x1.2b87fd0dad990p+0, -0x1.d219b1a6fbffap-60 },
+    { 0x1.2d285a6e4030bp+0, 0x1.b3782720c0ab4p-55 },
+    { 0x1.2ecafa93e2f56p+0, 0x1.e149289cecb8fp-57 },
+    { 0x1.306fe0a31b715p+0, 0x1.34d754db0abb6p-55 },
+    { 0x1.32170fc4cd831p+0, 0x1.64201e2ac744cp-55 },
+    { 0x1.33c08b26416ffp+0, 0x1.fdd395dd3f84ap-55 },
+    { 0x1.356c55f929ff1p+0, -0x1.6a3803b8e5b04p-55 },
+    { 0x1.371a7373aa9cbp+0, -0x1.24aedcc4b5068p-54 },
+    { 0x1.38cae6d05d866p+0, -0x1.907f81b512d8ep-54 },
+    { 0x1.3a7db34e59ff7p+0, -0x1.1d1e83e9436d2p-56 },
+    { 0x1.3c32dc313a8e5p+0, -0x1.91919b3ce1b15p-54 },
+    { 0x1.3dea64c123422p+0, 0x1.59f48a72a4c6dp-55 },
+    { 0x1.3fa4504ac801cp+0, -0x1.312607a28698ap-54 },
+    { 0x1.4160a21f72e2ap+0, -0x1.8a78f4817895bp-58 },
+    { 0x1.431f5d950a897p+0, -0x1.c2c9b67499a1bp-56 },
+    { 0x1.44e086061892dp+0, 0x1.363ed60c2ac11p-59 },
+    { 0x1.46a41ed1d0057p+0, 0x1.666093b0664efp-54 },
+    { 0x1.486a2b5c13cd0p+0, 0x1.ecce1daa10379p-57 },
+    { 0x1.4a32af0d7d3dep+0, 0x1.3ff8e3f0f1230p-54 },
+    { 0x1.4bfdad5362a27p+0, 0x1.690cebb7aafb0p-56 },
+    { 0x1.4dcb299fddd0dp+0, 0x1.31dbdeb54e077p-54 },
+    { 0x1.4f9b2769d2ca7p+0, -0x1.f94340071a38ep-55 },
+    { 0x1.516daa2cf6642p+0, -0x1.7deccdc93a349p-55 },
+    { 0x1.5342b569d4f82p+0, -0x1.8dec6bd0f385fp-56 },
+    { 0x1.551a4ca5d920fp+0, -0x1.61246ec7b5cf6p-55 },
+    { 0x1.56f4736b527dap+0, 0x1.3350518fdd78ep-54 },
+    { 0x1.58d12d497c7fdp+0, 0x1.b98b72f8a9b05p-56 },
+    { 0x1.5ab07dd485429p+0, 0x1.063e1e21c5409p-54 },
+    { 0x1.5c9268a5946b7p+0, 0x1.4c7855019c6eap-60 },
+    { 0x1.5e76f15ad2148p+0, 0x1.432e62b64c035p-54 },
+    { 0x1.605e1b976dc09p+0, -0x1.ce44a6199769fp-55 },
+    { 0x1.6247eb03a5585p+0, -0x1.c33c53bef4da8p-55 },
+    { 0x1.6434634ccc320p+0, -0x1.45378892be9aep-55 },
+    { 0x1.6623882552225p+0, -0x1.3cedd78565858p-54 },
+    { 0x1.68155d44ca973p+0, 0x1.710aa807e1964p-58 },
+    { 0x1.6a09e667f3bcdp+0, -0x1.3b3efbf5e2228p-54 },
+    { 0x1.6c012750bdabfp+0, -0x1.a12ad8734b982p-57 },
+    { 0x1.6dfb23c651a2fp+0, -0x1.367efb86da9eep-57 },
+    { 0x1.6ff7df9519484p+0, -0x1.0dc3d54e08851p-55 },
+    { 0x1.71f75e8ec5f74p+0, -0x1.81f647e5a3ecfp-56 },
+    { 0x1.73f9a48a58174p+0, -0x1.6ee4ac08b7db0p-55 },
+    { 0x1.75feb564267c9p+0, -0x1.619321e55e68ap-55 },
+    { 0x1.780694fde5d3fp+0, 0x1.09ccb5e09d4d3p-54 },
+    { 0x1.7a11473eb0187p+0, -0x1.b32dcb94da51dp-56 },
+    { 0x1.7c1ed0130c132p+0, 0x1.4ecfd5467c06bp-54 },
+    { 0x1.7e2f336cf4e62p+0, 0x1.5ebe1abd66c55p-57 },
+    { 0x1.80427543e1a12p+0, -0x1.8a1c52fb3cf42p-55 },
+    { 0x1.82589994cce13p+0, -0x1.369b6f13b3734p-54 },
+    { 0x1.8471a4623c7adp+0, -0x1.05e843a19ff1ep-55 },
+    { 0x1.868d99b4492edp+0, -0x1.4d450d872576ep-54 },
+    { 0x1.88ac7d98a6699p+0, 0x1.0ad675b0e8a00p-54 },
+    { 0x1.8ace5422aa0dbp+0, 0x1.db72fc1f0eab4p-55 },
+    { 0x1.8cf3216b5448cp+0, -0x1.5b6609cc5e7ffp-57 },
+    { 0x1.8f1ae99157736p+0, 0x1.bf68359f35f44p-56 },
+    { 0x1.9145b0b91ffc6p+0, -0x1.3091fa71e3d83p-54 },
+    { 0x1.93737b0cdc5e5p+0, -0x1.da9b88b6c1e29p-58 },
+    { 0x1.95a44cbc8520fp+0, -0x1.c23f97c90b959p-57 },
+    { 0x1.97d829fde4e50p+0, -0x1.2434322f4f9aap-54 },
+    { 0x1.9a0f170ca07bap+0, -0x1.5ca6cd7668e4bp-55 },
+    { 0x1.9c49182a3f090p+0, 0x1.1affc2b91ce27p-56 },
+    { 0x1.9e86319e32323p+0, 0x1.dd235e10a73bbp-57 },
+    { 0x1.a0c667b5de565p+0, -0x1.7c50422622263p-55 },
+    { 0x1.a309bec4a2d33p+0, 0x1.b1c86e3e231d5p-55 },
+    { 0x1.a5503b23e255dp+0, -0x1.1bbd1d3bcbb15p-54 },
+    { 0x1.a799e1330b358p+0, 0x1.0cc319cee31d2p-54 },
+    { 0x1.a9e6b5579fdbfp+0, 0x1.469846e735ab3p-55 },
+    { 0x1.ac36bbfd3f37ap+0, -0x1.2dfcd978e9db4p-55 },
+    { 0x1.ae89f995ad3adp+0, 0x1.c1a7792cb3387p-55 },
+    { 0x1.b0e07298db666p+0, -0x1.07b8f4ad1d9fap-54 },
+    { 0x1.b33a2b84f15fbp+0, -0x1.5c3d956dcaebap-58 },
+    { 0x1.b59728de5593ap+0, -0x1.0a40e3da6f640p-54 },
+    { 0x1.b7f76f2fb5e47p+0, -0x1.8d6f438ad9334p-57 },
+    { 0x1.ba5b030a1064ap+0, -0x1.1eee26b588a35p-54 },
+    { 0x1.bcc1e904bc1d2p+0, 0x1.4ffd70a5fddcdp-56 },
+    { 0x1.bf2c25bd71e09p+0, -0x1.1bdfbfa9298acp-54 },
+    { 0x1.c199bdd85529cp+0, 0x1.36eae30af0cb3p-56 },
+    { 0x1.c40ab5fffd07ap+0, 0x1.ee3325c9ffd94p-55 },
+    { 0x1.c67f12e57d14bp+0, 0x1.4e08fd10959acp-55 },
+    { 0x1.c8f6d9406e7b5p+0, 0x1.3cdaf384e1a67p-57 },
+    { 0x1.cb720dcef9069p+0, 0x1.76b2c6c921968p-57 },
+    { 0x1.cdf0b555dc3fap+0, -0x1.08a1883ccb5d2p-55 },
+    { 0x1.d072d4a07897cp+0, -0x1.fad5d3ffffa6fp-55 },
+    { 0x1.d2f87080d89f2p+0, -0x1.00dae3875a949p-54 },
+    { 0x1.d5818dcfba487p+0, 0x1.4a385a63d07a7p-56 },
+    { 0x1.d80e316c98398p+0, -0x1.2919e2040220fp-55 },
+    { 0x1.da9e603db3285p+0, 0x1.e5a50d5c192acp-55 },
+    { 0x1.dd321f301b460p+0, 0x1.43a59ac016b4bp-55 },
+    { 0x1.dfc97337b9b5fp+0, -0x1.2d52107b43e1fp-55 },
+    { 0x1.e264614f5a129p+0, -0x1.92ab93b470dc9p-55 },
+    { 0x1.e502ee78b3ff6p+0, 0x1.4b604603a88d3p-56 },
+    { 0x1.e7a51fbc74c83p+0, 0x1.3c5ec519d7271p-55 },
+    { 0x1.ea4afa2a490dap+0, -0x1.ff7128fd391f0p-55 },
+    { 0x1.ecf482d8e67f1p+0, -0x1.dae98e223747dp-55 },
+    { 0x1.efa1bee615a27p+0, 0x1.ec3bc41aa2008p-55 },
+    { 0x1.f252b376bba97p+0, 0x1.42b94c3a9eb32p-55 },
+    { 0x1.f50765b6e4540p+0, 0x1.a64a931d185eep-55 },
+    { 0x1.f7bfdad9cbe14p+0, -0x1.e37bae43be3edp-55 },
+    { 0x1.fa7c1819e90d8p+0, 0x1.7893b4d91cd9dp-56 },
+    { 0x1.fd3c22b8f71f1p+0, 0x1.305c14160cc89p-58 },
+};
+
+#define EXP_SHIFT 0x1.8p52              /* adding it rounds to an integer */
+#define INVLN2N   0x1.71547652b82fep+7  /* 128 / ln 2 */
+#define LN2N_HI   0x1.62e42fefa0000p-8  /* ln 2 / 128, kd * hi exact */
+#define LN2N_LO   0x1.cf79abc9e3b3ap-47
+
+/* 2^(k/128) * e^r for |r| a little over ln2/256. The tail of the table
+   entry rides in with r. Near the bottom of the range the sum is taken
+   2^1022 higher so that scale * tmp is not subnormal; results below it
+   round twice. */
+static double exp_scaled(INT64 k, double r) {
+    int j = (int)(k & 127);
+    INT64 e = k >> 7;
+    double r2 = r * r;
+    double tmp = s_exp2j[j].tail + r + r2 * (0.5 + r * (0x1.5555555555555p-3 +
+                 r * (0x1.5555555555555p-5 + r * 0x1.1111111111111p-7)));
+    UINT64 sbits = asuint64(s_exp2j[j].hi);
+    if (e >= -1000 && e <= 1023) {
+        double scale = asdouble(sbits + ((UINT64)e << 52));
+        return scale + scale * tmp;
+    }
+    if (e > 0) {
+        double scale = asdouble(sbits + ((UINT64)(e - 1) << 52));
+        return 2.0 * (scale + scale * tmp);
+    }
+    double scale = asdouble(sbits + ((UINT64)(e + 1022) << 52));
+    return (scale + scale * tmp) * 0x1p-1022;
+}
+
+/* e^(hi + lo) for hi between the caller's limits */
+static double exp_dd(double hi, double lo) {
+    double kd = hi * INVLN2N + EXP_SHIFT;
+    kd -= EXP_SHIFT;
+    double r = hi - kd * LN2N_HI - kd * LN2N_LO + lo;
+    return exp_scaled((INT64)kd, r);
+}
+
+double exp(double x) {
+    UINT32 top = TOP12(x) & 0x7ff;
+    if (top < 0x3c9)                    /* |x| < 2^-54 */
+        return 1.0 + x;
+    if (top >= 0x408) {                 /* |x| >= 512, inf or NaN */
+        if (x != x) return x + x;
+        if (x > 709.8) return asdouble(0x7ff0000000000000ULL);
+        if (x < -745.2) return 0.0;
+    }
+    return exp_dd(x, 0.0);
+}
+
+double exp2(double x) {
+    UINT32 top = TOP12(x) & 0x7ff;
+    if (top < 0x3c9)
+        return 1.0 + x;
+    if (top >= 0x409) {                 /* |x| >= 1024, inf or NaN */
+        if (x != x) return x + x;
+        if (x >= 1024) return asdouble(0x7ff0000000000000ULL);
+        if (x < -1075) return 0.0;
+    }
+    double kd = x * 128 + EXP_SHIFT;
+    kd -= EXP_SHIFT;
+    /* x - kd/128 is exact, and rounding its product with ln 2 once
+       costs well under 2^-60 */
+    return exp_scaled((INT64)kd, (x - kd * 0x1p-7) * 0x1.62e42fefa39efp-1);
+}
+
+/* ---- log ---- */
+
+/* For the 128 slices of [LOG_OFF, 2 LOG_OFF) by their top bits: 1/c
+   for a point c in each (1 exactly in the one holding 1) and -log of
+   that 1/c */
+static const struct { double invc, logc_hi, logc_lo; } s_logc[128] = {
+    { 0x1.69be8c81fb00cp+0, -0x1.620ef9ac6aa7cp-2, 0x1.7d5edf2436028p-56 },
+    { 0x1.67c22fe4dcddap+0, -0x1.5c6bfa1131b89p-2, 0x1.5accf53e0fb97p-56 },
+    { 0x1.65cb6049c63c4p+0, -0x1.56d0e0c69c3a3p-2, 0x1.c6ff348765107p-57 },
+    { 0x1.63da068aeb033p+0, -0x1.513d97c718e7ep-2, 0x1.dd1b3b0521ed4p-57 },
+    { 0x1.61ee0c0281abbp+0, -0x1.4bb20968ac7e1p-2, 0x1.b1c420e7eb68ep-56 },
+    { 0x1.60075a87531dbp+0, -0x1.462e205af89a2p-2, -0x1.32656a7abcfe8p-65 },
+    { 0x1.5e25dc6966c26p+0, -0x1.40b1c7a55020fp-2, -0x1.da8ee8453da74p-56 },
+    { 0x1.5c497c6ec9c1ap+0, -0x1.3b3ceaa4d8c01p-2, -0x1.175a194083e99p-62 },
+    { 0x1.5a7225d070680p+0, -0x1.35cf750ab91c3p-2, -0x1.3b97926470308p-56 },
+    { 0x1.589fc43730bf1p+0, -0x1.306952da53478p-2, -0x1.bf85e2d1f17a3p-56 },
+    { 0x1.56d243b8d56c2p+0, -0x1.2b0a70678b1d0p-2, 0x1.aa5563d85c314p-56 },
+    { 0x1.550990d547f30p+0, -0x1.25b2ba551821cp-2, 0x1.7ea05254c1a16p-56 },
+    { 0x1.53459873d182dp+0, -0x1.20621d92e28ddp-2, -0x1.1798dfe721091p-56 },
+    { 0x1.518647e0717edp+0, -0x1.1b18875c6b297p-2, -0x1.0e046c50d116ep-56 },
+    { 0x1.4fcb8cc948f96p+0, -0x1.15d5e5373da29p-2, -0x1.1a371bf0ea155p-56 },
+    { 0x1.4e15553c1a639p+0, -0x1.109a24f16d0e1p-2, -0x1.a3c61fb6a32a4p-58 },
+    { 0x1.4c638fa3dcb8ep+0, -0x1.0b6534a01a428p-2, -0x1.37c1238e8b88bp-58 },
+    { 0x1.4ab62ac66176cp+0, -0x1.0637029e03bf8p-2, -0x1.42b5d01e45f31p-57 },
+    { 0x1.490d15c20cb76p+0, -0x1.010f7d8a1ed9dp-2, 0x1.0734ab1b69901p-56 },
+    { 0x1.4768400b9ecd3p+0, -0x1.f7dd288c73c7dp-3, -0x1.355c9ac6293ddp-57 },
+    { 0x1.45c7996c0ec27p+0, -0x1.eda86beb4e196p-3, -0x1.40ffc2a7e6d71p-59 },
+    { 0x1.442b11fe75285p+0, -0x1.e380a3f7df699p-3, -0x1.862248039fdf5p-58 },
+    { 0x1.42929a2e06a4dp+0, -0x1.d965aff71ff0bp-3, 0x1.4620b777f6583p-57 },
+    { 0x1.40fe22b41db5ep+0, -0x1.cf576fa97461cp-3, -0x1.fccfea63fc024p-57 },
+    { 0x1.3f6d9c965323ep+0, -0x1.c555c34844615p-3, -0x1.782b790e0a62bp-57 },
+    { 0x1.3de0f924a4a53p+0, -0x1.bb608b83a0031p-3, 0x1.d9b800b01a214p-57 },
+    { 0x1.3c5829f7a9375p+0, -0x1.b177a97ff3db0p-3, -0x1.a6d00bc3af246p-58 },
+    { 0x1.3ad320eed2b70p+0, -0x1.a79afed3cb32dp-3, 0x1.6ec8f5499c79cp-57 },
+    { 0x1.3951d02ebc479p+0, -0x1.9dca6d85a004bp-3, -0x1.ed1e85911c4a0p-57 },
+    { 0x1.37d42a1f851a3p+0, -0x1.9405d809b84c5p-3, 0x1.4b038a142b56bp-58 },
+    { 0x1.365a216b372dap+0, -0x1.8a4d214010533p-3, -0x1.6b818e66a5769p-59 },
+    { 0x1.34e3a8fc39a0ap+0, -0x1.80a02c7251993p-3, -0x1.b4304ad16f8a7p-57 },
+    { 0x1.3370b3fbce360p+0, -0x1.76fedd51d5fd8p-3, 0x1.05611f9784a98p-60 },
+    { 0x1.320135d099ac2p+0, -0x1.6d6917f5b6cd2p-3, -0x1.549a64c679070p-65 },
+    { 0x1.3095221d368ecp+0, -0x1.63dec0d8e7691p-3, 0x1.be5fe31a14be8p-58 },
+    { 0x1.2f2c6cbed22b0p+0, -0x1.5a5fbcd85b285p-3, -0x1.39affd8c6a2a7p-58 },
+    { 0x1.2dc709cbd3534p+0, -0x1.50ebf131362fbp-3, -0x1.ef67c0f42aa21p-57 },
+    { 0x1.2c64ed928aa10p+0, -0x1.4783437f08e8dp-3, 0x1.1ea191ada8bbfp-60 },
+    { 0x1.2b060c97ebe82p+0, -0x1.3e2599ba15d49p-3, 0x1.64522fe3737adp-57 },
+    { 0x1.29aa5b9650907p+0, -0x1.34d2da35a16f4p-3, -0x1.04e39c61b7e42p-57 },
+    { 0x1.2851cf7c428cdp+0, -0x1.2b8aeb9e4bdbdp-3, 0x1.f68c8827b01d1p-59 },
+    { 0x1.26fc5d6b4fab4p+0, -0x1.224db4f87417bp-3, 0x1.e710e8a29df01p-57 },
+    { 0x1.25a9fab6e4facp+0, -0x1.191b1d9ea4760p-3, -0x1.90257918c1533p-58 },
+    { 0x1.245a9ce332056p+0, -0x1.0ff30d40081afp-3, 0x1.4dfd3e1b3ad2ep-59 },
+    { 0x1.230e39a413a1bp+0, -0x1.06d56bdee9439p-3, -0x1.e2c47ed4c6eccp-59 },
+    { 0x1.21c4c6dc061e2p+0, -0x1.fb84439e702d1p-4, 0x1.b7f69d2819213p-59 },
+    { 0x1.207e3a9b1e8d3p+0, -0x1.e9722f6a33913p-4, 0x1.c26f521d03b6ep-59 },
+    { 0x1.1f3a8b1e0af9dp+0, -0x1.d7746d06ffb25p-4, 0x1.d56376a0acdb6p-63 },
+    { 0x1.1df9aecd194e9p+0, -0x1.c58acef58e68fp-4, 0x1.28c4213df87bap-59 },
+    { 0x1.1cbb9c3b44badp+0, -0x1.b3b5284ebe043p-4, -0x1.671a3f8312014p-58 },
+    { 0x1.1b804a2549645p+0, -0x1.a1f34cc0ede39p-4, 0x1.2b44ab64fb0e4p-58 },
+    { 0x1.1a47af70be33ap+0, -0x1.9045108d699c6p-4, 0x1.2ab01f5a5978ep-61 },
+    { 0x1.1911c32b348dcp+0, -0x1.7eaa4885e25e2p-4, 0x1.b55bfcdd3c710p-59 },
+    { 0x1.17de7c895dcc0p+0, -0x1.6d22ca09f61fap-4, -0x1.ebb3580d31000p-61 },
+    { 0x1.16add2e63647fp+0, -0x1.5bae6b04c452ep-4, 0x1.ceb706f61e3a3p-59 },
+    { 0x1.157fbdc235cffp+0, -0x1.4a4d01ea8fb65p-4, -0x1.c196436ab3d12p-60 },
+    { 0x1.145434c2855c5p+0, -0x1.38fe65b66cfb2p-4, -0x1.0da207c54396ep-59 },
+    { 0x1.132b2fb039dc6p+0, -0x1.27c26de7fddc6p-4, -0x1.c013d13cde5e0p-59 },
+    { 0x1.1204a67793f6ap+0, -0x1.1698f281386bap-4, -0x1.014614e0e096bp-61 },
+    { 0x1.10e0912744966p+0, -0x1.0581cc043a393p-4, 0x1.2a6cb9cc7a32fp-58 },
+    { 0x1.0fbee7efb622ep+0, -0x1.e8f9a6e24e118p-5, 0x1.5ba90449ac832p-59 },
+    { 0x1.0e9fa3225a3e1p+0, -0x1.c713c48825a49p-5, -0x1.ee25d828e3ba6p-59 },
+    { 0x1.0d82bb30fbe96p+0, -0x1.a551a4e5ed89ep-5, 0x1.e694e77e75d05p-59 },
+    { 0x1.0c6828ad15f01p+0, -0x1.83b2fcd762045p-5, 0x1.91d69959eaea5p-59 },
+    { 0x1.0b4fe4472d780p+0, -0x1.623782241da36p-5, -0x1.c2ff468d1f31fp-59 },
+    { 0x1.0a39e6ce309acp+0, -0x1.40deeb7bc2178p-5, -0x1.6ada9c0fbe8dep-60 },
+    { 0x1.0926292ed8e9ep+0, -0x1.1fa8f07234fb2p-5, 0x1.dd1d46a7618b3p-59 },
+    { 0x1.0814a47311c1ap+0, -0x1.fd2a92f7e0072p-6, 0x1.fb21098c02293p-60 },
+    { 0x1.070551c1624f2p+0, -0x1.bb475fd4c8618p-6, -0x1.7c8345628b32fp-63 },
+    { 0x1.05f82a5c5b2f9p+0, -0x1.79a7bbd0df0e5p-6, -0x1.f270f12ef5506p-66 },
+    { 0x1.04ed27a2078e3p+0, -0x1.384b1cedc9a50p-6, -0x1.99710299adbd1p-60 },
+    { 0x1.03e4430b61a92p+0, -0x1.ee61f5a49475bp-7, 0x1.78ad5411fa1d5p-63 },
+    { 0x1.02dd762bcaa3fp+0, -0x1.6cb19d87294d0p-7, 0x1.bb98528ff019ep-61 },
+    { 0x1.01d8bab085916p+0, -0x1.d7084e7b15da2p-8, 0x1.cf7a22a6fcac8p-64 },
+    { 0x1.00d60a60359dbp+0, -0x1.ab622e93ce64bp-9, 0x1.468080bd33f77p-63 },
+    { 0x1.0000000000000p+0, 0x0p+0, 0x0p+0 },
+    { 0x1.fb602a2f91e1fp-1, 0x1.294daebc01564p-7, 0x1.4ba451f8ac5a0p-66 },
+    { 0x1.f77a4dd695191p-1, 0x1.1301d448a0b00p-6, -0x1.bd7b1244a97cfp-61 },
+    { 0x1.f3a3a89273f9ep-1, 0x1.906542de674f9p-6, 0x1.59199846e2d5ap-61 },
+    { 0x1.efdbe1f975defp-1, 0x1.066a72e47273fp-5, -0x1.c3eb3d678b4ddp-61 },
+    { 0x1.ec22a449beb96p-1, 0x1.442a34f660bdep-5, -0x1.359bd583a7670p-62 },
+    { 0x1.e8779c4ff8ee3p-1, 0x1.8173b38841751p-5, 0x1.5baa264c73457p-59 },
+    { 0x1.e4da794f1f1e5p-1, 0x1.be48b03e90f71p-5, -0x1.828e29edc3690p-61 },
+    { 0x1.e14aece9570c6p-1, 0x1.faaae2cc5a017p-5, 0x1.f19e21d368317p-59 },
+    { 0x1.ddc8ab09cfb09p-1, 0x1.1b4dfc9edb27fp-4, -0x1.7a3a09c5322acp-58 },
+    { 0x1.da5369cf9557bp-1, 0x1.390ecc1fcd474p-4, 0x1.a1cb77c488e98p-60 },
+    { 0x1.d6eae1794f6f3p-1, 0x1.5698adb285bd4p-4, -0x1.1cac9690a620ep-58 },
+    { 0x1.d38ecc51dc50bp-1, 0x1.73ec6ab4ec63cp-4, 0x1.a12ccb19eaba9p-58 },
+    { 0x1.d03ee69dc00cap-1, 0x1.910ac8397c5fdp-4, -0x1.0469b06e5d776p-59 },
+    { 0x1.ccfaee895bcefp-1, 0x1.adf487264f359p-4, 0x1.beaf1f2509d6dp-58 },
+    { 0x1.c9c2a417e40ffp-1, 0x1.caaa645311532p-4, 0x1.75d2300410594p-58 },
+    { 0x1.c695c9130c4d5p-1, 0x1.e72d18a5ebb68p-4, 0x1.d07e388643b01p-58 },
+    { 0x1.c37420fb5f8a6p-1, 0x1.01beac97b6e0cp-3, 0x1.a2bd521001a0dp-58 },
+    { 0x1.c05d70f93d515p-1, 0x1.0fcdeba2c0e23p-3, 0x1.1c7f0787f348bp-64 },
+    { 0x1.bd517fce73629p-1, 0x1.1dc4a04ebb231p-3, 0x1.0d5c175e1e973p-57 },
+    { 0x1.ba5015c86caaap-1, 0x1.2ba31fb292d05p-3, 0x1.ea496147f7a4dp-57 },
+    { 0x1.b758fcb2ee7e3p-1, 0x1.3969bd2da2806p-3, 0x1.46f451211a274p-59 },
+    { 0x1.b46bffcb5d798p-1, 0x1.4718ca7371c2ap-3, 0x1.6b5749c099af3p-58 },
+    { 0x1.b188ebb483bc1p-1, 0x1.54b0979710ddcp-3, -0x1.d1078baa02229p-57 },
+    { 0x1.aeaf8e6ad28c6p-1, 0x1.6231731614b2ep-3, 0x1.afad35c61c340p-57 },
+    { 0x1.abdfb73919c0fp-1, 0x1.6f9ba9e33686ap-3, 0x1.544cfaa039789p-57 },
+    { 0x1.a91936adaf945p-1, 0x1.7cef87709b4cdp-3, 0x1.f65b09415eef4p-58 },
+    { 0x1.a65bde9003d33p-1, 0x1.8a2d55b9c5e17p-3, 0x1.3cbdfde7dde9cp-58 },
+    { 0x1.a3a781d69993ap-1, 0x1.97555d4d3779fp-3, 0x1.027bd6130df9ep-57 },
+    { 0x1.a0fbf49d62e51p-1, 0x1.a467e555c16dcp-3, 0x1.86ea130e14454p-58 },
+    { 0x1.9e590c1c7a228p-1, 0x1.b16533a38b570p-3, 0x1.d680b8bfacfc8p-59 },
+    { 0x1.9bbe9e9f34c91p-1, 0x1.be4d8cb4d0662p-3, 0x1.0373ad54a0ab2p-58 },
+    { 0x1.992c837b8be99p-1, 0x1.cb2133be56a3dp-3, -0x1.4ef1f5c32d2dfp-59 },
+    { 0x1.96a29309d67c9p-1, 0x1.d7e06ab3a2c25p-3, 0x1.23c023db441c8p-59 },
+    { 0x1.9420a69cd210dp-1, 0x1.e48b724eeafb9p-3, 0x1.cf3eb9b5029b3p-60 },
+    { 0x1.91a69879f676ap-1, 0x1.f1228a18cb65ap-3, -0x1.75bec5178f06dp-57 },
+    { 0x1.8f3443d211372p-1, 0x1.fda5f06fbe011p-3, -0x1.d3ba4905db3cfp-63 },
+    { 0x1.8cc984ba25cabp-1, 0x1.050af147ac5e4p-2, -0x1.cbf6c618cc399p-60 },
+    { 0x1.8a6638248faa5p-1, 0x1.0b394e4ba9c08p-2, -0x1.9c1f9e095f6cap-57 },
+    { 0x1.880a3bda6379bp-1, 0x1.115e2cc92c26ap-2, -0x1.6666bb21cac30p-56 },
+    { 0x1.85b56e750ca95p-1, 0x1.1779a9be4fa76p-2, -0x1.2d78f8f728fe7p-58 },
+    { 0x1.8367af582510cp-1, 0x1.1d8be1a52c67dp-2, 0x1.147ddea1d4bbep-56 },
+    { 0x1.8120deab841dcp-1, 0x1.2394f076f3618p-2, 0x1.760791395f8d2p-56 },
+    { 0x1.7ee0dd558352dp-1, 0x1.2994f1aef3d0ap-2, 0x1.5e4d6256cfd54p-57 },
+    { 0x1.7ca78cf575ea8p-1, 0x1.2f8c004d8a1a6p-2, 0x1.590ca8dce923ap-57 },
+    { 0x1.7a74cfde518dap-1, 0x1.357a36daf8f5cp-2, -0x1.3b6477d6c3513p-58 },
+    { 0x1.7848891186241p-1, 0x1.3b5faf6a2d950p-2, 0x1.26ecf1489e666p-61 },
+    { 0x1.76229c3a02dd9p-1, 0x1.413c839b6f8adp-2, -0x1.e6471c3e16b15p-56 },
+    { 0x1.7402eda766a7bp-1, 0x1.4710cc9efd18dp-2, -0x1.4d5a4f28ae725p-60 },
+    { 0x1.71e962495a585p-1, 0x1.4cdca33794964p-2, -0x1.938c5cdb44450p-56 },
+    { 0x1.6fd5dfab12e9ep-1, 0x1.52a01fbceb8f3p-2, 0x1.8ac4a85833954p-57 },
+    { 0x1.6dc84beefa396p-1, 0x1.585b5a1e1438dp-2, -0x1.f90c322f56de5p-61 },
+    { 0x1.6bc08dca7cc53p-1, 0x1.5e0e69e3d1d5ap-2, -0x1.77b180c1a7a75p-57 },
+};
+
+#define LOG_OFF   0x3fe6955500000000ULL
+#define LN2_HI    0x1.62e42fefa3800p-1  /* k * hi exact */
+#define LN2_LO    0x1.ef35793c76730p-45
+
+/* log x as hi + lo, to about 2^-68 relative, for finite x > 0 */
+static void log_dd(double x, double *hi, double *lo) {
+    UINT64 ix = asuint64(x);
+    INT64 k = 0;
+    if (ix < 0x0010000000000000ULL) {   /* subnormal */
+        ix = asuint64(x * 0x1p52);
+        k = -52;
+    }
+    /* x = 2^k z with z in [LOG_OFF, 2 LOG_OFF) */
+    UINT64 tmp = ix - LOG_OFF;
+    int i = (int)((tmp >> 45) & 127);
+    k += (INT64)tmp >> 52;
+    double z = asdouble(ix - (tmp & (0xfffULL << 52)));
+
+    /* r = z/c - 1, exactly, as rh + rl */
+    double rh, rl;
+    two_prod(z, s_logc[i].invc, &rh, &rl);
+    rh -= 1.0;
+
+    /* log1p r = r - r^2/2 + r^3 p(r), |r| < 2^-7 */
+    double r2, r2l;
+    two_prod(rh, rh, &r2, &r2l);
+    double p = 0x1.5555555555555p-2 + rh * (-0x1p-2 + rh * (0x1.999999999999ap-3 +
+               rh * (-0x1.5555555555555p-3 + rh * (0x1.2492492492492p-3 +
+               rh * (-0x1p-3 + rh * (0x1.c71c71c71c71cp-4 +
+               rh * (-0x1.999999999999ap-4 + rh * 0x1.745d1745d1746p-4)))))));
+
+    double kd = (double)k, s, e1, e2, e3;
+    two_sum(kd * LN2_HI, s_logc[i].logc_hi, &s, &e1);
+    two_sum(s, rh, &s, &e2);
+    two_sum(s, -0.5 * r2, &s, &e3);
+    double l = e1 + e2 + e3 + kd * LN2_LO + s_logc[i].logc_lo + rl
+             - 0.5 * r2l - rh * rl + r2 * rl + r2 * rh * p;
+    *hi = s + l;
+    *lo = l - (*hi - s);
+}
+
+/* NaN for x < 0, -inf for 0, x itself for inf and NaN; 0 to go on */
+static int log_special(double x, double *out) {
+    UINT64 ix = asuint64(x);
+    if ((ix << 1) == 0) {
+        *out = -1.0 / (x * x);
+        return 1;
+    }
+    if (ix >= 0x7ff0000000000000ULL) {
+        if (ix == 0x7ff0000000000000ULL || (ix << 1) > 0xffe0000000000000ULL)
+            *out = x + x;
+        else
+            *out = (x - x) / (x - x);
+        return 1;
+    }
+    return 0;
+}
+
+double log(double x) {
+    double hi, lo;
+    if (log_special(x, &hi)) return hi;
+    log_dd(x, &hi, &lo);
+    return hi;
+}
+
+/* log x times 1/ln 2 or 1/ln 10, itself as hi + lo */
+static double log_times(double x, double inv_hi, double inv_lo) {
+    double hi, lo, p, e;
+    if (log_special(x, &hi)) return hi;
+    log_dd(x, &hi, &lo);
+    two_prod(hi, inv_hi, &p, &e);
+    return p + (e + hi * inv_lo + lo * inv_hi);
+}
+
+double log2(double x) {
+    return log_times(x, 0x1.71547652b82fep+0, 0x1.777d0ffda0d24p-56);
+}
+
+double log10(double x) {
+    return log_times(x, 0x1.bcb7b1526e50ep-2, 0x1.95355baaafad3p-57);
+}
+
+/* ---- pow ---- */
+
+/* 0 if the double with bits iy is not an integer, 1 if odd, 2 if even */
+static int int_kind(UINT64 iy) {
+    int e = (int)(iy >> 52) & 0x7ff;
+    if (e < 0x3ff) return 0;
+    if (e > 0x3ff + 52) return 2;
+    if (iy & ((1ULL << (0x3ff + 52 - e)) - 1)) return 0;
+    if (iy & (1ULL << (0x3ff + 52 - e))) return 1;
+    return 2;
+}
+
+double pow(double x, double y) {
+    UINT64 ix = asuint64(x), iy = asuint64(y);
+    UINT64 inf = 0x7ff0000000000000ULL;
+    int neg = 0;
+
+    if ((iy << 1) == 0 || ix == 0x3ff0000000000000ULL)
+        return 1.0;
+    if (x != x || y != y)
+        return x + y;
+    if (ix & SIGN_BIT) {
+        int kind = int_kind(iy);
+        if (kind == 0 && (ix << 1) != 0 && (ix << 1) < (inf << 1))
+            return (x - x) / (x - x);   /* negative to a fraction */
+        neg = kind == 1;
+        ix &= ~SIGN_BIT;
+        x = asdouble(ix);
+    }
+    UINT64 sign = neg ? SIGN_BIT : 0;
+    if (ix == 0x3ff0000000000000ULL)    /* -1 to an integer */
+        return neg ? -1.0 : 1.0;
+    if ((iy << 1) == (inf << 1)) {      /* y = +-inf */
+        if (ix == 0x3ff0000000000000ULL) return 1.0;
+        return (ix < 0x3ff0000000000000ULL) == (y > 0) ? 0.0 : asdouble(inf);
+    }
+    if (ix == 0)
+        return asdouble(sign | (y < 0 ? inf : 0));
+    if (ix == inf)
+        return asdouble(sign | (y < 0 ? 0 : inf));
+    /* |y log x| past 2^11 when |x| != 1: certain over- or underflow,
+       and y too big to split */
+    if ((TOP12(y) & 0x7ff) >= 0x3ff + 64)
+        return asdouble(sign | ((ix < 0x3ff0000000000000ULL) == (y > 0) ? 0 : inf));
+
+    double lh, ll, eh, el;
+    log_dd(x, &lh, &ll);
+    two_prod(y, lh, &eh, &el);
+    el += y * ll;
+    double hi = eh + el, lo = el - (hi - eh);
+    double r;
+    if (hi > 710.0)
+        r = asdouble(inf);
+    else if (hi < -746.0)
+        r = 0.0;
+    else
+        r = exp_dd(hi, lo);
+    return neg ? -r : r;
+}
+
+/* ---- sin, cos, tan ---- */
+
+/* fdlibm's kernels: sin and cos of x + y for |x + y| <= pi/4, y the
+   tail of a reduced argument (iy says whether there is one) */
+static double k_sin(double x, double y, int iy) {
+    const double S1 = -1.66666666666666324348e-01, S2 = 8.33333333332248946124e-03,
+                 S3 = -1.98412698298579493134e-04, S4 = 2.75573137070700676789e-06,
+                 S5 = -2.50507602534068634195e-08, S6 = 1.58969099521155010221e-10;
+    double z = x * x, w = z * z;
+    double r = S2 + z * (S3 + z * S4) + z * w * (S5 + z * S6);
+    double v = z * x;
+    if (!iy) return x + v * (S1 + z * r);
+    return x - ((z * (0.5 * y - v * r) - y) - v * S1);
+}
+
+static double k_cos(double x, double y) {
+    const double C1 = 4.16666666666666019037e-02, C2 = -1.38888888888741095749e-03,
+                 C3 = 2.48015872894767294178e-05, C4 = -2.75573143513906633035e-07,
+                 C5 = 2.08757232129817482790e-09, C6 = -1.13596475577881948265e-11;
+    double z = x * x, w = z * z;
+    double r = z * (C1 + z * (C2 + z * C3)) + w * w * (C4 + z * (C5 + z * C6));
+    double hz = 0.5 * z;
+    w = 1.0 - hz;
+    return w + (((1.0 - w) - hz) + (z * r - x * y));
+}
+
+/* 2/pi from the first bit after the point, far enough for the
+   largest double */
+static const UINT32 s_2opi[40] = {
+    0xA2F9836E, 0x4E441529, 0xFC2757D1, 0xF534DDC0, 0xDB629599, 0x3C439041,
+    0xFE5163AB, 0xDEBBC561, 0xB7246E3A, 0x424DD2E0, 0x06492EEA, 0x09D1921C,
+    0xFE1DEB1C, 0xB129A73E, 0xE88235F5, 0x2EBB4484, 0xE99C7026, 0xB45F7E41,
+    0x3991D639, 0x835339F4, 0x9C845F8B, 0xBDF9283B, 0x1FF897FF, 0xDE05980F,
+    0xEF2F118B, 0x5A0A6D1F, 0x6D367ECF, 0x27CB09B7, 0x4F463F66, 0x9E5FEA2D,
+    0x7527BAC7, 0xEBE5F17B, 0x3D0739F7, 0x8A5292EA, 0x6BFB5FB1, 0x1F8D5D08,
+    0x56033046, 0xFC7B6BAB, 0xF0CFBC20, 0x9AF4361D,
+};
+
+#define PIO2_HI 0x1.921fb54442d18p+0
+#define PIO2_LO 0x1.1a62633145c07p-54
+
+/* The 32 bits of 2/pi from bit pos on (bit 1 is the first after the
+   point, bits at 0 and above are all 0) */
+static UINT32 opi_bits(int pos) {
+    if (pos <= 0) {
+        if (pos <= -31) return 0;
+        return s_2opi[0] >> (1 - pos);
+    }
+    int w = (pos - 1) >> 5, off = (pos - 1) & 31;
+    UINT32 v = s_2opi[w] << off;
+    if (off) v |= s_2opi[w + 1] >> (32 - off);
+    return v;
+}
+
+/* Payne-Hanek for |x| >= 2^20 pi/2: with |x| = m 2^e, only 192 bits of
+   2/pi from bit e-1 on matter to x 2/pi mod 4, the bits before making
+   multiples of 4 and those after less than 2^-136. */
+static int rem_pio2_large(double x, double *y) {
+    UINT64 ix = asuint64(x);
+    int e = (int)((ix >> 52) & 0x7ff) - 1075;
+    UINT64 m = (ix & 0x000fffffffffffffULL) | (1ULL << 52);
+    UINT32 mw[2] = { (UINT32)m, (UINT32)(m >> 32) };
+    UINT32 w[6], p[8] = { 0 };
+    for (int k = 0; k < 6; k++)         /* little-endian window */
+        w[k] = opi_bits(e - 1 + 32 * (5 - k));
+    for (int a = 0; a < 2; a++) {
+        UINT64 c = 0;
+        for (int b = 0; b < 6; b++) {
+            UINT64 t = (UINT64)mw[a] * w[b] + p[a + b] + c;
+            p[a + b] = (UINT32)t;
+            c = t >> 32;
+        }
+        p[a + 6] += (UINT32)c;
+    }
+    /* m w = x 2/pi 2^190: bits 190-191 are the quadrant, those below
+       the fraction, taken to [-1/2, 1/2) */
+    int n = (int)(p[5] >> 30);
+    UINT64 q[3] = {
+        p[0] | (UINT64)p[1] << 32,
+        p[2] | (UINT64)p[3] << 32,
+        (p[4] | (UINT64)p[5] << 32) & ((1ULL << 62) - 1),
+    };
+    int fneg = (int)(q[2] >> 61) & 1;
+    if (fneg) {
+        n++;
+        q[0] = ~q[0] + 1;
+        q[1] = ~q[1] + (q[0] == 0);
+        q[2] = (~q[2] + (q[0] == 0 && q[1] == 0)) & ((1ULL << 62) - 1);
+    }
+    /* Bring the top bit to 189 */
+    int sh = 0;
+    while (q[2] == 0 && sh < 128) {
+        q[2] = q[1] >> 2;
+        q[1] = q[1] << 62 | q[0] >> 2;
+        q[0] <<= 62;
+        sh += 62;
+    }
+    while (!(q[2] >> 61)) {
+        q[2] = q[2] << 1 | q[1] >> 63;
+        q[1] = q[1] << 1 | q[0] >> 63;
+        q[0] <<= 1;
+        sh++;
+    }
+    double fh = (double)(INT64)(q[2] >> 9);
+    double fl = (double)(INT64)(((q[2] & 0x1ff) << 44) | q[1] >> 20);
+    fh *= asdouble((UINT64)(0x3ff - 53 - sh) << 52);
+    fl *= asdouble((UINT64)(0x3ff - 106 - sh) << 52);
+    double ph, pl;
+    two_prod(fh, PIO2_HI, &ph, &pl);
+    pl += fh * PIO2_LO + fl * PIO2_HI;
+    y[0] = ph + pl;
+    y[1] = pl - (y[0] - ph);
+    if (fneg) {
+        y[0] = -y[0];
+        y[1] = -y[1];
+    }
+    if (ix & SIGN_BIT) {
+        y[0] = -y[0];
+        y[1] = -y[1];
+        n = -n;
+    }
+    return n;
+}
+
+/* x - n pi/2 as y[0] + y[1], returning n; fdlibm's three-step
+   Cody-Waite below 2^20 pi/2 */
+static int rem_pio2(double x, double *y) {
+    const double invpio2 = 0x1.45f306dc9c883p-1,
+                 pio2_1 = 0x1.921fb54400000p+0, pio2_1t = 0x1.0b4611a626331p-34,
+                 pio2_2 = 0x1.0b4611a600000p-34, pio2_2t = 0x1.3198a2e037073p-69,
+                 pio2_3 = 0x1.3198a2e000000p-69, pio2_3t = 0x1.b839a252049c1p-104;
+    UINT32 ix = (UINT32)(asuint64(x) >> 32) & 0x7fffffff;
+    if (ix >= 0x413921fb)
+        return rem_pio2_large(x, y);
+    double fn = x * invpio2 + EXP_SHIFT;
+    fn -= EXP_SHIFT;
+    int n = (int)fn;
+    double r = x - fn * pio2_1, w = fn * pio2_1t, t;
+    y[0] = r - w;
+    int ex = (int)(ix >> 20), ey = (int)(TOP12(y[0]) & 0x7ff);
+    if (ex - ey > 16) {
+        t = r;
+        w = fn * pio2_2;
+        r = t - w;
+        w = fn * pio2_2t - ((t - r) - w);
+        y[0] = r - w;
+        ey = (int)(TOP12(y[0]) & 0x7ff);
+        if (ex - ey > 49) {
+            t = r;
+            w = fn * pio2_3;
+            r = t - w;
+            w = fn * pio2_3t - ((t - r) - w);
+            y[0] = r - w;
+        }
+    }
+    y[1] = (r - y[0]) - w;
+    return n;
+}
+
+double sin(double x) {
+    UINT32 ix = (UINT32)(asuint64(x) >> 32) & 0x7fffffff;
+    double y[2];
+    if (ix <= 0x3fe921fb) {             /* |x| about pi/4 or less */
+        if (ix < 0x3e500000) return x;  /* |x| < 2^-26 */
+        return k_sin(x, 0.0, 0);
+    }
+    if (ix >= 0x7ff00000) return x - x;
+    switch (rem_pio2(x, y) & 3) {
+    case 0:  return k_sin(y[0], y[1], 1);
+    case 1:  return k_cos(y[0], y[1]);
+    case 2:  return -k_sin(y[0], y[1], 1);
+    default: return -k_cos(y[0], y[1]);
+    }
+}
+
+double cos(double x) {
+    UINT32 ix = (UINT32)(asuint64(x) >> 32) & 0x7fffffff;
+    double y[2];
+    if (ix <= 0x3fe921fb) {
+        if (ix < 0x3e46a09e) return 1.0;    /* |x| < 2^-27 sqrt 2 */
+        return k_cos(x, 0.0);
+    }
+    if (ix >= 0x7ff00000) return x - x;
+    switch (rem_pio2(x, y) & 3) {
+    case 0:  return k_cos(y[0], y[1]);
+    case 1:  return -k_sin(y[0], y[1], 1);
+    case 2:  return -k_cos(y[0], y[1]);
+    default: return k_sin(y[0], y[1], 1);
+    }
+}
+
+/* The quotient of the two kernels: within 2.5 ulp */
+double tan(double x) {
+    UINT32 ix = (UINT32)(asuint64(x) >> 32) & 0x7fffffff;
+    double y[2];
+    if (ix <= 0x3fe921fb) {
+        if (ix < 0x3e400000) return x;  /* |x| < 2^-27 */
+        return k_sin(x, 0.0, 0) / k_cos(x, 0.0);
+    }
+    if (ix >= 0x7ff00000) return x - x;
+    if (rem_pio2(x, y) & 1)
+        return -k_cos(y[0], y[1]) / k_sin(y[0], y[1], 1);
+    return k_sin(y[0], y[1], 1) / k_cos(y[0], y[1]);
+}
+
+/* ---- atan, atan2, asin, acos ---- */
+
+/* atan(j/64) for j = 0..64 */
+static const struct { double hi, lo; } s_atanj[65] = {
+    { 0x0p+0, 0x0p+0 },
+    { 0x1.fff555bbb729bp-7, -0x1.220c39d4dff50p-61 },
+    { 0x1.ffd55bba97625p-6, -0x1.5ec431444912cp-60 },
+    { 0x1.7fb818430da2ap-5, -0x1.86ef8f794f105p-63 },
+    { 0x1.ff55bb72cfdeap-5, -0x1.c934d86d23f1dp-60 },
+    { 0x1.3f59f0e7c559dp-4, 0x1.ac4ce285df847p-58 },
+    { 0x1.7ee182602f10fp-4, -0x1.cfb654c0c3d98p-58 },
+    { 0x1.be39ebe6f07c3p-4, 0x1.f7b8f29a05987p-58 },
+    { 0x1.fd5ba9aac2f6ep-4, -0x1.cd37686760c17p-59 },
+    { 0x1.1e1fafb043727p-3, -0x1.b485914dacf8cp-59 },
+    { 0x1.3d6eee8c6626cp-3, 0x1.61a3b0ce9281bp-57 },
+    { 0x1.5c9811e3ec26ap-3, -0x1.054ab2c010f3dp-58 },
+    { 0x1.7b97b4bce5b02p-3, 0x1.347b0b4f881cap-58 },
+    { 0x1.9a6a8e96c8626p-3, 0x1.cf601e7b4348ep-59 },
+    { 0x1.b90d7529260a2p-3, 0x1.17b10d2e0e5abp-61 },
+    { 0x1.d77d5df205736p-3, 0x1.c648d1534597ep-57 },
+    { 0x1.f5b75f92c80ddp-3, 0x1.8ab6e3cf7afbdp-57 },
+    { 0x1.09dc597d86362p-2, 0x1.62e47390cb865p-56 },
+    { 0x1.18bf5a30bf178p-2, 0x1.30ca4748b1bf9p-57 },
+    { 0x1.278372057ef46p-2, -0x1.077cdd36dfc81p-56 },
+    { 0x1.362773707ebccp-2, -0x1.963a544b672d8p-57 },
+    { 0x1.44aa436c2af0ap-2, -0x1.5d5e43c55b3bap-56 },
+    { 0x1.530ad9951cd4ap-2, -0x1.2566480884082p-57 },
+    { 0x1.614840309cfe2p-2, -0x1.a725715711f00p-56 },
+    { 0x1.6f61941e4def1p-2, -0x1.c63aae6f6e918p-56 },
+    { 0x1.7d5604b63b3f7p-2, 0x1.69c885c2b249ap-56 },
+    { 0x1.8b24d394a1b25p-2, 0x1.b6d0ba3748fa8p-56 },
+    { 0x1.98cd5454d6b18p-2, 0x1.9e6c988fd0a77p-56 },
+    { 0x1.a64eec3cc23fdp-2, -0x1.24dec1b50b7ffp-56 },
+    { 0x1.b3a911da65c6cp-2, 0x1.ae187b1ca5040p-56 },
+    { 0x1.c0db4c94ec9f0p-2, -0x1.cc1ce70934c34p-56 },
+    { 0x1.cde53432c1351p-2, -0x1.a2cfa4418f1adp-56 },
+    { 0x1.dac670561bb4fp-2, 0x1.a2b7f222f65e2p-56 },
+    { 0x1.e77eb7f175a34p-2, 0x1.0e53dc1bf3435p-56 },
+    { 0x1.f40dd0b541418p-2, -0x1.a3992dc382a23p-57 },
+    { 0x1.0039c73c1a40cp-1, -0x1.b32c949c9d593p-55 },
+    { 0x1.0657e94db30d0p-1, -0x1.d5b495f6349e6p-56 },
+    { 0x1.0c6145b5b43dap-1, 0x1.974fa13b5404fp-58 },
+    { 0x1.1255d9bfbd2a9p-1, -0x1.2bdaee1c0ee35p-58 },
+    { 0x1.1835a88be7c13p-1, 0x1.c621cec00c301p-55 },
+    { 0x1.1e00babdefeb4p-1, -0x1.928df287a668fp-58 },
+    { 0x1.23b71e2cc9e6ap-1, 0x1.c421c9f38224ep-57 },
+    { 0x1.2958e59308e31p-1, -0x1.09e73b0c6c087p-56 },
+    { 0x1.2ee628406cbcap-1, 0x1.c5d5e9ff0cf8dp-55 },
+    { 0x1.345f01cce37bbp-1, 0x1.1021137c71102p-55 },
+    { 0x1.39c391cd4171ap-1, -0x1.2304331d8bf46p-55 },
+    { 0x1.3f13fb89e96f4p-1, 0x1.ecf8b492644f0p-56 },
+    { 0x1.445065b795b56p-1, -0x1.f76d0163f79c8p-56 },
+    { 0x1.4978fa3269ee1p-1, 0x1.2419a87f2a458p-56 },
+    { 0x1.4e8de5bb6ec04p-1, 0x1.4a33dbeb3796cp-55 },
+    { 0x1.538f57b89061fp-1, -0x1.1bb74abda520cp-55 },
+    { 0x1.587d81f732fbbp-1, -0x1.5e5c9d8c5a950p-56 },
+    { 0x1.5d58987169b18p-1, 0x1.0028e4bc5e7cap-57 },
+    { 0x1.6220d115d7b8ep-1, -0x1.2b785350ee8c1p-57 },
+    { 0x1.66d663923e087p-1, -0x1.6ea6febe8bbbap-56 },
+    { 0x1.6b798920b3d99p-1, -0x1.a80386188c50ep-55 },
+    { 0x1.700a7c5784634p-1, -0x1.8c34d25aadef6p-56 },
+    { 0x1.748978fba8e0fp-1, 0x1.7b2a6165884a1p-59 },
+    { 0x1.78f6bbd5d315ep-1, 0x1.406a089803740p-55 },
+    { 0x1.7d528289fa093p-1, 0x1.560821e2f3aa9p-55 },
+    { 0x1.819d0b7158a4dp-1, -0x1.bf76229d3b917p-56 },
+    { 0x1.85d69576cc2c5p-1, 0x1.6b66e7fc8b8c3p-57 },
+    { 0x1.89ff5ff57f1f8p-1, -0x1.55b9a5e177a1bp-55 },
+    { 0x1.8e17aa99cc05ep-1, -0x1.ec182ab042f61p-56 },
+    { 0x1.921fb54442d18p-1, 0x1.1a62633145c07p-55 },
+};
+
+/* atan(t + tl) as hi + lo for 0 <= t <= 1: from the nearest j/64 by
+   atan t = atan c + atan((t - c) / (1 + t c)) */
+static void atan_dd(double t, double tl, double *hi, double *lo) {
+    int j = (int)(t * 64 + 0.5);
+    double c = j * 0x1p-6;
+    double num = t - c;                 /* exact */
+    double ph, pl, d, dl, u, qh, ql;
+    two_prod(t, c, &ph, &pl);
+    d = 1.0 + ph;
+    dl = ((1.0 - d) + ph) + pl;
+    u = num / d;
+    two_prod(u, d, &qh, &ql);
+    double ul = ((num - qh) - ql - u * dl) / d;
+    double u2 = u * u;
+    double poly = u2 * u * (-0x1.5555555555555p-2 + u2 * (0x1.999999999999ap-3 +
+                  u2 * (-0x1.2492492492492p-3 + u2 * (0x1.c71c71c71c71cp-4 +
+                  u2 * -0x1.745d1745d1746p-4))));
+    double s, e;
+    two_sum(s_atanj[j].hi, u, &s, &e);
+    double l = e + s_atanj[j].lo + ul + poly + tl / (1.0 + t * t);
+    *hi = s + l;
+    *lo = l - (*hi - s);
+}
+
+/* atan(a/b) for finite a, b > 0 */
+static void atan_ratio(double a, double b, double *hi, double *lo) {
+    int swap = a > b;
+    if (swap) {
+        double t = a;
+        a = b;
+        b = t;
+    }
+    int ea = (int)(TOP12(a) & 0x7ff), eb = (int)(TOP12(b) & 0x7ff);
+    double q, ql = 0;
+    if (eb - ea > 60) {
+        q = a / b;                      /* atan q = q to the last bit */
+    } else {
+        /* Scale b to [1, 2) so the product can be split */
+        int sb;
+        frexp(b, &sb);
+        a = ldexp(a, 1 - sb);
+        b = ldexp(b, 1 - sb);
+        double p, pe;
+        q = a / b;
+        two_prod(q, b, &p, &pe);
+        ql = ((a - p) - pe) / b;
+    }
+    atan_dd(q, ql, hi, lo);
+    if (swap) {                         /* pi/2 - atan(b/a) */
+        double s, e;
+        two_sum(PIO2_HI, -*hi, &s, &e);
+        e += PIO2_LO - *lo;
+        *hi = s + e;
+        *lo = e - (*hi - s);
+    }
+}
+
+/* Within 1 ulp */
+double atan(double x) {
+    UINT64 ix = asuint64(x);
+    UINT32 top = TOP12(x) & 0x7ff;
+    double hi, lo;
+    if (top >= 0x3ff + 66) {            /* |x| >= 2^66, inf or NaN */
+        if (x != x) return x + x;
+        return asdouble((ix & SIGN_BIT) | asuint64(PIO2_HI));
+    }
+    if (top < 0x3ff - 27) return x;
+    atan_ratio(fabs(x), 1.0, &hi, &lo);
+    return (ix & SIGN_BIT) ? -hi : hi;
+}
+
+/* Within 1 ulp */
+double atan2(double y, double x) {
+    UINT64 ix = asuint64(x), iy = asuint64(y);
+    UINT64 ysign = iy & SIGN_BIT;
+    UINT64 inf = 0x7ff0000000000000ULL;
+    double hi, lo;
+
+    if (x != x || y != y) return x + y;
+    ix &= ~SIGN_BIT;
+    iy &= ~SIGN_BIT;
+    if (iy == 0 || (ix == inf && iy != inf)) {
+        if (!(asuint64(x) & SIGN_BIT)) return asdouble(ysign);       /* +-0 */
+        hi = 2 * PIO2_HI;                                            /* +-pi */
+        return ysign ? -hi : hi;
+    }
+    if (ix == 0 || iy == inf) {
+        if (ix == inf)                  /* both infinite: +-pi/4, +-3pi/4 */
+            hi = (asuint64(x) & SIGN_BIT) ? 3 * 0x1.921fb54442d18p-1
+                                          : 0x1.921fb54442d18p-1;
+        else
+            hi = PIO2_HI;
+        return ysign ? -hi : hi;
+    }
+    atan_ratio(asdouble(iy), asdouble(ix), &hi, &lo);
+    if (asuint64(x) & SIGN_BIT) {       /* pi - atan */
+        double s, e;
+        two_sum(2 * PIO2_HI, -hi, &s, &e);
+        e += 2 * PIO2_LO - lo;
+        hi = s + e;
+    }
+    return ysign ? -hi : hi;
+}
+
+/* Within 2 ulp, as atan2 of x and sqrt(1 - x^2) */
+double asin(double x) {
+    double a = fabs(x);
+    if (a > 1 || x != x) return (x - x) / (x - x);
+    if (a < 0x1p-26) return x;
+    return atan2(x, sqrt((1 - a) * (1 + a)));
+}
+
+double acos(double x) {
+    double a = fabs(x);
+    if (a > 1 || x != x) return (x - x) / (x - x);
+    if (x == 1) return 0.0;
+    return atan2(sqrt((1 - a) * (1 + a)), x);
+}
+
+/* ---- float ----
+ * Through double, whose results are close enough that rounding them
+ * to float is right but for the rarest halfway cases */
+
+float fabsf(float x) { return (float)fabs(x); }
+float truncf(float x) { return (float)trunc(x); }
+float floorf(float x) { return (float)floor(x); }
+float ceilf(float x) { return (float)ceil(x); }
+float roundf(float x) { return (float)round(x); }
+float fmodf(float x, float y) { return (float)fmod(x, y); }
+float expf(float x) { return (float)exp(x); }
+float exp2f(float x) { return (float)exp2(x); }
+float logf(float x) { return (float)log(x); }
+float log2f(float x) { return (float)log2(x); }
+float log10f(float x) { return (float)log10(x); }
+float powf(float x, float y) { return (float)pow(x, y); }
+float sinf(float x) { return (float)sin(x); }
+float cosf(float x) { return (float)cos(x); }
+float tanf(float x) { return (float)tan(x); }
+float atanf(float x) { return (float)atan(x); }
+float atan2f(float y, float x) { return (float)atan2(y, x); }
+float asinf(float x) { return (float)asin(x); }
+float acosf(float x) { return (float)acos(x); }
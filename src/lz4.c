@@ -0,0 +1,145 @@
+/*
+ * lz4.c — LZ4 block compression
+ *
+ * A block is a run of sequences: a token (literal count in the high
+ * nibble, match length - 4 in the low one, 15 meaning "more bytes
+ * follow, each adding up to 255"), the literals, a 16-bit little-endian
+ * offset back into the output and the match length's extra bytes. The
+ * last sequence is literals only. The format requires the last 5 bytes
+ * to be literals and no match to start within 12 bytes of the end.
+ */
+
+#include "lz4.h"
+#include "mem.h"
+
+#define HASH_LOG     12
+#define MIN_MATCH    4
+#define LAST_LITERALS 5
+#define MF_LIMIT     12
+#define MAX_OFFSET   65535
+#define SKIP_SHIFT   6      /* search faster through data that never matches */
+
+static UINT32 rd32(const UINT8 *p) {
+    return (UINT32)p[0] | (UINT32)p[1] << 8 | (UINT32)p[2] << 16 |
+           (UINT32)p[3] << 24;
+}
+
+static UINT32 hash4(UINT32 v) {
+    return (v * 2654435761u) >> (32 - HASH_LOG);
+}
+
+/* Append a length's continuation bytes (the part past 15) */
+static UINT8 *put_len(UINT8 *op, UINTN len) {
+    while (len >= 255) { *op++ = 255; len -= 255; }
+    *op++ = (UINT8)len;
+    return op;
+}
+
+/* Bytes a sequence with lit literals needs at most, without its match */
+static UINTN seq_bound(UINTN lit) {
+    return 1 + lit / 255 + 1 + lit + 2;
+}
+
+UINTN lz4_compress(const void *src, UINTN size, void *dst, UINTN cap,
+                   void *scratch) {
+    const UINT8 *base = (const UINT8 *)src;
+    const UINT8 *ip = base, *anchor = base, *iend = base + size;
+    UINT8 *op = (UINT8 *)dst, *oend = op + cap;
+    UINT32 *table = (UINT32 *)scratch;
+
+    if (size > MF_LIMIT) {
+        const UINT8 *mflimit = iend - MF_LIMIT;
+        const UINT8 *matchlimit = iend - LAST_LITERALS;
+        mem_set(table, 0, LZ4_SCRATCH);
+        while (ip < mflimit) {
+            UINT32 seq = rd32(ip);
+            UINT32 h = hash4(seq);
+            const UINT8 *ref = base + table[h];
+            table[h] = (UINT32)(ip - base);
+            if (ref >= ip || ip - ref > MAX_OFFSET || rd32(ref) != seq) {
+                ip += 1 + ((UINTN)(ip - anchor) >> SKIP_SHIFT);
+                continue;
+            }
+
+            /* Extend back over literals, then forward */
+            while (ip > anchor && ref > base && ip[-1] == ref[-1]) { ip--; ref--; }
+            const UINT8 *mp = ip + MIN_MATCH, *rp = ref + MIN_MATCH;
+            while (mp < matchlimit && *mp == *rp) { mp++; rp++; }
+
+            UINTN lit = (UINTN)(ip - anchor);
+            UINTN mlen = (UINTN)(mp - ip) - MIN_MATCH;
+            if ((UINTN)(oend - op) < seq_bound(lit) + mlen / 255 + 1) return 0;
+
+            UINT8 *token = op++;
+            *token = (UINT8)((lit >= 15 ? 15 : lit) << 4);
+            if (lit >= 15) op = put_len(op, lit - 15);
+            mem_copy(op, anchor, lit);
+            op += lit;
+            UINTN off = (UINTN)(ip - ref);
+            *op++ = (UINT8)off;
+            *op++ = (UINT8)(off >> 8);
+            *token |= (UINT8)(mlen >= 15 ? 15 : mlen);
+            if (mlen >= 15) op = put_len(op, mlen - 15);
+
+            ip = mp;
+            anchor = ip;
+            if (ip < mflimit) table[hash4(rd32(ip - 2))] = (UINT32)(ip - 2 - base);
+        }
+    }
+
+    /* The rest as literals */
+    UINTN lit = (UINTN)(iend - anchor);
+    if ((UINTN)(oend - op) < seq_bound(lit) - 2) return 0;
+    *op++ = (UINT8)((lit >= 15 ? 15 : lit) << 4);
+    if (lit >= 15) op = put_len(op, lit - 15);
+    mem_copy(op, anchor, lit);
+    op += lit;
+    return (UINTN)(op - (UINT8 *)dst);
+}
+
+/* Read a length's continuation bytes; -1 past the end of the block */
+static INTN get_len(const UINT8 **ip, const UINT8 *iend, UINTN len) {
+    UINT8 b;
+    do {
+        if (*ip >= iend) return -1;
+        b = *(*ip)++;
+        len += b;
+    } while (b == 255);
+    return (INTN)len;
+}
+
+INTN lz4_decompress(const void *src, UINTN size, void *dst, UINTN cap) {
+    const UINT8 *ip = (const UINT8 *)src, *iend = ip + size;
+    UINT8 *op = (UINT8 *)dst, *oend = op + cap;
+
+    while (ip < iend) {
+        UINT8 token = *ip++;
+        INTN lit = token >> 4;
+        if (lit == 15 && (lit = get_len(&ip, iend, 15)) < 0) return -1;
+        if ((UINTN)lit > (UINTN)(iend - ip) || (UINTN)lit > (UINTN)(oend - op))
+            return -1;
+        mem_copy(op, ip, (UINTN)lit);
+        ip += lit;
+        op += lit;
+        if (ip == iend) break;      /* the last sequence has no match */
+
+        if (iend - ip < 2) return -1;
+        UINTN off = (UINTN)ip[0] | (UINTN)ip[1] << 8;
+        ip += 2;
+        if (off == 0 || off > (UINTN)(op - (UINT8 *)dst)) return -1;
+        INTN mlen = token & 15;
+        if (mlen == 15 && (mlen = get_len(&ip, iend, 15)) < 0) return -1;
+        mlen += MIN_MATCH;
+        if ((UINTN)mlen > (UINTN)(oend - op)) return -1;
+
+        /* Overlapping copies repeat the last off bytes */
+        const UINT8 *match = op - off;
+        if (off >= (UINTN)mlen) {
+            mem_copy(op, match, (UINTN)mlen);
+            op += mlen;
+        } else {
+            while (mlen-- > 0) *op++ = *match++;
+        }
+    }
+    return (INTN)(op - (UINT8 *)dst);
+}
@@ -0,0 +1,27 @@
+/*
+ * lz4.h — LZ4 block compression
+ *
+ * The standard LZ4 block format (no frame header), so data written here
+ * can be unpacked by any LZ4 implementation.  The compressor is the
+ * single-pass greedy hash search: a few hundred MB/s, enough to keep up
+ * with USB devices while halving typical disk contents.
+ */
+#ifndef LZ4_H
+#define LZ4_H
+
+#include "boot.h"
+
+/* Scratch the compressor needs, in bytes */
+#define LZ4_SCRATCH (4096 * sizeof(UINT32))
+
+/* Compress size bytes of src into at most cap bytes of dst. scratch
+   holds LZ4_SCRATCH bytes. Returns the compressed length, or 0 if it
+   would not fit in cap. */
+UINTN lz4_compress(const void *src, UINTN size, void *dst, UINTN cap,
+                   void *scratch);
+
+/* Unpack size bytes of a block into at most cap bytes of dst. Returns
+   the unpacked length, or -1 if the block is malformed or too big. */
+INTN lz4_decompress(const void *src, UINTN size, void *dst, UINTN cap);
+
+#endif /* LZ4_H */
@@ -2,9 +2,15 @@
 #include "fb.h"
 #include "kbd.h"
 #include "mem.h"
+#include "cpu.h"
 #include "fs.h"
 #include "browse.h"
 #include "tcc.h"
+#include "mp.h"
+#include "trace.h"
+#include "timer.h"
+#include "event.h"
+#include "serial.h"
 
 /* Global boot state */
 struct boot_state g_boot;
@@ -38,40 +44,6 @@ static void con_print_ascii(const char *s) {
     }
 }
 
-/* Get total system memory in MB via UEFI memory map */
-static UINT32 get_total_memory_mb(void) {
-    UINTN map_size = 0, map_key, desc_size;
-    UINT32 desc_ver;
-
-    g_boot.bs->GetMemoryMap(&map_size, NULL, &map_key, &desc_size, &desc_ver);
-    map_size += 2 * desc_size;
-
-    EFI_MEMORY_DESCRIPTOR *map = (EFI_MEMORY_DESCRIPTOR *)mem_alloc(map_size);
-    if (!map) return 0;
-
-    EFI_STATUS status = g_boot.bs->GetMemoryMap(
-        &map_size, map, &map_key, &desc_size, &desc_ver);
-    if (EFI_ERROR(status)) {
-        mem_free(map);
-        return 0;
-    }
-
-    UINT64 total_pages = 0;
-    UINT8 *ptr = (UINT8 *)map;
-    UINT8 *end = ptr + map_size;
-    while (ptr < end) {
-        EFI_MEMORY_DESCRIPTOR *desc = (EFI_MEMORY_DESCRIPTOR *)ptr;
-        UINT32 t = desc->Type;
-        if ((t >= EfiLoaderCode && t <= EfiConventionalMemory) ||
-            t == EfiACPIReclaimMemory)
-            total_pages += desc->NumberOfPages;
-        ptr += desc_size;
-    }
-
-    mem_free(map);
-    return (UINT32)((total_pages * 4096) / (1024 * 1024));
-}
-
 static void print_banner_fb(void) {
     char res[64];
     char num[16];
@@ -89,6 +61,19 @@ static void print_banner_fb(void) {
     fb_print("  Platform: x86_64\n", COLOR_WHITE);
 #endif
 
+    /* Processor and the features the kernels were picked by */
+    char feat[96];
+    const struct cpu_info *cpu = cpu_get();
+    if (cpu->name[0]) {
+        fb_print("  CPU:      ", COLOR_GRAY);
+        fb_print(cpu->name, COLOR_GRAY);
+        fb_print("\n", COLOR_GRAY);
+    }
+    cpu_feature_names(feat, sizeof(feat));
+    fb_print("  Features: ", COLOR_GRAY);
+    fb_print(feat[0] ? feat : "none (portable C)", COLOR_GRAY);
+    fb_print("\n", COLOR_GRAY);
+
     /* Display resolution */
     uint_to_str(g_boot.fb_width, num);
     for (int j = 0; num[j]; j++) res[i++] = num[j];
@@ -123,7 +108,7 @@ static void print_banner_fb(void) {
     }
 
     /* Memory info */
-    UINT32 mem_mb = get_total_memory_mb();
+    UINT32 mem_mb = mem_total_mb();
     if (mem_mb > 0) {
         fb_print("  Memory:   ", COLOR_GRAY);
         uint_to_str(mem_mb, num); fb_print(num, COLOR_GRAY);
@@ -164,7 +149,7 @@ static void print_banner_console(void) {
     }
 
     /* Memory info */
-    UINT32 mem_mb = get_total_memory_mb();
+    UINT32 mem_mb = mem_total_mb();
     if (mem_mb > 0) {
         con_print_ascii("  Memory:   ");
         uint_to_str(mem_mb, num); con_print_ascii(num);
@@ -214,8 +199,10 @@ static void tcc_selftest(int use_fb) {
     else
         con_print(L"  TCC self-test: ");
 
+    /* Always compile, never rerun the image cached by the other pass */
+    tcc_cache_purge();
     struct tcc_result r = tcc_run_source(
-        "int main(void) { return 42; }\n", "selftest.c");
+        "int main(void) { return 42; }\n", "selftest.c", 0);
 
     if (r.success && r.exit_code == 42) {
         if (use_fb)
@@ -249,15 +236,28 @@ static void tcc_selftest(int use_fb) {
     }
 }
 
+/* The self-test is not needed to reach the browser: it runs while the
+   banner waits for a key, and not at all if a key comes first */
+static struct ev_handler s_selftest_idle;
+
+static int selftest_idle(void *arg) {
+    (void)arg;
+    ev_remove(&s_selftest_idle);
+    tcc_selftest(1);
+    fb_present();
+    return 0;
+}
+
 /* Framebuffer main loop */
 static void fb_loop(void) {
     print_banner_fb();
+    boot_phase("banner");
 
-    /* Run compiler self-test */
-    tcc_selftest(1);
-
+    ev_add_idle(&s_selftest_idle, EV_PRIO_LOW, selftest_idle, NULL);
     struct key_event ev;
     kbd_wait(&ev);
+    ev_remove(&s_selftest_idle);
+    boot_phase("key wait");
 
     browse_run();
 }
@@ -271,22 +271,62 @@ EFI_STATUS efi_main(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE *st) {
     g_boot.st = st;
     g_boot.bs = st->BootServices;
     g_boot.rs = st->RuntimeServices;
+    if (efistub_ticks[0]) {
+        /* Loaded packed: the firmware read the stub, which unpacked us */
+        boot_phase_at("firmware", efistub_ticks[0]);
+        boot_phase_at("unpack", efistub_ticks[1]);
+    } else {
+        boot_phase("firmware");
+    }
 
     /* Disable watchdog timer */
     g_boot.bs->SetWatchdogTimer(0, 0, 0, NULL);
 
     con_print(L"SURVIVAL WORKSTATION: Booting...\r\n");
 
-    /* Initialize subsystems */
+    /* Initialize subsystems; the kernels are picked from the CPU's */
+    cpu_init();
     mem_init();
+    trace_ring_init();
+    boot_phase("memory");
+    mp_init();
+    boot_phase("processors");
     fs_init();
+    trace_init();
+    trace_mark("boot", 0, 0, NULL);
+    boot_phase("filesystem");
+
+    /* Slow boot media (SD cards on ARM boards): serve it from memory */
+    if (fs_exists(FS_PRELOAD_FLAG)) {
+        UINT32 files;
+        UINT64 bytes;
+        char num[16];
+        con_print(L"Preloading boot volume... ");
+        if (fs_preload_boot(&files, &bytes) == 0) {
+            uint_to_str(files, num);
+            con_print_ascii(num);
+            con_print(L" files, ");
+            uint_to_str((UINT32)(bytes / 1024), num);
+            con_print_ascii(num);
+            con_print(L" KB in memory\r\n");
+        } else {
+            con_print(L"failed, reading from disk\r\n");
+        }
+        boot_phase("preload");
+    }
 
     status = fb_init();
     if (!EFI_ERROR(status)) {
         have_fb = 1;
+        if (fs_exists(SERIAL_FLAG))
+            serial_start(1);
+    } else if (serial_start(0) == 0) {
+        /* Headless: the text grid alone, shown on the serial line */
+        have_fb = 1;
     } else {
         con_print(L"No framebuffer, falling back to console.\r\n");
     }
+    boot_phase("display");
 
     /* Reset keyboard input */
     st->ConIn->Reset(st->ConIn, FALSE);
@@ -297,6 +337,11 @@ EFI_STATUS efi_main(EFI_HANDLE image_handle, EFI_SYSTEM_TABLE *st) {
     else
         console_loop();
 
+#ifdef TRACE_RING
+    fs_restore_boot_volume();
+    trace_ring_dump();
+#endif
+
     /* Shutdown */
     con_print(L"\r\nShutting down...\r\n");
     g_boot.bs->Stall(1000000);
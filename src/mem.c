@@ -1,23 +1,451 @@
 #include "mem.h"
+#include "cpu.h"
+#include "trace.h"
+
+/* SIMD bulk copy/fill kernels (memops_<arch>); see mem_copy() */
+#if defined(__aarch64__) || defined(__x86_64__)
+#define HAVE_SIMD_KERNELS 1
+void simd_copy64(void *dst, const void *src, UINTN blocks);
+void simd_set64(void *dst, const void *pattern16, UINTN blocks);
+#endif
+
+/* Byte-pair filter for mem_find(); other arches use the word loop */
+#ifdef __x86_64__
+#define HAVE_FIND_KERNEL 1
+UINTN simd_find_pair(const void *p, UINTN blocks, UINT32 pair);
+#endif
+
+/* Popcount kernels: POPCNT takes words, NEON cnt 64-byte blocks */
+#ifdef __x86_64__
+#define HAVE_POPCNT_KERNEL 1
+#define POPCNT_UNIT 8
+UINT64 popcnt_words(const void *p, UINTN words);
+#elif defined(__aarch64__)
+#define HAVE_POPCNT_KERNEL 1
+#define POPCNT_UNIT 64
+UINT64 popcnt_blocks(const void *p, UINTN blocks);
+#endif
+
+/* The kernels mem_init() found the CPU has (cpu.h); NULL where the
+   word loops do the job */
+static struct {
+    void  (*copy64)(void *dst, const void *src, UINTN blocks);
+    void  (*set64)(void *dst, const void *pattern16, UINTN blocks);
+    UINTN (*find_pair)(const void *p, UINTN blocks, UINT32 pair);
+    UINT64 (*popcount)(const void *p, UINTN units);
+} s_ops;
+
+/*
+ * Small allocations come from size-class slabs: 64 KB regions, aligned
+ * to their size, each holding objects of one class.  A freed object is
+ * pushed onto its slab's free list, so small alloc/free never calls the
+ * firmware.  Blocks larger than the biggest class go to AllocatePool.
+ *
+ * mem_free() finds a pointer's slab by masking it down to 64 KB and
+ * looking the base up in a hash set of live slabs; anything not found
+ * there came from AllocatePool.
+ *
+ * Slab pages are EfiLoaderCode like the pool path, so TCC's JIT-compiled
+ * code is executable wherever it lands.  EfiLoaderData pages may be NX
+ * on newer UEFI firmware.
+ */
+
+#define SLAB_SHIFT   16
+#define SLAB_SIZE    ((UINTN)1 << SLAB_SHIFT)
+#define SLAB_PAGES   (SLAB_SIZE / 4096)
+#define SLAB_HDR     64     /* header space; objects start after it */
+
+#define SLAB_CLASSES  MEM_SLAB_CLASSES
+static const UINT16 slab_class_size[SLAB_CLASSES] = {
+    16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024, 1536, 2048
+};
+#define SLAB_MAX_OBJ  2048
+
+struct slab {
+    struct slab *next, *prev;   /* class's list of slabs with room */
+    void  *free;                /* freed objects, linked through word 0 */
+    UINT8 *bump;                /* next never-used object */
+    UINT8 *end;
+    UINT32 used;
+    UINT8  cls;
+    UINT8  tag;                 /* subsystem the slab's objects belong to */
+    UINT16 listed;
+};
+
+struct slab_class {
+    struct slab *partial;       /* slabs with at least one free object */
+    struct slab *spare;         /* one empty slab kept for reuse */
+};
+
+/* Slabs are kept per tag so each object's owner is known at free */
+static struct slab_class s_classes[MEM_TAGS][SLAB_CLASSES];
+
+/* ---- Statistics ---- */
+
+static int s_tag;               /* charged for new allocations */
+static struct mem_stats s_stats;
+
+static const char *s_tag_names[MEM_TAGS] = {
+    "core", "fs", "browse", "edit", "tcc", "disk"
+};
+
+static void stats_add(int tag, UINTN bytes)
+{
+    s_stats.allocs++;
+    s_stats.live_bytes += bytes;
+    s_stats.tag_bytes[tag] += bytes;
+    if (s_stats.live_bytes > s_stats.peak_bytes)
+        s_stats.peak_bytes = s_stats.live_bytes;
+}
+
+static void stats_sub(int tag, UINTN bytes)
+{
+    s_stats.frees++;
+    s_stats.live_bytes -= bytes;
+    s_stats.tag_bytes[tag] -= bytes;
+}
+
+/* Open-addressed set of live slab bases (0 = empty slot) */
+static UINTN *s_slab_set;
+static UINTN  s_slab_cap;       /* power of two */
+static UINTN  s_slab_count;
+
+static UINTN slab_hash(UINTN base)
+{
+    UINT64 h = (UINT64)(base >> SLAB_SHIFT) * 0x9E3779B97F4A7C15ULL;
+    return (UINTN)(h >> 32) & (s_slab_cap - 1);
+}
+
+static int slab_set_contains(UINTN base)
+{
+    if (!s_slab_count)
+        return 0;
+    UINTN mask = s_slab_cap - 1;
+    for (UINTN i = slab_hash(base); s_slab_set[i]; i = (i + 1) & mask)
+        if (s_slab_set[i] == base)
+            return 1;
+    return 0;
+}
+
+static void slab_set_put(UINTN base)
+{
+    UINTN i = slab_hash(base);
+    while (s_slab_set[i])
+        i = (i + 1) & (s_slab_cap - 1);
+    s_slab_set[i] = base;
+    s_slab_count++;
+}
+
+static int slab_set_grow(void)
+{
+    UINTN cap = s_slab_cap ? s_slab_cap * 2 : 64;
+    UINTN *set = NULL;
+    if (EFI_ERROR(g_boot.bs->AllocatePool(EfiLoaderData, cap * sizeof(UINTN),
+                                          (void **)&set)))
+        return -1;
+    mem_set(set, 0, cap * sizeof(UINTN));
+
+    UINTN *old = s_slab_set, old_cap = s_slab_cap;
+    s_slab_set = set;
+    s_slab_cap = cap;
+    s_slab_count = 0;
+    for (UINTN i = 0; i < old_cap; i++)
+        if (old[i])
+            slab_set_put(old[i]);
+    if (old)
+        g_boot.bs->FreePool(old);
+    return 0;
+}
+
+/* Linear-probing delete: shift later members of the run back so
+   lookups never stop early at the hole */
+static void slab_set_remove(UINTN base)
+{
+    UINTN mask = s_slab_cap - 1;
+    UINTN i = slab_hash(base);
+    while (s_slab_set[i] != base)
+        i = (i + 1) & mask;
+    s_slab_set[i] = 0;
+    s_slab_count--;
+
+    for (UINTN j = (i + 1) & mask; s_slab_set[j]; j = (j + 1) & mask) {
+        UINTN home = slab_hash(s_slab_set[j]);
+        /* Move j into the hole unless its home lies in (i, j] */
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            s_slab_set[i] = s_slab_set[j];
+            s_slab_set[j] = 0;
+            i = j;
+        }
+    }
+}
+
+static void slab_reset(struct slab *s)
+{
+    UINTN size = slab_class_size[s->cls];
+    s->free = NULL;
+    s->bump = (UINT8 *)s + SLAB_HDR;
+    s->end = (UINT8 *)s + SLAB_HDR +
+             ((SLAB_SIZE - SLAB_HDR) / size) * size;
+    s->used = 0;
+}
+
+/* Allocate a SLAB_SIZE-aligned region: over-allocate by one slab less a
+   page, then hand the unaligned head and tail back to the firmware */
+static struct slab *slab_new(int cls, int tag)
+{
+    if (s_slab_count * 2 >= s_slab_cap && slab_set_grow() != 0)
+        return NULL;
+
+    UINTN pages = SLAB_PAGES * 2 - 1;
+    EFI_PHYSICAL_ADDRESS addr = 0;
+    if (EFI_ERROR(g_boot.bs->AllocatePages(AllocateAnyPages, EfiLoaderCode,
+                                           pages, &addr)))
+        return NULL;
+
+    EFI_PHYSICAL_ADDRESS base = (addr + SLAB_SIZE - 1) &
+                                ~(EFI_PHYSICAL_ADDRESS)(SLAB_SIZE - 1);
+    UINTN head = (UINTN)(base - addr) / 4096;
+    UINTN tail = pages - head - SLAB_PAGES;
+    if (head)
+        g_boot.bs->FreePages(addr, head);
+    if (tail)
+        g_boot.bs->FreePages(base + SLAB_SIZE, tail);
+
+    struct slab *s = (struct slab *)(UINTN)base;
+    s->next = s->prev = NULL;
+    s->cls = (UINT8)cls;
+    s->tag = (UINT8)tag;
+    s->listed = 0;
+    slab_reset(s);
+    slab_set_put((UINTN)base);
+    s_stats.slabs++;
+    s_stats.cls[cls].slabs++;
+    return s;
+}
+
+static void slab_link(struct slab_class *c, struct slab *s)
+{
+    s->prev = NULL;
+    s->next = c->partial;
+    if (c->partial)
+        c->partial->prev = s;
+    c->partial = s;
+    s->listed = 1;
+}
+
+static void slab_unlink(struct slab_class *c, struct slab *s)
+{
+    if (s->prev)
+        s->prev->next = s->next;
+    else
+        c->partial = s->next;
+    if (s->next)
+        s->next->prev = s->prev;
+    s->next = s->prev = NULL;
+    s->listed = 0;
+}
+
+static int slab_class_of(UINTN size)
+{
+    for (int i = 0; i < SLAB_CLASSES; i++)
+        if (size <= slab_class_size[i])
+            return i;
+    return -1;
+}
+
+static void *slab_alloc(int cls)
+{
+    struct slab_class *c = &s_classes[s_tag][cls];
+    struct slab *s = c->partial;
+    if (!s) {
+        s = c->spare;
+        c->spare = NULL;
+        if (s) {
+            s_stats.spare_slabs--;
+        } else {
+            s = slab_new(cls, s_tag);
+            if (!s)
+                return NULL;
+        }
+        slab_link(c, s);
+    }
+
+    void *obj;
+    if (s->free) {
+        obj = s->free;
+        s->free = *(void **)obj;
+    } else {
+        obj = s->bump;
+        s->bump += slab_class_size[cls];
+    }
+    s->used++;
+    s_stats.cls[cls].objects++;
+    stats_add(s_tag, slab_class_size[cls]);
+
+    if (!s->free && s->bump >= s->end)
+        slab_unlink(c, s);
+    return obj;
+}
+
+static void slab_release(struct slab *s, void *obj)
+{
+    struct slab_class *c = &s_classes[s->tag][s->cls];
+    *(void **)obj = s->free;
+    s->free = obj;
+    s->used--;
+    s_stats.cls[s->cls].objects--;
+    stats_sub(s->tag, slab_class_size[s->cls]);
+
+    if (s->used == 0) {
+        if (s->listed)
+            slab_unlink(c, s);
+        if (!c->spare) {
+            slab_reset(s);
+            c->spare = s;
+            s_stats.spare_slabs++;
+        } else {
+            s_stats.slabs--;
+            s_stats.cls[s->cls].slabs--;
+            slab_set_remove((UINTN)s);
+            g_boot.bs->FreePages((EFI_PHYSICAL_ADDRESS)(UINTN)s, SLAB_PAGES);
+        }
+    } else if (!s->listed) {
+        slab_link(c, s);
+    }
+}
+
+static void budget_init(void);
 
 void mem_init(void) {
-    /* Nothing to do — we use UEFI AllocatePool directly */
+    /* Slabs and the slab set are created on demand */
+#ifdef HAVE_SIMD_KERNELS
+    if (cpu_has(CPU_SIMD)) {
+        s_ops.copy64 = simd_copy64;
+        s_ops.set64 = simd_set64;
+#ifdef HAVE_FIND_KERNEL
+        s_ops.find_pair = simd_find_pair;
+#endif
+    }
+#endif
+#ifdef HAVE_POPCNT_KERNEL
+    if (cpu_has(CPU_POPCNT)) {
+#ifdef __x86_64__
+        s_ops.popcount = popcnt_words;
+#else
+        s_ops.popcount = popcnt_blocks;
+#endif
+    }
+#endif
+    budget_init();
 }
 
-void *mem_alloc(UINTN size) {
-    void *ptr = NULL;
-    /* Use EfiLoaderCode so TCC's JIT-compiled code is executable.
-       EfiLoaderData pages may be NX on newer UEFI firmware. */
-    EFI_STATUS status = g_boot.bs->AllocatePool(EfiLoaderCode, size, &ptr);
+/* Device I/O buffers, below */
+struct io_buf;
+static struct io_buf *s_io_idle;
+static UINT64 s_io_pool;
+static void io_trim(UINT64 keep);
+
+/* Blocks above the largest class come from AllocatePool behind a
+   header recording their size, for mem_usable_size(), and owner */
+struct pool_hdr {
+    UINTN size;
+    UINTN tag;                  /* also keeps the payload 16-byte offset */
+};
+
+void *mem_alloc_raw(UINTN size) {
+    int cls = slab_class_of(size);
+    if (cls >= 0) {
+        void *p = slab_alloc(cls);
+        TRACE_EVENT(TR_ALLOC, size, p);
+        return p;
+    }
+
+    struct pool_hdr *h = NULL;
+    if (size > (UINTN)-1 - sizeof(*h))
+        return NULL;
+    EFI_STATUS status = g_boot.bs->AllocatePool(EfiLoaderCode,
+                                                sizeof(*h) + size, (void **)&h);
+    if (EFI_ERROR(status) && s_io_idle) {
+        /* Idle device buffers may be what is in the way */
+        s_io_pool = mem_budget_shrink(MEM_BUDGET_IO);
+        io_trim(0);
+        status = g_boot.bs->AllocatePool(EfiLoaderCode,
+                                         sizeof(*h) + size, (void **)&h);
+    }
     if (EFI_ERROR(status))
         return NULL;
-    mem_set(ptr, 0, size);
+    h->size = size;
+    h->tag = (UINTN)s_tag;
+    s_stats.pool_blocks++;
+    s_stats.pool_bytes += size;
+    stats_add(s_tag, size);
+    TRACE_EVENT(TR_ALLOC, size, h + 1);
+    return h + 1;
+}
+
+void *mem_alloc(UINTN size) {
+    void *ptr = mem_alloc_raw(size);
+    if (ptr)
+        mem_set(ptr, 0, size);
     return ptr;
 }
 
 void mem_free(void *ptr) {
-    if (ptr)
-        g_boot.bs->FreePool(ptr);
+    if (!ptr)
+        return;
+    TRACE_EVENT(TR_FREE, ptr, 0);
+    UINTN base = (UINTN)ptr & ~(SLAB_SIZE - 1);
+    if (slab_set_contains(base)) {
+        slab_release((struct slab *)base, ptr);
+        return;
+    }
+    struct pool_hdr *h = (struct pool_hdr *)ptr - 1;
+    s_stats.pool_blocks--;
+    s_stats.pool_bytes -= h->size;
+    stats_sub((int)h->tag, h->size);
+    g_boot.bs->FreePool(h);
+}
+
+UINTN mem_usable_size(void *ptr) {
+    if (!ptr)
+        return 0;
+    UINTN base = (UINTN)ptr & ~(SLAB_SIZE - 1);
+    if (slab_set_contains(base))
+        return slab_class_size[((struct slab *)base)->cls];
+    return ((struct pool_hdr *)ptr - 1)->size;
+}
+
+int mem_grow(void **p, UINT32 *cap, UINT32 need, UINTN elem, UINT32 first) {
+    if (need <= *cap) return 0;
+    UINT32 n = *cap ? *cap : first;
+    while (n < need) n *= 2;
+    void *q = mem_alloc_raw((UINTN)n * elem);
+    if (!q) return -1;
+    if (*p) {
+        mem_copy(q, *p, (UINTN)*cap * elem);
+        mem_free(*p);
+    }
+    *p = q;
+    *cap = n;
+    return 0;
+}
+
+int mem_tag_set(int tag) {
+    int prev = s_tag;
+    if (tag >= 0 && tag < MEM_TAGS)
+        s_tag = tag;
+    return prev;
+}
+
+const char *mem_tag_name(int tag) {
+    return (tag >= 0 && tag < MEM_TAGS) ? s_tag_names[tag] : "?";
+}
+
+void mem_get_stats(struct mem_stats *out) {
+    mem_copy(out, &s_stats, sizeof(*out));
+    out->slab_bytes = (UINT64)s_stats.slabs * SLAB_SIZE;
+    for (int i = 0; i < SLAB_CLASSES; i++)
+        out->cls[i].size = slab_class_size[i];
 }
 
 void *mem_alloc_code(UINTN size) {
@@ -27,6 +455,7 @@ void *mem_alloc_code(UINTN size) {
         AllocateMaxAddress, EfiLoaderCode, pages, &addr);
     if (EFI_ERROR(status))
         return NULL;
+    s_stats.page_bytes += pages * 4096;
     mem_set((void *)(UINTN)addr, 0, pages * 4096);
     return (void *)(UINTN)addr;
 }
@@ -34,27 +463,474 @@ void *mem_alloc_code(UINTN size) {
 void mem_free_code(void *ptr, UINTN size) {
     if (!ptr) return;
     UINTN pages = (size + 4095) / 4096;
+    s_stats.page_bytes -= pages * 4096;
+    g_boot.bs->FreePages((EFI_PHYSICAL_ADDRESS)(UINTN)ptr, pages);
+}
+
+void *mem_alloc_pages(UINTN size) {
+    UINTN pages = (size + 4095) / 4096;
+    EFI_PHYSICAL_ADDRESS addr = 0;
+    EFI_STATUS status = g_boot.bs->AllocatePages(
+        AllocateAnyPages, EfiLoaderData, pages, &addr);
+    if (EFI_ERROR(status))
+        return NULL;
+    s_stats.page_bytes += pages * 4096;
+    mem_set((void *)(UINTN)addr, 0, pages * 4096);
+    return (void *)(UINTN)addr;
+}
+
+void mem_free_pages(void *ptr, UINTN size) {
+    if (!ptr) return;
+    UINTN pages = (size + 4095) / 4096;
+    s_stats.page_bytes -= pages * 4096;
     g_boot.bs->FreePages((EFI_PHYSICAL_ADDRESS)(UINTN)ptr, pages);
 }
 
+/* ---- Device I/O buffers ----
+ * Whole pages, aligned to s_io_align, each described by a node on the
+ * live or the idle list.  mem_io_put() parks a buffer on the idle list
+ * while the idle total stays within the pool size, so the buffers of
+ * one transfer are there for the next without going to the firmware. */
+
+struct io_buf {
+    struct io_buf *next;
+    UINT8 *ptr;                 /* aligned start handed out */
+    EFI_PHYSICAL_ADDRESS base;  /* the pages behind it */
+    UINTN pages;
+    UINTN size;                 /* usable bytes from ptr */
+};
+
+static struct io_buf *s_io_live;
+static UINTN  s_io_align = 4096;
+
+static void io_buf_release(struct io_buf *b) {
+    s_stats.page_bytes -= b->pages * 4096;
+    s_stats.io_bytes -= b->size;
+    g_boot.bs->FreePages(b->base, b->pages);
+    mem_free(b);
+}
+
+/* Free idle buffers until at most 'keep' bytes are left idle */
+static void io_trim(UINT64 keep) {
+    while (s_io_idle && s_stats.io_idle_bytes > keep) {
+        struct io_buf *b = s_io_idle;
+        s_io_idle = b->next;
+        s_stats.io_idle_bytes -= b->size;
+        io_buf_release(b);
+    }
+}
+
+static struct io_buf *io_buf_new(UINTN size) {
+    struct io_buf *b = (struct io_buf *)mem_alloc(sizeof(*b));
+    if (!b) return NULL;
+    UINTN extra = s_io_align > 4096 ? s_io_align / 4096 - 1 : 0;
+    b->pages = size / 4096 + extra;
+    EFI_STATUS status = g_boot.bs->AllocatePages(
+        AllocateAnyPages, EfiLoaderData, b->pages, &b->base);
+    if (EFI_ERROR(status) && s_io_idle) {
+        /* Idle buffers that did not fit may be what is in the way */
+        io_trim(0);
+        s_io_pool = mem_budget_shrink(MEM_BUDGET_IO);
+        status = g_boot.bs->AllocatePages(
+            AllocateAnyPages, EfiLoaderData, b->pages, &b->base);
+    }
+    if (EFI_ERROR(status)) {
+        mem_free(b);
+        return NULL;
+    }
+    b->ptr = (UINT8 *)(((UINTN)b->base + s_io_align - 1) & ~(s_io_align - 1));
+    b->size = size;
+    s_stats.page_bytes += b->pages * 4096;
+    s_stats.io_bytes += size;
+    return b;
+}
+
+void *mem_io_get(UINTN size) {
+    size = (size + 4095) & ~(UINTN)4095;
+    if (size == 0) size = 4096;
+
+    /* Smallest idle buffer that fits, is aligned well enough and is not
+       more than twice the size (a big one stays for a big request) */
+    struct io_buf **best = NULL;
+    for (struct io_buf **pp = &s_io_idle; *pp; pp = &(*pp)->next) {
+        struct io_buf *b = *pp;
+        if (b->size < size || b->size / 2 > size ||
+            ((UINTN)b->ptr & (s_io_align - 1)))
+            continue;
+        if (!best || b->size < (*best)->size)
+            best = pp;
+    }
+
+    struct io_buf *b;
+    if (best) {
+        b = *best;
+        *best = b->next;
+        s_stats.io_idle_bytes -= b->size;
+    } else {
+        b = io_buf_new(size);
+        if (!b) return NULL;
+    }
+    b->next = s_io_live;
+    s_io_live = b;
+    return b->ptr;
+}
+
+void mem_io_put(void *ptr) {
+    if (!ptr) return;
+    for (struct io_buf **pp = &s_io_live; *pp; pp = &(*pp)->next) {
+        struct io_buf *b = *pp;
+        if (b->ptr != (UINT8 *)ptr)
+            continue;
+        *pp = b->next;
+        if (s_stats.io_idle_bytes + b->size > s_io_pool) {
+            io_buf_release(b);
+        } else {
+            b->next = s_io_idle;
+            s_io_idle = b;
+            s_stats.io_idle_bytes += b->size;
+        }
+        return;
+    }
+}
+
+UINT64 mem_io_set_pool(UINT64 bytes) {
+    UINT64 prev = s_io_pool;
+    s_io_pool = bytes;
+    io_trim(bytes);
+    return prev;
+}
+
+void mem_io_align(UINT32 align) {
+    /* IoAlign is 0 or 1 for none, otherwise a power of two */
+    if (align > s_io_align && (align & (align - 1)) == 0)
+        s_io_align = align;
+}
+
+int mem_map_stats(struct mem_map_stats *out) {
+    mem_set(out, 0, sizeof(*out));
+
+    UINTN map_size = 0, map_key, desc_size;
+    UINT32 desc_ver;
+
+    g_boot.bs->GetMemoryMap(&map_size, NULL, &map_key, &desc_size, &desc_ver);
+    map_size += 2 * desc_size;
+
+    EFI_MEMORY_DESCRIPTOR *map = (EFI_MEMORY_DESCRIPTOR *)mem_alloc(map_size);
+    if (!map) return -1;
+
+    EFI_STATUS status = g_boot.bs->GetMemoryMap(
+        &map_size, map, &map_key, &desc_size, &desc_ver);
+    if (EFI_ERROR(status)) {
+        mem_free(map);
+        return -1;
+    }
+
+    UINT8 *ptr = (UINT8 *)map;
+    UINT8 *end = ptr + map_size;
+    while (ptr < end) {
+        EFI_MEMORY_DESCRIPTOR *desc = (EFI_MEMORY_DESCRIPTOR *)ptr;
+        UINT32 t = desc->Type;
+        UINT64 n = desc->NumberOfPages;
+        out->type_pages[t < MEM_MAP_TYPES ? t : MEM_MAP_TYPES - 1] += n;
+        out->descriptors++;
+        if ((t >= EfiLoaderCode && t <= EfiConventionalMemory) ||
+            t == EfiACPIReclaimMemory)
+            out->usable_pages += n;
+        if (t == EfiConventionalMemory) {
+            out->free_ranges++;
+            if (n > out->largest_free)
+                out->largest_free = n;
+        }
+        ptr += desc_size;
+    }
+
+    mem_free(map);
+    return 0;
+}
+
+/* Get total system memory in MB via UEFI memory map */
+UINT32 mem_total_mb(void) {
+    struct mem_map_stats m;
+    if (mem_map_stats(&m) != 0)
+        return 0;
+    return (UINT32)((m.usable_pages * 4096) / (1024 * 1024));
+}
+
+/* ---- Memory budget ---- */
+
+#define MB (1024ULL * 1024)
+
+/* RAM / share, within floor and ceiling (0: none) */
+static const struct {
+    const char *name;
+    UINT32 share;
+    UINT64 floor, ceiling;
+} s_budget_rules[MEM_BUDGETS] = {
+    { "bcache",   64,   1 * MB,     64 * MB },
+    { "io",       128,  4 * MB,     64 * MB },
+    { "preload",  16,   0,          1024 * MB },
+    { "fcache",   256,  1 * MB,     32 * MB },
+    { "copy",     256,  64 * 1024,  16 * MB },
+    { "hl",       1024, 256 * 1024, 8 * MB },
+    { "ramdisk",  2,    0,          0 },
+};
+
+static UINT64 s_budget[MEM_BUDGETS];
+
+/* Sizes from the memory map; the floors if it cannot be read */
+static void budget_init(void) {
+    UINT64 ram = (UINT64)mem_total_mb() * MB;
+    for (int i = 0; i < MEM_BUDGETS; i++) {
+        UINT64 b = ram / s_budget_rules[i].share;
+        if (b < s_budget_rules[i].floor) b = s_budget_rules[i].floor;
+        if (s_budget_rules[i].ceiling && b > s_budget_rules[i].ceiling)
+            b = s_budget_rules[i].ceiling;
+        s_budget[i] = b;
+    }
+    s_io_pool = s_budget[MEM_BUDGET_IO];
+}
+
+UINT64 mem_budget(int pool) {
+    return (pool >= 0 && pool < MEM_BUDGETS) ? s_budget[pool] : 0;
+}
+
+UINT64 mem_budget_shrink(int pool) {
+    if (pool < 0 || pool >= MEM_BUDGETS)
+        return 0;
+    UINT64 b = s_budget[pool] / 2;
+    if (b < s_budget_rules[pool].floor) b = s_budget_rules[pool].floor;
+    if (b > s_budget[pool]) b = s_budget[pool];
+    s_budget[pool] = b;
+    return b;
+}
+
+const char *mem_budget_name(int pool) {
+    return (pool >= 0 && pool < MEM_BUDGETS) ? s_budget_rules[pool].name : "?";
+}
+
+/* ---- Bulk memory ----
+ *
+ * Copies and fills move 8-byte words once the pointers are aligned,
+ * and hand runs of 64-byte blocks to the architecture's SIMD kernel
+ * (memops_<arch>) when mem_init() found the CPU has one. Every access is naturally
+ * aligned: GOP framebuffers may be Device memory on ARM, where
+ * unaligned accesses fault. Buffers whose addresses differ in the low
+ * three bits cannot be aligned together and are moved bytewise.
+ */
+
+/* Below this, the word loops beat setting up a kernel call */
+#define SIMD_MIN 256
+
+#define WORD_ONES  0x0101010101010101ULL
+#define WORD_HIGHS 0x8080808080808080ULL
+
 void mem_set(void *dst, UINT8 val, UINTN size) {
     UINT8 *d = (UINT8 *)dst;
-    for (UINTN i = 0; i < size; i++)
-        d[i] = val;
+    if (size >= 16) {
+        UINT64 w = WORD_ONES * val;
+        while ((UINTN)d & 7) { *d++ = val; size--; }
+#ifdef HAVE_SIMD_KERNELS
+        if (s_ops.set64 && size >= SIMD_MIN) {
+            if ((UINTN)d & 8) { *(UINT64 *)d = w; d += 8; size -= 8; }
+            UINT64 buf[4];  /* pattern, 16-byte aligned within */
+            UINT64 *pat = (UINT64 *)(((UINTN)buf + 15) & ~(UINTN)15);
+            pat[0] = pat[1] = w;
+            UINTN blocks = size / 64;
+            s_ops.set64(d, pat, blocks);
+            d += blocks * 64;
+            size -= blocks * 64;
+        }
+#endif
+        UINT64 *q = (UINT64 *)d;
+        for (; size >= 32; size -= 32, q += 4) {
+            q[0] = w; q[1] = w; q[2] = w; q[3] = w;
+        }
+        for (; size >= 8; size -= 8)
+            *q++ = w;
+        d = (UINT8 *)q;
+    }
+    while (size--)
+        *d++ = val;
 }
 
+/* Forward copy; also safe for overlapping buffers when dst < src */
 void mem_copy(void *dst, const void *src, UINTN size) {
     UINT8 *d = (UINT8 *)dst;
     const UINT8 *s = (const UINT8 *)src;
-    for (UINTN i = 0; i < size; i++)
-        d[i] = s[i];
+    if (size >= 16 && (((UINTN)d ^ (UINTN)s) & 7) == 0) {
+        while ((UINTN)d & 7) { *d++ = *s++; size--; }
+#ifdef HAVE_SIMD_KERNELS
+        if (s_ops.copy64 && size >= SIMD_MIN &&
+            (((UINTN)d ^ (UINTN)s) & 15) == 0) {
+            if ((UINTN)d & 8) {
+                *(UINT64 *)d = *(const UINT64 *)s;
+                d += 8; s += 8; size -= 8;
+            }
+            UINTN blocks = size / 64;
+            s_ops.copy64(d, s, blocks);
+            d += blocks * 64;
+            s += blocks * 64;
+            size -= blocks * 64;
+        }
+#endif
+        UINT64 *q = (UINT64 *)d;
+        const UINT64 *p = (const UINT64 *)s;
+        for (; size >= 32; size -= 32, q += 4, p += 4) {
+            UINT64 a = p[0], b = p[1], c = p[2], e = p[3];
+            q[0] = a; q[1] = b; q[2] = c; q[3] = e;
+        }
+        for (; size >= 8; size -= 8)
+            *q++ = *p++;
+        d = (UINT8 *)q;
+        s = (const UINT8 *)p;
+    }
+    while (size--)
+        *d++ = *s++;
+}
+
+void mem_move(void *dst, const void *src, UINTN size) {
+    UINT8 *d = (UINT8 *)dst;
+    const UINT8 *s = (const UINT8 *)src;
+    if (d <= s || d >= s + size) {
+        mem_copy(dst, src, size);
+        return;
+    }
+
+    /* Overlap with dst above src: copy from the end down */
+    d += size;
+    s += size;
+    if (size >= 16 && (((UINTN)d ^ (UINTN)s) & 7) == 0) {
+        while ((UINTN)d & 7) { *--d = *--s; size--; }
+        UINT64 *q = (UINT64 *)d;
+        const UINT64 *p = (const UINT64 *)s;
+        for (; size >= 8; size -= 8)
+            *--q = *--p;
+        d = (UINT8 *)q;
+        s = (const UINT8 *)p;
+    }
+    while (size--)
+        *--d = *--s;
+}
+
+int mem_cmp(const void *a, const void *b, UINTN size) {
+    const UINT8 *x = (const UINT8 *)a;
+    const UINT8 *y = (const UINT8 *)b;
+    if (size >= 16 && (((UINTN)x ^ (UINTN)y) & 7) == 0) {
+        while ((UINTN)x & 7) {
+            if (*x != *y) return (int)*x - (int)*y;
+            x++; y++; size--;
+        }
+        /* Skip equal words; the byte loop below finds the difference */
+        while (size >= 8 && *(const UINT64 *)x == *(const UINT64 *)y) {
+            x += 8; y += 8; size -= 8;
+        }
+    }
+    for (; size; size--, x++, y++)
+        if (*x != *y) return (int)*x - (int)*y;
+    return 0;
+}
+
+/* Words holding c are found with the zero-byte test, then bytewise */
+const void *mem_chr(const void *buf, UINT8 c, UINTN size) {
+    const UINT8 *p = (const UINT8 *)buf;
+    while (size && ((UINTN)p & 7)) {
+        if (*p == c) return p;
+        p++; size--;
+    }
+    UINT64 pat = WORD_ONES * c;
+    while (size >= 8) {
+        UINT64 w = *(const UINT64 *)p ^ pat;
+        if ((w - WORD_ONES) & ~w & WORD_HIGHS) break;
+        p += 8; size -= 8;
+    }
+    for (; size; size--, p++)
+        if (*p == c) return p;
+    return NULL;
+}
+
+/* Candidates must match the needle's first two bytes; the kernel
+   tests 32 positions at a time, mem_chr() the first byte elsewhere */
+const void *mem_find(const void *hay, UINTN size, const void *needle, UINTN len) {
+    const UINT8 *p = (const UINT8 *)hay;
+    const UINT8 *n = (const UINT8 *)needle;
+    if (len == 0) return hay;
+    if (len > size) return NULL;
+    if (len == 1) return mem_chr(hay, n[0], size);
+    const UINT8 *end = p + (size - len + 1);    /* last start + 1 */
+#ifdef HAVE_FIND_KERNEL
+    /* A block reads one byte past itself; with len >= 2 that byte is
+       still inside hay */
+    if (s_ops.find_pair) {
+        UINT32 pair = n[0] | (UINT32)n[1] << 8;
+        while ((UINTN)(end - p) >= 32) {
+            UINTN blocks = (UINTN)(end - p) / 32;
+            UINTN k = s_ops.find_pair(p, blocks, pair);
+            if (k == blocks) {
+                p += blocks * 32;
+                break;
+            }
+            const UINT8 *q = p + k * 32;
+            for (UINTN i = 0; i < 32; i++)
+                if (q[i] == n[0] && q[i + 1] == n[1] &&
+                    mem_cmp(q + i, n, len) == 0)
+                    return q + i;
+            p = q + 32;
+        }
+    }
+#endif
+    while (p < end) {
+        p = (const UINT8 *)mem_chr(p, n[0], (UINTN)(end - p));
+        if (!p) return NULL;
+        if (p[1] == n[1] && mem_cmp(p, n, len) == 0) return p;
+        p++;
+    }
+    return NULL;
 }
 
+/* Whole units go to the kernel; the ends and CPUs without one fold
+   8-byte words in parallel */
+UINT64 mem_popcount(const void *data, UINTN size) {
+    const UINT8 *p = (const UINT8 *)data;
+    UINT64 n = 0;
+    while (size && ((UINTN)p & 7)) {
+        for (UINT8 b = *p++; b; b &= (UINT8)(b - 1)) n++;
+        size--;
+    }
+#ifdef HAVE_POPCNT_KERNEL
+    if (s_ops.popcount && size >= POPCNT_UNIT) {
+        UINTN units = size / POPCNT_UNIT;
+        n += s_ops.popcount(p, units);
+        p += units * POPCNT_UNIT;
+        size -= units * POPCNT_UNIT;
+    }
+#endif
+    for (; size >= 8; size -= 8, p += 8) {
+        UINT64 w = *(const UINT64 *)p;
+        w -= (w >> 1) & 0x5555555555555555ULL;
+        w = (w & 0x3333333333333333ULL) + ((w >> 2) & 0x3333333333333333ULL);
+        w = (w + (w >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+        n += (w * WORD_ONES) >> 56;
+    }
+    for (; size; size--)
+        for (UINT8 b = *p++; b; b &= (UINT8)(b - 1)) n++;
+    return n;
+}
+
+/* Aligned words never cross a page, so reading past the terminator
+   within the last word is safe */
 UINTN str_len(const CHAR8 *s) {
-    UINTN len = 0;
-    while (s[len])
-        len++;
-    return len;
+    const CHAR8 *p = s;
+    while ((UINTN)p & 7) {
+        if (!*p) return (UINTN)(p - s);
+        p++;
+    }
+    const UINT64 *w = (const UINT64 *)p;
+    while (!((*w - WORD_ONES) & ~*w & WORD_HIGHS))
+        w++;
+    p = (const CHAR8 *)w;
+    while (*p)
+        p++;
+    return (UINTN)(p - s);
 }
 
 int str_cmp(const CHAR8 *a, const CHAR8 *b) {
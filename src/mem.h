@@ -6,19 +6,147 @@
 /* Initialize the memory allocator (call after boot_state is set up) */
 void mem_init(void);
 
-/* Simple allocator using UEFI AllocatePool */
+/* Zeroed general-purpose allocation: size-class slabs up to 2 KB,
+   UEFI AllocatePool above that */
 void *mem_alloc(UINTN size);
 void mem_free(void *ptr);
 
+/* As mem_alloc, but the memory is left uninitialized */
+void *mem_alloc_raw(UINTN size);
+
+/* Bytes actually usable at ptr (its size class, so at least the size
+   requested); a block may be grown in place up to this */
+UINTN mem_usable_size(void *ptr);
+
+/* Make the array at *p (of *cap elements of elem bytes, or NULL) hold
+   at least need: its capacity doubles from first until it does, and
+   the contents move to the new block. Returns 0, -1 when out of memory
+   (the array as it was). */
+int mem_grow(void **p, UINT32 *cap, UINT32 need, UINTN elem, UINT32 first);
+
 /* Allocate/free executable memory in the lower address range.
    Uses AllocatePages(AllocateMaxAddress) below 2GB so TCC-generated
    code can reach workstation symbols via RIP-relative addressing. */
 void *mem_alloc_code(UINTN size);
 void mem_free_code(void *ptr, UINTN size);
 
+/* Allocate/free page-aligned (4 KB) zeroed memory, e.g. for large
+   device I/O buffers that must satisfy BlockIO IoAlign. */
+void *mem_alloc_pages(UINTN size);
+void mem_free_pages(void *ptr, UINTN size);
+
+/* ---- Device I/O buffers ----
+ * A pool of page-backed buffers for raw BlockIO transfers, aligned for
+ * the IoAlign of every device described to mem_io_align() (4 KB at
+ * least), so firmware drivers neither bounce nor split them. */
+
+/* A buffer of at least size bytes, contents undefined; NULL if out of
+   memory. Give it back with mem_io_put(). */
+void *mem_io_get(UINTN size);
+void mem_io_put(void *ptr);
+
+/* Set how many bytes of returned buffers are kept idle for the next
+   mem_io_get() (any above it are freed now); MEM_BUDGET_IO until this
+   is called. Returns the old size. */
+UINT64 mem_io_set_pool(UINT64 bytes);
+
+/* Raise the alignment of buffers handed out from now on to a device's
+   Media->IoAlign */
+void mem_io_align(UINT32 align);
+
+/* Usable RAM in MB from the UEFI memory map (0 if unavailable) */
+UINT32 mem_total_mb(void);
+
+/* ---- Memory budget ----
+ * Every cache and buffer pool that could use more memory than it needs
+ * takes its size from here: a share of the RAM mem_init() found, kept
+ * between a floor and a ceiling, so one binary suits a 512 MB board and
+ * a server alike. A pool whose allocation fails calls
+ * mem_budget_shrink() and tries again with less. */
+#define MEM_BUDGET_BCACHE   0   /* block cache per exFAT/NTFS mount */
+#define MEM_BUDGET_IO       1   /* idle device I/O buffers kept */
+#define MEM_BUDGET_PRELOAD  2   /* boot volume files held in memory */
+#define MEM_BUDGET_FCACHE   3   /* read-only files kept open for TCC */
+#define MEM_BUDGET_COPY     4   /* file copy transfer buffer */
+#define MEM_BUDGET_HL       5   /* editor syntax highlight spans */
+#define MEM_BUDGET_RAMDISK  6   /* the [RAM] volume */
+#define MEM_BUDGETS         7
+
+/* Bytes the pool may hold now */
+UINT64 mem_budget(int pool);
+
+/* After an allocation for the pool failed: halve its budget, down to
+   the floor. Returns the new budget (the old one at the floor). */
+UINT64 mem_budget_shrink(int pool);
+
+const char *mem_budget_name(int pool);
+
+/* ---- Statistics ---- */
+
+/* Subsystem tags: each mem_alloc block is charged to the tag current
+   when it was allocated */
+#define MEM_TAG_CORE    0
+#define MEM_TAG_FS      1   /* volume mounts and their caches */
+#define MEM_TAG_BROWSE  2
+#define MEM_TAG_EDIT    3
+#define MEM_TAG_TCC     4   /* compiler state and compiled programs */
+#define MEM_TAG_DISK    5   /* format, ISO write, USB clone */
+#define MEM_TAGS        6
+
+/* Set the tag for subsequent allocations; returns the previous one */
+int mem_tag_set(int tag);
+const char *mem_tag_name(int tag);
+
+#define MEM_SLAB_CLASSES 14
+
+struct mem_class_stats {
+    UINT32 size;            /* object size */
+    UINT32 slabs;           /* 64 KB slabs held, spares included */
+    UINT64 objects;         /* live objects */
+};
+
+struct mem_stats {
+    UINT64 live_bytes;      /* held by mem_alloc blocks (class-rounded) */
+    UINT64 peak_bytes;
+    UINT64 allocs, frees;   /* calls since boot */
+    UINT64 pool_blocks;     /* live blocks above the slab classes */
+    UINT64 pool_bytes;
+    UINT64 slab_bytes;      /* slab regions, free space included */
+    UINT64 page_bytes;      /* mem_alloc_pages + mem_alloc_code + mem_io */
+    UINT64 io_bytes;        /* mem_io buffers, in use or idle */
+    UINT64 io_idle_bytes;
+    UINT32 slabs, spare_slabs;
+    struct mem_class_stats cls[MEM_SLAB_CLASSES];
+    UINT64 tag_bytes[MEM_TAGS];
+};
+
+void mem_get_stats(struct mem_stats *out);
+
+/* UEFI memory map summary; sizes in 4 KB pages */
+#define MEM_MAP_TYPES 16    /* EFI_MEMORY_TYPE values; last bucket = other */
+
+struct mem_map_stats {
+    UINT64 type_pages[MEM_MAP_TYPES];
+    UINT64 usable_pages;    /* as counted by mem_total_mb() */
+    UINT64 largest_free;    /* largest conventional-memory range */
+    UINT32 free_ranges;     /* conventional-memory descriptors */
+    UINT32 descriptors;
+};
+
+/* Returns 0 on success */
+int mem_map_stats(struct mem_map_stats *out);
+
 /* Utility */
 void mem_set(void *dst, UINT8 val, UINTN size);
 void mem_copy(void *dst, const void *src, UINTN size);
+void mem_move(void *dst, const void *src, UINTN size);
+int mem_cmp(const void *a, const void *b, UINTN size);
+/* First c in size bytes, or NULL */
+const void *mem_chr(const void *buf, UINT8 c, UINTN size);
+/* First len-byte needle in size bytes of hay, or NULL */
+const void *mem_find(const void *hay, UINTN size, const void *needle, UINTN len);
+/* Set bits in size bytes */
+UINT64 mem_popcount(const void *data, UINTN size);
 UINTN str_len(const CHAR8 *s);
 int str_cmp(const CHAR8 *a, const CHAR8 *b);
 void str_copy(char *dst, const char *src, UINTN max);
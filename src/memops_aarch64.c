@@ -0,0 +1,642 @@
+/*
+ * memops_aarch64.c — NEON bulk copy/fill, array, popcount, CRC and
+ * SHA-256 kernels and the ID register reads, pre-assembled for TCC
+ *
+ * TCC's ARM64 assembler is a stub, so the kernels are raw machine code
+ * in .text, named directly as the functions (see setjmp_aarch64.c).
+ * mem.c handles alignment and remainders; these only move whole
+ * 64-byte blocks.  hash.c does the same for the CRC kernels, which
+ * take whole 8-byte words, and the SHA-256 one, whole 64-byte blocks.
+ *
+ *   void simd_copy64(void *dst, const void *src, UINTN blocks);
+ *   void simd_set64(void *dst, const void *pattern16, UINTN blocks);
+ *   UINT64 popcnt_blocks(const void *p, UINTN blocks);
+ *   UINT32 crc32c_words(UINT32 crc, const void *p, UINTN words);
+ *   UINT32 crc32_words(UINT32 crc, const void *p, UINTN words);
+ *   void sha256_blocks(UINT32 h[8], const void *p, UINTN blocks,
+ *                      const UINT32 k[64]);
+ *   UINT64 cpu_id_pfr0(void);  cpu_id_isar0(void);  cpu_id_midr(void);
+ *   vec_*_blocks — the array kernels behind vec.c, declared there
+ *   mt_* — the memory test and bandwidth kernels, declared in memtest.c
+ *   double sqrt(double x);  float sqrtf(float x);
+ *   void dcache_clean(const void *p, UINTN len);
+ *   void dcache_flush(const void *p, UINTN len);
+ *
+ * dst and src must be 16-byte aligned (framebuffers may be Device
+ * memory, where unaligned vector accesses fault) and blocks > 0.
+ * Only q0-q7 and x0-x6 are used, which AAPCS64 leaves caller-saved,
+ * except by sha256_blocks, which saves the d8-d11 it borrows.
+ */
+
+__attribute__((section(".text")))
+unsigned int simd_copy64[] = {
+    0xad400420, /* 1: ldp q0, q1, [x1]      */
+    0xad410c22, /* ldp q2, q3, [x1, #32]    */
+    0x91010021, /* add x1, x1, #64          */
+    0xad000400, /* stp q0, q1, [x0]         */
+    0xad010c02, /* stp q2, q3, [x0, #32]    */
+    0x91010000, /* add x0, x0, #64          */
+    0xf1000442, /* subs x2, x2, #1          */
+    0x54ffff21, /* b.ne 1b                  */
+    0xd65f03c0, /* ret                      */
+};
+
+__attribute__((section(".text")))
+unsigned int simd_set64[] = {
+    0x3dc00020, /* ldr q0, [x1]             */
+    0xad000000, /* 1: stp q0, q0, [x0]      */
+    0xad010000, /* stp q0, q0, [x0, #32]    */
+    0x91010000, /* add x0, x0, #64          */
+    0xf1000442, /* subs x2, x2, #1          */
+    0x54ffff81, /* b.ne 1b                  */
+    0xd65f03c0, /* ret                      */
+};
+
+/* Set bits in whole 64-byte blocks, blocks > 0: cnt per byte, the
+   four registers summed (at most 32 a lane), then across the lanes */
+__attribute__((section(".text")))
+unsigned int popcnt_blocks[] = {
+    0xaa0003e3, /* mov x3, x0                         */
+    0xd2800000, /* mov x0, #0                         */
+    0x4cdf2060, /* 1: ld1 {v0.16b-v3.16b}, [x3], #64  */
+    0x4e205800, /* cnt v0.16b, v0.16b                 */
+    0x4e205821, /* cnt v1.16b, v1.16b                 */
+    0x4e205842, /* cnt v2.16b, v2.16b                 */
+    0x4e205863, /* cnt v3.16b, v3.16b                 */
+    0x4e218400, /* add v0.16b, v0.16b, v1.16b         */
+    0x4e238442, /* add v2.16b, v2.16b, v3.16b         */
+    0x4e228400, /* add v0.16b, v0.16b, v2.16b         */
+    0x6e303800, /* uaddlv h0, v0.16b                  */
+    0x0e023c02, /* umov w2, v0.h[0]                   */
+    0x8b020000, /* add x0, x0, x2                     */
+    0xf1000421, /* subs x1, x1, #1                    */
+    0x54fffe81, /* b.ne 1b                            */
+    0xd65f03c0, /* ret                                */
+};
+
+/* crc is the raw (uninverted) state; words > 0 */
+__attribute__((section(".text")))
+unsigned int crc32c_words[] = {
+    0xf8408423, /* 1: ldr x3, [x1], #8      */
+    0x9ac35c00, /* crc32cx w0, w0, x3       */
+    0xf1000442, /* subs x2, x2, #1          */
+    0x54ffffa1, /* b.ne 1b                  */
+    0xd65f03c0, /* ret                      */
+};
+
+/* IEEE CRC32 (zlib's): the same extension, the other polynomial */
+__attribute__((section(".text")))
+unsigned int crc32_words[] = {
+    0xf8408423, /* 1: ldr x3, [x1], #8      */
+    0x9ac34c00, /* crc32x w0, w0, x3        */
+    0xf1000442, /* subs x2, x2, #1          */
+    0x54ffffa1, /* b.ne 1b                  */
+    0xd65f03c0, /* ret                      */
+};
+
+/* SHA-256 with the ARMv8 crypto extension: h is the state as
+   hash.c keeps it, k the round constants (all kept in v16-v31),
+   blocks > 0. Each block's words w live in v8-v11, four per
+   register, and sha256su0/su1 extend them four at a time while
+   sha256h/h2 do four rounds on ABCD (v2) and EFGH (v3). */
+__attribute__((section(".text")))
+unsigned int sha256_blocks[] = {
+    0x6dbe27e8, /* stp d8, d9, [sp, #-32]!            */
+    0x6d012fea, /* stp d10, d11, [sp, #16]            */
+    0x4cdf2870, /* ld1 {v16.4s-v19.4s}, [x3], #64     */
+    0x4cdf2874, /* ld1 {v20.4s-v23.4s}, [x3], #64     */
+    0x4cdf2878, /* ld1 {v24.4s-v27.4s}, [x3], #64     */
+    0x4c40287c, /* ld1 {v28.4s-v31.4s}, [x3]          */
+    0x4c40a800, /* ld1 {v0.4s, v1.4s}, [x0]           */
+    0x4cdf2828, /* 1: ld1 {v8.4s-v11.4s}, [x1], #64   */
+    0x6e200908, /* rev32 v8.16b, v8.16b               */
+    0x6e200929, /* rev32 v9.16b, v9.16b               */
+    0x6e20094a, /* rev32 v10.16b, v10.16b             */
+    0x6e20096b, /* rev32 v11.16b, v11.16b             */
+    0x4eb08505, /* add v5.4s, v8.4s, v16.4s           */
+    0x4ea01c02, /* mov v2.16b, v0.16b                 */
+    0x4ea11c23, /* mov v3.16b, v1.16b                 */
+    0x5e282928, /* sha256su0 v8.4s, v9.4s             */
+    0x4ea21c44, /* mov v4.16b, v2.16b                 */
+    0x4eb18526, /* add v6.4s, v9.4s, v17.4s           */
+    0x5e054062, /* sha256h q2, q3, v5.4s              */
+    0x5e055083, /* sha256h2 q3, q4, v5.4s             */
+    0x5e0b6148, /* sha256su1 v8.4s, v10.4s, v11.4s    */
+    0x5e282949, /* sha256su0 v9.4s, v10.4s            */
+    0x4ea21c44, /* mov v4.16b, v2.16b                 */
+    0x4eb28545, /* add v5.4s, v10.4s, v18.4s          */
+    0x5e064062, /* sha256h q2, q3, v6.4s              */
+    0x5e065083, /* sha256h2 q3, q4, v6.4s             */
+    0x5e086169, /* sha256su1 v9.4s, v11.4s, v8.4s     */
+    0x5e28296a, /* sha256su0 v10.4s, v11.4s           */
+    0x4ea21c44, /* mov v4.16b, v2.16b                 */
+    0x4eb38566, /* add v6.4s, v11.4s, v19.4s          */
+    0x5e054062, /* sha256h q2, q3, v5.4s              */
+    0x5e055083, /* sha256h2 q3, q4, v5.4s             */
+    0x5e09610a, /* sha256su1 v10.4s, v8.4s, v9.4s     */
+    0x5e28290b, /* sha256su0 v11.4s, v8.4s            */
+    0x4ea21c44, /* mov v4.16b, v2.16b                 */
+    0x4eb48505, /* add v5.4s, v8.4s, v20.4s           */
+    0x5e064062, /* sha256h q2, q3, v6.4s              */
+    0x5e065083, /* sha256h2 q3, q4, v6.4s             */
+    0x5e0a612b, /* sha256su1 v11.4s, v9.4s, v10.4s    */
+    0x5e282928, /* sha256su0 v8.4s, v9.4s             */
+    0x4ea21c44, /* mov v4.16b, v2.16b                 */
+    0x4eb58526, /* add v6.4s, v9.4s, v21.4s           */
+    0x5e054062, /* sha256h q2, q3, v5.4s              */
+    0x5e055083, /* sha256h2 q3, q4, v5.4s             */
+    0x5e0b6148, /* sha256su1 v8.4s, v10.4s, v11.4s    */
+    0x5e282949, /* sha256su0 v9.4s, v10.4s            */
+    0x4ea21c44, /* mov v4.16b, v2.16b                 */
+    0x4eb68545, /* add v5.4s, v10.4s, v22.4s          */
+    0x5e064062, /* sha256h q2, q3, v6.4s              */
+    0x5e065083, /* sha256h2 q3, q4, v6.4s             */
+    0x5e086169, /* sha256su1 v9.4s, v11.4s, v8.4s     */
+    0x5e28296a, /* sha256su0 v10.4s, v11.4s           */
+    0x4ea21c44, /* mov v4.16b, v2.16b                 */
+    0x4eb78566, /* add v6.4s, v11.4s, v23.4s          */
+    0x5e054062, /* sha256h q2, q3, v5.4s              */
+    0x5e055083, /* sha256h2 q3, q4, v5.4s             */
+    0x5e09610a, /* sha256su1 v10.4s, v8.4s, v9.4s     */
+    0x5e28290b, /* sha256su0 v11.4s, v8.4s            */
+    0x4ea21c44, /* mov v4.16b, v2.16b                 */
+    0x4eb88505, /* add v5.4s, v8.4s, v24.4s           */
+    0x5e064062, /* sha256h q2, q3, v6.4s              */
+    0x5e065083, /* sha256h2 q3, q4, v6.4s             */
+    0x5e0a612b, /* sha256su1 v11.4s, v9.4s, v10.4s    */
+    0x5e282928, /* sha256su0 v8.4s, v9.4s             */
+    0x4ea21c44, /* mov v4.16b, v2.16b                 */
+    0x4eb98526, /* add v6.4s, v9.4s, v25.4s           */
+    0x5e054062, /* sha256h q2, q3, v5.4s              */
+    0x5e055083, /* sha256h2 q3, q4, v5.4s             */
+    0x5e0b6148, /* sha256su1 v8.4s, v10.4s, v11.4s    */
+    0x5e282949, /* sha256su0 v9.4s, v10.4s            */
+    0x4ea21c44, /* mov v4.16b, v2.16b                 */
+    0x4eba8545, /* add v5.4s, v10.4s, v26.4s          */
+    0x5e064062, /* sha256h q2, q3, v6.4s              */
+    0x5e065083, /* sha256h2 q3, q4, v6.4s             */
+    0x5e086169, /* sha256su1 v9.4s, v11.4s, v8.4s     */
+    0x5e28296a, /* sha256su0 v10.4s, v11.4s           */
+    0x4ea21c44, /* mov v4.16b, v2.16b                 */
+    0x4ebb8566, /* add v6.4s, v11.4s, v27.4s          */
+    0x5e054062, /* sha256h q2, q3, v5.4s              */
+    0x5e055083, /* sha256h2 q3, q4, v5.4s             */
+    0x5e09610a, /* sha256su1 v10.4s, v8.4s, v9.4s     */
+    0x5e28290b, /* sha256su0 v11.4s, v8.4s            */
+    0x4ea21c44, /* mov v4.16b, v2.16b                 */
+    0x4ebc8505, /* add v5.4s, v8.4s, v28.4s           */
+    0x5e064062, /* sha256h q2, q3, v6.4s              */
+    0x5e065083, /* sha256h2 q3, q4, v6.4s             */
+    0x5e0a612b, /* sha256su1 v11.4s, v9.4s, v10.4s    */
+    0x4ea21c44, /* mov v4.16b, v2.16b                 */
+    0x4ebd8526, /* add v6.4s, v9.4s, v29.4s           */
+    0x5e054062, /* sha256h q2, q3, v5.4s              */
+    0x5e055083, /* sha256h2 q3, q4, v5.4s             */
+    0x4ea21c44, /* mov v4.16b, v2.16b                 */
+    0x4ebe8545, /* add v5.4s, v10.4s, v30.4s          */
+    0x5e064062, /* sha256h q2, q3, v6.4s              */
+    0x5e065083, /* sha256h2 q3, q4, v6.4s             */
+    0x4ea21c44, /* mov v4.16b, v2.16b                 */
+    0x4ebf8566, /* add v6.4s, v11.4s, v31.4s          */
+    0x5e054062, /* sha256h q2, q3, v5.4s              */
+    0x5e055083, /* sha256h2 q3, q4, v5.4s             */
+    0x4ea21c44, /* mov v4.16b, v2.16b                 */
+    0x5e064062, /* sha256h q2, q3, v6.4s              */
+    0x5e065083, /* sha256h2 q3, q4, v6.4s             */
+    0x4ea28400, /* add v0.4s, v0.4s, v2.4s            */
+    0x4ea38421, /* add v1.4s, v1.4s, v3.4s            */
+    0xf1000442, /* subs x2, x2, #1                    */
+    0x54fff3c1, /* b.ne 1b                            */
+    0x4c00a800, /* st1 {v0.4s, v1.4s}, [x0]           */
+    0x6d412fea, /* ldp d10, d11, [sp, #16]            */
+    0x6cc227e8, /* ldp d8, d9, [sp], #32              */
+    0xd65f03c0, /* ret                                */
+};
+
+/* ---- ID registers for cpu.c, readable at EL1 and EL2 ---- */
+
+__attribute__((section(".text")))
+unsigned int cpu_id_pfr0[] = {
+    0xd5380400, /* mrs x0, ID_AA64PFR0_EL1  */
+    0xd65f03c0, /* ret                      */
+};
+
+__attribute__((section(".text")))
+unsigned int cpu_id_isar0[] = {
+    0xd5380600, /* mrs x0, ID_AA64ISAR0_EL1 */
+    0xd65f03c0, /* ret                      */
+};
+
+__attribute__((section(".text")))
+unsigned int cpu_id_midr[] = {
+    0xd5380000, /* mrs x0, MIDR_EL1         */
+    0xd65f03c0, /* ret                      */
+};
+
+/* ---- Array kernels for vec.c ----
+ * Each takes whole 32-byte blocks (eight elements), blocks > 0, and
+ * leaves the lanes for vec.c to fold: two accumulators, one for the
+ * first four elements of every block and one for the last four. */
+
+__attribute__((section(".text")))
+unsigned int vec_sum_i32_blocks[] = {
+    0x6f00e400, /* movi v0.2d, #0                   */
+    0x6f00e401, /* movi v1.2d, #0                   */
+    0x4cdfa822, /* 1: ld1 {v2.4s, v3.4s}, [x1], #32 */
+    0x4ea06840, /* sadalp v0.2d, v2.4s              */
+    0x4ea06861, /* sadalp v1.2d, v3.4s              */
+    0xf1000442, /* subs x2, x2, #1                  */
+    0x54ffff81, /* b.ne 1b                          */
+    0x4ee18400, /* add v0.2d, v0.2d, v1.2d          */
+    0x4c007c00, /* st1 {v0.2d}, [x0]                */
+    0xd65f03c0, /* ret                              */
+};
+
+__attribute__((section(".text")))
+unsigned int vec_min_i32_blocks[] = {
+    0x4cdfa820, /* ld1 {v0.4s, v1.4s}, [x1], #32    */
+    0xf1000442, /* subs x2, x2, #1                  */
+    0x540000c0, /* b.eq 2f                          */
+    0x4cdfa822, /* 1: ld1 {v2.4s, v3.4s}, [x1], #32 */
+    0x4ea26c00, /* smin v0.4s, v0.4s, v2.4s         */
+    0x4ea36c21, /* smin v1.4s, v1.4s, v3.4s         */
+    0xf1000442, /* subs x2, x2, #1                  */
+    0x54ffff81, /* b.ne 1b                          */
+    0x4ea16c00, /* 2: smin v0.4s, v0.4s, v1.4s      */
+    0x4c007800, /* st1 {v0.4s}, [x0]                */
+    0xd65f03c0, /* ret                              */
+};
+
+__attribute__((section(".text")))
+unsigned int vec_max_i32_blocks[] = {
+    0x4cdfa820, /* ld1 {v0.4s, v1.4s}, [x1], #32    */
+    0xf1000442, /* subs x2, x2, #1                  */
+    0x540000c0, /* b.eq 2f                          */
+    0x4cdfa822, /* 1: ld1 {v2.4s, v3.4s}, [x1], #32 */
+    0x4ea26400, /* smax v0.4s, v0.4s, v2.4s         */
+    0x4ea36421, /* smax v1.4s, v1.4s, v3.4s         */
+    0xf1000442, /* subs x2, x2, #1                  */
+    0x54ffff81, /* b.ne 1b                          */
+    0x4ea16400, /* 2: smax v0.4s, v0.4s, v1.4s      */
+    0x4c007800, /* st1 {v0.4s}, [x0]                */
+    0xd65f03c0, /* ret                              */
+};
+
+__attribute__((section(".text")))
+unsigned int vec_dot_i32_blocks[] = {
+    0x6f00e400, /* movi v0.2d, #0                   */
+    0x6f00e401, /* movi v1.2d, #0                   */
+    0x4cdfa822, /* 1: ld1 {v2.4s, v3.4s}, [x1], #32 */
+    0x4cdfa844, /* ld1 {v4.4s, v5.4s}, [x2], #32    */
+    0x0ea48040, /* smlal v0.2d, v2.2s, v4.2s        */
+    0x4ea48041, /* smlal2 v1.2d, v2.4s, v4.4s       */
+    0x0ea58060, /* smlal v0.2d, v3.2s, v5.2s        */
+    0x4ea58061, /* smlal2 v1.2d, v3.4s, v5.4s       */
+    0xf1000463, /* subs x3, x3, #1                  */
+    0x54ffff21, /* b.ne 1b                          */
+    0x4ee18400, /* add v0.2d, v0.2d, v1.2d          */
+    0x4c007c00, /* st1 {v0.2d}, [x0]                */
+    0xd65f03c0, /* ret                              */
+};
+
+__attribute__((section(".text")))
+unsigned int vec_sum_f32_blocks[] = {
+    0x6f00e400, /* movi v0.2d, #0                   */
+    0x6f00e401, /* movi v1.2d, #0                   */
+    0x4cdfa822, /* 1: ld1 {v2.4s, v3.4s}, [x1], #32 */
+    0x4e22d400, /* fadd v0.4s, v0.4s, v2.4s         */
+    0x4e23d421, /* fadd v1.4s, v1.4s, v3.4s         */
+    0xf1000442, /* subs x2, x2, #1                  */
+    0x54ffff81, /* b.ne 1b                          */
+    0x4e21d400, /* fadd v0.4s, v0.4s, v1.4s         */
+    0x4c007800, /* st1 {v0.4s}, [x0]                */
+    0xd65f03c0, /* ret                              */
+};
+
+__attribute__((section(".text")))
+unsigned int vec_min_f32_blocks[] = {
+    0x4cdfa820, /* ld1 {v0.4s, v1.4s}, [x1], #32    */
+    0xf1000442, /* subs x2, x2, #1                  */
+    0x540000c0, /* b.eq 2f                          */
+    0x4cdfa822, /* 1: ld1 {v2.4s, v3.4s}, [x1], #32 */
+    0x4ea2f400, /* fmin v0.4s, v0.4s, v2.4s         */
+    0x4ea3f421, /* fmin v1.4s, v1.4s, v3.4s         */
+    0xf1000442, /* subs x2, x2, #1                  */
+    0x54ffff81, /* b.ne 1b                          */
+    0x4ea1f400, /* 2: fmin v0.4s, v0.4s, v1.4s      */
+    0x4c007800, /* st1 {v0.4s}, [x0]                */
+    0xd65f03c0, /* ret                              */
+};
+
+__attribute__((section(".text")))
+unsigned int vec_max_f32_blocks[] = {
+    0x4cdfa820, /* ld1 {v0.4s, v1.4s}, [x1], #32    */
+    0xf1000442, /* subs x2, x2, #1                  */
+    0x540000c0, /* b.eq 2f                          */
+    0x4cdfa822, /* 1: ld1 {v2.4s, v3.4s}, [x1], #32 */
+    0x4e22f400, /* fmax v0.4s, v0.4s, v2.4s         */
+    0x4e23f421, /* fmax v1.4s, v1.4s, v3.4s         */
+    0xf1000442, /* subs x2, x2, #1                  */
+    0x54ffff81, /* b.ne 1b                          */
+    0x4e21f400, /* 2: fmax v0.4s, v0.4s, v1.4s      */
+    0x4c007800, /* st1 {v0.4s}, [x0]                */
+    0xd65f03c0, /* ret                              */
+};
+
+/* fmul then fadd rather than fmla, rounding as SSE2 does */
+__attribute__((section(".text")))
+unsigned int vec_dot_f32_blocks[] = {
+    0x6f00e400, /* movi v0.2d, #0                   */
+    0x6f00e401, /* movi v1.2d, #0                   */
+    0x4cdfa822, /* 1: ld1 {v2.4s, v3.4s}, [x1], #32 */
+    0x4cdfa844, /* ld1 {v4.4s, v5.4s}, [x2], #32    */
+    0x6e24dc42, /* fmul v2.4s, v2.4s, v4.4s         */
+    0x6e25dc63, /* fmul v3.4s, v3.4s, v5.4s         */
+    0x4e22d400, /* fadd v0.4s, v0.4s, v2.4s         */
+    0x4e23d421, /* fadd v1.4s, v1.4s, v3.4s         */
+    0xf1000463, /* subs x3, x3, #1                  */
+    0x54ffff21, /* b.ne 1b                          */
+    0x4e21d400, /* fadd v0.4s, v0.4s, v1.4s         */
+    0x4c007800, /* st1 {v0.4s}, [x0]                */
+    0xd65f03c0, /* ret                              */
+};
+
+/* dst ^= src; dst 16-byte aligned */
+__attribute__((section(".text")))
+unsigned int vec_xor_blocks[] = {
+    0x4c40a000, /* 1: ld1 {v0.16b, v1.16b}, [x0]   */
+    0x4cdfa022, /* ld1 {v2.16b, v3.16b}, [x1], #32 */
+    0x6e221c00, /* eor v0.16b, v0.16b, v2.16b      */
+    0x6e231c21, /* eor v1.16b, v1.16b, v3.16b      */
+    0x4c9fa000, /* st1 {v0.16b, v1.16b}, [x0], #32 */
+    0xf1000442, /* subs x2, x2, #1                 */
+    0x54ffff41, /* b.ne 1b                         */
+    0xd65f03c0, /* ret                             */
+};
+
+/* Index of the first block at p holding byte c, or blocks */
+__attribute__((section(".text")))
+unsigned int vec_find_blocks[] = {
+    0x4e010c40, /* dup v0.16b, w2                     */
+    0xaa0003e3, /* mov x3, x0                         */
+    0xd2800000, /* mov x0, #0                         */
+    0x4cdfa061, /* 1: ld1 {v1.16b, v2.16b}, [x3], #32 */
+    0x6e208c21, /* cmeq v1.16b, v1.16b, v0.16b        */
+    0x6e208c42, /* cmeq v2.16b, v2.16b, v0.16b        */
+    0x4ea21c21, /* orr v1.16b, v1.16b, v2.16b         */
+    0x6e30a821, /* umaxv b1, v1.16b                   */
+    0x1e260024, /* fmov w4, s1                        */
+    0x35000084, /* cbnz w4, 2f                        */
+    0x91000400, /* add x0, x0, #1                     */
+    0xeb01001f, /* cmp x0, x1                         */
+    0x54fffee3, /* b.lo 1b                            */
+    0xd65f03c0, /* 2: ret                             */
+};
+
+/* Four pixels a step, dst 16-byte aligned: each byte becomes
+   (s*a + d*(255-a)) / 255 rounded, a (the src top byte) spread to all
+   four by the multiply with v7; urshr and raddhn make the division
+   (t + 128 + (t + 128 >> 8)) >> 8. */
+__attribute__((section(".text")))
+unsigned int vec_blend_blocks[] = {
+    0x4f00e427, /* movi v7.16b, #1              */
+    0xd37ff842, /* lsl x2, x2, #1               */
+    0x4cdf7020, /* 1: ld1 {v0.16b}, [x1], #16   */
+    0x4c407001, /* ld1 {v1.16b}, [x0]           */
+    0x6f280402, /* ushr v2.4s, v0.4s, #24       */
+    0x4ea79c42, /* mul v2.4s, v2.4s, v7.4s      */
+    0x6e205843, /* mvn v3.16b, v2.16b           */
+    0x2e22c004, /* umull v4.8h, v0.8b, v2.8b    */
+    0x2e238024, /* umlal v4.8h, v1.8b, v3.8b    */
+    0x6e22c005, /* umull2 v5.8h, v0.16b, v2.16b */
+    0x6e238025, /* umlal2 v5.8h, v1.16b, v3.16b */
+    0x6f182482, /* urshr v2.8h, v4.8h, #8       */
+    0x6f1824a3, /* urshr v3.8h, v5.8h, #8       */
+    0x2e224080, /* raddhn v0.8b, v4.8h, v2.8h   */
+    0x6e2340a0, /* raddhn2 v0.16b, v5.8h, v3.8h */
+    0x4c9f7000, /* st1 {v0.16b}, [x0], #16      */
+    0xf1000442, /* subs x2, x2, #1              */
+    0x54fffe21, /* b.ne 1b                      */
+    0xd65f03c0, /* ret                          */
+};
+
+/* ---- Memory test and bandwidth kernels for memtest.c ----
+ * Whole 64-byte blocks, blocks > 0. mt_stream64, mt_stream_copy64
+ * and mt_addr64 store with stnp, the non-temporal hint, so a write is
+ * timed as it reaches memory. The checks return the index of the
+ * first block that is not as expected (blocks if all are), and
+ * mt_swap64 steps by x4 (+64 or -64), for the moving inversions. */
+
+__attribute__((section(".text")))
+unsigned int mt_stream64[] = {
+    0x3dc00020, /* ldr q0, [x1]           */
+    0xac000000, /* 1: stnp q0, q0, [x0]   */
+    0xac010000, /* stnp q0, q0, [x0, #32] */
+    0x91010000, /* add x0, x0, #64        */
+    0xf1000442, /* subs x2, x2, #1        */
+    0x54ffff81, /* b.ne 1b                */
+    0xd65f03c0, /* ret                    */
+};
+
+__attribute__((section(".text")))
+unsigned int mt_stream_copy64[] = {
+    0xad400420, /* 1: ldp q0, q1, [x1]    */
+    0xad410c22, /* ldp q2, q3, [x1, #32]  */
+    0x91010021, /* add x1, x1, #64        */
+    0xac000400, /* stnp q0, q1, [x0]      */
+    0xac010c02, /* stnp q2, q3, [x0, #32] */
+    0x91010000, /* add x0, x0, #64        */
+    0xf1000442, /* subs x2, x2, #1        */
+    0x54ffff21, /* b.ne 1b                */
+    0xd65f03c0, /* ret                    */
+};
+
+__attribute__((section(".text")))
+unsigned int mt_read64[] = {
+    0x6f00e400, /* movi v0.2d, #0             */
+    0x6f00e401, /* movi v1.2d, #0             */
+    0xad400c02, /* 1: ldp q2, q3, [x0]        */
+    0xad411404, /* ldp q4, q5, [x0, #32]      */
+    0x91010000, /* add x0, x0, #64            */
+    0x6e221c00, /* eor v0.16b, v0.16b, v2.16b */
+    0x6e231c21, /* eor v1.16b, v1.16b, v3.16b */
+    0x6e241c00, /* eor v0.16b, v0.16b, v4.16b */
+    0x6e251c21, /* eor v1.16b, v1.16b, v5.16b */
+    0xf1000421, /* subs x1, x1, #1            */
+    0x54ffff01, /* b.ne 1b                    */
+    0x6e211c00, /* eor v0.16b, v0.16b, v1.16b */
+    0x6e004001, /* ext v1.16b, v0.16b, v0.16b, #8 */
+    0x2e211c00, /* eor v0.8b, v0.8b, v1.8b    */
+    0x9e660000, /* fmov x0, d0                */
+    0xd65f03c0, /* ret                        */
+};
+
+__attribute__((section(".text")))
+unsigned int mt_check64[] = {
+    0xaa0003e3, /* mov x3, x0                 */
+    0xd2800000, /* mov x0, #0                 */
+    0x3dc00024, /* ldr q4, [x1]               */
+    0xad400460, /* 1: ldp q0, q1, [x3]        */
+    0xad410c62, /* ldp q2, q3, [x3, #32]      */
+    0x6e241c00, /* eor v0.16b, v0.16b, v4.16b */
+    0x6e241c21, /* eor v1.16b, v1.16b, v4.16b */
+    0x6e241c42, /* eor v2.16b, v2.16b, v4.16b */
+    0x6e241c63, /* eor v3.16b, v3.16b, v4.16b */
+    0x4ea11c00, /* orr v0.16b, v0.16b, v1.16b */
+    0x4ea31c42, /* orr v2.16b, v2.16b, v3.16b */
+    0x4ea21c00, /* orr v0.16b, v0.16b, v2.16b */
+    0x6eb0a800, /* umaxv s0, v0.4s            */
+    0x1e260004, /* fmov w4, s0                */
+    0x350000a4, /* cbnz w4, 2f                */
+    0x91010063, /* add x3, x3, #64            */
+    0x91000400, /* add x0, x0, #1             */
+    0xeb02001f, /* cmp x0, x2                 */
+    0x54fffe23, /* b.lo 1b                    */
+    0xd65f03c0, /* 2: ret                     */
+};
+
+__attribute__((section(".text")))
+unsigned int mt_swap64[] = {
+    0xaa0003e5, /* mov x5, x0                 */
+    0xd2800000, /* mov x0, #0                 */
+    0x3dc00024, /* ldr q4, [x1]               */
+    0x3dc00045, /* ldr q5, [x2]               */
+    0xad4004a0, /* 1: ldp q0, q1, [x5]        */
+    0xad410ca2, /* ldp q2, q3, [x5, #32]      */
+    0x6e241c00, /* eor v0.16b, v0.16b, v4.16b */
+    0x6e241c21, /* eor v1.16b, v1.16b, v4.16b */
+    0x6e241c42, /* eor v2.16b, v2.16b, v4.16b */
+    0x6e241c63, /* eor v3.16b, v3.16b, v4.16b */
+    0x4ea11c00, /* orr v0.16b, v0.16b, v1.16b */
+    0x4ea31c42, /* orr v2.16b, v2.16b, v3.16b */
+    0x4ea21c00, /* orr v0.16b, v0.16b, v2.16b */
+    0x6eb0a800, /* umaxv s0, v0.4s            */
+    0x1e260006, /* fmov w6, s0                */
+    0x350000e6, /* cbnz w6, 2f                */
+    0xad0014a5, /* stp q5, q5, [x5]           */
+    0xad0114a5, /* stp q5, q5, [x5, #32]      */
+    0x8b0400a5, /* add x5, x5, x4             */
+    0x91000400, /* add x0, x0, #1             */
+    0xeb03001f, /* cmp x0, x3                 */
+    0x54fffde3, /* b.lo 1b                    */
+    0xd65f03c0, /* 2: ret                     */
+};
+
+__attribute__((section(".text")))
+unsigned int mt_addr64[] = {
+    0x4e080c42, /* dup v2.2d, x2                 */
+    0x91002004, /* add x4, x0, #8                */
+    0x9e670000, /* fmov d0, x0                   */
+    0x4e181c80, /* mov v0.d[1], x4               */
+    0xd2800204, /* mov x4, #16                   */
+    0x4e080c83, /* dup v3.2d, x4                 */
+    0x6e221c01, /* 1: eor v1.16b, v0.16b, v2.16b */
+    0x4ee38400, /* add v0.2d, v0.2d, v3.2d       */
+    0x6e221c04, /* eor v4.16b, v0.16b, v2.16b    */
+    0x4ee38400, /* add v0.2d, v0.2d, v3.2d       */
+    0x6e221c05, /* eor v5.16b, v0.16b, v2.16b    */
+    0x4ee38400, /* add v0.2d, v0.2d, v3.2d       */
+    0x6e221c06, /* eor v6.16b, v0.16b, v2.16b    */
+    0x4ee38400, /* add v0.2d, v0.2d, v3.2d       */
+    0xac001001, /* stnp q1, q4, [x0]             */
+    0xac011805, /* stnp q5, q6, [x0, #32]        */
+    0x91010000, /* add x0, x0, #64               */
+    0xf1000421, /* subs x1, x1, #1               */
+    0x54fffe81, /* b.ne 1b                       */
+    0xd65f03c0, /* ret                           */
+};
+
+__attribute__((section(".text")))
+unsigned int mt_addr_check64[] = {
+    0xaa0003e5, /* mov x5, x0                 */
+    0xd2800000, /* mov x0, #0                 */
+    0x4e080c42, /* dup v2.2d, x2              */
+    0x910020a4, /* add x4, x5, #8             */
+    0x9e6700a0, /* fmov d0, x5                */
+    0x4e181c80, /* mov v0.d[1], x4            */
+    0xd2800204, /* mov x4, #16                */
+    0x4e080c83, /* dup v3.2d, x4              */
+    0xad4014a4, /* 1: ldp q4, q5, [x5]        */
+    0xad411ca6, /* ldp q6, q7, [x5, #32]      */
+    0x6e221c01, /* eor v1.16b, v0.16b, v2.16b */
+    0x6e211c84, /* eor v4.16b, v4.16b, v1.16b */
+    0x4ee38400, /* add v0.2d, v0.2d, v3.2d    */
+    0x6e221c01, /* eor v1.16b, v0.16b, v2.16b */
+    0x6e211ca5, /* eor v5.16b, v5.16b, v1.16b */
+    0x4ee38400, /* add v0.2d, v0.2d, v3.2d    */
+    0x6e221c01, /* eor v1.16b, v0.16b, v2.16b */
+    0x6e211cc6, /* eor v6.16b, v6.16b, v1.16b */
+    0x4ee38400, /* add v0.2d, v0.2d, v3.2d    */
+    0x6e221c01, /* eor v1.16b, v0.16b, v2.16b */
+    0x6e211ce7, /* eor v7.16b, v7.16b, v1.16b */
+    0x4ee38400, /* add v0.2d, v0.2d, v3.2d    */
+    0x4ea51c84, /* orr v4.16b, v4.16b, v5.16b */
+    0x4ea71cc6, /* orr v6.16b, v6.16b, v7.16b */
+    0x4ea61c84, /* orr v4.16b, v4.16b, v6.16b */
+    0x6eb0a884, /* umaxv s4, v4.4s            */
+    0x1e260086, /* fmov w6, s4                */
+    0x350000a6, /* cbnz w6, 2f                */
+    0x910100a5, /* add x5, x5, #64            */
+    0x91000400, /* add x0, x0, #1             */
+    0xeb01001f, /* cmp x0, x1                 */
+    0x54fffd23, /* b.lo 1b                    */
+    0xd65f03c0, /* 2: ret                     */
+};
+
+/* Latency: follow the pointer chain from x0 for x1 rounds of eight
+   dependent loads; returns where it ended */
+__attribute__((section(".text")))
+unsigned int mt_chase[] = {
+    0xf9400000, /* 1: ldr x0, [x0] */
+    0xf9400000, /* ldr x0, [x0]    */
+    0xf9400000, /* ldr x0, [x0]    */
+    0xf9400000, /* ldr x0, [x0]    */
+    0xf9400000, /* ldr x0, [x0]    */
+    0xf9400000, /* ldr x0, [x0]    */
+    0xf9400000, /* ldr x0, [x0]    */
+    0xf9400000, /* ldr x0, [x0]    */
+    0xf1000421, /* subs x1, x1, #1 */
+    0x54fffee1, /* b.ne 1b         */
+    0xd65f03c0, /* ret             */
+};
+
+/* libm.c's square roots: the instruction rounds correctly */
+__attribute__((section(".text")))
+unsigned int sqrt[] = {
+    0x1e61c000, /* fsqrt d0, d0 */
+    0xd65f03c0, /* ret          */
+};
+
+__attribute__((section(".text")))
+unsigned int sqrtf[] = {
+    0x1e21c000, /* fsqrt s0, s0 */
+    0xd65f03c0, /* ret          */
+};
+
+/* sdmmc.c's DMA buffers: write back (clean), or write back and
+   invalidate (flush), every data cache line over [p, p + len), then
+   wait for it to complete. The line size comes from CTR_EL0.DminLine. */
+#define DCACHE_RANGE(op) \
+    0xd53b0022, /* mrs x2, CTR_EL0          */ \
+    0xd3504c42, /* ubfx x2, x2, #16, #4     */ \
+    0xd2800083, /* mov x3, #4               */ \
+    0x9ac22063, /* lsl x3, x3, x2           */ \
+    0xd1000464, /* sub x4, x3, #1           */ \
+    0x8b010001, /* add x1, x0, x1           */ \
+    0x8a240000, /* bic x0, x0, x4           */ \
+    op,         /* 1: dc <op>, x0           */ \
+    0x8b030000, /* add x0, x0, x3           */ \
+    0xeb01001f, /* cmp x0, x1               */ \
+    0x54ffffa3, /* b.lo 1b                  */ \
+    0xd5033f9f, /* dsb sy                   */ \
+    0xd65f03c0  /* ret                      */
+
+__attribute__((section(".text")))
+unsigned int dcache_clean[] = {
+    DCACHE_RANGE(0xd50b7a20 /* dc cvac, x0 */)
+};
+
+__attribute__((section(".text")))
+unsigned int dcache_flush[] = {
+    DCACHE_RANGE(0xd50b7e20 /* dc civac, x0 */)
+};
@@ -0,0 +1,761 @@
+/*
+ * memtest.c — Memory bandwidth, latency and a RAM pattern test
+ *
+ * See memtest.h. The inner loops are memops_<arch> kernels over whole
+ * 64-byte blocks, picked when the CPU has SIMD (cpu.h), with plain C
+ * versions otherwise; the test's checks only say which block differs,
+ * and the word, what it should have held and the bits that flipped are
+ * found here. Work is cut into MT_CHUNK pieces queued to the worker
+ * pool, every core taking the next, and each step of a pass finishes
+ * over all of memory before the next starts, as memtest86 does, so an
+ * address line fault between far-apart pages is still caught.
+ */
+
+#include "memtest.h"
+#include "fb.h"
+#include "kbd.h"
+#include "mem.h"
+#include "mp.h"
+#include "cpu.h"
+#include "progress.h"
+#include "timer.h"
+#include "shim.h"
+
+#define MB (1024ULL * 1024)
+
+#define MT_BLOCK      64                /* bytes a kernel step covers */
+#define MT_BENCH_BUF  (256 * MB)        /* far past any last-level cache */
+#define MT_BENCH_MS   1000              /* per bandwidth test */
+#define MT_LAT_MS     100               /* per latency working set */
+#define MT_LAT_MIN    (16 * 1024)
+#define MT_CHUNK      (64 * MB)         /* one job of a test step */
+#define MT_LOW        MB                /* below this, left to the firmware */
+#define MT_RESERVE    (64 * MB)         /* free memory left for the firmware */
+#define MT_MIN_RANGE  (64 * 1024)       /* smaller free ranges are skipped */
+#define MT_REGIONS    128
+#define MT_LOG        8                 /* errors a job keeps in detail */
+#define MT_SHOW       24                /* errors listed on screen */
+
+#define MT_CSV_HEADER "date,test,cores,size_kb,pass,mb_s,ns,errors\r\n"
+
+/* ---- Kernels ---- */
+
+#if defined(__aarch64__) || defined(__x86_64__)
+#define HAVE_MT_KERNELS 1
+void   mt_stream64(void *dst, const void *pattern16, UINTN blocks);
+void   mt_stream_copy64(void *dst, const void *src, UINTN blocks);
+UINT64 mt_read64(const void *p, UINTN blocks);
+UINTN  mt_check64(const void *p, const void *pattern16, UINTN blocks);
+UINTN  mt_swap64(void *p, const void *expect16, const void *store16,
+                 UINTN blocks, INTN step);
+void   mt_addr64(void *p, UINTN blocks, UINT64 x);
+UINTN  mt_addr_check64(const void *p, UINTN blocks, UINT64 x);
+void  *mt_chase(void *p, UINTN rounds);
+#endif
+
+/* The same in C: each 16-byte pattern is two words, alternating */
+static void c_stream64(void *dst, const void *pattern16, UINTN blocks) {
+    const UINT64 *pat = (const UINT64 *)pattern16;
+    UINT64 *w = (UINT64 *)dst;
+    for (UINTN i = 0; i < blocks * 8; i += 2) {
+        w[i] = pat[0];
+        w[i + 1] = pat[1];
+    }
+}
+
+static void c_stream_copy64(void *dst, const void *src, UINTN blocks) {
+    mem_copy(dst, src, blocks * MT_BLOCK);
+}
+
+static UINT64 c_read64(const void *p, UINTN blocks) {
+    const UINT64 *w = (const UINT64 *)p;
+    UINT64 x = 0;
+    for (UINTN i = 0; i < blocks * 8; i++)
+        x ^= w[i];
+    return x;
+}
+
+static int c_block_is(const UINT64 *w, const UINT64 *pat) {
+    for (int i = 0; i < 8; i++)
+        if (w[i] != pat[i & 1]) return 0;
+    return 1;
+}
+
+static UINTN c_check64(const void *p, const void *pattern16, UINTN blocks) {
+    const UINT64 *w = (const UINT64 *)p;
+    for (UINTN b = 0; b < blocks; b++, w += 8)
+        if (!c_block_is(w, (const UINT64 *)pattern16)) return b;
+    return blocks;
+}
+
+static UINTN c_swap64(void *p, const void *expect16, const void *store16,
+                      UINTN blocks, INTN step) {
+    const UINT64 *to = (const UINT64 *)store16;
+    UINT8 *q = (UINT8 *)p;
+    for (UINTN b = 0; b < blocks; b++, q += step) {
+        UINT64 *w = (UINT64 *)q;
+        if (!c_block_is(w, (const UINT64 *)expect16)) return b;
+        for (int i = 0; i < 8; i++) w[i] = to[i & 1];
+    }
+    return blocks;
+}
+
+static void c_addr64(void *p, UINTN blocks, UINT64 x) {
+    UINT64 *w = (UINT64 *)p;
+    for (UINTN i = 0; i < blocks * 8; i++)
+        w[i] = (UINT64)(UINTN)&w[i] ^ x;
+}
+
+static UINTN c_addr_check64(const void *p, UINTN blocks, UINT64 x) {
+    const UINT64 *w = (const UINT64 *)p;
+    for (UINTN i = 0; i < blocks * 8; i++)
+        if (w[i] != ((UINT64)(UINTN)&w[i] ^ x)) return i / 8;
+    return blocks;
+}
+
+static void *c_chase(void *p, UINTN rounds) {
+    void **q = (void **)p;
+    while (rounds--)
+        for (int i = 0; i < 8; i++) q = (void **)*q;
+    return q;
+}
+
+static struct {
+    void   (*stream)(void *dst, const void *pattern16, UINTN blocks);
+    void   (*stream_copy)(void *dst, const void *src, UINTN blocks);
+    UINT64 (*read)(const void *p, UINTN blocks);
+    UINTN  (*check)(const void *p, const void *pattern16, UINTN blocks);
+    UINTN  (*swap)(void *p, const void *expect16, const void *store16,
+                   UINTN blocks, INTN step);
+    void   (*addr)(void *p, UINTN blocks, UINT64 x);
+    UINTN  (*addr_check)(const void *p, UINTN blocks, UINT64 x);
+    void  *(*chase)(void *p, UINTN rounds);
+    const char *kind;
+} s_mt;
+
+static void mt_pick_kernels(void) {
+    s_mt.stream = c_stream64;
+    s_mt.stream_copy = c_stream_copy64;
+    s_mt.read = c_read64;
+    s_mt.check = c_check64;
+    s_mt.swap = c_swap64;
+    s_mt.addr = c_addr64;
+    s_mt.addr_check = c_addr_check64;
+    s_mt.chase = c_chase;
+    s_mt.kind = "portable C";
+#ifdef HAVE_MT_KERNELS
+    s_mt.chase = mt_chase;
+    if (cpu_has(CPU_SIMD)) {
+        s_mt.stream = mt_stream64;
+        s_mt.stream_copy = mt_stream_copy64;
+        s_mt.read = mt_read64;
+        s_mt.check = mt_check64;
+        s_mt.swap = mt_swap64;
+        s_mt.addr = mt_addr64;
+        s_mt.addr_check = mt_addr_check64;
+#ifdef __x86_64__
+        s_mt.kind = "SSE2, non-temporal stores";
+#else
+        s_mt.kind = "AdvSIMD, non-temporal stores";
+#endif
+    }
+#endif
+}
+
+/* ---- Shared ---- */
+
+/* xorshift64: patterns and chains no prefetcher can predict */
+static UINT64 mt_rand(UINT64 *seed) {
+    UINT64 x = *seed;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *seed = x;
+}
+
+static void mt_header(const char *title) {
+    fb_clear(COLOR_BLACK);
+    g_boot.cursor_x = 0;
+    g_boot.cursor_y = 0;
+    fb_print("\n", COLOR_WHITE);
+    fb_print("  ========================================\n", COLOR_CYAN);
+    fb_print("       ", COLOR_CYAN);
+    fb_print(title, COLOR_CYAN);
+    fb_print("\n  ========================================\n", COLOR_CYAN);
+    fb_print("\n", COLOR_WHITE);
+}
+
+static void mt_done(void) {
+    fb_print("\n  Press any key to return (PgUp/PgDn: scroll)...\n", COLOR_DGRAY);
+    fb_present();
+    struct key_event ev;
+    kbd_wait_scrollback(&ev);
+}
+
+static int mt_key(void) {
+    struct key_event ev;
+    return kbd_poll(&ev);
+}
+
+/* Tenths of a MB per second */
+static UINT64 mt_rate(UINT64 bytes, UINT64 ticks) {
+    UINT64 us = timer_us(ticks);
+    return us ? bytes * 10 * 1000000 / us / MB : 0;
+}
+
+static void mt_csv(const char *rows, UINTN len) {
+    if (len == 0) return;
+    if (progress_append(MEMTEST_CSV, MT_CSV_HEADER, rows, len,
+                        MEMTEST_CSV_MAX) == 0)
+        fb_print("\n  Results appended to \\MEMTEST.CSV on the boot volume.\n",
+                 COLOR_GREEN);
+    else
+        fb_print("\n  Could not save the results.\n", COLOR_RED);
+}
+
+/* One CSV row, dated, onto the text at *len */
+static void mt_row(char *text, UINTN cap, UINTN *len, const char *test,
+                   int cores, UINT64 size_kb, UINT32 pass, UINT64 rate,
+                   UINT64 ps, UINT64 errors) {
+    time_t now = time(NULL);
+    struct tm *t = localtime(&now);
+    int n = snprintf(text + *len, cap - *len,
+        "%04d-%02d-%02d %02d:%02d:%02d,%s,%d,%llu,%u,%llu.%llu,%llu.%03llu,%llu\r\n",
+        t->tm_year + 1900, t->tm_mon + 1, t->tm_mday,
+        t->tm_hour, t->tm_min, t->tm_sec, test, cores,
+        (unsigned long long)size_kb, pass,
+        (unsigned long long)(rate / 10), (unsigned long long)(rate % 10),
+        (unsigned long long)(ps / 1000), (unsigned long long)(ps % 1000),
+        (unsigned long long)errors);
+    if (n > 0 && (UINTN)n < cap - *len)
+        *len += (UINTN)n;
+}
+
+static void *mt_pages(UINT64 size) {
+    EFI_PHYSICAL_ADDRESS addr = 0;
+    if (EFI_ERROR(g_boot.bs->AllocatePages(AllocateAnyPages, EfiLoaderData,
+                                           (UINTN)(size / 4096), &addr)))
+        return NULL;
+    return (void *)(UINTN)addr;
+}
+
+static void mt_pages_free(void *p, UINT64 size) {
+    g_boot.bs->FreePages((EFI_PHYSICAL_ADDRESS)(UINTN)p, (UINTN)(size / 4096));
+}
+
+/* ---- Benchmark ---- */
+
+#define MT_READ  0
+#define MT_WRITE 1
+#define MT_COPY  2
+
+struct mt_bench_job {
+    struct mp_job job;
+    int op;
+    UINT8 *buf;
+    UINTN blocks;               /* per pass; a copy moves half to half */
+    UINT64 deadline;            /* counter value to stop passes at */
+    UINT64 bytes;
+    UINT64 sink;
+};
+
+static void mt_bench_job(void *arg, void *arena) {
+    struct mt_bench_job *j = (struct mt_bench_job *)arg;
+    UINT64 pat[2] = { 0x5A5A5A5A5A5A5A5AULL, 0xA5A5A5A5A5A5A5A5ULL };
+    (void)arena;
+    do {
+        if (j->op == MT_READ) {
+            j->sink ^= s_mt.read(j->buf, j->blocks);
+        } else if (j->op == MT_WRITE) {
+            s_mt.stream(j->buf, pat, j->blocks);
+        } else {
+            UINTN half = j->blocks / 2;
+            s_mt.stream_copy(j->buf + half * MT_BLOCK, j->buf, half);
+        }
+        j->bytes += (j->op == MT_COPY ? j->blocks / 2 : j->blocks) * MT_BLOCK;
+    } while (timer_ticks() < j->deadline);
+}
+
+/* Run op over buf split between jobs cores for MT_BENCH_MS; tenths of
+   a MB per second moved */
+static UINT64 mt_bandwidth(struct mt_bench_job *jobs, int cores, int op,
+                           UINT8 *buf, UINT64 size) {
+    UINTN per = (UINTN)(size / MT_BLOCK / (UINT64)cores) & ~(UINTN)1;
+    UINT64 t0 = timer_ticks();
+    UINT64 deadline = t0 + timer_hz() * MT_BENCH_MS / 1000;
+    for (int i = 0; i < cores; i++) {
+        struct mt_bench_job *j = &jobs[i];
+        mem_set(j, 0, sizeof(*j));
+        j->op = op;
+        j->buf = buf + (UINTN)i * per * MT_BLOCK;
+        j->blocks = per;
+        j->deadline = deadline;
+    }
+    if (cores == 1) {
+        mt_bench_job(&jobs[0], NULL);
+    } else {
+        for (int i = 0; i < cores; i++)
+            mp_submit(&jobs[i].job, mt_bench_job, &jobs[i]);
+        for (int i = 0; i < cores; i++)
+            mp_wait(&jobs[i].job);
+    }
+    UINT64 ticks = timer_ticks() - t0, bytes = 0;
+    for (int i = 0; i < cores; i++)
+        bytes += jobs[i].bytes;
+    return mt_rate(bytes, ticks);
+}
+
+/* Picoseconds per load along a random cycle through size bytes, one
+   pointer per cache line (Sattolo's shuffle makes it a single cycle) */
+static UINT64 mt_latency(UINT8 *buf, UINTN size, UINT64 *seed) {
+    UINTN n = size / MT_BLOCK;
+    for (UINTN i = 0; i < n; i++)
+        *(UINT64 *)(buf + i * MT_BLOCK) = i;
+    for (UINTN i = n - 1; i > 0; i--) {
+        UINTN j = (UINTN)(mt_rand(seed) % i);
+        UINT64 *a = (UINT64 *)(buf + i * MT_BLOCK);
+        UINT64 *b = (UINT64 *)(buf + j * MT_BLOCK);
+        UINT64 t = *a; *a = *b; *b = t;
+    }
+    for (UINTN i = 0; i < n; i++) {
+        UINT64 *a = (UINT64 *)(buf + i * MT_BLOCK);
+        *a = (UINT64)(UINTN)(buf + *a * MT_BLOCK);
+    }
+
+    /* One lap first, so the timed ones find what fits in cache there */
+    void *p = s_mt.chase(buf, n / 8 + 1);
+    UINT64 rounds = 0, ticks, t0 = timer_ticks();
+    UINT64 limit = timer_hz() * MT_LAT_MS / 1000;
+    do {
+        p = s_mt.chase(p, 4096);
+        rounds += 4096;
+        ticks = timer_ticks() - t0;
+    } while (ticks < limit);
+    if (!p) return 0;
+    return timer_ns(ticks) * 1000 / (rounds * 8);
+}
+
+static void mt_size_str(UINT64 bytes, char *out, UINTN size) {
+    if (bytes >= MB)
+        snprintf(out, size, "%llu MB", (unsigned long long)(bytes / MB));
+    else
+        snprintf(out, size, "%llu KB", (unsigned long long)(bytes / 1024));
+}
+
+void memtest_bench(void) {
+    char line[160], sz[16];
+    mt_header("MEMORY BENCHMARK");
+    mt_pick_kernels();
+
+    struct mem_map_stats mm;
+    UINT64 size = MT_BENCH_BUF;
+    if (mem_map_stats(&mm) == 0 && mm.largest_free * 4096 / 2 < size)
+        size = mm.largest_free * 4096 / 2 / MB * MB;
+    UINT8 *buf = size >= 4 * MB ? (UINT8 *)mt_pages(size) : NULL;
+    struct mt_bench_job *jobs = (struct mt_bench_job *)
+        mem_alloc(sizeof(*jobs) * (MP_MAX_WORKERS + 1));
+    if (!buf || !jobs) {
+        fb_print("  Not enough free memory for the buffer.\n", COLOR_RED);
+        if (buf) mt_pages_free(buf, size);
+        mem_free(jobs);
+        mt_done();
+        return;
+    }
+
+    const struct cpu_info *cpu = cpu_get();
+    int cores = mp_start() + 1;
+    mt_size_str(size, sz, sizeof(sz));
+    snprintf(line, sizeof(line), "  %s, %d core%s, %s buffer; kernels: %s\n",
+             cpu->name[0] ? cpu->name : "CPU", cores, cores == 1 ? "" : "s",
+             sz, s_mt.kind);
+    fb_print(line, COLOR_WHITE);
+    fb_print("  Any key between tests stops them.\n\n", COLOR_DGRAY);
+
+    UINTN cap = 24 * 128, len = 0;
+    char *csv = (char *)mem_alloc(cap);
+    static const char *const names[] = { "read", "write", "copy" };
+    static const char *const labels[] = {
+        "Read", "Write (non-temporal)", "Copy (non-temporal)"
+    };
+
+    snprintf(line, sizeof(line), "  %-24s %14s %14s\n", "Bandwidth", "1 core",
+             cores > 1 ? "all cores" : "");
+    fb_print(line, COLOR_CYAN);
+    int stopped = 0;
+    for (int op = MT_READ; op <= MT_COPY && !stopped; op++) {
+        UINT64 r1 = mt_bandwidth(jobs, 1, op, buf, size);
+        UINT64 rn = cores > 1 ? mt_bandwidth(jobs, cores, op, buf, size) : 0;
+        int n = snprintf(line, sizeof(line), "  %-24s %9llu.%llu MB/s",
+                         labels[op], (unsigned long long)(r1 / 10),
+                         (unsigned long long)(r1 % 10));
+        if (cores > 1 && n > 0 && (UINTN)n < sizeof(line))
+            snprintf(line + n, sizeof(line) - n, " %9llu.%llu MB/s",
+                     (unsigned long long)(rn / 10), (unsigned long long)(rn % 10));
+        fb_print(line, COLOR_WHITE);
+        fb_print("\n", COLOR_WHITE);
+        fb_present();
+        if (csv) {
+            mt_row(csv, cap, &len, names[op], 1, size / 1024, 0, r1, 0, 0);
+            if (cores > 1)
+                mt_row(csv, cap, &len, names[op], cores, size / 1024, 0, rn, 0, 0);
+        }
+        stopped = mt_key();
+    }
+    mp_stop();
+
+    if (!stopped) {
+        fb_print("\n", COLOR_WHITE);
+        snprintf(line, sizeof(line), "  %-24s %14s\n", "Latency (dependent loads)",
+                 "per load");
+        fb_print(line, COLOR_CYAN);
+    }
+    UINT64 seed = timer_ticks() | 1;
+    for (UINT64 ws = MT_LAT_MIN; ws <= size && !stopped; ws *= 4) {
+        UINT64 ps = mt_latency(buf, (UINTN)ws, &seed);
+        mt_size_str(ws, sz, sizeof(sz));
+        snprintf(line, sizeof(line), "  %-24s %9llu.%llu ns\n", sz,
+                 (unsigned long long)(ps / 1000),
+                 (unsigned long long)(ps % 1000 / 100));
+        fb_print(line, COLOR_WHITE);
+        fb_present();
+        if (csv)
+            mt_row(csv, cap, &len, "latency", 1, ws / 1024, 0, 0, ps, 0);
+        stopped = mt_key();
+    }
+    if (stopped)
+        fb_print("  Stopped.\n", COLOR_YELLOW);
+
+    mt_pages_free(buf, size);
+    mem_free(jobs);
+    if (csv) {
+        mt_csv(csv, len);
+        mem_free(csv);
+    }
+    mt_done();
+}
+
+/* ---- Pattern test ---- */
+
+struct mt_region {
+    UINT8 *base;
+    UINT64 size;
+};
+
+struct mt_err {
+    UINT64 addr, expect, got;
+};
+
+/* Test steps */
+#define MT_FILL      0          /* store pat */
+#define MT_UP        1          /* ascending: check pat, store ~pat */
+#define MT_DOWN      2          /* descending: check ~pat, store pat */
+#define MT_ADDR      3          /* store each word's address ^ x */
+#define MT_ADDR_SEE  4          /* check them */
+
+struct mt_chunk {
+    struct mp_job job;
+    UINT8 *base;
+    UINTN blocks;
+    int op;
+    UINT64 pat[2], inv[2];
+    UINT64 x;
+    UINT64 errors, bits;        /* this step's */
+    UINT32 nlog;
+    struct mt_err log[MT_LOG];
+};
+
+/* The block at p is not as it should be: find the words */
+static void mt_scan(struct mt_chunk *c, const UINT8 *p, const UINT64 *pat) {
+    const volatile UINT64 *w = (const volatile UINT64 *)p;
+    for (int i = 0; i < 8; i++) {
+        UINT64 want = pat ? pat[i & 1] : (UINT64)(UINTN)(p + i * 8) ^ c->x;
+        UINT64 got = w[i];
+        if (got == want) continue;
+        c->errors++;
+        c->bits |= got ^ want;
+        if (c->nlog < MT_LOG) {
+            struct mt_err *e = &c->log[c->nlog++];
+            e->addr = (UINT64)(UINTN)(p + i * 8);
+            e->expect = want;
+            e->got = got;
+        }
+    }
+}
+
+static void mt_chunk_job(void *arg, void *arena) {
+    struct mt_chunk *c = (struct mt_chunk *)arg;
+    UINT8 *p = c->base;
+    UINTN n = c->blocks;
+    (void)arena;
+    if (c->op == MT_FILL) {
+        s_mt.stream(p, c->pat, n);
+    } else if (c->op == MT_ADDR) {
+        s_mt.addr(p, n, c->x);
+    } else if (c->op == MT_ADDR_SEE) {
+        while (n) {
+            UINTN k = s_mt.addr_check(p, n, c->x);
+            if (k == n) break;
+            p += k * MT_BLOCK;
+            mt_scan(c, p, NULL);
+            p += MT_BLOCK;
+            n -= k + 1;
+        }
+    } else {
+        int up = c->op == MT_UP;
+        INTN step = up ? MT_BLOCK : -(INTN)MT_BLOCK;
+        const UINT64 *from = up ? c->pat : c->inv;
+        const UINT64 *to = up ? c->inv : c->pat;
+        if (!up) p += (n - 1) * MT_BLOCK;
+        while (n) {
+            UINTN k = s_mt.swap(p, from, to, n, step);
+            if (k == n) break;
+            p += (INTN)k * step;
+            mt_scan(c, p, from);
+            for (int i = 0; i < 8; i++)
+                ((UINT64 *)p)[i] = to[i & 1];
+            p += step;
+            n -= k + 1;
+        }
+    }
+}
+
+struct mt_test {
+    struct mt_region reg[MT_REGIONS];
+    int nreg;
+    UINT64 total;
+    struct mt_chunk *chunk;
+    UINTN nchunk;
+    int cores;
+    UINT64 errors, bits;
+    UINT32 shown;
+};
+
+/* Take the free ranges above MT_LOW, all but reserve bytes of them.
+   Returns the bytes taken. */
+static UINT64 mt_grab(struct mt_test *t, UINT64 reserve) {
+    UINTN map_size = 0, map_key, desc_size;
+    UINT32 desc_ver;
+    g_boot.bs->GetMemoryMap(&map_size, NULL, &map_key, &desc_size, &desc_ver);
+    map_size += 8 * desc_size;
+    UINT8 *map = (UINT8 *)mem_alloc(map_size);
+    if (!map) return 0;
+    if (EFI_ERROR(g_boot.bs->GetMemoryMap(&map_size, (EFI_MEMORY_DESCRIPTOR *)map,
+                                          &map_key, &desc_size, &desc_ver))) {
+        mem_free(map);
+        return 0;
+    }
+
+    UINT64 free = 0;
+    for (UINTN off = 0; off + desc_size <= map_size; off += desc_size) {
+        EFI_MEMORY_DESCRIPTOR *d = (EFI_MEMORY_DESCRIPTOR *)(map + off);
+        UINT64 end = d->PhysicalStart + d->NumberOfPages * 4096;
+        if (d->Type == EfiConventionalMemory && end > MT_LOW)
+            free += end - (d->PhysicalStart < MT_LOW ? MT_LOW : d->PhysicalStart);
+    }
+    UINT64 want = free > reserve ? free - reserve : 0;
+
+    for (UINTN off = 0; off + desc_size <= map_size && t->nreg < MT_REGIONS &&
+                        t->total < want; off += desc_size) {
+        EFI_MEMORY_DESCRIPTOR *d = (EFI_MEMORY_DESCRIPTOR *)(map + off);
+        if (d->Type != EfiConventionalMemory) continue;
+        UINT64 start = d->PhysicalStart < MT_LOW ? MT_LOW : d->PhysicalStart;
+        UINT64 end = d->PhysicalStart + d->NumberOfPages * 4096;
+        if (end <= start) continue;
+        UINT64 size = end - start;
+        if (size > want - t->total) size = (want - t->total) / 4096 * 4096;
+        if (size < MT_MIN_RANGE) continue;
+        EFI_PHYSICAL_ADDRESS addr = start;
+        if (EFI_ERROR(g_boot.bs->AllocatePages(AllocateAddress, EfiLoaderData,
+                                               (UINTN)(size / 4096), &addr)))
+            continue;               /* taken since the map was read */
+        t->reg[t->nreg].base = (UINT8 *)(UINTN)addr;
+        t->reg[t->nreg].size = size;
+        t->nreg++;
+        t->total += size;
+    }
+    mem_free(map);
+    return t->total;
+}
+
+static void mt_release(struct mt_test *t) {
+    for (int i = 0; i < t->nreg; i++)
+        mt_pages_free(t->reg[i].base, t->reg[i].size);
+    t->nreg = 0;
+    t->total = 0;
+}
+
+/* Cut the regions into chunks of at most MT_CHUNK */
+static int mt_cut(struct mt_test *t) {
+    UINTN n = 0;
+    for (int i = 0; i < t->nreg; i++)
+        n += (UINTN)((t->reg[i].size + MT_CHUNK - 1) / MT_CHUNK);
+    t->chunk = (struct mt_chunk *)mem_alloc(n * sizeof(*t->chunk));
+    if (!t->chunk) return -1;
+    t->nchunk = 0;
+    for (int i = 0; i < t->nreg; i++)
+        for (UINT64 off = 0; off < t->reg[i].size; off += MT_CHUNK) {
+            UINT64 left = t->reg[i].size - off;
+            struct mt_chunk *c = &t->chunk[t->nchunk++];
+            c->base = t->reg[i].base + off;
+            c->blocks = (UINTN)((left < MT_CHUNK ? left : MT_CHUNK) / MT_BLOCK);
+        }
+    return 0;
+}
+
+/* Run one step over every chunk on every core and report what it
+   found. Returns tenths of a MB per second through memory. */
+static UINT64 mt_step(struct mt_test *t, int op, const UINT64 pat[2], UINT64 x) {
+    UINT64 t0 = timer_ticks();
+    for (UINTN i = 0; i < t->nchunk; i++) {
+        struct mt_chunk *c = &t->chunk[i];
+        c->op = op;
+        c->pat[0] = pat[0];
+        c->pat[1] = pat[1];
+        c->inv[0] = ~pat[0];
+        c->inv[1] = ~pat[1];
+        c->x = x;
+        c->errors = c->bits = 0;
+        c->nlog = 0;
+        mp_submit(&c->job, mt_chunk_job, c);
+    }
+    for (UINTN i = 0; i < t->nchunk; i++)
+        mp_wait(&t->chunk[i].job);
+    UINT64 ticks = timer_ticks() - t0;
+
+    char line[160];
+    for (UINTN i = 0; i < t->nchunk; i++) {
+        struct mt_chunk *c = &t->chunk[i];
+        t->errors += c->errors;
+        t->bits |= c->bits;
+        for (UINT32 k = 0; k < c->nlog && t->shown < MT_SHOW; k++, t->shown++) {
+            const struct mt_err *e = &c->log[k];
+            snprintf(line, sizeof(line),
+                     "    at 0x%010llx: 0x%016llx, should be 0x%016llx (bits 0x%016llx)\n",
+                     (unsigned long long)e->addr, (unsigned long long)e->got,
+                     (unsigned long long)e->expect,
+                     (unsigned long long)(e->got ^ e->expect));
+            fb_print(line, COLOR_RED);
+        }
+    }
+    /* The inversions read and write every block */
+    UINT64 moved = t->total * (op == MT_UP || op == MT_DOWN ? 2 : 1);
+    return mt_rate(moved, ticks);
+}
+
+static const char *const s_steps[] = {
+    "own address", "own address, inverted", "zeros and ones",
+    "alternating bits", "walking bits", "random pattern",
+};
+#define MT_STEPS ((int)(sizeof(s_steps) / sizeof(s_steps[0])))
+
+/* One pass of every step; 0 when complete, 1 if a key stopped it */
+static int mt_pass(struct mt_test *t, UINT32 pass, UINT64 *seed, UINT64 *rate) {
+    char line[160];
+    for (int s = 0; s < MT_STEPS; s++) {
+        UINT64 before = t->errors, r;
+        UINT64 pat[2];
+        if (s < 2) {
+            UINT64 x = s ? ~0ULL : 0;
+            pat[0] = pat[1] = 0;
+            mt_step(t, MT_ADDR, pat, x);
+            r = mt_step(t, MT_ADDR_SEE, pat, x);
+        } else {
+            if (s == 2)
+                pat[0] = pat[1] = 0;
+            else if (s == 3)
+                pat[0] = pat[1] = 0x5555555555555555ULL;
+            else if (s == 4)
+                pat[0] = pat[1] = 0x0101010101010101ULL << (pass % 8);
+            else {
+                pat[0] = mt_rand(seed);
+                pat[1] = mt_rand(seed);
+            }
+            mt_step(t, MT_FILL, pat, 0);
+            mt_step(t, MT_UP, pat, 0);
+            r = mt_step(t, MT_DOWN, pat, 0);
+        }
+        *rate = r;
+        snprintf(line, sizeof(line), "  Pass %-3u %-24s %7llu.%llu MB/s  %llu error%s\n",
+                 pass, s_steps[s], (unsigned long long)(r / 10),
+                 (unsigned long long)(r % 10),
+                 (unsigned long long)(t->errors - before),
+                 t->errors - before == 1 ? "" : "s");
+        fb_print(line, t->errors != before ? COLOR_RED : COLOR_WHITE);
+        fb_present();
+        if (mt_key()) return 1;
+    }
+    return 0;
+}
+
+void memtest_run(void) {
+    char line[160], sz[16];
+    mt_header("MEMORY TEST");
+    mt_pick_kernels();
+
+    struct mt_test *t = (struct mt_test *)mem_alloc(sizeof(*t));
+    if (!t) {
+        fb_print("  Not enough memory.\n", COLOR_RED);
+        mt_done();
+        return;
+    }
+    /* The firmware keeps running: its pools grow into what is left */
+    struct mem_map_stats mm;
+    UINT64 reserve = MT_RESERVE;
+    if (mem_map_stats(&mm) == 0)
+        reserve += mm.type_pages[EfiConventionalMemory] * 4096 / 32;
+    fb_print("  Taking the free memory...\n", COLOR_WHITE);
+    fb_present();
+    if (mt_grab(t, reserve) == 0 || mt_cut(t) != 0) {
+        fb_print("  No free memory could be taken for the test.\n", COLOR_RED);
+        mt_release(t);
+        mem_free(t->chunk);
+        mem_free(t);
+        mt_done();
+        return;
+    }
+
+    t->cores = mp_start() + 1;
+    mt_size_str(t->total, sz, sizeof(sz));
+    snprintf(line, sizeof(line),
+             "  Testing %s in %d ranges on %d core%s (%llu MB left to the firmware)\n",
+             sz, t->nreg, t->cores, t->cores == 1 ? "" : "s",
+             (unsigned long long)(reserve / MB));
+    fb_print(line, COLOR_WHITE);
+    snprintf(line, sizeof(line),
+             "  Memory in use by the workstation and the firmware is not tested.\n"
+             "  Kernels: %s. Passes repeat until a key is pressed.\n\n", s_mt.kind);
+    fb_print(line, COLOR_DGRAY);
+    fb_present();
+
+    UINT64 seed = timer_ticks() | 1, rate = 0;
+    UINT64 t0 = timer_ticks();
+    UINT32 pass = 0;
+    while (mt_pass(t, pass + 1, &seed, &rate) == 0)
+        pass++;
+    UINT64 secs = timer_us(timer_ticks() - t0) / 1000000;
+    mp_stop();
+
+    fb_print("\n", COLOR_WHITE);
+    snprintf(line, sizeof(line), "  %u full pass%s in %llu s: ", pass,
+             pass == 1 ? "" : "es", (unsigned long long)secs);
+    fb_print(line, COLOR_WHITE);
+    if (t->errors == 0) {
+        fb_print(pass ? "no errors\n" : "no errors so far\n", COLOR_GREEN);
+    } else {
+        snprintf(line, sizeof(line), "%llu errors, bits 0x%016llx differ\n",
+                 (unsigned long long)t->errors, (unsigned long long)t->bits);
+        fb_print(line, COLOR_RED);
+        if (t->errors > t->shown)
+            fb_print("  (only the first are listed)\n", COLOR_DGRAY);
+    }
+
+    char row[160];
+    UINTN len = 0;
+    mt_row(row, sizeof(row), &len, "memtest", t->cores, t->total / 1024, pass,
+           rate, 0, t->errors);
+    mt_release(t);
+    mem_free(t->chunk);
+    mem_free(t);
+    mt_csv(row, len);
+    mt_done();
+}
@@ -0,0 +1,28 @@
+/*
+ * memtest.h — Memory bandwidth, latency and a RAM pattern test
+ *
+ * Both start from the memory view (F2 in the browser). The benchmark
+ * times reads, non-temporal writes and copies of a buffer well past the
+ * caches, on one core and then on every core through the worker pool,
+ * and the latency of dependent loads at working sets from L1 out to
+ * DRAM. The test takes every free page the firmware will give up above
+ * 1 MB, less a reserve it keeps running on, and repeats memtest86-style
+ * passes over them on every core until a key: own address and its
+ * inverse, then moving inversions of fixed, walking and random
+ * patterns. Each run is appended to MEMTEST_CSV on the boot volume.
+ */
+#ifndef MEMTEST_H
+#define MEMTEST_H
+
+#include "boot.h"
+
+#define MEMTEST_CSV     L"\\MEMTEST.CSV"
+#define MEMTEST_CSV_MAX (256 * 1024)    /* older rows are dropped past this */
+
+/* Run the benchmark screen; returns when the user leaves it */
+void memtest_bench(void);
+
+/* Run the pattern test until a key, then show what it found */
+void memtest_run(void);
+
+#endif /* MEMTEST_H */
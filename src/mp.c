@@ -0,0 +1,424 @@
+/*
+ * mp.c — Worker pool on the application processors
+ *
+ * Each worker is one AP started in non-blocking mode (StartupThisAP
+ * with a WaitEvent) on a run loop that spins on its own job slot.  The
+ * boot processor alone owns the queue and fills a slot only when it is
+ * empty; the worker runs the job, marks it done and clears the slot.
+ * With one writer per field, ordering is all the handover needs: a
+ * full barrier on each side, no atomic read-modify-write.
+ *
+ * TCC's ARM64 assembler is a stub, so the AArch64 barrier, spin hint
+ * and the exclusive-access loops of the atomics are raw machine code
+ * in .text (see setjmp_aarch64.c).
+ */
+
+#include "boot.h"
+#include "mem.h"
+#include "hash.h"
+#include "mp.h"
+
+/* How long mp_start() waits for the firmware to notice that a worker
+   from the last batch has returned (it polls, 100 ms apart on EDK2) */
+#define MP_RESTART_MS 250
+
+/* Stack below a worker's run loop that mp_on_worker() counts as its
+   own: what firmware gives an AP, with room to spare */
+#define MP_STACK_SPAN (64 * 1024)
+
+#ifdef __aarch64__
+__attribute__((section(".text")))
+static unsigned int s_fence[] = {
+    0xd5033bbf, /* dmb ish                  */
+    0xd65f03c0, /* ret                      */
+};
+
+__attribute__((section(".text")))
+static unsigned int s_relax[] = {
+    0xd503203f, /* yield                    */
+    0xd65f03c0, /* ret                      */
+};
+
+/* Each returns the old value; mp_fence() after makes it a full barrier */
+__attribute__((section(".text")))
+static unsigned int s_add32[] = {
+    0x885ffc02, /* 1: ldaxr w2, [x0]        */
+    0x0b010043, /* add   w3, w2, w1         */
+    0x8804fc03, /* stlxr w4, w3, [x0]       */
+    0x35ffffa4, /* cbnz  w4, 1b             */
+    0x2a0203e0, /* mov   w0, w2             */
+    0xd65f03c0, /* ret                      */
+};
+
+__attribute__((section(".text")))
+static unsigned int s_add64[] = {
+    0xc85ffc02, /* 1: ldaxr x2, [x0]        */
+    0x8b010043, /* add   x3, x2, x1         */
+    0xc804fc03, /* stlxr w4, x3, [x0]       */
+    0x35ffffa4, /* cbnz  w4, 1b             */
+    0xaa0203e0, /* mov   x0, x2             */
+    0xd65f03c0, /* ret                      */
+};
+
+__attribute__((section(".text")))
+static unsigned int s_cas32[] = {
+    0x885ffc03, /* 1: ldaxr w3, [x0]        */
+    0x6b01007f, /* cmp   w3, w1             */
+    0x540000a1, /* b.ne  2f                 */
+    0x8804fc02, /* stlxr w4, w2, [x0]       */
+    0x35ffff84, /* cbnz  w4, 1b             */
+    0x2a0303e0, /* mov   w0, w3             */
+    0xd65f03c0, /* ret                      */
+    0xd5033f5f, /* 2: clrex                 */
+    0x2a0303e0, /* mov   w0, w3             */
+    0xd65f03c0, /* ret                      */
+};
+
+__attribute__((section(".text")))
+static unsigned int s_cas64[] = {
+    0xc85ffc03, /* 1: ldaxr x3, [x0]        */
+    0xeb01007f, /* cmp   x3, x1             */
+    0x540000a1, /* b.ne  2f                 */
+    0xc804fc02, /* stlxr w4, x2, [x0]       */
+    0x35ffff84, /* cbnz  w4, 1b             */
+    0xaa0303e0, /* mov   x0, x3             */
+    0xd65f03c0, /* ret                      */
+    0xd5033f5f, /* 2: clrex                 */
+    0xaa0303e0, /* mov   x0, x3             */
+    0xd65f03c0, /* ret                      */
+};
+#endif
+
+void mp_fence(void) {
+#ifdef __aarch64__
+    ((void (*)(void))(UINTN)s_fence)();
+#else
+    __asm__ __volatile__("mfence" ::: "memory");
+#endif
+}
+
+void mp_relax(void) {
+#ifdef __aarch64__
+    ((void (*)(void))(UINTN)s_relax)();
+#else
+    __asm__ __volatile__("pause");
+#endif
+}
+
+/* ---- Atomics ---- */
+
+UINT32 mp_add32(volatile UINT32 *p, UINT32 v) {
+#ifdef __aarch64__
+    v = ((UINT32 (*)(volatile UINT32 *, UINT32))(UINTN)s_add32)(p, v);
+    mp_fence();
+#else
+    __asm__ __volatile__("lock; xaddl %0, %1" : "+r"(v), "+m"(*p) :: "memory");
+#endif
+    return v;
+}
+
+UINT64 mp_add64(volatile UINT64 *p, UINT64 v) {
+#ifdef __aarch64__
+    v = ((UINT64 (*)(volatile UINT64 *, UINT64))(UINTN)s_add64)(p, v);
+    mp_fence();
+#else
+    __asm__ __volatile__("lock; xaddq %0, %1" : "+r"(v), "+m"(*p) :: "memory");
+#endif
+    return v;
+}
+
+UINT32 mp_cas32(volatile UINT32 *p, UINT32 expect, UINT32 desired) {
+#ifdef __aarch64__
+    expect = ((UINT32 (*)(volatile UINT32 *, UINT32, UINT32))(UINTN)s_cas32)
+        (p, expect, desired);
+    mp_fence();
+#else
+    __asm__ __volatile__("lock; cmpxchgl %2, %1"
+                         : "+a"(expect), "+m"(*p) : "r"(desired) : "memory");
+#endif
+    return expect;
+}
+
+UINT64 mp_cas64(volatile UINT64 *p, UINT64 expect, UINT64 desired) {
+#ifdef __aarch64__
+    expect = ((UINT64 (*)(volatile UINT64 *, UINT64, UINT64))(UINTN)s_cas64)
+        (p, expect, desired);
+    mp_fence();
+#else
+    __asm__ __volatile__("lock; cmpxchgq %2, %1"
+                         : "+a"(expect), "+m"(*p) : "r"(desired) : "memory");
+#endif
+    return expect;
+}
+
+struct mp_worker {
+    UINTN cpu;                      /* MP services processor number */
+    EFI_EVENT event;                /* signaled once the run loop returned */
+    void *arena;
+    volatile UINTN stack;           /* an address in the run loop's frame */
+    struct mp_job *volatile slot;   /* set by the BSP, cleared by the worker */
+    volatile UINT32 stop;           /* BSP: return when idle */
+    volatile UINT32 stopped;        /* worker: returning */
+    int live;                       /* run loop started */
+    int ran;                        /* started since the event was seen */
+    struct mp_job *launched;        /* mp_launch() job, until it ends */
+    int held;                       /* launched and not yet released */
+};
+
+static EFI_MP_SERVICES_PROTOCOL *s_mp;
+static struct mp_worker s_workers[MP_MAX_WORKERS];
+static int s_nworkers;
+static int s_live;
+static int s_depth;
+static UINT64 s_bsp_arena[MP_ARENA / 8]; /* for jobs the BSP runs */
+static struct mp_job *s_queue, *s_tail;
+
+/* ---- Worker side ---- */
+
+static void EFIAPI worker_loop(void *arg) {
+    struct mp_worker *w = (struct mp_worker *)arg;
+    UINT8 mark = 0;
+    w->stack = (UINTN)&mark;
+    for (;;) {
+        struct mp_job *j = w->slot;
+        if (j) {
+            mp_fence();
+            j->fn(j->arg, w->arena);
+            mp_fence();
+            j->state = MP_DONE;
+            mp_fence();
+            w->slot = NULL;
+        } else if (w->stop) {
+            break;
+        } else {
+            mp_relax();
+        }
+    }
+    mp_fence();
+    w->stopped = 1;
+}
+
+/* A launched job, alone on its worker */
+static void EFIAPI launch_entry(void *arg) {
+    struct mp_worker *w = (struct mp_worker *)arg;
+    struct mp_job *j = w->launched;
+    mp_fence();
+    j->fn(j->arg, w->arena);
+    mp_fence();
+    j->state = MP_DONE;
+}
+
+/* ---- Boot processor side ---- */
+
+static struct mp_job *queue_pop(void) {
+    struct mp_job *j = s_queue;
+    if (j) {
+        s_queue = j->next;
+        if (!s_queue) s_tail = NULL;
+    }
+    return j;
+}
+
+static void run_here(struct mp_job *j) {
+    j->state = MP_RUNNING;
+    j->fn(j->arg, s_bsp_arena);
+    j->state = MP_DONE;
+}
+
+/* Hand queued jobs to the workers with an empty slot */
+static void dispatch(void) {
+    for (int i = 0; i < s_nworkers && s_queue; i++) {
+        struct mp_worker *w = &s_workers[i];
+        if (!w->live || w->slot) continue;
+        struct mp_job *j = queue_pop();
+        j->state = MP_RUNNING;
+        mp_fence();
+        w->slot = j;
+    }
+}
+
+void mp_init(void) {
+    EFI_GUID mp_guid = EFI_MP_SERVICES_PROTOCOL_GUID;
+
+    /* Tables built on first use must exist before cores race to it */
+    crc32c(0, NULL, 0);
+
+    if (EFI_ERROR(g_boot.bs->LocateProtocol(&mp_guid, NULL, (void **)&s_mp)) ||
+        !s_mp) {
+        s_mp = NULL;
+        return;
+    }
+
+    UINTN total = 0, enabled = 0, self = 0;
+    if (EFI_ERROR(s_mp->GetNumberOfProcessors(s_mp, &total, &enabled)) ||
+        EFI_ERROR(s_mp->WhoAmI(s_mp, &self)))
+        return;
+
+    UINT32 need = PROCESSOR_ENABLED_BIT | PROCESSOR_HEALTH_STATUS_BIT;
+    for (UINTN i = 0; i < total && s_nworkers < MP_MAX_WORKERS; i++) {
+        EFI_PROCESSOR_INFORMATION info;
+        if (i == self || EFI_ERROR(s_mp->GetProcessorInfo(s_mp, i, &info)))
+            continue;
+        if ((info.StatusFlag & need) != need ||
+            (info.StatusFlag & PROCESSOR_AS_BSP_BIT))
+            continue;
+
+        struct mp_worker *w = &s_workers[s_nworkers];
+        w->arena = mem_alloc_raw(MP_ARENA);
+        if (!w->arena) break;
+        if (EFI_ERROR(g_boot.bs->CreateEvent(0, 0, NULL, NULL, &w->event))) {
+            mem_free(w->arena);
+            break;
+        }
+        w->cpu = i;
+        s_nworkers++;
+    }
+}
+
+/* Wait for the firmware to see that the worker's last run returned */
+static void settle(struct mp_worker *w) {
+    if (!w->ran) return;
+    for (int t = 0; t < MP_RESTART_MS &&
+         g_boot.bs->CheckEvent(w->event) != EFI_SUCCESS; t++)
+        g_boot.bs->Stall(1000);
+    w->ran = 0;
+}
+
+/* Whether the worker is still in a launched job. A released one that
+   has ended is given back. */
+static int launch_busy(struct mp_worker *w) {
+    if (!w->launched) return 0;
+    if (w->launched->state != MP_DONE) {
+        if (g_boot.bs->CheckEvent(w->event) != EFI_SUCCESS)
+            return 1;
+        w->ran = 0;             /* reset by the timeout; event seen */
+    }
+    if (!w->held) w->launched = NULL;
+    return 0;
+}
+
+int mp_start(void) {
+    if (s_depth++ > 0) return s_live;
+
+    for (int i = 0; i < s_nworkers; i++) {
+        struct mp_worker *w = &s_workers[i];
+        if (w->held || launch_busy(w)) {
+            w->live = 0;
+            continue;
+        }
+        settle(w);
+        w->slot = NULL;
+        w->stop = 0;
+        w->stopped = 0;
+        mp_fence();
+        w->live = !EFI_ERROR(s_mp->StartupThisAP(s_mp, worker_loop, w->cpu,
+                                                 w->event, 0, w, NULL));
+        w->ran = w->live;
+        s_live += w->live;
+    }
+    return s_live;
+}
+
+void mp_stop(void) {
+    if (s_depth == 0 || --s_depth > 0) return;
+
+    /* Nothing may be left for a worker that is leaving */
+    struct mp_job *j;
+    while ((j = queue_pop()) != NULL)
+        run_here(j);
+    for (int i = 0; i < s_nworkers; i++) {
+        struct mp_worker *w = &s_workers[i];
+        if (!w->live) continue;
+        while (w->slot) mp_relax();
+        w->stop = 1;
+    }
+    for (int i = 0; i < s_nworkers; i++) {
+        struct mp_worker *w = &s_workers[i];
+        if (!w->live) continue;
+        while (!w->stopped) mp_relax();
+        w->live = 0;
+    }
+    mp_fence();
+    s_live = 0;
+}
+
+void mp_submit(struct mp_job *job, mp_fn fn, void *arg) {
+    job->fn = fn;
+    job->arg = arg;
+    job->next = NULL;
+    job->state = MP_QUEUED;
+    if (!s_live) {
+        run_here(job);
+        return;
+    }
+    if (s_tail) s_tail->next = job;
+    else s_queue = job;
+    s_tail = job;
+    dispatch();
+}
+
+void mp_wait(struct mp_job *job) {
+    while (job->state != MP_DONE) {
+        dispatch();
+        /* Every worker busy: take the next queued job meanwhile */
+        struct mp_job *j = job->state == MP_DONE ? NULL : queue_pop();
+        if (j) run_here(j);
+        else mp_relax();
+    }
+    mp_fence();
+}
+
+void mp_idle(void) {
+    for (int i = 0; i < s_nworkers; i++)
+        while (s_workers[i].live && s_workers[i].slot)
+            mp_relax();
+    mp_fence();
+}
+
+int mp_launch(struct mp_job *job, mp_fn fn, void *arg, UINTN timeout_us) {
+    if (!s_mp || s_depth) return -1;
+    /* From the top, leaving the low workers to the pool */
+    for (int i = s_nworkers - 1; i >= 0; i--) {
+        struct mp_worker *w = &s_workers[i];
+        if (w->held || launch_busy(w)) continue;
+        settle(w);
+        job->fn = fn;
+        job->arg = arg;
+        job->next = NULL;
+        job->state = MP_RUNNING;
+        w->launched = job;
+        w->held = 1;
+        mp_fence();
+        if (EFI_ERROR(s_mp->StartupThisAP(s_mp, launch_entry, w->cpu, w->event,
+                                          timeout_us, w, NULL))) {
+            w->launched = NULL;
+            w->held = 0;
+            continue;
+        }
+        w->ran = 1;
+        return i;
+    }
+    return -1;
+}
+
+int mp_launch_busy(int worker) {
+    if (worker < 0 || worker >= s_nworkers) return 0;
+    return launch_busy(&s_workers[worker]);
+}
+
+void mp_launch_release(int worker) {
+    if (worker < 0 || worker >= s_nworkers) return;
+    s_workers[worker].held = 0;
+    launch_busy(&s_workers[worker]);
+}
+
+int mp_on_worker(void) {
+    if (!s_live) return 0;
+    UINT8 here = 0;
+    for (int i = 0; i < s_nworkers; i++) {
+        const struct mp_worker *w = &s_workers[i];
+        if (w->live && w->stack && w->stack - (UINTN)&here < MP_STACK_SPAN)
+            return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,91 @@
+/*
+ * mp.h — Worker pool on the application processors
+ *
+ * Hashing and compression can run on the other cores through
+ * EFI_MP_SERVICES_PROTOCOL while the boot processor keeps the I/O
+ * going. Between mp_start() and mp_stop() every usable AP sits in a
+ * run loop taking jobs from a queue; the boot processor hands them out
+ * on mp_submit() and mp_wait() and runs queued ones itself while it
+ * waits. Without MP services (or before mp_start()) mp_submit() just
+ * runs the job, so callers need no second code path.
+ *
+ * A job runs with no boot services: it must not allocate, print, read
+ * keys or touch devices, only the memory its caller prepared, plus its
+ * worker's arena of MP_ARENA bytes for scratch. AP stacks are small
+ * (32 KB on most firmware).
+ */
+#ifndef MP_H
+#define MP_H
+
+#include "boot.h"
+
+#define MP_MAX_WORKERS 16
+#define MP_ARENA       (64 * 1024)
+
+typedef void (*mp_fn)(void *arg, void *arena);
+
+/* Job states */
+#define MP_QUEUED  0
+#define MP_RUNNING 1
+#define MP_DONE    2
+
+/* One unit of work, owned by the caller until mp_wait() returns */
+struct mp_job {
+    mp_fn fn;
+    void *arg;
+    volatile UINT32 state;        /* MP_QUEUED/RUNNING/DONE */
+    struct mp_job *next;          /* queue link */
+};
+
+/* Find the APs and allocate their arenas. Call once, after mem_init(). */
+void mp_init(void);
+
+/* Bring the workers up for a batch of jobs (nests). Returns the
+   number running, 0 if every job will run on the boot processor. */
+int mp_start(void);
+
+/* Run the queue dry and send the workers back to the firmware once
+   the outermost mp_start() is matched */
+void mp_stop(void);
+
+/* Queue fn(arg, arena) and hand it to an idle worker if there is one */
+void mp_submit(struct mp_job *job, mp_fn fn, void *arg);
+
+/* Return once job has finished; its results are visible then */
+void mp_wait(struct mp_job *job);
+
+/* Return once no worker holds a job, so the next ones submitted
+   (up to one per worker) start at once. The queue must be empty. */
+void mp_idle(void);
+
+/* Run job by itself on a worker kept out of the pool, for as long as
+   it takes, while the pool is stopped: user programs on their own
+   core (aprun.h). The firmware resets the core if the job is still
+   running after timeout_us (0: never). Returns the worker, or -1 if
+   none is free. */
+int mp_launch(struct mp_job *job, mp_fn fn, void *arg, UINTN timeout_us);
+
+/* 1 while the launched job's worker is still in it; 0 once the job is
+   MP_DONE, or was cut off by the timeout (its state is not MP_DONE) */
+int mp_launch_busy(int worker);
+
+/* Hand the worker back; one still in its job rejoins the pool only
+   once the job returns or the timeout resets the core */
+void mp_launch_release(int worker);
+
+/* 1 when called from a job running on a worker, 0 on the boot
+   processor (including the jobs it runs itself) */
+int mp_on_worker(void);
+
+/* Full memory barrier, and the spin-wait hint */
+void mp_fence(void);
+void mp_relax(void);
+
+/* Atomic add and compare-and-swap, each a full barrier. Return the
+   value *p held before. */
+UINT32 mp_add32(volatile UINT32 *p, UINT32 v);
+UINT64 mp_add64(volatile UINT64 *p, UINT64 v);
+UINT32 mp_cas32(volatile UINT32 *p, UINT32 expect, UINT32 desired);
+UINT64 mp_cas64(volatile UINT64 *p, UINT64 expect, UINT64 desired);
+
+#endif /* MP_H */
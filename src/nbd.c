@@ -0,0 +1,798 @@
+/*
+ * nbd.c — Serve a device to nbd-client over the firmware's TCP4
+ *
+ * Requests are pipelined. A read is cut into NBD_PIECE pieces that go
+ * to the device queue at once, and its reply (the header and every
+ * piece, in one Transmit) goes out when the last piece is in, so the
+ * disk reads ahead while the network sends. Replies keep the order of
+ * the requests, which NBD allows and which keeps the buffers simple:
+ * TCP finishes transmits in order, so pieces come back in order too.
+ * The firmware's TCP runs from its timer; the loop here only polls.
+ */
+
+#include "boot.h"
+#include "fb.h"
+#include "kbd.h"
+#include "mem.h"
+#include "timer.h"
+#include "disk.h"
+#include "net.h"
+#include "nbd.h"
+#include "progress.h"
+#include "shim.h"
+
+/* ---- Protocol (all fields big-endian) ---- */
+
+#define NBD_INIT_MAGIC   0x4E42444D41474943ULL  /* "NBDMAGIC" */
+#define NBD_OPTS_MAGIC   0x49484156454F5054ULL  /* "IHAVEOPT" */
+#define NBD_REP_MAGIC    0x0003E889045565A9ULL
+#define NBD_REQ_MAGIC    0x25609513
+#define NBD_REPLY_MAGIC  0x67446698
+
+#define NBD_FLAG_FIXED_NEWSTYLE 1       /* handshake flags */
+#define NBD_FLAG_NO_ZEROES      2
+#define NBD_FLAG_HAS_FLAGS      1       /* transmission flags */
+#define NBD_FLAG_READ_ONLY      2
+#define NBD_FLAG_SEND_FLUSH     4
+
+#define NBD_OPT_EXPORT_NAME 1
+#define NBD_OPT_ABORT       2
+#define NBD_OPT_LIST        3
+#define NBD_OPT_INFO        6
+#define NBD_OPT_GO          7
+
+#define NBD_REP_ACK       1
+#define NBD_REP_SERVER    2
+#define NBD_REP_INFO      3
+#define NBD_REP_ERR_UNSUP 0x80000001
+
+#define NBD_INFO_EXPORT     0
+#define NBD_INFO_BLOCK_SIZE 3
+
+#define NBD_CMD_READ  0
+#define NBD_CMD_WRITE 1
+#define NBD_CMD_DISC  2
+#define NBD_CMD_FLUSH 3
+
+#define NBD_EPERM  1
+#define NBD_EIO    5
+#define NBD_EINVAL 22
+
+#define NBD_NAME         "survival"     /* the one export; any name gets it */
+#define NBD_REQ_LEN      28
+#define NBD_OPT_MAX      4096           /* option data taken */
+#define NBD_HANDSHAKE_MS 10000
+#define NBD_CLOSE_MS     2000
+
+static void put16(UINT8 *p, UINT16 v) { p[0] = (UINT8)(v >> 8); p[1] = (UINT8)v; }
+static void put32(UINT8 *p, UINT32 v) { put16(p, (UINT16)(v >> 16)); put16(p + 2, (UINT16)v); }
+static void put64(UINT8 *p, UINT64 v) { put32(p, (UINT32)(v >> 32)); put32(p + 4, (UINT32)v); }
+static UINT16 get16(const UINT8 *p) { return (UINT16)(p[0] << 8 | p[1]); }
+static UINT32 get32(const UINT8 *p) { return (UINT32)get16(p) << 16 | get16(p + 2); }
+static UINT64 get64(const UINT8 *p) { return (UINT64)get32(p) << 32 | get32(p + 4); }
+
+/* ---- Connection state ---- */
+
+enum { C_FREE, C_FILL, C_DISK, C_SEND };
+
+/* A request, from its header until its reply has been sent */
+struct nbd_cmd {
+    int state;              /* C_FILL: a write's data still arriving */
+    UINT16 type;
+    UINT32 error;           /* decided on arrival (EINVAL, EPERM), or 0 */
+    UINT32 first, count;    /* its pieces, in ring order */
+    UINT32 len;
+    UINT8 reply[16];
+    EFI_TCP4_IO_TOKEN tx;
+    EFI_TCP4_TRANSMIT_DATA txd;                 /* FragmentTable[0]: reply */
+    EFI_TCP4_FRAGMENT_DATA frag[NBD_PIECES];    /* then the read pieces */
+};
+
+struct nbd_piece {
+    UINT8 *buf;             /* NBD_PIECE plus a block either side */
+    struct disk_io *io;     /* NULL once finished */
+    UINT8 *data;            /* the request's bytes in buf */
+    UINT32 len;
+    int failed;
+};
+
+struct nbd_conn {
+    EFI_TCP4_PROTOCOL *tcp;
+    struct disk_device *dev;
+    struct disk_queue *q;
+    UINT32 bs;
+    int writable;
+    struct nbd_piece piece[NBD_PIECES];
+    struct nbd_cmd cmd[NBD_CMDS];
+    /* running counts; slot = count % ring size */
+    UINT32 p_head, p_tail;
+    UINT32 c_head, c_sent, c_tail;
+
+    UINT8 *rx;
+    UINT32 rx_pos, rx_len;
+    int rx_busy;
+    EFI_TCP4_IO_TOKEN rx_tok;
+    EFI_TCP4_RECEIVE_DATA rxd;
+
+    struct nbd_cmd *wr;     /* the write whose data is arriving */
+    UINT64 wr_off;
+    UINT32 wr_left;
+    struct nbd_piece *fill; /* its piece being filled */
+    UINT32 fill_len, fill_want;
+    UINT32 skip;            /* data of a refused write, to drop */
+
+    int closing;            /* the client sent DISC */
+    int dead;               /* connection lost or protocol broken */
+    int esc;
+    int redraw;             /* the progress tracker asked for it */
+
+    UINT64 bytes_read, bytes_written;
+    UINT32 requests, errors;
+};
+
+/* ---- UI helpers ---- */
+
+static void nbd_print(const char *msg, UINT32 color) {
+    if (g_boot.cols) fb_print(msg, color);
+}
+
+static void nbd_wait_key(void) {
+    nbd_print("  Press any key to return.\n", COLOR_DGRAY);
+    struct key_event ev;
+    kbd_wait(&ev);
+}
+
+static void nbd_row(UINT32 row, const char *text, UINT32 color) {
+    char line[128];
+    int len = 0;
+    line[len++] = ' ';
+    line[len++] = ' ';
+    while (*text && len < 126) line[len++] = *text++;
+    while (len < (int)g_boot.cols && len < 126) line[len++] = ' ';
+    line[len] = '\0';
+    fb_string(0, row, line, color, COLOR_BLACK);
+}
+
+static void nbd_stats(struct nbd_conn *c, struct progress *pg, UINT32 row) {
+    char line[128];
+    progress_line(pg, line, sizeof(line));
+    nbd_row(row, line, COLOR_WHITE);
+    snprintf(line, sizeof(line), "%u requests, %llu MB read, %llu MB written, %u errors",
+             c->requests, (unsigned long long)(c->bytes_read / (1024 * 1024)),
+             (unsigned long long)(c->bytes_written / (1024 * 1024)), c->errors);
+    nbd_row(row + 1, line, c->errors ? COLOR_YELLOW : COLOR_DGRAY);
+    fb_present();
+}
+
+static int nbd_esc(void) {
+    struct key_event ev;
+    return kbd_poll(&ev) && ev.code == KEY_ESC;
+}
+
+/* ---- Handshake ---- */
+
+/* Poll the connection until t completes. Returns 0 if it succeeded. */
+static int wait_tok(struct nbd_conn *c, EFI_TCP4_COMPLETION_TOKEN *t, UINT32 ms) {
+    UINT64 hz = timer_hz(), t0 = timer_ticks();
+    while (g_boot.bs->CheckEvent(t->Event) != EFI_SUCCESS) {
+        c->tcp->Poll(c->tcp);
+        if (nbd_esc()) c->esc = 1;
+        if (c->esc || timer_ticks() - t0 > hz / 1000 * ms) return -1;
+    }
+    return EFI_ERROR(t->Status) ? -1 : 0;
+}
+
+static int hs_send(struct nbd_conn *c, const void *buf, UINT32 len) {
+    struct nbd_cmd *k = &c->cmd[0];
+    k->txd.Push = TRUE;
+    k->txd.DataLength = len;
+    k->txd.FragmentCount = 1;
+    k->txd.FragmentTable[0].FragmentLength = len;
+    k->txd.FragmentTable[0].FragmentBuffer = (VOID *)buf;
+    k->tx.Packet.TxData = &k->txd;
+    if (EFI_ERROR(c->tcp->Transmit(c->tcp, &k->tx))) return -1;
+    return wait_tok(c, &k->tx.CompletionToken, NBD_HANDSHAKE_MS);
+}
+
+/* Exactly len bytes: a receive may return fewer than it was given */
+static int hs_recv(struct nbd_conn *c, UINT8 *buf, UINT32 len) {
+    while (len > 0) {
+        c->rxd.DataLength = len;
+        c->rxd.FragmentCount = 1;
+        c->rxd.FragmentTable[0].FragmentLength = len;
+        c->rxd.FragmentTable[0].FragmentBuffer = buf;
+        c->rx_tok.Packet.RxData = &c->rxd;
+        if (EFI_ERROR(c->tcp->Receive(c->tcp, &c->rx_tok))
+            || wait_tok(c, &c->rx_tok.CompletionToken, NBD_HANDSHAKE_MS) != 0)
+            return -1;
+        UINT32 got = c->rxd.DataLength;
+        if (got == 0 || got > len) return -1;
+        buf += got;
+        len -= got;
+    }
+    return 0;
+}
+
+static int opt_reply(struct nbd_conn *c, UINT32 opt, UINT32 type,
+                     const void *data, UINT32 len) {
+    UINT8 b[20 + 64];
+    put64(b, NBD_REP_MAGIC);
+    put32(b + 8, opt);
+    put32(b + 12, type);
+    put32(b + 16, len);
+    mem_copy(b + 20, data, len);
+    return hs_send(c, b, 20 + len);
+}
+
+static UINT16 trans_flags(struct nbd_conn *c) {
+    return (UINT16)(NBD_FLAG_HAS_FLAGS
+                    | (c->writable ? NBD_FLAG_SEND_FLUSH : NBD_FLAG_READ_ONLY));
+}
+
+/* Fixed newstyle negotiation. Returns 1 to go on to transmission, 0
+   when the client gave up, -1 on an error. */
+static int handshake(struct nbd_conn *c) {
+    UINT8 *b = c->rx;       /* free until transmission starts */
+    UINT64 size = c->dev->size_bytes;
+    put64(b, NBD_INIT_MAGIC);
+    put64(b + 8, NBD_OPTS_MAGIC);
+    put16(b + 16, NBD_FLAG_FIXED_NEWSTYLE | NBD_FLAG_NO_ZEROES);
+    if (hs_send(c, b, 18) != 0 || hs_recv(c, b, 4) != 0) return -1;
+    int no_zeroes = (get32(b) & NBD_FLAG_NO_ZEROES) != 0;
+
+    for (;;) {
+        if (hs_recv(c, b, 16) != 0 || get64(b) != NBD_OPTS_MAGIC) return -1;
+        UINT32 opt = get32(b + 8), len = get32(b + 12);
+        if (len > NBD_OPT_MAX || hs_recv(c, b + 16, len) != 0) return -1;
+
+        UINT8 r[64];
+        switch (opt) {
+        case NBD_OPT_EXPORT_NAME:
+            /* No reply header, and no way to refuse */
+            mem_set(r, 0, sizeof(r));
+            put64(r, size);
+            put16(r + 8, trans_flags(c));
+            if (hs_send(c, r, 10) != 0) return -1;
+            if (!no_zeroes) {
+                mem_set(b, 0, 124);
+                if (hs_send(c, b, 124) != 0) return -1;
+            }
+            return 1;
+        case NBD_OPT_ABORT:
+            opt_reply(c, opt, NBD_REP_ACK, NULL, 0);
+            return 0;
+        case NBD_OPT_LIST: {
+            UINT32 n = (UINT32)str_len(NBD_NAME);
+            put32(r, n);
+            mem_copy(r + 4, NBD_NAME, n);
+            if (opt_reply(c, opt, NBD_REP_SERVER, r, 4 + n) != 0
+                || opt_reply(c, opt, NBD_REP_ACK, NULL, 0) != 0)
+                return -1;
+            break;
+        }
+        case NBD_OPT_INFO:
+        case NBD_OPT_GO: {
+            /* The client sizes its requests to these: whole blocks,
+               none past what the pieces hold */
+            UINT32 pref = c->bs > 4096 ? c->bs : 4096;
+            put16(r, NBD_INFO_EXPORT);
+            put64(r + 2, size);
+            put16(r + 10, trans_flags(c));
+            if (opt_reply(c, opt, NBD_REP_INFO, r, 12) != 0) return -1;
+            put16(r, NBD_INFO_BLOCK_SIZE);
+            put32(r + 2, c->bs);
+            put32(r + 6, pref);
+            put32(r + 10, NBD_MAX_REQ);
+            if (opt_reply(c, opt, NBD_REP_INFO, r, 14) != 0
+                || opt_reply(c, opt, NBD_REP_ACK, NULL, 0) != 0)
+                return -1;
+            if (opt == NBD_OPT_GO) return 1;
+            break;
+        }
+        default:
+            if (opt_reply(c, opt, NBD_REP_ERR_UNSUP, NULL, 0) != 0) return -1;
+            break;
+        }
+    }
+}
+
+/* ---- Transmission ---- */
+
+static struct nbd_piece *piece_at(struct nbd_conn *c, UINT32 n) {
+    return &c->piece[n % NBD_PIECES];
+}
+
+static UINT32 pieces_free(struct nbd_conn *c) {
+    return NBD_PIECES - (c->p_tail - c->p_head);
+}
+
+/* Take the next piece for a disk transfer of len bytes at off */
+static struct nbd_piece *piece_take(struct nbd_conn *c, struct nbd_cmd *k) {
+    struct nbd_piece *p = piece_at(c, c->p_tail++);
+    p->io = NULL;
+    p->failed = 0;
+    p->len = 0;
+    k->count++;
+    return p;
+}
+
+static void submit_read(struct nbd_conn *c, struct nbd_piece *p, UINT64 off,
+                        UINT32 len) {
+    UINT64 lba = off / c->bs;
+    UINT64 end = (off + len + c->bs - 1) / c->bs;
+    p->data = p->buf + (off - lba * c->bs);
+    p->len = len;
+    p->io = disk_submit_read(c->q, lba, (UINTN)(end - lba), p->buf);
+    if (!p->io) p->failed = 1;
+}
+
+/* Move a write's data from the receive buffer into pieces, starting
+   each one on the device as it fills */
+static void fill_write(struct nbd_conn *c) {
+    while (c->wr_left > 0 && c->rx_pos < c->rx_len) {
+        if (!c->fill) {
+            if (pieces_free(c) == 0) return;
+            c->fill = piece_take(c, c->wr);
+            c->fill_len = 0;
+            c->fill_want = c->wr_left < NBD_PIECE ? c->wr_left : NBD_PIECE;
+        }
+        UINT32 n = c->fill_want - c->fill_len;
+        if (n > c->rx_len - c->rx_pos) n = c->rx_len - c->rx_pos;
+        mem_copy(c->fill->buf + c->fill_len, c->rx + c->rx_pos, n);
+        c->fill_len += n;
+        c->rx_pos += n;
+        c->wr_left -= n;
+        if (c->fill_len == c->fill_want) {
+            struct nbd_piece *p = c->fill;
+            p->len = c->fill_want;
+            p->io = disk_submit_write(c->q, c->wr_off / c->bs, p->len / c->bs, p->buf);
+            if (!p->io) p->failed = 1;
+            c->wr_off += p->len;
+            c->fill = NULL;
+        }
+    }
+    if (c->wr_left == 0 && !c->fill) {
+        c->wr->state = C_DISK;
+        c->wr = NULL;
+    }
+}
+
+/* Take requests from the receive buffer while there is room for them */
+static void parse(struct nbd_conn *c) {
+    UINT64 size = c->dev->size_bytes;
+    for (;;) {
+        UINT32 avail = c->rx_len - c->rx_pos;
+        if (c->skip) {
+            UINT32 n = c->skip < avail ? c->skip : avail;
+            c->rx_pos += n;
+            c->skip -= n;
+            if (c->skip) return;
+            continue;
+        }
+        if (c->wr) {
+            fill_write(c);
+            if (c->wr) return;
+            continue;
+        }
+        if (c->closing || avail < NBD_REQ_LEN || c->c_tail - c->c_head == NBD_CMDS)
+            return;
+
+        const UINT8 *h = c->rx + c->rx_pos;
+        if (get32(h) != NBD_REQ_MAGIC) {
+            c->dead = 1;
+            return;
+        }
+        UINT16 type = get16(h + 6);
+        UINT64 off = get64(h + 16);
+        UINT32 len = get32(h + 24);
+        int in_range = off <= size && len <= size - off && len <= NBD_MAX_REQ;
+        UINT32 need = (len + NBD_PIECE - 1) / NBD_PIECE;
+        if (type == NBD_CMD_READ && in_range && pieces_free(c) < need)
+            return;     /* wait for replies to give pieces back */
+        c->rx_pos += NBD_REQ_LEN;
+        if (type == NBD_CMD_DISC) {
+            c->closing = 1;
+            return;
+        }
+
+        struct nbd_cmd *k = &c->cmd[c->c_tail++ % NBD_CMDS];
+        k->state = C_DISK;
+        k->type = type;
+        k->error = 0;
+        k->first = c->p_tail;
+        k->count = 0;
+        k->len = len;
+        put32(k->reply, NBD_REPLY_MAGIC);
+        mem_copy(k->reply + 8, h + 8, 8);
+        c->requests++;
+
+        if (type == NBD_CMD_READ) {
+            if (!in_range) {
+                k->error = NBD_EINVAL;
+                continue;
+            }
+            for (UINT32 i = 0; i < need; i++) {
+                UINT32 n = len - i * NBD_PIECE < NBD_PIECE ? len - i * NBD_PIECE
+                                                           : NBD_PIECE;
+                submit_read(c, piece_take(c, k), off + (UINT64)i * NBD_PIECE, n);
+            }
+        } else if (type == NBD_CMD_WRITE) {
+            if (!c->writable || !in_range || off % c->bs || len % c->bs) {
+                k->error = c->writable ? NBD_EINVAL : NBD_EPERM;
+                c->skip = len;
+                continue;
+            }
+            k->state = C_FILL;
+            c->wr = k;
+            c->wr_off = off;
+            c->wr_left = len;
+            c->fill = NULL;
+        } else if (type != NBD_CMD_FLUSH) {
+            k->error = NBD_EINVAL;
+        }
+    }
+}
+
+/* Reap finished disk requests */
+static void pump_disk(struct nbd_conn *c) {
+    for (UINT32 n = c->p_head; n != c->p_tail; n++) {
+        struct nbd_piece *p = piece_at(c, n);
+        if (p->io && disk_poll(c->q, p->io)) {
+            if (disk_wait(c->q, p->io) != 0) p->failed = 1;
+            p->io = NULL;
+        }
+    }
+}
+
+/* Send replies, in order, for the requests whose disk work is done */
+static void send_replies(struct nbd_conn *c, struct progress *pg) {
+    while (c->c_sent != c->c_tail && !c->dead) {
+        struct nbd_cmd *k = &c->cmd[c->c_sent % NBD_CMDS];
+        if (k->state != C_DISK) return;
+        int failed = 0;
+        for (UINT32 i = 0; i < k->count; i++) {
+            struct nbd_piece *p = piece_at(c, k->first + i);
+            if (p->io) return;
+            failed |= p->failed;
+        }
+
+        UINT32 error = k->error;
+        if (!error && failed) error = NBD_EIO;
+        /* Every write before it has finished: replies go in order */
+        if (!error && k->type == NBD_CMD_FLUSH && disk_flush(c->dev) != 0)
+            error = NBD_EIO;
+        put32(k->reply + 4, error);
+        if (error) c->errors++;
+
+        k->txd.Push = TRUE;
+        k->txd.FragmentTable[0].FragmentLength = sizeof(k->reply);
+        k->txd.FragmentTable[0].FragmentBuffer = k->reply;
+        UINT32 frags = 1, bytes = sizeof(k->reply);
+        if (k->type == NBD_CMD_READ && !error) {
+            for (UINT32 i = 0; i < k->count; i++) {
+                struct nbd_piece *p = piece_at(c, k->first + i);
+                k->txd.FragmentTable[frags].FragmentLength = p->len;
+                k->txd.FragmentTable[frags].FragmentBuffer = p->data;
+                frags++;
+                bytes += p->len;
+            }
+            c->bytes_read += k->len;
+        } else if (k->type == NBD_CMD_WRITE && !error) {
+            c->bytes_written += k->len;
+        }
+        k->txd.DataLength = bytes;
+        k->txd.FragmentCount = frags;
+        k->tx.Packet.TxData = &k->txd;
+        if (EFI_ERROR(c->tcp->Transmit(c->tcp, &k->tx))) {
+            c->dead = 1;
+            return;
+        }
+        k->state = C_SEND;
+        c->c_sent++;
+        c->redraw |= progress_add(pg, k->len);
+    }
+}
+
+/* Retire sent replies and give their pieces back */
+static void reap_sends(struct nbd_conn *c) {
+    while (c->c_head != c->c_sent) {
+        struct nbd_cmd *k = &c->cmd[c->c_head % NBD_CMDS];
+        if (g_boot.bs->CheckEvent(k->tx.CompletionToken.Event) != EFI_SUCCESS)
+            return;
+        if (EFI_ERROR(k->tx.CompletionToken.Status)) c->dead = 1;
+        c->p_head += k->count;
+        k->state = C_FREE;
+        c->c_head++;
+    }
+}
+
+/* Keep a receive posted on the free end of the buffer */
+static void pump_rx(struct nbd_conn *c) {
+    if (c->rx_busy) {
+        if (g_boot.bs->CheckEvent(c->rx_tok.CompletionToken.Event) != EFI_SUCCESS)
+            return;
+        c->rx_busy = 0;
+        /* An error here is the client closing the connection */
+        if (EFI_ERROR(c->rx_tok.CompletionToken.Status)) {
+            c->dead = 1;
+            return;
+        }
+        c->rx_len += c->rxd.DataLength;
+    }
+    if (c->closing || c->dead) return;
+    if (c->rx_pos > 0) {
+        mem_move(c->rx, c->rx + c->rx_pos, c->rx_len - c->rx_pos);
+        c->rx_len -= c->rx_pos;
+        c->rx_pos = 0;
+    }
+    UINT32 space = NBD_RX - c->rx_len;
+    if (space == 0) return;
+    c->rxd.DataLength = space;
+    c->rxd.FragmentCount = 1;
+    c->rxd.FragmentTable[0].FragmentLength = space;
+    c->rxd.FragmentTable[0].FragmentBuffer = c->rx + c->rx_len;
+    c->rx_tok.Packet.RxData = &c->rxd;
+    if (EFI_ERROR(c->tcp->Receive(c->tcp, &c->rx_tok)))
+        c->dead = 1;
+    else
+        c->rx_busy = 1;
+}
+
+/* One client, from the handshake until it disconnects, breaks the
+   protocol or ESC is pressed */
+static void serve(struct nbd_conn *c, struct progress *pg, UINT32 row) {
+    c->p_head = c->p_tail = 0;
+    c->c_head = c->c_sent = c->c_tail = 0;
+    c->rx_pos = c->rx_len = 0;
+    c->rx_busy = 0;
+    c->wr = NULL;
+    c->fill = NULL;
+    c->skip = 0;
+    c->closing = c->dead = 0;
+
+    nbd_row(row, "Client connected, negotiating...", COLOR_WHITE);
+    fb_present();
+    int hs = handshake(c);
+    if (hs <= 0) {
+        c->dead = 1;
+    } else {
+        nbd_row(row, "Client attached.", COLOR_GREEN);
+        fb_present();
+    }
+
+    while (!c->dead && !c->esc) {
+        c->tcp->Poll(c->tcp);
+        pump_rx(c);
+        parse(c);
+        pump_disk(c);
+        send_replies(c, pg);
+        reap_sends(c);
+        if (c->closing && !c->wr && c->c_head == c->c_tail) break;
+        if (c->redraw) {
+            c->redraw = 0;
+            nbd_stats(c, pg, row);
+        }
+        if (nbd_esc()) c->esc = 1;
+    }
+    if (pg->done) nbd_stats(c, pg, row);
+
+    /* Nothing may still be reading into or writing from a piece once
+       it is freed */
+    for (UINT32 n = c->p_head; n != c->p_tail; n++) {
+        struct nbd_piece *p = piece_at(c, n);
+        if (p->io) disk_wait(c->q, p->io);
+        p->io = NULL;
+    }
+
+    /* A clean close lets the last replies drain; an abort cancels the
+       tokens still posted */
+    EFI_TCP4_CLOSE_TOKEN close;
+    mem_set(&close, 0, sizeof(close));
+    close.AbortOnClose = c->dead || c->esc;
+    if (!EFI_ERROR(g_boot.bs->CreateEvent(0, 0, NULL, NULL,
+                                          &close.CompletionToken.Event))) {
+        int esc = c->esc;
+        c->esc = 0;
+        if (!EFI_ERROR(c->tcp->Close(c->tcp, &close)))
+            wait_tok(c, &close.CompletionToken, NBD_CLOSE_MS);
+        c->esc |= esc;
+        g_boot.bs->CloseEvent(close.CompletionToken.Event);
+    }
+}
+
+/* ---- Export ---- */
+
+/* Tokens a closed connection signalled stay signalled: clear them
+   before the next client's first check */
+static void conn_clear_events(struct nbd_conn *c) {
+    for (int i = 0; i < NBD_CMDS; i++)
+        g_boot.bs->CheckEvent(c->cmd[i].tx.CompletionToken.Event);
+    g_boot.bs->CheckEvent(c->rx_tok.CompletionToken.Event);
+}
+
+static void conn_free(struct nbd_conn *c) {
+    for (int i = 0; i < NBD_PIECES; i++)
+        if (c->piece[i].buf) mem_io_put(c->piece[i].buf);
+    for (int i = 0; i < NBD_CMDS; i++)
+        if (c->cmd[i].tx.CompletionToken.Event)
+            g_boot.bs->CloseEvent(c->cmd[i].tx.CompletionToken.Event);
+    if (c->rx_tok.CompletionToken.Event)
+        g_boot.bs->CloseEvent(c->rx_tok.CompletionToken.Event);
+    if (c->rx) mem_free(c->rx);
+    mem_free(c);
+}
+
+static struct nbd_conn *conn_alloc(struct disk_device *dev, int writable) {
+    struct nbd_conn *c = (struct nbd_conn *)mem_alloc(sizeof(*c));
+    if (!c) return NULL;
+    c->dev = dev;
+    c->bs = dev->block_size ? dev->block_size : 512;
+    c->writable = writable;
+    c->rx = (UINT8 *)mem_alloc_raw(NBD_RX);
+    int ok = c->rx != NULL
+             && !EFI_ERROR(g_boot.bs->CreateEvent(0, 0, NULL, NULL,
+                                                  &c->rx_tok.CompletionToken.Event));
+    for (int i = 0; i < NBD_CMDS && ok; i++)
+        ok = !EFI_ERROR(g_boot.bs->CreateEvent(0, 0, NULL, NULL,
+                                               &c->cmd[i].tx.CompletionToken.Event));
+    for (int i = 0; i < NBD_PIECES && ok; i++)
+        ok = (c->piece[i].buf = (UINT8 *)mem_io_get(NBD_PIECE + 2 * c->bs)) != NULL;
+    if (!ok) {
+        conn_free(c);
+        return NULL;
+    }
+    return c;
+}
+
+void nbd_export_run(struct disk_device *dev) {
+    char buf[160];
+    fb_clear(COLOR_BLACK);
+    nbd_print("\n", COLOR_WHITE);
+    nbd_print("  ========================================\n", COLOR_CYAN);
+    nbd_print("       EXPORT OVER THE NETWORK (NBD)\n", COLOR_CYAN);
+    nbd_print("  ========================================\n", COLOR_CYAN);
+    nbd_print("\n", COLOR_WHITE);
+    snprintf(buf, sizeof(buf), "  Device: %s, %llu MB, %u-byte blocks\n\n", dev->name,
+             (unsigned long long)(dev->size_bytes / (1024 * 1024)),
+             dev->block_size);
+    nbd_print(buf, COLOR_WHITE);
+
+    int writable = 0;
+    if (dev->is_boot_device) {
+        nbd_print("  This is the boot device: it is exported read-only.\n", COLOR_YELLOW);
+        nbd_print("  ENTER: export   ESC: cancel\n", COLOR_DGRAY);
+    } else {
+        nbd_print("  ENTER: export read-only   W: allow writes   ESC: cancel\n",
+                  COLOR_DGRAY);
+    }
+    fb_present();
+    for (;;) {
+        struct key_event ev;
+        kbd_wait(&ev);
+        if (ev.code == KEY_ESC) return;
+        if (ev.code == KEY_ENTER) break;
+        if ((ev.code == 'w' || ev.code == 'W') && !dev->is_boot_device) {
+            writable = 1;
+            break;
+        }
+    }
+    nbd_print(writable ? "\n  Read-write: the client can change this device.\n"
+                       : "\n  Read-only.\n",
+              writable ? COLOR_RED : COLOR_WHITE);
+
+    nbd_print("  Getting a network address...\n", COLOR_DGRAY);
+    fb_present();
+    EFI_GUID sb_guid = EFI_TCP4_SERVICE_BINDING_PROTOCOL_GUID;
+    EFI_GUID tcp_guid = EFI_TCP4_PROTOCOL_GUID;
+    char addr[NET_ADDR_MAX], err[96];
+    EFI_SERVICE_BINDING_PROTOCOL *sb = net_service(&sb_guid, addr, err, sizeof(err));
+    if (!sb) {
+        snprintf(buf, sizeof(buf), "  %s\n", err);
+        nbd_print(buf, COLOR_RED);
+        nbd_wait_key();
+        return;
+    }
+
+    struct disk_queue *q = disk_queue_open(dev, NBD_PIECES, 0);
+    struct nbd_conn *c = q ? conn_alloc(dev, writable) : NULL;
+    if (!c) {
+        nbd_print(q ? "  Out of memory.\n" : "  Could not open the device.\n", COLOR_RED);
+        if (q) disk_queue_close(q);
+        nbd_wait_key();
+        return;
+    }
+    c->q = q;
+
+    /* The listener: big windows, scaled, and no Nagle delay on the
+       small replies to writes and flushes */
+    EFI_HANDLE listen_child = NULL;
+    EFI_TCP4_PROTOCOL *listen = NULL;
+    EFI_TCP4_OPTION opt;
+    mem_set(&opt, 0, sizeof(opt));
+    opt.ReceiveBufferSize = NBD_TCP_BUF;
+    opt.SendBufferSize = NBD_TCP_BUF;
+    opt.MaxSynBackLog = 1;
+    opt.EnableNagle = FALSE;
+    opt.EnableWindowScaling = TRUE;
+    opt.EnableSelectiveAck = TRUE;
+    EFI_TCP4_CONFIG_DATA cfg;
+    mem_set(&cfg, 0, sizeof(cfg));
+    cfg.TimeToLive = 64;
+    cfg.AccessPoint.UseDefaultAddress = TRUE;
+    cfg.AccessPoint.StationPort = NBD_PORT;
+    cfg.AccessPoint.ActiveFlag = FALSE;
+    cfg.ControlOption = &opt;
+    EFI_TCP4_LISTEN_TOKEN accept;
+    mem_set(&accept, 0, sizeof(accept));
+    if (EFI_ERROR(sb->CreateChild(sb, &listen_child))
+        || EFI_ERROR(g_boot.bs->HandleProtocol(listen_child, &tcp_guid,
+                                               (VOID **)&listen))
+        || EFI_ERROR(listen->Configure(listen, &cfg))
+        || EFI_ERROR(g_boot.bs->CreateEvent(0, 0, NULL, NULL,
+                                            &accept.CompletionToken.Event))) {
+        nbd_print("  Could not listen on TCP port 10809.\n", COLOR_RED);
+        if (listen) listen->Configure(listen, NULL);
+        if (listen_child) sb->DestroyChild(sb, listen_child);
+        conn_free(c);
+        disk_queue_close(q);
+        nbd_wait_key();
+        return;
+    }
+
+    snprintf(buf, sizeof(buf), "\n  Listening on %s port %u. On the other machine:\n\n",
+             addr, NBD_PORT);
+    nbd_print(buf, COLOR_WHITE);
+    snprintf(buf, sizeof(buf), "    nbd-client %s /dev/nbd0 -N %s\n", addr, NBD_NAME);
+    nbd_print(buf, COLOR_GREEN);
+    nbd_print("    ddrescue /dev/nbd0 disk.img disk.map\n\n", COLOR_GREEN);
+    nbd_print("  One client at a time. ESC stops the export.\n\n", COLOR_DGRAY);
+    UINT32 row = g_boot.cursor_y;
+
+    struct progress pg;
+    progress_start(&pg, "Served", 0);
+    int posted = 0;
+    while (!c->esc) {
+        if (!posted) {
+            nbd_row(row, "Waiting for a client...", COLOR_DGRAY);
+            fb_present();
+            if (EFI_ERROR(listen->Accept(listen, &accept))) {
+                nbd_row(row, "The listener failed.", COLOR_RED);
+                break;
+            }
+            posted = 1;
+        }
+        listen->Poll(listen);
+        if (g_boot.bs->CheckEvent(accept.CompletionToken.Event) == EFI_SUCCESS) {
+            posted = 0;
+            EFI_HANDLE child = accept.NewChildHandle;
+            if (!EFI_ERROR(accept.CompletionToken.Status)
+                && !EFI_ERROR(g_boot.bs->HandleProtocol(child, &tcp_guid,
+                                                        (VOID **)&c->tcp)))
+                serve(c, &pg, row);
+            if (child) sb->DestroyChild(sb, child);
+            conn_clear_events(c);
+            continue;
+        }
+        if (nbd_esc()) c->esc = 1;
+    }
+
+    /* Unconfiguring the listener cancels a posted accept */
+    listen->Configure(listen, NULL);
+    sb->DestroyChild(sb, listen_child);
+    g_boot.bs->CloseEvent(accept.CompletionToken.Event);
+
+    UINT64 served = c->bytes_read + c->bytes_written;
+    UINT32 errors = c->errors;
+    conn_free(c);
+    disk_queue_close(q);
+    if (writable) disk_reconnect(dev);
+
+    if (served) {
+        snprintf(buf, sizeof(buf), "NBD export of %s%s", dev->name,
+                 writable ? " (read-write)" : "");
+        progress_log(&pg, buf, errors == 0);
+    }
+    g_boot.cursor_y = row + 2;
+    nbd_print("\n  Export stopped.\n", COLOR_WHITE);
+    nbd_wait_key();
+}
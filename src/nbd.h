@@ -0,0 +1,35 @@
+/*
+ * nbd.h — Export a device to another machine over NBD
+ *
+ * A dying disk is best pulled off whole, at the speed of the LAN, by
+ * ddrescue on a machine with room for the image. The workstation
+ * listens on TCP (net.h brings the interface up) and speaks the fixed
+ * newstyle NBD handshake, so on a Linux host
+ *
+ *     nbd-client <address> /dev/nbd0 -N survival
+ *     ddrescue /dev/nbd0 disk.img disk.map
+ *
+ * sees the device as a local one. Reads go through the device's async
+ * queue (disk.h) and are sent as soon as a whole request has been
+ * read; an unreadable span is answered with EIO, as ddrescue needs.
+ * Exports are read-only unless writes are asked for.
+ */
+#ifndef NBD_H
+#define NBD_H
+
+#include "disk.h"
+
+#define NBD_PORT      10809             /* IANA's, nbd-client's default */
+#define NBD_PIECE     (1024 * 1024)     /* device bytes per buffer */
+#define NBD_PIECES    32                /* buffers, also the queue depth */
+#define NBD_MAX_REQ   (NBD_PIECE * NBD_PIECES)  /* largest request taken */
+#define NBD_CMDS      64                /* requests in flight */
+#define NBD_RX        (256 * 1024)      /* receive buffer */
+#define NBD_TCP_BUF   (4 * 1024 * 1024) /* TCP send and receive windows */
+
+/* Serve dev until ESC, each client in turn. Asks read-only (the
+   default) or read-write first; the boot device is only ever
+   read-only. */
+void nbd_export_run(struct disk_device *dev);
+
+#endif /* NBD_H */
@@ -0,0 +1,535 @@
+/*
+ * net.c — HTTP downloads through the firmware's network stack
+ *
+ * EFI_HTTP_PROTOCOL does DNS, TCP and the HTTP framing (chunked bodies
+ * included); what is left here is finding an interface with an
+ * address, the request headers, redirects and keeping a receive posted.
+ * The firmware's network drivers run from its timer, so a receive
+ * posted before the caller starts writing out the last one fills while
+ * that write goes on.
+ */
+
+#include "boot.h"
+#include "mem.h"
+#include "timer.h"
+#include "net.h"
+#include "shim.h"
+
+struct net_get {
+    EFI_SERVICE_BINDING_PROTOCOL *sb;
+    EFI_HANDLE child;
+    EFI_HTTP_PROTOCOL *http;
+    EFI_HTTP_TOKEN token;
+    EFI_HTTP_MESSAGE msg;
+    int busy;                       /* token posted, not yet seen done */
+    int posted;                     /* buffer the posted receive fills */
+    UINT8 *buf[2];
+    UINT64 size, got;
+    int done, error;
+};
+
+/* EFI_HTTP_STATUS_CODE to the number on the wire */
+static const UINT16 s_status[] = {
+    0, 100, 101, 200, 201, 202, 203, 204, 205, 206,
+    300, 301, 302, 303, 304, 305, 307,
+    400, 401, 402, 403, 404, 405, 406, 407, 408, 409, 410, 411, 412,
+    413, 414, 415, 416, 417,
+    500, 501, 502, 503, 504, 505, 308, 429,
+};
+
+static UINT32 status_number(EFI_HTTP_STATUS_CODE code) {
+    return (UINTN)code < sizeof(s_status) / sizeof(s_status[0])
+           ? s_status[code] : 0;
+}
+
+/* ---- URLs ---- */
+
+/* Length of "http://" or "https://" at the start of url, 0 if neither */
+static UINTN scheme_len(const char *url) {
+    if (strncmp(url, "http://", 7) == 0) return 7;
+    if (strncmp(url, "https://", 8) == 0) return 8;
+    return 0;
+}
+
+/* Offset of the path (or the end) after scheme and authority */
+static UINTN path_start(const char *url) {
+    UINTN i = scheme_len(url);
+    while (url[i] && url[i] != '/' && url[i] != '?' && url[i] != '#') i++;
+    return i;
+}
+
+static int lower(int c) {
+    return c >= 'A' && c <= 'Z' ? c + 32 : c;
+}
+
+static int name_is(const char *a, const char *b) {
+    while (*a && lower(*a) == lower(*b)) a++, b++;
+    return *a == 0 && *b == 0;
+}
+
+static int hex_digit(int c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    c = lower(c);
+    return c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+}
+
+void net_url_name(const char *url, char *out, UINTN max) {
+    UINTN p = path_start(url), end = p, seg = p;
+    while (url[end] && url[end] != '?' && url[end] != '#') {
+        if (url[end] == '/') seg = end + 1;
+        end++;
+    }
+
+    UINTN n = 0;
+    for (UINTN i = seg; i < end && n + 1 < max; i++) {
+        int c = (UINT8)url[i];
+        if (c == '%' && i + 2 < end && hex_digit(url[i + 1]) >= 0
+            && hex_digit(url[i + 2]) >= 0) {
+            c = hex_digit(url[i + 1]) * 16 + hex_digit(url[i + 2]);
+            i += 2;
+        }
+        if (c < 0x20 || c >= 0x7F || c == '\\' || c == '/' || c == ':'
+            || c == '*' || c == '?' || c == '"' || c == '<' || c == '>'
+            || c == '|')
+            c = '_';
+        out[n++] = (char)c;
+    }
+    if (n == 0) {
+        str_copy(out, "download", max);
+        return;
+    }
+    out[n] = '\0';
+}
+
+/* The target of a redirect from url, made absolute. Returns 0 on
+   success. */
+static int resolve(const char *url, const char *loc, char *out, UINTN max) {
+    UINTN n = 0;
+    if (scheme_len(loc)) {
+        /* already absolute */
+    } else if (loc[0] == '/' && loc[1] == '/') {
+        n = scheme_len(url) - 2;            /* "http:" */
+    } else if (loc[0] == '/') {
+        n = path_start(url);
+    } else {
+        /* Relative to the directory of the path */
+        UINTN p = path_start(url), end = p;
+        while (url[end] && url[end] != '?' && url[end] != '#') {
+            if (url[end] == '/') n = end + 1;
+            end++;
+        }
+        if (n == 0) n = p;
+    }
+    if (n + str_len(loc) + 2 > max) return -1;
+    mem_copy(out, url, n);
+    out[n] = '\0';
+    if (n && loc[0] != '/' && out[n - 1] != '/' && !scheme_len(loc))
+        out[n++] = '/';
+    str_copy(out + n, loc, max - n);
+    return 0;
+}
+
+/* ---- Interfaces ---- */
+
+/* Whether the interface already has an IPv4 address; if so and addr is
+   not NULL, the address in dotted form */
+static int has_address(EFI_IP4_CONFIG2_PROTOCOL *cfg, char *addr) {
+    UINTN size = 0;
+    if (cfg->GetData(cfg, Ip4Config2DataTypeInterfaceInfo, &size, NULL)
+        != EFI_BUFFER_TOO_SMALL)
+        return 0;
+    EFI_IP4_CONFIG2_INTERFACE_INFO *info =
+        (EFI_IP4_CONFIG2_INTERFACE_INFO *)mem_alloc(size);
+    if (!info) return 0;
+
+    int ok = 0;
+    if (!EFI_ERROR(cfg->GetData(cfg, Ip4Config2DataTypeInterfaceInfo,
+                                &size, info))) {
+        UINT8 *a = info->StationAddress.Addr;
+        ok = (a[0] | a[1] | a[2] | a[3]) != 0;
+        if (ok && addr)
+            snprintf(addr, NET_ADDR_MAX, "%u.%u.%u.%u", a[0], a[1], a[2], a[3]);
+    }
+    mem_free(info);
+    return ok;
+}
+
+/* Handles with the service binding; the network stack is connected to
+   every interface first if none is there (the firmware does that only
+   for a network boot) */
+static EFI_HANDLE *service_handles(EFI_GUID *sb_guid, UINTN *count) {
+    EFI_GUID snp_guid = EFI_SIMPLE_NETWORK_PROTOCOL_GUID;
+    EFI_HANDLE *handles = NULL;
+
+    *count = 0;
+    if (!EFI_ERROR(g_boot.bs->LocateHandleBuffer(ByProtocol, sb_guid, NULL,
+                                                 count, &handles)) && *count)
+        return handles;
+
+    UINTN nsnp = 0;
+    EFI_HANDLE *snp = NULL;
+    if (EFI_ERROR(g_boot.bs->LocateHandleBuffer(ByProtocol, &snp_guid, NULL,
+                                                &nsnp, &snp)))
+        return NULL;
+    for (UINTN i = 0; i < nsnp; i++)
+        g_boot.bs->ConnectController(snp[i], NULL, NULL, TRUE);
+    g_boot.bs->FreePool(snp);
+
+    *count = 0;
+    if (EFI_ERROR(g_boot.bs->LocateHandleBuffer(ByProtocol, sb_guid, NULL,
+                                                count, &handles)))
+        return NULL;
+    return handles;
+}
+
+/* DHCP is started on every interface without an address and the
+   first to get one within NET_DHCP_MS wins; an interface without
+   Ip4Config2 is taken as configured */
+EFI_SERVICE_BINDING_PROTOCOL *net_service(EFI_GUID *sb_guid, char *addr,
+                                          char *err, UINTN errsz) {
+    EFI_GUID cfg_guid = EFI_IP4_CONFIG2_PROTOCOL_GUID;
+    UINTN count;
+    EFI_HANDLE *handles = service_handles(sb_guid, &count);
+    if (!handles) {
+        snprintf(err, errsz, "No network interface with the protocol needed");
+        return NULL;
+    }
+    if (addr) str_copy(addr, "?", NET_ADDR_MAX);
+
+    EFI_SERVICE_BINDING_PROTOCOL *sb = NULL;
+    EFI_HANDLE found = NULL;
+    for (int pass = 0; pass < 2 && !found; pass++) {
+        for (UINTN i = 0; i < count && !found; i++) {
+            EFI_IP4_CONFIG2_PROTOCOL *cfg = NULL;
+            if (EFI_ERROR(g_boot.bs->HandleProtocol(handles[i], &cfg_guid,
+                                                    (VOID **)&cfg)) || !cfg)
+                found = handles[i];
+            else if (has_address(cfg, addr))
+                found = handles[i];
+            else if (pass == 1) {
+                /* Already DHCP (and still waiting) is refused: harmless */
+                EFI_IP4_CONFIG2_POLICY policy = Ip4Config2PolicyDhcp;
+                cfg->SetData(cfg, Ip4Config2DataTypePolicy, sizeof(policy),
+                             &policy);
+            }
+        }
+    }
+
+    UINT64 hz = timer_hz(), t0 = timer_ticks();
+    while (!found && timer_ticks() - t0 < hz / 1000 * NET_DHCP_MS) {
+        g_boot.bs->Stall(100000);
+        for (UINTN i = 0; i < count && !found; i++) {
+            EFI_IP4_CONFIG2_PROTOCOL *cfg = NULL;
+            if (!EFI_ERROR(g_boot.bs->HandleProtocol(handles[i], &cfg_guid,
+                                                     (VOID **)&cfg))
+                && cfg && has_address(cfg, addr))
+                found = handles[i];
+        }
+    }
+
+    if (!found)
+        snprintf(err, errsz, "No address from DHCP (is a cable plugged in?)");
+    else if (EFI_ERROR(g_boot.bs->HandleProtocol(found, sb_guid,
+                                                 (VOID **)&sb)))
+        sb = NULL;
+    g_boot.bs->FreePool(handles);
+    return sb;
+}
+
+/* ---- Transfers ---- */
+
+/* Poll until the posted token completes. Returns 0 when it has, -1
+   after NET_TIMEOUT_MS without. */
+static int wait_token(struct net_get *g) {
+    UINT64 hz = timer_hz(), t0 = timer_ticks();
+    while (g_boot.bs->CheckEvent(g->token.Event) != EFI_SUCCESS) {
+        g->http->Poll(g->http);
+        if (timer_ticks() - t0 > hz / 1000 * NET_TIMEOUT_MS)
+            return -1;
+    }
+    g->busy = 0;
+    return 0;
+}
+
+/* Free a response's header array the way the firmware built it: each
+   name and value from the pool, then the array */
+static void free_headers(EFI_HTTP_MESSAGE *m) {
+    for (UINTN i = 0; i < m->HeaderCount; i++) {
+        if (m->Headers[i].FieldName) g_boot.bs->FreePool(m->Headers[i].FieldName);
+        if (m->Headers[i].FieldValue) g_boot.bs->FreePool(m->Headers[i].FieldValue);
+    }
+    if (m->Headers) g_boot.bs->FreePool(m->Headers);
+    m->Headers = NULL;
+    m->HeaderCount = 0;
+}
+
+static UINT64 parse_u64(const char *s) {
+    UINT64 v = 0;
+    while (*s == ' ') s++;
+    if (*s < '0' || *s > '9') return NET_SIZE_UNKNOWN;
+    while (*s >= '0' && *s <= '9') v = v * 10 + (UINT64)(*s++ - '0');
+    return v;
+}
+
+void net_close(struct net_get *g) {
+    if (!g) return;
+    int leak = 0;
+    if (g->busy) {
+        /* Cancel signals the token; if it does not, the firmware may
+           still write into the buffer, so give it up */
+        g->http->Cancel(g->http, &g->token);
+        leak = g_boot.bs->CheckEvent(g->token.Event) != EFI_SUCCESS;
+    }
+    if (g->http) g->http->Configure(g->http, NULL);
+    if (g->child) g->sb->DestroyChild(g->sb, g->child);
+    if (g->token.Event) g_boot.bs->CloseEvent(g->token.Event);
+    if (!leak) {
+        mem_free(g->buf[0]);
+        mem_free(g->buf[1]);
+    }
+    mem_free(g);
+}
+
+/* One GET on a fresh HTTP child: the request and the response headers.
+   Returns the HTTP status number (0 on a transport error, with err
+   set) and, for a redirect, the target in loc. */
+static UINT32 get_once(struct net_get *g, const char *url, char *loc,
+                       UINTN locsz, char *err, UINTN errsz) {
+    EFI_GUID http_guid = EFI_HTTP_PROTOCOL_GUID;
+    if (EFI_ERROR(g->sb->CreateChild(g->sb, &g->child))
+        || EFI_ERROR(g_boot.bs->HandleProtocol(g->child, &http_guid,
+                                               (VOID **)&g->http))) {
+        g->http = NULL;
+        snprintf(err, errsz, "Could not open an HTTP instance");
+        return 0;
+    }
+
+    EFI_HTTPv4_ACCESS_POINT ap;
+    mem_set(&ap, 0, sizeof(ap));
+    ap.UseDefaultAddress = TRUE;
+    EFI_HTTP_CONFIG_DATA cfg;
+    mem_set(&cfg, 0, sizeof(cfg));
+    cfg.HttpVersion = HttpVersion11;
+    cfg.TimeOutMillisec = NET_TIMEOUT_MS;
+    cfg.LocalAddressIsIPv6 = FALSE;
+    cfg.AccessPoint.IPv4Node = &ap;
+    if (EFI_ERROR(g->http->Configure(g->http, &cfg))) {
+        snprintf(err, errsz, "Could not configure HTTP");
+        return 0;
+    }
+
+    /* The firmware sends only the headers it is given */
+    CHAR16 url16[NET_URL_MAX];
+    UINTN n = 0;
+    for (; url[n] && n + 1 < NET_URL_MAX; n++) url16[n] = (UINT8)url[n];
+    url16[n] = 0;
+
+    char host[256];
+    UINTN hs = scheme_len(url), he = path_start(url);
+    if (he - hs >= sizeof(host)) he = hs + sizeof(host) - 1;
+    mem_copy(host, url + hs, he - hs);
+    host[he - hs] = '\0';
+
+    EFI_HTTP_HEADER req_headers[3] = {
+        { "Host", host },
+        { "Accept", "*/*" },
+        { "User-Agent", "Survival" },
+    };
+    EFI_HTTP_REQUEST_DATA req = { HttpMethodGet, url16 };
+    mem_set(&g->msg, 0, sizeof(g->msg));
+    g->msg.Data.Request = &req;
+    g->msg.HeaderCount = 3;
+    g->msg.Headers = req_headers;
+    g->token.Status = EFI_SUCCESS;
+    g->token.Message = &g->msg;
+
+    EFI_STATUS status = g->http->Request(g->http, &g->token);
+    if (!EFI_ERROR(status)) {
+        g->busy = 1;
+        status = wait_token(g) == 0 ? g->token.Status : EFI_NOT_READY;
+    }
+    if (EFI_ERROR(status)) {
+        snprintf(err, errsz, "Request failed (EFI error %u)",
+                 (unsigned)(status & 0xFFFF));
+        return 0;
+    }
+
+    /* Headers only: body bytes that came with them are kept for the
+       first body receive */
+    EFI_HTTP_RESPONSE_DATA resp;
+    resp.StatusCode = HTTP_STATUS_UNSUPPORTED_STATUS;
+    mem_set(&g->msg, 0, sizeof(g->msg));
+    g->msg.Data.Response = &resp;
+    g->token.Status = EFI_SUCCESS;
+    status = g->http->Response(g->http, &g->token);
+    if (!EFI_ERROR(status)) {
+        g->busy = 1;
+        status = wait_token(g) == 0 ? g->token.Status : EFI_NOT_READY;
+    }
+    if (EFI_ERROR(status)) {
+        free_headers(&g->msg);
+        snprintf(err, errsz, "No response (EFI error %u)",
+                 (unsigned)(status & 0xFFFF));
+        return 0;
+    }
+
+    g->size = NET_SIZE_UNKNOWN;
+    loc[0] = '\0';
+    for (UINTN i = 0; i < g->msg.HeaderCount; i++) {
+        EFI_HTTP_HEADER *h = &g->msg.Headers[i];
+        if (!h->FieldName || !h->FieldValue) continue;
+        if (name_is(h->FieldName, "Content-Length"))
+            g->size = parse_u64(h->FieldValue);
+        else if (name_is(h->FieldName, "Location"))
+            str_copy(loc, h->FieldValue, locsz);
+    }
+    free_headers(&g->msg);
+    return status_number(resp.StatusCode);
+}
+
+/* Drop the HTTP child, keeping the buffers, for the next redirect */
+static void reset_child(struct net_get *g) {
+    if (g->busy) {
+        g->http->Cancel(g->http, &g->token);
+        g->busy = 0;
+    }
+    if (g->http) g->http->Configure(g->http, NULL);
+    if (g->child) g->sb->DestroyChild(g->sb, g->child);
+    g->http = NULL;
+    g->child = NULL;
+}
+
+struct net_get *net_open(const char *url, UINT64 *size, char *err, UINTN errsz) {
+    err[0] = '\0';
+    if (!scheme_len(url) || str_len(url) >= NET_URL_MAX) {
+        snprintf(err, errsz, "Not an http:// or https:// URL");
+        return NULL;
+    }
+
+    struct net_get *g = (struct net_get *)mem_alloc(sizeof(*g));
+    if (!g) {
+        snprintf(err, errsz, "Out of memory");
+        return NULL;
+    }
+    g->buf[0] = (UINT8 *)mem_alloc(NET_BUF_SIZE);
+    g->buf[1] = (UINT8 *)mem_alloc(NET_BUF_SIZE);
+    if (!g->buf[0] || !g->buf[1]
+        || EFI_ERROR(g_boot.bs->CreateEvent(0, 0, NULL, NULL, &g->token.Event))) {
+        g->token.Event = NULL;
+        net_close(g);
+        snprintf(err, errsz, "Out of memory");
+        return NULL;
+    }
+    EFI_GUID sb_guid = EFI_HTTP_SERVICE_BINDING_PROTOCOL_GUID;
+    g->sb = net_service(&sb_guid, NULL, err, errsz);
+    if (!g->sb) {
+        net_close(g);
+        return NULL;
+    }
+
+    char cur[NET_URL_MAX], loc[NET_URL_MAX];
+    str_copy(cur, url, sizeof(cur));
+    for (int hops = 0;; hops++) {
+        UINT32 code = get_once(g, cur, loc, sizeof(loc), err, errsz);
+        if (code == 200) break;
+
+        int redirect = code == 301 || code == 302 || code == 303
+                    || code == 307 || code == 308;
+        if (code && redirect && loc[0] && hops < NET_REDIRECTS) {
+            char next[NET_URL_MAX];
+            if (resolve(cur, loc, next, sizeof(next)) == 0 && scheme_len(next)) {
+                str_copy(cur, next, sizeof(cur));
+                reset_child(g);
+                continue;
+            }
+        }
+        if (code && redirect)
+            snprintf(err, errsz, "Redirect not followed (HTTP %u)", (unsigned)code);
+        else if (code)
+            snprintf(err, errsz, "HTTP %u", (unsigned)code);
+        net_close(g);
+        return NULL;
+    }
+
+    *size = g->size;
+    return g;
+}
+
+/* Post the next body receive into buffer i */
+static int post_recv(struct net_get *g, int i) {
+    mem_set(&g->msg, 0, sizeof(g->msg));
+    g->msg.Data.Response = NULL;
+    g->msg.BodyLength = NET_BUF_SIZE;
+    if (g->size != NET_SIZE_UNKNOWN && g->size - g->got < NET_BUF_SIZE)
+        g->msg.BodyLength = (UINTN)(g->size - g->got);
+    g->msg.Body = g->buf[i];
+    g->token.Status = EFI_SUCCESS;
+    if (EFI_ERROR(g->http->Response(g->http, &g->token)))
+        return -1;
+    g->posted = i;
+    g->busy = 1;
+    return 0;
+}
+
+const void *net_next(struct net_get *g, UINTN *len) {
+    *len = 0;
+    if (g->done || g->error) return NULL;
+    if (g->size != NET_SIZE_UNKNOWN && g->got >= g->size) {
+        g->done = 1;
+        return NULL;
+    }
+    if (!g->busy && post_recv(g, 0) != 0) {
+        g->error = 1;
+        return NULL;
+    }
+
+    int i = g->posted;
+    if (wait_token(g) != 0) {
+        g->error = 1;
+        return NULL;
+    }
+
+    /* Without a length the body ends with the connection or an empty
+       receive; with one, either is an error before it is all here */
+    UINTN n = EFI_ERROR(g->token.Status) ? 0 : g->msg.BodyLength;
+    if (n == 0) {
+        if (g->size == NET_SIZE_UNKNOWN) g->done = 1;
+        else g->error = 1;
+        return NULL;
+    }
+    g->got += n;
+
+    /* Receive into the other buffer while the caller uses this one; a
+       closed connection refuses it, the end when there is no length */
+    if ((g->size == NET_SIZE_UNKNOWN || g->got < g->size)
+        && post_recv(g, i ^ 1) != 0) {
+        if (g->size == NET_SIZE_UNKNOWN) g->done = 1;
+        else g->error = 1;
+    }
+    *len = n;
+    return g->buf[i];
+}
+
+int net_error(const struct net_get *g) {
+    return g->error;
+}
+
+int net_fetch_small(const char *url, char *buf, UINTN *len) {
+    char err[80];
+    UINT64 size;
+    struct net_get *g = net_open(url, &size, err, sizeof(err));
+    if (!g) return -1;
+
+    UINTN have = 0, n;
+    const void *data;
+    while ((data = net_next(g, &n)) != NULL) {
+        if (n > *len - have) n = *len - have;
+        mem_copy(buf + have, data, n);
+        have += n;
+        if (have == *len) break;
+    }
+    int rc = net_error(g) ? -1 : 0;
+    net_close(g);
+    *len = have;
+    return rc;
+}
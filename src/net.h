@@ -0,0 +1,59 @@
+/*
+ * net.h — HTTP downloads through the firmware's network stack
+ *
+ * A GET over EFI_HTTP_PROTOCOL on the first network interface that
+ * has (or gets, by DHCP) an IPv4 address. The firmware resolves the
+ * host and runs TCP; redirects are followed here. The body streams
+ * through two buffers: while the caller hashes and writes one, the
+ * next receive is already posted into the other.
+ */
+#ifndef NET_H
+#define NET_H
+
+#include "boot.h"
+
+#define NET_URL_MAX    512
+#define NET_BUF_SIZE   (1024 * 1024)    /* per receive buffer */
+#define NET_DHCP_MS    15000            /* wait for an address */
+#define NET_TIMEOUT_MS 30000            /* no progress at all */
+#define NET_REDIRECTS  5
+
+#define NET_SIZE_UNKNOWN (~0ULL)        /* no Content-Length */
+#define NET_ADDR_MAX     16             /* "255.255.255.255" */
+
+/* The service binding sb_guid (HTTP's, TCP4's) on the first network
+   interface that has an IPv4 address, getting one by DHCP if none has.
+   The address goes to addr (NET_ADDR_MAX bytes) unless it is NULL.
+   Returns NULL on error, with a one-line reason in err. */
+EFI_SERVICE_BINDING_PROTOCOL *net_service(EFI_GUID *sb_guid, char *addr,
+                                          char *err, UINTN errsz);
+
+struct net_get;
+
+/* Start a GET of url (http:// or https:// if the firmware has TLS).
+   *size is the body length or NET_SIZE_UNKNOWN. Returns NULL on error,
+   with a one-line reason in err. */
+struct net_get *net_open(const char *url, UINT64 *size, char *err, UINTN errsz);
+
+/* The next piece of the body, valid until the next call: *len bytes,
+   at most NET_BUF_SIZE. Returns NULL at the end of the body or on an
+   error; net_error() tells which. */
+const void *net_next(struct net_get *g, UINTN *len);
+
+/* Nonzero once the transfer has failed: a receive error, a stall past
+   NET_TIMEOUT_MS, or a body shorter than its Content-Length */
+int net_error(const struct net_get *g);
+
+/* Cancel whatever is in flight and free the transfer */
+void net_close(struct net_get *g);
+
+/* GET a small document (a .sha256 file) into buf. *len is its size on
+   entry, the bytes read on return. Returns 0 on success. */
+int net_fetch_small(const char *url, char *buf, UINTN *len);
+
+/* The last path segment of url, without query or fragment, for a file
+   name; "download" when there is none. Characters a FAT name cannot
+   hold become '_'. */
+void net_url_name(const char *url, char *out, UINTN max);
+
+#endif /* NET_H */
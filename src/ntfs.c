@@ -11,6 +11,9 @@
 
 #include "ntfs.h"
 #include "mem.h"
+#include "trace.h"
+#include "bcache.h"
+#include "dirsort.h"
 
 /* ------------------------------------------------------------------ */
 /* On-disk structure definitions                                       */
@@ -186,34 +189,52 @@ struct ntfs_index_entry_header {
 /* $FILE_NAME flags */
 #define NTFS_FILE_ATTR_DIRECTORY  0x10000000
 
-/* Sector cache */
-#define NTFS_CACHE_SIZE           16
+/* Attribute header flags */
+#define NTFS_ATTR_FLAG_COMPRESSED 0x00FF
+#define NTFS_ATTR_FLAG_ENCRYPTED  0x4000
+#define NTFS_ATTR_FLAG_SPARSE     0x8000
 
-/* Maximum number of data runs we track */
-#define NTFS_MAX_RUNS             512
+/* An LZNT1 chunk expands to at most this many bytes */
+#define NTFS_LZNT1_CHUNK          4096
+
+/* Largest compression unit (Windows uses 16 clusters of up to 4 KB) */
+#define NTFS_MAX_CU_SIZE          65536
+
+/* Default cap on a single data read */
+#define NTFS_DEFAULT_MAX_XFER     (1024 * 1024)
 
 /* Maximum path components */
 #define NTFS_MAX_PATH_DEPTH       32
 
-/* Maximum directory entries for readdir dedup */
-#define NTFS_MAX_DIR_ENTRIES      1024
-
 /* Maximum MFT record size we expect */
 #define NTFS_MAX_MFT_SIZE         4096
 
 /* Maximum index block size we expect */
 #define NTFS_MAX_INDX_SIZE        65536
 
+/* Fixed-up MFT records kept in memory */
+#define NTFS_MFT_CACHE_SLOTS      64
+
+/* Records one ntfs_mft_prefetch() brings in: half the cache, so a batch
+   never evicts itself or the directory walk's own records */
+#define NTFS_MFT_PREFETCH_MAX     (NTFS_MFT_CACHE_SLOTS / 2)
+
+/* Unwanted records a prefetch run reads through to join two wanted ones */
+#define NTFS_MFT_PREFETCH_GAP     8
+
+/* Longest $FILE_NAME name, in UTF-16 units */
+#define NTFS_MAX_NAME_LEN         255
+
+/* Index B-tree depth limit (guards against loops on corrupt volumes) */
+#define NTFS_MAX_INDEX_DEPTH      32
+
+/* Well-known MFT record holding the upcase table */
+#define NTFS_MFT_RECORD_UPCASE    10
+
 /* ------------------------------------------------------------------ */
 /* Volume structure                                                    */
 /* ------------------------------------------------------------------ */
 
-struct ntfs_cache_entry {
-    UINT64  sector;
-    UINT8  *data;
-    int     valid;
-};
-
 /* A decoded data run extent */
 struct ntfs_extent {
     UINT64  vcn;        /* starting VCN for this extent */
@@ -221,6 +242,28 @@ struct ntfs_extent {
     UINT64  length;     /* number of clusters */
 };
 
+/* A growable array of extents, in VCN order once complete */
+struct ntfs_runlist {
+    struct ntfs_extent *ext;
+    int     count;
+    int     cap;
+};
+
+/* Sizes and layout of a non-resident stream, from its first piece */
+struct ntfs_stream_info {
+    UINT64  size;           /* data size in bytes */
+    UINT64  init_size;      /* initialized size; beyond it reads as zero */
+    UINT16  flags;          /* NTFS_ATTR_FLAG_* */
+    UINT8   cu_shift;       /* compression unit, log2 of clusters */
+};
+
+/* One cached, fixed-up MFT record */
+struct ntfs_mft_slot {
+    UINT64  rec;
+    UINT32  stamp;      /* LRU clock, 0 = empty */
+    UINT8  *buf;
+};
+
 struct ntfs_vol {
     ntfs_block_read_fn  read_fn;
     void               *ctx;
@@ -234,13 +277,8 @@ struct ntfs_vol {
     UINT64  mft_cluster;           /* starting cluster of $MFT */
     UINT64  total_sectors;
 
-    /* Cached $MFT data runs (raw bytes from the attribute) */
-    UINT8  *mft_runs;
-    UINT32  mft_runs_len;
-
-    /* Decoded $MFT extents for fast lookup */
-    struct ntfs_extent *mft_extents;
-    int     mft_extent_count;
+    /* Decoded $MFT extents (including any attribute-list pieces) */
+    struct ntfs_runlist mft_map;
 
     /* Volume label */
     char    label[48];
@@ -249,8 +287,24 @@ struct ntfs_vol {
     UINT64  total_clusters;
 
     /* Sector cache */
-    struct ntfs_cache_entry cache[NTFS_CACHE_SIZE];
-    int     cache_clock;           /* simple clock eviction */
+    struct bcache *cache;
+
+    /* Largest single data read issued to the device, in bytes */
+    UINT32  max_transfer;
+
+    /* Decoded MFT record cache (LRU) */
+    struct ntfs_mft_slot mft_cache[NTFS_MFT_CACHE_SLOTS];
+    UINT8  *mft_cache_mem;
+    UINT32  mft_cache_clock;
+
+    /* Free clusters from $Bitmap, counted on first query */
+    UINT64  free_clusters;
+    int     free_valid;
+
+    /* $UpCase table for index collation, loaded on first lookup */
+    UINT16 *upcase;
+    UINT32  upcase_len;         /* entries */
+    int     upcase_failed;
 };
 
 /* ------------------------------------------------------------------ */
@@ -264,7 +318,7 @@ static int ntfs_read_clusters(struct ntfs_vol *vol, UINT64 cluster,
 static int ntfs_apply_fixup(UINT8 *buf, UINT32 record_size,
                             UINT32 sector_size);
 static int ntfs_parse_data_runs(const UINT8 *runs, UINT32 runs_len,
-                                struct ntfs_extent *extents, int max_extents);
+                                UINT64 start_vcn, struct ntfs_runlist *rl);
 static int ntfs_read_mft_record(struct ntfs_vol *vol, UINT64 record_num,
                                 UINT8 *buf);
 static UINT8 *ntfs_find_attr(UINT8 *mft_buf, UINT32 mft_size, UINT32 type,
@@ -275,12 +329,17 @@ static UINT8 *ntfs_find_attr_next(UINT8 *mft_buf, UINT32 mft_size,
 static int ntfs_read_attr_data(struct ntfs_vol *vol, UINT8 *attr,
                                UINT8 **out_data, UINT64 *out_size);
 static INT64 ntfs_resolve_path(struct ntfs_vol *vol, const char *path);
+static UINT64 ntfs_get_file_size(struct ntfs_vol *vol, UINT64 mft_num);
 static int ntfs_utf16_to_ascii(const UINT16 *src, int src_len,
                                char *dst, int dst_max);
-static int ntfs_ascii_icmp(const char *a, const char *b);
 static int ntfs_name_icmp_utf16(const UINT16 *uname, int ulen,
                                 const char *ascii);
-static void ntfs_sort_entries(struct fs_entry *entries, int count);
+static int ntfs_collect_attrlist_runs(struct ntfs_vol *vol,
+                                      UINT8 *base_mft_buf, UINT32 type,
+                                      const UINT16 *name, UINT8 name_len,
+                                      struct ntfs_runlist *rl,
+                                      struct ntfs_stream_info *info,
+                                      UINT8 **out_resident);
 
 /* ------------------------------------------------------------------ */
 /* Utility: read little-endian values from unaligned buffer            */
@@ -319,71 +378,38 @@ static INT8 rd_s8(const void *p)
 /* Sector cache                                                        */
 /* ------------------------------------------------------------------ */
 
-static void ntfs_cache_init(struct ntfs_vol *vol)
+/*
+ * The cache unit is the NTFS sector, or the device block when the
+ * device blocks are larger (then sectors are extracted from blocks).
+ */
+static int ntfs_cache_init(struct ntfs_vol *vol)
 {
-    mem_set(vol->cache, 0, sizeof(vol->cache));
-    vol->cache_clock = 0;
+    UINT32 unit = vol->bytes_per_sector;
+    if (vol->dev_block_size > unit)
+        unit = vol->dev_block_size;
+    vol->cache = bcache_create(vol->read_fn, 0, vol->ctx,
+                               unit, vol->dev_block_size);
+    return vol->cache ? 0 : -1;
 }
 
 static void ntfs_cache_free(struct ntfs_vol *vol)
 {
-    for (int i = 0; i < NTFS_CACHE_SIZE; i++) {
-        if (vol->cache[i].data) {
-            mem_free(vol->cache[i].data);
-            vol->cache[i].data = 0;
-            vol->cache[i].valid = 0;
-        }
-    }
+    bcache_destroy(vol->cache);
+    vol->cache = 0;
 }
 
-/* Read a single device-block-sized sector through the cache */
-static int ntfs_cached_read_block(struct ntfs_vol *vol, UINT64 sector,
+/* Read a single device block through the cache (device > sector size) */
+static int ntfs_cached_read_block(struct ntfs_vol *vol, UINT64 dev_lba,
                                   UINT8 **out)
 {
-    /* Check cache */
-    for (int i = 0; i < NTFS_CACHE_SIZE; i++) {
-        if (vol->cache[i].valid && vol->cache[i].sector == sector) {
-            *out = vol->cache[i].data;
-            return 0;
-        }
-    }
-
-    /* Cache miss — find slot (simple clock) */
-    int slot = vol->cache_clock;
-    vol->cache_clock = (vol->cache_clock + 1) % NTFS_CACHE_SIZE;
-
-    if (!vol->cache[slot].data) {
-        vol->cache[slot].data = (UINT8 *)mem_alloc(vol->dev_block_size);
-        if (!vol->cache[slot].data)
-            return -1;
-    }
-
-    /* Convert NTFS sector to device blocks */
-    UINT64 dev_lba;
-    if (vol->dev_block_size == vol->bytes_per_sector) {
-        dev_lba = sector;
-    } else if (vol->dev_block_size < vol->bytes_per_sector) {
-        /* Multiple device blocks per NTFS sector -- not using cache for this */
-        dev_lba = sector * (vol->bytes_per_sector / vol->dev_block_size);
-    } else {
-        /* Device blocks larger than NTFS sector -- read one device block */
-        dev_lba = (sector * vol->bytes_per_sector) / vol->dev_block_size;
-    }
-
-    if (vol->read_fn(vol->ctx, dev_lba, 1, vol->cache[slot].data) != 0)
-        return -1;
-
-    vol->cache[slot].sector = sector;
-    vol->cache[slot].valid = 1;
-    *out = vol->cache[slot].data;
-    return 0;
+    *out = bcache_get(vol->cache, dev_lba);
+    return *out ? 0 : -1;
 }
 
 /* Invalidate entire cache (e.g., if we switch volumes) */
-static void ntfs_cache_invalidate(struct ntfs_vol *vol)
+static EFI_STATUS ntfs_cache_invalidate(struct ntfs_vol *vol)
 {
-    for (int i = 0; i < NTFS_CACHE_SIZE; i++)
-        vol->cache[i].valid = 0;
+    return bcache_invalidate_all(vol->cache);
 }
 
 /* ------------------------------------------------------------------ */
@@ -400,17 +426,9 @@ static int ntfs_read_sectors(struct ntfs_vol *vol, UINT64 sector,
     UINT8 *dst = (UINT8 *)buf;
     UINT32 bps = vol->bytes_per_sector;
 
-    if (vol->dev_block_size == bps) {
-        /* 1:1 mapping -- read directly */
-        return vol->read_fn(vol->ctx, sector, count, buf);
-    }
-
-    if (vol->dev_block_size < bps) {
-        /* Multiple device blocks per NTFS sector */
-        UINT32 ratio = bps / vol->dev_block_size;
-        UINT64 dev_lba = sector * ratio;
-        UINT32 dev_count = count * ratio;
-        return vol->read_fn(vol->ctx, dev_lba, dev_count, buf);
+    if (vol->dev_block_size <= bps) {
+        /* Whole sectors map onto device blocks -- cache in sector units */
+        return bcache_read(vol->cache, sector, count, buf);
     }
 
     /* Device blocks larger than NTFS sector -- rare but handle it */
@@ -457,28 +475,45 @@ static int ntfs_read_bytes(struct ntfs_vol *vol, UINT64 byte_off,
                                  (UINT32)(byte_len / bps), buf);
     }
 
-    /* Unaligned -- read sector by sector */
+    /* Unaligned -- partial head and tail sectors via a temp buffer,
+       whole sectors in between straight into the caller's buffer */
     UINT8 *dst = (UINT8 *)buf;
     UINT64 remaining = byte_len;
     UINT64 cur_sector = start_sector;
-    UINT32 cur_off = off_in_sector;
 
-    /* Allocate a temp sector buffer */
     UINT8 *tmp = (UINT8 *)mem_alloc(bps);
     if (!tmp) return -1;
 
-    while (remaining > 0) {
+    if (off_in_sector > 0) {
         if (ntfs_read_sectors(vol, cur_sector, 1, tmp) != 0) {
             mem_free(tmp);
             return -1;
         }
-        UINT32 avail = bps - cur_off;
+        UINT32 avail = bps - off_in_sector;
         UINT32 chunk = (remaining < avail) ? (UINT32)remaining : avail;
-        mem_copy(dst, tmp + cur_off, chunk);
+        mem_copy(dst, tmp + off_in_sector, chunk);
         dst += chunk;
         remaining -= chunk;
         cur_sector++;
-        cur_off = 0;
+    }
+
+    UINT64 full = remaining / bps;
+    if (full > 0) {
+        if (ntfs_read_sectors(vol, cur_sector, (UINT32)full, dst) != 0) {
+            mem_free(tmp);
+            return -1;
+        }
+        dst += full * bps;
+        remaining -= full * bps;
+        cur_sector += full;
+    }
+
+    if (remaining > 0) {
+        if (ntfs_read_sectors(vol, cur_sector, 1, tmp) != 0) {
+            mem_free(tmp);
+            return -1;
+        }
+        mem_copy(dst, tmp, (UINTN)remaining);
     }
 
     mem_free(tmp);
@@ -540,9 +575,80 @@ static int ntfs_apply_fixup(UINT8 *buf, UINT32 record_size,
 /* Data run decoding                                                   */
 /* ------------------------------------------------------------------ */
 
+/* Append one extent, doubling the array as needed. Returns 0 or -1. */
+static int ntfs_runlist_push(struct ntfs_runlist *rl, UINT64 vcn,
+                             UINT64 lcn, UINT64 length)
+{
+    if (rl->count == rl->cap) {
+        int cap = rl->cap ? rl->cap * 2 : 16;
+        struct ntfs_extent *ext = (struct ntfs_extent *)
+            mem_alloc((UINTN)cap * sizeof(struct ntfs_extent));
+        if (!ext)
+            return -1;
+        if (rl->count)
+            mem_copy(ext, rl->ext, rl->count * sizeof(struct ntfs_extent));
+        if (rl->ext)
+            mem_free(rl->ext);
+        rl->ext = ext;
+        rl->cap = cap;
+    }
+
+    rl->ext[rl->count].vcn = vcn;
+    rl->ext[rl->count].lcn = lcn;
+    rl->ext[rl->count].length = length;
+    rl->count++;
+    return 0;
+}
+
+static void ntfs_runlist_free(struct ntfs_runlist *rl)
+{
+    if (rl->ext)
+        mem_free(rl->ext);
+    rl->ext = 0;
+    rl->count = 0;
+    rl->cap = 0;
+}
+
+/* Order extents by VCN.  Pieces normally arrive in order, so this is
+   a single pass in practice. */
+static void ntfs_runlist_sort(struct ntfs_runlist *rl)
+{
+    struct ntfs_extent *ext = rl->ext;
+    for (int i = 1; i < rl->count; i++) {
+        struct ntfs_extent tmp;
+        mem_copy(&tmp, &ext[i], sizeof(tmp));
+        int j = i - 1;
+        while (j >= 0 && ext[j].vcn > tmp.vcn) {
+            mem_copy(&ext[j + 1], &ext[j], sizeof(tmp));
+            j--;
+        }
+        mem_copy(&ext[j + 1], &tmp, sizeof(tmp));
+    }
+}
+
+/*
+ * Binary search a VCN-ordered extent array for the first extent that
+ * ends after 'vcn'.  That extent contains vcn unless it starts beyond
+ * it (a hole).  Returns count if vcn lies past the last extent.
+ */
+static int ntfs_extent_find(const struct ntfs_extent *ext, int count,
+                            UINT64 vcn)
+{
+    int lo = 0, hi = count;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (ext[mid].vcn + ext[mid].length <= vcn)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
 /*
- * Parse a data run list from raw bytes into an array of extents.
- * Returns number of extents parsed, or -1 on error.
+ * Parse a data run list from raw bytes, appending extents to rl with
+ * VCNs counted from start_vcn.  Returns the number of extents added,
+ * or -1 on error.
  *
  * Data runs are a compressed encoding:
  *   byte 0: header — low nibble = length_size, high nibble = offset_size
@@ -553,14 +659,14 @@ static int ntfs_apply_fixup(UINT8 *buf, UINT32 record_size,
  * Offsets are delta-encoded relative to the previous run's starting LCN.
  */
 static int ntfs_parse_data_runs(const UINT8 *runs, UINT32 runs_len,
-                                struct ntfs_extent *extents, int max_extents)
+                                UINT64 start_vcn, struct ntfs_runlist *rl)
 {
     int count = 0;
     UINT32 pos = 0;
     INT64 prev_lcn = 0;
-    UINT64 vcn = 0;
+    UINT64 vcn = start_vcn;
 
-    while (pos < runs_len && count < max_extents) {
+    while (pos < runs_len) {
         UINT8 header = runs[pos];
         if (header == 0)
             break; /* end of runs */
@@ -607,9 +713,8 @@ static int ntfs_parse_data_runs(const UINT8 *runs, UINT32 runs_len,
             prev_lcn = lcn;
         }
 
-        extents[count].vcn = vcn;
-        extents[count].lcn = (UINT64)lcn;
-        extents[count].length = run_length;
+        if (ntfs_runlist_push(rl, vcn, (UINT64)lcn, run_length) != 0)
+            return -1;
         count++;
 
         vcn += run_length;
@@ -618,6 +723,21 @@ static int ntfs_parse_data_runs(const UINT8 *runs, UINT32 runs_len,
     return count;
 }
 
+/*
+ * Decode the runs of a non-resident attribute header into rl, starting
+ * at the attribute's lowest VCN.  Returns extents added, or -1.
+ */
+static int ntfs_runlist_from_attr(struct ntfs_runlist *rl, const UINT8 *attr)
+{
+    UINT32 attr_len = rd32(attr + 4);
+    UINT16 runs_off = rd16(attr + 32);
+
+    if (!attr[8] || runs_off >= attr_len)
+        return -1;
+    return ntfs_parse_data_runs(attr + runs_off, attr_len - runs_off,
+                                rd64(attr + 16), rl);
+}
+
 /*
  * Read data described by a set of extents.  Reads up to data_size bytes
  * into buf (which must be pre-allocated to at least data_size bytes).
@@ -631,170 +751,280 @@ static int ntfs_read_data_from_extents(struct ntfs_vol *vol,
     UINT8 *dst = (UINT8 *)buf;
     UINT64 remaining = data_size;
     UINT32 bpc = vol->bytes_per_cluster;
+    UINT64 max_chunk = vol->max_transfer / bpc;
+    if (max_chunk == 0)
+        max_chunk = 1;
 
-    for (int i = 0; i < extent_count && remaining > 0; i++) {
-        UINT64 run_bytes = extents[i].length * bpc;
-        UINT64 to_read = (remaining < run_bytes) ? remaining : run_bytes;
-
+    int i = 0;
+    while (i < extent_count && remaining > 0) {
         if (extents[i].lcn == 0 && extents[i].length > 0) {
             /* Sparse run — fill with zeros */
-            UINT64 fill = to_read;
+            UINT64 run_bytes = extents[i].length * bpc;
+            UINT64 fill = (remaining < run_bytes) ? remaining : run_bytes;
             mem_set(dst, 0, (UINTN)fill);
             dst += fill;
             remaining -= fill;
+            i++;
             continue;
         }
 
-        /* Read cluster by cluster to handle large runs without huge
-           intermediate buffers (the block read fn may have limits) */
-        UINT64 clusters_to_read = (to_read + bpc - 1) / bpc;
-        UINT64 bytes_read = 0;
-
-        /* Read in chunks of up to 64 clusters to reduce call overhead */
+        /* Merge following runs that continue on disk where this one
+           ends (common after defragmentation or attribute-list splits) */
         UINT64 lcn = extents[i].lcn;
-        UINT64 clust_remaining = clusters_to_read;
-
-        while (clust_remaining > 0 && remaining > 0) {
-            UINT32 chunk = (clust_remaining > 64) ? 64 :
-                           (UINT32)clust_remaining;
+        UINT64 clusters = extents[i].length;
+        i++;
+        while (i < extent_count && extents[i].lcn != 0 &&
+               extents[i].lcn == lcn + clusters) {
+            clusters += extents[i].length;
+            i++;
+        }
 
-            /* For the last chunk, we might read more than remaining,
-               so read into temp if partial cluster needed */
-            UINT64 chunk_bytes = (UINT64)chunk * bpc;
-            UINT64 want = (remaining < chunk_bytes) ? remaining : chunk_bytes;
+        UINT64 to_read = clusters * bpc;
+        if (to_read > remaining)
+            to_read = remaining;
+        UINT64 full = to_read / bpc;
+        UINT32 tail = (UINT32)(to_read % bpc);
+
+        /* Whole clusters straight into the caller's buffer, in chunks
+           of up to max_transfer bytes */
+        while (full > 0) {
+            UINT32 chunk = (full > max_chunk) ? (UINT32)max_chunk
+                                              : (UINT32)full;
+            if (ntfs_read_clusters(vol, lcn, chunk, dst) != 0)
+                return -1;
+            dst += (UINT64)chunk * bpc;
+            remaining -= (UINT64)chunk * bpc;
+            lcn += chunk;
+            full -= chunk;
+        }
 
-            if (want == chunk_bytes) {
-                /* Full cluster-aligned read */
-                if (ntfs_read_clusters(vol, lcn, chunk, dst) != 0)
-                    return -1;
-            } else {
-                /* Partial last cluster — need temp buffer */
-                UINT8 *tmp = (UINT8 *)mem_alloc(chunk_bytes);
-                if (!tmp) return -1;
-                if (ntfs_read_clusters(vol, lcn, chunk, tmp) != 0) {
-                    mem_free(tmp);
-                    return -1;
-                }
-                mem_copy(dst, tmp, (UINTN)want);
+        /* Partial last cluster — need temp buffer */
+        if (tail > 0) {
+            UINT8 *tmp = (UINT8 *)mem_alloc(bpc);
+            if (!tmp) return -1;
+            if (ntfs_read_clusters(vol, lcn, 1, tmp) != 0) {
                 mem_free(tmp);
+                return -1;
             }
-
-            dst += want;
-            remaining -= want;
-            lcn += chunk;
-            clust_remaining -= chunk;
-            bytes_read += want;
+            mem_copy(dst, tmp, tail);
+            mem_free(tmp);
+            dst += tail;
+            remaining -= tail;
         }
     }
 
     return 0;
 }
 
+/*
+ * Read 'len' bytes at byte offset 'off' of a non-resident stream.  Fails
+ * on sparse runs and holes, which only hold zeros.
+ */
+static int ntfs_read_stream_bytes(struct ntfs_vol *vol,
+                                  const struct ntfs_runlist *rl,
+                                  UINT64 off, UINT32 len, UINT8 *buf)
+{
+    UINT32 bpc = vol->bytes_per_cluster;
+    while (len > 0) {
+        UINT64 vcn = off / bpc;
+        int e = ntfs_extent_find(rl->ext, rl->count, vcn);
+        if (e == rl->count || rl->ext[e].vcn > vcn || rl->ext[e].lcn == 0)
+            return -1;
+
+        const struct ntfs_extent *x = &rl->ext[e];
+        UINT64 in_ext = (x->vcn + x->length) * bpc - off;
+        UINT32 n = (in_ext < len) ? (UINT32)in_ext : len;
+        UINT64 disk = (x->lcn + (vcn - x->vcn)) * bpc + off % bpc;
+        if (ntfs_read_bytes(vol, disk, n, buf) != 0)
+            return -1;
+        off += n;
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
 /* ------------------------------------------------------------------ */
 /* MFT record reading                                                  */
 /* ------------------------------------------------------------------ */
 
 /*
- * Read MFT record by record number.  Uses the cached $MFT extents
+ * Read MFT record by record number.  Uses the decoded $MFT extents
  * to locate the record on disk.  buf must be at least mft_record_size.
  * Returns 0 on success, -1 on error.
  */
-static int ntfs_read_mft_record(struct ntfs_vol *vol, UINT64 record_num,
-                                UINT8 *buf)
+static int ntfs_read_mft_record_raw(struct ntfs_vol *vol, UINT64 record_num,
+                                    UINT8 *buf)
 {
     UINT32 rec_size = vol->mft_record_size;
-    UINT32 bpc = vol->bytes_per_cluster;
 
-    /* Calculate byte offset of this record within $MFT data */
-    UINT64 byte_offset = record_num * rec_size;
+    /* The record may span clusters, and those clusters extents */
+    if (ntfs_read_stream_bytes(vol, &vol->mft_map, record_num * rec_size,
+                               rec_size, buf) != 0)
+        return -1;
 
-    /* Find which extent contains this byte offset */
-    UINT64 cluster_offset = byte_offset / bpc;
-    UINT32 off_in_cluster = (UINT32)(byte_offset % bpc);
+    /* Verify signature "FILE" */
+    if (buf[0] != 'F' || buf[1] != 'I' || buf[2] != 'L' || buf[3] != 'E')
+        return -1;
 
-    /* Walk the MFT extents to find the cluster on disk */
-    UINT64 vcn_start = 0;
-    int found = 0;
+    /* Apply fixup */
+    if (ntfs_apply_fixup(buf, rec_size, vol->bytes_per_sector) != 0)
+        return -1;
 
-    for (int i = 0; i < vol->mft_extent_count; i++) {
-        UINT64 ext_vcn = vol->mft_extents[i].vcn;
-        UINT64 ext_len = vol->mft_extents[i].length;
-        UINT64 ext_lcn = vol->mft_extents[i].lcn;
-
-        if (cluster_offset >= ext_vcn &&
-            cluster_offset < ext_vcn + ext_len) {
-            /* Found it */
-            UINT64 delta = cluster_offset - ext_vcn;
-            UINT64 disk_cluster = ext_lcn + delta;
-
-            /* The MFT record might span cluster boundaries if
-               off_in_cluster + rec_size > bpc. Handle this. */
-            UINT32 avail_in_cluster = bpc - off_in_cluster;
-
-            if (avail_in_cluster >= rec_size) {
-                /* Entire record fits in this cluster */
-                UINT64 disk_byte = disk_cluster * bpc + off_in_cluster;
-                if (ntfs_read_bytes(vol, disk_byte, rec_size, buf) != 0)
-                    return -1;
-            } else {
-                /* Record spans clusters — read first part */
-                UINT64 disk_byte = disk_cluster * bpc + off_in_cluster;
-                if (ntfs_read_bytes(vol, disk_byte, avail_in_cluster,
-                                    buf) != 0)
-                    return -1;
+    return 0;
+}
 
-                /* Read remaining from next cluster(s) */
-                UINT32 remaining = rec_size - avail_in_cluster;
-                UINT64 next_cluster_offset = cluster_offset + 1;
-                UINT8 *dst = buf + avail_in_cluster;
-
-                /* The next cluster might be in a different extent */
-                while (remaining > 0) {
-                    /* Find extent for next_cluster_offset */
-                    int fi = 0;
-                    for (int j = 0; j < vol->mft_extent_count; j++) {
-                        if (next_cluster_offset >= vol->mft_extents[j].vcn &&
-                            next_cluster_offset < vol->mft_extents[j].vcn +
-                            vol->mft_extents[j].length) {
-                            UINT64 d2 = next_cluster_offset -
-                                        vol->mft_extents[j].vcn;
-                            UINT64 dc2 = vol->mft_extents[j].lcn + d2;
-                            UINT64 db2 = dc2 * bpc;
-                            UINT32 chunk = (remaining < bpc) ?
-                                           remaining : bpc;
-                            if (ntfs_read_bytes(vol, db2, chunk, dst) != 0)
-                                return -1;
-                            dst += chunk;
-                            remaining -= chunk;
-                            next_cluster_offset++;
-                            fi = 1;
-                            break;
-                        }
-                    }
-                    if (!fi)
-                        return -1; /* extent not found */
-                }
-            }
+/* The record cache's slots, allocated on first use; 0 if out of memory */
+static int ntfs_mft_cache_ready(struct ntfs_vol *vol)
+{
+    UINT32 rec_size = vol->mft_record_size;
 
-            found = 1;
-            break;
+    if (!vol->mft_cache_mem) {
+        vol->mft_cache_mem = (UINT8 *)
+            mem_alloc((UINTN)NTFS_MFT_CACHE_SLOTS * rec_size);
+        if (vol->mft_cache_mem) {
+            for (int i = 0; i < NTFS_MFT_CACHE_SLOTS; i++)
+                vol->mft_cache[i].buf = vol->mft_cache_mem + i * rec_size;
         }
     }
+    return vol->mft_cache_mem != 0;
+}
 
-    if (!found)
-        return -1;
+/* The slot holding record_num, or -1 - (least recently used slot) */
+static int ntfs_mft_cache_find(struct ntfs_vol *vol, UINT64 record_num)
+{
+    int victim = 0;
 
-    /* Verify signature "FILE" */
-    if (buf[0] != 'F' || buf[1] != 'I' || buf[2] != 'L' || buf[3] != 'E')
-        return -1;
+    for (int i = 0; i < NTFS_MFT_CACHE_SLOTS; i++) {
+        struct ntfs_mft_slot *sl = &vol->mft_cache[i];
+        if (sl->stamp && sl->rec == record_num)
+            return i;
+        if (sl->stamp < vol->mft_cache[victim].stamp)
+            victim = i;
+    }
+    return -1 - victim;
+}
 
-    /* Apply fixup */
-    if (ntfs_apply_fixup(buf, rec_size, vol->bytes_per_sector) != 0)
+/* Copy a fixed-up record into the slot ntfs_mft_cache_find() chose */
+static void ntfs_mft_cache_put(struct ntfs_vol *vol, int slot,
+                               UINT64 record_num, const UINT8 *rec)
+{
+    struct ntfs_mft_slot *sl = &vol->mft_cache[slot];
+    mem_copy(sl->buf, rec, vol->mft_record_size);
+    sl->rec = record_num;
+    sl->stamp = ++vol->mft_cache_clock;
+}
+
+/*
+ * Read an MFT record through the record cache.  The volume is read-only,
+ * so a fixed-up record stays valid until unmount; a hit is one copy
+ * instead of a device read plus fixup.
+ */
+static int ntfs_read_mft_record(struct ntfs_vol *vol, UINT64 record_num,
+                                UINT8 *buf)
+{
+    UINT32 rec_size = vol->mft_record_size;
+
+    if (!ntfs_mft_cache_ready(vol))
+        return ntfs_read_mft_record_raw(vol, record_num, buf);
+
+    int slot = ntfs_mft_cache_find(vol, record_num);
+    if (slot >= 0) {
+        vol->mft_cache[slot].stamp = ++vol->mft_cache_clock;
+        TRACE_EVENT(TR_MFT_HIT, record_num, 0);
+        mem_copy(buf, vol->mft_cache[slot].buf, rec_size);
+        return 0;
+    }
+
+    TRACE_EVENT(TR_MFT_MISS, record_num, 0);
+    if (ntfs_read_mft_record_raw(vol, record_num, buf) != 0)
         return -1;
 
+    ntfs_mft_cache_put(vol, -1 - slot, record_num, buf);
     return 0;
 }
 
+/*
+ * Bring up to NTFS_MFT_PREFETCH_MAX records into the cache in as few
+ * device reads as possible, ahead of a loop that reads them one at a
+ * time in some other order (index order, attribute list order).  The
+ * numbers are sorted in place and the ones not cached yet are read in
+ * ascending runs, a run taking in gaps of up to NTFS_MFT_PREFETCH_GAP
+ * records: reading past a few unwanted records costs less than another
+ * request.  Records that fail to read or check are left out, for the
+ * caller's own read to report.
+ */
+static void ntfs_mft_prefetch(struct ntfs_vol *vol, UINT64 *recs, int n)
+{
+    UINT32 rec_size = vol->mft_record_size;
+
+    if (n > NTFS_MFT_PREFETCH_MAX)
+        n = NTFS_MFT_PREFETCH_MAX;
+    if (n < 2 || !ntfs_mft_cache_ready(vol))
+        return;
+
+    /* Sort, then drop duplicates and records already cached */
+    for (int i = 1; i < n; i++) {
+        UINT64 r = recs[i];
+        int j = i;
+        for (; j > 0 && recs[j - 1] > r; j--)
+            recs[j] = recs[j - 1];
+        recs[j] = r;
+    }
+    int want = 0;
+    for (int i = 0; i < n; i++) {
+        if (want > 0 && recs[want - 1] == recs[i])
+            continue;
+        if (ntfs_mft_cache_find(vol, recs[i]) >= 0)
+            continue;
+        recs[want++] = recs[i];
+    }
+    if (want < 2)
+        return;
+
+    /* Runs are capped by the device transfer size and the buffer by the
+       whole sorted range, whichever is smaller */
+    UINT32 span_max = vol->max_transfer / rec_size;
+    if (span_max < 2)
+        span_max = 2;
+    if (recs[want - 1] - recs[0] < span_max)
+        span_max = (UINT32)(recs[want - 1] - recs[0] + 1);
+    UINT8 *buf = (UINT8 *)mem_alloc_raw((UINTN)span_max * rec_size);
+    if (!buf)
+        return;
+
+    int i = 0;
+    while (i < want) {
+        /* Grow the run while the next record is close and fits */
+        int j = i + 1;
+        while (j < want && recs[j] - recs[j - 1] <= NTFS_MFT_PREFETCH_GAP &&
+               recs[j] - recs[i] < span_max)
+            j++;
+
+        UINT64 first = recs[i];
+        UINT32 span = (UINT32)(recs[j - 1] - first + 1);
+        if (ntfs_read_stream_bytes(vol, &vol->mft_map, first * rec_size,
+                                   span * rec_size, buf) == 0) {
+            for (int k = i; k < j; k++) {
+                UINT8 *rec = buf + (recs[k] - first) * rec_size;
+                if (rec[0] != 'F' || rec[1] != 'I' ||
+                    rec[2] != 'L' || rec[3] != 'E')
+                    continue;
+                if (ntfs_apply_fixup(rec, rec_size,
+                                     vol->bytes_per_sector) != 0)
+                    continue;
+                TRACE_EVENT(TR_MFT_MISS, recs[k], 0);
+                int slot = ntfs_mft_cache_find(vol, recs[k]);
+                ntfs_mft_cache_put(vol, slot >= 0 ? slot : -1 - slot,
+                                   recs[k], rec);
+            }
+        }
+        i = j;
+    }
+
+    mem_free(buf);
+}
+
 /* ------------------------------------------------------------------ */
 /* Attribute search within an MFT record                               */
 /* ------------------------------------------------------------------ */
@@ -907,6 +1137,34 @@ static UINT8 *ntfs_find_attr_any(UINT8 *mft_buf, UINT32 mft_size,
     return 0;
 }
 
+/*
+ * A non-resident attribute whose runs stop short of its allocation has
+ * the remaining pieces in extension records ($ATTRIBUTE_LIST).
+ */
+static int ntfs_attr_is_partial(struct ntfs_vol *vol, const UINT8 *attr)
+{
+    if (!attr[8])
+        return 0;
+    if (rd64(attr + 16) != 0)
+        return 1;
+    return (rd64(attr + 24) + 1) * vol->bytes_per_cluster < rd64(attr + 40);
+}
+
+static void ntfs_stream_info_from_attr(const UINT8 *attr,
+                                       struct ntfs_stream_info *info)
+{
+    info->flags = rd16(attr + 12);
+    if (attr[8]) {
+        info->size = rd64(attr + 48);
+        info->init_size = rd64(attr + 56);
+        info->cu_shift = attr[34];
+    } else {
+        info->size = rd32(attr + 16);
+        info->init_size = info->size;
+        info->cu_shift = 0;
+    }
+}
+
 /* ------------------------------------------------------------------ */
 /* Read attribute data (resident or non-resident)                      */
 /* ------------------------------------------------------------------ */
@@ -944,43 +1202,31 @@ static int ntfs_read_attr_data(struct ntfs_vol *vol, UINT8 *attr,
     }
 
     /* Non-resident */
-    UINT16 runs_off = rd16(attr + 32);
     UINT64 real_size = rd64(attr + 48);
 
-    if (runs_off >= attr_len)
-        return -1;
-
-    UINT32 runs_len = attr_len - runs_off;
-    const UINT8 *runs = attr + runs_off;
-
     /* Parse data runs */
-    struct ntfs_extent *extents = (struct ntfs_extent *)
-        mem_alloc(NTFS_MAX_RUNS * sizeof(struct ntfs_extent));
-    if (!extents) return -1;
-
-    int ext_count = ntfs_parse_data_runs(runs, runs_len,
-                                         extents, NTFS_MAX_RUNS);
-    if (ext_count <= 0) {
-        mem_free(extents);
+    struct ntfs_runlist rl = {0};
+    if (ntfs_runlist_from_attr(&rl, attr) <= 0) {
+        ntfs_runlist_free(&rl);
         return -1;
     }
 
     /* Allocate buffer for the data */
     UINT8 *data = (UINT8 *)mem_alloc((UINTN)real_size + 1);
     if (!data) {
-        mem_free(extents);
+        ntfs_runlist_free(&rl);
         return -1;
     }
 
-    if (ntfs_read_data_from_extents(vol, extents, ext_count,
+    if (ntfs_read_data_from_extents(vol, rl.ext, rl.count,
                                     real_size, data) != 0) {
         mem_free(data);
-        mem_free(extents);
+        ntfs_runlist_free(&rl);
         return -1;
     }
 
     data[real_size] = 0;
-    mem_free(extents);
+    ntfs_runlist_free(&rl);
 
     *out_data = data;
     *out_size = real_size;
@@ -1008,29 +1254,17 @@ static int ntfs_read_attr_data_into(struct ntfs_vol *vol, UINT8 *attr,
         return 0;
     }
 
-    UINT16 runs_off = rd16(attr + 32);
     UINT64 real_size = rd64(attr + 48);
-    if (runs_off >= attr_len)
-        return -1;
-
-    UINT32 runs_len = attr_len - runs_off;
-    const UINT8 *runs = attr + runs_off;
-
-    struct ntfs_extent *extents = (struct ntfs_extent *)
-        mem_alloc(NTFS_MAX_RUNS * sizeof(struct ntfs_extent));
-    if (!extents) return -1;
-
-    int ext_count = ntfs_parse_data_runs(runs, runs_len,
-                                         extents, NTFS_MAX_RUNS);
-    if (ext_count <= 0) {
-        mem_free(extents);
+    struct ntfs_runlist rl = {0};
+    if (ntfs_runlist_from_attr(&rl, attr) <= 0) {
+        ntfs_runlist_free(&rl);
         return -1;
     }
 
     UINT64 to_read = (real_size < buf_size) ? real_size : buf_size;
-    int rc = ntfs_read_data_from_extents(vol, extents, ext_count,
+    int rc = ntfs_read_data_from_extents(vol, rl.ext, rl.count,
                                          to_read, buf);
-    mem_free(extents);
+    ntfs_runlist_free(&rl);
     return rc;
 }
 
@@ -1059,21 +1293,6 @@ static int ntfs_utf16_to_ascii(const UINT16 *src, int src_len,
     return j;
 }
 
-/*
- * Case-insensitive ASCII comparison. Returns 0 if equal.
- */
-static int ntfs_ascii_icmp(const char *a, const char *b)
-{
-    while (*a && *b) {
-        char ca = *a, cb = *b;
-        if (ca >= 'A' && ca <= 'Z') ca += 32;
-        if (cb >= 'A' && cb <= 'Z') cb += 32;
-        if (ca != cb) return (int)(UINT8)ca - (int)(UINT8)cb;
-        a++; b++;
-    }
-    return (int)(UINT8)*a - (int)(UINT8)*b;
-}
-
 /*
  * Compare a UTF-16LE name (from disk) to an ASCII name, case-insensitive.
  * Returns 0 if equal.
@@ -1104,145 +1323,28 @@ static int ntfs_name_icmp_utf16(const UINT16 *uname, int ulen,
     return 0;
 }
 
-/* ------------------------------------------------------------------ */
-/* Sort directory entries                                               */
-/* ------------------------------------------------------------------ */
-
-static void ntfs_sort_entries(struct fs_entry *entries, int count)
-{
-    /* Insertion sort: directories first, then alphabetical */
-    for (int i = 1; i < count; i++) {
-        struct fs_entry tmp;
-        mem_copy(&tmp, &entries[i], sizeof(tmp));
-        int j = i - 1;
-        while (j >= 0) {
-            int swap = 0;
-            if (tmp.is_dir && !entries[j].is_dir) {
-                swap = 1;
-            } else if (tmp.is_dir == entries[j].is_dir) {
-                if (ntfs_ascii_icmp(tmp.name, entries[j].name) < 0)
-                    swap = 1;
-            }
-            if (!swap) break;
-            mem_copy(&entries[j + 1], &entries[j], sizeof(tmp));
-            j--;
-        }
-        mem_copy(&entries[j + 1], &tmp, sizeof(tmp));
-    }
-}
-
 /* ------------------------------------------------------------------ */
 /* Directory reading (index entries)                                   */
 /* ------------------------------------------------------------------ */
 
-/*
- * State for collecting directory entries with deduplication.
- * We prefer Win32 or Win32+DOS names over DOS-only names.
- */
-struct ntfs_dir_state {
-    struct fs_entry *entries;
-    int              count;
-    int              max_entries;
-
-    /* Dedup array: MFT reference of each entry already added */
-    UINT64          *mft_refs;
-    UINT8           *namespaces; /* namespace of each added entry */
-};
+/* Name of the directory index attributes */
+static const UINT16 ntfs_i30_name[4] = { '$', 'I', '3', '0' };
 
 /*
- * Add an entry to the dir_state, handling dedup.
- * Returns 0 on success (or skip), -1 on error.
+ * Index entry visitor: ref is the raw MFT reference, fn the entry's
+ * $FILE_NAME value.  Returns nonzero to stop the walk.
  */
-static int ntfs_dir_add_entry(struct ntfs_dir_state *state,
-                              UINT64 mft_ref_raw,
-                              const UINT8 *fn_data, UINT32 fn_len)
-{
-    /* fn_data points to a $FILE_NAME structure */
-    if (fn_len < 66)
-        return 0; /* too short */
-
-    UINT8 name_length = fn_data[64];
-    UINT8 name_ns = fn_data[65];
-
-    /* Skip . and .. (parent ref == self or name is "." ) */
-    if (name_length == 1) {
-        UINT16 ch = rd16(fn_data + 66);
-        if (ch == '.')
-            return 0; /* skip "." */
-    }
-    if (name_length == 2) {
-        UINT16 c1 = rd16(fn_data + 66);
-        UINT16 c2 = rd16(fn_data + 68);
-        if (c1 == '.' && c2 == '.')
-            return 0; /* skip ".." */
-    }
-
-    /* Extract MFT record number from reference (low 6 bytes) */
-    UINT64 mft_num = mft_ref_raw & 0x0000FFFFFFFFFFFFULL;
-
-    /* Check for duplicate MFT ref */
-    for (int i = 0; i < state->count; i++) {
-        if (state->mft_refs[i] == mft_num) {
-            /* Duplicate. Prefer Win32/Win32+DOS over DOS. */
-            if (name_ns == NTFS_NS_DOS)
-                return 0; /* already have a better name */
-
-            if (state->namespaces[i] == NTFS_NS_DOS &&
-                (name_ns == NTFS_NS_WIN32 || name_ns == NTFS_NS_WIN32_DOS)) {
-                /* Replace the DOS name with Win32 name */
-                UINT32 flags = rd32(fn_data + 56);
-                UINT64 real_size = rd64(fn_data + 48);
-
-                state->entries[i].is_dir =
-                    (flags & NTFS_FILE_ATTR_DIRECTORY) ? 1 : 0;
-                state->entries[i].size = state->entries[i].is_dir ?
-                                         0 : real_size;
-                ntfs_utf16_to_ascii((const UINT16 *)(fn_data + 66),
-                                    name_length,
-                                    state->entries[i].name, FS_MAX_NAME);
-                state->namespaces[i] = name_ns;
-                return 0;
-            }
-
-            /* Otherwise keep existing (it's already Win32 or POSIX) */
-            return 0;
-        }
-    }
-
-    /* Skip pure DOS names if we might see a Win32 name later?
-       No — we collect everything and dedup above handles it.
-       But we DO skip DOS-only to avoid clutter if we already
-       have entries. Actually, we should add it and let dedup
-       handle replacement if a Win32 name comes later. */
-
-    if (state->count >= state->max_entries)
-        return 0; /* overflow, silently drop */
-
-    int idx = state->count;
-    UINT32 flags = rd32(fn_data + 56);
-    UINT64 real_size = rd64(fn_data + 48);
-
-    state->entries[idx].is_dir =
-        (flags & NTFS_FILE_ATTR_DIRECTORY) ? 1 : 0;
-    state->entries[idx].size = state->entries[idx].is_dir ? 0 : real_size;
-    ntfs_utf16_to_ascii((const UINT16 *)(fn_data + 66),
-                        name_length,
-                        state->entries[idx].name, FS_MAX_NAME);
-    state->mft_refs[idx] = mft_num;
-    state->namespaces[idx] = name_ns;
-    state->count++;
-
-    return 0;
-}
+typedef int (*ntfs_index_visit_fn)(void *ctx, UINT64 ref,
+                                   const UINT8 *fn, UINT32 fn_len);
 
 /*
- * Parse index entries from a buffer (used for both INDEX_ROOT and INDX).
+ * Visit the entries of one index node (INDEX_ROOT value or INDX block).
  * entries_buf points to the start of the first index entry.
- * entries_size is the total size of all entries.
+ * Returns 1 if the visitor stopped the walk, 0 otherwise.
  */
-static int ntfs_parse_index_entries(struct ntfs_dir_state *state,
-                                    UINT8 *entries_buf,
-                                    UINT32 entries_size)
+static int ntfs_visit_index_entries(const UINT8 *entries_buf,
+                                    UINT32 entries_size,
+                                    ntfs_index_visit_fn visit, void *ctx)
 {
     UINT32 pos = 0;
 
@@ -1260,12 +1362,10 @@ static int ntfs_parse_index_entries(struct ntfs_dir_state *state,
 
         /* The stream data ($FILE_NAME) starts at offset 16 */
         if (stream_len > 0 && pos + 16 + stream_len <= entries_size) {
-            ntfs_dir_add_entry(state, mft_ref,
-                              entries_buf + pos + 16, stream_len);
+            if (visit(ctx, mft_ref, entries_buf + pos + 16, stream_len))
+                return 1;
         }
 
-        if (entry_len == 0)
-            break;
         pos += entry_len;
     }
 
@@ -1273,11 +1373,12 @@ static int ntfs_parse_index_entries(struct ntfs_dir_state *state,
 }
 
 /*
- * Parse an INDX block: verify signature, apply fixup, parse entries.
+ * Visit an INDX block: verify signature, apply fixup, visit entries.
+ * Returns 1 if the walk was stopped, 0 if not, -1 if the block is bad.
  */
-static int ntfs_parse_indx_block(struct ntfs_vol *vol,
-                                 struct ntfs_dir_state *state,
-                                 UINT8 *block_buf, UINT32 block_size)
+static int ntfs_visit_indx_block(struct ntfs_vol *vol, UINT8 *block_buf,
+                                 UINT32 block_size,
+                                 ntfs_index_visit_fn visit, void *ctx)
 {
     /* Verify "INDX" signature */
     if (block_buf[0] != 'I' || block_buf[1] != 'N' ||
@@ -1302,69 +1403,100 @@ static int ntfs_parse_indx_block(struct ntfs_vol *vol,
     if (entries_start + entries_size > block_size)
         entries_size = block_size - entries_start;
 
-    return ntfs_parse_index_entries(state, block_buf + entries_start,
-                                   entries_size);
+    return ntfs_visit_index_entries(block_buf + entries_start,
+                                    entries_size, visit, ctx);
 }
 
 /*
- * Read all directory entries from an MFT record (by record number).
- * Handles both small (INDEX_ROOT only) and large (INDEX_ROOT + INDEX_ALLOCATION)
- * directories.
- *
- * Returns entry count or -1 on error.
+ * Collect a directory's INDEX_ALLOCATION extents.  They come from the
+ * base record unless the allocation has been split across extension
+ * records, in which case the attribute list names all the pieces.
+ * Sets *out_size to the allocation's data size.  Returns 0 or -1.
  */
-static int ntfs_read_dir_entries(struct ntfs_vol *vol, UINT64 mft_num,
-                                 struct fs_entry *entries, int max_entries)
+static int ntfs_dir_alloc_runs(struct ntfs_vol *vol, UINT8 *mft_buf,
+                               struct ntfs_runlist *rl, UINT64 *out_size)
 {
-    UINT8 *mft_buf = (UINT8 *)mem_alloc(vol->mft_record_size);
-    if (!mft_buf)
-        return -1;
+    UINT8 *ia_attr = ntfs_find_attr(mft_buf, vol->mft_record_size,
+                                    NTFS_AT_INDEX_ALLOCATION,
+                                    ntfs_i30_name, 4);
+
+    if ((!ia_attr || ntfs_attr_is_partial(vol, ia_attr)) &&
+        ntfs_find_attr_any(mft_buf, vol->mft_record_size,
+                           NTFS_AT_ATTRIBUTE_LIST)) {
+        UINT8 *resident = 0;
+        struct ntfs_stream_info info;
+        if (ntfs_collect_attrlist_runs(vol, mft_buf,
+                                       NTFS_AT_INDEX_ALLOCATION,
+                                       ntfs_i30_name, 4, rl, &info,
+                                       &resident) == 0) {
+            *out_size = info.size;
+            if (!resident)
+                return 0;
+            mem_free(resident); /* INDEX_ALLOCATION is never resident */
+        }
+        ntfs_runlist_free(rl);
+    }
 
-    if (ntfs_read_mft_record(vol, mft_num, mft_buf) != 0) {
-        mem_free(mft_buf);
+    if (!ia_attr || !ia_attr[8])
+        return -1;
+    if (ntfs_runlist_from_attr(rl, ia_attr) <= 0) {
+        ntfs_runlist_free(rl);
         return -1;
     }
+    *out_size = rd64(ia_attr + 48);
+    return 0;
+}
 
-    /* Verify this is a directory */
-    UINT16 mft_flags = rd16(mft_buf + 22);
-    if (!(mft_flags & NTFS_MFT_DIRECTORY)) {
+/* Whether a $I30 $BITMAP marks INDX block b in use; without one, every
+   block is tried and stale ones fail their checks */
+static int ntfs_indx_in_use(const UINT8 *bitmap, UINT64 bitmap_size,
+                            UINT64 b)
+{
+    if (!bitmap)
+        return 1;
+    return b / 8 < bitmap_size && (bitmap[b / 8] & (1 << (b % 8)));
+}
+
+/*
+ * Walk every entry of a directory's $I30 index: the INDEX_ROOT node,
+ * then each in-use INDX block of INDEX_ALLOCATION in VCN order.  Only
+ * one index block is held at a time, so directories of any size stream
+ * through the visitor.  Entries come in index order, so a file appears
+ * once per name (hard links and DOS aliases included).
+ *
+ * Returns 0 on success (including a stop requested by the visitor), or
+ * -1 if the record cannot be read or is not a directory.
+ */
+static int ntfs_walk_dir(struct ntfs_vol *vol, UINT64 mft_num,
+                         ntfs_index_visit_fn visit, void *ctx)
+{
+    UINT8 *mft_buf = (UINT8 *)mem_alloc(vol->mft_record_size);
+    if (!mft_buf)
+        return -1;
+
+    if (ntfs_read_mft_record(vol, mft_num, mft_buf) != 0) {
         mem_free(mft_buf);
         return -1;
     }
 
-    /* Set up dir state with dedup arrays */
-    int alloc_max = (max_entries < NTFS_MAX_DIR_ENTRIES) ?
-                    NTFS_MAX_DIR_ENTRIES : max_entries;
-
-    struct ntfs_dir_state state;
-    state.entries = entries;
-    state.count = 0;
-    state.max_entries = max_entries;
-
-    state.mft_refs = (UINT64 *)mem_alloc(alloc_max * sizeof(UINT64));
-    state.namespaces = (UINT8 *)mem_alloc(alloc_max * sizeof(UINT8));
-
-    if (!state.mft_refs || !state.namespaces) {
-        if (state.mft_refs) mem_free(state.mft_refs);
-        if (state.namespaces) mem_free(state.namespaces);
+    /* Verify this is a directory */
+    UINT16 mft_flags = rd16(mft_buf + 22);
+    if (!(mft_flags & NTFS_MFT_DIRECTORY)) {
         mem_free(mft_buf);
         return -1;
     }
-    mem_set(state.mft_refs, 0, alloc_max * sizeof(UINT64));
-    mem_set(state.namespaces, 0, alloc_max * sizeof(UINT8));
 
-    /* --- Parse INDEX_ROOT (0x90) — named "$I30" --- */
+    /* --- INDEX_ROOT (0x90) — named "$I30", always resident --- */
     UINT8 *ir_attr = ntfs_find_attr_any(mft_buf, vol->mft_record_size,
                                         NTFS_AT_INDEX_ROOT);
     int has_large_index = 0;
 
-    if (ir_attr) {
-        /* INDEX_ROOT is always resident */
+    if (ir_attr && !ir_attr[8]) {
         UINT32 val_len = rd32(ir_attr + 16);
         UINT16 val_off = rd16(ir_attr + 20);
         UINT8 *ir_val = ir_attr + val_off;
 
-        if (val_len >= 32) {
+        if (val_len >= 32 && val_off + val_len <= rd32(ir_attr + 4)) {
             /* Index node header starts at offset 16 within the value */
             UINT32 node_entries_off = rd32(ir_val + 16);
             UINT32 node_total_size = rd32(ir_val + 20);
@@ -1379,322 +1511,535 @@ static int ntfs_read_dir_entries(struct ntfs_vol *vol, UINT64 mft_num,
                 if (entries_start + entries_size > val_len)
                     entries_size = val_len - entries_start;
 
-                ntfs_parse_index_entries(&state,
-                                        ir_val + entries_start,
-                                        entries_size);
+                if (ntfs_visit_index_entries(ir_val + entries_start,
+                                             entries_size, visit, ctx)) {
+                    mem_free(mft_buf);
+                    return 0;
+                }
             }
         }
     }
 
-    /* --- Parse INDEX_ALLOCATION (0xA0) if present --- */
-    if (has_large_index) {
-        UINT8 *ia_attr = ntfs_find_attr_any(mft_buf, vol->mft_record_size,
-                                             NTFS_AT_INDEX_ALLOCATION);
-        if (ia_attr && ia_attr[8]) { /* must be non-resident */
-            UINT16 runs_off = rd16(ia_attr + 32);
-            UINT64 real_size = rd64(ia_attr + 48);
-            UINT32 ia_attr_len = rd32(ia_attr + 4);
-
-            if (runs_off < ia_attr_len) {
-                UINT32 runs_len = ia_attr_len - runs_off;
-                const UINT8 *runs = ia_attr + runs_off;
-
-                struct ntfs_extent *extents = (struct ntfs_extent *)
-                    mem_alloc(NTFS_MAX_RUNS * sizeof(struct ntfs_extent));
-
-                if (extents) {
-                    int ext_count = ntfs_parse_data_runs(runs, runs_len,
-                                                         extents,
-                                                         NTFS_MAX_RUNS);
-
-                    if (ext_count > 0) {
-                        UINT32 ibs = vol->index_block_size;
-
-                        /* Read index blocks and parse each one */
-                        /* We'll read one block at a time */
-                        UINT8 *ibuf = (UINT8 *)mem_alloc(ibs);
-
-                        if (ibuf) {
-                            UINT64 total_read = 0;
-                            UINT32 bpc = vol->bytes_per_cluster;
-
-                            for (int e = 0; e < ext_count &&
-                                 total_read < real_size; e++) {
-                                UINT64 lcn = extents[e].lcn;
-                                UINT64 run_len = extents[e].length;
-
-                                if (lcn == 0 && run_len > 0)
-                                    continue; /* sparse, skip */
-
-                                UINT64 run_bytes = run_len * bpc;
-
-                                /* How many index blocks in this run? */
-                                UINT64 blocks_in_run;
-                                if (ibs >= bpc)
-                                    blocks_in_run = run_bytes / ibs;
-                                else
-                                    blocks_in_run = run_bytes / ibs;
-
-                                for (UINT64 b = 0; b < blocks_in_run &&
-                                     total_read < real_size; b++) {
-                                    UINT64 block_byte_off = b * ibs;
-                                    UINT64 block_cluster = lcn +
-                                        (block_byte_off / bpc);
-                                    UINT32 off_in_clust =
-                                        (UINT32)(block_byte_off % bpc);
-
-                                    UINT64 disk_byte = block_cluster * bpc +
-                                                       off_in_clust;
-
-                                    if (ntfs_read_bytes(vol, disk_byte,
-                                                        ibs, ibuf) != 0)
-                                        break;
-
-                                    ntfs_parse_indx_block(vol, &state,
-                                                          ibuf, ibs);
-                                    total_read += ibs;
-                                }
-                            }
-
-                            mem_free(ibuf);
-                        }
-                    }
+    if (!has_large_index) {
+        mem_free(mft_buf);
+        return 0;
+    }
+
+    /* --- INDEX_ALLOCATION (0xA0) --- */
+    struct ntfs_runlist rl = {0};
+    UINT64 alloc_size = 0;
+    if (ntfs_dir_alloc_runs(vol, mft_buf, &rl, &alloc_size) != 0) {
+        mem_free(mft_buf);
+        return 0;
+    }
 
-                    mem_free(extents);
+    /* $I30 $BITMAP: bit n set means INDX block n is in use */
+    UINT8 *bitmap = 0;
+    UINT64 bitmap_size = 0;
+    UINT8 *bm_attr = ntfs_find_attr(mft_buf, vol->mft_record_size,
+                                    NTFS_AT_BITMAP, ntfs_i30_name, 4);
+    if (!bm_attr ||
+        ntfs_read_attr_data(vol, bm_attr, &bitmap, &bitmap_size) != 0)
+        bitmap = 0;
+
+    /* Runs of in-use blocks are read NTFS_MAX_INDX_SIZE at a time, so
+       a directory of 4 KB blocks costs one request per 16 of them */
+    UINT32 ibs = vol->index_block_size;
+    UINT32 per_read = (ibs < NTFS_MAX_INDX_SIZE) ? NTFS_MAX_INDX_SIZE / ibs
+                                                 : 1;
+    UINT8 *ibuf = (UINT8 *)mem_alloc_raw((UINTN)per_read * ibs);
+
+    if (ibuf) {
+        UINT64 blocks = alloc_size / ibs;
+        UINT64 b = 0;
+        int stop = 0;
+        while (b < blocks && !stop) {
+            if (!ntfs_indx_in_use(bitmap, bitmap_size, b)) {
+                b++;
+                continue;
+            }
+            UINT32 run = 1;
+            while (run < per_read && b + run < blocks &&
+                   ntfs_indx_in_use(bitmap, bitmap_size, b + run))
+                run++;
+
+            /* Sparse or unreadable blocks are skipped; a run that fails
+               as a whole is retried block by block to find them */
+            if (ntfs_read_stream_bytes(vol, &rl, b * ibs, run * ibs,
+                                       ibuf) == 0) {
+                for (UINT32 k = 0; k < run && !stop; k++)
+                    stop = ntfs_visit_indx_block(vol, ibuf + k * ibs, ibs,
+                                                 visit, ctx) == 1;
+            } else {
+                for (UINT32 k = 0; k < run && !stop; k++) {
+                    if (ntfs_read_stream_bytes(vol, &rl, (b + k) * ibs, ibs,
+                                               ibuf) != 0)
+                        continue;
+                    stop = ntfs_visit_indx_block(vol, ibuf, ibs,
+                                                 visit, ctx) == 1;
                 }
             }
+            b += run;
         }
+        mem_free(ibuf);
     }
 
-    int result = state.count;
-
-    mem_free(state.mft_refs);
-    mem_free(state.namespaces);
+    if (bitmap)
+        mem_free(bitmap);
+    ntfs_runlist_free(&rl);
     mem_free(mft_buf);
+    return 0;
+}
+
+/* NTFS time (100 ns units since 1601) in FS_DOS_TIME() form, 0 when
+   outside the years that form can hold */
+static UINT32 ntfs_dos_time(UINT64 t)
+{
+    UINT64 secs = t / 10000000ULL;
+    if (secs < 11644473600ULL)
+        return 0;
+    secs -= 11644473600ULL;             /* now since 1970 */
+    UINT32 rem = (UINT32)(secs % 86400);
+
+    /* Civil date from the day number, in 400-year eras of March years */
+    UINT32 z = (UINT32)(secs / 86400) + 719468;
+    UINT32 era = z / 146097;
+    UINT32 doe = z - era * 146097;
+    UINT32 yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    UINT32 doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    UINT32 mp = (5 * doy + 2) / 153;
+    UINT32 day = doy - (153 * mp + 2) / 5 + 1;
+    UINT32 month = mp < 10 ? mp + 3 : mp - 9;
+    UINT32 year = yoe + era * 400 + (month <= 2);
+
+    if (year < 1980 || year >= 2108)
+        return 0;
+    return FS_DOS_TIME(year, month, day, rem / 3600, rem / 60 % 60, rem % 60);
+}
+
+/* Convert a $FILE_NAME value into a directory entry.  Returns 0 if the
+   name should be listed: "." / ".." and DOS 8.3 aliases (always paired
+   with a Win32 name for the same file) are not. */
+static int ntfs_make_entry(const UINT8 *fn, UINT32 fn_len,
+                           struct fs_entry *entry)
+{
+    if (fn_len < 66)
+        return -1; /* too short */
+
+    UINT8 name_length = fn[64];
+    if (66 + (UINT32)name_length * 2 > fn_len)
+        return -1;
+    if (fn[65] == NTFS_NS_DOS)
+        return -1;
+
+    /* Skip . and .. */
+    if (name_length == 1 && rd16(fn + 66) == '.')
+        return -1;
+    if (name_length == 2 && rd16(fn + 66) == '.' && rd16(fn + 68) == '.')
+        return -1;
+
+    UINT32 flags = rd32(fn + 56);
+    UINT64 real_size = rd64(fn + 48);
+
+    entry->is_dir = (flags & NTFS_FILE_ATTR_DIRECTORY) ? 1 : 0;
+    entry->size = entry->is_dir ? 0 : real_size;
+    entry->mtime = ntfs_dos_time(rd64(fn + 16));
+    entry->ctime = ntfs_dos_time(rd64(fn + 8));
+    entry->attr = (UINT8)(flags & 0x27);
+    entry->id = 0;
+    ntfs_utf16_to_ascii((const UINT16 *)(fn + 66), name_length,
+                        entry->name, FS_MAX_NAME);
+    return 0;
+}
+
+/*
+ * Adapter from index entries to the public per-entry callback.  An index
+ * entry's $FILE_NAME copy carries no size for files Windows never
+ * updated it for, and none at all for ones whose $DATA lives in
+ * extension records; those take the size from the file's own record.
+ * Rather than one MFT read per such file in name order, entries wait in
+ * a batch until it holds NTFS_MFT_PREFETCH_MAX records to look up, which
+ * then come in through one sorted ntfs_mft_prefetch(); entries are still
+ * delivered in index order.
+ */
+#define NTFS_ENUM_BATCH (NTFS_MFT_PREFETCH_MAX * 4)
+
+struct ntfs_enum_pending {
+    struct fs_entry entry;
+    UINT64          rec;        /* record to take the size from, or ~0 */
+};
+
+struct ntfs_enum_state {
+    ntfs_dir_fn      fn;
+    void            *ctx;
+    struct ntfs_vol *vol;
+    struct ntfs_enum_pending *pend;     /* NTFS_ENUM_BATCH, on first use */
+    int              npend;
+    int              nneed;             /* of them with rec set */
+    struct fs_entry  entry;
+};
+
+#define NTFS_ENUM_NO_REC (~(UINT64)0)
+
+/* Look up the batch's sizes and deliver it; the callback's result */
+static int ntfs_enum_flush(struct ntfs_enum_state *st)
+{
+    UINT64 recs[NTFS_MFT_PREFETCH_MAX];
+    int n = 0;
+
+    for (int i = 0; i < st->npend && n < NTFS_MFT_PREFETCH_MAX; i++)
+        if (st->pend[i].rec != NTFS_ENUM_NO_REC)
+            recs[n++] = st->pend[i].rec;
+    ntfs_mft_prefetch(st->vol, recs, n);
+
+    int rc = 0;
+    for (int i = 0; i < st->npend && rc == 0; i++) {
+        struct ntfs_enum_pending *p = &st->pend[i];
+        if (p->rec != NTFS_ENUM_NO_REC)
+            p->entry.size = ntfs_get_file_size(st->vol, p->rec);
+        rc = st->fn(st->ctx, &p->entry);
+    }
+    st->npend = 0;
+    st->nneed = 0;
+    return rc;
+}
+
+static int ntfs_enum_visit(void *ctx, UINT64 ref, const UINT8 *fn,
+                           UINT32 fn_len)
+{
+    struct ntfs_enum_state *st = (struct ntfs_enum_state *)ctx;
+
+    if (ntfs_make_entry(fn, fn_len, &st->entry) != 0)
+        return 0;
+    st->entry.id = ref & 0x0000FFFFFFFFFFFFULL;
+
+    int need = !st->entry.is_dir && st->entry.size == 0;
+    if (!need && st->npend == 0)
+        return st->fn(st->ctx, &st->entry);
+
+    if (!st->pend)
+        st->pend = (struct ntfs_enum_pending *)
+            mem_alloc(NTFS_ENUM_BATCH * sizeof(struct ntfs_enum_pending));
+    if (!st->pend) {
+        /* No memory for a batch: one record at a time */
+        st->entry.size = ntfs_get_file_size(st->vol,
+                                            ref & 0x0000FFFFFFFFFFFFULL);
+        return st->fn(st->ctx, &st->entry);
+    }
+
+    struct ntfs_enum_pending *p = &st->pend[st->npend++];
+    mem_copy(&p->entry, &st->entry, sizeof(p->entry));
+    p->rec = need ? (ref & 0x0000FFFFFFFFFFFFULL) : NTFS_ENUM_NO_REC;
+    st->nneed += need;
+
+    if (st->nneed == NTFS_MFT_PREFETCH_MAX || st->npend == NTFS_ENUM_BATCH)
+        return ntfs_enum_flush(st);
+    return 0;
+}
+
+/* Walk a directory through ntfs_enum_visit, the last batch included */
+static int ntfs_enum_run(struct ntfs_vol *vol, UINT64 dir_mft,
+                         ntfs_dir_fn fn, void *ctx)
+{
+    struct ntfs_enum_state st;
+    mem_set(&st, 0, sizeof(st));
+    st.fn = fn;
+    st.ctx = ctx;
+    st.vol = vol;
+
+    int rc = ntfs_walk_dir(vol, dir_mft, ntfs_enum_visit, &st);
+    if (rc == 0 && st.npend > 0)
+        ntfs_enum_flush(&st);       /* a stop here is still success */
+    if (st.pend)
+        mem_free(st.pend);
+    return rc;
+}
+
+/* Collects entries into a caller-supplied array for ntfs_readdir */
+struct ntfs_fill_state {
+    struct fs_entry *entries;
+    int              count;
+    int              max_entries;
+};
+
+static int ntfs_fill_visit(void *ctx, const struct fs_entry *entry)
+{
+    struct ntfs_fill_state *st = (struct ntfs_fill_state *)ctx;
 
-    return result;
+    mem_copy(&st->entries[st->count], entry, sizeof(*entry));
+    st->count++;
+    return st->count >= st->max_entries;
 }
 
 /* ------------------------------------------------------------------ */
 /* Path resolution                                                     */
 /* ------------------------------------------------------------------ */
 
+struct ntfs_scan_state {
+    const char *name;
+    INT64       result;
+};
+
+static int ntfs_scan_visit(void *ctx, UINT64 ref, const UINT8 *fn,
+                           UINT32 fn_len)
+{
+    struct ntfs_scan_state *st = (struct ntfs_scan_state *)ctx;
+
+    if (fn_len < 66 || 66 + (UINT32)fn[64] * 2 > fn_len)
+        return 0;
+    if (ntfs_name_icmp_utf16((const UINT16 *)(fn + 66), fn[64],
+                             st->name) != 0)
+        return 0;
+
+    st->result = (INT64)(ref & 0x0000FFFFFFFFFFFFULL);
+    /* A Win32/POSIX match is final; a DOS match is kept while looking
+       for a long name */
+    return fn[65] != NTFS_NS_DOS;
+}
+
 /*
- * Look up a single name component in a directory (given by MFT record number).
+ * Look up a name by scanning every entry of a directory index.  Used when
+ * the B-tree cannot be descended (no $UpCase, unusual layout).
  * Returns the MFT record number of the matching entry, or -1 if not found.
  */
-static INT64 ntfs_lookup_name(struct ntfs_vol *vol, UINT64 dir_mft,
-                              const char *name)
+static INT64 ntfs_lookup_name_scan(struct ntfs_vol *vol, UINT64 dir_mft,
+                                   const char *name)
 {
-    UINT8 *mft_buf = (UINT8 *)mem_alloc(vol->mft_record_size);
-    if (!mft_buf)
-        return -1;
+    struct ntfs_scan_state st;
+    st.name = name;
+    st.result = -1;
 
-    if (ntfs_read_mft_record(vol, dir_mft, mft_buf) != 0) {
-        mem_free(mft_buf);
+    if (ntfs_walk_dir(vol, dir_mft, ntfs_scan_visit, &st) != 0)
         return -1;
-    }
+    return st.result;
+}
 
-    INT64 result = -1;
+/* ------------------------------------------------------------------ */
+/* $I30 B-tree search                                                   */
+/* ------------------------------------------------------------------ */
 
-    /* First search INDEX_ROOT (named "$I30") */
-    UINT8 *ir_attr = ntfs_find_attr_any(mft_buf, vol->mft_record_size,
-                                        NTFS_AT_INDEX_ROOT);
-    int has_large_index = 0;
+/* Load $UpCase once; index entries are ordered by up-cased name */
+static int ntfs_load_upcase(struct ntfs_vol *vol)
+{
+    if (vol->upcase)
+        return 0;
+    if (vol->upcase_failed)
+        return -1;
+    vol->upcase_failed = 1;
 
-    if (ir_attr) {
-        UINT32 val_len = rd32(ir_attr + 16);
-        UINT16 val_off = rd16(ir_attr + 20);
-        UINT8 *ir_val = ir_attr + val_off;
+    UINT8 *rec = (UINT8 *)mem_alloc(vol->mft_record_size);
+    if (!rec)
+        return -1;
+    int rc = -1;
+    if (ntfs_read_mft_record(vol, NTFS_MFT_RECORD_UPCASE, rec) == 0) {
+        UINT8 *attr = ntfs_find_attr(rec, vol->mft_record_size,
+                                     NTFS_AT_DATA, 0, 0);
+        UINT8 *data = 0;
+        UINT64 size = 0;
+        if (attr && ntfs_read_attr_data(vol, attr, &data, &size) == 0) {
+            if (size >= 256) {
+                vol->upcase = (UINT16 *)data;
+                vol->upcase_len = (UINT32)(size / 2);
+                vol->upcase_failed = 0;
+                rc = 0;
+            } else {
+                mem_free(data);
+            }
+        }
+    }
+    mem_free(rec);
+    return rc;
+}
 
-        if (val_len >= 32) {
-            UINT32 node_entries_off = rd32(ir_val + 16);
-            UINT32 node_total_size = rd32(ir_val + 20);
-            UINT32 node_flags = rd32(ir_val + 28);
-            has_large_index = (node_flags & 0x01) ? 1 : 0;
+static UINT16 ntfs_upcase(struct ntfs_vol *vol, UINT16 c)
+{
+    return (c < vol->upcase_len) ? rd16(&vol->upcase[c]) : c;
+}
 
-            UINT32 entries_start = 16 + node_entries_off;
-            if (entries_start < val_len) {
-                UINT32 entries_size = node_total_size;
-                if (entries_start + entries_size > val_len)
-                    entries_size = val_len - entries_start;
+/*
+ * Collate an up-cased key against an on-disk UTF-16LE name the way
+ * $I30 (COLLATION_FILENAME) orders entries.  Returns <0, 0 or >0.
+ */
+static int ntfs_collate_name(struct ntfs_vol *vol, const UINT16 *key,
+                             int key_len, const UINT8 *uname, int ulen)
+{
+    int n = (key_len < ulen) ? key_len : ulen;
+    for (int i = 0; i < n; i++) {
+        UINT16 c = ntfs_upcase(vol, rd16(uname + i * 2));
+        if (key[i] != c)
+            return (key[i] < c) ? -1 : 1;
+    }
+    return key_len - ulen;
+}
 
-                /* Walk entries looking for name */
-                UINT32 pos = 0;
-                UINT8 *eb = ir_val + entries_start;
-
-                while (pos + 16 <= entries_size) {
-                    UINT64 mft_ref = rd64(eb + pos);
-                    UINT16 entry_len = rd16(eb + pos + 8);
-                    UINT16 stream_len = rd16(eb + pos + 10);
-                    UINT32 eflags = rd32(eb + pos + 12);
-
-                    if (eflags & NTFS_INDEX_ENTRY_LAST)
-                        break;
-
-                    if (stream_len >= 66 && pos + 16 + stream_len <= entries_size) {
-                        UINT8 *fn = eb + pos + 16;
-                        UINT8 fn_nlen = fn[64];
-                        UINT8 fn_ns = fn[65];
-
-                        /* Skip DOS-only if possible, but still check */
-                        if (ntfs_name_icmp_utf16(
-                                (const UINT16 *)(fn + 66),
-                                fn_nlen, name) == 0) {
-                            result = (INT64)(mft_ref & 0x0000FFFFFFFFFFFFULL);
-                            /* If it's a Win32/POSIX match, use it immediately */
-                            if (fn_ns != NTFS_NS_DOS)
-                                goto done;
-                            /* If DOS, keep looking for Win32 */
-                        }
-                    }
+/*
+ * Search the entries of one index node.  Returns 1 and sets *out when
+ * the key is found, 2 and sets *vcn when the search continues in a
+ * child node, 0 when the key is not in the index, -1 on a malformed node.
+ */
+static int ntfs_index_node_search(struct ntfs_vol *vol, const UINT8 *eb,
+                                  UINT32 size, const UINT16 *key,
+                                  int key_len, INT64 *out, UINT64 *vcn)
+{
+    UINT32 pos = 0;
+    while (pos + 16 <= size) {
+        UINT16 entry_len = rd16(eb + pos + 8);
+        UINT16 stream_len = rd16(eb + pos + 10);
+        UINT32 eflags = rd32(eb + pos + 12);
 
-                    if (entry_len == 0)
-                        break;
-                    pos += entry_len;
-                }
+        if (entry_len < 16 || pos + entry_len > size)
+            return -1;
+
+        int cmp = -1;  /* the LAST entry sorts after every key */
+        if (!(eflags & NTFS_INDEX_ENTRY_LAST)) {
+            if (stream_len < 66 || 16 + (UINT32)stream_len > entry_len)
+                return -1;
+            const UINT8 *fn = eb + pos + 16;
+            UINT8 fn_nlen = fn[64];
+            if (66 + (UINT32)fn_nlen * 2 > stream_len)
+                return -1;
+            cmp = ntfs_collate_name(vol, key, key_len, fn + 66, fn_nlen);
+            if (cmp == 0) {
+                *out = (INT64)(rd64(eb + pos) & 0x0000FFFFFFFFFFFFULL);
+                return 1;
             }
         }
+
+        if (cmp < 0) {
+            if (!(eflags & NTFS_INDEX_ENTRY_SUBNODE))
+                return 0;
+            if (entry_len < 24)
+                return -1;
+            *vcn = rd64(eb + pos + entry_len - 8);
+            return 2;
+        }
+        pos += entry_len;
     }
+    return -1;  /* ran off the node without a LAST entry */
+}
 
-    /* If found in INDEX_ROOT (non-DOS), we're done */
-    if (result >= 0 && !has_large_index)
-        goto done;
-
-    /* Search INDEX_ALLOCATION if present */
-    if (has_large_index) {
-        UINT8 *ia_attr = ntfs_find_attr_any(mft_buf, vol->mft_record_size,
-                                             NTFS_AT_INDEX_ALLOCATION);
-        if (ia_attr && ia_attr[8]) {
-            UINT16 runs_off = rd16(ia_attr + 32);
-            UINT64 real_size = rd64(ia_attr + 48);
-            UINT32 ia_attr_len = rd32(ia_attr + 4);
-
-            if (runs_off < ia_attr_len) {
-                UINT32 runs_len = ia_attr_len - runs_off;
-                const UINT8 *runs = ia_attr + runs_off;
-
-                struct ntfs_extent *extents = (struct ntfs_extent *)
-                    mem_alloc(NTFS_MAX_RUNS * sizeof(struct ntfs_extent));
-
-                if (extents) {
-                    int ext_count = ntfs_parse_data_runs(runs, runs_len,
-                                                         extents,
-                                                         NTFS_MAX_RUNS);
-
-                    if (ext_count > 0) {
-                        UINT32 ibs = vol->index_block_size;
-                        UINT8 *ibuf = (UINT8 *)mem_alloc(ibs);
-                        UINT32 bpc = vol->bytes_per_cluster;
-
-                        if (ibuf) {
-                            UINT64 total_read = 0;
-
-                            for (int e = 0; e < ext_count &&
-                                 total_read < real_size; e++) {
-                                UINT64 lcn = extents[e].lcn;
-                                UINT64 run_len = extents[e].length;
-
-                                if (lcn == 0 && run_len > 0) {
-                                    total_read += run_len * bpc;
-                                    continue;
-                                }
-
-                                UINT64 run_bytes = run_len * bpc;
-                                UINT64 blocks_in_run = run_bytes / ibs;
-
-                                for (UINT64 b = 0; b < blocks_in_run &&
-                                     total_read < real_size; b++) {
-                                    UINT64 bbo = b * ibs;
-                                    UINT64 bc = lcn + (bbo / bpc);
-                                    UINT32 oic = (UINT32)(bbo % bpc);
-                                    UINT64 db = bc * bpc + oic;
-
-                                    if (ntfs_read_bytes(vol, db,
-                                                        ibs, ibuf) != 0)
-                                        break;
-
-                                    /* Verify and fixup INDX block */
-                                    if (ibuf[0] != 'I' || ibuf[1] != 'N' ||
-                                        ibuf[2] != 'D' || ibuf[3] != 'X') {
-                                        total_read += ibs;
-                                        continue;
-                                    }
-
-                                    if (ntfs_apply_fixup(ibuf, ibs,
-                                            vol->bytes_per_sector) != 0) {
-                                        total_read += ibs;
-                                        continue;
-                                    }
-
-                                    /* Parse entries in this INDX block */
-                                    UINT32 ie_off = rd32(ibuf + 24);
-                                    UINT32 ie_size = rd32(ibuf + 28);
-                                    UINT32 ie_start = 24 + ie_off;
-
-                                    if (ie_start < ibs) {
-                                        if (ie_start + ie_size > ibs)
-                                            ie_size = ibs - ie_start;
-
-                                        UINT32 pos = 0;
-                                        UINT8 *eb = ibuf + ie_start;
-
-                                        while (pos + 16 <= ie_size) {
-                                            UINT64 mr = rd64(eb + pos);
-                                            UINT16 el = rd16(eb + pos + 8);
-                                            UINT16 sl = rd16(eb + pos + 10);
-                                            UINT32 ef = rd32(eb + pos + 12);
-
-                                            if (ef & NTFS_INDEX_ENTRY_LAST)
-                                                break;
-
-                                            if (sl >= 66 &&
-                                                pos + 16 + sl <= ie_size) {
-                                                UINT8 *fn = eb + pos + 16;
-                                                UINT8 fnl = fn[64];
-                                                UINT8 fns = fn[65];
-
-                                                if (ntfs_name_icmp_utf16(
-                                                    (const UINT16 *)(fn + 66),
-                                                    fnl, name) == 0) {
-                                                    INT64 new_ref =
-                                                        (INT64)(mr &
-                                                        0x0000FFFFFFFFFFFFULL);
-                                                    if (fns != NTFS_NS_DOS) {
-                                                        result = new_ref;
-                                                        mem_free(ibuf);
-                                                        mem_free(extents);
-                                                        goto done;
-                                                    }
-                                                    /* DOS match — save but
-                                                       keep looking */
-                                                    result = new_ref;
-                                                }
-                                            }
-
-                                            if (el == 0)
-                                                break;
-                                            pos += el;
-                                        }
-                                    }
-
-                                    total_read += ibs;
-                                }
-                            }
-
-                            mem_free(ibuf);
-                        }
-                    }
+/*
+ * Descend a directory's $I30 B-tree in collation order.  Returns 0 with
+ * *out set (record number, or -1 when the name is absent) if the search
+ * was conclusive, or -1 if the tree could not be searched this way.
+ */
+static int ntfs_index_search(struct ntfs_vol *vol, UINT64 dir_mft,
+                             const char *name, INT64 *out)
+{
+    if (ntfs_load_upcase(vol) != 0)
+        return -1;
 
-                    mem_free(extents);
-                }
-            }
+    /* Up-case the key once */
+    UINT16 key[NTFS_MAX_NAME_LEN];
+    int key_len = 0;
+    while (name[key_len]) {
+        if (key_len == NTFS_MAX_NAME_LEN)
+            return -1;
+        UINT8 c = (UINT8)name[key_len];
+        if (c >= 0x80)
+            return -1;  /* only ASCII keys can match (see name_icmp) */
+        key[key_len] = ntfs_upcase(vol, c);
+        key_len++;
+    }
+
+    UINT8 *mft_buf = (UINT8 *)mem_alloc(vol->mft_record_size);
+    if (!mft_buf)
+        return -1;
+    if (ntfs_read_mft_record(vol, dir_mft, mft_buf) != 0) {
+        mem_free(mft_buf);
+        return -1;
+    }
+
+    int rc = -1;
+    UINT64 vcn = 0;
+    UINT8 *ibuf = 0;
+    struct ntfs_runlist rl = {0};
+    UINT64 alloc_size;
+
+    /* Root node lives in INDEX_ROOT */
+    UINT8 *ir_attr = ntfs_find_attr_any(mft_buf, vol->mft_record_size,
+                                        NTFS_AT_INDEX_ROOT);
+    if (!ir_attr || ir_attr[8])
+        goto out;
+    UINT32 val_len = rd32(ir_attr + 16);
+    UINT8 *ir_val = ir_attr + rd16(ir_attr + 20);
+    if (val_len < 32 || rd32(ir_val) != NTFS_AT_FILE_NAME)
+        goto out;
+    UINT32 ent_off = 16 + rd32(ir_val + 16);
+    UINT32 ent_end = 16 + rd32(ir_val + 20);
+    if (ent_end > val_len)
+        ent_end = val_len;
+    if (ent_off >= ent_end)
+        goto out;
+
+    int r = ntfs_index_node_search(vol, ir_val + ent_off, ent_end - ent_off,
+                                   key, key_len, out, &vcn);
+    if (r < 0)
+        goto out;
+    if (r < 2) {
+        if (r == 0)
+            *out = -1;
+        rc = 0;
+        goto out;
+    }
+
+    /* Child nodes live in INDEX_ALLOCATION */
+    if (ntfs_dir_alloc_runs(vol, mft_buf, &rl, &alloc_size) != 0)
+        goto out;
+
+    UINT32 ibs = vol->index_block_size;
+    UINT32 vcn_size = (ibs >= vol->bytes_per_cluster)
+                      ? vol->bytes_per_cluster : 512;
+    ibuf = (UINT8 *)mem_alloc(ibs);
+    if (!ibuf)
+        goto out;
+
+    for (int depth = 0; depth < NTFS_MAX_INDEX_DEPTH; depth++) {
+        if (ntfs_read_stream_bytes(vol, &rl, vcn * vcn_size, ibs, ibuf) != 0)
+            goto out;
+        if (ibuf[0] != 'I' || ibuf[1] != 'N' || ibuf[2] != 'D' ||
+            ibuf[3] != 'X' ||
+            ntfs_apply_fixup(ibuf, ibs, vol->bytes_per_sector) != 0)
+            goto out;
+
+        UINT32 node_off = 24 + rd32(ibuf + 24);
+        UINT32 node_end = 24 + rd32(ibuf + 28);
+        if (node_end > ibs)
+            node_end = ibs;
+        if (node_off >= node_end)
+            goto out;
+
+        r = ntfs_index_node_search(vol, ibuf + node_off, node_end - node_off,
+                                   key, key_len, out, &vcn);
+        if (r < 0)
+            goto out;
+        if (r < 2) {
+            if (r == 0)
+                *out = -1;
+            rc = 0;
+            goto out;
         }
     }
 
-done:
+out:
+    if (ibuf)
+        mem_free(ibuf);
+    ntfs_runlist_free(&rl);
     mem_free(mft_buf);
-    return result;
+    return rc;
+}
+
+/*
+ * Look up a single name component in a directory (given by MFT record number).
+ * Returns the MFT record number of the matching entry, or -1 if not found.
+ */
+static INT64 ntfs_lookup_name(struct ntfs_vol *vol, UINT64 dir_mft,
+                              const char *name)
+{
+    INT64 result;
+    if (ntfs_index_search(vol, dir_mft, name, &result) == 0)
+        return result;
+    return ntfs_lookup_name_scan(vol, dir_mft, name);
 }
 
 /*
@@ -1794,8 +2139,23 @@ static UINT64 ntfs_get_file_size(struct ntfs_vol *vol, UINT64 mft_num)
     UINT8 *data_attr = ntfs_find_attr(mft_buf, vol->mft_record_size,
                                       NTFS_AT_DATA, 0, 0);
     if (!data_attr) {
+        /* In extension records: the size is in the piece at VCN 0 */
+        UINT64 size = 0;
+        if (ntfs_find_attr_any(mft_buf, vol->mft_record_size,
+                               NTFS_AT_ATTRIBUTE_LIST)) {
+            struct ntfs_runlist rl;
+            struct ntfs_stream_info info;
+            UINT8 *resident = 0;
+            mem_set(&rl, 0, sizeof(rl));
+            if (ntfs_collect_attrlist_runs(vol, mft_buf, NTFS_AT_DATA, 0, 0,
+                                           &rl, &info, &resident) == 0)
+                size = info.size;
+            ntfs_runlist_free(&rl);
+            if (resident)
+                mem_free(resident);
+        }
         mem_free(mft_buf);
-        return 0;
+        return size;
     }
 
     UINT64 size;
@@ -1865,14 +2225,22 @@ static void ntfs_read_volume_label(struct ntfs_vol *vol)
  * $ATTRIBUTE_LIST (type 0x20) that references other MFT records holding
  * the additional attributes.
  *
- * This function reads the $DATA attribute for a file that may have its
- * $DATA attribute in an extension record.  Returns 0 on success.
+ * This function collects the extents of a non-resident attribute (given
+ * by type and name; name NULL for unnamed) whose pieces may live in
+ * extension records, sorted by VCN.  On success rl holds the extents,
+ * *info the stream sizes, and 0 is returned; if the attribute turns out
+ * to be resident, rl is left empty and *out_resident holds a copy of the
+ * value instead.  The caller frees rl either way.
  */
-static int ntfs_read_file_data_via_attrlist(struct ntfs_vol *vol,
-                                            UINT8 *base_mft_buf,
-                                            UINT8 **out_data,
-                                            UINT64 *out_size)
+static int ntfs_collect_attrlist_runs(struct ntfs_vol *vol,
+                                      UINT8 *base_mft_buf, UINT32 type,
+                                      const UINT16 *name, UINT8 name_len,
+                                      struct ntfs_runlist *rl,
+                                      struct ntfs_stream_info *info,
+                                      UINT8 **out_resident)
 {
+    *out_resident = 0;
+
     /* Find $ATTRIBUTE_LIST */
     UINT8 *al_attr = ntfs_find_attr_any(base_mft_buf, vol->mft_record_size,
                                         NTFS_AT_ATTRIBUTE_LIST);
@@ -1885,8 +2253,14 @@ static int ntfs_read_file_data_via_attrlist(struct ntfs_vol *vol,
     if (ntfs_read_attr_data(vol, al_attr, &al_data, &al_size) != 0)
         return -1;
 
+    UINT8 *ext_buf = (UINT8 *)mem_alloc(vol->mft_record_size);
+    if (!ext_buf) {
+        mem_free(al_data);
+        return -1;
+    }
+
     /*
-     * Walk the attribute list looking for $DATA (type 0x80) entries.
+     * Walk the attribute list looking for entries of the wanted type.
      * Each entry in the attribute list:
      *   0  UINT32  type
      *   4  UINT16  record_length
@@ -1896,18 +2270,25 @@ static int ntfs_read_file_data_via_attrlist(struct ntfs_vol *vol,
      *  16  UINT64  mft_reference (low 6 = record, high 2 = seq)
      *  24  UINT16  attribute_id
      */
-    struct ntfs_extent *all_extents = (struct ntfs_extent *)
-        mem_alloc(NTFS_MAX_RUNS * sizeof(struct ntfs_extent));
-    if (!all_extents) {
-        mem_free(al_data);
-        return -1;
-    }
-
-    int total_extents = 0;
-    UINT64 total_data_size = 0;
-    int found_data = 0;
+    int found = 0;
+    int rc = 0;
 
+    /* The pieces' records first, so a fragmented file's extension
+       records come in a few sorted reads rather than one by one */
+    UINT64 pre[NTFS_MFT_PREFETCH_MAX];
+    int npre = 0;
     UINT64 pos = 0;
+    while (pos + 26 <= al_size && npre < NTFS_MFT_PREFETCH_MAX) {
+        UINT16 al_rec_len = rd16(al_data + pos + 4);
+        if (al_rec_len < 26 || pos + al_rec_len > al_size)
+            break;
+        if (rd32(al_data + pos) == type && al_data[pos + 6] == name_len)
+            pre[npre++] = rd64(al_data + pos + 16) & 0x0000FFFFFFFFFFFFULL;
+        pos += al_rec_len;
+    }
+    ntfs_mft_prefetch(vol, pre, npre);
+
+    pos = 0;
     while (pos + 26 <= al_size) {
         UINT32 al_type = rd32(al_data + pos);
         UINT16 al_rec_len = rd16(al_data + pos + 4);
@@ -1918,368 +2299,93 @@ static int ntfs_read_file_data_via_attrlist(struct ntfs_vol *vol,
         if (pos + al_rec_len > al_size)
             break;
 
-        if (al_type == NTFS_AT_DATA && al_nlen == 0) {
-            /* Found a $DATA entry. Read the MFT record it points to. */
+        if (al_type == type && al_nlen == name_len) {
+            /* Read the MFT record holding this piece */
+            UINT64 svcn = rd64(al_data + pos + 8);
             UINT64 ext_mft_ref = rd64(al_data + pos + 16);
             UINT64 ext_mft_num = ext_mft_ref & 0x0000FFFFFFFFFFFFULL;
 
-            UINT8 *ext_buf = (UINT8 *)mem_alloc(vol->mft_record_size);
-            if (!ext_buf) {
-                mem_free(all_extents);
-                mem_free(al_data);
-                return -1;
+            UINT8 *da = 0;
+            if (ntfs_read_mft_record(vol, ext_mft_num, ext_buf) == 0) {
+                /* A record may hold several pieces; take this one */
+                da = ntfs_find_attr(ext_buf, vol->mft_record_size,
+                                    type, name, name_len);
+                while (da && da[8] && rd64(da + 16) != svcn)
+                    da = ntfs_find_attr_next(ext_buf, vol->mft_record_size,
+                                             type, name, name_len, da);
             }
 
-            if (ntfs_read_mft_record(vol, ext_mft_num, ext_buf) == 0) {
-                UINT8 *da = ntfs_find_attr(ext_buf, vol->mft_record_size,
-                                           NTFS_AT_DATA, 0, 0);
-                if (da) {
-                    found_data = 1;
-
-                    if (!da[8]) {
-                        /* Resident $DATA in extension record —
-                           unlikely for split files but handle it */
-                        UINT32 vl = rd32(da + 16);
-                        UINT16 vo = rd16(da + 20);
-
-                        UINT8 *data = (UINT8 *)mem_alloc(vl + 1);
-                        if (data) {
-                            mem_copy(data, da + vo, vl);
-                            data[vl] = 0;
-                            *out_data = data;
-                            *out_size = vl;
-                            mem_free(ext_buf);
-                            mem_free(all_extents);
-                            mem_free(al_data);
-                            return 0;
-                        }
-                    } else {
-                        /* Non-resident: extract data runs and
-                           collect real_size */
-                        UINT16 runs_off = rd16(da + 32);
-                        UINT64 real_size = rd64(da + 48);
-                        UINT32 da_len = rd32(da + 4);
-
-                        if (real_size > total_data_size)
-                            total_data_size = real_size;
-
-                        if (runs_off < da_len) {
-                            UINT32 rl = da_len - runs_off;
-                            int space = NTFS_MAX_RUNS - total_extents;
-                            if (space > 0) {
-                                int n = ntfs_parse_data_runs(
-                                    da + runs_off, rl,
-                                    all_extents + total_extents,
-                                    space);
-                                if (n > 0) {
-                                    /* Adjust VCNs: the starting_vcn
-                                       in the attr list entry tells us
-                                       the base VCN for these runs */
-                                    UINT64 svcn = rd64(da + 16);
-                                    for (int k = 0; k < n; k++) {
-                                        all_extents[total_extents + k].vcn +=
-                                            svcn;
-                                    }
-                                    total_extents += n;
-                                }
-                            }
-                        }
-                    }
+            if (da && !da[8]) {
+                /* Resident value in an extension record —
+                   unlikely for split attributes but handle it */
+                UINT32 vl = rd32(da + 16);
+                UINT16 vo = rd16(da + 20);
+
+                UINT8 *data = (UINT8 *)mem_alloc(vl + 1);
+                if (data) {
+                    mem_copy(data, da + vo, vl);
+                    data[vl] = 0;
+                    *out_resident = data;
+                    ntfs_stream_info_from_attr(da, info);
+                    ntfs_runlist_free(rl);
+                    found = 1;
+                } else {
+                    rc = -1;
                 }
+                break;
             }
 
-            mem_free(ext_buf);
+            if (da) {
+                /* Sizes are only valid in the piece starting at VCN 0,
+                   the others hold zero */
+                if (svcn == 0) {
+                    ntfs_stream_info_from_attr(da, info);
+                    found = 1;
+                }
+
+                if (ntfs_runlist_from_attr(rl, da) < 0) {
+                    rc = -1;
+                    break;
+                }
+            }
         }
 
         pos += al_rec_len;
     }
 
+    mem_free(ext_buf);
     mem_free(al_data);
 
-    if (!found_data || total_extents == 0) {
-        mem_free(all_extents);
-        return -1;
-    }
-
-    /* Sort extents by VCN (they should already be in order from the
-       attribute list, but be safe) */
-    for (int i = 1; i < total_extents; i++) {
-        struct ntfs_extent tmp;
-        mem_copy(&tmp, &all_extents[i], sizeof(tmp));
-        int j = i - 1;
-        while (j >= 0 && all_extents[j].vcn > tmp.vcn) {
-            mem_copy(&all_extents[j + 1], &all_extents[j], sizeof(tmp));
-            j--;
-        }
-        mem_copy(&all_extents[j + 1], &tmp, sizeof(tmp));
-    }
-
-    /* Now read all the data */
-    UINT8 *data = (UINT8 *)mem_alloc((UINTN)total_data_size + 1);
-    if (!data) {
-        mem_free(all_extents);
+    if (rc != 0 || !found)
         return -1;
-    }
-
-    if (ntfs_read_data_from_extents(vol, all_extents, total_extents,
-                                    total_data_size, data) != 0) {
-        mem_free(data);
-        mem_free(all_extents);
+    if (*out_resident)
+        return 0;
+    if (rl->count == 0)
         return -1;
-    }
 
-    data[total_data_size] = 0;
-    mem_free(all_extents);
-
-    *out_data = data;
-    *out_size = total_data_size;
+    /* The attribute list is ordered by VCN, but be safe */
+    ntfs_runlist_sort(rl);
     return 0;
 }
 
-/*
- * Similar to above but for INDEX_ALLOCATION via attribute list.
- * Collects extents from all extension records and reads INDX blocks.
- */
-static int ntfs_read_dir_via_attrlist(struct ntfs_vol *vol,
-                                      UINT8 *base_mft_buf,
-                                      struct ntfs_dir_state *state)
-{
-    UINT8 *al_attr = ntfs_find_attr_any(base_mft_buf, vol->mft_record_size,
-                                        NTFS_AT_ATTRIBUTE_LIST);
-    if (!al_attr)
-        return -1;
+/* ------------------------------------------------------------------ */
+/* Public API: ntfs_mount                                              */
+/* ------------------------------------------------------------------ */
 
-    UINT8 *al_data = 0;
-    UINT64 al_size = 0;
-    if (ntfs_read_attr_data(vol, al_attr, &al_data, &al_size) != 0)
-        return -1;
-
-    struct ntfs_extent *all_extents = (struct ntfs_extent *)
-        mem_alloc(NTFS_MAX_RUNS * sizeof(struct ntfs_extent));
-    if (!all_extents) {
-        mem_free(al_data);
-        return -1;
-    }
-
-    int total_extents = 0;
-    UINT64 total_alloc_size = 0;
-
-    UINT64 pos = 0;
-    while (pos + 26 <= al_size) {
-        UINT32 al_type = rd32(al_data + pos);
-        UINT16 al_rec_len = rd16(al_data + pos + 4);
-
-        if (al_rec_len < 26)
-            break;
-        if (pos + al_rec_len > al_size)
-            break;
-
-        if (al_type == NTFS_AT_INDEX_ALLOCATION) {
-            UINT64 ext_mft_ref = rd64(al_data + pos + 16);
-            UINT64 ext_mft_num = ext_mft_ref & 0x0000FFFFFFFFFFFFULL;
-
-            UINT8 *ext_buf = (UINT8 *)mem_alloc(vol->mft_record_size);
-            if (!ext_buf) break;
-
-            if (ntfs_read_mft_record(vol, ext_mft_num, ext_buf) == 0) {
-                UINT8 *ia = ntfs_find_attr_any(ext_buf, vol->mft_record_size,
-                                               NTFS_AT_INDEX_ALLOCATION);
-                if (ia && ia[8]) {
-                    UINT16 runs_off = rd16(ia + 32);
-                    UINT64 real_size = rd64(ia + 48);
-                    UINT32 ia_len = rd32(ia + 4);
-
-                    if (real_size > total_alloc_size)
-                        total_alloc_size = real_size;
-
-                    if (runs_off < ia_len) {
-                        UINT32 rl = ia_len - runs_off;
-                        int space = NTFS_MAX_RUNS - total_extents;
-                        if (space > 0) {
-                            int n = ntfs_parse_data_runs(
-                                ia + runs_off, rl,
-                                all_extents + total_extents, space);
-                            if (n > 0) {
-                                UINT64 svcn = rd64(ia + 16);
-                                for (int k = 0; k < n; k++)
-                                    all_extents[total_extents + k].vcn += svcn;
-                                total_extents += n;
-                            }
-                        }
-                    }
-                }
-            }
-
-            mem_free(ext_buf);
-        }
-
-        pos += al_rec_len;
-    }
-
-    mem_free(al_data);
-
-    if (total_extents > 0 && total_alloc_size > 0) {
-        UINT32 ibs = vol->index_block_size;
-        UINT32 bpc = vol->bytes_per_cluster;
-        UINT8 *ibuf = (UINT8 *)mem_alloc(ibs);
-
-        if (ibuf) {
-            /* Sort extents by VCN */
-            for (int i = 1; i < total_extents; i++) {
-                struct ntfs_extent tmp;
-                mem_copy(&tmp, &all_extents[i], sizeof(tmp));
-                int j = i - 1;
-                while (j >= 0 && all_extents[j].vcn > tmp.vcn) {
-                    mem_copy(&all_extents[j + 1], &all_extents[j], sizeof(tmp));
-                    j--;
-                }
-                mem_copy(&all_extents[j + 1], &tmp, sizeof(tmp));
-            }
-
-            UINT64 total_read = 0;
-            for (int e = 0; e < total_extents && total_read < total_alloc_size; e++) {
-                UINT64 lcn = all_extents[e].lcn;
-                UINT64 run_len = all_extents[e].length;
-                if (lcn == 0 && run_len > 0) {
-                    total_read += run_len * bpc;
-                    continue;
-                }
-                UINT64 run_bytes = run_len * bpc;
-                UINT64 blocks_in_run = run_bytes / ibs;
-
-                for (UINT64 b = 0; b < blocks_in_run && total_read < total_alloc_size; b++) {
-                    UINT64 bbo = b * ibs;
-                    UINT64 bc = lcn + (bbo / bpc);
-                    UINT32 oic = (UINT32)(bbo % bpc);
-                    UINT64 db = bc * bpc + oic;
-
-                    if (ntfs_read_bytes(vol, db, ibs, ibuf) != 0)
-                        break;
-
-                    ntfs_parse_indx_block(vol, state, ibuf, ibs);
-                    total_read += ibs;
-                }
-            }
-
-            mem_free(ibuf);
-        }
-    }
-
-    mem_free(all_extents);
-    return 0;
-}
-
-/* ------------------------------------------------------------------ */
-/* Extended directory reading with ATTRIBUTE_LIST support               */
-/* ------------------------------------------------------------------ */
-
-/*
- * Read directory entries, handling the case where the directory's
- * INDEX_ALLOCATION attribute is split across extension MFT records
- * via $ATTRIBUTE_LIST.
- */
-static int ntfs_read_dir_entries_full(struct ntfs_vol *vol, UINT64 mft_num,
-                                      struct fs_entry *entries,
-                                      int max_entries)
-{
-    /* Try simple read first */
-    int result = ntfs_read_dir_entries(vol, mft_num, entries, max_entries);
-    if (result >= 0)
-        return result;
-
-    /* If that failed, check if the MFT record has an ATTRIBUTE_LIST */
-    UINT8 *mft_buf = (UINT8 *)mem_alloc(vol->mft_record_size);
-    if (!mft_buf)
-        return -1;
-
-    if (ntfs_read_mft_record(vol, mft_num, mft_buf) != 0) {
-        mem_free(mft_buf);
-        return -1;
-    }
-
-    UINT8 *al_attr = ntfs_find_attr_any(mft_buf, vol->mft_record_size,
-                                        NTFS_AT_ATTRIBUTE_LIST);
-    if (!al_attr) {
-        mem_free(mft_buf);
-        return -1;
-    }
-
-    /* Set up dir state */
-    int alloc_max = (max_entries < NTFS_MAX_DIR_ENTRIES) ?
-                    NTFS_MAX_DIR_ENTRIES : max_entries;
-
-    struct ntfs_dir_state state;
-    state.entries = entries;
-    state.count = 0;
-    state.max_entries = max_entries;
-    state.mft_refs = (UINT64 *)mem_alloc(alloc_max * sizeof(UINT64));
-    state.namespaces = (UINT8 *)mem_alloc(alloc_max * sizeof(UINT8));
-
-    if (!state.mft_refs || !state.namespaces) {
-        if (state.mft_refs) mem_free(state.mft_refs);
-        if (state.namespaces) mem_free(state.namespaces);
-        mem_free(mft_buf);
-        return -1;
-    }
-    mem_set(state.mft_refs, 0, alloc_max * sizeof(UINT64));
-    mem_set(state.namespaces, 0, alloc_max * sizeof(UINT8));
-
-    /* Parse INDEX_ROOT from base record */
-    UINT8 *ir_attr = ntfs_find_attr_any(mft_buf, vol->mft_record_size,
-                                        NTFS_AT_INDEX_ROOT);
-    if (ir_attr) {
-        UINT32 val_len = rd32(ir_attr + 16);
-        UINT16 val_off = rd16(ir_attr + 20);
-        UINT8 *ir_val = ir_attr + val_off;
-
-        if (val_len >= 32) {
-            UINT32 node_entries_off = rd32(ir_val + 16);
-            UINT32 node_total_size = rd32(ir_val + 20);
-
-            UINT32 entries_start = 16 + node_entries_off;
-            if (entries_start < val_len) {
-                UINT32 entries_size = node_total_size;
-                if (entries_start + entries_size > val_len)
-                    entries_size = val_len - entries_start;
-                ntfs_parse_index_entries(&state,
-                                        ir_val + entries_start,
-                                        entries_size);
-            }
-        }
-    }
-
-    /* Read INDEX_ALLOCATION from extension records via attribute list */
-    ntfs_read_dir_via_attrlist(vol, mft_buf, &state);
-
-    result = state.count;
-
-    mem_free(state.mft_refs);
-    mem_free(state.namespaces);
-    mem_free(mft_buf);
-
-    return result;
-}
-
-/* ------------------------------------------------------------------ */
-/* Public API: ntfs_mount                                              */
-/* ------------------------------------------------------------------ */
-
-struct ntfs_vol *ntfs_mount(ntfs_block_read_fn read_fn,
-                            void *ctx, UINT32 block_size)
-{
-    /* Allocate volume structure */
-    struct ntfs_vol *vol = (struct ntfs_vol *)
-        mem_alloc(sizeof(struct ntfs_vol));
-    if (!vol)
-        return 0;
-    mem_set(vol, 0, sizeof(struct ntfs_vol));
+struct ntfs_vol *ntfs_mount(ntfs_block_read_fn read_fn,
+                            void *ctx, UINT32 block_size)
+{
+    /* Allocate volume structure */
+    struct ntfs_vol *vol = (struct ntfs_vol *)
+        mem_alloc(sizeof(struct ntfs_vol));
+    if (!vol)
+        return 0;
+    mem_set(vol, 0, sizeof(struct ntfs_vol));
 
     vol->read_fn = read_fn;
     vol->ctx = ctx;
     vol->dev_block_size = block_size;
-
-    /* Initialize cache */
-    ntfs_cache_init(vol);
+    vol->max_transfer = NTFS_DEFAULT_MAX_XFER;
 
     /* Read boot sector (sector 0) */
     UINT32 boot_buf_size = (block_size < 512) ? 512 : block_size;
@@ -2346,6 +2452,12 @@ struct ntfs_vol *ntfs_mount(ntfs_block_read_fn read_fn,
 
     mem_free(boot);
 
+    /* Initialize cache (needs the sector size) */
+    if (ntfs_cache_init(vol) != 0) {
+        mem_free(vol);
+        return 0;
+    }
+
     /* Sanity checks */
     if (vol->mft_record_size == 0 || vol->mft_record_size > NTFS_MAX_MFT_SIZE) {
         ntfs_cache_free(vol);
@@ -2419,142 +2531,33 @@ struct ntfs_vol *ntfs_mount(ntfs_block_read_fn read_fn,
         return 0;
     }
 
-    /* Save the raw data runs */
-    UINT16 runs_off = rd16(mft_data_attr + 32);
-    UINT32 attr_len = rd32(mft_data_attr + 4);
-
-    if (runs_off >= attr_len) {
+    /* Decode the MFT extents held in the base record */
+    if (ntfs_runlist_from_attr(&vol->mft_map, mft_data_attr) <= 0) {
+        ntfs_runlist_free(&vol->mft_map);
         mem_free(mft0);
         ntfs_cache_free(vol);
         mem_free(vol);
         return 0;
     }
 
-    vol->mft_runs_len = attr_len - runs_off;
-    vol->mft_runs = (UINT8 *)mem_alloc(vol->mft_runs_len);
-    if (!vol->mft_runs) {
-        mem_free(mft0);
-        ntfs_cache_free(vol);
-        mem_free(vol);
-        return 0;
-    }
-    mem_copy(vol->mft_runs, mft_data_attr + runs_off, vol->mft_runs_len);
-
-    /* Pre-decode MFT extents */
-    vol->mft_extents = (struct ntfs_extent *)
-        mem_alloc(NTFS_MAX_RUNS * sizeof(struct ntfs_extent));
-    if (!vol->mft_extents) {
-        mem_free(vol->mft_runs);
-        mem_free(mft0);
-        ntfs_cache_free(vol);
-        mem_free(vol);
-        return 0;
-    }
+    /* A very large $MFT has its remaining runs in extension records,
+       listed by an attribute list.  Those records are found through
+       the base extents, which always map the start of the $MFT. */
+    if (ntfs_attr_is_partial(vol, mft_data_attr)) {
+        struct ntfs_runlist full = {0};
+        struct ntfs_stream_info info;
+        UINT8 *resident = 0;
 
-    vol->mft_extent_count = ntfs_parse_data_runs(vol->mft_runs,
-                                                  vol->mft_runs_len,
-                                                  vol->mft_extents,
-                                                  NTFS_MAX_RUNS);
-    if (vol->mft_extent_count <= 0) {
-        mem_free(vol->mft_extents);
-        mem_free(vol->mft_runs);
-        mem_free(mft0);
-        ntfs_cache_free(vol);
-        mem_free(vol);
-        return 0;
-    }
-
-    /* Check if $MFT has an attribute list (very large MFT) */
-    UINT8 *al_attr = ntfs_find_attr_any(mft0, vol->mft_record_size,
-                                        NTFS_AT_ATTRIBUTE_LIST);
-    if (al_attr) {
-        /* Read the attribute list to find extension $DATA runs */
-        UINT8 *al_data = 0;
-        UINT64 al_size = 0;
-        if (ntfs_read_attr_data(vol, al_attr, &al_data, &al_size) == 0) {
-            /* Collect additional $DATA extents from extension records */
-            struct ntfs_extent *extra = (struct ntfs_extent *)
-                mem_alloc(NTFS_MAX_RUNS * sizeof(struct ntfs_extent));
-            int extra_count = 0;
-
-            if (extra) {
-                /* Copy existing extents */
-                mem_copy(extra, vol->mft_extents,
-                         vol->mft_extent_count * sizeof(struct ntfs_extent));
-                extra_count = vol->mft_extent_count;
-
-                UINT64 apos = 0;
-                while (apos + 26 <= al_size) {
-                    UINT32 at = rd32(al_data + apos);
-                    UINT16 arl = rd16(al_data + apos + 4);
-                    UINT8 anl = al_data[apos + 6];
-                    UINT64 svcn = rd64(al_data + apos + 8);
-
-                    if (arl < 26) break;
-                    if (apos + arl > al_size) break;
-
-                    if (at == NTFS_AT_DATA && anl == 0 && svcn > 0) {
-                        UINT64 emr = rd64(al_data + apos + 16);
-                        UINT64 emn = emr & 0x0000FFFFFFFFFFFFULL;
-
-                        /* Read extension MFT record - use current extents */
-                        UINT8 *ebuf = (UINT8 *)mem_alloc(vol->mft_record_size);
-                        if (ebuf) {
-                            if (ntfs_read_mft_record(vol, emn, ebuf) == 0) {
-                                UINT8 *eda = ntfs_find_attr(
-                                    ebuf, vol->mft_record_size,
-                                    NTFS_AT_DATA, 0, 0);
-                                if (eda && eda[8]) {
-                                    UINT16 ero = rd16(eda + 32);
-                                    UINT32 eal = rd32(eda + 4);
-                                    if (ero < eal) {
-                                        int sp = NTFS_MAX_RUNS - extra_count;
-                                        if (sp > 0) {
-                                            int n = ntfs_parse_data_runs(
-                                                eda + ero, eal - ero,
-                                                extra + extra_count, sp);
-                                            if (n > 0) {
-                                                for (int k = 0; k < n; k++)
-                                                    extra[extra_count + k].vcn += svcn;
-                                                extra_count += n;
-                                            }
-                                        }
-                                    }
-                                }
-                            }
-                            mem_free(ebuf);
-                        }
-                    }
-
-                    apos += arl;
-                }
-
-                if (extra_count > vol->mft_extent_count) {
-                    /* Sort by VCN */
-                    for (int i = 1; i < extra_count; i++) {
-                        struct ntfs_extent tmp;
-                        mem_copy(&tmp, &extra[i], sizeof(tmp));
-                        int j = i - 1;
-                        while (j >= 0 && extra[j].vcn > tmp.vcn) {
-                            mem_copy(&extra[j + 1], &extra[j], sizeof(tmp));
-                            j--;
-                        }
-                        mem_copy(&extra[j + 1], &tmp, sizeof(tmp));
-                    }
-
-                    /* Replace the old extent array */
-                    mem_free(vol->mft_extents);
-                    vol->mft_extents = extra;
-                    vol->mft_extent_count = extra_count;
-                    extra = 0; /* don't free below */
-                }
-
-                if (extra)
-                    mem_free(extra);
-            }
-
-            mem_free(al_data);
+        if (ntfs_collect_attrlist_runs(vol, mft0, NTFS_AT_DATA, 0, 0,
+                                       &full, &info, &resident) == 0 &&
+            full.count > vol->mft_map.count) {
+            ntfs_runlist_free(&vol->mft_map);
+            vol->mft_map = full;
+        } else {
+            ntfs_runlist_free(&full);
         }
+        if (resident)
+            mem_free(resident);
     }
 
     mem_free(mft0);
@@ -2565,6 +2568,19 @@ struct ntfs_vol *ntfs_mount(ntfs_block_read_fn read_fn,
     return vol;
 }
 
+/* ------------------------------------------------------------------ */
+/* Public API: ntfs_set_max_transfer                                   */
+/* ------------------------------------------------------------------ */
+
+void ntfs_set_max_transfer(struct ntfs_vol *vol, UINT32 bytes)
+{
+    if (!vol)
+        return;
+    if (bytes < vol->bytes_per_cluster)
+        bytes = vol->bytes_per_cluster;
+    vol->max_transfer = bytes;
+}
+
 /* ------------------------------------------------------------------ */
 /* Public API: ntfs_unmount                                            */
 /* ------------------------------------------------------------------ */
@@ -2576,10 +2592,11 @@ void ntfs_unmount(struct ntfs_vol *vol)
 
     ntfs_cache_free(vol);
 
-    if (vol->mft_runs)
-        mem_free(vol->mft_runs);
-    if (vol->mft_extents)
-        mem_free(vol->mft_extents);
+    if (vol->mft_cache_mem)
+        mem_free(vol->mft_cache_mem);
+    if (vol->upcase)
+        mem_free(vol->upcase);
+    ntfs_runlist_free(&vol->mft_map);
 
     mem_free(vol);
 }
@@ -2598,15 +2615,35 @@ int ntfs_readdir(struct ntfs_vol *vol, const char *path,
     if (mft_num < 0)
         return -1;
 
-    int count = ntfs_read_dir_entries_full(vol, (UINT64)mft_num,
-                                           entries, max_entries);
-    if (count < 0)
+    struct ntfs_fill_state fill;
+    fill.entries = entries;
+    fill.count = 0;
+    fill.max_entries = max_entries;
+
+    if (ntfs_enum_run(vol, (UINT64)mft_num, ntfs_fill_visit, &fill) != 0)
         return -1;
 
     /* Sort results */
-    ntfs_sort_entries(entries, count);
+    dirsort_entries(entries, fill.count);
 
-    return count;
+    return fill.count;
+}
+
+/* ------------------------------------------------------------------ */
+/* Public API: ntfs_enumdir                                            */
+/* ------------------------------------------------------------------ */
+
+int ntfs_enumdir(struct ntfs_vol *vol, const char *path,
+                 ntfs_dir_fn fn, void *ctx)
+{
+    if (!vol || !path || !fn)
+        return -1;
+
+    INT64 mft_num = ntfs_resolve_path(vol, path);
+    if (mft_num < 0)
+        return -1;
+
+    return ntfs_enum_run(vol, (UINT64)mft_num, fn, ctx);
 }
 
 /* ------------------------------------------------------------------ */
@@ -2620,59 +2657,239 @@ void *ntfs_readfile(struct ntfs_vol *vol, const char *path, UINTN *out_size)
 
     *out_size = 0;
 
-    INT64 mft_num = ntfs_resolve_path(vol, path);
-    if (mft_num < 0)
+    /* Read through a file handle so that sparse, compressed and split
+       $DATA all take the same path */
+    UINT64 size = 0;
+    struct ntfs_file *f = ntfs_open(vol, path, &size);
+    if (!f)
         return 0;
 
+    UINT8 *data = (UINT8 *)mem_alloc((UINTN)size + 1);
+    UINTN got = (UINTN)size;
+    if (!data || ntfs_read(f, data, &got) != 0 || got != size) {
+        if (data)
+            mem_free(data);
+        ntfs_close(f);
+        return 0;
+    }
+    ntfs_close(f);
+
+    data[size] = 0; /* null-terminate for convenience */
+    *out_size = (UINTN)size;
+    return data;
+}
+
+/* ------------------------------------------------------------------ */
+/* Free space ($Bitmap)                                                */
+/* ------------------------------------------------------------------ */
+
+/* $Bitmap is streamed in chunks of this size */
+#define NTFS_BITMAP_CHUNK         (256 * 1024)
+
+/* Set bits in buf[0..bits), counted a 64-bit word at a time */
+static UINT64 ntfs_count_set_bits(const UINT8 *buf, UINT64 bits)
+{
+    UINT64 n = 0;
+    UINT64 words = bits / 64;
+    for (UINT64 i = 0; i < words; i++) {
+        UINT64 w = rd64(buf + i * 8);
+        if (w == 0)
+            continue;
+        if (w == ~(UINT64)0) {
+            n += 64;
+            continue;
+        }
+        w = w - ((w >> 1) & 0x5555555555555555ULL);
+        w = (w & 0x3333333333333333ULL) + ((w >> 2) & 0x3333333333333333ULL);
+        w = (w + (w >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+        n += (w * 0x0101010101010101ULL) >> 56;
+    }
+    for (UINT64 bit = words * 64; bit < bits; bit++)
+        n += (buf[bit / 8] >> (bit % 8)) & 1;
+    return n;
+}
+
+/* Called for consecutive pieces of $Bitmap: bits [first, first+n) are
+   bits[0..n), or all clear when bits is NULL (a sparse run) */
+typedef int (*ntfs_bitmap_fn)(void *ctx, const UINT8 *bits, UINT64 first,
+                              UINT64 n);
+
+/*
+ * Stream $Bitmap (MFT record 6) through fn, up to the cluster count.
+ * Returns 0, or -1 on a read error or when fn returns nonzero.
+ */
+static int ntfs_bitmap_walk(struct ntfs_vol *vol, ntfs_bitmap_fn fn, void *ctx)
+{
     UINT8 *mft_buf = (UINT8 *)mem_alloc(vol->mft_record_size);
     if (!mft_buf)
-        return 0;
+        return -1;
 
-    if (ntfs_read_mft_record(vol, (UINT64)mft_num, mft_buf) != 0) {
-        mem_free(mft_buf);
-        return 0;
+    int rc = -1;
+    UINT64 max_bit = vol->total_clusters;
+    UINT8 *bm_attr = 0;
+    if (ntfs_read_mft_record(vol, 6, mft_buf) == 0)
+        bm_attr = ntfs_find_attr(mft_buf, vol->mft_record_size,
+                                 NTFS_AT_DATA, 0, 0);
+
+    if (bm_attr && !bm_attr[8]) {
+        /* Resident bitmap (very small volume) */
+        UINT8 *bm_data = 0;
+        UINT64 bm_size = 0;
+        if (ntfs_read_attr_data(vol, bm_attr, &bm_data, &bm_size) == 0) {
+            UINT64 bits = bm_size * 8;
+            rc = fn(ctx, bm_data, 0, bits < max_bit ? bits : max_bit) ? -1 : 0;
+            mem_free(bm_data);
+        }
+    } else if (bm_attr) {
+        /* Non-resident bitmap: stream it extent by extent */
+        struct ntfs_runlist rl = {0};
+        UINT8 *chunk = (UINT8 *)mem_alloc(NTFS_BITMAP_CHUNK);
+        int ec = 0;
+
+        if (chunk)
+            ec = ntfs_runlist_from_attr(&rl, bm_attr);
+        struct ntfs_extent *ext = rl.ext;
+
+        UINT64 bit = 0;
+        UINT32 bpc = vol->bytes_per_cluster;
+        rc = (ec > 0) ? 0 : -1;
+        for (int e = 0; rc == 0 && e < ec && bit < max_bit; e++) {
+            UINT64 run_bytes = ext[e].length * bpc;
+
+            if (ext[e].lcn == 0) {
+                /* Sparse: all clear */
+                UINT64 bits = run_bytes * 8;
+                if (bits > max_bit - bit)
+                    bits = max_bit - bit;
+                if (fn(ctx, 0, bit, bits))
+                    rc = -1;
+                bit += bits;
+                continue;
+            }
+
+            UINT64 disk_byte = ext[e].lcn * bpc;
+            while (run_bytes > 0 && bit < max_bit) {
+                UINT32 n = (run_bytes < NTFS_BITMAP_CHUNK)
+                           ? (UINT32)run_bytes : NTFS_BITMAP_CHUNK;
+                if (ntfs_read_bytes(vol, disk_byte, n, chunk) != 0) {
+                    rc = -1;
+                    break;
+                }
+                UINT64 bits = (UINT64)n * 8;
+                if (bits > max_bit - bit)
+                    bits = max_bit - bit;
+                if (fn(ctx, chunk, bit, bits)) {
+                    rc = -1;
+                    break;
+                }
+                bit += bits;
+                disk_byte += n;
+                run_bytes -= n;
+            }
+        }
+
+        if (chunk)
+            mem_free(chunk);
+        ntfs_runlist_free(&rl);
     }
+    mem_free(mft_buf);
+    return rc;
+}
 
-    /* Verify it's a file, not a directory */
-    UINT16 flags = rd16(mft_buf + 22);
-    if (flags & NTFS_MFT_DIRECTORY) {
-        mem_free(mft_buf);
+static int ntfs_count_piece(void *ctx, const UINT8 *bits, UINT64 first,
+                            UINT64 n)
+{
+    (void)first;
+    if (bits)
+        *(UINT64 *)ctx += ntfs_count_set_bits(bits, n);
+    return 0;
+}
+
+/*
+ * Count free clusters from $Bitmap.  The volume is mounted read-only,
+ * so the result is computed once and kept for the mount.
+ */
+static int ntfs_count_free(struct ntfs_vol *vol, UINT64 *out)
+{
+    if (vol->free_valid) {
+        *out = vol->free_clusters;
         return 0;
     }
 
-    /* Find $DATA attribute (unnamed) */
-    UINT8 *data_attr = ntfs_find_attr(mft_buf, vol->mft_record_size,
-                                      NTFS_AT_DATA, 0, 0);
+    UINT64 max_bit = vol->total_clusters;
+    UINT64 used = 0;
+    if (ntfs_bitmap_walk(vol, ntfs_count_piece, &used) != 0)
+        return -1;
+    vol->free_clusters = (used < max_bit) ? max_bit - used : 0;
+    vol->free_valid = 1;
+    *out = vol->free_clusters;
+    return 0;
+}
 
-    if (data_attr) {
-        /* Read attribute data */
-        UINT8 *data = 0;
-        UINT64 size = 0;
+/* Allocated clusters gathered into runs for ntfs_used_runs() */
+struct ntfs_run_state {
+    struct ntfs_vol *vol;
+    fs_run_fn fn;
+    void *ctx;
+    UINT64 start, len;          /* the run being gathered, in clusters */
+};
+
+static int ntfs_run_emit(struct ntfs_run_state *st)
+{
+    if (!st->len)
+        return 0;
+    UINT64 per = st->vol->bytes_per_cluster / st->vol->dev_block_size;
+    int stop = st->fn(st->ctx, st->start * per, st->len * per);
+    st->len = 0;
+    return stop;
+}
 
-        if (ntfs_read_attr_data(vol, data_attr, &data, &size) == 0) {
-            *out_size = (UINTN)size;
-            mem_free(mft_buf);
-            return data;
+static int ntfs_run_piece(void *ctx, const UINT8 *bits, UINT64 first,
+                          UINT64 n)
+{
+    struct ntfs_run_state *st = (struct ntfs_run_state *)ctx;
+    if (!bits)
+        return ntfs_run_emit(st);
+    for (UINT64 i = 0; i < n; ) {
+        /* Whole bytes of one value at a time */
+        if (i % 8 == 0 && n - i >= 8 && (bits[i / 8] == 0 || bits[i / 8] == 0xFF)) {
+            if (bits[i / 8]) {
+                if (!st->len)
+                    st->start = first + i;
+                st->len += 8;
+            } else if (ntfs_run_emit(st)) {
+                return 1;
+            }
+            i += 8;
+            continue;
+        }
+        if ((bits[i / 8] >> (i % 8)) & 1) {
+            if (!st->len)
+                st->start = first + i;
+            st->len++;
+        } else if (ntfs_run_emit(st)) {
+            return 1;
         }
+        i++;
     }
+    return 0;
+}
 
-    /* $DATA not found in base record — check for $ATTRIBUTE_LIST */
-    UINT8 *al = ntfs_find_attr_any(mft_buf, vol->mft_record_size,
-                                   NTFS_AT_ATTRIBUTE_LIST);
-    if (al) {
-        UINT8 *data = 0;
-        UINT64 size = 0;
+int ntfs_used_runs(struct ntfs_vol *vol, fs_run_fn fn, void *ctx)
+{
+    if (!vol || vol->bytes_per_cluster < vol->dev_block_size)
+        return -1;
 
-        if (ntfs_read_file_data_via_attrlist(vol, mft_buf,
-                                             &data, &size) == 0) {
-            *out_size = (UINTN)size;
-            mem_free(mft_buf);
-            return data;
-        }
-    }
+    struct ntfs_run_state st = { vol, fn, ctx, 0, 0 };
+    if (ntfs_bitmap_walk(vol, ntfs_run_piece, &st) != 0 || ntfs_run_emit(&st))
+        return -1;
 
-    mem_free(mft_buf);
-    return 0;
+    /* The backup boot sector, just past the last sector the boot
+       sector counts */
+    UINT64 lba = vol->total_sectors * vol->bytes_per_sector / vol->dev_block_size;
+    UINT64 n = (vol->bytes_per_sector + vol->dev_block_size - 1) /
+               vol->dev_block_size;
+    return fn(ctx, lba, n) ? -1 : 0;
 }
 
 /* ------------------------------------------------------------------ */
@@ -2689,125 +2906,10 @@ int ntfs_volume_info(struct ntfs_vol *vol, UINT64 *total_bytes,
         *total_bytes = vol->total_sectors * vol->bytes_per_sector;
 
     if (free_bytes) {
-        /* To get free space accurately, we'd need to read and parse the
-           $Bitmap (MFT record 6), which tracks every cluster's allocation
-           status.  For a read-only driver this is optional but useful.
-
-           We attempt to read $Bitmap and count free clusters. */
+        UINT64 free_clusters = 0;
         *free_bytes = 0;
-
-        UINT8 *mft_buf = (UINT8 *)mem_alloc(vol->mft_record_size);
-        if (mft_buf) {
-            if (ntfs_read_mft_record(vol, 6, mft_buf) == 0) {
-                UINT8 *bm_attr = ntfs_find_attr(mft_buf, vol->mft_record_size,
-                                                NTFS_AT_DATA, 0, 0);
-                if (bm_attr) {
-                    UINT8 *bm_data = 0;
-                    UINT64 bm_size = 0;
-
-                    /* For very large volumes, the bitmap could be huge
-                       (e.g., 1TB / 4096 clusters / 8 bits = 32MB).
-                       We'll read it in chunks to avoid excessive memory. */
-                    if (!bm_attr[8]) {
-                        /* Resident bitmap (very small volume) */
-                        if (ntfs_read_attr_data(vol, bm_attr,
-                                                &bm_data, &bm_size) == 0) {
-                            UINT64 free_clusters = 0;
-                            UINT64 max_bit = vol->total_clusters;
-                            UINT64 bit = 0;
-
-                            for (UINT64 i = 0; i < bm_size && bit < max_bit; i++) {
-                                UINT8 byte = bm_data[i];
-                                for (int b = 0; b < 8 && bit < max_bit; b++, bit++) {
-                                    if (!(byte & (1 << b)))
-                                        free_clusters++;
-                                }
-                            }
-
-                            *free_bytes = free_clusters * vol->bytes_per_cluster;
-                            mem_free(bm_data);
-                        }
-                    } else {
-                        /* Non-resident bitmap — read in 64KB chunks */
-                        UINT16 runs_off = rd16(bm_attr + 32);
-                        UINT64 real_size = rd64(bm_attr + 48);
-                        UINT32 ba_len = rd32(bm_attr + 4);
-
-                        if (runs_off < ba_len) {
-                            struct ntfs_extent *ext = (struct ntfs_extent *)
-                                mem_alloc(NTFS_MAX_RUNS * sizeof(struct ntfs_extent));
-                            if (ext) {
-                                int ec = ntfs_parse_data_runs(
-                                    bm_attr + runs_off, ba_len - runs_off,
-                                    ext, NTFS_MAX_RUNS);
-
-                                if (ec > 0) {
-                                    UINT64 free_clusters = 0;
-                                    UINT64 max_bit = vol->total_clusters;
-                                    UINT64 bit = 0;
-
-                                    /* Read chunks from extents */
-                                    UINT32 chunk_size = 65536;
-                                    UINT8 *chunk = (UINT8 *)mem_alloc(chunk_size);
-
-                                    if (chunk) {
-                                        UINT64 offset = 0;
-                                        UINT32 bpc = vol->bytes_per_cluster;
-
-                                        for (int e = 0; e < ec && bit < max_bit; e++) {
-                                            UINT64 lcn = ext[e].lcn;
-                                            UINT64 run_bytes = ext[e].length * bpc;
-
-                                            if (lcn == 0) {
-                                                /* Sparse - treat as all free */
-                                                UINT64 bits_in_run = run_bytes * 8;
-                                                if (bit + bits_in_run > max_bit)
-                                                    bits_in_run = max_bit - bit;
-                                                free_clusters += bits_in_run;
-                                                bit += bits_in_run;
-                                                offset += run_bytes;
-                                                continue;
-                                            }
-
-                                            UINT64 run_remaining = run_bytes;
-                                            UINT64 disk_byte = lcn * bpc;
-
-                                            while (run_remaining > 0 && bit < max_bit) {
-                                                UINT32 to_read = (run_remaining < chunk_size) ?
-                                                    (UINT32)run_remaining : chunk_size;
-
-                                                if (ntfs_read_bytes(vol, disk_byte,
-                                                                    to_read, chunk) != 0)
-                                                    break;
-
-                                                for (UINT32 i = 0; i < to_read && bit < max_bit; i++) {
-                                                    UINT8 byte = chunk[i];
-                                                    for (int b = 0; b < 8 && bit < max_bit; b++, bit++) {
-                                                        if (!(byte & (1 << b)))
-                                                            free_clusters++;
-                                                    }
-                                                }
-
-                                                disk_byte += to_read;
-                                                run_remaining -= to_read;
-                                                offset += to_read;
-                                            }
-                                        }
-
-                                        mem_free(chunk);
-                                    }
-
-                                    *free_bytes = free_clusters * vol->bytes_per_cluster;
-                                }
-
-                                mem_free(ext);
-                            }
-                        }
-                    }
-                }
-            }
-            mem_free(mft_buf);
-        }
+        if (ntfs_count_free(vol, &free_clusters) == 0)
+            *free_bytes = free_clusters * vol->bytes_per_cluster;
     }
 
     return 0;
@@ -2852,3 +2954,744 @@ const char *ntfs_get_label(struct ntfs_vol *vol)
         return "";
     return vol->label;
 }
+
+/* ------------------------------------------------------------------ */
+/* LZNT1 decompression                                                 */
+/* ------------------------------------------------------------------ */
+
+/*
+ * Decompress one compression unit.  LZNT1 data is a sequence of chunks,
+ * each a 16-bit header (bits 0-11: stored length - 3, bit 15: compressed)
+ * that expands to at most 4 KB.  Compressed chunks are groups of eight
+ * tokens behind a flag byte: a clear bit is a literal byte, a set bit a
+ * 16-bit back-reference whose offset/length split depends on how far
+ * into the chunk we are.  Short chunks are zero-padded to 4 KB.
+ *
+ * Returns the number of bytes produced, or -1 on corrupt input.
+ */
+static int ntfs_lznt1_decompress(const UINT8 *src, UINT32 src_len,
+                                 UINT8 *dst, UINT32 dst_len)
+{
+    UINT32 sp = 0, dp = 0;
+
+    while (sp + 2 <= src_len && dp < dst_len) {
+        UINT16 hdr = rd16(src + sp);
+        if (hdr == 0)
+            break; /* end of data */
+        sp += 2;
+
+        UINT32 clen = (UINT32)(hdr & 0x0FFF) + 1;
+        if (clen > src_len - sp)
+            return -1;
+
+        UINT32 chunk_start = dp;
+        UINT32 chunk_end = dp + NTFS_LZNT1_CHUNK;
+        if (chunk_end > dst_len)
+            chunk_end = dst_len;
+
+        const UINT8 *cs = src + sp;
+        const UINT8 *ce = cs + clen;
+
+        if (!(hdr & 0x8000)) {
+            /* Stored chunk */
+            UINT32 n = (clen < chunk_end - dp) ? clen : chunk_end - dp;
+            mem_copy(dst + dp, cs, n);
+            dp += n;
+        } else {
+            while (cs < ce && dp < chunk_end) {
+                UINT8 tags = *cs++;
+                for (int bit = 0; bit < 8 && cs < ce && dp < chunk_end;
+                     bit++, tags >>= 1) {
+                    if (!(tags & 1)) {
+                        dst[dp++] = *cs++;
+                        continue;
+                    }
+
+                    if (ce - cs < 2)
+                        return -1;
+                    UINT16 tok = rd16(cs);
+                    cs += 2;
+
+                    /* Offset bits grow with the position in the chunk */
+                    UINT32 pos = dp - chunk_start;
+                    int len_bits = 12;
+                    for (UINT32 p = pos - 1; pos > 0 && p >= 0x10; p >>= 1)
+                        len_bits--;
+                    UINT32 back = (UINT32)(tok >> len_bits) + 1;
+                    UINT32 n = (UINT32)(tok & ((1u << len_bits) - 1)) + 3;
+                    if (back > pos)
+                        return -1;
+                    if (n > chunk_end - dp)
+                        n = chunk_end - dp;
+
+                    /* Byte at a time: the source may overlap the copy */
+                    for (UINT32 k = 0; k < n; k++, dp++)
+                        dst[dp] = dst[dp - back];
+                }
+            }
+        }
+
+        /* Every chunk but the last expands to a full 4 KB */
+        if (dp < chunk_end) {
+            mem_set(dst + dp, 0, chunk_end - dp);
+            dp = chunk_end;
+        }
+        sp += clen;
+    }
+
+    return (int)dp;
+}
+
+/* ------------------------------------------------------------------ */
+/* Public API: streaming file handles                                  */
+/* ------------------------------------------------------------------ */
+
+struct ntfs_file {
+    struct ntfs_vol    *vol;
+    UINT64              size;
+    UINT64              pos;
+
+    /* Resident $DATA: the whole value, copied at open */
+    UINT8              *resident;
+
+    /* Non-resident $DATA: extents sorted by VCN, plus a cursor */
+    struct ntfs_runlist runs;
+    int                 cur_ext;
+    UINT64              init_size;  /* bytes past this read as zero */
+
+    /* Compressed $DATA: unit size in bytes (0 if not compressed) and
+       the last decompressed unit */
+    UINT32              cu_size;
+    UINT8              *cu_data;
+    UINT8              *cu_raw;
+    UINT64              cu_cached;  /* unit index + 1, 0 = none */
+};
+
+/*
+ * Read len bytes at file offset off, walking the extents from the
+ * cursor (found by binary search after a seek).  Disk-contiguous extents
+ * are merged up to max_transfer bytes; sparse runs and holes read as
+ * zeros without touching the disk.
+ */
+static int ntfs_file_read_plain(struct ntfs_file *f, UINT64 off,
+                                UINT8 *dst, UINTN len)
+{
+    struct ntfs_vol *vol = f->vol;
+    UINT32 bpc = vol->bytes_per_cluster;
+    struct ntfs_extent *ext = f->runs.ext;
+    int count = f->runs.count;
+
+    while (len > 0) {
+        UINT64 vcn = off / bpc;
+
+        /* Sequential reads stay on the cursor or step to the next
+           extent; anything else is a seek */
+        int c = f->cur_ext;
+        if (c < count && vcn >= ext[c].vcn + ext[c].length &&
+            (c + 1 == count || vcn < ext[c + 1].vcn + ext[c + 1].length))
+            c++;
+        else if (c >= count || vcn >= ext[c].vcn + ext[c].length ||
+                 (c > 0 && vcn < ext[c - 1].vcn + ext[c - 1].length))
+            c = ntfs_extent_find(ext, count, vcn);
+        f->cur_ext = c;
+
+        if (f->cur_ext >= count) {
+            /* Past the last run (beyond initialized data) */
+            mem_set(dst, 0, len);
+            return 0;
+        }
+
+        struct ntfs_extent *e = &ext[f->cur_ext];
+        UINT64 n;
+
+        if (vcn < e->vcn || e->lcn == 0) {
+            /* Hole before this extent, or a sparse run */
+            UINT64 end = (vcn < e->vcn) ? e->vcn * bpc
+                                        : (e->vcn + e->length) * bpc;
+            n = end - off;
+            if (n > len)
+                n = len;
+            mem_set(dst, 0, (UINTN)n);
+        } else {
+            /* Extend over following extents that continue on disk */
+            UINT64 lcn_end = e->lcn + e->length;
+            UINT64 vcn_end = e->vcn + e->length;
+            for (int i = f->cur_ext + 1; i < count; i++) {
+                if (ext[i].lcn == 0 || ext[i].vcn != vcn_end ||
+                    ext[i].lcn != lcn_end)
+                    break;
+                lcn_end += ext[i].length;
+                vcn_end += ext[i].length;
+            }
+
+            n = vcn_end * bpc - off;
+            if (n > len)
+                n = len;
+            if (n > vol->max_transfer)
+                n = vol->max_transfer;
+
+            UINT64 disk_off = (e->lcn + (vcn - e->vcn)) * bpc + off % bpc;
+            if (ntfs_read_bytes(vol, disk_off, n, dst) != 0)
+                return -1;
+        }
+
+        off += n;
+        dst += n;
+        len -= (UINTN)n;
+    }
+    return 0;
+}
+
+/* Allocated (non-sparse) clusters among the count starting at vcn */
+static UINT64 ntfs_file_alloc_clusters(struct ntfs_file *f, UINT64 vcn,
+                                       UINT64 count)
+{
+    struct ntfs_extent *ext = f->runs.ext;
+    UINT64 end = vcn + count;
+    UINT64 n = 0;
+
+    for (int i = ntfs_extent_find(ext, f->runs.count, vcn);
+         i < f->runs.count && ext[i].vcn < end; i++) {
+        if (ext[i].lcn == 0)
+            continue;
+        UINT64 a = (ext[i].vcn > vcn) ? ext[i].vcn : vcn;
+        UINT64 b = ext[i].vcn + ext[i].length;
+        if (b > end)
+            b = end;
+        n += b - a;
+    }
+    return n;
+}
+
+/*
+ * Read from a compressed stream, one compression unit at a time.  A unit
+ * with no clusters on disk is a hole, one with all of them is stored
+ * as-is, and anything in between holds LZNT1 data in its leading
+ * clusters.  Only the last decompressed unit is cached, which is all
+ * sequential reads need.
+ */
+static int ntfs_file_read_compressed(struct ntfs_file *f, UINT64 off,
+                                     UINT8 *dst, UINTN len)
+{
+    struct ntfs_vol *vol = f->vol;
+    UINT32 bpc = vol->bytes_per_cluster;
+    UINT32 cu = f->cu_size;
+    UINT64 cu_clusters = cu / bpc;
+
+    while (len > 0) {
+        UINT64 unit = off / cu;
+        UINT32 in_unit = (UINT32)(off % cu);
+        UINTN n = cu - in_unit;
+        if (n > len)
+            n = len;
+
+        if (f->cu_cached == unit + 1) {
+            mem_copy(dst, f->cu_data + in_unit, n);
+        } else {
+            UINT64 alloc = ntfs_file_alloc_clusters(f, unit * cu_clusters,
+                                                    cu_clusters);
+            if (alloc == 0) {
+                mem_set(dst, 0, n);
+            } else if (alloc >= cu_clusters) {
+                if (ntfs_file_read_plain(f, off, dst, n) != 0)
+                    return -1;
+            } else {
+                f->cu_cached = 0;
+                UINT32 raw_len = (UINT32)alloc * bpc;
+                if (ntfs_read_stream_bytes(vol, &f->runs, unit * cu,
+                                           raw_len, f->cu_raw) != 0)
+                    return -1;
+                int got = ntfs_lznt1_decompress(f->cu_raw, raw_len,
+                                                f->cu_data, cu);
+                if (got < 0)
+                    return -1;
+                mem_set(f->cu_data + got, 0, cu - (UINT32)got);
+                f->cu_cached = unit + 1;
+                mem_copy(dst, f->cu_data + in_unit, n);
+            }
+        }
+
+        off += n;
+        dst += n;
+        len -= n;
+    }
+    return 0;
+}
+
+/* Read len bytes at file offset off from a non-resident stream */
+static int ntfs_file_read_at(struct ntfs_file *f, UINT64 off, UINT8 *dst,
+                             UINTN len)
+{
+    /* Past the initialized size the data is zero by definition */
+    if (off + len > f->init_size) {
+        UINT64 z = (off > f->init_size) ? off : f->init_size;
+        mem_set(dst + (z - off), 0, (UINTN)(off + len - z));
+        len = (UINTN)(z - off);
+        if (len == 0)
+            return 0;
+    }
+
+    if (f->cu_size)
+        return ntfs_file_read_compressed(f, off, dst, len);
+    return ntfs_file_read_plain(f, off, dst, len);
+}
+
+/*
+ * Take a non-resident stream's sizes and compression into a handle.
+ * Encrypted (EFS) data cannot be read without the user's key.
+ */
+static int ntfs_file_setup(struct ntfs_file *f,
+                           const struct ntfs_stream_info *info)
+{
+    if (info->flags & NTFS_ATTR_FLAG_ENCRYPTED)
+        return -1;
+
+    f->size = info->size;
+    f->init_size = (info->init_size < info->size) ? info->init_size
+                                                  : info->size;
+
+    if (info->flags & NTFS_ATTR_FLAG_COMPRESSED) {
+        UINT32 bpc = f->vol->bytes_per_cluster;
+        if (info->cu_shift == 0 || info->cu_shift > 8 ||
+            ((UINT64)bpc << info->cu_shift) > NTFS_MAX_CU_SIZE)
+            return -1;
+        f->cu_size = bpc << info->cu_shift;
+        f->cu_data = (UINT8 *)mem_alloc(f->cu_size);
+        f->cu_raw = (UINT8 *)mem_alloc(f->cu_size);
+        if (!f->cu_data || !f->cu_raw)
+            return -1;
+    }
+    return 0;
+}
+
+/* Records before this one are the metafiles ($MFT, $LogFile, ...) */
+#define NTFS_FIRST_USER_RECORD    16
+
+/*
+ * Open the unnamed $DATA of a file record.  Returns a handle, or NULL
+ * for a directory or data that cannot be read.
+ */
+static struct ntfs_file *ntfs_open_mft(struct ntfs_vol *vol, UINT64 mft_num,
+                                       UINT64 *out_size)
+{
+    UINT8 *mft_buf = (UINT8 *)mem_alloc(vol->mft_record_size);
+    if (!mft_buf)
+        return 0;
+
+    if (ntfs_read_mft_record(vol, mft_num, mft_buf) != 0 ||
+        (rd16(mft_buf + 22) & NTFS_MFT_DIRECTORY)) {
+        mem_free(mft_buf);
+        return 0;
+    }
+
+    struct ntfs_file *f =
+        (struct ntfs_file *)mem_alloc(sizeof(struct ntfs_file));
+    if (!f) {
+        mem_free(mft_buf);
+        return 0;
+    }
+    f->vol = vol;
+
+    int ok = 0;
+    struct ntfs_stream_info info;
+    mem_set(&info, 0, sizeof(info));
+    UINT8 *data_attr = ntfs_find_attr(mft_buf, vol->mft_record_size,
+                                      NTFS_AT_DATA, 0, 0);
+    if (data_attr && !ntfs_attr_is_partial(vol, data_attr)) {
+        UINT32 attr_len = rd32(data_attr + 4);
+
+        if (!data_attr[8]) {
+            /* Resident: small enough to keep in memory */
+            UINT32 val_len = rd32(data_attr + 16);
+            UINT16 val_off = rd16(data_attr + 20);
+            if (val_off + val_len <= attr_len) {
+                f->resident = (UINT8 *)mem_alloc(val_len + 1);
+                if (f->resident) {
+                    mem_copy(f->resident, data_attr + val_off, val_len);
+                    f->size = val_len;
+                    ok = 1;
+                }
+            }
+        } else {
+            ntfs_stream_info_from_attr(data_attr, &info);
+            ok = ntfs_runlist_from_attr(&f->runs, data_attr) > 0;
+            if (!ok)
+                ntfs_runlist_free(&f->runs);
+        }
+    }
+
+    if (!ok && ntfs_find_attr_any(mft_buf, vol->mft_record_size,
+                                  NTFS_AT_ATTRIBUTE_LIST)) {
+        /* $DATA lives in extension records */
+        if (ntfs_collect_attrlist_runs(vol, mft_buf, NTFS_AT_DATA, 0, 0,
+                                       &f->runs, &info,
+                                       &f->resident) == 0) {
+            ok = 1;
+            if (f->resident)
+                f->size = info.size;
+        } else {
+            ntfs_runlist_free(&f->runs);
+        }
+    }
+
+    mem_free(mft_buf);
+
+    if (ok && !f->resident && ntfs_file_setup(f, &info) != 0)
+        ok = 0;
+    if (!ok) {
+        ntfs_close(f);
+        return 0;
+    }
+    if (out_size)
+        *out_size = f->size;
+    return f;
+}
+
+struct ntfs_file *ntfs_open(struct ntfs_vol *vol, const char *path,
+                            UINT64 *out_size)
+{
+    if (!vol || !path)
+        return 0;
+
+    INT64 mft_num = ntfs_resolve_path(vol, path);
+    if (mft_num < 0)
+        return 0;
+    return ntfs_open_mft(vol, (UINT64)mft_num, out_size);
+}
+
+struct ntfs_file *ntfs_open_record(struct ntfs_vol *vol, UINT64 record,
+                                   UINT64 *out_size)
+{
+    if (!vol || record < NTFS_FIRST_USER_RECORD)
+        return 0;
+    return ntfs_open_mft(vol, record, out_size);
+}
+
+int ntfs_read(struct ntfs_file *f, void *buf, UINTN *size)
+{
+    if (!f || !size)
+        return -1;
+
+    UINTN want = *size;
+    if (f->pos >= f->size)
+        want = 0;
+    else if ((UINT64)want > f->size - f->pos)
+        want = (UINTN)(f->size - f->pos);
+
+    *size = 0;
+    if (want == 0)
+        return 0;
+
+    if (f->resident)
+        mem_copy(buf, f->resident + f->pos, want);
+    else if (ntfs_file_read_at(f, f->pos, (UINT8 *)buf, want) != 0)
+        return -1;
+
+    f->pos += want;
+    *size = want;
+    return 0;
+}
+
+int ntfs_seek(struct ntfs_file *f, UINT64 pos)
+{
+    if (!f)
+        return -1;
+    f->pos = (pos > f->size) ? f->size : pos;
+    return 0;
+}
+
+void ntfs_close(struct ntfs_file *f)
+{
+    if (!f)
+        return;
+    if (f->resident)
+        mem_free(f->resident);
+    ntfs_runlist_free(&f->runs);
+    if (f->cu_data)
+        mem_free(f->cu_data);
+    if (f->cu_raw)
+        mem_free(f->cu_raw);
+    mem_free(f);
+}
+
+/* ------------------------------------------------------------------ */
+/* Public API: $MFT scan                                               */
+/* ------------------------------------------------------------------ */
+
+/* Bytes of $MFT read at a time: large enough that a million records
+   cost a few hundred reads */
+#define NTFS_SCAN_CHUNK           (4 * 1024 * 1024)
+
+struct ntfs_mft_scan {
+    struct ntfs_vol *vol;
+    UINT8  *buf;
+    UINT64  records;        /* the $MFT's allocated records */
+    UINT64  next;           /* first record not yet read */
+    UINT32  in_buf;         /* records in buf */
+    UINT32  pos;            /* the record being looked at */
+    int     checked;        /* it has been validated and fixed up */
+    UINT8  *attr;           /* its last $FILE_NAME reported */
+    UINT64  size;           /* its unnamed $DATA size */
+
+    /* Deleted files instead (ntfs_mft_scan_open_deleted()) */
+    int     deleted;
+    UINT64  overwritten;    /* the current one's bytes now in use */
+    struct ntfs_runlist runs;       /* its $DATA runs, decoded */
+    struct ntfs_runlist bm_runs;    /* $Bitmap, non-resident */
+    UINT8  *bm_res;                 /* or resident */
+    UINT64  bm_size;                /* its bytes */
+    UINT8  *bm_win;                 /* NTFS_BITMAP_CHUNK bytes of it */
+    UINT64  bm_win_off;
+    UINT32  bm_win_len;
+};
+
+struct ntfs_mft_scan *ntfs_mft_scan_open(struct ntfs_vol *vol)
+{
+    if (!vol || vol->mft_map.count == 0)
+        return 0;
+    struct ntfs_mft_scan *s = (struct ntfs_mft_scan *)mem_alloc(sizeof(*s));
+    if (!s)
+        return 0;
+    UINT32 per_chunk = NTFS_SCAN_CHUNK / vol->mft_record_size;
+    s->buf = (UINT8 *)mem_alloc_raw((UINTN)per_chunk * vol->mft_record_size);
+    if (!s->buf) {
+        mem_free(s);
+        return 0;
+    }
+    s->vol = vol;
+
+    /* The allocation, not the data size: records past the end of the
+       data fail the signature check */
+    UINT64 clusters = 0;
+    for (int i = 0; i < vol->mft_map.count; i++)
+        clusters += vol->mft_map.ext[i].length;
+    s->records = clusters * vol->bytes_per_cluster / vol->mft_record_size;
+    return s;
+}
+
+struct ntfs_mft_scan *ntfs_mft_scan_open_deleted(struct ntfs_vol *vol)
+{
+    struct ntfs_mft_scan *s = ntfs_mft_scan_open(vol);
+    if (!s)
+        return 0;
+    s->deleted = 1;
+
+    /* $Bitmap says which of a deleted file's clusters are taken again */
+    UINT8 *mft_buf = (UINT8 *)mem_alloc(vol->mft_record_size);
+    UINT8 *bm_attr = 0;
+    int ok = 0;
+    if (mft_buf && ntfs_read_mft_record(vol, 6, mft_buf) == 0)
+        bm_attr = ntfs_find_attr(mft_buf, vol->mft_record_size,
+                                 NTFS_AT_DATA, 0, 0);
+    if (bm_attr && !bm_attr[8]) {
+        ok = ntfs_read_attr_data(vol, bm_attr, &s->bm_res, &s->bm_size) == 0;
+    } else if (bm_attr && !ntfs_attr_is_partial(vol, bm_attr)) {
+        s->bm_size = rd64(bm_attr + 48);
+        s->bm_win = (UINT8 *)mem_alloc_raw(NTFS_BITMAP_CHUNK);
+        ok = s->bm_win && ntfs_runlist_from_attr(&s->bm_runs, bm_attr) > 0;
+    }
+    if (mft_buf)
+        mem_free(mft_buf);
+    if (!ok) {
+        ntfs_mft_scan_close(s);
+        return 0;
+    }
+    return s;
+}
+
+/* Whether $Bitmap has cluster lcn in use. Clusters past its end, or in
+   a piece of it that will not read, count as in use. */
+static int ntfs_scan_cluster_used(struct ntfs_mft_scan *s, UINT64 lcn)
+{
+    UINT64 byte = lcn / 8;
+    if (byte >= s->bm_size)
+        return 1;
+    if (s->bm_res)
+        return (s->bm_res[byte] >> (lcn % 8)) & 1;
+
+    if (byte < s->bm_win_off || byte >= s->bm_win_off + s->bm_win_len) {
+        s->bm_win_off = byte - byte % NTFS_BITMAP_CHUNK;
+        UINT64 left = s->bm_size - s->bm_win_off;
+        s->bm_win_len = (left < NTFS_BITMAP_CHUNK) ? (UINT32)left
+                                                   : NTFS_BITMAP_CHUNK;
+        if (ntfs_read_stream_bytes(s->vol, &s->bm_runs, s->bm_win_off,
+                                   s->bm_win_len, s->bm_win) != 0)
+            mem_set(s->bm_win, 0xFF, s->bm_win_len);
+    }
+    return (s->bm_win[byte - s->bm_win_off] >> (lcn % 8)) & 1;
+}
+
+/* Whether a deleted record's $DATA can still be read: resident, or
+   whole in the record with every run inside the volume. Notes the
+   bytes whose clusters have been taken again. */
+static int ntfs_scan_check_deleted(struct ntfs_mft_scan *s, UINT8 *r)
+{
+    struct ntfs_vol *vol = s->vol;
+    UINT32 rec = vol->mft_record_size;
+    UINT8 *data = ntfs_find_attr(r, rec, NTFS_AT_DATA, 0, 0);
+
+    s->overwritten = 0;
+    if (!data)
+        return 0;
+    if (!data[8]) {
+        s->size = rd32(data + 16);
+        return (UINT32)rd16(data + 20) + s->size <= rd32(data + 4);
+    }
+    if (ntfs_attr_is_partial(vol, data) ||
+        (rd16(data + 12) & NTFS_ATTR_FLAG_ENCRYPTED))
+        return 0;
+
+    s->size = rd64(data + 48);
+    s->runs.count = 0;
+    if (ntfs_runlist_from_attr(&s->runs, data) <= 0)
+        return 0;
+
+    UINT64 used = 0;
+    for (int i = 0; i < s->runs.count; i++) {
+        const struct ntfs_extent *x = &s->runs.ext[i];
+        if (x->lcn == 0)
+            continue;   /* sparse */
+        if (x->lcn >= vol->total_clusters ||
+            x->length > vol->total_clusters - x->lcn)
+            return 0;
+        for (UINT64 c = 0; c < x->length; c++)
+            used += ntfs_scan_cluster_used(s, x->lcn + c);
+    }
+    used *= vol->bytes_per_cluster;
+    s->overwritten = (used < s->size) ? used : s->size;
+    return 1;
+}
+
+/* Read the next chunk of records. A chunk that will not read in one
+   go (a bad sector, a hole) is read record by record, and the records
+   that still fail are zeroed so they are skipped. */
+static int ntfs_scan_fill(struct ntfs_mft_scan *s)
+{
+    struct ntfs_vol *vol = s->vol;
+    UINT32 rec = vol->mft_record_size;
+    UINT32 n = NTFS_SCAN_CHUNK / rec;
+    if (s->records - s->next < n)
+        n = (UINT32)(s->records - s->next);
+    if (n == 0)
+        return 0;
+
+    if (ntfs_read_stream_bytes(vol, &vol->mft_map, s->next * rec,
+                               n * rec, s->buf) != 0) {
+        for (UINT32 i = 0; i < n; i++) {
+            if (ntfs_read_stream_bytes(vol, &vol->mft_map, (s->next + i) * rec,
+                                       rec, s->buf + i * rec) != 0)
+                mem_set(s->buf + i * rec, 0, rec);
+        }
+    }
+    s->next += n;
+    s->in_buf = n;
+    s->pos = 0;
+    s->checked = 0;
+    return 1;
+}
+
+/* Whether the current record is an in-use base record; it is fixed up
+   and its $DATA size noted */
+static int ntfs_scan_check(struct ntfs_mft_scan *s, UINT8 *r, UINT64 num)
+{
+    struct ntfs_vol *vol = s->vol;
+    UINT32 rec = vol->mft_record_size;
+
+    if (num < NTFS_FIRST_USER_RECORD)
+        return 0;
+    if (r[0] != 'F' || r[1] != 'I' || r[2] != 'L' || r[3] != 'E')
+        return 0;
+    if (ntfs_apply_fixup(r, rec, vol->bytes_per_sector) != 0)
+        return 0;
+    if (rd64(r + 32) != 0)
+        return 0;       /* an extension of another record */
+    if (s->deleted) {
+        if (rd16(r + 22) & (NTFS_MFT_IN_USE | NTFS_MFT_DIRECTORY))
+            return 0;
+        return ntfs_scan_check_deleted(s, r);
+    }
+    if (!(rd16(r + 22) & NTFS_MFT_IN_USE))
+        return 0;
+
+    s->size = 0;
+    UINT8 *data = ntfs_find_attr(r, rec, NTFS_AT_DATA, 0, 0);
+    if (data)
+        s->size = data[8] ? rd64(data + 48) : rd32(data + 16);
+    return 1;
+}
+
+int ntfs_mft_scan_next(struct ntfs_mft_scan *s, struct ntfs_mft_name *out)
+{
+    if (!s || !out)
+        return -1;
+    UINT32 rec = s->vol->mft_record_size;
+
+    for (;;) {
+        if (s->pos >= s->in_buf && !ntfs_scan_fill(s))
+            return 0;
+
+        UINT8 *r = s->buf + s->pos * rec;
+        UINT64 num = s->next - s->in_buf + s->pos;
+        if (!s->checked) {
+            s->checked = 1;
+            s->attr = 0;
+            if (!ntfs_scan_check(s, r, num)) {
+                s->pos++;
+                s->checked = 0;
+                continue;
+            }
+        }
+
+        UINT8 *fn = ntfs_find_attr_next(r, rec, NTFS_AT_FILE_NAME, 0, 0,
+                                        s->attr);
+        if (!fn) {
+            s->pos++;
+            s->checked = 0;
+            continue;
+        }
+        s->attr = fn;
+        if (fn[8])
+            continue;   /* $FILE_NAME is always resident */
+
+        UINT32 vlen = rd32(fn + 16);
+        UINT16 voff = rd16(fn + 20);
+        if ((UINT32)voff + vlen > rec - (UINT32)(fn - r))
+            continue;
+        const UINT8 *value = fn + voff;
+        if (ntfs_make_entry(value, vlen, &out->entry) != 0)
+            continue;   /* a DOS alias */
+        out->record = num;
+        out->entry.id = num;
+        out->parent = rd64(value) & 0x0000FFFFFFFFFFFFULL;
+        out->overwritten = s->overwritten;
+        if (!out->entry.is_dir && s->size)
+            out->entry.size = s->size;
+        if (s->deleted) {
+            /* One name is enough to recover the file by */
+            s->pos++;
+            s->checked = 0;
+        }
+        return 1;
+    }
+}
+
+void ntfs_mft_scan_progress(const struct ntfs_mft_scan *s, UINT64 *done,
+                            UINT64 *total)
+{
+    *done = s ? s->next - s->in_buf + s->pos : 0;
+    *total = s ? s->records : 0;
+}
+
+void ntfs_mft_scan_close(struct ntfs_mft_scan *s)
+{
+    if (!s)
+        return;
+    ntfs_runlist_free(&s->runs);
+    ntfs_runlist_free(&s->bm_runs);
+    if (s->bm_res)
+        mem_free(s->bm_res);
+    if (s->bm_win)
+        mem_free(s->bm_win);
+    mem_free(s->buf);
+    mem_free(s);
+}
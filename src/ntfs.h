@@ -2,8 +2,9 @@
  * ntfs.h — NTFS filesystem driver (read-only)
  *
  * Portable: uses callback-based block I/O, no UEFI dependency.
- * Supports: file/dir read, path resolution, MFT parsing.
- * Does NOT support: compression, encryption, sparse files, ADS.
+ * Supports: file/dir read, path resolution, MFT parsing, sparse and
+ * LZNT1-compressed files.
+ * Does NOT support: encryption, ADS.
  */
 #ifndef NTFS_H
 #define NTFS_H
@@ -22,6 +23,10 @@ struct ntfs_vol;
 struct ntfs_vol *ntfs_mount(ntfs_block_read_fn read_fn,
                              void *ctx, UINT32 block_size);
 
+/* Cap the size of a single data read issued to read_fn (default 1 MB).
+   Physically contiguous runs are merged up to this size. */
+void ntfs_set_max_transfer(struct ntfs_vol *vol, UINT32 bytes);
+
 /* Unmount and free all resources */
 void ntfs_unmount(struct ntfs_vol *vol);
 
@@ -30,12 +35,26 @@ void ntfs_unmount(struct ntfs_vol *vol);
 int ntfs_readdir(struct ntfs_vol *vol, const char *path,
                  struct fs_entry *entries, int max_entries);
 
+/* Directory entry callback for ntfs_enumdir. Return nonzero to stop. */
+typedef int (*ntfs_dir_fn)(void *ctx, const struct fs_entry *entry);
+
+/* Stream a directory of any size through fn, one entry at a time, in
+   index order (unsorted). Returns 0 on success, -1 on error. */
+int ntfs_enumdir(struct ntfs_vol *vol, const char *path,
+                 ntfs_dir_fn fn, void *ctx);
+
 /* Read entire file into newly allocated buffer. Returns NULL on error. */
 void *ntfs_readfile(struct ntfs_vol *vol, const char *path, UINTN *out_size);
 
 /* Get volume info. Returns 0 on success. */
 int ntfs_volume_info(struct ntfs_vol *vol, UINT64 *total_bytes, UINT64 *free_bytes);
 
+/* The blocks the volume uses, in ascending runs: every cluster
+   $Bitmap marks allocated (the boot sector and metafiles among them)
+   and the backup boot sector. What a clone of the volume must copy.
+   Returns 0, or -1 on a read error or when fn stops the walk. */
+int ntfs_used_runs(struct ntfs_vol *vol, fs_run_fn fn, void *ctx);
+
 /* Get file size. Returns 0 if not found. */
 UINT64 ntfs_file_size(struct ntfs_vol *vol, const char *path);
 
@@ -45,4 +64,70 @@ int ntfs_exists(struct ntfs_vol *vol, const char *path);
 /* Get volume label (ASCII). Returns empty string if none. */
 const char *ntfs_get_label(struct ntfs_vol *vol);
 
+/* ---- Streaming file handles ---- */
+
+/* Opaque open-file handle. Close all handles before unmounting. */
+struct ntfs_file;
+
+/* Open a file for reading. Sets *out_size. Returns NULL on error. */
+struct ntfs_file *ntfs_open(struct ntfs_vol *vol, const char *path,
+                            UINT64 *out_size);
+
+/* Read up to *size bytes at the current position; *size is set to the
+   number read (0 at end of file). Returns 0 on success. */
+int ntfs_read(struct ntfs_file *f, void *buf, UINTN *size);
+
+/* Open a file by its MFT record, as found by a $MFT scan, even one
+   deleted: its data is read from the clusters the record still lists,
+   whatever they hold now. Returns NULL for a directory, a metafile or
+   data that cannot be read. */
+struct ntfs_file *ntfs_open_record(struct ntfs_vol *vol, UINT64 record,
+                                   UINT64 *out_size);
+
+/* Set the position (clamped to the file size). Returns 0 on success. */
+int ntfs_seek(struct ntfs_file *f, UINT64 pos);
+
+/* Close a handle and free its resources */
+void ntfs_close(struct ntfs_file *f);
+
+/* ---- $MFT scan ---- */
+
+/* Every file and directory on the volume, read from the $MFT in large
+   sequential chunks instead of through the directory indexes: the
+   fast way to see all names (a search). In record order, so a
+   directory may come after what it holds; a file with hard links is
+   reported once per name. Metafiles are left out. */
+struct ntfs_mft_scan;
+
+/* The root directory's record: the parent at the top of every path */
+#define NTFS_ROOT_RECORD 5
+
+struct ntfs_mft_name {
+    UINT64 record;              /* the file's MFT record */
+    UINT64 parent;              /* its directory's record */
+    UINT64 overwritten;         /* deleted: bytes of it now taken again */
+    struct fs_entry entry;
+};
+
+/* Returns NULL on error */
+struct ntfs_mft_scan *ntfs_mft_scan_open(struct ntfs_vol *vol);
+
+/* The same scan for deleted files whose data can still be read: records
+   no longer in use that keep a resident $DATA, or runs that all lie on
+   the volume (ntfs_open_record() reads them back), each under one of
+   its names. overwritten is measured against $Bitmap; the rest of the
+   file is as it was, unless another deleted file took the same
+   clusters. Returns NULL on error. */
+struct ntfs_mft_scan *ntfs_mft_scan_open_deleted(struct ntfs_vol *vol);
+
+/* Next name: 1 with *out filled, 0 at the end, -1 on error. Records
+   that cannot be read are skipped. */
+int ntfs_mft_scan_next(struct ntfs_mft_scan *s, struct ntfs_mft_name *out);
+
+/* Records looked at so far, and in all */
+void ntfs_mft_scan_progress(const struct ntfs_mft_scan *s, UINT64 *done,
+                            UINT64 *total);
+
+void ntfs_mft_scan_close(struct ntfs_mft_scan *s);
+
 #endif /* NTFS_H */
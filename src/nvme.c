@@ -0,0 +1,642 @@
+/*
+ * nvme.c — NVMe I/O queues of our own beside the firmware's NVMe driver
+ *
+ * Queue creation and the other admin commands go through the
+ * firmware's Pass Thru, which owns the admin queue. The I/O queues are
+ * ours: the submission and completion rings and the PRP list pages
+ * live in one common buffer from PCI IO, commands are written to the
+ * submission ring and its tail doorbell rung, and completions are
+ * recognised by their phase bit and released by the head doorbell.
+ * Queue IDs are taken from the top of what the controller allocated,
+ * skipping any the firmware already uses (creation fails on them).
+ *
+ * A caller's request is split into commands of at most max_xfer bytes
+ * and completes, its token signalled, when the last of them does. The
+ * submit and reap paths run at TPL_CALLBACK, the level of the timer
+ * that reaps completions nobody is waiting for.
+ */
+
+#include "nvme.h"
+#include "mem.h"
+#include "timer.h"
+
+#define NVME_PAGE 4096          /* memory page size (CC.MPS 0) */
+
+/* Controller registers (BAR 0) */
+#define REG_CAP 0x00
+#define REG_CC  0x14
+#define REG_DBL 0x1000
+
+#define OPC_FLUSH 0x00
+#define OPC_WRITE 0x01
+#define OPC_READ  0x02
+
+#define ADM_DELETE_SQ    0x00
+#define ADM_CREATE_SQ    0x01
+#define ADM_DELETE_CQ    0x04
+#define ADM_CREATE_CQ    0x05
+#define ADM_IDENTIFY     0x06
+#define ADM_GET_FEATURES 0x0a
+#define FEAT_NUM_QUEUES  0x07
+
+#define TIMER_PERIODIC 1
+typedef EFI_STATUS (*BS_SET_TIMER)(EFI_EVENT, UINT32, UINT64);
+typedef EFI_STATUS (*BS_SIGNAL_EVENT)(EFI_EVENT);
+typedef EFI_TPL (*BS_RAISE_TPL)(EFI_TPL);
+typedef VOID (*BS_RESTORE_TPL)(EFI_TPL);
+typedef EFI_STATUS (*BS_LOCATE_DEVICE_PATH)(EFI_GUID *, EFI_DEVICE_PATH **,
+                                            EFI_HANDLE *);
+
+struct nvme_sqe {
+    UINT32 cdw0, nsid, cdw2, cdw3;
+    UINT64 mptr, prp1, prp2;
+    UINT32 cdw10, cdw11, cdw12, cdw13, cdw14, cdw15;
+};
+
+struct nvme_cqe {
+    UINT32 dw0, dw1;
+    UINT16 sqhd, sqid;
+    UINT16 cid;
+    UINT16 status;              /* phase in bit 0 */
+};
+
+/* A caller's request: one or more commands */
+struct nvme_req {
+    EFI_BLOCK_IO2_TOKEN *token; /* NULL: the caller polls for it */
+    UINT32 pending;             /* commands not yet completed */
+    EFI_STATUS status;
+    int used;
+};
+
+struct nvme_cmd {
+    struct nvme_req *req;       /* NULL while the slot is free */
+    VOID *map;                  /* PCI IO mapping of the data */
+    UINT64 *prp;                /* this command's PRP list page */
+    UINT64 prp_dev;
+    UINT64 deadline;            /* timer ticks */
+};
+
+struct nvme_queue {
+    UINT16 qid;
+    UINT16 tail;                /* submission ring */
+    UINT16 head;                /* completion ring */
+    UINT8 phase;                /* of entries not yet seen */
+    volatile struct nvme_sqe *sq;
+    volatile struct nvme_cqe *cq;
+    int inflight;
+    struct nvme_cmd cmd[NVME_QUEUE_DEPTH];
+};
+
+struct nvme_ctrl {
+    EFI_NVM_EXPRESS_PASS_THRU_PROTOCOL *pt;
+    EFI_PCI_IO_PROTOCOL *pci;
+    UINT32 stride;              /* doorbell stride, bytes */
+    UINT32 depth;               /* ring entries */
+    UINT32 max_xfer;
+    int nq, next;               /* queues, the next to submit on */
+    int dead;                   /* a command timed out: firmware only */
+    EFI_EVENT tick;
+    UINT8 *mem;                 /* common buffer */
+    UINT64 mem_dev;             /* its device address */
+    struct nvme_queue q[NVME_QUEUES];
+    struct nvme_req req[NVME_QUEUES * NVME_QUEUE_DEPTH];
+};
+
+/* Per queue: the submission ring, the completion ring, a PRP list per
+   command */
+#define QUEUE_PAGES (2 + NVME_QUEUE_DEPTH)
+#define MEM_PAGES   (NVME_QUEUES * QUEUE_PAGES)
+
+struct nvme_ns {
+    EFI_BLOCK_IO bio;           /* first: This points here */
+    EFI_BLOCK_IO2_PROTOCOL bio2;
+    EFI_BLOCK_IO_MEDIA media;
+    struct nvme_ctrl *c;
+    UINT32 nsid;
+    EFI_BLOCK_IO *fw;           /* the firmware's */
+};
+
+#define NS_OF_BIO2(p) \
+    ((struct nvme_ns *)((UINT8 *)(p) - (UINTN)&((struct nvme_ns *)0)->bio2))
+
+static struct nvme_ctrl *s_ctrl[NVME_MAX_CTRLS];
+static int s_nctrl;
+static struct nvme_ns *s_ns[DISK_MAX_DEVICES];
+static int s_nns;
+
+static EFI_TPL raise_tpl(void) {
+    return ((BS_RAISE_TPL)g_boot.bs->RaiseTPL)(TPL_CALLBACK);
+}
+
+static void restore_tpl(EFI_TPL old) {
+    ((BS_RESTORE_TPL)g_boot.bs->RestoreTPL)(old);
+}
+
+static UINT32 bar_read32(struct nvme_ctrl *c, UINT64 off) {
+    UINT32 v = 0;
+    c->pci->Mem.Read(c->pci, EfiPciIoWidthUint32, 0, off, 1, &v);
+    return v;
+}
+
+static void bar_write32(struct nvme_ctrl *c, UINT64 off, UINT32 v) {
+    c->pci->Mem.Write(c->pci, EfiPciIoWidthUint32, 0, off, 1, &v);
+}
+
+/* One admin command through the firmware; 0 on success */
+static int admin(struct nvme_ctrl *c, UINT8 opc, UINT32 nsid, UINT32 cdw10,
+                 UINT32 cdw11, void *buf, UINT32 len, UINT32 *dw0) {
+    EFI_NVM_EXPRESS_COMMAND cmd;
+    EFI_NVM_EXPRESS_COMPLETION cpl;
+    EFI_NVM_EXPRESS_PASS_THRU_COMMAND_PACKET pkt;
+    mem_set(&cmd, 0, sizeof(cmd));
+    mem_set(&cpl, 0, sizeof(cpl));
+    mem_set(&pkt, 0, sizeof(pkt));
+    cmd.Cdw0 = opc;
+    cmd.Nsid = nsid;
+    cmd.Cdw10 = cdw10;
+    cmd.Cdw11 = cdw11;
+    cmd.Flags = CDW10_VALID | CDW11_VALID;
+    pkt.CommandTimeout = (UINT64)NVME_TIMEOUT_MS * 10000;
+    pkt.TransferBuffer = buf;
+    pkt.TransferLength = len;
+    pkt.QueueType = NVME_ADMIN_QUEUE;
+    pkt.NvmeCmd = &cmd;
+    pkt.NvmeCompletion = &cpl;
+    if (EFI_ERROR(c->pt->PassThru(c->pt, 0, &pkt, NULL)) ||
+        ((cpl.DW3 >> 17) & 0x7fff) != 0)
+        return -1;
+    if (dw0) *dw0 = cpl.DW0;
+    return 0;
+}
+
+static void complete(struct nvme_req *r) {
+    if (!r->token) return;      /* the caller collects it */
+    r->token->TransactionStatus = r->status;
+    ((BS_SIGNAL_EVENT)g_boot.bs->SignalEvent)(r->token->Event);
+    r->used = 0;
+}
+
+static void cmd_done(struct nvme_ctrl *c, struct nvme_queue *q,
+                     struct nvme_cmd *cmd, int ok) {
+    struct nvme_req *r = cmd->req;
+    if (cmd->map && !c->dead) c->pci->Unmap(c->pci, cmd->map);
+    cmd->map = NULL;
+    cmd->req = NULL;
+    q->inflight--;
+    if (!ok) r->status = EFI_DEVICE_ERROR;
+    if (--r->pending == 0) complete(r);
+}
+
+/* Reap every completion posted so far; fails what has outlived
+   NVME_TIMEOUT_MS and gives the controller up to the firmware */
+static void poll(struct nvme_ctrl *c) {
+    for (int i = 0; i < c->nq; i++) {
+        struct nvme_queue *q = &c->q[i];
+        int moved = 0;
+        while (q->inflight > 0) {
+            volatile struct nvme_cqe *e = &q->cq[q->head];
+            UINT16 st = e->status;
+            if ((st & 1) != q->phase) break;
+            UINT16 cid = e->cid;
+            if (cid < c->depth && q->cmd[cid].req)
+                cmd_done(c, q, &q->cmd[cid], (st >> 1) == 0);
+            if (++q->head == c->depth) {
+                q->head = 0;
+                q->phase ^= 1;
+            }
+            moved = 1;
+        }
+        if (moved)
+            bar_write32(c, REG_DBL + (2 * q->qid + 1) * c->stride, q->head);
+        else if (q->inflight > 0) {
+            UINT64 now = timer_ticks();
+            for (UINT32 k = 0; k < c->depth; k++)
+                if (q->cmd[k].req && now > q->cmd[k].deadline) {
+                    c->dead = 1;
+                    cmd_done(c, q, &q->cmd[k], 0);
+                }
+        }
+    }
+}
+
+static VOID EFIAPI nvme_tick(EFI_EVENT e, VOID *ctx) {
+    struct nvme_ctrl *c = (struct nvme_ctrl *)ctx;
+    (void)e;
+    poll(c);
+}
+
+/* Queue one command for r. Returns 0 when submitted, 1 if every
+   queue is full (poll and retry), -1 if the buffer can't be mapped. */
+static int submit(struct nvme_ctrl *c, UINT32 nsid, UINT8 opc, UINT64 lba,
+                  UINT32 blocks, void *buf, UINTN bytes, struct nvme_req *r) {
+    struct nvme_queue *q = NULL;
+    for (int i = 0; i < c->nq && !q; i++) {
+        struct nvme_queue *t = &c->q[(c->next + i) % c->nq];
+        if (t->inflight < (int)c->depth - 1) q = t;
+    }
+    if (!q) return 1;
+    c->next = (int)(q - c->q + 1) % c->nq;
+
+    UINT32 cid = 0;
+    while (q->cmd[cid].req) cid++;
+    struct nvme_cmd *cmd = &q->cmd[cid];
+
+    UINT64 prp1 = 0, prp2 = 0;
+    if (bytes) {
+        int rd = opc == OPC_READ;
+        UINTN n = bytes;
+        EFI_PHYSICAL_ADDRESS dev;
+        VOID *map = NULL;
+        if (EFI_ERROR(c->pci->Map(c->pci, rd ? EfiPciIoOperationBusMasterWrite64
+                                             : EfiPciIoOperationBusMasterRead64,
+                                  buf, &n, &dev, &map))) {
+            n = bytes;
+            if (EFI_ERROR(c->pci->Map(c->pci, rd ? EfiPciIoOperationBusMasterWrite
+                                                 : EfiPciIoOperationBusMasterRead,
+                                      buf, &n, &dev, &map)))
+                return -1;
+        }
+        if (n < bytes) {
+            c->pci->Unmap(c->pci, map);
+            return -1;
+        }
+        cmd->map = map;
+
+        /* The first page from the buffer's offset, then whole pages:
+           the second in PRP2, or all of them in the command's list */
+        UINT64 first = NVME_PAGE - (dev & (NVME_PAGE - 1));
+        prp1 = dev;
+        if (bytes > first + NVME_PAGE) {
+            UINT64 a = dev + first;
+            int k = 0;
+            for (UINT64 left = bytes - first; left > 0;
+                 left -= left < NVME_PAGE ? left : NVME_PAGE) {
+                cmd->prp[k++] = a;
+                a += NVME_PAGE;
+            }
+            prp2 = cmd->prp_dev;
+        } else if (bytes > first) {
+            prp2 = dev + first;
+        }
+    }
+
+    volatile struct nvme_sqe *e = &q->sq[q->tail];
+    mem_set((void *)e, 0, sizeof(*e));
+    e->cdw0 = opc | (cid << 16);
+    e->nsid = nsid;
+    e->prp1 = prp1;
+    e->prp2 = prp2;
+    if (blocks) {
+        e->cdw10 = (UINT32)lba;
+        e->cdw11 = (UINT32)(lba >> 32);
+        e->cdw12 = blocks - 1;
+    }
+    cmd->req = r;
+    cmd->deadline = timer_ticks() + timer_hz() / 1000 * NVME_TIMEOUT_MS;
+    r->pending++;
+    q->inflight++;
+    if (++q->tail == c->depth) q->tail = 0;
+    bar_write32(c, REG_DBL + 2 * q->qid * c->stride, q->tail);
+    return 0;
+}
+
+static struct nvme_req *req_get(struct nvme_ctrl *c) {
+    for (;;) {
+        for (int i = 0; i < NVME_QUEUES * NVME_QUEUE_DEPTH; i++)
+            if (!c->req[i].used) {
+                struct nvme_req *r = &c->req[i];
+                mem_set(r, 0, sizeof(*r));
+                r->used = 1;
+                return r;
+            }
+        poll(c);
+    }
+}
+
+static EFI_STATUS fw_rw(struct nvme_ns *ns, int write, EFI_LBA lba,
+                        UINTN size, VOID *buf, EFI_BLOCK_IO2_TOKEN *token) {
+    EFI_BLOCK_IO *fw = ns->fw;
+    EFI_STATUS s = write ? fw->WriteBlocks(fw, fw->Media->MediaId, lba, size, buf)
+                         : fw->ReadBlocks(fw, fw->Media->MediaId, lba, size, buf);
+    if (token && token->Event) {
+        token->TransactionStatus = s;
+        ((BS_SIGNAL_EVENT)g_boot.bs->SignalEvent)(token->Event);
+        return EFI_SUCCESS;
+    }
+    return s;
+}
+
+/* Reads, writes (opc) and flushes (size 0) for both protocols; a token
+   with an event makes it asynchronous */
+static EFI_STATUS ns_io(struct nvme_ns *ns, UINT32 media_id, UINT8 opc,
+                        EFI_LBA lba, UINTN size, VOID *buf,
+                        EFI_BLOCK_IO2_TOKEN *token) {
+    struct nvme_ctrl *c = ns->c;
+    UINT32 bs = ns->media.BlockSize;
+    if (opc != OPC_FLUSH) {
+        if (media_id != ns->media.MediaId) return EFI_MEDIA_CHANGED;
+        if (opc == OPC_WRITE && ns->media.ReadOnly) return EFI_WRITE_PROTECTED;
+        if (size % bs) return EFI_BAD_BUFFER_SIZE;
+        if (!buf && size) return EFI_INVALID_PARAMETER;
+        if (lba > ns->media.LastBlock ||
+            size / bs > ns->media.LastBlock - lba + 1)
+            return EFI_INVALID_PARAMETER;
+        if ((UINTN)buf & (ns->media.IoAlign - 1)) return EFI_INVALID_PARAMETER;
+    }
+    if (token && !token->Event) token = NULL;
+    if (c->dead) {
+        if (opc != OPC_FLUSH)
+            return fw_rw(ns, opc == OPC_WRITE, lba, size, buf, token);
+        EFI_STATUS s = ns->fw->FlushBlocks(ns->fw);
+        if (!token) return s;
+        token->TransactionStatus = s;
+        ((BS_SIGNAL_EVENT)g_boot.bs->SignalEvent)(token->Event);
+        return EFI_SUCCESS;
+    }
+
+    EFI_TPL old = raise_tpl();
+    struct nvme_req *r = req_get(c);
+    r->token = token;
+    r->status = EFI_SUCCESS;
+    r->pending = 1;             /* held until every command is in */
+
+    UINT8 *p = (UINT8 *)buf;
+    UINTN left = size;
+    int mapped = 1;
+    do {
+        UINTN n = left < c->max_xfer ? left : c->max_xfer;
+        int rc;
+        while ((rc = submit(c, ns->nsid, opc, lba, (UINT32)(n / bs), p, n, r)) == 1)
+            poll(c);
+        if (rc != 0) {
+            mapped = 0;
+            r->status = EFI_DEVICE_ERROR;
+            break;
+        }
+        lba += n / bs;
+        p += n;
+        left -= n;
+    } while (left > 0);
+
+    /* Nothing could be mapped for DMA: the firmware does it instead */
+    if (!mapped && r->pending == 1 && left == size) {
+        r->used = 0;
+        restore_tpl(old);
+        return fw_rw(ns, opc == OPC_WRITE, lba, size, buf, token);
+    }
+
+    if (--r->pending == 0) complete(r);
+    EFI_STATUS s = EFI_SUCCESS;
+    if (!token) {
+        while (r->pending > 0) poll(c);
+        s = r->status;
+        r->used = 0;
+    }
+    restore_tpl(old);
+    return s;
+}
+
+static EFI_STATUS EFIAPI ns_read(EFI_BLOCK_IO *This, UINT32 media_id,
+                                 EFI_LBA lba, UINTN size, VOID *buf) {
+    return ns_io((struct nvme_ns *)This, media_id, OPC_READ, lba, size, buf, NULL);
+}
+
+static EFI_STATUS EFIAPI ns_write(EFI_BLOCK_IO *This, UINT32 media_id,
+                                  EFI_LBA lba, UINTN size, VOID *buf) {
+    return ns_io((struct nvme_ns *)This, media_id, OPC_WRITE, lba, size, buf, NULL);
+}
+
+static EFI_STATUS EFIAPI ns_flush(EFI_BLOCK_IO *This) {
+    return ns_io((struct nvme_ns *)This, 0, OPC_FLUSH, 0, 0, NULL, NULL);
+}
+
+static EFI_STATUS EFIAPI ns_reset(EFI_BLOCK_IO *This, BOOLEAN extended) {
+    (void)This; (void)extended;
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI ns_read_ex(EFI_BLOCK_IO2_PROTOCOL *This,
+                                    UINT32 media_id, EFI_LBA lba,
+                                    EFI_BLOCK_IO2_TOKEN *token, UINTN size,
+                                    VOID *buf) {
+    return ns_io(NS_OF_BIO2(This), media_id, OPC_READ, lba, size, buf, token);
+}
+
+static EFI_STATUS EFIAPI ns_write_ex(EFI_BLOCK_IO2_PROTOCOL *This,
+                                     UINT32 media_id, EFI_LBA lba,
+                                     EFI_BLOCK_IO2_TOKEN *token, UINTN size,
+                                     VOID *buf) {
+    return ns_io(NS_OF_BIO2(This), media_id, OPC_WRITE, lba, size, buf, token);
+}
+
+static EFI_STATUS EFIAPI ns_flush_ex(EFI_BLOCK_IO2_PROTOCOL *This,
+                                     EFI_BLOCK_IO2_TOKEN *token) {
+    return ns_io(NS_OF_BIO2(This), 0, OPC_FLUSH, 0, 0, NULL, token);
+}
+
+static EFI_STATUS EFIAPI ns_reset_ex(EFI_BLOCK_IO2_PROTOCOL *This,
+                                     BOOLEAN extended) {
+    (void)This; (void)extended;
+    return EFI_SUCCESS;
+}
+
+/* Create up to NVME_QUEUES queue pairs and the timer; 0 if any exist */
+static int ctrl_start(struct nvme_ctrl *c) {
+    UINT32 cap_lo = bar_read32(c, REG_CAP), cap_hi = bar_read32(c, REG_CAP + 4);
+    UINT32 cc = bar_read32(c, REG_CC);
+    if (((cc >> 7) & 0xf) != 0) return -1;     /* pages other than 4 KB */
+    c->stride = 4u << (cap_hi & 0xf);
+    c->depth = (cap_lo & 0xffff) + 1;
+    if (c->depth > NVME_QUEUE_DEPTH) c->depth = NVME_QUEUE_DEPTH;
+    if (c->depth < 2) return -1;
+
+    /* MDTS, in units of the minimum page size */
+    UINT8 *id = (UINT8 *)mem_alloc_pages(NVME_PAGE);
+    if (!id) return -1;
+    c->max_xfer = NVME_MAX_XFER;
+    if (admin(c, ADM_IDENTIFY, 0, 1, 0, id, NVME_PAGE, NULL) == 0 && id[77]) {
+        UINT64 mdts = (UINT64)(4096u << ((cap_hi >> 16) & 0xf)) << id[77];
+        if (mdts < c->max_xfer) c->max_xfer = (UINT32)mdts;
+    }
+    mem_free_pages(id, NVME_PAGE);
+
+    UINT32 dw0 = 0;
+    UINT32 maxq = 1;
+    if (admin(c, ADM_GET_FEATURES, 0, FEAT_NUM_QUEUES, 0, NULL, 0, &dw0) == 0) {
+        UINT32 nsq = (dw0 & 0xffff) + 1, ncq = (dw0 >> 16) + 1;
+        maxq = nsq < ncq ? nsq : ncq;
+    }
+    if (maxq > 64) maxq = 64;
+
+    VOID *host = NULL, *map = NULL;
+    UINTN bytes = MEM_PAGES * NVME_PAGE;
+    EFI_PHYSICAL_ADDRESS dev;
+    if (EFI_ERROR(c->pci->AllocateBuffer(c->pci, AllocateAnyPages,
+                                         EfiBootServicesData, MEM_PAGES,
+                                         &host, 0)))
+        return -1;
+    if (EFI_ERROR(c->pci->Map(c->pci, EfiPciIoOperationBusMasterCommonBuffer64,
+                              host, &bytes, &dev, &map)) ||
+        bytes < MEM_PAGES * NVME_PAGE) {
+        bytes = MEM_PAGES * NVME_PAGE;
+        if (map) c->pci->Unmap(c->pci, map);
+        map = NULL;
+        if (EFI_ERROR(c->pci->Map(c->pci, EfiPciIoOperationBusMasterCommonBuffer,
+                                  host, &bytes, &dev, &map)) ||
+            bytes < MEM_PAGES * NVME_PAGE) {
+            c->pci->FreeBuffer(c->pci, MEM_PAGES, host);
+            return -1;
+        }
+    }
+    c->mem = (UINT8 *)host;
+    c->mem_dev = dev;
+    mem_set(c->mem, 0, MEM_PAGES * NVME_PAGE);
+
+    for (UINT32 qid = maxq; qid >= 1 && c->nq < NVME_QUEUES; qid--) {
+        struct nvme_queue *q = &c->q[c->nq];
+        UINTN off = (UINTN)c->nq * QUEUE_PAGES * NVME_PAGE;
+        UINT64 sq_dev = c->mem_dev + off, cq_dev = sq_dev + NVME_PAGE;
+        UINT32 size = (c->depth - 1) << 16;
+        /* Pass Thru takes the rings' device addresses as transfer buffers */
+        if (admin(c, ADM_CREATE_CQ, 0, size | qid, 1, (void *)(UINTN)cq_dev,
+                  NVME_PAGE, NULL) != 0)
+            continue;
+        if (admin(c, ADM_CREATE_SQ, 0, size | qid, (qid << 16) | 1,
+                  (void *)(UINTN)sq_dev, NVME_PAGE, NULL) != 0) {
+            admin(c, ADM_DELETE_CQ, 0, qid, 0, NULL, 0, NULL);
+            continue;
+        }
+        q->qid = (UINT16)qid;
+        q->sq = (volatile struct nvme_sqe *)(c->mem + off);
+        q->cq = (volatile struct nvme_cqe *)(c->mem + off + NVME_PAGE);
+        q->phase = 1;
+        for (UINT32 k = 0; k < c->depth; k++) {
+            q->cmd[k].prp = (UINT64 *)(c->mem + off + (2 + k) * NVME_PAGE);
+            q->cmd[k].prp_dev = sq_dev + (2 + k) * NVME_PAGE;
+        }
+        c->nq++;
+    }
+    if (c->nq == 0) return -1;
+
+    if (!EFI_ERROR(g_boot.bs->CreateEvent(EVT_TIMER | EVT_NOTIFY_SIGNAL,
+                                          TPL_CALLBACK, nvme_tick, c,
+                                          &c->tick)))
+        ((BS_SET_TIMER)g_boot.bs->SetTimer)(c->tick, TIMER_PERIODIC,
+                                            (UINT64)NVME_TICK_MS * 10000);
+    return 0;
+}
+
+static struct nvme_ctrl *ctrl_for(EFI_HANDLE h) {
+    EFI_GUID pt_guid = EFI_NVM_EXPRESS_PASS_THRU_PROTOCOL_GUID;
+    EFI_GUID pci_guid = EFI_PCI_IO_PROTOCOL_GUID;
+    EFI_NVM_EXPRESS_PASS_THRU_PROTOCOL *pt = NULL;
+    EFI_PCI_IO_PROTOCOL *pci = NULL;
+    if (EFI_ERROR(g_boot.bs->HandleProtocol(h, &pt_guid, (VOID **)&pt)) ||
+        EFI_ERROR(g_boot.bs->HandleProtocol(h, &pci_guid, (VOID **)&pci)) ||
+        !pt || !pci)
+        return NULL;
+    for (int i = 0; i < s_nctrl; i++)
+        if (s_ctrl[i]->pt == pt) return s_ctrl[i]->nq ? s_ctrl[i] : NULL;
+    if (s_nctrl == NVME_MAX_CTRLS) return NULL;
+
+    struct nvme_ctrl *c = (struct nvme_ctrl *)mem_alloc(sizeof(*c));
+    if (!c) return NULL;
+    c->pt = pt;
+    c->pci = pci;
+    s_ctrl[s_nctrl++] = c;      /* kept even if it fails: tried once */
+    return ctrl_start(c) == 0 ? c : NULL;
+}
+
+/* Our read of 64 KB at lba matches the firmware's */
+static int check_read(struct nvme_ns *ns, UINT64 lba, UINT8 *buf) {
+    UINTN n = 65536;
+    if (EFI_ERROR(ns->fw->ReadBlocks(ns->fw, ns->fw->Media->MediaId, lba, n,
+                                     buf + n)))
+        return -1;
+    mem_set(buf, 0xa5, n);
+    if (EFI_ERROR(ns_read(&ns->bio, ns->media.MediaId, lba, n, buf)))
+        return -1;
+    return mem_cmp(buf, buf + n, n) == 0 ? 0 : -1;
+}
+
+int nvme_attach(struct disk_device *dev) {
+    EFI_GUID dp_guid = { 0x9576e91, 0x6d3f, 0x11d2,
+        {0x8e, 0x39, 0x0, 0xa0, 0xc9, 0x69, 0x72, 0x3b} };
+    EFI_GUID pt_guid = EFI_NVM_EXPRESS_PASS_THRU_PROTOCOL_GUID;
+    EFI_DEVICE_PATH *dp = NULL, *last = NULL;
+
+    if (!dev || !dev->block_io || nvme_owns(dev->block_io)) return -1;
+    if (s_nns == DISK_MAX_DEVICES) return -1;
+
+    /* A namespace node (messaging, subtype 0x17) ends the path */
+    if (EFI_ERROR(g_boot.bs->HandleProtocol(dev->handle, &dp_guid,
+                                            (VOID **)&dp)) || !dp)
+        return -1;
+    EFI_DEVICE_PATH *walk = dp;
+    while (walk->Type != 0x7f) {
+        UINTN len = walk->Length[0] | ((UINTN)walk->Length[1] << 8);
+        if (len < 4) return -1;
+        last = walk;
+        walk = (EFI_DEVICE_PATH *)((UINT8 *)walk + len);
+    }
+    if (!last || last->Type != 3 || last->SubType != 0x17) return -1;
+    UINT32 nsid;
+    mem_copy(&nsid, (UINT8 *)last + 4, sizeof(nsid));
+
+    EFI_HANDLE ctrl_handle = NULL;
+    EFI_DEVICE_PATH *rest = dp;
+    if (EFI_ERROR(((BS_LOCATE_DEVICE_PATH)g_boot.bs->LocateDevicePath)(
+            &pt_guid, &rest, &ctrl_handle)))
+        return -1;
+    struct nvme_ctrl *c = ctrl_for(ctrl_handle);
+    if (!c) return -1;
+
+    struct nvme_ns *ns = (struct nvme_ns *)mem_alloc(sizeof(*ns));
+    if (!ns) return -1;
+    EFI_BLOCK_IO *fw = dev->block_io;
+    ns->c = c;
+    ns->nsid = nsid;
+    ns->fw = fw;
+    UINT64 rev = fw->Revision;
+    if (rev >= EFI_BLOCK_IO_PROTOCOL_REVISION2)
+        ns->media = *fw->Media;
+    else
+        mem_copy(&ns->media, fw->Media,
+                 (UINTN)&((EFI_BLOCK_IO_MEDIA *)0)->LowestAlignedLba);
+    if (ns->media.IoAlign < 4) ns->media.IoAlign = 4;
+    ns->bio.Revision = rev;
+    ns->bio.Media = &ns->media;
+    ns->bio.Reset = ns_reset;
+    ns->bio.ReadBlocks = ns_read;
+    ns->bio.WriteBlocks = ns_write;
+    ns->bio.FlushBlocks = ns_flush;
+    ns->bio2.Media = &ns->media;
+    ns->bio2.Reset = ns_reset_ex;
+    ns->bio2.ReadBlocksEx = ns_read_ex;
+    ns->bio2.WriteBlocksEx = ns_write_ex;
+    ns->bio2.FlushBlocksEx = ns_flush_ex;
+
+    UINT8 *buf = (UINT8 *)mem_alloc_pages(2 * 65536);
+    int ok = buf && ns->media.BlockSize <= 65536 &&
+             ns->media.LastBlock >= 2 * 65536 / ns->media.BlockSize &&
+             check_read(ns, 0, buf) == 0 &&
+             check_read(ns, (ns->media.LastBlock + 1) / 2, buf) == 0;
+    if (buf) mem_free_pages(buf, 2 * 65536);
+    if (!ok) {
+        mem_free(ns);
+        return -1;
+    }
+
+    s_ns[s_nns++] = ns;
+    mem_io_align(ns->media.IoAlign);
+    dev->block_io = &ns->bio;
+    dev->block_io2 = &ns->bio2;
+    dev->xfer_size = 0;
+    return 0;
+}
+
+int nvme_owns(EFI_BLOCK_IO *bio) {
+    for (int i = 0; i < s_nns; i++)
+        if (bio == &s_ns[i]->bio) return 1;
+    return 0;
+}
@@ -0,0 +1,37 @@
+/*
+ * nvme.h — NVMe I/O queues of our own beside the firmware's NVMe driver
+ *
+ * Firmware NVMe BlockIO typically runs one command at a time on one
+ * I/O queue. This driver leaves the controller and its admin queue to
+ * the firmware, asks it (NVM Express Pass Thru) to create up to
+ * NVME_QUEUES more I/O queue pairs of NVME_QUEUE_DEPTH entries each,
+ * and then drives those itself through the controller's BAR (PCI IO):
+ * commands of up to NVME_MAX_XFER with PRP lists in per-command pages,
+ * completions reaped by polling, from a periodic timer for requests in
+ * flight and directly when a caller waits. A namespace is presented as
+ * BlockIO and BlockIO2, so disk_queue_open() gets deep queues on it.
+ *
+ * Built with NVME=1 (NVME_NATIVE defined), disk_enumerate() hands each
+ * disk to nvme_attach(). Requests the driver cannot map for DMA, and
+ * everything after a command times out, go to the firmware's BlockIO.
+ */
+#ifndef NVME_H
+#define NVME_H
+
+#include "disk.h"
+
+#define NVME_QUEUES       4       /* I/O queue pairs per controller */
+#define NVME_QUEUE_DEPTH  64      /* entries per queue (one kept empty) */
+#define NVME_MAX_XFER     (1024 * 1024)
+#define NVME_TIMEOUT_MS   10000
+#define NVME_TICK_MS      1       /* completion polling while idle */
+#define NVME_MAX_CTRLS    4
+
+/* If dev is an NVMe namespace, point dev->block_io and block_io2 at
+   this driver's for it and return 0; -1 leaves dev alone */
+int nvme_attach(struct disk_device *dev);
+
+/* Whether bio is one of this driver's */
+int nvme_owns(EFI_BLOCK_IO *bio);
+
+#endif /* NVME_H */
@@ -0,0 +1,520 @@
+/*
+ * parapi.c — Parallel runtime for user programs
+ *
+ * A layer over mp.c that starts the pool when a program first asks
+ * for it. par_for() hands out pieces of its range through one atomic
+ * counter, so cores that finish early take more and the boot processor
+ * works through its share instead of waiting. par_run() starts its
+ * functions only on idle workers, so they really run side by side and
+ * a barrier among them cannot wait on one still queued.
+ *
+ * The guard_* functions stand in for the API calls that reach the
+ * firmware or shared state: on a worker they count the call and return
+ * failure, from a program on its own core (aprun.h) they hand it to the
+ * boot processor, elsewhere they pass it on.
+ */
+
+#include "boot.h"
+#include "mem.h"
+#include "fb.h"
+#include "kbd.h"
+#include "fs.h"
+#include "blkapi.h"
+#include "mp.h"
+#include "aprun.h"
+#include "parapi.h"
+
+#define PAR_PIECES 4            /* par_for() pieces per core, chunk 0 */
+
+struct par_slot {
+    struct mp_job job;
+    par_job_fn fn;
+    void *ctx;
+    int busy;
+};
+
+static struct par_slot s_slots[PAR_JOBS];
+static int s_started;           /* mp_start() done this run */
+static int s_cores = 1;
+static volatile UINT32 s_refused;
+static const char *volatile s_refused_name;
+
+/* Bring the pool up on first use */
+static int par_up(void) {
+    /* Only the boot processor can start the workers */
+    if (!s_started && !aprun_on_ap()) {
+        s_started = 1;
+        s_cores = mp_start() + 1;
+    }
+    return s_cores;
+}
+
+int par_cores(void) {
+    return mp_on_worker() ? 1 : par_up();
+}
+
+/* ---- Parallel for ---- */
+
+struct par_range {
+    volatile UINT64 next;       /* offset from begin of the next piece */
+    UINT64 total;
+    UINT64 chunk;
+    INT64 begin;
+    par_range_fn fn;
+    void *ctx;
+};
+
+static void range_job(void *arg, void *arena) {
+    (void)arena;
+    struct par_range *r = (struct par_range *)arg;
+    for (;;) {
+        UINT64 lo = mp_add64(&r->next, r->chunk);
+        if (lo >= r->total) break;
+        UINT64 hi = r->total - lo < r->chunk ? r->total : lo + r->chunk;
+        r->fn(r->begin + (INT64)lo, r->begin + (INT64)hi, r->ctx);
+    }
+}
+
+void par_for(INT64 begin, INT64 end, INT64 chunk, par_range_fn fn, void *ctx) {
+    if (end <= begin) return;
+    if (mp_on_worker() || par_up() == 1) {
+        fn(begin, end, ctx);
+        return;
+    }
+    struct par_range r;
+    r.next = 0;
+    r.total = (UINT64)(end - begin);
+    r.chunk = chunk > 0 ? (UINT64)chunk
+                        : (r.total + s_cores * PAR_PIECES - 1) / (s_cores * PAR_PIECES);
+    r.begin = begin;
+    r.fn = fn;
+    r.ctx = ctx;
+
+    struct mp_job jobs[MP_MAX_WORKERS];
+    int n = s_cores - 1;
+    for (int i = 0; i < n; i++)
+        mp_submit(&jobs[i], range_job, &r);
+    range_job(&r, NULL);
+    for (int i = 0; i < n; i++)
+        mp_wait(&jobs[i]);
+}
+
+/* ---- Jobs ---- */
+
+static void slot_job(void *arg, void *arena) {
+    (void)arena;
+    struct par_slot *s = (struct par_slot *)arg;
+    s->fn(s->ctx);
+}
+
+int par_submit(par_job_fn fn, void *ctx) {
+    if (mp_on_worker()) {
+        s_refused_name = "par_submit";
+        mp_add32(&s_refused, 1);
+        return -1;
+    }
+    par_up();
+    for (int i = 0; i < PAR_JOBS; i++) {
+        struct par_slot *s = &s_slots[i];
+        if (s->busy) continue;
+        s->busy = 1;
+        s->fn = fn;
+        s->ctx = ctx;
+        mp_submit(&s->job, slot_job, s);
+        return i;
+    }
+    return -1;
+}
+
+int par_wait(int job) {
+    if (mp_on_worker() || job < 0 || job >= PAR_JOBS || !s_slots[job].busy)
+        return -1;
+    mp_wait(&s_slots[job].job);
+    s_slots[job].busy = 0;
+    return 0;
+}
+
+/* ---- Groups and barriers ---- */
+
+struct par_group {
+    par_group_fn fn;
+    void *ctx;
+    int n;
+};
+
+struct par_member {
+    struct mp_job job;
+    struct par_group *g;
+    int i;
+};
+
+static void member_job(void *arg, void *arena) {
+    (void)arena;
+    struct par_member *m = (struct par_member *)arg;
+    m->g->fn(m->i, m->g->n, m->g->ctx);
+}
+
+int par_run(int n, par_group_fn fn, void *ctx) {
+    if (n < 1) return 0;
+    if (mp_on_worker()) {
+        fn(0, 1, ctx);
+        return 1;
+    }
+    if (n > par_up()) n = s_cores;
+
+    /* Everything submitted done and every slot empty: each member then
+       goes straight to a worker of its own */
+    for (int i = 0; i < PAR_JOBS; i++)
+        if (s_slots[i].busy) mp_wait(&s_slots[i].job);
+    mp_idle();
+
+    struct par_group g;
+    g.fn = fn;
+    g.ctx = ctx;
+    g.n = n;
+    struct par_member m[MP_MAX_WORKERS];
+    for (int i = 1; i < n; i++) {
+        m[i - 1].g = &g;
+        m[i - 1].i = i;
+        mp_submit(&m[i - 1].job, member_job, &m[i - 1]);
+    }
+    fn(0, n, ctx);
+    for (int i = 1; i < n; i++)
+        mp_wait(&m[i - 1].job);
+    return n;
+}
+
+void par_barrier_init(struct par_barrier *b, UINT32 n) {
+    b->count = 0;
+    b->gen = 0;
+    b->n = n;
+    b->pad = 0;
+    mp_fence();
+}
+
+void par_barrier_wait(struct par_barrier *b) {
+    UINT32 gen = b->gen;
+    mp_fence();
+    if (mp_add32(&b->count, 1) + 1 == b->n) {
+        b->count = 0;
+        mp_add32(&b->gen, 1);
+        return;
+    }
+    while (b->gen == gen)
+        mp_relax();
+    mp_fence();
+}
+
+/* ---- End of a run ---- */
+
+void par_release(void) {
+    for (int i = 0; i < PAR_JOBS; i++) {
+        if (!s_slots[i].busy) continue;
+        mp_wait(&s_slots[i].job);
+        s_slots[i].busy = 0;
+    }
+    if (s_started) {
+        mp_stop();
+        s_started = 0;
+        s_cores = 1;
+    }
+    if (s_refused) {
+        printf("%u call%s from parallel jobs refused (%s): jobs cannot use "
+               "output, memory allocation, the screen, keys, files or disks\n",
+               s_refused, s_refused == 1 ? "" : "s", s_refused_name);
+        s_refused = 0;
+        s_refused_name = NULL;
+    }
+}
+
+/* ---- Calls refused on a worker ---- */
+
+static int refused(const char *name) {
+    if (!mp_on_worker()) return 0;
+    s_refused_name = name;
+    mp_add32(&s_refused, 1);
+    return 1;
+}
+
+/* __func__ minus the "guard_" */
+#define REFUSED() refused(__func__ + 6)
+
+/* From a program on its own core (aprun.h) the call is made on the
+   boot processor instead */
+#define ON_BSP(type, fn, n, ...) do {                                    \
+        if (aprun_on_ap())                                               \
+            return (type)aprun_call((const void *)(UINTN)(fn), n,        \
+                                    __VA_ARGS__);                        \
+    } while (0)
+#define ON_BSP_VOID(fn, n, ...) do {                                     \
+        if (aprun_on_ap()) {                                             \
+            aprun_call((const void *)(UINTN)(fn), n, __VA_ARGS__);       \
+            return;                                                      \
+        }                                                                \
+    } while (0)
+
+void guard_fb_pixel(UINT32 x, UINT32 y, UINT32 color) {
+    ON_BSP_VOID(fb_pixel, 3, x, y, color);
+    if (!REFUSED()) fb_pixel(x, y, color);
+}
+
+void guard_fb_rect(UINT32 x, UINT32 y, UINT32 w, UINT32 h, UINT32 color) {
+    ON_BSP_VOID(fb_rect, 5, x, y, w, h, color);
+    if (!REFUSED()) fb_rect(x, y, w, h, color);
+}
+
+void guard_fb_clear(UINT32 color) {
+    ON_BSP_VOID(fb_clear, 1, color);
+    if (!REFUSED()) fb_clear(color);
+}
+
+void guard_fb_char(UINT32 cx, UINT32 cy, char c, UINT32 fg, UINT32 bg) {
+    ON_BSP_VOID(fb_char, 5, cx, cy, c, fg, bg);
+    if (!REFUSED()) fb_char(cx, cy, c, fg, bg);
+}
+
+void guard_fb_string(UINT32 cx, UINT32 cy, const char *s, UINT32 fg, UINT32 bg) {
+    ON_BSP_VOID(fb_string, 5, cx, cy, s, fg, bg);
+    if (!REFUSED()) fb_string(cx, cy, s, fg, bg);
+}
+
+void guard_fb_scroll(void) {
+    ON_BSP_VOID(fb_scroll, 0, 0);
+    if (!REFUSED()) fb_scroll();
+}
+
+void guard_fb_print(const char *s, UINT32 fg) {
+    if (aprun_on_ap())
+        aprun_print(s, strlen(s), fg);
+    else if (!REFUSED())
+        fb_print(s, fg);
+}
+
+void guard_fb_present(void) {
+    ON_BSP_VOID(fb_present, 0, 0);
+    if (!REFUSED()) fb_present();
+}
+
+struct fb_surface *guard_fb_surface_create(UINT32 w, UINT32 h) {
+    ON_BSP(struct fb_surface *, fb_surface_create, 2, w, h);
+    return REFUSED() ? NULL : fb_surface_create(w, h);
+}
+
+void guard_fb_surface_free(struct fb_surface *s) {
+    ON_BSP_VOID(fb_surface_free, 1, s);
+    if (!REFUSED()) fb_surface_free(s);
+}
+
+struct fb_surface *guard_fb_surface_screen(void) {
+    ON_BSP(struct fb_surface *, fb_surface_screen, 0, 0);
+    return REFUSED() ? NULL : fb_surface_screen();
+}
+
+void guard_fb_surface_present(struct fb_surface *s, UINT32 x, UINT32 y) {
+    ON_BSP_VOID(fb_surface_present, 3, s, x, y);
+    if (!REFUSED()) fb_surface_present(s, x, y);
+}
+
+void guard_fb_surface_present_rect(struct fb_surface *s, UINT32 sx, UINT32 sy,
+                                   UINT32 w, UINT32 h, UINT32 x, UINT32 y) {
+    ON_BSP_VOID(fb_surface_present_rect, 7, s, sx, sy, w, h, x, y);
+    if (!REFUSED()) fb_surface_present_rect(s, sx, sy, w, h, x, y);
+}
+
+void guard_fb_surface_text(struct fb_surface *s, UINT32 x, UINT32 y,
+                           const char *str, UINT32 fg, UINT32 bg) {
+    ON_BSP_VOID(fb_surface_text, 6, s, x, y, str, fg, bg);
+    if (!REFUSED()) fb_surface_text(s, x, y, str, fg, bg);
+}
+
+UINT32 guard_fb_frame_wait(UINT32 fps) {
+    ON_BSP(UINT32, fb_frame_wait, 1, fps);
+    return REFUSED() ? 0 : fb_frame_wait(fps);
+}
+
+int guard_kbd_poll(struct key_event *ev) {
+    ON_BSP(int, aprun_key_poll, 1, ev);
+    return REFUSED() ? 0 : kbd_poll(ev);
+}
+
+void guard_kbd_wait(struct key_event *ev) {
+    ON_BSP_VOID(aprun_key_wait, 1, ev);
+    if (REFUSED())
+        mem_set(ev, 0, sizeof(*ev));
+    else
+        kbd_wait(ev);
+}
+
+void *guard_mem_alloc(UINTN size) {
+    ON_BSP(void *, mem_alloc, 1, size);
+    return REFUSED() ? NULL : mem_alloc(size);
+}
+
+void guard_mem_free(void *ptr) {
+    ON_BSP_VOID(mem_free, 1, ptr);
+    if (!REFUSED()) mem_free(ptr);
+}
+
+void *guard_fs_readfile(const CHAR16 *path, UINTN *out_size) {
+    ON_BSP(void *, fs_readfile, 2, path, out_size);
+    return REFUSED() ? NULL : fs_readfile(path, out_size);
+}
+
+EFI_STATUS guard_fs_writefile(const CHAR16 *path, const void *data, UINTN size) {
+    ON_BSP(EFI_STATUS, fs_writefile, 3, path, data, size);
+    return REFUSED() ? EFI_ACCESS_DENIED : fs_writefile(path, data, size);
+}
+
+int guard_fs_readdir(const CHAR16 *path, struct fs_entry *entries, int max_entries) {
+    ON_BSP(int, fs_readdir, 3, path, entries, max_entries);
+    return REFUSED() ? -1 : fs_readdir(path, entries, max_entries);
+}
+
+int guard_blk_count(void) {
+    ON_BSP(int, blk_count, 0, 0);
+    return REFUSED() ? 0 : blk_count();
+}
+
+int guard_blk_info(int disk, struct blk_info *out) {
+    ON_BSP(int, blk_info, 2, disk, out);
+    return REFUSED() ? -1 : blk_info(disk, out);
+}
+
+int guard_blk_read(int disk, UINT64 lba, UINT64 count, void *buf) {
+    ON_BSP(int, blk_read, 4, disk, lba, count, buf);
+    return REFUSED() ? -1 : blk_read(disk, lba, count, buf);
+}
+
+int guard_blk_write(int disk, UINT64 lba, UINT64 count, const void *buf) {
+    ON_BSP(int, blk_write, 4, disk, lba, count, buf);
+    return REFUSED() ? -1 : blk_write(disk, lba, count, buf);
+}
+
+int guard_blk_flush(int disk) {
+    ON_BSP(int, blk_flush, 1, disk);
+    return REFUSED() ? -1 : blk_flush(disk);
+}
+
+void *guard_blk_buf_alloc(UINTN size) {
+    ON_BSP(void *, blk_buf_alloc, 1, size);
+    return REFUSED() ? NULL : blk_buf_alloc(size);
+}
+
+void guard_blk_buf_free(void *buf) {
+    ON_BSP_VOID(blk_buf_free, 1, buf);
+    if (!REFUSED()) blk_buf_free(buf);
+}
+
+int guard_blk_queue_open(int disk, int depth) {
+    ON_BSP(int, blk_queue_open, 2, disk, depth);
+    return REFUSED() ? -1 : blk_queue_open(disk, depth);
+}
+
+int guard_blk_submit_read(int queue, UINT64 lba, UINT64 count, void *buf) {
+    ON_BSP(int, blk_submit_read, 4, queue, lba, count, buf);
+    return REFUSED() ? -1 : blk_submit_read(queue, lba, count, buf);
+}
+
+int guard_blk_submit_write(int queue, UINT64 lba, UINT64 count, const void *buf) {
+    ON_BSP(int, blk_submit_write, 4, queue, lba, count, buf);
+    return REFUSED() ? -1 : blk_submit_write(queue, lba, count, buf);
+}
+
+int guard_blk_poll(int queue, int req) {
+    ON_BSP(int, blk_poll, 2, queue, req);
+    return REFUSED() ? -1 : blk_poll(queue, req);
+}
+
+int guard_blk_wait(int queue, int req) {
+    ON_BSP(int, blk_wait, 2, queue, req);
+    return REFUSED() ? -1 : blk_wait(queue, req);
+}
+
+int guard_blk_queue_close(int queue) {
+    ON_BSP(int, blk_queue_close, 1, queue);
+    return REFUSED() ? -1 : blk_queue_close(queue);
+}
+
+int guard_printf(const char *fmt, ...) {
+    if (REFUSED()) return -1;
+    va_list ap;
+    va_start(ap, fmt);
+    int ret;
+    if (aprun_on_ap()) {
+        char buf[1024];
+        ret = vsnprintf(buf, sizeof(buf), fmt, ap);
+        aprun_print(buf, strlen(buf), APRUN_STDOUT);
+    } else {
+        ret = vfprintf(stdout, fmt, ap);
+    }
+    va_end(ap);
+    return ret;
+}
+
+int guard_puts(const char *s) {
+    if (aprun_on_ap()) {
+        aprun_print(s, strlen(s), APRUN_STDOUT);
+        aprun_print("\n", 1, APRUN_STDOUT);
+        return 0;
+    }
+    return REFUSED() ? -1 : puts(s);
+}
+
+int guard_putchar(int c) {
+    if (aprun_on_ap()) {
+        char ch = (char)c;
+        aprun_print(&ch, 1, APRUN_STDOUT);
+        return c;
+    }
+    return REFUSED() ? -1 : putchar(c);
+}
+
+int guard_fflush(FILE *f) {
+    ON_BSP(int, fflush, 1, f);
+    return REFUSED() ? -1 : fflush(f);
+}
+
+void *guard_malloc(size_t size) {
+    ON_BSP(void *, malloc, 1, size);
+    return REFUSED() ? NULL : malloc(size);
+}
+
+void guard_free(void *ptr) {
+    ON_BSP_VOID(free, 1, ptr);
+    if (!REFUSED()) free(ptr);
+}
+
+void *guard_realloc(void *ptr, size_t size) {
+    ON_BSP(void *, realloc, 2, ptr, size);
+    return REFUSED() ? NULL : realloc(ptr, size);
+}
+
+void *guard_calloc(size_t nmemb, size_t size) {
+    ON_BSP(void *, calloc, 2, nmemb, size);
+    return REFUSED() ? NULL : calloc(nmemb, size);
+}
+
+char *guard_strdup(const char *s) {
+    ON_BSP(char *, strdup, 1, s);
+    return REFUSED() ? NULL : strdup(s);
+}
+
+time_t guard_time(time_t *t) {
+    ON_BSP(time_t, time, 1, t);
+    return REFUSED() ? (time_t)-1 : time(t);
+}
+
+int guard_clock_gettime(clockid_t id, struct timespec *ts) {
+    ON_BSP(int, clock_gettime, 2, id, ts);
+    return REFUSED() ? -1 : clock_gettime(id, ts);
+}
+
+int guard_gettimeofday(struct timeval *tv, void *tz) {
+    ON_BSP(int, gettimeofday, 2, tv, tz);
+    return REFUSED() ? -1 : gettimeofday(tv, tz);
+}
+
+struct tm *guard_localtime(const time_t *t) {
+    ON_BSP(struct tm *, localtime, 1, t);
+    return REFUSED() ? NULL : localtime(t);
+}
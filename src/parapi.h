@@ -0,0 +1,129 @@
+/*
+ * parapi.h — Parallel runtime for user programs
+ *
+ * What F5 programs get of the mp.h worker pool: a parallel for over an
+ * index range, jobs to submit and wait for, a group of functions run
+ * side by side (which may meet at a barrier), and atomics. The pool is
+ * brought up on the first call of a run and sent back to the firmware
+ * by par_release() when the program returns.
+ *
+ * Job code on the other cores runs with no firmware behind it, so it
+ * may only compute on memory the program already holds: no output,
+ * allocation, framebuffer, keyboard, files or disks. Those API calls
+ * are refused when they come from a worker (they return an error or do
+ * nothing), and the run ends with a note of how many were. A program run
+ * on an AP of its own (aprun.h) has them made on the boot processor.
+ * src/user-headers/survival.h mirrors these.
+ */
+#ifndef PARAPI_H
+#define PARAPI_H
+
+#include "boot.h"
+#include "shim.h"
+
+#define PAR_JOBS 64             /* par_submit() jobs held at once */
+
+typedef void (*par_job_fn)(void *ctx);
+typedef void (*par_range_fn)(INT64 lo, INT64 hi, void *ctx);
+typedef void (*par_group_fn)(int i, int n, void *ctx);
+
+/* Cores jobs run on, this one included (1 without MP services) */
+int par_cores(void);
+
+/* fn(lo, hi, ctx) over pieces of [begin, end) chunk long (0: a few
+   per core), every core taking the next piece until none is left.
+   Returns once all are done. */
+void par_for(INT64 begin, INT64 end, INT64 chunk, par_range_fn fn, void *ctx);
+
+/* Queue fn(ctx) for a core. Returns the job, or -1 if PAR_JOBS are
+   outstanding or this is a job itself. */
+int par_submit(par_job_fn fn, void *ctx);
+
+/* Wait for a job and release it. Returns 0, or -1 for a bad job. */
+int par_wait(int job);
+
+/* fn(i, n, ctx) for i in 0..n-1, all at the same time on different
+   cores, waiting for submitted jobs first; n is cut to par_cores().
+   Only these may meet at a barrier. Returns n. */
+int par_run(int n, par_group_fn fn, void *ctx);
+
+/* Sense-reversing barrier for the n functions of a par_run() */
+struct par_barrier {
+    volatile UINT32 count;
+    volatile UINT32 gen;
+    UINT32 n;
+    UINT32 pad;
+};
+
+void par_barrier_init(struct par_barrier *b, UINT32 n);
+void par_barrier_wait(struct par_barrier *b);
+
+/* The atomics are mp_add32() and friends, exported under par_ names */
+
+/* Wait for what the program left submitted, stop the pool and report
+   refused calls. Called after every run. */
+void par_release(void);
+
+/* ---- Calls refused on a worker ----
+ * The API table points these names here instead of at the real
+ * functions. */
+void guard_fb_pixel(UINT32 x, UINT32 y, UINT32 color);
+void guard_fb_rect(UINT32 x, UINT32 y, UINT32 w, UINT32 h, UINT32 color);
+void guard_fb_clear(UINT32 color);
+void guard_fb_char(UINT32 cx, UINT32 cy, char c, UINT32 fg, UINT32 bg);
+void guard_fb_string(UINT32 cx, UINT32 cy, const char *s, UINT32 fg, UINT32 bg);
+void guard_fb_scroll(void);
+void guard_fb_print(const char *s, UINT32 fg);
+void guard_fb_present(void);
+struct fb_surface *guard_fb_surface_create(UINT32 w, UINT32 h);
+void guard_fb_surface_free(struct fb_surface *s);
+struct fb_surface *guard_fb_surface_screen(void);
+void guard_fb_surface_present(struct fb_surface *s, UINT32 x, UINT32 y);
+void guard_fb_surface_present_rect(struct fb_surface *s, UINT32 sx, UINT32 sy,
+                                   UINT32 w, UINT32 h, UINT32 x, UINT32 y);
+void guard_fb_surface_text(struct fb_surface *s, UINT32 x, UINT32 y,
+                           const char *str, UINT32 fg, UINT32 bg);
+UINT32 guard_fb_frame_wait(UINT32 fps);
+
+struct key_event;
+int guard_kbd_poll(struct key_event *ev);
+void guard_kbd_wait(struct key_event *ev);
+
+void *guard_mem_alloc(UINTN size);
+void guard_mem_free(void *ptr);
+
+struct fs_entry;
+void *guard_fs_readfile(const CHAR16 *path, UINTN *out_size);
+EFI_STATUS guard_fs_writefile(const CHAR16 *path, const void *data, UINTN size);
+int guard_fs_readdir(const CHAR16 *path, struct fs_entry *entries, int max_entries);
+
+struct blk_info;
+int guard_blk_count(void);
+int guard_blk_info(int disk, struct blk_info *out);
+int guard_blk_read(int disk, UINT64 lba, UINT64 count, void *buf);
+int guard_blk_write(int disk, UINT64 lba, UINT64 count, const void *buf);
+int guard_blk_flush(int disk);
+void *guard_blk_buf_alloc(UINTN size);
+void guard_blk_buf_free(void *buf);
+int guard_blk_queue_open(int disk, int depth);
+int guard_blk_submit_read(int queue, UINT64 lba, UINT64 count, void *buf);
+int guard_blk_submit_write(int queue, UINT64 lba, UINT64 count, const void *buf);
+int guard_blk_poll(int queue, int req);
+int guard_blk_wait(int queue, int req);
+int guard_blk_queue_close(int queue);
+
+int guard_printf(const char *fmt, ...);
+int guard_puts(const char *s);
+int guard_putchar(int c);
+int guard_fflush(FILE *f);
+void *guard_malloc(size_t size);
+void guard_free(void *ptr);
+void *guard_realloc(void *ptr, size_t size);
+void *guard_calloc(size_t nmemb, size_t size);
+char *guard_strdup(const char *s);
+time_t guard_time(time_t *t);
+int guard_clock_gettime(clockid_t id, struct timespec *ts);
+int guard_gettimeofday(struct timeval *tv, void *tz);
+struct tm *guard_localtime(const time_t *t);
+
+#endif /* PARAPI_H */
@@ -0,0 +1,214 @@
+/*
+ * part.c — MBR and GPT partition tables
+ *
+ * Portable: uses callback-based block I/O, no UEFI dependency.
+ *
+ * A protective MBR (a type 0xEE entry) sends the scan to the GPT
+ * header in block 1; when its CRCs do not hold, the backup header in
+ * the last block is tried. Otherwise block 0 is read as an MBR, the
+ * chain of extended boot records behind an extended entry giving the
+ * logical partitions. A block 0 that is itself a boot sector (FAT32,
+ * exFAT or NTFS on the whole device) is no table at all.
+ */
+
+#include "part.h"
+#include "mem.h"
+#include "hash.h"
+
+/* ---- Constants ---- */
+
+#define MBR_TABLE       446     /* four 16-byte entries */
+#define MBR_TYPE_GPT    0xEE
+#define MBR_MAX_EBR     64      /* logical partitions followed */
+
+#define GPT_HEADER_MIN  92
+#define GPT_ENTRY_MIN   128
+#define GPT_ENTRIES_MAX 1024
+
+static UINT32 rd32(const UINT8 *p)
+{
+    return (UINT32)p[0] | ((UINT32)p[1] << 8) |
+           ((UINT32)p[2] << 16) | ((UINT32)p[3] << 24);
+}
+
+static UINT64 rd64(const UINT8 *p)
+{
+    return (UINT64)rd32(p) | ((UINT64)rd32(p + 4) << 32);
+}
+
+static int is_extended(UINT8 type)
+{
+    return type == 0x05 || type == 0x0F || type == 0x85;
+}
+
+/* Whether a block with the 55 AA signature is a filesystem's boot
+   sector rather than an MBR */
+static int is_boot_sector(const UINT8 *b)
+{
+    if (mem_cmp(b + 3, "EXFAT   ", 8) == 0 || mem_cmp(b + 3, "NTFS    ", 8) == 0)
+        return 1;
+    return mem_cmp(b + 82, "FAT32   ", 8) == 0 ||
+           mem_cmp(b + 54, "FAT1", 4) == 0;
+}
+
+static int add(struct part_entry *out, int n, int max, UINT64 start,
+               UINT64 blocks, UINT8 type)
+{
+    if (n >= max)
+        return n;
+    mem_set(&out[n], 0, sizeof(out[n]));
+    out[n].start = start;
+    out[n].blocks = blocks;
+    out[n].mbr_type = type;
+    return n + 1;
+}
+
+/* ------------------------------------------------------------------ */
+/* GPT                                                                 */
+/* ------------------------------------------------------------------ */
+
+/* Read the GPT whose header is at block lba. Returns the count, or -1
+   if the header or its entries are not valid. */
+static int gpt_read(part_read_fn read_fn, void *ctx, UINT32 bs,
+                    UINT64 total_blocks, UINT64 lba, UINT8 *blk,
+                    struct part_entry *out, int max)
+{
+    if (read_fn(ctx, lba, 1, blk) != 0 || mem_cmp(blk, "EFI PART", 8) != 0)
+        return -1;
+    UINT32 hsize = rd32(blk + 12);
+    UINT32 hcrc = rd32(blk + 16);
+    if (hsize < GPT_HEADER_MIN || hsize > bs)
+        return -1;
+    blk[16] = blk[17] = blk[18] = blk[19] = 0;
+    if (crc32(0, blk, hsize) != hcrc)
+        return -1;
+
+    UINT64 first = rd64(blk + 40), last = rd64(blk + 48);
+    UINT64 table = rd64(blk + 72);
+    UINT32 count = rd32(blk + 80), esize = rd32(blk + 84);
+    UINT32 ecrc = rd32(blk + 88);
+    if (esize < GPT_ENTRY_MIN || esize % 8 || count == 0 ||
+        count > GPT_ENTRIES_MAX || last >= total_blocks || first > last)
+        return -1;
+
+    UINT64 bytes = (UINT64)count * esize;
+    UINT32 blocks = (UINT32)((bytes + bs - 1) / bs);
+    if (table + blocks > total_blocks)
+        return -1;
+    UINT8 *ents = (UINT8 *)mem_alloc_raw((UINTN)blocks * bs);
+    if (!ents)
+        return -1;
+    int n = -1;
+    if (read_fn(ctx, table, blocks, ents) == 0 &&
+        crc32(0, ents, (UINTN)bytes) == ecrc) {
+        n = 0;
+        for (UINT32 i = 0; i < count; i++) {
+            const UINT8 *e = ents + (UINTN)i * esize;
+            UINT64 s = rd64(e + 32), l = rd64(e + 40);
+            int used = 0;
+            for (int k = 0; k < 16; k++)
+                used |= e[k];
+            if (!used || s < first || l > last || l < s)
+                continue;
+            int before = n;
+            n = add(out, n, max, s, l - s + 1, 0);
+            if (n == before)
+                break;
+            out[before].gpt = 1;
+            /* The name is UTF-16LE */
+            int c = 0;
+            for (int k = 0; k < 36; k++) {
+                UINT16 ch = (UINT16)(e[56 + 2 * k] | (e[57 + 2 * k] << 8));
+                if (!ch)
+                    break;
+                out[before].name[c++] = (ch >= 0x20 && ch <= 0x7E) ? (char)ch : '?';
+            }
+            out[before].name[c] = '\0';
+        }
+    }
+    mem_free(ents);
+    return n;
+}
+
+/* ------------------------------------------------------------------ */
+/* MBR                                                                 */
+/* ------------------------------------------------------------------ */
+
+/* The logical partitions behind the extended partition at ext_start */
+static int mbr_logical(part_read_fn read_fn, void *ctx, UINT64 total_blocks,
+                       UINT64 ext_start, UINT64 ext_blocks, UINT8 *blk,
+                       struct part_entry *out, int n, int max)
+{
+    UINT64 ebr = ext_start;
+    for (int hop = 0; hop < MBR_MAX_EBR && n < max; hop++) {
+        if (read_fn(ctx, ebr, 1, blk) != 0 || blk[510] != 0x55 || blk[511] != 0xAA)
+            break;
+        const UINT8 *e0 = blk + MBR_TABLE, *e1 = e0 + 16;
+        /* The first entry is relative to this EBR, the link to the
+           extended partition */
+        UINT64 s = ebr + rd32(e0 + 8), len = rd32(e0 + 12);
+        if (e0[4] && len && s + len <= total_blocks)
+            n = add(out, n, max, s, len, e0[4]);
+        if (!is_extended(e1[4]) || rd32(e1 + 8) == 0)
+            break;
+        UINT64 next = ext_start + rd32(e1 + 8);
+        if (next <= ebr || next >= ext_start + ext_blocks)
+            break;  /* links only go forward */
+        ebr = next;
+    }
+    return n;
+}
+
+int part_scan(part_read_fn read_fn, void *ctx, UINT32 block_size,
+              UINT64 total_blocks, struct part_entry *out, int max)
+{
+    if (!read_fn || block_size < 512 || block_size > 4096 || total_blocks < 2)
+        return -1;
+    UINT8 *blk = (UINT8 *)mem_alloc_raw(block_size);
+    if (!blk)
+        return -1;
+    int n = -1;
+    if (read_fn(ctx, 0, 1, blk) != 0)
+        goto out;
+    n = 0;
+    if (blk[510] != 0x55 || blk[511] != 0xAA || is_boot_sector(blk))
+        goto out;
+
+    /* Entries: boot flag 0x00 or 0x80, else this is not a table */
+    UINT8 mbr[64];
+    mem_copy(mbr, blk + MBR_TABLE, 64);
+    int gpt = 0;
+    for (int i = 0; i < 4; i++) {
+        const UINT8 *e = mbr + 16 * i;
+        if ((e[0] & 0x7F) != 0)
+            goto out;
+        if (e[4] == MBR_TYPE_GPT)
+            gpt = 1;
+    }
+
+    if (gpt) {
+        n = gpt_read(read_fn, ctx, block_size, total_blocks, 1, blk, out, max);
+        if (n < 0)
+            n = gpt_read(read_fn, ctx, block_size, total_blocks,
+                         total_blocks - 1, blk, out, max);
+        if (n >= 0)
+            goto out;
+        n = 0;      /* no valid GPT: read the MBR as it stands */
+    }
+
+    for (int i = 0; i < 4; i++) {
+        const UINT8 *e = mbr + 16 * i;
+        UINT64 s = rd32(e + 8), len = rd32(e + 12);
+        if (!e[4] || e[4] == MBR_TYPE_GPT || !len || s == 0 ||
+            s + len > total_blocks)
+            continue;
+        if (is_extended(e[4]))
+            n = mbr_logical(read_fn, ctx, total_blocks, s, len, blk, out, n, max);
+        else
+            n = add(out, n, max, s, len, e[4]);
+    }
+
+out:
+    mem_free(blk);
+    return n;
+}
@@ -0,0 +1,37 @@
+/*
+ * part.h — MBR and GPT partition tables
+ *
+ * Portable: reads through the same callback-based block I/O as the
+ * filesystem drivers, so a device or a disk image file (fs.h) is
+ * parsed the same way.
+ * Supports: GPT (primary header, else the backup at the end, both
+ * CRC-checked), MBR primary partitions and the logical partitions of
+ * an extended one.
+ */
+#ifndef PART_H
+#define PART_H
+
+#include "boot.h"
+
+#define PART_MAX 32
+
+/* Block I/O callback */
+typedef int (*part_read_fn)(void *ctx, UINT64 lba, UINT32 count, void *buf);
+
+struct part_entry {
+    UINT64 start;           /* first block */
+    UINT64 blocks;
+    UINT8  mbr_type;        /* MBR system id; 0 on GPT */
+    UINT8  gpt;
+    char   name[37];        /* GPT partition name (ASCII), or "" */
+};
+
+/* Read the partition table of a device of total_blocks blocks of
+   block_size bytes (512 to 4096) into out, in table order, leaving out
+   empty slots and extended partitions themselves. Returns the count,
+   0 if there is no table (a superfloppy: block 0 is a boot sector),
+   -1 on a read error. */
+int part_scan(part_read_fn read_fn, void *ctx, UINT32 block_size,
+              UINT64 total_blocks, struct part_entry *out, int max);
+
+#endif /* PART_H */
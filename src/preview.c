@@ -0,0 +1,586 @@
+/*
+ * preview.c — Quick look at the file under the browser's cursor
+ *
+ * See preview.h. A file goes wait -> head -> (iso | thumb) -> done: the
+ * one-shot timer ends the wait, then each idle step reads one chunk of
+ * the head, the ISO descriptor sectors, or one sampled row of the
+ * thumbnail. What the file is follows from its head alone, not from its
+ * name. The thumbnail's samples are kept, so a redraw reads nothing.
+ */
+
+#include "preview.h"
+#include "event.h"
+#include "fb.h"
+#include "font.h"
+#include "mem.h"
+#include "shim.h"
+
+#define PV_PATH       512
+#define PV_TAB        4
+#define PV_ISO_AT     (16 * 2048)   /* primary volume descriptor */
+#define PV_ISO_BYTES  4096          /* it and the boot record after it */
+#define PV_ROW        4096          /* BMP rows up to this are read whole */
+#define PV_THUMB_ROW  4             /* pane row the thumbnail starts at */
+
+enum { PV_NONE, PV_WAIT, PV_HEAD, PV_ISO, PV_THUMB, PV_DONE };
+
+static UINT32 s_x, s_y, s_w, s_h;
+
+static int s_state;
+static struct fs_volume *s_vol;
+static CHAR16 s_path[PV_PATH];
+static char s_name[128];
+static UINT64 s_size;
+static struct fs_file *s_file;
+static int s_failed;                /* would not open or read */
+
+static UINT8 s_head[PREVIEW_HEAD];
+static UINT32 s_len;
+static UINT8 s_iso[PV_ISO_BYTES];
+static UINT32 s_iso_len;
+
+/* BMP thumbnail: sw x sh samples of a w x h image */
+static struct {
+    UINT32 w, h;
+    int top_down;
+    UINT32 bpp, data, row_bytes;
+    UINT32 pal, colors;             /* 8-bit: palette in s_head */
+    UINT32 sw, sh;                  /* 0: no thumbnail */
+    UINT32 rows;                    /* sample rows read */
+    UINT32 px[PREVIEW_THUMB * PREVIEW_THUMB];
+} s_thumb;
+static UINT8 s_row[PV_ROW];
+
+static struct ev_handler s_timer;
+static struct ev_handler s_idle;
+
+static UINT32 le16(const UINT8 *p) { return p[0] | (UINT32)p[1] << 8; }
+static UINT32 le32(const UINT8 *p) { return le16(p) | le16(p + 2) << 16; }
+static UINT64 le64(const UINT8 *p) { return le32(p) | (UINT64)le32(p + 4) << 32; }
+static UINT32 be16(const UINT8 *p) { return (UINT32)p[0] << 8 | p[1]; }
+static UINT32 be32(const UINT8 *p) { return be16(p) << 16 | be16(p + 2); }
+
+/* ---- Drawing ---- */
+
+/* Pane row r: text clipped and padded to the pane's width */
+static void pane_row(UINT32 r, const char *text, UINT32 fg) {
+    char line[256];
+    if (r >= s_h) return;
+    UINT32 n = s_w < sizeof(line) - 1 ? s_w : sizeof(line) - 1;
+    UINT32 i = 0;
+    for (; i < n && text[i]; i++) line[i] = text[i];
+    for (; i < n; i++) line[i] = ' ';
+    line[n] = '\0';
+    fb_string(s_x, s_y + r, line, fg, COLOR_BLACK);
+}
+
+static void put(UINT32 *r, UINT32 fg, const char *fmt, ...) {
+    char line[256];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(line, sizeof(line), fmt, ap);
+    va_end(ap);
+    pane_row((*r)++, line, fg);
+}
+
+/* n bytes of a fixed-width field, unprintables dropped and trailing
+   blanks trimmed */
+static void field(char *out, const UINT8 *p, int n) {
+    int k = 0;
+    for (int i = 0; i < n && p[i]; i++)
+        if (shim_isprint(p[i])) out[k++] = (char)p[i];
+    while (k > 0 && out[k - 1] == ' ') k--;
+    out[k] = '\0';
+}
+
+static int looks_text(void) {
+    UINT32 odd = 0;
+    for (UINT32 i = 0; i < s_len; i++) {
+        UINT8 c = s_head[i];
+        if (c == 0) return 0;
+        if (c < 0x20 && c != '\t' && c != '\n' && c != '\r' && c != '\f' &&
+            c != 27)
+            odd++;
+    }
+    return odd * 32 <= s_len;
+}
+
+/* The head's lines, tabs expanded and cut at the pane's width */
+static void draw_text(UINT32 r) {
+    UINT32 i = 0;
+    while (r < s_h && i < s_len) {
+        char line[256];
+        UINT32 n = 0, col = 0;
+        for (; i < s_len && s_head[i] != '\n'; i++) {
+            UINT8 c = s_head[i];
+            if (c == '\r' || (c >= 0x80 && c < 0xC0))
+                continue;           /* CR, UTF-8 continuation */
+            do {
+                if (n < sizeof(line) - 1)
+                    line[n++] = c == '\t' ? ' ' : c >= 0x80 ? '?' :
+                                shim_isprint(c) ? (char)c : '.';
+                col++;
+            } while (c == '\t' && col % PV_TAB);
+        }
+        i++;
+        line[n] = '\0';
+        pane_row(r++, line, COLOR_WHITE);
+    }
+}
+
+static void draw_hex(UINT32 r) {
+    UINT32 per = s_w > 6 + 16 ? (s_w - 6) / 4 : 4;
+    if (per > 16) per = 16;
+    per &= ~3u;
+    for (UINT32 off = 0; r < s_h && off < s_len; off += per) {
+        char line[256];
+        int n = snprintf(line, sizeof(line), "%04x ", off);
+        for (UINT32 k = 0; k < per; k++)
+            n += off + k < s_len
+                 ? snprintf(line + n, sizeof(line) - n, " %02x", s_head[off + k])
+                 : snprintf(line + n, sizeof(line) - n, "   ");
+        line[n++] = ' ';
+        for (UINT32 k = 0; k < per && off + k < s_len; k++)
+            line[n++] = shim_isprint(s_head[off + k]) ? (char)s_head[off + k] : '.';
+        line[n] = '\0';
+        pane_row(r++, line, COLOR_GRAY);
+    }
+}
+
+/* GPT entries that lie in the head (the array at LBA 2) */
+static void draw_gpt(UINT32 *r) {
+    const UINT8 *h = s_head + 512;
+    UINT32 count = le32(h + 80), size = le32(h + 84);
+    put(r, COLOR_CYAN, "GUID partition table, %u entries", count);
+    if (le64(h + 72) != 2 || size < 128 || size > PREVIEW_HEAD) return;
+    UINT32 shown = 0;
+    for (UINT32 i = 0; i < count && 1024 + (i + 1) * size <= s_len; i++) {
+        const UINT8 *e = s_head + 1024 + i * size;
+        int used = 0;
+        for (int k = 0; k < 16; k++) used |= e[k];
+        if (!used) continue;
+        char name[40];
+        int k = 0;
+        for (int c = 0; c < 36 && le16(e + 56 + c * 2); c++) {
+            UINT32 ch = le16(e + 56 + c * 2);
+            name[k++] = ch < 0x80 && shim_isprint((int)ch) ? (char)ch : '?';
+        }
+        name[k] = '\0';
+        UINT64 first = le64(e + 32), last = le64(e + 40);
+        put(r, COLOR_WHITE, "%2u  %-20s %llu MB", i + 1, name,
+            last >= first ? (last - first + 1) / 2048 : 0);
+        shown++;
+    }
+    if (shown < count && 1024 + (UINT64)count * size > s_len)
+        put(r, COLOR_GRAY, "(those within the first %u KB)", PREVIEW_HEAD / 1024);
+}
+
+/* Sector 0 of a disk image or volume: its BPB, or its partitions */
+static int draw_boot(UINT32 *r) {
+    const UINT8 *b = s_head;
+    char t[64];
+    if (s_len < 512 || b[510] != 0x55 || b[511] != 0xAA) return 0;
+
+    if (!mem_cmp(b + 3, "EXFAT   ", 8) && b[108] <= 12 && b[109] <= 25) {
+        put(r, COLOR_CYAN, "exFAT boot sector");
+        put(r, COLOR_WHITE, "Sector   %u bytes", 1u << b[108]);
+        put(r, COLOR_WHITE, "Cluster  %u bytes", (1u << b[108]) << b[109]);
+        put(r, COLOR_WHITE, "Volume   %llu sectors", le64(b + 72));
+        put(r, COLOR_WHITE, "Serial   %08x", le32(b + 100));
+        return 1;
+    }
+    if (!mem_cmp(b + 3, "NTFS    ", 8)) {
+        put(r, COLOR_CYAN, "NTFS boot sector");
+        put(r, COLOR_WHITE, "Sector   %u bytes", le16(b + 11));
+        put(r, COLOR_WHITE, "Cluster  %u bytes", le16(b + 11) * b[13]);
+        put(r, COLOR_WHITE, "Volume   %llu sectors", le64(b + 40));
+        put(r, COLOR_WHITE, "Serial   %016llx", le64(b + 72));
+        return 1;
+    }
+    int fat32 = !mem_cmp(b + 82, "FAT32", 5);
+    if (fat32 || !mem_cmp(b + 54, "FAT1", 4)) {
+        const UINT8 *ext = b + (fat32 ? 64 : 36);   /* extended BPB */
+        field(t, fat32 ? b + 82 : b + 54, 8);
+        put(r, COLOR_CYAN, "%s boot sector", t);
+        field(t, b + 3, 8);
+        put(r, COLOR_WHITE, "OEM      %s", t);
+        put(r, COLOR_WHITE, "Sector   %u bytes", le16(b + 11));
+        put(r, COLOR_WHITE, "Cluster  %u sectors", b[13]);
+        put(r, COLOR_WHITE, "Reserved %u sectors, %u FATs", le16(b + 14), b[16]);
+        put(r, COLOR_WHITE, "Volume   %u sectors",
+            le16(b + 19) ? le16(b + 19) : le32(b + 32));
+        field(t, ext + 7, 11);
+        put(r, COLOR_WHITE, "Label    %s", t);
+        put(r, COLOR_WHITE, "Serial   %08x", le32(ext + 3));
+        return 1;
+    }
+
+    put(r, COLOR_CYAN, "Master boot record");
+    int gpt = 0;
+    for (int i = 0; i < 4; i++) {
+        const UINT8 *p = b + 446 + i * 16;
+        if (!p[4]) continue;
+        if (p[4] == 0xEE) gpt = 1;
+        put(r, COLOR_WHITE, "%d  type %02x  at %u, %u MB%s", i + 1, p[4],
+            le32(p + 8), le32(p + 12) / 2048, p[0] == 0x80 ? "  boot" : "");
+    }
+    if (gpt && s_len >= 1024 && !mem_cmp(b + 512, "EFI PART", 8)) {
+        (*r)++;
+        draw_gpt(r);
+    }
+    return 1;
+}
+
+/* An ISO 9660 primary volume descriptor, and El Torito after it */
+static int draw_iso(UINT32 *r) {
+    const UINT8 *d = s_iso;
+    char t[132];
+    if (s_iso_len < 2048 || d[0] != 1 || mem_cmp(d + 1, "CD001", 5)) return 0;
+    put(r, COLOR_CYAN, "ISO 9660 image");
+    field(t, d + 40, 32);
+    put(r, COLOR_WHITE, "Volume   %s", t);
+    field(t, d + 8, 32);
+    put(r, COLOR_WHITE, "System   %s", t);
+    put(r, COLOR_WHITE, "Size     %u blocks of %u bytes", le32(d + 80), le16(d + 128));
+    field(t, d + 813, 12);
+    if (str_len((CHAR8 *)t) == 12)
+        put(r, COLOR_WHITE, "Created  %.4s-%.2s-%.2s %.2s:%.2s", t, t + 4,
+            t + 6, t + 8, t + 10);
+    field(t, d + 318, 128);
+    if (t[0]) put(r, COLOR_WHITE, "Publisher %s", t);
+    field(t, d + 574, 128);
+    if (t[0]) put(r, COLOR_WHITE, "App      %s", t);
+    int torito = s_iso_len >= 4096 && d[2048] == 0 &&
+                 !mem_cmp(d + 2049, "CD001", 5) &&
+                 !mem_cmp(d + 2055, "EL TORITO SPECIFICATION", 23);
+    put(r, COLOR_WHITE, "Boot     %s", torito ? "El Torito" : "none found");
+    if (s_len >= 512 && s_head[510] == 0x55 && s_head[511] == 0xAA)
+        put(r, COLOR_WHITE, "Hybrid   also has an MBR (boots from USB)");
+    return 1;
+}
+
+/* The thumbnail's sample rows from..to-1 */
+static void draw_thumb_rows(UINT32 from, UINT32 to) {
+    if (!s_thumb.sw || s_h <= PV_THUMB_ROW || !fb_surface_screen()) return;
+    UINT32 cw = FONT_WIDTH * g_boot.scale, ch = FONT_HEIGHT * g_boot.scale;
+    UINT32 bw = s_w * cw / s_thumb.sw;
+    UINT32 bh = (s_h - PV_THUMB_ROW) * ch / s_thumb.sh;
+    UINT32 b = bw < bh ? bw : bh;
+    if (!b) return;
+    UINT32 x0 = s_x * cw, y0 = (s_y + PV_THUMB_ROW) * ch;
+    for (UINT32 j = from; j < to; j++)
+        for (UINT32 i = 0; i < s_thumb.sw; i++)
+            fb_rect(x0 + i * b, y0 + j * b, b, b, s_thumb.px[j * s_thumb.sw + i]);
+}
+
+static int draw_image(UINT32 *r) {
+    const UINT8 *b = s_head;
+    if (s_len >= 26 && !mem_cmp(b, "\x89PNG\r\n\x1a\n", 8)) {
+        static const char *kinds[] = { "grey", "?", "RGB", "palette",
+                                       "grey+alpha", "?", "RGBA" };
+        put(r, COLOR_CYAN, "PNG image");
+        put(r, COLOR_WHITE, "%u x %u, %u-bit %s", be32(b + 16), be32(b + 20),
+            b[24], b[25] <= 6 ? kinds[b[25]] : "?");
+        return 1;
+    }
+    if (s_len >= 10 && (!mem_cmp(b, "GIF87a", 6) || !mem_cmp(b, "GIF89a", 6))) {
+        put(r, COLOR_CYAN, "GIF image");
+        put(r, COLOR_WHITE, "%u x %u", le16(b + 6), le16(b + 8));
+        return 1;
+    }
+    if (s_len >= 4 && b[0] == 0xFF && b[1] == 0xD8 && b[2] == 0xFF) {
+        put(r, COLOR_CYAN, "JPEG image");
+        /* Segments up to the frame header, as far as the head goes */
+        UINT32 i = 2;
+        while (i + 10 <= s_len && b[i] == 0xFF) {
+            UINT8 m = b[i + 1];
+            if (m >= 0xC0 && m <= 0xCF && m != 0xC4 && m != 0xC8 && m != 0xCC) {
+                put(r, COLOR_WHITE, "%u x %u, %u components, %s", be16(b + i + 7),
+                    be16(b + i + 5), b[i + 9],
+                    m == 0xC2 ? "progressive" : "baseline");
+                return 1;
+            }
+            i += 2 + be16(b + i + 2);
+        }
+        put(r, COLOR_GRAY, "Frame header past the first %u KB", PREVIEW_HEAD / 1024);
+        return 1;
+    }
+    if (s_len >= 54 && b[0] == 'B' && b[1] == 'M') {
+        put(r, COLOR_CYAN, "BMP image");
+        INT32 h = (INT32)le32(b + 22);
+        put(r, COLOR_WHITE, "%u x %d, %u-bit%s", le32(b + 18), h < 0 ? -h : h,
+            le16(b + 28), le32(b + 30) && le32(b + 30) != 3 ? ", compressed" : "");
+        draw_thumb_rows(0, s_thumb.rows);
+        return 1;
+    }
+    return 0;
+}
+
+void preview_draw(void) {
+    if (!s_w || !s_h) return;
+    UINT32 r = 0;
+    if (s_state == PV_NONE && !s_name[0]) {
+        for (; r < s_h; r++) pane_row(r, "", COLOR_BLACK);
+        return;
+    }
+    put(&r, COLOR_YELLOW, "%s", s_name);
+    UINT32 body = r;
+    for (UINT32 k = r; k < s_h; k++) pane_row(k, "", COLOR_BLACK);
+
+    if (s_failed)
+        put(&r, COLOR_RED, "Could not read the file");
+    else if (s_state <= PV_ISO)
+        put(&r, COLOR_GRAY, "%s", s_state == PV_NONE ? "" : "...");
+    else if (!s_len)
+        put(&r, COLOR_GRAY, "Empty file");
+    else if (draw_image(&r) || draw_iso(&r) || draw_boot(&r))
+        ;
+    else if (looks_text())
+        draw_text(body);
+    else
+        draw_hex(body);
+}
+
+/* ---- Reading ---- */
+
+static void close_file(void) {
+    if (s_file) fs_stream_close(s_file);
+    s_file = NULL;
+}
+
+/* n bytes at pos, or -1 */
+static int read_at(UINT64 pos, void *buf, UINT32 n) {
+    if (fs_stream_seek(s_file, pos) != 0) return -1;
+    UINT32 got = 0;
+    while (got < n) {
+        UINTN k = n - got;
+        if (fs_stream_read(s_file, (UINT8 *)buf + got, &k) != 0 || !k)
+            return -1;
+        got += (UINT32)k;
+    }
+    return 0;
+}
+
+/* After the head: set up a thumbnail of a plain BMP if pixels show */
+static int thumb_begin(void) {
+    const UINT8 *b = s_head;
+    s_thumb.sw = s_thumb.sh = s_thumb.rows = 0;
+    if (s_len < 54 || b[0] != 'B' || b[1] != 'M' || !fb_surface_screen())
+        return 0;
+    UINT32 info = le32(b + 14), comp = le32(b + 30), bpp = le16(b + 28);
+    INT32 w = (INT32)le32(b + 18), h = (INT32)le32(b + 22);
+    if (info < 40 || w <= 0 || w > 65535 || h == 0 || h > 65535 || h < -65535)
+        return 0;
+    if (!(bpp == 8 || bpp == 24 || bpp == 32) ||
+        !(comp == 0 || (comp == 3 && bpp == 32)))
+        return 0;
+    s_thumb.colors = 0;
+    if (bpp == 8) {
+        s_thumb.pal = 14 + info;
+        s_thumb.colors = le32(b + 46) ? le32(b + 46) : 256;
+        if (s_thumb.colors > 256 || s_thumb.pal + s_thumb.colors * 4 > s_len)
+            return 0;
+    }
+    s_thumb.top_down = h < 0;
+    s_thumb.w = (UINT32)w;
+    s_thumb.h = (UINT32)(h < 0 ? -h : h);
+    s_thumb.bpp = bpp;
+    s_thumb.data = le32(b + 10);
+    s_thumb.row_bytes = (s_thumb.w * bpp + 31) / 32 * 4;
+    if (s_thumb.data + (UINT64)s_thumb.row_bytes * s_thumb.h > s_size)
+        return 0;
+
+    UINT32 sw = s_thumb.w, sh = s_thumb.h;
+    if (sw > PREVIEW_THUMB || sh > PREVIEW_THUMB) {
+        if (sw >= sh) {
+            sh = sh * PREVIEW_THUMB / sw;
+            sw = PREVIEW_THUMB;
+        } else {
+            sw = sw * PREVIEW_THUMB / sh;
+            sh = PREVIEW_THUMB;
+        }
+    }
+    s_thumb.sw = sw ? sw : 1;
+    s_thumb.sh = sh ? sh : 1;
+    return 1;
+}
+
+/* One sample row of the thumbnail */
+static int thumb_step(void) {
+    UINT32 j = s_thumb.rows;
+    UINT32 y = j * s_thumb.h / s_thumb.sh;
+    UINT32 fy = s_thumb.top_down ? y : s_thumb.h - 1 - y;
+    UINT64 base = s_thumb.data + (UINT64)fy * s_thumb.row_bytes;
+    UINT32 step = s_thumb.bpp / 8;
+    int whole = s_thumb.row_bytes <= PV_ROW;
+    if (whole && read_at(base, s_row, s_thumb.row_bytes) != 0)
+        return -1;
+    UINT32 *out = &s_thumb.px[j * s_thumb.sw];
+    for (UINT32 i = 0; i < s_thumb.sw; i++) {
+        UINT32 x = i * s_thumb.w / s_thumb.sw;
+        UINT8 one[4];
+        const UINT8 *p = s_row + x * step;
+        if (!whole) {
+            if (read_at(base + x * step, one, step) != 0) return -1;
+            p = one;
+        }
+        if (step == 1)      /* palette entries are BGRX */
+            out[i] = p[0] < s_thumb.colors
+                     ? le32(s_head + s_thumb.pal + p[0] * 4) & 0xFFFFFF : 0;
+        else
+            out[i] = (UINT32)p[2] << 16 | (UINT32)p[1] << 8 | p[0];
+    }
+    s_thumb.rows++;
+    return 0;
+}
+
+/* One step of reading; returns 1 while there is more */
+static int pv_step(void) {
+    switch (s_state) {
+    case PV_HEAD: {
+        if (!s_file) {
+            UINT64 size;
+            s_file = fs_volume_open_read(s_vol, s_path, &size);
+            if (!s_file) break;
+            s_size = size;
+            return 1;
+        }
+        UINTN n = PREVIEW_HEAD - s_len;
+        if (n > PREVIEW_CHUNK) n = PREVIEW_CHUNK;
+        if (fs_stream_read(s_file, s_head + s_len, &n) != 0) break;
+        s_len += (UINT32)n;
+        if (n && s_len < PREVIEW_HEAD) return 1;
+
+        /* A blank sector 0 or an MBR in front of the descriptors */
+        int blank = s_len >= 512;
+        for (UINT32 i = 0; blank && i < 512; i++) blank = !s_head[i];
+        int mbr = s_len >= 512 && s_head[510] == 0x55 && s_head[511] == 0xAA;
+        if ((blank || mbr) && s_size >= PV_ISO_AT + PV_ISO_BYTES) {
+            s_state = PV_ISO;
+            return 1;
+        }
+        s_state = thumb_begin() ? PV_THUMB : PV_DONE;
+        preview_draw();
+        return s_state == PV_THUMB;
+    }
+    case PV_ISO:
+        if (read_at(PV_ISO_AT, s_iso, PV_ISO_BYTES) == 0)
+            s_iso_len = PV_ISO_BYTES;
+        s_state = PV_DONE;
+        preview_draw();
+        return 0;
+
+    case PV_THUMB:
+        if (thumb_step() != 0) {
+            s_thumb.sw = 0;     /* what was read stays unshown */
+            s_state = PV_DONE;
+            preview_draw();
+            return 0;
+        }
+        draw_thumb_rows(s_thumb.rows - 1, s_thumb.rows);
+        if (s_thumb.rows < s_thumb.sh) return 1;
+        s_state = PV_DONE;
+        return 0;
+    }
+    if (s_state == PV_DONE || s_state == PV_NONE || s_state == PV_WAIT)
+        return 0;
+    /* Read error */
+    s_failed = 1;
+    s_state = PV_DONE;
+    close_file();
+    preview_draw();
+    return 0;
+}
+
+static int pv_idle(void *arg) {
+    (void)arg;
+    int more = pv_step();
+    if (!more) {
+        close_file();
+        ev_remove(&s_idle);
+    }
+    return more;
+}
+
+/* PREVIEW_DELAY_MS after the last key */
+static int pv_fire(void *arg) {
+    (void)arg;
+    ev_remove(&s_timer);
+    if (s_state == PV_WAIT) {
+        s_state = PV_HEAD;
+        ev_add_idle(&s_idle, EV_PRIO_HIGH, pv_idle, NULL);
+    }
+    return 0;
+}
+
+/* ---- Interface ---- */
+
+void preview_layout(UINT32 x, UINT32 y, UINT32 w, UINT32 h) {
+    s_x = x;
+    s_y = y;
+    s_w = w;
+    s_h = h;
+}
+
+static int same_path(const CHAR16 *a, const CHAR16 *b) {
+    while (*a && *a == *b) {
+        a++;
+        b++;
+    }
+    return *a == *b;
+}
+
+void preview_select(struct fs_volume *v, const CHAR16 *path,
+                    const char *name, UINT64 size) {
+    if (!path) {
+        if (s_state != PV_NONE || s_name[0]) {
+            preview_clear();
+            preview_draw();
+        }
+        return;
+    }
+    if (s_state != PV_NONE && v == s_vol && same_path(path, s_path))
+        return;
+    preview_clear();
+    int i = 0;
+    for (; path[i] && i < PV_PATH - 1; i++) s_path[i] = path[i];
+    s_path[i] = 0;
+    str_copy(s_name, name, sizeof(s_name));
+    s_vol = v;
+    s_size = size;
+    s_state = PV_WAIT;
+    preview_draw();
+}
+
+void preview_cancel(void) {
+    if (s_state == PV_WAIT || s_state == PV_DONE) return;
+    if (s_state != PV_NONE) {
+        close_file();
+        s_state = PV_NONE;  /* read again if asked again */
+    }
+}
+
+void preview_clear(void) {
+    close_file();
+    ev_remove(&s_timer);
+    ev_remove(&s_idle);
+    s_state = PV_NONE;
+    s_name[0] = '\0';
+    s_len = s_iso_len = 0;
+    s_failed = 0;
+    s_thumb.sw = s_thumb.rows = 0;
+}
+
+void preview_arm(void) {
+    if (s_state == PV_WAIT &&
+        ev_add_timer(&s_timer, PREVIEW_DELAY_MS, 0, EV_PRIO_NORMAL,
+                     pv_fire, NULL) != 0)
+        s_state = PV_HEAD;      /* no timer: read at once */
+    if (s_state >= PV_HEAD && s_state < PV_DONE)
+        ev_add_idle(&s_idle, EV_PRIO_HIGH, pv_idle, NULL);
+}
+
+void preview_disarm(void) {
+    ev_remove(&s_timer);
+    ev_remove(&s_idle);
+}
@@ -0,0 +1,53 @@
+/*
+ * preview.h — Quick look at the file under the browser's cursor
+ *
+ * V in the browser splits the screen: the listing keeps the left half
+ * and the right half shows the file the cursor is on. Text shows its
+ * first screenful, a binary file its first bytes in hex, a disk image
+ * or boot sector its BPB fields or partition table, an ISO its primary
+ * volume descriptor and boot record, and an image its size and format,
+ * with a thumbnail where the pixels are stored plain (BMP).
+ *
+ * Only PREVIEW_HEAD bytes of the file are read, plus the two sectors of
+ * an ISO's descriptors and one sampled pixel row per step of a
+ * thumbnail, all through the streaming API. Nothing is read until the
+ * cursor has rested PREVIEW_DELAY_MS on a file, and then a chunk at a
+ * time as idle work of the browser's key wait, so a key always comes
+ * first and moving on drops a read half done.
+ */
+#ifndef PREVIEW_H
+#define PREVIEW_H
+
+#include "boot.h"
+#include "fs.h"
+
+#define PREVIEW_HEAD      4096  /* bytes read from the start */
+#define PREVIEW_CHUNK     1024  /* read per step */
+#define PREVIEW_DELAY_MS  120   /* cursor at rest before reading */
+#define PREVIEW_THUMB     64    /* thumbnail samples per side, at most */
+
+/* The pane: w x h text cells from column x, row y */
+void preview_layout(UINT32 x, UINT32 y, UINT32 w, UINT32 h);
+
+/* Show path on v (NULL for nothing: a directory or a device entry).
+   The same file as now keeps what is shown; another is read once the
+   cursor rests. name is shown as the pane's title. */
+void preview_select(struct fs_volume *v, const CHAR16 *path,
+                    const char *name, UINT64 size);
+
+/* Stop a read in progress, before a key that may use the volume; the
+   next preview_select() of the file starts it again */
+void preview_cancel(void);
+
+/* Forget what is shown too (the listing was read again) */
+void preview_clear(void);
+
+/* Draw the pane as far as it is known */
+void preview_draw(void);
+
+/* Around the browser's kbd_wait(): register the delay and the reading
+   while there is any to do, and remove them again */
+void preview_arm(void);
+void preview_disarm(void);
+
+#endif /* PREVIEW_H */
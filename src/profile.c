@@ -0,0 +1,130 @@
+/*
+ * profile.c — Flat function profile of a program run
+ *
+ * Functions are found by address in an open-addressed table. A stack
+ * of activations holds each one's start and the ticks its callees took,
+ * which its exit subtracts for self time and passes up to the caller.
+ */
+
+#include "profile.h"
+#include "mem.h"
+#include "timer.h"
+
+struct prof_frame {
+    struct prof_func *f;    /* NULL when the table was full */
+    UINT64 start;
+    UINT64 child;           /* ticks spent in callees */
+};
+
+static struct prof_func s_funcs[PROF_FUNCS];
+static const struct prof_func *s_sorted[PROF_FUNCS];
+static int s_nfuncs;
+static struct prof_frame s_stack[PROF_DEPTH];
+static UINT32 s_depth;      /* may exceed PROF_DEPTH */
+static int s_on;
+static UINT64 s_t0, s_t1;
+
+static struct prof_func *prof_slot(const void *fn, int add) {
+    UINTN h = ((UINTN)fn >> 2) * 0x9E3779B97F4A7C15ULL;
+    UINT32 k = (UINT32)(h >> 40) & (PROF_FUNCS - 1);
+    for (int n = 0; n < PROF_FUNCS; n++, k = (k + 1) & (PROF_FUNCS - 1)) {
+        struct prof_func *f = &s_funcs[k];
+        if (f->fn == fn)
+            return f;
+        if (!f->fn) {
+            /* Keep a slot free so lookups of unknown functions end */
+            if (!add || s_nfuncs >= PROF_FUNCS - 1)
+                return NULL;
+            f->fn = fn;
+            s_nfuncs++;
+            return f;
+        }
+    }
+    return NULL;
+}
+
+void prof_begin(void) {
+    mem_set(s_funcs, 0, sizeof(s_funcs));
+    s_nfuncs = 0;
+    s_depth = 0;
+    s_on = 1;
+    s_t0 = timer_ticks();
+}
+
+static void prof_pop(UINT64 now) {
+    if (--s_depth >= PROF_DEPTH)
+        return;
+    struct prof_frame *fr = &s_stack[s_depth];
+    UINT64 elapsed = now - fr->start;
+    if (fr->f) {
+        fr->f->self += elapsed - fr->child;
+        if (--fr->f->active == 0)
+            fr->f->total += elapsed;
+    }
+    if (s_depth)
+        s_stack[s_depth - 1].child += elapsed;
+}
+
+void prof_end(void) {
+    if (!s_on)
+        return;
+    UINT64 now = timer_ticks();
+    while (s_depth)
+        prof_pop(now);
+    s_on = 0;
+    s_t1 = now;
+}
+
+void __cyg_profile_func_enter(void *fn, void *call_site) {
+    (void)call_site;
+    if (!s_on)
+        return;
+    if (s_depth < PROF_DEPTH) {
+        struct prof_func *f = prof_slot(fn, 1);
+        if (f) {
+            f->calls++;
+            f->active++;
+        }
+        s_stack[s_depth].f = f;
+        s_stack[s_depth].child = 0;
+        s_stack[s_depth].start = timer_ticks();
+    }
+    s_depth++;
+}
+
+void __cyg_profile_func_exit(void *fn, void *call_site) {
+    (void)fn;
+    (void)call_site;
+    if (s_on && s_depth)
+        prof_pop(timer_ticks());
+}
+
+void prof_name(void *ctx, const char *name, const void *fn) {
+    (void)ctx;
+    struct prof_func *f = prof_slot(fn, 0);
+    if (!f || f->name[0])
+        return;
+    int i = 0;
+    for (; name[i] && i < PROF_NAME - 1; i++)
+        f->name[i] = name[i];
+    f->name[i] = '\0';
+}
+
+int prof_result(const struct prof_func *const **out, UINT64 *run_ticks) {
+    int n = 0;
+    for (int i = 0; i < PROF_FUNCS; i++) {
+        if (!s_funcs[i].fn)
+            continue;
+        /* Insertion sort, largest self time first: n is small */
+        int j = n++;
+        while (j > 0 && s_sorted[j - 1]->self < s_funcs[i].self) {
+            s_sorted[j] = s_sorted[j - 1];
+            j--;
+        }
+        s_sorted[j] = &s_funcs[i];
+    }
+    *out = s_sorted;
+    if (run_ticks)
+        *run_ticks = s_t1 - s_t0;
+    return n;
+}
@@ -0,0 +1,47 @@
+/*
+ * profile.h — Flat function profile of a program run
+ *
+ * A program compiled with -finstrument-functions (Ctrl+F5 in the
+ * editor) calls the two hooks below around every function body.
+ * Each call charges the counter ticks between them to the function:
+ * total time once per outermost activation (so recursion is not
+ * counted twice) and self time with its callees taken out. The hooks
+ * cost a counter read and a hash probe, so a profiled run stays close
+ * to the speed of a plain one.
+ */
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include "boot.h"
+
+#define PROF_FUNCS   1024   /* distinct functions; a power of two */
+#define PROF_DEPTH   256    /* call nesting timed; deeper calls are not */
+#define PROF_NAME    40     /* bytes of a function name kept */
+
+struct prof_func {
+    const void *fn;         /* NULL = empty slot */
+    UINT64 calls;
+    UINT64 self, total;     /* timer_ticks() */
+    UINT32 active;          /* activations on the stack */
+    char   name[PROF_NAME];
+};
+
+/* Clear the table and start recording */
+void prof_begin(void);
+
+/* Stop recording. Functions still on the stack (the program called
+   exit()) are charged up to now. */
+void prof_end(void);
+
+/* Name fn in the report, if it was called; for tcc_list_functions() */
+void prof_name(void *ctx, const char *name, const void *fn);
+
+/* The hooks TinyCC's -finstrument-functions code calls */
+void __cyg_profile_func_enter(void *fn, void *call_site);
+void __cyg_profile_func_exit(void *fn, void *call_site);
+
+/* Functions recorded, sorted by self time, and the run's length in
+   ticks. Returns the count; *out stays valid until prof_begin(). */
+int prof_result(const struct prof_func *const **out, UINT64 *run_ticks);
+
+#endif /* PROFILE_H */
@@ -0,0 +1,212 @@
+/*
+ * progress.c — Throughput, ETA and latency tracking for long device I/O
+ *
+ * The rate is sampled over PROGRESS_WINDOW_MS windows and smoothed with
+ * an exponential moving average (new samples weigh 1/4), which follows
+ * a stick that slows down once its cache fills without jumping on every
+ * slow chunk. Chunk latency is the time between two progress_add()
+ * calls, so it includes whatever the caller does per chunk.
+ */
+
+#include "progress.h"
+#include "fs.h"
+#include "mem.h"
+#include "shim.h"
+#include "timer.h"
+#include "trace.h"
+
+#define MB (1024 * 1024)
+
+void progress_start(struct progress *p, const char *what, UINT64 total) {
+    mem_set(p, 0, sizeof(*p));
+    p->what = what;
+    p->total = total;
+    p->t_start = p->t_last = p->t_window = timer_ticks();
+}
+
+int progress_add(struct progress *p, UINT64 bytes) {
+    UINT64 now = timer_ticks();
+    UINT64 hz = timer_hz();
+
+    UINT64 lat = timer_ns(now - p->t_last);
+    if (p->chunks == 0 || lat < p->lat_min) p->lat_min = lat;
+    if (lat > p->lat_max) p->lat_max = lat;
+    p->t_last = now;
+    p->chunks++;
+    p->done += bytes;
+
+    UINT64 window = now - p->t_window;
+    if (window >= hz * PROGRESS_WINDOW_MS / 1000 && window > 0) {
+        UINT64 sample = (p->done - p->b_window) * hz / window;
+        p->rate = p->rate ? (p->rate * 3 + sample) / 4 : sample;
+        p->t_window = now;
+        p->b_window = p->done;
+    }
+
+    int due = p->t_draw == 0 || now - p->t_draw >= hz / PROGRESS_HZ ||
+              (p->total && p->done >= p->total);
+    if (due) p->t_draw = now;
+    return due;
+}
+
+UINT64 progress_rate(const struct progress *p) {
+    if (p->rate) return p->rate;
+    UINT64 elapsed = p->t_last - p->t_start;
+    return elapsed ? p->done * timer_hz() / elapsed : 0;
+}
+
+INT64 progress_eta(const struct progress *p) {
+    UINT64 rate = progress_rate(p);
+    if (!p->total || !rate) return -1;
+    if (p->done >= p->total) return 0;
+    return (INT64)((p->total - p->done + rate - 1) / rate);
+}
+
+UINT64 progress_elapsed_ms(const struct progress *p) {
+    return timer_us(timer_ticks() - p->t_start) / 1000;
+}
+
+/* Tenths of a MB per second */
+static UINT64 rate_tenths(const struct progress *p) {
+    return progress_rate(p) * 10 / MB;
+}
+
+int progress_line(const struct progress *p, char *buf, UINTN size) {
+    UINT64 r = rate_tenths(p);
+    int n;
+    if (p->total) {
+        int pct = (int)(p->done * 100 / p->total);
+        n = snprintf(buf, size, "%s: %llu MB / %llu MB (%d%%)  %llu.%llu MB/s",
+                     p->what, (unsigned long long)(p->done / MB),
+                     (unsigned long long)(p->total / MB), pct,
+                     (unsigned long long)(r / 10), (unsigned long long)(r % 10));
+    } else {
+        n = snprintf(buf, size, "%s: %llu MB  %llu.%llu MB/s",
+                     p->what, (unsigned long long)(p->done / MB),
+                     (unsigned long long)(r / 10), (unsigned long long)(r % 10));
+    }
+    if (n < 0 || (UINTN)n >= size) return (int)str_len((CHAR8 *)buf);
+
+    INT64 eta = progress_eta(p);
+    if (eta > 0) {
+        int m;
+        if (eta >= 3600)
+            m = snprintf(buf + n, size - n, "  ETA %d:%02d:%02d", (int)(eta / 3600),
+                         (int)(eta / 60 % 60), (int)(eta % 60));
+        else
+            m = snprintf(buf + n, size - n, "  ETA %d:%02d", (int)(eta / 60),
+                         (int)(eta % 60));
+        if (m > 0 && (UINTN)(n + m) < size) n += m;
+    }
+    return n;
+}
+
+int progress_summary(const struct progress *p, char *buf, UINTN size) {
+    UINT64 r = rate_tenths(p);
+    UINT64 ms = timer_us(p->t_last - p->t_start) / 1000;
+    return snprintf(buf, size, "average %llu.%llu MB/s over %llu.%llu s, chunks %llu-%llu ms",
+                    (unsigned long long)(r / 10), (unsigned long long)(r % 10),
+                    (unsigned long long)(ms / 1000),
+                    (unsigned long long)(ms / 100 % 10),
+                    (unsigned long long)(p->lat_min / 1000000),
+                    (unsigned long long)(p->lat_max / 1000000));
+}
+
+int progress_size(UINT64 bytes, char *buf, UINTN size) {
+    if (bytes < 1024)
+        return snprintf(buf, size, "%llu B", (unsigned long long)bytes);
+    if (bytes < MB)
+        return snprintf(buf, size, "%llu KB", (unsigned long long)(bytes / 1024));
+    return snprintf(buf, size, "%llu MB", (unsigned long long)(bytes / MB));
+}
+
+/* The firmware vendor as ASCII */
+static void firmware_name(char *out, UINTN size) {
+    const CHAR16 *v = g_boot.st ? g_boot.st->FirmwareVendor : NULL;
+    UINTN i = 0;
+    while (v && v[i] && i + 1 < size) {
+        out[i] = (v[i] >= 0x20 && v[i] < 0x7F) ? (char)v[i] : '?';
+        i++;
+    }
+    out[i] = '\0';
+}
+
+int progress_log(const struct progress *p, const char *detail, int ok) {
+    char line[512], fw[64];
+    firmware_name(fw, sizeof(fw));
+    time_t now = time(NULL);
+    struct tm *t = localtime(&now);
+    UINT64 r = rate_tenths(p);
+    UINT64 ms = timer_us(p->t_last - p->t_start) / 1000;
+    int n = snprintf(line, sizeof(line),
+        "%04d-%02d-%02d %02d:%02d:%02d %s %s: %llu bytes in %llu.%03llu s, "
+        "%llu.%llu MB/s, %u chunks %llu-%llu us, fw %s %08x, %s\r\n",
+        t->tm_year + 1900, t->tm_mon + 1, t->tm_mday,
+        t->tm_hour, t->tm_min, t->tm_sec, p->what, detail,
+        (unsigned long long)p->done, (unsigned long long)(ms / 1000),
+        (unsigned long long)(ms % 1000),
+        (unsigned long long)(r / 10), (unsigned long long)(r % 10),
+        p->chunks, (unsigned long long)(p->lat_min / 1000),
+        (unsigned long long)(p->lat_max / 1000), fw,
+        g_boot.st ? (unsigned)g_boot.st->FirmwareRevision : 0u,
+        ok ? "ok" : "FAILED");
+    if (n <= 0) return -1;
+    if ((UINTN)n >= sizeof(line)) n = sizeof(line) - 1;
+    trace_mark(ok ? "io" : "io-failed", p->done, ms, p->what);
+    return progress_append(PROGRESS_LOG, NULL, line, (UINTN)n, PROGRESS_LOG_MAX);
+}
+
+int progress_append(const CHAR16 *path, const char *header,
+                    const char *text, UINTN len, UINTN max) {
+    EFI_FILE_HANDLE root = fs_get_boot_root();
+    if (!root) return -1;
+    UINTN hlen = header ? str_len((const CHAR8 *)header) : 0;
+    if (hlen + len > max) return -1;
+
+    /* Keep the newest lines: what fits besides the header and text */
+    char *buf = (char *)mem_alloc_raw(max);
+    if (!buf) return -1;
+    mem_copy(buf, header, hlen);
+    UINTN keep = 0;
+    UINT64 size = 0;
+    struct fs_file *f = fs_open_read(root, path, &size);
+    if (f) {
+        UINT64 room = max - hlen - len;
+        UINT64 skip = size > room ? size - room : 0;
+        UINTN want = (UINTN)(size - skip);
+        char *old = buf + hlen;
+        if (fs_stream_seek(f, skip) == 0) {
+            while (keep < want) {
+                UINTN got = want - keep;
+                if (fs_stream_read(f, old + keep, &got) != 0 || got == 0) break;
+                keep += got;
+            }
+        }
+        fs_stream_close(f);
+
+        /* Start on a line boundary after dropping old lines, and drop
+           the old copy of the header */
+        UINTN s = 0;
+        if (skip && keep) {
+            while (s < keep && old[s] != '\n') s++;
+            s = s < keep ? s + 1 : keep;
+        } else if (hlen && keep >= hlen && mem_cmp(old, header, hlen) == 0) {
+            s = hlen;
+        }
+        if (s) {
+            mem_move(old, old + s, keep - s);
+            keep -= s;
+        }
+    }
+    keep += hlen;
+    mem_copy(buf + keep, text, len);
+
+    int rc = -1;
+    f = fs_open_write(root, path);
+    if (f) {
+        rc = fs_stream_write(f, buf, keep + len);
+        if (fs_stream_close(f) != 0) rc = -1;
+    }
+    mem_free(buf);
+    return rc;
+}
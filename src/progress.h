@@ -0,0 +1,73 @@
+/*
+ * progress.h — Throughput, ETA and latency tracking for long device I/O
+ *
+ * Callers report each chunk as it completes. The tracker keeps a moving
+ * average of the rate, the fastest and slowest chunk, and says when a
+ * redraw is due (at most PROGRESS_HZ times a second), so a status line
+ * costs nothing next to the I/O. A finished run can be appended to a
+ * log on the boot volume to compare sticks and firmware versions.
+ */
+#ifndef PROGRESS_H
+#define PROGRESS_H
+
+#include "boot.h"
+
+#define PROGRESS_HZ        10   /* redraws per second, at most */
+#define PROGRESS_WINDOW_MS 500  /* rate sample length */
+
+/* Appended to by progress_log(), on the boot volume */
+#define PROGRESS_LOG     L"\\SURVIVAL.LOG"
+#define PROGRESS_LOG_MAX (64 * 1024)    /* older lines are dropped past this */
+
+struct progress {
+    const char *what;           /* "Writing"; may be changed between calls */
+    UINT64 total;               /* bytes expected, 0 if unknown */
+    UINT64 done;
+    UINT32 chunks;
+    UINT64 t_start, t_last, t_draw;     /* timer ticks */
+    UINT64 t_window, b_window;          /* start of the current sample */
+    UINT64 rate;                /* bytes/s, moving average */
+    UINT64 lat_min, lat_max;    /* ns per chunk */
+};
+
+void progress_start(struct progress *p, const char *what, UINT64 total);
+
+/* Count a finished chunk of bytes. Returns 1 when the display should be
+   redrawn: the first time, after 1/PROGRESS_HZ s, and at the total. */
+int progress_add(struct progress *p, UINT64 bytes);
+
+/* Bytes per second: the moving average once a sample has been taken,
+   the mean so far before */
+UINT64 progress_rate(const struct progress *p);
+
+/* Seconds left at the current rate, or -1 if not known */
+INT64 progress_eta(const struct progress *p);
+
+/* Milliseconds since progress_start() */
+UINT64 progress_elapsed_ms(const struct progress *p);
+
+/* "Writing: 120 MB / 3900 MB (3%)  21.4 MB/s  ETA 2:56". Returns the
+   length. */
+int progress_line(const struct progress *p, char *buf, UINTN size);
+
+/* "average 21.4 MB/s over 182 s, chunks 12-840 ms" */
+int progress_summary(const struct progress *p, char *buf, UINTN size);
+
+/* "512 B", "12 KB", "3900 MB": a size in whole units, as the file lists
+   show it. Returns the length. */
+int progress_size(UINT64 bytes, char *buf, UINTN size);
+
+/* Append one line for a finished run: local time, what, detail (e.g.
+   file and device), totals, rate, chunk latency, firmware and whether
+   it succeeded. Returns 0 on success. Never call it while the boot
+   volume may be gone (an ISO written over the boot device). */
+int progress_log(const struct progress *p, const char *detail, int ok);
+
+/* Append len bytes of text to a file on the boot volume, dropping the
+   oldest lines to stay within max bytes. A header (NULL for none) is
+   kept as the first line, written when the file is new. Returns 0 on
+   success; the same caveat as progress_log() applies. */
+int progress_append(const CHAR16 *path, const char *header,
+                    const char *text, UINTN len, UINTN max);
+
+#endif /* PROGRESS_H */
@@ -0,0 +1,110 @@
+/*
+ * ramdisk.c — Sparse block store in memory
+ *
+ * A table of chunk pointers covers the whole store; a NULL entry reads
+ * as zeros.  Chunks are whole pages from mem_alloc_pages(), which come
+ * back zeroed, so writes of zeros to an absent chunk need no memory.
+ */
+
+#include "ramdisk.h"
+#include "mem.h"
+
+#define CHUNK_BLOCKS (RAMDISK_CHUNK / RAMDISK_BLOCK)
+
+struct ramdisk {
+    UINT64 blocks;
+    UINT32 nchunks;
+    UINT32 used;            /* chunks allocated */
+    UINT8 **chunks;
+};
+
+struct ramdisk *ramdisk_create(UINT64 size) {
+    UINT64 n = size / RAMDISK_CHUNK;
+    if (n == 0 || n > 0xFFFFFFFFULL)
+        return NULL;
+    struct ramdisk *rd = (struct ramdisk *)mem_alloc(sizeof(*rd));
+    if (!rd)
+        return NULL;
+    rd->chunks = (UINT8 **)mem_alloc((UINTN)n * sizeof(UINT8 *));
+    if (!rd->chunks) {
+        mem_free(rd);
+        return NULL;
+    }
+    rd->nchunks = (UINT32)n;
+    rd->blocks = n * CHUNK_BLOCKS;
+    return rd;
+}
+
+void ramdisk_destroy(struct ramdisk *rd) {
+    if (!rd)
+        return;
+    for (UINT32 i = 0; i < rd->nchunks; i++)
+        mem_free_pages(rd->chunks[i], RAMDISK_CHUNK);
+    mem_free(rd->chunks);
+    mem_free(rd);
+}
+
+static int all_zero(const UINT8 *p, UINTN len) {
+    const UINT64 *q = (const UINT64 *)p;
+    for (UINTN i = 0; i < len / 8; i++)
+        if (q[i])
+            return 0;
+    return 1;
+}
+
+/* Both callbacks split a request at chunk boundaries */
+int ramdisk_read(void *ctx, UINT64 lba, UINT32 count, void *buf) {
+    struct ramdisk *rd = (struct ramdisk *)ctx;
+    if (lba > rd->blocks || count > rd->blocks - lba)
+        return -1;
+    UINT8 *dst = (UINT8 *)buf;
+    while (count > 0) {
+        UINT32 ci = (UINT32)(lba / CHUNK_BLOCKS);
+        UINT32 first = (UINT32)(lba % CHUNK_BLOCKS);
+        UINT32 n = CHUNK_BLOCKS - first;
+        if (n > count) n = count;
+        UINTN len = (UINTN)n * RAMDISK_BLOCK;
+        if (rd->chunks[ci])
+            mem_copy(dst, rd->chunks[ci] + (UINTN)first * RAMDISK_BLOCK, len);
+        else
+            mem_set(dst, 0, len);
+        dst += len;
+        lba += n;
+        count -= n;
+    }
+    return 0;
+}
+
+int ramdisk_write(void *ctx, UINT64 lba, UINT32 count, const void *buf) {
+    struct ramdisk *rd = (struct ramdisk *)ctx;
+    if (lba > rd->blocks || count > rd->blocks - lba)
+        return -1;
+    const UINT8 *src = (const UINT8 *)buf;
+    while (count > 0) {
+        UINT32 ci = (UINT32)(lba / CHUNK_BLOCKS);
+        UINT32 first = (UINT32)(lba % CHUNK_BLOCKS);
+        UINT32 n = CHUNK_BLOCKS - first;
+        if (n > count) n = count;
+        UINTN len = (UINTN)n * RAMDISK_BLOCK;
+        if (!rd->chunks[ci] && !all_zero(src, len)) {
+            rd->chunks[ci] = (UINT8 *)mem_alloc_pages(RAMDISK_CHUNK);
+            if (!rd->chunks[ci])
+                return -1;
+            rd->used++;
+        }
+        if (rd->chunks[ci])
+            mem_copy(rd->chunks[ci] + (UINTN)first * RAMDISK_BLOCK, src, len);
+        src += len;
+        lba += n;
+        count -= n;
+    }
+    return 0;
+}
+
+UINT64 ramdisk_size(const struct ramdisk *rd) {
+    return rd->blocks * RAMDISK_BLOCK;
+}
+
+UINT64 ramdisk_used(const struct ramdisk *rd) {
+    return (UINT64)rd->used * RAMDISK_CHUNK;
+}
@@ -0,0 +1,36 @@
+/*
+ * ramdisk.h — Sparse block store in memory, backing the RAM disk volume
+ *
+ * Presents the block-read/write callbacks of the portable filesystem
+ * drivers over RAM: fs.c formats it as exFAT and mounts it like any
+ * other device.  Memory is taken in large chunks the first time one is
+ * written with anything but zeros, so a big RAM disk costs only what
+ * its files occupy.
+ */
+#ifndef RAMDISK_H
+#define RAMDISK_H
+
+#include "boot.h"
+
+#define RAMDISK_BLOCK  4096                /* block size of the store */
+#define RAMDISK_CHUNK  (2 * 1024 * 1024)   /* allocation unit */
+
+struct ramdisk;
+
+/* A store of size bytes (rounded down to whole chunks), all zeros and
+   holding no memory yet. Returns NULL on error. */
+struct ramdisk *ramdisk_create(UINT64 size);
+
+/* Free the store and every chunk in it */
+void ramdisk_destroy(struct ramdisk *rd);
+
+/* Block I/O callbacks; ctx is the ramdisk. A write fails when a chunk
+   cannot be allocated. Return 0 on success, -1 on error. */
+int ramdisk_read(void *ctx, UINT64 lba, UINT32 count, void *buf);
+int ramdisk_write(void *ctx, UINT64 lba, UINT32 count, const void *buf);
+
+/* Size of the store, and bytes of it backed by memory */
+UINT64 ramdisk_size(const struct ramdisk *rd);
+UINT64 ramdisk_used(const struct ramdisk *rd);
+
+#endif /* RAMDISK_H */
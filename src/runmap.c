@@ -0,0 +1,128 @@
+/*
+ * runmap.c — Cluster runs shared by the FAT32 and exFAT drivers
+ *
+ * A fragmented file has few runs even when it has millions of clusters,
+ * so the map stays small; it starts at 16 runs and doubles.  Used
+ * clusters are passed on a run at a time, not one call per cluster.
+ */
+
+#include "runmap.h"
+#ifndef ESP_PLATFORM
+#include "mem.h"
+#endif
+
+#define RUN_MAP_FIRST 16
+
+int run_map_init(struct run_map *m)
+{
+    m->runs = (struct file_run *)mem_alloc(RUN_MAP_FIRST * sizeof(*m->runs));
+    m->nruns = 0;
+    m->cap = m->runs ? RUN_MAP_FIRST : 0;
+    m->cur = 0;
+    m->failed = !m->runs;
+    return m->runs ? 0 : -1;
+}
+
+int run_map_add(struct run_map *m, UINT32 cluster)
+{
+    struct file_run *last = m->nruns ? &m->runs[m->nruns - 1] : 0;
+    if (last && last->cluster + last->count == cluster) {
+        last->count++;
+        return 0;
+    }
+    if (m->nruns == m->cap) {
+        struct file_run *bigger =
+            (struct file_run *)mem_alloc(m->cap * 2 * sizeof(*m->runs));
+        if (!bigger) {
+            run_map_free(m);
+            m->failed = 1;
+            return -1;
+        }
+        mem_copy(bigger, m->runs, m->nruns * sizeof(*m->runs));
+        mem_free(m->runs);
+        m->runs = bigger;
+        m->cap *= 2;
+        last = m->nruns ? &m->runs[m->nruns - 1] : 0;
+    }
+    struct file_run *r = &m->runs[m->nruns++];
+    r->index = last ? last->index + last->count : 0;
+    r->cluster = cluster;
+    r->count = 1;
+    return 0;
+}
+
+int run_map_seek(struct run_map *m, UINT64 idx, UINT32 *cluster)
+{
+    /* The last run starting at or before the wanted cluster */
+    UINT32 lo = 0, hi = m->nruns;
+    while (hi - lo > 1) {
+        UINT32 mid = (lo + hi) / 2;
+        if (m->runs[mid].index <= idx)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    if (m->nruns == 0 || idx - m->runs[lo].index >= m->runs[lo].count)
+        return -1;
+    const struct file_run *r = &m->runs[lo];
+    m->cur = lo;
+    *cluster = r->cluster + (UINT32)(idx - r->index);
+    return 0;
+}
+
+UINT32 run_map_left(const struct run_map *m, UINT32 cluster)
+{
+    if (!m->runs || m->nruns == 0)
+        return 0;
+    const struct file_run *r = &m->runs[m->cur];
+    return r->count - (cluster - r->cluster);
+}
+
+void run_map_free(struct run_map *m)
+{
+    if (m->runs)
+        mem_free(m->runs);
+    m->runs = 0;
+    m->nruns = m->cap = m->cur = 0;
+}
+
+int used_runs_init(struct used_runs *u, fs_run_fn fn, void *ctx,
+                   UINT32 bytes_per_sector, UINT32 dev_block_size,
+                   UINT64 heap, UINT32 spc)
+{
+    if (dev_block_size == 0 || bytes_per_sector % dev_block_size)
+        return -1;
+    u->fn = fn;
+    u->ctx = ctx;
+    u->per = bytes_per_sector / dev_block_size;
+    u->heap = heap;
+    u->spc = spc;
+    u->start = u->len = 0;
+    return 0;
+}
+
+int used_runs_sectors(struct used_runs *u, UINT64 sector, UINT64 count)
+{
+    return count ? u->fn(u->ctx, sector * u->per, count * u->per) : 0;
+}
+
+int used_runs_end(struct used_runs *u)
+{
+    UINT32 len = u->len;
+    u->len = 0;
+    return used_runs_sectors(u, u->heap + (UINT64)(u->start - 2) * u->spc,
+                             (UINT64)len * u->spc);
+}
+
+int used_runs_clusters(struct used_runs *u, UINT32 cl, UINT32 count,
+                       int used)
+{
+    if (u->len && (!used || u->start + u->len != cl) && used_runs_end(u))
+        return -1;
+    if (used) {
+        if (!u->len)
+            u->start = cl;
+        u->len += count;
+    }
+    return 0;
+}
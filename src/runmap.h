@@ -0,0 +1,80 @@
+/*
+ * runmap.h — Cluster runs shared by the FAT32 and exFAT drivers
+ *
+ * Portable: no UEFI dependency, so the ESP32 build of exFAT links it
+ * too.  A file's cluster chain is kept as runs of consecutive clusters,
+ * built once by the driver's chain walk, so a seek is a binary search
+ * and a read knows how far the clusters stay contiguous.  The clusters
+ * a volume uses are gathered into runs the same way for the drivers'
+ * *_used_runs().
+ */
+#ifndef RUNMAP_H
+#define RUNMAP_H
+
+#ifdef ESP_PLATFORM
+#include "fs_port.h"
+#else
+#include "boot.h"
+#include "fs.h"
+#endif
+
+/* A stretch of a file on consecutive clusters */
+struct file_run {
+    UINT32 index;                /* file cluster number of the first */
+    UINT32 cluster;
+    UINT32 count;
+};
+
+struct run_map {
+    struct file_run *runs;       /* NULL: not mapped */
+    UINT32 nruns, cap;
+    UINT32 cur;                  /* run of the last run_map_seek() */
+    int    failed;               /* out of memory: walk the chain */
+};
+
+/* Start an empty map. Returns 0, -1 when out of memory (failed set). */
+int run_map_init(struct run_map *m);
+
+/* Append the file's next cluster: it extends the last run when it
+   follows it on disk. Returns 0, -1 when out of memory (the map is
+   freed and failed set). */
+int run_map_add(struct run_map *m, UINT32 cluster);
+
+/* The cluster holding file cluster idx into *cluster, its run becoming
+   the current one. Returns 0, -1 if the map ends before idx. */
+int run_map_seek(struct run_map *m, UINT64 idx, UINT32 *cluster);
+
+/* Clusters from cluster (in the current run) to the end of that run;
+   0 without a map */
+UINT32 run_map_left(const struct run_map *m, UINT32 cluster);
+
+void run_map_free(struct run_map *m);
+
+/* Used sectors and clusters of a volume, passed to fn as runs of
+   device blocks */
+struct used_runs {
+    fs_run_fn fn;
+    void  *ctx;
+    UINT32 per;                  /* device blocks per sector */
+    UINT64 heap;                 /* sector of cluster 2 */
+    UINT32 spc;                  /* sectors per cluster */
+    UINT32 start, len;           /* the cluster run being gathered */
+};
+
+/* Returns -1 if a sector is not a whole number of device blocks */
+int used_runs_init(struct used_runs *u, fs_run_fn fn, void *ctx,
+                   UINT32 bytes_per_sector, UINT32 dev_block_size,
+                   UINT64 heap, UINT32 spc);
+
+/* Sectors [sector, sector+count) are in use (boot region, FATs) */
+int used_runs_sectors(struct used_runs *u, UINT64 sector, UINT64 count);
+
+/* Clusters [cl, cl+count) are all in use or all free; called in
+   cluster order, so runs of used ones go to fn whole */
+int used_runs_clusters(struct used_runs *u, UINT32 cl, UINT32 count,
+                       int used);
+
+/* Pass on the run still being gathered */
+int used_runs_end(struct used_runs *u);
+
+#endif /* RUNMAP_H */
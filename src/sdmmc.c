@@ -0,0 +1,395 @@
+/*
+ * sdmmc.c — Amlogic SD_EMMC (S905X) SD card driver with DMA descriptor chains
+ *
+ * The controller runs a chain of 16-byte descriptors from memory: the
+ * first issues the command with the first stretch of data, the rest
+ * (NO_CMD) carry on its data phase, each DMAing up to 511 blocks to or
+ * from its own address. Completion is polled on the status register.
+ * Reads and writes are READ/WRITE_MULTIPLE_BLOCK chains closed with
+ * STOP_TRANSMISSION; the card is U-Boot's, already in the transfer
+ * state, so no command here needs its RCA.
+ *
+ * DMA is not coherent with the CPU caches on these SoCs: buffers are
+ * cleaned before a write and cleaned and invalidated around a read
+ * (dcache_* in memops_aarch64.c), and the media's IoAlign is a cache
+ * line so disk_bio_* bounce anything that would share one.
+ */
+
+#include "sdmmc.h"
+#include "mem.h"
+#include "timer.h"
+
+#ifdef __aarch64__
+
+void dcache_clean(const void *p, UINTN len);
+void dcache_flush(const void *p, UINTN len);
+
+/* Registers (Linux drivers/mmc/host/meson-gx-mmc.c) */
+#define SD_EMMC_CLOCK   0x00
+#define   CLK_DIV_MASK      0x3fu
+#define   CLK_SRC_SHIFT     6
+#define   CLK_SRC_MASK      (3u << 6)
+#define   CLK_SRC_XTAL      0           /* 24 MHz */
+#define   CLK_SRC_DIV2      1           /* fclk_div2, 1 GHz */
+#define SD_EMMC_START   0x40
+#define   START_DESC_BUSY   (1u << 1)
+#define SD_EMMC_CFG     0x44
+#define   CFG_BLK_LEN_SHIFT 4
+#define   CFG_BLK_LEN_MASK  (0xfu << 4)
+#define SD_EMMC_STATUS  0x48
+#define   STATUS_ERRORS     0x1fffu     /* CRC, timeouts, descriptor */
+#define   STATUS_END_OF_CHAIN (1u << 13)
+#define   STATUS_CLEAR      0xffffu
+#define   STATUS_DAT0       (1u << 16)  /* low while the card is busy */
+#define   STATUS_BUSY       (1u << 31)
+#define SD_EMMC_CMD_RSP 0x5c
+
+/* Descriptor cmd_cfg */
+#define CMD_CFG_BLOCK_MODE   (1u << 9)
+#define CMD_CFG_R1B          (1u << 10)
+#define CMD_CFG_END_OF_CHAIN (1u << 11)
+#define CMD_CFG_TIMEOUT_SHIFT 12        /* 2^n ms */
+#define CMD_CFG_NO_RESP      (1u << 16)
+#define CMD_CFG_NO_CMD       (1u << 17)
+#define CMD_CFG_DATA_IO      (1u << 18)
+#define CMD_CFG_DATA_WR      (1u << 19)
+#define CMD_CFG_RESP_NUM     (1u << 22)
+#define CMD_CFG_CMD_SHIFT    24
+#define CMD_CFG_OWNER        (1u << 31)
+
+struct sd_desc {
+    UINT32 cmd_cfg;
+    UINT32 cmd_arg;
+    UINT32 cmd_data;
+    UINT32 cmd_resp;
+};
+
+#define SD_SWITCH_FUNC      6
+#define SD_STOP_TRANSMISSION 12
+#define SD_READ_SINGLE      17
+#define SD_READ_MULTIPLE    18
+#define SD_WRITE_SINGLE     24
+#define SD_WRITE_MULTIPLE   25
+
+/* Card status error bits of an R1 response */
+#define R1_ERRORS 0xfcf80000u
+
+#define RSP_NONE 0
+#define RSP_R1   1
+#define RSP_R1B  2
+
+struct sdmmc {
+    EFI_BLOCK_IO        bio;    /* first: This points here */
+    EFI_BLOCK_IO_MEDIA  media;
+    EFI_BLOCK_IO       *fw;     /* the firmware's, for what DMA can't reach */
+    EFI_HANDLE          handle;
+    struct sd_desc     *desc;   /* SDMMC_DESCS, page memory */
+    UINT8              *probe;  /* page memory for checks and CMD6 */
+};
+
+#define PROBE_BYTES 8192
+
+static struct sdmmc *s_sd;
+
+static volatile UINT32 *reg(UINT32 off) {
+    return (volatile UINT32 *)(UINTN)(SDMMC_BASE + off);
+}
+
+static UINT64 ms_to_ticks(UINT64 ms) {
+    return timer_hz() / 1000 * ms;
+}
+
+/* Controller idle and DAT0 released by the card */
+static int wait_ready(void) {
+    UINT64 end = timer_ticks() + ms_to_ticks(SDMMC_TIMEOUT_MS);
+    for (;;) {
+        UINT32 st = *reg(SD_EMMC_STATUS);
+        if (!(st & STATUS_BUSY) && (st & STATUS_DAT0)) return 0;
+        if (timer_ticks() > end) return -1;
+    }
+}
+
+static UINT32 log2_of(UINT32 v) {
+    UINT32 n = 0;
+    while (v > 1) { v >>= 1; n++; }
+    return n;
+}
+
+/* Run one command, with blocks of blksz bytes in or out of buf when
+   blocks > 0, as a descriptor chain. 0 on success (R1 error bits clear) */
+static int sd_cmd(struct sdmmc *m, UINT32 op, UINT32 arg, int rsp, int write,
+                  UINT8 *buf, UINT32 blocks, UINT32 blksz) {
+    UINT32 cfg = CMD_CFG_OWNER | (op << CMD_CFG_CMD_SHIFT);
+    UINTN bytes = (UINTN)blocks * blksz;
+    int n = 1;
+
+    if (rsp == RSP_NONE) cfg |= CMD_CFG_NO_RESP;
+    else cfg |= CMD_CFG_RESP_NUM | (rsp == RSP_R1B ? CMD_CFG_R1B : 0);
+    cfg |= (blocks ? 12u : 10u) << CMD_CFG_TIMEOUT_SHIFT;
+
+    if (wait_ready() != 0) return -1;
+
+    if (blocks) {
+        UINT32 c = *reg(SD_EMMC_CFG);
+        UINT32 bl = log2_of(blksz) << CFG_BLK_LEN_SHIFT;
+        if ((c & CFG_BLK_LEN_MASK) != bl)
+            *reg(SD_EMMC_CFG) = (c & ~CFG_BLK_LEN_MASK) | bl;
+        cfg |= CMD_CFG_DATA_IO | CMD_CFG_BLOCK_MODE |
+               (write ? CMD_CFG_DATA_WR : 0);
+        n = 0;
+        for (UINT32 done = 0; done < blocks; n++) {
+            UINT32 len = blocks - done;
+            if (len > SDMMC_DESC_BLOCKS) len = SDMMC_DESC_BLOCKS;
+            m->desc[n].cmd_cfg = cfg | len | (n ? CMD_CFG_NO_CMD : 0);
+            m->desc[n].cmd_arg = arg;
+            m->desc[n].cmd_data = (UINT32)(UINTN)(buf + (UINTN)done * blksz);
+            m->desc[n].cmd_resp = 0;
+            done += len;
+        }
+        if (write) dcache_clean(buf, bytes);
+        else dcache_flush(buf, bytes);
+    } else {
+        m->desc[0].cmd_cfg = cfg;
+        m->desc[0].cmd_arg = arg;
+        m->desc[0].cmd_data = 0;
+        m->desc[0].cmd_resp = 0;
+    }
+    m->desc[n - 1].cmd_cfg |= CMD_CFG_END_OF_CHAIN;
+    dcache_clean(m->desc, n * sizeof(struct sd_desc));
+
+    *reg(SD_EMMC_STATUS) = STATUS_CLEAR;
+    *reg(SD_EMMC_START) = (UINT32)(UINTN)m->desc | START_DESC_BUSY;
+
+    UINT64 end = timer_ticks() + ms_to_ticks(SDMMC_TIMEOUT_MS);
+    UINT32 st;
+    for (;;) {
+        st = *reg(SD_EMMC_STATUS);
+        if (st & (STATUS_END_OF_CHAIN | STATUS_ERRORS)) break;
+        if (timer_ticks() > end) { st = STATUS_ERRORS; break; }
+    }
+    *reg(SD_EMMC_STATUS) = STATUS_CLEAR;
+    if (blocks && !write) dcache_flush(buf, bytes);
+
+    if (st & STATUS_ERRORS) {
+        *reg(SD_EMMC_START) = 0;    /* abandon the rest of the chain */
+        return -1;
+    }
+    if (rsp != RSP_NONE && op != SD_STOP_TRANSMISSION &&
+        (*reg(SD_EMMC_CMD_RSP) & R1_ERRORS))
+        return -1;
+    return 0;
+}
+
+/* Whole blocks at lba: one multi-block command and its stop */
+static int sd_xfer(struct sdmmc *m, int write, UINT64 lba, UINT32 blocks,
+                   UINT8 *buf) {
+    UINT32 bs = m->media.BlockSize;
+    if (blocks == 1)
+        return sd_cmd(m, write ? SD_WRITE_SINGLE : SD_READ_SINGLE,
+                      (UINT32)lba, RSP_R1, write, buf, 1, bs);
+    int rc = sd_cmd(m, write ? SD_WRITE_MULTIPLE : SD_READ_MULTIPLE,
+                    (UINT32)lba, RSP_R1, write, buf, blocks, bs);
+    /* Stop even after an error: the card is left mid-transfer */
+    if (sd_cmd(m, SD_STOP_TRANSMISSION, 0, RSP_R1B, 0, NULL, 0, 0) != 0)
+        rc = -1;
+    return rc;
+}
+
+/* What the controller can DMA to: 32-bit addresses */
+static int dma_ok(const void *buf, UINTN size) {
+    return (UINT64)(UINTN)buf + size <= 0x100000000ULL;
+}
+
+static EFI_STATUS sdmmc_rw(struct sdmmc *m, UINT32 media_id, int write,
+                           EFI_LBA lba, UINTN size, UINT8 *buf) {
+    UINT32 bs = m->media.BlockSize;
+    if (media_id != m->media.MediaId) return EFI_MEDIA_CHANGED;
+    if (write && m->media.ReadOnly) return EFI_WRITE_PROTECTED;
+    if (size % bs) return EFI_BAD_BUFFER_SIZE;
+    if (!buf && size) return EFI_INVALID_PARAMETER;
+    if (lba > m->media.LastBlock ||
+        size / bs > m->media.LastBlock - lba + 1)
+        return EFI_INVALID_PARAMETER;
+    if (!dma_ok(buf, size) || ((UINTN)buf & (m->media.IoAlign - 1)))
+        return write ? m->fw->WriteBlocks(m->fw, m->fw->Media->MediaId,
+                                          lba, size, buf)
+                     : m->fw->ReadBlocks(m->fw, m->fw->Media->MediaId,
+                                         lba, size, buf);
+
+    const UINT32 max = SDMMC_DESC_BLOCKS * SDMMC_DESCS;
+    while (size > 0) {
+        UINT32 blocks = size / bs > max ? max : (UINT32)(size / bs);
+        if (sd_xfer(m, write, lba, blocks, buf) != 0) return EFI_DEVICE_ERROR;
+        lba += blocks;
+        buf += (UINTN)blocks * bs;
+        size -= (UINTN)blocks * bs;
+    }
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI sdmmc_read(EFI_BLOCK_IO *This, UINT32 media_id,
+                                    EFI_LBA lba, UINTN size, VOID *buf) {
+    return sdmmc_rw((struct sdmmc *)This, media_id, 0, lba, size, buf);
+}
+
+static EFI_STATUS EFIAPI sdmmc_write(EFI_BLOCK_IO *This, UINT32 media_id,
+                                     EFI_LBA lba, UINTN size, VOID *buf) {
+    return sdmmc_rw((struct sdmmc *)This, media_id, 1, lba, size, buf);
+}
+
+/* Writes are complete once the card releases DAT0 */
+static EFI_STATUS EFIAPI sdmmc_flush(EFI_BLOCK_IO *This) {
+    (void)This;
+    return wait_ready() == 0 ? EFI_SUCCESS : EFI_DEVICE_ERROR;
+}
+
+static EFI_STATUS EFIAPI sdmmc_reset(EFI_BLOCK_IO *This, BOOLEAN extended) {
+    struct sdmmc *m = (struct sdmmc *)This;
+    return m->fw->Reset(m->fw, extended);
+}
+
+/* The firmware's device tree describes a meson-gx SD controller */
+static int dt_has_meson_mmc(void) {
+    EFI_GUID dtb_guid = EFI_DTB_TABLE_GUID;
+    EFI_CONFIGURATION_TABLE *t = g_boot.st->ConfigurationTable;
+    static const char compat[] = "amlogic,meson-gx-mmc";
+    for (UINTN i = 0; i < g_boot.st->NumberOfTableEntries; i++) {
+        if (mem_cmp(&t[i].VendorGuid, &dtb_guid, sizeof(EFI_GUID)) != 0)
+            continue;
+        const UINT8 *fdt = (const UINT8 *)t[i].VendorTable;
+        if (!fdt || fdt[0] != 0xd0 || fdt[1] != 0x0d || fdt[2] != 0xfe ||
+            fdt[3] != 0xed)
+            return 0;
+        UINT32 size = ((UINT32)fdt[4] << 24) | ((UINT32)fdt[5] << 16) |
+                      ((UINT32)fdt[6] << 8) | fdt[7];
+        return mem_find(fdt, size, compat, sizeof(compat) - 1) != NULL;
+    }
+    return 0;
+}
+
+/* The device path ends in an SD node (messaging, subtype 0x1a) */
+static int path_is_sd(EFI_HANDLE h) {
+    EFI_GUID dp_guid = { 0x9576e91, 0x6d3f, 0x11d2,
+        {0x8e, 0x39, 0x0, 0xa0, 0xc9, 0x69, 0x72, 0x3b} };
+    EFI_DEVICE_PATH *dp = NULL, *last = NULL;
+    if (EFI_ERROR(g_boot.bs->HandleProtocol(h, &dp_guid, (void **)&dp)) || !dp)
+        return 0;
+    while (dp->Type != 0x7f) {
+        UINTN len = dp->Length[0] | ((UINTN)dp->Length[1] << 8);
+        if (len < 4) return 0;
+        last = dp;
+        dp = (EFI_DEVICE_PATH *)((UINT8 *)dp + len);
+    }
+    return last && last->Type == 3 && last->SubType == 0x1a;
+}
+
+/* Our read of PROBE_BYTES at lba matches the firmware's */
+static int check_read(struct sdmmc *m, UINT64 lba) {
+    UINT8 *ours = m->probe, *theirs = m->probe + PROBE_BYTES;
+    UINT32 bs = m->media.BlockSize;
+    if (EFI_ERROR(m->fw->ReadBlocks(m->fw, m->fw->Media->MediaId, lba,
+                                    PROBE_BYTES, theirs)))
+        return -1;
+    mem_set(ours, 0xa5, PROBE_BYTES);
+    if (sd_xfer(m, 0, lba, PROBE_BYTES / bs, ours) != 0) return -1;
+    return mem_cmp(ours, theirs, PROBE_BYTES) == 0 ? 0 : -1;
+}
+
+static int check_reads(struct sdmmc *m) {
+    UINT64 last = m->media.LastBlock + 1 - PROBE_BYTES / m->media.BlockSize;
+    return check_read(m, 0) == 0 && check_read(m, last / 2) == 0 &&
+           check_read(m, last) == 0 ? 0 : -1;
+}
+
+static UINT32 bus_hz(UINT32 clock) {
+    UINT32 div = clock & CLK_DIV_MASK;
+    UINT32 src = (clock & CLK_SRC_MASK) >> CLK_SRC_SHIFT;
+    if (!div) return 0;
+    return (src == CLK_SRC_DIV2 ? 1000000000u : 24000000u) / div;
+}
+
+/* A card left at default speed (25 MHz or less) goes to High Speed if
+   CMD6 says it can; the controller is put back if reads then differ */
+static void try_high_speed(struct sdmmc *m) {
+    UINT32 clock = *reg(SD_EMMC_CLOCK);
+    if (bus_hz(clock) > 25000000u) return;
+
+    UINT8 *st = m->probe;
+    if (sd_cmd(m, SD_SWITCH_FUNC, 0x00fffff1u, RSP_R1, 0, st, 1, 64) != 0 ||
+        !(st[13] & 0x02))
+        return;
+    if (sd_cmd(m, SD_SWITCH_FUNC, 0x80fffff1u, RSP_R1, 0, st, 1, 64) != 0 ||
+        (st[16] & 0x0f) != 1)
+        return;
+
+    UINT32 div = (1000000000u + SDMMC_HS_HZ - 1) / SDMMC_HS_HZ;
+    *reg(SD_EMMC_CLOCK) = (clock & ~(CLK_DIV_MASK | CLK_SRC_MASK)) |
+                          (CLK_SRC_DIV2 << CLK_SRC_SHIFT) | div;
+    if (check_reads(m) != 0)
+        *reg(SD_EMMC_CLOCK) = clock;    /* the card copes with slower */
+}
+
+int sdmmc_attach(struct disk_device *dev) {
+    if (!dev || !dev->block_io || sdmmc_owns(dev->block_io)) return -1;
+    EFI_BLOCK_IO_MEDIA *fw = dev->block_io->Media;
+
+    /* SDSC cards (2 GB and under) take byte addresses: leave them be */
+    if (fw->BlockSize != 512 || fw->LastBlock < (2ULL << 30) / 512)
+        return -1;
+    if (!dt_has_meson_mmc() || !path_is_sd(dev->handle)) return -1;
+
+    struct sdmmc *m = s_sd;
+    if (!m) {
+        m = (struct sdmmc *)mem_alloc(sizeof(*m));
+        if (!m) return -1;
+        m->desc = (struct sd_desc *)mem_alloc_pages(4096);
+        m->probe = (UINT8 *)mem_alloc_pages(2 * PROBE_BYTES);
+        if (!m->desc || !m->probe || !dma_ok(m->desc, 4096) ||
+            !dma_ok(m->probe, 2 * PROBE_BYTES)) {
+            if (m->desc) mem_free_pages(m->desc, 4096);
+            if (m->probe) mem_free_pages(m->probe, 2 * PROBE_BYTES);
+            mem_free(m);
+            return -1;
+        }
+        s_sd = m;
+    }
+    m->fw = dev->block_io;
+    m->handle = dev->handle;
+    mem_set(&m->media, 0, sizeof(m->media));
+    mem_copy(&m->media, fw, (UINTN)&((EFI_BLOCK_IO_MEDIA *)0)->LowestAlignedLba);
+    if (m->media.IoAlign < 64) m->media.IoAlign = 64;
+
+    if (check_reads(m) != 0) return -1;
+    try_high_speed(m);
+
+    m->bio.Revision = 1;
+    m->bio.Media = &m->media;
+    m->bio.Reset = sdmmc_reset;
+    m->bio.ReadBlocks = sdmmc_read;
+    m->bio.WriteBlocks = sdmmc_write;
+    m->bio.FlushBlocks = sdmmc_flush;
+
+    mem_io_align(m->media.IoAlign);
+    dev->block_io = &m->bio;
+    dev->block_io2 = NULL;
+    dev->xfer_size = 0;
+    return 0;
+}
+
+int sdmmc_owns(EFI_BLOCK_IO *bio) {
+    return s_sd && bio == &s_sd->bio;
+}
+
+#else
+
+int sdmmc_attach(struct disk_device *dev) {
+    (void)dev;
+    return -1;
+}
+
+int sdmmc_owns(EFI_BLOCK_IO *bio) {
+    (void)bio;
+    return 0;
+}
+
+#endif
@@ -0,0 +1,40 @@
+/*
+ * sdmmc.h — Amlogic SD_EMMC (S905X) SD card driver with DMA descriptor chains
+ *
+ * U-Boot's EFI BlockIO on the S905X boards moves a microSD card's data
+ * one command at a time at whatever bus clock it set up. This driver
+ * takes the already initialised card over on the SD_EMMC_B controller
+ * (docs/bare-metal-roadmap.md): multi-block READ/WRITE_MULTIPLE_BLOCK
+ * commands of up to SDMMC_DESCS descriptors of SDMMC_DESC_BLOCKS each,
+ * with the data DMAed straight to and from the caller's buffer, and a
+ * CMD6 switch to High Speed (50 MHz) when the card was left at default
+ * speed. The result is presented as a BlockIO, so disk_* paths and the
+ * volumes fs.c mounts on the card's partitions use it unchanged.
+ *
+ * Built with SDMMC=1 (SDMMC_NATIVE defined) for AArch64, and only
+ * attaches when the firmware's device tree names the controller and
+ * the BlockIO's device path ends in an SD node. UHS modes (SDR50 and
+ * up) need the card switched to 1.8 V signalling at initialisation,
+ * which would mean re-initialising it under U-Boot: not done.
+ */
+#ifndef SDMMC_H
+#define SDMMC_H
+
+#include "disk.h"
+
+#define SDMMC_BASE        0xd0072000u   /* SD_EMMC_B, the microSD slot */
+#define SDMMC_DESC_BLOCKS 256     /* 128 KB per descriptor (field max 511) */
+#define SDMMC_DESCS       16      /* 2 MB per command */
+#define SDMMC_HS_HZ       50000000
+#define SDMMC_TIMEOUT_MS  5000    /* per command chain, and card busy */
+
+/* If dev is the microSD card on SD_EMMC_B, point dev->block_io at
+   this driver's BlockIO for it (dropping BlockIO2) and return 0. The
+   driver checks its reads against the firmware's before taking over;
+   -1 leaves dev alone. */
+int sdmmc_attach(struct disk_device *dev);
+
+/* Whether bio is this driver's */
+int sdmmc_owns(EFI_BLOCK_IO *bio);
+
+#endif /* SDMMC_H */
@@ -0,0 +1,544 @@
+/*
+ * search.c — Find files by name anywhere on a volume
+ *
+ * The index is one table of names, each with its directory's id, plus
+ * the directories' positions in it sorted by id: NTFS ids are MFT
+ * records, a walk numbers directories as it finds them, and either way
+ * they arrive in ascending order. A path is rebuilt from the parent
+ * ids only when a result is drawn or picked, so on NTFS a match whose
+ * directory the $MFT has not reached yet is still listed at once.
+ */
+
+#include "boot.h"
+#include "fb.h"
+#include "kbd.h"
+#include "mem.h"
+#include "fs.h"
+#include "ntfs.h"
+#include "timer.h"
+#include "progress.h"
+#include "search.h"
+#include "shim.h"
+
+#define SX_STEP_MS  30          /* scanning between looks at the keyboard */
+#define SX_DRAW_MS  100         /* redraws while scanning */
+#define SX_PATH_MAX 512
+#define SX_MAGIC    "SVSRCH1"   /* and its NUL: 8 bytes */
+
+struct sx_ent {
+    UINT64 id;                  /* a directory's own id */
+    UINT64 parent;              /* the id of the directory holding it */
+    UINT64 size;
+    UINT32 name;                /* offset in the name pool */
+    UINT32 is_dir;
+};
+
+/* SEARCH_INDEX: this, then the entries, the name pool and the
+   directory table */
+struct sx_header {
+    char   magic[8];
+    UINT32 count, pool_len, ndirs, reserved;
+    UINT64 root;
+};
+
+struct sx_index {
+    struct sx_ent *ents;
+    UINT32 count, cap;
+    char  *pool;
+    UINT32 pool_len, pool_cap;
+    UINT32 *dirs;               /* entries that are directories, by id */
+    UINT32 ndirs, dirs_cap;
+    UINT64 root;                /* the root directory's id */
+    UINT32 gen;                 /* fs_generation() it belongs to */
+    int    complete;            /* every name is in */
+    int    saved;               /* read from SEARCH_INDEX */
+
+    /* The scan under way */
+    struct ntfs_mft_scan *mft;
+    struct fs_dir *dir;         /* the directory being walked */
+    UINT64 dir_id;
+    UINT32 walk;                /* directories opened: the root, then dirs[] */
+    UINT64 next_id;
+    UINT32 errors;              /* directories that would not read */
+};
+
+/* Kept between searches: the same volume, unchanged, is not read again */
+static struct sx_index s_ix;
+
+/* ---- Index ---- */
+
+static void ix_reset(struct sx_index *ix) {
+    if (ix->mft) ntfs_mft_scan_close(ix->mft);
+    if (ix->dir) fs_closedir(ix->dir);
+    if (ix->ents) mem_free(ix->ents);
+    if (ix->pool) mem_free(ix->pool);
+    if (ix->dirs) mem_free(ix->dirs);
+    mem_set(ix, 0, sizeof(*ix));
+}
+
+/* Start a scan of v: the $MFT on NTFS, a walk from the root elsewhere */
+static void ix_begin(struct sx_index *ix, struct fs_volume *v) {
+    ix_reset(ix);
+    ix->gen = fs_generation();
+    struct ntfs_vol *nv = fs_volume_ntfs(v);
+    if (nv && (ix->mft = ntfs_mft_scan_open(nv)) != NULL) {
+        ix->root = NTFS_ROOT_RECORD;
+    } else {
+        ix->root = 0;
+        ix->next_id = 1;
+    }
+}
+
+static int ix_add(struct sx_index *ix, const struct fs_entry *e, UINT64 id,
+                  UINT64 parent) {
+    UINT32 nlen = (UINT32)str_len((const CHAR8 *)e->name) + 1;
+    if (mem_grow((void **)&ix->ents, &ix->cap, ix->count + 1,
+                 sizeof(struct sx_ent), 1024) != 0
+        || mem_grow((void **)&ix->pool, &ix->pool_cap, ix->pool_len + nlen,
+                    1, 1024) != 0
+        || (e->is_dir && mem_grow((void **)&ix->dirs, &ix->dirs_cap, ix->ndirs + 1,
+                                  sizeof(UINT32), 1024) != 0))
+        return -1;
+    struct sx_ent *x = &ix->ents[ix->count];
+    x->id = id;
+    x->parent = parent;
+    x->size = e->size;
+    x->name = ix->pool_len;
+    x->is_dir = e->is_dir;
+    mem_copy(ix->pool + ix->pool_len, e->name, nlen);
+    ix->pool_len += nlen;
+    if (e->is_dir) ix->dirs[ix->ndirs++] = ix->count;
+    ix->count++;
+    return 0;
+}
+
+/* The entry of the directory with id, or -1 if it is not in (yet) */
+static INT64 find_dir(const struct sx_index *ix, UINT64 id) {
+    UINT32 lo = 0, hi = ix->ndirs;
+    while (lo < hi) {
+        UINT32 mid = lo + (hi - lo) / 2;
+        UINT64 m = ix->ents[ix->dirs[mid]].id;
+        if (m == id) return ix->dirs[mid];
+        if (m < id) lo = mid + 1;
+        else hi = mid;
+    }
+    return -1;
+}
+
+/* The path of directory id, "\\"-separated from the root. Returns 0,
+   or -1 when part of the chain is not known (out starts "\\..." then) */
+static int dir_path(const struct sx_index *ix, UINT64 id, char *out, UINTN max) {
+    UINT32 chain[SEARCH_DEPTH_MAX];
+    int n = 0, known = 1;
+    while (id != ix->root) {
+        INT64 d = find_dir(ix, id);
+        if (d < 0 || n == SEARCH_DEPTH_MAX) {
+            known = 0;
+            break;
+        }
+        chain[n++] = (UINT32)d;
+        id = ix->ents[d].parent;
+    }
+    UINTN len = 0;
+    if (!known) {
+        str_copy(out, "\\...", max);
+        len = str_len((CHAR8 *)out);
+    }
+    for (int i = n - 1; i >= 0; i--) {
+        const char *s = ix->pool + ix->ents[chain[i]].name;
+        if (len + 1 < max) out[len++] = '\\';
+        while (*s && len + 1 < max) out[len++] = *s++;
+    }
+    if (len == 0 && max > 1) out[len++] = '\\';
+    out[len] = '\0';
+    return known ? 0 : -1;
+}
+
+/* Add names for about SX_STEP_MS. Returns 1 while there are more, 0
+   once the index is complete, -1 when it cannot grow. */
+static int ix_step(struct sx_index *ix, struct fs_volume *v) {
+    UINT64 hz = timer_hz(), t0 = timer_ticks();
+    while (timer_ticks() - t0 < hz / 1000 * SX_STEP_MS) {
+        if (ix->mft) {
+            struct ntfs_mft_name nm;
+            int r = ntfs_mft_scan_next(ix->mft, &nm);
+            if (r <= 0) {
+                ntfs_mft_scan_close(ix->mft);
+                ix->mft = NULL;
+                if (r < 0) ix->errors++;
+                ix->complete = 1;
+                return 0;
+            }
+            if (ix_add(ix, &nm.entry, nm.record, nm.parent) != 0) return -1;
+            continue;
+        }
+
+        if (!ix->dir) {
+            /* Directories are queued in the order they were found, so
+               the walk is breadth-first */
+            if (ix->walk > ix->ndirs) {
+                ix->complete = 1;
+                return 0;
+            }
+            UINT64 id = ix->walk == 0 ? ix->root : ix->ents[ix->dirs[ix->walk - 1]].id;
+            ix->walk++;
+            char path[SX_PATH_MAX];
+            CHAR16 wpath[SX_PATH_MAX];
+            dir_path(ix, id, path, sizeof(path));
+            UINTN i = 0;
+            for (; path[i]; i++) wpath[i] = (CHAR16)path[i];
+            wpath[i] = 0;
+            ix->dir = fs_volume_opendir(v, wpath);
+            if (!ix->dir) {
+                ix->errors++;
+                continue;
+            }
+            ix->dir_id = id;
+        }
+
+        struct fs_entry e;
+        int r = fs_readdir_next(ix->dir, &e);
+        if (r <= 0) {
+            if (r < 0) ix->errors++;
+            fs_closedir(ix->dir);
+            ix->dir = NULL;
+            continue;
+        }
+        if (ix_add(ix, &e, e.is_dir ? ix->next_id++ : 0, ix->dir_id) != 0)
+            return -1;
+    }
+    return 1;
+}
+
+/* ---- Saved index ---- */
+
+static int read_all(struct fs_file *f, void *buf, UINTN size) {
+    UINT8 *p = (UINT8 *)buf;
+    while (size > 0) {
+        UINTN n = size;
+        if (fs_stream_read(f, p, &n) != 0 || n == 0) return -1;
+        p += n;
+        size -= n;
+    }
+    return 0;
+}
+
+static int ix_save(struct sx_index *ix, struct fs_volume *v) {
+    struct sx_header h;
+    mem_set(&h, 0, sizeof(h));
+    mem_copy(h.magic, SX_MAGIC, 8);
+    h.count = ix->count;
+    h.pool_len = ix->pool_len;
+    h.ndirs = ix->ndirs;
+    h.root = ix->root;
+
+    struct fs_file *f = fs_volume_open_write(v, SEARCH_INDEX);
+    if (!f) return -1;
+    int rc = fs_stream_write(f, &h, sizeof(h)) != 0
+             || fs_stream_write(f, ix->ents, (UINTN)ix->count * sizeof(struct sx_ent)) != 0
+             || fs_stream_write(f, ix->pool, ix->pool_len) != 0
+             || fs_stream_write(f, ix->dirs, (UINTN)ix->ndirs * sizeof(UINT32)) != 0
+             ? -1 : 0;
+    if (fs_stream_close(f) != 0) rc = -1;
+    if (rc != 0) fs_volume_delete(v, SEARCH_INDEX);
+    /* The write moved the generation on; the index still holds */
+    ix->gen = fs_generation();
+    return rc;
+}
+
+/* Returns 0 with a complete index from SEARCH_INDEX, -1 if there is
+   none (or it does not hold together) */
+static int ix_load(struct sx_index *ix, struct fs_volume *v) {
+    ix_reset(ix);
+    UINT64 size;
+    struct fs_file *f = fs_volume_open_read(v, SEARCH_INDEX, &size);
+    if (!f) return -1;
+    struct sx_header h;
+    int ok = read_all(f, &h, sizeof(h)) == 0
+             && mem_cmp(h.magic, SX_MAGIC, 8) == 0
+             && size == sizeof(h) + (UINT64)h.count * sizeof(struct sx_ent)
+                        + h.pool_len + (UINT64)h.ndirs * sizeof(UINT32)
+             && h.ndirs <= h.count
+             && mem_grow((void **)&ix->ents, &ix->cap, h.count,
+                         sizeof(struct sx_ent), 1024) == 0
+             && mem_grow((void **)&ix->pool, &ix->pool_cap, h.pool_len,
+                         1, 1024) == 0
+             && mem_grow((void **)&ix->dirs, &ix->dirs_cap, h.ndirs,
+                         sizeof(UINT32), 1024) == 0
+             && read_all(f, ix->ents, (UINTN)h.count * sizeof(struct sx_ent)) == 0
+             && read_all(f, ix->pool, h.pool_len) == 0
+             && read_all(f, ix->dirs, (UINTN)h.ndirs * sizeof(UINT32)) == 0;
+    fs_stream_close(f);
+    for (UINT32 i = 0; ok && i < h.count; i++)
+        ok = ix->ents[i].name < h.pool_len;
+    for (UINT32 i = 0; ok && i < h.ndirs; i++)
+        ok = ix->dirs[i] < h.count;
+    if (!ok || (h.pool_len && ix->pool[h.pool_len - 1] != '\0')) {
+        ix_reset(ix);
+        return -1;
+    }
+    ix->count = h.count;
+    ix->pool_len = h.pool_len;
+    ix->ndirs = h.ndirs;
+    ix->root = h.root;
+    ix->complete = 1;
+    ix->saved = 1;
+    ix->gen = fs_generation();
+    return 0;
+}
+
+/* ---- Matching ---- */
+
+static int lower(int c) {
+    return c >= 'A' && c <= 'Z' ? c + 32 : c;
+}
+
+/* The whole of s against pat, * and ? wild */
+static int glob_match(const char *pat, const char *s) {
+    const char *star = NULL, *resume = NULL;
+    while (*s) {
+        if (*pat == '*') {
+            star = pat++;
+            resume = s;
+        } else if (*pat == '?' || lower(*pat) == lower(*s)) {
+            pat++;
+            s++;
+        } else if (star) {
+            pat = star + 1;
+            s = ++resume;
+        } else {
+            return 0;
+        }
+    }
+    while (*pat == '*') pat++;
+    return *pat == '\0';
+}
+
+int search_name_matches(const char *name, const char *q) {
+    for (const char *p = q; *p; p++)
+        if (*p == '*' || *p == '?') return glob_match(q, name);
+    for (; *name; name++) {
+        const char *a = name, *b = q;
+        while (*b && lower(*a) == lower(*b)) {
+            a++;
+            b++;
+        }
+        if (!*b) return 1;
+    }
+    return 0;
+}
+
+/* ---- Screen ---- */
+
+struct sx_view {
+    char q[SEARCH_QUERY_MAX];
+    UINT32 *hits;
+    UINT32 nhits, hits_cap;
+    UINT32 tested;              /* entries matched against q so far */
+    int cursor, scroll;
+    const char *msg;            /* one-off status line */
+};
+
+static void draw_hit(struct sx_index *ix, struct sx_view *vw, int idx, UINT32 row) {
+    const struct sx_ent *x = &ix->ents[vw->hits[idx]];
+    char path[SX_PATH_MAX], line[256];
+    dir_path(ix, x->parent, path, sizeof(path));
+    UINTN len = str_len((CHAR8 *)path);
+    if (len > 1 && len + 1 < sizeof(path)) path[len++] = '\\';
+    str_copy(path + len, ix->pool + x->name, sizeof(path) - len);
+
+    /* Keep the end of a long path, where the name is */
+    int room = (int)g_boot.cols - 16;
+    if (room > (int)sizeof(line) - 8) room = (int)sizeof(line) - 8;
+    int plen = (int)str_len((CHAR8 *)path);
+    const char *shown = plen > room ? path + plen - room : path;
+    snprintf(line, sizeof(line), " %s%s%s", x->is_dir ? "[DIR] " : "",
+             plen > room ? "..." : "", shown);
+    if (!x->is_dir) {
+        char size[24];
+        progress_size(x->size, size, sizeof(size));
+        int n = (int)str_len((CHAR8 *)line);
+        int col = (int)g_boot.cols - (int)str_len((CHAR8 *)size) - 2;
+        while (n < col && n < (int)sizeof(line) - 26) line[n++] = ' ';
+        str_copy(line + n, size, sizeof(line) - n);
+    }
+    int sel = idx == vw->cursor;
+    fb_line(row, line, sel ? COLOR_BLACK : x->is_dir ? COLOR_GREEN : COLOR_WHITE,
+            sel ? COLOR_CYAN : COLOR_BLACK);
+}
+
+static void draw_view(struct sx_index *ix, struct sx_view *vw) {
+    char line[256];
+    snprintf(line, sizeof(line), " Find: %s_", vw->q);
+    fb_line(0, line, COLOR_CYAN, COLOR_DGRAY);
+
+    if (!ix->complete) {
+        UINT64 done, total;
+        if (ix->mft) {
+            ntfs_mft_scan_progress(ix->mft, &done, &total);
+            snprintf(line, sizeof(line), " %u found in %u names; reading the $MFT, %u%%",
+                     vw->nhits, ix->count,
+                     total ? (UINT32)(done * 100 / total) : 0);
+        } else {
+            snprintf(line, sizeof(line), " %u found in %u names; %u of %u directories read",
+                     vw->nhits, ix->count, ix->walk, ix->ndirs + 1);
+        }
+    } else {
+        snprintf(line, sizeof(line), " %u found in %u names%s%s", vw->nhits, ix->count,
+                 ix->saved ? " (saved index: F5 reads the volume again)" : "",
+                 ix->errors ? ", some directories unreadable" : "");
+    }
+    fb_line(1, line, ix->complete ? COLOR_YELLOW : COLOR_GRAY, COLOR_BLACK);
+
+    UINT32 rows = g_boot.rows - 3;
+    for (UINT32 r = 0; r < rows; r++) {
+        int idx = vw->scroll + (int)r;
+        if (idx < (int)vw->nhits)
+            draw_hit(ix, vw, idx, 2 + r);
+        else
+            fb_line(2 + r, "", COLOR_WHITE, COLOR_BLACK);
+    }
+
+    fb_line(g_boot.rows - 1,
+            vw->msg ? vw->msg
+                    : " Type to search (* ? for patterns)  ENTER:Go to  F2:Save index  F5:Rescan  ESC:Back",
+            COLOR_GRAY, COLOR_DGRAY);
+    vw->msg = NULL;
+    fb_present();
+}
+
+/* Match the entries added since the last call */
+static void match_new(struct sx_index *ix, struct sx_view *vw) {
+    for (; vw->tested < ix->count; vw->tested++) {
+        if (!vw->q[0] || !search_name_matches(ix->pool + ix->ents[vw->tested].name, vw->q))
+            continue;
+        if (mem_grow((void **)&vw->hits, &vw->hits_cap, vw->nhits + 1,
+                     sizeof(UINT32), 1024) != 0)
+            return;
+        vw->hits[vw->nhits++] = vw->tested;
+    }
+}
+
+static void rematch(struct sx_view *vw) {
+    vw->nhits = 0;
+    vw->tested = 0;
+    vw->cursor = 0;
+    vw->scroll = 0;
+}
+
+int search_run(CHAR16 *dir, UINTN dir_max, char *name) {
+    struct fs_volume *v = fs_volume_current();
+    struct sx_index *ix = &s_ix;
+    if (ix->gen != fs_generation() || !ix->complete) {
+        if (ix_load(ix, v) != 0) ix_begin(ix, v);
+    }
+
+    struct sx_view vw;
+    mem_set(&vw, 0, sizeof(vw));
+    int rows = (int)g_boot.rows - 3;
+    int failed = 0, rc = -1;
+    UINT64 hz = timer_hz(), t_draw = 0;
+    fb_clear(COLOR_BLACK);
+
+    for (;;) {
+        if (!ix->complete && !failed && ix_step(ix, v) < 0) {
+            failed = 1;
+            vw.msg = " Out of memory: the index holds part of the volume";
+        }
+        match_new(ix, &vw);
+
+        int scanning = !ix->complete && !failed;
+        UINT64 now = timer_ticks();
+        if (!scanning || now - t_draw > hz / 1000 * SX_DRAW_MS) {
+            draw_view(ix, &vw);
+            t_draw = now;
+        }
+
+        struct key_event ev;
+        if (scanning) {
+            if (!kbd_poll(&ev)) continue;
+        } else {
+            kbd_wait(&ev);
+        }
+
+        int len = (int)str_len((CHAR8 *)vw.q);
+        switch (ev.code) {
+        case KEY_UP:
+            if (vw.cursor > 0) vw.cursor--;
+            break;
+        case KEY_DOWN:
+            if (vw.cursor < (int)vw.nhits - 1) vw.cursor++;
+            break;
+        case KEY_PGUP:
+            vw.cursor -= rows;
+            if (vw.cursor < 0) vw.cursor = 0;
+            break;
+        case KEY_PGDN:
+            vw.cursor += rows;
+            if (vw.cursor > (int)vw.nhits - 1) vw.cursor = (int)vw.nhits - 1;
+            if (vw.cursor < 0) vw.cursor = 0;
+            break;
+        case KEY_HOME:
+            vw.cursor = 0;
+            break;
+        case KEY_END:
+            vw.cursor = vw.nhits ? (int)vw.nhits - 1 : 0;
+            break;
+        case KEY_BS:
+            if (len > 0) {
+                vw.q[len - 1] = '\0';
+                rematch(&vw);
+            }
+            break;
+        case KEY_F2:
+            if (!ix->complete || failed)
+                vw.msg = " The index is saved once the scan has finished";
+            else if (fs_is_read_only())
+                vw.msg = " Read-only volume: the index stays in memory";
+            else if (ix_save(ix, v) != 0)
+                vw.msg = " Could not write \\SEARCH.IDX";
+            else
+                vw.msg = " Index saved as \\SEARCH.IDX";
+            break;
+        case KEY_F5:
+            ix_begin(ix, v);
+            failed = 0;
+            rematch(&vw);
+            break;
+        case KEY_ENTER:
+            if (vw.nhits > 0) {
+                const struct sx_ent *x = &ix->ents[vw.hits[vw.cursor]];
+                char path[SX_PATH_MAX];
+                if (dir_path(ix, x->parent, path, sizeof(path)) != 0) {
+                    vw.msg = " Its directory has not been read yet";
+                    break;
+                }
+                UINTN i = 0;
+                for (; path[i] && i + 1 < dir_max; i++) dir[i] = (CHAR16)path[i];
+                dir[i] = 0;
+                str_copy(name, ix->pool + x->name, FS_MAX_NAME);
+                rc = 0;
+                goto out;
+            }
+            break;
+        case KEY_ESC:
+            goto out;
+        default:
+            if (ev.code >= 0x20 && ev.code <= 0x7E && len < SEARCH_QUERY_MAX - 1) {
+                vw.q[len] = (char)ev.code;
+                vw.q[len + 1] = '\0';
+                rematch(&vw);
+            }
+            break;
+        }
+        if (vw.cursor < vw.scroll) vw.scroll = vw.cursor;
+        if (vw.cursor >= vw.scroll + rows) vw.scroll = vw.cursor - rows + 1;
+        t_draw = 0;     /* a key always shows */
+    }
+
+out:
+    /* A scan cut short holds a directory open: it cannot wait */
+    if (!ix->complete || failed) ix_reset(ix);
+    if (vw.hits) mem_free(vw.hits);
+    return rc;
+}
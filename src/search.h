@@ -0,0 +1,32 @@
+/*
+ * search.h — Find files by name anywhere on a volume
+ *
+ * Every name on the current volume goes into an index as fast as its
+ * filesystem allows: on NTFS the $MFT is read straight through
+ * (ntfs.h), elsewhere the tree is walked breadth-first with the
+ * drivers' directory cursors, whose reads the block cache runs ahead
+ * of. Matches show while the scan goes on, and a changed query only
+ * filters the index in memory. The index can be saved on the volume
+ * as SEARCH_INDEX, and is loaded from there the next time.
+ */
+#ifndef SEARCH_H
+#define SEARCH_H
+
+#include "boot.h"
+#include "fs.h"
+
+#define SEARCH_INDEX     L"\\SEARCH.IDX"
+#define SEARCH_QUERY_MAX 64
+#define SEARCH_DEPTH_MAX 64     /* directories followed up from a name */
+
+/* Search the current volume by name: a substring, or a pattern of the
+   whole name when it holds * or ?; case is ignored. Returns 0 when a
+   result was picked, with its directory in dir (dir_max CHAR16s, from
+   "\\") and its name in name (FS_MAX_NAME bytes); -1 when left. */
+int search_run(CHAR16 *dir, UINTN dir_max, char *name);
+
+/* Whether name matches query as in the search: a substring, or the
+   whole name against a pattern with * or ?; case is ignored */
+int search_name_matches(const char *name, const char *query);
+
+#endif /* SEARCH_H */
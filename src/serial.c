@@ -0,0 +1,539 @@
+/*
+ * serial.c — The screen mirrored to a serial terminal, and keys from it
+ *
+ * See serial.h. s_sent is what the terminal shows, in the grid's own
+ * colours, with ch 0 for a cell it may not show (after a reset, or a
+ * row a scroll brought in). Colours go out as the nearest of the 16
+ * every terminal has. The bottom right cell is never written, since
+ * on some terminals and on ConOut that scrolls the screen.
+ */
+
+#include "serial.h"
+#include "fb.h"
+#include "mem.h"
+#include "timer.h"
+#include "shim.h"
+
+#define SERIAL_OUT     2048     /* bytes per Write */
+#define SERIAL_IN      32       /* bytes of a key sequence kept */
+#define SERIAL_RUN     128      /* characters per ConOut OutputString */
+#define SERIAL_SCROLL  8        /* rows a scroll is looked for up to */
+#define SERIAL_SKIP    4        /* unchanged cells resent, not jumped */
+#define TIMER_PERIODIC 1
+
+typedef EFI_STATUS (*BS_SET_TIMER)(EFI_EVENT, UINT32, UINT64);
+
+static EFI_SERIAL_IO_PROTOCOL *s_io;
+static int     s_conout;        /* no port: the grid goes to ConOut */
+static int     s_active;
+static struct fb_cell *s_sent;  /* s_rows x s_cols */
+static UINT32  s_cols, s_rows;
+static UINT32  s_gen;           /* fb_text_generation() last shown */
+static INT32   s_cx = -1, s_cy; /* terminal cursor; s_cx -1: unknown */
+static int     s_fg = -1, s_bg = -1;   /* colours set, -1: unknown */
+
+static char    s_out[SERIAL_OUT];
+static UINTN   s_out_len;
+static CHAR16  s_wtext[SERIAL_RUN + 1];
+static UINTN   s_wtext_len;
+
+static EFI_EVENT s_poll;
+static UINT8   s_in[SERIAL_IN];
+static UINT32  s_in_len;
+static UINT64  s_in_t;          /* when the first byte kept arrived */
+
+/* ---- Colours ---- */
+
+/* The screen colours the terminal's 16 stand for (0x00RRGGBB, as the
+   COLOR_* constants read), in ANSI order */
+static const UINT32 s_palette[16] = {
+    0x000000, 0x800000, 0x008000, 0x808000,
+    0x000080, 0x800080, 0x008080, 0xA0A0A0,
+    0x404040, 0xFF0000, 0x00FF00, 0xFFFF00,
+    0x0000FF, 0xFF00FF, 0x00FFFF, 0xFFFFFF,
+};
+
+/* ANSI colour number to EFI_TEXT_ATTR's */
+static const UINT8 s_efi_color[16] = {
+    0, 4, 2, 6, 1, 5, 3, 7, 8, 12, 10, 14, 9, 13, 11, 15,
+};
+
+#define SERIAL_MAP 4            /* colours remembered */
+
+static UINT32 s_map_rgb[SERIAL_MAP];
+static int    s_map_idx[SERIAL_MAP];
+static int    s_map_n, s_map_next;
+
+static int color_index(UINT32 rgb) {
+    for (int i = 0; i < s_map_n; i++)
+        if (s_map_rgb[i] == rgb)
+            return s_map_idx[i];
+    int r = (int)(rgb >> 16 & 0xFF), g = (int)(rgb >> 8 & 0xFF), b = (int)(rgb & 0xFF);
+    int best = 0;
+    UINT32 best_d = 0xFFFFFFFF;
+    for (int i = 0; i < 16; i++) {
+        int dr = r - (int)(s_palette[i] >> 16 & 0xFF);
+        int dg = g - (int)(s_palette[i] >> 8 & 0xFF);
+        int db = b - (int)(s_palette[i] & 0xFF);
+        UINT32 d = (UINT32)(dr * dr + dg * dg + db * db);
+        if (d < best_d) {
+            best_d = d;
+            best = i;
+        }
+    }
+    int slot = s_map_n < SERIAL_MAP ? s_map_n++ : s_map_next++ % SERIAL_MAP;
+    s_map_rgb[slot] = rgb;
+    s_map_idx[slot] = best;
+    return best;
+}
+
+/* ---- Output ---- */
+
+static void out_flush(void) {
+    UINTN done = 0;
+    while (s_io && done < s_out_len) {
+        UINTN n = s_out_len - done;
+        if (EFI_ERROR(s_io->Write(s_io, &n, s_out + done)) || n == 0)
+            break;
+        done += n;
+    }
+    s_out_len = 0;
+}
+
+static void out_put(const char *s, UINTN n) {
+    if (s_out_len + n > SERIAL_OUT)
+        out_flush();
+    mem_copy(s_out + s_out_len, s, n);
+    s_out_len += n;
+}
+
+static void out_str(const char *s) {
+    out_put(s, strlen(s));
+}
+
+static void text_flush(void) {
+    if (!s_wtext_len)
+        return;
+    s_wtext[s_wtext_len] = 0;
+    s_wtext_len = 0;
+    g_boot.st->ConOut->OutputString(g_boot.st->ConOut, s_wtext);
+}
+
+static void term_set(int fg, int bg) {
+    if (s_conout) {
+        text_flush();
+        g_boot.st->ConOut->SetAttribute(g_boot.st->ConOut,
+            EFI_TEXT_ATTR(s_efi_color[fg], s_efi_color[bg] & 7));
+    } else {
+        char buf[24];
+        int n = 0;
+        buf[n++] = '\x1b';
+        buf[n++] = '[';
+        if (fg != s_fg)
+            n += snprintf(buf + n, sizeof(buf) - n, "%d", fg < 8 ? 30 + fg : 82 + fg);
+        if (bg != s_bg)
+            n += snprintf(buf + n, sizeof(buf) - n, "%s%d", fg != s_fg ? ";" : "",
+                          bg < 8 ? 40 + bg : 92 + bg);
+        buf[n++] = 'm';
+        out_put(buf, (UINTN)n);
+    }
+    s_fg = fg;
+    s_bg = bg;
+}
+
+/* Whether a shows without a colour change; a blank needs only its
+   background */
+static int colors_set(const struct fb_cell *a) {
+    return color_index(a->bg) == s_bg &&
+           (a->ch == ' ' || color_index(a->fg) == s_fg);
+}
+
+static void term_cell(const struct fb_cell *a) {
+    if (!colors_set(a)) {
+        int bg = color_index(a->bg);
+        int fg = a->ch == ' ' && s_fg >= 0 ? s_fg : color_index(a->fg);
+        term_set(fg, bg);
+    }
+    if (s_conout) {
+        if (s_wtext_len == SERIAL_RUN)
+            text_flush();
+        s_wtext[s_wtext_len++] = (CHAR16)a->ch;
+    } else {
+        char ch = (char)a->ch;
+        out_put(&ch, 1);
+    }
+    /* Past the last column the cursor is wherever the terminal wraps */
+    if (++s_cx >= (INT32)s_cols)
+        s_cx = -1;
+}
+
+/* Put the cursor at c, r; row holds what the terminal shows there */
+static void term_goto(UINT32 c, UINT32 r, const struct fb_cell *row) {
+    if (s_cx >= 0 && (UINT32)s_cy == r && (UINT32)s_cx == c)
+        return;
+    if (!s_conout && s_cx >= 0 && (UINT32)s_cy == r && c > (UINT32)s_cx &&
+        c - (UINT32)s_cx <= SERIAL_SKIP) {
+        /* Resending a few cells is shorter than a cursor move */
+        UINT32 k = (UINT32)s_cx;
+        while (k < c && row[k].ch && colors_set(&row[k]))
+            k++;
+        if (k == c) {
+            for (k = (UINT32)s_cx; k < c; k++)
+                term_cell(&row[k]);
+            return;
+        }
+    }
+    if (s_conout) {
+        text_flush();
+        g_boot.st->ConOut->SetCursorPosition(g_boot.st->ConOut, c, r);
+    } else if (s_cx >= 0 && (UINT32)s_cy + 1 == r && c == 0) {
+        out_put("\r\n", 2);
+    } else {
+        char buf[24];
+        snprintf(buf, sizeof(buf), "\x1b[%u;%uH", (unsigned)(r + 1), (unsigned)(c + 1));
+        out_str(buf);
+    }
+    s_cx = (INT32)c;
+    s_cy = (INT32)r;
+}
+
+/* ---- Mirror ---- */
+
+static const struct fb_cell s_unknown = { COLOR_BLACK, COLOR_BLACK, ' ' };
+
+static const struct fb_cell *look(const struct fb_cell *w) {
+    return w->ch ? w : &s_unknown;
+}
+
+static int row_eq(const struct fb_cell *a, const struct fb_cell *b) {
+    return mem_cmp(a, b, (UINTN)s_cols * sizeof(struct fb_cell)) == 0;
+}
+
+/* Rows the screen moved up by since the terminal was drawn, when that
+   explains more of it than leaving it does; 0 otherwise */
+static UINT32 scroll_guess(void) {
+    UINT32 best = 0, best_rows = 0;
+    for (UINT32 r = 0; r < s_rows; r++)
+        if (row_eq(fb_text_row(r), s_sent + (UINTN)r * s_cols))
+            best_rows++;
+    for (UINT32 k = 1; k <= SERIAL_SCROLL && k < s_rows; k++) {
+        UINT32 rows = 0;
+        for (UINT32 r = 0; r + k < s_rows; r++)
+            if (row_eq(fb_text_row(r), s_sent + (UINTN)(r + k) * s_cols))
+                rows++;
+        if (rows > best_rows && rows * 2 >= s_rows - k) {
+            best = k;
+            best_rows = rows;
+        }
+    }
+    return best;
+}
+
+/* Scroll the terminal up k rows, as the screen did */
+static void term_scroll(UINT32 k) {
+    struct fb_cell blank = { COLOR_BLACK, COLOR_BLACK, ' ' };
+    /* Terminals that fill new rows with the colour set fill them black */
+    if (!colors_set(&blank))
+        term_set(s_fg >= 0 ? s_fg : 7, 0);
+    char buf[24];
+    snprintf(buf, sizeof(buf), "\x1b[%u;1H", (unsigned)s_rows);
+    out_str(buf);
+    for (UINT32 i = 0; i < k; i++)
+        out_put("\n", 1);
+    s_cx = -1;
+
+    UINTN keep = (UINTN)(s_rows - k) * s_cols;
+    mem_move(s_sent, s_sent + (UINTN)k * s_cols, keep * sizeof(struct fb_cell));
+    mem_set(s_sent + keep, 0, (UINTN)k * s_cols * sizeof(struct fb_cell));
+}
+
+static void mirror_row(UINT32 r, const struct fb_cell *w) {
+    struct fb_cell *sent = s_sent + (UINTN)r * s_cols;
+    UINT32 end = r + 1 == s_rows ? s_cols - 1 : s_cols;
+    UINT32 c = 0;
+    while (c < end) {
+        if (fb_cell_eq(look(&w[c]), &sent[c])) {
+            c++;
+            continue;
+        }
+        term_goto(c, r, sent);
+        while (c < end && !fb_cell_eq(look(&w[c]), &sent[c])) {
+            sent[c] = *look(&w[c]);
+            term_cell(&sent[c]);
+            c++;
+        }
+    }
+}
+
+static void term_reset(void) {
+    if (s_conout) {
+        g_boot.st->ConOut->ClearScreen(g_boot.st->ConOut);
+        g_boot.st->ConOut->EnableCursor(g_boot.st->ConOut, FALSE);
+    } else {
+        char buf[48];
+        /* Plain colours, a clear screen, scrolling within the grid's
+           rows, no cursor */
+        snprintf(buf, sizeof(buf), "\x1b[0m\x1b[2J\x1b[1;%ur\x1b[?25l",
+                 (unsigned)s_rows);
+        out_str(buf);
+        out_flush();
+    }
+    mem_set(s_sent, 0, (UINTN)s_rows * s_cols * sizeof(struct fb_cell));
+    s_cx = -1;
+    s_fg = s_bg = -1;
+    s_gen = fb_text_generation() - 1;
+}
+
+static void serial_present(void) {
+    if (!s_active)
+        return;
+    if (g_boot.cols != s_cols || g_boot.rows != s_rows) {
+        /* The grid was set up again at another size */
+        struct fb_cell *sent = (struct fb_cell *)mem_alloc(
+            (UINTN)g_boot.cols * g_boot.rows * sizeof(struct fb_cell));
+        if (!sent) {
+            s_active = 0;
+            return;
+        }
+        mem_free(s_sent);
+        s_sent = sent;
+        s_cols = g_boot.cols;
+        s_rows = g_boot.rows;
+        term_reset();
+    }
+    UINT32 gen = fb_text_generation();
+    if (gen == s_gen)
+        return;
+    s_gen = gen;
+
+    if (!s_conout) {
+        UINT32 k = scroll_guess();
+        if (k)
+            term_scroll(k);
+    }
+    for (UINT32 r = 0; r < s_rows; r++) {
+        const struct fb_cell *w = fb_text_row(r);
+        if (w && !row_eq(w, s_sent + (UINTN)r * s_cols))
+            mirror_row(r, w);
+    }
+    if (s_conout)
+        text_flush();
+    else
+        out_flush();
+}
+
+int serial_start(int have_gop) {
+    if (s_active)
+        return 0;
+    EFI_GUID guid = EFI_SERIAL_IO_PROTOCOL_GUID;
+    EFI_SERIAL_IO_PROTOCOL *io = NULL;
+    if (EFI_ERROR(g_boot.bs->LocateProtocol(&guid, NULL, (void **)&io)))
+        io = NULL;
+    SIMPLE_TEXT_OUTPUT_INTERFACE *out = g_boot.st->ConOut;
+    if (!io && (have_gop || !out))
+        return -1;
+
+    if (!have_gop) {
+        UINTN cols = 0, rows = 0;
+        if (!out || !out->Mode ||
+            EFI_ERROR(out->QueryMode(out, (UINTN)out->Mode->Mode, &cols, &rows)) ||
+            !cols || !rows) {
+            cols = 80;
+            rows = 25;
+        }
+        if (EFI_ERROR(fb_init_text((UINT32)cols, (UINT32)rows)))
+            return -1;
+    }
+
+    s_cols = g_boot.cols;
+    s_rows = g_boot.rows;
+    s_sent = (struct fb_cell *)mem_alloc((UINTN)s_cols * s_rows * sizeof(struct fb_cell));
+    if (!s_sent)
+        return -1;
+    s_io = io;
+    s_conout = !io;
+    term_reset();
+
+    if (s_io && !EFI_ERROR(g_boot.bs->CreateEvent(EVT_TIMER, 0, NULL, NULL, &s_poll)))
+        ((BS_SET_TIMER)g_boot.bs->SetTimer)(s_poll, TIMER_PERIODIC,
+                                            (UINT64)SERIAL_POLL_MS * 10000);
+    s_active = 1;
+    fb_set_mirror_hook(serial_present);
+    return 0;
+}
+
+int serial_active(void) {
+    return s_active;
+}
+
+/* ---- Input ---- */
+
+/* Take what the port holds, up to a full buffer */
+static void in_fill(void) {
+    while (s_in_len < SERIAL_IN) {
+        UINT32 ctl;
+        if (EFI_ERROR(s_io->GetControl(s_io, &ctl)) ||
+            (ctl & EFI_SERIAL_INPUT_BUFFER_EMPTY))
+            break;
+        UINTN n = 1;
+        UINT8 b;
+        if (EFI_ERROR(s_io->Read(s_io, &n, &b)) || n != 1)
+            break;
+        if (!s_in_len)
+            s_in_t = timer_ticks();
+        s_in[s_in_len++] = b;
+    }
+}
+
+static void in_drop(UINT32 n) {
+    mem_move(s_in, s_in + n, s_in_len - n);
+    s_in_len -= n;
+    if (s_in_len)
+        s_in_t = timer_ticks();
+}
+
+/* A byte that is a key by itself */
+static void in_byte(UINT8 b, struct key_event *ev) {
+    if (b == '\r')
+        ev->code = KEY_ENTER;
+    else if (b == 0x7F || b == 0x08)
+        ev->code = KEY_BS;
+    else if (b == '\t')
+        ev->code = KEY_TAB;
+    else if (b == 0x1B)
+        ev->code = KEY_ESC;
+    else if (b >= 1 && b <= 26 && b != '\n') {
+        ev->code = b;
+        ev->modifiers |= KMOD_CTRL;
+    } else if (b >= 0x20 && b < 0x7F)
+        ev->code = b;
+}
+
+/* The key of CSI/SS3 final byte f with parameter p */
+static UINT16 in_final(UINT8 f, UINT32 p) {
+    switch (f) {
+    case 'A': return KEY_UP;
+    case 'B': return KEY_DOWN;
+    case 'C': return KEY_RIGHT;
+    case 'D': return KEY_LEFT;
+    case 'H': return KEY_HOME;
+    case 'F': return KEY_END;
+    case 'P': return KEY_F1;
+    case 'Q': return KEY_F2;
+    case 'R': return KEY_F3;
+    case 'S': return KEY_F4;
+    case 'Z': return KEY_TAB;
+    case '~':
+        switch (p) {
+        case 1: case 7: return KEY_HOME;
+        case 2: return KEY_INS;
+        case 3: return KEY_DEL;
+        case 4: case 8: return KEY_END;
+        case 5: return KEY_PGUP;
+        case 6: return KEY_PGDN;
+        case 11: return KEY_F1;
+        case 12: return KEY_F2;
+        case 13: return KEY_F3;
+        case 14: return KEY_F4;
+        case 15: return KEY_F5;
+        case 17: return KEY_F6;
+        case 18: return KEY_F7;
+        case 19: return KEY_F8;
+        case 20: return KEY_F9;
+        case 21: return KEY_F10;
+        case 23: return KEY_F11;
+        case 24: return KEY_F12;
+        }
+    }
+    return KEY_NONE;
+}
+
+/* Decode the front of s_in into ev: the bytes it took, 0 while the
+   sequence may still be coming */
+static UINT32 in_decode(struct key_event *ev, int timed_out) {
+    if (s_in[0] != 0x1B) {
+        in_byte(s_in[0], ev);
+        return 1;
+    }
+    if (s_in_len == 1) {
+        if (!timed_out)
+            return 0;
+        ev->code = KEY_ESC;
+        return 1;
+    }
+    UINT8 intro = s_in[1];
+    if (intro == 0x1B) {
+        ev->code = KEY_ESC;
+        return 1;
+    }
+    if (intro != '[' && intro != 'O') {
+        /* ESC before a key is Alt with it */
+        in_byte(intro, ev);
+        ev->modifiers |= KMOD_ALT;
+        return 2;
+    }
+
+    UINT32 end = 2;
+    while (end < s_in_len && (s_in[end] < 0x40 || s_in[end] > 0x7E))
+        end++;
+    if (end == s_in_len) {
+        if (!timed_out && s_in_len < SERIAL_IN)
+            return 0;
+        /* Cut short: take it all as ESC */
+        ev->code = KEY_ESC;
+        return s_in_len;
+    }
+
+    UINT32 p[2] = { 0, 0 }, np = 0;
+    for (UINT32 i = 2; i < end; i++) {
+        if (s_in[i] >= '0' && s_in[i] <= '9') {
+            if (np < 2) p[np] = p[np] * 10 + (s_in[i] - '0');
+        } else if (s_in[i] == ';') {
+            np++;
+        }
+    }
+    ev->code = in_final(s_in[end], p[0]);
+    if (s_in[end] == 'Z')
+        ev->modifiers |= KMOD_SHIFT;
+    /* xterm's modifier parameter is one more than a shift/alt/ctrl mask */
+    if (np >= 1 && p[1] > 1) {
+        UINT32 m = p[1] - 1;
+        if (m & 1) ev->modifiers |= KMOD_SHIFT;
+        if (m & 2) ev->modifiers |= KMOD_ALT;
+        if (m & 4) ev->modifiers |= KMOD_CTRL;
+    }
+    return end + 1;
+}
+
+int serial_read_key(struct key_event *ev) {
+    if (!s_active || !s_io)
+        return 0;
+    in_fill();
+    while (s_in_len) {
+        ev->code = KEY_NONE;
+        ev->scancode = 0;
+        ev->modifiers = 0;
+        int timed_out = timer_ticks() - s_in_t >= timer_hz() / 1000 * SERIAL_ESC_MS;
+        UINT32 n = in_decode(ev, timed_out);
+        if (!n)
+            return 0;
+        in_drop(n);
+        if (ev->code != KEY_NONE)
+            return 1;
+    }
+    return 0;
+}
+
+int serial_pending(void) {
+    if (!s_active || !s_io)
+        return 0;
+    if (s_in_len)
+        return 1;
+    UINT32 ctl;
+    return !EFI_ERROR(s_io->GetControl(s_io, &ctl)) &&
+           !(ctl & EFI_SERIAL_INPUT_BUFFER_EMPTY);
+}
+
+EFI_EVENT serial_wait_event(void) {
+    return s_active && s_io ? s_poll : NULL;
+}
@@ -0,0 +1,52 @@
+/*
+ * serial.h — The screen mirrored to a serial terminal, and keys from it
+ *
+ * The text grid (fb.h) is the whole UI, so a terminal can show it cell
+ * for cell. After each present the rows are compared with what the
+ * terminal was last sent, and only the changed runs go out: a cursor
+ * move where one is needed, a colour change where it differs, the
+ * characters. A screen that scrolled is scrolled on the terminal too
+ * instead of repainted. At 115200 baud a keystroke in the editor or
+ * browser costs about what it changed on screen.
+ *
+ * Output goes to the first EFI_SERIAL_IO port as ANSI escapes, and
+ * keys typed there are decoded from VT100/xterm sequences, alongside
+ * the firmware's keyboard. With no serial port and no GOP, the grid
+ * goes to ConOut through its cursor and attribute calls instead, and
+ * keys come from ConIn as always.
+ *
+ * With a GOP, mirroring starts only when SERIAL_FLAG exists on the boot
+ * volume, since every change then also costs serial time; the terminal
+ * should be g_boot.cols x g_boot.rows. Without one it starts by itself
+ * at the size of the firmware's text mode. Trace marks (trace.h) share
+ * the port and are best not used with it.
+ */
+#ifndef SERIAL_H
+#define SERIAL_H
+
+#include "boot.h"
+#include "kbd.h"
+
+#define SERIAL_FLAG      L"\\SERIAL"
+#define SERIAL_ESC_MS    50     /* a lone ESC is the key after this */
+#define SERIAL_POLL_MS   10     /* kbd_wait() checks the line this often */
+
+/* Start mirroring. have_gop 0 also sets up the text grid itself
+   (fb_init_text()). Returns 0 when mirroring, -1 if nothing can show
+   the grid. */
+int serial_start(int have_gop);
+
+/* Whether the screen is being mirrored */
+int serial_active(void);
+
+/* The next key typed on the serial line: 0 if none (yet) */
+int serial_read_key(struct key_event *ev);
+
+/* Whether bytes are waiting on the line, without taking them */
+int serial_pending(void);
+
+/* A periodic event for kbd_wait() to wake on while keys can come from
+   the line; NULL when they cannot */
+EFI_EVENT serial_wait_event(void);
+
+#endif /* SERIAL_H */
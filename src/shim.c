@@ -3,14 +3,16 @@
  *
  * Provides the ~30 C library functions that TCC's internals require.
  * Routes memory through UEFI AllocatePool, output through fb_print,
- * and file I/O through our fs_readfile/fs_writefile wrappers.
+ * and file I/O through our fs stream/fs_writefile wrappers.
  */
 
 #include "boot.h"
 #include "fb.h"
 #include "mem.h"
 #include "fs.h"
+#include "fpconv.h"
 #include "shim.h"
+#include "timer.h"
 
 /* TCC PE x86_64 generates __chkstk calls for large stack frames (>4096).
    Unlike Microsoft's __chkstk, TCC's version must set up the entire frame:
@@ -65,19 +67,211 @@ struct alloc_hdr {
     size_t magic;
 };
 
-void *malloc(size_t size) {
-    if (size == 0) size = 1;
-    struct alloc_hdr *hdr = (struct alloc_hdr *)mem_alloc(
+/* ---- Compilation arena ----
+ *
+ * While an arena is active, new blocks come from large chunks instead
+ * of the heap, carved in power-of-two sizes (header included). Freed
+ * blocks wait on a per-size free list for reuse; blocks above 64 KB get
+ * a separate heap allocation, linked so they can be released early. At
+ * shim_arena_end() every chunk and big block goes back at once, so
+ * tearing down a TCCState costs a handful of frees however many objects
+ * it made, and its remains never fragment the pool.
+ *
+ * Arena blocks carry ARENA_MAGIC with the size shift (or ARENA_BIG) in
+ * the low byte, so free() and realloc() route them without a lookup.
+ */
+
+#define ARENA_MAGIC      0xA7E4A000
+#define ARENA_BIG        0xFF
+#define IS_ARENA(m)      (((m) & ~(size_t)0xFF) == ARENA_MAGIC)
+#define ARENA_MIN_SHIFT  5
+#define ARENA_MAX_SHIFT  16
+#define ARENA_CHUNK_MIN  (256 * 1024)
+#define ARENA_CHUNK_MAX  (4 * 1024 * 1024)
+
+struct arena_chunk {
+    struct arena_chunk *next;
+    size_t size;
+};
+
+/* Precedes the alloc_hdr of a big block */
+struct arena_big {
+    struct arena_big *next, *prev;
+    size_t cap;
+    size_t pad;
+};
+
+static struct {
+    int    depth;
+    int    prev_tag;
+    struct arena_chunk *chunks;
+    uint8_t *cur, *end;
+    size_t next_chunk;
+    struct alloc_hdr *free[ARENA_MAX_SHIFT + 1];
+    struct arena_big *big;
+} s_arena;
+
+static struct shim_alloc_stats s_astats;
+
+void shim_get_alloc_stats(struct shim_alloc_stats *out) {
+    mem_copy(out, &s_astats, sizeof(*out));
+}
+
+void shim_arena_begin(void) {
+    if (s_arena.depth++) return;
+    s_arena.next_chunk = ARENA_CHUNK_MIN;
+    s_arena.prev_tag = mem_tag_set(MEM_TAG_TCC);
+    s_astats.arenas++;
+}
+
+void shim_arena_end(void) {
+    if (s_arena.depth == 0 || --s_arena.depth) return;
+    struct arena_chunk *c = s_arena.chunks;
+    while (c) {
+        struct arena_chunk *next = c->next;
+        mem_free(c);
+        c = next;
+    }
+    struct arena_big *b = s_arena.big;
+    while (b) {
+        struct arena_big *next = b->next;
+        mem_free(b);
+        b = next;
+    }
+    mem_tag_set(s_arena.prev_tag);
+    mem_set(&s_arena, 0, sizeof(s_arena));
+    s_astats.arena_bytes = 0;
+    s_astats.arena_chunks = 0;
+    s_astats.arena_big = 0;
+}
+
+static void arena_grew(size_t bytes) {
+    s_astats.arena_bytes += bytes;
+    if (s_astats.arena_bytes > s_astats.arena_peak)
+        s_astats.arena_peak = s_astats.arena_bytes;
+}
+
+static struct alloc_hdr *arena_block(size_t size) {
+    size_t need = sizeof(struct alloc_hdr) + size;
+    struct alloc_hdr *hdr;
+
+    if (need > ((size_t)1 << ARENA_MAX_SHIFT)) {
+        if (need > (size_t)-1 - sizeof(struct arena_big)) return NULL;
+        struct arena_big *b = (struct arena_big *)mem_alloc_raw(
+            sizeof(struct arena_big) + need);
+        if (!b) return NULL;
+        b->cap = size;
+        arena_grew(sizeof(struct arena_big) + need);
+        s_astats.arena_big++;
+        b->prev = NULL;
+        b->next = s_arena.big;
+        if (s_arena.big) s_arena.big->prev = b;
+        s_arena.big = b;
+        hdr = (struct alloc_hdr *)(b + 1);
+        hdr->size = size;
+        hdr->magic = ARENA_MAGIC | ARENA_BIG;
+        return hdr;
+    }
+
+    int shift = ARENA_MIN_SHIFT;
+    while (((size_t)1 << shift) < need) shift++;
+
+    hdr = s_arena.free[shift];
+    if (hdr) {
+        s_arena.free[shift] = *(struct alloc_hdr **)(hdr + 1);
+    } else {
+        size_t len = (size_t)1 << shift;
+        if ((size_t)(s_arena.end - s_arena.cur) < len) {
+            size_t csize = s_arena.next_chunk;
+            struct arena_chunk *c = (struct arena_chunk *)mem_alloc_raw(csize);
+            if (!c) return NULL;
+            c->size = csize;
+            arena_grew(csize);
+            s_astats.arena_chunks++;
+            c->next = s_arena.chunks;
+            s_arena.chunks = c;
+            s_arena.cur = (uint8_t *)(c + 1);
+            s_arena.end = (uint8_t *)c + csize;
+            if (csize < ARENA_CHUNK_MAX) s_arena.next_chunk = csize * 2;
+        }
+        hdr = (struct alloc_hdr *)s_arena.cur;
+        s_arena.cur += len;
+    }
+    hdr->size = size;
+    hdr->magic = ARENA_MAGIC | (size_t)shift;
+    return hdr;
+}
+
+/* Kept big blocks link to themselves */
+void shim_arena_keep(void) {
+    s_arena.chunks = NULL;
+    struct arena_big *b = s_arena.big;
+    while (b) {
+        struct arena_big *next = b->next;
+        b->next = b->prev = b;
+        b = next;
+    }
+    s_arena.big = NULL;
+}
+
+static void arena_release(struct alloc_hdr *hdr) {
+    int shift = (int)(hdr->magic & 0xFF);
+    hdr->magic = 0;
+    if (shift == ARENA_BIG) {
+        struct arena_big *b = ((struct arena_big *)hdr) - 1;
+        if (b->next == b)
+            return;
+        if (b->prev) b->prev->next = b->next;
+        else s_arena.big = b->next;
+        if (b->next) b->next->prev = b->prev;
+        s_astats.arena_bytes -= sizeof(struct arena_big) +
+                                sizeof(struct alloc_hdr) + b->cap;
+        s_astats.arena_big--;
+        mem_free(b);
+        return;
+    }
+    *(struct alloc_hdr **)(hdr + 1) = s_arena.free[shift];
+    s_arena.free[shift] = hdr;
+}
+
+/* Payload bytes the block can hold without moving */
+static size_t block_capacity(struct alloc_hdr *hdr) {
+    if (!IS_ARENA(hdr->magic))
+        return mem_usable_size(hdr) - sizeof(struct alloc_hdr);
+    size_t shift = hdr->magic & 0xFF;
+    if (shift == ARENA_BIG)
+        return (((struct arena_big *)hdr) - 1)->cap;
+    return ((size_t)1 << shift) - sizeof(struct alloc_hdr);
+}
+
+/* malloc and realloc leave memory uninitialized; only calloc zeroes.
+   A block lives in the arena or the heap for its whole life. */
+static struct alloc_hdr *alloc_block(size_t size, int in_arena) {
+    if (size > (size_t)-1 - sizeof(struct alloc_hdr)) return NULL;
+    if (in_arena) return arena_block(size);
+    struct alloc_hdr *hdr = (struct alloc_hdr *)mem_alloc_raw(
         sizeof(struct alloc_hdr) + size);
     if (!hdr) return NULL;
     hdr->size = size;
     hdr->magic = ALLOC_MAGIC;
-    return (void *)(hdr + 1);
+    return hdr;
+}
+
+void *malloc(size_t size) {
+    s_astats.mallocs++;
+    if (size == 0) size = 1;
+    struct alloc_hdr *hdr = alloc_block(size, s_arena.depth > 0);
+    return hdr ? (void *)(hdr + 1) : NULL;
 }
 
 void free(void *ptr) {
     if (!ptr) return;
     struct alloc_hdr *hdr = ((struct alloc_hdr *)ptr) - 1;
+    s_astats.frees++;
+    if (IS_ARENA(hdr->magic)) {
+        if (s_arena.depth) arena_release(hdr);
+        return;
+    }
     if (hdr->magic != ALLOC_MAGIC) return; /* bad pointer */
     hdr->magic = 0;
     mem_free(hdr);
@@ -88,22 +282,35 @@ void *realloc(void *ptr, size_t size) {
     if (size == 0) { free(ptr); return NULL; }
 
     struct alloc_hdr *hdr = ((struct alloc_hdr *)ptr) - 1;
-    if (hdr->magic != ALLOC_MAGIC) return NULL;
+    int in_arena = IS_ARENA(hdr->magic);
+    if (in_arena ? !s_arena.depth : hdr->magic != ALLOC_MAGIC) return NULL;
+
+    /* Grow in place into the block's size-class slack */
+    s_astats.reallocs++;
+    size_t cap = block_capacity(hdr);
+    if (size <= cap) {
+        if (size > hdr->size) hdr->size = size;
+        s_astats.reallocs_in_place++;
+        return ptr;
+    }
 
+    /* Moving: reserve half again so repeated small growth stays linear */
     size_t old_size = hdr->size;
-    if (size <= old_size) return ptr; /* shrink: just return */
-
-    void *new_ptr = malloc(size);
-    if (!new_ptr) return NULL;
-    memcpy(new_ptr, ptr, old_size);
+    size_t want = size + size / 2;
+    struct alloc_hdr *nh = want > size ? alloc_block(want, in_arena) : NULL;
+    if (!nh) nh = alloc_block(size, in_arena);
+    if (!nh) return NULL;
+    nh->size = size;
+    memcpy(nh + 1, ptr, old_size);
     free(ptr);
-    return new_ptr;
+    return (void *)(nh + 1);
 }
 
 void *calloc(size_t nmemb, size_t size) {
+    if (size && nmemb > (size_t)-1 / size) return NULL;
     size_t total = nmemb * size;
     void *ptr = malloc(total);
-    /* mem_alloc already zeroes, so no memset needed */
+    if (ptr) memset(ptr, 0, total);
     return ptr;
 }
 
@@ -113,20 +320,12 @@ void *calloc(size_t nmemb, size_t size) {
 
 __attribute__((weak))
 void *memcpy(void *dst, const void *src, size_t n) {
-    uint8_t *d = (uint8_t *)dst;
-    const uint8_t *s = (const uint8_t *)src;
-    for (size_t i = 0; i < n; i++) d[i] = s[i];
+    mem_copy(dst, src, n);
     return dst;
 }
 
 void *memmove(void *dst, const void *src, size_t n) {
-    uint8_t *d = (uint8_t *)dst;
-    const uint8_t *s = (const uint8_t *)src;
-    if (d < s) {
-        for (size_t i = 0; i < n; i++) d[i] = s[i];
-    } else if (d > s) {
-        for (size_t i = n; i > 0; i--) d[i-1] = s[i-1];
-    }
+    mem_move(dst, src, n);
     return dst;
 }
 
@@ -135,26 +334,16 @@ void __clear_cache(void *beg, void *end) { (void)beg; (void)end; }
 
 __attribute__((weak))
 void *memset(void *s, int c, size_t n) {
-    uint8_t *p = (uint8_t *)s;
-    for (size_t i = 0; i < n; i++) p[i] = (uint8_t)c;
+    mem_set(s, (UINT8)c, n);
     return s;
 }
 
 void *memchr(const void *s, int c, size_t n) {
-    const uint8_t *p = (const uint8_t *)s;
-    for (size_t i = 0; i < n; i++) {
-        if (p[i] == (uint8_t)c) return (void *)(p + i);
-    }
-    return NULL;
+    return (void *)mem_chr(s, (UINT8)c, n);
 }
 
 int memcmp(const void *s1, const void *s2, size_t n) {
-    const uint8_t *a = (const uint8_t *)s1;
-    const uint8_t *b = (const uint8_t *)s2;
-    for (size_t i = 0; i < n; i++) {
-        if (a[i] != b[i]) return (int)a[i] - (int)b[i];
-    }
-    return 0;
+    return mem_cmp(s1, s2, n);
 }
 
 /* libgcc builtins needed by TCC-compiled code.
@@ -185,9 +374,7 @@ double __floatundidf(unsigned long long a) {
 }
 
 size_t strlen(const char *s) {
-    size_t len = 0;
-    while (s[len]) len++;
-    return len;
+    return str_len((const CHAR8 *)s);
 }
 
 char *strcpy(char *dst, const char *src) {
@@ -249,13 +436,7 @@ char *strrchr(const char *s, int c) {
 }
 
 char *strstr(const char *hay, const char *needle) {
-    if (!*needle) return (char *)hay;
-    size_t nlen = strlen(needle);
-    while (*hay) {
-        if (strncmp(hay, needle, nlen) == 0) return (char *)hay;
-        hay++;
-    }
-    return NULL;
+    return (char *)mem_find(hay, strlen(hay), needle, strlen(needle));
 }
 
 char *strdup(const char *s) {
@@ -397,62 +578,19 @@ unsigned long long strtoull(const char *s, char **endp, int base) {
 int atoi(const char *s) { return (int)strtol(s, NULL, 10); }
 long atol(const char *s) { return strtol(s, NULL, 10); }
 
-/* Minimal strtod: integer + decimal + exponent */
+/* Correctly rounded; see fpconv.c */
 double strtod(const char *s, char **endp) {
-    const char *start = s;
-    while (isspace((uint8_t)*s)) s++;
-
-    int neg = 0;
-    if (*s == '-') { neg = 1; s++; }
-    else if (*s == '+') s++;
-
-    double result = 0.0;
-    int any = 0;
-
-    /* Integer part */
-    while (*s >= '0' && *s <= '9') {
-        result = result * 10.0 + (*s - '0');
-        s++;
-        any = 1;
-    }
-
-    /* Decimal part */
-    if (*s == '.') {
-        s++;
-        double frac = 0.1;
-        while (*s >= '0' && *s <= '9') {
-            result += (*s - '0') * frac;
-            frac *= 0.1;
-            s++;
-            any = 1;
-        }
-    }
-
-    /* Exponent part */
-    if (any && (*s == 'e' || *s == 'E')) {
-        s++;
-        int exp_neg = 0;
-        if (*s == '-') { exp_neg = 1; s++; }
-        else if (*s == '+') s++;
-
-        int exp_val = 0;
-        while (*s >= '0' && *s <= '9') {
-            exp_val = exp_val * 10 + (*s - '0');
-            s++;
-        }
-
-        double factor = 1.0;
-        for (int i = 0; i < exp_val; i++) factor *= 10.0;
-        if (exp_neg) result /= factor;
-        else result *= factor;
-    }
-
-    if (endp) *endp = (char *)(any ? s : start);
-    return neg ? -result : result;
+    int erange;
+    double v = fp_strtod(s, endp, &erange);
+    if (erange) errno = ERANGE;
+    return v;
 }
 
 float strtof(const char *s, char **endp) {
-    return (float)strtod(s, endp);
+    int erange;
+    float v = fp_strtof(s, endp, &erange);
+    if (erange) errno = ERANGE;
+    return v;
 }
 
 long double strtold(const char *s, char **endp) {
@@ -534,94 +672,98 @@ static void sn_int(char *buf, size_t size, size_t *pos,
     }
 }
 
+/* Helper: the digits of d without the sign. kind is 'e' or 'f';
+   frac is the number of digits after the point. */
+static void sn_float_body(char *buf, size_t size, size_t *pos,
+                          const struct fp_decimal *d, char kind, int frac,
+                          char exp_ch) {
+    if (kind == 'e') {
+        int x = d->nd ? d->dp - 1 : 0;
+        sn_putc(buf, size, pos, d->nd ? d->d[0] : '0');
+        if (frac > 0) sn_putc(buf, size, pos, '.');
+        for (int i = 1; i <= frac; i++)
+            sn_putc(buf, size, pos, i < d->nd ? d->d[i] : '0');
+        sn_putc(buf, size, pos, exp_ch);
+        sn_putc(buf, size, pos, x < 0 ? '-' : '+');
+        if (x < 0) x = -x;
+        if (x >= 100) sn_putc(buf, size, pos, (char)('0' + x / 100));
+        sn_putc(buf, size, pos, (char)('0' + x / 10 % 10));
+        sn_putc(buf, size, pos, (char)('0' + x % 10));
+        return;
+    }
+
+    int dp = d->nd ? d->dp : 0;
+    if (dp <= 0) sn_putc(buf, size, pos, '0');
+    for (int i = 0; i < dp; i++)
+        sn_putc(buf, size, pos, i < d->nd ? d->d[i] : '0');
+    if (frac > 0) sn_putc(buf, size, pos, '.');
+    for (int i = 0; i < frac; i++) {
+        int k = dp + i;
+        sn_putc(buf, size, pos, (k >= 0 && k < d->nd) ? d->d[k] : '0');
+    }
+}
+
 /* Helper: format a double value as %f, %e, or %g */
 static void sn_float(char *buf, size_t size, size_t *pos,
                      double val, int prec, int width, int zero_pad,
                      int left_align, char fmt_ch) {
-    char tmp[80];
-    int len = 0;
+    struct fp_decimal d;
+    int upper = (fmt_ch >= 'A' && fmt_ch <= 'Z');
+    char lower = upper ? (char)(fmt_ch + 32) : fmt_ch;
+    char kind = 'f';
+    int frac = 0, cls;
 
     if (prec < 0) prec = 6;
 
-    int neg = 0;
-    if (val < 0) { neg = 1; val = -val; }
-
-    if (fmt_ch == 'e' || fmt_ch == 'E') {
-        /* Scientific notation */
-        int exponent = 0;
-        if (val != 0.0) {
-            while (val >= 10.0) { val /= 10.0; exponent++; }
-            while (val < 1.0 && val > 0.0) { val *= 10.0; exponent--; }
-        }
-        /* Format mantissa as fixed point with 1 digit before decimal */
-        if (neg) tmp[len++] = '-';
-        /* Integer part (single digit) */
-        int ipart = (int)val;
-        tmp[len++] = '0' + (ipart % 10);
-        if (prec > 0) {
-            tmp[len++] = '.';
-            double frac = val - (double)ipart;
-            for (int i = 0; i < prec; i++) {
-                frac *= 10.0;
-                int d = (int)frac;
-                if (d > 9) d = 9;
-                tmp[len++] = '0' + d;
-                frac -= (double)d;
-            }
+    if (lower == 'e') {
+        cls = fp_digits(val, FP_SIGNIFICANT, prec + 1, &d);
+        kind = 'e';
+        frac = prec;
+    } else if (lower == 'g') {
+        /* Style e if the exponent is below -4 or at least the precision,
+           then trailing zeros go */
+        int p = prec ? prec : 1;
+        cls = fp_digits(val, FP_SIGNIFICANT, p, &d);
+        int x = d.nd ? d.dp - 1 : 0;
+        if (x < -4 || x >= p) {
+            kind = 'e';
+            frac = d.nd > 1 ? d.nd - 1 : 0;
+        } else {
+            frac = d.nd > d.dp ? d.nd - (d.nd ? d.dp : 0) : 0;
         }
-        /* Exponent */
-        tmp[len++] = fmt_ch;
-        tmp[len++] = (exponent < 0) ? '-' : '+';
-        if (exponent < 0) exponent = -exponent;
-        if (exponent < 10) tmp[len++] = '0';
-        if (exponent >= 100) { tmp[len++] = '0' + (exponent / 100); exponent %= 100; }
-        if (exponent >= 10) { tmp[len++] = '0' + (exponent / 10); exponent %= 10; }
-        tmp[len++] = '0' + exponent;
     } else {
-        /* %f — fixed point */
-        if (neg) tmp[len++] = '-';
-        /* Integer part */
-        unsigned long long ipart = (unsigned long long)val;
-        char itmp[24]; int ilen = 0;
-        if (ipart == 0) itmp[ilen++] = '0';
-        else while (ipart > 0) { itmp[ilen++] = '0' + (int)(ipart % 10); ipart /= 10; }
-        for (int i = ilen - 1; i >= 0; i--) tmp[len++] = itmp[i];
-        if (prec > 0) {
-            tmp[len++] = '.';
-            double frac = val - (double)(unsigned long long)val;
-            for (int i = 0; i < prec && len < 78; i++) {
-                frac *= 10.0;
-                int d = (int)frac;
-                if (d > 9) d = 9;
-                tmp[len++] = '0' + d;
-                frac -= (double)d;
-            }
-        }
-    }
-    tmp[len] = '\0';
-
-    /* %g: strip trailing zeros */
-    if (fmt_ch == 'g' || fmt_ch == 'G') {
-        char *dot = NULL;
-        for (int i = 0; i < len; i++) if (tmp[i] == '.') { dot = &tmp[i]; break; }
-        if (dot) {
-            char *end = tmp + len - 1;
-            while (end > dot && *end == '0') end--;
-            if (end == dot) end--; /* remove dot too */
-            len = (int)(end - tmp + 1);
-            tmp[len] = '\0';
-        }
+        cls = fp_digits(val, FP_FRACTION, prec, &d);
+        frac = prec;
     }
 
-    int pad = (width > len) ? width - len : 0;
-    if (!left_align) {
-        char pc = zero_pad ? '0' : ' ';
-        for (int i = 0; i < pad; i++) sn_putc(buf, size, pos, pc);
+    if (cls != FP_FINITE) {
+        const char *w = cls == FP_INF ? (upper ? "INF" : "inf")
+                                          : (upper ? "NAN" : "nan");
+        int len = 3 + d.neg;
+        int pad = (width > len) ? width - len : 0;
+        if (!left_align)
+            for (int i = 0; i < pad; i++) sn_putc(buf, size, pos, ' ');
+        if (d.neg) sn_putc(buf, size, pos, '-');
+        for (int i = 0; i < 3; i++) sn_putc(buf, size, pos, w[i]);
+        if (left_align)
+            for (int i = 0; i < pad; i++) sn_putc(buf, size, pos, ' ');
+        return;
     }
-    for (int i = 0; i < len; i++) sn_putc(buf, size, pos, tmp[i]);
-    if (left_align) {
+
+    /* Measure first so the padding needs no buffer */
+    char exp_ch = upper ? 'E' : 'e';
+    size_t len = d.neg ? 1 : 0;
+    sn_float_body((char *)"", 1, &len, &d, kind, frac, exp_ch);
+
+    int pad = (width > (int)len) ? width - (int)len : 0;
+    if (!left_align && !zero_pad)
+        for (int i = 0; i < pad; i++) sn_putc(buf, size, pos, ' ');
+    if (d.neg) sn_putc(buf, size, pos, '-');
+    if (!left_align && zero_pad)
+        for (int i = 0; i < pad; i++) sn_putc(buf, size, pos, '0');
+    sn_float_body(buf, size, pos, &d, kind, frac, exp_ch);
+    if (left_align)
         for (int i = 0; i < pad; i++) sn_putc(buf, size, pos, ' ');
-    }
 }
 
 int vsnprintf(char *buf, size_t size, const char *fmt, va_list ap) {
@@ -766,10 +908,8 @@ int vsnprintf(char *buf, size_t size, const char *fmt, va_list ap) {
         }
         case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': {
             double val = va_arg(ap, double);
-            char fc = *fmt;
-            if (fc == 'g' || fc == 'G') fc = 'f'; /* %g uses %f format, then strips zeros */
             sn_float(out, out_size, &pos, val, prec, width, zero_pad, left_align,
-                     (*fmt == 'g' || *fmt == 'G') ? *fmt : fc);
+                     *fmt);
             break;
         }
         case '%':
@@ -813,19 +953,105 @@ int sprintf(char *buf, const char *fmt, ...) {
     return ret;
 }
 
-static void shim_output(const char *s, int to_stderr) {
+/* ---- Console output ----
+ *
+ * stdout collects in s_out and reaches fb_print() once per flush
+ * instead of once per call: at the end of any write that holds a
+ * newline (line buffered, the default), only when full (_IOFBF), or
+ * straight away (_IONBF).  Full buffering also holds the console, so
+ * a burst of output draws only its final screen; the scrollback ring
+ * still has every line.  fb_present() flushes first, so key polls and
+ * sleeps show a pending prompt.  stderr is unbuffered and flushes
+ * stdout first to keep the two in order.
+ */
+#define SHIM_OUT_BUF 4096
+
+static char   s_out[SHIM_OUT_BUF + 1];
+static size_t s_out_len;
+static int    s_out_mode = _IOLBF;
+static int    s_out_hooked;
+
+static void shim_out_flush(void) {
+    if (!s_out_len)
+        return;
+    s_out[s_out_len] = '\0';
+    s_out_len = 0;
+    /* fb_print may present, which calls back here with nothing left */
+    if (g_boot.cols)
+        fb_print(s_out, COLOR_WHITE);
+}
+
+/* Print n bytes without buffering, through a NUL-terminated chunk */
+static void shim_out_direct(const char *s, size_t n, UINT32 fg) {
+    char tmp[257];
+    while (n) {
+        size_t k = n < 256 ? n : 256;
+        memcpy(tmp, s, k);
+        tmp[k] = '\0';
+        if (g_boot.cols)
+            fb_print(tmp, fg);
+        s += k;
+        n -= k;
+    }
+}
+
+static void shim_out_write(const char *s, size_t n, int to_stderr) {
+    if (!s_out_hooked) {
+        fb_set_present_hook(shim_out_flush);
+        s_out_hooked = 1;
+    }
     if (to_stderr) {
         /* Capture to error buffer */
-        int len = (int)strlen(s);
-        for (int i = 0; i < len && shim_errbuf_pos < (int)sizeof(shim_errbuf) - 1; i++) {
+        for (size_t i = 0; i < n && shim_errbuf_pos < (int)sizeof(shim_errbuf) - 1; i++)
             shim_errbuf[shim_errbuf_pos++] = s[i];
-        }
         shim_errbuf[shim_errbuf_pos] = '\0';
+        shim_out_flush();
+        shim_out_direct(s, n, COLOR_RED);
+        return;
     }
-    /* Also print to screen if we have a framebuffer */
-    if (g_boot.framebuffer) {
-        fb_print(s, to_stderr ? COLOR_RED : COLOR_WHITE);
+    if (s_out_mode == _IONBF) {
+        shim_out_direct(s, n, COLOR_WHITE);
+        return;
     }
+    int newline = s_out_mode == _IOLBF && memchr(s, '\n', n) != NULL;
+    while (n) {
+        size_t k = SHIM_OUT_BUF - s_out_len;
+        if (k > n) k = n;
+        memcpy(s_out + s_out_len, s, k);
+        s_out_len += k;
+        s += k;
+        n -= k;
+        if (s_out_len == SHIM_OUT_BUF)
+            shim_out_flush();
+    }
+    if (newline)
+        shim_out_flush();
+}
+
+static void shim_output(const char *s, int to_stderr) {
+    shim_out_write(s, strlen(s), to_stderr);
+}
+
+int setvbuf(FILE *f, char *buf, int mode, size_t size) {
+    (void)buf; (void)size;
+    if (mode != _IOFBF && mode != _IOLBF && mode != _IONBF)
+        return -1;
+    if (f != stdout)
+        return 0;
+    shim_out_flush();
+    if ((mode == _IOFBF) != (s_out_mode == _IOFBF))
+        fb_print_hold(mode == _IOFBF);
+    s_out_mode = mode;
+    return 0;
+}
+
+void setbuf(FILE *f, char *buf) {
+    setvbuf(f, buf, buf ? _IOFBF : _IONBF, BUFSIZ);
+}
+
+void shim_console_reset(void) {
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    shim_out_flush();
 }
 
 int printf(const char *fmt, ...) {
@@ -865,8 +1091,8 @@ int fputs(const char *s, FILE *f) {
 }
 
 int fputc(int c, FILE *f) {
-    char buf[2] = { (char)c, '\0' };
-    shim_output(buf, (f == stderr));
+    char ch = (char)c;
+    shim_out_write(&ch, 1, (f == stderr));
     return c;
 }
 
@@ -875,7 +1101,11 @@ int putchar(int c) {
 }
 
 int fflush(FILE *f) {
-    (void)f;
+    if (!f || f == stdout) {
+        shim_out_flush();
+        if (g_boot.cols)
+            fb_present();
+    }
     return 0;
 }
 
@@ -938,18 +1168,186 @@ int sscanf(const char *str, const char *fmt, ...) {
 #define FD_MAX 64
 #define FD_OFFSET 3  /* skip stdin=0, stdout=1, stderr=2 */
 
+/* Write window: bytes held before they are streamed to the volume */
+#define FD_WBUF (64 * 1024)
+
+/* Bytes written behind the streamed end on an append-only volume */
+struct fd_patch {
+    struct fd_patch *next;
+    size_t  off;
+    size_t  len;
+    char    data[];
+};
+
+/* Read fds stream from the volume through an fs_file, whose own window
+   buffer serves the short reads the preprocessor issues.  Write fds
+   stream too: data collects in a fixed window that goes out through
+   fs_stream_write when it fills, so output is never held whole.  The
+   PE writer seeks back to patch its checksum; SFS streams follow the
+   seek, while exFAT and FAT32 streams are append-only, so bytes written
+   behind their end are kept as patches and applied on close. */
 struct fd_slot {
-    char   *data;
+    struct fs_file *file; /* read or write stream */
+    char   *data;      /* write window, or whole file for small reads */
     size_t  size;
     size_t  pos;
-    size_t  cap;       /* buffer capacity (for writable fds) */
+    size_t  woff;      /* file offset of data[0] (writable fds) */
+    size_t  wlen;      /* bytes pending in the write window */
+    size_t  spos;      /* position of the write stream */
     int     used;
     int     writable;
-    CHAR16  wpath[512]; /* path for write-back on close */
+    int     failed;    /* a write could not be committed */
+    struct fd_patch *patches;
+    struct fcache_ent *cache; /* data borrowed from the file cache */
+    CHAR16  wpath[512]; /* path for applying patches on close */
 };
 
 static struct fd_slot fd_table[FD_MAX];
 
+/* ---- Read-only file cache ----
+ *
+ * Every translation unit of a rebuild includes the same headers, so
+ * small files opened read-only are loaded whole once and kept.  Entries
+ * are keyed by path and fs_generation() and are immutable: an open fd
+ * borrows the buffer instead of copying it.  fs.c reports each file it
+ * replaces, deletes or renames (editor saves included), which drops the
+ * entry; one still open stays alive until its last close.  Unused
+ * entries are evicted least recently used first to stay within
+ * MEM_BUDGET_FCACHE, which shrinks when memory for a file runs out.
+ */
+#define FCACHE_SLOTS    128
+#define FCACHE_FILE_MAX (256 * 1024)
+#define FCACHE_PATH     160
+
+struct fcache_ent {
+    char   *data;      /* NULL = empty slot */
+    size_t  size;
+    UINT32  gen;
+    UINT32  hash;
+    UINT32  stamp;     /* LRU */
+    int     refs;      /* fds borrowing the buffer */
+    int     stale;     /* dropped while borrowed */
+    CHAR16  path[FCACHE_PATH];
+};
+
+static struct fcache_ent s_fcache[FCACHE_SLOTS];
+static size_t s_fcache_bytes;
+static UINT32 s_fcache_clock;
+static int    s_fcache_hooked;
+
+static CHAR16 fcache_fold(CHAR16 c) {
+    return (c >= L'A' && c <= L'Z') ? (CHAR16)(c + 32) : c;
+}
+
+/* Hash of the case-folded path (FAT and exFAT names are case-insensitive).
+   Returns -1 in *len when the path is too long to cache. */
+static UINT32 fcache_hash(const CHAR16 *path, int *len) {
+    UINT32 h = 2166136261u;
+    int i = 0;
+    for (; path[i]; i++)
+        h = (h ^ fcache_fold(path[i])) * 16777619u;
+    *len = i < FCACHE_PATH ? i : -1;
+    return h;
+}
+
+static int fcache_same(const CHAR16 *a, const CHAR16 *b) {
+    while (*a && fcache_fold(*a) == fcache_fold(*b)) { a++; b++; }
+    return *a == *b;
+}
+
+/* 1 when path is name itself or lies under directory name */
+static int fcache_under(const CHAR16 *path, const CHAR16 *name) {
+    int i = 0;
+    for (; name[i]; i++)
+        if (fcache_fold(path[i]) != fcache_fold(name[i]))
+            return 0;
+    return path[i] == 0 || path[i] == L'\\';
+}
+
+static void fcache_free(struct fcache_ent *e) {
+    s_fcache_bytes -= e->size;
+    mem_free(e->data);
+    memset(e, 0, sizeof(*e));
+}
+
+static void fcache_drop(struct fcache_ent *e) {
+    if (e->refs > 0)
+        e->stale = 1;
+    else
+        fcache_free(e);
+}
+
+/* fs.c write listener; NULL drops everything */
+static void fcache_forget(const CHAR16 *path) {
+    for (int i = 0; i < FCACHE_SLOTS; i++) {
+        struct fcache_ent *e = &s_fcache[i];
+        if (e->data && !e->stale && (!path || fcache_under(e->path, path)))
+            fcache_drop(e);
+    }
+}
+
+static struct fcache_ent *fcache_find(const CHAR16 *path, UINT32 hash) {
+    UINT32 gen = fs_generation();
+    for (int i = 0; i < FCACHE_SLOTS; i++) {
+        struct fcache_ent *e = &s_fcache[i];
+        if (e->data && !e->stale && e->gen == gen && e->hash == hash &&
+            fcache_same(e->path, path))
+            return e;
+    }
+    return NULL;
+}
+
+/* A free slot with room for size more bytes, evicting unused entries
+   (other generations first, then least recently used). NULL if the
+   borrowed entries alone leave no room. */
+static struct fcache_ent *fcache_reserve(size_t size) {
+    UINT32 gen = fs_generation();
+    for (int i = 0; i < FCACHE_SLOTS; i++) {
+        struct fcache_ent *e = &s_fcache[i];
+        if (e->data && e->refs == 0 && e->gen != gen)
+            fcache_free(e);
+    }
+    for (;;) {
+        struct fcache_ent *empty = NULL, *lru = NULL;
+        for (int i = 0; i < FCACHE_SLOTS; i++) {
+            struct fcache_ent *e = &s_fcache[i];
+            if (!e->data) {
+                if (!empty) empty = e;
+            } else if (e->refs == 0 && (!lru || e->stamp < lru->stamp)) {
+                lru = e;
+            }
+        }
+        if (empty && s_fcache_bytes + size <= mem_budget(MEM_BUDGET_FCACHE))
+            return empty;
+        if (!lru)
+            return NULL;
+        fcache_free(lru);
+    }
+}
+
+/* Read a whole small file into a new buffer. Returns NULL on error. */
+static char *read_whole(struct fs_file *file, size_t size) {
+    char *buf = (char *)mem_alloc(size ? size : 1);
+    if (!buf) {
+        /* Make room by keeping fewer files */
+        mem_budget_shrink(MEM_BUDGET_FCACHE);
+        fcache_reserve(0);
+        buf = (char *)mem_alloc(size ? size : 1);
+        if (!buf)
+            return NULL;
+    }
+    size_t done = 0;
+    while (done < size) {
+        UINTN got = size - done;
+        if (fs_stream_read(file, buf + done, &got) != 0 || got == 0) {
+            mem_free(buf);
+            return NULL;
+        }
+        done += got;
+    }
+    return buf;
+}
+
 /* Convert ASCII path to CHAR16 for UEFI */
 static void path_to_uefi(const char *path, CHAR16 *out, size_t max) {
     size_t i = 0;
@@ -983,30 +1381,79 @@ int open(const char *path, int flags, ...) {
     path_to_uefi(path, upath, 512);
 
     if (flags & (O_WRONLY | O_CREAT)) {
-        /* Write mode: start with empty growable buffer */
-        fd_table[slot].data = (char *)mem_alloc(4096);
-        fd_table[slot].size = 0;
-        fd_table[slot].cap = 4096;
-        fd_table[slot].pos = 0;
+        /* Write mode: stream through a fixed window */
+        char *win = (char *)mem_alloc(FD_WBUF);
+        struct fs_file *file = win ? fs_open_overwrite(NULL, upath) : NULL;
+        if (!file) {
+            if (win) mem_free(win);
+            errno = win ? EACCES : ENOMEM;
+            return -1;
+        }
+        memset(&fd_table[slot], 0, sizeof(struct fd_slot));
+        fd_table[slot].file = file;
+        fd_table[slot].data = win;
         fd_table[slot].used = 1;
         fd_table[slot].writable = 1;
         memcpy(fd_table[slot].wpath, upath, 512 * sizeof(CHAR16));
         return slot + FD_OFFSET;
     }
 
-    /* Read mode */
-    UINTN fsize = 0;
-    char *data = (char *)fs_readfile(upath, &fsize);
-    if (!data) {
+    /* Read mode: small files come from (or go into) the file cache */
+    if (!s_fcache_hooked) {
+        fs_set_write_listener(fcache_forget);
+        s_fcache_hooked = 1;
+    }
+    int plen;
+    UINT32 hash = fcache_hash(upath, &plen);
+    struct fcache_ent *e = plen >= 0 ? fcache_find(upath, hash) : NULL;
+    if (e) {
+        e->refs++;
+        e->stamp = ++s_fcache_clock;
+        fd_table[slot].data = e->data;
+        fd_table[slot].size = e->size;
+        fd_table[slot].cache = e;
+        fd_table[slot].pos = 0;
+        fd_table[slot].used = 1;
+        fd_table[slot].writable = 0;
+        return slot + FD_OFFSET;
+    }
+
+    UINT64 fsize = 0;
+    struct fs_file *file = fs_open_read(NULL, upath, &fsize);
+    if (!file) {
         errno = ENOENT; return -1;
     }
 
-    fd_table[slot].data = data;
-    fd_table[slot].size = fsize;
+    fd_table[slot].size = (size_t)fsize;
     fd_table[slot].pos = 0;
     fd_table[slot].used = 1;
     fd_table[slot].writable = 0;
 
+    if (fsize > FCACHE_FILE_MAX) {
+        fd_table[slot].file = file;
+        return slot + FD_OFFSET;
+    }
+
+    char *buf = read_whole(file, (size_t)fsize);
+    fs_stream_close(file);
+    if (!buf) {
+        memset(&fd_table[slot], 0, sizeof(struct fd_slot));
+        errno = EIO; return -1;
+    }
+    fd_table[slot].data = buf;
+
+    e = plen >= 0 ? fcache_reserve((size_t)fsize) : NULL;
+    if (e) {
+        e->data = buf;
+        e->size = (size_t)fsize;
+        e->gen = fs_generation();
+        e->hash = hash;
+        e->stamp = ++s_fcache_clock;
+        e->refs = 1;
+        memcpy(e->path, upath, (size_t)(plen + 1) * sizeof(CHAR16));
+        s_fcache_bytes += e->size;
+        fd_table[slot].cache = e;
+    }
     return slot + FD_OFFSET;
 }
 
@@ -1017,51 +1464,142 @@ ssize_t read(int fd, void *buf, size_t count) {
         return -1;
     }
     struct fd_slot *f = &fd_table[slot];
+    if (f->writable) {
+        errno = EBADF;
+        return -1;
+    }
     size_t avail = f->size - f->pos;
     if (count > avail) count = avail;
-    if (count > 0) {
+    if (count == 0) return 0;
+    if (f->file) {
+        UINTN got = count;
+        if (fs_stream_seek(f->file, f->pos) != 0 ||
+            fs_stream_read(f->file, buf, &got) != 0) {
+            errno = EIO;
+            return -1;
+        }
+        count = got;
+    } else {
         memcpy(buf, f->data + f->pos, count);
-        f->pos += count;
     }
+    f->pos += count;
     return (ssize_t)count;
 }
 
-ssize_t write(int fd, const void *buf, size_t count) {
-    if (fd == 1) {
-        /* stdout */
-        char tmp[1025];
-        size_t n = count > 1024 ? 1024 : count;
-        memcpy(tmp, buf, n);
-        tmp[n] = '\0';
-        shim_output(tmp, 0);
-        return (ssize_t)count;
+/* Remember bytes written behind the end of an append-only stream */
+static int fd_patch_add(struct fd_slot *f, size_t off, const char *src, size_t len) {
+    struct fd_patch *p = (struct fd_patch *)mem_alloc(sizeof(struct fd_patch) + len);
+    if (!p)
+        return -1;
+    p->next = NULL;
+    p->off = off;
+    p->len = len;
+    memcpy(p->data, src, len);
+    struct fd_patch **tail = &f->patches;
+    while (*tail)
+        tail = &(*tail)->next;
+    *tail = p;
+    return 0;
+}
+
+/* Stream the write window out at woff. Returns 0 on success. */
+static int fd_flush(struct fd_slot *f) {
+    const char *src = f->data;
+    size_t off = f->woff, n = f->wlen;
+    f->woff += f->wlen;
+    f->wlen = 0;
+    if (n == 0)
+        return 0;
+    if (off != f->spos) {
+        if (fs_stream_seek(f->file, off) == 0) {
+            f->spos = off;
+        } else {
+            /* Append-only: whatever lies behind the end becomes a patch */
+            if (off > f->spos)
+                return -1;
+            size_t behind = f->spos - off;
+            if (behind > n) behind = n;
+            if (fd_patch_add(f, off, src, behind) != 0)
+                return -1;
+            src += behind;
+            off += behind;
+            n -= behind;
+            if (n == 0)
+                return 0;
+        }
     }
-    if (fd == 2) {
-        /* stderr */
-        char tmp[1025];
-        size_t n = count > 1024 ? 1024 : count;
-        memcpy(tmp, buf, n);
-        tmp[n] = '\0';
-        shim_output(tmp, 1);
+    if (fs_stream_write(f->file, src, n) != 0)
+        return -1;
+    f->spos = off + n;
+    return 0;
+}
+
+/* Rewrite a closed file with its patches applied. This is the one
+   path that holds a written file whole, and only append-only volumes
+   whose writer seeked back take it. */
+static int fd_apply_patches(struct fd_slot *f) {
+    UINT64 fsize = 0;
+    struct fs_file *file = fs_open_read(NULL, f->wpath, &fsize);
+    if (!file)
+        return -1;
+    char *buf = read_whole(file, (size_t)fsize);
+    fs_stream_close(file);
+    if (!buf)
+        return -1;
+    for (struct fd_patch *p = f->patches; p; p = p->next) {
+        if (p->off + p->len <= fsize)
+            memcpy(buf + p->off, p->data, p->len);
+    }
+    EFI_STATUS status = fs_writefile(f->wpath, buf, (UINTN)fsize);
+    mem_free(buf);
+    return EFI_ERROR(status) ? -1 : 0;
+}
+
+ssize_t write(int fd, const void *buf, size_t count) {
+    if (fd == 1 || fd == 2) {
+        shim_out_write((const char *)buf, count, fd == 2);
         return (ssize_t)count;
     }
     /* Regular file write */
     int slot = fd - FD_OFFSET;
     if (slot >= 0 && slot < FD_MAX && fd_table[slot].used && fd_table[slot].writable) {
         struct fd_slot *f = &fd_table[slot];
-        size_t need = f->pos + count;
-        if (need > f->cap) {
-            size_t new_cap = f->cap * 2;
-            if (new_cap < need) new_cap = need;
-            char *new_data = (char *)mem_alloc(new_cap);
-            if (f->size > 0) memcpy(new_data, f->data, f->size);
-            mem_free(f->data);
-            f->data = new_data;
-            f->cap = new_cap;
+        const char *src = (const char *)buf;
+        size_t left = count;
+        while (left > 0) {
+            /* The window only grows contiguously from woff */
+            if (f->pos < f->woff || f->pos > f->woff + f->wlen ||
+                f->pos == f->woff + FD_WBUF) {
+                if (fd_flush(f) != 0) {
+                    f->failed = 1;
+                    errno = EIO;
+                    return -1;
+                }
+                f->woff = f->pos;
+            }
+            size_t n;
+            if (f->wlen == 0 && left >= FD_WBUF && f->pos == f->spos) {
+                /* Large sequential writes bypass the window */
+                if (fs_stream_write(f->file, src, left) != 0) {
+                    f->failed = 1;
+                    errno = EIO;
+                    return -1;
+                }
+                n = left;
+                f->spos += n;
+                f->woff += n;
+            } else {
+                size_t at = f->pos - f->woff;
+                n = FD_WBUF - at;
+                if (n > left) n = left;
+                memcpy(f->data + at, src, n);
+                if (at + n > f->wlen) f->wlen = at + n;
+            }
+            f->pos += n;
+            src += n;
+            left -= n;
+            if (f->pos > f->size) f->size = f->pos;
         }
-        memcpy(f->data + f->pos, buf, count);
-        f->pos += count;
-        if (f->pos > f->size) f->size = f->pos;
         return (ssize_t)count;
     }
     errno = EBADF;
@@ -1094,15 +1632,37 @@ int close(int fd) {
         errno = EBADF;
         return -1;
     }
-    /* Flush writable files to filesystem */
-    if (fd_table[slot].writable && fd_table[slot].data && fd_table[slot].size > 0) {
-        fs_writefile(fd_table[slot].wpath, fd_table[slot].data, fd_table[slot].size);
+    /* Commit what is left of the window, then any patches */
+    int rc = 0;
+    struct fd_slot *f = &fd_table[slot];
+    if (f->writable) {
+        if (fd_flush(f) != 0) f->failed = 1;
+        if (fs_stream_close(f->file) != 0) f->failed = 1;
+        f->file = NULL;
+        if (f->patches && !f->failed && fd_apply_patches(f) != 0)
+            f->failed = 1;
+        while (f->patches) {
+            struct fd_patch *p = f->patches;
+            f->patches = p->next;
+            mem_free(p);
+        }
+        if (f->failed) {
+            errno = EIO;
+            rc = -1;
+        }
     }
-    if (fd_table[slot].data) {
+    struct fcache_ent *e = fd_table[slot].cache;
+    if (e) {
+        if (--e->refs == 0 && e->stale)
+            fcache_free(e);
+    } else if (fd_table[slot].data) {
         mem_free(fd_table[slot].data);
     }
+    if (fd_table[slot].file) {
+        fs_stream_close(fd_table[slot].file);
+    }
     memset(&fd_table[slot], 0, sizeof(struct fd_slot));
-    return 0;
+    return rc;
 }
 
 /* ================================================================
@@ -1134,16 +1694,7 @@ size_t fread(void *ptr, size_t size, size_t nmemb, FILE *f) {
 size_t fwrite(const void *ptr, size_t size, size_t nmemb, FILE *f) {
     size_t total = size * nmemb;
     if (f == stdout || f == stderr) {
-        char buf[1025];
-        size_t done = 0;
-        while (done < total) {
-            size_t chunk = total - done;
-            if (chunk > 1024) chunk = 1024;
-            memcpy(buf, (const char *)ptr + done, chunk);
-            buf[chunk] = '\0';
-            shim_output(buf, (f == stderr));
-            done += chunk;
-        }
+        shim_out_write((const char *)ptr, total, f == stderr);
         return nmemb;
     }
     int fd = FILE_TO_FD(f);
@@ -1252,13 +1803,6 @@ void _exit(int status) { exit(status); }
 
 char *getenv(const char *name) { (void)name; return NULL; }
 
-time_t time(time_t *t) {
-    if (t) *t = 0;
-    return 0;
-}
-
-static struct tm zero_tm;
-struct tm *localtime(const time_t *t) { (void)t; return &zero_tm; }
 
 char *getcwd(char *buf, size_t size) {
     if (buf && size > 1) {
@@ -1268,28 +1812,283 @@ char *getcwd(char *buf, size_t size) {
     return buf;
 }
 
+/* ---- Clocks ----
+ *
+ * The wall clock is read from the firmware once and then advanced by
+ * the cycle counter (timer.c), so reading it costs no runtime call and
+ * never steps backwards.  UEFI gives the zone as minutes from UTC
+ * (UTC = local - TimeZone) or leaves it unspecified, in which case the
+ * RTC is taken to be UTC.  CLOCK_MONOTONIC and clock() are the counter
+ * alone.
+ */
+#define EFI_UNSPECIFIED_TIMEZONE 0x07FF
+
+static INT64  s_rt_base;        /* epoch seconds at s_rt_ticks */
+static UINT32 s_rt_base_ns;
+static UINT64 s_rt_ticks;
+static INT16  s_rt_zone = EFI_UNSPECIFIED_TIMEZONE;
+static int    s_rt_ready;
+static struct tm s_tm;
+
+/* Days since 1970-01-01 of a proleptic Gregorian date */
+static INT64 days_from_civil(INT64 y, int m, int d) {
+    y -= m <= 2;
+    INT64 era = (y >= 0 ? y : y - 399) / 400;
+    INT64 yoe = y - era * 400;
+    INT64 doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+    INT64 doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+    return era * 146097 + doe - 719468;
+}
+
+static void rt_init(void) {
+    s_rt_ready = 1;
+    timer_hz();
+    s_rt_ticks = timer_ticks();
+    EFI_TIME et;
+    if (!g_boot.rs || EFI_ERROR(g_boot.rs->GetTime(&et, NULL)))
+        return;
+    INT64 secs = days_from_civil(et.Year, et.Month, et.Day) * 86400 +
+                 et.Hour * 3600 + et.Minute * 60 + et.Second;
+    if (et.TimeZone != EFI_UNSPECIFIED_TIMEZONE &&
+        et.TimeZone >= -1440 && et.TimeZone <= 1440) {
+        secs -= (INT64)et.TimeZone * 60;
+        s_rt_zone = et.TimeZone;
+    }
+    s_rt_base = secs;
+    s_rt_base_ns = et.Nanosecond < 1000000000 ? et.Nanosecond : 0;
+}
+
+int clock_gettime(clockid_t id, struct timespec *ts) {
+    if (!ts) { errno = EINVAL; return -1; }
+    if (id == CLOCK_MONOTONIC) {
+        UINT64 ns = bench_ns();
+        ts->tv_sec = (time_t)(ns / 1000000000ULL);
+        ts->tv_nsec = (long)(ns % 1000000000ULL);
+        return 0;
+    }
+    if (id != CLOCK_REALTIME) { errno = EINVAL; return -1; }
+    if (!s_rt_ready)
+        rt_init();
+    UINT64 ns = s_rt_base_ns + timer_ns(timer_ticks() - s_rt_ticks);
+    ts->tv_sec = (time_t)(s_rt_base + (INT64)(ns / 1000000000ULL));
+    ts->tv_nsec = (long)(ns % 1000000000ULL);
+    return 0;
+}
+
+time_t time(time_t *t) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    if (t) *t = ts.tv_sec;
+    return ts.tv_sec;
+}
+
 int gettimeofday(struct timeval *tv, void *tz) {
     (void)tz;
-    if (tv) { tv->tv_sec = 0; tv->tv_usec = 0; }
+    if (tv) {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        tv->tv_sec = (long)ts.tv_sec;
+        tv->tv_usec = ts.tv_nsec / 1000;
+    }
     return 0;
 }
 
-/* Simple insertion sort for qsort */
-void qsort(void *base, size_t nmemb, size_t size,
-            int (*compar)(const void *, const void *)) {
-    char *b = (char *)base;
-    char *tmp = (char *)malloc(size);
-    if (!tmp) return;
-    for (size_t i = 1; i < nmemb; i++) {
-        size_t j = i;
-        while (j > 0 && compar(b + j * size, b + (j-1) * size) < 0) {
-            memcpy(tmp, b + j * size, size);
-            memcpy(b + j * size, b + (j-1) * size, size);
-            memcpy(b + (j-1) * size, tmp, size);
-            j--;
+clock_t clock(void) {
+    return (clock_t)(bench_ns() / (1000000000ULL / CLOCKS_PER_SEC));
+}
+
+struct tm *gmtime(const time_t *t) {
+    INT64 secs = t ? *t : 0;
+    INT64 days = secs / 86400, rem = secs % 86400;
+    if (rem < 0) { rem += 86400; days--; }
+    s_tm.tm_hour = (int)(rem / 3600);
+    s_tm.tm_min = (int)(rem / 60 % 60);
+    s_tm.tm_sec = (int)(rem % 60);
+    s_tm.tm_wday = (int)((days % 7 + 11) % 7);     /* 1970-01-01 was a Thursday */
+
+    /* Civil date from the day count */
+    INT64 z = days + 719468;
+    INT64 era = (z >= 0 ? z : z - 146096) / 146097;
+    INT64 doe = z - era * 146097;
+    INT64 yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    INT64 doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    INT64 mp = (5 * doy + 2) / 153;
+    int mday = (int)(doy - (153 * mp + 2) / 5 + 1);
+    int mon = (int)(mp < 10 ? mp + 3 : mp - 9);
+    INT64 year = yoe + era * 400 + (mon <= 2);
+    s_tm.tm_mday = mday;
+    s_tm.tm_mon = mon - 1;
+    s_tm.tm_year = (int)(year - 1900);
+    s_tm.tm_yday = (int)(days - days_from_civil(year, 1, 1));
+    s_tm.tm_isdst = 0;
+    return &s_tm;
+}
+
+struct tm *localtime(const time_t *t) {
+    if (!s_rt_ready)
+        rt_init();
+    time_t local = t ? *t : 0;
+    if (s_rt_zone != EFI_UNSPECIFIED_TIMEZONE)
+        local += (time_t)s_rt_zone * 60;
+    return gmtime(&local);
+}
+
+/* ---- Sorting ----
+ *
+ * Introsort: median-of-three quicksort with Hoare partitioning (equal
+ * keys stop both scans, so runs of duplicates split evenly), a
+ * heapsort fallback once the depth passes 2 log2 n, and insertion sort
+ * below SORT_INSERTION elements.  The smaller side recurses and the
+ * larger one loops, so the stack stays O(log n).  Elements of 4, 8
+ * and 16 bytes that are aligned for it are swapped as words. */
+#define SORT_INSERTION 16
+
+typedef void (*sort_swap_fn)(char *a, char *b, size_t size);
+
+struct sort_ctx {
+    size_t       size;
+    int        (*cmp)(const void *, const void *, void *);
+    void        *arg;
+    sort_swap_fn swap;
+};
+
+static void swap4(char *a, char *b, size_t size) {
+    (void)size;
+    UINT32 t = *(UINT32 *)a;
+    *(UINT32 *)a = *(UINT32 *)b;
+    *(UINT32 *)b = t;
+}
+
+static void swap8(char *a, char *b, size_t size) {
+    (void)size;
+    UINT64 t = *(UINT64 *)a;
+    *(UINT64 *)a = *(UINT64 *)b;
+    *(UINT64 *)b = t;
+}
+
+static void swap16(char *a, char *b, size_t size) {
+    (void)size;
+    UINT64 t0 = ((UINT64 *)a)[0], t1 = ((UINT64 *)a)[1];
+    ((UINT64 *)a)[0] = ((UINT64 *)b)[0];
+    ((UINT64 *)a)[1] = ((UINT64 *)b)[1];
+    ((UINT64 *)b)[0] = t0;
+    ((UINT64 *)b)[1] = t1;
+}
+
+static void swap_bytes(char *a, char *b, size_t size) {
+    while (size--) {
+        char t = *a;
+        *a++ = *b;
+        *b++ = t;
+    }
+}
+
+static sort_swap_fn sort_pick_swap(const void *base, size_t size) {
+    UINTN align = (UINTN)base | size;
+    if (size == 4 && !(align & 3)) return swap4;
+    if (size == 8 && !(align & 7)) return swap8;
+    if (size == 16 && !(align & 7)) return swap16;
+    return swap_bytes;
+}
+
+static void sort_insertion(const struct sort_ctx *c, char *lo, size_t n) {
+    size_t sz = c->size;
+    for (size_t i = 1; i < n; i++)
+        for (char *p = lo + i * sz;
+             p > lo && c->cmp(p, p - sz, c->arg) < 0; p -= sz)
+            c->swap(p, p - sz, sz);
+}
+
+static void sort_sift(const struct sort_ctx *c, char *lo, size_t root,
+                      size_t n) {
+    size_t sz = c->size;
+    for (;;) {
+        size_t child = 2 * root + 1;
+        if (child >= n)
+            break;
+        if (child + 1 < n &&
+            c->cmp(lo + child * sz, lo + (child + 1) * sz, c->arg) < 0)
+            child++;
+        if (c->cmp(lo + root * sz, lo + child * sz, c->arg) >= 0)
+            break;
+        c->swap(lo + root * sz, lo + child * sz, sz);
+        root = child;
+    }
+}
+
+static void sort_heap(const struct sort_ctx *c, char *lo, size_t n) {
+    for (size_t i = n / 2; i-- > 0; )
+        sort_sift(c, lo, i, n);
+    while (n > 1) {
+        n--;
+        c->swap(lo, lo + n * c->size, c->size);
+        sort_sift(c, lo, 0, n);
+    }
+}
+
+static void sort_range(const struct sort_ctx *c, char *lo, size_t n,
+                       int depth) {
+    size_t sz = c->size;
+    while (n > SORT_INSERTION) {
+        if (depth-- == 0) {
+            sort_heap(c, lo, n);
+            return;
+        }
+
+        /* Median of lo, mid and hi, then parked at lo as the pivot */
+        char *mid = lo + (n / 2) * sz, *hi = lo + (n - 1) * sz;
+        if (c->cmp(mid, lo, c->arg) < 0) c->swap(mid, lo, sz);
+        if (c->cmp(hi, mid, c->arg) < 0) {
+            c->swap(hi, mid, sz);
+            if (c->cmp(mid, lo, c->arg) < 0) c->swap(mid, lo, sz);
+        }
+        c->swap(lo, mid, sz);
+
+        size_t i = 0, j = n;
+        for (;;) {
+            do i++; while (i < n && c->cmp(lo + i * sz, lo, c->arg) < 0);
+            do j--; while (j > 0 && c->cmp(lo + j * sz, lo, c->arg) > 0);
+            if (i >= j)
+                break;
+            c->swap(lo + i * sz, lo + j * sz, sz);
+        }
+        c->swap(lo, lo + j * sz, sz);
+
+        /* [0, j) <= pivot == [j] <= (j, n) */
+        size_t left = j, right = n - j - 1;
+        if (left < right) {
+            sort_range(c, lo, left, depth);
+            lo += (j + 1) * sz;
+            n = right;
+        } else {
+            sort_range(c, lo + (j + 1) * sz, right, depth);
+            n = left;
         }
     }
-    free(tmp);
+    sort_insertion(c, lo, n);
+}
+
+void qsort_r(void *base, size_t nmemb, size_t size,
+             int (*compar)(const void *, const void *, void *), void *arg) {
+    if (nmemb < 2 || !size)
+        return;
+    struct sort_ctx c = { size, compar, arg, sort_pick_swap(base, size) };
+    int depth = 0;
+    for (size_t n = nmemb; n > 1; n >>= 1)
+        depth += 2;
+    sort_range(&c, (char *)base, nmemb, depth);
+}
+
+/* qsort_r's comparator signature, for the plain one passed as arg */
+static int sort_plain_cmp(const void *a, const void *b, void *arg) {
+    int (*compar)(const void *, const void *) =
+        (int (*)(const void *, const void *))(UINTN)arg;
+    return compar(a, b);
+}
+
+void qsort(void *base, size_t nmemb, size_t size,
+           int (*compar)(const void *, const void *)) {
+    qsort_r(base, nmemb, size, sort_plain_cmp, (void *)(UINTN)compar);
 }
 
 void *bsearch(const void *key, const void *base, size_t nmemb, size_t size,
@@ -1361,27 +2160,9 @@ int isatty(int fd) { (void)fd; return 0; }
 pid_t getpid(void) { return 1; }
 
 unsigned int sleep(unsigned int seconds) {
+    fb_present();
     if (g_boot.bs) {
         g_boot.bs->Stall(seconds * 1000000ULL);
     }
     return 0;
 }
-
-/* Math stubs */
-double ldexp(double x, int exp) {
-    double factor = 1.0;
-    int neg = 0;
-    if (exp < 0) { neg = 1; exp = -exp; }
-    for (int i = 0; i < exp; i++) factor *= 2.0;
-    return neg ? x / factor : x * factor;
-}
-
-double frexp(double x, int *exp) {
-    if (x == 0.0) { *exp = 0; return 0.0; }
-    *exp = 0;
-    int neg = 0;
-    if (x < 0) { neg = 1; x = -x; }
-    while (x >= 1.0) { x *= 0.5; (*exp)++; }
-    while (x < 0.5) { x *= 2.0; (*exp)--; }
-    return neg ? -x : x;
-}
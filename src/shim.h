@@ -183,6 +183,13 @@ extern FILE *stderr;
 #define BUFSIZ 1024
 #endif
 
+/* setvbuf modes */
+#ifndef _IOFBF
+#define _IOFBF 0
+#define _IOLBF 1
+#define _IONBF 2
+#endif
+
 /* ---- fcntl / open flags ---- */
 #ifndef O_RDONLY
 #define O_RDONLY  0
@@ -226,6 +233,18 @@ struct timeval {
     long tv_usec;
 };
 
+#ifndef CLOCK_REALTIME
+struct timespec {
+    time_t tv_sec;
+    long   tv_nsec;
+};
+typedef int  clockid_t;
+typedef long clock_t;
+#define CLOCK_REALTIME  0
+#define CLOCK_MONOTONIC 1
+#define CLOCKS_PER_SEC  1000000L
+#endif
+
 /* ---- assert ---- */
 #ifndef assert
 #define assert(x) ((void)0)
@@ -260,6 +279,28 @@ void  free(void *ptr);
 void *realloc(void *ptr, size_t size);
 void *calloc(size_t nmemb, size_t size);
 
+/* Arena mode: between begin and end the malloc family draws from a
+   private region that end releases in one pass. Brackets a TCCState
+   from tcc_new() to tcc_delete(); nested pairs join the outer arena. */
+void shim_arena_begin(void);
+void shim_arena_end(void);
+
+/* Leave what the open arena holds now allocated for good, past
+   shim_arena_end(): for a program still running on another core
+   (aprun.h) */
+void shim_arena_keep(void);
+
+/* malloc-family counters since boot; arena_* describe the open arena */
+struct shim_alloc_stats {
+    uint64_t mallocs, frees;
+    uint64_t reallocs, reallocs_in_place;
+    uint64_t arenas;            /* arenas opened */
+    uint64_t arena_bytes;       /* chunks and big blocks held now */
+    uint64_t arena_peak;        /* largest arena_bytes seen */
+    uint64_t arena_chunks, arena_big;
+};
+void shim_get_alloc_stats(struct shim_alloc_stats *out);
+
 /* ---- String ---- */
 void *memcpy(void *dst, const void *src, size_t n);
 void *memmove(void *dst, const void *src, size_t n);
@@ -307,6 +348,12 @@ int fputs(const char *s, FILE *f);
 int fputc(int c, FILE *f);
 int putchar(int c);
 int fflush(FILE *f);
+/* Only stdout is buffered: line buffered by default; _IOFBF also holds
+   the console so a burst renders only its final screen. buf is unused. */
+int  setvbuf(FILE *f, char *buf, int mode, size_t size);
+void setbuf(FILE *f, char *buf);
+/* Flush stdout and return it to line buffering (after each program run) */
+void shim_console_reset(void);
 
 /* ---- File I/O (fd-based) ---- */
 int   open(const char *path, int flags, ...);
@@ -342,12 +389,20 @@ void   exit(int status) __attribute__((noreturn));
 void   abort(void) __attribute__((noreturn));
 void   _exit(int status) __attribute__((noreturn));
 char  *getenv(const char *name);
+/* Wall clock: the firmware's GetTime() once, advanced by the cycle
+   counter. localtime applies the firmware time zone when it has one. */
 time_t time(time_t *t);
 struct tm *localtime(const time_t *t);
+struct tm *gmtime(const time_t *t);
+int    clock_gettime(clockid_t id, struct timespec *ts);
+clock_t clock(void);
 char  *getcwd(char *buf, size_t size);
 int    gettimeofday(struct timeval *tv, void *tz);
 void   qsort(void *base, size_t nmemb, size_t size,
              int (*compar)(const void *, const void *));
+/* GNU argument order: arg is passed to compar as its third argument */
+void   qsort_r(void *base, size_t nmemb, size_t size,
+               int (*compar)(const void *, const void *, void *), void *arg);
 void  *bsearch(const void *key, const void *base, size_t nmemb, size_t size,
                int (*compar)(const void *, const void *));
 int    rand(void);
@@ -396,9 +451,61 @@ static inline long  labs(long x) { return x < 0 ? -x : x; }
 static inline long long llabs(long long x) { return x < 0 ? -x : x; }
 #endif
 
-/* ---- math stubs ---- */
+/* ---- math (libm.c) ---- */
+#ifndef HUGE_VAL
+#define HUGE_VAL  (1.0 / 0.0)
+#define INFINITY  (1.0f / 0.0f)
+#define NAN       (0.0f / 0.0f)
+#endif
+#ifndef M_PI
+#define M_PI      3.14159265358979323846
+#endif
+#define isnan(x)    ((x) != (x))
+#define isinf(x)    (!isnan(x) && isnan((x) - (x)))
+#define isfinite(x) (!isnan((x) - (x)))
+
 double ldexp(double x, int exp);
 double frexp(double x, int *exp);
+double fabs(double x);
+double trunc(double x);
+double floor(double x);
+double ceil(double x);
+double round(double x);
+double fmod(double x, double y);
+double sqrt(double x);
+double exp(double x);
+double exp2(double x);
+double log(double x);
+double log2(double x);
+double log10(double x);
+double pow(double x, double y);
+double sin(double x);
+double cos(double x);
+double tan(double x);
+double atan(double x);
+double atan2(double y, double x);
+double asin(double x);
+double acos(double x);
+float fabsf(float x);
+float truncf(float x);
+float floorf(float x);
+float ceilf(float x);
+float roundf(float x);
+float fmodf(float x, float y);
+float sqrtf(float x);
+float expf(float x);
+float exp2f(float x);
+float logf(float x);
+float log2f(float x);
+float log10f(float x);
+float powf(float x, float y);
+float sinf(float x);
+float cosf(float x);
+float tanf(float x);
+float atanf(float x);
+float atan2f(float y, float x);
+float asinf(float x);
+float acosf(float x);
 
 /* ---- environ ---- */
 extern char **environ;
@@ -0,0 +1,705 @@
+/*
+ * symidx.c — Symbol index of the workstation sources
+ *
+ * See symidx.h. The lexer skips comments, strings, character constants
+ * and numbers and reads only the preprocessor's #define lines; the rest
+ * is a token stream in which brace depth 0 is file scope. There each
+ * declaration is followed to its ',' or ';': the name in front of its
+ * first '(' is a function (a definition when a '{' follows), a name
+ * after struct, union or enum is a tag when its body follows, and the
+ * last name outside parentheses and brackets is the declarator. Bodies
+ * of functions and initializers are skipped whole; enum bodies give
+ * their constants. Symbols are one array, a file's kept together in
+ * the order found, with a chained hash table of the names over it
+ * that is rebuilt whenever a file's symbols change.
+ */
+
+#include "boot.h"
+#include "mem.h"
+#include "fs.h"
+#include "timer.h"
+#include "hash.h"
+#include "symidx.h"
+
+#define SI_FILES_MAX 512
+
+struct si_file {
+    char   path[SYMIDX_PATH];   /* "" for a free slot */
+    UINT64 hash;                /* fnv1a64() of the contents */
+    UINT8  seen;                /* found by this walk */
+};
+
+static struct {
+    int    loaded;              /* SYMIDX_FILE read */
+    struct si_file *files;
+    UINT32 nfiles, files_cap;
+    struct sym *syms;
+    UINT32 nsyms, syms_cap;
+    UINT32 *heads;              /* name hash: symbol + 1, 0 ends */
+    UINT32 *chain;              /* per symbol, the same */
+    UINT32 heads_cap, chain_cap;
+
+    /* The walk: the names listed in SYMIDX_DIR, NUL-ended */
+    char   *names;
+    UINT32 names_len, names_cap;
+    UINT32 name_next;
+    int    walking, listed, dirty;
+} s_si;
+
+static const char *s_kind_names[] = {
+    "func", "macro", "tag", "typedef", "enum", "var", "decl"
+};
+static const char s_kind_chars[] = "fmsTevd";   /* in SYMIDX_FILE */
+
+static void wpath(const char *path, CHAR16 *out) {
+    int i = 0;
+    for (; path[i] && i < SYMIDX_PATH - 1; i++)
+        out[i] = (path[i] == '/') ? L'\\' : (CHAR16)(UINT8)path[i];
+    out[i] = 0;
+}
+
+static UINT32 name_hash(const char *s, int n) {
+    UINT32 h = 2166136261u;
+    for (int i = 0; i < n; i++)
+        h = (h ^ (UINT8)s[i]) * 16777619u;
+    return h;
+}
+
+/* ---- Table ---- */
+
+static void rehash(void) {
+    UINT32 want = 256;
+    while (want < s_si.nsyms) want *= 2;
+    if (want > s_si.heads_cap) {
+        if (s_si.heads) mem_free(s_si.heads);
+        s_si.heads = (UINT32 *)mem_alloc_raw((UINTN)want * sizeof(UINT32));
+        s_si.heads_cap = s_si.heads ? want : 0;
+    }
+    if (!s_si.heads || mem_grow((void **)&s_si.chain, &s_si.chain_cap,
+                                s_si.nsyms, sizeof(UINT32), 256) != 0) {
+        s_si.heads_cap = 0;     /* lookups find nothing */
+        return;
+    }
+    mem_set(s_si.heads, 0, (UINTN)s_si.heads_cap * sizeof(UINT32));
+    /* Backwards, so each chain is in array order */
+    for (UINT32 i = s_si.nsyms; i-- > 0;) {
+        const char *n = s_si.syms[i].name;
+        UINT32 b = name_hash(n, (int)str_len((CHAR8 *)n)) & (s_si.heads_cap - 1);
+        s_si.chain[i] = s_si.heads[b];
+        s_si.heads[b] = i + 1;
+    }
+}
+
+static void sym_add(UINT32 file, int kind, const char *name, int n,
+                    UINT32 line) {
+    if (n <= 0) return;
+    if (mem_grow((void **)&s_si.syms, &s_si.syms_cap, s_si.nsyms + 1,
+                 sizeof(struct sym), 256) != 0)
+        return;
+    struct sym *s = &s_si.syms[s_si.nsyms++];
+    if (n > SYMIDX_NAME - 1) n = SYMIDX_NAME - 1;
+    mem_copy(s->name, name, (UINTN)n);
+    s->name[n] = '\0';
+    s->line = line;
+    s->file = (UINT16)file;
+    s->kind = (UINT8)kind;
+}
+
+/* Drop a file's symbols, keeping the others in order */
+static void syms_drop(UINT32 file) {
+    UINT32 k = 0;
+    for (UINT32 i = 0; i < s_si.nsyms; i++) {
+        if (s_si.syms[i].file == file) continue;
+        if (k != i) s_si.syms[k] = s_si.syms[i];
+        k++;
+    }
+    s_si.nsyms = k;
+}
+
+/* The slot of path, a free one taken if it is new; -1 when full */
+static int file_slot(const char *path, int add) {
+    int free_slot = -1;
+    for (UINT32 i = 0; i < s_si.nfiles; i++) {
+        if (!s_si.files[i].path[0]) {
+            if (free_slot < 0) free_slot = (int)i;
+        } else if (str_cmp((CHAR8 *)s_si.files[i].path, (CHAR8 *)path) == 0) {
+            return (int)i;
+        }
+    }
+    if (!add) return -1;
+    if (free_slot < 0) {
+        if (s_si.nfiles >= SI_FILES_MAX ||
+            mem_grow((void **)&s_si.files, &s_si.files_cap, s_si.nfiles + 1,
+                     sizeof(struct si_file), 256) != 0)
+            return -1;
+        free_slot = (int)s_si.nfiles++;
+    }
+    struct si_file *f = &s_si.files[free_slot];
+    str_copy(f->path, path, SYMIDX_PATH);
+    f->hash = 0;
+    f->seen = 0;
+    return free_slot;
+}
+
+/* ---- Lexer ---- */
+
+struct si_tok {
+    const char *s;
+    int n;
+    UINT32 line;
+};
+
+/* The declaration at file scope being read */
+struct si_decl {
+    struct si_tok last;         /* last name outside ( ) and [ ] */
+    struct si_tok func;         /* the name before the first '(' */
+    struct si_tok inner;        /* typedef: the name after '*' in it */
+    struct si_tok tag;          /* after struct, union or enum */
+    int parens, brackets, attr;
+    int had_paren, init, typedef_, extern_;
+    int tag_kw;                 /* 1 struct or union, 2 enum */
+    int tag_next;               /* the next name is the tag */
+};
+
+static const char *s_keywords[] = {
+    "auto", "break", "case", "char", "const", "continue", "default",
+    "do", "double", "else", "enum", "extern", "float", "for", "goto",
+    "if", "inline", "int", "long", "register", "return", "short",
+    "signed", "sizeof", "static", "struct", "switch", "typedef",
+    "union", "unsigned", "void", "volatile", "while", "__attribute__",
+    "__declspec", "__inline", NULL
+};
+
+static int tok_is(const struct si_tok *t, const char *w) {
+    int n = (int)str_len((CHAR8 *)w);
+    return t->n == n && mem_cmp(t->s, w, (UINTN)n) == 0;
+}
+
+static int is_keyword(const struct si_tok *t) {
+    for (int i = 0; s_keywords[i]; i++)
+        if (tok_is(t, s_keywords[i])) return 1;
+    return 0;
+}
+
+static int ident_start(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+static int ident_char(char c) {
+    return ident_start(c) || (c >= '0' && c <= '9');
+}
+
+static void decl_reset(struct si_decl *d, int keep_specifiers) {
+    int typedef_ = d->typedef_, extern_ = d->extern_;
+    mem_set(d, 0, sizeof(*d));
+    if (keep_specifiers) {
+        d->typedef_ = typedef_;
+        d->extern_ = extern_;
+    }
+}
+
+/* A declarator ended at ',' or ';' */
+static void decl_end(UINT32 file, const struct si_decl *d) {
+    if (d->typedef_) {
+        const struct si_tok *t = d->inner.n ? &d->inner : &d->last;
+        sym_add(file, SYM_TYPEDEF, t->s, t->n, t->line);
+    } else if (d->had_paren) {
+        if (d->func.n)
+            sym_add(file, SYM_DECL, d->func.s, d->func.n, d->func.line);
+    } else if (d->last.n) {
+        sym_add(file, d->extern_ ? SYM_DECL : SYM_VAR,
+                d->last.s, d->last.n, d->last.line);
+    }
+}
+
+static void lex(UINT32 file, const char *p, UINTN size) {
+    struct si_decl d;
+    decl_reset(&d, 0);
+    UINT32 line = 1;
+    int depth = 0;              /* braces */
+    int skip_to = -1;           /* in a body skipped to this depth */
+    int enum_depth = 0;         /* inside an enum body at this depth */
+    int enum_next = 0;          /* the next name is an enum constant */
+    int enum_parens = 0;        /* in a constant's value */
+    int bol = 1;                /* only blanks since the line began */
+    int prev_name = 0;          /* the last token was a name */
+    char prev = 0;              /* the last punctuator */
+    UINTN i = 0;
+
+    while (i < size) {
+        char c = p[i];
+        if (c == '\n') {
+            line++;
+            bol = 1;
+            i++;
+            continue;
+        }
+        if (c == ' ' || c == '\t' || c == '\r' || c == '\f' || c == '\v') {
+            i++;
+            continue;
+        }
+        if (c == '/' && i + 1 < size && p[i + 1] == '/') {
+            while (i < size && p[i] != '\n') i++;
+            continue;
+        }
+        if (c == '/' && i + 1 < size && p[i + 1] == '*') {
+            i += 2;
+            while (i < size && !(p[i] == '*' && i + 1 < size && p[i + 1] == '/')) {
+                if (p[i] == '\n') line++;
+                i++;
+            }
+            i += 2;
+            continue;
+        }
+        if (c == '#' && bol) {
+            /* A directive: only #define names anything */
+            i++;
+            while (i < size && (p[i] == ' ' || p[i] == '\t')) i++;
+            if (i + 6 <= size && mem_cmp(p + i, "define", 6) == 0) {
+                i += 6;
+                while (i < size && (p[i] == ' ' || p[i] == '\t')) i++;
+                UINTN s = i;
+                while (i < size && ident_char(p[i])) i++;
+                sym_add(file, SYM_MACRO, p + s, (int)(i - s), line);
+            }
+            /* To the end of the line, continuations and comments
+               included */
+            while (i < size && p[i] != '\n') {
+                if (p[i] == '/' && i + 1 < size && p[i + 1] == '/') {
+                    while (i < size && p[i] != '\n') i++;
+                    break;
+                }
+                if (p[i] == '/' && i + 1 < size && p[i + 1] == '*') {
+                    i += 2;
+                    while (i < size && !(p[i] == '*' && i + 1 < size && p[i + 1] == '/')) {
+                        if (p[i] == '\n') line++;
+                        i++;
+                    }
+                    i += 2;
+                    continue;
+                }
+                if (p[i] == '\\' && i + 1 < size && p[i + 1] == '\n') {
+                    line++;
+                    i++;
+                } else if (p[i] == '\\' && i + 2 < size && p[i + 1] == '\r' &&
+                           p[i + 2] == '\n') {
+                    line++;
+                    i += 2;
+                }
+                i++;
+            }
+            continue;
+        }
+        bol = 0;
+        if (c == '"' || c == '\'') {
+            i++;
+            while (i < size && p[i] != c && p[i] != '\n') {
+                if (p[i] == '\\' && i + 1 < size) i++;
+                i++;
+            }
+            i++;
+            prev_name = 0;
+            prev = c;
+            continue;
+        }
+        if (c >= '0' && c <= '9') {
+            while (i < size && (ident_char(p[i]) || p[i] == '.')) i++;
+            prev_name = 0;
+            prev = '0';
+            continue;
+        }
+
+        if (ident_start(c)) {
+            struct si_tok t = { p + i, 0, line };
+            while (i < size && ident_char(p[i])) i++;
+            t.n = (int)(p + i - t.s);
+            if (skip_to >= 0) continue;
+            if (enum_depth && depth == enum_depth) {
+                if (enum_next)
+                    sym_add(file, SYM_ENUM, t.s, t.n, t.line);
+                enum_next = 0;
+                continue;
+            }
+            if (depth > 0 || d.attr) continue;
+
+            int kw = is_keyword(&t);
+            if (tok_is(&t, "typedef")) {
+                d.typedef_ = 1;
+            } else if (tok_is(&t, "extern")) {
+                d.extern_ = 1;
+            } else if (tok_is(&t, "struct") || tok_is(&t, "union")) {
+                d.tag_kw = 1;
+                d.tag_next = 1;
+                prev_name = 0;
+                continue;
+            } else if (tok_is(&t, "enum")) {
+                d.tag_kw = 2;
+                d.tag_next = 1;
+                prev_name = 0;
+                continue;
+            } else if (tok_is(&t, "__attribute__") || tok_is(&t, "__declspec")) {
+                d.attr = -1;    /* its ( ) come next */
+            } else if (d.tag_next) {
+                d.tag = t;
+            } else if (!kw && !d.init) {
+                if (d.parens == 0 && d.brackets == 0)
+                    d.last = t;
+                else if (d.parens == 1 && d.typedef_ && !d.inner.n && prev == '*')
+                    d.inner = t;
+            }
+            d.tag_next = 0;
+            prev_name = !kw;
+            continue;
+        }
+
+        /* A punctuator */
+        i++;
+        int was_name = prev_name;
+        prev_name = 0;
+        prev = c;
+        if (c == '{') {
+            depth++;
+            if (skip_to >= 0 || depth > 1) continue;
+            if (d.tag.n && !d.last.n && !d.had_paren && !d.init)
+                sym_add(file, SYM_TAG, d.tag.s, d.tag.n, d.tag.line);
+            if (d.init || (d.had_paren && !d.typedef_)) {
+                if (!d.init && d.func.n)
+                    sym_add(file, SYM_FUNC, d.func.s, d.func.n, d.func.line);
+                skip_to = 0;    /* a function body or an initializer */
+            } else if (d.tag_kw == 2) {
+                enum_depth = 1;
+                enum_next = 1;
+                enum_parens = 0;
+            }
+            d.tag.n = 0;
+            d.tag_next = 0;
+            continue;
+        }
+        if (c == '}') {
+            if (depth > 0) depth--;
+            if (enum_depth && depth < enum_depth) enum_depth = 0;
+            if (skip_to >= 0 && depth == skip_to) {
+                skip_to = -1;
+                /* A function ends here; an initializer goes on */
+                if (!d.init) decl_reset(&d, 0);
+            }
+            continue;
+        }
+        if (skip_to >= 0) continue;
+        if (enum_depth && depth == enum_depth) {
+            if (c == '(') enum_parens++;
+            else if (c == ')' && enum_parens > 0) enum_parens--;
+            else if (c == ',' && enum_parens == 0) enum_next = 1;
+            continue;
+        }
+        if (depth > 0) continue;
+
+        if (d.attr) {
+            if (c == '(') {
+                d.attr = d.attr < 0 ? 1 : d.attr + 1;
+            } else if (c == ')' && d.attr > 0) {
+                d.attr--;
+            } else if (d.attr < 0) {
+                d.attr = 0;     /* no ( ) after all */
+            }
+            if (d.attr != 0 || c == ')') continue;
+        }
+        d.tag_next = 0;
+        if (c == '(') {
+            if (d.parens == 0 && d.brackets == 0 && !d.had_paren && !d.init) {
+                d.had_paren = 1;
+                if (was_name) d.func = d.last;
+            }
+            d.parens++;
+        } else if (c == ')') {
+            if (d.parens > 0) d.parens--;
+        } else if (c == '[') {
+            d.brackets++;
+        } else if (c == ']') {
+            if (d.brackets > 0) d.brackets--;
+        } else if (c == '=' && d.parens == 0 && d.brackets == 0) {
+            d.init = 1;
+        } else if ((c == ',' || c == ';') && d.parens == 0 && d.brackets == 0) {
+            decl_end(file, &d);
+            decl_reset(&d, c == ',');
+        }
+    }
+}
+
+/* ---- Index file ---- */
+
+/* Lines: "F <16 hex digits> <path>" for a file, then each of its
+   symbols as "<kind char> <line> <name>" */
+static void index_load(void) {
+    CHAR16 w[SYMIDX_PATH];
+    wpath(SYMIDX_FILE, w);
+    UINTN size = 0;
+    char *data = (char *)fs_readfile(w, &size);
+    if (!data) return;
+    int file = -1;
+    UINTN i = 0;
+    while (i < size) {
+        UINTN end = i;
+        while (end < size && data[end] != '\n') end++;
+        char k = data[i];
+        UINTN j = i + 2;
+        if (end - i > 2 && data[i + 1] == ' ') {
+            if (k == 'F') {
+                UINT64 h = 0;
+                for (; j < end && data[j] != ' '; j++) {
+                    char c = data[j];
+                    int v = (c >= '0' && c <= '9') ? c - '0' :
+                            (c >= 'a' && c <= 'f') ? c - 'a' + 10 : 0;
+                    h = (h << 4) | (UINT64)v;
+                }
+                char path[SYMIDX_PATH];
+                int n = 0;
+                for (j++; j < end && n < SYMIDX_PATH - 1; j++)
+                    path[n++] = data[j];
+                path[n] = '\0';
+                file = n ? file_slot(path, 1) : -1;
+                if (file >= 0) s_si.files[file].hash = h;
+            } else if (file >= 0) {
+                int kind = -1;
+                for (int q = 0; s_kind_chars[q]; q++)
+                    if (s_kind_chars[q] == k) kind = q;
+                UINT32 ln = 0;
+                for (; j < end && data[j] >= '0' && data[j] <= '9'; j++)
+                    ln = ln * 10 + (UINT32)(data[j] - '0');
+                j++;
+                if (kind >= 0 && j < end)
+                    sym_add((UINT32)file, kind, data + j, (int)(end - j), ln);
+            }
+        }
+        i = end + 1;
+    }
+    mem_free(data);
+    rehash();
+}
+
+static void index_save(void) {
+    if (fs_is_read_only()) return;
+    UINTN cap = (UINTN)s_si.nfiles * (SYMIDX_PATH + 24) +
+                (UINTN)s_si.nsyms * (SYMIDX_NAME + 16) + 1;
+    char *buf = (char *)mem_alloc_raw(cap);
+    if (!buf) return;
+    UINTN pos = 0;
+    for (UINT32 f = 0; f < s_si.nfiles; f++) {
+        const struct si_file *sf = &s_si.files[f];
+        if (!sf->path[0]) continue;
+        buf[pos++] = 'F';
+        buf[pos++] = ' ';
+        for (int k = 15; k >= 0; k--)
+            buf[pos++] = "0123456789abcdef"[(sf->hash >> (k * 4)) & 15];
+        buf[pos++] = ' ';
+        for (int k = 0; sf->path[k]; k++)
+            buf[pos++] = sf->path[k];
+        buf[pos++] = '\n';
+        for (UINT32 i = 0; i < s_si.nsyms; i++) {
+            const struct sym *s = &s_si.syms[i];
+            if (s->file != f) continue;
+            char num[12];
+            int n = 0;
+            UINT32 v = s->line;
+            do { num[n++] = (char)('0' + v % 10); v /= 10; } while (v);
+            buf[pos++] = s_kind_chars[s->kind];
+            buf[pos++] = ' ';
+            while (n > 0) buf[pos++] = num[--n];
+            buf[pos++] = ' ';
+            for (int k = 0; s->name[k]; k++)
+                buf[pos++] = s->name[k];
+            buf[pos++] = '\n';
+        }
+    }
+
+    /* SYMIDX_FILE's directory, on a volume never rebuilt on */
+    CHAR16 w[SYMIDX_PATH];
+    char dir[SYMIDX_PATH];
+    str_copy(dir, SYMIDX_FILE, SYMIDX_PATH);
+    int slash = 0;
+    for (int k = 0; dir[k]; k++)
+        if (dir[k] == '/') slash = k;
+    dir[slash] = '\0';
+    wpath(dir, w);
+    if (slash > 0 && !fs_exists(w))
+        fs_mkdir(w);
+    wpath(SYMIDX_FILE, w);
+    fs_writefile(w, buf, pos);
+    mem_free(buf);
+}
+
+/* ---- Walk ---- */
+
+static int is_source(const char *name) {
+    int n = (int)str_len((CHAR8 *)name);
+    return n > 2 && name[n - 2] == '.' && (name[n - 1] == 'c' || name[n - 1] == 'h');
+}
+
+/* Read path and tokenize it again if its hash changed */
+static void file_check(const char *path) {
+    int f = file_slot(path, 1);
+    if (f < 0) return;
+    s_si.files[f].seen = 1;
+    CHAR16 w[SYMIDX_PATH];
+    wpath(path, w);
+    UINTN size = 0;
+    char *data = (char *)fs_readfile(w, &size);
+    if (!data) return;
+    UINT64 h = fnv1a64(FNV1A64_INIT, data, size);
+    if (h != s_si.files[f].hash) {
+        syms_drop((UINT32)f);
+        lex((UINT32)f, data, size);
+        s_si.files[f].hash = h;
+        s_si.dirty = 1;
+        rehash();
+    }
+    mem_free(data);
+}
+
+static void list_dir(void) {
+    s_si.listed = 1;
+    s_si.names_len = s_si.name_next = 0;
+    CHAR16 w[SYMIDX_PATH];
+    wpath(SYMIDX_DIR, w);
+    struct fs_dir *d = fs_opendir(w);
+    if (!d) return;
+    struct fs_entry e;
+    while (fs_readdir_next(d, &e) > 0) {
+        if (e.is_dir || !is_source(e.name)) continue;
+        UINT32 n = (UINT32)str_len((CHAR8 *)e.name) + 1;
+        if (mem_grow((void **)&s_si.names, &s_si.names_cap, s_si.names_len + n,
+                     1, 256) != 0)
+            break;
+        mem_copy(s_si.names + s_si.names_len, e.name, n);
+        s_si.names_len += n;
+    }
+    fs_closedir(d);
+}
+
+void symidx_begin(void) {
+    if (!s_si.loaded) {
+        s_si.loaded = 1;
+        index_load();
+    }
+    for (UINT32 i = 0; i < s_si.nfiles; i++)
+        s_si.files[i].seen = 0;
+    s_si.walking = 1;
+    s_si.listed = 0;
+}
+
+int symidx_step(void) {
+    if (!s_si.walking) return SYMIDX_IDLE;
+    UINT64 end = timer_ticks() + timer_hz() / 1000 * SYMIDX_STEP_MS;
+    if (!s_si.listed) {
+        list_dir();
+        if (timer_ticks() >= end) return SYMIDX_BUSY;
+    }
+    while (s_si.name_next < s_si.names_len) {
+        char path[SYMIDX_PATH];
+        const char *name = s_si.names + s_si.name_next;
+        UINT32 n = (UINT32)str_len((CHAR8 *)name);
+        s_si.name_next += n + 1;
+        UINT32 dn = (UINT32)str_len((CHAR8 *)SYMIDX_DIR);
+        if (dn + 1 + n < SYMIDX_PATH) {
+            mem_copy(path, SYMIDX_DIR, dn);
+            path[dn] = '/';
+            mem_copy(path + dn + 1, name, n + 1);
+            file_check(path);
+        }
+        if (timer_ticks() >= end) return SYMIDX_BUSY;
+    }
+
+    /* Files gone since the index was made */
+    for (UINT32 i = 0; i < s_si.nfiles; i++) {
+        if (s_si.files[i].path[0] && !s_si.files[i].seen) {
+            syms_drop(i);
+            s_si.files[i].path[0] = '\0';
+            s_si.dirty = 1;
+        }
+    }
+    if (s_si.dirty) {
+        rehash();
+        index_save();
+        s_si.dirty = 0;
+    }
+    s_si.walking = 0;
+    return SYMIDX_IDLE;
+}
+
+void symidx_finish(void) {
+    while (symidx_step() != SYMIDX_IDLE)
+        ;
+}
+
+void symidx_update(const char *path) {
+    UINT32 dn = (UINT32)str_len((CHAR8 *)SYMIDX_DIR);
+    if (mem_cmp(path, SYMIDX_DIR "/", dn + 1) != 0 || !is_source(path))
+        return;
+    for (const char *c = path + dn + 1; *c; c++)
+        if (*c == '/') return;  /* not in a subdirectory */
+    if (!s_si.loaded) symidx_begin();
+    file_check(path);
+    /* A walk under way writes the index; otherwise write it now */
+    if (s_si.dirty && !s_si.walking) {
+        index_save();
+        s_si.dirty = 0;
+    }
+}
+
+/* ---- Lookup ---- */
+
+int symidx_lookup(const char *name, const struct sym **out, int max) {
+    if (!s_si.heads_cap) return 0;
+    int len = (int)str_len((CHAR8 *)name);
+    UINT32 b = name_hash(name, len) & (s_si.heads_cap - 1);
+    int n = 0;
+    for (int decl = 0; decl < 2; decl++) {
+        for (UINT32 k = s_si.heads[b]; k && n < max; k = s_si.chain[k - 1]) {
+            const struct sym *s = &s_si.syms[k - 1];
+            if ((s->kind == SYM_DECL) == decl &&
+                str_cmp((CHAR8 *)s->name, (CHAR8 *)name) == 0)
+                out[n++] = s;
+        }
+    }
+    return n;
+}
+
+static char lower(char c) {
+    return (c >= 'A' && c <= 'Z') ? (char)(c + 32) : c;
+}
+
+/* Where text is in name, any case: 0 the whole name, 1 a prefix, 2
+   elsewhere, -1 not at all */
+static int match_rank(const char *name, const char *text, int tlen) {
+    for (int at = 0; name[at]; at++) {
+        int k = 0;
+        while (k < tlen && name[at + k] && lower(name[at + k]) == lower(text[k]))
+            k++;
+        if (k == tlen)
+            return at > 0 ? 2 : name[k] ? 1 : 0;
+    }
+    return -1;
+}
+
+int symidx_search(const char *text, const struct sym **out, int max) {
+    int tlen = (int)str_len((CHAR8 *)text);
+    if (tlen == 0) return 0;
+    int n = 0;
+    for (int rank = 0; rank < 6 && n < max; rank++) {
+        for (UINT32 i = 0; i < s_si.nsyms && n < max; i++) {
+            const struct sym *s = &s_si.syms[i];
+            if ((s->kind == SYM_DECL) != (rank & 1)) continue;
+            if (match_rank(s->name, text, tlen) == rank / 2)
+                out[n++] = s;
+        }
+    }
+    return n;
+}
+
+const char *symidx_path(const struct sym *s) {
+    return s->file < s_si.nfiles ? s_si.files[s->file].path : "";
+}
+
+const char *symidx_kind_name(int kind) {
+    return kind >= 0 && kind <= SYM_DECL ? s_kind_names[kind] : "?";
+}
@@ -0,0 +1,71 @@
+/*
+ * symidx.h — Symbol index of the workstation sources, for the editor
+ *
+ * The .c and .h files of SYMIDX_DIR are tokenized by a small C lexer
+ * for the names they define at file scope: functions and their
+ * prototypes, macros, struct/union/enum tags, enum constants, typedefs
+ * and variables. symidx_step() brings the index up to date between
+ * keystrokes, a few files at a time: each is read and hashed with
+ * fnv1a64() (hash.h), the content hash the rebuild keys objects by,
+ * and only the ones whose hash changed are tokenized again. The index
+ * is kept in SYMIDX_FILE with those hashes, so a session starts out
+ * with the last one's symbols, and symidx_update() redoes a file just
+ * saved. Names are looked up through a hash table.
+ */
+#ifndef SYMIDX_H
+#define SYMIDX_H
+
+#include "boot.h"
+
+#define SYMIDX_DIR     "/src"
+#define SYMIDX_FILE    "/build/symbols.idx"
+#define SYMIDX_STEP_MS 20       /* indexing per symidx_step() */
+#define SYMIDX_PATH    64
+#define SYMIDX_NAME    48       /* longer names are cut */
+
+/* What a symbol is. SYM_DECL is a prototype or extern declaration;
+   the others are definitions. */
+enum sym_kind { SYM_FUNC, SYM_MACRO, SYM_TAG, SYM_TYPEDEF, SYM_ENUM,
+                SYM_VAR, SYM_DECL };
+
+struct sym {
+    char   name[SYMIDX_NAME];
+    UINT32 line;                /* from 1 */
+    UINT16 file;                /* for symidx_path() */
+    UINT8  kind;
+};
+
+/* symidx_step() results */
+#define SYMIDX_IDLE 0           /* the index matches the files */
+#define SYMIDX_BUSY 1           /* more to read */
+
+/* Check every file of the current volume's SYMIDX_DIR again, loading
+   SYMIDX_FILE first the first time. The symbols stay usable meanwhile. */
+void symidx_begin(void);
+
+/* Check files for about SYMIDX_STEP_MS; once the walk is through,
+   SYMIDX_FILE is rewritten if anything changed */
+int symidx_step(void);
+
+/* Run the walk to its end now */
+void symidx_finish(void);
+
+/* Index the file at path ("/src/name.c") again, as just saved; other
+   paths are ignored */
+void symidx_update(const char *path);
+
+/* The symbols named name, definitions first. Returns the count (up
+   to max). Pointers stay valid until the index next changes. */
+int symidx_lookup(const char *name, const struct sym **out, int max);
+
+/* The symbols whose names contain text in any case: whole-name
+   matches, then prefixes, then the rest, definitions first in each */
+int symidx_search(const char *text, const struct sym **out, int max);
+
+/* The path of a symbol's file ("/src/name.c") */
+const char *symidx_path(const struct sym *s);
+
+/* A short word for a kind ("func", "macro", ...) */
+const char *symidx_kind_name(int kind);
+
+#endif /* SYMIDX_H */
@@ -38,6 +38,7 @@ typedef UINT64             EFI_PHYSICAL_ADDRESS;
 typedef VOID              *EFI_EVENT;
 typedef VOID              *EFI_HANDLE;
 typedef UINTN              EFI_STATUS;
+typedef UINTN              EFI_TPL;
 
 #ifndef TRUE
 #define TRUE  1
@@ -65,8 +66,10 @@ typedef UINTN              EFI_STATUS;
 #define EFI_DEVICE_ERROR         EFIERR(7)
 #define EFI_WRITE_PROTECTED      EFIERR(8)
 #define EFI_OUT_OF_RESOURCES     EFIERR(9)
+#define EFI_MEDIA_CHANGED        EFIERR(13)
 #define EFI_NOT_FOUND            EFIERR(14)
 #define EFI_ACCESS_DENIED        EFIERR(15)
+#define EFI_SECURITY_VIOLATION   EFIERR(26)
 
 /* ---- GUID ---- */
 typedef struct {
@@ -184,14 +187,68 @@ struct _EFI_SIMPLE_TEXT_INPUT_EX_PROTOCOL {
 typedef struct _SIMPLE_TEXT_OUTPUT_INTERFACE SIMPLE_TEXT_OUTPUT_INTERFACE;
 typedef SIMPLE_TEXT_OUTPUT_INTERFACE EFI_SIMPLE_TEXT_OUT_PROTOCOL;
 
+typedef struct {
+    INT32 MaxMode;
+    INT32 Mode;
+    INT32 Attribute;
+    INT32 CursorColumn;
+    INT32 CursorRow;
+    BOOLEAN CursorVisible;
+} SIMPLE_TEXT_OUTPUT_MODE;
+
 struct _SIMPLE_TEXT_OUTPUT_INTERFACE {
     void *Reset;
     EFI_STATUS (EFIAPI *OutputString)(SIMPLE_TEXT_OUTPUT_INTERFACE *, CHAR16 *);
-    void *TestString; void *QueryMode; void *SetMode;
-    void *SetAttribute; void *ClearScreen;
-    void *SetCursorPosition; void *EnableCursor; void *Mode;
+    void *TestString;
+    EFI_STATUS (EFIAPI *QueryMode)(SIMPLE_TEXT_OUTPUT_INTERFACE *, UINTN,
+                                   UINTN *, UINTN *);
+    void *SetMode;
+    EFI_STATUS (EFIAPI *SetAttribute)(SIMPLE_TEXT_OUTPUT_INTERFACE *, UINTN);
+    EFI_STATUS (EFIAPI *ClearScreen)(SIMPLE_TEXT_OUTPUT_INTERFACE *);
+    EFI_STATUS (EFIAPI *SetCursorPosition)(SIMPLE_TEXT_OUTPUT_INTERFACE *,
+                                           UINTN, UINTN);
+    EFI_STATUS (EFIAPI *EnableCursor)(SIMPLE_TEXT_OUTPUT_INTERFACE *, BOOLEAN);
+    SIMPLE_TEXT_OUTPUT_MODE *Mode;
 };
 
+/* Attributes: foreground in bits 0-3, background (0-7) in bits 4-6 */
+#define EFI_TEXT_ATTR(fg, bg)    ((fg) | ((bg) << 4))
+
+/* ---- Serial I/O ---- */
+typedef struct _EFI_SERIAL_IO_PROTOCOL EFI_SERIAL_IO_PROTOCOL;
+
+typedef struct {
+    UINT32 ControlMask;
+    UINT32 Timeout;             /* microseconds Read() waits for a byte */
+    UINT64 BaudRate;
+    UINT32 ReceiveFifoDepth;
+    UINT32 DataBits;
+    UINT32 Parity;
+    UINT32 StopBits;
+} EFI_SERIAL_IO_MODE;
+
+#define EFI_SERIAL_INPUT_BUFFER_EMPTY 0x00000100
+
+struct _EFI_SERIAL_IO_PROTOCOL {
+    UINT32 Revision;
+    void *Reset; void *SetAttributes; void *SetControl;
+    EFI_STATUS (EFIAPI *GetControl)(EFI_SERIAL_IO_PROTOCOL *, UINT32 *);
+    EFI_STATUS (EFIAPI *Write)(EFI_SERIAL_IO_PROTOCOL *, UINTN *, VOID *);
+    EFI_STATUS (EFIAPI *Read)(EFI_SERIAL_IO_PROTOCOL *, UINTN *, VOID *);
+    EFI_SERIAL_IO_MODE *Mode;
+};
+
+/* ---- Events ---- */
+#define EVT_TIMER                0x80000000
+#define EVT_NOTIFY_WAIT          0x00000100
+#define EVT_NOTIFY_SIGNAL        0x00000200
+
+#define TPL_APPLICATION          4
+#define TPL_CALLBACK             8
+#define TPL_NOTIFY               16
+
+typedef VOID (EFIAPI *EFI_EVENT_NOTIFY)(EFI_EVENT, VOID *);
+
 /* ---- Boot Services ---- */
 typedef struct {
     EFI_TABLE_HEADER Hdr;
@@ -206,9 +263,13 @@ typedef struct {
     EFI_STATUS (EFIAPI *AllocatePool)(EFI_MEMORY_TYPE, UINTN, VOID **);
     EFI_STATUS (EFIAPI *FreePool)(VOID *);
     /* Events */
-    void *CreateEvent; void *SetTimer;
+    EFI_STATUS (EFIAPI *CreateEvent)(UINT32, EFI_TPL, EFI_EVENT_NOTIFY,
+                                      VOID *, EFI_EVENT *);
+    void *SetTimer;
     EFI_STATUS (EFIAPI *WaitForEvent)(UINTN, EFI_EVENT *, UINTN *);
-    void *SignalEvent; void *CloseEvent; void *CheckEvent;
+    void *SignalEvent;
+    EFI_STATUS (EFIAPI *CloseEvent)(EFI_EVENT);
+    EFI_STATUS (EFIAPI *CheckEvent)(EFI_EVENT);
     /* Protocol Handlers */
     void *InstallProtocolInterface; void *ReinstallProtocolInterface;
     void *UninstallProtocolInterface;
@@ -217,8 +278,12 @@ typedef struct {
     void *RegisterProtocolNotify; void *LocateHandle;
     void *LocateDevicePath; void *InstallConfigurationTable;
     /* Image */
-    void *LoadImage; void *StartImage; void *Exit;
-    void *UnloadImage; void *ExitBootServices;
+    EFI_STATUS (EFIAPI *LoadImage)(BOOLEAN, EFI_HANDLE, VOID *, VOID *,
+                                    UINTN, EFI_HANDLE *);
+    EFI_STATUS (EFIAPI *StartImage)(EFI_HANDLE, UINTN *, CHAR16 **);
+    void *Exit;
+    EFI_STATUS (EFIAPI *UnloadImage)(EFI_HANDLE);
+    void *ExitBootServices;
     /* Misc */
     void *GetNextMonotonicCount;
     EFI_STATUS (EFIAPI *Stall)(UINTN);
@@ -247,7 +312,8 @@ typedef struct {
 /* ---- Runtime Services ---- */
 typedef struct {
     EFI_TABLE_HEADER Hdr;
-    void *GetTime; void *SetTime;
+    EFI_STATUS (EFIAPI *GetTime)(EFI_TIME *, VOID *);
+    void *SetTime;
     void *GetWakeupTime; void *SetWakeupTime;
     void *SetVirtualAddressMap; void *ConvertPointer;
     void *GetVariable; void *GetNextVariableName; void *SetVariable;
@@ -255,6 +321,12 @@ typedef struct {
     void (EFIAPI *ResetSystem)(EFI_RESET_TYPE, EFI_STATUS, UINTN, VOID *);
 } EFI_RUNTIME_SERVICES;
 
+/* ---- Configuration tables (ACPI, SMBIOS, the device tree, ...) ---- */
+typedef struct {
+    EFI_GUID VendorGuid;
+    VOID *VendorTable;
+} EFI_CONFIGURATION_TABLE;
+
 /* ---- System Table ---- */
 typedef struct _EFI_SYSTEM_TABLE {
     EFI_TABLE_HEADER Hdr;
@@ -269,7 +341,7 @@ typedef struct _EFI_SYSTEM_TABLE {
     EFI_RUNTIME_SERVICES *RuntimeServices;
     EFI_BOOT_SERVICES *BootServices;
     UINTN NumberOfTableEntries;
-    void *ConfigurationTable;
+    EFI_CONFIGURATION_TABLE *ConfigurationTable;
 } EFI_SYSTEM_TABLE;
 
 /* ================================================================
@@ -388,6 +460,10 @@ typedef struct {
     UINT32 OptimalTransferLengthGranularity;
 } EFI_BLOCK_IO_MEDIA;
 
+/* Revisions with the LowestAlignedLba and granularity fields */
+#define EFI_BLOCK_IO_PROTOCOL_REVISION2 0x00020001
+#define EFI_BLOCK_IO_PROTOCOL_REVISION3 0x0002001f
+
 typedef struct _EFI_BLOCK_IO_PROTOCOL EFI_BLOCK_IO_PROTOCOL;
 typedef EFI_BLOCK_IO_PROTOCOL EFI_BLOCK_IO;
 
@@ -402,6 +478,517 @@ struct _EFI_BLOCK_IO_PROTOCOL {
     EFI_STATUS (EFIAPI *FlushBlocks)(EFI_BLOCK_IO_PROTOCOL *);
 };
 
+/* ---- Block IO2 (asynchronous, token-based) ---- */
+
+typedef struct {
+    EFI_EVENT Event;              /* signaled on completion (NULL = blocking) */
+    EFI_STATUS TransactionStatus;
+} EFI_BLOCK_IO2_TOKEN;
+
+typedef struct _EFI_BLOCK_IO2_PROTOCOL EFI_BLOCK_IO2_PROTOCOL;
+
+struct _EFI_BLOCK_IO2_PROTOCOL {
+    EFI_BLOCK_IO_MEDIA *Media;
+    EFI_STATUS (EFIAPI *Reset)(EFI_BLOCK_IO2_PROTOCOL *, BOOLEAN);
+    EFI_STATUS (EFIAPI *ReadBlocksEx)(EFI_BLOCK_IO2_PROTOCOL *, UINT32,
+                                       EFI_LBA, EFI_BLOCK_IO2_TOKEN *,
+                                       UINTN, VOID *);
+    EFI_STATUS (EFIAPI *WriteBlocksEx)(EFI_BLOCK_IO2_PROTOCOL *, UINT32,
+                                        EFI_LBA, EFI_BLOCK_IO2_TOKEN *,
+                                        UINTN, VOID *);
+    EFI_STATUS (EFIAPI *FlushBlocksEx)(EFI_BLOCK_IO2_PROTOCOL *,
+                                        EFI_BLOCK_IO2_TOKEN *);
+};
+
+/* ---- Erase Block (discard/TRIM/erase of whole blocks) ---- */
+
+typedef struct {
+    EFI_EVENT Event;              /* signaled on completion (NULL = blocking) */
+    EFI_STATUS TransactionStatus;
+} EFI_ERASE_BLOCK_TOKEN;
+
+typedef struct _EFI_ERASE_BLOCK_PROTOCOL EFI_ERASE_BLOCK_PROTOCOL;
+
+struct _EFI_ERASE_BLOCK_PROTOCOL {
+    UINT64 Revision;
+    UINT32 EraseLengthGranularity;  /* blocks; erases should be multiples */
+    EFI_STATUS (EFIAPI *EraseBlocks)(EFI_BLOCK_IO_PROTOCOL *, UINT32,
+                                      EFI_LBA, EFI_ERASE_BLOCK_TOKEN *,
+                                      UINTN);
+};
+
+/* ---- USB IO (one interface of a device, from the firmware USB bus) ---- */
+
+typedef struct {
+    UINT8  RequestType;
+    UINT8  Request;
+    UINT16 Value;
+    UINT16 Index;
+    UINT16 Length;
+} EFI_USB_DEVICE_REQUEST;
+
+typedef enum {
+    EfiUsbDataIn,
+    EfiUsbDataOut,
+    EfiUsbNoData
+} EFI_USB_DATA_DIRECTION;
+
+typedef struct {
+    UINT8  Length;
+    UINT8  DescriptorType;
+    UINT16 BcdUSB;
+    UINT8  DeviceClass;
+    UINT8  DeviceSubClass;
+    UINT8  DeviceProtocol;
+    UINT8  MaxPacketSize0;
+    UINT16 IdVendor;
+    UINT16 IdProduct;
+    UINT16 BcdDevice;
+    UINT8  StrManufacturer;
+    UINT8  StrProduct;
+    UINT8  StrSerialNumber;
+    UINT8  NumConfigurations;
+} EFI_USB_DEVICE_DESCRIPTOR;
+
+typedef struct {
+    UINT8 Length;
+    UINT8 DescriptorType;
+    UINT8 InterfaceNumber;
+    UINT8 AlternateSetting;
+    UINT8 NumEndpoints;
+    UINT8 InterfaceClass;
+    UINT8 InterfaceSubClass;
+    UINT8 InterfaceProtocol;
+    UINT8 Interface;
+} EFI_USB_INTERFACE_DESCRIPTOR;
+
+/* Packed in the spec; only the 16-bit field's padding differs here,
+   after every field the firmware fills */
+typedef struct {
+    UINT8  Length;
+    UINT8  DescriptorType;
+    UINT8  EndpointAddress;
+    UINT8  Attributes;
+    UINT16 MaxPacketSize;
+    UINT8  Interval;
+} EFI_USB_ENDPOINT_DESCRIPTOR;
+
+#define EFI_USB_ERR_STALL 0x02   /* transfer result bit */
+
+typedef struct _EFI_USB_IO_PROTOCOL EFI_USB_IO_PROTOCOL;
+
+struct _EFI_USB_IO_PROTOCOL {
+    EFI_STATUS (EFIAPI *UsbControlTransfer)(EFI_USB_IO_PROTOCOL *,
+                                            EFI_USB_DEVICE_REQUEST *,
+                                            EFI_USB_DATA_DIRECTION, UINT32,
+                                            VOID *, UINTN, UINT32 *);
+    EFI_STATUS (EFIAPI *UsbBulkTransfer)(EFI_USB_IO_PROTOCOL *, UINT8,
+                                         VOID *, UINTN *, UINTN, UINT32 *);
+    void *UsbAsyncInterruptTransfer; void *UsbSyncInterruptTransfer;
+    void *UsbIsochronousTransfer; void *UsbAsyncIsochronousTransfer;
+    EFI_STATUS (EFIAPI *UsbGetDeviceDescriptor)(EFI_USB_IO_PROTOCOL *,
+                                                EFI_USB_DEVICE_DESCRIPTOR *);
+    void *UsbGetConfigDescriptor;
+    EFI_STATUS (EFIAPI *UsbGetInterfaceDescriptor)(EFI_USB_IO_PROTOCOL *,
+                                                   EFI_USB_INTERFACE_DESCRIPTOR *);
+    EFI_STATUS (EFIAPI *UsbGetEndpointDescriptor)(EFI_USB_IO_PROTOCOL *, UINT8,
+                                                  EFI_USB_ENDPOINT_DESCRIPTOR *);
+    void *UsbGetStringDescriptor; void *UsbGetSupportedLanguages;
+    EFI_STATUS (EFIAPI *UsbPortReset)(EFI_USB_IO_PROTOCOL *);
+};
+
+/* ---- PCI IO (a PCI function's BARs, config space and DMA mappings) ---- */
+
+typedef enum {
+    EfiPciIoWidthUint8, EfiPciIoWidthUint16, EfiPciIoWidthUint32,
+    EfiPciIoWidthUint64
+} EFI_PCI_IO_PROTOCOL_WIDTH;
+
+typedef enum {
+    EfiPciIoOperationBusMasterRead,         /* device reads memory */
+    EfiPciIoOperationBusMasterWrite,        /* device writes memory */
+    EfiPciIoOperationBusMasterCommonBuffer,
+    EfiPciIoOperationBusMasterRead64,
+    EfiPciIoOperationBusMasterWrite64,
+    EfiPciIoOperationBusMasterCommonBuffer64
+} EFI_PCI_IO_PROTOCOL_OPERATION;
+
+typedef struct _EFI_PCI_IO_PROTOCOL EFI_PCI_IO_PROTOCOL;
+
+typedef EFI_STATUS (EFIAPI *EFI_PCI_IO_PROTOCOL_IO_MEM)(
+    EFI_PCI_IO_PROTOCOL *, EFI_PCI_IO_PROTOCOL_WIDTH, UINT8 BarIndex,
+    UINT64 Offset, UINTN Count, VOID *Buffer);
+
+typedef struct {
+    EFI_PCI_IO_PROTOCOL_IO_MEM Read;
+    EFI_PCI_IO_PROTOCOL_IO_MEM Write;
+} EFI_PCI_IO_PROTOCOL_ACCESS;
+
+struct _EFI_PCI_IO_PROTOCOL {
+    void *PollMem; void *PollIo;
+    EFI_PCI_IO_PROTOCOL_ACCESS Mem;
+    EFI_PCI_IO_PROTOCOL_ACCESS Io;
+    void *PciRead; void *PciWrite;
+    void *CopyMem;
+    EFI_STATUS (EFIAPI *Map)(EFI_PCI_IO_PROTOCOL *,
+                             EFI_PCI_IO_PROTOCOL_OPERATION, VOID *, UINTN *,
+                             EFI_PHYSICAL_ADDRESS *, VOID **);
+    EFI_STATUS (EFIAPI *Unmap)(EFI_PCI_IO_PROTOCOL *, VOID *);
+    EFI_STATUS (EFIAPI *AllocateBuffer)(EFI_PCI_IO_PROTOCOL *,
+                                        EFI_ALLOCATE_TYPE, EFI_MEMORY_TYPE,
+                                        UINTN, VOID **, UINT64);
+    EFI_STATUS (EFIAPI *FreeBuffer)(EFI_PCI_IO_PROTOCOL *, UINTN, VOID *);
+    void *Flush;
+    void *GetLocation; void *Attributes;
+    void *GetBarAttributes; void *SetBarAttributes;
+    UINT64 RomSize;
+    VOID *RomImage;
+};
+
+/* ---- NVM Express Pass Thru (raw commands to an NVMe controller) ---- */
+
+typedef struct {
+    UINT32 Attributes;
+    UINT32 IoAlign;
+    UINT32 NvmeVersion;
+} EFI_NVM_EXPRESS_PASS_THRU_MODE;
+
+#define CDW10_VALID 0x04
+#define CDW11_VALID 0x08
+#define CDW12_VALID 0x10
+
+typedef struct {
+    UINT32 Cdw0;                /* opcode in bits 7:0 */
+    UINT8  Flags;               /* CDWn_VALID */
+    UINT32 Nsid;
+    UINT32 Cdw2, Cdw3;
+    UINT32 Cdw10, Cdw11, Cdw12, Cdw13, Cdw14, Cdw15;
+} EFI_NVM_EXPRESS_COMMAND;
+
+typedef struct {
+    UINT32 DW0, DW1, DW2, DW3;
+} EFI_NVM_EXPRESS_COMPLETION;
+
+#define NVME_ADMIN_QUEUE 0x00
+#define NVME_IO_QUEUE    0x01
+
+typedef struct {
+    UINT64 CommandTimeout;      /* 100 ns units, 0 = forever */
+    VOID  *TransferBuffer;
+    UINT32 TransferLength;
+    VOID  *MetadataBuffer;
+    UINT32 MetadataLength;
+    UINT8  QueueType;
+    EFI_NVM_EXPRESS_COMMAND *NvmeCmd;
+    EFI_NVM_EXPRESS_COMPLETION *NvmeCompletion;
+} EFI_NVM_EXPRESS_PASS_THRU_COMMAND_PACKET;
+
+typedef struct _EFI_NVM_EXPRESS_PASS_THRU_PROTOCOL EFI_NVM_EXPRESS_PASS_THRU_PROTOCOL;
+
+struct _EFI_NVM_EXPRESS_PASS_THRU_PROTOCOL {
+    EFI_NVM_EXPRESS_PASS_THRU_MODE *Mode;
+    EFI_STATUS (EFIAPI *PassThru)(EFI_NVM_EXPRESS_PASS_THRU_PROTOCOL *, UINT32,
+                                  EFI_NVM_EXPRESS_PASS_THRU_COMMAND_PACKET *,
+                                  EFI_EVENT);
+    void *GetNextNamespace; void *BuildDevicePath; void *GetNamespace;
+};
+
+/* ================================================================
+ * MP Services Protocol
+ * ================================================================ */
+
+#define PROCESSOR_AS_BSP_BIT        0x00000001
+#define PROCESSOR_ENABLED_BIT       0x00000002
+#define PROCESSOR_HEALTH_STATUS_BIT 0x00000004
+
+typedef struct {
+    UINT32 Package;
+    UINT32 Core;
+    UINT32 Thread;
+} EFI_CPU_PHYSICAL_LOCATION;
+
+typedef struct {
+    UINT64 ProcessorId;
+    UINT32 StatusFlag;            /* PROCESSOR_*_BIT */
+    EFI_CPU_PHYSICAL_LOCATION Location;
+} EFI_PROCESSOR_INFORMATION;
+
+typedef VOID (EFIAPI *EFI_AP_PROCEDURE)(VOID *);
+
+typedef struct _EFI_MP_SERVICES_PROTOCOL EFI_MP_SERVICES_PROTOCOL;
+
+struct _EFI_MP_SERVICES_PROTOCOL {
+    EFI_STATUS (EFIAPI *GetNumberOfProcessors)(EFI_MP_SERVICES_PROTOCOL *,
+                                               UINTN *, UINTN *);
+    EFI_STATUS (EFIAPI *GetProcessorInfo)(EFI_MP_SERVICES_PROTOCOL *, UINTN,
+                                          EFI_PROCESSOR_INFORMATION *);
+    EFI_STATUS (EFIAPI *StartupAllAPs)(EFI_MP_SERVICES_PROTOCOL *,
+                                       EFI_AP_PROCEDURE, BOOLEAN, EFI_EVENT,
+                                       UINTN, VOID *, UINTN **);
+    /* A WaitEvent makes the call return at once (non-blocking mode) */
+    EFI_STATUS (EFIAPI *StartupThisAP)(EFI_MP_SERVICES_PROTOCOL *,
+                                       EFI_AP_PROCEDURE, UINTN, EFI_EVENT,
+                                       UINTN, VOID *, BOOLEAN *);
+    EFI_STATUS (EFIAPI *SwitchBSP)(EFI_MP_SERVICES_PROTOCOL *, UINTN, BOOLEAN);
+    EFI_STATUS (EFIAPI *EnableDisableAP)(EFI_MP_SERVICES_PROTOCOL *, UINTN,
+                                         BOOLEAN, UINT32 *);
+    EFI_STATUS (EFIAPI *WhoAmI)(EFI_MP_SERVICES_PROTOCOL *, UINTN *);
+};
+
+/* ================================================================
+ * Network: Service Binding, IP4 Config2, HTTP, TCP4
+ * ================================================================ */
+
+typedef struct { UINT8 Addr[4]; } EFI_IPv4_ADDRESS;
+typedef struct { UINT8 Addr[16]; } EFI_IPv6_ADDRESS;
+typedef struct { UINT8 Addr[32]; } EFI_MAC_ADDRESS;
+
+typedef struct _EFI_SERVICE_BINDING_PROTOCOL EFI_SERVICE_BINDING_PROTOCOL;
+
+struct _EFI_SERVICE_BINDING_PROTOCOL {
+    EFI_STATUS (EFIAPI *CreateChild)(EFI_SERVICE_BINDING_PROTOCOL *, EFI_HANDLE *);
+    EFI_STATUS (EFIAPI *DestroyChild)(EFI_SERVICE_BINDING_PROTOCOL *, EFI_HANDLE);
+};
+
+typedef enum {
+    Ip4Config2DataTypeInterfaceInfo,
+    Ip4Config2DataTypePolicy,
+    Ip4Config2DataTypeManualAddress,
+    Ip4Config2DataTypeGateway,
+    Ip4Config2DataTypeDnsServer,
+    Ip4Config2DataTypeMaximum
+} EFI_IP4_CONFIG2_DATA_TYPE;
+
+typedef enum {
+    Ip4Config2PolicyStatic,
+    Ip4Config2PolicyDhcp,
+    Ip4Config2PolicyMax
+} EFI_IP4_CONFIG2_POLICY;
+
+typedef struct {
+    EFI_IPv4_ADDRESS SubnetAddress;
+    EFI_IPv4_ADDRESS SubnetMask;
+    EFI_IPv4_ADDRESS GatewayAddress;
+} EFI_IP4_ROUTE_TABLE;
+
+typedef struct {
+    CHAR16 Name[32];
+    UINT8 IfType;
+    UINT32 HwAddressSize;
+    EFI_MAC_ADDRESS HwAddress;
+    EFI_IPv4_ADDRESS StationAddress;   /* 0.0.0.0 until configured */
+    EFI_IPv4_ADDRESS SubnetMask;
+    UINT32 RouteTableSize;
+    EFI_IP4_ROUTE_TABLE *RouteTable;   /* stored after the structure */
+} EFI_IP4_CONFIG2_INTERFACE_INFO;
+
+typedef struct _EFI_IP4_CONFIG2_PROTOCOL EFI_IP4_CONFIG2_PROTOCOL;
+
+struct _EFI_IP4_CONFIG2_PROTOCOL {
+    EFI_STATUS (EFIAPI *SetData)(EFI_IP4_CONFIG2_PROTOCOL *,
+                                 EFI_IP4_CONFIG2_DATA_TYPE, UINTN, VOID *);
+    EFI_STATUS (EFIAPI *GetData)(EFI_IP4_CONFIG2_PROTOCOL *,
+                                 EFI_IP4_CONFIG2_DATA_TYPE, UINTN *, VOID *);
+    void *RegisterDataNotify;
+    void *UnregisterDataNotify;
+};
+
+typedef enum { HttpVersion10, HttpVersion11, HttpVersionUnsupported } EFI_HTTP_VERSION;
+
+typedef enum {
+    HttpMethodGet, HttpMethodPost, HttpMethodPatch, HttpMethodOptions,
+    HttpMethodConnect, HttpMethodHead, HttpMethodPut, HttpMethodDelete,
+    HttpMethodTrace, HttpMethodMax
+} EFI_HTTP_METHOD;
+
+/* Status codes are an enumeration, not the numbers: HTTP_STATUS_200_OK
+   is 3. The order is the UEFI specification's; 308 and 429 came last. */
+typedef enum {
+    HTTP_STATUS_UNSUPPORTED_STATUS,
+    HTTP_STATUS_100_CONTINUE, HTTP_STATUS_101_SWITCHING_PROTOCOLS,
+    HTTP_STATUS_200_OK, HTTP_STATUS_201_CREATED, HTTP_STATUS_202_ACCEPTED,
+    HTTP_STATUS_203_NON_AUTHORITATIVE_INFORMATION,
+    HTTP_STATUS_204_NO_CONTENT, HTTP_STATUS_205_RESET_CONTENT,
+    HTTP_STATUS_206_PARTIAL_CONTENT,
+    HTTP_STATUS_300_MULTIPLE_CHOICES, HTTP_STATUS_301_MOVED_PERMANENTLY,
+    HTTP_STATUS_302_FOUND, HTTP_STATUS_303_SEE_OTHER,
+    HTTP_STATUS_304_NOT_MODIFIED, HTTP_STATUS_305_USE_PROXY,
+    HTTP_STATUS_307_TEMPORARY_REDIRECT,
+    HTTP_STATUS_400_BAD_REQUEST, HTTP_STATUS_401_UNAUTHORIZED,
+    HTTP_STATUS_402_PAYMENT_REQUIRED, HTTP_STATUS_403_FORBIDDEN,
+    HTTP_STATUS_404_NOT_FOUND, HTTP_STATUS_405_METHOD_NOT_ALLOWED,
+    HTTP_STATUS_406_NOT_ACCEPTABLE,
+    HTTP_STATUS_407_PROXY_AUTHENTICATION_REQUIRED,
+    HTTP_STATUS_408_REQUEST_TIME_OUT, HTTP_STATUS_409_CONFLICT,
+    HTTP_STATUS_410_GONE, HTTP_STATUS_411_LENGTH_REQUIRED,
+    HTTP_STATUS_412_PRECONDITION_FAILED,
+    HTTP_STATUS_413_REQUEST_ENTITY_TOO_LARGE,
+    HTTP_STATUS_414_REQUEST_URI_TOO_LARGE,
+    HTTP_STATUS_415_UNSUPPORTED_MEDIA_TYPE,
+    HTTP_STATUS_416_REQUESTED_RANGE_NOT_SATISFIED,
+    HTTP_STATUS_417_EXPECTATION_FAILED,
+    HTTP_STATUS_500_INTERNAL_SERVER_ERROR, HTTP_STATUS_501_NOT_IMPLEMENTED,
+    HTTP_STATUS_502_BAD_GATEWAY, HTTP_STATUS_503_SERVICE_UNAVAILABLE,
+    HTTP_STATUS_504_GATEWAY_TIME_OUT,
+    HTTP_STATUS_505_HTTP_VERSION_NOT_SUPPORTED,
+    HTTP_STATUS_308_PERMANENT_REDIRECT, HTTP_STATUS_429_TOO_MANY_REQUESTS
+} EFI_HTTP_STATUS_CODE;
+
+typedef struct {
+    BOOLEAN UseDefaultAddress;        /* take the address Ip4Config2 has */
+    EFI_IPv4_ADDRESS LocalAddress;
+    EFI_IPv4_ADDRESS LocalSubnet;
+    UINT16 LocalPort;
+} EFI_HTTPv4_ACCESS_POINT;
+
+typedef struct {
+    EFI_HTTP_VERSION HttpVersion;
+    UINT32 TimeOutMillisec;
+    BOOLEAN LocalAddressIsIPv6;
+    union {
+        EFI_HTTPv4_ACCESS_POINT *IPv4Node;
+        void *IPv6Node;
+    } AccessPoint;
+} EFI_HTTP_CONFIG_DATA;
+
+typedef struct {
+    EFI_HTTP_METHOD Method;
+    CHAR16 *Url;
+} EFI_HTTP_REQUEST_DATA;
+
+typedef struct {
+    EFI_HTTP_STATUS_CODE StatusCode;
+} EFI_HTTP_RESPONSE_DATA;
+
+typedef struct {
+    CHAR8 *FieldName;
+    CHAR8 *FieldValue;
+} EFI_HTTP_HEADER;
+
+typedef struct {
+    union {
+        EFI_HTTP_REQUEST_DATA *Request;
+        EFI_HTTP_RESPONSE_DATA *Response;   /* NULL for more of the body */
+    } Data;
+    UINTN HeaderCount;
+    EFI_HTTP_HEADER *Headers;           /* a response's from AllocatePool */
+    UINTN BodyLength;
+    VOID *Body;
+} EFI_HTTP_MESSAGE;
+
+typedef struct {
+    EFI_EVENT Event;
+    EFI_STATUS Status;
+    EFI_HTTP_MESSAGE *Message;
+} EFI_HTTP_TOKEN;
+
+typedef struct _EFI_HTTP_PROTOCOL EFI_HTTP_PROTOCOL;
+
+struct _EFI_HTTP_PROTOCOL {
+    EFI_STATUS (EFIAPI *GetModeData)(EFI_HTTP_PROTOCOL *, EFI_HTTP_CONFIG_DATA *);
+    EFI_STATUS (EFIAPI *Configure)(EFI_HTTP_PROTOCOL *, EFI_HTTP_CONFIG_DATA *);
+    EFI_STATUS (EFIAPI *Request)(EFI_HTTP_PROTOCOL *, EFI_HTTP_TOKEN *);
+    EFI_STATUS (EFIAPI *Cancel)(EFI_HTTP_PROTOCOL *, EFI_HTTP_TOKEN *);
+    EFI_STATUS (EFIAPI *Response)(EFI_HTTP_PROTOCOL *, EFI_HTTP_TOKEN *);
+    EFI_STATUS (EFIAPI *Poll)(EFI_HTTP_PROTOCOL *);
+};
+
+/* ---- TCP4 ---- */
+
+typedef struct {
+    BOOLEAN UseDefaultAddress;
+    EFI_IPv4_ADDRESS StationAddress;
+    EFI_IPv4_ADDRESS SubnetMask;
+    UINT16 StationPort;
+    EFI_IPv4_ADDRESS RemoteAddress;
+    UINT16 RemotePort;
+    BOOLEAN ActiveFlag;               /* FALSE: listen */
+} EFI_TCP4_ACCESS_POINT;
+
+typedef struct {
+    UINT32 ReceiveBufferSize;
+    UINT32 SendBufferSize;
+    UINT32 MaxSynBackLog;
+    UINT32 ConnectionTimeout;
+    UINT32 DataRetries;
+    UINT32 FinTimeout;
+    UINT32 TimeWaitTimeout;
+    UINT32 KeepAliveProbes;
+    UINT32 KeepAliveTime;
+    UINT32 KeepAliveInterval;
+    BOOLEAN EnableNagle;
+    BOOLEAN EnableTimeStamp;
+    BOOLEAN EnableWindowScaling;
+    BOOLEAN EnableSelectiveAck;
+    BOOLEAN EnablePathMtuDiscovery;
+} EFI_TCP4_OPTION;
+
+typedef struct {
+    UINT8 TypeOfService;
+    UINT8 TimeToLive;
+    EFI_TCP4_ACCESS_POINT AccessPoint;
+    EFI_TCP4_OPTION *ControlOption;   /* NULL for the defaults */
+} EFI_TCP4_CONFIG_DATA;
+
+typedef struct {
+    EFI_EVENT Event;
+    EFI_STATUS Status;
+} EFI_TCP4_COMPLETION_TOKEN;
+
+typedef struct {
+    EFI_TCP4_COMPLETION_TOKEN CompletionToken;
+    EFI_HANDLE NewChildHandle;        /* the accepted connection */
+} EFI_TCP4_LISTEN_TOKEN;
+
+typedef struct {
+    UINT32 FragmentLength;
+    VOID *FragmentBuffer;
+} EFI_TCP4_FRAGMENT_DATA;
+
+/* FragmentTable runs on past the structure for FragmentCount entries */
+typedef struct {
+    BOOLEAN UrgentFlag;
+    UINT32 DataLength;
+    UINT32 FragmentCount;
+    EFI_TCP4_FRAGMENT_DATA FragmentTable[1];
+} EFI_TCP4_RECEIVE_DATA;
+
+typedef struct {
+    BOOLEAN Push;
+    BOOLEAN Urgent;
+    UINT32 DataLength;
+    UINT32 FragmentCount;
+    EFI_TCP4_FRAGMENT_DATA FragmentTable[1];
+} EFI_TCP4_TRANSMIT_DATA;
+
+typedef struct {
+    EFI_TCP4_COMPLETION_TOKEN CompletionToken;
+    union {
+        EFI_TCP4_RECEIVE_DATA *RxData;
+        EFI_TCP4_TRANSMIT_DATA *TxData;
+    } Packet;
+} EFI_TCP4_IO_TOKEN;
+
+typedef struct {
+    EFI_TCP4_COMPLETION_TOKEN CompletionToken;
+    BOOLEAN AbortOnClose;
+} EFI_TCP4_CLOSE_TOKEN;
+
+typedef struct _EFI_TCP4_PROTOCOL EFI_TCP4_PROTOCOL;
+
+struct _EFI_TCP4_PROTOCOL {
+    void *GetModeData;
+    EFI_STATUS (EFIAPI *Configure)(EFI_TCP4_PROTOCOL *, EFI_TCP4_CONFIG_DATA *);
+    void *Routes;
+    void *Connect;
+    EFI_STATUS (EFIAPI *Accept)(EFI_TCP4_PROTOCOL *, EFI_TCP4_LISTEN_TOKEN *);
+    EFI_STATUS (EFIAPI *Transmit)(EFI_TCP4_PROTOCOL *, EFI_TCP4_IO_TOKEN *);
+    EFI_STATUS (EFIAPI *Receive)(EFI_TCP4_PROTOCOL *, EFI_TCP4_IO_TOKEN *);
+    EFI_STATUS (EFIAPI *Close)(EFI_TCP4_PROTOCOL *, EFI_TCP4_CLOSE_TOKEN *);
+    EFI_STATUS (EFIAPI *Cancel)(EFI_TCP4_PROTOCOL *, EFI_TCP4_COMPLETION_TOKEN *);
+    EFI_STATUS (EFIAPI *Poll)(EFI_TCP4_PROTOCOL *);
+};
+
 /* ================================================================
  * Loaded Image Protocol
  * ================================================================ */
@@ -444,4 +1031,46 @@ typedef EFI_LOADED_IMAGE_PROTOCOL EFI_LOADED_IMAGE;
 #define EFI_BLOCK_IO_PROTOCOL_GUID \
     { 0x964e5b21, 0x6459, 0x11d2, {0x8e, 0x39, 0x0, 0xa0, 0xc9, 0x69, 0x72, 0x3b} }
 
+#define EFI_BLOCK_IO2_PROTOCOL_GUID \
+    { 0xa77b2472, 0xe282, 0x4e9f, {0xa2, 0x45, 0xc2, 0xc0, 0xe2, 0x7b, 0xbc, 0xc1} }
+
+#define EFI_ERASE_BLOCK_PROTOCOL_GUID \
+    { 0x95a9a93e, 0xa86e, 0x4926, {0xaa, 0xef, 0x99, 0x18, 0xe7, 0x72, 0xd9, 0x87} }
+
+#define EFI_USB_IO_PROTOCOL_GUID \
+    { 0x2b2f68d6, 0x0cd2, 0x44cf, {0x8e, 0x8b, 0xbb, 0xa2, 0x0b, 0x1b, 0x5b, 0x75} }
+
+#define EFI_DTB_TABLE_GUID \
+    { 0xb1b621d5, 0xf19c, 0x41a5, {0x83, 0x0b, 0xd9, 0x15, 0x2c, 0x69, 0xaa, 0xe0} }
+
+#define EFI_PCI_IO_PROTOCOL_GUID \
+    { 0x4cf5b200, 0x68b8, 0x4ca5, {0x9e, 0xec, 0xb2, 0x3e, 0x3f, 0x50, 0x02, 0x9a} }
+
+#define EFI_NVM_EXPRESS_PASS_THRU_PROTOCOL_GUID \
+    { 0x52c78312, 0x8edc, 0x4233, {0x98, 0xf2, 0x1a, 0x1a, 0xa5, 0xe3, 0x88, 0xa5} }
+
+#define EFI_MP_SERVICES_PROTOCOL_GUID \
+    { 0x3fdda605, 0xa76e, 0x4f46, {0xad, 0x29, 0x12, 0xf4, 0x53, 0x1b, 0x3d, 0x08} }
+
+#define EFI_SIMPLE_NETWORK_PROTOCOL_GUID \
+    { 0xa19832b9, 0xac25, 0x11d3, {0x9a, 0x2d, 0x00, 0x90, 0x27, 0x3f, 0xc1, 0x4d} }
+
+#define EFI_IP4_CONFIG2_PROTOCOL_GUID \
+    { 0x5b446ed1, 0xe30b, 0x4faa, {0x87, 0x1a, 0x36, 0x54, 0xec, 0xa3, 0x60, 0x80} }
+
+#define EFI_HTTP_SERVICE_BINDING_PROTOCOL_GUID \
+    { 0xbdc8e6af, 0xd9bc, 0x4379, {0xa7, 0x2a, 0xe0, 0xc4, 0xe7, 0x5d, 0xae, 0x1c} }
+
+#define EFI_HTTP_PROTOCOL_GUID \
+    { 0x7a59b29b, 0x910b, 0x4171, {0x82, 0x42, 0xa8, 0x5a, 0x0d, 0xf2, 0x5b, 0x5b} }
+
+#define EFI_TCP4_SERVICE_BINDING_PROTOCOL_GUID \
+    { 0x00720665, 0x67eb, 0x4a99, {0xba, 0xf7, 0xd3, 0xc3, 0x3a, 0x1c, 0x7c, 0xc9} }
+
+#define EFI_SERIAL_IO_PROTOCOL_GUID \
+    { 0xbb25cf6f, 0xf1d4, 0x11d2, {0x9a, 0x0c, 0x00, 0x90, 0x27, 0x3f, 0xc1, 0xfd} }
+
+#define EFI_TCP4_PROTOCOL_GUID \
+    { 0x65530bc7, 0xa359, 0x410f, {0xb0, 0x10, 0x5a, 0xad, 0xc7, 0xec, 0x2b, 0x62} }
+
 #endif /* _TCC_EFI_STUB_H */
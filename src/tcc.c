@@ -2,8 +2,8 @@
  * tcc.c — TCC runtime wrapper for Survival Workstation
  *
  * Compiles C source to machine code in memory and executes it.
- * Provides workstation API symbols (fb_*, kbd_*, fs_*, mem_*)
- * to user programs via tcc_add_symbol().
+ * Provides workstation API symbols (fb_*, kbd_*, fs_*, mem_*, par_*,
+ * vec_*) to user programs via tcc_add_symbol().
  */
 
 #include "boot.h"
@@ -11,7 +11,17 @@
 #include "kbd.h"
 #include "mem.h"
 #include "fs.h"
+#include "fpconv.h"
 #include "shim.h"
+#include "timer.h"
+#include "trace.h"
+#include "hash.h"
+#include "vec.h"
+#include "blkapi.h"
+#include "parapi.h"
+#include "mp.h"
+#include "aprun.h"
+#include "profile.h"
 #include "tcc.h"
 
 /* TCC's public API */
@@ -40,162 +50,853 @@ static void tcc_error_handler(void *opaque, const char *msg) {
 
 /* ---- Register workstation API ---- */
 
-/* Cast function pointers to const void* for tcc_add_symbol.
- * C forbids implicit function-ptr → void* conversion; GCC allows it
- * but TCC (when self-hosting) rejects it. */
-#define SYM(name, fn) tcc_add_symbol(s, name, (const void *)(UINTN)(fn))
+/* Everything user programs can call, resolved at link time.  The
+ * addresses are fixed for the life of the binary, so nothing is copied
+ * into a TCC state: the first compile hashes the names into s_api_index
+ * and TinyCC asks api_resolve() for whatever the program left
+ * undefined, so a new state costs the same however large the API
+ * grows.  The void * casts are explicit because C forbids the implicit
+ * function-pointer conversion and TCC (when self-hosting) rejects it. */
+struct api_sym {
+    const char *name;
+    const void *addr;
+};
 
-/* Shim functions that user programs can call */
-static void register_api(TCCState *s) {
+#define API(fn) { #fn, (const void *)(UINTN)(fn) }
+
+/* Calls parallel jobs may not make: refused on a worker (parapi.h) */
+#define API_GUARD(fn) { #fn, (const void *)(UINTN)(guard_##fn) }
+
+static const struct api_sym s_api[] = {
     /* Framebuffer */
-    SYM("fb_pixel",  fb_pixel);
-    SYM("fb_rect",   fb_rect);
-    SYM("fb_clear",  fb_clear);
-    SYM("fb_char",   fb_char);
-    SYM("fb_string", fb_string);
-    SYM("fb_scroll", fb_scroll);
-    SYM("fb_print",  fb_print);
+    API_GUARD(fb_pixel),
+    API_GUARD(fb_rect),
+    API_GUARD(fb_clear),
+    API_GUARD(fb_char),
+    API_GUARD(fb_string),
+    API_GUARD(fb_scroll),
+    API_GUARD(fb_print),
+    API_GUARD(fb_present),
+    API_GUARD(fb_surface_create),
+    API_GUARD(fb_surface_free),
+    API_GUARD(fb_surface_screen),
+    API_GUARD(fb_surface_present),
+    API_GUARD(fb_surface_present_rect),
+    API_GUARD(fb_surface_text),
+    API_GUARD(fb_frame_wait),
 
     /* Keyboard */
-    SYM("kbd_poll", kbd_poll);
-    SYM("kbd_wait", kbd_wait);
+    API_GUARD(kbd_poll),
+    API_GUARD(kbd_wait),
 
     /* Memory */
-    SYM("mem_alloc", mem_alloc);
-    SYM("mem_free",  mem_free);
-    SYM("mem_set",   mem_set);
-    SYM("mem_copy",  mem_copy);
+    API_GUARD(mem_alloc),
+    API_GUARD(mem_free),
+    API(mem_set),
+    API(mem_copy),
 
     /* Filesystem */
-    SYM("fs_readfile",  fs_readfile);
-    SYM("fs_writefile", fs_writefile);
-    SYM("fs_readdir",   fs_readdir);
+    API_GUARD(fs_readfile),
+    API_GUARD(fs_writefile),
+    API_GUARD(fs_readdir),
+
+    /* Raw block devices */
+    API_GUARD(blk_count),
+    API_GUARD(blk_info),
+    API_GUARD(blk_read),
+    API_GUARD(blk_write),
+    API_GUARD(blk_flush),
+    API_GUARD(blk_buf_alloc),
+    API_GUARD(blk_buf_free),
+    API_GUARD(blk_queue_open),
+    API_GUARD(blk_submit_read),
+    API_GUARD(blk_submit_write),
+    API_GUARD(blk_poll),
+    API_GUARD(blk_wait),
+    API_GUARD(blk_queue_close),
+
+    /* Profiling hooks of -finstrument-functions */
+    API(__cyg_profile_func_enter),
+    API(__cyg_profile_func_exit),
+
+    /* Timing */
+    API(bench_start),
+    API(bench_stop),
+    API(bench_ns),
+
+    /* Checksums */
+    API(crc32c),
+    API(crc32),
+    API(hash_accel),
+    API(sha256_init),
+    API(sha256_update),
+    API(sha256_final),
+
+    /* Array kernels */
+    API(vec_sum_i32),
+    API(vec_min_i32),
+    API(vec_max_i32),
+    API(vec_dot_i32),
+    API(vec_sum_f32),
+    API(vec_min_f32),
+    API(vec_max_f32),
+    API(vec_dot_f32),
+    API(vec_find_byte),
+    API(vec_xor),
+    API(vec_blend),
+
+    /* Parallel jobs */
+    API(par_cores),
+    API(par_for),
+    API(par_submit),
+    API(par_wait),
+    API(par_run),
+    API(par_barrier_init),
+    API(par_barrier_wait),
+    { "par_add32", (const void *)(UINTN)mp_add32 },
+    { "par_add64", (const void *)(UINTN)mp_add64 },
+    { "par_cas32", (const void *)(UINTN)mp_cas32 },
+    { "par_cas64", (const void *)(UINTN)mp_cas64 },
+    { "par_fence", (const void *)(UINTN)mp_fence },
+    { "par_relax", (const void *)(UINTN)mp_relax },
+
+    /* Number formatting */
+    API(fp_shortest),
 
     /* Global state */
-    tcc_add_symbol(s, "g_boot", &g_boot);
+    { "g_boot", &g_boot },
 
     /* Shim libc functions */
-    SYM("printf",   printf);
-    SYM("snprintf", snprintf);
-    SYM("sprintf",  sprintf);
-    SYM("strlen",   strlen);
-    SYM("strcmp",    strcmp);
-    SYM("strcpy",   strcpy);
-    SYM("memcpy",   memcpy);
-    SYM("memset",   memset);
-    SYM("malloc",   malloc);
-    SYM("free",     free);
-    SYM("puts",     puts);
-    SYM("memchr",   memchr);
-    SYM("strspn",   strspn);
-    SYM("strcspn",  strcspn);
-    SYM("strtok",   strtok);
-    SYM("bsearch",  bsearch);
-    SYM("rand",     rand);
-    SYM("srand",    srand);
-    SYM("strcat",   strcat);
-    SYM("strrchr",  strrchr);
-    SYM("strstr",   strstr);
-    SYM("strdup",   strdup);
-    SYM("strncpy",  strncpy);
-    SYM("strncmp",  strncmp);
-    SYM("strchr",   strchr);
-    SYM("atoi",     atoi);
-    SYM("realloc",  realloc);
-    SYM("calloc",   calloc);
-    SYM("memcmp",   memcmp);
-    SYM("memmove",  memmove);
-    SYM("qsort",    qsort);
-    SYM("strtol",   strtol);
-    SYM("strtoul",  strtoul);
-}
-
-#undef SYM
+    API_GUARD(printf),
+    API(snprintf),
+    API(sprintf),
+    API(strlen),
+    API(strcmp),
+    API(strcpy),
+    API(memcpy),
+    API(memset),
+    API_GUARD(malloc),
+    API_GUARD(free),
+    API_GUARD(puts),
+    API_GUARD(putchar),
+    API_GUARD(fflush),
+    API(setvbuf),
+    API(setbuf),
+    API_GUARD(time),
+    API(clock),
+    API_GUARD(clock_gettime),
+    API_GUARD(gettimeofday),
+    API_GUARD(localtime),
+    API(gmtime),
+    API(memchr),
+    API(strspn),
+    API(strcspn),
+    API(strtok),
+    API(bsearch),
+    API(rand),
+    API(srand),
+    API(strcat),
+    API(strrchr),
+    API(strstr),
+    API_GUARD(strdup),
+    API(strncpy),
+    API(strncmp),
+    API(strchr),
+    API(atoi),
+    API_GUARD(realloc),
+    API_GUARD(calloc),
+    API(memcmp),
+    API(memmove),
+    API(qsort),
+    API(qsort_r),
+    API(strtol),
+    API(strtoul),
+    API(strtod),
+    API(strtof),
+
+    /* Math */
+    API(ldexp),
+    API(frexp),
+    API(fabs),
+    API(trunc),
+    API(floor),
+    API(ceil),
+    API(round),
+    API(fmod),
+    API(sqrt),
+    API(exp),
+    API(exp2),
+    API(log),
+    API(log2),
+    API(log10),
+    API(pow),
+    API(sin),
+    API(cos),
+    API(tan),
+    API(atan),
+    API(atan2),
+    API(asin),
+    API(acos),
+    API(fabsf),
+    API(truncf),
+    API(floorf),
+    API(ceilf),
+    API(roundf),
+    API(fmodf),
+    API(sqrtf),
+    API(expf),
+    API(exp2f),
+    API(logf),
+    API(log2f),
+    API(log10f),
+    API(powf),
+    API(sinf),
+    API(cosf),
+    API(tanf),
+    API(atanf),
+    API(atan2f),
+    API(asinf),
+    API(acosf),
+};
+
+#undef API
+
+#define API_COUNT (sizeof(s_api) / sizeof(s_api[0]))
+
+/* Open-addressed, linear-probed; keep at least twice API_COUNT so
+   probes stay short */
+#define API_SLOTS 512
+
+typedef char api_slots_enough[API_SLOTS >= 2 * API_COUNT ? 1 : -1];
+
+static UINT16 s_api_index[API_SLOTS];   /* s_api position + 1, 0 = empty */
+static int    s_api_ready;
+
+static UINT32 api_hash(const char *name) {
+    UINT32 h = 2166136261u;
+    while (*name)
+        h = (h ^ (UINT8)*name++) * 16777619u;
+    return h;
+}
+
+static void api_index_build(void) {
+    for (UINTN i = 0; i < API_COUNT; i++) {
+        UINT32 k = api_hash(s_api[i].name) & (API_SLOTS - 1);
+        while (s_api_index[k])
+            k = (k + 1) & (API_SLOTS - 1);
+        s_api_index[k] = (UINT16)(i + 1);
+    }
+    s_api_ready = 1;
+}
+
+static const void *api_resolve(void *opaque, const char *name) {
+    (void)opaque;
+    UINT32 k = api_hash(name) & (API_SLOTS - 1);
+    for (UINT16 i; (i = s_api_index[k]) != 0; k = (k + 1) & (API_SLOTS - 1))
+        if (strcmp(s_api[i - 1].name, name) == 0)
+            return s_api[i - 1].addr;
+    return NULL;
+}
+
+static void register_api(TCCState *s) {
+    if (!s_api_ready)
+        api_index_build();
+    tcc_set_resolver(s, NULL, api_resolve);
+}
+
+/* ---- Program image cache ----
+ *
+ * F5 on an unchanged program reuses the relocated image of the last
+ * compile instead of building it again.  The key hashes the API table,
+ * the file name, the source and every header it reaches through
+ * #include (found the way TCC looks for them here: next to the
+ * includer for "name", then in /include).  An image is run from a
+ * pristine copy taken before its first run, so globals start fresh.
+ */
+#define JIT_SLOTS     4
+#define JIT_BYTES     (8 * 1024 * 1024)  /* images plus pristine copies */
+#define JIT_PATH      128
+#define JIT_HEADERS   32                 /* distinct headers per key */
+
+struct jit_entry {
+    UINT64 key;             /* 0 = empty slot */
+    UINT8 *image;           /* mem_alloc_code() pages */
+    UINT8 *pristine;        /* image as relocated, before any run */
+    UINTN  size;
+    UINTN  entry;           /* offset of main() */
+    UINT32 stamp;           /* LRU */
+};
+
+static struct jit_entry s_jit[JIT_SLOTS];
+static UINT32 s_jit_clock;
+static UINT64 s_jit_hits, s_jit_misses;
+
+struct jit_scan {
+    UINT64 h;
+    int    nseen;
+    char   seen[JIT_HEADERS][JIT_PATH];
+};
+
+static UINT64 jit_mix(UINT64 h, const void *data, UINTN n) {
+    const UINT8 *p = (const UINT8 *)data;
+    for (UINTN i = 0; i < n; i++)
+        h = (h ^ p[i]) * 0x100000001B3ULL;
+    return h;
+}
+
+/* Whole file through the shim (and its cache). NULL if missing. */
+static char *jit_read(const char *path, size_t *size) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    off_t n = lseek(fd, 0, SEEK_END);
+    lseek(fd, 0, SEEK_SET);
+    char *buf = n >= 0 ? (char *)malloc((size_t)n + 1) : NULL;
+    size_t got = 0;
+    while (buf && got < (size_t)n) {
+        ssize_t r = read(fd, buf + got, (size_t)n - got);
+        if (r <= 0) {
+            free(buf);
+            buf = NULL;
+        } else {
+            got += (size_t)r;
+        }
+    }
+    close(fd);
+    *size = got;
+    return buf;
+}
+
+static void jit_scan_text(struct jit_scan *sc, const char *dir,
+                          const char *text, size_t size, int depth);
+
+/* Hash one included file (or its absence) and what it includes */
+static void jit_scan_file(struct jit_scan *sc, const char *path, int depth) {
+    for (int i = 0; i < sc->nseen; i++)
+        if (strcmp(sc->seen[i], path) == 0)
+            return;
+    if (sc->nseen < JIT_HEADERS)
+        strcpy(sc->seen[sc->nseen++], path);
+
+    sc->h = jit_mix(sc->h, path, strlen(path) + 1);
+    size_t size = 0;
+    char *data = jit_read(path, &size);
+    if (!data) {
+        sc->h = jit_mix(sc->h, "-", 1);
+        return;
+    }
+    sc->h = jit_mix(sc->h, &size, sizeof(size));
+    sc->h = jit_mix(sc->h, data, size);
+
+    char dir[JIT_PATH];
+    strcpy(dir, path);
+    char *slash = strrchr(dir, '/');
+    if (slash) slash[1] = '\0';
+    jit_scan_text(sc, dir, data, size, depth + 1);
+    free(data);
+}
+
+static int jit_exists(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    close(fd);
+    return 1;
+}
+
+/* Every #include at the start of a line; conditional ones are followed
+   too, which can only cause extra compiles */
+static void jit_scan_text(struct jit_scan *sc, const char *dir,
+                          const char *text, size_t size, int depth) {
+    if (depth > 8)
+        return;
+    size_t i = 0;
+    while (i < size) {
+        size_t p = i;
+        while (p < size && (text[p] == ' ' || text[p] == '\t')) p++;
+        if (p < size && text[p] == '#') {
+            p++;
+            while (p < size && (text[p] == ' ' || text[p] == '\t')) p++;
+            if (p + 7 < size && memcmp(&text[p], "include", 7) == 0) {
+                p += 7;
+                while (p < size && (text[p] == ' ' || text[p] == '\t')) p++;
+                char open_c = p < size ? text[p] : 0;
+                if (open_c == '"' || open_c == '<') {
+                    char close_c = open_c == '"' ? '"' : '>';
+                    char name[JIT_PATH];
+                    int n = 0;
+                    p++;
+                    while (p < size && text[p] != close_c && text[p] != '\n' &&
+                           n < JIT_PATH - 16)
+                        name[n++] = text[p++];
+                    name[n] = '\0';
+                    char path[JIT_PATH * 2];
+                    snprintf(path, sizeof(path), "%s%s", dir, name);
+                    if (n > 0 && !(open_c == '"' && strlen(path) < JIT_PATH &&
+                                   jit_exists(path)))
+                        snprintf(path, sizeof(path), "/include/%s", name);
+                    if (n > 0 && strlen(path) < JIT_PATH)
+                        jit_scan_file(sc, path, depth);
+                }
+            }
+        }
+        while (i < size && text[i] != '\n') i++;
+        i++;
+    }
+}
+
+static UINT64 jit_key(const char *source, const char *filename) {
+    struct jit_scan *sc = (struct jit_scan *)malloc(sizeof(struct jit_scan));
+    if (!sc)
+        return 0;
+    sc->h = 0xCBF29CE484222325ULL;
+    sc->nseen = 0;
+    sc->h = jit_mix(sc->h, s_api, sizeof(s_api));
+    sc->h = jit_mix(sc->h, filename, strlen(filename) + 1);
+    size_t len = strlen(source);
+    sc->h = jit_mix(sc->h, source, len);
+    /* A compiled string's "name" includes resolve from the root */
+    jit_scan_text(sc, "/", source, len, 0);
+    UINT64 h = sc->h ? sc->h : 1;
+    free(sc);
+    return h;
+}
+
+static struct jit_entry *jit_find(UINT64 key) {
+    for (int i = 0; i < JIT_SLOTS; i++)
+        if (key && s_jit[i].key == key)
+            return &s_jit[i];
+    return NULL;
+}
+
+static UINTN jit_bytes(void) {
+    UINTN total = 0;
+    for (int i = 0; i < JIT_SLOTS; i++)
+        if (s_jit[i].key)
+            total += 2 * s_jit[i].size;
+    return total;
+}
+
+static void jit_free(struct jit_entry *e) {
+    mem_free_code(e->image, e->size);
+    mem_free(e->pristine);
+    mem_set(e, 0, sizeof(*e));
+}
+
+/* Take ownership of an image; returns 0 if it does not fit */
+static int jit_insert(UINT64 key, UINT8 *image, UINT8 *pristine,
+                      UINTN size, UINTN entry) {
+    if (!key || 2 * size > JIT_BYTES)
+        return 0;
+    for (;;) {
+        struct jit_entry *empty = NULL, *lru = NULL;
+        for (int i = 0; i < JIT_SLOTS; i++) {
+            if (!s_jit[i].key) {
+                if (!empty) empty = &s_jit[i];
+            } else if (!lru || s_jit[i].stamp < lru->stamp) {
+                lru = &s_jit[i];
+            }
+        }
+        if (empty && jit_bytes() + 2 * size <= JIT_BYTES) {
+            empty->key = key;
+            empty->image = image;
+            empty->pristine = pristine;
+            empty->size = size;
+            empty->entry = entry;
+            empty->stamp = ++s_jit_clock;
+            return 1;
+        }
+        jit_free(lru);
+    }
+}
+
+void tcc_cache_stats(struct tcc_cache_stats *out) {
+    mem_set(out, 0, sizeof(*out));
+    for (int i = 0; i < JIT_SLOTS; i++)
+        if (s_jit[i].key)
+            out->programs++;
+    out->bytes = jit_bytes();
+    out->hits = s_jit_hits;
+    out->misses = s_jit_misses;
+}
+
+void tcc_cache_purge(void) {
+    for (int i = 0; i < JIT_SLOTS; i++)
+        if (s_jit[i].key)
+            jit_free(&s_jit[i]);
+}
+
+/* ---- State lifetime ---- */
+
+TCCState *tcc_arena_new(void) {
+    shim_arena_begin();
+    TCCState *s = tcc_new();
+    if (!s)
+        shim_arena_end();
+    return s;
+}
+
+void tcc_arena_delete(TCCState *s) {
+    tcc_delete(s);
+    shim_arena_end();
+}
+
+/* ---- Phase timing ---- */
+
+void tcc_phase_collect(TCCState *s, UINT64 compile_ticks,
+                       struct tcc_phase_stats *out) {
+    TCCStats st;
+    tcc_get_stats(s, &st);
+    /* Directives and macros run inside the one compile pass */
+    out->preprocess = st.pp_ticks < compile_ticks ? st.pp_ticks : compile_ticks;
+    out->compile = compile_ticks - out->preprocess;
+    out->lines = st.lines;
+    out->tokens = st.tokens;
+    out->code_bytes = st.text_bytes;
+}
 
 /* ---- Main compile+run entry point ---- */
 
-struct tcc_result tcc_run_source(const char *source, const char *filename) {
-    struct tcc_result result;
-    mem_set(&result, 0, sizeof(result));
+/* Call main() with exit() recovery via setjmp/longjmp, or on an AP
+   with TCC_RUN_AP. Returns 0 if the program is done with its image,
+   1 if it is still running on its AP and the image must stay. */
+static int run_main(int (*prog_main)(void), struct tcc_result *result,
+                    int flags) {
+    int profile = (flags & TCC_RUN_PROFILE) != 0;
+    TRACE_BEGIN(TR_TCC_RUN, 0, 0);
+    if (profile)
+        prof_begin();
+    else if (flags & TCC_RUN_AP)
+        result->aprun = aprun_main(prog_main, &result->exit_code);
 
-    /* Setup error capture */
-    s_errbuf = result.error_msg;
-    s_errbuf_pos = 0;
-    s_errbuf_size = (int)sizeof(result.error_msg);
-    s_errbuf[0] = '\0';
+    if (result->aprun) {
+        result->success = 1;
+    } else {
+        shim_exit_active = 1;
+        shim_exit_code = 0;
+        int jmpval = setjmp(shim_exit_jmpbuf);
 
-    /* Create TCC context */
-    TCCState *tcc = tcc_new();
-    if (!tcc) {
-        strcpy(result.error_msg, "Failed to create TCC context");
-        return result;
+        if (jmpval == 0) {
+            /* First time — call the program */
+            result->exit_code = prog_main();
+            result->success = 1;
+        } else {
+            /* Returned from exit() via longjmp */
+            result->exit_code = shim_exit_code;
+            result->success = 1;
+        }
+        shim_exit_active = 0;
     }
 
-    tcc_set_error_func(tcc, NULL, tcc_error_handler);
-    tcc_set_options(tcc, "-nostdlib -nostdinc");
-    tcc_set_output_type(tcc, TCC_OUTPUT_MEMORY);
+    if (profile)
+        prof_end();
+    int stranded = result->aprun == APRUN_STRANDED;
+    if (stranded) {
+        /* Whatever it was given, it may still be using */
+        shim_arena_keep();
+        blk_keep_buffers();
+        fb_surface_keep();
+    }
+    par_release();
+    blk_release();
+    fb_surface_release();
+    TRACE_END(TR_TCC_RUN, result->exit_code, 0);
+    shim_console_reset();
+    return stranded;
+}
 
-    /* Add include path — user headers on the FAT32 image */
-    tcc_add_include_path(tcc, "/include");
+/* Rerun the cached image for key, if one is kept. Returns 1 if it ran. */
+static int run_cached(UINT64 key, int flags, struct tcc_result *result) {
+    struct jit_entry *e = jit_find(key);
+    if (!e)
+        return 0;
+    s_jit_hits++;
+    e->stamp = ++s_jit_clock;
+    mem_copy(e->image, e->pristine, e->size);
+    result->cached = 1;
+    /* The program's own mallocs go to an arena, as when compiled */
+    shim_arena_begin();
+    if (run_main((int (*)(void))(UINTN)(e->image + e->entry), result,
+                 flags)) {
+        /* Out of the cache, but the image stays where it runs */
+        mem_free(e->pristine);
+        mem_set(e, 0, sizeof(*e));
+    }
+    shim_arena_end();
+    return 1;
+}
 
-    /* Register workstation API symbols */
-    register_api(tcc);
+/* Relocate what was added to tcc, run its main() and keep the image
+   under key. Deletes the state. */
+static void run_state(TCCState *tcc, UINT64 key, int flags,
+                      struct tcc_result *result) {
+    int profile = (flags & TCC_RUN_PROFILE) != 0;
+    /* Relocate */
+    UINT64 t0 = timer_ticks();
+    TRACE_BEGIN(TR_TCC_RELOCATE, 0, 0);
+    int relocated = tcc_relocate(tcc);
+    TRACE_END(TR_TCC_RELOCATE, 0, 0);
+    if (relocated < 0) {
+        tcc_arena_delete(tcc);
+        return;
+    }
+    result->stats.relocate = timer_ticks() - t0;
+
+    /* Get main symbol */
+    int (*prog_main)(void) = (int (*)(void))tcc_get_symbol(tcc, "main");
+    if (!prog_main) {
+        strcpy(result->error_msg, "No main() function found");
+        tcc_arena_delete(tcc);
+        return;
+    }
 
+    /* Keep the image past the state, with a copy for later runs */
+    unsigned long size = 0;
+    UINT8 *image = (UINT8 *)tcc_take_image(tcc, &size);
+    UINT8 *pristine = image && !profile ? (UINT8 *)mem_alloc(size) : NULL;
+    if (pristine)
+        mem_copy(pristine, image, size);
+
+    int running = run_main(prog_main, result, flags);
+    if (profile)
+        tcc_list_functions(tcc, NULL, prof_name);
+    tcc_arena_delete(tcc);
+
+    if (running) {
+        if (pristine) mem_free(pristine);
+    } else if (image && !(pristine &&
+                   jit_insert(key, image, pristine, size,
+                              (UINTN)((UINT8 *)(UINTN)prog_main - image)))) {
+        mem_free_code(image, size);
+        if (pristine) mem_free(pristine);
+    }
+}
+
+/* Compile errors go to result's message */
+static void error_capture(struct tcc_result *result) {
+    s_errbuf = result->error_msg;
+    s_errbuf_pos = 0;
+    s_errbuf_size = (int)sizeof(result->error_msg);
+    s_errbuf[0] = '\0';
+}
+
+/* Compile source into tcc as the file filename, counting its lines
+   into result's stats. Returns 0, -1 with the message in result. */
+static int compile_named(TCCState *tcc, const char *source,
+                         const char *filename, struct tcc_result *result) {
     /* Build a line directive so errors show the right filename */
     char prefix[256];
-    snprintf(prefix, sizeof(prefix), "#line 1 \"%s\"\n", filename ? filename : "input.c");
+    snprintf(prefix, sizeof(prefix), "#line 1 \"%s\"\n", filename);
 
     /* Concatenate prefix + source */
     int plen = (int)strlen(prefix);
     int slen = (int)strlen(source);
     char *full = (char *)malloc((size_t)(plen + slen + 1));
     if (!full) {
-        strcpy(result.error_msg, "Out of memory");
-        tcc_delete(tcc);
-        return result;
+        strcpy(result->error_msg, "Out of memory");
+        return -1;
     }
     memcpy(full, prefix, (size_t)plen);
     memcpy(full + plen, source, (size_t)slen);
     full[plen + slen] = '\0';
 
     /* Compile */
-    if (tcc_compile_string(tcc, full) < 0) {
-        free(full);
-        tcc_delete(tcc);
+    UINT64 t0 = timer_ticks();
+    TRACE_BEGIN(TR_TCC_COMPILE, plen + slen, 0);
+    int compiled = tcc_compile_string(tcc, full);
+    TRACE_END(TR_TCC_COMPILE, plen + slen, 0);
+    free(full);
+    if (compiled < 0)
+        return -1;
+    tcc_phase_collect(tcc, timer_ticks() - t0, &result->stats);
+
+    /* The source is a string, so TinyCC only counted the headers' lines */
+    for (int i = 0; i < slen; i++)
+        if (source[i] == '\n')
+            result->stats.lines++;
+    return 0;
+}
+
+struct tcc_result tcc_run_source(const char *source, const char *filename,
+                                 int flags) {
+    struct tcc_result result;
+    mem_set(&result, 0, sizeof(result));
+    error_capture(&result);
+
+    if (!filename)
+        filename = "input.c";
+
+    /* Unchanged since an earlier run: restore its image and go */
+    int profile = (flags & TCC_RUN_PROFILE) != 0;
+    UINT64 key = jit_key(source, filename);
+    if (!profile && run_cached(key, flags, &result))
+        return result;
+    s_jit_misses++;
+
+    /* Create TCC context */
+    TCCState *tcc = tcc_arena_new();
+    if (!tcc) {
+        strcpy(result.error_msg, "Failed to create TCC context");
+        return result;
+    }
+
+    tcc_set_error_func(tcc, NULL, tcc_error_handler);
+    tcc_set_options(tcc, TCC_RUN_OPTIONS);
+    if (profile)
+        tcc_set_options(tcc, "-finstrument-functions");
+    tcc_set_output_type(tcc, TCC_OUTPUT_MEMORY);
+
+    /* Add include path — user headers on the FAT32 image */
+    tcc_add_include_path(tcc, "/include");
+
+    /* Register workstation API symbols */
+    register_api(tcc);
+
+    if (compile_named(tcc, source, filename, &result) != 0) {
+        tcc_arena_delete(tcc);
         return result; /* error_msg already filled by handler */
     }
-    free(full);
 
-    /* Relocate */
-    if (tcc_relocate(tcc) < 0) {
-        tcc_delete(tcc);
+    run_state(tcc, key, flags, &result);
+    return result;
+}
+
+struct tcc_result tcc_run_files(const char *const *files, int count,
+                                const char *options,
+                                const char *const *includes,
+                                UINT64 key, int flags) {
+    struct tcc_result result;
+    mem_set(&result, 0, sizeof(result));
+    error_capture(&result);
+
+    /* The caller's key covers the files, not what they link against */
+    int profile = (flags & TCC_RUN_PROFILE) != 0;
+    if (key)
+        key = jit_mix(key, s_api, sizeof(s_api));
+    if (!profile && key && run_cached(key, flags, &result))
+        return result;
+    s_jit_misses++;
+
+    TCCState *tcc = tcc_arena_new();
+    if (!tcc) {
+        strcpy(result.error_msg, "Failed to create TCC context");
         return result;
     }
+    tcc_set_error_func(tcc, NULL, tcc_error_handler);
+    tcc_set_options(tcc, options ? options : TCC_RUN_OPTIONS);
+    if (profile)
+        tcc_set_options(tcc, "-finstrument-functions");
+    tcc_set_output_type(tcc, TCC_OUTPUT_MEMORY);
+    for (int k = 0; includes && includes[k]; k++)
+        tcc_add_include_path(tcc, includes[k]);
+    register_api(tcc);
 
-    /* Get main symbol */
-    int (*prog_main)(void) = (int (*)(void))tcc_get_symbol(tcc, "main");
-    if (!prog_main) {
-        strcpy(result.error_msg, "No main() function found");
-        tcc_delete(tcc);
+    /* Sources are compiled here, objects only loaded */
+    UINT64 t0 = timer_ticks();
+    TRACE_BEGIN(TR_TCC_COMPILE, 0, 0);
+    for (int i = 0; i < count; i++) {
+        if (tcc_add_file(tcc, files[i]) < 0) {
+            TRACE_END(TR_TCC_COMPILE, 0, 0);
+            tcc_arena_delete(tcc);
+            return result;
+        }
+    }
+    TRACE_END(TR_TCC_COMPILE, 0, 0);
+    tcc_phase_collect(tcc, timer_ticks() - t0, &result.stats);
+
+    run_state(tcc, key, flags, &result);
+    return result;
+}
+
+/* ---- Standalone EFI applications ----
+ *
+ * An application calls the API through an import table naming
+ * TCC_APP_DLL rather than through addresses fixed at link time, so it
+ * outlives the workstation binary it was built on.  Only the
+ * workstation can start it: its loader (efiapp.c) binds the imports
+ * with tcc_app_lookup() and sets TCC_APP_MARK, without which the entry
+ * point returns EFI_LOAD_ERROR before calling any of them.  main() runs
+ * through app_run(), as F5 runs it, and its exit code is the image's
+ * status.
+ */
+static const char s_app_stub[] = TCC_APP_STUB;
+
+static int app_run(int (*prog_main)(void)) {
+    struct tcc_result result;
+    mem_set(&result, 0, sizeof(result));
+    shim_arena_begin();
+    run_main(prog_main, &result, 0);
+    shim_arena_end();
+    return result.exit_code;
+}
+
+const void *tcc_app_lookup(const char *name) {
+    if (strcmp(name, "__survival_run") == 0)
+        return (const void *)(UINTN)app_run;
+    if (!s_api_ready)
+        api_index_build();
+    return api_resolve(NULL, name);
+}
+
+struct tcc_result tcc_build_app(const char *source, const char *filename,
+                                const char *const *files, int count,
+                                const char *options,
+                                const char *const *includes,
+                                const char *out_path) {
+    struct tcc_result result;
+    mem_set(&result, 0, sizeof(result));
+    error_capture(&result);
+
+    TCCState *tcc = tcc_arena_new();
+    if (!tcc) {
+        strcpy(result.error_msg, "Failed to create TCC context");
         return result;
     }
+    tcc_set_error_func(tcc, NULL, tcc_error_handler);
+    tcc_set_options(tcc, options ? options : TCC_RUN_OPTIONS);
+    tcc_set_options(tcc, "-Wl,-subsystem=efiapp -Wl,-e=__survival_start");
+    tcc_set_output_type(tcc, TCC_OUTPUT_DLL);
+    for (int k = 0; includes && includes[k]; k++)
+        tcc_add_include_path(tcc, includes[k]);
 
-    /* Setup exit() recovery via setjmp/longjmp */
-    shim_exit_active = 1;
-    shim_exit_code = 0;
-    int jmpval = setjmp(shim_exit_jmpbuf);
+    /* Every function is offered; only those used reach the table. Data
+       cannot be reached through a thunk, so g_boot stays undefined. */
+    for (UINTN i = 0; i < API_COUNT; i++)
+        if (s_api[i].addr != (const void *)&g_boot)
+            tcc_add_import(tcc, TCC_APP_DLL, s_api[i].name);
+    tcc_add_import(tcc, TCC_APP_DLL, "__survival_run");
 
-    if (jmpval == 0) {
-        /* First time — call the program */
-        result.exit_code = prog_main();
-        result.success = 1;
-    } else {
-        /* Returned from exit() via longjmp */
-        result.exit_code = shim_exit_code;
-        result.success = 1;
+    if (source && compile_named(tcc, source, filename ? filename : "input.c",
+                                &result) != 0) {
+        tcc_arena_delete(tcc);
+        return result;
+    }
+    UINT64 t0 = timer_ticks();
+    TRACE_BEGIN(TR_TCC_COMPILE, 0, 0);
+    for (int i = 0; i < count; i++) {
+        if (tcc_add_file(tcc, files[i]) < 0) {
+            TRACE_END(TR_TCC_COMPILE, 0, 0);
+            tcc_arena_delete(tcc);
+            return result;
+        }
+    }
+    TRACE_END(TR_TCC_COMPILE, 0, 0);
+    if (!source)
+        tcc_phase_collect(tcc, timer_ticks() - t0, &result.stats);
+    if (tcc_compile_string(tcc, s_app_stub) < 0) {
+        tcc_arena_delete(tcc);
+        return result;
     }
 
-    shim_exit_active = 0;
-    tcc_delete(tcc);
+    t0 = timer_ticks();
+    if (tcc_output_file(tcc, out_path) < 0) {
+        if (!result.error_msg[0])
+            strcpy(result.error_msg, "Cannot write the application");
+        tcc_arena_delete(tcc);
+        return result;
+    }
+    result.stats.output = timer_ticks() - t0;
+    result.success = 1;
+    tcc_arena_delete(tcc);
     return result;
 }
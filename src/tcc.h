@@ -3,13 +3,110 @@
 
 #include "boot.h"
 
+/* Time spent in each phase of one compile, in timer_ticks() units
+   (0 for a phase that did not run), and what it read and produced */
+struct tcc_phase_stats {
+    UINT64 preprocess;  /* directives and macro expansion */
+    UINT64 compile;     /* the rest of the single pass: lexing, parsing
+                           and code generation */
+    UINT64 relocate;
+    UINT64 output;      /* writing the object or PE file */
+    UINT32 lines;       /* source lines, headers included */
+    UINT32 tokens;      /* source tokens, before macro expansion */
+    UINT32 code_bytes;
+};
+
 struct tcc_result {
     int  success;       /* 1 = ok, 0 = error */
     char error_msg[2048];
     int  exit_code;
+    int  cached;        /* ran a cached image without compiling */
+    int  aprun;         /* TCC_RUN_AP: how it ended (APRUN_*), 0 if it
+                           ran on the boot processor */
+    struct tcc_phase_stats stats;   /* compile and relocate, if not cached */
+};
+
+/* tcc_run_source() flags */
+#define TCC_RUN_PROFILE 0x1     /* -finstrument-functions; see profile.h */
+#define TCC_RUN_AP      0x2     /* on an AP when one is free; see aprun.h.
+                                   Not with TCC_RUN_PROFILE. */
+
+/* What user programs are compiled with */
+#define TCC_RUN_OPTIONS "-nostdlib -nostdinc -O1"
+
+/* Compile and run C source in memory. Returns result. Relocated
+   programs are cached by a hash of the source and its headers, so an
+   unchanged program reruns without compiling. A profiled run always
+   compiles and is not cached; prof_result() has its profile. */
+struct tcc_result tcc_run_source(const char *source, const char *filename,
+                                 int flags);
+
+/* Link count files in memory and run the program: objects built with
+   TCC_RUN_OPTIONS, or sources, compiled here with options (NULL for
+   TCC_RUN_OPTIONS) and the NULL-terminated include paths. key hashes
+   everything that went into the files; an image cached under it reruns
+   without loading any, and 0 does not cache. */
+struct tcc_result tcc_run_files(const char *const *files, int count,
+                                const char *options,
+                                const char *const *includes,
+                                UINT64 key, int flags);
+
+/* An application from tcc_build_app() imports the API from TCC_APP_DLL
+   and runs only once its loader has bound the imports and set the
+   exported TCC_APP_MARK to TCC_APP_LINKED (efiapp.h) */
+#define TCC_APP_DLL     "survival.dll"
+#define TCC_APP_MARK    "__survival_linked"
+#define TCC_APP_LINKED  0x534C564CULL
+
+/* The entry point tcc_build_app() adds to every application. It returns
+   EFI_LOAD_ERROR until TCC_APP_MARK is set, then runs main() through
+   the imported __survival_run(). */
+#define TCC_APP_STR_(x) #x
+#define TCC_APP_STR(x)  TCC_APP_STR_(x)
+#define TCC_APP_STUB \
+    "int main(void);\n" \
+    "int __survival_run(int (*)(void));\n" \
+    "__attribute__((dllexport)) unsigned long long " TCC_APP_MARK " = 1;\n" \
+    "unsigned long long __survival_start(void *image, void *st) {\n" \
+    "    if (" TCC_APP_MARK " != " TCC_APP_STR(TCC_APP_LINKED) ")\n" \
+    "        return 0x8000000000000001ULL;\n" \
+    "    return (unsigned int)__survival_run(main);\n" \
+    "}\n"
+
+/* Compile a program into the EFI application out_path instead of
+   running it: source named filename (either may be NULL) and count
+   files, taken as tcc_run_files() takes them. Only a small entry point
+   is added; the API is imported, except g_boot, which is data. */
+struct tcc_result tcc_build_app(const char *source, const char *filename,
+                                const char *const *files, int count,
+                                const char *options,
+                                const char *const *includes,
+                                const char *out_path);
+
+/* What an application's import of name binds to, NULL if nothing */
+const void *tcc_app_lookup(const char *name);
+
+/* Program image cache contents and counters */
+struct tcc_cache_stats {
+    int    programs;
+    UINT64 bytes;       /* images plus their pristine copies */
+    UINT64 hits, misses;
 };
+void tcc_cache_stats(struct tcc_cache_stats *out);
+
+/* Free every cached program image */
+void tcc_cache_purge(void);
+
+/* tcc_new()/tcc_delete() with everything the state allocates through
+   malloc held in a shim arena, which tcc_arena_delete() releases in
+   bulk. Use instead of the plain pair. */
+struct TCCState;
+struct TCCState *tcc_arena_new(void);
+void tcc_arena_delete(struct TCCState *s);
 
-/* Compile and run C source in memory. Returns result. */
-struct tcc_result tcc_run_source(const char *source, const char *filename);
+/* Fill out's counters and preprocess/compile split from a state that
+   spent compile_ticks in tcc_add_file() or tcc_compile_string() */
+void tcc_phase_collect(struct TCCState *s, UINT64 compile_ticks,
+                       struct tcc_phase_stats *out);
 
 #endif /* TCC_WRAPPER_H */
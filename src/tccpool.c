@@ -0,0 +1,718 @@
+/*
+ * tccpool.c — Object compiles on the application processors
+ *
+ * A worker is a stack block of TCCPOOL_STACK bytes with its context at
+ * the bottom, launched with mp_launch() and moved onto that stack, so
+ * the wrappers below find their worker from the stack pointer as
+ * aprun.c finds its run. Workers take the next job with an atomic add
+ * on a shared index until none is left.
+ *
+ * The loaded compiler's undefined symbols are bound by pool_resolve():
+ * string, number and sorting functions that touch no shared state go
+ * straight to the shim; malloc and friends to the worker's own heap;
+ * file, clock and console calls to wrappers that post them in the
+ * worker's mailbox (idle -> posted by the worker, posted -> done by the
+ * boot processor, done -> idle by the worker, a full barrier at each
+ * handover) and wait. errno is a variable of each loaded copy.
+ *
+ * The heap hands out power-of-two blocks with a 16-byte header from a
+ * free list per size, or from the untouched end; the block at the end
+ * grows in place. A compile that runs it dry fails inside TinyCC with
+ * "memory full" and goes back to the caller as TCCPOOL_PENDING. A call
+ * to exit() unwinds the worker, which takes no more jobs, and its
+ * compiler is loaded afresh next time.
+ */
+
+#include "boot.h"
+#include "mem.h"
+#include "shim.h"
+#include "timer.h"
+#include "mp.h"
+#include "aprun.h"
+#include "tcc.h"
+#include "libtcc.h"
+#include "tccpool.h"
+
+/* Mailbox states */
+#define CALL_IDLE   0
+#define CALL_POSTED 1
+#define CALL_DONE   2
+
+#define POOL_ARGS    4
+#define POOL_CLASSES 32
+#define POOL_HDR     16
+#define POOL_MIN_CLS 5          /* 32-byte blocks */
+#define POOL_LINE    512        /* one printf() worth */
+
+/* A loaded copy of the compiler: the entry points F6 uses */
+struct pool_tcc {
+    UINT8 *image;
+    unsigned long size;
+    UINT64 key;
+    int broken;                 /* unwound by exit(): load again */
+    int err;                    /* its errno */
+    TCCState *(*new_)(void);
+    void (*delete_)(TCCState *s);
+    void (*set_error_func)(TCCState *s, void *opaque, TCCErrorFunc *fn);
+    int (*set_options)(TCCState *s, const char *str);
+    int (*set_output_type)(TCCState *s, int type);
+    int (*add_include_path)(TCCState *s, const char *path);
+    int (*add_file)(TCCState *s, const char *path);
+    int (*output_file)(TCCState *s, const char *path);
+    void (*get_stats)(TCCState *s, TCCStats *st);
+};
+
+struct pool_heap {
+    UINT8 *base, *top, *end;
+    void *free[POOL_CLASSES];
+    int oom;                    /* an allocation failed since reset */
+};
+
+struct pool_worker {
+    struct mp_job job;
+    int worker;                 /* mp_launch() handle */
+    struct pool_tcc *tcc;
+    struct pool_heap heap;
+    struct tccpool_job *cur;    /* the job it is in */
+    struct tm tm;               /* localtime() result */
+    struct {
+        const void *fn;
+        UINTN args[POOL_ARGS];
+        UINTN ret;
+        int err;
+        volatile UINT32 state;
+    } call;
+    jmp_buf jmp;                /* the worker's start, on its stack */
+};
+
+static struct pool_tcc s_tcc[TCCPOOL_WORKERS];
+static struct pool_worker *s_workers[TCCPOOL_WORKERS];
+static struct tccpool_job *s_jobs;
+static int s_count;
+static volatile UINT32 s_next;  /* next job to take */
+static const char *const *s_includes;
+
+/* ---- Worker's core ---- */
+
+static struct pool_worker *pool_self(void) {
+    UINT8 here = 0;
+    for (int i = 0; i < TCCPOOL_WORKERS; i++) {
+        struct pool_worker *w = s_workers[i];
+        if (w && (UINTN)&here - (UINTN)w < TCCPOOL_STACK)
+            return w;
+    }
+    return NULL;
+}
+
+/* Have the boot processor call fn with n arguments; its errno becomes
+   the compiler's */
+static UINTN pool_forward(const void *fn, int n, ...) {
+    struct pool_worker *w = pool_self();
+    if (!w) return 0;
+    va_list ap;
+    va_start(ap, n);
+    for (int i = 0; i < POOL_ARGS; i++)
+        w->call.args[i] = i < n ? va_arg(ap, UINTN) : 0;
+    va_end(ap);
+    w->call.fn = fn;
+    mp_fence();
+    w->call.state = CALL_POSTED;
+    while (w->call.state != CALL_DONE)
+        mp_relax();
+    mp_fence();
+    UINTN ret = w->call.ret;
+    w->tcc->err = w->call.err;
+    w->call.state = CALL_IDLE;
+    return ret;
+}
+
+/* Heap */
+
+static void heap_reset(struct pool_heap *h) {
+    h->top = h->base;
+    h->oom = 0;
+    mem_set(h->free, 0, sizeof(h->free));
+}
+
+static int heap_class(size_t n) {
+    int c = POOL_MIN_CLS;
+    while (c < POOL_CLASSES - 1 && ((UINTN)1 << c) < n + POOL_HDR) c++;
+    return c;
+}
+
+static void *w_malloc(size_t n) {
+    struct pool_worker *w = pool_self();
+    if (!w) return NULL;
+    struct pool_heap *h = &w->heap;
+    int c = heap_class(n);
+    UINT8 *b = (UINT8 *)h->free[c];
+    if (b) {
+        h->free[c] = *(void **)(b + POOL_HDR);
+    } else if ((UINTN)(h->end - h->top) >= ((UINTN)1 << c)) {
+        b = h->top;
+        h->top += (UINTN)1 << c;
+    } else {
+        h->oom = 1;
+        return NULL;
+    }
+    *(UINT64 *)b = (UINT64)c;
+    return b + POOL_HDR;
+}
+
+static void w_free(void *p) {
+    struct pool_worker *w = pool_self();
+    if (!w || !p) return;
+    UINT8 *b = (UINT8 *)p - POOL_HDR;
+    int c = (int)*(UINT64 *)b;
+    *(void **)p = w->heap.free[c];
+    w->heap.free[c] = b;
+}
+
+static void *w_realloc(void *p, size_t n) {
+    if (!p) return w_malloc(n);
+    if (n == 0) {
+        w_free(p);
+        return NULL;
+    }
+    struct pool_worker *w = pool_self();
+    if (!w) return NULL;
+    struct pool_heap *h = &w->heap;
+    UINT8 *b = (UINT8 *)p - POOL_HDR;
+    int c = (int)*(UINT64 *)b, nc = heap_class(n);
+    if (nc <= c) return p;
+    /* The last block handed out grows where it is */
+    if (b + ((UINTN)1 << c) == h->top &&
+        (UINTN)(h->end - b) >= ((UINTN)1 << nc)) {
+        h->top = b + ((UINTN)1 << nc);
+        *(UINT64 *)b = (UINT64)nc;
+        return p;
+    }
+    void *q = w_malloc(n);
+    if (!q) return NULL;
+    mem_copy(q, p, ((UINTN)1 << c) - POOL_HDR);
+    w_free(p);
+    return q;
+}
+
+/* Files, clock and console, on the boot processor */
+
+static UINTN bsp_open(UINTN path, UINTN flags, UINTN mode) {
+    return (UINTN)(INTN)open((const char *)path, (int)flags, (int)mode);
+}
+static UINTN bsp_read(UINTN fd, UINTN buf, UINTN n) {
+    return (UINTN)read((int)fd, (void *)buf, (size_t)n);
+}
+static UINTN bsp_lseek(UINTN fd, UINTN off, UINTN whence) {
+    return (UINTN)lseek((int)fd, (off_t)off, (int)whence);
+}
+static UINTN bsp_close(UINTN fd) {
+    return (UINTN)(INTN)close((int)fd);
+}
+static UINTN bsp_unlink(UINTN path) {
+    return (UINTN)(INTN)unlink((const char *)path);
+}
+static UINTN bsp_fopen(UINTN path, UINTN mode) {
+    return (UINTN)fopen((const char *)path, (const char *)mode);
+}
+static UINTN bsp_fdopen(UINTN fd, UINTN mode) {
+    return (UINTN)fdopen((int)fd, (const char *)mode);
+}
+static UINTN bsp_freopen(UINTN path, UINTN mode, UINTN f) {
+    return (UINTN)freopen((const char *)path, (const char *)mode, (FILE *)f);
+}
+static UINTN bsp_fclose(UINTN f) {
+    return (UINTN)(INTN)fclose((FILE *)f);
+}
+static UINTN bsp_fflush(UINTN f) {
+    return (UINTN)(INTN)fflush((FILE *)f);
+}
+static UINTN bsp_fwrite(UINTN p, UINTN size, UINTN n, UINTN f) {
+    return (UINTN)fwrite((const void *)p, (size_t)size, (size_t)n, (FILE *)f);
+}
+static UINTN bsp_fseek(UINTN f, UINTN off, UINTN whence) {
+    return (UINTN)(INTN)fseek((FILE *)f, (long)off, (int)whence);
+}
+static UINTN bsp_time(void) {
+    return (UINTN)time(NULL);
+}
+static UINTN bsp_localtime(UINTN t, UINTN out) {
+    struct tm *tm = localtime((const time_t *)t);
+    if (!tm) return 0;
+    mem_copy((void *)out, tm, sizeof(*tm));
+    return out;
+}
+static UINTN bsp_alloc_code(UINTN size) {
+    return (UINTN)mem_alloc_code(size);
+}
+static UINTN bsp_free_code(UINTN p, UINTN size) {
+    mem_free_code((void *)p, size);
+    return 0;
+}
+
+#define FWD(fn, ...) pool_forward((const void *)(UINTN)(fn), __VA_ARGS__)
+
+static int w_open(const char *path, int flags, ...) {
+    int mode = 0;
+    if (flags & O_CREAT) {
+        va_list ap;
+        va_start(ap, flags);
+        mode = va_arg(ap, int);
+        va_end(ap);
+    }
+    return (int)(INTN)FWD(bsp_open, 3, path, (UINTN)flags, (UINTN)mode);
+}
+static ssize_t w_read(int fd, void *buf, size_t n) {
+    return (ssize_t)FWD(bsp_read, 3, (UINTN)fd, buf, (UINTN)n);
+}
+static off_t w_lseek(int fd, off_t off, int whence) {
+    return (off_t)FWD(bsp_lseek, 3, (UINTN)fd, (UINTN)off, (UINTN)whence);
+}
+static int w_close(int fd) {
+    return (int)(INTN)FWD(bsp_close, 1, (UINTN)fd);
+}
+static int w_unlink(const char *path) {
+    return (int)(INTN)FWD(bsp_unlink, 1, path);
+}
+static FILE *w_fopen(const char *path, const char *mode) {
+    return (FILE *)FWD(bsp_fopen, 2, path, mode);
+}
+static FILE *w_fdopen(int fd, const char *mode) {
+    return (FILE *)FWD(bsp_fdopen, 2, (UINTN)fd, mode);
+}
+static FILE *w_freopen(const char *path, const char *mode, FILE *f) {
+    return (FILE *)FWD(bsp_freopen, 3, path, mode, f);
+}
+static int w_fclose(FILE *f) {
+    return (int)(INTN)FWD(bsp_fclose, 1, f);
+}
+static int w_fflush(FILE *f) {
+    return (int)(INTN)FWD(bsp_fflush, 1, f);
+}
+static size_t w_fwrite(const void *p, size_t size, size_t n, FILE *f) {
+    return (size_t)FWD(bsp_fwrite, 4, p, (UINTN)size, (UINTN)n, f);
+}
+static int w_fseek(FILE *f, long off, int whence) {
+    return (int)(INTN)FWD(bsp_fseek, 3, f, (UINTN)off, (UINTN)whence);
+}
+static int w_fputc(int c, FILE *f) {
+    unsigned char b = (unsigned char)c;
+    return w_fwrite(&b, 1, 1, f) == 1 ? b : EOF;
+}
+static int w_fputs(const char *s, FILE *f) {
+    size_t n = strlen(s);
+    return w_fwrite(s, 1, n, f) == n ? 0 : EOF;
+}
+static int w_vfprintf(FILE *f, const char *fmt, va_list ap) {
+    char line[POOL_LINE];
+    int n = vsnprintf(line, sizeof(line), fmt, ap);
+    if (n > 0)
+        w_fwrite(line, 1, n < (int)sizeof(line) ? (size_t)n : sizeof(line) - 1, f);
+    return n;
+}
+static int w_fprintf(FILE *f, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = w_vfprintf(f, fmt, ap);
+    va_end(ap);
+    return n;
+}
+static int w_printf(const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    int n = w_vfprintf(stdout, fmt, ap);
+    va_end(ap);
+    return n;
+}
+static time_t w_time(time_t *t) {
+    time_t now = (time_t)FWD(bsp_time, 0);
+    if (t) *t = now;
+    return now;
+}
+static struct tm *w_localtime(const time_t *t) {
+    struct pool_worker *w = pool_self();
+    if (!w) return NULL;
+    return (struct tm *)FWD(bsp_localtime, 2, t, &w->tm);
+}
+static void *w_alloc_code(UINTN size) {
+    return (void *)FWD(bsp_alloc_code, 1, size);
+}
+static void w_free_code(void *p, UINTN size) {
+    FWD(bsp_free_code, 2, p, size);
+}
+
+/* As the shim's, with the copy on the worker's heap */
+static char *w_realpath(const char *path, char *resolved) {
+    if (!path) return NULL;
+    if (!resolved) resolved = (char *)w_malloc(strlen(path) + 1);
+    if (resolved) strcpy(resolved, path);
+    return resolved;
+}
+
+static void w_exit(int status) {
+    (void)status;
+    struct pool_worker *w = pool_self();
+    if (w) longjmp(w->jmp, 1);
+    for (;;) { }
+}
+
+/* The compiler's error callback: one line per message into the job */
+static void pool_error(void *opaque, const char *msg) {
+    struct tccpool_job *job = (struct tccpool_job *)opaque;
+    UINTN len = strlen(job->errors), room = sizeof(job->errors) - len;
+    if (room < 2) return;
+    UINTN n = strlen(msg);
+    if (n > room - 2) n = room - 2;
+    mem_copy(job->errors + len, msg, n);
+    job->errors[len + n] = '\n';
+    job->errors[len + n + 1] = '\0';
+}
+
+/* One unit, as rebuild_compile() does it on the boot processor */
+static UINT32 pool_run(struct pool_worker *w, struct tccpool_job *job) {
+    const struct pool_tcc *t = w->tcc;
+    job->errors[0] = '\0';
+    mem_set(&job->stats, 0, sizeof(job->stats));
+    TCCState *s = t->new_();
+    if (!s) {
+        w->heap.oom = 0;
+        return TCCPOOL_PENDING;
+    }
+    t->set_error_func(s, job, pool_error);
+    t->set_options(s, job->flags);
+    t->set_output_type(s, TCC_OUTPUT_OBJ);
+    for (int k = 0; s_includes && s_includes[k]; k++)
+        t->add_include_path(s, s_includes[k]);
+
+    UINT64 t0 = timer_ticks();
+    int rc = t->add_file(s, job->src);
+    if (rc >= 0) {
+        /* As tcc_phase_collect() */
+        UINT64 ticks = timer_ticks() - t0;
+        TCCStats st;
+        t->get_stats(s, &st);
+        job->stats.preprocess = st.pp_ticks < ticks ? st.pp_ticks : ticks;
+        job->stats.compile = ticks - job->stats.preprocess;
+        job->stats.lines = st.lines;
+        job->stats.tokens = st.tokens;
+        job->stats.code_bytes = st.text_bytes;
+        t0 = timer_ticks();
+        rc = t->output_file(s, job->obj);
+        job->stats.output = timer_ticks() - t0;
+    }
+    t->delete_(s);
+
+    if (w->heap.oom) {
+        w->heap.oom = 0;
+        return TCCPOOL_PENDING;
+    }
+    return rc >= 0 ? TCCPOOL_DONE : TCCPOOL_FAILED;
+}
+
+/* On the worker's own stack */
+static void pool_body(void *arg) {
+    struct pool_worker *w = (struct pool_worker *)arg;
+    if (setjmp(w->jmp) != 0) {
+        /* exit(): the compiler's globals are past trusting */
+        w->tcc->broken = 1;
+        if (w->cur) {
+            mp_fence();
+            w->cur->state = TCCPOOL_PENDING;
+        }
+        return;
+    }
+    for (;;) {
+        UINT32 i = mp_add32(&s_next, 1);
+        if (i >= (UINT32)s_count) break;
+        struct tccpool_job *job = &s_jobs[i];
+        w->cur = job;
+        job->state = TCCPOOL_RUNNING;
+        mp_fence();
+        UINT32 st = pool_run(w, job);
+        mp_fence();
+        job->state = st;
+        w->cur = NULL;
+    }
+}
+
+static void pool_entry(void *arg, void *arena) {
+    (void)arena;
+    UINTN top = ((UINTN)arg + TCCPOOL_STACK) & ~(UINTN)15;
+    aprun_switch_stack((void *)top, pool_body, arg);
+}
+
+/* ---- Boot processor ---- */
+
+extern unsigned long long __fixunsdfdi(double a);
+extern double __floatundidf(unsigned long long a);
+extern void __clear_cache(void *beg, void *end);
+
+struct pool_sym {
+    const char *name;
+    const void *addr;
+};
+
+#define SYM(fn)      { #fn, (const void *)(UINTN)(fn) }
+#define WRAP(fn)     { #fn, (const void *)(UINTN)(w_##fn) }
+
+static const struct pool_sym s_syms[] = {
+    /* No shared state: the shim's own */
+    SYM(__fixunsdfdi),
+    SYM(__floatundidf),
+    SYM(__clear_cache),
+    SYM(atoi),
+    SYM(getcwd),
+    SYM(getenv),
+    SYM(ldexp),
+    SYM(setjmp),
+    SYM(longjmp),
+    SYM(memcmp),
+    SYM(memcpy),
+    SYM(memmove),
+    SYM(memset),
+    SYM(mprotect),
+    SYM(qsort),
+    SYM(snprintf),
+    SYM(sprintf),
+    SYM(vsnprintf),
+    SYM(strcasecmp),
+    SYM(strcat),
+    SYM(strchr),
+    SYM(strcmp),
+    SYM(strcpy),
+    SYM(strerror),
+    SYM(strlen),
+    SYM(strncmp),
+    SYM(strrchr),
+    SYM(strtod),
+    SYM(strtof),
+    SYM(strtol),
+    SYM(strtoll),
+    SYM(strtoul),
+    SYM(strtoull),
+    SYM(sysconf),
+    SYM(timer_ticks),
+    { "environ", &environ },
+    { "stdin", &stdin },
+    { "stdout", &stdout },
+    { "stderr", &stderr },
+
+    /* The worker's heap */
+    WRAP(malloc),
+    WRAP(realloc),
+    WRAP(free),
+
+    /* Handed to the boot processor, or kept on the worker */
+    WRAP(open),
+    WRAP(read),
+    WRAP(lseek),
+    WRAP(close),
+    WRAP(unlink),
+    WRAP(fopen),
+    WRAP(fdopen),
+    WRAP(freopen),
+    WRAP(fclose),
+    WRAP(fflush),
+    WRAP(fwrite),
+    WRAP(fseek),
+    WRAP(fputc),
+    WRAP(fputs),
+    WRAP(fprintf),
+    WRAP(vfprintf),
+    WRAP(printf),
+    WRAP(time),
+    WRAP(localtime),
+    WRAP(realpath),
+    WRAP(exit),
+    { "mem_alloc_code", (const void *)(UINTN)w_alloc_code },
+    { "mem_free_code", (const void *)(UINTN)w_free_code },
+};
+
+#undef SYM
+#undef WRAP
+
+#define SYM_COUNT (sizeof(s_syms) / sizeof(s_syms[0]))
+
+static const void *pool_resolve(void *opaque, const char *name) {
+    struct pool_tcc *t = (struct pool_tcc *)opaque;
+    if (strcmp(name, "errno") == 0)
+        return &t->err;
+    for (UINTN i = 0; i < SYM_COUNT; i++)
+        if (strcmp(s_syms[i].name, name) == 0)
+            return s_syms[i].addr;
+    return NULL;
+}
+
+static void pool_quiet(void *opaque, const char *msg) {
+    (void)opaque;
+    (void)msg;
+}
+
+static void pool_unload(struct pool_tcc *t) {
+    if (t->image) mem_free_code(t->image, t->size);
+    mem_set(t, 0, sizeof(*t));
+}
+
+/* Link a private copy of the compiler from libtcc, unless t holds one
+   from it already. Returns 0 when t can compile. */
+static int pool_load(struct pool_tcc *t, const char *libtcc, UINT64 key) {
+    if (t->image && t->key == key && !t->broken) return 0;
+    pool_unload(t);
+
+    TCCState *s = tcc_arena_new();
+    if (!s) return -1;
+    tcc_set_error_func(s, NULL, pool_quiet);
+    tcc_set_options(s, "-nostdlib");
+    tcc_set_output_type(s, TCC_OUTPUT_MEMORY);
+    tcc_set_resolver(s, t, pool_resolve);
+    int ok = tcc_add_file(s, libtcc) >= 0 && tcc_relocate(s) >= 0;
+    if (ok) {
+        t->new_ = (TCCState *(*)(void))tcc_get_symbol(s, "tcc_new");
+        t->delete_ = (void (*)(TCCState *))tcc_get_symbol(s, "tcc_delete");
+        t->set_error_func = (void (*)(TCCState *, void *, TCCErrorFunc *))
+            tcc_get_symbol(s, "tcc_set_error_func");
+        t->set_options = (int (*)(TCCState *, const char *))
+            tcc_get_symbol(s, "tcc_set_options");
+        t->set_output_type = (int (*)(TCCState *, int))
+            tcc_get_symbol(s, "tcc_set_output_type");
+        t->add_include_path = (int (*)(TCCState *, const char *))
+            tcc_get_symbol(s, "tcc_add_include_path");
+        t->add_file = (int (*)(TCCState *, const char *))
+            tcc_get_symbol(s, "tcc_add_file");
+        t->output_file = (int (*)(TCCState *, const char *))
+            tcc_get_symbol(s, "tcc_output_file");
+        t->get_stats = (void (*)(TCCState *, TCCStats *))
+            tcc_get_symbol(s, "tcc_get_stats");
+        ok = t->new_ && t->delete_ && t->set_error_func && t->set_options &&
+             t->set_output_type && t->add_include_path && t->add_file &&
+             t->output_file && t->get_stats;
+    }
+    if (ok) {
+        t->image = (UINT8 *)tcc_take_image(s, &t->size);
+        ok = t->image != NULL;
+    }
+    tcc_arena_delete(s);
+    if (!ok) {
+        pool_unload(t);
+        return -1;
+    }
+    t->key = key;
+    return 0;
+}
+
+/* Make the call a worker posted */
+typedef UINTN (*call_fn)(UINTN, UINTN, UINTN, UINTN);
+
+static void pool_serve(struct pool_worker *w) {
+    mp_fence();
+    const UINTN *a = w->call.args;
+    errno = 0;
+    w->call.ret = ((call_fn)(UINTN)w->call.fn)(a[0], a[1], a[2], a[3]);
+    w->call.err = errno;
+    mp_fence();
+    w->call.state = CALL_DONE;
+}
+
+static void pool_report(tccpool_progress_fn progress, void *ctx) {
+    for (int i = 0; i < s_count; i++) {
+        struct tccpool_job *job = &s_jobs[i];
+        UINT32 st = job->state;
+        if (st == job->reported) continue;
+        mp_fence();
+        /* A start missed between polls is still shown */
+        if (job->reported == TCCPOOL_PENDING) {
+            job->reported = TCCPOOL_RUNNING;
+            if (progress) progress(job, ctx);
+        }
+        if (st == TCCPOOL_DONE || st == TCCPOOL_FAILED) {
+            job->reported = st;
+            if (progress) progress(job, ctx);
+        }
+    }
+}
+
+static void pool_free(struct pool_worker *w) {
+    if (w->heap.base) mem_free(w->heap.base);
+    mem_free(w);
+}
+
+int tccpool_compile(const char *libtcc, UINT64 key,
+                    struct tccpool_job *jobs, int count,
+                    const char *const *includes,
+                    tccpool_progress_fn progress, void *ctx) {
+    if (count < 2 || mp_on_worker() || aprun_on_ap()) return 0;
+    int n = count < TCCPOOL_WORKERS ? count : TCCPOOL_WORKERS;
+
+    for (int i = 0; i < count; i++) {
+        jobs[i].state = jobs[i].reported = TCCPOOL_PENDING;
+        jobs[i].errors[0] = '\0';
+    }
+    s_jobs = jobs;
+    s_count = count;
+    s_next = 0;
+    s_includes = includes;
+
+    /* Workers with a compiler, a stack and a heap each; one alone would
+       only move the compiles off this core, no faster */
+    struct pool_worker *ready[TCCPOOL_WORKERS];
+    int nready = 0;
+    while (nready < n && pool_load(&s_tcc[nready], libtcc, key) == 0) {
+        struct pool_worker *w = (struct pool_worker *)mem_alloc(TCCPOOL_STACK);
+        if (!w) break;
+        mem_set(w, 0, sizeof(*w));
+        w->heap.base = (UINT8 *)mem_alloc_raw(TCCPOOL_HEAP);
+        if (!w->heap.base) {
+            mem_free(w);
+            break;
+        }
+        w->heap.end = w->heap.base + TCCPOOL_HEAP;
+        heap_reset(&w->heap);
+        w->tcc = &s_tcc[nready];
+        w->call.state = CALL_IDLE;
+        ready[nready++] = w;
+    }
+
+    /* And a core each */
+    int launched = 0;
+    for (int i = 0; i < nready; i++) {
+        struct pool_worker *w = ready[i];
+        if (nready >= 2 && launched == i) {
+            s_workers[i] = w;
+            mp_fence();
+            w->worker = mp_launch(&w->job, pool_entry, w, 0);
+            if (w->worker >= 0) {
+                launched++;
+                continue;
+            }
+            s_workers[i] = NULL;
+        }
+        pool_free(w);
+    }
+
+    for (;;) {
+        int busy = 0;
+        for (int i = 0; i < launched; i++) {
+            struct pool_worker *w = s_workers[i];
+            if (w->call.state == CALL_POSTED)
+                pool_serve(w);
+            if (mp_launch_busy(w->worker))
+                busy = 1;
+        }
+        pool_report(progress, ctx);
+        if (!busy) break;
+        mp_relax();
+    }
+    mp_fence();
+
+    for (int i = 0; i < launched; i++) {
+        mp_launch_release(s_workers[i]->worker);
+        pool_free(s_workers[i]);
+        s_workers[i] = NULL;
+    }
+    /* Jobs a worker left mid-way are the caller's again */
+    for (int i = 0; i < count; i++)
+        if (jobs[i].state == TCCPOOL_RUNNING)
+            jobs[i].state = TCCPOOL_PENDING;
+    s_jobs = NULL;
+    s_count = 0;
+    return launched;
+}
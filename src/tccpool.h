@@ -0,0 +1,65 @@
+/*
+ * tccpool.h — Object compiles on the application processors
+ *
+ * TinyCC keeps its preprocessor and code generator state in globals,
+ * so one copy of it compiles one unit at a time. F6 runs its
+ * independent per-unit compiles on the other cores instead, each with
+ * a private copy of the compiler: the boot processor loads the
+ * prebuilt libtcc.o once per worker with its own TinyCC (an in-memory
+ * link, as F5 links a program), so every copy has globals of its own.
+ * Each is bound to a heap of TCCPOOL_HEAP bytes that only its worker
+ * uses, and its file access, clock and console output are handed to
+ * the boot processor one call at a time, as aprun.h does for a user
+ * program. The boot processor serves those calls until the last
+ * worker is done, then links on its own as before.
+ *
+ * Whatever the pool could not finish (a worker that ran out of heap,
+ * a unit no worker reached, no MP services at all) is left
+ * TCCPOOL_PENDING for the caller to compile itself, so a build gets
+ * the same objects either way.
+ */
+#ifndef TCCPOOL_H
+#define TCCPOOL_H
+
+#include "boot.h"
+#include "tcc.h"
+
+#define TCCPOOL_WORKERS 8
+#define TCCPOOL_STACK   (1024 * 1024)           /* per worker */
+#define TCCPOOL_HEAP    (64 * 1024 * 1024)      /* per worker */
+#define TCCPOOL_ERRORS  1024                    /* message bytes per job */
+
+/* Job states */
+#define TCCPOOL_PENDING 0   /* not compiled here: the caller's to do */
+#define TCCPOOL_RUNNING 1
+#define TCCPOOL_DONE    2   /* tcc_output_file() succeeded */
+#define TCCPOOL_FAILED  3   /* compile errors, in errors */
+
+/* One unit: src compiled with flags to the object obj */
+struct tccpool_job {
+    const char *src;
+    const char *flags;
+    const char *obj;
+    int tag;                        /* the caller's */
+    struct tcc_phase_stats stats;
+    volatile UINT32 state;          /* TCCPOOL_* */
+    UINT32 reported;                /* boot processor: state last shown */
+    char errors[TCCPOOL_ERRORS];    /* one message per line */
+};
+
+/* Called on the boot processor when a job starts (job->reported is
+   TCCPOOL_RUNNING) and when it ends (TCCPOOL_DONE or TCCPOOL_FAILED) */
+typedef void (*tccpool_progress_fn)(struct tccpool_job *job, void *ctx);
+
+/* Compile the count jobs on up to TCCPOOL_WORKERS workers, each with
+   the compiler in the object libtcc and the NULL-terminated include
+   paths. key identifies that object's contents: compilers loaded from
+   it stay loaded for later calls with the same key. Returns the number
+   of workers that ran: 0, with every job left TCCPOOL_PENDING, when
+   fewer than two could be set up. */
+int tccpool_compile(const char *libtcc, UINT64 key,
+                    struct tccpool_job *jobs, int count,
+                    const char *const *includes,
+                    tccpool_progress_fn progress, void *ctx);
+
+#endif /* TCCPOOL_H */
@@ -0,0 +1,119 @@
+/*
+ * timer.c — Cycle counter for phase timing and benchmarks
+ *
+ * TCC's ARM64 assembler is a stub, so the AArch64 readers are raw
+ * machine code in .text (see setjmp_aarch64.c), called through a cast;
+ * x86_64 uses inline rdtsc.  UEFI gives no TSC frequency, so it is
+ * measured once against the boot services Stall().
+ */
+
+#include "timer.h"
+
+#ifdef __aarch64__
+__attribute__((section(".text")))
+static unsigned int s_read_cntvct[] = {
+    0xd5033fdf, /* isb                      */
+    0xd53be040, /* mrs x0, CNTVCT_EL0       */
+    0xd65f03c0, /* ret                      */
+};
+
+__attribute__((section(".text")))
+static unsigned int s_read_cntfrq[] = {
+    0xd53be000, /* mrs x0, CNTFRQ_EL0       */
+    0xd65f03c0, /* ret                      */
+};
+#endif
+
+static UINT64 s_hz;
+
+UINT64 timer_ticks(void)
+{
+#ifdef __aarch64__
+    return ((UINT64 (*)(void))(UINTN)s_read_cntvct)();
+#else
+    UINT32 lo, hi;
+    __asm__ __volatile__("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((UINT64)hi << 32) | lo;
+#endif
+}
+
+UINT64 timer_hz(void)
+{
+    if (s_hz)
+        return s_hz;
+#ifdef __aarch64__
+    s_hz = ((UINT64 (*)(void))(UINTN)s_read_cntfrq)();
+#else
+    UINT64 t0 = timer_ticks();
+    g_boot.bs->Stall(TIMER_CALIBRATE_US);
+    s_hz = (timer_ticks() - t0) * (1000000 / TIMER_CALIBRATE_US);
+#endif
+    if (!s_hz)
+        s_hz = 1000000;     /* no usable counter: report raw ticks as us */
+    return s_hz;
+}
+
+UINT64 timer_us(UINT64 ticks)
+{
+    UINT64 hz = timer_hz();
+    /* split to keep ticks * 1e6 from overflowing */
+    return ticks / hz * 1000000 + ticks % hz * 1000000 / hz;
+}
+
+UINT64 timer_ns(UINT64 ticks)
+{
+    UINT64 hz = timer_hz();
+    return ticks / hz * 1000000000ULL + ticks % hz * 1000000000ULL / hz;
+}
+
+/* ---- Benchmarking ---- */
+
+static UINT64 s_bench_base;
+
+UINT64 bench_start(void)
+{
+    timer_hz();             /* calibrate outside the measured span */
+    return timer_ticks();
+}
+
+UINT64 bench_stop(UINT64 start)
+{
+    return timer_ns(timer_ticks() - start);
+}
+
+UINT64 bench_ns(void)
+{
+    if (!s_bench_base) {
+        timer_hz();
+        s_bench_base = timer_ticks();
+    }
+    return timer_ns(timer_ticks() - s_bench_base);
+}
+
+/* ---- Boot phases ---- */
+
+static struct boot_phase s_phases[BOOT_PHASE_MAX];
+static int s_nphases;
+
+/* Exported, so the stub finds it in the image it lays out */
+__attribute__((dllexport)) UINT64 efistub_ticks[2];
+
+void boot_phase(const char *name)
+{
+    boot_phase_at(name, timer_ticks());
+}
+
+void boot_phase_at(const char *name, UINT64 ticks)
+{
+    if (s_nphases == BOOT_PHASE_MAX)
+        return;
+    s_phases[s_nphases].name = name;
+    s_phases[s_nphases].ticks = ticks;
+    s_nphases++;
+}
+
+int boot_phases(const struct boot_phase **out)
+{
+    *out = s_phases;
+    return s_nphases;
+}
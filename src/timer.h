@@ -0,0 +1,65 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include "boot.h"
+
+/* Free-running counter: the TSC on x86_64, CNTVCT_EL0 on AArch64.
+   Cheap enough to read around every compile phase. */
+UINT64 timer_ticks(void);
+
+/* Counter frequency in Hz. AArch64 reads CNTFRQ_EL0; the TSC rate is
+   measured once against Stall(), which takes TIMER_CALIBRATE_US. */
+UINT64 timer_hz(void);
+
+/* Ticks to microseconds */
+UINT64 timer_us(UINT64 ticks);
+
+/* Ticks to nanoseconds */
+UINT64 timer_ns(UINT64 ticks);
+
+/* ---- Benchmarking (exported to programs) ----
+ *
+ *     UINT64 t = bench_start();
+ *     work();
+ *     printf("%llu ns\n", bench_stop(t));
+ */
+
+/* Start a measurement; the value is an opaque counter reading */
+UINT64 bench_start(void);
+
+/* Nanoseconds since the bench_start() that returned start */
+UINT64 bench_stop(UINT64 start);
+
+/* Monotonic nanoseconds since the clock was first read */
+UINT64 bench_ns(void);
+
+#define TIMER_CALIBRATE_US 10000
+
+/* ---- Boot phases ----
+ *
+ * efi_main() marks the end of each startup phase with the raw counter,
+ * so marking costs nothing (no calibration) until the phases are shown.
+ * The first mark's reading counts from wherever the counter started,
+ * normally reset: firmware and image load.
+ */
+
+#define BOOT_PHASE_MAX 16
+
+struct boot_phase {
+    const char *name;
+    UINT64 ticks;               /* counter at the end of the phase */
+};
+
+/* End the phase called name, now or when the counter read ticks;
+   ignored once BOOT_PHASE_MAX are marked */
+void boot_phase(const char *name);
+void boot_phase_at(const char *name, UINT64 ticks);
+
+/* Set by efistub.c in an image it unpacked: the counter on entering
+   the stub and on leaving it for efi_main(); zero otherwise */
+extern UINT64 efistub_ticks[2];
+
+/* The phases so far, in order. Returns the count. */
+int boot_phases(const struct boot_phase **out);
+
+#endif /* TIMER_H */
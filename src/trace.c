@@ -0,0 +1,139 @@
+/*
+ * trace.c — Event marks on the serial console for scripted test runs
+ *
+ * Lines go through StdErr with OutputString, so they need the text
+ * output protocol only and work before and after the framebuffer is
+ * set up. Each stays within 80 columns, so the firmware's serial
+ * terminal never wraps one, and detail text is cut at the first
+ * control character to keep one event per line.
+ */
+
+#include "trace.h"
+#include "fs.h"
+#include "mem.h"
+#include "shim.h"
+#include "timer.h"
+
+#define TRACE_COLS 78           /* printed per line, before CR LF */
+
+static int s_on;
+static UINT64 s_t0;
+
+void trace_init(void) {
+    s_on = fs_exists(TRACE_FLAG);
+    if (s_on)
+        s_t0 = bench_ns();      /* calibrates the counter: only when asked */
+}
+
+int trace_enabled(void) {
+    return s_on;
+}
+
+void trace_mark(const char *event, UINT64 a, UINT64 b, const char *detail) {
+    if (!s_on) return;
+    SIMPLE_TEXT_OUTPUT_INTERFACE *out = g_boot.st->StdErr;
+    if (!out) return;
+
+    char line[TRACE_COLS + 1];
+    int n = snprintf(line, sizeof(line), "@@ %llu %s %llu %llu ",
+                     (unsigned long long)((bench_ns() - s_t0) / 1000000),
+                     event, (unsigned long long)a, (unsigned long long)b);
+    if (n < 0) return;
+    if (n > TRACE_COLS) n = TRACE_COLS;
+    for (int i = 0; detail && detail[i] && n < TRACE_COLS; i++) {
+        if ((unsigned char)detail[i] < 0x20) break;
+        line[n++] = detail[i];
+    }
+
+    CHAR16 w[TRACE_COLS + 3];
+    int i = 0;
+    for (; i < n; i++)
+        w[i] = (CHAR16)(unsigned char)line[i];
+    w[i++] = L'\r';
+    w[i++] = L'\n';
+    w[i] = 0;
+    out->OutputString(out, w);
+}
+
+/* ---- Event ring ----
+ * The ring sits behind its file header in one page allocation, so the
+ * dump is a single write with no copy. Records are stored at head modulo
+ * TRACE_RING_RECS; the header carries head so the reader can tell where
+ * the oldest one is once the ring has wrapped. */
+
+#ifdef TRACE_RING
+
+#define TRACE_RING_MAGIC    "SVTRACE"
+#define TRACE_RING_VERSION  1
+#define TRACE_NAME_LEN      16
+
+struct trace_ring_hdr {
+    char magic[8];
+    UINT32 version;
+    UINT32 rec_size;
+    UINT64 hz;          /* timer_ticks() per second */
+    UINT64 head;        /* records ever written */
+    UINT32 cap;         /* records the ring holds */
+    UINT32 nids;        /* names that follow, TRACE_NAME_LEN bytes each */
+};
+
+static const char *s_ring_names[TR_COUNT] = {
+    "bio-read", "bio-write", "disk-read", "disk-write",
+    "bcache-hit", "bcache-miss", "mft-hit", "mft-miss",
+    "alloc", "free", "present",
+    "tcc-compile", "tcc-relocate", "tcc-run",
+};
+
+#define TRACE_RING_PREFIX \
+    (sizeof(struct trace_ring_hdr) + TR_COUNT * TRACE_NAME_LEN)
+#define TRACE_RING_BYTES \
+    (TRACE_RING_PREFIX + TRACE_RING_RECS * sizeof(struct trace_rec))
+
+static UINT8 *s_ring_mem;
+static struct trace_rec *s_ring;
+static UINT64 s_head;
+
+void trace_ring_init(void) {
+    if (s_ring_mem) return;
+    s_ring_mem = (UINT8 *)mem_alloc_pages(TRACE_RING_BYTES);
+    if (!s_ring_mem) return;
+    s_ring = (struct trace_rec *)(s_ring_mem + TRACE_RING_PREFIX);
+}
+
+void trace_ring_put(UINT32 id, UINT32 phase, UINT64 a, UINT64 b) {
+    if (!s_ring) return;
+    struct trace_rec *r = &s_ring[s_head & (TRACE_RING_RECS - 1)];
+    r->ticks = timer_ticks();
+    r->id = id;
+    r->phase = phase;
+    r->a = a;
+    r->b = b;
+    s_head++;
+}
+
+int trace_ring_dump(void) {
+    if (!s_ring || s_head == 0) return -1;
+
+    struct trace_ring_hdr *h = (struct trace_ring_hdr *)s_ring_mem;
+    mem_copy(h->magic, TRACE_RING_MAGIC, sizeof(TRACE_RING_MAGIC));
+    h->version = TRACE_RING_VERSION;
+    h->rec_size = sizeof(struct trace_rec);
+    h->hz = timer_hz();
+    h->head = s_head;
+    h->cap = TRACE_RING_RECS;
+    h->nids = TR_COUNT;
+    char *names = (char *)(h + 1);
+    for (int i = 0; i < TR_COUNT; i++) {
+        char *n = names + i * TRACE_NAME_LEN;
+        int j = 0;
+        for (; s_ring_names[i][j] && j < TRACE_NAME_LEN - 1; j++)
+            n[j] = s_ring_names[i][j];
+        n[j] = 0;
+    }
+
+    UINT64 n = s_head < TRACE_RING_RECS ? s_head : TRACE_RING_RECS;
+    UINTN size = TRACE_RING_PREFIX + (UINTN)n * sizeof(struct trace_rec);
+    return EFI_ERROR(fs_writefile(TRACE_RING_FILE, s_ring_mem, size)) ? -1 : 0;
+}
+
+#endif
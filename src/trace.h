@@ -0,0 +1,105 @@
+/*
+ * trace.h — Event marks on the serial console for scripted test runs
+ *
+ * When TRACE_FLAG exists on the boot volume, each mark is written as
+ * one line to the firmware's standard error, which OVMF and AAVMF send
+ * to the serial port and not to the screen:
+ *
+ *     @@ <ms> <event> <a> <b> <detail>
+ *
+ * ms counts from the first mark. scripts/qemu-perf-test.py waits on
+ * these lines to know when to send the next keys and reads its timings
+ * from them. Without the flag every mark returns at once.
+ *
+ * Built with TRACE=1 (TRACE_RING defined), the hot paths also record
+ * fixed-size events into a ring in memory: a counter timestamp, an
+ * event id and two numbers, with no formatting and no I/O. The ring is
+ * written to TRACE_RING_FILE on the boot volume at shutdown and
+ * scripts/trace2chrome.py turns it into Chrome trace JSON. Without
+ * TRACE_RING the TRACE_* macros compile to nothing.
+ */
+#ifndef TRACE_H
+#define TRACE_H
+
+#include "boot.h"
+
+#define TRACE_FLAG       L"\\TRACE"
+#define TRACE_LIST_MAX   64     /* directory entries listed per mark */
+
+/* Look for TRACE_FLAG; call once the boot volume is up */
+void trace_init(void);
+
+int trace_enabled(void);
+
+/* One line: what happened, two numbers (their meaning is the event's)
+   and a short text, which may be NULL */
+void trace_mark(const char *event, UINT64 a, UINT64 b, const char *detail);
+
+/* ---- Event ring ----
+ * Only the boot processor records: the ring has one writer, so it needs
+ * no lock. The mp.c workers run jobs on their own arenas and never reach
+ * a trace point. Once full, the oldest records are overwritten. */
+
+#define TRACE_RING_FILE  L"\\TRACE.BIN"
+#define TRACE_RING_RECS  65536  /* records kept; a power of two */
+
+/* Keep this in step with s_ring_names in trace.c */
+enum trace_id {
+    TR_BIO_READ,        /* fs.c BlockIO callback: lba, blocks */
+    TR_BIO_WRITE,
+    TR_DISK_READ,       /* disk.c device transfer: lba, bytes */
+    TR_DISK_WRITE,
+    TR_BCACHE_HIT,      /* block cache (exFAT, NTFS): block, cache */
+    TR_BCACHE_MISS,
+    TR_MFT_HIT,         /* NTFS MFT record cache: record, 0 */
+    TR_MFT_MISS,
+    TR_ALLOC,           /* mem.c: size, pointer */
+    TR_FREE,            /* mem.c: pointer, 0 */
+    TR_PRESENT,         /* fb.c: dirty areas, 0 */
+    TR_TCC_COMPILE,     /* tcc.c phases: source bytes, 0 */
+    TR_TCC_RELOCATE,
+    TR_TCC_RUN,         /* exit code at the end */
+    TR_COUNT
+};
+
+enum trace_phase {
+    TRACE_PH_BEGIN,
+    TRACE_PH_END,
+    TRACE_PH_EVENT
+};
+
+/* One record; the dump holds these as they are in memory */
+struct trace_rec {
+    UINT64 ticks;       /* timer_ticks() */
+    UINT32 id;          /* enum trace_id */
+    UINT32 phase;       /* enum trace_phase */
+    UINT64 a, b;
+};
+
+#ifdef TRACE_RING
+
+/* Allocate the ring; call once memory is up. Records before it are lost. */
+void trace_ring_init(void);
+
+void trace_ring_put(UINT32 id, UINT32 phase, UINT64 a, UINT64 b);
+
+/* Write the ring to TRACE_RING_FILE on the current volume */
+int trace_ring_dump(void);
+
+#define TRACE_BEGIN(id, a, b) \
+    trace_ring_put((id), TRACE_PH_BEGIN, (UINT64)(a), (UINT64)(b))
+#define TRACE_END(id, a, b) \
+    trace_ring_put((id), TRACE_PH_END, (UINT64)(a), (UINT64)(b))
+#define TRACE_EVENT(id, a, b) \
+    trace_ring_put((id), TRACE_PH_EVENT, (UINT64)(a), (UINT64)(b))
+
+#else
+
+#define trace_ring_init()       ((void)0)
+#define TRACE_BEGIN(id, a, b)   ((void)0)
+#define TRACE_END(id, a, b)     ((void)0)
+#define TRACE_EVENT(id, a, b)   ((void)0)
+
+#endif
+
+#endif /* TRACE_H */
@@ -0,0 +1,323 @@
+/*
+ * undelete.c — Recover deleted files from an NTFS volume
+ *
+ * The list is one table of what the deleted-file scan reported, names
+ * in a pool beside it, filled a few milliseconds at a time between
+ * looks at the keyboard as search.c does. A file is recovered through
+ * a copy job: its record's runs are read with ntfs_read() and written
+ * with copy_open()/copy_write(), so the destination gets the room
+ * reserved up front and a file that fails part way is removed.
+ */
+
+#include "boot.h"
+#include "fb.h"
+#include "kbd.h"
+#include "mem.h"
+#include "fs.h"
+#include "ntfs.h"
+#include "copy.h"
+#include "timer.h"
+#include "progress.h"
+#include "undelete.h"
+#include "shim.h"
+
+#define UD_STEP_MS  30          /* scanning between looks at the keyboard */
+#define UD_DRAW_MS  100         /* redraws while scanning or recovering */
+#define UD_READ     (1024 * 1024)   /* bytes read from the file at a time */
+#define UD_PATH_MAX 512
+
+struct ud_ent {
+    UINT64 record;
+    UINT64 size;
+    UINT64 overwritten;
+    UINT32 name;                /* offset in the name pool */
+    UINT32 recovered;
+};
+
+struct ud_list {
+    struct ud_ent *ents;
+    UINT32 count, cap;
+    char  *pool;
+    UINT32 pool_len, pool_cap;
+    struct ntfs_mft_scan *scan; /* NULL once complete */
+    int    cursor, scroll;
+    const char *msg;            /* one-off status line */
+    char   msg_buf[128];
+    UINT64 t_draw;              /* last progress line while recovering */
+};
+
+static int list_add(struct ud_list *l, const struct ntfs_mft_name *nm) {
+    UINT32 nlen = (UINT32)str_len((const CHAR8 *)nm->entry.name) + 1;
+    if (mem_grow((void **)&l->ents, &l->cap, l->count + 1,
+                 sizeof(struct ud_ent), 256) != 0
+        || mem_grow((void **)&l->pool, &l->pool_cap, l->pool_len + nlen,
+                    1, 256) != 0)
+        return -1;
+    struct ud_ent *x = &l->ents[l->count++];
+    x->record = nm->record;
+    x->size = nm->entry.size;
+    x->overwritten = nm->overwritten;
+    x->name = l->pool_len;
+    x->recovered = 0;
+    mem_copy(l->pool + l->pool_len, nm->entry.name, nlen);
+    l->pool_len += nlen;
+    return 0;
+}
+
+/* Add files for about UD_STEP_MS */
+static void list_step(struct ud_list *l) {
+    UINT64 hz = timer_hz(), t0 = timer_ticks();
+    while (l->scan && timer_ticks() - t0 < hz / 1000 * UD_STEP_MS) {
+        struct ntfs_mft_name nm;
+        int r = ntfs_mft_scan_next(l->scan, &nm);
+        if (r <= 0) {
+            ntfs_mft_scan_close(l->scan);
+            l->scan = NULL;
+            return;
+        }
+        if (list_add(l, &nm) != 0) {
+            ntfs_mft_scan_close(l->scan);
+            l->scan = NULL;
+            l->msg = " Out of memory: the list holds part of the deleted files";
+            return;
+        }
+    }
+}
+
+/* ---- Screen ---- */
+
+static void draw_ent(struct ud_list *l, int idx, UINT32 row) {
+    const struct ud_ent *x = &l->ents[idx];
+    char line[256], size[24], state[32];
+    progress_size(x->size, size, sizeof(size));
+    if (x->recovered)
+        str_copy(state, "recovered", sizeof(state));
+    else if (x->overwritten == 0)
+        str_copy(state, "intact", sizeof(state));
+    else if (x->overwritten >= x->size)
+        str_copy(state, "overwritten", sizeof(state));
+    else
+        snprintf(state, sizeof(state), "%u%% overwritten",
+                 (UINT32)(x->overwritten * 100 / x->size));
+
+    /* Name on the left, size and state in columns at the right */
+    int room = (int)g_boot.cols - 36;
+    if (room > (int)sizeof(line) - 48) room = (int)sizeof(line) - 48;
+    if (room < 8) room = 8;
+    const char *name = l->pool + x->name;
+    int nlen = (int)str_len((CHAR8 *)name);
+    snprintf(line, sizeof(line), " %.*s%s", nlen > room ? room - 3 : nlen, name,
+             nlen > room ? "..." : "");
+    int n = (int)str_len((CHAR8 *)line);
+    int col = (int)g_boot.cols - 34;
+    while (n < col && n < (int)sizeof(line) - 48) line[n++] = ' ';
+    snprintf(line + n, sizeof(line) - n, "%10s  %s", size, state);
+
+    int sel = idx == l->cursor;
+    UINT32 fg = x->recovered ? COLOR_GREEN
+              : x->overwritten ? COLOR_GRAY : COLOR_WHITE;
+    fb_line(row, line, sel ? COLOR_BLACK : fg, sel ? COLOR_CYAN : COLOR_BLACK);
+}
+
+static void draw_view(struct ud_list *l) {
+    fb_line(0, " Undelete: deleted files on this NTFS volume", COLOR_CYAN, COLOR_DGRAY);
+
+    char line[256];
+    if (l->scan) {
+        UINT64 done, total;
+        ntfs_mft_scan_progress(l->scan, &done, &total);
+        snprintf(line, sizeof(line), " %u deleted files found; reading the $MFT, %u%%",
+                 l->count, total ? (UINT32)(done * 100 / total) : 0);
+    } else {
+        snprintf(line, sizeof(line), " %u deleted files found", l->count);
+    }
+    fb_line(1, line, l->scan ? COLOR_GRAY : COLOR_YELLOW, COLOR_BLACK);
+
+    UINT32 rows = g_boot.rows - 3;
+    for (UINT32 r = 0; r < rows; r++) {
+        int idx = l->scroll + (int)r;
+        if (idx < (int)l->count)
+            draw_ent(l, idx, 2 + r);
+        else
+            fb_line(2 + r, "", COLOR_WHITE, COLOR_BLACK);
+    }
+
+    fb_line(g_boot.rows - 1,
+            l->msg ? l->msg : " ENTER:Recover to \\RECOVERED on the boot volume  ESC:Back",
+            COLOR_GRAY, COLOR_DGRAY);
+    l->msg = NULL;
+    fb_present();
+}
+
+/* ---- Recovery ---- */
+
+static void recover_progress(struct copy_job *job, const CHAR16 *path,
+                             UINT64 done, UINT64 size) {
+    (void)path;
+    struct ud_list *l = (struct ud_list *)job->ctx;
+    UINT64 now = timer_ticks();
+    if (done != 0 && done != size && now - l->t_draw < timer_hz() / 1000 * UD_DRAW_MS)
+        return;
+    l->t_draw = now;
+    char line[96], a[24], b[24];
+    progress_size(done, a, sizeof(a));
+    progress_size(size, b, sizeof(b));
+    snprintf(line, sizeof(line), " Recovering: %s of %s", a, b);
+    fb_line(g_boot.rows - 1, line, COLOR_YELLOW, COLOR_DGRAY);
+    fb_present();
+}
+
+static int exists(struct fs_volume *v, const CHAR16 *path) {
+    UINT64 size;
+    struct fs_file *f = fs_volume_open_read(v, path, &size);
+    if (!f) return 0;
+    fs_stream_close(f);
+    return 1;
+}
+
+/* UNDELETE_DIR\name, or name_2, name_3 ... before the extension when
+   that is taken, into out and (in ASCII, to show) shown. Returns 0, or
+   -1 if all of them are. */
+static int unique_path(struct fs_volume *v, const char *name, CHAR16 *out,
+                       char *shown) {
+    int dot = -1, len = (int)str_len((CHAR8 *)name);
+    for (int i = len - 1; i > 0; i--) {
+        if (name[i] == '.') {
+            dot = i;
+            break;
+        }
+    }
+    for (int n = 1; n < 100; n++) {
+        char tail[8] = "";
+        if (n > 1) snprintf(tail, sizeof(tail), "_%d", n);
+        int base = dot >= 0 ? dot : len;
+        int p = 0;
+        for (const CHAR16 *d = UNDELETE_DIR; *d; d++) shown[p++] = (char)*d;
+        snprintf(shown + p, UD_PATH_MAX - p, "\\%.*s%s%s", base, name, tail,
+                 dot >= 0 ? name + dot : "");
+        for (p = 0; shown[p]; p++) out[p] = (CHAR16)shown[p];
+        out[p] = 0;
+        if (!exists(v, out)) return 0;
+    }
+    return -1;
+}
+
+/* Copy record x out to the boot volume */
+static void recover(struct ud_list *l, struct ntfs_vol *nv, struct ud_ent *x) {
+    UINT64 size;
+    struct ntfs_file *f = ntfs_open_record(nv, x->record, &size);
+    if (!f) {
+        l->msg = " Its data can no longer be read";
+        return;
+    }
+    struct fs_volume *dst = fs_volume_open(FS_VOL_SFS, NULL);
+    UINT8 *buf = (UINT8 *)mem_alloc_raw(UD_READ);
+    CHAR16 path[UD_PATH_MAX];
+    char shown[UD_PATH_MAX];
+    if (!dst || !buf) {
+        l->msg = !dst ? " Cannot open the boot volume" : " Out of memory";
+        goto out;
+    }
+    fs_volume_mkdir(dst, UNDELETE_DIR);
+    if (unique_path(dst, l->pool + x->name, path, shown) != 0) {
+        l->msg = " Too many files of that name in \\RECOVERED";
+        goto out;
+    }
+
+    struct copy_job job;
+    copy_init(&job, NULL, dst);
+    job.progress = recover_progress;
+    job.ctx = l;
+    int ok = copy_open(&job, path, size) == 0;
+    for (UINT64 done = 0; ok && done < size;) {
+        UINTN n = UD_READ;
+        if (ntfs_read(f, buf, &n) != 0 || n == 0 || copy_write(&job, buf, n) != 0)
+            ok = 0;
+        done += n;
+    }
+    if (job.out && copy_close(&job, ok) != 0) ok = 0;
+    copy_done(&job);
+
+    if (ok) {
+        x->recovered = 1;
+        snprintf(l->msg_buf, sizeof(l->msg_buf), " Saved as %s%s", shown,
+                 x->overwritten ? " (parts of it were overwritten)" : "");
+    } else {
+        snprintf(l->msg_buf, sizeof(l->msg_buf), " Could not write %s", shown);
+    }
+    l->msg = l->msg_buf;
+
+out:
+    if (buf) mem_free(buf);
+    if (dst) fs_volume_close(dst);
+    ntfs_close(f);
+}
+
+int undelete_run(void) {
+    struct ntfs_vol *nv = fs_volume_ntfs(fs_volume_current());
+    struct ud_list l;
+    mem_set(&l, 0, sizeof(l));
+    if (!nv || (l.scan = ntfs_mft_scan_open_deleted(nv)) == NULL) return -1;
+
+    int rows = (int)g_boot.rows - 3;
+    UINT64 hz = timer_hz(), t_draw = 0;
+    fb_clear(COLOR_BLACK);
+
+    for (;;) {
+        list_step(&l);
+
+        int scanning = l.scan != NULL;
+        UINT64 now = timer_ticks();
+        if (!scanning || now - t_draw > hz / 1000 * UD_DRAW_MS) {
+            draw_view(&l);
+            t_draw = now;
+        }
+
+        struct key_event ev;
+        if (scanning) {
+            if (!kbd_poll(&ev)) continue;
+        } else {
+            kbd_wait(&ev);
+        }
+
+        switch (ev.code) {
+        case KEY_UP:
+            if (l.cursor > 0) l.cursor--;
+            break;
+        case KEY_DOWN:
+            if (l.cursor < (int)l.count - 1) l.cursor++;
+            break;
+        case KEY_PGUP:
+            l.cursor -= rows;
+            if (l.cursor < 0) l.cursor = 0;
+            break;
+        case KEY_PGDN:
+            l.cursor += rows;
+            if (l.cursor > (int)l.count - 1) l.cursor = (int)l.count - 1;
+            if (l.cursor < 0) l.cursor = 0;
+            break;
+        case KEY_HOME:
+            l.cursor = 0;
+            break;
+        case KEY_END:
+            l.cursor = l.count ? (int)l.count - 1 : 0;
+            break;
+        case KEY_ENTER:
+            if (l.count > 0) recover(&l, nv, &l.ents[l.cursor]);
+            break;
+        case KEY_ESC:
+            goto out;
+        default:
+            break;
+        }
+        if (l.cursor < l.scroll) l.scroll = l.cursor;
+        if (l.cursor >= l.scroll + rows) l.scroll = l.cursor - rows + 1;
+        t_draw = 0;     /* a key always shows */
+    }
+
+out:
+    if (l.scan) ntfs_mft_scan_close(l.scan);
+    if (l.ents) mem_free(l.ents);
+    if (l.pool) mem_free(l.pool);
+    return 0;
+}
@@ -0,0 +1,22 @@
+/*
+ * undelete.h — Recover deleted files from an NTFS volume
+ *
+ * The $MFT is read straight through for records that are no longer in
+ * use but still list where their data was (ntfs.h). Files show as the
+ * scan finds them, each with how much of it $Bitmap says has been
+ * taken by newer files since, and the one picked is copied out to
+ * UNDELETE_DIR on the boot volume, never to the volume it came from.
+ */
+#ifndef UNDELETE_H
+#define UNDELETE_H
+
+#include "boot.h"
+
+#define UNDELETE_DIR L"\\RECOVERED"
+
+/* List the deleted files of the current volume, which must be NTFS.
+   Returns when left; -1 if the volume is not NTFS or cannot be
+   scanned. */
+int undelete_run(void);
+
+#endif /* UNDELETE_H */
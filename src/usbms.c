@@ -0,0 +1,350 @@
+/*
+ * usbms.c — USB mass storage (Bulk-Only Transport) over the firmware's USB IO
+ *
+ * Each command is a 31-byte Command Block Wrapper on the bulk-out
+ * endpoint, an optional data phase, and a 13-byte Command Status
+ * Wrapper on bulk-in. The device sees plain SCSI: READ CAPACITY once,
+ * then READ/WRITE(10) or (16) and SYNCHRONIZE CACHE. A failed command
+ * is followed by REQUEST SENSE, which clears the device's error state;
+ * a transport error (stall on the wrapper, bad or out-of-phase CSW) by
+ * the class reset recovery: Bulk-Only Mass Storage Reset, then clearing
+ * the halt on both endpoints.
+ */
+
+#include "usbms.h"
+#include "mem.h"
+
+#define CBW_SIGNATURE 0x43425355u   /* "USBC" */
+#define CSW_SIGNATURE 0x53425355u   /* "USBS" */
+#define CBW_LEN 31
+#define CSW_LEN 13
+#define CSW_GOOD   0
+#define CSW_FAILED 1
+
+#define USB_CLASS_MASS_STORAGE 0x08
+#define USB_SUBCLASS_SCSI      0x06
+#define USB_PROTOCOL_BOT       0x50
+
+#define SCSI_TEST_UNIT_READY 0x00
+#define SCSI_REQUEST_SENSE   0x03
+#define SCSI_READ_CAPACITY10 0x25
+#define SCSI_READ10          0x28
+#define SCSI_WRITE10         0x2a
+#define SCSI_SYNC_CACHE10    0x35
+#define SCSI_READ16          0x88
+#define SCSI_WRITE16         0x8a
+#define SCSI_SERVICE_IN16    0x9e   /* READ CAPACITY(16) */
+
+struct usbms {
+    EFI_BLOCK_IO         bio;       /* first: This points here */
+    EFI_BLOCK_IO_MEDIA   media;
+    EFI_USB_IO_PROTOCOL *usb;
+    EFI_HANDLE           handle;
+    UINT8                ep_in, ep_out;
+    UINT8                iface;
+    int                  cdb16;     /* past 2^32 blocks */
+    UINT32               max_xfer;  /* bytes per command */
+    UINT32               tag;
+    UINT8                cbw[CBW_LEN];
+    UINT8                csw[CSW_LEN];
+    UINT8                sense[18];
+    UINT8                cap[32];
+};
+
+static struct usbms *s_dev[USBMS_MAX_DEVICES];
+static int s_ndev;
+
+static void put_be32(UINT8 *p, UINT32 v) {
+    p[0] = (UINT8)(v >> 24); p[1] = (UINT8)(v >> 16);
+    p[2] = (UINT8)(v >> 8);  p[3] = (UINT8)v;
+}
+
+static UINT32 get_be32(const UINT8 *p) {
+    return ((UINT32)p[0] << 24) | ((UINT32)p[1] << 16) |
+           ((UINT32)p[2] << 8) | p[3];
+}
+
+static UINT32 get_le32(const UINT8 *p) {
+    return p[0] | ((UINT32)p[1] << 8) | ((UINT32)p[2] << 16) |
+           ((UINT32)p[3] << 24);
+}
+
+static EFI_STATUS control(struct usbms *m, UINT8 type, UINT8 req,
+                          UINT16 value, UINT16 index) {
+    EFI_USB_DEVICE_REQUEST r;
+    UINT32 st = 0;
+    r.RequestType = type;
+    r.Request = req;
+    r.Value = value;
+    r.Index = index;
+    r.Length = 0;
+    return m->usb->UsbControlTransfer(m->usb, &r, EfiUsbNoData,
+                                      USBMS_TIMEOUT_MS, NULL, 0, &st);
+}
+
+/* Bulk-Only Mass Storage Reset and CLEAR_FEATURE(ENDPOINT_HALT) on
+   both pipes: the recovery the class defines for any transport error */
+static void reset_recovery(struct usbms *m) {
+    control(m, 0x21, 0xff, 0, m->iface);
+    control(m, 0x02, 0x01, 0, m->ep_in);
+    control(m, 0x02, 0x01, 0, m->ep_out);
+}
+
+static EFI_STATUS bulk(struct usbms *m, UINT8 ep, void *buf, UINTN *len) {
+    UINT32 st = 0;
+    EFI_STATUS s = m->usb->UsbBulkTransfer(m->usb, ep, buf, len,
+                                           USBMS_TIMEOUT_MS, &st);
+    if (!EFI_ERROR(s) && st != 0) s = EFI_DEVICE_ERROR;
+    return s;
+}
+
+/* One command: len bytes in (dir_in) or out of buf. Returns the CSW
+   status (CSW_GOOD, CSW_FAILED), or -1 after a transport error, which
+   has already been recovered from. */
+static int bot_command(struct usbms *m, const UINT8 *cdb, int cdb_len,
+                       int dir_in, void *buf, UINT32 len) {
+    UINT8 *w = m->cbw;
+    UINTN n;
+
+    mem_set(w, 0, CBW_LEN);
+    w[0] = (UINT8)CBW_SIGNATURE; w[1] = (UINT8)(CBW_SIGNATURE >> 8);
+    w[2] = (UINT8)(CBW_SIGNATURE >> 16); w[3] = (UINT8)(CBW_SIGNATURE >> 24);
+    UINT32 tag = ++m->tag;
+    w[4] = (UINT8)tag; w[5] = (UINT8)(tag >> 8);
+    w[6] = (UINT8)(tag >> 16); w[7] = (UINT8)(tag >> 24);
+    w[8] = (UINT8)len; w[9] = (UINT8)(len >> 8);
+    w[10] = (UINT8)(len >> 16); w[11] = (UINT8)(len >> 24);
+    w[12] = dir_in ? 0x80 : 0x00;
+    w[13] = 0;                  /* LUN */
+    w[14] = (UINT8)cdb_len;
+    mem_copy(w + 15, cdb, cdb_len);
+
+    n = CBW_LEN;
+    if (EFI_ERROR(bulk(m, m->ep_out, w, &n)) || n != CBW_LEN) {
+        reset_recovery(m);
+        return -1;
+    }
+
+    /* A stalled data phase still ends in a CSW (the firmware's USB IO
+       clears the halt itself before returning) */
+    if (len > 0) {
+        n = len;
+        bulk(m, dir_in ? m->ep_in : m->ep_out, buf, &n);
+    }
+
+    for (int tries = 0; ; tries++) {
+        n = CSW_LEN;
+        if (!EFI_ERROR(bulk(m, m->ep_in, m->csw, &n)) && n == CSW_LEN)
+            break;
+        if (tries == 1) {
+            reset_recovery(m);
+            return -1;
+        }
+    }
+    if (get_le32(m->csw) != CSW_SIGNATURE || get_le32(m->csw + 4) != tag ||
+        m->csw[12] > CSW_FAILED) {
+        reset_recovery(m);
+        return -1;
+    }
+    if (m->csw[12] == CSW_GOOD && get_le32(m->csw + 8) != 0)
+        return CSW_FAILED;          /* short transfer */
+    return m->csw[12];
+}
+
+/* As bot_command, fetching and discarding the sense data of a failed
+   command so the device accepts the next one. Returns 0 on success. */
+static int scsi(struct usbms *m, const UINT8 *cdb, int cdb_len,
+                int dir_in, void *buf, UINT32 len) {
+    int rc = bot_command(m, cdb, cdb_len, dir_in, buf, len);
+    if (rc == CSW_FAILED) {
+        UINT8 rs[6] = { SCSI_REQUEST_SENSE, 0, 0, 0, sizeof(m->sense), 0 };
+        bot_command(m, rs, 6, 1, m->sense, sizeof(m->sense));
+    }
+    return rc == CSW_GOOD ? 0 : -1;
+}
+
+static void rw_cdb(struct usbms *m, UINT8 *cdb, int write, UINT64 lba,
+                   UINT32 blocks) {
+    mem_set(cdb, 0, 16);
+    if (m->cdb16) {
+        cdb[0] = write ? SCSI_WRITE16 : SCSI_READ16;
+        put_be32(cdb + 2, (UINT32)(lba >> 32));
+        put_be32(cdb + 6, (UINT32)lba);
+        put_be32(cdb + 10, blocks);
+    } else {
+        cdb[0] = write ? SCSI_WRITE10 : SCSI_READ10;
+        put_be32(cdb + 2, (UINT32)lba);
+        cdb[7] = (UINT8)(blocks >> 8);
+        cdb[8] = (UINT8)blocks;
+    }
+}
+
+static EFI_STATUS usbms_rw(struct usbms *m, UINT32 media_id, int write,
+                           EFI_LBA lba, UINTN size, UINT8 *buf) {
+    UINT32 bs = m->media.BlockSize;
+    if (media_id != m->media.MediaId) return EFI_MEDIA_CHANGED;
+    if (write && m->media.ReadOnly) return EFI_WRITE_PROTECTED;
+    if (size % bs) return EFI_BAD_BUFFER_SIZE;
+    if (!buf && size) return EFI_INVALID_PARAMETER;
+    if (lba > m->media.LastBlock ||
+        size / bs > m->media.LastBlock - lba + 1)
+        return EFI_INVALID_PARAMETER;
+
+    while (size > 0) {
+        UINTN piece = size < m->max_xfer ? size : m->max_xfer;
+        UINT32 blocks = (UINT32)(piece / bs);
+        UINT8 cdb[16];
+        rw_cdb(m, cdb, write, lba, blocks);
+        if (scsi(m, cdb, m->cdb16 ? 16 : 10, !write, buf, (UINT32)piece) != 0) {
+            /* Some bridges reject long transfers: settle for the size
+               every device takes, and try this piece again */
+            if (m->max_xfer <= USBMS_XFER_SAFE) return EFI_DEVICE_ERROR;
+            m->max_xfer = USBMS_XFER_SAFE - USBMS_XFER_SAFE % bs;
+            if (m->max_xfer < bs) m->max_xfer = bs;
+            continue;
+        }
+        lba += blocks;
+        buf += piece;
+        size -= piece;
+    }
+    return EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI usbms_read(EFI_BLOCK_IO *This, UINT32 media_id,
+                                    EFI_LBA lba, UINTN size, VOID *buf) {
+    return usbms_rw((struct usbms *)This, media_id, 0, lba, size, buf);
+}
+
+static EFI_STATUS EFIAPI usbms_write(EFI_BLOCK_IO *This, UINT32 media_id,
+                                     EFI_LBA lba, UINTN size, VOID *buf) {
+    return usbms_rw((struct usbms *)This, media_id, 1, lba, size, buf);
+}
+
+/* Devices without a cache commonly reject SYNCHRONIZE CACHE: only a
+   transport failure counts */
+static EFI_STATUS EFIAPI usbms_flush(EFI_BLOCK_IO *This) {
+    struct usbms *m = (struct usbms *)This;
+    UINT8 cdb[10] = { SCSI_SYNC_CACHE10 };
+    if (m->media.ReadOnly) return EFI_SUCCESS;
+    return bot_command(m, cdb, 10, 0, NULL, 0) < 0 ? EFI_DEVICE_ERROR
+                                                    : EFI_SUCCESS;
+}
+
+static EFI_STATUS EFIAPI usbms_reset(EFI_BLOCK_IO *This, BOOLEAN extended) {
+    struct usbms *m = (struct usbms *)This;
+    (void)extended;
+    reset_recovery(m);
+    return EFI_SUCCESS;
+}
+
+/* Block size and last block from READ CAPACITY; 0 on success */
+static int read_capacity(struct usbms *m, UINT32 *bs, UINT64 *last) {
+    UINT8 tur[6] = { SCSI_TEST_UNIT_READY };
+    UINT8 rc10[10] = { SCSI_READ_CAPACITY10 };
+
+    /* The first commands after a reset may report a unit attention */
+    for (int i = 0; i < 3 && scsi(m, tur, 6, 0, NULL, 0) != 0; i++)
+        ;
+    if (scsi(m, rc10, 10, 1, m->cap, 8) != 0) return -1;
+    *last = get_be32(m->cap);
+    *bs = get_be32(m->cap + 4);
+    if (*last == 0xffffffffu) {
+        UINT8 rc16[16] = { SCSI_SERVICE_IN16, 0x10 };
+        rc16[13] = 32;
+        if (scsi(m, rc16, 16, 1, m->cap, 32) != 0) return -1;
+        *last = ((UINT64)get_be32(m->cap) << 32) | get_be32(m->cap + 4);
+        *bs = get_be32(m->cap + 8);
+    }
+    return 0;
+}
+
+static struct usbms *slot_for(EFI_USB_IO_PROTOCOL *usb) {
+    for (int i = 0; i < s_ndev; i++)
+        if (s_dev[i]->usb == usb) return s_dev[i];
+    if (s_ndev == USBMS_MAX_DEVICES) return NULL;
+    struct usbms *m = (struct usbms *)mem_alloc(sizeof(*m));
+    if (m) s_dev[s_ndev++] = m;
+    return m;
+}
+
+int usbms_attach(struct disk_device *dev) {
+    EFI_GUID usb_guid = EFI_USB_IO_PROTOCOL_GUID;
+    EFI_USB_IO_PROTOCOL *usb = NULL;
+    EFI_USB_INTERFACE_DESCRIPTOR ifd;
+    EFI_USB_DEVICE_DESCRIPTOR dd;
+
+    if (!dev || !dev->handle || !dev->block_io || usbms_owns(dev->block_io))
+        return -1;
+    /* The firmware puts a single-LUN device's BlockIO on the interface
+       handle itself; further LUNs get child handles without USB IO */
+    if (EFI_ERROR(g_boot.bs->HandleProtocol(dev->handle, &usb_guid,
+                                            (VOID **)&usb)) || !usb)
+        return -1;
+    if (EFI_ERROR(usb->UsbGetInterfaceDescriptor(usb, &ifd)) ||
+        ifd.InterfaceClass != USB_CLASS_MASS_STORAGE ||
+        ifd.InterfaceSubClass != USB_SUBCLASS_SCSI ||
+        ifd.InterfaceProtocol != USB_PROTOCOL_BOT)
+        return -1;
+
+    UINT8 ep_in = 0, ep_out = 0;
+    for (UINT8 i = 0; i < ifd.NumEndpoints; i++) {
+        EFI_USB_ENDPOINT_DESCRIPTOR ed;
+        if (EFI_ERROR(usb->UsbGetEndpointDescriptor(usb, i, &ed)) ||
+            (ed.Attributes & 3) != 2)
+            continue;
+        if (ed.EndpointAddress & 0x80) { if (!ep_in) ep_in = ed.EndpointAddress; }
+        else if (!ep_out) ep_out = ed.EndpointAddress;
+    }
+    if (!ep_in || !ep_out) return -1;
+
+    struct usbms *m = slot_for(usb);
+    if (!m) return -1;
+    m->usb = usb;
+    m->handle = dev->handle;
+    m->iface = ifd.InterfaceNumber;
+    m->ep_in = ep_in;
+    m->ep_out = ep_out;
+    m->cdb16 = 0;
+    m->max_xfer = USBMS_XFER_SAFE;
+    if (!EFI_ERROR(usb->UsbGetDeviceDescriptor(usb, &dd)) &&
+        dd.BcdUSB >= 0x0300)
+        m->max_xfer = USBMS_XFER_USB3;
+
+    /* Only take over a device that answers as the firmware describes it */
+    EFI_BLOCK_IO_MEDIA *fw = dev->block_io->Media;
+    UINT32 bs;
+    UINT64 last;
+    if (read_capacity(m, &bs, &last) != 0 || bs != fw->BlockSize ||
+        last != fw->LastBlock || bs == 0)
+        return -1;
+    m->cdb16 = last > 0xffffffffu;
+    m->max_xfer -= m->max_xfer % bs;
+    if (m->max_xfer < bs) m->max_xfer = bs;
+
+    /* The Rev2/3 hints only exist past the base structure on newer
+       firmware */
+    UINT64 rev = dev->block_io->Revision;
+    if (rev >= EFI_BLOCK_IO_PROTOCOL_REVISION2) {
+        m->media = *fw;
+    } else {
+        mem_set(&m->media, 0, sizeof(m->media));
+        mem_copy(&m->media, fw, (UINTN)&((EFI_BLOCK_IO_MEDIA *)0)->LowestAlignedLba);
+    }
+    m->bio.Revision = rev;
+    m->bio.Media = &m->media;
+    m->bio.Reset = usbms_reset;
+    m->bio.ReadBlocks = usbms_read;
+    m->bio.WriteBlocks = usbms_write;
+    m->bio.FlushBlocks = usbms_flush;
+
+    dev->block_io = &m->bio;
+    dev->block_io2 = NULL;
+    dev->xfer_size = 0;
+    return 0;
+}
+
+int usbms_owns(EFI_BLOCK_IO *bio) {
+    for (int i = 0; i < s_ndev; i++)
+        if (bio == &s_dev[i]->bio) return 1;
+    return 0;
+}
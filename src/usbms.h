@@ -0,0 +1,40 @@
+/*
+ * usbms.h — USB mass storage (Bulk-Only Transport) over the firmware's USB IO
+ *
+ * Many firmware mass-storage drivers send one small SCSI command at a
+ * time, a few dozen KB each, so a USB 3 SSD that streams hundreds of
+ * MB/s tops out well below that. This driver talks Bulk-Only Transport
+ * itself on the EFI_USB_IO_PROTOCOL the firmware's USB bus driver
+ * already installs on the stick's interface, with READ/WRITE commands
+ * of up to USBMS_XFER_USB3 (USBMS_XFER_SAFE on USB 2.0 devices and
+ * after any device that chokes on larger ones), and presents the
+ * result as a BlockIO, so every disk_* path uses it unchanged.
+ *
+ * Built with USBMS=1 (USBMS_NATIVE defined), disk_enumerate() hands
+ * each removable disk to usbms_attach(). Without it nothing changes.
+ * Firmware without USB IO (U-Boot's EFI) keeps its own BlockIO.
+ */
+#ifndef USBMS_H
+#define USBMS_H
+
+#include "disk.h"
+
+#define USBMS_MAX_DEVICES 8
+
+/* Largest data phase of one command: Linux's usb-storage limits */
+#define USBMS_XFER_USB3   (1024 * 1024)
+#define USBMS_XFER_SAFE   (240 * 512)
+
+#define USBMS_TIMEOUT_MS  30000   /* per bulk transfer, as SCSI's default */
+
+/* If dev's BlockIO handle is a single-LUN SCSI Bulk-Only interface,
+   point dev->block_io at this driver's BlockIO for it (BlockIO2 is
+   dropped, so all I/O takes that path). Leaves dev alone and returns
+   -1 otherwise, or if the device does not answer as the firmware's
+   BlockIO describes it. */
+int usbms_attach(struct disk_device *dev);
+
+/* Whether bio is one of this driver's */
+int usbms_owns(EFI_BLOCK_IO *bio);
+
+#endif /* USBMS_H */
@@ -0,0 +1,46 @@
+/* hashbench.c — Checksum throughput on this machine */
+#include <survival.h>
+
+#define BUF_SIZE (16 * 1024 * 1024)
+
+static void report(const char *name, uint32_t hw_bit, uint64_t ns) {
+    uint64_t mbs = ns ? (uint64_t)BUF_SIZE * 1000 / ns : 0;
+    printf("  %-8s %6llu MB/s  (%s)\n", name, (unsigned long long)mbs,
+           (hash_accel() & hw_bit) ? "CPU instructions" : "portable C");
+}
+
+int main(void) {
+    uint8_t *buf = malloc(BUF_SIZE);
+    if (!buf) {
+        printf("Out of memory\n");
+        return 1;
+    }
+    uint32_t x = 2463534242u;
+    for (size_t i = 0; i < BUF_SIZE; i++) {
+        x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+        buf[i] = (uint8_t)x;
+    }
+
+    printf("Hashing %d MB:\n", BUF_SIZE / (1024 * 1024));
+
+    uint64_t t = bench_start();
+    uint32_t c = crc32c(0, buf, BUF_SIZE);
+    report("CRC32C", HASH_HW_CRC32C, bench_stop(t));
+
+    t = bench_start();
+    uint32_t z = crc32(0, buf, BUF_SIZE);
+    report("CRC32", HASH_HW_CRC32, bench_stop(t));
+
+    struct sha256_ctx ctx;
+    uint8_t digest[SHA256_DIGEST];
+    t = bench_start();
+    sha256_init(&ctx);
+    sha256_update(&ctx, buf, BUF_SIZE);
+    sha256_final(&ctx, digest);
+    report("SHA-256", HASH_HW_SHA256, bench_stop(t));
+
+    printf("\n  crc32c %08x  crc32 %08x  sha256 %02x%02x%02x%02x...\n",
+           c, z, digest[0], digest[1], digest[2], digest[3]);
+    free(buf);
+    return 0;
+}
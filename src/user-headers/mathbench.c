@@ -0,0 +1,100 @@
+/* mathbench.c — The math functions: speed, and how far identities
+   between them drift */
+#include <survival.h>
+
+#define COUNT 200000
+
+static volatile double sink;
+
+/* Nanoseconds a call over COUNT arguments in [lo, hi) */
+static uint64_t time1(double (*fn)(double), double lo, double hi) {
+    double step = (hi - lo) / COUNT, acc = 0;
+    uint64_t t = bench_start();
+    for (int i = 0; i < COUNT; i++) acc += fn(lo + i * step);
+    uint64_t ns = bench_stop(t);
+    sink = acc;
+    return ns / COUNT;
+}
+
+/* The largest |a - b| / |b| over the pairs seen */
+static double worst;
+
+static void track(double a, double b) {
+    double d = fabs(a - b) / (b == 0 ? 1 : fabs(b));
+    if (d > worst) worst = d;
+}
+
+static double drift(const char *what) {
+    printf("  %-24s worst %.2e\n", what, worst);
+    double w = worst;
+    worst = 0;
+    return w;
+}
+
+int main(void) {
+    struct { const char *name; double (*fn)(double); double lo, hi; } f[] = {
+        { "sqrt",  sqrt,  0,     1e6 },
+        { "exp",   exp,   -700,  700 },
+        { "log",   log,   1e-9,  1e9 },
+        { "log2",  log2,  1e-9,  1e9 },
+        { "sin",   sin,   -10,   10 },
+        { "cos",   cos,   -10,   10 },
+        { "sin",   sin,   1e15,  1e16 },
+        { "tan",   tan,   -1.5,  1.5 },
+        { "atan",  atan,  -50,   50 },
+        { "asin",  asin,  -1,    1 },
+        { "floor", floor, -1e6,  1e6 },
+    };
+    printf("Per call:\n");
+    for (int i = 0; i < (int)(sizeof(f) / sizeof(f[0])); i++) {
+        char range[40];
+        snprintf(range, sizeof(range), "[%g, %g)", f[i].lo, f[i].hi);
+        printf("  %-6s %-16s %4llu ns\n", f[i].name, range,
+               (unsigned long long)time1(f[i].fn, f[i].lo, f[i].hi));
+    }
+
+    uint64_t t = bench_start();
+    double acc = 0;
+    for (int i = 0; i < COUNT; i++) acc += pow(1 + i * 1e-5, 0.5 + i * 1e-4);
+    sink = acc;
+    printf("  %-6s %-16s %4llu ns\n", "pow", "",
+           (unsigned long long)(bench_stop(t) / COUNT));
+
+    /* 2^-52 is one ulp at 1: these should stay within a few of it */
+    printf("Relative drift (2^-52 = %.2e):\n", 0x1p-52);
+    int bad = 0;
+    for (int i = 0; i < COUNT; i++) {
+        double x = -20 + i * (40.0 / COUNT);
+        double s = sin(x), c = cos(x);
+        track(s * s + c * c, 1);
+    }
+    bad += drift("sin^2 + cos^2 = 1") > 0x1p-50;
+    for (int i = 1; i < COUNT; i++) {
+        double x = i * 0.37;
+        track(exp(log(x)), x);
+    }
+    bad += drift("exp(log x) = x") > 0x1p-40;
+    for (int i = 1; i < COUNT; i++) {
+        double x = 1 + i * 1e-4, y = -30 + i * (60.0 / COUNT);
+        track(pow(x, y), exp(y * log(x)));
+    }
+    bad += drift("pow(x, y) = exp(y log x)") > 0x1p-40;
+    for (int i = 0; i < COUNT; i++) {
+        double x = -1 + i * (2.0 / COUNT);
+        track(sin(asin(x)), x);
+    }
+    bad += drift("sin(asin x) = x") > 0x1p-50;
+    for (int i = 1; i < COUNT; i++) {
+        double x = i * 1e3;
+        track(sqrt(x) * sqrt(x), x);
+    }
+    bad += drift("sqrt(x)^2 = x") > 0x1p-51;
+
+    /* A few that should come out exact */
+    bad += pow(2, 10) != 1024 || pow(-2, 3) != -8 || sqrt(144) != 12;
+    bad += exp(0) != 1 || log(1) != 0 || log10(1000) != 3 || log2(0x1p-30) != -30;
+    bad += floor(-2.5) != -3 || ceil(-2.5) != -2 || round(-2.5) != -3;
+    bad += fmod(10, 3) != 1 || !isnan(sqrt(-1)) || !isinf(log(0));
+    printf(bad ? "FAILED\n" : "All as expected\n");
+    return bad != 0;
+}
@@ -0,0 +1,72 @@
+/* parhash.c — Hashing spread over every core with par_for() */
+#include <survival.h>
+
+#define BUF_SIZE (64 * 1024 * 1024)
+#define PIECE    (1024 * 1024)
+#define PIECES   (BUF_SIZE / PIECE)
+
+struct work {
+    const uint8_t *buf;
+    uint32_t crc[PIECES];           /* CRC32C of each piece */
+    volatile uint64_t sum;          /* and a checksum word over it all */
+};
+
+static void hash_pieces(int64_t lo, int64_t hi, void *ctx) {
+    struct work *w = ctx;
+    uint64_t sum = 0;
+    for (int64_t i = lo; i < hi; i++) {
+        const uint8_t *p = w->buf + i * PIECE;
+        w->crc[i] = crc32c(0, p, PIECE);
+        const uint64_t *q = (const uint64_t *)p;
+        for (int k = 0; k < PIECE / 8; k++)
+            sum += q[k] * 0x9E3779B97F4A7C15ull;
+    }
+    par_add64(&w->sum, sum);
+}
+
+static uint64_t run(struct work *w, int64_t chunk, int parallel) {
+    w->sum = 0;
+    uint64_t t = bench_start();
+    if (parallel)
+        par_for(0, PIECES, chunk, hash_pieces, w);
+    else
+        hash_pieces(0, PIECES, w);
+    return bench_stop(t);
+}
+
+int main(void) {
+    uint8_t *buf = malloc(BUF_SIZE);
+    struct work *w = malloc(sizeof(*w));
+    if (!buf || !w) {
+        printf("Out of memory\n");
+        return 1;
+    }
+    uint32_t x = 2463534242u;
+    for (size_t i = 0; i < BUF_SIZE; i++) {
+        x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+        buf[i] = (uint8_t)x;
+    }
+    w->buf = buf;
+
+    int cores = par_cores();
+    printf("Hashing %d MB in %d MB pieces:\n", BUF_SIZE / (1024 * 1024),
+           PIECE / (1024 * 1024));
+
+    uint64_t one = run(w, 0, 0);
+    uint64_t sum1 = w->sum;
+    uint32_t crc1 = crc32c(0, w->crc, sizeof(w->crc));
+    uint64_t all = run(w, 1, 1);
+    int same = w->sum == sum1 && crc32c(0, w->crc, sizeof(w->crc)) == crc1;
+
+    printf("  1 core     %6llu MB/s\n",
+           (unsigned long long)(one ? (uint64_t)BUF_SIZE * 1000 / one : 0));
+    printf("  %d core%s %6llu MB/s  (%llu.%02llux)\n", cores,
+           cores == 1 ? " " : "s",
+           (unsigned long long)(all ? (uint64_t)BUF_SIZE * 1000 / all : 0),
+           (unsigned long long)(all ? one / all : 0),
+           (unsigned long long)(all ? one * 100 / all % 100 : 0));
+    printf("\n  results %s\n", same ? "match" : "DIFFER");
+    free(w);
+    free(buf);
+    return same ? 0 : 1;
+}
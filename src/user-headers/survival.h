@@ -42,6 +42,32 @@ void fb_char(uint32_t col, uint32_t row, char c, uint32_t fg, uint32_t bg);
 void fb_string(uint32_t col, uint32_t row, const char *s, uint32_t fg, uint32_t bg);
 void fb_scroll(int lines);
 void fb_print(const char *s, uint32_t color);
+/* Show what was drawn; fb_print and the kbd_* calls do this too */
+void fb_present(void);
+
+/* ---- Surfaces ----
+ * Draw into pixels[y * pitch + x] directly, then present: a whole
+ * surface, or just the rectangle you changed. fb_surface_screen() is
+ * the screen's own back buffer (present it at 0, 0; nothing is copied).
+ * Surfaces still allocated when the program ends are freed. */
+struct fb_surface {
+    uint32_t *pixels;
+    uint32_t width, height;
+    uint32_t pitch;             /* pixels per row */
+};
+
+struct fb_surface *fb_surface_create(uint32_t w, uint32_t h);
+void fb_surface_free(struct fb_surface *s);
+struct fb_surface *fb_surface_screen(void);
+void fb_surface_present(struct fb_surface *s, uint32_t x, uint32_t y);
+/* The w x h area at sx,sy of s, shown for s placed at x,y */
+void fb_surface_present_rect(struct fb_surface *s, uint32_t sx, uint32_t sy,
+                             uint32_t w, uint32_t h, uint32_t x, uint32_t y);
+/* Text at pixel x,y in the console's font size */
+void fb_surface_text(struct fb_surface *s, uint32_t x, uint32_t y,
+                     const char *str, uint32_t fg, uint32_t bg);
+/* Wait for the next frame of a steady fps; returns frames missed */
+uint32_t fb_frame_wait(uint32_t fps);
 
 /* ---- Keyboard ---- */
 struct key_event {
@@ -73,11 +99,203 @@ void  mem_free(void *ptr);
 void  mem_set(void *dst, uint8_t val, size_t size);
 void  mem_copy(void *dst, const void *src, size_t size);
 
+/* ---- Raw block devices ----
+ * Whole disks by index, as the browser lists them. Transfers go
+ * straight between the device and your buffer; blk_buf_alloc() buffers
+ * suit every disk's alignment, others may be staged through a copy.
+ * Writes to the boot device are refused. Queues, requests in flight,
+ * buffers and queued writes still open when the program ends are
+ * finished, flushed and freed for you. Functions return 0 (or an index)
+ * on success and -1 on error. */
+struct blk_info {
+    char     name[64];
+    uint64_t size_bytes;
+    uint32_t block_size;
+    uint32_t io_align;
+    int32_t  removable;
+    int32_t  boot;          /* writes refused */
+    int32_t  async;         /* queued requests overlap */
+    int32_t  pad;
+};
+
+#define BLK_QUEUE_MAX 64    /* deepest queue */
+
+int   blk_count(void);
+int   blk_info(int disk, struct blk_info *out);
+/* Small writes are queued: blk_flush() makes them durable */
+int   blk_read(int disk, uint64_t lba, uint64_t count, void *buf);
+int   blk_write(int disk, uint64_t lba, uint64_t count, const void *buf);
+int   blk_flush(int disk);
+void *blk_buf_alloc(size_t size);
+void  blk_buf_free(void *buf);
+
+/* Up to depth requests in flight; buf must live until blk_wait() */
+int   blk_queue_open(int disk, int depth);
+int   blk_submit_read(int queue, uint64_t lba, uint64_t count, void *buf);
+int   blk_submit_write(int queue, uint64_t lba, uint64_t count, const void *buf);
+int   blk_poll(int queue, int req);     /* 1 done, 0 in flight */
+int   blk_wait(int queue, int req);
+int   blk_queue_close(int queue);
+
+/* ---- Timing ---- */
+/* Nanosecond stopwatch: t = bench_start(); ...; ns = bench_stop(t) */
+uint64_t bench_start(void);
+uint64_t bench_stop(uint64_t start);
+uint64_t bench_ns(void);
+
+/* ---- Checksums ---- */
+/* Extend a CRC (start from 0, feed each result back in, as with
+   zlib's crc32()): CRC32C (Castagnoli) or the IEEE CRC32 */
+uint32_t crc32c(uint32_t crc, const void *data, size_t size);
+uint32_t crc32(uint32_t crc, const void *data, size_t size);
+
+/* Which run on CPU instructions (the rest are portable C) */
+#define HASH_HW_CRC32C 0x1
+#define HASH_HW_CRC32  0x2
+#define HASH_HW_SHA256 0x4
+uint32_t hash_accel(void);
+
+#define SHA256_DIGEST 32
+
+struct sha256_ctx {
+    uint32_t h[8];
+    uint64_t len;
+    uint8_t  block[64];
+    uint32_t used;
+};
+
+void sha256_init(struct sha256_ctx *c);
+void sha256_update(struct sha256_ctx *c, const void *data, size_t size);
+void sha256_final(struct sha256_ctx *c, uint8_t out[SHA256_DIGEST]);
+
+/* ---- Array kernels ----
+ * Hot loops on SSE2 or NEON, which compiled code never uses. Float
+ * results are summed in several lanes at once, so the last bits may
+ * differ from a plain loop's; min and max are not for arrays holding
+ * NaNs. Empty arrays give 0. */
+int64_t vec_sum_i32(const int32_t *a, size_t n);
+int32_t vec_min_i32(const int32_t *a, size_t n);
+int32_t vec_max_i32(const int32_t *a, size_t n);
+int64_t vec_dot_i32(const int32_t *a, const int32_t *b, size_t n);
+float   vec_sum_f32(const float *a, size_t n);
+float   vec_min_f32(const float *a, size_t n);
+float   vec_max_f32(const float *a, size_t n);
+float   vec_dot_f32(const float *a, const float *b, size_t n);
+
+/* First byte c among the n at p, as memchr() */
+void *vec_find_byte(const void *p, int c, size_t n);
+/* dst[i] ^= src[i] over n bytes */
+void  vec_xor(void *dst, const void *src, size_t n);
+/* Source over: each byte of dst[i] becomes (s*a + d*(255-a)) / 255,
+   a being the top byte of src[i] */
+void  vec_blend(uint32_t *dst, const uint32_t *src, size_t n);
+
+/* ---- Parallel jobs ----
+ * Spread work over every core. Job functions on the other cores run
+ * with no firmware behind them: they may compute on memory the program
+ * already holds and call the string, memory, checksum, vec_*, math,
+ * bench_* and par_* atomic/barrier functions, but not print, allocate or
+ * free, draw, read keys, or touch files or disks. Those calls are refused
+ * there (they fail or do nothing) and counted in a note after the run.
+ * Stacks on the other cores are small (32 KB): keep big arrays in
+ * memory you allocated beforehand. */
+typedef void (*par_job_fn)(void *ctx);
+typedef void (*par_range_fn)(int64_t lo, int64_t hi, void *ctx);
+typedef void (*par_group_fn)(int i, int n, void *ctx);
+
+#define PAR_JOBS 64         /* par_submit() jobs outstanding at once */
+
+/* Cores jobs run on, this one included (1 in a program run on an AP of
+   its own with Alt+F5) */
+int  par_cores(void);
+/* fn(lo, hi, ctx) over [begin, end) in pieces chunk long (0: a few per
+   core); returns when every piece is done */
+void par_for(int64_t begin, int64_t end, int64_t chunk, par_range_fn fn,
+             void *ctx);
+/* Run fn(ctx) on some core: returns a job for par_wait(), or -1 */
+int  par_submit(par_job_fn fn, void *ctx);
+int  par_wait(int job);
+/* fn(i, n, ctx) for i = 0..n-1 at the same time, one per core (n is
+   cut to par_cores()); these may meet at a barrier. Returns n. */
+int  par_run(int n, par_group_fn fn, void *ctx);
+
+struct par_barrier {
+    volatile uint32_t count, gen;
+    uint32_t n, pad;
+};
+void par_barrier_init(struct par_barrier *b, uint32_t n);
+void par_barrier_wait(struct par_barrier *b);
+
+/* Atomics, each a full barrier; add and cas return the old value */
+uint32_t par_add32(volatile uint32_t *p, uint32_t v);
+uint64_t par_add64(volatile uint64_t *p, uint64_t v);
+uint32_t par_cas32(volatile uint32_t *p, uint32_t expect, uint32_t desired);
+uint64_t par_cas64(volatile uint64_t *p, uint64_t expect, uint64_t desired);
+void     par_fence(void);
+void     par_relax(void);   /* in spin loops */
+
+/* ---- Math ----
+ * exp, log and pow are within 0.52 ulp of the exact result, sin, cos
+ * and atan within 1, tan, asin and acos 2.5; the rest are exact. The
+ * float versions round the double result. errno is never set. */
+#define HUGE_VAL  (1.0 / 0.0)
+#define INFINITY  (1.0f / 0.0f)
+#define NAN       (0.0f / 0.0f)
+#define M_PI      3.14159265358979323846
+#define isnan(x)    ((x) != (x))
+#define isinf(x)    (!isnan(x) && isnan((x) - (x)))
+#define isfinite(x) (!isnan((x) - (x)))
+
+double fabs(double x);
+double trunc(double x);
+double floor(double x);
+double ceil(double x);
+double round(double x);         /* halves away from zero */
+double fmod(double x, double y);
+double ldexp(double x, int exp);
+double frexp(double x, int *exp);
+double sqrt(double x);
+double exp(double x);
+double exp2(double x);
+double log(double x);
+double log2(double x);
+double log10(double x);
+double pow(double x, double y);
+double sin(double x);
+double cos(double x);
+double tan(double x);
+double atan(double x);
+double atan2(double y, double x);
+double asin(double x);
+double acos(double x);
+
+float fabsf(float x);
+float truncf(float x);
+float floorf(float x);
+float ceilf(float x);
+float roundf(float x);
+float fmodf(float x, float y);
+float sqrtf(float x);
+float expf(float x);
+float exp2f(float x);
+float logf(float x);
+float log2f(float x);
+float log10f(float x);
+float powf(float x, float y);
+float sinf(float x);
+float cosf(float x);
+float tanf(float x);
+float atanf(float x);
+float atan2f(float y, float x);
+float asinf(float x);
+float acosf(float x);
+
 /* ---- Libc-like ---- */
 void *malloc(size_t size);
 void  free(void *ptr);
 void *memcpy(void *dst, const void *src, size_t n);
 void *memset(void *s, int c, size_t n);
+int   memcmp(const void *a, const void *b, size_t n);
 size_t strlen(const char *s);
 int   strcmp(const char *a, const char *b);
 char *strcpy(char *dst, const char *src);
@@ -0,0 +1,113 @@
+/* vecbench.c — Array kernels against the plain loops they replace */
+#include <survival.h>
+
+#define COUNT (4 * 1024 * 1024)
+
+static void report(const char *name, uint64_t loop_ns, uint64_t vec_ns,
+                   int same) {
+    printf("  %-8s loop %6llu us  vec %6llu us  %s\n", name,
+           (unsigned long long)(loop_ns / 1000),
+           (unsigned long long)(vec_ns / 1000), same ? "" : "DIFFER");
+}
+
+int main(void) {
+    int32_t *a = malloc(COUNT * sizeof(int32_t));
+    int32_t *b = malloc(COUNT * sizeof(int32_t));
+    float *f = malloc(COUNT * sizeof(float));
+    uint32_t *px = malloc(COUNT * sizeof(uint32_t));
+    if (!a || !b || !f || !px) {
+        printf("Out of memory\n");
+        return 1;
+    }
+    uint32_t x = 2463534242u;
+    for (int i = 0; i < COUNT; i++) {
+        x ^= x << 13; x ^= x >> 17; x ^= x << 5;
+        a[i] = (int32_t)(x % 2001) - 1000;
+        b[i] = (int32_t)(x >> 21) - 1024;
+        f[i] = (float)a[i] / 8;
+        px[i] = x;
+    }
+    printf("Over %d elements:\n", COUNT);
+
+    uint64_t t = bench_start();
+    int64_t s = 0;
+    for (int i = 0; i < COUNT; i++) s += a[i];
+    uint64_t loop = bench_stop(t);
+    t = bench_start();
+    int same = vec_sum_i32(a, COUNT) == s;
+    report("sum i32", loop, bench_stop(t), same);
+
+    t = bench_start();
+    int32_t m = a[0];
+    for (int i = 1; i < COUNT; i++)
+        if (a[i] > m) m = a[i];
+    loop = bench_stop(t);
+    t = bench_start();
+    same = vec_max_i32(a, COUNT) == m;
+    report("max i32", loop, bench_stop(t), same);
+
+    t = bench_start();
+    int64_t d = 0;
+    for (int i = 0; i < COUNT; i++) d += (int64_t)a[i] * b[i];
+    loop = bench_stop(t);
+    t = bench_start();
+    same = vec_dot_i32(a, b, COUNT) == d;
+    report("dot i32", loop, bench_stop(t), same);
+
+    /* Eighths below 2^21 in total add up exactly in any order */
+    t = bench_start();
+    float fs = 0;
+    for (int i = 0; i < COUNT / 16; i++) fs += f[i];
+    loop = bench_stop(t) * 16;
+    t = bench_start();
+    same = vec_sum_f32(f, COUNT / 16) == fs;
+    report("sum f32", loop, bench_stop(t) * 16, same);
+
+    uint8_t *bytes = (uint8_t *)px;
+    size_t nbytes = COUNT * sizeof(uint32_t);
+    for (size_t i = 0; i < nbytes; i++)
+        if (bytes[i] == 0xA5) bytes[i] = 0;
+    bytes[nbytes - 1] = 0xA5;
+    t = bench_start();
+    size_t at = 0;
+    while (bytes[at] != 0xA5) at++;
+    loop = bench_stop(t);
+    t = bench_start();
+    same = (uint8_t *)vec_find_byte(bytes, 0xA5, nbytes) == bytes + at;
+    report("find", loop, bench_stop(t), same);
+
+    /* Blend px over two copies of b, one each way */
+    uint32_t *dst = (uint32_t *)a;
+    memcpy(dst, b, nbytes);
+    t = bench_start();
+    for (int i = 0; i < COUNT; i++) {
+        uint32_t s = px[i], d = (uint32_t)b[i], al = s >> 24, r = 0;
+        for (int sh = 0; sh < 32; sh += 8) {
+            uint32_t v = ((s >> sh) & 0xFF) * al +
+                         ((d >> sh) & 0xFF) * (255 - al) + 128;
+            r |= ((v + (v >> 8)) >> 8) << sh;
+        }
+        b[i] = (int32_t)r;
+    }
+    loop = bench_stop(t);
+    t = bench_start();
+    vec_blend(dst, px, COUNT);
+    uint64_t ns = bench_stop(t);
+    report("blend", loop, ns, memcmp(dst, b, nbytes) == 0);
+
+    t = bench_start();
+    for (int i = 0; i < COUNT; i++) px[i] ^= (uint32_t)b[i];
+    loop = bench_stop(t);
+    t = bench_start();
+    vec_xor(px, b, nbytes);
+    ns = bench_stop(t);
+    /* Twice over: px is back to what it was */
+    report("xor", loop, ns, vec_find_byte(px, 0xA5, nbytes) ==
+                            (void *)(bytes + at));
+
+    free(px);
+    free(f);
+    free(b);
+    free(a);
+    return 0;
+}
@@ -0,0 +1,245 @@
+/*
+ * vec.c — Array kernels for user programs
+ *
+ * The kernels (memops_<arch>) take whole 32-byte blocks and leave
+ * their lanes in a small array; this folds the lanes and does the
+ * remainders, and the whole job where there are no kernels. The
+ * folding order is fixed, so a result only depends on the input.
+ */
+
+#include "vec.h"
+#include "cpu.h"
+
+#if defined(__aarch64__) || defined(__x86_64__)
+#define HAVE_VEC_KERNELS 1
+void vec_sum_i32_blocks(INT64 lanes[2], const INT32 *p, UINTN blocks);
+void vec_min_i32_blocks(INT32 lanes[4], const INT32 *p, UINTN blocks);
+void vec_max_i32_blocks(INT32 lanes[4], const INT32 *p, UINTN blocks);
+void vec_sum_f32_blocks(float lanes[4], const float *p, UINTN blocks);
+void vec_min_f32_blocks(float lanes[4], const float *p, UINTN blocks);
+void vec_max_f32_blocks(float lanes[4], const float *p, UINTN blocks);
+void vec_dot_f32_blocks(float lanes[4], const float *a, const float *b,
+                        UINTN blocks);
+void vec_xor_blocks(void *dst, const void *src, UINTN blocks);
+UINTN vec_find_blocks(const void *p, UINTN blocks, UINT32 c);
+void vec_blend_blocks(UINT32 *dst, const UINT32 *src, UINTN blocks);
+#endif
+/* SSE2 has no signed 32-bit multiply */
+#ifdef __aarch64__
+#define HAVE_DOT_I32_KERNEL 1
+void vec_dot_i32_blocks(INT64 lanes[2], const INT32 *a, const INT32 *b,
+                        UINTN blocks);
+#endif
+
+#define VEC_BYTES 32                /* a kernel block */
+#define VEC_WORDS (VEC_BYTES / 4)   /* int32s or floats in one */
+
+#ifdef HAVE_VEC_KERNELS
+static int vec_on(void) {
+    return cpu_has(CPU_SIMD);
+}
+#endif
+
+INT64 vec_sum_i32(const INT32 *a, UINTN n) {
+    INT64 s = 0;
+    UINTN i = 0;
+#ifdef HAVE_VEC_KERNELS
+    UINTN blocks = vec_on() ? n / VEC_WORDS : 0;
+    if (blocks) {
+        INT64 l[2];
+        vec_sum_i32_blocks(l, a, blocks);
+        s = l[0] + l[1];
+        i = blocks * VEC_WORDS;
+    }
+#endif
+    for (; i < n; i++) s += a[i];
+    return s;
+}
+
+INT32 vec_min_i32(const INT32 *a, UINTN n) {
+    if (n == 0) return 0;
+    INT32 m = a[0];
+    UINTN i = 1;
+#ifdef HAVE_VEC_KERNELS
+    UINTN blocks = vec_on() ? n / VEC_WORDS : 0;
+    if (blocks) {
+        INT32 l[4];
+        vec_min_i32_blocks(l, a, blocks);
+        for (int k = 0; k < 4; k++)
+            if (l[k] < m) m = l[k];
+        i = blocks * VEC_WORDS;
+    }
+#endif
+    for (; i < n; i++)
+        if (a[i] < m) m = a[i];
+    return m;
+}
+
+INT32 vec_max_i32(const INT32 *a, UINTN n) {
+    if (n == 0) return 0;
+    INT32 m = a[0];
+    UINTN i = 1;
+#ifdef HAVE_VEC_KERNELS
+    UINTN blocks = vec_on() ? n / VEC_WORDS : 0;
+    if (blocks) {
+        INT32 l[4];
+        vec_max_i32_blocks(l, a, blocks);
+        for (int k = 0; k < 4; k++)
+            if (l[k] > m) m = l[k];
+        i = blocks * VEC_WORDS;
+    }
+#endif
+    for (; i < n; i++)
+        if (a[i] > m) m = a[i];
+    return m;
+}
+
+INT64 vec_dot_i32(const INT32 *a, const INT32 *b, UINTN n) {
+    UINT64 s = 0;                   /* wraps rather than overflows */
+    UINTN i = 0;
+#ifdef HAVE_DOT_I32_KERNEL
+    UINTN blocks = vec_on() ? n / VEC_WORDS : 0;
+    if (blocks) {
+        INT64 l[2];
+        vec_dot_i32_blocks(l, a, b, blocks);
+        s = (UINT64)l[0] + (UINT64)l[1];
+        i = blocks * VEC_WORDS;
+    }
+#endif
+    for (; i < n; i++) s += (UINT64)((INT64)a[i] * b[i]);
+    return (INT64)s;
+}
+
+float vec_sum_f32(const float *a, UINTN n) {
+    float s = 0;
+    UINTN i = 0;
+#ifdef HAVE_VEC_KERNELS
+    UINTN blocks = vec_on() ? n / VEC_WORDS : 0;
+    if (blocks) {
+        float l[4];
+        vec_sum_f32_blocks(l, a, blocks);
+        s = (l[0] + l[1]) + (l[2] + l[3]);
+        i = blocks * VEC_WORDS;
+    }
+#endif
+    for (; i < n; i++) s += a[i];
+    return s;
+}
+
+float vec_min_f32(const float *a, UINTN n) {
+    if (n == 0) return 0;
+    float m = a[0];
+    UINTN i = 1;
+#ifdef HAVE_VEC_KERNELS
+    UINTN blocks = vec_on() ? n / VEC_WORDS : 0;
+    if (blocks) {
+        float l[4];
+        vec_min_f32_blocks(l, a, blocks);
+        for (int k = 0; k < 4; k++)
+            if (l[k] < m) m = l[k];
+        i = blocks * VEC_WORDS;
+    }
+#endif
+    for (; i < n; i++)
+        if (a[i] < m) m = a[i];
+    return m;
+}
+
+float vec_max_f32(const float *a, UINTN n) {
+    if (n == 0) return 0;
+    float m = a[0];
+    UINTN i = 1;
+#ifdef HAVE_VEC_KERNELS
+    UINTN blocks = vec_on() ? n / VEC_WORDS : 0;
+    if (blocks) {
+        float l[4];
+        vec_max_f32_blocks(l, a, blocks);
+        for (int k = 0; k < 4; k++)
+            if (l[k] > m) m = l[k];
+        i = blocks * VEC_WORDS;
+    }
+#endif
+    for (; i < n; i++)
+        if (a[i] > m) m = a[i];
+    return m;
+}
+
+float vec_dot_f32(const float *a, const float *b, UINTN n) {
+    float s = 0;
+    UINTN i = 0;
+#ifdef HAVE_VEC_KERNELS
+    UINTN blocks = vec_on() ? n / VEC_WORDS : 0;
+    if (blocks) {
+        float l[4];
+        vec_dot_f32_blocks(l, a, b, blocks);
+        s = (l[0] + l[1]) + (l[2] + l[3]);
+        i = blocks * VEC_WORDS;
+    }
+#endif
+    for (; i < n; i++) s += a[i] * b[i];
+    return s;
+}
+
+void *vec_find_byte(const void *p, int c, UINTN n) {
+    const UINT8 *s = p;
+    UINT8 b = (UINT8)c;
+    UINTN i = 0;
+#ifdef HAVE_VEC_KERNELS
+    UINTN blocks = vec_on() ? n / VEC_BYTES : 0;
+    if (blocks)
+        i = vec_find_blocks(s, blocks, b) * VEC_BYTES;
+#endif
+    for (; i < n; i++)
+        if (s[i] == b) return (void *)(s + i);
+    return NULL;
+}
+
+/* The kernels store 16 bytes at a time to dst, which on AArch64 must
+   be aligned for Device memory such as a framebuffer */
+void vec_xor(void *dst, const void *src, UINTN n) {
+    UINT8 *d = dst;
+    const UINT8 *s = src;
+    while (n && ((UINTN)d & 15)) {
+        *d++ ^= *s++;
+        n--;
+    }
+#ifdef HAVE_VEC_KERNELS
+    UINTN blocks = vec_on() ? n / VEC_BYTES : 0;
+    if (blocks) {
+        vec_xor_blocks(d, s, blocks);
+        d += blocks * VEC_BYTES;
+        s += blocks * VEC_BYTES;
+        n -= blocks * VEC_BYTES;
+    }
+#endif
+    while (n--) *d++ ^= *s++;
+}
+
+static UINT32 blend_pixel(UINT32 d, UINT32 s) {
+    UINT32 a = s >> 24, r = 0;
+    for (int sh = 0; sh < 32; sh += 8) {
+        UINT32 t = ((s >> sh) & 0xFF) * a + ((d >> sh) & 0xFF) * (255 - a)
+                 + 128;
+        r |= ((t + (t >> 8)) >> 8) << sh;
+    }
+    return r;
+}
+
+void vec_blend(UINT32 *dst, const UINT32 *src, UINTN n) {
+    while (n && ((UINTN)dst & 15)) {
+        *dst = blend_pixel(*dst, *src++);
+        dst++;
+        n--;
+    }
+#ifdef HAVE_VEC_KERNELS
+    UINTN blocks = vec_on() ? n / VEC_WORDS : 0;
+    if (blocks) {
+        vec_blend_blocks(dst, src, blocks);
+        dst += blocks * VEC_WORDS;
+        src += blocks * VEC_WORDS;
+        n -= blocks * VEC_WORDS;
+    }
+#endif
+    for (; n; n--, dst++)
+        *dst = blend_pixel(*dst, *src++);
+}
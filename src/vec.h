@@ -0,0 +1,38 @@
+/*
+ * vec.h — Array kernels for user programs: sums, minima, maxima and
+ * dot products over int32 and float, byte search, XOR and pixel blend
+ *
+ * TCC compiles user code to scalar instructions only, so these run the
+ * hot loops on SSE2 or NEON (memops_<arch>) and plain C otherwise.
+ * Float results are summed in several lanes at once, so their last
+ * bits may differ from a plain loop's. Empty arrays give 0.
+ * src/user-headers/survival.h mirrors these.
+ */
+#ifndef VEC_H
+#define VEC_H
+
+#include "boot.h"
+
+INT64 vec_sum_i32(const INT32 *a, UINTN n);
+INT32 vec_min_i32(const INT32 *a, UINTN n);
+INT32 vec_max_i32(const INT32 *a, UINTN n);
+/* Products summed in 64 bits (wrapping past it) */
+INT64 vec_dot_i32(const INT32 *a, const INT32 *b, UINTN n);
+
+float vec_sum_f32(const float *a, UINTN n);
+/* Not for arrays holding NaNs, where the lanes disagree */
+float vec_min_f32(const float *a, UINTN n);
+float vec_max_f32(const float *a, UINTN n);
+float vec_dot_f32(const float *a, const float *b, UINTN n);
+
+/* First byte c among the n at p, as memchr() */
+void *vec_find_byte(const void *p, int c, UINTN n);
+
+/* dst[i] ^= src[i] over n bytes */
+void vec_xor(void *dst, const void *src, UINTN n);
+
+/* Source over: each byte of dst[i] becomes (s*a + d*(255-a)) / 255
+   rounded, a being the top byte of src[i], the top byte too */
+void vec_blend(UINT32 *dst, const UINT32 *src, UINTN n);
+
+#endif /* VEC_H */
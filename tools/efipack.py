@@ -0,0 +1,100 @@
+#!/usr/bin/env python3
+"""
+efipack.py — Pack survival.efi as the payload of the efistub.c loader.
+
+make COMPRESS=1 links the loader (src/efistub.c) with the C source this
+writes: the image as one LZ4 block in the format src/lz4.c reads, plus
+its unpacked size (src/efistub.h names the symbols).  The search is the
+same greedy one as lz4_compress(), but remembers every position rather
+than one per hash slot, so the build packs a little tighter than an F6
+rebuild does.  The F6 rebuild writes the same source itself.
+
+Usage:
+    python3 efipack.py IMAGE OUTPUT.c
+
+Prints the unpacked and packed sizes.
+"""
+
+import sys
+
+MIN_MATCH = 4
+LAST_LITERALS = 5
+MF_LIMIT = 12
+MAX_OFFSET = 65535
+
+
+def put_len(out, n):
+    while n >= 255:
+        out.append(255)
+        n -= 255
+    out.append(n)
+
+
+def sequence(out, lit, mlen, off):
+    """One sequence: literals, then a match of mlen (0 for none)."""
+    token = min(len(lit), 15) << 4
+    if mlen:
+        token |= min(mlen - MIN_MATCH, 15)
+    out.append(token)
+    if len(lit) >= 15:
+        put_len(out, len(lit) - 15)
+    out += lit
+    if mlen:
+        out += bytes((off & 0xFF, off >> 8))
+        if mlen - MIN_MATCH >= 15:
+            put_len(out, mlen - MIN_MATCH - 15)
+
+
+def lz4_compress(data):
+    out = bytearray()
+    last = {}
+    n = len(data)
+    ip = anchor = 0
+    mflimit = n - MF_LIMIT
+    matchlimit = n - LAST_LITERALS
+    while ip < mflimit:
+        key = data[ip:ip + 4]
+        ref = last.get(key)
+        last[key] = ip
+        if ref is None or ip - ref > MAX_OFFSET:
+            ip += 1
+            continue
+        while ip > anchor and ref > 0 and data[ip - 1] == data[ref - 1]:
+            ip -= 1
+            ref -= 1
+        mp = ip + MIN_MATCH
+        rp = ref + MIN_MATCH
+        while mp < matchlimit and data[mp] == data[rp]:
+            mp += 1
+            rp += 1
+        sequence(out, data[anchor:ip], mp - ip, ip - ref)
+        for p in range(ip + 1, min(mp, mflimit)):
+            last[data[p:p + 4]] = p
+        ip = anchor = mp
+    sequence(out, data[anchor:], 0, 0)
+    return bytes(out)
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.exit("usage: efipack.py IMAGE OUTPUT.c")
+    with open(sys.argv[1], "rb") as f:
+        image = f.read()
+    packed = lz4_compress(image)
+    with open(sys.argv[2], "w") as f:
+        f.write("/* Generated by tools/efipack.py from %s */\n"
+                % sys.argv[1].replace("\\", "/").split("/")[-1])
+        f.write('#include "efistub.h"\n\n')
+        f.write("const UINT32 efistub_raw_size = %d;\n" % len(image))
+        f.write("const UINT32 efistub_packed_size = %d;\n" % len(packed))
+        f.write("const UINT8 efistub_packed[] = {\n")
+        for i in range(0, len(packed), 16):
+            f.write("    " + ",".join(str(b) for b in packed[i:i + 16]) + ",\n")
+        f.write("};\n")
+    print("%s: %d bytes, packed %d (%d%%)"
+          % (sys.argv[1], len(image), len(packed),
+             len(packed) * 100 // max(len(image), 1)))
+
+
+if __name__ == "__main__":
+    main()
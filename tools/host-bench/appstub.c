@@ -0,0 +1,90 @@
+/*
+ * appstub.c — host check of the entry point F7 adds to applications
+ *
+ * With no argument, prints TCC_APP_STUB (src/tcc.h) followed by a
+ * main() and a local __survival_run(), a complete program for a
+ * cross-compiler from tools/tinycc to link as an efiapp DLL.  Given that
+ * image, checks that it exports TCC_APP_MARK, which efiapp.c sets before
+ * starting it.  Exits non-zero if not.
+ */
+
+#include "tcc.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+static unsigned char *s_img;
+static size_t s_size;
+
+static unsigned rd16(size_t off) {
+    return off + 2 <= s_size ? (unsigned)(s_img[off] | s_img[off + 1] << 8) : 0;
+}
+
+static unsigned rd32(size_t off) {
+    return off + 4 <= s_size ? rd16(off) | rd16(off + 2) << 16 : 0;
+}
+
+/* File offset of rva, 0 if no section holds it */
+static size_t rva_off(size_t sects, unsigned nsects, unsigned rva) {
+    for (unsigned i = 0; i < nsects; i++) {
+        size_t s = sects + i * 40;
+        unsigned vsize = rd32(s + 8), va = rd32(s + 12);
+        unsigned rsize = rd32(s + 16), raw = rd32(s + 20);
+        if (rva >= va && rva < va + (vsize > rsize ? vsize : rsize))
+            return raw + (rva - va);
+    }
+    return 0;
+}
+
+static int exports_mark(const char *path) {
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        fprintf(stderr, "%s: cannot open\n", path);
+        return 0;
+    }
+    fseek(f, 0, SEEK_END);
+    s_size = (size_t)ftell(f);
+    fseek(f, 0, SEEK_SET);
+    s_img = malloc(s_size ? s_size : 1);
+    if (!s_img || fread(s_img, 1, s_size, f) != s_size) {
+        fclose(f);
+        fprintf(stderr, "%s: cannot read\n", path);
+        return 0;
+    }
+    fclose(f);
+
+    size_t pe = rd32(0x3c);
+    if (rd32(pe) != 0x4550 || rd16(pe + 24) != 0x20b) {
+        fprintf(stderr, "%s: not a PE32+ image\n", path);
+        return 0;
+    }
+    unsigned nsects = rd16(pe + 6);
+    size_t sects = pe + 24 + rd16(pe + 20);
+    unsigned dir = rd32(pe + 24 + 112);     /* export directory RVA */
+    size_t ed = dir ? rva_off(sects, nsects, dir) : 0;
+    if (!ed) {
+        fprintf(stderr, "%s: no export table\n", path);
+        return 0;
+    }
+    unsigned count = rd32(ed + 24);
+    size_t names = rva_off(sects, nsects, rd32(ed + 32));
+    for (unsigned i = 0; names && i < count; i++) {
+        size_t n = rva_off(sects, nsects, rd32(names + 4 * i));
+        size_t len = strlen(TCC_APP_MARK);
+        if (n && n + len < s_size && memcmp(s_img + n, TCC_APP_MARK, len + 1) == 0)
+            return 1;
+    }
+    fprintf(stderr, "%s: %s is not exported\n", path, TCC_APP_MARK);
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fputs(TCC_APP_STUB, stdout);
+        fputs("int __survival_run(int (*f)(void)) { return f(); }\n"
+              "int main(void) { return 0; }\n", stdout);
+        return 0;
+    }
+    return exports_mark(argv[1]) ? 0 : 1;
+}
@@ -0,0 +1,1536 @@
+/*
+ * bench.c — Host benchmarks for the portable exFAT and NTFS drivers
+ * and float conversions
+ *
+ * `make host-bench` builds src/exfat.c, src/ntfs.c, src/bcache.c,
+ * src/runmap.c and src/dirsort.c with the host compiler over a block
+ * device backed by an image file, and times them on the shapes that
+ * have been slow before: a deep tree, a directory of 100k files, a
+ * fragmented large file and a nearly full volume. The exFAT images are
+ * made by the driver itself (which is timed too). There is no NTFS
+ * formatter here, so an NTFS image given with --ntfs, like an exFAT one
+ * given with --exfat, gets the generic walk: list every directory, read
+ * every file, look paths up at random.
+ *
+ * Times depend on the host; the other numbers do not. Each measurement
+ * counts the device reads and writes it made and the block cache's hits
+ * and misses (bcache_create is wrapped at link time to find each
+ * volume's cache), so a cache or allocator change shows up as fewer
+ * bytes read per op or a better hit rate whatever machine runs it.
+ *
+ * The nospace group is a test rather than a timing: it runs small
+ * volumes out of space through every write path and has exfat_check()
+ * look at the result, which must find nothing wrong, then or after a
+ * remount. It also checks that the block cache keeps a dirty block it
+ * cannot write back. A failure is listed on stderr and makes the exit
+ * status 1; `make host-test` runs only that group.
+ *
+ * The fpconv group holds src/fpconv.c, behind the shim's strtod() and
+ * printf(), to the host libc on a few million random doubles and texts,
+ * the midpoints between neighbouring doubles among them, then times the
+ * two on the same inputs. A mismatch is a failure like the above.
+ *
+ * Output: one JSON document on stdout, a table on stderr.
+ *
+ *   host-bench [--dir DIR] [--files N] [--seed N] [--only NAME] [--keep]
+ *              [--exfat IMAGE] [--ntfs IMAGE]
+ */
+
+#include "exfat.h"
+#include "ntfs.h"
+#include "bcache.h"
+#include "fsck.h"
+#include "fpconv.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+
+#define BLOCK_SIZE 512
+
+/* ---- Block device ---- */
+
+struct dev {
+    int    fd;
+    UINT64 blocks;
+    UINT64 reads, read_bytes;
+    UINT64 writes, write_bytes;
+};
+
+static int dev_read(void *ctx, UINT64 lba, UINT32 count, void *buf)
+{
+    struct dev *d = ctx;
+    if (lba + count > d->blocks)
+        return -1;
+    char *p = buf;
+    size_t len = (size_t)count * BLOCK_SIZE;
+    off_t off = (off_t)(lba * BLOCK_SIZE);
+    while (len > 0) {
+        ssize_t n = pread(d->fd, p, len, off);
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= (size_t)n;
+        off += n;
+    }
+    d->reads++;
+    d->read_bytes += (UINT64)count * BLOCK_SIZE;
+    return 0;
+}
+
+static int dev_write(void *ctx, UINT64 lba, UINT32 count, const void *buf)
+{
+    struct dev *d = ctx;
+    if (lba + count > d->blocks)
+        return -1;
+    const char *p = buf;
+    size_t len = (size_t)count * BLOCK_SIZE;
+    off_t off = (off_t)(lba * BLOCK_SIZE);
+    while (len > 0) {
+        ssize_t n = pwrite(d->fd, p, len, off);
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= (size_t)n;
+        off += n;
+    }
+    d->writes++;
+    d->write_bytes += (UINT64)count * BLOCK_SIZE;
+    return 0;
+}
+
+/* Open an image; with size_mb, create it (sparse) at that size first */
+static int dev_open(struct dev *d, const char *path, UINT64 size_mb)
+{
+    memset(d, 0, sizeof(*d));
+    if (size_mb) {
+        d->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (d->fd < 0 || ftruncate(d->fd, (off_t)(size_mb << 20)) != 0)
+            return -1;
+    } else {
+        d->fd = open(path, O_RDWR);
+        if (d->fd < 0)
+            d->fd = open(path, O_RDONLY);
+        if (d->fd < 0)
+            return -1;
+    }
+    off_t end = lseek(d->fd, 0, SEEK_END);
+    if (end < 0)
+        return -1;
+    d->blocks = (UINT64)end / BLOCK_SIZE;
+    return 0;
+}
+
+static void dev_close(struct dev *d)
+{
+    if (d->fd >= 0)
+        close(d->fd);
+    d->fd = -1;
+}
+
+/* ---- The volume's cache ---- */
+
+struct bcache *__real_bcache_create(bcache_read_fn read_fn,
+                                    bcache_write_fn write_fn, void *ctx,
+                                    UINT32 block_size, UINT32 dev_block_size);
+struct bcache *__wrap_bcache_create(bcache_read_fn read_fn,
+                                    bcache_write_fn write_fn, void *ctx,
+                                    UINT32 block_size, UINT32 dev_block_size);
+
+static struct bcache *s_cache;          /* of the volume mounted last */
+
+struct bcache *__wrap_bcache_create(bcache_read_fn read_fn,
+                                    bcache_write_fn write_fn, void *ctx,
+                                    UINT32 block_size, UINT32 dev_block_size)
+{
+    s_cache = __real_bcache_create(read_fn, write_fn, ctx, block_size,
+                                   dev_block_size);
+    return s_cache;
+}
+
+/* ---- Measurements ---- */
+
+static struct dev *s_dev;               /* device being measured */
+static const char *s_fs = "";           /* labels of the results that follow */
+static const char *s_image = "";
+static int s_results;
+
+struct mark {
+    double t;
+    UINT64 reads, read_bytes, writes, write_bytes;
+    UINT64 hits, misses;
+};
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void mark(struct mark *m)
+{
+    memset(m, 0, sizeof(*m));
+    m->reads = s_dev->reads;
+    m->read_bytes = s_dev->read_bytes;
+    m->writes = s_dev->writes;
+    m->write_bytes = s_dev->write_bytes;
+    if (s_cache)
+        bcache_stats(s_cache, &m->hits, &m->misses);
+    m->t = now();
+}
+
+/* One result: ops operations since a, moving bytes of file data */
+static void report(const char *op, UINT64 ops, UINT64 bytes,
+                   const struct mark *a)
+{
+    struct mark b;
+    mark(&b);
+    double secs = b.t - a->t;
+    UINT64 reads = b.reads - a->reads;
+    UINT64 read_bytes = b.read_bytes - a->read_bytes;
+    UINT64 writes = b.writes - a->writes;
+    UINT64 write_bytes = b.write_bytes - a->write_bytes;
+    /* A remount in between starts a new cache: count from zero */
+    UINT64 hits = b.hits >= a->hits ? b.hits - a->hits : b.hits;
+    UINT64 misses = b.misses >= a->misses ? b.misses - a->misses : b.misses;
+    double rate = hits + misses ? (double)hits / (double)(hits + misses) : 0;
+    double per_s = secs > 0 ? (double)ops / secs : 0;
+    double rd_op = ops ? (double)read_bytes / (double)ops : 0;
+    double mb_s = secs > 0 ? (double)bytes / secs / 1e6 : 0;
+
+    printf("%s\n    {\"fs\": \"%s\", \"image\": \"%s\", \"op\": \"%s\", "
+           "\"ops\": %llu, \"seconds\": %.6f, \"ops_per_s\": %.1f, "
+           "\"bytes\": %llu, \"mb_per_s\": %.2f, "
+           "\"dev_reads\": %llu, \"dev_read_bytes\": %llu, "
+           "\"read_bytes_per_op\": %.1f, "
+           "\"dev_writes\": %llu, \"dev_write_bytes\": %llu, "
+           "\"cache_hits\": %llu, \"cache_misses\": %llu, "
+           "\"cache_hit_rate\": %.4f}",
+           s_results++ ? "," : "", s_fs, s_image, op,
+           (unsigned long long)ops, secs, per_s,
+           (unsigned long long)bytes, mb_s,
+           (unsigned long long)reads, (unsigned long long)read_bytes, rd_op,
+           (unsigned long long)writes, (unsigned long long)write_bytes,
+           (unsigned long long)hits, (unsigned long long)misses, rate);
+    fflush(stdout);
+    fprintf(stderr, "%-6s %-6s %-18s %9llu ops %11.1f/s %11.1f B/op read"
+            "  hit %5.1f%%\n", s_fs, s_image, op, (unsigned long long)ops,
+            per_s, rd_op, rate * 100);
+}
+
+/* What each image turned out to be, listed after the results */
+#define MAX_IMAGES 16
+
+static struct image_info {
+    const char *fs, *image;
+    UINT64 bytes, used;
+    UINT64 dirs, files;
+    int extents;                        /* of its largest file, -1 if none */
+} s_images[MAX_IMAGES];
+static int s_image_count;
+
+static struct image_info *image_info(void)
+{
+    if (s_image_count == MAX_IMAGES)
+        return NULL;
+    struct image_info *ii = &s_images[s_image_count++];
+    memset(ii, 0, sizeof(*ii));
+    ii->fs = s_fs;
+    ii->image = s_image;
+    ii->extents = -1;
+    return ii;
+}
+
+/* ---- Options, randomness, buffers ---- */
+
+static const char *s_dir = "build/host";
+static int s_files = 100000;            /* in the wide directory */
+static const char *s_only;
+static int s_keep;
+static UINT64 s_rng = 0x9E3779B97F4A7C15ULL;
+
+static UINT64 rng_next(void)
+{
+    s_rng ^= s_rng << 13;
+    s_rng ^= s_rng >> 7;
+    s_rng ^= s_rng << 17;
+    return s_rng;
+}
+
+static UINT8 *s_data;                   /* DATA_SIZE of pattern */
+#define DATA_SIZE (1u << 20)
+
+static int run(const char *name)
+{
+    return !s_only || strcmp(s_only, name) == 0;
+}
+
+/* ---- exFAT images ---- */
+
+static char s_img_path[1024];
+
+/* A fresh image of size_mb, formatted and mounted */
+static struct exfat_vol *ex_create(struct dev *d, const char *name,
+                                   UINT64 size_mb)
+{
+    snprintf(s_img_path, sizeof(s_img_path), "%s/%s.img", s_dir, name);
+    if (dev_open(d, s_img_path, size_mb) != 0) {
+        fprintf(stderr, "Cannot create %s\n", s_img_path);
+        return NULL;
+    }
+    if (exfat_format(dev_write, d, BLOCK_SIZE, d->blocks, name,
+                     (UINT32)rng_next()) != 0) {
+        fprintf(stderr, "Format of %s failed\n", s_img_path);
+        dev_close(d);
+        return NULL;
+    }
+    s_dev = d;
+    s_fs = "exfat";
+    s_image = name;
+    struct exfat_vol *v = exfat_mount(dev_read, dev_write, d, BLOCK_SIZE);
+    if (!v) {
+        fprintf(stderr, "Mount of %s failed\n", s_img_path);
+        dev_close(d);
+    }
+    return v;
+}
+
+/* Unmount (writing everything back) and mount again, cache cold */
+static struct exfat_vol *ex_remount(struct exfat_vol *v, struct dev *d)
+{
+    exfat_unmount(v);
+    s_cache = NULL;
+    return exfat_mount(dev_read, dev_write, d, BLOCK_SIZE);
+}
+
+static void ex_done(struct exfat_vol *v, struct dev *d)
+{
+    struct image_info *ii = &s_images[s_image_count - 1];
+    if (v) {
+        exfat_volume_info(v, &ii->bytes, &ii->used);
+        ii->used = ii->bytes - ii->used;
+        exfat_unmount(v);
+    }
+    s_cache = NULL;
+    dev_close(d);
+    if (!s_keep)
+        unlink(s_img_path);
+}
+
+/* Read a file through a handle in chunk-byte pieces; returns bytes read */
+static UINT64 ex_read_all(struct exfat_vol *v, const char *path, UINTN chunk)
+{
+    UINT64 size, total = 0;
+    struct exfat_file *f = exfat_open(v, path, &size);
+    if (!f)
+        return 0;
+    for (;;) {
+        UINTN n = chunk;
+        if (exfat_read(f, s_data, &n) != 0 || n == 0)
+            break;
+        total += n;
+    }
+    exfat_close(f);
+    return total;
+}
+
+/* A chain of DEEP_LEVELS directories, DEEP_FILES small files in each and
+ * a 1 MB file at the bottom */
+#define DEEP_LEVELS 64
+#define DEEP_FILES  8
+
+static void bench_deep(void)
+{
+    struct dev d;
+    struct exfat_vol *v = ex_create(&d, "deep", 256);
+    if (!v) return;
+    struct image_info *ii = image_info();
+
+    char path[512], file[600];
+    int len = 0;
+    UINT64 bytes = 0, ops = 0;
+    struct mark m;
+    mark(&m);
+    for (int l = 0; l < DEEP_LEVELS; l++) {
+        len += snprintf(path + len, sizeof(path) - (size_t)len, "/d%02d", l);
+        if (exfat_mkdir(v, path) != 0) {
+            fprintf(stderr, "mkdir %s failed\n", path);
+            break;
+        }
+        ops++;
+        for (int f = 0; f < DEEP_FILES; f++) {
+            snprintf(file, sizeof(file), "%s/f%d.txt", path, f);
+            if (exfat_writefile(v, file, s_data + f, 1024) == 0) {
+                ops++;
+                bytes += 1024;
+            }
+        }
+    }
+    snprintf(file, sizeof(file), "%s/big.bin", path);
+    if (exfat_writefile(v, file, s_data, DATA_SIZE) == 0) {
+        ops++;
+        bytes += DATA_SIZE;
+    }
+    report("create", ops, bytes, &m);
+    ii->dirs = DEEP_LEVELS;
+    ii->files = (UINT64)DEEP_LEVELS * DEEP_FILES + 1;
+
+    v = ex_remount(v, &d);
+    if (!v) { ex_done(v, &d); return; }
+
+    mark(&m);
+    for (int i = 0; i < 1000; i++)
+        exfat_exists(v, file);
+    report("lookup_deep", 1000, 0, &m);
+
+    static struct fs_entry entries[DEEP_FILES + 4];
+    mark(&m);
+    ops = 0;
+    for (int pass = 0; pass < 10; pass++) {
+        len = 0;
+        for (int l = 0; l < DEEP_LEVELS; l++) {
+            len += snprintf(path + len, sizeof(path) - (size_t)len, "/d%02d", l);
+            if (exfat_readdir(v, path, entries, DEEP_FILES + 4) >= 0)
+                ops++;
+        }
+    }
+    report("readdir_levels", ops, 0, &m);
+
+    mark(&m);
+    bytes = 0;
+    for (int i = 0; i < 20; i++)
+        bytes += ex_read_all(v, file, 65536);
+    report("read_deep", 20, bytes, &m);
+
+    ex_done(v, &d);
+}
+
+/* One directory of s_files empty files */
+static void bench_wide(void)
+{
+    struct dev d;
+    struct exfat_vol *v = ex_create(&d, "wide", 256);
+    if (!v) return;
+    struct image_info *ii = image_info();
+
+    char name[64];
+    static const UINT8 empty[1];
+    exfat_mkdir(v, "/wide");
+    struct mark m;
+    mark(&m);
+    int made = 0;
+    for (int i = 0; i < s_files; i++) {
+        snprintf(name, sizeof(name), "/wide/file%06d.dat", i);
+        if (exfat_writefile(v, name, empty, 0) != 0) {
+            fprintf(stderr, "create %s failed\n", name);
+            break;
+        }
+        made++;
+    }
+    report("create", (UINT64)made, 0, &m);
+    ii->dirs = 1;
+    ii->files = (UINT64)made;
+    if (made == 0) { ex_done(v, &d); return; }
+
+    v = ex_remount(v, &d);
+    if (!v) { ex_done(v, &d); return; }
+
+    mark(&m);
+    UINT64 count = 0;
+    struct exfat_dir *dir = exfat_opendir(v, "/wide");
+    struct fs_entry e;
+    while (dir && exfat_readdir_next(dir, &e) == 1)
+        count++;
+    if (dir) exfat_closedir(dir);
+    report("enumerate", count, 0, &m);
+
+    struct fs_entry *entries = malloc(sizeof(*entries) * (size_t)(made + 16));
+    if (entries) {
+        mark(&m);
+        int n = exfat_readdir(v, "/wide", entries, made + 16);
+        report("readdir_sorted", n > 0 ? (UINT64)n : 0, 0, &m);
+        free(entries);
+    }
+
+    mark(&m);
+    for (int i = 0; i < 10000; i++) {
+        snprintf(name, sizeof(name), "/wide/file%06d.dat",
+                 (int)(rng_next() % (UINT64)made));
+        exfat_exists(v, name);
+    }
+    report("lookup_hit", 10000, 0, &m);
+
+    mark(&m);
+    for (int i = 0; i < 2000; i++) {
+        snprintf(name, sizeof(name), "/wide/none%06d.dat", i);
+        exfat_exists(v, name);
+    }
+    report("lookup_miss", 2000, 0, &m);
+
+    mark(&m);
+    for (int i = 0; i < 1000; i++) {
+        snprintf(name, sizeof(name), "/wide/file%06d.dat",
+                 (int)(rng_next() % (UINT64)made));
+        exfat_delete(v, name);
+        exfat_writefile(v, name, empty, 0);
+    }
+    report("replace", 1000, 0, &m);
+
+    ex_done(v, &d);
+}
+
+/* A large file written into the holes left by deleting every other one
+ * of a volume's worth of small files */
+#define FRAG_PIECE (16 * 1024)
+#define FRAG_MAX_EXTENTS 65536
+
+static void bench_frag(void)
+{
+    struct dev d;
+    struct exfat_vol *v = ex_create(&d, "frag", 256);
+    if (!v) return;
+    struct image_info *ii = image_info();
+
+    char name[64];
+    exfat_mkdir(v, "/fill");
+    int pieces = 0;
+    for (;; pieces++) {
+        snprintf(name, sizeof(name), "/fill/p%05d", pieces);
+        if (exfat_writefile(v, name, s_data, FRAG_PIECE) != 0)
+            break;
+    }
+    exfat_delete(v, name);              /* may have been left half made */
+    for (int i = 0; i < pieces; i += 2) {
+        snprintf(name, sizeof(name), "/fill/p%05d", i);
+        exfat_delete(v, name);
+    }
+
+    /* Nine tenths of what was freed, so it cannot all be contiguous */
+    UINT64 size = (UINT64)(pieces / 2) * FRAG_PIECE * 9 / 10;
+    struct mark m;
+    mark(&m);
+    UINT64 bytes = 0;
+    struct exfat_file *f = exfat_create(v, "/big.bin");
+    while (f && bytes < size) {
+        UINTN n = size - bytes > DATA_SIZE ? DATA_SIZE : (UINTN)(size - bytes);
+        if (exfat_write(f, s_data, n) != 0)
+            break;
+        bytes += n;
+    }
+    if (f) exfat_close(f);
+    report("write_fragmented", 1, bytes, &m);
+
+    struct fs_extent *ext = malloc(sizeof(*ext) * FRAG_MAX_EXTENTS);
+    if (ext) {
+        ii->extents = exfat_extents(v, "/big.bin", ext, FRAG_MAX_EXTENTS);
+        free(ext);
+    }
+    ii->dirs = 1;
+    ii->files = (UINT64)(pieces / 2) + 1;
+
+    v = ex_remount(v, &d);
+    if (!v) { ex_done(v, &d); return; }
+
+    mark(&m);
+    bytes = ex_read_all(v, "/big.bin", DATA_SIZE);
+    report("read_seq", bytes / DATA_SIZE + 1, bytes, &m);
+
+    UINT64 fsize;
+    f = exfat_open(v, "/big.bin", &fsize);
+    mark(&m);
+    bytes = 0;
+    for (int i = 0; f && fsize >= 4096 && i < 4000; i++) {
+        UINTN n = 4096;
+        exfat_seek(f, rng_next() % (fsize / 4096) * 4096);
+        if (exfat_read(f, s_data, &n) == 0)
+            bytes += n;
+    }
+    report("read_rand_4k", 4000, bytes, &m);
+    if (f) exfat_close(f);
+
+    mark(&m);
+    for (int i = 0; i < 1000; i++) {
+        f = exfat_open(v, "/big.bin", &fsize);
+        if (f) exfat_close(f);
+    }
+    report("open_close", 1000, 0, &m);
+
+    ex_done(v, &d);
+}
+
+/* A volume filled to the last cluster */
+static void bench_full(void)
+{
+    struct dev d;
+    struct exfat_vol *v = ex_create(&d, "full", 128);
+    if (!v) return;
+    struct image_info *ii = image_info();
+
+    char name[64];
+    exfat_mkdir(v, "/big");
+    exfat_mkdir(v, "/small");
+    struct mark m;
+    mark(&m);
+    int big = 0;
+    for (;; big++) {
+        snprintf(name, sizeof(name), "/big/b%04d", big);
+        if (exfat_writefile(v, name, s_data, DATA_SIZE) != 0)
+            break;
+    }
+    exfat_delete(v, name);
+    report("fill_1m", (UINT64)big, (UINT64)big * DATA_SIZE, &m);
+
+    /* Free a few at random and fill those up again in 4 KB files */
+    for (int i = 0; i < 8 && big > 0; i++) {
+        snprintf(name, sizeof(name), "/big/b%04d",
+                 (int)(rng_next() % (UINT64)big));
+        exfat_delete(v, name);
+    }
+    mark(&m);
+    int small = 0;
+    for (;; small++) {
+        snprintf(name, sizeof(name), "/small/s%05d", small);
+        if (exfat_writefile(v, name, s_data, 4096) != 0)
+            break;
+    }
+    exfat_delete(v, name);
+    report("create_near_full", (UINT64)small, (UINT64)small * 4096, &m);
+    ii->dirs = 2;
+    ii->files = (UINT64)big + (UINT64)small;
+
+    v = ex_remount(v, &d);
+    if (!v) { ex_done(v, &d); return; }
+
+    UINT64 total, free_bytes;
+    mark(&m);
+    for (int i = 0; i < 100; i++)
+        exfat_volume_info(v, &total, &free_bytes);
+    report("volume_info", 100, 0, &m);
+
+    mark(&m);
+    for (int i = 0; i < 200; i++) {
+        snprintf(name, sizeof(name), "/small/x%05d", i);
+        exfat_writefile(v, name, s_data, 4096);
+    }
+    report("write_when_full", 200, 0, &m);
+
+    ex_done(v, &d);
+}
+
+/* ---- Out of space ---- */
+
+static int s_failures;
+static int s_problems;                  /* found by the check running */
+
+static void nospace_problem(struct fs_check *c, const char *path,
+                            const char *what)
+{
+    (void)c;
+    fprintf(stderr, "    %s: %s\n", path, what);
+    s_problems++;
+}
+
+static void expect(int ok, const char *step)
+{
+    fprintf(stderr, "%-6s %-11s %-44s %s\n", s_fs, s_image, step,
+            ok ? "ok" : "FAILED");
+    if (!ok)
+        s_failures++;
+}
+
+/* The volume is consistent, and is again after a remount */
+static struct exfat_vol *expect_clean(struct exfat_vol *v, struct dev *d,
+                                      const char *step)
+{
+    char what[96];
+    for (int pass = 0; pass < 2 && v; pass++) {
+        struct fs_check c;
+        memset(&c, 0, sizeof(c));
+        c.problem = nospace_problem;
+        s_problems = 0;
+        int rc = exfat_check(v, &c);
+        snprintf(what, sizeof(what), "%s: check%s", step,
+                 pass ? " after remount" : "");
+        expect(rc == 0 && !c.io_error && s_problems == 0, what);
+        if (pass == 0)
+            v = ex_remount(v, d);
+    }
+    if (!v)
+        expect(0, "remount");
+    return v;
+}
+
+/* The file holds size bytes of s_data from offset skew, repeating */
+static int same_data(struct exfat_vol *v, const char *path, UINT64 size,
+                     UINTN skew)
+{
+    UINTN n;
+    UINT8 *p = exfat_readfile(v, path, &n);
+    int ok = p && n == size;
+    for (UINTN i = 0; ok && i < n; i += DATA_SIZE) {
+        UINTN len = n - i < DATA_SIZE ? n - i : DATA_SIZE;
+        ok = memcmp(p + i, s_data + skew, len) == 0;
+    }
+    free(p);
+    return ok;
+}
+
+/* Stream DATA_SIZE pieces until a write fails; returns bytes accepted */
+static UINT64 stream_until_full(struct exfat_file *f, UINT64 limit)
+{
+    UINT64 bytes = 0;
+    while (bytes < limit && exfat_write(f, s_data, DATA_SIZE) == 0)
+        bytes += DATA_SIZE;
+    return bytes;
+}
+
+#define NOSPACE_OPS 400
+#define NOSPACE_BIG 12                  /* MB in the largest writefile */
+
+static void bench_nospace(void)
+{
+    struct dev d;
+    UINT64 size;
+    UINT8 *big = malloc((size_t)NOSPACE_BIG * DATA_SIZE);
+    if (!big) { s_failures++; return; }
+    for (int i = 0; i < NOSPACE_BIG; i++)
+        memcpy(big + (size_t)i * DATA_SIZE, s_data, DATA_SIZE);
+    struct exfat_vol *v = ex_create(&d, "nospace", 16);
+    if (!v) { free(big); s_failures++; return; }
+    image_info();
+
+    /* A streamed write past the end of the volume keeps what reached
+       the disk, the rest of its clusters freed */
+    struct exfat_file *f = exfat_create(v, "/a.bin");
+    stream_until_full(f, 64ULL << 20);
+    expect(exfat_close(f) != 0, "stream until full: close fails");
+    v = expect_clean(v, &d, "stream until full");
+    if (!v) goto out;
+    size = exfat_file_size(v, "/a.bin");
+    expect(size > 0 && size % DATA_SIZE == 0 &&
+           same_data(v, "/a.bin", size, 0), "stream until full: data kept");
+    expect(exfat_delete(v, "/a.bin") == 0, "stream until full: delete");
+
+    /* A preallocation larger than the volume reserves nothing; the
+       same stream after it is kept the same way */
+    f = exfat_create(v, "/a.bin");
+    expect(exfat_preallocate(f, 32ULL << 20) != 0, "preallocate: fails");
+    stream_until_full(f, 64ULL << 20);
+    expect(exfat_close(f) != 0, "preallocate: close fails");
+    v = expect_clean(v, &d, "preallocate then stream");
+    if (!v) goto out;
+    expect(exfat_delete(v, "/a.bin") == 0, "preallocate: delete");
+
+    /* One that fits, with writes running on past it until full */
+    f = exfat_create(v, "/a.bin");
+    expect(exfat_preallocate(f, 4 * DATA_SIZE) == 0, "preallocate 4 MB");
+    stream_until_full(f, 64ULL << 20);
+    expect(exfat_close(f) != 0, "preallocate 4 MB: close fails");
+    v = expect_clean(v, &d, "preallocate 4 MB then stream");
+    if (!v) goto out;
+    size = exfat_file_size(v, "/a.bin");
+    expect(size > 4 * DATA_SIZE && same_data(v, "/a.bin", size, 0),
+           "preallocate 4 MB: data kept");
+    expect(exfat_delete(v, "/a.bin") == 0, "preallocate 4 MB: delete");
+
+    /* And one written short of its reservation */
+    f = exfat_create(v, "/a.bin");
+    expect(exfat_preallocate(f, 4 * DATA_SIZE) == 0 &&
+           exfat_write(f, s_data, DATA_SIZE) == 0 && exfat_close(f) == 0,
+           "preallocate 4 MB, write 1 MB");
+    v = expect_clean(v, &d, "preallocate 4 MB, write 1 MB");
+    if (!v) goto out;
+    expect(same_data(v, "/a.bin", DATA_SIZE, 0), "write 1 MB: data kept");
+    expect(exfat_delete(v, "/a.bin") == 0, "write 1 MB: delete");
+
+    /* A rewrite that does not fit leaves the old file as it was */
+    expect(exfat_writefile(v, "/old.bin", s_data + 1, DATA_SIZE) == 0,
+           "rewrite: old file");
+    expect(exfat_writefile(v, "/fill.bin", big, 12 * DATA_SIZE) == 0,
+           "rewrite: fill");
+    expect(exfat_writefile(v, "/old.bin", big, 8 * DATA_SIZE) != 0,
+           "rewrite: larger fails");
+    v = expect_clean(v, &d, "rewrite larger");
+    if (!v) goto out;
+    expect(exfat_exists(v, "/old.bin") &&
+           same_data(v, "/old.bin", DATA_SIZE, 1), "rewrite: old data kept");
+
+    /* A streamed rewrite that runs out goes back to the old layout */
+    f = exfat_overwrite(v, "/old.bin");
+    stream_until_full(f, 64ULL << 20);
+    expect(exfat_close(f) != 0, "stream rewrite: close fails");
+    v = expect_clean(v, &d, "stream rewrite");
+    if (!v) goto out;
+    expect(exfat_file_size(v, "/old.bin") == DATA_SIZE,
+           "stream rewrite: old size kept");
+
+    /* One that fits still goes in place */
+    expect(exfat_writefile(v, "/old.bin", s_data + 2, DATA_SIZE / 2) == 0,
+           "rewrite smaller");
+    v = expect_clean(v, &d, "rewrite smaller");
+    if (!v) goto out;
+    expect(same_data(v, "/old.bin", DATA_SIZE / 2, 2),
+           "rewrite smaller: data");
+    ex_done(v, &d);
+
+    /* Random creates, rewrites, streams and deletes on a small volume
+       that keeps running full */
+    v = ex_create(&d, "nospace_mix", 48);
+    if (!v) { free(big); s_failures++; return; }
+    image_info();
+    char name[32];
+    int bad = 0;
+    for (int op = 0; op < NOSPACE_OPS && !bad; op++) {
+        snprintf(name, sizeof(name), "/f%02d", (int)(rng_next() % 24));
+        UINT64 len = rng_next() % ((UINT64)NOSPACE_BIG * DATA_SIZE);
+        int rc = 0;
+        switch (rng_next() % 4) {
+        case 0:
+            exfat_delete(v, name);
+            break;
+        case 1:
+            rc = exfat_writefile(v, name, big, (UINTN)len);
+            break;
+        case 2:
+            f = rng_next() & 1 ? exfat_overwrite(v, name)
+                               : exfat_create(v, name);
+            if (!f) break;
+            if (rng_next() & 1)
+                exfat_preallocate(f, len);
+            while (len > 0) {
+                UINTN n = len > DATA_SIZE ? DATA_SIZE : (UINTN)len;
+                if ((rc = exfat_write(f, s_data, n)) != 0) break;
+                len -= n;
+            }
+            if (exfat_close(f) != 0) rc = -1;
+            break;
+        default:
+            rc = exfat_writefile(v, name, s_data, DATA_SIZE);
+            break;
+        }
+        if (rc == 0 && op % 50 != 49)
+            continue;
+        struct fs_check c;
+        memset(&c, 0, sizeof(c));
+        c.problem = nospace_problem;
+        s_problems = 0;
+        bad = exfat_check(v, &c) != 0 || c.io_error || s_problems != 0;
+    }
+    expect(!bad, "random writes near full");
+    v = expect_clean(v, &d, "random writes near full");
+out:
+    ex_done(v, &d);
+    free(big);
+}
+
+/* ---- Failed write-back ---- */
+
+#define WB_BLOCKS 64
+
+static UINT8 s_wb_disk[WB_BLOCKS * BLOCK_SIZE];
+static int s_wb_fail;                   /* device writes fail while set */
+
+static int wb_read(void *ctx, UINT64 lba, UINT32 count, void *buf)
+{
+    (void)ctx;
+    if (lba + count > WB_BLOCKS)
+        return -1;
+    memcpy(buf, s_wb_disk + lba * BLOCK_SIZE, (size_t)count * BLOCK_SIZE);
+    return 0;
+}
+
+static int wb_write(void *ctx, UINT64 lba, UINT32 count, const void *buf)
+{
+    (void)ctx;
+    if (s_wb_fail || lba + count > WB_BLOCKS)
+        return -1;
+    memcpy(s_wb_disk + lba * BLOCK_SIZE, buf, (size_t)count * BLOCK_SIZE);
+    return 0;
+}
+
+/* A dirty block whose write-back fails is never evicted or invalidated:
+   a clean block goes instead, or the cache hands out nothing, until the
+   device takes the writes again */
+static void bench_writeback(void)
+{
+    UINT64 budget = bcache_get_budget();
+    bcache_set_budget(16 * BLOCK_SIZE);     /* the 16-entry minimum */
+    struct bcache *bc = bcache_create(wb_read, wb_write, NULL,
+                                      BLOCK_SIZE, BLOCK_SIZE);
+    bcache_set_budget(budget);
+    s_cache = NULL;
+    if (!bc) { s_failures++; return; }
+    bcache_set_readahead(bc, 0);
+    s_fs = "bcache";
+    s_image = "writeback";
+    memset(s_wb_disk, 0, sizeof(s_wb_disk));
+    s_wb_fail = 1;
+
+    /* Dirty blocks at the LRU tail, one clean block among them */
+    int ok = 1;
+    for (UINT64 blk = 0; blk < 16 && ok; blk++) {
+        UINT8 *p = bcache_get(bc, blk);
+        ok = p != NULL;
+        if (ok && blk != 8) {
+            p[0] = (UINT8)(blk + 1);
+            bcache_mark_dirty(bc, blk);
+        }
+    }
+    expect(ok, "fill with dirty blocks");
+
+    UINT8 *p = bcache_get(bc, 16);
+    expect(p != NULL, "write fails: clean block evicted");
+    if (p) {
+        p[0] = 17;
+        bcache_mark_dirty(bc, 16);
+    }
+    expect(bcache_get(bc, 17) == NULL, "write fails, all dirty: no slot");
+
+    p = bcache_get(bc, 3);
+    expect(EFI_ERROR(bcache_invalidate(bc, 3)) &&
+           (p = bcache_get(bc, 3)) != NULL && p[0] == 4,
+           "write fails: invalidate kept it");
+    expect(EFI_ERROR(bcache_invalidate_all(bc)) &&
+           (p = bcache_get(bc, 5)) != NULL && p[0] == 6,
+           "write fails: invalidate_all kept them");
+
+    s_wb_fail = 0;
+    expect(bcache_flush(bc) == 0, "device back: flush");
+    ok = 1;
+    for (UINT64 blk = 0; blk <= 16; blk++)
+        if (blk != 8 && s_wb_disk[blk * BLOCK_SIZE] != (UINT8)(blk + 1))
+            ok = 0;
+    expect(ok, "device back: every dirty block written");
+    expect(!EFI_ERROR(bcache_invalidate_all(bc)), "device back: invalidate_all");
+    bcache_destroy(bc);
+}
+
+/* ---- Walking any image ---- */
+
+#define WALK_PATHS     10000            /* files kept for lookups and reads */
+#define WALK_READ_CAP  (256ULL << 20)   /* bytes read_all reads at most */
+
+struct walk {
+    char  **paths;                      /* files seen, up to WALK_PATHS */
+    int     path_count;
+    char  **pending;                    /* directories still to list */
+    int     pending_count, pending_max;
+    UINT64  dirs, files, entries;
+    const char *dir;                    /* the one being listed */
+};
+
+static char *join(const char *dir, const char *name)
+{
+    size_t n = strlen(dir) + strlen(name) + 2;
+    char *p = malloc(n);
+    if (p)
+        snprintf(p, n, "%s%s%s", dir, strcmp(dir, "/") ? "/" : "", name);
+    return p;
+}
+
+static void walk_push(struct walk *w, char *dir)
+{
+    if (!dir) return;
+    if (w->pending_count == w->pending_max) {
+        int max = w->pending_max ? w->pending_max * 2 : 64;
+        char **p = realloc(w->pending, sizeof(*p) * (size_t)max);
+        if (!p) { free(dir); return; }
+        w->pending = p;
+        w->pending_max = max;
+    }
+    w->pending[w->pending_count++] = dir;
+}
+
+static int walk_entry(void *ctx, const struct fs_entry *e)
+{
+    struct walk *w = ctx;
+    if (strcmp(e->name, ".") == 0 || strcmp(e->name, "..") == 0)
+        return 0;
+    w->entries++;
+    if (e->is_dir) {
+        w->dirs++;
+        walk_push(w, join(w->dir, e->name));
+    } else {
+        w->files++;
+        if (w->path_count < WALK_PATHS)
+            w->paths[w->path_count++] = join(w->dir, e->name);
+    }
+    return 0;
+}
+
+static void walk_free(struct walk *w)
+{
+    for (int i = 0; i < w->path_count; i++)
+        free(w->paths[i]);
+    for (int i = 0; i < w->pending_count; i++)
+        free(w->pending[i]);
+    free(w->paths);
+    free(w->pending);
+}
+
+static int ex_list(void *vol, const char *path, struct walk *w)
+{
+    struct exfat_dir *d = exfat_opendir(vol, path);
+    if (!d) return -1;
+    struct fs_entry e;
+    while (exfat_readdir_next(d, &e) == 1)
+        walk_entry(w, &e);
+    exfat_closedir(d);
+    return 0;
+}
+
+static int nt_list(void *vol, const char *path, struct walk *w)
+{
+    return ntfs_enumdir(vol, path, walk_entry, w);
+}
+
+/* The three generic workloads, over list and the given readers */
+static void walk_bench(void *vol, int (*list)(void *, const char *, struct walk *),
+                       UINT64 (*read_all)(void *, const char *),
+                       int (*exists)(void *, const char *),
+                       struct image_info *ii)
+{
+    struct walk w;
+    memset(&w, 0, sizeof(w));
+    w.paths = calloc(WALK_PATHS, sizeof(*w.paths));
+    if (!w.paths) return;
+
+    struct mark m;
+    mark(&m);
+    walk_push(&w, strdup("/"));
+    while (w.pending_count > 0) {
+        char *dir = w.pending[--w.pending_count];
+        w.dir = dir;
+        list(vol, dir, &w);
+        free(dir);
+    }
+    report("walk", w.entries, 0, &m);
+    ii->dirs = w.dirs;
+    ii->files = w.files;
+
+    mark(&m);
+    UINT64 bytes = 0;
+    int read = 0;
+    for (; read < w.path_count && bytes < WALK_READ_CAP; read++)
+        bytes += read_all(vol, w.paths[read]);
+    report("read_all", (UINT64)read, bytes, &m);
+
+    if (w.path_count > 0) {
+        mark(&m);
+        for (int i = 0; i < 10000; i++)
+            exists(vol, w.paths[rng_next() % (UINT64)w.path_count]);
+        report("lookup", 10000, 0, &m);
+    }
+    walk_free(&w);
+}
+
+static UINT64 ex_read_path(void *vol, const char *path)
+{
+    return ex_read_all(vol, path, 65536);
+}
+
+static int ex_exists_path(void *vol, const char *path)
+{
+    return exfat_exists(vol, path);
+}
+
+static UINT64 nt_read_path(void *vol, const char *path)
+{
+    UINT64 size, total = 0;
+    struct ntfs_file *f = ntfs_open(vol, path, &size);
+    if (!f)
+        return 0;
+    for (;;) {
+        UINTN n = 65536;
+        if (ntfs_read(f, s_data, &n) != 0 || n == 0)
+            break;
+        total += n;
+    }
+    ntfs_close(f);
+    return total;
+}
+
+static int nt_exists_path(void *vol, const char *path)
+{
+    return ntfs_exists(vol, path);
+}
+
+static void bench_image(const char *path, int ntfs)
+{
+    struct dev d;
+    if (dev_open(&d, path, 0) != 0) {
+        fprintf(stderr, "Cannot open %s\n", path);
+        return;
+    }
+    s_dev = &d;
+    s_fs = ntfs ? "ntfs" : "exfat";
+    s_image = path;
+    struct image_info *ii = image_info();
+    if (!ii) { dev_close(&d); return; }
+
+    if (ntfs) {
+        struct ntfs_vol *v = ntfs_mount(dev_read, &d, BLOCK_SIZE);
+        if (v) {
+            walk_bench(v, nt_list, nt_read_path, nt_exists_path, ii);
+            ntfs_volume_info(v, &ii->bytes, &ii->used);
+            ii->used = ii->bytes - ii->used;
+            ntfs_unmount(v);
+        } else {
+            fprintf(stderr, "%s: not NTFS\n", path);
+            s_image_count--;
+        }
+    } else {
+        /* Read-only: the benchmark must not change a given image */
+        struct exfat_vol *v = exfat_mount(dev_read, NULL, &d, BLOCK_SIZE);
+        if (v) {
+            walk_bench(v, ex_list, ex_read_path, ex_exists_path, ii);
+            exfat_volume_info(v, &ii->bytes, &ii->used);
+            ii->used = ii->bytes - ii->used;
+            exfat_unmount(v);
+        } else {
+            fprintf(stderr, "%s: not exFAT\n", path);
+            s_image_count--;
+        }
+    }
+    s_cache = NULL;
+    dev_close(&d);
+}
+
+/* ---- Float conversion ---- */
+
+/* src/fpconv.c against the host libc, which rounds correctly: random
+   doubles printed shortest, to a number of significant digits and to a
+   number of decimals, and random decimal text read back, including
+   text too long for the 19-digit paths and the exact midpoints between
+   neighbouring doubles and floats, where only the big decimal can
+   decide. Then each side's time on the same inputs. */
+
+#define FP_CASES    1000000
+#define FP_HALFWAY  20000
+#define FP_EXACT    1420        /* a double's exact decimal, zero padded */
+#define FP_TEXT     1600
+
+static UINT64 fp_bits(double v)
+{
+    UINT64 b;
+    memcpy(&b, &v, sizeof(b));
+    return b;
+}
+
+static double fp_double(UINT64 b)
+{
+    double v;
+    memcpy(&v, &b, sizeof(v));
+    return v;
+}
+
+static UINT32 fp_fbits(float v)
+{
+    UINT32 b;
+    memcpy(&b, &v, sizeof(b));
+    return b;
+}
+
+/* A finite double of any sign and size, with more than their share of
+   subnormals and powers of two */
+static double fp_random(void)
+{
+    for (;;) {
+        UINT64 b = rng_next();
+        UINT32 pick = (UINT32)(b >> 60) & 7;
+        if (pick == 0)
+            b &= 0x800FFFFFFFFFFFFFULL;         /* subnormal */
+        else if (pick == 1)
+            b &= 0xFFF0000000000000ULL;         /* power of two */
+        if ((b & 0x7FF0000000000000ULL) != 0x7FF0000000000000ULL)
+            return fp_double(b);
+    }
+}
+
+/* A double between 1e-9 and 1e15, as numbers in files mostly are */
+static double fp_random_near(void)
+{
+    UINT64 b = rng_next();
+    UINT64 exp = 1023 - 30 + (b >> 52) % 80;
+    return fp_double((b & 0x800FFFFFFFFFFFFFULL) | exp << 52);
+}
+
+/* Digits of a number printf printed, as 0.d * 10^dp: leading zeros
+   dropped, trailing ones kept. Returns the number of digits. */
+static int fp_text_digits(const char *s, char *d, int *dp)
+{
+    int nd = 0, point = -1;
+    *dp = 0;
+    if (*s == '-')
+        s++;
+    for (; (*s >= '0' && *s <= '9') || *s == '.'; s++) {
+        if (*s == '.')
+            point = nd;
+        else if (*s != '0' || nd)
+            d[nd++] = *s;
+        else if (point >= 0)
+            (*dp)--;                            /* a zero after the point */
+    }
+    *dp += point >= 0 ? point : nd;
+    if (*s == 'e')
+        *dp += atoi(s + 1);
+    return nd;
+}
+
+/* fp_digits() gave what printf printed in s */
+static int fp_same(const struct fp_decimal *a, const char *s)
+{
+    char d[FP_TEXT];
+    int dp, nd = fp_text_digits(s, d, &dp);
+    while (nd > 0 && d[nd - 1] == '0')
+        nd--;
+    return a->nd == nd && memcmp(a->d, d, (size_t)nd) == 0 &&
+           (nd == 0 || a->dp == dp);
+}
+
+/* 0.d * 10^dp reads back as v */
+static int fp_reads_back(const char *d, int nd, int dp, double v)
+{
+    char s[64];
+    snprintf(s, sizeof(s), "0.%.*se%d", nd, d, dp);
+    return fp_bits(strtod(s, NULL)) == fp_bits(v);
+}
+
+/* Add one to the last of nd digits (-1: take one), carrying */
+static void fp_step(char *d, int nd, int *dp, int dir)
+{
+    int i = nd - 1;
+    for (; i >= 0; i--) {
+        if (dir > 0 && d[i] != '9') { d[i]++; return; }
+        if (dir < 0 && d[i] != '0') { d[i]--; return; }
+        d[i] = dir > 0 ? '0' : '9';
+    }
+    if (dir > 0) {                              /* 99.9 became 100 */
+        d[0] = '1';
+        (*dp)++;
+    }
+}
+
+/* Fewest digits that read back, the nearest of them where there is a
+   choice: no decimal of one digit less lies in v's rounding interval,
+   and the closest ones on either side of v decide that */
+static int fp_shortest_ok(double v, const struct fp_decimal *a)
+{
+    char s[64], d[64];
+    int dp, nd;
+    double x = v < 0 ? -v : v;
+    snprintf(s, sizeof(s), "%.*e", a->nd - 1, x);
+    if (fp_bits(strtod(s, NULL)) == fp_bits(x) && !fp_same(a, s))
+        return 0;
+    if (a->nd == 1)
+        return 1;
+    snprintf(s, sizeof(s), "%.*e", a->nd - 2, x);
+    nd = fp_text_digits(s, d, &dp);
+    if (fp_reads_back(d, nd, dp, x))
+        return 0;
+    /* The neighbour of the nearest on x's other side */
+    fp_step(d, nd, &dp, strtod(s, NULL) < x ? 1 : -1);
+    return !fp_reads_back(d, nd, dp, x);
+}
+
+/* The exact midpoint between lo and hi > lo, both positive, as text */
+static void fp_midpoint(double lo, double hi, char *out)
+{
+    char a[FP_TEXT], b[FP_TEXT];
+    int n = snprintf(a, sizeof(a), "%0*.*f", FP_EXACT, 1100, lo);
+    snprintf(b, sizeof(b), "%0*.*f", FP_EXACT, 1100, hi);
+    /* Sum the digits, then halve them from the left */
+    int carry = 0;
+    for (int i = n - 1; i >= 0; i--) {
+        if (a[i] == '.') { out[i] = '.'; continue; }
+        int s = a[i] - '0' + b[i] - '0' + carry;
+        out[i] = (char)(s % 10);
+        carry = s / 10;
+    }
+    int rem = carry;
+    for (int i = 0; i < n; i++) {
+        if (out[i] == '.') continue;
+        int s = rem * 10 + out[i];
+        out[i] = (char)('0' + s / 2);
+        rem = s % 2;
+    }
+    if (rem)
+        out[n++] = '5';
+    out[n] = '\0';
+}
+
+/* The midpoint, just above it and just below it read by both sides */
+static void fp_halfway(char *m, int single, UINT64 *wrong)
+{
+    char *p = m + strlen(m);
+    for (int k = 0; k < 3; k++) {
+        if (k == 1) {
+            strcpy(p, "0001");
+        } else if (k == 2) {
+            *p = '\0';
+            char *q = p - 1;
+            for (; *q == '0' || *q == '.'; q--)
+                if (*q == '0') *q = '9';
+            (*q)--;
+            strcpy(p, "9999");
+        }
+        int same = single
+            ? fp_fbits(fp_strtof(m, NULL, NULL)) == fp_fbits(strtof(m, NULL))
+            : fp_bits(fp_strtod(m, NULL, NULL)) == fp_bits(strtod(m, NULL));
+        if (!same)
+            (*wrong)++;
+    }
+}
+
+/* A decimal number as text: up to 19 digits mostly, sometimes past
+   what a double holds; a point anywhere and an exponent that can take
+   it out of range */
+static void fp_random_text(char *s)
+{
+    UINT64 r = rng_next();
+    int n = (int)(r % 4 ? 1 + (r >> 8) % 19
+                  : r % 32 ? 20 + (r >> 8) % 21 : 41 + (r >> 8) % 900);
+    int point = (int)(rng_next() % (UINT64)(n + 1));
+    int len = 0;
+    if (r & (1ULL << 40))
+        s[len++] = '-';
+    for (int i = 0; i < n; i++) {
+        if (i == point && i > 0)
+            s[len++] = '.';
+        int digit = (int)(rng_next() % 10);
+        s[len++] = (char)('0' + (i == 0 && digit == 0 ? 1 : digit));
+    }
+    sprintf(s + len, "e%d", (int)((r >> 44) % 700) - 360 - point);
+}
+
+/* Times of the same work done both ways */
+static void fp_report(const char *op, UINT64 ops, double secs,
+                      double libc_secs)
+{
+    double per_s = secs > 0 ? (double)ops / secs : 0;
+    double libc_per_s = libc_secs > 0 ? (double)ops / libc_secs : 0;
+    double speedup = secs > 0 ? libc_secs / secs : 0;
+    printf("%s\n    {\"fs\": \"%s\", \"image\": \"%s\", \"op\": \"%s\", "
+           "\"ops\": %llu, \"seconds\": %.6f, \"ops_per_s\": %.1f, "
+           "\"libc_seconds\": %.6f, \"libc_ops_per_s\": %.1f, "
+           "\"vs_libc\": %.2f}",
+           s_results++ ? "," : "", s_fs, s_image, op,
+           (unsigned long long)ops, secs, per_s, libc_secs, libc_per_s,
+           speedup);
+    fflush(stdout);
+    fprintf(stderr, "%-6s %-6s %-18s %9llu ops %11.1f/s  libc %11.1f/s"
+            "  %5.2fx\n", s_fs, s_image, op, (unsigned long long)ops,
+            per_s, libc_per_s, speedup);
+}
+
+static volatile double s_fp_sink;       /* keeps the timed loops */
+
+static void bench_fpconv(void)
+{
+    static char text[FP_CASES][32];
+    static double vals[FP_CASES];
+    struct fp_decimal d;
+    char s[FP_TEXT], m[FP_TEXT];
+    UINT64 wrong;
+    s_fs = "fpconv";
+
+    s_image = "print";
+    wrong = 0;
+    for (int i = 0; i < FP_CASES; i++) {
+        double v = fp_random();
+        fp_shortest(v, s, sizeof(s));
+        fp_digits(v, FP_SHORTEST, 0, &d);
+        if (fp_bits(strtod(s, NULL)) != fp_bits(v) ||
+            (v != 0 && !fp_shortest_ok(v, &d)))
+            wrong++;
+    }
+    expect(wrong == 0, "shortest reads back, fewest digits");
+    wrong = 0;
+    for (int i = 0; i < FP_CASES; i++) {
+        double v = fp_random();
+        UINT64 r = rng_next();
+        int prec = (int)(r % 64 ? 1 + (r >> 8) % 25 : 1 + (r >> 8) % 780);
+        fp_digits(v, FP_SIGNIFICANT, prec, &d);
+        snprintf(s, sizeof(s), "%.*e", prec - 1, v);
+        if (!fp_same(&d, s))
+            wrong++;
+    }
+    expect(wrong == 0, "%.*e digits");
+    wrong = 0;
+    for (int i = 0; i < FP_CASES; i++) {
+        double v = i % 2 ? fp_random() : fp_random_near();
+        int prec = (int)(rng_next() % 21);
+        fp_digits(v, FP_FRACTION, prec, &d);
+        snprintf(s, sizeof(s), "%.*f", prec, v);
+        if (!fp_same(&d, s))
+            wrong++;
+    }
+    expect(wrong == 0, "%.*f digits");
+
+    s_image = "parse";
+    wrong = 0;
+    for (int i = 0; i < FP_CASES; i++) {
+        char *end, *libc_end;
+        int erange;
+        fp_random_text(s);
+        UINT64 b = fp_bits(fp_strtod(s, &end, &erange));
+        UINT64 mag = b & ~(1ULL << 63);
+        if (b != fp_bits(strtod(s, &libc_end)) || end != libc_end ||
+            erange != (mag == 0 || mag == 0x7FF0000000000000ULL) ||
+            fp_fbits(fp_strtof(s, NULL, NULL)) != fp_fbits(strtof(s, NULL)))
+            wrong++;
+    }
+    expect(wrong == 0, "strtod, strtof random text");
+    wrong = 0;
+    for (int i = 0; i < FP_HALFWAY; i++) {
+        double v = fp_double(fp_bits(fp_random()) & ~(1ULL << 63));
+        UINT64 b = fp_bits(v);
+        if (b + 1 >= 0x7FF0000000000000ULL)
+            continue;
+        fp_midpoint(v, fp_double(b + 1), m);
+        fp_halfway(m, 0, &wrong);
+    }
+    expect(wrong == 0, "strtod halfway, just off it");
+    wrong = 0;
+    for (int i = 0; i < FP_HALFWAY; i++) {
+        UINT32 b = (UINT32)rng_next() & 0x7FFFFFFF;
+        if (b + 1 >= 0x7F800000)
+            continue;
+        float lo, hi;
+        UINT32 b1 = b + 1;
+        memcpy(&lo, &b, sizeof(lo));
+        memcpy(&hi, &b1, sizeof(hi));
+        fp_midpoint(lo, hi, m);
+        fp_halfway(m, 1, &wrong);
+    }
+    expect(wrong == 0, "strtof halfway, just off it");
+
+    /* Throughput, the libc doing the same on the same inputs */
+    double t, fp_secs, sum = 0;
+    s_image = "time";
+    for (int i = 0; i < FP_CASES; i++) {
+        /* Uniform bits: subnormals, which take the big decimal, are as
+           rare as they are */
+        UINT64 bits;
+        do
+            bits = rng_next();
+        while ((bits >> 52 & 0x7FF) == 0x7FF);
+        snprintf(text[i], sizeof(text[i]), "%.17g", fp_double(bits));
+    }
+    t = now();
+    for (int i = 0; i < FP_CASES; i++)
+        sum += fp_strtod(text[i], NULL, NULL);
+    fp_secs = now() - t;
+    t = now();
+    for (int i = 0; i < FP_CASES; i++)
+        sum -= strtod(text[i], NULL);
+    fp_report("strtod %.17g", FP_CASES, fp_secs, now() - t);
+
+    for (int i = 0; i < FP_CASES; i++)
+        snprintf(text[i], sizeof(text[i]), "%.*g",
+                 1 + (int)(rng_next() % 8), fp_random_near());
+    t = now();
+    for (int i = 0; i < FP_CASES; i++)
+        sum += fp_strtod(text[i], NULL, NULL);
+    fp_secs = now() - t;
+    t = now();
+    for (int i = 0; i < FP_CASES; i++)
+        sum -= strtod(text[i], NULL);
+    fp_report("strtod %.8g", FP_CASES, fp_secs, now() - t);
+
+    /* The values just parsed, printed back */
+    for (int i = 0; i < FP_CASES; i++)
+        vals[i] = strtod(text[i], NULL);
+    t = now();
+    for (int i = 0; i < FP_CASES; i++)
+        sum += fp_shortest(vals[i], s, 32);
+    fp_secs = now() - t;
+    t = now();
+    for (int i = 0; i < FP_CASES; i++)
+        sum -= snprintf(s, 32, "%.17g", vals[i]);
+    fp_report("shortest, %.17g", FP_CASES, fp_secs, now() - t);
+    s_fp_sink = sum;
+}
+
+/* ---- Main ---- */
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: host-bench [--dir DIR] [--files N] [--seed N] "
+            "[--only deep|wide|frag|full|nospace|fpconv|images]\n"
+            "                  [--keep] [--exfat IMAGE]... [--ntfs IMAGE]...\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    const char *images[16];
+    int image_ntfs[16], image_count = 0;
+    UINT64 seed = 1;
+
+    for (int i = 1; i < argc; i++) {
+        const char *a = argv[i];
+        const char *arg = i + 1 < argc ? argv[i + 1] : NULL;
+        if (strcmp(a, "--keep") == 0) {
+            s_keep = 1;
+            continue;
+        }
+        if (!arg) usage();
+        i++;
+        if (strcmp(a, "--dir") == 0) s_dir = arg;
+        else if (strcmp(a, "--files") == 0) s_files = atoi(arg);
+        else if (strcmp(a, "--seed") == 0) seed = strtoull(arg, NULL, 0);
+        else if (strcmp(a, "--only") == 0) s_only = arg;
+        else if ((strcmp(a, "--exfat") == 0 || strcmp(a, "--ntfs") == 0) &&
+                 image_count < 16) {
+            image_ntfs[image_count] = a[2] == 'n';
+            images[image_count++] = arg;
+        } else usage();
+    }
+    s_rng ^= seed * 0x2545F4914F6CDD1DULL;
+    if (!s_rng) s_rng = 1;
+
+    s_data = malloc(DATA_SIZE + 64);
+    if (!s_data) return 1;
+    for (UINT32 i = 0; i < DATA_SIZE + 64; i++)
+        s_data[i] = (UINT8)rng_next();
+
+    printf("{\n  \"version\": 1,\n  \"config\": {\"block_size\": %d, \"seed\": %llu, "
+           "\"files\": %d, \"bcache_budget\": %llu},\n  \"results\": [",
+           BLOCK_SIZE, (unsigned long long)seed, s_files,
+           (unsigned long long)bcache_get_budget());
+
+    if (run("deep")) bench_deep();
+    if (run("wide")) bench_wide();
+    if (run("frag")) bench_frag();
+    if (run("full")) bench_full();
+    if (run("nospace")) {
+        bench_nospace();
+        bench_writeback();
+    }
+    if (run("fpconv")) bench_fpconv();
+    if (run("images"))
+        for (int i = 0; i < image_count; i++)
+            bench_image(images[i], image_ntfs[i]);
+
+    printf("\n  ],\n  \"images\": [");
+    for (int i = 0; i < s_image_count; i++) {
+        struct image_info *ii = &s_images[i];
+        printf("%s\n    {\"fs\": \"%s\", \"image\": \"%s\", \"bytes\": %llu, "
+               "\"used_bytes\": %llu, \"dirs\": %llu, \"files\": %llu, "
+               "\"largest_file_extents\": %d}",
+               i ? "," : "", ii->fs, ii->image,
+               (unsigned long long)ii->bytes, (unsigned long long)ii->used,
+               (unsigned long long)ii->dirs, (unsigned long long)ii->files,
+               ii->extents);
+    }
+    printf("\n  ]\n}\n");
+    free(s_data);
+    return s_failures ? 1 : 0;
+}
@@ -0,0 +1,64 @@
+/*
+ * hostport.c — mem.h for a hosted build of the filesystem drivers
+ *
+ * src/exfat.c, src/ntfs.c, src/bcache.c, src/runmap.c and src/dirsort.c
+ * take their memory and string helpers from mem.h; on the host they are
+ * libc.
+ * mem_alloc() memory starts zeroed, as on UEFI.
+ */
+
+#include "mem.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+void *mem_alloc(UINTN size) { return calloc(1, size ? size : 1); }
+void *mem_alloc_raw(UINTN size) { return malloc(size ? size : 1); }
+void mem_free(void *ptr) { free(ptr); }
+
+int mem_grow(void **p, UINT32 *cap, UINT32 need, UINTN elem, UINT32 first)
+{
+    if (need <= *cap) return 0;
+    UINT32 n = *cap ? *cap : first;
+    while (n < need) n *= 2;
+    void *q = realloc(*p, (size_t)n * elem);
+    if (!q) return -1;
+    *p = q;
+    *cap = n;
+    return 0;
+}
+
+void *mem_io_get(UINTN size) { return malloc(size ? size : 1); }
+void mem_io_put(void *ptr) { free(ptr); }
+
+void mem_set(void *dst, UINT8 val, UINTN size) { memset(dst, val, size); }
+void mem_copy(void *dst, const void *src, UINTN size) { memcpy(dst, src, size); }
+void mem_move(void *dst, const void *src, UINTN size) { memmove(dst, src, size); }
+int mem_cmp(const void *a, const void *b, UINTN size) { return memcmp(a, b, size); }
+
+UINT64 mem_popcount(const void *data, UINTN size)
+{
+    const UINT8 *p = (const UINT8 *)data;
+    UINT64 n = 0;
+    for (; size >= 8; size -= 8, p += 8) {
+        UINT64 w;
+        memcpy(&w, p, 8);
+        n += (UINT64)__builtin_popcountll(w);
+    }
+    while (size--)
+        n += (UINT64)__builtin_popcount(*p++);
+    return n;
+}
+
+UINTN str_len(const CHAR8 *s) { return strlen(s); }
+int str_cmp(const CHAR8 *a, const CHAR8 *b) { return strcmp(a, b); }
+
+void str_copy(char *dst, const char *src, UINTN max)
+{
+    UINTN i = 0;
+    while (i < max - 1 && src[i]) {
+        dst[i] = src[i];
+        i++;
+    }
+    dst[i] = '\0';
+}
@@ -0,0 +1,140 @@
+#!/usr/bin/env python3
+"""
+objkey.py — Compute the F6 rebuild cache key of a translation unit.
+
+The self-hosted rebuild (handle_rebuild() in src/edit.c) reuses an object
+under /build/<arch>/ when objects.lst records the same key for it.  The
+key is a 64-bit FNV-1a hash of the unit's compile flags, then, in
+depth-first include order, the path and content hash of every file the
+source reaches through #include.  This script computes it the same way
+over an ESP directory, so the build can ship prebuilt objects that the
+device accepts until the sources change.  Keep the two in sync.
+
+Usage:
+    python3 objkey.py ESP_DIR SOURCE FLAGS
+
+SOURCE is an ESP path such as /tools/tinycc/libtcc.c; FLAGS must be
+the string the device compiles that unit with.  Prints the key as 16
+lowercase hex digits.
+"""
+
+import os
+import sys
+
+FNV_OFFSET = 0xCBF29CE484222325
+FNV_PRIME = 0x100000001B3
+MASK = (1 << 64) - 1
+
+INCLUDE_PATHS = ["/src/tcc-headers", "/src", "/tools/tinycc"]
+PATH_MAX = 128  # REBUILD_PATH, including the NUL
+
+
+def fnv_mix(h, data):
+    for b in data:
+        h = ((h ^ b) * FNV_PRIME) & MASK
+    return h
+
+
+class Scanner:
+    def __init__(self, esp):
+        self.esp = esp
+        self.files = {}  # path -> (hash, [child paths])
+
+    def host(self, path):
+        return os.path.join(self.esp, path.lstrip("/"))
+
+    def exists(self, path):
+        return os.path.exists(self.host(path))
+
+    def resolve(self, frm, name, quoted):
+        if quoted:
+            d = frm.rfind("/")
+            if d < 0:
+                d = 0
+            if d + 1 + len(name) < PATH_MAX:
+                p = frm[:d + 1] + name
+                if self.exists(p):
+                    return p
+        for inc in INCLUDE_PATHS:
+            if len(inc) + 1 + len(name) >= PATH_MAX:
+                continue
+            p = inc + "/" + name
+            if self.exists(p):
+                return p
+        return None
+
+    def load(self, path):
+        if path in self.files:
+            return self.files[path]
+        try:
+            with open(self.host(path), "rb") as f:
+                data = f.read()
+        except OSError:
+            self.files[path] = (0, [])
+            return self.files[path]
+
+        children = []
+        size = len(data)
+        i = 0
+        while i < size:
+            p = i
+            while p < size and data[p] in b" \t":
+                p += 1
+            if p + 8 < size and data[p] == ord("#"):
+                p += 1
+                while p < size and data[p] in b" \t":
+                    p += 1
+                if p + 7 < size and data[p:p + 7] == b"include":
+                    p += 7
+                    while p < size and data[p] in b" \t":
+                        p += 1
+                    opener = data[p] if p < size else 0
+                    if opener in (ord('"'), ord("<")):
+                        close = ord('"') if opener == ord('"') else ord(">")
+                        p += 1
+                        name = bytearray()
+                        while (p < size and data[p] != close and
+                               data[p] != ord("\n") and len(name) < PATH_MAX - 1):
+                            name.append(data[p])
+                            p += 1
+                        if name:
+                            r = self.resolve(path, name.decode("latin-1"),
+                                             opener == ord('"'))
+                            if r is not None:
+                                children.append(r)
+            nl = data.find(b"\n", i)
+            i = size + 1 if nl < 0 else nl + 1
+
+        self.files[path] = (fnv_mix(FNV_OFFSET, data), children)
+        return self.files[path]
+
+    def key(self, src, flags):
+        h = fnv_mix(FNV_OFFSET, flags.encode())
+        seen = set()
+
+        def visit(path, h):
+            if path in seen:
+                return h
+            seen.add(path)
+            fhash, children = self.load(path)
+            h = fnv_mix(h, path.encode("latin-1"))
+            h = fnv_mix(h, fhash.to_bytes(8, "little"))
+            for c in children:
+                h = visit(c, h)
+            return h
+
+        sys.setrecursionlimit(10000)
+        h = visit(src, h)
+        return h if h else 1
+
+
+def main():
+    if len(sys.argv) != 4:
+        sys.stderr.write(__doc__)
+        sys.exit(2)
+    esp, src, flags = sys.argv[1:]
+    print("%016x" % Scanner(esp).key(src, flags))
+
+
+if __name__ == "__main__":
+    main()
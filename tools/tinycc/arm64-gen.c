@@ -486,6 +486,20 @@ static void arm64_sym(int r, Sym *sym, unsigned long addend)
 
 static void arm64_load_cmp(int r, SValue *sv);
 
+/* -O1 store-to-load forwarding: the last store of a register to a
+   local.  When the very next instruction would reload that local into
+   the same register, with no jump target in between, the load is
+   dropped.  Only full-width types: narrower reloads re-extend. */
+static struct { int ind, r, t; uint64_t off; } last_store = { -1 };
+
+static int fwd_type(int t)
+{
+    int bt = t & VT_BTYPE;
+    if (t & VT_VOLATILE)
+        return 0;
+    return bt == VT_LLONG || bt == VT_PTR || bt == VT_FLOAT || bt == VT_DOUBLE;
+}
+
 ST_FUNC void load(int r, SValue *sv)
 {
     int svtt = sv->type.t;
@@ -495,6 +509,11 @@ ST_FUNC void load(int r, SValue *sv)
     svcul = svcul >> 31 & 1 ? svcul - ((uint64_t)1 << 32) : svcul;
 
     if (svr == (VT_LOCAL | VT_LVAL)) {
+        if (tcc_state->optimize && last_store.ind == ind
+            && label_ind != ind && last_store.r == r
+            && last_store.off == svcul && fwd_type(svtt)
+            && (svtt & VT_BTYPE) == last_store.t)
+            return;
         if (IS_FREG(r))
             arm64_ldrv(arm64_type_size(svtt), fltr(r), 29, svcul);
         else
@@ -620,6 +639,12 @@ ST_FUNC void store(int r, SValue *sv)
             arm64_strv(arm64_type_size(svtt), fltr(r), 29, svcul);
         else
             arm64_strx(arm64_type_size(svtt), intr(r), 29, svcul);
+        if (fwd_type(svtt)) {
+            last_store.ind = ind;
+            last_store.r = r;
+            last_store.off = svcul;
+            last_store.t = svtt & VT_BTYPE;
+        }
         return;
     }
 
@@ -743,6 +768,38 @@ static void gen_bounds_epilog(void)
 }
 #endif
 
+/* -finstrument-functions: call __cyg_profile_func_enter/exit(this
+   function, its call site) after the prolog and before the epilog */
+static Sym *func_profile_sym;
+
+static void gen_profile_call(int v)
+{
+    Sym *sym = external_helper_sym(v);
+    arm64_sym(0, func_profile_sym, 0); // x0 = this function
+    o(0xf94007a1); // ldr x1,[x29,#8]: saved x30
+    greloca(cur_text_section, sym, ind, R_AARCH64_CALL26, 0);
+    o(0x94000000); // bl
+}
+
+static void gen_profile_prolog(Sym *func_sym)
+{
+    // parameters passed in registers are in the frame by now
+    func_profile_sym = func_sym;
+    gen_profile_call(TOK___cyg_profile_func_enter);
+}
+
+static void gen_profile_epilog(void)
+{
+    // returned value: x0, x1 and an HFA in up to q0-q3
+    o(0xa9bf07e0); // stp x0,x1,[sp,#-16]!
+    o(0xadbf07e0); // stp q0,q1,[sp,#-32]!
+    o(0xadbf0fe2); // stp q2,q3,[sp,#-32]!
+    gen_profile_call(TOK___cyg_profile_func_exit);
+    o(0xacc10fe2); // ldp q2,q3,[sp],#32
+    o(0xacc107e0); // ldp q0,q1,[sp],#32
+    o(0xa8c107e0); // ldp x0,x1,[sp],#16
+}
+
 static int arm64_hfa_aux(CType *type, int *fsize, int num)
 {
     if (is_float(type->t)) {
@@ -1191,6 +1248,7 @@ ST_FUNC void gfunc_prolog(Sym *func_sym)
     int variadic = func_sym->type.ref->f.func_type == FUNC_ELLIPSIS;
     int var_nb_arg = n_func_args(&func_sym->type);
 
+    last_store.ind = -1;
     func_vc = 144; // offset of where x8 is stored
 
     for (sym = func_type->ref; sym; sym = sym->next)
@@ -1286,6 +1344,8 @@ ST_FUNC void gfunc_prolog(Sym *func_sym)
     if (tcc_state->do_bounds_check)
         gen_bounds_prolog();
 #endif
+    if (tcc_state->instrument_functions)
+        gen_profile_prolog(func_sym);
 }
 
 ST_FUNC void gen_va_start(void)
@@ -1474,6 +1534,8 @@ ST_FUNC void gfunc_epilog(void)
     if (tcc_state->do_bounds_check)
         gen_bounds_epilog();
 #endif
+    if (tcc_state->instrument_functions)
+        gen_profile_epilog();
 
     if (loc) {
         // Insert instructions to subtract size of stack frame from SP.
@@ -1434,7 +1434,9 @@ static int tcc_set_linker(TCCState *s, const char *optarg)
             ignoring = 1;
         } else if (link_option(&o, "Map=")) {
             tcc_set_str(&s->mapfile, o.arg);
+#if !(defined(TCC_TARGET_PE) || defined(TCC_TARGET_ARM64) || defined(TCC_TARGET_X86_64))
             ignoring = 1;
+#endif
         } else if (link_option(&o, "oformat=")) {
 #if defined TCC_TARGET_PE
             if (0 == strncmp("pe-", o.arg, 3))
@@ -1481,6 +1483,8 @@ static int tcc_set_linker(TCCState *s, const char *optarg)
         } else if (link_option(&o, "subsystem=")) {
             if (pe_setsubsy(s, o.arg) < 0)
                 goto err;
+        } else if (link_option(&o, "gc-sections")) {
+            s->gc_sections = 1;
 #elif defined TCC_TARGET_MACHO
         } else if (link_option(&o, "all_load")) {
 	    s->filetype |= AFF_WHOLE_ARCHIVE;
@@ -1721,6 +1725,10 @@ static const FlagDef options_f[] = {
     { offsetof(TCCState, ms_extensions), 0, "ms-extensions" },
     { offsetof(TCCState, dollars_in_identifiers), 0, "dollars-in-identifiers" },
     { offsetof(TCCState, test_coverage), 0, "test-coverage" },
+    { offsetof(TCCState, instrument_functions), 0, "instrument-functions" },
+    { offsetof(TCCState, syntax_only), 0, "syntax-only" },
+    { offsetof(TCCState, function_sections), 0, "function-sections" },
+    { offsetof(TCCState, data_sections), 0, "data-sections" },
     { offsetof(TCCState, reverse_funcargs), 0, "reverse-funcargs" },
     { offsetof(TCCState, gnu89_inline), 0, "gnu89-inline" },
     { offsetof(TCCState, unwind_tables), 0, "asynchronous-unwind-tables" },
@@ -2240,6 +2248,51 @@ LIBTCCAPI int tcc_set_options(TCCState *s, const char *r)
     return ret;
 }
 
+#ifdef __UEFI__
+LIBTCCAPI void tcc_set_resolver(TCCState *s1, void *opaque,
+    const void *(*fn)(void *opaque, const char *name))
+{
+    s1->resolve_sym = fn;
+    s1->resolve_opaque = opaque;
+}
+
+LIBTCCAPI void tcc_set_poll(TCCState *s1, void *opaque,
+    int (*fn)(void *opaque))
+{
+    s1->poll_fn = fn;
+    s1->poll_opaque = opaque;
+}
+
+LIBTCCAPI void tcc_get_stats(TCCState *s1, TCCStats *st)
+{
+    st->lines = total_lines;
+    st->tokens = total_tokens;
+    st->source_bytes = total_bytes;
+    st->text_bytes = s1->total_output[0];
+    st->data_bytes = s1->total_output[1] + s1->total_output[2];
+    st->pp_ticks = s1->pp_ticks;
+    st->write_ticks = s1->write_ticks;
+}
+#endif
+
+LIBTCCAPI int tcc_get_obj_size(TCCState *s1, int i, TCCObjSize *out)
+{
+    if (i < 0 || i >= s1->nb_obj_sizes)
+        return -1;
+    *out = *s1->obj_sizes[i];
+    return 0;
+}
+
+LIBTCCAPI int tcc_add_import(TCCState *s1, const char *dll, const char *name)
+{
+#if defined(TCC_TARGET_PE) || defined(TCC_TARGET_ARM64) || defined(TCC_TARGET_X86_64)
+    pe_putimport(s1, tcc_add_dllref(s1, dll, 0)->index, name, 0);
+    return 0;
+#else
+    return -1;
+#endif
+}
+
 PUB_FUNC void tcc_print_stats(TCCState *s1, unsigned total_time)
 {
     if (!total_time)
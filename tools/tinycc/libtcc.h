@@ -98,6 +98,65 @@ LIBTCCAPI void *tcc_get_symbol(TCCState *s, const char *name);
 LIBTCCAPI void tcc_list_symbols(TCCState *s, void *ctx,
     void (*symbol_cb)(void *ctx, const char *name, const void *val));
 
+/* UEFI build only: after tcc_relocate(), take ownership of the program
+   image (allocated with mem_alloc_code()) so that it outlives the state.
+   Sets *size and returns the image, or NULL if there is none. */
+LIBTCCAPI void *tcc_take_image(TCCState *s1, unsigned long *size);
+
+/* UEFI build only: after tcc_relocate(), list every function the
+   program defines, static ones included, with its address */
+LIBTCCAPI void tcc_list_functions(TCCState *s, void *ctx,
+    void (*symbol_cb)(void *ctx, const char *name, const void *val));
+
+/* UEFI build only: symbols still undefined when tcc_relocate() runs
+   are looked up with fn (NULL if unknown) before they are reported,
+   so the host can serve its API from a table of its own instead of
+   one tcc_add_symbol() per name and state. */
+LIBTCCAPI void tcc_set_resolver(TCCState *s1, void *opaque,
+    const void *(*fn)(void *opaque, const char *name));
+
+/* UEFI build only: while compiling, fn is called every few hundred
+   source tokens; once it returns nonzero the compile stops with an
+   "interrupted" error, so a compile nobody waits for any more can be
+   dropped.  Pairs with -fsyntax-only, which parses and checks function
+   bodies without generating their code. */
+LIBTCCAPI void tcc_set_poll(TCCState *s1, void *opaque,
+    int (*fn)(void *opaque));
+
+/* UEFI build only: what the state has compiled so far.  The tick
+   counts come from the workstation's timer_ticks(). */
+typedef struct TCCStats {
+    unsigned lines;         /* source lines, headers included */
+    unsigned tokens;        /* source tokens, before macro expansion */
+    unsigned source_bytes;
+    unsigned text_bytes;    /* code generated */
+    unsigned data_bytes;    /* initialized data, read-write and read-only */
+    unsigned long long pp_ticks;    /* in directives and macro expansion */
+    unsigned long long write_ticks; /* writing the PE image */
+} TCCStats;
+LIBTCCAPI void tcc_get_stats(TCCState *s1, TCCStats *st);
+
+/* What each object file added with tcc_add_file() brought to the
+   image, its code, data (read-write and read-only) and bss, and how
+   much of it -Wl,--gc-sections kept.  Fills out for the i-th one, from
+   0, and returns 0, or -1 past the last.  kept is final once
+   tcc_output_file() has run. */
+#define TCC_OBJ_CODE 0
+#define TCC_OBJ_DATA 1
+#define TCC_OBJ_BSS  2
+typedef struct TCCObjSize {
+    const char *name;       /* as given, or the archive's */
+    unsigned size[3];       /* by TCC_OBJ_ kind */
+    unsigned kept[3];
+} TCCObjSize;
+LIBTCCAPI int tcc_get_obj_size(TCCState *s1, int i, TCCObjSize *out);
+
+/* PE output: name, if the program leaves it undefined, is imported
+   from dll as though dll's .def file listed it.  For a host that fills
+   in the import table itself once the image is loaded.  Returns 0, -1
+   when not a PE target. */
+LIBTCCAPI int tcc_add_import(TCCState *s1, const char *dll, const char *name);
+
 /* experimental/advanced section (see libtcc_test_mt.c for an example) */
 
 /* catch runtime exceptions (optionally limit backtraces at top_func),
@@ -125,6 +125,8 @@ static const char help2[] =
     "  reverse-funcargs              evaluate function arguments right to left\n"
     "  gnu89-inline                  'extern inline' is like 'static inline'\n"
     "  asynchronous-unwind-tables    create eh_frame section [on]\n"
+    "  function-sections             put each function in a section of its own\n"
+    "  data-sections                 same for each variable\n"
     "  test-coverage                 create code coverage code\n"
     "-m... target specific options:\n"
     "  ms-bitfields                  use MSVC bitfield layout\n"
@@ -146,6 +148,8 @@ static const char help2[] =
     "  -stack=                       set PE stack reserve\n"
     "  -large-address-aware          set related PE option\n"
     "  -subsystem=[console/windows]  set PE subsystem\n"
+    "  -gc-sections                  drop sections nothing refers to\n"
+    "  -Map=file                     write the size by object file\n"
     "  -oformat=[pe-* binary]        set executable output format\n"
     "Predefined macros:\n"
     "  tcc -E -dM - < nul\n"
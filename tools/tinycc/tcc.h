@@ -586,6 +586,7 @@ typedef struct Section {
     struct Section *reloc;   /* corresponding section for relocation, if any */
     struct Section *hash;    /* hash table for symbols */
     struct Section *prev;    /* previous section on section stack */
+    int gc_obj;              /* with --gc-sections: 1 + obj_sizes index */
     char name[1];           /* section name */
 } Section;
 
@@ -746,7 +747,7 @@ struct TCCState {
     unsigned char symbolic; /* if true, resolve symbols in the current module first */
     unsigned char znodelete; /* Set DF_1_NODELETE in dynamic section */
     unsigned char filetype; /* file type for compilation (NONE,C,ASM) */
-    unsigned char optimize; /* only to #define __OPTIMIZE__ */
+    unsigned char optimize; /* #define __OPTIMIZE__; -O1 also forwards stores to reloads */
     unsigned char option_pthread; /* -pthread option */
     unsigned char enable_new_dtags; /* -Wl,--enable-new-dtags */
     unsigned int  cversion; /* supported C ISO version, 199901 (the default), 201112, ... */
@@ -788,6 +789,10 @@ struct TCCState {
     unsigned char do_bounds_check;
 #endif
     unsigned char test_coverage;  /* generate test coverage code */
+    unsigned char instrument_functions; /* call __cyg_profile_func_enter/exit */
+    unsigned char syntax_only; /* -fsyntax-only: no code for function bodies */
+    unsigned char function_sections; /* each function in a section of its own */
+    unsigned char data_sections; /* same for variables */
 
     /* use GNU C extensions */
     unsigned char gnu_ext;
@@ -818,7 +823,7 @@ struct TCCState {
     char *elf_entryname; /* "_start" unless set */
     char *init_symbol; /* symbols to call at load-time (not used currently) */
     char *fini_symbol; /* symbols to call at unload-time (not used currently) */
-    char *mapfile; /* create a mapfile (not used currently) */
+    char *mapfile; /* PE: write the size by object to it */
 
     /* output type, see TCC_OUTPUT_XXX */
     int output_type;
@@ -949,6 +954,7 @@ struct TCCState {
     unsigned pe_file_align;
     unsigned pe_stack_size;
     addr_t pe_imagebase;
+    unsigned char gc_sections; /* -Wl,--gc-sections */
 # ifdef TCC_TARGET_X86_64
     Section *uw_pdata;
     int uw_sym;
@@ -996,12 +1002,26 @@ struct TCCState {
     int total_lines;
     unsigned int total_bytes;
     unsigned int total_output[4];
+    unsigned int total_tokens; /* source tokens, before macro expansion */
+#ifdef __UEFI__
+    /* tcc_set_resolver(): host symbols looked up at relocation */
+    const void *(*resolve_sym)(void *opaque, const char *name);
+    void *resolve_opaque;
+    /* tcc_set_poll(): asked every few hundred tokens whether to stop */
+    int (*poll_fn)(void *opaque);
+    void *poll_opaque;
+    unsigned long long pp_ticks;    /* directives and macro expansion */
+    unsigned long long write_ticks; /* writing the PE image */
+#endif
 
     /* used by tcc_load_ldscript */
     unsigned char *ld_p; /* text pointer */
 
     /* for warnings/errors for object files */
     const char *current_filename;
+    /* what each object file loaded brought, for tcc_get_obj_size() */
+    TCCObjSize **obj_sizes;
+    int nb_obj_sizes;
 
     /* used by main and tcc_parse_args only */
     struct filespec **files; /* files seen on command line */
@@ -1429,6 +1449,7 @@ ST_DATA Sym *define_stack;
 ST_DATA CType int_type, func_old_type, char_pointer_type;
 ST_DATA SValue *vtop;
 ST_DATA int rsym, anon_sym, ind, loc;
+ST_DATA int label_ind; /* code offset of the last jump target (for -O1) */
 ST_DATA char debug_modes;
 
 ST_DATA int nocode_wanted; /* true if no code generation wanted for an expression */
@@ -1545,6 +1566,8 @@ ST_FUNC void section_realloc(Section *sec, unsigned long new_size);
 ST_FUNC size_t section_add(Section *sec, addr_t size, int align);
 ST_FUNC void *section_ptr_add(Section *sec, addr_t size);
 ST_FUNC Section *find_section(TCCState *s1, const char *name);
+ST_FUNC int section_split(const char *name);
+ST_FUNC int section_obj_kind(Section *s);
 ST_FUNC void free_section(Section *s);
 ST_FUNC Section *new_symtab(TCCState *s1, const char *symtab_name, int sh_type, int sh_flags, const char *strtab_name, const char *hash_name, int hash_sh_flags);
 ST_FUNC void init_symtab(Section *s);
@@ -1986,6 +2009,7 @@ static inline void post_sem(TCCSem *p) {
 #define total_idents        TCC_STATE_VAR(total_idents)
 #define total_lines         TCC_STATE_VAR(total_lines)
 #define total_bytes         TCC_STATE_VAR(total_bytes)
+#define total_tokens        TCC_STATE_VAR(total_tokens)
 
 PUB_FUNC void tcc_enter_state(TCCState *s1);
 PUB_FUNC void tcc_exit_state(TCCState *s1);
@@ -143,6 +143,7 @@ ST_FUNC void tccelf_delete(TCCState *s1)
     for(i = 0; i < s1->nb_priv_sections; i++)
         free_section(s1->priv_sections[i]);
     dynarray_reset(&s1->priv_sections, &s1->nb_priv_sections);
+    dynarray_reset(&s1->obj_sizes, &s1->nb_obj_sizes);
 
     tcc_free(s1->sym_attrs);
     symtab_section = NULL; /* for tccrun.c:rt_printline() */
@@ -355,6 +356,36 @@ ST_FUNC Section *find_section(TCCState *s1, const char *name)
     return new_section(s1, name, SHT_PROGBITS, SHF_ALLOC);
 }
 
+/* ".text.f", ".data.v" and the like, as -ffunction-sections and
+   -fdata-sections name them: with --gc-sections each stays a section
+   of its own, dropped when nothing refers to it */
+ST_FUNC int section_split(const char *name)
+{
+    static const char *const base[] = {
+        ".text.", ".data.", ".rdata.", ".rodata.", ".bss."
+    };
+    int i, n;
+    for (i = 0; i < countof(base); ++i) {
+        n = strlen(base[i]);
+        if (0 == strncmp(name, base[i], n))
+            return name[n] != 0;
+    }
+    return 0;
+}
+
+/* TCC_OBJ_CODE, _DATA or _BSS for what s brings to the image, -1 if
+   nothing */
+ST_FUNC int section_obj_kind(Section *s)
+{
+    if (!(s->sh_flags & SHF_ALLOC))
+        return -1;
+    if (s->sh_flags & SHF_EXECINSTR)
+        return TCC_OBJ_CODE;
+    if (s->sh_type == SHT_NOBITS)
+        return TCC_OBJ_BSS;
+    return TCC_OBJ_DATA;
+}
+
 /* ------------------------------------------------------------------------- */
 
 ST_FUNC int put_elf_str(Section *s, const char *sym)
@@ -575,6 +606,23 @@ LIBTCCAPI void tcc_list_symbols(TCCState *s, void *ctx,
     list_elf_symbols(s, ctx, symbol_cb);
 }
 
+#ifdef __UEFI__
+LIBTCCAPI void tcc_list_functions(TCCState *s, void *ctx,
+    void (*symbol_cb)(void *ctx, const char *name, const void *val))
+{
+    Section *symtab = s->symtab;
+    int sym_index, end_sym = symtab->data_offset / sizeof (ElfSym);
+
+    for (sym_index = 1; sym_index < end_sym; ++sym_index) {
+        ElfW(Sym) *sym = &((ElfW(Sym) *)symtab->data)[sym_index];
+        if (ELFW(ST_TYPE)(sym->st_info) == STT_FUNC
+            && sym->st_shndx != SHN_UNDEF && sym->st_value)
+            symbol_cb(ctx, (char *) symtab->link->data + sym->st_name,
+                      (void*)(uintptr_t)sym->st_value);
+    }
+}
+#endif
+
 #ifndef ELF_OBJ_ONLY
 static void
 version_add (TCCState *s1)
@@ -1079,6 +1127,10 @@ ST_FUNC void relocate_syms(TCCState *s1, Section *symtab, int do_resolve)
                 void *addr = NULL;
                 if (!s1->nostdlib)
                     addr = dlsym(RTLD_DEFAULT, name_ud);
+#ifdef __UEFI__
+                if (addr == NULL && s1->resolve_sym)
+                    addr = (void *)s1->resolve_sym(s1->resolve_opaque, name_ud);
+#endif
 		if (addr == NULL) {
 		    int i;
 		    for (i = 0; i < s1->nb_loaded_dlls; i++)
@@ -1593,12 +1645,15 @@ static void tcc_compile_string_no_debug(TCCState *s, const char *str)
 {
     int save_do_debug = s->do_debug;
     int save_test_coverage = s->test_coverage;
+    int save_instrument = s->instrument_functions;
 
     s->do_debug = 0;
     s->test_coverage = 0;
+    s->instrument_functions = 0;
     tcc_compile_string(s, str);
     s->do_debug = save_do_debug;
     s->test_coverage = save_test_coverage;
+    s->instrument_functions = save_instrument;
 }
 
 #ifdef CONFIG_TCC_BACKTRACE
@@ -3197,6 +3252,8 @@ ST_FUNC int tcc_load_object_file(TCCState *s1,
     ElfW(Sym) *sym, *symtab;
     ElfW_Rel *rel;
     Section *s;
+    TCCObjSize *obj;
+    int kind, split;
 
     lseek(fd, file_offset, SEEK_SET);
     if (tcc_object_type(fd, &ehdr) != AFF_BINTYPE_REL)
@@ -3225,6 +3282,11 @@ invalid:
     stab_index = stabstr_index = 0;
     ret = -1;
 
+    name = (char *)(s1->current_filename ? s1->current_filename : "");
+    obj = tcc_mallocz(sizeof *obj + strlen(name) + 1);
+    obj->name = strcpy((char *)(obj + 1), name);
+    dynarray_add(&s1->obj_sizes, &s1->nb_obj_sizes, obj);
+
     for(i = 1; i < ehdr.e_shnum; i++) {
         sh = &shdr[i];
         if (sh->sh_type == SHT_SYMTAB) {
@@ -3255,6 +3317,8 @@ invalid:
 	  sh = &shdr[sh->sh_info];
         /* ignore sections types we do not handle (plus relocs to those) */
         sh_name = strsec + sh->sh_name;
+        /* ...and keep what --gc-sections may drop apart, relocs too */
+        split = s1->gc_sections && section_split(sh_name);
         if (0 == strncmp(sh_name, ".debug_", 7)
          || 0 == strncmp(sh_name, ".stab", 5)) {
 	    if (!s1->do_debug || seencompressed)
@@ -3290,9 +3354,9 @@ invalid:
         if (sh->sh_addralign < 1)
             sh->sh_addralign = 1;
         /* find corresponding section, if any */
-        for(j = 1; j < s1->nb_sections;j++) {
+        for(j = 1; j < s1->nb_sections && !split; j++) {
             s = s1->sections[j];
-            if (strcmp(s->name, sh_name))
+            if (s->gc_obj || strcmp(s->name, sh_name))
                 continue;
             if (sh->sh_type != s->sh_type
                 && strcmp (s->name, ".eh_frame")
@@ -3323,8 +3387,13 @@ invalid:
         s->sh_addralign = sh->sh_addralign;
         s->sh_entsize = sh->sh_entsize;
         sm_table[i].new_section = 1;
+        if (split)
+            s->gc_obj = s1->nb_obj_sizes;
     found:
         size = sh->sh_size;
+        kind = section_obj_kind(s);
+        if (kind >= 0 && s->sh_type != SHT_RELX)
+            obj->size[kind] += size, obj->kept[kind] += size;
         /* align start of section */
         offset = section_add(s, size, sh->sh_addralign);
         if (sh->sh_addralign > s->sh_addralign)
@@ -30,6 +30,7 @@
    anon_sym: anonymous symbol index
 */
 ST_DATA int rsym, anon_sym, ind, loc;
+ST_DATA int label_ind;
 
 ST_DATA Sym *global_stack;
 ST_DATA Sym *local_stack;
@@ -76,6 +77,15 @@ ST_DATA const char *funcname;
 ST_DATA CType int_type, func_old_type, char_type, char_pointer_type;
 static CString initstr;
 
+/* -fdata-sections: where the current function's unnamed data goes */
+static Section *func_data_sections[3];
+/* string literals of the unit so far, hashed for merge_string() */
+static struct str_lit {
+    unsigned hash;
+    int sh_num, offset, size;
+} *str_lits;
+static int nb_str_lits, str_lits_size;
+
 #if PTR_SIZE == 4
 #define VT_SIZE_T (VT_INT | VT_UNSIGNED)
 #define VT_PTRDIFF_T VT_INT
@@ -167,6 +177,7 @@ ST_FUNC void gsym(int t)
 {
   if (t) {
     gsym_addr(t, ind);
+    label_ind = ind;
     CODE_ON();
   }
 }
@@ -175,6 +186,7 @@ ST_FUNC void gsym(int t)
 static int gind()
 {
   int t = ind;
+  label_ind = ind;
   CODE_ON();
   if (debug_modes)
     tcc_tcov_block_begin(tcc_state);
@@ -444,6 +456,8 @@ ST_FUNC void tccgen_finish(TCCState *s1)
     /* free sym_pools */
     dynarray_reset(&sym_pools, &nb_sym_pools);
     cstr_free(&initstr);
+    tcc_free(str_lits);
+    str_lits = NULL, nb_str_lits = str_lits_size = 0;
     dynarray_reset(&stk_data, &nb_stk_data);
     while (cur_switch)
         end_switch();
@@ -491,7 +505,8 @@ ST_FUNC void update_storage(Sym *sym)
         esym->st_info = ELFW(ST_INFO)(sym_bind, ELFW(ST_TYPE)(esym->st_info));
     }
 
-#ifdef TCC_TARGET_PE
+#if defined(TCC_TARGET_PE) || defined(TCC_TARGET_ARM64) || defined(TCC_TARGET_X86_64)
+    /* ARM64 links PE through tccpe.c too, without TCC_TARGET_PE */
     if (sym->a.dllimport)
         esym->st_other |= ST_PE_IMPORT;
     if (sym->a.dllexport)
@@ -1142,6 +1157,113 @@ static void vpush_ref(CType *type, Section *sec, unsigned long offset, unsigned
     vpushsym(type, get_sym_ref(type, sec, offset, size));  
 }
 
+/* a section "<base>.<name>" of its own, as -ffunction-sections and
+   -fdata-sections put things */
+static Section *split_section(Section *base, const char *name)
+{
+    char buf[256];
+    Section *s;
+
+    pstrcpy(buf, sizeof buf, base->name);
+    pstrcat(buf, sizeof buf, ".");
+    pstrcat(buf, sizeof buf, name);
+    s = new_section(tcc_state, buf, base->sh_type, base->sh_flags);
+    if (base != text_section)
+        s->sh_addralign = 1; /* raised by what goes in */
+    return s;
+}
+
+/* the section for the code of function sym */
+static Section *func_section(Sym *sym)
+{
+    /* line numbers and the like assume a single text section */
+    if (!tcc_state->function_sections || tcc_state->do_debug)
+        return text_section;
+    return split_section(text_section, get_tok_str(sym->v, NULL));
+}
+
+/* the section for data of variable v (0 if unnamed) that would go to
+   sec: variables get one each, the unnamed data of a function (its
+   string literals, ...) one per function */
+static Section *data_split_section(Section *sec, int v)
+{
+    int k;
+
+    if (!tcc_state->data_sections)
+        return sec;
+    if (sec == data_section)
+        k = 0;
+    else if (sec == rodata_section)
+        k = 1;
+    else if (sec == bss_section)
+        k = 2;
+    else
+        return sec;
+    if (v)
+        return split_section(sec, get_tok_str(v, NULL));
+    if (!funcname[0])
+        return sec;
+    if (!func_data_sections[k])
+        func_data_sections[k] = split_section(sec, funcname);
+    return func_data_sections[k];
+}
+
+/* the string literal just put at the end of its section by sym: if the
+   unit has the same bytes already, suitably aligned, use those and
+   give the space back */
+static void merge_string(Sym *sym, int align)
+{
+    ElfSym *esym = elfsym(sym);
+    Section *sec, *o;
+    struct str_lit *e;
+    unsigned char *p;
+    unsigned h, i, mask;
+    int size;
+
+    if (!esym || !(size = esym->st_size))
+        return;
+    sec = tcc_state->sections[esym->st_shndx];
+    if (esym->st_value + size != sec->data_offset)
+        return; /* padded for bound checking */
+    p = sec->data + esym->st_value;
+    for (h = 2166136261u, i = 0; i < size; ++i)
+        h = (h ^ p[i]) * 16777619u;
+
+    if (2 * (nb_str_lits + 1) > str_lits_size) {
+        struct str_lit *old = str_lits;
+        int n = str_lits_size;
+        str_lits_size = n ? 2 * n : 256;
+        str_lits = tcc_mallocz(str_lits_size * sizeof *str_lits);
+        mask = str_lits_size - 1;
+        for (i = 0; i < n; ++i) {
+            unsigned j;
+            if (!old[i].size)
+                continue;
+            for (j = old[i].hash & mask; str_lits[j].size; j = (j + 1) & mask)
+                ;
+            str_lits[j] = old[i];
+        }
+        tcc_free(old);
+    }
+    mask = str_lits_size - 1;
+    for (i = h & mask; (e = &str_lits[i])->size; i = (i + 1) & mask) {
+        if (e->hash != h || e->size != size || e->offset % align)
+            continue;
+        o = tcc_state->sections[e->sh_num];
+        if (0 == memcmp(o->data + e->offset, p, size)) {
+            sec->data_offset = esym->st_value;
+            esym->st_value = e->offset;
+            esym->st_shndx = e->sh_num;
+            return;
+        }
+    }
+    e->hash = h;
+    e->sh_num = sec->sh_num;
+    e->offset = esym->st_value;
+    e->size = size;
+    ++nb_str_lits;
+}
+
 /* define a new external reference to a symbol 'v' of type 'u' */
 ST_FUNC Sym *external_global_sym(int v, CType *type)
 {
@@ -5668,6 +5790,8 @@ ST_FUNC void unary(void)
         memset(&ad, 0, sizeof(AttributeDef));
         ad.section = rodata_section;
         decl_initializer_alloc(&type, &ad, VT_CONST, 2, 0, 0);
+        type_size(pointed_type(&type), &align);
+        merge_string(vtop->sym, align);
         break;
     case TOK_SOTYPE:
     case '(':
@@ -7430,6 +7554,7 @@ again:
 
     } else if (t == TOK_ASM1 || t == TOK_ASM2 || t == TOK_ASM3) {
         asm_instr();
+        label_ind = ind; /* asm labels are invisible to the backend */
 
     } else {
         if (tok == ':' && t >= TOK_UIDENT) {
@@ -8347,6 +8472,7 @@ static void decl_initializer_alloc(CType *type, AttributeDef *ad, int r,
         }
 
         if (sec) {
+            sec = data_split_section(sec, v);
 	    addr = section_add(sec, size, align);
 #ifdef CONFIG_TCC_BCHECK
             /* add padding if bound check */
@@ -8508,6 +8634,7 @@ static void gen_function(Sym *sym)
 
     cur_scope = root_scope = &f;
     nocode_wanted = 0;
+    memset(func_data_sections, 0, sizeof func_data_sections);
 
     ind = cur_text_section->data_offset;
     if (sym->a.aligned) {
@@ -8545,6 +8672,8 @@ static void gen_function(Sym *sym)
     gfunc_prolog(sym);
     tcc_debug_prolog_epilog(tcc_state, 0);
     func_vla_arg(sym);
+    /* -fsyntax-only: the body is checked as under sizeof() */
+    nocode_wanted = tcc_state->syntax_only;
     block(0);
     gsym(rsym);
     nocode_wanted = 0;
@@ -8598,7 +8727,7 @@ static void gen_inline_functions(TCCState *s)
                 tccpp_putfile(fn->filename);
                 begin_macro(fn->func_str, 1);
                 next();
-                cur_text_section = text_section;
+                cur_text_section = func_section(sym);
                 gen_function(sym);
                 end_macro();
 
@@ -8805,7 +8934,7 @@ static int decl(int l)
                     /* compute text section */
                     cur_text_section = ad.section;
                     if (!cur_text_section)
-                        cur_text_section = text_section;
+                        cur_text_section = func_section(sym);
                     else if (cur_text_section->sh_num > bss_section->sh_num)
                         cur_text_section->sh_flags = text_section->sh_flags;
                     gen_function(sym);
@@ -31,6 +31,10 @@
 # endif
 #endif
 
+#ifdef __UEFI__
+extern unsigned long long timer_ticks(void); /* for write_ticks */
+#endif
+
 #ifdef TCC_TARGET_X86_64
 # define ADDR3264 ULONGLONG
 # define PE_IMAGE_REL IMAGE_REL_BASED_DIR64
@@ -1202,9 +1206,10 @@ static int pe_section_class(Section *s)
 
 static int pe_assign_addresses (struct pe_info *pe)
 {
-    int i, k, n, c, nbs;
+    int i, k, n, c, nbs, a;
+    int first[sec_last + 1];
     ADDR3264 addr;
-    int *sec_order, *sec_cls;
+    int *sec_order, *sec_cls, *cls;
     struct section_info *si;
     Section *s;
     TCCState *s1 = pe->s1;
@@ -1213,16 +1218,20 @@ static int pe_assign_addresses (struct pe_info *pe)
         pe->reloc = new_section(s1, ".reloc", SHT_PROGBITS, 0);
     //pe->thunk = new_section(s1, ".iedat", SHT_PROGBITS, SHF_ALLOC);
 
+    /* order by class, keeping the order within one: a counting sort,
+       as with -ffunction-sections there are thousands of sections */
     nbs = s1->nb_sections;
-    sec_order = tcc_mallocz(2 * sizeof (int) * nbs);
-    sec_cls = sec_order + nbs;
-    for (i = 1; i < nbs; ++i) {
-        s = s1->sections[i];
-        k = pe_section_class(s);
-        for (n = i; n > 1 && k < (c = sec_cls[n - 1]); --n)
-            sec_cls[n] = c, sec_order[n] = sec_order[n - 1];
-        sec_cls[n] = k, sec_order[n] = i;
-    }
+    sec_order = tcc_mallocz(3 * sizeof (int) * (nbs + 1));
+    sec_cls = sec_order + nbs + 1;
+    cls = sec_cls + nbs + 1;
+    memset(first, 0, sizeof first);
+    for (i = 1; i < nbs; ++i)
+        ++first[cls[i] = pe_section_class(s1->sections[i])];
+    for (n = 1, k = 0; k <= sec_last; ++k)
+        c = first[k], first[k] = n, n += c;
+    for (i = 1; i < nbs; ++i)
+        k = cls[i], sec_cls[first[k]] = k, sec_order[first[k]++] = i;
+    sec_cls[nbs] = sec_last;
     si = NULL;
     addr = pe->imagebase + 1;
 
@@ -1234,7 +1243,8 @@ static int pe_assign_addresses (struct pe_info *pe)
 
         if (si && c == si->cls && c != sec_debug) {
             /* merge with previous section */
-            s->sh_addr = addr = ((addr - 1) | (16 - 1)) + 1;
+            a = section_split(s->name) ? s->sh_addralign : 16;
+            s->sh_addr = addr = ((addr - 1) | (a - 1)) + 1;
         } else {
             si = NULL;
             s->sh_addr = addr = pe_virtual_align(pe, addr);
@@ -1260,7 +1270,9 @@ static int pe_assign_addresses (struct pe_info *pe)
         si = tcc_mallocz(sizeof *si);
         dynarray_add(&pe->sec_info, &pe->sec_count, si);
 
-        strcpy(si->name, s->name);
+        pstrcpy(si->name, sizeof si->name, s->name);
+        if (section_split(s->name)) /* ".text.f" starts ".text" */
+            *strchr(si->name + 1, '.') = 0;
         si->cls = c;
         si->sh_addr = addr;
 
@@ -1399,11 +1411,16 @@ static int pe_check_symbols(struct pe_info *pe)
                     put_elf_reloc(symtab_section, text_section,
                         offset + 8, R_XXX_THUNKFIX, is->iat_index); // offset to IAT position
 #elif defined TCC_TARGET_ARM64
-                    p = section_ptr_add(text_section, 16); // ldr x16, [pc+8]; br x16; .quad addr
-                    write32le(p + 0, 0x58000050); // ldr x16, #8 (literal PC+8)
-                    write32le(p + 4, 0xD61F0200); // br x16
+                    /* The word at +20 holds the IAT slot's offset from
+                       itself, so the thunk needs no base relocation */
+                    p = section_ptr_add(text_section, 24);
+                    write32le(p + 0, 0x100000B0); // adr x16, #20
+                    write32le(p + 4, 0xB9800211); // ldrsw x17, [x16]
+                    write32le(p + 8, 0x8B110210); // add x16, x16, x17
+                    write32le(p + 12, 0xF9400210); // ldr x16, [x16]
+                    write32le(p + 16, 0xD61F0200); // br x16
                     put_elf_reloc(symtab_section, text_section,
-                        offset + 8, R_XXX_THUNKFIX, is->iat_index);
+                        offset + 20, R_XXX_THUNKFIX, is->iat_index);
 #else
                     p = section_ptr_add(text_section, 8);
                     write16le(p, 0x25FF);
@@ -1438,6 +1455,153 @@ static int pe_check_symbols(struct pe_info *pe)
     return ret;
 }
 
+/*----------------------------------------------------------------------------*/
+/* -Wl,--gc-sections: the sections split off by -ffunction-sections and
+   -fdata-sections that neither the entry point, the exports nor the
+   other sections refer to, directly or not, are emptied */
+
+static void pe_gc_mark(TCCState *s1, unsigned char *live, int *stack,
+                       int *sp, int sh)
+{
+    if (sh > 0 && sh < s1->nb_sections && !live[sh])
+        live[sh] = 1, stack[(*sp)++] = sh;
+}
+
+#ifdef TCC_TARGET_X86_64
+/* keep the unwind entries of the functions kept */
+static void pe_gc_pdata(TCCState *s1, Section *pd, unsigned char *live)
+{
+    ElfW(Sym) *symtab = (ElfW(Sym) *)symtab_section->data;
+    ElfW_Rel *rel, *w;
+    Section *s;
+    int n, e, k, *to;
+    unsigned char *keep;
+
+    n = pd->data_offset / 12;
+    if (!n || !pd->reloc)
+        return;
+    to = tcc_malloc(n * sizeof *to);
+    keep = tcc_malloc(n);
+    memset(keep, 1, n);
+    /* an entry goes with the section of its BeginAddress */
+    for_each_elem(pd->reloc, 0, rel, ElfW_Rel) {
+        if (rel->r_offset % 12 || rel->r_offset / 12 >= n)
+            continue;
+        e = rel->r_offset / 12;
+        s = s1->sections[symtab[ELFW(R_SYM)(rel->r_info)].st_shndx];
+        if (live[s->sh_num] || !section_split(s->name))
+            continue;
+        keep[e] = 0;
+        if (s->gc_obj)
+            s1->obj_sizes[s->gc_obj - 1]->kept[TCC_OBJ_DATA] -= 12;
+    }
+    for (e = k = 0; e < n; ++e) {
+        to[e] = k;
+        if (keep[e])
+            memmove(pd->data + 12 * k++, pd->data + 12 * e, 12);
+    }
+    pd->data_offset = 12 * k;
+    w = (ElfW_Rel *)pd->reloc->data;
+    for_each_elem(pd->reloc, 0, rel, ElfW_Rel) {
+        e = rel->r_offset / 12;
+        if (e < n && !keep[e])
+            continue;
+        if (e < n)
+            rel->r_offset = 12 * to[e] + rel->r_offset % 12;
+        *w++ = *rel;
+    }
+    pd->reloc->data_offset = (unsigned char *)w - pd->reloc->data;
+    tcc_free(keep);
+    tcc_free(to);
+}
+#endif
+
+static void pe_gc_sections(struct pe_info *pe)
+{
+    TCCState *s1 = pe->s1;
+    ElfW(Sym) *sym;
+    ElfW_Rel *rel;
+    Section *s, *pd = NULL;
+    unsigned char *live;
+    int *stack, sp = 0, i, k, nbs = s1->nb_sections;
+
+    live = tcc_mallocz(nbs);
+    stack = tcc_malloc(nbs * sizeof *stack);
+    for (i = 1; i < nbs; ++i) {
+        s = s1->sections[i];
+        if (!(s->sh_flags & SHF_ALLOC) || section_split(s->name))
+            continue;
+        if (0 == strcmp(s->name, ".pdata"))
+            pd = s; /* refers to every function */
+        else
+            pe_gc_mark(s1, live, stack, &sp, i);
+    }
+    i = find_elf_sym(symtab_section, pe->start_symbol);
+    if (i)
+        pe_gc_mark(s1, live, stack, &sp,
+                   ((ElfW(Sym) *)symtab_section->data)[i].st_shndx);
+    for_each_elem(symtab_section, 1, sym, ElfW(Sym)) {
+        if ((sym->st_other & ST_PE_EXPORT)
+            || (s1->rdynamic && ELFW(ST_BIND)(sym->st_info) != STB_LOCAL))
+            pe_gc_mark(s1, live, stack, &sp, sym->st_shndx);
+    }
+    while (sp) {
+        s = s1->sections[stack[--sp]];
+        if (!s->reloc)
+            continue;
+        for_each_elem(s->reloc, 0, rel, ElfW_Rel) {
+            sym = (ElfW(Sym) *)symtab_section->data + ELFW(R_SYM)(rel->r_info);
+            pe_gc_mark(s1, live, stack, &sp, sym->st_shndx);
+        }
+    }
+
+#ifdef TCC_TARGET_X86_64
+    if (pd)
+        pe_gc_pdata(s1, pd, live);
+#endif
+    for (i = 1; i < nbs; ++i) {
+        s = s1->sections[i];
+        if (live[i] || !(s->sh_flags & SHF_ALLOC) || !section_split(s->name))
+            continue;
+        k = section_obj_kind(s);
+        if (s->gc_obj)
+            s1->obj_sizes[s->gc_obj - 1]->kept[k] -= s->data_offset;
+        s->data_offset = 0;
+        if (s->reloc)
+            s->reloc->data_offset = 0;
+    }
+    tcc_free(stack);
+    tcc_free(live);
+}
+
+/* -Wl,-Map=file: what each object file brought to the image */
+static void pe_write_map(TCCState *s1)
+{
+    unsigned size[3] = {0}, kept[3] = {0};
+    TCCObjSize *o;
+    FILE *f;
+    int i, k;
+
+    f = fopen(s1->mapfile, "w");
+    if (!f) {
+        tcc_error_noabort("could not write '%s'", s1->mapfile);
+        return;
+    }
+    fprintf(f, "%-32s %8s %8s %8s   %8s %8s %8s\n", "object (bytes)",
+            "code", "data", "bss", "kept", "data", "bss");
+    for (i = 0; i < s1->nb_obj_sizes; ++i) {
+        o = s1->obj_sizes[i];
+        fprintf(f, "%-32s %8u %8u %8u   %8u %8u %8u\n", o->name,
+                o->size[0], o->size[1], o->size[2],
+                o->kept[0], o->kept[1], o->kept[2]);
+        for (k = 0; k < 3; ++k)
+            size[k] += o->size[k], kept[k] += o->kept[k];
+    }
+    fprintf(f, "%-32s %8u %8u %8u   %8u %8u %8u\n", "total",
+            size[0], size[1], size[2], kept[0], kept[1], kept[2]);
+    fclose(f);
+}
+
 /*----------------------------------------------------------------------------*/
 #if PE_PRINT_SECTIONS
 static void pe_print_section(FILE * f, Section * s)
@@ -1864,9 +2028,9 @@ static unsigned pe_add_uwwind_info(TCCState *s1)
         s1->uw_pdata = find_section(s1, ".pdata");
         s1->uw_pdata->sh_addralign = 4;
     }
-    if (0 == s1->uw_sym)
-        s1->uw_sym = put_elf_sym(symtab_section, 0, 0, 0, 0, text_section->sh_num, ".uw_base");
-    if (0 == s1->uw_offs) {
+    /* once per file (with -ffunction-sections .text may well be empty,
+       so uw_offs alone cannot tell) */
+    if (0 == s1->uw_sym) {
         /* As our functions all have the same stackframe, we use one entry for all */
         static const unsigned char uw_info[] = {
             0x01, // UBYTE: 3 Version , UBYTE: 5 Flags
@@ -1883,6 +2047,7 @@ static unsigned pe_add_uwwind_info(TCCState *s1)
         Section *s = text_section;
         unsigned char *p;
 
+        s1->uw_sym = put_elf_sym(symtab_section, 0, 0, 0, 0, text_section->sh_num, ".uw_base");
         section_ptr_add(s, -s->data_offset & 3); /* align */
         s1->uw_offs = s->data_offset;
         p = section_ptr_add(s, sizeof uw_info);
@@ -1896,7 +2061,8 @@ ST_FUNC void pe_add_unwind_data(unsigned start, unsigned end, unsigned stack)
 {
     TCCState *s1 = tcc_state;
     Section *pd;
-    unsigned o, n, d;
+    unsigned o, d;
+    int base;
     struct /* _RUNTIME_FUNCTION */ {
       DWORD BeginAddress;
       DWORD EndAddress;
@@ -1913,9 +2079,15 @@ ST_FUNC void pe_add_unwind_data(unsigned start, unsigned end, unsigned stack)
     p->EndAddress = end;
     p->UnwindData = d;
 
-    /* put relocations on it */
-    for (n = o + sizeof *p; o < n; o += sizeof p->BeginAddress)
-        put_elf_reloc(symtab_section, pd, o, R_XXX_RELATIVE, s1->uw_sym);
+    /* put relocations on it, the addresses relative to the function's
+       section (one of its own with -ffunction-sections) */
+    base = s1->uw_sym;
+    if (cur_text_section != text_section)
+        base = put_elf_sym(symtab_section, 0, 0, 0, 0,
+                           cur_text_section->sh_num, ".uw_base");
+    put_elf_reloc(symtab_section, pd, o, R_XXX_RELATIVE, base);
+    put_elf_reloc(symtab_section, pd, o + 4, R_XXX_RELATIVE, base);
+    put_elf_reloc(symtab_section, pd, o + 8, R_XXX_RELATIVE, s1->uw_sym);
 }
 #endif
 /* ------------------------------------------------------------- */
@@ -2103,6 +2275,8 @@ ST_FUNC int pe_output_file(TCCState *s1, const char *filename)
     pe_add_runtime(s1, &pe);
     resolve_common_syms(s1);
     pe_set_options(s1, &pe);
+    if (s1->gc_sections && filename)
+        pe_gc_sections(&pe);
     pe_check_symbols(&pe);
 
     if (s1->nb_errors)
@@ -2114,8 +2288,17 @@ ST_FUNC int pe_output_file(TCCState *s1, const char *filename)
         relocate_sections(s1);
         pe.start_addr = (DWORD)
             (get_sym_addr(s1, pe.start_symbol, 1, 1) - pe.imagebase);
-        if (0 == s1->nb_errors)
+        if (0 == s1->nb_errors) {
+#ifdef __UEFI__
+            unsigned long long t0 = timer_ticks();
             pe_write(&pe);
+            s1->write_ticks += timer_ticks() - t0;
+#else
+            pe_write(&pe);
+#endif
+            if (s1->mapfile)
+                pe_write_map(s1);
+        }
         dynarray_reset(&pe.sec_info, &pe.sec_count);
     } else {
 #ifdef TCC_IS_NATIVE
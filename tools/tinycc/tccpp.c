@@ -59,6 +59,22 @@ static void parse_string(const char *p, int len);
 static struct TinyAlloc *toksym_alloc;
 static struct TinyAlloc *tokstr_alloc;
 
+#ifdef __UEFI__
+/* time spent in directives and macro expansion, for the workstation's
+   compile report; nested entries (macros in #if) count once */
+extern unsigned long long timer_ticks(void);
+static int pp_time_depth;
+static unsigned long long pp_time_start;
+# define PP_TIME_BEGIN() \
+    (void)(pp_time_depth++ || (pp_time_start = timer_ticks(), 0))
+# define PP_TIME_END() \
+    (void)(--pp_time_depth || \
+           (tcc_state->pp_ticks += timer_ticks() - pp_time_start, 0))
+#else
+# define PP_TIME_BEGIN() (void)0
+# define PP_TIME_END() (void)0
+#endif
+
 static TokenString *macro_stack;
 
 static const char tcc_keywords[] = 
@@ -2670,7 +2686,9 @@ maybe_newline:
             (parse_flags & PARSE_FLAG_PREPROCESS)) {
             tok_flags &= ~TOK_FLAG_BOL;
             file->buf_ptr = p;
+            PP_TIME_BEGIN();
             preprocess(tok_flags & TOK_FLAG_BOF);
+            PP_TIME_END();
             p = file->buf_ptr;
             goto maybe_newline;
         } else {
@@ -3543,13 +3561,23 @@ redo:
     }
 
     next_nomacro();
+    ++total_tokens;
+#ifdef __UEFI__
+    if ((total_tokens & 255) == 0 && tcc_state->poll_fn
+        && tcc_state->poll_fn(tcc_state->poll_opaque)) {
+        tcc_state->poll_fn = NULL; /* once */
+        tcc_error("interrupted");
+    }
+#endif
     t = tok;
     if (t >= TOK_IDENT && (parse_flags & PARSE_FLAG_PREPROCESS)) {
         /* if reading from file, try to substitute macros */
         Sym *s = define_find(t);
         if (s) {
             Sym *nested_list = NULL;
+            PP_TIME_BEGIN();
             macro_subst_tok(&tokstr_buf, &nested_list, s);
+            PP_TIME_END();
             tok_str_add(&tokstr_buf, 0);
             begin_macro(&tokstr_buf, 0);
             goto redo;
@@ -3687,6 +3715,9 @@ ST_FUNC void preprocess_start(TCCState *s1, int filetype)
     file->ifdef_stack_ptr = s1->ifdef_stack_ptr;
     pp_expr = 0;
     pp_counter = 0;
+#ifdef __UEFI__
+    pp_time_depth = 0; /* an error may have left a phase open */
+#endif
     pp_debug_tok = pp_debug_symv = 0;
     s1->pack_stack[0] = 0;
     s1->pack_stack_ptr = s1->pack_stack;
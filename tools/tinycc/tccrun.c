@@ -211,6 +211,22 @@ ST_FUNC void tcc_run_free(TCCState *s1)
 #endif
 }
 
+#ifdef __UEFI__
+/* hand the relocated image over to the caller, who releases it with
+   mem_free_code(ptr, *size); tcc_delete() then leaves it alone */
+LIBTCCAPI void *tcc_take_image(TCCState *s1, unsigned long *size)
+{
+    void *ptr = s1->run_ptr;
+    if (ptr) {
+        st_unlink(s1);
+        *size = s1->run_size;
+        s1->run_ptr = NULL;
+        s1->run_size = 0;
+    }
+    return ptr;
+}
+#endif
+
 #define RT_EXIT_ZERO 0xE0E00E0E /* passed from longjmp instead of '0' */
 
 /* launch the compiled program with the given arguments */
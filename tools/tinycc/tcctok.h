@@ -302,6 +302,8 @@
 #endif
 
      DEF(TOK_alloca, "alloca")
+     DEF(TOK___cyg_profile_func_enter, "__cyg_profile_func_enter")
+     DEF(TOK___cyg_profile_func_exit, "__cyg_profile_func_exit")
 
 #if defined TCC_TARGET_PE
      DEF(TOK___chkstk, "__chkstk")
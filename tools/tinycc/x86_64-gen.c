@@ -360,11 +360,32 @@ static void gen_modrm64(int opcode, int op_reg, int r, Sym *sym, int c)
 
 
 /* load 'r' from value 'sv' */
+/* -O1 store-to-load forwarding: the last store of a register to a
+   local.  When the very next instruction would reload that local into
+   the same register, with no jump target in between, the load is
+   dropped.  Only full-width types: a 32-bit reload also clears the
+   upper half of the register, which later code may rely on. */
+static struct { int ind, r, t; int64_t fc; } last_store = { -1 };
+
+static int fwd_type(int t)
+{
+    int bt = t & VT_BTYPE;
+    if (t & VT_VOLATILE)
+        return 0;
+    return bt == VT_LLONG || bt == VT_PTR || bt == VT_FLOAT || bt == VT_DOUBLE;
+}
+
 void load(int r, SValue *sv)
 {
     int v, t, ft, fc, fr;
     SValue v1;
 
+    if (tcc_state->optimize && last_store.ind == ind && label_ind != ind
+        && sv->r == (VT_LOCAL | VT_LVAL) && sv->c.i == last_store.fc
+        && r == last_store.r && fwd_type(sv->type.t)
+        && (sv->type.t & VT_BTYPE) == last_store.t)
+        return;
+
     fr = sv->r;
     ft = sv->type.t & ~VT_DEFSIGN;
     fc = sv->c.i;
@@ -573,6 +594,7 @@ void store(int r, SValue *v)
     int op64 = 0;
     /* store the REX prefix in this variable when PIC is enabled */
     int pic = 0;
+    int r0 = r;
 
     fr = v->r & VT_VALMASK;
     ft = v->type.t;
@@ -640,6 +662,13 @@ void store(int r, SValue *v)
             o(0xc0 + fr + r * 8); /* mov r, fr */
         }
     }
+    if (v->r == (VT_LOCAL | VT_LVAL) && !pic && fc == v->c.i
+        && fwd_type(v->type.t)) {
+        last_store.ind = ind;
+        last_store.r = r0;
+        last_store.fc = fc;
+        last_store.t = v->type.t & VT_BTYPE;
+    }
 }
 
 /* 'is_jmp' is '1' if it is a jump */
@@ -732,6 +761,53 @@ static void gen_bounds_epilog(void)
 }
 #endif
 
+/* -finstrument-functions: call __cyg_profile_func_enter/exit(this
+   function, its call site) after the prolog and before the epilog */
+static Sym *func_profile_sym;
+
+static void gen_profile_call(int v)
+{
+    Sym *sym = external_helper_sym(v);
+    greloca(cur_text_section, func_profile_sym, ind + 3, R_X86_64_PC32, -4);
+#ifdef TCC_TARGET_PE
+    o(0x0d8d48);   /* lea func(%rip), %rcx */
+    gen_le32(0);
+    o(0x08558b48); /* mov 8(%rbp), %rdx */
+#else
+    o(0x3d8d48);   /* lea func(%rip), %rdi */
+    gen_le32(0);
+    o(0x08758b48); /* mov 8(%rbp), %rsi */
+#endif
+    oad(0xe8, 0);
+    greloca(cur_text_section, sym, ind-4, R_X86_64_PLT32, -4);
+}
+
+static void gen_profile_prolog(Sym *func_sym)
+{
+    /* parameters passed in registers are in the frame by now */
+    func_profile_sym = func_sym;
+    gen_profile_call(TOK___cyg_profile_func_enter);
+}
+
+static void gen_profile_epilog(void)
+{
+    /* keep the stack 16-byte aligned with room for the callee's home
+       area (PE) above which xmm0 and xmm1 are saved */
+    o(0x5250);     /* push %rax, push %rdx: returned value, if any */
+    o(0x30ec8348); /* sub $48,%rsp */
+    o(0xd60f66);   /* movq %xmm0,0x20(%rsp) */
+    o(0x202444);
+    o(0xd60f66);   /* movq %xmm1,0x28(%rsp) */
+    o(0x28244c);
+    gen_profile_call(TOK___cyg_profile_func_exit);
+    o(0x7e0ff3);   /* movq 0x20(%rsp),%xmm0 */
+    o(0x202444);
+    o(0x7e0ff3);   /* movq 0x28(%rsp),%xmm1 */
+    o(0x28244c);
+    o(0x30c48348); /* add $48,%rsp */
+    o(0x585a);     /* pop %rdx, pop %rax */
+}
+
 #ifdef TCC_TARGET_PE
 
 #define REGN 4
@@ -950,6 +1026,7 @@ void gfunc_prolog(Sym *func_sym)
     func_scratch = 32;
     func_alloca = 0;
     loc = 0;
+    last_store.ind = -1;
 
     addr = PTR_SIZE * 2;
     ind += FUNC_PROLOG_SIZE;
@@ -1007,6 +1084,8 @@ void gfunc_prolog(Sym *func_sym)
     if (tcc_state->do_bounds_check)
         gen_bounds_prolog();
 #endif
+    if (tcc_state->instrument_functions)
+        gen_profile_prolog(func_sym);
 }
 
 /* generate function epilog */
@@ -1022,6 +1101,8 @@ void gfunc_epilog(void)
     if (tcc_state->do_bounds_check)
         gen_bounds_epilog();
 #endif
+    if (tcc_state->instrument_functions)
+        gen_profile_epilog();
 
     o(0xc9); /* leave */
     if (func_ret_sub == 0) {
@@ -1456,6 +1537,7 @@ void gfunc_prolog(Sym *func_sym)
     sym = func_type->ref;
     addr = PTR_SIZE * 2;
     loc = 0;
+    last_store.ind = -1;
     ind += FUNC_PROLOG_SIZE;
     func_sub_sp_offset = ind;
     func_ret_sub = 0;
@@ -1594,6 +1676,8 @@ void gfunc_prolog(Sym *func_sym)
     if (tcc_state->do_bounds_check)
         gen_bounds_prolog();
 #endif
+    if (tcc_state->instrument_functions)
+        gen_profile_prolog(func_sym);
 }
 
 /* generate function epilog */
@@ -1605,6 +1689,8 @@ void gfunc_epilog(void)
     if (tcc_state->do_bounds_check)
         gen_bounds_epilog();
 #endif
+    if (tcc_state->instrument_functions)
+        gen_profile_epilog();
     o(0xc9); /* leave */
     if (func_ret_sub == 0) {
         o(0xc3); /* ret */